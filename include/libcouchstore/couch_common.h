@@ -34,7 +34,7 @@ extern "C" {
     /** Document content metadata flags */
     typedef uint8_t couchstore_content_meta_flags;
     enum {
-        COUCH_DOC_IS_COMPRESSED = 128,  /**< Document contents compressed via Snappy */
+        COUCH_DOC_IS_COMPRESSED = 128,  /**< Document contents compressed (see couchstore_set_codecs) */
         /* Content Type Reasons (content_meta & 0x0F): */
         COUCH_DOC_IS_JSON = 0,      /**< Document is valid JSON data */
         COUCH_DOC_INVALID_JSON = 1, /**< Document was checked, and was not valid JSON */
@@ -46,13 +46,29 @@ extern "C" {
     typedef enum {
 #ifdef POSIX_FADV_NORMAL
         /* Evict this range from FS caches if possible */
-        COUCHSTORE_FILE_ADVICE_EVICT = POSIX_FADV_DONTNEED
+        COUCHSTORE_FILE_ADVICE_EVICT = POSIX_FADV_DONTNEED,
+        /* This range will be read soon; start reading it in */
+        COUCHSTORE_FILE_ADVICE_WILLNEED = POSIX_FADV_WILLNEED
 #else
         /* Assign these whatever values, we'll be ignoring them.. */
-        COUCHSTORE_FILE_ADVICE_EVICT
+        COUCHSTORE_FILE_ADVICE_EVICT,
+        COUCHSTORE_FILE_ADVICE_WILLNEED
 #endif
     } couchstore_file_advice_t;
 
+    /** Compression codecs for document bodies and B-tree nodes. */
+    typedef enum {
+        COUCHSTORE_CODEC_SNAPPY = 0,    /**< The default, and all there is before disk version 13 */
+        COUCHSTORE_CODEC_LZ4 = 1,       /**< Faster, compresses somewhat less */
+        COUCHSTORE_CODEC_ZSTD = 2       /**< Slower, compresses more; may use a dictionary */
+    } couchstore_codec;
+
+    /** How the nodes of a B-tree are sized. */
+    typedef enum {
+        COUCHSTORE_NODE_SIZE_FIXED = 0,     /**< About 1.3KB, the default */
+        COUCHSTORE_NODE_SIZE_ADAPTIVE = 1   /**< Whole 4KB blocks, fitted to the entries */
+    } couchstore_node_size_policy;
+
     /** A generic data blob. Nothing is implied about ownership of the block pointed to. */
     typedef struct _sized_buf {
         char *buf;
@@ -98,6 +114,18 @@ extern "C" {
         cs_off_t header_position;   /**< File offset of current header */
     } DbInfo;
 
+    /** Where the space in a database file goes, worked out from the
+        header alone (see couchstore_fragmentation_stats). */
+    typedef struct {
+        uint64_t file_size;         /**< Total disk space used by database */
+        uint64_t live_doc_bytes;    /**< Bodies of the current documents */
+        uint64_t by_id_tree_bytes;  /**< Live nodes of the by-ID tree */
+        uint64_t by_seq_tree_bytes; /**< Live nodes of the by-sequence tree */
+        uint64_t local_tree_bytes;  /**< Live nodes of the local documents tree */
+        uint64_t live_tree_bytes;   /**< All three trees */
+        uint64_t stale_bytes;       /**< Everything else; what compaction frees */
+    } couchstore_fragmentation_info;
+
 
     /** Opaque reference to an open database. */
     typedef struct _db Db;
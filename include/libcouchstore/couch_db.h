@@ -25,9 +25,97 @@ extern "C" {
         /**
          * Open the database in read only mode
          */
-        COUCHSTORE_OPEN_FLAG_RDONLY = 2
+        COUCHSTORE_OPEN_FLAG_RDONLY = 2,
+        /**
+         * Memory-map the file and serve reads from the mapping instead of
+         * the read buffers. Only valid together with
+         * COUCHSTORE_OPEN_FLAG_RDONLY; data appended after the file was
+         * opened is read through the file ops until the mapping is
+         * refreshed by couchstore_reopen_file(). Ignored on platforms
+         * without mmap.
+         */
+        COUCHSTORE_OPEN_FLAG_MMAP = 4,
+        /**
+         * Keep a Bloom filter of the file's document IDs, so that
+         * couchstore_docinfo_by_id() can answer most lookups of missing IDs
+         * without reading the by-ID tree. If the file has no filter yet,
+         * one is built from the by-ID tree on first use and saved with the
+         * next commit. Files that have a filter keep using and updating it
+         * whether or not this flag is given, and compaction rebuilds it.
+         * Ignored for files in the older disk format.
+         */
+        COUCHSTORE_OPEN_FLAG_BLOOM_FILTER = 8,
+        /**
+         * When creating a file, keep the positions of its latest headers
+         * in the first block, so that opening it needn't scan back from
+         * the end for the newest one; after a crash the end can hold
+         * megabytes written since the last commit, or space reserved by
+         * couchstore_set_preallocation(). The list is checked by CRC, and
+         * the scan is still done if it doesn't check out. Files created
+         * with it keep it whether or not the flag is given later, and
+         * compaction carries it over. Ignored for existing files.
+         *
+         * The list is updated in the same sync as a commit's header, so a
+         * commit that returned is always found. One that didn't finish
+         * syncing may be, where a scan could have found it. In relaxed
+         * durability mode headers are listed once they're synced.
+         */
+        COUCHSTORE_OPEN_FLAG_HEADER_HINTS = 16,
+        /**
+         * Let any number of threads look documents up in the handle at
+         * once, while one thread at a time goes on using it for everything
+         * else, writes and commits included. The lookups are
+         * couchstore_docinfo_by_id(), couchstore_docinfos_by_id(),
+         * couchstore_docinfo_by_sequence(), couchstore_open_document(),
+         * couchstore_open_doc_with_docinfo(),
+         * couchstore_open_document_range() and couchstore_read_doc_into().
+         * Each of them borrows a snapshot (see couchstore_open_snapshot())
+         * of the last commit from a pool kept by the handle, so they see
+         * what was last committed from whatever thread they are made;
+         * saves not yet committed aren't found, even by the thread that
+         * made them. The snapshots share the file descriptor and block
+         * cache; there are as many as lookups have been made at once, each
+         * with its own read buffers and node cache.
+         *
+         * No lookups may be going on while the handle is closed, dropped
+         * or reopened. Reopening it with the flag sets up a new pool.
+         * The file ops must allow pread to be called on a handle from
+         * several threads at once, and while it's being written to, as
+         * those of the library do.
+         */
+        COUCHSTORE_OPEN_FLAG_SHARED_READS = 32,
+        /**
+         * When creating a file, checksum its chunks and headers with
+         * CRC32C rather than CRC32, which CPUs with SSE4.2 or the ARMv8
+         * CRC extension compute in an instruction, making the check of
+         * every chunk read close to free. Files created with it keep it
+         * whether or not the flag is given later, and compaction carries
+         * it over; versions of the library from before it can't read
+         * them. Ignored for existing files.
+         */
+        COUCHSTORE_OPEN_FLAG_CRC32C = 64
     };
 
+    /**
+     * When creating a file, lay it out in blocks of 2^shift bytes rather
+     * than 4KB, for a shift from 12 to 20 (4KB to 1MB). Each block starts
+     * with a byte telling whether a header is there, which chunk reads
+     * and writes step over, and headers are written at block boundaries;
+     * larger blocks split the reads and writes of large bodies into fewer
+     * pieces, and opening a file steps back through fewer blocks looking
+     * for its newest header, at the cost of padding each commit's header
+     * out to a larger boundary. Suits files of mostly large documents on
+     * devices whose best I/O size is larger than 4KB.
+     *
+     * The size is recorded at the start of the file, which the block cache
+     * still reads 4KB at a time. Files created with it keep it whether or
+     * not the flag is given later, and compaction carries it over; versions
+     * of the library from before it can't read them. Ignored for existing
+     * files.
+     */
+#define COUCHSTORE_OPEN_BLOCK_SHIFT(shift) ((couchstore_open_flags)(shift) << 32)
+#define COUCHSTORE_OPEN_BLOCK_SHIFT_MASK COUCHSTORE_OPEN_BLOCK_SHIFT(0xff)
+
 
     /**
      * Open a database.
@@ -68,6 +156,44 @@ extern "C" {
                                              const couch_file_ops *ops,
                                              Db **db);
 
+    /** One file for couchstore_open_dbs() to open. */
+    typedef struct {
+        const char *filename;       /**< In: the file to open */
+        Db *db;                     /**< Out: its handle, or NULL */
+        couchstore_error_t error;   /**< Out: how opening it went */
+    } couchstore_open_request;
+
+    /**
+     * Open many databases at once, as at startup, on up to the given
+     * number of threads, so that the header reads of one file overlap
+     * those of others instead of each waiting on the one before. Each
+     * handle can also be warmed up with the top levels of its trees,
+     * whose interior nodes end up in its node cache.
+     *
+     * The handles are returned in the requests, to be closed with
+     * couchstore_close_db() and used from any one thread at a time, as
+     * handles from couchstore_open_db_ex() are. A file that can't be
+     * opened gets a NULL handle and its error, and doesn't stop the rest.
+     *
+     * @param requests the files to open
+     * @param count how many there are
+     * @param flags as for couchstore_open_db_ex(), for all of them
+     * @param ops the file I/O operations to use for all of them
+     * @param threads how many files to open at a time; 0 or 1 opens them
+     *        one after another on the calling thread
+     * @param warm_levels how many levels of each tree to read after
+     *        opening; 0 reads nothing more than opening does
+     * @return COUCHSTORE_SUCCESS if all the files were opened, or else
+     *         the error of the first one that wasn't
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_dbs(couchstore_open_request *requests,
+                                           size_t count,
+                                           couchstore_open_flags flags,
+                                           const couch_file_ops *ops,
+                                           unsigned threads,
+                                           unsigned warm_levels);
+
     /**
      * Close an open database and free all allocated resources.
      *
@@ -124,12 +250,229 @@ extern "C" {
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_rewind_db_header(Db *db);
 
+    /**
+     * Open a database read-only at the newest header whose update_seq is
+     * no later than seq, as it was when that was committed. Rather than
+     * rewinding one header at a time, which scans back from each to the
+     * one before, the header is found by a binary search over the file,
+     * or straight from the list a file opened with
+     * COUCHSTORE_OPEN_FLAG_HEADER_HINTS keeps of its latest ones. The
+     * search relies on later headers having later sequences, as they do
+     * unless a file has been committed to after rewinding it.
+     *
+     * @param filename The name of the file containing the database
+     * @param seq the latest update_seq wanted
+     * @param pDb Pointer to where you want the handle to the database to be
+     *           stored.
+     * @return COUCHSTORE_SUCCESS upon success, or
+     *         COUCHSTORE_ERROR_NO_HEADER if every header is later than seq
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_db_at_seq(const char *filename,
+                                                 uint64_t seq,
+                                                 Db **pDb);
+
+    /**
+     * Called by couchstore_backup_since() with each range of the file in
+     * turn, to be written at pos in the copy, as by
+     * couchstore_restore_write(). Any error returned stops the backup
+     * and is returned from it.
+     */
+    typedef couchstore_error_t (*couchstore_backup_fn)(uint64_t pos,
+                                                       const void *buf,
+                                                       size_t size,
+                                                       void *ctx);
+
+    /**
+     * Stream what has been written to a file since an earlier header, up
+     * to the end of the handle's current one, so that a copy of the file
+     * as it was at the earlier header can be brought up to date. Since
+     * the file is append-only that's the bytes between the two, bodies
+     * and tree nodes as they are on disk, CRCs and all, read in large
+     * sequential pieces with nothing decompressed; block 0 follows if the
+     * file keeps header hints (see COUCHSTORE_OPEN_FLAG_HEADER_HINTS),
+     * which are rewritten in place. A compaction writes a new file, whose
+     * headers an earlier backup's position doesn't name; the next backup
+     * after one has to be a full one.
+     *
+     * @param db the database to back up
+     * @param since the position of the header the copy was made at, as
+     *        given by couchstore_get_header_position(), or 0 for the whole
+     *        file
+     * @param callback called with each range of the file
+     * @param ctx passed to callback
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if since isn't before the
+     *         current header
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_backup_since(Db *db,
+                                               uint64_t since,
+                                               couchstore_backup_fn callback,
+                                               void *ctx);
+
+    /** Brings a copy of a file up to date from a couchstore_backup_since() stream. */
+    typedef struct _couchstore_restore couchstore_restore;
+
+    /**
+     * Start restoring into a copy of a file. Nothing may write to it until
+     * the restore is finished; read-only handles opened at its header
+     * since may stay open, and be moved on to the new one once it's
+     * finished with couchstore_refresh_db_header(), which is how a replica
+     * kept in step by a stream of backups is read.
+     *
+     * @param filename the copy, as it was at the header at since; created
+     *        if it doesn't exist and since is 0
+     * @param since the position the stream was taken since
+     * @param pRestore where to store the new restore
+     * @return COUCHSTORE_SUCCESS on success,
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if the copy doesn't reach
+     *         since, or COUCHSTORE_ERROR_NO_HEADER if there's no header
+     *         there
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_restore_open(const char *filename,
+                                               uint64_t since,
+                                               couchstore_restore **pRestore);
+
+    /**
+     * Write one range of a backup stream into the copy. Ranges must be
+     * written in the order they were streamed.
+     *
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_DB_NO_LONGER_VALID if the stream doesn't
+     *         start from the copy's header at since, as when it's of
+     *         another file or of a compacted one
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_restore_write(couchstore_restore *restore,
+                                                uint64_t pos,
+                                                const void *buf,
+                                                size_t size);
+
+    /**
+     * Finish a restore: check what was written, cut off anything past it,
+     * sync the copy and check that it opens at a header. Every chunk
+     * written has to match its CRC and every header has to be valid and
+     * have an update sequence no lower than the one before it, ending with
+     * a header. If not, the copy is cut back to its header at since and the
+     * error returned, so that a stream damaged on the way can be sent again.
+     * Frees the restore whether or not that succeeds.
+     *
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_CHECKSUM_FAIL or COUCHSTORE_ERROR_CORRUPT if
+     *         what was written doesn't check out
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_restore_finish(couchstore_restore *restore);
+
+    /** Free a restore without finishing it. NULL is ignored. */
+    LIBCOUCHSTORE_API
+    void couchstore_restore_abort(couchstore_restore *restore);
+
+    /**
+     * Move a read-only handle on to the newest header in its file, as
+     * written since it was opened by another handle or by a restore.
+     *
+     * @param db the database, opened with COUCHSTORE_OPEN_FLAG_RDONLY
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if it isn't read-only
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_refresh_db_header(Db *db);
+
+    /**
+     * Open a snapshot of a database as of its last commit: a read-only
+     * handle that keeps seeing the file as it was then, however much the
+     * original goes on writing and committing. Unlike opening the file
+     * again, this doesn't look for the header, and reads through the
+     * original's file descriptor and block cache, so snapshots are cheap
+     * enough to take one per reader thread and per scan.
+     *
+     * The snapshot is used and closed with couchstore_close_db() like any
+     * handle, by one thread at a time, which needn't be the one using the
+     * original; many snapshots of one database can be read from at once.
+     * It must be closed before the original is closed or dropped.
+     * Snapshots of handles with custom file ops need ops whose pread can
+     * be called on one handle from more than one thread at once, as the
+     * default ones can.
+     *
+     * This must be called from the thread using db, which writes out
+     * anything it has buffered so that the snapshot can read it.
+     *
+     * @param db the database to take a snapshot of
+     * @param snapshot on success, the new handle
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_snapshot(Db *db, Db **snapshot);
+
     /**
      * Get the default couch_file_ops object
      */
     LIBCOUCHSTORE_API
     const couch_file_ops *couchstore_get_default_file_ops(void);
 
+    /**
+     * Get a couch_file_ops object that performs its I/O through a Linux
+     * io_uring owned by each file handle. Pass it to couchstore_open_db_ex().
+     * Writes are queued and submitted together with the sync or read that
+     * needs them, so an error from one may be returned by that later call.
+     * Handles fall back to blocking system calls if the running kernel
+     * cannot create a ring.
+     *
+     * @return the io_uring file ops, or NULL if the library was built
+     *         without io_uring support
+     */
+    LIBCOUCHSTORE_API
+    const couch_file_ops *couchstore_get_io_uring_file_ops(void);
+
+    /**
+     * Get a couch_file_ops object that bypasses the operating system's page
+     * cache (O_DIRECT, F_NOCACHE on OS X or FILE_FLAG_NO_BUFFERING on
+     * Windows), through aligned buffers shared by all handles. Meant for
+     * bulk writers such as the compactor that shouldn't evict the working
+     * set of other readers.
+     *
+     * @return the direct I/O file ops, or NULL on platforms without them
+     */
+    LIBCOUCHSTORE_API
+    const couch_file_ops *couchstore_get_direct_file_ops(void);
+
+    /**
+     * Sizes of the buffers the library puts in front of the file I/O
+     * operations of every open database. Zero fields select the defaults.
+     */
+    typedef struct {
+        /** Bytes per read buffer (default 8KB) */
+        size_t read_buffer_capacity;
+        /** Number of read buffers kept per file (default 8) */
+        unsigned max_read_buffers;
+        /** Bytes of writes collected before they are issued (default 128KB) */
+        size_t write_buffer_capacity;
+        /** Largest read-ahead window used once reads are detected to be
+            sequential (default 1MB). A value no larger than
+            read_buffer_capacity disables read-ahead. */
+        size_t max_readahead;
+        /** If non-zero, read-ahead also asks the OS, through the advise
+            file op, to start fetching the window after the current one */
+        int advise_readahead;
+    } couchstore_buffer_options;
+
+    /**
+     * Change the buffer sizes of an open database, e.g. a multi-megabyte
+     * write buffer for a bulk load, or more and smaller read buffers for
+     * random reads. Pending writes are flushed first. The sizes are kept
+     * across couchstore_drop_file() and couchstore_reopen_file().
+     *
+     * @param db The database to configure
+     * @param options The new buffer sizes
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_buffer_options(Db *db,
+                                                     const couchstore_buffer_options *options);
+
     /**
      * Get information about the database.
      *
@@ -140,6 +483,27 @@ extern "C" {
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_db_info(Db *db, DbInfo* info);
 
+    /**
+     * Break down the space in the database file into live document
+     * bodies, the live nodes of each tree, and the stale rest, without
+     * reading anything past the header: the figures come from the
+     * reductions and sizes in the trees' roots. Cheap enough to poll
+     * every file of a server when picking which to compact.
+     *
+     * The stale bytes also count the few live chunks the header points
+     * to besides the trees, such as the Bloom filter and the headers
+     * themselves, so they slightly overstate what a compaction frees.
+     * Documents saved but not yet folded in from the delta buffer are
+     * counted once folded, as couchstore_db_info() does.
+     *
+     * @param db the database
+     * @param info where to put the figures
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_fragmentation_stats(Db *db,
+                                                      couchstore_fragmentation_info *info);
+
 
     /**
      * Returns the filename of the database, as given when it was opened.
@@ -182,7 +546,24 @@ extern "C" {
          * sequence number as given. The update_seq for the DB will be set to
          * at least this sequence.
          * */
-        COUCHSTORE_SEQUENCE_AS_IS = 2
+        COUCHSTORE_SEQUENCE_AS_IS = 2,
+        /**
+         * The caller guarantees that none of the documents are in the
+         * database yet, as on an initial load or for an append-only
+         * stream of new IDs. Couchstore then skips looking up each ID's
+         * previous version, which would have to be removed from the
+         * by-sequence index. Saving an ID that does already exist this way
+         * leaves its old sequence number behind in the by-sequence index,
+         * so that changes feeds report it twice.
+         */
+        COUCHSTORE_SAVE_BLIND_INSERT = 4,
+        /**
+         * The bodies are in the file already, written by a document writer
+         * (see couchstore_doc_writer_open()), and each DocInfo's bp and
+         * size say where. The docs aren't looked at, and may be NULL; a
+         * DocInfo with a bp of 0 is saved as a deletion.
+         */
+        COUCHSTORE_SAVE_BODIES_WRITTEN = 8
     };
 
     /**
@@ -231,8 +612,187 @@ extern "C" {
                                                  DocInfo *infos[],
                                                  unsigned numDocs,
                                                  couchstore_save_options options);
+
+    /**
+     * Writes one document body to a file a piece at a time, so that a body
+     * too large to hold in memory at once can be saved. No more than a
+     * segment of it is buffered (see couchstore_set_body_segment_size(),
+     * which sets the size, or 64KB if it isn't set): each segment is
+     * compressed with the file's doc codec and written, with its CRC, as
+     * soon as it's filled. Other documents may be saved while a body is
+     * being written.
+     */
+    typedef struct _couchstore_doc_writer couchstore_doc_writer;
+
+    /**
+     * Start writing a document body. Only files of disk version 16 or
+     * later can have bodies written this way.
+     *
+     * @param db the database, open for writing
+     * @param pWriter where to store the new writer
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS for an older file
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_doc_writer_open(Db *db, couchstore_doc_writer **pWriter);
+
+    /**
+     * Add to the end of the body being written.
+     *
+     * @param writer the writer
+     * @param data the bytes to add
+     * @param size the number of bytes
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_doc_writer_append(couchstore_doc_writer *writer,
+                                                    const void *data,
+                                                    size_t size);
+
+    /**
+     * Finish writing a body, and free the writer whether or not that
+     * succeeds. Fills in info's bp and size and sets COUCH_DOC_IS_COMPRESSED
+     * in its content_meta, ready to save it with the rest of its fields set
+     * and COUCHSTORE_SAVE_BODIES_WRITTEN. The body is only found once
+     * saved and committed; one that's never saved is left as garbage for
+     * compaction.
+     *
+     * @param writer the writer
+     * @param info document info to save the body with
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_doc_writer_finish(couchstore_doc_writer *writer,
+                                                    DocInfo *info);
+
+    /**
+     * Free a document writer without finishing its body. NULL is ignored.
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_doc_writer_abort(couchstore_doc_writer *writer);
+
+    /**
+     * A reusable list of documents to save, which keeps the memory saving
+     * them takes from one save to the next. A writer that flushes small
+     * batches over and over, each through the same write batch, stops
+     * allocating for them once the batches stop growing. A write batch may
+     * save into any database, but is used by one thread at a time.
+     */
+    typedef struct _couchstore_write_batch couchstore_write_batch;
+
+    /**
+     * Create an empty write batch.
+     *
+     * @param pBatch where to store the new batch
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_write_batch_open(couchstore_write_batch **pBatch);
+
+    /**
+     * Add a document to a write batch. Neither doc nor info is copied;
+     * both must stay valid until the batch is saved or cleared.
+     *
+     * @param batch the batch to add to
+     * @param doc the document, or NULL to delete the one info names
+     * @param info document info, as for couchstore_save_document(); its
+     *        db_seq is filled in when the batch is saved
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_write_batch_add(couchstore_write_batch *batch,
+                                                  const Doc *doc,
+                                                  DocInfo *info);
+
+    /**
+     * Called when a write batch is done with a document it was given to
+     * own, to free it or put it back in a pool. info's db_seq has been
+     * filled in if the batch was saved.
+     */
+    typedef void (*couchstore_doc_release_fn)(Doc *doc, DocInfo *info, void *ctx);
+
+    /**
+     * Add a document to a write batch, and give the batch ownership of it,
+     * so that a writer that builds documents for the batch alone can hand
+     * them over rather than copying them or keeping track of them. Bodies
+     * saved uncompressed are written to the file straight from doc's
+     * buffer. The batch calls release exactly
+     * once, when it has been saved (whether or not saving succeeds),
+     * cleared or freed. If adding fails, the caller keeps ownership.
+     *
+     * @param batch the batch to add to
+     * @param doc the document, or NULL to delete the one info names
+     * @param info document info, as for couchstore_write_batch_add()
+     * @param release called with doc, info and ctx to give them back
+     * @param ctx passed to release
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_write_batch_add_owned(couchstore_write_batch *batch,
+                                                        Doc *doc,
+                                                        DocInfo *info,
+                                                        couchstore_doc_release_fn release,
+                                                        void *ctx);
+
+    /**
+     * Save the documents of a write batch, as couchstore_save_documents()
+     * would, and empty it for the next ones. The batch is emptied even if
+     * saving fails.
+     *
+     * @param db the database to save documents in
+     * @param batch the documents to save
+     * @param options as for couchstore_save_documents()
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_save_write_batch(Db *db,
+                                                   couchstore_write_batch *batch,
+                                                   couchstore_save_options options);
+
+    /**
+     * Drop the documents added to a write batch without saving them,
+     * releasing those it owns.
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_write_batch_clear(couchstore_write_batch *batch);
+
+    /**
+     * Free a write batch and the memory it keeps, releasing any documents
+     * it owns. NULL is ignored.
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_write_batch_free(couchstore_write_batch *batch);
+
+    /**
+     * Load documents into an empty database, as when restoring one from a
+     * backup. Takes the same arguments as couchstore_save_documents(), but
+     * rather than updating the indexes it sorts the documents and builds
+     * the by-sequence and by-ID B-trees bottom up, writing each node once
+     * and reading none. The document IDs must all be different. With
+     * COUCHSTORE_SEQUENCE_AS_IS the sequence numbers must be too;
+     * otherwise documents get consecutive ones in the order given.
+     *
+     * @param db an empty database
+     * @param docs an array of document pointers, or NULL to load just
+     *        deletions
+     * @param infos an array of docinfo pointers
+     * @param numDocs the number documents to load
+     * @param options COMPRESS_DOC_BODIES and COUCHSTORE_SEQUENCE_AS_IS are
+     *        supported
+     * @return COUCHSTORE_SUCCESS upon success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if the database already
+     *         has documents, or IDs or sequence numbers repeat
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_bulk_load(Db *db,
+                                            Doc* const docs[],
+                                            DocInfo *infos[],
+                                            unsigned numDocs,
+                                            couchstore_save_options options);
     /**
      * Commit all pending changes and flush buffers to persistent storage.
+     * In relaxed durability mode (see couchstore_set_relaxed_durability())
+     * the header is written, but left to be synced in the background.
      *
      * @param db database to perform the commit on
      * @return COUCHSTORE_SUCCESS on success
@@ -324,6 +884,102 @@ extern "C" {
                                                         Doc **pDoc,
                                                         couchstore_open_options options);
 
+    /**
+     * Retrieve part of a doc's body, using a DocInfo. The range is of the
+     * body as couchstore_open_doc_with_docinfo() would return it with the
+     * same options, and ends early where the body does; past the end the
+     * doc's data is empty.
+     *
+     * A body stored as it's returned, which is any body unless it's
+     * decompressed, has only the range read, and without checking its
+     * CRC, which covers the whole. A compressed body has to be read whole,
+     * unless it was written in segments (see
+     * couchstore_set_body_segment_size()); then only the segments the
+     * range is in are read when decompressing.
+     *
+     * Do not free the docinfo before freeing the doc, with couchstore_free_document().
+     *
+     * @param db database to load document from
+     * @param docinfo a valid DocInfo, as filled in by couchstore_docinfo_by_id()
+     * @param offset where in the body to start
+     * @param len the most bytes to return
+     * @param pDoc Where to store the result
+     * @param options See DECOMPRESS_DOC_BODIES
+     * @return COUCHSTORE_SUCCESS if found
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_document_range(Db *db,
+                                                      const DocInfo *docinfo,
+                                                      uint64_t offset,
+                                                      size_t len,
+                                                      Doc **pDoc,
+                                                      couchstore_open_options options);
+
+    /**
+     * Read a doc's body straight into a buffer of the caller's, such as a
+     * socket's send buffer, rather than into a newly allocated Doc. The
+     * body is the one couchstore_open_doc_with_docinfo() would return with
+     * the same options, and is decompressed into the buffer if asked to.
+     *
+     * If dst is NULL, or the body is longer than dst_len, nothing is
+     * copied, and out_len tells how large a buffer the body needs; the
+     * call still succeeds, so compare out_len with dst_len. Finding out
+     * the length of a compressed body reads it.
+     *
+     * @param db database to load document from
+     * @param docinfo a valid DocInfo, as filled in by couchstore_docinfo_by_id()
+     * @param dst where to put the body, or NULL to just ask for its length
+     * @param dst_len the size of dst
+     * @param out_len set to the length of the body
+     * @param options See DECOMPRESS_DOC_BODIES
+     * @return COUCHSTORE_SUCCESS if found
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_read_doc_into(Db *db,
+                                                const DocInfo *docinfo,
+                                                void *dst,
+                                                size_t dst_len,
+                                                size_t *out_len,
+                                                couchstore_open_options options);
+
+    /**
+     * Ask for the bodies of several docs to be read into memory in the
+     * background, ahead of opening them with couchstore_open_doc_with_docinfo().
+     * Nearby bodies are requested together, in file order.
+     *
+     * @param db database the docs are in
+     * @param docinfos valid DocInfos, as filled in by couchstore_docinfos_by_id()
+     * @param numDocs number of DocInfos
+     * @return COUCHSTORE_SUCCESS if the request was made
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_prefetch_docs(Db *db,
+                                                DocInfo *docinfos[],
+                                                unsigned numDocs);
+
+    /**
+     * Retrieve several docs from the db, using their DocInfos. This has the
+     * same result as calling couchstore_open_doc_with_docinfo() on each, but
+     * prefetches all the bodies first and then reads them in file order.
+     *
+     * Docs whose DocInfo has no body (deleted docs) come back as NULL.
+     * Do not free the docinfos before freeing the docs.
+     *
+     * @param db database to load documents from
+     * @param docinfos valid DocInfos, as filled in by couchstore_docinfos_by_id()
+     * @param numDocs number of DocInfos
+     * @param docs where to store the docs, in the same order as the DocInfos
+     * @param options See DECOMPRESS_DOC_BODIES
+     * @return COUCHSTORE_SUCCESS if all the docs were read. On failure all
+     *         the entries of docs are NULL.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_open_docs_with_docinfos(Db *db,
+                                                          DocInfo *docinfos[],
+                                                          unsigned numDocs,
+                                                          Doc *docs[],
+                                                          couchstore_open_options options);
+
     /**
      * Free all allocated resources from a document returned from
      * couchstore_open_document().
@@ -395,15 +1051,38 @@ extern "C" {
         /**
          * Send only non-deleted items.
          */
-        COUCHSTORE_NO_DELETES = 4
+        COUCHSTORE_NO_DELETES = 4,
+        /**
+         * Iterate from the end backwards. Supported by
+         * couchstore_changes_since() and couchstore_all_docs().
+         */
+        COUCHSTORE_DESCENDING = 8,
+        /**
+         * Pass the callback a DocInfo that borrows its memory from the
+         * index, instead of allocating one for each document. It is only
+         * valid until the callback returns; anything needed afterwards has
+         * to be copied, and returning 1 to keep it has no effect.
+         * Supported by couchstore_changes_since(), couchstore_all_docs(),
+         * couchstore_walk_id_tree() and couchstore_walk_seq_tree().
+         */
+        COUCHSTORE_BORROW_DOCINFOS = 16
     };
 
     /**
      * Iterate through the changes since sequence number `since`.
      *
+     * With COUCHSTORE_DESCENDING, the same changes are iterated newest
+     * first, so the callback can stop after the latest few by returning
+     * a negative value.
+     *
+     * With COUCHSTORE_DELETES_ONLY or COUCHSTORE_NO_DELETES, runs of
+     * changes that are all filtered out aren't read at all, in files of
+     * disk version 16 or later.
+     *
      * @param db the database to iterate through
      * @param since the sequence number to start iterating from
-     * @param options COUCHSTORE_DELETES_ONLY and COUCHSTORE_NO_DELETES are supported
+     * @param options COUCHSTORE_DELETES_ONLY, COUCHSTORE_NO_DELETES and
+     *        COUCHSTORE_DESCENDING are supported
      * @param callback the callback function used to iterate over all changes
      * @param ctx client context (passed to the callback)
      * @return COUCHSTORE_SUCCESS upon success
@@ -418,9 +1097,14 @@ extern "C" {
     /**
      * Iterate through all documents in order by key.
      *
+     * With COUCHSTORE_DESCENDING, documents are iterated in reverse order,
+     * starting at the start key and going down from there.
+     *
      * @param db the database to iterate through
      * @param startKeyPtr  The key to start at, or NULL to start from the beginning
-     * @param options COUCHSTORE_DELETES_ONLY and COUCHSTORE_NO_DELETES are supported
+     *        (the end, if descending)
+     * @param options COUCHSTORE_DELETES_ONLY, COUCHSTORE_NO_DELETES and
+     *        COUCHSTORE_DESCENDING are supported
      * @param callback the callback function used to iterate over all documents
      * @param ctx client context (passed to the callback)
      * @return COUCHSTORE_SUCCESS upon success
@@ -461,6 +1145,109 @@ extern "C" {
                                                        couchstore_changes_callback_fn callback,
                                                        void *ctx);
 
+    /**
+     * Keep, or stop keeping, an index of the live documents by the expiry
+     * time in their rev_meta. It's maintained by every save and rewritten
+     * by compaction, and its root is in the header, so that it survives
+     * reopening with the rest; couchstore_expired_since() searches it.
+     * Documents whose time is 0, or whose rev_meta is too short to hold
+     * one, aren't in it. Turning it on indexes the documents already
+     * there, and takes effect at the next commit, like any save.
+     *
+     * Only files of disk version 16 or later can have the index.
+     *
+     * @param db the database, open for writing
+     * @param enable 1 to index the documents, 0 to drop the index
+     * @param time_offset where in the rev_meta the expiry time is, as a
+     *        32-bit big-endian number; 8 for the one stored after the CAS
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS for an older file
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_expiry_index(Db *db,
+                                                   int enable,
+                                                   uint16_t time_offset);
+
+    /**
+     * Iterate over the documents that expire at or before a time, earliest
+     * first, through the index set up by couchstore_set_expiry_index().
+     * Documents expiring at the same time come in sequence order.
+     *
+     * @param db the database to search
+     * @param time the latest expiry time to report
+     * @param options COUCHSTORE_BORROW_DOCINFOS is supported
+     * @param callback the callback function used to iterate over documents
+     * @param ctx client context (passed to the callback)
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if the database has no index
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_expired_since(Db *db,
+                                                uint32_t time,
+                                                couchstore_docinfos_options options,
+                                                couchstore_changes_callback_fn callback,
+                                                void *ctx);
+
+    /** How a value log is used; see couchstore_set_value_log() */
+    typedef struct {
+        /** Smallest body, in bytes before compression, that goes to the
+            log; 0 to write all bodies to the database file again */
+        uint32_t min_body_size;
+        /** Share of the log, in percent, that may be bodies no longer used
+            before compaction rewrites it; 0 never to rewrite it */
+        uint8_t max_garbage_percent;
+    } couchstore_value_log_options;
+
+    /**
+     * Keep the bodies of large documents in a value log, a file of their
+     * own, instead of in the database file. Compaction then leaves them
+     * where they are, pointing the compacted file at the same log, until
+     * max_garbage_percent of the log is bodies that are no longer used;
+     * that compaction copies the rest into a new log. Logs are named
+     * after path, with a number added: "path.1", then "path.2" and so
+     * on. Once a compaction that started a new log is done, the old log
+     * may be removed along with the old database file.
+     *
+     * The first call starts the log; later ones change its settings and
+     * must give the same path, or NULL. Bodies already written stay where
+     * they are. The change takes effect at the next commit, like any
+     * save. Only files of disk version 16 or later can have a value log.
+     *
+     * @param db the database, open for writing
+     * @param path the base path of the log files
+     * @param options how the log is used
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS for an older file or a
+     *         different path
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_value_log(Db *db,
+                                                const char *path,
+                                                const couchstore_value_log_options *options);
+
+    /**
+     * Write compressed bodies larger than segment_size in segments of that
+     * size, each compressed on its own, so that
+     * couchstore_open_document_range() can decompress only the part of a
+     * body it's asked for. Only bodies saved with COMPRESS_DOC_BODIES and
+     * COUCH_DOC_IS_COMPRESSED set are segmented, and not those going to a
+     * value log. A segmented body compresses less well, and reading one
+     * whole without DECOMPRESS_DOC_BODIES compresses it again.
+     *
+     * The setting is the handle's and isn't kept in the file; bodies
+     * already written stay as they are, and compaction copies them as
+     * they are. Only files of disk version 16 or later can have segmented
+     * bodies.
+     *
+     * @param db the database, open for writing
+     * @param segment_size the size of the segments before compression, or
+     *        0 to write bodies whole
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS for an older file
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_body_segment_size(Db *db, uint32_t segment_size);
+
     /**
      * Iterate over the document infos of a set of ids.
      *
@@ -503,7 +1290,9 @@ extern "C" {
      * returns 0. A positive return value will preserve the DocInfo
      * for future use (should be freed with free_docinfo by the
      * caller). A negative return value will cancel the iteration and
-     * pass the error value back to the caller.
+     * pass the error value back to the caller. For a tree node,
+     * COUCHSTORE_WALK_SKIP_SUBTREE passes over the node and everything
+     * under it without reading them, going on with the node after it.
      *
      * @param db the database being traversed
      * @param depth the current depth in the tree (the root node is 0, and documents are one level
@@ -512,8 +1301,12 @@ extern "C" {
      * @param subtree_size the on-disk size of this tree node and its children, or 0 for a document
      * @param reduce_value the reduce data of this node, or NULL for a document
      * @param ctx user context
-     * @return 1 to preserve the DocInfo, 0 to free it, or a negative error code to abort iteration.
+     * @return 1 to preserve the DocInfo, 0 to free it, COUCHSTORE_WALK_SKIP_SUBTREE to skip a
+     *         node's subtree, or a negative error code to abort iteration.
      */
+    enum {
+        COUCHSTORE_WALK_SKIP_SUBTREE = 2
+    };
     typedef int (*couchstore_walk_tree_callback_fn)(Db *db,
                                                     int depth,
                                                     const DocInfo* doc_info,
@@ -567,17 +1360,185 @@ extern "C" {
                                                 couchstore_walk_tree_callback_fn callback,
                                                 void *ctx);
 
-    /*////////////////////  LOCAL DOCUMENTS: */
+    /** The index a cursor walks through. */
+    typedef enum {
+        COUCHSTORE_CURSOR_BY_ID,
+        COUCHSTORE_CURSOR_BY_SEQUENCE
+    } couchstore_cursor_index;
+
+    /** A node of a B-tree, as couchstore_walk_nodes() reports it. */
+    typedef struct {
+        int depth;              /**< The root is 0 */
+        int is_leaf;            /**< Whether its entries are documents */
+        unsigned count;         /**< Its entries: children, or documents */
+        uint64_t disk_size;     /**< Bytes of its chunk in the file */
+        uint64_t size;          /**< Bytes once decompressed, prefixes expanded */
+    } couchstore_node_info;
 
     /**
-     * Get a local doc from the db.
+     * The callback function used by couchstore_walk_nodes(). A negative
+     * return value cancels the walk and is passed back to its caller.
+     */
+    typedef int (*couchstore_walk_nodes_callback_fn)(Db *db,
+                                                     const couchstore_node_info *node,
+                                                     void *ctx);
+
+    /**
+     * Visit every node of the by-ID or by-sequence B-tree, depth-first
+     * with the root first, without looking at the documents. Meant for
+     * tools that report on the shape and fill of the trees, such as
+     * couch_dbinfo --stats.
      *
-     * The document should be freed with couchstore_free_local_document().
+     * A node's disk size is worked out from the subtree sizes kept in
+     * the pointers to it and its children, so it costs no extra reads.
      *
-     * @param db database to load document from
-     * @param id the identifier to load (must begin with "_local/")
-     * @param idlen the number of bytes in the id
-     * @param lDoc Where to store the result
+     * @param db the database to walk through
+     * @param index which tree to walk
+     * @param callback called for each node
+     * @param ctx client context (passed to the callback)
+     * @return COUCHSTORE_SUCCESS upon success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_walk_nodes(Db *db,
+                                             couchstore_cursor_index index,
+                                             couchstore_walk_nodes_callback_fn callback,
+                                             void *ctx);
+
+
+    /**
+     * A position in one of a database's indexes, which is stepped through
+     * with couchstore_cursor_next() rather than calling back, so that the
+     * caller decides when to fetch the next document. Any number of cursors
+     * can be open on a database, but a cursor must not be used at the same
+     * time as the database it belongs to, and must be closed before it.
+     */
+    typedef struct _couchstore_cursor couchstore_cursor;
+
+    /**
+     * Open a cursor on the by-ID or by-sequence index, positioned before
+     * its first document.
+     *
+     * @param db the database to iterate through
+     * @param index which index to walk
+     * @param pCursor where to store the new cursor
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_cursor_open(Db *db,
+                                              couchstore_cursor_index index,
+                                              couchstore_cursor **pCursor);
+
+    /**
+     * Move a cursor to just before the first document whose key is at
+     * least the given one. A cursor keeps walking the version of the index
+     * it was positioned on, no matter what is saved meanwhile; seeking
+     * moves it onto the current version.
+     *
+     * @param cursor the cursor to move
+     * @param key the document ID to seek to (a 48-bit big-endian sequence
+     *        for by-sequence cursors), or NULL for the start of the index
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_cursor_seek(couchstore_cursor *cursor,
+                                              const sized_buf *key);
+
+    /**
+     * Move a by-sequence cursor to just before the first document with a
+     * sequence number of at least the given one.
+     *
+     * @param cursor the cursor to move
+     * @param sequence the sequence number to seek to
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_cursor_seek_sequence(couchstore_cursor *cursor,
+                                                       uint64_t sequence);
+
+    /**
+     * Step a cursor to its next document.
+     *
+     * The DocInfo should be freed with couchstore_free_docinfo().
+     *
+     * @param cursor the cursor to step
+     * @param pInfo where to store the document's info, or NULL once the
+     *        cursor has passed the last document
+     * @return COUCHSTORE_SUCCESS on success. After a read error the same
+     *         call can be retried.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_cursor_next(couchstore_cursor *cursor,
+                                              DocInfo **pInfo);
+
+    /**
+     * Close a cursor and release its memory.
+     *
+     * @param cursor the cursor to close, or NULL
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_cursor_close(couchstore_cursor *cursor);
+
+    /**
+     * The callback function used by couchstore_parallel_scan(), called on
+     * the scan's threads, for one partition's documents at a time on each
+     * and in index order within a partition. Calls for different
+     * partitions may be made at once.
+     *
+     * @param db the snapshot the partition is read from, to read bodies
+     *        with on the same thread
+     * @param partition the partition the document is in, numbered from 0
+     *        in index order
+     * @param docinfo the document's info, freed if 0 is returned
+     * @param ctx client context (passed to the callback)
+     * @return 0 to free the DocInfo, 1 to keep it (to be freed with
+     *         couchstore_free_docinfo()), or a negative error code to stop
+     *         the whole scan
+     */
+    typedef int (*couchstore_parallel_scan_fn)(Db *db,
+                                               int partition,
+                                               DocInfo *docinfo,
+                                               void *ctx);
+
+    /**
+     * Scan all of the by-ID or by-sequence index of the last commit on
+     * several threads at once. The index is split into key ranges at the
+     * boundaries of its upper interior nodes, as evenly by subtree size as
+     * they allow, and each range is walked on a thread and snapshot (see
+     * couchstore_open_snapshot()) of its own, the calling thread taking
+     * the first. There are no more partitions than threads, and fewer if
+     * the tree is too small to split that far.
+     *
+     * This must be called from the thread using db.
+     *
+     * @param db the database to scan
+     * @param index which index to scan
+     * @param nthreads how many threads to scan on, at most 64
+     * @param options COUCHSTORE_DELETES_ONLY and COUCHSTORE_NO_DELETES are
+     *        supported
+     * @param callback called with each document
+     * @param ctx client context (passed to the callback)
+     * @return COUCHSTORE_SUCCESS upon success, or the first partition's
+     *         error if any failed, the others stopping shortly after
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_parallel_scan(Db *db,
+                                                couchstore_cursor_index index,
+                                                int nthreads,
+                                                couchstore_docinfos_options options,
+                                                couchstore_parallel_scan_fn callback,
+                                                void *ctx);
+
+    /*////////////////////  LOCAL DOCUMENTS: */
+
+    /**
+     * Get a local doc from the db.
+     *
+     * The document should be freed with couchstore_free_local_document().
+     *
+     * @param db database to load document from
+     * @param id the identifier to load (must begin with "_local/")
+     * @param idlen the number of bytes in the id
+     * @param lDoc Where to store the result
      * @return COUCHSTORE_SUCCESS if found
      */
     LIBCOUCHSTORE_API
@@ -608,6 +1569,508 @@ extern "C" {
     void couchstore_free_local_document(LocalDoc *lDoc);
 
 
+    /*////////////////////  BLOCK CACHE: */
+
+    /**
+     * A cache of file blocks that can be shared by any number of open
+     * databases, across threads.
+     */
+    typedef struct _couchstore_block_cache couchstore_block_cache;
+
+    typedef struct {
+        /** Reads served from the cache */
+        uint64_t hits;
+        /** Reads that had to go to the file */
+        uint64_t misses;
+        /** Blocks dropped to make room for others */
+        uint64_t evictions;
+        /** Bytes of block data currently held */
+        uint64_t size;
+        /** Maximum number of bytes of block data the cache will hold */
+        uint64_t capacity;
+    } couchstore_block_cache_stats;
+
+    /**
+     * Create a block cache.
+     *
+     * @param size the number of bytes of block data the cache may hold
+     * @param shards the number of independently locked partitions, or 0 for
+     *        the default. More shards reduce contention between threads.
+     * @param cache where to store the new cache
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_block_cache_create(size_t size,
+                                                     unsigned shards,
+                                                     couchstore_block_cache **cache);
+
+    /**
+     * Destroy a block cache. Every database attached to it must have been
+     * closed or detached first.
+     *
+     * @param cache the cache to destroy
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_block_cache_destroy(couchstore_block_cache *cache);
+
+    /**
+     * Get the hit, miss and eviction counters of a block cache.
+     *
+     * @param cache the cache to examine
+     * @param stats where to store the counters
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_block_cache_get_stats(couchstore_block_cache *cache,
+                                          couchstore_block_cache_stats *stats);
+
+    /**
+     * Attach a database to a block cache, so that its reads are served from
+     * and populate the shared cache. Databases with the same file open share
+     * its cached blocks. The attachment survives couchstore_drop_file() and
+     * couchstore_reopen_file().
+     *
+     * @param db the database to attach
+     * @param cache the cache to use, or NULL to detach the database
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_block_cache(Db *db,
+                                                  couchstore_block_cache *cache);
+
+    /**
+     * Set how much memory a database may spend keeping the interior nodes
+     * of its B-trees decoded, so that lookups don't read and parse them
+     * again. The cache belongs to the handle and starts out at 512KB; the
+     * setting survives couchstore_drop_file() and couchstore_reopen_file().
+     *
+     * @param db the database to change
+     * @param size the budget in bytes, or 0 to turn the cache off
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_node_cache_size(Db *db, size_t size);
+
+    /**
+     * Set how many worker threads compress the B-tree nodes that saving
+     * documents writes, and the bodies of a batch saved with
+     * COMPRESS_DOC_BODIES. The calling thread goes on building nodes and
+     * appends each chunk once it is compressed, in the same order as
+     * before, so the file comes out byte for byte the same; what overlaps
+     * is the compression with the tree traversal and the writes. Worth it
+     * for large batches. The threads belong to the handle; the setting
+     * survives couchstore_drop_file() and couchstore_reopen_file().
+     *
+     * @param db the database to change
+     * @param threads the number of threads, or 0 (the default) to
+     *        compress nodes on the calling thread
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_compression_threads(Db *db, unsigned threads);
+
+    /**
+     * Set how many worker threads read document bodies ahead when this
+     * database is compacted with couchstore_compact_db() or
+     * couchstore_compact_db_ex(). Each opens the file read-only with its
+     * own handle, through the file ops given to the compaction, and the
+     * calling thread appends the bodies and builds the new trees in the
+     * same order as before, so the compacted file comes out byte for byte
+     * the same; what overlaps is the reads, which keeps several in flight
+     * on disks that serve many at once. Worth it for files well beyond the
+     * page cache.
+     *
+     * @param db the database to be compacted
+     * @param threads the number of threads, or 0 (the default) to read
+     *        bodies on the calling thread
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_compaction_threads(Db *db, unsigned threads);
+
+    /**
+     * Set the memory the sort of the by-ID entries takes when this database
+     * is compacted with couchstore_compact_db() or couchstore_compact_db_ex().
+     * The entries are sorted in memory in runs of up to about that much,
+     * on as many threads as couchstore_set_compaction_threads() gives (one
+     * if none), and the runs, written to compressed temporary files, are
+     * merged in one pass: a larger budget means fewer runs to merge, and
+     * none at all for a file whose IDs fit.
+     *
+     * @param db the database to be compacted
+     * @param max_bytes the budget, or 0 (the default) for 100 MB
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_compaction_sort_memory(Db *db, size_t max_bytes);
+
+    /**
+     * Set the steps in which a database reserves disk space ahead of its
+     * writes, so that an appended file grows in a few large extents rather
+     * than one buffered write at a time. The space is reserved without
+     * changing the file's size, which stays where the data ends, and is
+     * released when the file is closed or dropped. File ops that can't
+     * reserve space that way (see couch_file_ops) simply don't. The
+     * setting survives couchstore_drop_file() and couchstore_reopen_file().
+     *
+     * @param db the database to change
+     * @param chunk_size the step in bytes, or 0 (the default) to stop
+     *        reserving space
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_preallocation(Db *db, size_t chunk_size);
+
+    /**
+     * Choose the codecs that document bodies saved with COMPRESS_DOC_BODIES
+     * and B-tree nodes are compressed with from now on. Each chunk records
+     * its codec, so a file can mix them and reading needs no setting; but
+     * only a build of the library with the codec can read what it wrote.
+     * Codecs other than snappy need a file of disk version 13 or later. The
+     * setting belongs to the handle and survives couchstore_drop_file() and
+     * couchstore_reopen_file(). Compaction keeps the codecs chunks were
+     * written with.
+     *
+     * @param db the database to change
+     * @param doc_codec the codec for document bodies
+     * @param node_codec the codec for B-tree nodes
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if a codec isn't built in or
+     *         the file is too old for it
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_codecs(Db *db,
+                                             couchstore_codec doc_codec,
+                                             couchstore_codec node_codec);
+
+    /**
+     * Store a zstd dictionary in the file, which everything compressed with
+     * COUCHSTORE_CODEC_ZSTD after it is compressed with. Small documents
+     * that look alike, which on their own hardly compress, do much better
+     * with a dictionary trained on samples of them (by `zstd --train` or
+     * ZDICT_trainFromBuffer()). A file has one dictionary, for good: it is
+     * written at most once, and compaction copies it. It is committed with
+     * the next couchstore_commit().
+     *
+     * @param db the database to change
+     * @param dict the serialized dictionary
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if zstd isn't built in, the
+     *         file is older than disk version 13 or already has a dictionary
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_zstd_dictionary(Db *db, const sized_buf *dict);
+
+    /**
+     * Choose how the nodes of the by-ID and by-sequence trees are sized as
+     * they are written from now on. Fixed-size nodes are about 1.3KB,
+     * which leaves trees of small keys deep and holds few large values.
+     * Adaptive sizing keeps averages of the sizes of a tree's keys and
+     * values as documents are saved, and fills nodes to whole 4KB blocks,
+     * more of them if a block wouldn't hold a fair number of entries. The
+     * policies and averages are stored in the file with the next commit,
+     * and copied by compaction. Needs disk version 13 or later.
+     *
+     * @param db the database to change
+     * @param by_id the policy for the by-ID tree
+     * @param by_seq the policy for the by-sequence tree
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if the file is too old
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_node_size_policy(Db *db,
+                                                       couchstore_node_size_policy by_id,
+                                                       couchstore_node_size_policy by_seq);
+
+    /**
+     * Keep the index entries of recently saved documents in a delta buffer
+     * instead of updating the trees at once, and fold them into the trees in
+     * one batch when more than max_docs would be buffered. Each commit appends
+     * just the entries saved since the last one to a log in the file, rather
+     * than new paths through both trees, which makes commits of a few
+     * documents much cheaper. The buffer is reloaded from the log when the
+     * file is opened, whatever this handle setting is.
+     *
+     * Looking up a document by ID or sequence finds it in the buffer. Other
+     * reads (changes, iteration, counts, DbInfo) first fold the buffer into
+     * the trees. A read-only handle can't write the new nodes to the file,
+     * so it keeps them in memory until it moves to another header; tools
+     * that walk the nodes see them at positions past the end of the file.
+     * Compaction folds the buffer into the new file.
+     *
+     * @param db the database to change
+     * @param max_docs how many saves to buffer before folding; 0 folds any
+     *        pending entries and updates the trees at once from then on
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if the file is older than
+     *         disk version 13
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_delta_buffer(Db *db, unsigned max_docs);
+
+    /**
+     * Hold saves in the delta buffer (see couchstore_set_delta_buffer())
+     * until the next commit, which folds them into the trees instead of
+     * logging them. Saves between two commits then rewrite each path
+     * through the trees once, however many calls they're made in, and a
+     * document saved again before the commit is written to the trees only
+     * the last time. The buffer is folded before a save if it holds more
+     * than max_bytes, and as before ahead of reads other than lookups by
+     * ID or sequence.
+     *
+     * Unlike the delta buffer's log, this works with files of any version.
+     * If both are set, the buffer is also folded once it has max_docs
+     * saves, but never logged.
+     *
+     * @param db the database to change
+     * @param max_bytes the most memory the held entries may take before
+     *        they are folded; 0 folds any held entries and stops holding
+     *        them
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_write_back(Db *db, size_t max_bytes);
+
+    /**
+     * Cap the working memory of the tree updates of saves and commits, and
+     * of compactions of the file. Each of the arenas they allocate nodes
+     * and copied entries from may hold at most max_bytes; an update that
+     * would need more fails with COUCHSTORE_ERROR_ALLOC_FAIL, leaving the
+     * file as of the last commit, rather than running the process out of
+     * memory. What the arenas of a compaction hold is reported in its
+     * couchstore_compact_progress.
+     *
+     * @param db the database to change
+     * @param max_bytes the cap per arena, or 0 for none
+     * @return COUCHSTORE_SUCCESS
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_arena_limit(Db *db, size_t max_bytes);
+
+
+    /*////////////////////  I/O STATISTICS: */
+
+#define COUCHSTORE_HISTOGRAM_BUCKETS 32
+
+    /**
+     * A histogram with power-of-two buckets. Bucket 0 counts values of 0,
+     * and bucket i counts values from 2^(i-1) up to 2^i - 1; the last bucket
+     * also counts everything larger than that.
+     */
+    typedef struct {
+        /** Number of values recorded */
+        uint64_t count;
+        /** Sum of the values recorded */
+        uint64_t total;
+        uint64_t buckets[COUCHSTORE_HISTOGRAM_BUCKETS];
+    } couchstore_histogram;
+
+    /**
+     * I/O done on behalf of a database handle. Counts are of calls made to
+     * the couch_file_ops the database was opened with, below the library's
+     * own buffering.
+     */
+    typedef struct {
+        /** Read calls, and the bytes they returned */
+        uint64_t reads;
+        uint64_t bytes_read;
+        /** Write calls (a vectored write counts once), and the bytes written */
+        uint64_t writes;
+        uint64_t bytes_written;
+        /** Sync calls */
+        uint64_t syncs;
+        /** Reads served from the read buffers, and ones that weren't */
+        uint64_t buffer_hits;
+        uint64_t buffer_misses;
+        /** Read buffers reused for a different part of the file */
+        uint64_t buffer_evictions;
+        /** Successful commits */
+        uint64_t commits;
+        /** Latencies of reads, writes and syncs, in microseconds */
+        couchstore_histogram read_latency;
+        couchstore_histogram write_latency;
+        couchstore_histogram sync_latency;
+        /** Bytes written to the file per commit, header and all */
+        couchstore_histogram commit_bytes;
+    } couchstore_io_stats;
+
+    /**
+     * Get the I/O statistics of a database handle. They cover the handle's
+     * whole lifetime, including across couchstore_drop_file() and
+     * couchstore_reopen_file(), or since the last couchstore_reset_io_stats().
+     *
+     * @param db the database to examine
+     * @param stats where to store the statistics
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_get_io_stats(Db *db, couchstore_io_stats *stats);
+
+    /**
+     * Reset the I/O statistics of a database handle to zero.
+     *
+     * @param db the database whose statistics to reset
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_reset_io_stats(Db *db);
+
+
+    /*////////////////////  GROUP COMMIT: */
+
+    /**
+     * A background committer that batches the commits of many databases,
+     * so that their file syncs are issued together instead of one caller
+     * at a time.
+     */
+    typedef struct _couchstore_commit_group couchstore_commit_group;
+
+    /**
+     * Called on the committer's thread once a commit queued with
+     * couchstore_commit_async() is durable, or has failed.
+     *
+     * @param db the database that was committed
+     * @param result the outcome, as couchstore_commit() would have returned it
+     * @param ctx the context passed to couchstore_commit_async()
+     */
+    typedef void (*couchstore_commit_callback)(Db *db,
+                                               couchstore_error_t result,
+                                               void *ctx);
+
+    typedef struct {
+        /** Commits completed, callbacks included */
+        uint64_t commits;
+        /** Batches the commits were grouped into */
+        uint64_t batches;
+    } couchstore_commit_group_stats;
+
+    /**
+     * Create a commit group.
+     *
+     * @param max_delay_ms how long to hold a commit back waiting for others
+     *        to batch it with. With 0, a batch is whatever was queued while
+     *        the previous one was being synced.
+     * @param sync_threads the number of extra threads that sync the files of
+     *        a batch in parallel, or 0 to sync them all from the committer
+     *        thread
+     * @param group where to store the new group
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_commit_group_create(unsigned max_delay_ms,
+                                                      unsigned sync_threads,
+                                                      couchstore_commit_group **group);
+
+    /**
+     * Destroy a commit group. Commits still queued are completed, and their
+     * callbacks called, before this returns.
+     *
+     * @param group the group to destroy
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_commit_group_destroy(couchstore_commit_group *group);
+
+    /**
+     * Queue a commit of a database. The database must not be used by the
+     * caller, or queued again, until the callback has been called for it.
+     *
+     * @param group the commit group
+     * @param db the database to commit
+     * @param callback called when the commit is durable or has failed
+     * @param ctx passed to the callback
+     * @return COUCHSTORE_SUCCESS if the commit was queued
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_commit_async(couchstore_commit_group *group,
+                                               Db *db,
+                                               couchstore_commit_callback callback,
+                                               void *ctx);
+
+    /**
+     * Get the counters of a commit group.
+     *
+     * @param group the group to examine
+     * @param stats where to store the counters
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_commit_group_get_stats(couchstore_commit_group *group,
+                                           couchstore_commit_group_stats *stats);
+
+
+    /*////////////////////  RELAXED DURABILITY: */
+
+    /** When a database in relaxed durability mode is synced. */
+    typedef struct {
+        /** How long a commit may wait to be synced, to be synced along
+            with those after it; 0 syncs each as soon as the last sync is
+            done */
+        unsigned interval_ms;
+        /** Sync sooner than that once this many bytes have been written
+            since the last header synced; 0 for no limit */
+        uint64_t max_bytes;
+    } couchstore_relaxed_durability;
+
+    /**
+     * Put a database in relaxed durability mode, or take it out of it.
+     *
+     * In relaxed mode couchstore_commit() writes the header and returns
+     * without syncing; a background thread syncs the file as the options
+     * say, through the handle's file descriptor, and keeps the newest
+     * header it has synced as the durable watermark (see
+     * couchstore_get_durable_header() and couchstore_wait_durable()).
+     * Commits after the watermark are lost in a crash. The thread syncs a
+     * commit's data before listing its header in the file's header hints
+     * (see COUCHSTORE_OPEN_FLAG_HEADER_HINTS) and syncing those, so the
+     * file must have them: opening it after a crash goes to the newest
+     * header listed, passing over later ones the file system may have
+     * written out before the data they point at. Bodies written to a
+     * value log are still synced by each commit.
+     *
+     * Taking the database out of relaxed mode, dropping it or closing it
+     * syncs what was committed and stops the thread. The file ops must
+     * allow sync to be called on a handle while it's being written to, as
+     * the default ones do. Group commits (couchstore_commit_async()) sync
+     * as before.
+     *
+     * This must be called from the thread using db.
+     *
+     * @param db the database
+     * @param options when to sync, or NULL to sync every commit again
+     * @return COUCHSTORE_SUCCESS on success,
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if the database is read
+     *         only or its file has no header hints, or the error of a
+     *         background sync that failed when leaving relaxed mode
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_relaxed_durability(Db *db,
+                                                         const couchstore_relaxed_durability *options);
+
+    /**
+     * Get the durable watermark: the position and update sequence of the
+     * newest header known to be synced. Outside relaxed mode that's the
+     * current header, which only the thread using db may ask for; in it,
+     * any thread may.
+     *
+     * @param db the database
+     * @param position where to store the header's position
+     * @param update_seq where to store its update sequence
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_get_durable_header(Db *db, uint64_t *position, uint64_t *update_seq);
+
+    /**
+     * Wait until the header at a position, as given by
+     * couchstore_get_header_position() after a commit, is synced. Returns
+     * at once outside relaxed mode. In it, any thread may call this.
+     *
+     * @param db the database
+     * @param position the header's position
+     * @return COUCHSTORE_SUCCESS once it's synced, the error of a
+     *         background sync that failed, or
+     *         COUCHSTORE_ERROR_INVALID_ARGUMENTS if no header has been
+     *         committed at or past that position
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_wait_durable(Db *db, uint64_t position);
+
+
     /*////////////////////  UTILITIES: */
 
     /**
@@ -615,6 +2078,10 @@ extern "C" {
      * source db, omitting data that is no longer needed.
      * Will use default couch_file_ops to create and write the target db.
      *
+     * The new file is always in the latest disk format, whatever that of the
+     * source, so versions of the library from before it may not be able to
+     * open it. There's no way to keep the older format.
+     *
      * @param source the source database
      * @param target_filename the filename of the new database to create.
      * @return COUCHSTORE_SUCCESS on success
@@ -651,6 +2118,153 @@ extern "C" {
                                            DocInfo *docinfo,
                                            void *ctx);
 
+    /**
+     * Called every so often during a compaction with how many bytes it has
+     * moved so far: bodies and nodes written to the target, and records
+     * written while sorting the by-ID entries. It may sleep to slow the
+     * compaction down, and any error it returns aborts it.
+     */
+    typedef couchstore_error_t (*couchstore_compact_throttle_fn)(uint64_t bytes,
+                                                                 void *ctx);
+
+    /**
+     * How a compaction keeps out of the way of foreground I/O.
+     */
+    typedef struct {
+        /** The most bytes a second to move, or 0 for no limit. The
+            compaction sleeps between batches to stay under it. */
+        uint64_t bytes_per_sec;
+        /** Called between batches, if not NULL */
+        couchstore_compact_throttle_fn callback;
+        void *callback_ctx;
+        /** Nonzero to run the compaction's I/O in the idle scheduling
+            class, where the platform has one (Linux ioprio) */
+        int idle_io;
+    } couchstore_compact_throttle;
+
+    /**
+     * Set how compactions of this database by couchstore_compact_db(),
+     * couchstore_compact_db_ex() and couchstore_compact_db_resumable() are
+     * held back, copying throttle. The limit applies to the copying of the
+     * by-sequence tree as well as the sorting and writing of the by-ID
+     * one, in steps of a few hundred kilobytes. The I/O priority is set
+     * on the calling thread for the length of the compaction, and taken
+     * on by the threads it starts (see couchstore_set_compaction_threads).
+     *
+     * @param db the database to be compacted
+     * @param throttle the settings, or NULL to compact at full speed
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_compaction_throttle(Db *db,
+                                                          const couchstore_compact_throttle *throttle);
+
+    /** The stages a compaction goes through, in order. */
+    typedef enum {
+        /** Copying the by-sequence tree and the bodies */
+        COUCHSTORE_COMPACT_PHASE_SEQ_COPY,
+        /** Sorting the by-ID entries of what was copied */
+        COUCHSTORE_COMPACT_PHASE_ID_SORT,
+        /** Writing the by-ID tree */
+        COUCHSTORE_COMPACT_PHASE_ID_WRITE,
+        /** Copying the local documents */
+        COUCHSTORE_COMPACT_PHASE_LOCAL_DOCS,
+        /** Finished and committed */
+        COUCHSTORE_COMPACT_PHASE_DONE,
+        COUCHSTORE_COMPACT_PHASES
+    } couchstore_compact_phase;
+
+    /** How far a compaction has got. Times are in nanoseconds. */
+    typedef struct {
+        couchstore_compact_phase phase;
+        /** By-sequence entries copied, tombstones included */
+        uint64_t items_copied;
+        /** By-sequence entries in the source, dropped ones included */
+        uint64_t items_total;
+        /** Read from the source file */
+        uint64_t bytes_read;
+        /** Written to the target file */
+        uint64_t bytes_written;
+        /** What the target should come to: the live document bytes and
+            the sizes of the source's trees, going by their roots */
+        uint64_t estimated_bytes;
+        /** Spent in each phase so far, the current one included */
+        uint64_t phase_ns[COUCHSTORE_COMPACT_PHASES];
+        uint64_t elapsed_ns;
+        /** bytes_written over elapsed_ns */
+        uint64_t bytes_per_sec;
+        /** The time left at that rate to write what's still estimated;
+            0 once done */
+        uint64_t remaining_ns;
+        /** Held by the compaction's arenas, and the most each has held
+            added up (see couchstore_set_arena_limit) */
+        uint64_t arena_bytes;
+        uint64_t arena_peak_bytes;
+    } couchstore_compact_progress;
+
+    /**
+     * Called as a compaction starts each phase, every few hundred kilobytes
+     * it writes, and once it's done. Any error it returns aborts the
+     * compaction.
+     */
+    typedef couchstore_error_t (*couchstore_compact_progress_fn)(const couchstore_compact_progress *progress,
+                                                                 void *ctx);
+
+    /**
+     * Set what is told how compactions of this database by
+     * couchstore_compact_db(), couchstore_compact_db_ex() and
+     * couchstore_compact_db_resumable() are getting on. A resumable
+     * compaction reports on the slice each call goes through, copying the
+     * by-ID entries along with the by-sequence ones; the totals are of the
+     * whole source.
+     *
+     * @param db the database to be compacted
+     * @param callback called with the progress, or NULL for none
+     * @param ctx passed to callback
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_compaction_progress(Db *db,
+                                                          couchstore_compact_progress_fn callback,
+                                                          void *ctx);
+
+    /**
+     * Which tombstones a compaction drops, decided from the by-sequence
+     * entries themselves rather than by calling a hook with each one's
+     * DocInfo. A tombstone is dropped if either rule that is set matches.
+     */
+    typedef struct {
+        /** Drop tombstones of this sequence number or lower; 0 for none */
+        uint64_t max_seq;
+        /** Drop tombstones deleted before this time; 0 for none. The time
+            is read from the rev_meta, and tombstones whose rev_meta is too
+            short to hold one are kept. */
+        uint32_t before_time;
+        /** Where in the rev_meta the deletion time is, as a 32-bit
+            big-endian number; 8 for the expiry time stored after the CAS,
+            where deletions record theirs */
+        uint16_t time_offset;
+    } couchstore_purge_policy;
+
+    /**
+     * Set which tombstones compactions of this database by
+     * couchstore_compact_db(), couchstore_compact_db_ex() and
+     * couchstore_compact_db_resumable() drop, copying policy. Tombstones
+     * it drops never reach the compaction's hook, which still sees the
+     * rest. The target's purge_seq is raised to the highest sequence
+     * dropped, as a hook would with couchstore_set_purge_seq(). A file
+     * whose by-ID counts show no tombstones at all is copied without
+     * looking at any.
+     *
+     * @param db the database to be compacted
+     * @param policy the rules, or NULL to drop only what the flags and
+     *        hook say
+     * @return COUCHSTORE_SUCCESS on success
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_purge_policy(Db *db,
+                                                   const couchstore_purge_policy *policy);
+
     /**
      * Set purge sequence number. This allows the compactor hook to set the highest
      * purged sequence number into the header once compaction is complete
@@ -679,6 +2293,220 @@ extern "C" {
                                                 couchstore_compact_hook hook, void* hook_ctx,
                                                 const couch_file_ops *ops);
 
+    /**
+     * Compact a database like couchstore_compact_db_ex(), in slices that
+     * can be spread over several calls and carried on after a restart.
+     * Every checkpoint_docs documents, and at the end of each slice, the
+     * target is committed along with where the compaction has got to; a
+     * call given a target with such a checkpoint picks up from there.
+     *
+     * The checkpoint names the source header being compacted, so the
+     * source may be updated in between calls: the compaction carries on
+     * from a read-only snapshot of the file at that header, and the
+     * target, once done, has the data of that snapshot. If the snapshot
+     * can't be found, say because the source has itself been replaced,
+     * or the flags differ, or the target has no checkpoint, the target is
+     * removed and the compaction starts over from the source's current
+     * header.
+     *
+     * Unlike couchstore_compact_db_ex(), the target isn't removed on
+     * failure, so that its last checkpoint can be resumed from. Its trees
+     * are added to a batch at a time rather than built in one pass, so
+     * their nodes are less full than with the other compactors.
+     *
+     * @param source the source database
+     * @param target_filename the filename of the new database
+     * @param flags flags that change compaction behavior
+     * @param hook as for couchstore_compact_db_ex(); it is called with the
+     *        NULL docinfo once, when the compaction finishes
+     * @param hook_ctx passed to hook
+     * @param ops the file I/O operations for the target, and for the
+     *        snapshot of the source if it needs opening
+     * @param checkpoint_docs how many source documents to go through
+     *        between checkpoints; 0 for one at the end of the slice only
+     * @param max_docs how many source documents this call goes through
+     *        at most; 0 to carry on to the end
+     * @param pDone set to 1 if the compaction is finished, in which case
+     *        the target no longer has a checkpoint, or 0 if there's more
+     *        to come
+     * @return COUCHSTORE_SUCCESS on success, whether or not finished
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_compact_db_resumable(Db* source, const char* target_filename,
+                                                       uint64_t flags,
+                                                       couchstore_compact_hook hook,
+                                                       void* hook_ctx,
+                                                       const couch_file_ops *ops,
+                                                       uint64_t checkpoint_docs,
+                                                       uint64_t max_docs,
+                                                       int *pDone);
+
+    /**
+     * Bring a compacted file up to date with what has been saved to its
+     * source since the snapshot it was compacted from, so that writers
+     * needn't stop for the compaction. Each round replays the by-sequence
+     * changes past the target's update_seq into it, deletions included,
+     * copies the local documents again and commits the target; rounds go
+     * on until one replays no more than small_enough changes, or after
+     * max_rounds of them.
+     *
+     * A read-only source handle is moved on to the newest header in its
+     * file before each round, so that it sees what writers on other
+     * handles have committed. A writable handle is taken as it is, with
+     * what it has saved but not committed. To finish, stop the writers,
+     * commit, catch up once more and then swap the target in for the
+     * source.
+     *
+     * @param source the database that was compacted
+     * @param target the finished compaction of it, open for writing
+     * @param small_enough how few changes in a round count as caught up
+     * @param max_rounds the most rounds to go through; at least one is
+     * @param pReplayed set to the number of changes the last round replayed
+     * @return COUCHSTORE_SUCCESS on success, or
+     *         COUCHSTORE_ERROR_DB_NO_LONGER_VALID if the source is older
+     *         than the target, as after it's been replaced
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_compact_catch_up(Db* source, Db* target,
+                                                   uint64_t small_enough,
+                                                   unsigned max_rounds,
+                                                   uint64_t *pReplayed);
+
+
+    /*////////////////////  OPERATION LATENCIES: */
+
+    /**
+     * Latencies, in microseconds, of the work done inside calls on a
+     * database handle, for telling whether a slow call spent its time on
+     * I/O, decompression or comparisons. Calls made by others are counted
+     * again in their own histograms: couchstore_open_document() looks the
+     * ID up with couchstore_docinfo_by_id(), and saves and commits update
+     * the trees.
+     */
+    typedef struct {
+        couchstore_histogram open_document;
+        couchstore_histogram docinfo_by_id;
+        couchstore_histogram save_documents;
+        couchstore_histogram commit;
+        /** B-tree nodes read from the file rather than the node cache:
+            reading the chunk (I/O and decompression), then decoding it */
+        couchstore_histogram node_read;
+        couchstore_histogram node_decode;
+        /** Each update of one of the file's B-trees */
+        couchstore_histogram tree_update;
+        /** Each phase of the compactions of the file */
+        couchstore_histogram compact_phase[COUCHSTORE_COMPACT_PHASES];
+    } couchstore_op_stats;
+
+    /**
+     * Start or stop recording a database handle's operation latencies.
+     * They're off by default, and cost a clock read at each end of a timed
+     * operation while on. Stopping discards what has been recorded.
+     *
+     * Like the I/O statistics they aren't locked, so they're only exact
+     * when the handle is used by one thread at a time, which rules out
+     * COUCHSTORE_OPEN_FLAG_SHARED_READS.
+     *
+     * @param db the database to time
+     * @param enable nonzero to start, zero to stop
+     * @return COUCHSTORE_SUCCESS, or COUCHSTORE_ERROR_INVALID_ARGUMENTS if
+     *         the library was built with the COUCHSTORE_OP_STATS option off
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_op_stats(Db *db, int enable);
+
+    /**
+     * Get the operation latencies recorded on a database handle since
+     * they were turned on or last reset; all zero if they're off.
+     *
+     * @param db the database to examine
+     * @param stats where to store the latencies
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_get_op_stats(Db *db, couchstore_op_stats *stats);
+
+    /**
+     * Reset the operation latencies of a database handle to zero.
+     *
+     * @param db the database whose latencies to reset
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_reset_op_stats(Db *db);
+
+
+    /*////////////////////  MEMORY: */
+
+    /**
+     * Memory a database handle holds, in bytes, by what holds it. The
+     * process-wide fields are the same whichever handle is asked.
+     */
+    typedef struct {
+        /** Read, write and read-ahead buffers of the file */
+        size_t io_buffers;
+        /** Decoded B-tree nodes; see couchstore_set_node_cache_size() */
+        size_t node_cache;
+        /** Bloom filter of document IDs */
+        size_t bloom_filter;
+        /** Saves not yet in the trees; see couchstore_set_delta_buffer() */
+        size_t delta_buffer;
+        /** The file's zstd dictionary, once loaded */
+        size_t dictionary;
+        /** All of the above, for the snapshots of a handle opened with
+            COUCHSTORE_OPEN_FLAG_SHARED_READS that aren't lent out */
+        size_t read_pool;
+        /** Local documents kept from the last reads and saves */
+        size_t local_docs;
+        /** Sum of the fields above */
+        size_t total;
+        /** Process-wide: the arenas of tree updates, write batches,
+            compactions and view updates, while they last */
+        size_t arenas;
+        /** Process-wide: freed arena chunks kept for the next arenas */
+        size_t arena_pool;
+    } couchstore_memory_stats;
+
+    /**
+     * Get the memory a database handle holds. Block caches are shared,
+     * and report theirs in couchstore_block_cache_get_stats(). It should
+     * be called on the thread using the handle, as its buffers change
+     * with every read.
+     *
+     * @param db the database to examine, or NULL for just the process-wide
+     *        fields
+     * @param stats where to store the byte counts
+     */
+    LIBCOUCHSTORE_API
+    void couchstore_get_memory_stats(Db *db, couchstore_memory_stats *stats);
+
+    /**
+     * Functions the library allocates and frees its memory with, e.g. to
+     * give it a jemalloc arena of its own or to account for it. Each is
+     * passed ctx, and must behave like its C library namesake.
+     */
+    typedef struct {
+        void *(*malloc_fn)(void *ctx, size_t size);
+        void *(*calloc_fn)(void *ctx, size_t count, size_t size);
+        void *(*realloc_fn)(void *ctx, void *ptr, size_t size);
+        void (*free_fn)(void *ctx, void *ptr);
+        void *ctx;
+    } couchstore_allocator;
+
+    /**
+     * Route the library's allocations through an allocator. It has to be
+     * set before anything else is called, since memory allocated with one
+     * allocator is freed with whichever is set then. What the library
+     * returns, such as documents and DocInfos, is allocated with it too,
+     * and must be freed with the library's functions for the purpose.
+     * Allocations inside V8, the compression libraries and the C++
+     * standard library don't go through it.
+     *
+     * @param allocator the functions to use, or NULL for malloc and free
+     * @return COUCHSTORE_SUCCESS, or COUCHSTORE_ERROR_INVALID_ARGUMENTS if
+     *         a function is missing
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_set_allocator(const couchstore_allocator *allocator);
+
 
     /*////////////////////  MISC: */
 
@@ -720,6 +2548,73 @@ extern "C" {
                                                  uint64_t max_seq,
                                                  uint64_t *count);
 
+     /**
+      * Counts the documents whose IDs lie between two IDs, inclusive. Only
+      * the B-tree nodes that the ends of the range fall in are read; the
+      * document counts kept in the interior nodes cover the rest, so this
+      * takes about as long as two lookups however wide the range is.
+      *
+      * @param db The db to count documents in
+      * @param start_id The first ID to count, or NULL to start at the first
+      * @param end_id The last ID to count, or NULL to count to the end
+      * @param options COUCHSTORE_DELETES_ONLY and COUCHSTORE_NO_DELETES are
+      *        supported
+      * @param count Pointer to uint64_t to store count in
+      * @return COUCHSTORE_SUCCESS on success
+      */
+     LIBCOUCHSTORE_API
+     couchstore_error_t couchstore_count_range(Db *db,
+                                               const sized_buf *start_id,
+                                               const sized_buf *end_id,
+                                               couchstore_docinfos_options options,
+                                               uint64_t *count);
+
+     /**
+      * Retrieves the info of the document at a given position in ID order,
+      * such as the first document of a page of couchstore_all_docs()
+      * results, by a single descent of the by-ID tree.
+      *
+      * @param db The db the document is in
+      * @param rank The number of documents that come before it
+      * @param options COUCHSTORE_DELETES_ONLY and COUCHSTORE_NO_DELETES are
+      *        supported, and select which documents are counted
+      * @param pInfo Pointer to a DocInfo set to the new document info;
+      *        free it with couchstore_free_docinfo()
+      * @return COUCHSTORE_SUCCESS on success, or COUCHSTORE_ERROR_DOC_NOT_FOUND
+      *         if there are no more than rank documents
+      */
+     LIBCOUCHSTORE_API
+     couchstore_error_t couchstore_docinfo_by_rank(Db *db,
+                                                   uint64_t rank,
+                                                   couchstore_docinfos_options options,
+                                                   DocInfo **pInfo);
+
+     /**
+      * Calls back with a uniformly random sample of the documents, without
+      * reading the rest: n distinct documents, each with the same chance
+      * of being in it, found by one descent of the by-ID tree apiece
+      * using the document counts kept in its interior nodes. They come in
+      * ID order. The same seed gives the same sample of the same tree.
+      *
+      * @param db The db to sample
+      * @param n How many documents to sample; all of them if there are no
+      *        more than that
+      * @param seed Seeds the choice of documents
+      * @param options COUCHSTORE_DELETES_ONLY and COUCHSTORE_NO_DELETES are
+      *        supported, and select which documents are sampled from
+      * @param callback Called with each document chosen, as by
+      *        couchstore_changes_since()
+      * @param ctx Client context (passed to the callback)
+      * @return COUCHSTORE_SUCCESS on success
+      */
+     LIBCOUCHSTORE_API
+     couchstore_error_t couchstore_sample_docinfos(Db *db,
+                                                   uint64_t n,
+                                                   uint64_t seed,
+                                                   couchstore_docinfos_options options,
+                                                   couchstore_changes_callback_fn callback,
+                                                   void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
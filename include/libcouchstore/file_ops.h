@@ -32,7 +32,9 @@ extern "C" {
     typedef struct {
         /**
          * Version number that describes the layout of the
-         * structure. Should be set to 5
+         * structure. Should be set to 5, 6 if the structure includes
+         * the pwritev member, or 7 if it also includes allocate and
+         * truncate
          */
         uint64_t version;
 
@@ -149,6 +151,54 @@ extern "C" {
          * global state across all handles.
          */
         void *cookie;
+
+        /**
+         * Write several chunks of data to consecutive locations in the
+         * file, starting at a given offset. Present in version 6 and later;
+         * may be NULL, in which case the chunks are written one at a time
+         * with pwrite.
+         *
+         * @param handle file handle to write to
+         * @param iov the chunks to write, in file order
+         * @param iovcnt number of chunks
+         * @param offset where to write the first chunk
+         * @return number of bytes written (which may be less than the
+         *         total of the chunks), or a value <= 0 if an error occurred
+         */
+        ssize_t (*pwritev)(couchstore_error_info_t *errinfo,
+                           couch_file_handle handle,
+                           const sized_buf *iov,
+                           int iovcnt,
+                           cs_off_t offset);
+
+        /**
+         * Reserve disk space for a range of the file without changing its
+         * size, so that later writes there don't have to allocate it. Only
+         * present in version 7; may be NULL if the platform can't do that,
+         * in which case files aren't preallocated.
+         *
+         * @param handle file handle to allocate space for
+         * @param offset where the range starts
+         * @param len length of the range
+         * @return COUCHSTORE_SUCCESS upon success
+         */
+        couchstore_error_t (*allocate)(couchstore_error_info_t *errinfo,
+                                       couch_file_handle handle,
+                                       cs_off_t offset,
+                                       cs_off_t len);
+
+        /**
+         * Set the size of the file, releasing any space reserved past it
+         * with allocate. Only present in version 7; may be NULL only if
+         * allocate is.
+         *
+         * @param handle file handle to truncate
+         * @param size the new size of the file
+         * @return COUCHSTORE_SUCCESS upon success
+         */
+        couchstore_error_t (*truncate)(couchstore_error_info_t *errinfo,
+                                       couch_file_handle handle,
+                                       cs_off_t size);
     } couch_file_ops;
 
 #ifdef __cplusplus
@@ -65,6 +65,19 @@ def _toString (key):
     return str(key)
 
 
+def _joinBuffers (pieces):
+    # Copies strings or buffers (None for empty) into one ctypes buffer, returning it
+    # and the offset of each piece, plus the end
+    offsets = [0]
+    for piece in pieces:
+        offsets.append(offsets[-1] + (len(piece) if piece else 0))
+    joined = bytearray(max(offsets[-1], 1))
+    for i in xrange(len(pieces)):
+        if pieces[i]:
+            joined[offsets[i]:offsets[i + 1]] = pieces[i]
+    return (c_char * len(joined)).from_buffer(joined), offsets
+
+
 ### INTERNAL STRUCTS:
 
 class SizedBuf (Structure):
@@ -283,28 +296,37 @@ class CouchStore (object):
 
     def saveMultiple(self, ids, datas, options =0):
         """Saves multiple documents. 'ids' is an array of either strings or DocumentInfo objects.
-           'datas' is a parallel array of value strings (or None, in which case the documents
-           will be deleted.) Returns an array of new sequence numbers."""
+           'datas' is a parallel array of values (or None, in which case the documents
+           will be deleted.) Values can be strings or any buffer, such as a bytearray or
+           memoryview; they're copied into one buffer with a single call rather than one
+           at a time. Returns an array of new sequence numbers."""
         n = len(ids)
-        docStructs = (POINTER(DocStruct) * n)()
-        infoStructs = (POINTER(DocInfoStruct) * n)()
-        for i in xrange(0, n):
+        docStructs = (DocStruct * n)()
+        infoStructs = (DocInfoStruct * n)()
+        docPtrs = (POINTER(DocStruct) * n)()
+        infoPtrs = (POINTER(DocInfoStruct) * n)()
+        keep = []
+        values = [(datas[i] if datas else None) for i in xrange(n)]
+        body, offsets = _joinBuffers(values)
+        for i in xrange(n):
             id = ids[i]
             if isinstance(id, DocumentInfo):
                 info = id._asStruct()
             else:
                 info = DocInfoStruct(SizedBuf(id))
-            doc = DocStruct(info.id)
-            if datas and datas[i]:
-                doc.data = SizedBuf(datas[i])
+            keep.append(info)
+            infoStructs[i] = info
+            docStructs[i].id = infoStructs[i].id
+            if values[i]:
+                docStructs[i].data.buf = cast(addressof(body) + offsets[i], POINTER(c_char))
+                docStructs[i].data.size = offsets[i + 1] - offsets[i]
             else:
-                info.deleted = True
-            infoStructs[i] = pointer(info)
-            docStructs[i] = pointer(doc)
-        _check(_lib.couchstore_save_documents(self, byref(docStructs), byref(infoStructs), c_uint(n), \
+                infoStructs[i].deleted = True
+            infoPtrs[i] = pointer(infoStructs[i])
+            docPtrs[i] = pointer(docStructs[i])
+        _check(_lib.couchstore_save_documents(self, docPtrs, infoPtrs, c_uint(n), \
                                               c_uint64(options)))
-        return [info.contents.db_seq for info in infoStructs]
-    pass
+        return [info.db_seq for info in infoStructs]
 
     def commit (self):
         """Ensures all saved data is flushed to disk."""
@@ -324,6 +346,66 @@ class CouchStore (object):
         _lib.couchstore_free_document(docptr)
         return data
 
+    def getMultiple(self, ids, options =0):
+        """Returns the contents of several documents given their IDs, as a parallel array
+           of memoryviews (None for missing or deleted documents.) The bodies are read in
+           file order and share one bytearray; call tobytes() on a memoryview for a
+           string."""
+        byId = {}
+        for id in ids:
+            byId[_toString(id)] = None
+        keys = byId.keys()
+        idBufs = (SizedBuf * len(keys))()
+        for i in xrange(len(keys)):
+            idBufs[i] = SizedBuf(keys[i])
+        addrs = []
+        def callback (dbPtr, docInfoPtr, context):
+            addrs.append(addressof(docInfoPtr.contents))
+            return 1
+        err = _lib.couchstore_docinfos_by_id(self, idBufs, c_uint(len(keys)), c_uint64(0), \
+                                             CouchStore.ITERATORFUNC(callback), c_void_p(0))
+        try:
+            _check(err)
+            bodies = self._readBodies(addrs, options)
+            for i in xrange(len(addrs)):
+                info = cast(c_void_p(addrs[i]), POINTER(DocInfoStruct)).contents
+                byId[str(info.id)] = bodies[i]
+        finally:
+            for addr in addrs:
+                _lib.couchstore_free_docinfo(c_void_p(addr))
+        return [byId[_toString(id)] for id in ids]
+
+    def _readBodies(self, infoAddrs, options):
+        # Reads the docs of the given DocInfo addresses with one batched call, and
+        # copies their bodies into one bytearray
+        n = len(infoAddrs)
+        if n == 0:
+            return []
+        infoPtrs = (c_void_p * n)(*infoAddrs)
+        docPtrs = (POINTER(DocStruct) * n)()
+        _check(_lib.couchstore_open_docs_with_docinfos(self, infoPtrs, c_uint(n), docPtrs, \
+                                                       c_uint64(options)))
+        try:
+            total = sum(docPtrs[i].contents.data.size for i in xrange(n) if docPtrs[i])
+            buf = bytearray(total)
+            view = memoryview(buf)
+            base = addressof((c_char * total).from_buffer(buf)) if total > 0 else 0
+            bodies = []
+            offset = 0
+            for i in xrange(n):
+                if not docPtrs[i]:
+                    bodies.append(None)
+                    continue
+                data = docPtrs[i].contents.data
+                memmove(base + offset, data.buf, data.size)
+                bodies.append(view[offset:offset + data.size])
+                offset += data.size
+            return bodies
+        finally:
+            for i in xrange(n):
+                if docPtrs[i]:
+                    _lib.couchstore_free_document(docPtrs[i])
+
     def __getitem__ (self, key):
         return self.get(key)
 
@@ -380,6 +462,40 @@ class CouchStore (object):
         self.forEachChange(since, lambda docInfo: changes.append(docInfo))
         return changes
 
+    def changesBatches(self, since, batchSize =1000, bodies =False, options =0):
+        """Generates the changes since the sequence number "since" as arrays of up to
+           batchSize DocumentInfo objects. With bodies set, the arrays are of
+           (DocumentInfo, memoryview) pairs, the bodies of each batch being read with one
+           batched call as getMultiple does; deleted documents have None for a body."""
+        while True:
+            batch = []
+            addrs = []
+            def callback (dbPtr, docInfoPtr, context):
+                if len(batch) == batchSize:
+                    return -12 # CANCEL: carry on in the next batch
+                batch.append(DocumentInfo._fromStruct(docInfoPtr.contents, self))
+                if bodies:
+                    addrs.append(addressof(docInfoPtr.contents))
+                    return 1
+                return 0
+            err = _lib.couchstore_changes_since(self, c_uint64(since), c_uint64(0), \
+                                                CouchStore.ITERATORFUNC(callback), c_void_p(0))
+            try:
+                if err != -12:
+                    _check(err)
+                if bodies:
+                    batch = zip(batch, self._readBodies(addrs, options))
+            finally:
+                for addr in addrs:
+                    _lib.couchstore_free_docinfo(c_void_p(addr))
+            if not batch:
+                return
+            yield batch
+            if len(batch) < batchSize:
+                return
+            last = batch[-1][0] if bodies else batch[-1]
+            since = last.sequence + 1
+
     def forEachDoc(self, startKey, endKey, fn):
         def callback (dbPtr, docInfoPtr, context):
             fn(DocumentInfo._fromStruct(docInfoPtr.contents, self))
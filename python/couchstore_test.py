@@ -136,6 +136,42 @@ class CouchStoreTest (unittest.TestCase):
         for i in xrange(1000):
             self.assertEqual(self.store[self.expectedKey(i)], self.expectedValue(i))
 
+    def testBulkBuffers(self):
+        ids = [self.expectedKey(i) for i in xrange(3)]
+        datas = [bytearray("bytes"), memoryview("view"), "string"]
+        self.store.saveMultiple(ids, datas)
+        self.assertEqual(self.store[ids[0]], "bytes")
+        self.assertEqual(self.store[ids[1]], "view")
+        self.assertEqual(self.store[ids[2]], "string")
+
+    def testGetMultiple(self):
+        self.addBulkDocs(1000)
+        del self.store[self.expectedKey(10)]
+        ids = [self.expectedKey(i) for i in xrange(999, -1, -3)] + ["missing"]
+        values = self.store.getMultiple(ids)
+        self.assertEqual(len(values), len(ids))
+        for i in xrange(len(ids) - 1):
+            if ids[i] == self.expectedKey(10):
+                self.assertEqual(values[i], None)
+            else:
+                self.assertTrue(isinstance(values[i], memoryview))
+                self.assertEqual(values[i].tobytes(), self.expectedValue(999 - i * 3))
+        self.assertEqual(values[-1], None)
+        self.assertEqual(self.store.getMultiple([]), [])
+
+    def testChangesBatches(self):
+        self.addBulkDocs(250)
+        batches = list(self.store.changesBatches(0, 100))
+        self.assertEqual([len(batch) for batch in batches], [100, 100, 50])
+        changes = [info for batch in batches for info in batch]
+        for i in xrange(250):
+            self.assertEqual(changes[i].id, self.expectedKey(i))
+
+        batches = list(self.store.changesBatches(201, 25, bodies=True))
+        self.assertEqual([len(batch) for batch in batches], [25, 25])
+        for info, body in batches[1]:
+            self.assertEqual(body.tobytes(), self.expectedValue(info.sequence - 1))
+
     def testDelete(self):
         self.store["key"] = "value"
         del self.store["key"]
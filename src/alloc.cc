@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// The allocator hook. The library's own allocations all go through the
+// functions of alloc.h, whose defaults are the C library's.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "alloc.h"
+
+static void *default_malloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *default_calloc(void *ctx, size_t count, size_t size)
+{
+    (void)ctx;
+    return calloc(count, size);
+}
+
+static void *default_realloc(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    return realloc(ptr, size);
+}
+
+static void default_free(void *ctx, void *ptr)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static const couchstore_allocator default_allocator = {
+    default_malloc, default_calloc, default_realloc, default_free, NULL
+};
+
+couchstore_allocator couch_allocator = default_allocator;
+
+char *cs_strdup(const char *str)
+{
+    size_t size = strlen(str) + 1;
+    char *copy = static_cast<char *>(cs_malloc(size));
+    if (copy) {
+        memcpy(copy, str, size);
+    }
+    return copy;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_allocator(const couchstore_allocator *allocator)
+{
+    if (allocator == NULL) {
+        couch_allocator = default_allocator;
+        return COUCHSTORE_SUCCESS;
+    }
+    if (!allocator->malloc_fn || !allocator->calloc_fn ||
+        !allocator->realloc_fn || !allocator->free_fn) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    couch_allocator = *allocator;
+    return COUCHSTORE_SUCCESS;
+}
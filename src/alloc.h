@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_ALLOC_H
+#define LIBCOUCHSTORE_ALLOC_H 1
+
+#include <libcouchstore/couch_db.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* The allocator set by couchstore_set_allocator, which everything the
+       library mallocs goes through, the views and mapreduce included. */
+    extern couchstore_allocator couch_allocator;
+
+    static inline void *cs_malloc(size_t size)
+    {
+        return couch_allocator.malloc_fn(couch_allocator.ctx, size);
+    }
+
+    static inline void *cs_calloc(size_t count, size_t size)
+    {
+        return couch_allocator.calloc_fn(couch_allocator.ctx, count, size);
+    }
+
+    static inline void *cs_realloc(void *ptr, size_t size)
+    {
+        return couch_allocator.realloc_fn(couch_allocator.ctx, ptr, size);
+    }
+
+    static inline void cs_free(void *ptr)
+    {
+        couch_allocator.free_fn(couch_allocator.ctx, ptr);
+    }
+
+    /** strdup, allocating with cs_malloc. */
+    char *cs_strdup(const char *str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,20 +7,29 @@
 //
 #include "config.h"
 #include "arena.h"
+#include "alloc.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <atomic>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 
 #define ALIGNMENT 4                 // Byte alignment of blocks; must be a power of 2
 #define PAGE_SIZE 4096              // Chunk allocation will be rounded to a multiple of this
 #define DEFAULT_CHUNK_SIZE 32768    // Used if 0 is passed to new_arena
 #define LOG_STATS 0                 // Set to 1 to log info about allocations when arenas are freed
+#define POOL_THREAD_CHUNKS 32       // Default-size chunks kept for reuse by each thread
+#define POOL_TOTAL_CHUNKS 1024      // ...and by all threads together
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)    // Chunk size of huge-page arenas
 
 typedef struct arena_chunk {
     struct arena_chunk* prev_chunk; // Link to previous chunk
     size_t size;                    // Size of available bytes after this header
+    size_t mapped;                  // Bytes mapped for the chunk, or 0 if malloced
 } arena_chunk;
 
 
@@ -29,6 +38,10 @@ struct arena {
     char* end;                  // End of the current chunk; can't allocate past here
     arena_chunk* cur_chunk;     // The current chunk
     size_t chunk_size;          // The size of chunks to allocate, as passed to new_arena
+    size_t held;                // Bytes of the chunks attached
+    size_t peak;                // Most bytes ever held
+    size_t limit;               // Most bytes that may be held, or 0
+    int huge_pages;             // Chunks are mapped from huge pages if they can be
 #ifdef DEBUG
     int blocks_allocated;       // Number of blocks allocated
     size_t bytes_allocated;     // Number of bytes allocated
@@ -48,6 +61,126 @@ static inline void* chunk_end(arena_chunk* chunk)
     return (char*)chunk_start(chunk) + chunk->size;
 }
 
+// Chunks of the default size that arenas have freed are kept for the next
+// arena on the same thread, so that the arenas made and deleted by every
+// save, compaction and view update don't each go back to malloc, and don't
+// leave the heap fragmented with chunks of their own. Each thread keeps a
+// few, and all of them together a bounded number, past which chunks are
+// freed as before.
+namespace {
+    std::atomic<size_t> pooled_total(0);
+    std::atomic<size_t> held_total(0);     // by all arenas, for arena_total_held
+
+    struct chunk_pool {
+        arena_chunk* chunks;        // linked through prev_chunk
+        size_t count;
+        chunk_pool() : chunks(NULL), count(0) {}
+        ~chunk_pool() {
+            while (chunks) {
+                arena_chunk* chunk = chunks;
+                chunks = chunk->prev_chunk;
+                cs_free(chunk);
+            }
+            pooled_total -= count;
+        }
+    };
+    thread_local chunk_pool pool;
+}
+
+static arena_chunk* alloc_chunk(size_t chunk_size)
+{
+    if (chunk_size == DEFAULT_CHUNK_SIZE - sizeof(arena_chunk) && pool.chunks) {
+        arena_chunk* chunk = pool.chunks;
+        pool.chunks = chunk->prev_chunk;
+        --pool.count;
+        --pooled_total;
+        return chunk;
+    }
+    arena_chunk* chunk = static_cast<arena_chunk*>(cs_malloc(sizeof(arena_chunk) + chunk_size));
+    if (chunk) {
+        chunk->size = chunk_size;
+        chunk->mapped = 0;
+    }
+    return chunk;
+}
+
+// Maps a chunk of the given size, a multiple of HUGE_PAGE_SIZE, from huge
+// pages: reserved ones if the system has any, else anonymous memory aligned
+// to a huge page and marked for transparent ones. Returns NULL if mapping
+// fails, for the caller to malloc instead.
+static arena_chunk* map_chunk(size_t bytes)
+{
+#ifndef WIN32
+    char* p = (char*)MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = static_cast<char*>(mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+#endif
+    if (p == MAP_FAILED) {
+        // Map a huge page more than needed, and trim it to an aligned range.
+        size_t span = bytes + HUGE_PAGE_SIZE;
+        char* base = static_cast<char*>(mmap(NULL, span, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+        p = (char*)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (p > base) {
+            munmap(base, p - base);
+        }
+        if (base + span > p + bytes) {
+            munmap(p + bytes, base + span - (p + bytes));
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    arena_chunk* chunk = reinterpret_cast<arena_chunk*>(p);
+    chunk->size = bytes - sizeof(arena_chunk);
+    chunk->mapped = bytes;
+    return chunk;
+#else
+    (void)bytes;
+    return NULL;
+#endif
+}
+
+static void free_chunk(arena_chunk* chunk)
+{
+#ifndef WIN32
+    if (chunk->mapped) {
+        munmap(chunk, chunk->mapped);
+        return;
+    }
+#endif
+    if (chunk->size == DEFAULT_CHUNK_SIZE - sizeof(arena_chunk) &&
+        pool.count < POOL_THREAD_CHUNKS) {
+        if (pooled_total.fetch_add(1) < POOL_TOTAL_CHUNKS) {
+            chunk->prev_chunk = pool.chunks;
+            pool.chunks = chunk;
+            ++pool.count;
+            return;
+        }
+        --pooled_total;
+    }
+    cs_free(chunk);
+}
+
+size_t arena_pooled_chunks(void)
+{
+    return pool.count;
+}
+
+size_t arena_total_held(void)
+{
+    return held_total;
+}
+
+size_t arena_total_pooled(void)
+{
+    return pooled_total * DEFAULT_CHUNK_SIZE;
+}
+
 // Allocates a new chunk, attaches it to the arena, and allocates 'size' bytes from it.
 static void* add_chunk(arena* a, size_t size)
 {
@@ -55,13 +188,35 @@ static void* add_chunk(arena* a, size_t size)
     if (size > chunk_size) {
         chunk_size = size;  // make sure the new chunk is big enough to fit 'size' bytes
     }
-    arena_chunk* chunk;
-    chunk = static_cast<arena_chunk*>(malloc(sizeof(arena_chunk) + chunk_size));
+    arena_chunk* chunk = NULL;
+    if (a->huge_pages) {
+        size_t bytes = sizeof(arena_chunk) + chunk_size;
+        bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+        if (!a->limit || a->held + bytes - sizeof(arena_chunk) <= a->limit) {
+            chunk = map_chunk(bytes);
+        }
+        if (!chunk) {
+            // Fall back on a chunk of the default size, or what's asked for.
+            chunk_size = size > DEFAULT_CHUNK_SIZE - sizeof(arena_chunk)
+                ? size : DEFAULT_CHUNK_SIZE - sizeof(arena_chunk);
+        }
+    }
     if (!chunk) {
-        return NULL;
+        if (a->limit && a->held + chunk_size > a->limit) {
+            return NULL;
+        }
+        chunk = alloc_chunk(chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+    }
+    chunk_size = chunk->size;
+    a->held += chunk_size;
+    held_total += chunk_size;
+    if (a->held > a->peak) {
+        a->peak = a->held;
     }
     chunk->prev_chunk = a->cur_chunk;
-    chunk->size = chunk_size;
 
     void* result = chunk_start(chunk);
     a->next_block = (char*)result + size;
@@ -73,7 +228,7 @@ static void* add_chunk(arena* a, size_t size)
 
 arena* new_arena(size_t chunk_size)
 {
-    arena* a = static_cast<arena*>(calloc(1, sizeof(arena)));
+    arena* a = static_cast<arena*>(cs_calloc(1, sizeof(arena)));
     if (a) {
         if (chunk_size == 0) {
             chunk_size = DEFAULT_CHUNK_SIZE;
@@ -86,6 +241,16 @@ arena* new_arena(size_t chunk_size)
     return a;
 }
 
+arena* new_huge_page_arena(void)
+{
+    arena* a = new_arena(0);
+    if (a) {
+        a->chunk_size = HUGE_PAGE_SIZE - sizeof(arena_chunk);
+        a->huge_pages = 1;
+    }
+    return a;
+}
+
 void delete_arena(arena* a)
 {
 #ifdef DEBUG
@@ -97,16 +262,17 @@ void delete_arena(arena* a)
 #ifdef DEBUG
         total_allocated += chunk->size;
 #endif
-        void* to_free = chunk;
+        arena_chunk* to_free = chunk;
         chunk = chunk->prev_chunk;
-        free(to_free);
+        free_chunk(to_free);
     }
+    held_total -= a->held;
 #if LOG_STATS
     fprintf(stderr, "delete_arena: %zd bytes malloced for %zd bytes of data in %d blocks (%.0f%%)\n",
             total_allocated, a->bytes_allocated, a->blocks_allocated,
             a->bytes_allocated*100.0/total_allocated);
 #endif
-    free(a);
+    cs_free(a);
 }
 
 void* arena_alloc_unaligned(arena* a, size_t size)
@@ -132,7 +298,8 @@ void* arena_alloc(arena* a, size_t size)
         return arena_alloc_unaligned(a, size);
     }
     padding = ALIGNMENT - padding;
-    return (char*)arena_alloc_unaligned(a, size + padding) + padding;
+    char* result = static_cast<char*>(arena_alloc_unaligned(a, size + padding));
+    return result ? result + padding : NULL;
 }
 
 void arena_free(arena* a, void* block)
@@ -155,6 +322,23 @@ void arena_free(arena* a, void* block)
 #endif
 }
 
+void* arena_realloc_last(arena* a, void* block, size_t old_size, size_t new_size)
+{
+    char* b = static_cast<char*>(block);
+    if (b + old_size == a->next_block && b + new_size <= a->end) {
+        a->next_block = b + new_size;
+#ifdef DEBUG
+        a->bytes_allocated += new_size - old_size;
+#endif
+        return block;
+    }
+    void* result = arena_alloc(a, new_size);
+    if (result) {
+        memcpy(result, block, old_size < new_size ? old_size : new_size);
+    }
+    return result;
+}
+
 const arena_position* arena_mark(arena *a)
 {
     return (const arena_position*) a->next_block;
@@ -165,7 +349,9 @@ void arena_free_from_mark(arena *a, const arena_position *mark)
     arena_chunk* chunk = a->cur_chunk;
     while (chunk && ((void*)mark < chunk_start(chunk) || (void*)mark > chunk_end(chunk))) {
         a->cur_chunk = chunk->prev_chunk;
-        free(chunk);
+        a->held -= chunk->size;
+        held_total -= chunk->size;
+        free_chunk(chunk);
         chunk = a->cur_chunk;
     }
     assert(chunk != NULL || mark == NULL);   // If this fails, mark was bogus
@@ -180,5 +366,37 @@ void arena_free_from_mark(arena *a, const arena_position *mark)
 
 void arena_free_all(arena *a)
 {
+    if (a->huge_pages) {
+        // Mapping is too costly to give up the chunk each time.
+        arena_reset(a);
+        return;
+    }
     arena_free_from_mark(a, NULL);
 }
+
+void arena_reset(arena *a)
+{
+    arena_chunk* chunk = a->cur_chunk;
+    if (!chunk) {
+        return;
+    }
+    while (chunk->prev_chunk) {
+        a->cur_chunk = chunk->prev_chunk;
+        a->held -= chunk->size;
+        held_total -= chunk->size;
+        free_chunk(chunk);
+        chunk = a->cur_chunk;
+    }
+    arena_free_from_mark(a, (const arena_position*)chunk_start(chunk));
+}
+
+void arena_set_limit(arena *a, size_t max_bytes)
+{
+    a->limit = max_bytes;
+}
+
+void arena_get_stats(const arena *a, arena_stats *stats)
+{
+    stats->held = a->held;
+    stats->peak = a->peak;
+}
@@ -28,6 +28,17 @@ typedef struct arena_position arena_position;
  */
 arena* new_arena(size_t chunk_size);
 
+/**
+ * Creates an arena allocating from chunks of huge pages (2 MB): explicit
+ * ones if the system has any to spare, else transparent ones, asked for
+ * with madvise. Chunks that can't be mapped are malloced as in new_arena.
+ * It saves TLB misses when building large trees, at the cost of holding a
+ * chunk of 2 MB, which arena_free_all keeps (as arena_reset does) rather
+ * than mapping it again each time.
+ * @return The new arena object.
+ */
+arena* new_huge_page_arena(void);
+
 /**
  * Deletes an arena and all of its memory allocations.
  */
@@ -54,6 +65,14 @@ void* arena_alloc_unaligned(arena* a, size_t size);
  */
 void arena_free(arena*, void*);
 
+/**
+ * Resizes a block allocated from an arena. The last block allocated grows
+ * or shrinks in place if its chunk has room; any other is copied to a new
+ * block, the old one staying allocated until the arena is freed.
+ * @return The block, or its copy; NULL on failure, the block being left as it was.
+ */
+void* arena_realloc_last(arena* a, void* block, size_t old_size, size_t new_size);
+
 /**
  * Captures the current state of an arena, i.e. which blocks have been allocated.
  * Save the return value and pass it to arena_free_from_mark later to free all blocks allocated
@@ -72,6 +91,45 @@ void arena_free_from_mark(arena *a, const arena_position *mark);
  */
 void arena_free_all(arena *a);
 
+/**
+ * Frees all blocks from the arena, like arena_free_all, but keeps its first
+ * chunk to allocate from again, so that an arena used over and over for
+ * about the same amount goes back to malloc only when it needs more.
+ */
+void arena_reset(arena *a);
+
+/** Memory held by an arena, in bytes of chunks. */
+typedef struct arena_stats {
+    size_t held;                /**< Attached to the arena now */
+    size_t peak;                /**< Most ever attached at once */
+} arena_stats;
+
+/**
+ * Caps the memory an arena may hold. Allocations that would need a chunk
+ * past it fail, returning NULL as if malloc had. Pass 0 to lift the cap.
+ */
+void arena_set_limit(arena *a, size_t max_bytes);
+
+/**
+ * Gets the memory an arena holds, and has held at most.
+ */
+void arena_get_stats(const arena *a, arena_stats *stats);
+
+/**
+ * The number of freed chunks the calling thread keeps for its next arenas.
+ * Arenas with the default chunk size take their chunks from these before
+ * going to malloc, and give them back when freed, up to a limit per thread
+ * and over all threads.
+ */
+size_t arena_pooled_chunks(void);
+
+/**
+ * The bytes of chunks attached to all the arenas of the process, and kept
+ * for reuse by all of its threads.
+ */
+size_t arena_total_held(void);
+size_t arena_total_pooled(void);
+
 #ifdef __cplusplus
 }
 #endif
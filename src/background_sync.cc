@@ -0,0 +1,168 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Background syncs of a Db in relaxed durability mode; see
+// couchstore_set_relaxed_durability().
+
+#include "config.h"
+#include <stdlib.h>
+
+#include "internal.h"
+#include "background_sync.h"
+#include "util.h"
+
+struct background_sync {
+    tree_file file;             // reads nothing; syncs the Db's descriptor
+    Db *db;                     // whose header hints the thread keeps
+    cb_mutex_t mutex;
+    cb_cond_t work_cond;        // the thread waits here for headers
+    cb_cond_t durable_cond;     // background_sync_wait waits here for syncs
+    cb_thread_t thread;
+    unsigned interval_ms;
+    uint64_t max_bytes;
+    uint64_t written_pos;       // of the last header written
+    uint64_t written_seq;
+    uint64_t durable_pos;       // of the last header synced
+    uint64_t durable_seq;
+    couchstore_error_t error;   // of the first failed sync
+    int shutdown;
+};
+
+// Whether enough has been written since the last sync to sync now.
+static int sync_due(const background_sync *sync)
+{
+    return sync->max_bytes > 0 && sync->written_pos - sync->durable_pos >= sync->max_bytes;
+}
+
+static void sync_loop(void *arg)
+{
+    background_sync *sync = static_cast<background_sync *>(arg);
+
+    cb_mutex_enter(&sync->mutex);
+    for (;;) {
+        if (sync->written_pos == sync->durable_pos || sync->error != COUCHSTORE_SUCCESS) {
+            if (sync->shutdown) {
+                break;
+            }
+            cb_cond_wait(&sync->work_cond, &sync->mutex);
+            continue;
+        }
+        if (!sync->shutdown && !sync_due(sync) && sync->interval_ms > 0) {
+            // Let more commits in before syncing them all at once.
+            cb_cond_timedwait(&sync->work_cond, &sync->mutex, sync->interval_ms);
+        }
+        uint64_t pos = sync->written_pos, seq = sync->written_seq;
+        cb_mutex_exit(&sync->mutex);
+
+        // The data first, then the header hints listing the header, so
+        // that a crash leaves the newest header listed with its trees.
+        couchstore_error_t errcode = sync->file.ops->sync(&sync->file.lastError,
+                                                          sync->file.handle);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = db_add_header_hint(sync->db, &sync->file, pos);
+        }
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = sync->file.ops->sync(&sync->file.lastError, sync->file.handle);
+        }
+
+        cb_mutex_enter(&sync->mutex);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            sync->durable_pos = pos;
+            sync->durable_seq = seq;
+        } else {
+            sync->error = errcode;
+        }
+        cb_cond_broadcast(&sync->durable_cond);
+    }
+    cb_mutex_exit(&sync->mutex);
+}
+
+couchstore_error_t background_sync_start(Db *db,
+                                         const couchstore_relaxed_durability *options,
+                                         background_sync **pSync)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    background_sync *sync = static_cast<background_sync *>(cs_calloc(1, sizeof(*sync)));
+    if (sync == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    error_pass(tree_file_open_shared(&sync->file, &db->file));
+    cb_mutex_initialize(&sync->mutex);
+    cb_cond_initialize(&sync->work_cond);
+    cb_cond_initialize(&sync->durable_cond);
+    sync->db = db;
+    sync->interval_ms = options->interval_ms;
+    sync->max_bytes = options->max_bytes;
+    sync->written_pos = sync->durable_pos = db->header.position;
+    sync->written_seq = sync->durable_seq = db->header.update_seq;
+    if (cb_create_thread(&sync->thread, sync_loop, sync, 0) != 0) {
+        cb_cond_destroy(&sync->durable_cond);
+        cb_cond_destroy(&sync->work_cond);
+        cb_mutex_destroy(&sync->mutex);
+        tree_file_close(&sync->file);
+        error_pass(COUCHSTORE_ERROR_ALLOC_FAIL);
+    }
+    *pSync = sync;
+    sync = NULL;
+cleanup:
+    cs_free(sync);
+    return errcode;
+}
+
+couchstore_error_t background_sync_stop(background_sync *sync)
+{
+    cb_mutex_enter(&sync->mutex);
+    sync->shutdown = 1;
+    cb_cond_signal(&sync->work_cond);
+    cb_mutex_exit(&sync->mutex);
+    cb_join_thread(sync->thread);
+
+    couchstore_error_t errcode = sync->error;
+    cb_cond_destroy(&sync->durable_cond);
+    cb_cond_destroy(&sync->work_cond);
+    cb_mutex_destroy(&sync->mutex);
+    tree_file_close(&sync->file);
+    cs_free(sync);
+    return errcode;
+}
+
+couchstore_error_t background_sync_committed(background_sync *sync,
+                                             uint64_t pos, uint64_t seq)
+{
+    cb_mutex_enter(&sync->mutex);
+    int idle = sync->written_pos == sync->durable_pos;
+    sync->written_pos = pos;
+    sync->written_seq = seq;
+    if (idle || sync_due(sync)) {
+        cb_cond_signal(&sync->work_cond);
+    }
+    couchstore_error_t errcode = sync->error;
+    cb_mutex_exit(&sync->mutex);
+    return errcode;
+}
+
+void background_sync_durable(background_sync *sync, uint64_t *pos, uint64_t *seq)
+{
+    cb_mutex_enter(&sync->mutex);
+    *pos = sync->durable_pos;
+    *seq = sync->durable_seq;
+    cb_mutex_exit(&sync->mutex);
+}
+
+couchstore_error_t background_sync_wait(background_sync *sync, uint64_t pos)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    cb_mutex_enter(&sync->mutex);
+    if (pos > sync->written_pos) {
+        // No such header has been written, so it would never be synced.
+        errcode = COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    while (errcode == COUCHSTORE_SUCCESS && sync->durable_pos < pos &&
+           sync->error == COUCHSTORE_SUCCESS) {
+        cb_cond_wait(&sync->durable_cond, &sync->mutex);
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = sync->error;
+    }
+    cb_mutex_exit(&sync->mutex);
+    return errcode;
+}
@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_BACKGROUND_SYNC_H
+#define LIBCOUCHSTORE_BACKGROUND_SYNC_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* The thread syncing a Db whose commits don't, set up by
+       couchstore_set_relaxed_durability(). It syncs through a handle of
+       its own on the Db's file descriptor, every so often while there are
+       headers it hasn't synced, or sooner once enough has been written
+       past the last one it did, and keeps the position and sequence of
+       that one for any thread to read or wait on. Headers are listed in
+       the Db's header hints once synced, and only by the thread, so that
+       opening the file after a crash finds one whose data is on disk. */
+    typedef struct background_sync background_sync;
+
+    /** Starts the thread, on the thread writing the Db, with everything
+        up to its current header already synced. */
+    couchstore_error_t background_sync_start(Db *db,
+                                             const couchstore_relaxed_durability *options,
+                                             background_sync **pSync);
+
+    /** Syncs what's left to sync, stops the thread and frees it; returns
+        the first error any of its syncs had. */
+    couchstore_error_t background_sync_stop(background_sync *sync);
+
+    /** Tells the thread of a header written and flushed, on the thread
+        writing the Db; returns the error of a failed sync, if any. */
+    couchstore_error_t background_sync_committed(background_sync *sync,
+                                                 uint64_t pos, uint64_t seq);
+
+    /** The header most recently known to be synced. */
+    void background_sync_durable(background_sync *sync, uint64_t *pos, uint64_t *seq);
+
+    /** Waits until the header at pos, or a later one, has been synced, or
+        a sync has failed. */
+    couchstore_error_t background_sync_wait(background_sync *sync, uint64_t pos);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,349 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Incremental backup and restore of a database file; see
+// couchstore_backup_since().
+//
+// Everything a commit adds is appended after the header before it, so the
+// bytes between two headers are all a copy made at the first needs to be
+// brought up to the second: bodies and nodes go as they are, CRCs and
+// all, and land at the same positions. Block 0 of a file with header
+// hints is the one part written in place; it's sent last. A preamble
+// giving the file's block size is only ever written with the first header.
+//
+// A restore checks what it's given before it's kept: the header it starts
+// from has to be the copy's own, every chunk after has to check out by
+// its CRC, every header has to be valid and no older than the one before,
+// and the last thing written has to be a header.
+
+#include "config.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "iobuffer.h"
+#include "node_types.h"
+#include "util.h"
+
+// How much of the file is read, and handed on, at a time
+#define BACKUP_READ_SIZE (1024 * 1024)
+
+struct _couchstore_restore {
+    tree_file file;
+    char *filename;
+    uint64_t since;
+    uint64_t since_seq;
+    char *since_header;         // as the copy has it, marker and all
+    size_t since_header_size;
+    uint64_t end;               // of what's been written
+};
+
+// Whether there's a header at pos, by its marker.
+static couchstore_error_t check_header_marker(tree_file *file, uint64_t pos)
+{
+    uint8_t marker;
+    ssize_t got = file->ops->pread(&file->lastError, file->handle, &marker, 1, pos);
+    if (got != 1) {
+        return got < 0 ? (couchstore_error_t)got : COUCHSTORE_ERROR_READ;
+    }
+    if (marker != 1 && marker != BLOCK_HEADER_CRC32C) {
+        return COUCHSTORE_ERROR_NO_HEADER;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Reads a range of the file and hands it to the callback in pieces.
+static couchstore_error_t send_range(tree_file *file, uint64_t pos, uint64_t end,
+                                     char *buf, couchstore_backup_fn callback,
+                                     void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    while (pos < end) {
+        size_t size = end - pos < BACKUP_READ_SIZE ? (size_t)(end - pos)
+                                                   : BACKUP_READ_SIZE;
+        ssize_t got = file->ops->pread(&file->lastError, file->handle, buf, size, pos);
+        error_unless(got >= 0, static_cast<couchstore_error_t>(got));
+        error_unless(got > 0, COUCHSTORE_ERROR_READ);
+        error_pass(callback(pos, buf, got, ctx));
+        pos += got;
+    }
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_backup_since(Db *db,
+                                           uint64_t since,
+                                           couchstore_backup_fn callback,
+                                           void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *buf = NULL;
+    cs_off_t end;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(since <= db->header.position && since % db->file.block_size == 0,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    if (since > 0) {
+        error_pass(check_header_marker(&db->file, since));
+    }
+    end = pread_header_end(&db->file, db->header.position);
+    error_unless(end >= 0, static_cast<couchstore_error_t>(end));
+    buf = static_cast<char *>(cs_malloc(BACKUP_READ_SIZE));
+    error_unless(buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    error_pass(send_range(&db->file, since, end, buf, callback, ctx));
+    if (since > 0 && db->header_hints) {
+        // A read buffer may still hold the list as it was before the
+        // commits since it was last read.
+        uint64_t hints_pos = file_preamble_size(&db->file);
+        ssize_t got = couch_pread_unbuffered(&db->file.lastError, db->file.ops,
+                                             db->file.handle, buf,
+                                             1 + sizeof(raw_header_hints), hints_pos);
+        error_unless(got >= 0, static_cast<couchstore_error_t>(got));
+        error_unless(got == (ssize_t)(1 + sizeof(raw_header_hints)),
+                     COUCHSTORE_ERROR_READ);
+        error_pass(callback(hints_pos, buf, got, ctx));
+    }
+cleanup:
+    cs_free(buf);
+    return errcode;
+}
+
+// Checks the header at pos, which must be no older than the last one
+// seen, and takes the file's settings from it as find_header_at_pos does.
+static couchstore_error_t check_header(tree_file *file, uint64_t pos, uint8_t marker,
+                                       uint64_t *seq, uint64_t *end)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *buf = NULL;
+    const raw_file_header *raw;
+    uint64_t version, update_seq;
+    cs_off_t header_end;
+
+    file->crc32c = marker == BLOCK_HEADER_CRC32C;
+    int len = pread_header(file, pos, &buf, MAX_DB_HEADER_SIZE);
+    error_unless(len >= 0, static_cast<couchstore_error_t>(len));
+    error_unless(len >= (int)sizeof(raw_file_header), COUCHSTORE_ERROR_CORRUPT);
+    raw = (const raw_file_header*)buf;
+    version = decode_raw08(raw->version);
+    error_unless(version >= COUCH_MIN_DISK_VERSION && version <= COUCH_DISK_VERSION,
+                 COUCHSTORE_ERROR_HEADER_VERSION);
+    update_seq = decode_raw48(raw->update_seq);
+    error_unless(update_seq >= *seq, COUCHSTORE_ERROR_CORRUPT);
+    file->chunk_codecs = version >= COUCH_DISK_VERSION_CODECS;
+    header_end = pread_header_end(file, pos);
+    error_unless(header_end >= 0, static_cast<couchstore_error_t>(header_end));
+    *seq = update_seq;
+    *end = header_end;
+cleanup:
+    cs_free(buf);
+    return errcode;
+}
+
+static couchstore_error_t read_byte(tree_file *file, uint64_t pos, uint8_t *byte)
+{
+    ssize_t got = file->ops->pread(&file->lastError, file->handle, byte, 1, pos);
+    if (got != 1) {
+        return got < 0 ? (couchstore_error_t)got : COUCHSTORE_ERROR_READ;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Walks what the restore wrote after its first header, checking each
+// chunk and header in turn.
+static couchstore_error_t check_appended(couchstore_restore *restore)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    tree_file *file = &restore->file;
+    uint64_t pos = restore->since + restore->since_header_size;
+    uint64_t seq = restore->since_seq;
+    int at_header = restore->since_header != NULL;
+    int padding = 0;
+    uint8_t byte;
+
+    while (pos < restore->end) {
+        error_pass(read_byte(file, pos, &byte));
+        if (pos == 0 && byte == BLOCK_PREAMBLE) {
+            // The block size everything after is laid out in
+            error_pass(read_file_preamble(file));
+            pos = file_preamble_size(file);
+            error_unless(pos < restore->end, COUCHSTORE_ERROR_CORRUPT);
+            error_pass(read_byte(file, pos, &byte));
+            if (byte == BLOCK_HEADER_HINTS) {
+                pos += 1 + sizeof(raw_header_hints);
+            }
+            padding = 1;
+            continue;
+        }
+        if (pos % file->block_size == 0) {
+            if (byte == 1 || byte == BLOCK_HEADER_CRC32C) {
+                error_pass(check_header(file, pos, byte, &seq, &pos));
+                at_header = 1;
+                padding = 0;
+                continue;
+            } else if (pos == 0 && byte == BLOCK_HEADER_HINTS) {
+                pos = 1 + sizeof(raw_header_hints);
+                padding = 1;
+                continue;
+            }
+            // Only a header follows the zeroes up to a block.
+            error_unless(byte == 0 && !padding, COUCHSTORE_ERROR_CORRUPT);
+            ++pos;
+            error_pass(read_byte(file, pos, &byte));
+        }
+        at_header = 0;
+        if (byte == 0) {
+            // A chunk's length has its top bit set, so this is the padding
+            // before a header. It isn't all zeroes: the chunk of one byte
+            // db_commit_prepare writes to grow the file may be in it. So
+            // skip to the next block, where there has to be a header.
+            pos += file->block_size - pos % file->block_size;
+            padding = 1;
+            continue;
+        }
+        error_unless((byte & 0x80) && !padding, COUCHSTORE_ERROR_CORRUPT);
+        cs_off_t next = pread_chunk_end(file, pos);
+        error_unless(next >= 0, static_cast<couchstore_error_t>(next));
+        // The CRC doesn't cover the prefixes of the blocks the chunk runs
+        // over, which have to be those of data.
+        for (pos += file->block_size - pos % file->block_size; pos < (uint64_t)next;
+             pos += file->block_size) {
+            error_pass(read_byte(file, pos, &byte));
+            error_unless(byte == 0, COUCHSTORE_ERROR_CORRUPT);
+        }
+        pos = next;
+    }
+    error_unless(at_header && pos == restore->end, COUCHSTORE_ERROR_CORRUPT);
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_restore_open(const char *filename,
+                                           uint64_t since,
+                                           couchstore_restore **pRestore)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_restore *restore = NULL;
+    cs_off_t eof;
+    uint64_t end;
+    uint8_t marker;
+    ssize_t got;
+
+    error_unless(since % COUCH_BLOCK_SIZE == 0, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    restore = static_cast<couchstore_restore *>(cs_calloc(1, sizeof(*restore)));
+    error_unless(restore, COUCHSTORE_ERROR_ALLOC_FAIL);
+    restore->filename = cs_strdup(filename);
+    error_unless(restore->filename, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(tree_file_open(&restore->file, filename, O_RDWR | O_CREAT,
+                              couchstore_get_default_file_ops()));
+    eof = restore->file.ops->goto_eof(&restore->file.lastError, restore->file.handle);
+    error_unless(eof >= 0, COUCHSTORE_ERROR_READ);
+    // The copy must hold the header the stream starts from.
+    error_unless((uint64_t)eof >= since, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    restore->since = since;
+    restore->end = since;
+    if (since > 0) {
+        error_pass(read_file_preamble(&restore->file));
+        error_unless(since % restore->file.block_size == 0,
+                     COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+        error_pass(read_byte(&restore->file, since, &marker));
+        error_unless(marker == 1 || marker == BLOCK_HEADER_CRC32C,
+                     COUCHSTORE_ERROR_NO_HEADER);
+        error_pass(check_header(&restore->file, since, marker, &restore->since_seq, &end));
+        restore->since_header_size = (size_t)(end - since);
+        restore->since_header = static_cast<char *>(cs_malloc(restore->since_header_size));
+        error_unless(restore->since_header, COUCHSTORE_ERROR_ALLOC_FAIL);
+        got = restore->file.ops->pread(&restore->file.lastError, restore->file.handle,
+                                       restore->since_header, restore->since_header_size,
+                                       since);
+        error_unless(got == (ssize_t)restore->since_header_size, COUCHSTORE_ERROR_READ);
+    }
+    *pRestore = restore;
+    restore = NULL;
+cleanup:
+    couchstore_restore_abort(restore);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_restore_write(couchstore_restore *restore,
+                                            uint64_t pos,
+                                            const void *buf,
+                                            size_t size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t header_end = restore->since + restore->since_header_size;
+    ssize_t written;
+
+    // Ranges come in the order they were sent, so never leave a gap.
+    error_unless(pos <= restore->end, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    if (pos < header_end && pos + size > restore->since) {
+        // A stream from another file, or from another copy of this one,
+        // can't be applied.
+        uint64_t from = pos > restore->since ? pos : restore->since;
+        uint64_t to = pos + size < header_end ? pos + size : header_end;
+        error_unless(memcmp((const char *)buf + (from - pos),
+                            restore->since_header + (from - restore->since),
+                            (size_t)(to - from)) == 0,
+                     COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    }
+    written = restore->file.ops->pwrite(&restore->file.lastError, restore->file.handle,
+                                        buf, size, pos);
+    error_unless(written >= 0, static_cast<couchstore_error_t>(written));
+    error_unless((size_t)written == size, COUCHSTORE_ERROR_WRITE);
+    if (pos + size > restore->end) {
+        restore->end = pos + size;
+    }
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_restore_finish(couchstore_restore *restore)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const couch_file_ops *ops = restore->file.ops;
+    Db *db = NULL;
+    uint64_t keep = restore->end;
+
+    errcode = check_appended(restore);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        // Back to what the copy was, less any hints that point past it,
+        // which opening it passes over.
+        keep = restore->since + restore->since_header_size;
+    }
+    // Past the end may be what an earlier restore left, which a scan for
+    // the newest header mustn't find. Files that can't be truncated keep it.
+    couchstore_error_t truncated = ops->truncate(&restore->file.lastError,
+                                                 restore->file.handle, keep);
+    if (truncated != COUCHSTORE_ERROR_INVALID_ARGUMENTS && errcode == COUCHSTORE_SUCCESS) {
+        errcode = truncated;
+    }
+    error_pass(errcode);
+    error_pass(ops->sync(&restore->file.lastError, restore->file.handle));
+    tree_file_close(&restore->file);
+    restore->file.ops = NULL;
+    // The copy is only done if it opens at a header.
+    error_pass(couchstore_open_db(restore->filename, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    couchstore_restore_abort(restore);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_restore_abort(couchstore_restore *restore)
+{
+    if (restore) {
+        if (restore->file.ops) {
+            tree_file_close(&restore->file);
+        }
+        cs_free(restore->since_header);
+        cs_free(restore->filename);
+        cs_free(restore);
+    }
+}
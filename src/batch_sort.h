@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_BATCH_SORT_H
+#define LIBCOUCHSTORE_BATCH_SORT_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "couch_btree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Working memory of the sorts below, kept from one batch to the next. */
+    typedef struct {
+        void *buf;
+        size_t size;
+    } sort_space;
+
+    void sort_space_free(sort_space *space);
+
+    /**
+     * Sorts by-sequence modify actions by sequence, and those on the same
+     * sequence by type, with a radix sort of the 48-bit keys. Actions
+     * already in order, as those of most batches are, are left as they
+     * are after one pass over them.
+     */
+    couchstore_error_t sort_seq_actions(couchfile_modify_action *acts,
+                                        size_t count,
+                                        sort_space *space);
+
+    /**
+     * Sorts pointers to by-ID keys with ebin_cmp. Large arrays are split
+     * into parts sorted on up to the given number of extra threads, and
+     * then merged.
+     */
+    couchstore_error_t sort_id_pointers(const sized_buf **ids,
+                                        size_t count,
+                                        unsigned threads,
+                                        sort_space *space);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
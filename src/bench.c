@@ -0,0 +1,679 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * couchstore_bench: repeatable micro and macro benchmarks of the storage
+ * engine, reported as JSON on stdout. Each benchmark gives its
+ * throughput, its latency percentiles, and for those that write, the bytes
+ * the file grew by against the bytes of documents given to it.
+ *
+ * The documents, their ids and the order they're read in all come from a
+ * seeded generator, so two runs with the same options do the same work.
+ */
+
+#include "config.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libcouchstore/couch_db.h>
+
+#ifdef WIN32
+#define snprintf _snprintf
+#endif
+
+#define ID_FORMAT "doc-%010u"
+#define ID_SIZE 14
+
+/* Most bytes of documents a batch save run writes, so that the big
+   documents don't take all day */
+#define SAVE_BYTES_MAX (256 * 1024 * 1024)
+
+typedef struct {
+    const char *dir;
+    unsigned docs;
+    unsigned doc_size;
+    unsigned gets;
+    unsigned files;
+    uint64_t seed;
+} bench_options;
+
+/* Latencies of the operations of a run, in ns */
+typedef struct {
+    uint64_t *ns;
+    size_t count;
+    size_t capacity;
+    hrtime_t start;
+    hrtime_t total;
+} samples;
+
+static int first_result = 1;
+
+
+static void exit_error(const char *what, couchstore_error_t errcode)
+{
+    fprintf(stderr, "%s: %s\n", what, couchstore_strerror(errcode));
+    exit(1);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--dir <path>] [--docs <n>] [--doc-size <bytes>]"
+            " [--gets <n>] [--files <n>] [--seed <n>]\n", prog);
+    exit(1);
+}
+
+
+static uint64_t next_random(uint64_t *state)
+{
+    /* xorshift64*, so that runs can be repeated */
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * UINT64_C(2685821657736338717);
+}
+
+
+static void samples_init(samples *s, size_t capacity)
+{
+    s->ns = (uint64_t *) malloc(sizeof(uint64_t) * (capacity ? capacity : 1));
+    if (s->ns == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(1);
+    }
+    s->count = 0;
+    s->capacity = capacity;
+    s->total = 0;
+}
+
+static void samples_free(samples *s)
+{
+    free(s->ns);
+}
+
+static void sample_start(samples *s)
+{
+    s->start = gethrtime();
+}
+
+static void sample_end(samples *s)
+{
+    hrtime_t elapsed = gethrtime() - s->start;
+    if (s->count < s->capacity) {
+        s->ns[s->count++] = elapsed;
+    }
+    s->total += elapsed;
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const samples *s, double p)
+{
+    size_t i;
+    if (s->count == 0) {
+        return 0.0;
+    }
+    i = (size_t) (p * (double) (s->count - 1) + 0.5);
+    return s->ns[i] / 1000.0;
+}
+
+
+/* Prints a benchmark's result. items is the number of documents the run
+   went through, which for batched operations is more than the number of
+   samples; bytes_written and bytes_logical are 0 if it doesn't write. */
+static void report(const char *name, unsigned batch, unsigned doc_size,
+                   samples *s, uint64_t items,
+                   uint64_t bytes_written, uint64_t bytes_logical)
+{
+    double seconds = s->total / 1e9;
+
+    qsort(s->ns, s->count, sizeof(uint64_t), cmp_uint64);
+
+    printf("%s    {\"name\": \"%s\", \"batch\": %u, \"doc_size\": %u,"
+           " \"ops\": %" PRIu64 ", \"items\": %" PRIu64 ", \"seconds\": %.6f,"
+           " \"ops_per_sec\": %.1f, \"items_per_sec\": %.1f,"
+           " \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f",
+           first_result ? "" : ",\n", name, batch, doc_size,
+           (uint64_t) s->count, items, seconds,
+           seconds > 0 ? s->count / seconds : 0.0,
+           seconds > 0 ? items / seconds : 0.0,
+           percentile_us(s, 0.5), percentile_us(s, 0.99),
+           percentile_us(s, 0.999));
+    if (bytes_logical > 0) {
+        printf(", \"bytes_written\": %" PRIu64 ", \"bytes_logical\": %" PRIu64
+               ", \"write_amplification\": %.3f",
+               bytes_written, bytes_logical,
+               (double) bytes_written / bytes_logical);
+    }
+    printf("}");
+    fflush(stdout);
+    first_result = 0;
+}
+
+
+static void bench_path(char *buf, size_t size, const bench_options *opts,
+                       const char *name)
+{
+    snprintf(buf, size, "%s/couchstore_bench_%s.couch", opts->dir, name);
+    remove(buf);
+}
+
+static uint64_t file_size(Db *db)
+{
+    DbInfo info;
+    couchstore_error_t errcode = couchstore_db_info(db, &info);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Getting database info", errcode);
+    }
+    return info.file_size;
+}
+
+
+/* A batch of documents with random bodies, numbered by batch_number() */
+typedef struct {
+    Doc *docs;
+    DocInfo *infos;
+    Doc **doc_ptrs;
+    DocInfo **info_ptrs;
+    char *ids;
+    char *bodies;
+    unsigned count;
+} doc_batch;
+
+static void batch_init(doc_batch *b, unsigned count, unsigned doc_size,
+                       uint64_t *rnd)
+{
+    unsigned i, j;
+
+    b->docs = (Doc *) calloc(count, sizeof(Doc));
+    b->infos = (DocInfo *) calloc(count, sizeof(DocInfo));
+    b->doc_ptrs = (Doc **) calloc(count, sizeof(Doc *));
+    b->info_ptrs = (DocInfo **) calloc(count, sizeof(DocInfo *));
+    b->ids = (char *) malloc((size_t) count * (ID_SIZE + 1));
+    b->bodies = (char *) malloc((size_t) count * doc_size + 1);
+    if (b->docs == NULL || b->infos == NULL || b->doc_ptrs == NULL ||
+        b->info_ptrs == NULL || b->ids == NULL || b->bodies == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(1);
+    }
+    b->count = count;
+
+    /* Bodies that compress about as JSON does, with runs of repeats */
+    for (j = 0; j < count * doc_size; j += 8) {
+        uint64_t r = next_random(rnd);
+        unsigned k;
+        for (k = 0; k < 8 && j + k < count * doc_size; ++k) {
+            b->bodies[j + k] = (r & 0x100) ? 'a' + (char) (r % 16) : '"';
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        b->docs[i].id.buf = b->ids + (size_t) i * (ID_SIZE + 1);
+        b->docs[i].id.size = ID_SIZE;
+        b->docs[i].data.buf = b->bodies + (size_t) i * doc_size;
+        b->docs[i].data.size = doc_size;
+        b->infos[i].id = b->docs[i].id;
+        b->doc_ptrs[i] = &b->docs[i];
+        b->info_ptrs[i] = &b->infos[i];
+    }
+}
+
+static void batch_number(doc_batch *b, unsigned first)
+{
+    unsigned i;
+    for (i = 0; i < b->count; ++i) {
+        snprintf(b->docs[i].id.buf, ID_SIZE + 1, ID_FORMAT, first + i);
+        b->infos[i].rev_seq = 1;
+        b->infos[i].db_seq = 0;
+    }
+}
+
+static void batch_free(doc_batch *b)
+{
+    free(b->docs);
+    free(b->infos);
+    free(b->doc_ptrs);
+    free(b->info_ptrs);
+    free(b->ids);
+    free(b->bodies);
+}
+
+
+/* Saves docs documents (up to SAVE_BYTES_MAX of them) in batches of batch,
+   committing once at the end */
+static void bench_save(const bench_options *opts, unsigned batch,
+                       unsigned doc_size)
+{
+    char path[1024], name[64];
+    uint64_t rnd = opts->seed;
+    uint64_t docs = opts->docs;
+    unsigned batches;
+    unsigned i;
+    uint64_t start_size;
+    samples s;
+    doc_batch b;
+    Db *db;
+    couchstore_error_t errcode;
+
+    if (docs * doc_size > SAVE_BYTES_MAX) {
+        docs = SAVE_BYTES_MAX / doc_size;
+    }
+    batches = (unsigned) ((docs + batch - 1) / batch);
+
+    snprintf(name, sizeof(name), "save_%u_%u", batch, doc_size);
+    bench_path(path, sizeof(path), opts, name);
+    errcode = couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_CREATE, &db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Opening database", errcode);
+    }
+    start_size = file_size(db);
+
+    batch_init(&b, batch, doc_size, &rnd);
+    samples_init(&s, batches);
+    for (i = 0; i < batches; ++i) {
+        batch_number(&b, i * batch);
+        sample_start(&s);
+        errcode = couchstore_save_documents(db, b.doc_ptrs, b.info_ptrs,
+                                            batch, 0);
+        sample_end(&s);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Saving documents", errcode);
+        }
+    }
+    errcode = couchstore_commit(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Committing", errcode);
+    }
+
+    report("batch_save", batch, doc_size, &s, (uint64_t) batches * batch,
+           file_size(db) - start_size,
+           (uint64_t) batches * batch * (doc_size + ID_SIZE));
+
+    samples_free(&s);
+    batch_free(&b);
+    couchstore_close_db(db);
+    remove(path);
+}
+
+
+/* Commits after every batch of 100 documents */
+static void bench_commit(const bench_options *opts)
+{
+    char path[1024];
+    uint64_t rnd = opts->seed;
+    unsigned batch = 100;
+    unsigned commits = opts->docs / batch < 1000 ? opts->docs / batch : 1000;
+    unsigned i;
+    uint64_t start_size;
+    samples s;
+    doc_batch b;
+    Db *db;
+    couchstore_error_t errcode;
+
+    if (commits == 0) {
+        commits = 1;
+    }
+    bench_path(path, sizeof(path), opts, "commit");
+    errcode = couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_CREATE, &db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Opening database", errcode);
+    }
+    start_size = file_size(db);
+
+    batch_init(&b, batch, opts->doc_size, &rnd);
+    samples_init(&s, commits);
+    for (i = 0; i < commits; ++i) {
+        batch_number(&b, i * batch);
+        errcode = couchstore_save_documents(db, b.doc_ptrs, b.info_ptrs,
+                                            batch, 0);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Saving documents", errcode);
+        }
+        sample_start(&s);
+        errcode = couchstore_commit(db);
+        sample_end(&s);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Committing", errcode);
+        }
+    }
+
+    report("commit", batch, opts->doc_size, &s, (uint64_t) commits * batch,
+           file_size(db) - start_size,
+           (uint64_t) commits * batch * (opts->doc_size + ID_SIZE));
+
+    samples_free(&s);
+    batch_free(&b);
+    couchstore_close_db(db);
+    remove(path);
+}
+
+
+/* The database the read benchmarks work on: docs documents, saved in
+   batches of 1000 */
+static Db *load_db(const bench_options *opts, const char *path)
+{
+    uint64_t rnd = opts->seed;
+    unsigned batch = opts->docs < 1000 ? opts->docs : 1000;
+    unsigned i;
+    doc_batch b;
+    Db *db;
+    couchstore_error_t errcode;
+
+    errcode = couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_CREATE, &db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Opening database", errcode);
+    }
+    batch_init(&b, batch, opts->doc_size, &rnd);
+    for (i = 0; i < opts->docs; i += batch) {
+        unsigned n = opts->docs - i < batch ? opts->docs - i : batch;
+        batch_number(&b, i);
+        errcode = couchstore_save_documents(db, b.doc_ptrs, b.info_ptrs,
+                                            n, 0);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Saving documents", errcode);
+        }
+    }
+    batch_free(&b);
+    errcode = couchstore_commit(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Committing", errcode);
+    }
+    return db;
+}
+
+
+static void bench_get_by_id(const bench_options *opts, Db *db)
+{
+    uint64_t rnd = opts->seed + 1;
+    char id[ID_SIZE + 1];
+    unsigned i;
+    samples s;
+
+    samples_init(&s, opts->gets);
+    for (i = 0; i < opts->gets; ++i) {
+        Doc *doc;
+        couchstore_error_t errcode;
+
+        snprintf(id, sizeof(id), ID_FORMAT,
+                 (unsigned) (next_random(&rnd) % opts->docs));
+        sample_start(&s);
+        errcode = couchstore_open_document(db, id, ID_SIZE, &doc, 0);
+        sample_end(&s);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Getting document by id", errcode);
+        }
+        couchstore_free_document(doc);
+    }
+    report("get_by_id", 1, opts->doc_size, &s, s.count, 0, 0);
+    samples_free(&s);
+}
+
+
+static void bench_get_by_seq(const bench_options *opts, Db *db)
+{
+    uint64_t rnd = opts->seed + 2;
+    unsigned i;
+    samples s;
+
+    samples_init(&s, opts->gets);
+    for (i = 0; i < opts->gets; ++i) {
+        uint64_t seq = 1 + next_random(&rnd) % opts->docs;
+        DocInfo *info;
+        Doc *doc;
+        couchstore_error_t errcode;
+
+        sample_start(&s);
+        errcode = couchstore_docinfo_by_sequence(db, seq, &info);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = couchstore_open_doc_with_docinfo(db, info, &doc, 0);
+            if (errcode == COUCHSTORE_SUCCESS) {
+                couchstore_free_document(doc);
+            }
+            couchstore_free_docinfo(info);
+        }
+        sample_end(&s);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Getting document by sequence", errcode);
+        }
+    }
+    report("get_by_seq", 1, opts->doc_size, &s, s.count, 0, 0);
+    samples_free(&s);
+}
+
+
+static int count_docinfo(Db *db, DocInfo *info, void *ctx)
+{
+    (void) db;
+    (void) info;
+    ++*(uint64_t *) ctx;
+    return 0;
+}
+
+
+/* Looks up batches of 100 distinct ids, spread over the database */
+static void bench_multi_get(const bench_options *opts, Db *db)
+{
+    uint64_t rnd = opts->seed + 3;
+    unsigned batch = opts->docs < 100 ? opts->docs : 100;
+    unsigned lookups = opts->gets / 100 ? opts->gets / 100 : 1;
+    unsigned stride = opts->docs / batch;
+    char *ids = (char *) malloc((size_t) batch * (ID_SIZE + 1));
+    sized_buf *keys = (sized_buf *) malloc(sizeof(sized_buf) * batch);
+    uint64_t found = 0;
+    unsigned i, j;
+    samples s;
+
+    if (ids == NULL || keys == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(1);
+    }
+    samples_init(&s, lookups);
+    for (i = 0; i < lookups; ++i) {
+        couchstore_error_t errcode;
+
+        /* One id from each stretch of stride, so none repeats */
+        for (j = 0; j < batch; ++j) {
+            keys[j].buf = ids + (size_t) j * (ID_SIZE + 1);
+            keys[j].size = ID_SIZE;
+            snprintf(keys[j].buf, ID_SIZE + 1, ID_FORMAT,
+                     j * stride + (unsigned) (next_random(&rnd) % stride));
+        }
+        sample_start(&s);
+        errcode = couchstore_docinfos_by_id(db, keys, batch, 0,
+                                            count_docinfo, &found);
+        sample_end(&s);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Getting documents by id", errcode);
+        }
+    }
+    report("multi_get", batch, opts->doc_size, &s, found, 0, 0);
+    samples_free(&s);
+    free(keys);
+    free(ids);
+}
+
+
+static void bench_changes_since(const bench_options *opts, Db *db)
+{
+    unsigned i;
+    uint64_t count = 0;
+    samples s;
+
+    samples_init(&s, 5);
+    for (i = 0; i < 5; ++i) {
+        couchstore_error_t errcode;
+
+        sample_start(&s);
+        errcode = couchstore_changes_since(db, 0, 0, count_docinfo, &count);
+        sample_end(&s);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Scanning changes", errcode);
+        }
+    }
+    report("changes_since", opts->docs, opts->doc_size, &s, count, 0, 0);
+    samples_free(&s);
+}
+
+
+static void bench_compact(const bench_options *opts, Db *db)
+{
+    char path[1024];
+    DbInfo info;
+    samples s;
+    Db *target;
+    couchstore_error_t errcode;
+
+    errcode = couchstore_db_info(db, &info);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Getting database info", errcode);
+    }
+    bench_path(path, sizeof(path), opts, "compacted");
+    samples_init(&s, 1);
+    sample_start(&s);
+    errcode = couchstore_compact_db(db, path);
+    sample_end(&s);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Compacting", errcode);
+    }
+
+    errcode = couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_RDONLY, &target);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Opening compacted database", errcode);
+    }
+    report("compact", opts->docs, opts->doc_size, &s, info.doc_count,
+           file_size(target),
+           (uint64_t) opts->docs * (opts->doc_size + ID_SIZE));
+    couchstore_close_db(target);
+    samples_free(&s);
+    remove(path);
+}
+
+
+/* Opens files of 100 documents each, reading one back to warm it up */
+static void bench_open(const bench_options *opts)
+{
+    bench_options small = *opts;
+    char (*paths)[1024];
+    char name[64];
+    unsigned i;
+    samples s;
+
+    paths = malloc(sizeof(*paths) * (opts->files ? opts->files : 1));
+    if (paths == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(1);
+    }
+    small.docs = 100;
+    for (i = 0; i < opts->files; ++i) {
+        snprintf(name, sizeof(name), "open_%u", i);
+        bench_path(paths[i], sizeof(paths[i]), opts, name);
+        couchstore_close_db(load_db(&small, paths[i]));
+    }
+
+    samples_init(&s, opts->files);
+    for (i = 0; i < opts->files; ++i) {
+        Db *db;
+        Doc *doc;
+        char id[ID_SIZE + 1];
+        couchstore_error_t errcode;
+
+        snprintf(id, sizeof(id), ID_FORMAT, i % small.docs);
+        sample_start(&s);
+        errcode = couchstore_open_db(paths[i], COUCHSTORE_OPEN_FLAG_RDONLY,
+                                     &db);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = couchstore_open_document(db, id, ID_SIZE, &doc, 0);
+            if (errcode == COUCHSTORE_SUCCESS) {
+                couchstore_free_document(doc);
+            }
+            couchstore_close_db(db);
+        }
+        sample_end(&s);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Opening and warming up database", errcode);
+        }
+    }
+    report("open_warmup", 1, opts->doc_size, &s, s.count, 0, 0);
+    samples_free(&s);
+
+    for (i = 0; i < opts->files; ++i) {
+        remove(paths[i]);
+    }
+    free(paths);
+}
+
+
+int main(int argc, char **argv)
+{
+    static const unsigned batch_sizes[] = { 1, 10, 100, 1000 };
+    static const unsigned doc_sizes[] = { 64, 1024, 16384 };
+    bench_options opts;
+    char path[1024];
+    unsigned i, j;
+    int argp;
+    Db *db;
+
+    opts.dir = ".";
+    opts.docs = 100000;
+    opts.doc_size = 256;
+    opts.gets = 100000;
+    opts.files = 64;
+    opts.seed = 42;
+
+    for (argp = 1; argp < argc; argp += 2) {
+        const char *arg = argv[argp];
+        if (argp + 1 >= argc) {
+            usage(argv[0]);
+        }
+        if (!strcmp(arg, "--dir")) {
+            opts.dir = argv[argp + 1];
+        } else if (!strcmp(arg, "--docs")) {
+            opts.docs = (unsigned) strtoul(argv[argp + 1], NULL, 10);
+        } else if (!strcmp(arg, "--doc-size")) {
+            opts.doc_size = (unsigned) strtoul(argv[argp + 1], NULL, 10);
+        } else if (!strcmp(arg, "--gets")) {
+            opts.gets = (unsigned) strtoul(argv[argp + 1], NULL, 10);
+        } else if (!strcmp(arg, "--files")) {
+            opts.files = (unsigned) strtoul(argv[argp + 1], NULL, 10);
+        } else if (!strcmp(arg, "--seed")) {
+            opts.seed = strtoull(argv[argp + 1], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (opts.docs == 0 || opts.seed == 0) {
+        usage(argv[0]);
+    }
+
+    printf("{\"options\": {\"docs\": %u, \"doc_size\": %u, \"gets\": %u,"
+           " \"files\": %u, \"seed\": %" PRIu64 "},\n \"results\": [\n",
+           opts.docs, opts.doc_size, opts.gets, opts.files, opts.seed);
+
+    for (i = 0; i < sizeof(batch_sizes) / sizeof(batch_sizes[0]); ++i) {
+        for (j = 0; j < sizeof(doc_sizes) / sizeof(doc_sizes[0]); ++j) {
+            bench_save(&opts, batch_sizes[i], doc_sizes[j]);
+        }
+    }
+    bench_commit(&opts);
+
+    bench_path(path, sizeof(path), &opts, "reads");
+    db = load_db(&opts, path);
+    bench_get_by_id(&opts, db);
+    bench_get_by_seq(&opts, db);
+    bench_multi_get(&opts, db);
+    bench_changes_since(&opts, db);
+    bench_compact(&opts, db);
+    couchstore_close_db(db);
+    remove(path);
+
+    bench_open(&opts);
+
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,357 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Process-wide cache of file blocks, shared by every Db attached to it.
+//
+// Blocks are keyed by (file identity, block number) and spread over
+// independently locked shards. Each shard holds a fixed number of slots and
+// evicts with the CLOCK algorithm: a hit sets the slot's reference bit, and
+// the clock hand clears bits until it finds an unreferenced victim.
+//
+// Since .couch files are append-only, bytes that have been read never change,
+// so no write invalidation is needed. The last block of a file may be cached
+// while still partial; reads past its cached length are treated as misses and
+// the longer block replaces it.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
+
+#include "internal.h"
+#include "block_cache.h"
+#include "util.h"
+
+#define DEFAULT_CACHE_SHARDS 16
+#define REGISTRY_BUCKETS 256
+
+typedef struct cache_slot {
+    uint64_t file_id;               // 0 if the slot is free
+    uint64_t block;
+    struct cache_slot *next;        // hash chain
+    uint32_t length;                // valid bytes in data
+    uint8_t referenced;
+    char *data;
+} cache_slot;
+
+typedef struct {
+    cb_mutex_t mutex;
+    cache_slot *slots;
+    size_t nslots;
+    size_t used;
+    size_t hand;
+    cache_slot **buckets;
+    size_t nbuckets;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} cache_shard;
+
+typedef struct registered_file {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t file_id;
+    unsigned refcount;
+    struct registered_file *next;
+} registered_file;
+
+struct _couchstore_block_cache {
+    cache_shard *shards;
+    unsigned nshards;
+    size_t capacity;
+    cb_mutex_t registry_mutex;
+    registered_file *registry[REGISTRY_BUCKETS];
+    uint64_t next_file_id;
+};
+
+static inline uint64_t hash_key(uint64_t file_id, uint64_t block)
+{
+    uint64_t h = (file_id * 0x9E3779B97F4A7C15ULL) ^ block;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline cache_shard *shard_for(couchstore_block_cache *cache, uint64_t h)
+{
+    return &cache->shards[h % cache->nshards];
+}
+
+static inline cache_slot **bucket_for(cache_shard *shard, uint64_t h)
+{
+    return &shard->buckets[(h >> 16) % shard->nbuckets];
+}
+
+static cache_slot *shard_find(cache_shard *shard, uint64_t h,
+                              uint64_t file_id, uint64_t block)
+{
+    cache_slot *slot = *bucket_for(shard, h);
+    while (slot && (slot->file_id != file_id || slot->block != block)) {
+        slot = slot->next;
+    }
+    return slot;
+}
+
+static void shard_unlink(cache_shard *shard, cache_slot *victim)
+{
+    cache_slot **link = bucket_for(shard, hash_key(victim->file_id, victim->block));
+    while (*link != victim) {
+        link = &(*link)->next;
+    }
+    *link = victim->next;
+    victim->next = NULL;
+    victim->file_id = 0;
+}
+
+// Picks a slot to hold a new block, evicting one if the shard is full.
+static cache_slot *shard_claim_slot(cache_shard *shard)
+{
+    if (shard->used < shard->nslots) {
+        cache_slot *slot = &shard->slots[shard->used];
+        slot->data = static_cast<char *>(cs_malloc(COUCH_BLOCK_SIZE));
+        if (slot->data == NULL) {
+            return NULL;
+        }
+        ++shard->used;
+        return slot;
+    }
+
+    for (;;) {
+        cache_slot *slot = &shard->slots[shard->hand];
+        shard->hand = (shard->hand + 1) % shard->nslots;
+        if (slot->referenced) {
+            slot->referenced = 0;
+            continue;
+        }
+        if (slot->file_id != 0) {
+            shard_unlink(shard, slot);
+            ++shard->evictions;
+        }
+        return slot;
+    }
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_block_cache_create(size_t size,
+                                                 unsigned shards,
+                                                 couchstore_block_cache **pCache)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_block_cache *cache;
+    size_t nblocks = size / COUCH_BLOCK_SIZE;
+    unsigned i;
+
+    if (shards == 0) {
+        shards = DEFAULT_CACHE_SHARDS;
+    }
+    if (nblocks < shards) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    cache = static_cast<couchstore_block_cache *>(cs_calloc(1, sizeof(*cache)));
+    error_unless(cache, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cache->shards = static_cast<cache_shard *>(cs_calloc(shards, sizeof(cache_shard)));
+    error_unless(cache->shards, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cache->nshards = shards;
+    cache->next_file_id = 1;
+    cb_mutex_initialize(&cache->registry_mutex);
+
+    for (i = 0; i < shards; ++i) {
+        cb_mutex_initialize(&cache->shards[i].mutex);
+    }
+    for (i = 0; i < shards; ++i) {
+        cache_shard *shard = &cache->shards[i];
+        shard->nslots = nblocks / shards;
+        shard->nbuckets = shard->nslots;
+        cache->capacity += shard->nslots;
+        shard->slots = static_cast<cache_slot *>(cs_calloc(shard->nslots, sizeof(cache_slot)));
+        shard->buckets = static_cast<cache_slot **>(cs_calloc(shard->nbuckets, sizeof(cache_slot *)));
+        error_unless(shard->slots && shard->buckets, COUCHSTORE_ERROR_ALLOC_FAIL);
+    }
+
+    *pCache = cache;
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS && cache) {
+        couchstore_block_cache_destroy(cache);
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_block_cache_destroy(couchstore_block_cache *cache)
+{
+    unsigned i;
+    size_t j;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->shards) {
+        for (i = 0; i < cache->nshards; ++i) {
+            cache_shard *shard = &cache->shards[i];
+            if (shard->slots) {
+                for (j = 0; j < shard->used; ++j) {
+                    cs_free(shard->slots[j].data);
+                }
+            }
+            cs_free(shard->slots);
+            cs_free(shard->buckets);
+            cb_mutex_destroy(&shard->mutex);
+        }
+        cs_free(cache->shards);
+        cb_mutex_destroy(&cache->registry_mutex);
+    }
+
+    for (i = 0; i < REGISTRY_BUCKETS; ++i) {
+        registered_file *rf = cache->registry[i];
+        while (rf) {
+            registered_file *next = rf->next;
+            cs_free(rf);
+            rf = next;
+        }
+    }
+    cs_free(cache);
+}
+
+LIBCOUCHSTORE_API
+void couchstore_block_cache_get_stats(couchstore_block_cache *cache,
+                                      couchstore_block_cache_stats *stats)
+{
+    unsigned i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = cache->capacity * COUCH_BLOCK_SIZE;
+    for (i = 0; i < cache->nshards; ++i) {
+        cache_shard *shard = &cache->shards[i];
+        cb_mutex_enter(&shard->mutex);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->size += shard->used * COUCH_BLOCK_SIZE;
+        cb_mutex_exit(&shard->mutex);
+    }
+}
+
+uint64_t block_cache_register(couchstore_block_cache *cache, const char *path)
+{
+    uint64_t dev = 0, ino = 0;
+    int shareable = 0;
+    registered_file *rf = NULL;
+    uint64_t file_id = 0;
+
+#ifndef WIN32
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        dev = (uint64_t)st.st_dev;
+        ino = (uint64_t)st.st_ino;
+        shareable = 1;
+    }
+#else
+    (void)path;
+#endif
+
+    unsigned bucket = (unsigned)(hash_key(dev, ino) % REGISTRY_BUCKETS);
+
+    cb_mutex_enter(&cache->registry_mutex);
+    // Files we couldn't stat get an identity of their own:
+    if (shareable) {
+        for (rf = cache->registry[bucket]; rf; rf = rf->next) {
+            if (rf->dev == dev && rf->ino == ino && rf->refcount > 0) {
+                break;
+            }
+        }
+    }
+    if (rf == NULL) {
+        rf = static_cast<registered_file *>(cs_calloc(1, sizeof(*rf)));
+        if (rf) {
+            rf->dev = dev;
+            rf->ino = ino;
+            rf->file_id = cache->next_file_id++;
+            rf->next = cache->registry[bucket];
+            cache->registry[bucket] = rf;
+        }
+    }
+    if (rf) {
+        ++rf->refcount;
+        file_id = rf->file_id;
+    }
+    cb_mutex_exit(&cache->registry_mutex);
+    return file_id;
+}
+
+void block_cache_unregister(couchstore_block_cache *cache, uint64_t file_id)
+{
+    unsigned i;
+
+    cb_mutex_enter(&cache->registry_mutex);
+    for (i = 0; i < REGISTRY_BUCKETS; ++i) {
+        registered_file **link = &cache->registry[i];
+        while (*link && (*link)->file_id != file_id) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            registered_file *rf = *link;
+            if (--rf->refcount == 0) {
+                // The identity is retired; its blocks age out of the cache.
+                *link = rf->next;
+                cs_free(rf);
+            }
+            break;
+        }
+    }
+    cb_mutex_exit(&cache->registry_mutex);
+}
+
+int block_cache_read(couchstore_block_cache *cache, uint64_t file_id,
+                     uint64_t block, size_t offset, void *dst, size_t len)
+{
+    uint64_t h = hash_key(file_id, block);
+    cache_shard *shard = shard_for(cache, h);
+    int hit = 0;
+
+    cb_mutex_enter(&shard->mutex);
+    cache_slot *slot = shard_find(shard, h, file_id, block);
+    if (slot && offset + len <= slot->length) {
+        memcpy(dst, slot->data + offset, len);
+        slot->referenced = 1;
+        ++shard->hits;
+        hit = 1;
+    } else {
+        ++shard->misses;
+    }
+    cb_mutex_exit(&shard->mutex);
+    return hit;
+}
+
+void block_cache_insert(couchstore_block_cache *cache, uint64_t file_id,
+                        uint64_t block, const void *data, size_t length)
+{
+    uint64_t h = hash_key(file_id, block);
+    cache_shard *shard = shard_for(cache, h);
+
+    cb_mutex_enter(&shard->mutex);
+    // Another handle on the same file may have raced us to it, or this is
+    // a longer copy of a partial block:
+    cache_slot *slot = shard_find(shard, h, file_id, block);
+    if (slot == NULL) {
+        slot = shard_claim_slot(shard);
+        if (slot) {
+            slot->file_id = file_id;
+            slot->block = block;
+            slot->length = 0;
+            slot->referenced = 0;
+            cache_slot **bucket = bucket_for(shard, h);
+            slot->next = *bucket;
+            *bucket = slot;
+        }
+    }
+    if (slot && length > slot->length) {
+        memcpy(slot->data, data, length);
+        slot->length = (uint32_t)length;
+    }
+    cb_mutex_exit(&shard->mutex);
+}
@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_BLOCK_CACHE_H
+#define LIBCOUCHSTORE_BLOCK_CACHE_H 1
+
+#include <libcouchstore/couch_db.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * Registers a file with a block cache and returns the identity its
+     * blocks are cached under. Handles that have the same file open at the
+     * same time share an identity; identities are never reused, so blocks
+     * of a file that has since been closed can never be returned for a
+     * different file.
+     * @return the file identity, or 0 if it couldn't be allocated
+     */
+    uint64_t block_cache_register(couchstore_block_cache *cache, const char *path);
+
+    /** Drops a registration made by block_cache_register. */
+    void block_cache_unregister(couchstore_block_cache *cache, uint64_t file_id);
+
+    /**
+     * Copies len bytes starting at offset within a cached block into dst.
+     * @return 1 on a hit, 0 if the block isn't cached
+     */
+    int block_cache_read(couchstore_block_cache *cache, uint64_t file_id,
+                         uint64_t block, size_t offset, void *dst, size_t len);
+
+    /**
+     * Caches the first length bytes of a block of a file. length is less
+     * than COUCH_BLOCK_SIZE only for the block at the end of the file, and
+     * a cached partial block is replaced by a longer one.
+     */
+    void block_cache_insert(couchstore_block_cache *cache, uint64_t file_id,
+                            uint64_t block, const void *data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,369 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Bloom filter of document IDs.
+//
+// Looking up an ID that isn't in the file costs a full walk from the root
+// of the by-ID tree down to a leaf, only to find nothing there. A filter
+// over all the IDs in the file answers most of those misses from memory.
+// IDs are only ever added: deleted documents keep their tombstones in the
+// tree, and IDs dropped by compaction leave behind at worst a false
+// positive until the filter is rebuilt by the next compaction.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "bloom_filter.h"
+#include "couch_btree.h"
+#include "node_types.h"
+#include "reduces.h"
+#include "util.h"
+
+// With 7 hashes and 10 bits per key, a filter holding as many keys as it
+// was sized for has a false positive rate of about 1%.
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+#define BLOOM_MAX_HASHES 32
+
+typedef struct {
+    raw_32 nbits;
+    raw_08 nhashes;
+    raw_48 count;
+    /* nbits / 8 bytes of bits follow */
+} raw_bloom_filter;
+
+static uint64_t hash_key(const sized_buf *key)
+{
+    // FNV-1a, followed by a finalizer that spreads the bits of similar
+    // keys over the whole word.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key->size; ++i) {
+        h ^= (uint8_t)key->buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+bloom_filter *bloom_create(uint64_t capacity)
+{
+    if (capacity < BLOOM_MIN_CAPACITY) {
+        capacity = BLOOM_MIN_CAPACITY;
+    }
+    uint64_t nbits = capacity * BLOOM_BITS_PER_KEY;
+    if (nbits > UINT32_MAX - 7) {
+        nbits = UINT32_MAX - 7;
+    }
+    nbits = (nbits + 7) & ~7ULL;
+
+    bloom_filter *filter = static_cast<bloom_filter*>(cs_calloc(1, sizeof(bloom_filter)));
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->bits = static_cast<uint8_t*>(cs_calloc(1, nbits / 8));
+    if (filter->bits == NULL) {
+        cs_free(filter);
+        return NULL;
+    }
+    filter->nbits = (uint32_t)nbits;
+    filter->nhashes = BLOOM_HASHES;
+    return filter;
+}
+
+void bloom_free(bloom_filter *filter)
+{
+    if (filter) {
+        cs_free(filter->bits);
+        cs_free(filter);
+    }
+}
+
+size_t bloom_memory(const bloom_filter *filter)
+{
+    return filter ? sizeof(bloom_filter) + filter->nbits / 8 : 0;
+}
+
+int bloom_add(bloom_filter *filter, const sized_buf *key)
+{
+    uint64_t h = hash_key(key);
+    uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+    int changed = 0;
+    for (uint32_t i = 0; i < filter->nhashes; ++i) {
+        uint32_t bit = (uint32_t)((h1 + i * h2) % filter->nbits);
+        uint8_t mask = (uint8_t)(1 << (bit & 7));
+        if (!(filter->bits[bit >> 3] & mask)) {
+            filter->bits[bit >> 3] |= mask;
+            changed = 1;
+        }
+    }
+    filter->count += changed;
+    return changed;
+}
+
+int bloom_may_contain(const bloom_filter *filter, const sized_buf *key)
+{
+    uint64_t h = hash_key(key);
+    uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+    for (uint32_t i = 0; i < filter->nhashes; ++i) {
+        uint32_t bit = (uint32_t)((h1 + i * h2) % filter->nbits);
+        if (!(filter->bits[bit >> 3] & (1 << (bit & 7)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int bloom_overloaded(const bloom_filter *filter)
+{
+    return filter->count > filter->nbits / BLOOM_BITS_PER_KEY;
+}
+
+couchstore_error_t bloom_encode(const bloom_filter *filter, sized_buf *buf)
+{
+    buf->size = sizeof(raw_bloom_filter) + filter->nbits / 8;
+    buf->buf = static_cast<char*>(cs_malloc(buf->size));
+    if (buf->buf == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    raw_bloom_filter *raw = (raw_bloom_filter*)buf->buf;
+    raw->nbits = encode_raw32(filter->nbits);
+    raw->nhashes = encode_raw08((uint8_t)filter->nhashes);
+    raw->count = encode_raw48(filter->count);
+    memcpy(raw + 1, filter->bits, filter->nbits / 8);
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t bloom_decode(const char *buf, size_t size, bloom_filter **pFilter)
+{
+    if (size < sizeof(raw_bloom_filter)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    const raw_bloom_filter *raw = (const raw_bloom_filter*)buf;
+    uint32_t nbits = decode_raw32(raw->nbits);
+    uint32_t nhashes = decode_raw08(raw->nhashes);
+    if (nbits == 0 || nbits % 8 != 0 || size != sizeof(raw_bloom_filter) + nbits / 8 ||
+        nhashes == 0 || nhashes > BLOOM_MAX_HASHES) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    bloom_filter *filter = static_cast<bloom_filter*>(cs_calloc(1, sizeof(bloom_filter)));
+    if (filter == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    filter->bits = static_cast<uint8_t*>(cs_malloc(nbits / 8));
+    if (filter->bits == NULL) {
+        cs_free(filter);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(filter->bits, raw + 1, nbits / 8);
+    filter->nbits = nbits;
+    filter->nhashes = nhashes;
+    filter->count = decode_raw48(raw->count);
+    *pFilter = filter;
+    return COUCHSTORE_SUCCESS;
+}
+
+// Documents in the file, deleted ones included, judging by the by-ID root.
+static uint64_t db_doc_count(const Db *db)
+{
+    const node_pointer *root = db->header.by_id_root;
+    if (root == NULL || root->reduce_value.size < sizeof(raw_by_id_reduce)) {
+        return 0;
+    }
+    const raw_by_id_reduce *reduce = (const raw_by_id_reduce*)root->reduce_value.buf;
+    return decode_raw40(reduce->notdeleted) + decode_raw40(reduce->deleted);
+}
+
+typedef struct {
+    bloom_filter *filter;
+    uint64_t added;
+} fill_ctx;
+
+static couchstore_error_t fill_by_id_cb(couchfile_lookup_request *rq,
+                                        const sized_buf *k,
+                                        const sized_buf *v)
+{
+    (void)v;
+    fill_ctx *ctx = (fill_ctx *) rq->callback_ctx;
+    ctx->added += bloom_add(ctx->filter, k);
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t fill_by_seq_cb(couchfile_lookup_request *rq,
+                                         const sized_buf *k,
+                                         const sized_buf *v)
+{
+    (void)k;
+    fill_ctx *ctx = (fill_ctx *) rq->callback_ctx;
+    const raw_seq_index_value *raw = (const raw_seq_index_value*)v->buf;
+    uint32_t idsize, datasize;
+    if (v->size < sizeof(raw_seq_index_value)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    decode_kv_length(&raw->sizes, &idsize, &datasize);
+    if (v->size < sizeof(raw_seq_index_value) + idsize) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    sized_buf id = { (char *)(raw + 1), idsize };
+    ctx->added += bloom_add(ctx->filter, &id);
+    return COUCHSTORE_SUCCESS;
+}
+
+// Adds every key of a tree from start on, or every ID in the values of a
+// by-sequence tree.
+static couchstore_error_t fill_from_tree(Db *db, fill_ctx *ctx,
+                                         const node_pointer *root,
+                                         sized_buf *start,
+                                         int by_seq)
+{
+    couchfile_lookup_request rq;
+    if (root == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    rq.cmp.compare = by_seq ? seq_cmp : ebin_cmp;
+    rq.file = &db->file;
+    rq.num_keys = 1;
+    rq.keys = &start;
+    rq.callback_ctx = ctx;
+    rq.fetch_callback = by_seq ? fill_by_seq_cb : fill_by_id_cb;
+    rq.node_callback = NULL;
+    rq.fold = 1;
+    return btree_lookup(&rq, root->pointer);
+}
+
+// Builds a filter from scratch out of the by-ID tree, with room for the
+// file to double in size.
+static couchstore_error_t build_filter(Db *db, bloom_filter **pFilter)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf start = { NULL, 0 };
+    fill_ctx ctx = { bloom_create(2 * db_doc_count(db)), 0 };
+    error_unless(ctx.filter, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(fill_from_tree(db, &ctx, db->header.by_id_root, &start, 0));
+    *pFilter = ctx.filter;
+    ctx.filter = NULL;
+    // Nothing of it is on disk yet:
+    db->bloom_unsaved = (*pFilter)->count;
+cleanup:
+    bloom_free(ctx.filter);
+    return errcode;
+}
+
+// Reads the filter the header points to and brings it up to date.
+static couchstore_error_t load_filter(Db *db, bloom_filter **pFilter)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *buf = NULL;
+    raw_48 key = encode_raw48(db->header.bloom_seq + 1);
+    sized_buf start = { (char *)&key, sizeof(key) };
+    fill_ctx ctx = { NULL, 0 };
+    int size = pread_bin(&db->file, db->header.bloom_ptr, &buf);
+    if (size < 0) {
+        error_pass(static_cast<couchstore_error_t>(size));
+    }
+    error_pass(bloom_decode(buf, size, &ctx.filter));
+    error_pass(fill_from_tree(db, &ctx, db->header.by_seq_root, &start, 1));
+    *pFilter = ctx.filter;
+    ctx.filter = NULL;
+    db->bloom_unsaved = ctx.added;
+cleanup:
+    cs_free(buf);
+    bloom_free(ctx.filter);
+    return errcode;
+}
+
+couchstore_error_t db_bloom_get(Db *db, bloom_filter **pFilter)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (db->bloom_enabled && db->bloom == NULL) {
+        if (db->header.bloom_ptr) {
+            errcode = load_filter(db, &db->bloom);
+        } else {
+            errcode = build_filter(db, &db->bloom);
+        }
+    }
+    *pFilter = db->bloom;
+    return errcode;
+}
+
+void db_bloom_add(Db *db, const sized_buf *id, uint64_t seq)
+{
+    bloom_filter *filter;
+    if (db_bloom_get(db, &filter) != COUCHSTORE_SUCCESS) {
+        // The document is saved already, and a filter that missed it would
+        // give wrong answers; do without one until the next compaction.
+        db_bloom_reset(db);
+        db->bloom_enabled = 0;
+        db->header.bloom_ptr = 0;
+        return;
+    }
+    if (filter == NULL) {
+        return;
+    }
+    db->bloom_unsaved += bloom_add(filter, id);
+    if (db->header.bloom_ptr && seq <= db->header.bloom_seq) {
+        // Saved with COUCHSTORE_SEQUENCE_AS_IS below the covered sequence,
+        // where catching up when loading won't look.
+        db->bloom_stale = 1;
+    }
+}
+
+couchstore_error_t db_bloom_prepare_commit(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf buf = { NULL, 0 };
+    cs_off_t pos;
+    int written;
+    if (db->bloom == NULL) {
+        // Never loaded, so nothing was added and the header's still good.
+        return COUCHSTORE_SUCCESS;
+    }
+    if (bloom_overloaded(db->bloom)) {
+        bloom_filter *rebuilt = NULL;
+        error_pass(build_filter(db, &rebuilt));
+        bloom_free(db->bloom);
+        db->bloom = rebuilt;
+    } else if (db->header.bloom_ptr && !db->bloom_stale &&
+               db->bloom_unsaved * 8 <= db->bloom->count) {
+        // Loading catches up on the few IDs added since.
+        return COUCHSTORE_SUCCESS;
+    }
+
+    error_pass(bloom_encode(db->bloom, &buf));
+    written = db_write_buf(&db->file, &buf, &pos, NULL);
+    if (written < 0) {
+        error_pass(static_cast<couchstore_error_t>(written));
+    }
+    db->header.bloom_ptr = pos;
+    db->header.bloom_seq = db->header.update_seq;
+    db->bloom_unsaved = 0;
+    db->bloom_stale = 0;
+cleanup:
+    cs_free(buf.buf);
+    return errcode;
+}
+
+couchstore_error_t db_bloom_start(Db *target, const Db *source)
+{
+    db_bloom_reset(target);
+    target->bloom = bloom_create(2 * db_doc_count(source));
+    if (target->bloom == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    target->bloom_enabled = 1;
+    target->header.bloom_ptr = 0;
+    return COUCHSTORE_SUCCESS;
+}
+
+void db_bloom_reset(Db *db)
+{
+    bloom_free(db->bloom);
+    db->bloom = NULL;
+    db->bloom_unsaved = 0;
+    db->bloom_stale = 0;
+}
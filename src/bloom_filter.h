@@ -0,0 +1,84 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_BLOOM_FILTER_H
+#define LIBCOUCHSTORE_BLOOM_FILTER_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Smallest number of keys a filter is sized for: */
+#define BLOOM_MIN_CAPACITY 1024
+
+    /* Bloom filter over a set of keys. Answers "definitely absent" or
+       "maybe present"; keys can be added but never removed. */
+    typedef struct bloom_filter {
+        uint32_t nbits;
+        uint32_t nhashes;
+        /* Number of adds that set at least one new bit, which doesn't
+           count keys added again: */
+        uint64_t count;
+        uint8_t *bits;
+    } bloom_filter;
+
+    /** Creates an empty filter sized for about capacity keys. */
+    bloom_filter *bloom_create(uint64_t capacity);
+
+    void bloom_free(bloom_filter *filter);
+
+    /** The bytes a filter takes, or 0 for NULL. */
+    size_t bloom_memory(const bloom_filter *filter);
+
+    /**
+     * Adds a key.
+     * @return 1 if that changed the filter, 0 if it already matched the key
+     */
+    int bloom_add(bloom_filter *filter, const sized_buf *key);
+
+    /** @return 0 if the key was never added, 1 if it may have been */
+    int bloom_may_contain(const bloom_filter *filter, const sized_buf *key);
+
+    /** @return nonzero once the filter holds so many more keys than it was
+        sized for that its false positive rate has badly degraded */
+    int bloom_overloaded(const bloom_filter *filter);
+
+    /** Serializes a filter into a malloced buffer. */
+    couchstore_error_t bloom_encode(const bloom_filter *filter, sized_buf *buf);
+
+    /** Reads back a filter written by bloom_encode. */
+    couchstore_error_t bloom_decode(const char *buf, size_t size, bloom_filter **pFilter);
+
+    /* The Bloom filter of a Db's document IDs. It is persisted as a chunk
+       that the header points to, along with the sequence number it is
+       complete up to; IDs saved after that are added back from the
+       by-sequence tree when the filter is loaded. So the chunk needn't be
+       rewritten at every commit, only once enough has been added to it. */
+
+    /**
+     * Gets the Db's filter, loading or building it first if needed.
+     * *pFilter is set to NULL if the Db doesn't keep one.
+     */
+    couchstore_error_t db_bloom_get(Db *db, bloom_filter **pFilter);
+
+    /** Adds the ID of a document just saved with the given sequence number.
+        If the filter can't be loaded, the Db stops keeping one. */
+    void db_bloom_add(Db *db, const sized_buf *id, uint64_t seq);
+
+    /** Writes the filter out ahead of a commit, if it is due to be. Called
+        by db_commit_prepare, before the header size is worked out. */
+    couchstore_error_t db_bloom_prepare_commit(Db *db);
+
+    /** Gives a compaction target an empty filter sized for the documents
+        of its source; the compactor adds the IDs it copies. */
+    couchstore_error_t db_bloom_start(Db *target, const Db *source);
+
+    /** Forgets the in-memory filter, e.g. after switching headers. */
+    void db_bloom_reset(Db *db);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
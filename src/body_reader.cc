@@ -0,0 +1,248 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Reading of document bodies ahead on worker threads.
+//
+// Compacting a file that doesn't fit the page cache waits on one body read
+// after another, which keeps a single request in flight on a disk that
+// serves dozens at once. Entries go into a ring of slots; workers, each
+// with its own handle since the buffered ops aren't thread-safe, read the
+// bodies in queue order, and the calling thread takes the finished ones
+// from the head and writes them, so the target comes out as it would have
+// from reading each body in turn. When the ring is full the caller waits
+// for the oldest entry, which bounds the memory held by bodies read ahead.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "body_reader.h"
+#include "util.h"
+
+// Ring slots per worker thread:
+#define SLOTS_PER_THREAD 32
+
+typedef struct {
+    char *kv;                       // the key, followed by the value
+    size_t key_size;
+    size_t value_size;
+    uint64_t bp;
+    char *body;
+    int body_size;                  // or the error from reading it
+    unsigned codec;
+    // Read, or nothing to read:
+    int done;
+} body_job;
+
+typedef struct {
+    body_reader *reader;
+    tree_file file;
+    cb_thread_t thread;
+    int started;
+} body_worker;
+
+struct body_reader {
+    cb_mutex_t mutex;
+    cb_cond_t work_cond;            // entries queued, or shutdown
+    cb_cond_t done_cond;            // a body was read
+    body_job *slots;
+    unsigned nslots;
+    // Counters of queued entries; slot = counter % nslots.
+    uint64_t head;                  // oldest not taken
+    uint64_t next;                  // next to hand to a worker
+    uint64_t tail;                  // next free
+    int raw;                        // read with pread_raw_chunk
+    int shutdown;
+    body_worker *workers;
+    unsigned nworkers;
+};
+
+static void read_worker(void *arg)
+{
+    body_worker *worker = static_cast<body_worker *>(arg);
+    body_reader *reader = worker->reader;
+
+    cb_mutex_enter(&reader->mutex);
+    while (!reader->shutdown) {
+        if (reader->next == reader->tail) {
+            cb_cond_wait(&reader->work_cond, &reader->mutex);
+            continue;
+        }
+        body_job *job = &reader->slots[reader->next++ % reader->nslots];
+        if (job->done) {
+            continue;
+        }
+        cb_mutex_exit(&reader->mutex);
+
+        if (reader->raw) {
+            job->body_size = pread_raw_chunk(&worker->file, job->bp, &job->body);
+        } else {
+            job->body_size = pread_chunk(&worker->file, job->bp, &job->body, &job->codec);
+        }
+        if (job->body_size < 0) {
+            job->body = NULL;
+        }
+
+        cb_mutex_enter(&reader->mutex);
+        job->done = 1;
+        cb_cond_broadcast(&reader->done_cond);
+    }
+    cb_mutex_exit(&reader->mutex);
+}
+
+couchstore_error_t body_reader_create(const tree_file *source,
+                                      const couch_file_ops *ops,
+                                      unsigned threads,
+                                      int raw,
+                                      body_reader **pReader)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    body_reader *reader;
+    unsigned i;
+
+    error_unless(threads > 0 && source->path, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    reader = static_cast<body_reader *>(cs_calloc(1, sizeof(*reader)));
+    error_unless(reader, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cb_mutex_initialize(&reader->mutex);
+    cb_cond_initialize(&reader->work_cond);
+    cb_cond_initialize(&reader->done_cond);
+
+    reader->raw = raw;
+    reader->nslots = threads * SLOTS_PER_THREAD;
+    reader->slots = static_cast<body_job *>(cs_calloc(reader->nslots, sizeof(body_job)));
+    reader->workers = static_cast<body_worker *>(cs_calloc(threads, sizeof(body_worker)));
+    if (!reader->slots || !reader->workers) {
+        body_reader_destroy(reader);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    for (i = 0; i < threads; ++i) {
+        body_worker *worker = &reader->workers[i];
+        worker->reader = reader;
+        errcode = tree_file_open(&worker->file, source->path, O_RDONLY, ops);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            body_reader_destroy(reader);
+            return errcode;
+        }
+        worker->file.chunk_codecs = source->chunk_codecs;
+        worker->file.block_size = source->block_size;
+        ++reader->nworkers;
+        if (cb_create_thread(&worker->thread, read_worker, worker, 0) != 0) {
+            body_reader_destroy(reader);
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        worker->started = 1;
+    }
+    *pReader = reader;
+
+cleanup:
+    return errcode;
+}
+
+void body_reader_destroy(body_reader *reader)
+{
+    unsigned i;
+
+    if (reader == NULL) {
+        return;
+    }
+
+    cb_mutex_enter(&reader->mutex);
+    reader->shutdown = 1;
+    cb_cond_broadcast(&reader->work_cond);
+    cb_mutex_exit(&reader->mutex);
+    for (i = 0; i < reader->nworkers; ++i) {
+        if (reader->workers[i].started) {
+            cb_join_thread(reader->workers[i].thread);
+        }
+        tree_file_close(&reader->workers[i].file);
+    }
+
+    for (; reader->head < reader->tail; ++reader->head) {
+        body_job *job = &reader->slots[reader->head % reader->nslots];
+        cs_free(job->kv);
+        cs_free(job->body);
+    }
+    cs_free(reader->workers);
+    cs_free(reader->slots);
+    cb_cond_destroy(&reader->work_cond);
+    cb_cond_destroy(&reader->done_cond);
+    cb_mutex_destroy(&reader->mutex);
+    cs_free(reader);
+}
+
+int body_reader_full(const body_reader *reader)
+{
+    return reader->tail - reader->head == reader->nslots;
+}
+
+int body_reader_pending(const body_reader *reader)
+{
+    return reader->tail != reader->head;
+}
+
+couchstore_error_t body_reader_add(body_reader *reader,
+                                   const sized_buf *k,
+                                   const sized_buf *v,
+                                   uint64_t bp)
+{
+    if (body_reader_full(reader)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    // Slots from head to tail are only touched by the workers, so this one
+    // can be filled in before it's published.
+    body_job *job = &reader->slots[reader->tail % reader->nslots];
+    job->kv = static_cast<char *>(cs_malloc(k->size + v->size));
+    if (job->kv == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(job->kv, k->buf, k->size);
+    memcpy(job->kv + k->size, v->buf, v->size);
+    job->key_size = k->size;
+    job->value_size = v->size;
+    job->bp = bp;
+    job->body = NULL;
+    job->body_size = 0;
+    job->codec = 0;
+    job->done = bp == 0;
+
+    cb_mutex_enter(&reader->mutex);
+    ++reader->tail;
+    cb_cond_signal(&reader->work_cond);
+    cb_mutex_exit(&reader->mutex);
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t body_reader_take(body_reader *reader, read_body *out)
+{
+    if (!body_reader_pending(reader)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    body_job *job = &reader->slots[reader->head % reader->nslots];
+    cb_mutex_enter(&reader->mutex);
+    while (!job->done) {
+        cb_cond_wait(&reader->done_cond, &reader->mutex);
+    }
+    ++reader->head;
+    cb_mutex_exit(&reader->mutex);
+
+    if (job->body_size < 0) {
+        cs_free(job->kv);
+        return static_cast<couchstore_error_t>(job->body_size);
+    }
+    out->key.buf = job->kv;
+    out->key.size = job->key_size;
+    out->value.buf = job->kv + job->key_size;
+    out->value.size = job->value_size;
+    out->body.buf = job->body;
+    out->body.size = job->body_size;
+    out->codec = job->codec;
+    return COUCHSTORE_SUCCESS;
+}
+
+void body_reader_release(read_body *entry)
+{
+    cs_free(entry->key.buf);
+    cs_free(entry->body.buf);
+    entry->key.buf = NULL;
+    entry->value.buf = NULL;
+    entry->body.buf = NULL;
+}
@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_BODY_READER_H
+#define LIBCOUCHSTORE_BODY_READER_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Reads document bodies ahead on worker threads, each with a handle of
+       its own on the file, while the caller goes on walking the tree. Each
+       body is queued with the entry that points to it, and they are taken
+       back in the order they were queued, so whatever the caller does with
+       them comes out exactly as if each had been read when it was queued. */
+    typedef struct body_reader body_reader;
+
+    /* An entry taken back from the reader, with its body. All three buffers
+       belong to the caller, and are freed with body_reader_release. */
+    typedef struct {
+        sized_buf key;
+        sized_buf value;
+        sized_buf body;         /* buf is NULL for entries without a body */
+        unsigned codec;         /* unless read raw */
+    } read_body;
+
+    /**
+     * Starts a reader with the given number (at least 1) of threads, each
+     * opening the file at source's path read-only with ops. source gives
+     * the chunk format; it isn't read from. The bodies are read with
+     * pread_raw_chunk if raw is set, and with pread_chunk otherwise.
+     */
+    couchstore_error_t body_reader_create(const tree_file *source,
+                                          const couch_file_ops *ops,
+                                          unsigned threads,
+                                          int raw,
+                                          body_reader **pReader);
+
+    /** Stops the threads, and frees the entries still queued. */
+    void body_reader_destroy(body_reader *reader);
+
+    /** Whether every slot is taken, so an entry has to be taken first. */
+    int body_reader_full(const body_reader *reader);
+
+    /** Whether any entry is queued. */
+    int body_reader_pending(const body_reader *reader);
+
+    /**
+     * Queues an entry, copying k and v, with the body at bp to be read; a
+     * bp of 0 is an entry without one. The reader must not be full.
+     */
+    couchstore_error_t body_reader_add(body_reader *reader,
+                                       const sized_buf *k,
+                                       const sized_buf *v,
+                                       uint64_t bp);
+
+    /**
+     * Takes the oldest entry, waiting for its body to be read. A failed
+     * read is returned here, and the entry is dropped.
+     */
+    couchstore_error_t body_reader_take(body_reader *reader, read_body *out);
+
+    /** Frees an entry taken with body_reader_take. */
+    void body_reader_release(read_body *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,250 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "body_segments.h"
+#include "bitfield.h"
+#include "codec.h"
+#include "util.h"
+
+int db_body_segmented(const Db *db, size_t size, int compress)
+{
+    return compress && db->body_segment_size && size > db->body_segment_size &&
+           db->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES;
+}
+
+static size_t segment_count(uint64_t length, uint32_t segment_size)
+{
+    return (size_t)((length + segment_size - 1) / segment_size);
+}
+
+couchstore_error_t db_write_segment_index(tree_file *file, uint64_t length,
+                                          uint32_t segment_size, const cs_off_t *positions,
+                                          size_t count, uint64_t *bp, size_t *disk_size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf buf;
+    raw_body_segments *raw;
+    raw_48 *raw_positions;
+    cs_off_t pos;
+    size_t ii;
+
+    buf.size = sizeof(raw_body_segments) + count * sizeof(raw_48);
+    buf.buf = static_cast<char *>(cs_malloc(buf.size));
+    error_unless(buf.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    raw = (raw_body_segments*)buf.buf;
+    raw->length = encode_raw48(length);
+    raw->segment_size = encode_raw32(segment_size);
+    raw_positions = (raw_48*)(raw + 1);
+    for (ii = 0; ii < count; ii++) {
+        raw_positions[ii] = encode_raw48(positions[ii]);
+    }
+    error_pass(static_cast<couchstore_error_t>(db_write_buf(file, &buf, &pos, disk_size)));
+    *bp = (uint64_t)pos | BP_SEGMENTED_FLAG;
+cleanup:
+    cs_free(buf.buf);
+    return errcode;
+}
+
+couchstore_error_t db_write_segmented(Db *db, const sized_buf *body,
+                                      uint64_t *bp, size_t *disk_size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint32_t segment_size = db->body_segment_size;
+    size_t count = segment_count(body->size, segment_size);
+    size_t total = 0, size, ii;
+    cs_off_t *positions = static_cast<cs_off_t *>(cs_malloc(count * sizeof(cs_off_t)));
+
+    error_unless(positions, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (ii = 0; ii < count; ii++) {
+        sized_buf segment;
+        segment.buf = body->buf + ii * segment_size;
+        segment.size = body->size - ii * segment_size;
+        if (segment.size > segment_size) {
+            segment.size = segment_size;
+        }
+        error_pass(db_write_buf_compressed(&db->file, &segment, db->file.doc_codec,
+                                           &positions[ii], &size));
+        total += size;
+    }
+    error_pass(db_write_segment_index(&db->file, body->size, segment_size, positions,
+                                      count, bp, &size));
+    *disk_size = total + size;
+cleanup:
+    cs_free(positions);
+    return errcode;
+}
+
+// Reads the index chunk of a segmented body.
+static couchstore_error_t read_index(tree_file *file, uint64_t bp, char **buf,
+                                     uint64_t *length, uint32_t *segment_size,
+                                     size_t *count)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    int size = pread_bin(file, bp & ~(BP_DELETED_FLAG | BP_SEGMENTED_FLAG), buf);
+    error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+    error_unless(size >= (int)sizeof(raw_body_segments), COUCHSTORE_ERROR_CORRUPT);
+    {
+        const raw_body_segments *raw = (const raw_body_segments*)*buf;
+        *length = decode_raw48(raw->length);
+        *segment_size = decode_raw32(raw->segment_size);
+        error_unless(*segment_size > 0, COUCHSTORE_ERROR_CORRUPT);
+        *count = segment_count(*length, *segment_size);
+        error_unless((size_t)size == sizeof(*raw) + *count * sizeof(raw_48),
+                     COUCHSTORE_ERROR_CORRUPT);
+    }
+cleanup:
+    return errcode;
+}
+
+// Reads and decompresses one segment, checking it's the size it should be.
+static couchstore_error_t read_segment(tree_file *file, const raw_48 *position,
+                                       size_t expected, char **buf, unsigned *codec)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *compressed = NULL;
+    size_t size = 0;
+    int len = pread_chunk(file, decode_raw48(*position), &compressed, codec);
+    error_unless(len >= 0, static_cast<couchstore_error_t>(len));
+    error_pass(codec_uncompress(file, *codec, compressed, len, buf, &size));
+    if (size != expected) {
+        cs_free(*buf);
+        *buf = NULL;
+        error_pass(COUCHSTORE_ERROR_CORRUPT);
+    }
+cleanup:
+    cs_free(compressed);
+    return errcode;
+}
+
+// Compresses a whole body again and takes the range asked for of that.
+static couchstore_error_t recompress_range(tree_file *file, unsigned codec,
+                                           const char *body, size_t body_size,
+                                           uint64_t offset, size_t len,
+                                           char **buf, size_t *size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t compressed_size = codec_max_compressed_length(codec, body_size);
+    char *compressed = static_cast<char *>(cs_malloc(compressed_size));
+    error_unless(compressed, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(codec_compress(file, codec, body, body_size, compressed, &compressed_size));
+    if (offset >= compressed_size) {
+        *buf = NULL;
+        *size = 0;
+        goto cleanup;
+    }
+    if (len > compressed_size - offset) {
+        len = compressed_size - offset;
+    }
+    if (offset == 0) {
+        *buf = compressed;
+        compressed = NULL;
+    } else {
+        *buf = static_cast<char *>(cs_malloc(len));
+        error_unless(*buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+        memcpy(*buf, compressed + offset, len);
+    }
+    *size = len;
+cleanup:
+    cs_free(compressed);
+    return errcode;
+}
+
+couchstore_error_t db_read_segmented(Db *db, uint64_t bp,
+                                     uint64_t offset, size_t len,
+                                     int decompress,
+                                     char **buf, size_t *size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *index = NULL, *body = NULL, *segment = NULL;
+    uint64_t length, end;
+    uint64_t range_offset = offset;
+    size_t range_len = len;
+    uint32_t segment_size;
+    size_t count, ii, filled = 0;
+    unsigned codec = 0;
+    const raw_48 *positions;
+
+    *buf = NULL;
+    *size = 0;
+    error_pass(read_index(&db->file, bp, &index, &length, &segment_size, &count));
+    positions = (const raw_48*)(index + sizeof(raw_body_segments));
+    if (!decompress) {
+        // The compressed form depends on all of it; the range is taken
+        // from it after.
+        offset = 0;
+        len = (size_t)length;
+    }
+    if (offset >= length || len == 0) {
+        goto cleanup;
+    }
+    end = length - offset > len ? offset + len : length;
+    body = static_cast<char *>(cs_malloc((size_t)(end - offset)));
+    error_unless(body, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (ii = (size_t)(offset / segment_size); filled < end - offset; ii++) {
+        uint64_t start = (uint64_t)ii * segment_size;
+        size_t expected = length - start > segment_size ? segment_size
+                                                        : (size_t)(length - start);
+        error_pass(read_segment(&db->file, &positions[ii], expected, &segment, &codec));
+        size_t from = offset > start ? (size_t)(offset - start) : 0;
+        size_t take = expected - from;
+        if (take > end - offset - filled) {
+            take = (size_t)(end - offset - filled);
+        }
+        memcpy(body + filled, segment + from, take);
+        filled += take;
+        cs_free(segment);
+        segment = NULL;
+    }
+    if (decompress) {
+        *buf = body;
+        *size = filled;
+        body = NULL;
+    } else {
+        error_pass(recompress_range(&db->file, codec, body, filled, range_offset, range_len,
+                                    buf, size));
+    }
+cleanup:
+    cs_free(segment);
+    cs_free(body);
+    cs_free(index);
+    return errcode;
+}
+
+couchstore_error_t db_copy_segmented(tree_file *source, tree_file *target,
+                                     raw_seq_index_value *raw)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t bp = decode_raw48(raw->bp);
+    char *index = NULL;
+    sized_buf item = { NULL, 0 };
+    cs_off_t *positions = NULL;
+    uint64_t length, new_bp;
+    uint32_t segment_size;
+    size_t count, ii;
+
+    error_pass(read_index(source, bp, &index, &length, &segment_size, &count));
+    positions = static_cast<cs_off_t *>(cs_malloc(count * sizeof(cs_off_t)));
+    error_unless(positions, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (ii = 0; ii < count; ii++) {
+        // Copied with the codec it was written with, as the compactor does.
+        const raw_48 *pos = (const raw_48*)(index + sizeof(raw_body_segments)) + ii;
+        unsigned codec;
+        int size = pread_chunk(source, decode_raw48(*pos), &item.buf, &codec);
+        error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+        item.size = size;
+        int written = db_write_chunk(target, &item, codec, &positions[ii], NULL);
+        error_unless(written >= 0, static_cast<couchstore_error_t>(written));
+        cs_free(item.buf);
+        item.buf = NULL;
+    }
+    error_pass(db_write_segment_index(target, length, segment_size, positions, count,
+                                      &new_bp, NULL));
+    raw->bp = encode_raw48((bp & BP_DELETED_FLAG) | new_bp);
+cleanup:
+    cs_free(item.buf);
+    cs_free(positions);
+    cs_free(index);
+    return errcode;
+}
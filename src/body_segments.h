@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_BODY_SEGMENTS_H
+#define LIBCOUCHSTORE_BODY_SEGMENTS_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+#include "node_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* A large compressed body may be written as segments, each of a set
+       size before compression and compressed on its own, so that part of
+       it can be read without the rest. Its bp has BP_SEGMENTED_FLAG set
+       and points to a plain chunk of raw_body_segments followed by the
+       segments' positions, written after them. */
+
+    /** Whether a body of this size, compressed or not, is written in
+        segments. */
+    int db_body_segmented(const Db *db, size_t size, int compress);
+
+    /** Writes a body in segments compressed with the file's doc codec. */
+    couchstore_error_t db_write_segmented(Db *db, const sized_buf *body,
+                                          uint64_t *bp, size_t *disk_size);
+
+    /** Appends the index chunk of a body's segments, written already at
+        the given positions, and sets bp to point to it. */
+    couchstore_error_t db_write_segment_index(tree_file *file, uint64_t length,
+                                              uint32_t segment_size,
+                                              const cs_off_t *positions, size_t count,
+                                              uint64_t *bp, size_t *disk_size);
+
+    /**
+     * Reads up to len bytes of a segmented body from offset on, reading
+     * only the segments they're in. Unless decompress is set the whole
+     * body is compressed again, with the codec of its segments, and the
+     * range is of that.
+     * @param buf  set to a malloced buffer, or NULL if nothing's in range
+     */
+    couchstore_error_t db_read_segmented(Db *db, uint64_t bp,
+                                         uint64_t offset, size_t len,
+                                         int decompress,
+                                         char **buf, size_t *size);
+
+    /** Copies a segmented body from one file to another, as the compactor
+        does other bodies, and points the by-sequence value at the copy. */
+    couchstore_error_t db_copy_segmented(tree_file *source, tree_file *target,
+                                         raw_seq_index_value *raw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,14 +9,31 @@
 #include "util.h"
 #include "arena.h"
 #include "node_types.h"
+#include "node_cache.h"
+#include "chunk_writer.h"
+#include "op_stats.h"
+#include "probes.h"
 
 
 static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t mr_quota);
 static couchstore_error_t flush_mr(couchfile_modify_result *res);
+
+// What the purge callbacks made of a node's items, worked out ahead on a
+// thread of guided_purge_btree_parallel(), to purge the node by rather
+// than call them again.
+typedef struct purge_plan {
+    int count;
+    signed char *actions;           // one per item, in order
+    struct purge_plan **partial;    // the plans of those PURGE_PARTIAL
+} purge_plan;
+
 static couchstore_error_t purge_node(couchfile_modify_request *rq,
                                       node_pointer *nptr,
+                                      const purge_plan *plan,
                                       couchfile_modify_result *dst);
 
+//A node written before the end of what's modified is not the one it
+//replaces, so it and the rest can't be reduced from a delta.
 static couchstore_error_t maybe_flush(couchfile_modify_result *mr)
 {
     if(mr->rq->compacting) {
@@ -27,6 +44,7 @@ static couchstore_error_t maybe_flush(couchfile_modify_result *mr)
             mr->node_len > (mr->rq->kv_chunk_threshold * 2 / 3)) ||
             ((mr->node_type == KP_NODE) &&
              mr->node_len > (mr->rq->kp_chunk_threshold * 2 / 3)))) {
+            mr->delta_base = NULL;
             return flush_mr(mr);
         }
     } else if (mr->modified &&  mr->count > 3) {
@@ -38,6 +56,7 @@ static couchstore_error_t maybe_flush(couchfile_modify_result *mr)
         }
         if ((mr->node_type == KP_NODE) &&
              mr->node_len > mr->rq->kp_chunk_threshold) {
+            mr->delta_base = NULL;
             return flush_mr_partial(mr, (mr->rq->kp_chunk_threshold * 2 / 3));
         }
     }
@@ -81,6 +100,11 @@ static couchfile_modify_result *make_modres(arena* a, couchfile_modify_request *
     res->count = 0;
     res->modified = 0;
     res->error_state = 0;
+    res->delta_base = NULL;
+    res->removed = NULL;
+    res->removed_count = 0;
+    res->added = NULL;
+    res->added_count = 0;
     res->rq = rq;
     return res;
 }
@@ -92,12 +116,16 @@ couchfile_modify_result *new_btree_modres(arena *a, arena *transient_arena, tree
 {
     couchfile_modify_request* rq;
     rq = static_cast<couchfile_modify_request*>(arena_alloc(a, sizeof(couchfile_modify_request)));
+    if (!rq) {
+        return NULL;
+    }
     rq->cmp = *cmp;
     rq->file = file;
     rq->num_actions = 0;
     rq->fetch_callback = NULL;
     rq->reduce = reduce;
     rq->rereduce = rereduce;
+    rq->reduce_delta = NULL;
     rq->user_reduce_ctx = user_reduce_ctx;
     rq->compacting = 1;
     rq->enable_purging = 0;
@@ -169,6 +197,46 @@ static couchstore_error_t mr_push_pointerinfo(node_pointer *ptr,
     return maybe_flush(dst);
 }
 
+//Adds a pointer to one of the lists of a delta.
+static couchstore_error_t push_delta_pointer(arena *a, node_pointer *ptr,
+                                             nodelist **list, int *count)
+{
+    nodelist *pel = static_cast<nodelist*>(arena_alloc(a, sizeof(nodelist)));
+    if (!pel) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memset(pel, 0, sizeof(nodelist));
+    pel->pointer = ptr;
+    pel->next = *list;
+    *list = pel;
+    (*count)++;
+    return COUCHSTORE_SUCCESS;
+}
+
+//Notes the child nptr of the KP node being modified in dst as replaced by
+//the nodes written in local_result, if any.
+static couchstore_error_t mr_note_replaced(node_pointer *nptr,
+                                           couchfile_modify_result *local_result,
+                                           couchfile_modify_result *dst)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (!dst->delta_base) {
+        return errcode;
+    }
+    if (nptr) {
+        error_pass(push_delta_pointer(dst->arena, nptr, &dst->removed,
+                                      &dst->removed_count));
+    }
+    if (local_result) {
+        for (nodelist *i = local_result->pointers->next; i != NULL; i = i->next) {
+            error_pass(push_delta_pointer(dst->arena, i->pointer, &dst->added,
+                                          &dst->added_count));
+        }
+    }
+cleanup:
+    return errcode;
+}
+
 static node_pointer *read_pointer(arena* a, sized_buf *key, char *buf)
 {
     //Parse KP pair into a node_pointer {K, {ptr, reduce_value, subtreesize}}
@@ -193,6 +261,21 @@ static couchstore_error_t flush_mr(couchfile_modify_result *res)
 }
 
 //Write a node using enough items from the values list to create a node
+//Puts an interior node just written into the file's node cache, since the
+//next modification of the tree starts by reading it back. Takes buf.
+static void cache_written_node(tree_file *file, cs_off_t pos, char *buf, size_t len)
+{
+    if (file->node_cache == NULL) {
+        cs_free(buf);
+        return;
+    }
+    decoded_node *node;
+    if (decode_node(buf, (int)len, 0, &node) == COUCHSTORE_SUCCESS) {
+        node_cache_put(file->node_cache, pos, node);
+        node_release(file->node_cache, node);
+    }
+}
+
 //with uncompressed size of at least mr_quota
 static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t mr_quota)
 {
@@ -207,14 +290,27 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
     cs_off_t diskpos;
     size_t disk_size;
     sized_buf final_key = {NULL, 0};
+    size_t consumed = 0;
 
     if (res->values_end == res->values || ! res->modified) {
         //Empty
         return COUCHSTORE_SUCCESS;
     }
 
-    // nodebuf/writebuf is very short-lived and can be large, so use regular malloc heap for it:
-    nodebuf = static_cast<char*>(malloc(res->node_len + 1));
+    chunk_writer *writer = res->rq->file->chunk_writer;
+    if (writer && res->node_type == KP_NODE) {
+        //The pointers we're about to write need the positions of their
+        //nodes, so those have to be written first.
+        errcode = chunk_writer_flush(writer, res->rq->file);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+
+    // nodebuf/writebuf is very short-lived and can be large, so use regular malloc heap for it.
+    // Prefixed keys take up to two more bytes each.
+    int prefix_keys = res->rq->file->prefix_keys;
+    nodebuf = static_cast<char*>(cs_malloc(res->node_len + 1 + (prefix_keys ? 2 * res->count : 0)));
     if (!nodebuf) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -222,17 +318,22 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
     writebuf.buf = nodebuf;
 
     dst = nodebuf;
-    *(dst++) = (char) res->node_type;
+    *(dst++) = (char) (prefix_keys ? res->node_type | NODE_PREFIXED_KEYS : res->node_type);
 
     nodelist *i = res->values->next;
     //We don't care that we've reached mr_quota if we haven't written out
     //at least two items and we're not writing a leaf node.
-    while (i != NULL && (mr_quota > 0 || (itmcount < 2 && res->node_type == KP_NODE))) {
-        dst = static_cast<char*>(write_kv(dst, i->key, i->data));
+    while (i != NULL && (consumed < mr_quota || (itmcount < 2 && res->node_type == KP_NODE))) {
+        if (prefix_keys) {
+            dst = static_cast<char*>(write_prefixed_kv(dst, itmcount ? &final_key : NULL,
+                                                       i->key, i->data));
+        } else {
+            dst = static_cast<char*>(write_kv(dst, i->key, i->data));
+        }
         if (i->pointer) {
             subtreesize += i->pointer->subtreesize;
         }
-        mr_quota -= i->key.size + i->data.size + sizeof(raw_kv_length);
+        consumed += i->key.size + i->data.size + sizeof(raw_kv_length);
         final_key = i->key;
         i = i->next;
         res->count--;
@@ -241,30 +342,61 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
 
     writebuf.size = dst - nodebuf;
 
-    errcode = static_cast<couchstore_error_t>(db_write_buf_compressed(res->rq->file, &writebuf, &diskpos, &disk_size));
-    free(nodebuf);  // here endeth the nodebuf.
-    if (errcode != COUCHSTORE_SUCCESS) {
-        return errcode;
+    if (writer) {
+        //The node's position and disk size are filled in once it's written.
+        diskpos = 0;
+        disk_size = 0;
+    } else {
+        errcode = static_cast<couchstore_error_t>(db_write_buf_compressed(res->rq->file, &writebuf, res->rq->file->node_codec, &diskpos, &disk_size));
+        if (errcode == COUCHSTORE_SUCCESS && res->node_type == KP_NODE && !prefix_keys) {
+            cache_written_node(res->rq->file, diskpos, nodebuf, writebuf.size);
+        } else {
+            cs_free(nodebuf);  // here endeth the nodebuf.
+        }
+        nodebuf = NULL;
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
     }
+    PROBE4(node_flush, res->node_type, itmcount, writebuf.size, diskpos);
 
     if (res->node_type == KV_NODE && res->rq->reduce) {
         errcode = res->rq->reduce(reducebuf, &reducesize, res->values->next, itmcount, res->rq->user_reduce_ctx);
         if (errcode != COUCHSTORE_SUCCESS) {
+            cs_free(nodebuf);
             return errcode;
         }
         assert(reducesize <= sizeof(reducebuf));
     }
 
     if (res->node_type == KP_NODE && res->rq->rereduce) {
-        errcode = res->rq->rereduce(reducebuf, &reducesize, res->values->next, itmcount, res->rq->user_reduce_ctx);
-        if (errcode != COUCHSTORE_SUCCESS) {
-            return errcode;
+        int reduced = 0;
+        if (res->delta_base) {
+            reduce_delta delta;
+            delta.old_reduction = &res->delta_base->reduce_value;
+            delta.removed = res->removed;
+            delta.removed_count = res->removed_count;
+            delta.added = res->added;
+            delta.added_count = res->added_count;
+            reduced = res->rq->reduce_delta(reducebuf, &reducesize, res->values->next, itmcount, &delta, res->rq->user_reduce_ctx);
+            if (reduced < 0) {
+                cs_free(nodebuf);
+                return static_cast<couchstore_error_t>(reduced);
+            }
+        }
+        if (!reduced) {
+            errcode = res->rq->rereduce(reducebuf, &reducesize, res->values->next, itmcount, res->rq->user_reduce_ctx);
+            if (errcode != COUCHSTORE_SUCCESS) {
+                cs_free(nodebuf);
+                return errcode;
+            }
         }
         assert(reducesize <= sizeof(reducebuf));
     }
 
     node_pointer *ptr = (node_pointer *) arena_alloc(res->arena, sizeof(node_pointer) + final_key.size + reducesize);
     if (!ptr) {
+        cs_free(nodebuf);
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
 
@@ -282,13 +414,22 @@ static couchstore_error_t flush_mr_partial(couchfile_modify_result *res, size_t
 
     nodelist *pel = encode_pointer(res->arena, ptr);
     if (!pel) {
+        cs_free(nodebuf);
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
 
+    if (writer) {
+        errcode = chunk_writer_add_node(writer, res->rq->file, nodebuf, writebuf.size,
+                                  ptr, (raw_node_pointer *)pel->data.buf);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+
     res->pointers_end->next = pel;
     res->pointers_end = pel;
 
-    res->node_len -= (writebuf.size - 1);
+    res->node_len -= consumed;
 
     res->values->next = i;
     if(i == NULL) {
@@ -332,12 +473,16 @@ cleanup:
 static couchstore_error_t maybe_purgekv(couchfile_modify_request *rq,
                                             sized_buf *key,
                                             sized_buf *val,
+                                            const purge_plan *plan,
+                                            int item,
                                             couchfile_modify_result *result)
 {
     int action;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
-    if (rq->enable_purging && rq->purge_kv) {
+    if (rq->enable_purging && plan) {
+        action = plan->actions[item];
+    } else if (rq->enable_purging && rq->purge_kv) {
         action = rq->purge_kv(key, val, rq->guided_purge_ctx);
         if (action < 0) {
             return (couchstore_error_t) action;
@@ -364,12 +509,15 @@ static couchstore_error_t maybe_purgekv(couchfile_modify_request *rq,
 
 // Perform purging for a kp-node if it qualifies for purging
 static couchstore_error_t maybe_purgekp(couchfile_modify_request *rq, node_pointer *node,
+                                        const purge_plan *plan, int item,
                                         couchfile_modify_result *result)
 {
     int action;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
-    if (rq->enable_purging && rq->purge_kp) {
+    if (rq->enable_purging && plan) {
+        action = plan->actions[item];
+    } else if (rq->enable_purging && rq->purge_kp) {
         action = rq->purge_kp(node, rq->guided_purge_ctx);
         if (action < 0) {
             return (couchstore_error_t) action;
@@ -381,10 +529,12 @@ static couchstore_error_t maybe_purgekp(couchfile_modify_request *rq, node_point
     switch (action) {
     case PURGE_ITEM:
         result->modified = 1;
+        errcode = mr_note_replaced(node, NULL, result);
         break;
 
     case PURGE_PARTIAL:
-        errcode = purge_node(rq, node, result);
+        result->delta_base = NULL;
+        errcode = purge_node(rq, node, plan ? plan->partial[item] : NULL, result);
         break;
 
     case PURGE_STOP:
@@ -403,7 +553,8 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                                       int start, int end,
                                       couchfile_modify_result *dst)
 {
-    char *nodebuf = NULL;  // FYI, nodebuf is a malloced block, not in the arena
+    decoded_node *node = NULL;  // from the file's node cache, or read for us
+    const char *nodebuf = NULL;
     int bufpos = 1;
     int nodebuflen = 0;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -414,9 +565,9 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
     }
 
     if (nptr) {
-        if ((nodebuflen = pread_compressed(rq->file, nptr->pointer, (char **) &nodebuf)) < 0) {
-            error_pass(COUCHSTORE_ERROR_READ);
-        }
+        error_pass(btree_read_node(rq->file, nptr->pointer, 0, &node));
+        nodebuf = node->buf;
+        nodebuflen = node->length;
     }
 
     local_result = make_modres(dst->arena, rq);
@@ -430,10 +581,10 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
             int advance = 0;
             while (!advance && start < end) {
                 advance = 1;
-                int cmp_val = rq->cmp.compare(&cmp_key, rq->actions[start].key);
+                int cmp_val = compare_keys(&rq->cmp, &cmp_key, rq->actions[start].key);
 
                 if (cmp_val < 0) { //Key less than action key
-                    errcode = maybe_purgekv(rq, &cmp_key, &val_buf, local_result);
+                    errcode = maybe_purgekv(rq, &cmp_key, &val_buf, NULL, 0, local_result);
                     if (errcode != COUCHSTORE_SUCCESS) {
                         goto cleanup;
                     }
@@ -483,7 +634,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
             }
             if (start == end && !advance) {
                 //If we've exhausted actions then just keep this key
-                errcode = maybe_purgekv(rq, &cmp_key, &val_buf, local_result);
+                errcode = maybe_purgekv(rq, &cmp_key, &val_buf, NULL, 0, local_result);
                 if (errcode != COUCHSTORE_SUCCESS) {
                     goto cleanup;
                 }
@@ -512,10 +663,13 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
         }
     } else if (nodebuf[0] == 0) { //KP Node
         local_result->node_type = KP_NODE;
+        if (rq->reduce_delta) {
+            local_result->delta_base = nptr;
+        }
         while (bufpos < nodebuflen && start < end) {
             sized_buf cmp_key, val_buf;
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
-            int cmp_val = rq->cmp.compare(&cmp_key, rq->actions[start].key);
+            int cmp_val = compare_keys(&rq->cmp, &cmp_key, rq->actions[start].key);
             if (bufpos == nodebuflen) {
                 //We're at the last item in the kpnode, must apply all our
                 //actions here.
@@ -541,7 +695,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                     goto cleanup;
                 }
 
-                errcode = maybe_purgekp(rq, add, local_result);
+                errcode = maybe_purgekp(rq, add, NULL, 0, local_result);
                 if (errcode != COUCHSTORE_SUCCESS) {
                     goto cleanup;
                 }
@@ -551,7 +705,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                 //are less than the key here.
                 int range_end = start;
                 while (range_end < end &&
-                        rq->cmp.compare(rq->actions[range_end].key, &cmp_key) <= 0) {
+                        compare_keys(&rq->cmp, rq->actions[range_end].key, &cmp_key) <= 0) {
                     range_end++;
                 }
 
@@ -577,7 +731,7 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
                 goto cleanup;
             }
 
-            errcode = maybe_purgekp(rq, add, local_result);
+            errcode = maybe_purgekp(rq, add, NULL, 0, local_result);
             if (errcode != COUCHSTORE_SUCCESS) {
                 goto cleanup;
             }
@@ -594,12 +748,11 @@ static couchstore_error_t modify_node(couchfile_modify_request *rq,
     } else {
         //Otherwise, give back the pointers to the nodes we've created.
         dst->modified = 1;
+        error_pass(mr_note_replaced(nptr, local_result, dst));
         error_pass(mr_move_pointers(local_result, dst));
     }
 cleanup:
-    if (nodebuf) {
-        free(nodebuf);
-    }
+    node_release(rq->file->node_cache, node);
 
     return errcode;
 }
@@ -653,7 +806,7 @@ static node_pointer* copy_node_pointer(node_pointer* ptr)
         return NULL;
     }
     node_pointer* ret_ptr;
-    ret_ptr = static_cast<node_pointer*>(malloc(sizeof(node_pointer) + ptr->key.size + ptr->reduce_value.size));
+    ret_ptr = static_cast<node_pointer*>(cs_malloc(sizeof(node_pointer) + ptr->key.size + ptr->reduce_value.size));
     if (!ret_ptr) {
         return NULL;
     }
@@ -665,6 +818,23 @@ static node_pointer* copy_node_pointer(node_pointer* ptr)
     return ret_ptr;
 }
 
+// Writes out the nodes still queued for compression, which the caller is
+// about to return pointers to, or drops them if the modification failed.
+static couchstore_error_t finish_writes(couchfile_modify_request *rq,
+                                        couchstore_error_t errcode)
+{
+    chunk_writer *writer = rq->file->chunk_writer;
+    if (writer) {
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = chunk_writer_flush(writer, rq->file);
+        }
+        if (errcode != COUCHSTORE_SUCCESS) {
+            chunk_writer_discard(writer);
+        }
+    }
+    return errcode;
+}
+
 // Finished creating a new b-tree (from compaction), build pointers and get a
 // root node.
 
@@ -672,12 +842,13 @@ node_pointer* complete_new_btree(couchfile_modify_result* mr, couchstore_error_t
 {
     *errcode = flush_mr(mr);
     if(*errcode != COUCHSTORE_SUCCESS) {
+        finish_writes(mr->rq, *errcode);
         return NULL;
     }
 
     couchfile_modify_result* targ_mr = make_modres(mr->arena, mr->rq);
     if (!targ_mr) {
-        *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+        *errcode = finish_writes(mr->rq, COUCHSTORE_ERROR_ALLOC_FAIL);
         return NULL;
     }
     targ_mr->modified = 1;
@@ -685,6 +856,7 @@ node_pointer* complete_new_btree(couchfile_modify_result* mr, couchstore_error_t
 
     *errcode = mr_move_pointers(mr, targ_mr);
     if(*errcode != COUCHSTORE_SUCCESS) {
+        finish_writes(mr->rq, *errcode);
         return NULL;
     }
 
@@ -694,6 +866,7 @@ node_pointer* complete_new_btree(couchfile_modify_result* mr, couchstore_error_t
     } else {
         ret_ptr = targ_mr->values_end->pointer;
     }
+    *errcode = finish_writes(mr->rq, *errcode);
 
     if (*errcode != COUCHSTORE_SUCCESS || ret_ptr == NULL) {
         return NULL;
@@ -706,22 +879,151 @@ node_pointer* complete_new_btree(couchfile_modify_result* mr, couchstore_error_t
     return ret_ptr;
 }
 
+int btree_chunks_copyable(const tree_file *source, const tree_file *target)
+{
+    return source->chunk_codecs == target->chunk_codecs &&
+           source->crc32c == target->crc32c;
+}
+
+couchstore_error_t mr_push_raw_leaf(couchfile_modify_result *mr,
+                                    tree_file *source,
+                                    const node_pointer *ptr)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    tree_file *target = mr->rq->file;
+    char *chunk = NULL;
+    int size;
+    sized_buf buf;
+    cs_off_t pos;
+    size_t disk_size;
+    node_pointer *copy;
+    nodelist *pel;
+
+    error_pass(flush_mr(mr));
+    if (target->chunk_writer) {
+        //Keeps the nodes in the order their pointers are.
+        error_pass(chunk_writer_flush(target->chunk_writer, target));
+    }
+
+    size = pread_raw_chunk(source, ptr->pointer, &chunk);
+    error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+    buf.buf = chunk;
+    buf.size = size;
+    error_pass(static_cast<couchstore_error_t>(db_write_raw_chunk(target, &buf, &pos, &disk_size)));
+    PROBE4(node_flush, KV_NODE, 0, buf.size, pos);
+
+    copy = (node_pointer *) arena_alloc(mr->arena, sizeof(node_pointer) +
+                                        ptr->key.size + ptr->reduce_value.size);
+    error_unless(copy, COUCHSTORE_ERROR_ALLOC_FAIL);
+    copy->key.buf = ((char *)copy) + sizeof(node_pointer);
+    copy->key.size = ptr->key.size;
+    memcpy(copy->key.buf, ptr->key.buf, ptr->key.size);
+    copy->reduce_value.buf = copy->key.buf + ptr->key.size;
+    copy->reduce_value.size = ptr->reduce_value.size;
+    memcpy(copy->reduce_value.buf, ptr->reduce_value.buf, ptr->reduce_value.size);
+    //A leaf's subtree is just itself.
+    copy->subtreesize = disk_size;
+    copy->pointer = pos;
+
+    pel = encode_pointer(mr->arena, copy);
+    error_unless(pel, COUCHSTORE_ERROR_ALLOC_FAIL);
+    mr->pointers_end->next = pel;
+    mr->pointers_end = pel;
+
+cleanup:
+    cs_free(chunk);
+    return errcode;
+}
+
+static couchstore_error_t copy_leaves(couchfile_lookup_request *rq,
+                                      uint64_t pos,
+                                      const node_pointer *ptr,
+                                      int unchanged,
+                                      couchfile_modify_result *mr,
+                                      int (*unchanged_fn)(couchfile_lookup_request *rq,
+                                                          const node_pointer *ptr))
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    decoded_node *node = NULL;
+    unsigned i;
+
+    //A leaf to be copied only needs its type read, not its items.
+    error_pass(btree_read_node(rq->file, pos, !unchanged, &node));
+
+    if (node->buf[0] == KP_NODE) {
+        for (i = 0; i < node->count; ++i) {
+            const raw_node_pointer *raw = (const raw_node_pointer*)node->entries[i].value.buf;
+            node_pointer child;
+            child.key = node->entries[i].key;
+            child.pointer = decode_raw48(raw->pointer);
+            child.subtreesize = decode_raw48(raw->subtreesize);
+            child.reduce_value.buf = node->entries[i].value.buf + sizeof(*raw);
+            child.reduce_value.size = decode_raw16(raw->reduce_value_size);
+
+            int child_unchanged = unchanged;
+            if (!child_unchanged && unchanged_fn) {
+                child_unchanged = unchanged_fn(rq, &child);
+                error_unless(child_unchanged >= 0,
+                             static_cast<couchstore_error_t>(child_unchanged));
+            }
+            error_pass(copy_leaves(rq, child.pointer, &child, child_unchanged, mr,
+                                   unchanged_fn));
+        }
+    } else if (unchanged) {
+        error_pass(mr_push_raw_leaf(mr, rq->file, ptr));
+    } else {
+        for (i = 0; i < node->count; ++i) {
+            error_pass(rq->fetch_callback(rq, &node->entries[i].key,
+                                          &node->entries[i].value));
+        }
+    }
+
+cleanup:
+    node_release(rq->file->node_cache, node);
+    return errcode;
+}
+
+couchstore_error_t btree_copy_leaves(couchfile_lookup_request *rq,
+                                     uint64_t root_pointer,
+                                     couchfile_modify_result *mr,
+                                     int (*unchanged)(couchfile_lookup_request *rq,
+                                                      const node_pointer *ptr))
+{
+    if (!btree_chunks_copyable(rq->file, mr->rq->file)) {
+        unchanged = NULL;
+    }
+    return copy_leaves(rq, root_pointer, NULL, 0, mr, unchanged);
+}
+
 node_pointer *modify_btree(couchfile_modify_request *rq,
                            node_pointer *root,
                            couchstore_error_t *errcode)
 {
     arena* a = new_arena(0);
+    if (!a) {
+        *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+        return root;
+    }
+    node_pointer *ret_ptr = modify_btree_in_arena(rq, root, a, errcode);
+    delete_arena(a);
+    return ret_ptr;
+}
+
+static node_pointer *modify_tree(couchfile_modify_request *rq,
+                                 node_pointer *root,
+                                 arena *a,
+                                 couchstore_error_t *errcode)
+{
     node_pointer *ret_ptr = root;
     couchfile_modify_result *root_result = make_modres(a, rq);
     if (!root_result) {
-        delete_arena(a);
         *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
         return root;
     }
     root_result->node_type = KP_NODE;
     *errcode = modify_node(rq, root, 0, rq->num_actions, root_result);
     if (*errcode < 0) {
-        delete_arena(a);
+        finish_writes(rq, *errcode);
         return NULL;
     }
 
@@ -743,20 +1045,37 @@ node_pointer *modify_btree(couchfile_modify_request *rq,
             ret_ptr = root_result->values_end->pointer;
         }
     }
+    *errcode = finish_writes(rq, *errcode);
+    if (*errcode < 0) {
+        ret_ptr = NULL;
+    }
     if (ret_ptr != root) {
         ret_ptr = copy_node_pointer(ret_ptr);
     }
-    delete_arena(a);
+    return ret_ptr;
+}
+
+node_pointer *modify_btree_in_arena(couchfile_modify_request *rq,
+                                    node_pointer *root,
+                                    arena *a,
+                                    couchstore_error_t *errcode)
+{
+    OP_STATS_START(rq->file->op_stats);
+    node_pointer *ret_ptr = modify_tree(rq, root, a, errcode);
+    OP_STATS_END(rq->file->op_stats, tree_update);
     return ret_ptr;
 }
 
 static couchstore_error_t purge_node(couchfile_modify_request *rq,
                                      node_pointer *nptr,
+                                     const purge_plan *plan,
                                      couchfile_modify_result *dst)
 {
-    char *nodebuf = NULL;  // FYI, nodebuf is a malloced block, not in the arena
+    decoded_node *node = NULL;  // from the file's node cache, or read for us
+    const char *nodebuf = NULL;
     int bufpos = 1;
     int nodebuflen = 0;
+    int item = 0;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     couchfile_modify_result *local_result = NULL;
 
@@ -770,9 +1089,9 @@ static couchstore_error_t purge_node(couchfile_modify_request *rq,
         return mr_push_pointerinfo(nptr, dst);
     }
 
-    if ((nodebuflen = pread_compressed(rq->file, nptr->pointer, (char **) &nodebuf)) < 0) {
-        error_pass(COUCHSTORE_ERROR_READ);
-    }
+    error_pass(btree_read_node(rq->file, nptr->pointer, 0, &node));
+    nodebuf = node->buf;
+    nodebuflen = node->length;
 
     local_result = make_modres(dst->arena, rq);
     error_unless(local_result, COUCHSTORE_ERROR_ALLOC_FAIL);
@@ -783,7 +1102,7 @@ static couchstore_error_t purge_node(couchfile_modify_request *rq,
             sized_buf cmp_key, val_buf;
             bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
 
-            errcode = maybe_purgekv(rq, &cmp_key, &val_buf, local_result);
+            errcode = maybe_purgekv(rq, &cmp_key, &val_buf, plan, item++, local_result);
             if (errcode != COUCHSTORE_SUCCESS) {
                 goto cleanup;
             }
@@ -800,7 +1119,7 @@ static couchstore_error_t purge_node(couchfile_modify_request *rq,
                 goto cleanup;
             }
 
-            errcode = maybe_purgekp(rq, desc, local_result);
+            errcode = maybe_purgekp(rq, desc, plan, item++, local_result);
             if (errcode != COUCHSTORE_SUCCESS) {
                 goto cleanup;
             }
@@ -818,12 +1137,12 @@ static couchstore_error_t purge_node(couchfile_modify_request *rq,
     }
 
 cleanup:
-    free(nodebuf);
+    node_release(rq->file->node_cache, node);
     return errcode;
 }
 
-node_pointer *guided_purge_btree(couchfile_modify_request *rq, node_pointer *root,
-                                                couchstore_error_t *errcode)
+static node_pointer *purge_tree(couchfile_modify_request *rq, node_pointer *root,
+                                const purge_plan *plan, couchstore_error_t *errcode)
 {
     rq->enable_purging = 1;
     arena* a = new_arena(0);
@@ -841,7 +1160,8 @@ node_pointer *guided_purge_btree(couchfile_modify_request *rq, node_pointer *roo
     }
 
     root_result->node_type = KP_NODE;
-    *errcode = purge_node(rq, root, root_result);
+    *errcode = purge_node(rq, root, plan, root_result);
+    *errcode = finish_writes(rq, *errcode);
     if (*errcode < 0) {
         delete_arena(a);
         return NULL;
@@ -858,3 +1178,293 @@ node_pointer *guided_purge_btree(couchfile_modify_request *rq, node_pointer *roo
     delete_arena(a);
     return ret_ptr;
 }
+
+node_pointer *guided_purge_btree(couchfile_modify_request *rq, node_pointer *root,
+                                                couchstore_error_t *errcode)
+{
+    return purge_tree(rq, root, NULL, errcode);
+}
+
+// A subtree of the root the callbacks would purge some of, for a thread
+// to plan.
+typedef struct {
+    node_pointer *ptr;
+    purge_plan **plan;
+    couchstore_error_t errcode;
+} purge_job;
+
+typedef struct {
+    couchfile_modify_request *rq;
+    purge_job *jobs;
+    int num_jobs;
+    int next;
+    int stop_job;               // the first a callback stopped the purge in
+    int failed;
+    cb_mutex_t mutex;
+} purge_jobs;
+
+typedef struct {
+    purge_jobs *jobs;
+    void *ctx;
+    arena *plans;               // and the pointers they were made from
+    int stopped;
+    cb_thread_t thread;
+    int started;
+} purge_worker;
+
+static int count_items(const decoded_node *node)
+{
+    int bufpos = 1, count = 0;
+    while (bufpos < (int)node->length) {
+        sized_buf key, val;
+        bufpos += read_kv(node->buf + bufpos, &key, &val);
+        count++;
+    }
+    return count;
+}
+
+static purge_plan *make_plan(arena *a, int count)
+{
+    purge_plan *plan = static_cast<purge_plan *>(arena_alloc(a, sizeof(purge_plan)));
+    if (plan == NULL) {
+        return NULL;
+    }
+    plan->count = count;
+    plan->actions = static_cast<signed char *>(arena_alloc(a, count + 1));
+    plan->partial = static_cast<purge_plan **>(arena_alloc(a, (count + 1) * sizeof(purge_plan *)));
+    if (plan->actions == NULL || plan->partial == NULL) {
+        return NULL;
+    }
+    memset(plan->partial, 0, (count + 1) * sizeof(purge_plan *));
+    return plan;
+}
+
+// Calls the callbacks on the subtree's items as purge_node would, with the
+// worker's ctx, and notes what they made of them.
+static couchstore_error_t plan_node(purge_worker *worker, node_pointer *nptr,
+                                    purge_plan **pPlan)
+{
+    couchfile_modify_request *rq = worker->jobs->rq;
+    decoded_node *node = NULL;
+    purge_plan *plan = NULL;
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    int bufpos = 1, item = 0;
+
+    error_pass(btree_read_node(rq->file, nptr->pointer, 0, &node));
+    error_unless(node->buf[0] == KV_NODE || node->buf[0] == KP_NODE,
+                 COUCHSTORE_ERROR_CORRUPT);
+    plan = make_plan(worker->plans, count_items(node));
+    error_unless(plan, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    while (bufpos < (int)node->length) {
+        sized_buf cmp_key, val_buf;
+        int action = PURGE_KEEP;
+        bufpos += read_kv(node->buf + bufpos, &cmp_key, &val_buf);
+
+        if (worker->stopped) {
+            // The rest of the tree is kept, as the first PURGE_STOP has it.
+        } else if (node->buf[0] == KV_NODE) {
+            if (rq->purge_kv) {
+                action = rq->purge_kv(&cmp_key, &val_buf, worker->ctx);
+            }
+        } else {
+            node_pointer *desc = read_pointer(worker->plans, &cmp_key, val_buf.buf);
+            error_unless(desc, COUCHSTORE_ERROR_ALLOC_FAIL);
+            if (rq->purge_kp) {
+                action = rq->purge_kp(desc, worker->ctx);
+            }
+            if (action == PURGE_PARTIAL) {
+                error_pass(plan_node(worker, desc, &plan->partial[item]));
+            }
+        }
+        error_unless(action >= 0, static_cast<couchstore_error_t>(action));
+        if (action == PURGE_STOP) {
+            worker->stopped = 1;
+        }
+        plan->actions[item++] = static_cast<signed char>(action);
+    }
+    *pPlan = plan;
+
+cleanup:
+    node_release(rq->file->node_cache, node);
+    return errcode;
+}
+
+static void purge_worker_run(void *arg)
+{
+    purge_worker *worker = static_cast<purge_worker *>(arg);
+    purge_jobs *jobs = worker->jobs;
+
+    for (;;) {
+        int job = -1;
+
+        cb_mutex_enter(&jobs->mutex);
+        if (!jobs->failed && jobs->next < jobs->num_jobs && jobs->next < jobs->stop_job) {
+            job = jobs->next++;
+        }
+        cb_mutex_exit(&jobs->mutex);
+        if (job < 0) {
+            return;
+        }
+
+        // Jobs are taken in order, so once one is stopped in, those after
+        // it are past the stop and left alone.
+        purge_job *current = &jobs->jobs[job];
+        current->errcode = plan_node(worker, current->ptr, current->plan);
+        if (current->errcode != COUCHSTORE_SUCCESS || worker->stopped) {
+            cb_mutex_enter(&jobs->mutex);
+            if (current->errcode != COUCHSTORE_SUCCESS) {
+                jobs->failed = 1;
+            } else if (job < jobs->stop_job) {
+                jobs->stop_job = job;
+            }
+            cb_mutex_exit(&jobs->mutex);
+            return;
+        }
+    }
+}
+
+node_pointer *guided_purge_btree_parallel(couchfile_modify_request *rq,
+                                          node_pointer *root,
+                                          int nthreads,
+                                          void **thread_ctxs,
+                                          couchstore_error_t *errcode)
+{
+    node_pointer *ret_ptr = NULL;
+    decoded_node *node = NULL;
+    purge_plan *plan = NULL;
+    purge_jobs jobs;
+    purge_worker *workers = NULL;
+    cb_mutex_t io_mutex;
+    int bufpos = 1, item = 0, stopped = 0, ii;
+    arena *a = NULL;
+
+    if (nthreads <= 1 || root == NULL) {
+        return guided_purge_btree(rq, root, errcode);
+    }
+
+    memset(&jobs, 0, sizeof(jobs));
+    cb_mutex_initialize(&jobs.mutex);
+    cb_mutex_initialize(&io_mutex);
+    jobs.rq = rq;
+
+    a = new_arena(0);
+    if (!a) {
+        *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+        goto cleanup;
+    }
+    *errcode = btree_read_node(rq->file, root->pointer, 0, &node);
+    if (*errcode != COUCHSTORE_SUCCESS) {
+        goto cleanup;
+    }
+    if (node->buf[0] != KP_NODE) {
+        // A single leaf, with nothing to share out.
+        ret_ptr = guided_purge_btree(rq, root, errcode);
+        goto cleanup;
+    }
+
+    // The root's children are decided on here, with the request's own ctx,
+    // and those to be purged some of are the jobs.
+    plan = make_plan(a, count_items(node));
+    jobs.jobs = static_cast<purge_job *>(arena_alloc(a, (plan ? plan->count + 1 : 1) * sizeof(purge_job)));
+    if (plan == NULL || jobs.jobs == NULL) {
+        *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+        goto cleanup;
+    }
+    while (bufpos < (int)node->length) {
+        sized_buf cmp_key, val_buf;
+        int action = PURGE_KEEP;
+        bufpos += read_kv(node->buf + bufpos, &cmp_key, &val_buf);
+
+        node_pointer *desc = read_pointer(a, &cmp_key, val_buf.buf);
+        if (desc == NULL) {
+            *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+            goto cleanup;
+        }
+        if (!stopped && rq->purge_kp) {
+            action = rq->purge_kp(desc, rq->guided_purge_ctx);
+        }
+        if (action < 0) {
+            *errcode = static_cast<couchstore_error_t>(action);
+            goto cleanup;
+        }
+        if (action == PURGE_STOP) {
+            stopped = 1;
+        } else if (action == PURGE_PARTIAL) {
+            jobs.jobs[jobs.num_jobs].ptr = desc;
+            jobs.jobs[jobs.num_jobs].plan = &plan->partial[item];
+            jobs.jobs[jobs.num_jobs].errcode = COUCHSTORE_SUCCESS;
+            jobs.num_jobs++;
+        }
+        plan->actions[item++] = static_cast<signed char>(action);
+    }
+    jobs.stop_job = jobs.num_jobs;
+
+    if (nthreads > jobs.num_jobs) {
+        nthreads = jobs.num_jobs > 0 ? jobs.num_jobs : 1;
+    }
+    workers = static_cast<purge_worker *>(cs_calloc(nthreads, sizeof(purge_worker)));
+    if (workers == NULL) {
+        *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+        goto cleanup;
+    }
+    for (ii = 0; ii < nthreads; ii++) {
+        workers[ii].jobs = &jobs;
+        workers[ii].ctx = thread_ctxs[ii];
+        workers[ii].plans = new_arena(0);
+        if (workers[ii].plans == NULL) {
+            *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+            goto cleanup;
+        }
+    }
+
+    // The threads take turns to read the file, as only this one writes to
+    // it, once they're done; the calling thread plans too, and all of it
+    // if no other thread could be started.
+    if (rq->file->io_mutex == NULL && nthreads > 1) {
+        rq->file->io_mutex = &io_mutex;
+    }
+    for (ii = 1; ii < nthreads; ii++) {
+        workers[ii].started =
+            cb_create_thread(&workers[ii].thread, purge_worker_run, &workers[ii], 0) == 0;
+    }
+    purge_worker_run(&workers[0]);
+    for (ii = 1; ii < nthreads; ii++) {
+        if (workers[ii].started) {
+            cb_join_thread(workers[ii].thread);
+        }
+    }
+    if (rq->file->io_mutex == &io_mutex) {
+        rq->file->io_mutex = NULL;
+    }
+    // A job past the stop might have failed where a serial purge would
+    // never have got to it.
+    for (ii = 0; ii < jobs.num_jobs && ii <= jobs.stop_job; ii++) {
+        if (jobs.jobs[ii].errcode != COUCHSTORE_SUCCESS) {
+            *errcode = jobs.jobs[ii].errcode;
+            goto cleanup;
+        }
+    }
+
+    // Everything is written from here, in the order a serial purge would.
+    ret_ptr = purge_tree(rq, root, plan, errcode);
+
+cleanup:
+    if (workers != NULL) {
+        for (ii = 0; ii < nthreads; ii++) {
+            if (workers[ii].plans != NULL) {
+                delete_arena(workers[ii].plans);
+            }
+        }
+        cs_free(workers);
+    }
+    if (node != NULL) {
+        node_release(rq->file->node_cache, node);
+    }
+    if (a != NULL) {
+        delete_arena(a);
+    }
+    cb_mutex_destroy(&io_mutex);
+    cb_mutex_destroy(&jobs.mutex);
+    return ret_ptr;
+}
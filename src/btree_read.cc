@@ -4,6 +4,13 @@
 #include "couch_btree.h"
 #include "util.h"
 #include "node_types.h"
+#include "node_cache.h"
+#include "op_stats.h"
+
+// How much of the file to ask for at each child pointer when prefetching.
+// Nodes are written once they pass CHUNK_THRESHOLD (1279 bytes), so this
+// covers one, block prefixes included, with room to spare.
+#define NODE_PREFETCH_SIZE 8192
 
 /* Helper function to handle lookup specific special cases */
 static int lookup_compare(couchfile_lookup_request *rq,
@@ -21,30 +28,196 @@ static int lookup_compare(couchfile_lookup_request *rq,
             return 0;
         }
 
-        return rq->cmp.compare(key1, key2);
+        return compare_keys(&rq->cmp, key1, key2);
+}
+
+// Interior nodes read from the file are added to the cache; leaves are too
+// numerous to be worth keeping.
+couchstore_error_t btree_read_node(tree_file *file, uint64_t diskpos,
+                                   int split_leaves, decoded_node **pNode)
+{
+    if (!file->node_cache && file->node_cache_size > 0) {
+        // Created on first use; a failure just means reading uncached.
+        tree_file_lock(file);
+        if (!file->node_cache) {
+            file->node_cache = node_cache_create(file->node_cache_size);
+        }
+        tree_file_unlock(file);
+    }
+    node_cache *cache = file->node_cache;
+    if (cache && (*pNode = node_cache_get(cache, diskpos)) != NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    char *nodebuf = NULL;
+    OP_STATS_START(file->op_stats);
+    int nodebuflen = pread_node(file, diskpos, &nodebuf);
+    if (nodebuflen < 0) {  // if negative, it's an error code
+        return static_cast<couchstore_error_t>(nodebuflen);
+    }
+    OP_STATS_LAP(file->op_stats, node_read);
+    int flags = DECODE_POOLED_BUF | (split_leaves ? 0 : DECODE_UNSPLIT_LEAF);
+    couchstore_error_t errcode = decode_node(nodebuf, nodebuflen, flags, pNode);
+    OP_STATS_END(file->op_stats, node_decode);
+    if (errcode == COUCHSTORE_SUCCESS && cache && (*pNode)->buf[0] == KP_NODE) {
+        node_cache_put(cache, diskpos, *pNode);
+    }
+    return errcode;
+}
+
+static couchstore_error_t read_node(tree_file *file, uint64_t diskpos,
+                                    decoded_node **pNode)
+{
+    return btree_read_node(file, diskpos, 1, pNode);
+}
+
+couchstore_error_t btree_warm(tree_file *file, uint64_t root_pointer, unsigned levels)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    decoded_node *node = NULL;
+    unsigned i;
+
+    if (levels == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    error_pass(read_node(file, root_pointer, &node));
+    if (node->buf[0] == KP_NODE && levels > 1) {
+        for (i = 0; i < node->count; i++) {
+            const raw_node_pointer *raw = (const raw_node_pointer*)node->entries[i].value.buf;
+            error_pass(btree_warm(file, decode_raw48(raw->pointer), levels - 1));
+        }
+    }
+cleanup:
+    if (node != NULL) {
+        node_release(file->node_cache, node);
+    }
+    return errcode;
+}
+
+// lower_bound for the default comparator, which it calls in line: through
+// a function pointer, the call costs as much again as the comparison.
+static unsigned ebin_lower_bound(const decoded_node *node,
+                                 unsigned lo,
+                                 const sized_buf *key)
+{
+    unsigned hi = node->count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (ebin_compare(&node->entries[mid].key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Binary-searches a node, from entry 'from' on, for the first entry whose key
+// isn't less than 'key'. Returns the node's count if there's none.
+static unsigned lower_bound(couchfile_lookup_request *rq,
+                            const decoded_node *node,
+                            unsigned from,
+                            const sized_buf *key)
+{
+    if (rq->cmp.compare == ebin_cmp && key->size) {
+        // (lookup_compare's special case for empty keys agrees with ebin_cmp
+        // as long as the key itself isn't empty)
+        return ebin_lower_bound(node, from, key);
+    }
+    unsigned lo = from, hi = node->count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (lookup_compare(rq, &node->entries[mid].key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Asks the OS to start reading every child of a KP node that the keys from
+// 'current' to 'end' are going to descend into, so that the reads overlap
+// rather than each waiting for the last. Runs of children that lie close
+// together are advised as one range. Advice is only a hint, so failures are
+// ignored.
+static void prefetch_children(couchfile_lookup_request *rq,
+                              const decoded_node *node,
+                              int current,
+                              int end)
+{
+    tree_file *file = rq->file;
+    couchstore_error_info_t ignored;
+    cs_off_t start = 0, stop = 0;
+    unsigned i = 0, nchildren = 0;
+
+    if (file->map) {
+        return;
+    }
+    while (current < end) {
+        i = lower_bound(rq, node, i, rq->keys[current]);
+        if (i == node->count) {
+            break;
+        }
+        const sized_buf *key = &node->entries[i].key;
+        const raw_node_pointer *raw = (const raw_node_pointer*)node->entries[i].value.buf;
+        cs_off_t pointer = decode_raw48(raw->pointer);
+        if (nchildren > 0 && pointer >= start && pointer <= stop) {
+            if (pointer + NODE_PREFETCH_SIZE > stop) {
+                stop = pointer + NODE_PREFETCH_SIZE;
+            }
+        } else {
+            if (nchildren > 0) {
+                file->ops->advise(&ignored, file->handle, start, stop - start,
+                                  COUCHSTORE_FILE_ADVICE_WILLNEED);
+            }
+            start = pointer;
+            stop = pointer + NODE_PREFETCH_SIZE;
+        }
+        ++nchildren;
+
+        do {
+            ++current;
+        } while (current < end && lookup_compare(rq, key, rq->keys[current]) >= 0);
+        ++i;
+    }
+    // A single child is about to be read anyway.
+    if (nchildren > 1) {
+        file->ops->advise(&ignored, file->handle, start, stop - start,
+                          COUCHSTORE_FILE_ADVICE_WILLNEED);
+    }
 }
 
 static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                                              uint64_t diskpos,
                                              int current,
-                                             int end)
+                                             int end,
+                                             int prefetch)
 {
-    int bufpos = 1, nodebuflen = 0;
+    unsigned i;
 
     if (current == end) {
         return COUCHSTORE_SUCCESS;
     }
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
-    char *nodebuf = NULL;
-
-    nodebuflen = pread_compressed(rq->file, diskpos, &nodebuf);
-    error_unless(nodebuflen >= 0, (static_cast<couchstore_error_t>(nodebuflen)));  // if negative, it's an error code
+    decoded_node *node = NULL;
+    error_pass(read_node(rq->file, diskpos, &node));
 
-    if (nodebuf[0] == 0) { //KP Node
-        while (bufpos < nodebuflen && current < end) {
-            sized_buf cmp_key, val_buf;
-            bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+    if (node->buf[0] == KP_NODE) {
+        if (prefetch && !rq->fold && end - current > 1) {
+            prefetch_children(rq, node, current, end);
+        }
+        for (i = 0; i < node->count && current < end; ++i) {
+            if (!rq->in_fold) {
+                // Entries with keys below the current one lead nowhere.
+                i = lower_bound(rq, node, i, rq->keys[current]);
+                if (i == node->count) {
+                    break;
+                }
+            }
+            sized_buf cmp_key = node->entries[i].key;
+            sized_buf val_buf = node->entries[i].value;
 
             if (lookup_compare(rq, &cmp_key, rq->keys[current]) >= 0) {
                 if (rq->fold) {
@@ -60,15 +233,19 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                 } while (last_item < end && lookup_compare(rq, &cmp_key, rq->keys[last_item]) >= 0);
 
                 const raw_node_pointer *raw = (const raw_node_pointer*)val_buf.buf;
+                int skip = 0;
                 if(rq->node_callback) {
                     uint64_t subtreeSize = decode_raw48(raw->subtreesize);
                     sized_buf reduce_value =
                     {val_buf.buf + sizeof(raw_node_pointer), decode_raw16(raw->reduce_value_size)};
                     error_pass(rq->node_callback(rq, subtreeSize, &reduce_value));
+                    skip = errcode == BTREE_SKIP_SUBTREE;
                 }
 
                 pointer = decode_raw48(raw->pointer);
-                error_pass(btree_lookup_inner(rq, pointer, current, last_item));
+                if (!skip) {
+                    error_pass(btree_lookup_inner(rq, pointer, current, last_item, prefetch));
+                }
                 if (!rq->in_fold) {
                     current = last_item;
                 }
@@ -77,10 +254,17 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
                 }
             }
         }
-    } else if (nodebuf[0] == 1) { //KV Node
-        while (bufpos < nodebuflen && current < end) {
-            sized_buf cmp_key, val_buf;
-            bufpos += read_kv(nodebuf + bufpos, &cmp_key, &val_buf);
+    } else if (node->buf[0] == KV_NODE) {
+        for (i = 0; i < node->count && current < end; ++i) {
+            if (!rq->in_fold) {
+                // Neither a match nor the start of a fold.
+                i = lower_bound(rq, node, i, rq->keys[current]);
+                if (i == node->count) {
+                    break;
+                }
+            }
+            sized_buf cmp_key = node->entries[i].key;
+            sized_buf val_buf = node->entries[i].value;
             int cmp_val = lookup_compare(rq, &cmp_key, rq->keys[current]);
             if (cmp_val >= 0 && rq->fold && !rq->in_fold) {
                 rq->in_fold = 1;
@@ -109,8 +293,69 @@ static couchstore_error_t btree_lookup_inner(couchfile_lookup_request *rq,
     }
 
 cleanup:
-    free(nodebuf);
+    node_release(rq->file->node_cache, node);
+
+    return errcode;
+}
+
+// Calls back for the keys from high down to low, either of which may be
+// NULL for no limit.
+static couchstore_error_t lookup_descending(couchfile_lookup_request *rq,
+                                            uint64_t diskpos,
+                                            const sized_buf *high,
+                                            const sized_buf *low)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    decoded_node *node = NULL;
+    unsigned i;
+
+    error_pass(read_node(rq->file, diskpos, &node));
+
+    // Find the end of the entries to visit. A KP entry's subtree holds keys
+    // up to and including its own, so the first entry >= high is included.
+    i = node->count;
+    if (high) {
+        i = lower_bound(rq, node, 0, high);
+        if (i < node->count && (node->buf[0] == KP_NODE ||
+                                lookup_compare(rq, &node->entries[i].key, high) == 0)) {
+            ++i;
+        }
+    }
 
+    if (node->buf[0] == KP_NODE) {
+        while (i-- > 0) {
+            const raw_node_pointer *raw = (const raw_node_pointer*)node->entries[i].value.buf;
+            int skip = 0;
+            if (rq->node_callback) {
+                sized_buf reduce_value = { node->entries[i].value.buf + sizeof(raw_node_pointer),
+                                           decode_raw16(raw->reduce_value_size) };
+                error_pass(rq->node_callback(rq, decode_raw48(raw->subtreesize), &reduce_value));
+                skip = errcode == BTREE_SKIP_SUBTREE;
+            }
+            if (!skip) {
+                error_pass(lookup_descending(rq, decode_raw48(raw->pointer), high, low));
+            }
+            if (rq->node_callback) {
+                error_pass(rq->node_callback(rq, 0, NULL));
+            }
+            // Only the first subtree visited can hold keys above high.
+            high = NULL;
+            if (low && i > 0 && lookup_compare(rq, &node->entries[i - 1].key, low) < 0) {
+                break;
+            }
+        }
+    } else if (node->buf[0] == KV_NODE) {
+        while (i-- > 0) {
+            if (low && lookup_compare(rq, &node->entries[i].key, low) < 0) {
+                break;
+            }
+            error_pass(rq->fetch_callback(rq, &node->entries[i].key,
+                                          &node->entries[i].value));
+        }
+    }
+
+cleanup:
+    node_release(rq->file->node_cache, node);
     return errcode;
 }
 
@@ -118,5 +363,305 @@ couchstore_error_t btree_lookup(couchfile_lookup_request *rq,
                                 uint64_t root_pointer)
 {
     rq->in_fold = 0;
-    return btree_lookup_inner(rq, root_pointer, 0, rq->num_keys);
+    return btree_lookup_inner(rq, root_pointer, 0, rq->num_keys, 0);
+}
+
+couchstore_error_t btree_lookup_batched(couchfile_lookup_request *rq,
+                                        uint64_t root_pointer)
+{
+    rq->in_fold = 0;
+    return btree_lookup_inner(rq, root_pointer, 0, rq->num_keys, 1);
+}
+
+couchstore_error_t btree_lookup_descending(couchfile_lookup_request *rq,
+                                           uint64_t root_pointer)
+{
+    const sized_buf *high = rq->keys[0];
+    const sized_buf *low = rq->num_keys > 1 ? rq->keys[1] : NULL;
+    rq->in_fold = 1;
+    return lookup_descending(rq, root_pointer,
+                             high->size ? high : NULL,
+                             low && low->size ? low : NULL);
+}
+
+/* Counting */
+
+// Like lower_bound, for a counting request.
+static unsigned count_lower_bound(const btree_count_request *rq,
+                                  const decoded_node *node,
+                                  const sized_buf *key)
+{
+    if (rq->compare == ebin_cmp) {
+        return ebin_lower_bound(node, 0, key);
+    }
+    unsigned lo = 0, hi = node->count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (rq->compare(&node->entries[mid].key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Items counted under entry i of a node, from the reduce value if it's
+// interior.
+static uint64_t entry_count(const btree_count_request *rq,
+                            const decoded_node *node,
+                            unsigned i)
+{
+    const node_entry *entry = &node->entries[i];
+    if (node->buf[0] == KV_NODE) {
+        return rq->item_count(&entry->key, &entry->value, rq->ctx);
+    }
+    sized_buf reduce = { entry->value.buf + sizeof(raw_node_pointer),
+                         entry->value.size - sizeof(raw_node_pointer) };
+    return rq->reduce_count(&reduce, rq->ctx);
+}
+
+// Adds up the items between low and high in the subtree at pos. Children
+// that lie wholly inside the range are counted from their reduce values;
+// only the ones a bound falls in are read.
+static couchstore_error_t count_range(const btree_count_request *rq,
+                                      uint64_t pos,
+                                      const sized_buf *low,
+                                      const sized_buf *high,
+                                      uint64_t *count)
+{
+    decoded_node *node;
+    couchstore_error_t errcode = read_node(rq->file, pos, &node);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    unsigned first = low ? count_lower_bound(rq, node, low) : 0;
+    for (unsigned i = first; i < node->count; ++i) {
+        int cmp_high = high ? rq->compare(&node->entries[i].key, high) : -1;
+        if (node->buf[0] == KV_NODE) {
+            if (cmp_high > 0) {
+                break;
+            }
+            *count += entry_count(rq, node, i);
+        } else if ((i == first && low) || cmp_high > 0) {
+            const raw_node_pointer *raw = (const raw_node_pointer*)node->entries[i].value.buf;
+            errcode = count_range(rq, decode_raw48(raw->pointer),
+                                  i == first ? low : NULL,
+                                  cmp_high > 0 ? high : NULL,
+                                  count);
+            if (errcode != COUCHSTORE_SUCCESS) {
+                break;
+            }
+        } else {
+            *count += entry_count(rq, node, i);
+        }
+        if (cmp_high >= 0) {
+            break;
+        }
+    }
+    node_release(rq->file->node_cache, node);
+    return errcode;
+}
+
+couchstore_error_t btree_count_range(const btree_count_request *rq,
+                                     uint64_t root_pointer,
+                                     const sized_buf *low,
+                                     const sized_buf *high,
+                                     uint64_t *count)
+{
+    *count = 0;
+    return count_range(rq, root_pointer, low, high, count);
+}
+
+couchstore_error_t btree_find_nth(const btree_count_request *rq,
+                                  uint64_t root_pointer,
+                                  uint64_t rank,
+                                  btree_nth_callback callback,
+                                  void *callback_ctx)
+{
+    uint64_t pos = root_pointer;
+    for (;;) {
+        decoded_node *node;
+        couchstore_error_t errcode = read_node(rq->file, pos, &node);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+        unsigned i;
+        for (i = 0; i < node->count; ++i) {
+            uint64_t n = entry_count(rq, node, i);
+            if (rank < n) {
+                break;
+            }
+            rank -= n;
+        }
+        if (i == node->count) {
+            node_release(rq->file->node_cache, node);
+            return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+        }
+        const node_entry *entry = &node->entries[i];
+        if (node->buf[0] == KV_NODE) {
+            errcode = callback(&entry->key, &entry->value, callback_ctx);
+            node_release(rq->file->node_cache, node);
+            return errcode;
+        }
+        pos = decode_raw48(((const raw_node_pointer*)entry->value.buf)->pointer);
+        node_release(rq->file->node_cache, node);
+    }
+}
+
+/* Cursor */
+
+typedef struct {
+    decoded_node *node;
+    unsigned index;         // the child being walked, or the next KV entry
+} cursor_level;
+
+struct btree_cursor {
+    tree_file *file;
+    compare_callback compare;
+    cursor_level *path;     // from the root down
+    unsigned depth;
+    unsigned capacity;
+};
+
+static void cursor_pop(btree_cursor *cursor)
+{
+    --cursor->depth;
+    node_release(cursor->file->node_cache, cursor->path[cursor->depth].node);
+}
+
+// Reads a node onto the path, at its first entry >= key.
+static couchstore_error_t cursor_push(btree_cursor *cursor, uint64_t pos,
+                                      const sized_buf *key)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    decoded_node *node = NULL;
+    unsigned lo = 0, hi;
+
+    if (cursor->depth == cursor->capacity) {
+        unsigned capacity = cursor->capacity ? 2 * cursor->capacity : 8;
+        cursor_level *path = static_cast<cursor_level *>(cs_realloc(cursor->path,
+                                                                 capacity * sizeof(cursor_level)));
+        error_unless(path, COUCHSTORE_ERROR_ALLOC_FAIL);
+        cursor->path = path;
+        cursor->capacity = capacity;
+    }
+
+    error_pass(read_node(cursor->file, pos, &node));
+    error_unless(node->buf[0] == KP_NODE || node->buf[0] == KV_NODE,
+                 COUCHSTORE_ERROR_CORRUPT);
+    for (hi = node->count; key && lo < hi; ) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (cursor->compare(&node->entries[mid].key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    cursor->path[cursor->depth].node = node;
+    cursor->path[cursor->depth].index = lo;
+    ++cursor->depth;
+    node = NULL;
+
+cleanup:
+    node_release(cursor->file->node_cache, node);
+    return errcode;
+}
+
+// Walks down from the node at pos to the leaf holding the first key >= key.
+static couchstore_error_t cursor_descend(btree_cursor *cursor, uint64_t pos,
+                                         const sized_buf *key)
+{
+    for (;;) {
+        couchstore_error_t errcode = cursor_push(cursor, pos, key);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+        cursor_level *top = &cursor->path[cursor->depth - 1];
+        if (top->node->buf[0] == KV_NODE || top->index == top->node->count) {
+            return COUCHSTORE_SUCCESS;
+        }
+        const raw_node_pointer *raw =
+            (const raw_node_pointer*)top->node->entries[top->index].value.buf;
+        pos = decode_raw48(raw->pointer);
+    }
+}
+
+couchstore_error_t btree_cursor_create(tree_file *file,
+                                       compare_callback compare,
+                                       btree_cursor **pCursor)
+{
+    btree_cursor *cursor = static_cast<btree_cursor *>(cs_calloc(1, sizeof(btree_cursor)));
+    if (cursor == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    cursor->file = file;
+    cursor->compare = compare;
+    *pCursor = cursor;
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t btree_cursor_seek(btree_cursor *cursor,
+                                     const node_pointer *root,
+                                     const sized_buf *key)
+{
+    while (cursor->depth > 0) {
+        cursor_pop(cursor);
+    }
+    if (root == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    couchstore_error_t errcode = cursor_descend(cursor, root->pointer, key);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        // A partial path would resume from the wrong place.
+        while (cursor->depth > 0) {
+            cursor_pop(cursor);
+        }
+    }
+    return errcode;
+}
+
+couchstore_error_t btree_cursor_next(btree_cursor *cursor,
+                                     sized_buf *key,
+                                     sized_buf *value,
+                                     int *found)
+{
+    while (cursor->depth > 0) {
+        cursor_level *top = &cursor->path[cursor->depth - 1];
+        if (top->index == top->node->count) {
+            // Done with this node; move on to its parent's next child.
+            cursor_pop(cursor);
+            if (cursor->depth > 0) {
+                ++cursor->path[cursor->depth - 1].index;
+            }
+        } else if (top->node->buf[0] == KV_NODE) {
+            *key = top->node->entries[top->index].key;
+            *value = top->node->entries[top->index].value;
+            ++top->index;
+            *found = 1;
+            return COUCHSTORE_SUCCESS;
+        } else {
+            const raw_node_pointer *raw =
+                (const raw_node_pointer*)top->node->entries[top->index].value.buf;
+            couchstore_error_t errcode = cursor_descend(cursor,
+                                                        decode_raw48(raw->pointer),
+                                                        NULL);
+            if (errcode != COUCHSTORE_SUCCESS) {
+                return errcode;
+            }
+        }
+    }
+    *found = 0;
+    return COUCHSTORE_SUCCESS;
+}
+
+void btree_cursor_free(btree_cursor *cursor)
+{
+    if (cursor) {
+        while (cursor->depth > 0) {
+            cursor_pop(cursor);
+        }
+        cs_free(cursor->path);
+        cs_free(cursor);
+    }
 }
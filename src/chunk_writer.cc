@@ -0,0 +1,325 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Compression of chunks on worker threads.
+//
+// Saving a batch spends much of its time compressing each body
+// and node before it's appended. Chunks go into a ring of slots; workers
+// compress them in queue order, and the calling thread writes out the
+// finished ones from the head, so the file layout is the same as without
+// the writer. When the ring is full the caller waits for the oldest chunk,
+// which bounds the memory held by chunks not yet written.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "chunk_writer.h"
+#include "codec.h"
+#include "util.h"
+
+// Ring slots per worker thread:
+#define SLOTS_PER_THREAD 4
+
+typedef struct {
+    const char *buf;
+    size_t size;
+    int owned;                      // buf is freed once it's compressed
+    int compress;
+    unsigned codec;                 // chunk codec, picked when queued
+    const tree_file *file;          // for the codec's dictionary
+    char *compressed;
+    size_t compressed_size;
+    // Where the position goes once written:
+    cs_off_t *pos;
+    size_t *disk_size;
+    node_pointer *ptr;
+    raw_node_pointer *raw;
+    // Ready to be written; set at once for chunks that aren't compressed:
+    int done;
+} chunk_job;
+
+struct chunk_writer {
+    cb_mutex_t mutex;
+    cb_cond_t work_cond;            // workers wait here for chunks
+    cb_cond_t done_cond;            // the caller waits here for compression
+    chunk_job *slots;
+    unsigned nslots;
+    // Positions in the queue; slot of position n is n % nslots:
+    uint64_t head;                  // oldest chunk not yet written
+    uint64_t next;                  // next chunk for a worker to look at
+    uint64_t tail;                  // where the next chunk is queued
+    unsigned compressing;
+    int shutdown;
+    cb_thread_t *threads;
+    unsigned nthreads;
+};
+
+static void free_job(chunk_job *job)
+{
+    if (job->owned) {
+        cs_free((char *)job->buf);
+    }
+    cs_free(job->compressed);
+    job->buf = NULL;
+    job->compressed = NULL;
+}
+
+static void compress_worker(void *arg)
+{
+    chunk_writer *writer = static_cast<chunk_writer *>(arg);
+
+    cb_mutex_enter(&writer->mutex);
+    while (!writer->shutdown) {
+        if (writer->next == writer->tail) {
+            cb_cond_wait(&writer->work_cond, &writer->mutex);
+            continue;
+        }
+        chunk_job *job = &writer->slots[writer->next++ % writer->nslots];
+        if (job->done) {
+            continue;
+        }
+        ++writer->compressing;
+        cb_mutex_exit(&writer->mutex);
+
+        // A failed allocation or compression is reported when the chunk is
+        // written.
+        job->compressed = static_cast<char *>(cs_malloc(codec_max_compressed_length(job->codec,
+                                                                                 job->size)));
+        if (job->compressed &&
+            codec_compress(job->file, job->codec, job->buf, job->size,
+                           job->compressed, &job->compressed_size) != COUCHSTORE_SUCCESS) {
+            cs_free(job->compressed);
+            job->compressed = NULL;
+        }
+        if (job->owned) {
+            cs_free((char *)job->buf);
+            job->buf = NULL;
+        }
+
+        cb_mutex_enter(&writer->mutex);
+        job->done = 1;
+        --writer->compressing;
+        cb_cond_broadcast(&writer->done_cond);
+    }
+    cb_mutex_exit(&writer->mutex);
+}
+
+couchstore_error_t chunk_writer_create(unsigned threads, chunk_writer **pWriter)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    chunk_writer *writer;
+    unsigned i;
+
+    error_unless(threads > 0, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    writer = static_cast<chunk_writer *>(cs_calloc(1, sizeof(*writer)));
+    error_unless(writer, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cb_mutex_initialize(&writer->mutex);
+    cb_cond_initialize(&writer->work_cond);
+    cb_cond_initialize(&writer->done_cond);
+
+    writer->nslots = threads * SLOTS_PER_THREAD;
+    writer->slots = static_cast<chunk_job *>(cs_calloc(writer->nslots, sizeof(chunk_job)));
+    writer->threads = static_cast<cb_thread_t *>(cs_calloc(threads, sizeof(cb_thread_t)));
+    if (!writer->slots || !writer->threads) {
+        chunk_writer_destroy(writer);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    for (i = 0; i < threads; ++i) {
+        if (cb_create_thread(&writer->threads[i], compress_worker, writer, 0) != 0) {
+            chunk_writer_destroy(writer);
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        ++writer->nthreads;
+    }
+    *pWriter = writer;
+
+cleanup:
+    return errcode;
+}
+
+void chunk_writer_destroy(chunk_writer *writer)
+{
+    unsigned i;
+
+    if (writer == NULL) {
+        return;
+    }
+    chunk_writer_discard(writer);
+
+    cb_mutex_enter(&writer->mutex);
+    writer->shutdown = 1;
+    cb_cond_broadcast(&writer->work_cond);
+    cb_mutex_exit(&writer->mutex);
+    for (i = 0; i < writer->nthreads; ++i) {
+        cb_join_thread(writer->threads[i]);
+    }
+
+    cs_free(writer->threads);
+    cs_free(writer->slots);
+    cb_cond_destroy(&writer->work_cond);
+    cb_cond_destroy(&writer->done_cond);
+    cb_mutex_destroy(&writer->mutex);
+    cs_free(writer);
+}
+
+// Appends a finished chunk and stores its position.
+static couchstore_error_t write_job(chunk_job *job, tree_file *file)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf to_write;
+    cs_off_t pos;
+    size_t disk_size;
+    unsigned codec = CHUNK_CODEC_SNAPPY;
+
+    if (job->compress) {
+        error_unless(job->compressed, COUCHSTORE_ERROR_ALLOC_FAIL);
+        to_write.buf = job->compressed;
+        to_write.size = job->compressed_size;
+        codec = job->codec;
+    } else {
+        to_write.buf = (char *)job->buf;
+        to_write.size = job->size;
+    }
+    error_pass(static_cast<couchstore_error_t>(db_write_chunk(file, &to_write, codec,
+                                                                &pos, &disk_size)));
+
+    if (job->pos) {
+        *job->pos = pos;
+        *job->disk_size = disk_size;
+    }
+    if (job->ptr) {
+        job->ptr->pointer = pos;
+        job->ptr->subtreesize += disk_size;
+        job->raw->pointer = encode_raw48(job->ptr->pointer);
+        job->raw->subtreesize = encode_raw48(job->ptr->subtreesize);
+    }
+
+cleanup:
+    free_job(job);
+    return errcode;
+}
+
+// Writes out chunks from the head of the queue as long as they are
+// finished, waiting for those before position until.
+static couchstore_error_t write_queued(chunk_writer *writer, tree_file *file, uint64_t until)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+
+    cb_mutex_enter(&writer->mutex);
+    while (writer->head < writer->tail && errcode == COUCHSTORE_SUCCESS) {
+        chunk_job *job = &writer->slots[writer->head % writer->nslots];
+        if (!job->done) {
+            if (writer->head >= until) {
+                break;
+            }
+            cb_cond_wait(&writer->done_cond, &writer->mutex);
+            continue;
+        }
+        // Workers never touch a finished job, so it's written without
+        // holding the mutex.
+        cb_mutex_exit(&writer->mutex);
+        errcode = write_job(job, file);
+        cb_mutex_enter(&writer->mutex);
+        job->done = 0;
+        ++writer->head;
+        if (writer->next < writer->head) {
+            writer->next = writer->head;
+        }
+    }
+    cb_mutex_exit(&writer->mutex);
+    return errcode;
+}
+
+static couchstore_error_t queue_job(chunk_writer *writer, tree_file *file,
+                                    const chunk_job *job)
+{
+    couchstore_error_t errcode;
+
+    if (writer->tail - writer->head == writer->nslots) {
+        // Full: wait for the oldest chunk to make room.
+        errcode = write_queued(writer, file, writer->head + 1);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+
+    cb_mutex_enter(&writer->mutex);
+    writer->slots[writer->tail % writer->nslots] = *job;
+    ++writer->tail;
+    if (!job->done) {
+        cb_cond_signal(&writer->work_cond);
+    }
+    cb_mutex_exit(&writer->mutex);
+
+    return write_queued(writer, file, writer->head);
+}
+
+couchstore_error_t chunk_writer_add_node(chunk_writer *writer,
+                                         tree_file *file,
+                                         char *buf,
+                                         size_t size,
+                                         node_pointer *ptr,
+                                         raw_node_pointer *raw)
+{
+    chunk_job job;
+    memset(&job, 0, sizeof(job));
+    job.buf = buf;
+    job.size = size;
+    job.owned = 1;
+    job.compress = 1;
+    job.codec = tree_file_chunk_codec(file, file->node_codec);
+    job.file = file;
+    job.ptr = ptr;
+    job.raw = raw;
+
+    couchstore_error_t errcode = queue_job(writer, file, &job);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        cs_free(buf);
+    }
+    return errcode;
+}
+
+couchstore_error_t chunk_writer_add(chunk_writer *writer,
+                                    tree_file *file,
+                                    const sized_buf *buf,
+                                    int compress,
+                                    cs_off_t *pos,
+                                    size_t *disk_size)
+{
+    chunk_job job;
+    memset(&job, 0, sizeof(job));
+    job.buf = buf->buf;
+    job.size = buf->size;
+    job.compress = compress;
+    if (compress) {
+        job.codec = tree_file_chunk_codec(file, file->doc_codec);
+        job.file = file;
+    }
+    job.pos = pos;
+    job.disk_size = disk_size;
+    job.done = !compress;
+
+    return queue_job(writer, file, &job);
+}
+
+couchstore_error_t chunk_writer_flush(chunk_writer *writer, tree_file *file)
+{
+    return write_queued(writer, file, writer->tail);
+}
+
+void chunk_writer_discard(chunk_writer *writer)
+{
+    cb_mutex_enter(&writer->mutex);
+    // Chunks no worker has taken yet are simply not handed out...
+    writer->next = writer->tail;
+    // ...and the ones being compressed are waited for.
+    while (writer->compressing > 0) {
+        cb_cond_wait(&writer->done_cond, &writer->mutex);
+    }
+    while (writer->head < writer->tail) {
+        chunk_job *job = &writer->slots[writer->head++ % writer->nslots];
+        free_job(job);
+        job->done = 0;
+    }
+    cb_mutex_exit(&writer->mutex);
+}
@@ -0,0 +1,66 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_CHUNK_WRITER_H
+#define LIBCOUCHSTORE_CHUNK_WRITER_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+#include "node_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Compresses chunks (B-tree nodes and document bodies) on worker
+       threads while the caller goes on producing the next ones. The chunks
+       are still appended to the file by the calling thread, in the order
+       they were queued, so the file comes out exactly as if each had been
+       written when it was queued.
+
+       A queued chunk doesn't have a position yet; it is filled in when the
+       chunk is written. So nodes pointing to queued ones may only be built,
+       and positions of queued bodies only used, after chunk_writer_flush. */
+    typedef struct chunk_writer chunk_writer;
+
+    /** Starts a writer with the given number (at least 1) of threads. */
+    couchstore_error_t chunk_writer_create(unsigned threads, chunk_writer **pWriter);
+
+    /** Stops the threads. Chunks still queued are dropped. */
+    void chunk_writer_destroy(chunk_writer *writer);
+
+    /**
+     * Queues a B-tree node to be compressed and written, taking ownership
+     * of buf, which must be malloced. Once the node is written, ptr->pointer
+     * is set to its position and its size on disk is added to
+     * ptr->subtreesize, and both are encoded into raw as well. Any chunks at
+     * the head of the queue that are already compressed are written first.
+     */
+    couchstore_error_t chunk_writer_add_node(chunk_writer *writer,
+                                             tree_file *file,
+                                             char *buf,
+                                             size_t size,
+                                             node_pointer *ptr,
+                                             raw_node_pointer *raw);
+
+    /**
+     * Queues a chunk, compressed or not, whose position and size on disk
+     * are stored through pos and disk_size once it is written. buf isn't
+     * copied and has to stay valid until then.
+     */
+    couchstore_error_t chunk_writer_add(chunk_writer *writer,
+                                        tree_file *file,
+                                        const sized_buf *buf,
+                                        int compress,
+                                        cs_off_t *pos,
+                                        size_t *disk_size);
+
+    /** Writes out every queued chunk, waiting for them to be compressed. */
+    couchstore_error_t chunk_writer_flush(chunk_writer *writer, tree_file *file);
+
+    /** Drops every queued chunk, e.g. after a failed modification. */
+    void chunk_writer_discard(chunk_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
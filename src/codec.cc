@@ -0,0 +1,323 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Compression codecs for chunks.
+//
+// Snappy is always there. LZ4 and zstd are built in when their headers are
+// found; a file that uses one can't be read by a build without it, which
+// reports its chunks as corrupt. zstd contexts are kept per thread, since
+// the chunk writer compresses on several at once.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <snappy.h>
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+#include "internal.h"
+#include "codec.h"
+#include "bitfield.h"
+#include "util.h"
+
+struct codec_dict {
+#ifdef HAVE_ZSTD_H
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+#else
+    int unused;
+#endif
+};
+
+#ifdef HAVE_ZSTD_H
+namespace {
+    struct zstd_contexts {
+        ZSTD_CCtx *cctx;
+        ZSTD_DCtx *dctx;
+        zstd_contexts() : cctx(NULL), dctx(NULL) {}
+        ~zstd_contexts() {
+            ZSTD_freeCCtx(cctx);
+            ZSTD_freeDCtx(dctx);
+        }
+    };
+    thread_local zstd_contexts zstd_ctx;
+}
+#endif
+
+int codec_available(couchstore_codec codec)
+{
+    switch (codec) {
+    case COUCHSTORE_CODEC_SNAPPY:
+        return 1;
+#ifdef HAVE_LZ4_H
+    case COUCHSTORE_CODEC_LZ4:
+        return 1;
+#endif
+#ifdef HAVE_ZSTD_H
+    case COUCHSTORE_CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+static couchstore_error_t load_dict(tree_file *file)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *buf = NULL;
+    if (file->dict == NULL && file->dict_pos != 0) {
+        int size = pread_bin(file, file->dict_pos, &buf);
+        error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+        error_pass(codec_dict_create(buf, size, &file->dict));
+    }
+cleanup:
+    cs_free(buf);
+    return errcode;
+}
+
+unsigned tree_file_chunk_codec(tree_file *file, couchstore_codec codec)
+{
+    switch (codec) {
+    case COUCHSTORE_CODEC_LZ4:
+        return CHUNK_CODEC_LZ4;
+    case COUCHSTORE_CODEC_ZSTD:
+        // Without its dictionary, plain zstd still does.
+        if (file->dict_pos != 0 && load_dict(file) == COUCHSTORE_SUCCESS) {
+            return CHUNK_CODEC_ZSTD_DICT;
+        }
+        return CHUNK_CODEC_ZSTD;
+    default:
+        return CHUNK_CODEC_SNAPPY;
+    }
+}
+
+size_t codec_max_compressed_length(unsigned chunk_codec, size_t len)
+{
+    switch (chunk_codec) {
+#ifdef HAVE_LZ4_H
+    case CHUNK_CODEC_LZ4:
+        return sizeof(raw_32) + LZ4_compressBound((int)len);
+#endif
+#ifdef HAVE_ZSTD_H
+    case CHUNK_CODEC_ZSTD:
+    case CHUNK_CODEC_ZSTD_DICT:
+        return ZSTD_compressBound(len);
+#endif
+    default:
+        return snappy::MaxCompressedLength(len);
+    }
+}
+
+couchstore_error_t codec_compress(const tree_file *file,
+                                  unsigned chunk_codec,
+                                  const char *in, size_t len,
+                                  char *out, size_t *out_len)
+{
+    switch (chunk_codec) {
+    case CHUNK_CODEC_SNAPPY:
+        snappy::RawCompress(in, len, out, out_len);
+        return COUCHSTORE_SUCCESS;
+#ifdef HAVE_LZ4_H
+    case CHUNK_CODEC_LZ4: {
+        int size = LZ4_compress_default(in, out + sizeof(raw_32), (int)len,
+                                        LZ4_compressBound((int)len));
+        if (size <= 0) {
+            return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+        }
+        *(raw_32 *)out = encode_raw32((uint32_t)len);
+        *out_len = sizeof(raw_32) + size;
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+#ifdef HAVE_ZSTD_H
+    case CHUNK_CODEC_ZSTD:
+    case CHUNK_CODEC_ZSTD_DICT: {
+        size_t size;
+        if (zstd_ctx.cctx == NULL && (zstd_ctx.cctx = ZSTD_createCCtx()) == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        if (chunk_codec == CHUNK_CODEC_ZSTD_DICT) {
+            if (file->dict == NULL) {
+                return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+            }
+            size = ZSTD_compress_usingCDict(zstd_ctx.cctx, out, ZSTD_compressBound(len),
+                                            in, len, file->dict->cdict);
+        } else {
+            size = ZSTD_compressCCtx(zstd_ctx.cctx, out, ZSTD_compressBound(len),
+                                     in, len, ZSTD_CLEVEL_DEFAULT);
+        }
+        if (ZSTD_isError(size)) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        *out_len = size;
+        return COUCHSTORE_SUCCESS;
+    }
+#endif
+    default:
+        (void)file;
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+}
+
+couchstore_error_t codec_uncompressed_length(unsigned chunk_codec,
+                                             const char *in, size_t len,
+                                             size_t *out_len)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t size = 0;
+
+    switch (chunk_codec) {
+    case CHUNK_CODEC_SNAPPY:
+        //should be compressed but snappy doesn't see it as valid.
+        error_unless(snappy::GetUncompressedLength(in, len, &size), COUCHSTORE_ERROR_CORRUPT);
+        break;
+#ifdef HAVE_LZ4_H
+    case CHUNK_CODEC_LZ4:
+        error_unless(len >= sizeof(raw_32), COUCHSTORE_ERROR_CORRUPT);
+        size = decode_raw32(*(const raw_32 *)in);
+        break;
+#endif
+#ifdef HAVE_ZSTD_H
+    case CHUNK_CODEC_ZSTD:
+    case CHUNK_CODEC_ZSTD_DICT: {
+        unsigned long long content_size = ZSTD_getFrameContentSize(in, len);
+        error_unless(content_size != ZSTD_CONTENTSIZE_UNKNOWN &&
+                     content_size != ZSTD_CONTENTSIZE_ERROR &&
+                     content_size <= CHUNK_LENGTH_MASK,
+                     COUCHSTORE_ERROR_CORRUPT);
+        size = (size_t)content_size;
+        break;
+    }
+#endif
+    default:
+        // Written by a build with a codec this one lacks.
+        error_pass(COUCHSTORE_ERROR_CORRUPT);
+    }
+
+    *out_len = size;
+cleanup:
+    return errcode;
+}
+
+couchstore_error_t codec_uncompress_into(tree_file *file,
+                                         unsigned chunk_codec,
+                                         const char *in, size_t len,
+                                         char *out, size_t out_len)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+
+    switch (chunk_codec) {
+    case CHUNK_CODEC_SNAPPY:
+        error_unless(snappy::RawUncompress(in, len, out), COUCHSTORE_ERROR_CORRUPT);
+        break;
+#ifdef HAVE_LZ4_H
+    case CHUNK_CODEC_LZ4:
+        error_unless(len >= sizeof(raw_32), COUCHSTORE_ERROR_CORRUPT);
+        error_unless(LZ4_decompress_safe(in + sizeof(raw_32), out,
+                                         (int)(len - sizeof(raw_32)),
+                                         (int)out_len) == (int)out_len,
+                     COUCHSTORE_ERROR_CORRUPT);
+        break;
+#endif
+#ifdef HAVE_ZSTD_H
+    case CHUNK_CODEC_ZSTD:
+    case CHUNK_CODEC_ZSTD_DICT: {
+        size_t result;
+        if (zstd_ctx.dctx == NULL) {
+            zstd_ctx.dctx = ZSTD_createDCtx();
+            error_unless(zstd_ctx.dctx, COUCHSTORE_ERROR_ALLOC_FAIL);
+        }
+        if (chunk_codec == CHUNK_CODEC_ZSTD_DICT) {
+            error_pass(load_dict(file));
+            error_unless(file->dict, COUCHSTORE_ERROR_CORRUPT);
+            result = ZSTD_decompress_usingDDict(zstd_ctx.dctx, out, out_len, in, len,
+                                                file->dict->ddict);
+        } else {
+            result = ZSTD_decompressDCtx(zstd_ctx.dctx, out, out_len, in, len);
+        }
+        error_unless(!ZSTD_isError(result) && result == out_len, COUCHSTORE_ERROR_CORRUPT);
+        break;
+    }
+#endif
+    default:
+        (void)file;
+        (void)out_len;
+        error_pass(COUCHSTORE_ERROR_CORRUPT);
+    }
+
+cleanup:
+    return errcode;
+}
+
+couchstore_error_t codec_uncompress(tree_file *file,
+                                    unsigned chunk_codec,
+                                    const char *in, size_t len,
+                                    char **out, size_t *out_len)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *buf = NULL;
+    size_t size = 0;
+
+    error_pass(codec_uncompressed_length(chunk_codec, in, len, &size));
+    buf = static_cast<char *>(cs_malloc(size));
+    error_unless(buf || size == 0, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(codec_uncompress_into(file, chunk_codec, in, len, buf, size));
+
+    *out = buf;
+    *out_len = size;
+    buf = NULL;
+cleanup:
+    cs_free(buf);
+    return errcode;
+}
+
+couchstore_error_t codec_dict_create(const char *buf, size_t size,
+                                     codec_dict **pDict)
+{
+#ifdef HAVE_ZSTD_H
+    codec_dict *dict = static_cast<codec_dict *>(cs_calloc(1, sizeof(codec_dict)));
+    if (!dict) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    dict->cdict = ZSTD_createCDict(buf, size, ZSTD_CLEVEL_DEFAULT);
+    dict->ddict = ZSTD_createDDict(buf, size);
+    if (!dict->cdict || !dict->ddict) {
+        codec_dict_free(dict);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *pDict = dict;
+    return COUCHSTORE_SUCCESS;
+#else
+    (void)buf;
+    (void)size;
+    (void)pDict;
+    return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+#endif
+}
+
+void codec_dict_free(codec_dict *dict)
+{
+    if (dict) {
+#ifdef HAVE_ZSTD_H
+        ZSTD_freeCDict(dict->cdict);
+        ZSTD_freeDDict(dict->ddict);
+#endif
+        cs_free(dict);
+    }
+}
+
+size_t codec_dict_memory(const codec_dict *dict)
+{
+    if (!dict) {
+        return 0;
+    }
+    size_t total = sizeof(codec_dict);
+#ifdef HAVE_ZSTD_H
+    total += ZSTD_sizeof_CDict(dict->cdict) + ZSTD_sizeof_DDict(dict->ddict);
+#endif
+    return total;
+}
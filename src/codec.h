@@ -0,0 +1,85 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_CODEC_H
+#define LIBCOUCHSTORE_CODEC_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* In files of disk version COUCH_DISK_VERSION_CODECS and later, two bits
+       of a chunk's length word name the codec its contents are compressed
+       with, if they are; this leaves 29 bits for the length. Snappy, the
+       only codec before, is 0, so chunks that use it look as they always
+       did. */
+#define CHUNK_CODEC_SHIFT 29
+#define CHUNK_CODEC_MASK (3U << CHUNK_CODEC_SHIFT)
+#define CHUNK_LENGTH_MASK ((1U << CHUNK_CODEC_SHIFT) - 1)
+
+    enum {
+        CHUNK_CODEC_SNAPPY = 0,
+        /* The uncompressed length as a raw_32, then an LZ4 block */
+        CHUNK_CODEC_LZ4 = 1,
+        /* A zstd frame */
+        CHUNK_CODEC_ZSTD = 2,
+        /* A zstd frame compressed with the file's dictionary */
+        CHUNK_CODEC_ZSTD_DICT = 3
+    };
+
+    /* A zstd dictionary, prepared for both directions. */
+    typedef struct codec_dict codec_dict;
+
+    /** @return nonzero if this build of the library has the codec */
+    int codec_available(couchstore_codec codec);
+
+    /**
+     * Picks the chunk codec to write data meant for the given codec with:
+     * zstd uses the file's dictionary if it has one. Loads the dictionary,
+     * so it must be called on the thread that owns the file.
+     */
+    unsigned tree_file_chunk_codec(tree_file *file, couchstore_codec codec);
+
+    /** Largest size that compressing len bytes with a chunk codec takes. */
+    size_t codec_max_compressed_length(unsigned chunk_codec, size_t len);
+
+    /** Compresses into out, which has room for codec_max_compressed_length
+        bytes. Safe to call from any thread. */
+    couchstore_error_t codec_compress(const tree_file *file,
+                                      unsigned chunk_codec,
+                                      const char *in, size_t len,
+                                      char *out, size_t *out_len);
+
+    /** The length a chunk decompresses to. */
+    couchstore_error_t codec_uncompressed_length(unsigned chunk_codec,
+                                                 const char *in, size_t len,
+                                                 size_t *out_len);
+
+    /** Decompresses a chunk into out, which has room for the
+        codec_uncompressed_length bytes it comes to. */
+    couchstore_error_t codec_uncompress_into(tree_file *file,
+                                             unsigned chunk_codec,
+                                             const char *in, size_t len,
+                                             char *out, size_t out_len);
+
+    /** Decompresses a chunk into a malloced buffer. */
+    couchstore_error_t codec_uncompress(tree_file *file,
+                                        unsigned chunk_codec,
+                                        const char *in, size_t len,
+                                        char **out, size_t *out_len);
+
+    /** Prepares a dictionary from its serialized form. */
+    couchstore_error_t codec_dict_create(const char *buf, size_t size,
+                                         codec_dict **pDict);
+
+    void codec_dict_free(codec_dict *dict);
+
+    /** The bytes a dictionary takes, or 0 for NULL. */
+    size_t codec_dict_memory(const codec_dict *dict);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
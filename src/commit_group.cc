@@ -0,0 +1,308 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Group commit: a background thread that commits many Dbs at once.
+//
+// A commit is a write that extends the file, a sync, the header write and
+// another sync. The committer takes every commit queued since its last
+// batch (optionally holding the first one back for a while to let others
+// arrive), does the writes of the whole batch, and then lets its sync
+// threads issue the syncs of the batch in parallel, so that the file
+// system can fold them into as few journal commits and device flushes as
+// it is able to. Callbacks run once the second round of syncs is done.
+
+#include "config.h"
+#include <stdlib.h>
+
+#include "internal.h"
+#include "background_sync.h"
+#include "util.h"
+
+// Commits taken into a single batch at most:
+#define MAX_BATCH 256
+
+typedef struct pending_commit {
+    Db *db;
+    couchstore_commit_callback callback;
+    void *ctx;
+    couchstore_error_t result;
+    struct pending_commit *next;
+} pending_commit;
+
+struct _couchstore_commit_group {
+    cb_mutex_t mutex;
+    cb_cond_t queue_cond;           // the committer waits here for commits
+    cb_cond_t sync_cond;            // sync threads wait here for a batch
+    cb_cond_t batch_cond;           // the committer waits here for syncs
+    pending_commit *head;
+    pending_commit *tail;
+    unsigned queued;
+    unsigned max_delay_ms;
+    int shutdown;
+    int stop_syncing;
+    int committer_running;
+    cb_thread_t committer;
+    cb_thread_t *sync_threads;
+    unsigned nsync_threads;
+    // The batch whose files are being synced:
+    pending_commit **batch;
+    unsigned batch_size;
+    unsigned next_sync;
+    unsigned syncs_running;
+    uint64_t commits;
+    uint64_t batches;
+};
+
+// Syncs files of the current batch until there are none left to take.
+// Called, and returns, with the mutex held.
+static void run_syncs(couchstore_commit_group *group)
+{
+    while (group->next_sync < group->batch_size) {
+        pending_commit *pc = group->batch[group->next_sync++];
+        ++group->syncs_running;
+        cb_mutex_exit(&group->mutex);
+
+        if (pc->result == COUCHSTORE_SUCCESS) {
+            Db *db = pc->db;
+            pc->result = db->file.ops->sync(&db->file.lastError, db->file.handle);
+        }
+
+        cb_mutex_enter(&group->mutex);
+        if (--group->syncs_running == 0 && group->next_sync == group->batch_size) {
+            cb_cond_signal(&group->batch_cond);
+        }
+    }
+}
+
+static void sync_worker(void *arg)
+{
+    couchstore_commit_group *group = static_cast<couchstore_commit_group *>(arg);
+
+    cb_mutex_enter(&group->mutex);
+    while (!group->stop_syncing) {
+        if (group->next_sync < group->batch_size) {
+            run_syncs(group);
+        } else {
+            cb_cond_wait(&group->sync_cond, &group->mutex);
+        }
+    }
+    cb_mutex_exit(&group->mutex);
+}
+
+// Syncs the files of a batch, sharing the work with the sync threads.
+static void sync_batch(couchstore_commit_group *group,
+                       pending_commit **batch, unsigned n)
+{
+    cb_mutex_enter(&group->mutex);
+    group->batch = batch;
+    group->batch_size = n;
+    group->next_sync = 0;
+    cb_cond_broadcast(&group->sync_cond);
+    run_syncs(group);
+    while (group->syncs_running > 0) {
+        cb_cond_wait(&group->batch_cond, &group->mutex);
+    }
+    group->batch = NULL;
+    group->batch_size = 0;
+    group->next_sync = 0;
+    cb_mutex_exit(&group->mutex);
+}
+
+static void commit_batch(couchstore_commit_group *group,
+                         pending_commit **batch, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; ++i) {
+        batch[i]->result = db_commit_prepare(batch[i]->db);
+    }
+    sync_batch(group, batch, n);
+
+    for (i = 0; i < n; ++i) {
+        if (batch[i]->result == COUCHSTORE_SUCCESS) {
+            batch[i]->result = db_write_header(batch[i]->db);
+        }
+    }
+    sync_batch(group, batch, n);
+
+    for (i = 0; i < n; ++i) {
+        if (batch[i]->result == COUCHSTORE_SUCCESS) {
+            db_count_commit(batch[i]->db);
+            if (batch[i]->db->syncer != NULL) {
+                // For the syncer to list in the header hints.
+                batch[i]->result = background_sync_committed(batch[i]->db->syncer,
+                                                             batch[i]->db->header.position,
+                                                             batch[i]->db->header.update_seq);
+            }
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        pending_commit pc = *batch[i];
+        cs_free(batch[i]);
+        pc.callback(pc.db, pc.result, pc.ctx);
+    }
+
+    cb_mutex_enter(&group->mutex);
+    group->commits += n;
+    ++group->batches;
+    cb_mutex_exit(&group->mutex);
+}
+
+static void committer_loop(void *arg)
+{
+    couchstore_commit_group *group = static_cast<couchstore_commit_group *>(arg);
+    pending_commit *batch[MAX_BATCH];
+
+    cb_mutex_enter(&group->mutex);
+    for (;;) {
+        while (group->queued == 0 && !group->shutdown) {
+            cb_cond_wait(&group->queue_cond, &group->mutex);
+        }
+        if (group->queued == 0) {
+            break;
+        }
+        if (group->max_delay_ms > 0 && group->queued < MAX_BATCH &&
+                !group->shutdown) {
+            // Give other commits a chance to join this batch:
+            cb_cond_timedwait(&group->queue_cond, &group->mutex,
+                              group->max_delay_ms);
+        }
+
+        unsigned n = 0;
+        while (group->head && n < MAX_BATCH) {
+            batch[n++] = group->head;
+            group->head = group->head->next;
+        }
+        if (group->head == NULL) {
+            group->tail = NULL;
+        }
+        group->queued -= n;
+
+        cb_mutex_exit(&group->mutex);
+        commit_batch(group, batch, n);
+        cb_mutex_enter(&group->mutex);
+    }
+    cb_mutex_exit(&group->mutex);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_commit_group_create(unsigned max_delay_ms,
+                                                  unsigned sync_threads,
+                                                  couchstore_commit_group **pGroup)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_commit_group *group;
+    unsigned i;
+
+    group = static_cast<couchstore_commit_group *>(cs_calloc(1, sizeof(*group)));
+    error_unless(group, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cb_mutex_initialize(&group->mutex);
+    cb_cond_initialize(&group->queue_cond);
+    cb_cond_initialize(&group->sync_cond);
+    cb_cond_initialize(&group->batch_cond);
+    group->max_delay_ms = max_delay_ms;
+
+    if (sync_threads > 0) {
+        group->sync_threads = static_cast<cb_thread_t *>(cs_calloc(sync_threads,
+                                                                sizeof(cb_thread_t)));
+        error_unless(group->sync_threads, COUCHSTORE_ERROR_ALLOC_FAIL);
+        for (i = 0; i < sync_threads; ++i) {
+            error_unless(cb_create_thread(&group->sync_threads[i], sync_worker,
+                                          group, 0) == 0,
+                         COUCHSTORE_ERROR_ALLOC_FAIL);
+            ++group->nsync_threads;
+        }
+    }
+
+    error_unless(cb_create_thread(&group->committer, committer_loop, group, 0) == 0,
+                 COUCHSTORE_ERROR_ALLOC_FAIL);
+    group->committer_running = 1;
+    *pGroup = group;
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS && group) {
+        couchstore_commit_group_destroy(group);
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_commit_group_destroy(couchstore_commit_group *group)
+{
+    unsigned i;
+
+    if (group == NULL) {
+        return;
+    }
+
+    // The committer drains the queue before it exits...
+    if (group->committer_running) {
+        cb_mutex_enter(&group->mutex);
+        group->shutdown = 1;
+        cb_cond_signal(&group->queue_cond);
+        cb_mutex_exit(&group->mutex);
+        cb_join_thread(group->committer);
+    }
+
+    // ...and needs the sync threads to do so.
+    cb_mutex_enter(&group->mutex);
+    group->stop_syncing = 1;
+    cb_cond_broadcast(&group->sync_cond);
+    cb_mutex_exit(&group->mutex);
+    for (i = 0; i < group->nsync_threads; ++i) {
+        cb_join_thread(group->sync_threads[i]);
+    }
+
+    cs_free(group->sync_threads);
+    cb_cond_destroy(&group->queue_cond);
+    cb_cond_destroy(&group->sync_cond);
+    cb_cond_destroy(&group->batch_cond);
+    cb_mutex_destroy(&group->mutex);
+    cs_free(group);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_commit_async(couchstore_commit_group *group,
+                                           Db *db,
+                                           couchstore_commit_callback callback,
+                                           void *ctx)
+{
+    if (group == NULL || db == NULL || callback == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    pending_commit *pc = static_cast<pending_commit *>(cs_malloc(sizeof(pending_commit)));
+    if (pc == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    pc->db = db;
+    pc->callback = callback;
+    pc->ctx = ctx;
+    pc->result = COUCHSTORE_SUCCESS;
+    pc->next = NULL;
+
+    cb_mutex_enter(&group->mutex);
+    if (group->tail) {
+        group->tail->next = pc;
+    } else {
+        group->head = pc;
+    }
+    group->tail = pc;
+    ++group->queued;
+    // Wake the committer if it's idle, or end its wait once a batch is full:
+    if (group->queued == 1 || group->queued == MAX_BATCH) {
+        cb_cond_signal(&group->queue_cond);
+    }
+    cb_mutex_exit(&group->mutex);
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_commit_group_get_stats(couchstore_commit_group *group,
+                                       couchstore_commit_group_stats *stats)
+{
+    cb_mutex_enter(&group->mutex);
+    stats->commits = group->commits;
+    stats->batches = group->batches;
+    cb_mutex_exit(&group->mutex);
+}
@@ -0,0 +1,136 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Progress reports of compactions.
+//
+// A compaction of a large file runs for minutes, and the scheduler running
+// it has to tell one that's slow from one that's stuck, and guess when
+// it'll end. The work to be done is known up front from the source's
+// roots: the by-sequence count says how many entries there are to copy,
+// and the by-ID reduction's document size plus the trees' subtree sizes
+// about what the target will take. The figures are only worked out when
+// reported, which happens at the phases and at the steps io_throttle takes
+// through the bytes written, so none of it costs the copy loop anything.
+
+#include "config.h"
+#include <string.h>
+#include "internal.h"
+#include "compact_progress.h"
+#include "reduces.h"
+#include "bitfield.h"
+#include "util.h"
+
+static uint64_t tree_size(const node_pointer *root)
+{
+    return root ? root->subtreesize : 0;
+}
+
+void compact_progress_start(compact_progress *progress,
+                            const Db *source,
+                            const Db *from,
+                            const tree_file *target)
+{
+    memset(progress, 0, sizeof(*progress));
+    progress->arena_limit = source->arena_limit;
+#ifdef COUCHSTORE_OP_STATS
+    progress->op_stats = source->op_stats;
+    if (progress->op_stats != NULL) {
+        progress->start = progress->phase_start = gethrtime();
+    }
+#endif
+    if (source->compaction_progress == NULL) {
+        return;
+    }
+    progress->callback = source->compaction_progress;
+    progress->callback_ctx = source->compaction_progress_ctx;
+    progress->source_stats = &from->io_stats;
+    progress->source_read_base = from->io_stats.bytes_read;
+    progress->target = target;
+    progress->target_base = target->pos;
+    progress->start = progress->phase_start = gethrtime();
+
+    const db_header *header = &from->header;
+    couchstore_compact_progress *report = &progress->report;
+    const node_pointer *seq_root = header->by_seq_root;
+    if (seq_root && seq_root->reduce_value.size >= sizeof(raw_by_seq_reduce)) {
+        const raw_by_seq_reduce *reduce = (const raw_by_seq_reduce*)seq_root->reduce_value.buf;
+        report->items_total = decode_raw40(reduce->count);
+    }
+    const node_pointer *id_root = header->by_id_root;
+    if (id_root && id_root->reduce_value.size >= sizeof(raw_by_id_reduce)) {
+        const raw_by_id_reduce *reduce = (const raw_by_id_reduce*)id_root->reduce_value.buf;
+        report->estimated_bytes = decode_raw48(reduce->size);
+    }
+    report->estimated_bytes += tree_size(id_root) + tree_size(seq_root) +
+                               tree_size(header->local_docs_root);
+}
+
+void compact_progress_arena(compact_progress *progress, arena *a)
+{
+    arena_set_limit(a, progress->arena_limit);
+    if (progress->narenas < COMPACT_PROGRESS_ARENAS) {
+        progress->arenas[progress->narenas++] = a;
+    }
+}
+
+void compact_progress_item(compact_progress *progress)
+{
+    ++progress->report.items_copied;
+}
+
+void compact_progress_read(compact_progress *progress, uint64_t bytes)
+{
+    progress->other_reads += bytes;
+}
+
+couchstore_error_t compact_progress_report(compact_progress *progress)
+{
+    if (progress->callback == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    couchstore_compact_progress report = progress->report;
+    hrtime_t now = gethrtime();
+
+    if (report.phase != COUCHSTORE_COMPACT_PHASE_DONE) {
+        report.phase_ns[report.phase] += now - progress->phase_start;
+    }
+    report.elapsed_ns = now - progress->start;
+    for (unsigned i = 0; i < progress->narenas; i++) {
+        arena_stats stats;
+        arena_get_stats(progress->arenas[i], &stats);
+        report.arena_bytes += stats.held;
+        report.arena_peak_bytes += stats.peak;
+    }
+    report.bytes_read = progress->source_stats->bytes_read - progress->source_read_base +
+                        progress->other_reads;
+    cs_off_t pos = progress->target->pos;
+    report.bytes_written = pos > progress->target_base ? (uint64_t)(pos - progress->target_base) : 0;
+    if (report.elapsed_ns > 0) {
+        report.bytes_per_sec = (uint64_t)((double)report.bytes_written * 1e9 / report.elapsed_ns);
+    }
+    if (report.phase != COUCHSTORE_COMPACT_PHASE_DONE && report.bytes_written > 0 &&
+        report.estimated_bytes > report.bytes_written) {
+        report.remaining_ns = (uint64_t)((double)(report.estimated_bytes - report.bytes_written) *
+                                         report.elapsed_ns / report.bytes_written);
+    }
+    return progress->callback(&report, progress->callback_ctx);
+}
+
+couchstore_error_t compact_progress_phase(compact_progress *progress,
+                                          couchstore_compact_phase phase)
+{
+    if (progress->callback == NULL && progress->op_stats == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    hrtime_t now = gethrtime();
+    couchstore_compact_progress *report = &progress->report;
+    if (report->phase != COUCHSTORE_COMPACT_PHASE_DONE) {
+        report->phase_ns[report->phase] += now - progress->phase_start;
+        if (progress->op_stats != NULL && phase != report->phase) {
+            couch_histogram_add(&progress->op_stats->compact_phase[report->phase],
+                                (now - progress->phase_start) / 1000);
+        }
+    }
+    report->phase = phase;
+    progress->phase_start = now;
+    return compact_progress_report(progress);
+}
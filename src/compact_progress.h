@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_COMPACT_PROGRESS_H
+#define LIBCOUCHSTORE_COMPACT_PROGRESS_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COMPACT_PROGRESS_ARENAS 4
+
+    /* Keeps the figures of couchstore_compact_progress for a compaction,
+       and reports them to the source's callback. Reports between phases
+       come from io_throttle, which steps through the bytes written. */
+    typedef struct compact_progress {
+        couchstore_compact_progress_fn callback;    /* NULL: does nothing */
+        void *callback_ctx;
+        couchstore_compact_progress report;
+        const couchstore_io_stats *source_stats;
+        uint64_t source_read_base;
+        uint64_t other_reads;       /* bodies read on other handles */
+        const tree_file *target;
+        cs_off_t target_base;
+        hrtime_t start;
+        hrtime_t phase_start;
+        size_t arena_limit;
+        const arena *arenas[COMPACT_PROGRESS_ARENAS];
+        unsigned narenas;
+        couchstore_op_stats *op_stats;  /* the source's, timing the phases */
+    } compact_progress;
+
+    /** Starts timing, reporting to source's callback on the compaction of
+        from (source itself, or the snapshot of it compacted) into target,
+        which totals are worked out from. */
+    void compact_progress_start(compact_progress *progress,
+                                const Db *source,
+                                const Db *from,
+                                const tree_file *target);
+
+    /** Caps an arena of the compaction at the source's arena limit, and
+        counts what it holds in the reports. */
+    void compact_progress_arena(compact_progress *progress, arena *a);
+
+    /** Counts an entry copied. */
+    void compact_progress_item(compact_progress *progress);
+
+    /** Counts bytes read from the source other than through its handle. */
+    void compact_progress_read(compact_progress *progress, uint64_t bytes);
+
+    /** Reports the figures so far. */
+    couchstore_error_t compact_progress_report(compact_progress *progress);
+
+    /** Moves on to the next phase, and reports. */
+    couchstore_error_t compact_progress_phase(compact_progress *progress,
+                                              couchstore_compact_phase phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,16 +3,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <platform/platform.h>
 #include "bitfield.h"
-
-static void exit_error(couchstore_error_t errcode)
-{
-    fprintf(stderr, "Couchstore error: %s\n", couchstore_strerror(errcode));
-    exit(-1);
-}
+#include "tools.h"
 
 static void usage(const char* prog) {
-    fprintf(stderr, "Usage: %s [--purge-before <timestamp>] [--purge-only-upto-seq seq] [--dropdeletes] <input file> <output file>\n", prog);
+    fprintf(stderr, "Usage: %s [--purge-before <timestamp>] [--purge-only-upto-seq seq] [--dropdeletes]\n"
+            "       [--direct-io] [--threads <n>] [--rate-limit <MB/s>] [--resume] [--progress]\n"
+            "       [-j <jobs>] <input file> <output file> [<input file> <output file> ...]\n", prog);
     exit(-1);
 }
 
@@ -28,6 +26,30 @@ typedef struct {
     raw_32 flags;
 } CouchbaseRevMeta;
 
+/* How every file is compacted */
+typedef struct {
+    int purge;
+    time_purge_ctx timepurge;
+    couchstore_compact_flags flags;
+    const couch_file_ops* target_io_ops;
+    unsigned threads;
+    /* Shared by the files compacted at once */
+    uint64_t rate_limit;
+    int jobs;
+    int resume;
+    int progress;
+    /* The output file of each input file */
+    const char** outputs;
+} compact_options;
+
+typedef struct {
+    const char* file;
+    hrtime_t last;
+} progress_ctx;
+
+/* Documents a resumed compaction goes through between checkpoints */
+#define RESUME_CHECKPOINT_DOCS 100000
+
 static int time_purge_hook(Db* target, DocInfo* info, void* ctx_p) {
     time_purge_ctx* ctx = (time_purge_ctx*) ctx_p;
 
@@ -52,62 +74,159 @@ static int time_purge_hook(Db* target, DocInfo* info, void* ctx_p) {
     return COUCHSTORE_COMPACT_KEEP_ITEM;
 }
 
-int main(int argc, char** argv)
+static couchstore_error_t print_progress(const couchstore_compact_progress* progress,
+                                         void* ctx_p)
 {
-    Db* source;
-    couchstore_error_t errcode;
-    time_purge_ctx timepurge = {0, 0};
-    couchstore_compact_hook hook = NULL;
-    void* hook_ctx = NULL;
-    int argp = 1;
-    couchstore_compact_flags flags = 0;
-    const couch_file_ops* target_io_ops = couchstore_get_default_file_ops();
-    if(argc < 3)
-    {
-        usage(argv[0]);
+    static const char* phases[COUCHSTORE_COMPACT_PHASES] = {
+        "copying by-sequence tree", "sorting IDs", "writing by-ID tree",
+        "copying local docs", "done"
+    };
+    progress_ctx* ctx = (progress_ctx*) ctx_p;
+    hrtime_t now = gethrtime();
+
+    /* A line a second at most, and the last one */
+    if(progress->phase != COUCHSTORE_COMPACT_PHASE_DONE &&
+       ctx->last != 0 && now - ctx->last < 1000000000) {
+        return COUCHSTORE_SUCCESS;
     }
+    ctx->last = now;
+    fprintf(stderr, "%s: %s, %"PRIu64"/%"PRIu64" items, %.1f/%.1f MB written,"
+            " %.1f MB/s, %.0fs left\n", ctx->file, phases[progress->phase],
+            progress->items_copied, progress->items_total,
+            progress->bytes_written / 1048576.0,
+            progress->estimated_bytes / 1048576.0,
+            progress->bytes_per_sec / 1048576.0,
+            progress->remaining_ns / 1e9);
+    return COUCHSTORE_SUCCESS;
+}
 
-    while(argv[argp][0] == '-') {
-        if(!strcmp(argv[argp],"--purge-before")) {
-            argp+=2;
-            if(argc + argp < 2) {
-                usage(argv[0]);
-            }
-            hook = time_purge_hook;
-            hook_ctx = &timepurge;
-            timepurge.purge_before_ts = atoi(argv[argp-1]);
-            printf("Purging items before timestamp %"PRIu64"\n", timepurge.purge_before_ts);
-        }
+static int compact_file(const char* input, int index, FILE* out, void* ctx_p)
+{
+    const compact_options* opts = (const compact_options*) ctx_p;
+    const char* output = opts->outputs[index];
+    time_purge_ctx timepurge = opts->timepurge;
+    couchstore_compact_hook hook = opts->purge ? time_purge_hook : NULL;
+    progress_ctx progress = { input, 0 };
+    Db* source = NULL;
+    couchstore_error_t errcode;
 
-        if(!strcmp(argv[argp],"--purge-only-upto-seq")) {
-            if(argc - argp < 3) {
-                usage(argv[0]);
-            }
-            argp+=2;
-            timepurge.purge_before_seq = (uint64_t)(atoll(argv[argp-1]));
-            printf("Purging items only up-to seq %"PRIu64"\n", timepurge.purge_before_seq);
+    errcode = couchstore_open_db(input, COUCHSTORE_OPEN_FLAG_RDONLY, &source);
+    if(errcode == COUCHSTORE_SUCCESS && opts->threads > 0) {
+        errcode = couchstore_set_compaction_threads(source, opts->threads);
+    }
+    if(errcode == COUCHSTORE_SUCCESS && opts->rate_limit > 0) {
+        couchstore_compact_throttle throttle;
+        memset(&throttle, 0, sizeof(throttle));
+        throttle.bytes_per_sec = opts->rate_limit / opts->jobs;
+        errcode = couchstore_set_compaction_throttle(source, &throttle);
+    }
+    if(errcode == COUCHSTORE_SUCCESS && opts->progress) {
+        errcode = couchstore_set_compaction_progress(source, print_progress, &progress);
+    }
+    if(errcode == COUCHSTORE_SUCCESS) {
+        if(opts->resume) {
+            int done = 0;
+            errcode = couchstore_compact_db_resumable(source, output, opts->flags,
+                                                      hook, &timepurge,
+                                                      opts->target_io_ops,
+                                                      RESUME_CHECKPOINT_DOCS,
+                                                      0, &done);
+        } else {
+            errcode = couchstore_compact_db_ex(source, output, opts->flags,
+                                               hook, &timepurge,
+                                               opts->target_io_ops);
         }
+    }
+    if(source != NULL) {
+        couchstore_close_db(source);
+    }
+
+    if(errcode) {
+        fprintf(stderr, "Failed to compact %s -> %s: %s\n", input, output,
+                couchstore_strerror(errcode));
+        return -1;
+    }
+    fprintf(out, "Compacted %s -> %s\n", input, output);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    compact_options opts;
+    const char** inputs;
+    const char** outputs;
+    int num_files;
+    int argp = 1;
+    int i;
 
-        if(!strcmp(argv[argp],"--dropdeletes")) {
+    memset(&opts, 0, sizeof(opts));
+    opts.target_io_ops = couchstore_get_default_file_ops();
+    opts.jobs = 1;
+
+    while(argp < argc && argv[argp][0] == '-') {
+        const char* arg = argv[argp++];
+        const char* val = argp < argc ? argv[argp] : NULL;
+
+        if(!strcmp(arg, "--purge-before") && val) {
+            argp++;
+            opts.purge = 1;
+            opts.timepurge.purge_before_ts = atoi(val);
+            printf("Purging items before timestamp %"PRIu64"\n", opts.timepurge.purge_before_ts);
+        } else if(!strcmp(arg, "--purge-only-upto-seq") && val) {
+            argp++;
+            opts.timepurge.purge_before_seq = (uint64_t)(atoll(val));
+            printf("Purging items only up-to seq %"PRIu64"\n", opts.timepurge.purge_before_seq);
+        } else if(!strcmp(arg, "--dropdeletes")) {
+            opts.flags = COUCHSTORE_COMPACT_FLAG_DROP_DELETES;
+        } else if(!strcmp(arg, "--direct-io")) {
+            if(couchstore_get_direct_file_ops() != NULL) {
+                opts.target_io_ops = couchstore_get_direct_file_ops();
+            } else {
+                fprintf(stderr, "Direct I/O isn't supported on this platform, ignoring --direct-io\n");
+            }
+        } else if(!strcmp(arg, "--threads") && val) {
+            argp++;
+            opts.threads = (unsigned) atoi(val);
+        } else if(!strcmp(arg, "--rate-limit") && val) {
             argp++;
-            if(argc + argp < 2) {
+            opts.rate_limit = (uint64_t) (atof(val) * 1048576.0);
+        } else if(!strcmp(arg, "--resume")) {
+            opts.resume = 1;
+        } else if(!strcmp(arg, "--progress")) {
+            opts.progress = 1;
+        } else if(!strcmp(arg, "-j") && val) {
+            argp++;
+            opts.jobs = atoi(val);
+            if(opts.jobs < 1) {
                 usage(argv[0]);
             }
-            flags = COUCHSTORE_COMPACT_FLAG_DROP_DELETES;
+        } else {
+            usage(argv[0]);
         }
     }
 
-    errcode = couchstore_open_db(argv[argp++], COUCHSTORE_OPEN_FLAG_RDONLY, &source);
-    if(errcode)
-    {
-        exit_error(errcode);
+    num_files = (argc - argp) / 2;
+    if(num_files == 0 || (argc - argp) % 2 != 0) {
+        usage(argv[0]);
     }
-    errcode = couchstore_compact_db_ex(source, argv[argp], flags, hook, hook_ctx, target_io_ops);
-    if(errcode)
-    {
-        exit_error(errcode);
+    if(opts.jobs > num_files) {
+        opts.jobs = num_files;
     }
 
-    printf("Compacted %s -> %s\n", argv[argp - 1], argv[argp]);
-    return 0;
+    inputs = (const char**) malloc(num_files * sizeof(char*));
+    outputs = (const char**) malloc(num_files * sizeof(char*));
+    if(inputs == NULL || outputs == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(-1);
+    }
+    for(i = 0; i < num_files; ++i) {
+        inputs[i] = argv[argp + i * 2];
+        outputs[i] = argv[argp + i * 2 + 1];
+    }
+    opts.outputs = outputs;
+
+    i = run_tool_on_files(inputs, num_files, opts.jobs, compact_file, &opts, stdout);
+    free(inputs);
+    free(outputs);
+    return i ? -1 : 0;
 }
@@ -12,12 +12,28 @@ extern "C" {
 #define MAX_REDUCTION_SIZE ((1 << 16) - 1)
 
     typedef int (*compare_callback)(const sized_buf *k1, const sized_buf *k2);
+    typedef int (*compare_arg_callback)(const sized_buf *k1, const sized_buf *k2,
+                                        const void *arg);
 
     typedef struct compare_info {
         /* Compare function */
         compare_callback compare;
+        /* Used instead when compare is NULL, for orders that depend on
+           something other than the keys (spatial views' Z-order) */
+        compare_arg_callback compare_arg;
+        const void *arg;
     } compare_info;
 
+    static inline int compare_keys(const compare_info *cmp,
+                                   const sized_buf *k1,
+                                   const sized_buf *k2)
+    {
+        if (cmp->compare != NULL) {
+            return cmp->compare(k1, k2);
+        }
+        return cmp->compare_arg(k1, k2, cmp->arg);
+    }
+
 
     /* Lookup */
 
@@ -36,14 +52,114 @@ extern "C" {
         couchstore_error_t (*fetch_callback) (struct couchfile_lookup_request *rq,
 					      const sized_buf *k,
 					      const sized_buf *v);
+        /* Called with the size and reduce value of each subtree before
+           descending into it, and with NULL once it's done. */
         couchstore_error_t (*node_callback) (struct couchfile_lookup_request *rq,
                                              uint64_t subtreeSize,
                                              const sized_buf *reduce_value);
     } couchfile_lookup_request;
 
+    /* Returned by a node_callback to pass over the subtree it was called
+       for; it's still called back with NULL after it. */
+#define BTREE_SKIP_SUBTREE ((couchstore_error_t) 1)
+
     couchstore_error_t btree_lookup(couchfile_lookup_request *rq,
                                     uint64_t root_pointer);
 
+    /* Like btree_lookup, but meant for many keys at once: at each interior
+       node it first asks the OS to start reading all the children the keys
+       lead to, so those reads overlap instead of happening one after
+       another. Callbacks still come in key order. Folds are looked up just
+       as btree_lookup does. */
+    couchstore_error_t btree_lookup_batched(couchfile_lookup_request *rq,
+                                            uint64_t root_pointer);
+
+    /* Reads the top levels of the tree with the given root, down to the
+       given depth, so that its interior nodes are in the file's node cache
+       before the first lookups need them. Leaves read on the way aren't
+       kept, so a depth past the interior levels only costs reads. */
+    couchstore_error_t btree_warm(tree_file *file, uint64_t root_pointer, unsigned levels);
+
+    struct decoded_node;
+
+    /* Reads the node at a position, from the file's node cache if it's
+       there; interior nodes read from the file are added to it. Leaves
+       are split into entries only if split_leaves is set. Give the node
+       back with node_release. */
+    couchstore_error_t btree_read_node(tree_file *file, uint64_t pos,
+                                       int split_leaves,
+                                       struct decoded_node **pNode);
+
+    /* Folds in descending order: calls fetch_callback for every key from
+       key 0 down to key 1 inclusive, or down to the first key of the tree
+       if there is only one key. An empty key 0 starts from the last key of
+       the tree. The fold flag is ignored; node_callback is called as in
+       btree_lookup. */
+    couchstore_error_t btree_lookup_descending(couchfile_lookup_request *rq,
+                                               uint64_t root_pointer);
+
+    /* Counting: uses the counts kept in reduce values to count the items
+       in a key range, or to find the item at a given position, reading
+       only the nodes along the way down. */
+    typedef struct btree_count_request {
+        tree_file *file;
+        compare_callback compare;
+        /* Number of items a reduce value stands for: */
+        uint64_t (*reduce_count)(const sized_buf *reduce_value, void *ctx);
+        /* Whether a leaf item is counted (1) or not (0), consistently with
+           reduce_count: */
+        uint64_t (*item_count)(const sized_buf *k, const sized_buf *v, void *ctx);
+        void *ctx;
+    } btree_count_request;
+
+    /* Counts the items from low to high inclusive; either bound may be
+       NULL to leave that end open. */
+    couchstore_error_t btree_count_range(const btree_count_request *rq,
+                                         uint64_t root_pointer,
+                                         const sized_buf *low,
+                                         const sized_buf *high,
+                                         uint64_t *count);
+
+    typedef couchstore_error_t (*btree_nth_callback)(const sized_buf *k,
+                                                     const sized_buf *v,
+                                                     void *ctx);
+
+    /* Calls callback with the counted item that has rank items before it,
+       or returns COUCHSTORE_ERROR_DOC_NOT_FOUND if there are no more than
+       rank. */
+    couchstore_error_t btree_find_nth(const btree_count_request *rq,
+                                      uint64_t root_pointer,
+                                      uint64_t rank,
+                                      btree_nth_callback callback,
+                                      void *callback_ctx);
+
+    /* Cursor: walks the leaves of a tree in key order, keeping the path of
+       nodes down to its position, so that it can be stepped through at the
+       caller's pace and moved without starting again from scratch. */
+    typedef struct btree_cursor btree_cursor;
+
+    couchstore_error_t btree_cursor_create(tree_file *file,
+                                           compare_callback compare,
+                                           btree_cursor **pCursor);
+
+    /* Positions the cursor before the first key >= key (or the first key of
+       all, if key is NULL) in the tree with the given root, which may be
+       NULL for an empty tree. The tree needn't be the one seeked before. */
+    couchstore_error_t btree_cursor_seek(btree_cursor *cursor,
+                                         const node_pointer *root,
+                                         const sized_buf *key);
+
+    /* Steps to the next key. *found is set to 0 at the end of the tree;
+       otherwise key and value point into the cursor's current leaf, and
+       stay valid until the cursor is next moved or freed. After an error
+       the cursor can be stepped again to retry. */
+    couchstore_error_t btree_cursor_next(btree_cursor *cursor,
+                                         sized_buf *key,
+                                         sized_buf *value,
+                                         int *found);
+
+    void btree_cursor_free(btree_cursor *cursor);
+
     /* Modify */
     typedef struct nodelist {
         sized_buf data;
@@ -59,6 +175,27 @@ extern "C" {
                                             int count,
                                             void *ctx);
 
+    /* A modified KP node that holds the children it had but for some
+       replaced: its reduce value before, the pointers of the children
+       replaced, and those of the children written in their place */
+    typedef struct {
+        const sized_buf *old_reduction;
+        const nodelist *removed;
+        int removed_count;
+        const nodelist *added;
+        int added_count;
+    } reduce_delta;
+
+    /* Works out such a node's reduce value from the delta rather than its
+       count items, as rereduce would. Returns 1 if it has, 0 if the items
+       need rereducing after all, or a negative couchstore_error_t. */
+    typedef int (*reduce_delta_fn)(char *dst,
+                                   size_t *size_r,
+                                   const nodelist *itmlist,
+                                   int count,
+                                   const reduce_delta *delta,
+                                   void *ctx);
+
 #define ACTION_FETCH  0
 #define ACTION_REMOVE 1
 #define ACTION_INSERT 2
@@ -90,6 +227,9 @@ extern "C" {
         void (*fetch_callback) (struct couchfile_modify_request *rq, sized_buf *k, sized_buf *v, void *arg);
         reduce_fn reduce;
         reduce_fn rereduce;
+        /* Optional, tried before rereduce on KP nodes it can be given a
+           delta for */
+        reduce_delta_fn reduce_delta;
         void *user_reduce_ctx;
         /* For guided btree purge */
         purge_kp_fn purge_kp;
@@ -124,12 +264,27 @@ extern "C" {
         /* 1 - leaf, 0 - ptr */
         int node_type;
         int error_state;
+        /* For rq->reduce_delta, the old pointer of the KP node modified,
+           and the children replaced in it so far; NULL once the node has
+           split or been purged from, and can only be rereduced. */
+        node_pointer *delta_base;
+        nodelist *removed;
+        int removed_count;
+        nodelist *added;
+        int added_count;
     } couchfile_modify_result;
 
     node_pointer *modify_btree(couchfile_modify_request *rq,
                                node_pointer *root,
                                couchstore_error_t *errcode);
 
+    /* modify_btree, allocating from the given arena rather than one of its
+       own; the caller frees or resets the arena afterwards. */
+    node_pointer *modify_btree_in_arena(couchfile_modify_request *rq,
+                                        node_pointer *root,
+                                        struct arena *a,
+                                        couchstore_error_t *errcode);
+
     couchstore_error_t mr_push_item(sized_buf *k, sized_buf *v, couchfile_modify_result *dst);
 
     couchfile_modify_result* new_btree_modres(arena* a, arena* transient_arena, tree_file *file,
@@ -140,10 +295,53 @@ extern "C" {
 
     node_pointer* complete_new_btree(couchfile_modify_result* mr, couchstore_error_t *errcode);
 
+    /* Adds the leaf ptr points to in source to the tree mr is building,
+       copying its chunk as it is, still compressed, with the key,
+       reduction and position of ptr's KP entry, rather than its items.
+       Items pushed before it are written out first. The source's chunks
+       must be readable in mr's file as they are (see
+       btree_chunks_copyable). */
+    couchstore_error_t mr_push_raw_leaf(couchfile_modify_result *mr,
+                                        tree_file *source,
+                                        const node_pointer *ptr);
+
+    /* Whether leaves can be copied from source to target with
+       mr_push_raw_leaf: their chunks carry the same codec bits and
+       checksums. */
+    int btree_chunks_copyable(const tree_file *source, const tree_file *target);
+
+    /* Copies the whole tree at root_pointer in rq->file into the one mr is
+       building, as a fold of rq would: the items of each leaf go to
+       rq->fetch_callback in order. Before a subtree is read, unchanged is
+       asked about its KP entry (if the chunks are copyable at all); once
+       it returns 1, no item under it would be dropped or altered, so its
+       leaves are copied with mr_push_raw_leaf instead, without asking
+       about anything under it. Negative returns are errors. rq's keys,
+       fold and node_callback are ignored. */
+    couchstore_error_t btree_copy_leaves(couchfile_lookup_request *rq,
+                                         uint64_t root_pointer,
+                                         couchfile_modify_result *mr,
+                                         int (*unchanged)(couchfile_lookup_request *rq,
+                                                          const node_pointer *ptr));
+
     node_pointer *guided_purge_btree(couchfile_modify_request *rq,
                                                 node_pointer *root,
                                                 couchstore_error_t *errcode);
 
+    /* guided_purge_btree, with the subtrees of the root's children it
+       purges some of shared out among nthreads threads, the calling one
+       among them, each calling the callbacks with its own of thread_ctxs
+       in place of guided_purge_ctx, which is kept for the root's own. The
+       threads only read; the calling thread then writes the tree out just
+       as guided_purge_btree would have, by what the callbacks made of each
+       item. A PURGE_STOP keeps the rest of the tree as it is, though the
+       other threads' callbacks may have been called past it. */
+    node_pointer *guided_purge_btree_parallel(couchfile_modify_request *rq,
+                                              node_pointer *root,
+                                              int nthreads,
+                                              void **thread_ctxs,
+                                              couchstore_error_t *errcode);
+
 #ifdef __cplusplus
 }
 #endif
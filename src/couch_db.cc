@@ -7,15 +7,40 @@
 #include <stdio.h>
 
 #include "internal.h"
+#include "background_sync.h"
+#include "bloom_filter.h"
+#include "body_segments.h"
+#include "codec.h"
+#include "delta_buffer.h"
+#include "expiry_index.h"
+#include "node_cache.h"
 #include "node_types.h"
+#include "op_stats.h"
+#include "probes.h"
+#include "value_log.h"
 #include "couch_btree.h"
 #include "bitfield.h"
+#include "crc32.h"
+#include "iobuffer.h"
+#include "local_doc_cache.h"
+#include "read_pool.h"
 #include "reduces.h"
 #include "util.h"
 
 #define ROOT_BASE_SIZE 12
 #define HEADER_BASE_SIZE 25
 
+static couchstore_error_t read_tree_sizing(tree_sizing *sizing, const raw_tree_sizing *raw)
+{
+    sizing->policy = (couchstore_node_size_policy)decode_raw08(raw->policy);
+    sizing->avg_key_size = decode_raw16(raw->avg_key_size);
+    sizing->avg_value_size = decode_raw16(raw->avg_value_size);
+    if (sizing->policy > COUCHSTORE_NODE_SIZE_ADAPTIVE) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 // Initializes one of the db's root node pointers from data in the file header
 static couchstore_error_t read_db_root(Db *db, node_pointer **root,
                                        void *root_data, int root_size)
@@ -33,12 +58,119 @@ cleanup:
     return errcode;
 }
 
+// Sizes of what may follow the roots in the header: each part is there if
+// a later one is, zeroed if unused.
+#define TAIL_BLOOM sizeof(raw_bloom_ref)
+#define TAIL_DICT (TAIL_BLOOM + sizeof(raw_dict_ref))
+#define TAIL_NODE_SIZING (TAIL_DICT + sizeof(raw_node_sizing))
+#define TAIL_DELTA (TAIL_NODE_SIZING + sizeof(raw_delta_ref))
+#define TAIL_COMPACT (TAIL_DELTA + sizeof(raw_compact_ref))
+#define TAIL_EXPIRY (TAIL_COMPACT + sizeof(raw_expiry_ref))
+#define TAIL_VALUE_LOG (TAIL_EXPIRY + sizeof(raw_value_log_ref))
+
+// Reads the refs and settings that follow the roots in the header
+static couchstore_error_t read_header_tail(Db *db, const char *tail, int size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    db->header.bloom_ptr = 0;
+    db->header.bloom_seq = 0;
+    db->header.dict_ptr = 0;
+    memset(&db->header.id_sizing, 0, sizeof(db->header.id_sizing));
+    memset(&db->header.seq_sizing, 0, sizeof(db->header.seq_sizing));
+    db->header.delta_ptr = 0;
+    db->header.compact_ptr = 0;
+    db->header.expiry_index = 0;
+    db->header.expiry_offset = 0;
+    db->header.expiry_root = NULL;
+    db->header.vlog_ptr = 0;
+    db->header.vlog_live = 0;
+
+    if (db->header.disk_version >= COUCH_DISK_VERSION_CODECS) {
+        error_unless(size == 0 || size == (int)TAIL_BLOOM || size == (int)TAIL_DICT ||
+                     size == (int)TAIL_NODE_SIZING || size == (int)TAIL_DELTA ||
+                     size == (int)TAIL_COMPACT ||
+                     (size == (int)TAIL_EXPIRY &&
+                      db->header.disk_version >= COUCH_DISK_VERSION_EXPIRY_INDEX) ||
+                     (size == (int)TAIL_VALUE_LOG &&
+                      db->header.disk_version >= COUCH_DISK_VERSION_VALUE_LOG),
+                     COUCHSTORE_ERROR_CORRUPT);
+    } else if (db->header.disk_version >= COUCH_DISK_VERSION_BLOOM_FILTER) {
+        error_unless(size == 0 || size == (int)TAIL_BLOOM, COUCHSTORE_ERROR_CORRUPT);
+    } else {
+        error_unless(size == 0, COUCHSTORE_ERROR_CORRUPT);
+    }
+
+    if (size >= (int)TAIL_BLOOM) {
+        const raw_bloom_ref *ref = (const raw_bloom_ref*)tail;
+        db->header.bloom_ptr = decode_raw48(ref->pointer);
+        db->header.bloom_seq = decode_raw48(ref->covered_seq);
+        error_unless(db->header.bloom_ptr < db->header.position &&
+                     db->header.bloom_seq <= db->header.update_seq,
+                     COUCHSTORE_ERROR_CORRUPT);
+    }
+    if (size >= (int)TAIL_DICT) {
+        const raw_dict_ref *ref = (const raw_dict_ref*)(tail + TAIL_BLOOM);
+        db->header.dict_ptr = decode_raw48(ref->pointer);
+        // A tail that ends with the dictionary ref is only written for one.
+        error_unless((db->header.dict_ptr != 0 || size > (int)TAIL_DICT) &&
+                     db->header.dict_ptr < db->header.position,
+                     COUCHSTORE_ERROR_CORRUPT);
+    }
+    if (size >= (int)TAIL_NODE_SIZING) {
+        const raw_node_sizing *sizing = (const raw_node_sizing*)(tail + TAIL_DICT);
+        error_pass(read_tree_sizing(&db->header.id_sizing, &sizing->by_id));
+        error_pass(read_tree_sizing(&db->header.seq_sizing, &sizing->by_seq));
+    }
+    if (size >= (int)TAIL_DELTA) {
+        const raw_delta_ref *ref = (const raw_delta_ref*)(tail + TAIL_NODE_SIZING);
+        db->header.delta_ptr = decode_raw48(ref->pointer);
+        error_unless((db->header.delta_ptr != 0 || size > (int)TAIL_DELTA) &&
+                     db->header.delta_ptr < db->header.position,
+                     COUCHSTORE_ERROR_CORRUPT);
+    }
+    if (size >= (int)TAIL_COMPACT) {
+        const raw_compact_ref *ref = (const raw_compact_ref*)(tail + TAIL_DELTA);
+        db->header.compact_ptr = decode_raw48(ref->pointer);
+        error_unless((db->header.compact_ptr != 0 || size > (int)TAIL_COMPACT) &&
+                     db->header.compact_ptr < db->header.position,
+                     COUCHSTORE_ERROR_CORRUPT);
+    }
+    if (size >= (int)TAIL_EXPIRY) {
+        const raw_expiry_ref *ref = (const raw_expiry_ref*)(tail + TAIL_COMPACT);
+        uint16_t offset = decode_raw16(ref->time_offset);
+        if (offset == EXPIRY_NO_INDEX) {
+            // A tail that ends with the expiry part is only written for an index.
+            error_unless(size > (int)TAIL_EXPIRY && decode_raw48(ref->pointer) == 0,
+                         COUCHSTORE_ERROR_CORRUPT);
+        } else {
+            db->header.expiry_index = 1;
+            db->header.expiry_offset = offset;
+        }
+        if (decode_raw48(ref->pointer) != 0) {
+            // The pointer, subtree size and count are laid out as a root.
+            error_pass(read_db_root(db, &db->header.expiry_root, (void *)&ref->pointer,
+                                    (int)(sizeof(*ref) - sizeof(ref->time_offset))));
+        }
+    }
+    if (size >= (int)TAIL_VALUE_LOG) {
+        const raw_value_log_ref *ref = (const raw_value_log_ref*)(tail + TAIL_EXPIRY);
+        db->header.vlog_ptr = decode_raw48(ref->pointer);
+        db->header.vlog_live = decode_raw48(ref->live_bytes);
+        error_unless(db->header.vlog_ptr != 0 &&
+                     db->header.vlog_ptr < db->header.position,
+                     COUCHSTORE_ERROR_CORRUPT);
+    }
+cleanup:
+    return errcode;
+}
+
 // Attempts to initialize the database from a header at the given file position
 static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
 {
     int seqrootsize;
     int idrootsize;
     int localrootsize;
+    int roots_end;
     char *root_data;
     int header_len;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
@@ -47,14 +179,19 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
         char *buf;
     } header_buf = { NULL };
     uint8_t buf[2];
+    // Whatever root was here is the caller's to free.
+    db->header.expiry_root = NULL;
     ssize_t readsize = db->file.ops->pread(&db->file.lastError, db->file.handle,
                                            buf, 2, pos);
     error_unless(readsize == 2, COUCHSTORE_ERROR_READ);
-    if (buf[0] == 0) {
+    if (buf[0] == 0 ||
+        (pos == 0 && (buf[0] == BLOCK_HEADER_HINTS || buf[0] == BLOCK_PREAMBLE))) {
         return COUCHSTORE_ERROR_NO_HEADER;
-    } else if (buf[0] != 1) {
+    } else if (buf[0] != 1 && buf[0] != BLOCK_HEADER_CRC32C) {
         return COUCHSTORE_ERROR_CORRUPT;
     }
+    // The marker tells which CRC the header, and the file, are checked by.
+    db->file.crc32c = buf[0] == BLOCK_HEADER_CRC32C;
 
     header_len = pread_header(&db->file, pos, &header_buf.buf, MAX_DB_HEADER_SIZE);
     if (header_len < 0) {
@@ -63,8 +200,15 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
 
     db->header.position = pos;
     db->header.disk_version = decode_raw08(header_buf.raw->version);
-    error_unless(db->header.disk_version == COUCH_DISK_VERSION,
+    error_unless(db->header.disk_version >= COUCH_MIN_DISK_VERSION &&
+                 db->header.disk_version <= COUCH_DISK_VERSION,
                  COUCHSTORE_ERROR_HEADER_VERSION);
+    error_unless(!db->file.crc32c || db->header.disk_version >= COUCH_DISK_VERSION_CRC32C,
+                 COUCHSTORE_ERROR_CORRUPT);
+    // Files stay in the format they were created with, so that older
+    // versions can still read the ones they wrote.
+    db->file.prefix_keys = db->header.disk_version >= COUCH_DISK_VERSION_PREFIXED_KEYS;
+    db->file.chunk_codecs = db->header.disk_version >= COUCH_DISK_VERSION_CODECS;
     db->header.update_seq = decode_raw48(header_buf.raw->update_seq);
     db->header.purge_seq = decode_raw48(header_buf.raw->purge_seq);
     db->header.purge_ptr = decode_raw48(header_buf.raw->purge_ptr);
@@ -72,8 +216,15 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
     seqrootsize = decode_raw16(header_buf.raw->seqrootsize);
     idrootsize = decode_raw16(header_buf.raw->idrootsize);
     localrootsize = decode_raw16(header_buf.raw->localrootsize);
-    error_unless(header_len == HEADER_BASE_SIZE + seqrootsize + idrootsize + localrootsize,
-                 COUCHSTORE_ERROR_CORRUPT);
+    roots_end = HEADER_BASE_SIZE + seqrootsize + idrootsize + localrootsize;
+    error_pass(read_header_tail(db, header_buf.buf + roots_end, header_len - roots_end));
+    if (db->file.dict_pos != db->header.dict_ptr) {
+        // Rewound to before the dictionary, or onto another file's.
+        codec_dict_free(db->file.dict);
+        db->file.dict = NULL;
+        db->file.dict_pos = db->header.dict_ptr;
+    }
+    db_value_log_moved(db);
 
     root_data = (char*) (header_buf.raw + 1);  // i.e. just past *header_buf
     error_pass(read_db_root(db, &db->header.by_seq_root, root_data, seqrootsize));
@@ -83,18 +234,62 @@ static couchstore_error_t find_header_at_pos(Db *db, cs_off_t pos)
     error_pass(read_db_root(db, &db->header.local_docs_root, root_data, localrootsize));
 
 cleanup:
-    free(header_buf.raw);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        // Unlike the other roots, it's read before the header is known to
+        // be good, and the next one tried would lose it.
+        cs_free(db->header.expiry_root);
+        db->header.expiry_root = NULL;
+    }
+    cs_free(header_buf.raw);
     return errcode;
 }
 
-// Finds the database header by scanning back from the end of the file at 4k boundaries
+// Whether the header needs node sizing, which adaptive policies keep there
+static int has_node_sizing(const db_header *header)
+{
+    return header->id_sizing.policy != COUCHSTORE_NODE_SIZE_FIXED ||
+           header->seq_sizing.policy != COUCHSTORE_NODE_SIZE_FIXED;
+}
+
+// Size of what follows the roots in the header
+static size_t header_tail_size(const db_header *header)
+{
+    if (header->vlog_ptr) {
+        return TAIL_VALUE_LOG;
+    } else if (header->expiry_index) {
+        return TAIL_EXPIRY;
+    } else if (header->compact_ptr) {
+        return TAIL_COMPACT;
+    } else if (header->delta_ptr) {
+        return TAIL_DELTA;
+    } else if (has_node_sizing(header)) {
+        return TAIL_NODE_SIZING;
+    } else if (header->dict_ptr) {
+        return TAIL_DICT;
+    } else if (header->bloom_ptr) {
+        return TAIL_BLOOM;
+    }
+    return 0;
+}
+
+static void encode_tree_sizing(raw_tree_sizing *raw, const tree_sizing *sizing)
+{
+    raw->policy = encode_raw08(sizing->policy);
+    raw->avg_key_size = encode_raw16(sizing->avg_key_size);
+    raw->avg_value_size = encode_raw16(sizing->avg_value_size);
+}
+
+// Finds the database header by scanning back from the end of the file at
+// block boundaries
 static couchstore_error_t find_header(Db *db, int64_t start_pos)
 {
     couchstore_error_t last_header_errcode = COUCHSTORE_ERROR_NO_HEADER;
+    const int64_t block_size = (int64_t)db->file.block_size;
     int64_t pos = start_pos;
-    pos -= pos % COUCH_BLOCK_SIZE;
-    for (; pos >= 0; pos -= COUCH_BLOCK_SIZE) {
+    pos -= pos % block_size;
+    for (; pos >= 0; pos -= block_size) {
         couchstore_error_t errcode = find_header_at_pos(db, pos);
+        PROBE2(find_header, pos, errcode);
         switch(errcode) {
             case COUCHSTORE_SUCCESS:
                 // Found it!
@@ -114,7 +309,97 @@ static couchstore_error_t find_header(Db *db, int64_t start_pos)
     return last_header_errcode;
 }
 
-static couchstore_error_t db_write_header(Db *db)
+// Writes the list of the latest headers into block 0, after its marker,
+// which follows the file's preamble if it has one, through the file given.
+static couchstore_error_t write_header_hints(Db *db, tree_file *file)
+{
+    char buf[1 + sizeof(raw_header_hints)];
+    raw_header_hints *raw = (raw_header_hints*)(buf + 1);
+    unsigned ii;
+
+    memset(buf, 0, sizeof(buf));
+    buf[0] = BLOCK_HEADER_HINTS;
+    raw->count = encode_raw08((uint8_t)db->nhints);
+    for (ii = 0; ii < db->nhints; ii++) {
+        raw->headers[ii] = encode_raw48(db->hints[ii]);
+    }
+    raw->crc32 = encode_raw32(hash_crc32((const char*)&raw->count,
+                                         sizeof(*raw) - sizeof(raw->crc32)));
+    // Appends never reach block 0, so the list goes straight to the file;
+    // that way the syncer can write it through its shared handle.
+    ssize_t written = couch_pwrite_unbuffered(&file->lastError, file->ops,
+                                              file->handle, buf, sizeof(buf),
+                                              file_preamble_size(&db->file));
+    return written < 0 ? (couchstore_error_t)written : COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t db_add_header_hint(Db *db, tree_file *file, uint64_t pos)
+{
+    memmove(db->hints + 1, db->hints, (HEADER_HINTS - 1) * sizeof(db->hints[0]));
+    db->hints[0] = pos;
+    if (db->nhints < HEADER_HINTS) {
+        ++db->nhints;
+    }
+    return write_header_hints(db, file);
+}
+
+// Loads the list of the latest headers from block 0, returning whether the
+// file has one that checks out.
+static int read_header_hints(Db *db)
+{
+    char buf[1 + sizeof(raw_header_hints)];
+    const raw_header_hints *raw = (const raw_header_hints*)(buf + 1);
+    unsigned ii, count;
+
+    // Rewritten in place, so not to be taken from a read buffer
+    ssize_t got = couch_pread_unbuffered(&db->file.lastError, db->file.ops,
+                                         db->file.handle, buf, sizeof(buf),
+                                         file_preamble_size(&db->file));
+    if (got != (ssize_t)sizeof(buf) || buf[0] != BLOCK_HEADER_HINTS ||
+        decode_raw32(raw->crc32) != hash_crc32((const char*)&raw->count,
+                                               sizeof(*raw) - sizeof(raw->crc32))) {
+        return 0;
+    }
+    count = decode_raw08(raw->count);
+    if (count > HEADER_HINTS) {
+        return 0;
+    }
+    for (ii = 0; ii < count; ii++) {
+        db->hints[ii] = decode_raw48(raw->headers[ii]);
+    }
+    db->nhints = count;
+    return 1;
+}
+
+// Finds the newest header, from the list in block 0 if the file has one,
+// and otherwise by scanning back from the end of the file, having taken
+// the block size from the preamble.
+static couchstore_error_t find_newest_header(Db *db)
+{
+    unsigned ii;
+
+    couchstore_error_t errcode = read_file_preamble(&db->file);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    db->header_hints = read_header_hints(db);
+    if (!db->header_hints) {
+        db->nhints = 0;
+    }
+    for (ii = 0; ii < db->nhints; ii++) {
+        // Newest first; one that didn't make it to disk is passed over.
+        if (db->hints[ii] + 2 > (uint64_t)db->file.pos) {
+            continue;
+        }
+        errcode = find_header_at_pos(db, db->hints[ii]);
+        if (errcode == COUCHSTORE_SUCCESS || errcode == COUCHSTORE_ERROR_ALLOC_FAIL) {
+            return errcode;
+        }
+    }
+    return find_header(db, db->file.pos - 2);
+}
+
+couchstore_error_t db_write_header(Db *db)
 {
     sized_buf writebuf;
     size_t seqrootsize = 0, idrootsize = 0, localrootsize = 0;
@@ -127,10 +412,12 @@ static couchstore_error_t db_write_header(Db *db)
     if (db->header.local_docs_root) {
         localrootsize = ROOT_BASE_SIZE + db->header.local_docs_root->reduce_value.size;
     }
-    writebuf.size = sizeof(raw_file_header) + seqrootsize + idrootsize + localrootsize;
-    writebuf.buf = (char *) calloc(1, writebuf.size);
+    size_t tailsize = header_tail_size(&db->header);
+    writebuf.size = sizeof(raw_file_header) + seqrootsize + idrootsize + localrootsize +
+                    tailsize;
+    writebuf.buf = (char *) cs_calloc(1, writebuf.size);
     raw_file_header* header = (raw_file_header*)writebuf.buf;
-    header->version = encode_raw08(COUCH_DISK_VERSION);
+    header->version = encode_raw08(db->header.disk_version);
     header->update_seq = encode_raw48(db->header.update_seq);
     header->purge_seq = encode_raw48(db->header.purge_seq);
     header->purge_ptr = encode_raw48(db->header.purge_ptr);
@@ -143,18 +430,60 @@ static couchstore_error_t db_write_header(Db *db)
     encode_root(root, db->header.by_id_root);
     root += idrootsize;
     encode_root(root, db->header.local_docs_root);
+    // Each part of the tail is there if a later one is, zeroed if unused.
+    uint8_t *tail = root + localrootsize;
+    if (tailsize >= TAIL_BLOOM) {
+        raw_bloom_ref *ref = (raw_bloom_ref*)tail;
+        ref->pointer = encode_raw48(db->header.bloom_ptr);
+        ref->covered_seq = encode_raw48(db->header.bloom_seq);
+    }
+    if (tailsize >= TAIL_DICT) {
+        raw_dict_ref *ref = (raw_dict_ref*)(tail + TAIL_BLOOM);
+        ref->pointer = encode_raw48(db->header.dict_ptr);
+    }
+    if (tailsize >= TAIL_NODE_SIZING) {
+        raw_node_sizing *sizing = (raw_node_sizing*)(tail + TAIL_DICT);
+        encode_tree_sizing(&sizing->by_id, &db->header.id_sizing);
+        encode_tree_sizing(&sizing->by_seq, &db->header.seq_sizing);
+    }
+    if (tailsize >= TAIL_DELTA) {
+        raw_delta_ref *ref = (raw_delta_ref*)(tail + TAIL_NODE_SIZING);
+        ref->pointer = encode_raw48(db->header.delta_ptr);
+    }
+    if (tailsize >= TAIL_COMPACT) {
+        raw_compact_ref *ref = (raw_compact_ref*)(tail + TAIL_DELTA);
+        ref->pointer = encode_raw48(db->header.compact_ptr);
+    }
+    if (tailsize >= TAIL_EXPIRY) {
+        raw_expiry_ref *ref = (raw_expiry_ref*)(tail + TAIL_COMPACT);
+        ref->time_offset = encode_raw16(db->header.expiry_index ? db->header.expiry_offset
+                                                                : EXPIRY_NO_INDEX);
+        encode_root(&ref->pointer, db->header.expiry_root);
+    }
+    if (tailsize >= TAIL_VALUE_LOG) {
+        raw_value_log_ref *ref = (raw_value_log_ref*)(tail + TAIL_EXPIRY);
+        ref->pointer = encode_raw48(db->header.vlog_ptr);
+        ref->live_bytes = encode_raw48(db->header.vlog_live);
+    }
     cs_off_t pos;
     couchstore_error_t errcode = write_header(&db->file, &writebuf, &pos);
     if (errcode == COUCHSTORE_SUCCESS) {
         db->header.position = pos;
     }
-    free(writebuf.buf);
+    if (errcode == COUCHSTORE_SUCCESS && db->header_hints && db->syncer == NULL) {
+        // Synced along with the header, by whoever syncs that. In relaxed
+        // mode the syncer lists headers once they're synced instead.
+        errcode = db_add_header_hint(db, &db->file, pos);
+    }
+    cs_free(writebuf.buf);
     return errcode;
 }
 
 static couchstore_error_t create_header(Db *db)
 {
     db->header.disk_version = COUCH_DISK_VERSION;
+    db->file.prefix_keys = 1;
+    db->file.chunk_codecs = 1;
     db->header.update_seq = 0;
     db->header.by_id_root = NULL;
     db->header.by_seq_root = NULL;
@@ -162,6 +491,35 @@ static couchstore_error_t create_header(Db *db)
     db->header.purge_seq = 0;
     db->header.purge_ptr = 0;
     db->header.position = 0;
+    db->header.bloom_ptr = 0;
+    db->header.bloom_seq = 0;
+    db->header.dict_ptr = 0;
+    memset(&db->header.id_sizing, 0, sizeof(db->header.id_sizing));
+    memset(&db->header.seq_sizing, 0, sizeof(db->header.seq_sizing));
+    db->header.delta_ptr = 0;
+    db->header.compact_ptr = 0;
+    db->header.expiry_index = 0;
+    db->header.expiry_offset = 0;
+    db->header.expiry_root = NULL;
+    db->header.vlog_ptr = 0;
+    db->header.vlog_live = 0;
+    if (file_preamble_size(&db->file) > 0) {
+        // Block 0 is kept for the preamble, and any list after it.
+        couchstore_error_t errcode = write_file_preamble(&db->file);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+        db->file.pos = db->file.block_size;
+    }
+    if (db->header_hints) {
+        // Block 0 is kept for the list.
+        db->nhints = 0;
+        couchstore_error_t errcode = write_header_hints(db, &db->file);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+        db->file.pos = db->file.block_size;
+    }
     return db_write_header(db);
 }
 
@@ -171,9 +529,18 @@ uint64_t couchstore_get_header_position(Db *db)
     return db->header.position;
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_commit(Db *db)
+couchstore_error_t db_commit_prepare(Db *db)
 {
+    couchstore_error_t errcode = db_delta_prepare_commit(db);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = db_bloom_prepare_commit(db);
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = db_value_log_sync(db);
+    }
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
     cs_off_t curpos = db->file.pos;
     sized_buf zerobyte = { const_cast<char*>("\0"), 1};
     size_t seqrootsize = 0, idrootsize = 0, localrootsize = 0;
@@ -187,25 +554,140 @@ couchstore_error_t couchstore_commit(Db *db)
         localrootsize = 12 + db->header.local_docs_root->reduce_value.size;
     }
     db->file.pos += 25 + seqrootsize + idrootsize + localrootsize;
+    db->file.pos += header_tail_size(&db->header);
     //Extend file size to where end of header will land before we do first sync
-    db_write_buf(&db->file, &zerobyte, NULL, NULL);
-
-    couchstore_error_t errcode = db->file.ops->sync(&db->file.lastError,
-                                                    db->file.handle);
+    int written = db_write_buf(&db->file, &zerobyte, NULL, NULL);
 
     //Set the pos back to where it was when we started to write the real header.
     db->file.pos = curpos;
+    return written < 0 ? (couchstore_error_t)written : COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_commit(Db *db)
+{
+    OP_STATS_START(db->op_stats);
+    PROBE1(commit_start, db->file.pos);
+    couchstore_error_t errcode = db_commit_prepare(db);
+
+    if (errcode == COUCHSTORE_SUCCESS && db->syncer == NULL) {
+        errcode = db->file.ops->sync(&db->file.lastError, db->file.handle);
+    }
+
     if (errcode == COUCHSTORE_SUCCESS) {
         errcode = db_write_header(db);
     }
 
     if (errcode == COUCHSTORE_SUCCESS) {
-        errcode = db->file.ops->sync(&db->file.lastError, db->file.handle);
+        if (db->syncer == NULL) {
+            errcode = db->file.ops->sync(&db->file.lastError, db->file.handle);
+        } else {
+            // Out to the file, for the syncer's handle to sync.
+            errcode = couch_flush_buffered_file(&db->file.lastError, db->file.ops,
+                                                db->file.handle);
+        }
     }
 
+    if (errcode == COUCHSTORE_SUCCESS) {
+        db_count_commit(db);
+        if (db->syncer != NULL) {
+            errcode = background_sync_committed(db->syncer, db->header.position,
+                                                db->header.update_seq);
+        }
+    }
+
+    PROBE2(commit_end, db->header.position, errcode);
+    OP_STATS_END(db->op_stats, commit);
     return errcode;
 }
 
+void db_count_commit(Db *db)
+{
+    // Everything is flushed by now, so the written bytes are all counted.
+    couch_histogram_add(&db->io_stats.commit_bytes,
+                        db->io_stats.bytes_written - db->bytes_written_at_commit);
+    db->bytes_written_at_commit = db->io_stats.bytes_written;
+    ++db->io_stats.commits;
+    if (db->readers != NULL) {
+        read_pool_committed(db->readers, db->header.position);
+    }
+}
+
+LIBCOUCHSTORE_API
+void couchstore_get_io_stats(Db *db, couchstore_io_stats *stats)
+{
+    *stats = db->io_stats;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_reset_io_stats(Db *db)
+{
+    memset(&db->io_stats, 0, sizeof(db->io_stats));
+    db->bytes_written_at_commit = 0;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_op_stats(Db *db, int enable)
+{
+#ifdef COUCHSTORE_OP_STATS
+    if (enable && db->op_stats == NULL) {
+        db->op_stats = static_cast<couchstore_op_stats*>(cs_calloc(1, sizeof(couchstore_op_stats)));
+        if (db->op_stats == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    } else if (!enable) {
+        cs_free(db->op_stats);
+        db->op_stats = NULL;
+    }
+    db->file.op_stats = db->op_stats;
+    return COUCHSTORE_SUCCESS;
+#else
+    return enable ? COUCHSTORE_ERROR_INVALID_ARGUMENTS : COUCHSTORE_SUCCESS;
+#endif
+}
+
+LIBCOUCHSTORE_API
+void couchstore_get_op_stats(Db *db, couchstore_op_stats *stats)
+{
+    if (db->op_stats != NULL) {
+        *stats = *db->op_stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+LIBCOUCHSTORE_API
+void couchstore_reset_op_stats(Db *db)
+{
+    if (db->op_stats != NULL) {
+        memset(db->op_stats, 0, sizeof(*db->op_stats));
+    }
+}
+
+LIBCOUCHSTORE_API
+void couchstore_get_memory_stats(Db *db, couchstore_memory_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (db != NULL) {
+        stats->io_buffers = couch_buffered_file_memory(db->file.ops, db->file.handle);
+        if (db->file.node_cache) {
+            stats->node_cache = node_cache_memory(db->file.node_cache);
+        }
+        stats->bloom_filter = bloom_memory(db->bloom);
+        stats->delta_buffer = db_delta_memory(db);
+        stats->dictionary = codec_dict_memory(db->file.dict);
+        if (db->readers) {
+            stats->read_pool = read_pool_memory(db->readers);
+        }
+        stats->local_docs = local_cache_memory(db->local_cache);
+        stats->total = stats->io_buffers + stats->node_cache + stats->bloom_filter +
+                       stats->delta_buffer + stats->dictionary + stats->read_pool +
+                       stats->local_docs;
+    }
+    stats->arenas = arena_total_held();
+    stats->arena_pool = arena_total_pooled();
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_open_db(const char *filename,
                                       couchstore_open_flags flags,
@@ -230,8 +712,17 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
         (flags & COUCHSTORE_OPEN_FLAG_CREATE)) {
         return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
     }
+    if ((flags & COUCHSTORE_OPEN_FLAG_MMAP) &&
+        !(flags & COUCHSTORE_OPEN_FLAG_RDONLY)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    unsigned block_shift = (unsigned)((flags & COUCHSTORE_OPEN_BLOCK_SHIFT_MASK) >> 32);
+    if (block_shift != 0 &&
+        (block_shift < COUCH_MIN_BLOCK_SHIFT || block_shift > COUCH_MAX_BLOCK_SHIFT)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
 
-    if ((db = static_cast<Db*>(calloc(1, sizeof(Db)))) == NULL) {
+    if ((db = static_cast<Db*>(cs_calloc(1, sizeof(Db)))) == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
 
@@ -246,6 +737,10 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
     }
 
     error_pass(tree_file_open(&db->file, filename, openflags, ops));
+    tree_file_set_io_stats(&db->file, &db->io_stats);
+    if (flags & COUCHSTORE_OPEN_FLAG_MMAP) {
+        error_pass(tree_file_map(&db->file));
+    }
 
     if ((db->file.pos = db->file.ops->goto_eof(&db->file.lastError, db->file.handle)) == 0) {
         /* This is an empty file. Create a new fileheader unless the
@@ -254,10 +749,24 @@ couchstore_error_t couchstore_open_db_ex(const char *filename,
         if (flags & COUCHSTORE_OPEN_FLAG_RDONLY) {
             error_pass(COUCHSTORE_ERROR_NO_HEADER);
         } else {
+            db->header_hints = (flags & COUCHSTORE_OPEN_FLAG_HEADER_HINTS) != 0;
+            db->file.crc32c = (flags & COUCHSTORE_OPEN_FLAG_CRC32C) != 0;
+            if (block_shift != 0) {
+                db->file.block_size = (size_t)1 << block_shift;
+            }
             error_pass(create_header(db));
         }
     } else {
-        error_pass(find_header(db, db->file.pos - 2));
+        error_pass(find_newest_header(db));
+    }
+    db->readonly = (flags & COUCHSTORE_OPEN_FLAG_RDONLY) != 0;
+    error_pass(db_delta_load(db));
+    if (db->header.disk_version >= COUCH_DISK_VERSION_BLOOM_FILTER) {
+        db->bloom_enabled = (flags & COUCHSTORE_OPEN_FLAG_BLOOM_FILTER) ||
+                            db->header.bloom_ptr != 0;
+    }
+    if (flags & COUCHSTORE_OPEN_FLAG_SHARED_READS) {
+        error_pass(read_pool_create(db, &db->readers));
     }
 
     *pDb = db;
@@ -277,19 +786,80 @@ couchstore_error_t couchstore_drop_file(Db *db)
     if(db->dropped) {
         return COUCHSTORE_SUCCESS;
     }
+    // The snapshots read through the file's handle, as does the syncer.
+    read_pool_destroy(db->readers);
+    db->readers = NULL;
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (db->syncer != NULL) {
+        errcode = background_sync_stop(db->syncer);
+        db->syncer = NULL;
+    }
+    db_value_log_close(db);
     tree_file_close(&db->file);
     db->dropped = 1;
-    return COUCHSTORE_SUCCESS;
+    return errcode;
 }
 
 LIBCOUCHSTORE_API
-couchstore_error_t couchstore_reopen_file(Db* db, char* filename, couchstore_open_flags flags)
+couchstore_error_t couchstore_set_relaxed_durability(Db *db,
+                                                     const couchstore_relaxed_durability *options)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    if(!db->dropped) {
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    if (db->syncer != NULL) {
+        errcode = background_sync_stop(db->syncer);
+        db->syncer = NULL;
+        error_pass(errcode);
+    }
+    if (options != NULL) {
+        // Opening the file after a crash goes back to the last header the
+        // syncer listed, whose data it had synced first.
+        error_unless(!db->readonly && db->header_hints,
+                     COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+        error_pass(background_sync_start(db, options, &db->syncer));
+    }
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_get_durable_header(Db *db, uint64_t *position, uint64_t *update_seq)
+{
+    if (db->syncer != NULL) {
+        background_sync_durable(db->syncer, position, update_seq);
+    } else {
+        *position = db->header.position;
+        *update_seq = db->header.update_seq;
+    }
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_wait_durable(Db *db, uint64_t position)
+{
+    if (db->syncer == NULL) {
         return COUCHSTORE_SUCCESS;
     }
+    return background_sync_wait(db->syncer, position);
+}
+
+// Reopens a dropped handle at the header it had, or if at_newest is set at
+// the newest one in the file, which must then be the same file grown since.
+static couchstore_error_t reopen_file(Db* db, const char* filename,
+                                      couchstore_open_flags flags, int at_newest)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if ((flags & COUCHSTORE_OPEN_FLAG_MMAP) &&
+        !(flags & COUCHSTORE_OPEN_FLAG_RDONLY)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
     db_header previous = db->header;
+    couchstore_block_cache *cache = db->file.cache;
+    couchstore_buffer_options buffer_options = db->file.buffer_options;
+    size_t node_cache_size = db->file.node_cache_size;
+    unsigned compression_threads = db->file.compression_threads;
+    size_t prealloc_chunk = db->file.prealloc_chunk;
+    couchstore_codec doc_codec = db->file.doc_codec;
+    couchstore_codec node_codec = db->file.node_codec;
     int openflags = 0;
     if(flags & COUCHSTORE_OPEN_FLAG_RDONLY) {
         openflags = O_RDONLY;
@@ -298,55 +868,586 @@ couchstore_error_t couchstore_reopen_file(Db* db, char* filename, couchstore_ope
     }
 
     error_pass(tree_file_open(&db->file, filename, openflags, db->file.ops));
-    error_pass(find_header_at_pos(db, previous.position));
-    free(previous.by_id_root);
-    free(previous.by_seq_root);
-    free(previous.local_docs_root);
+    tree_file_set_io_stats(&db->file, &db->io_stats);
+    db->file.op_stats = db->op_stats;
+    if (flags & COUCHSTORE_OPEN_FLAG_MMAP) {
+        error_pass(tree_file_map(&db->file));
+    }
+    error_pass(tree_file_set_buffer_options(&db->file, &buffer_options));
+    error_pass(tree_file_set_cache(&db->file, cache));
+    error_pass(tree_file_set_node_cache_size(&db->file, node_cache_size));
+    error_pass(tree_file_set_compression_threads(&db->file, compression_threads));
+    error_pass(tree_file_set_preallocation(&db->file, prealloc_chunk));
+    db->file.doc_codec = doc_codec;
+    db->file.node_codec = node_codec;
+    // Writes carry on from the end of the file, as after opening it.
+    db->file.pos = db->file.ops->goto_eof(&db->file.lastError, db->file.handle);
+    error_unless(db->file.pos > 0, COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    if (at_newest) {
+        db_bloom_reset(db);
+        error_pass(find_newest_header(db));
+        db->bloom_enabled |= db->header.bloom_ptr != 0;
+    } else {
+        error_pass(read_file_preamble(&db->file));
+        error_pass(find_header_at_pos(db, previous.position));
+    }
+    cs_free(previous.by_id_root);
+    cs_free(previous.by_seq_root);
+    cs_free(previous.local_docs_root);
+    cs_free(previous.expiry_root);
+    // Another file may well have a root at the same position.
+    local_cache_clear(db->local_cache);
 
     // Assume we've got the same file if we find a header with the
-    // same update_seq at the old position.
-    error_unless(previous.update_seq == db->header.update_seq, COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    // same update_seq at the old position, or one no older past it.
+    if (at_newest) {
+        error_unless(db->header.position >= previous.position &&
+                     db->header.update_seq >= previous.update_seq,
+                     COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    } else {
+        error_unless(previous.update_seq == db->header.update_seq,
+                     COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    }
+    // Like the roots, the buffer goes back to what was last committed.
+    db->readonly = (flags & COUCHSTORE_OPEN_FLAG_RDONLY) != 0;
+    error_pass(db_delta_load(db));
     db->dropped = 0;
+    if (flags & COUCHSTORE_OPEN_FLAG_SHARED_READS) {
+        error_pass(read_pool_create(db, &db->readers));
+    }
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_reopen_file(Db* db, char* filename, couchstore_open_flags flags)
+{
+    if(!db->dropped) {
+        return COUCHSTORE_SUCCESS;
+    }
+    return reopen_file(db, filename, flags, 0);
+}
+
+couchstore_error_t db_refresh_header(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *path = NULL;
+    couchstore_open_flags flags = COUCHSTORE_OPEN_FLAG_RDONLY;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(db->readonly, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    path = cs_strdup(db->file.path);
+    error_unless(path, COUCHSTORE_ERROR_ALLOC_FAIL);
+    if (db->readers != NULL) {
+        flags |= COUCHSTORE_OPEN_FLAG_SHARED_READS;
+    }
+    error_pass(couchstore_drop_file(db));
+    error_pass(reopen_file(db, path, flags, 1));
+cleanup:
+    cs_free(path);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_refresh_db_header(Db *db)
+{
+    return db_refresh_header(db);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_buffer_options(Db *db,
+                                                 const couchstore_buffer_options *options)
+{
+    if (db->dropped) {
+        // Applied by couchstore_reopen_file
+        db->file.buffer_options = *options;
+        return COUCHSTORE_SUCCESS;
+    }
+    return tree_file_set_buffer_options(&db->file, options);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_block_cache(Db *db, couchstore_block_cache *cache)
+{
+    if (db->dropped) {
+        // Picked up again by couchstore_reopen_file
+        db->file.cache = cache;
+        return COUCHSTORE_SUCCESS;
+    }
+    return tree_file_set_cache(&db->file, cache);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_node_cache_size(Db *db, size_t size)
+{
+    if (db->dropped) {
+        // Applied by couchstore_reopen_file
+        db->file.node_cache_size = size;
+        return COUCHSTORE_SUCCESS;
+    }
+    return tree_file_set_node_cache_size(&db->file, size);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_compression_threads(Db *db, unsigned threads)
+{
+    if (db->dropped) {
+        // Applied by couchstore_reopen_file
+        db->file.compression_threads = threads;
+        return COUCHSTORE_SUCCESS;
+    }
+    return tree_file_set_compression_threads(&db->file, threads);
+}
+
+couchstore_error_t couchstore_set_compaction_threads(Db *db, unsigned threads)
+{
+    db->compaction_threads = threads;
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t couchstore_set_compaction_sort_memory(Db *db, size_t max_bytes)
+{
+    db->compaction_sort_memory = max_bytes;
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t couchstore_set_compaction_throttle(Db *db,
+                                                      const couchstore_compact_throttle *throttle)
+{
+    if (throttle) {
+        db->compaction_throttle = *throttle;
+    } else {
+        memset(&db->compaction_throttle, 0, sizeof(db->compaction_throttle));
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_compaction_progress(Db *db,
+                                                      couchstore_compact_progress_fn callback,
+                                                      void *ctx)
+{
+    db->compaction_progress = callback;
+    db->compaction_progress_ctx = ctx;
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_purge_policy(Db *db,
+                                               const couchstore_purge_policy *policy)
+{
+    if (policy) {
+        db->purge_policy = *policy;
+    } else {
+        memset(&db->purge_policy, 0, sizeof(db->purge_policy));
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_preallocation(Db *db, size_t chunk_size)
+{
+    if (db->dropped) {
+        // Applied by couchstore_reopen_file
+        db->file.prealloc_chunk = chunk_size;
+        return COUCHSTORE_SUCCESS;
+    }
+    return tree_file_set_preallocation(&db->file, chunk_size);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_codecs(Db *db,
+                                         couchstore_codec doc_codec,
+                                         couchstore_codec node_codec)
+{
+    if (!codec_available(doc_codec) || !codec_available(node_codec)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (db->header.disk_version < COUCH_DISK_VERSION_CODECS &&
+        (doc_codec != COUCHSTORE_CODEC_SNAPPY || node_codec != COUCHSTORE_CODEC_SNAPPY)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    db->file.doc_codec = doc_codec;
+    db->file.node_codec = node_codec;
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_node_size_policy(Db *db,
+                                                   couchstore_node_size_policy by_id,
+                                                   couchstore_node_size_policy by_seq)
+{
+    if (by_id > COUCHSTORE_NODE_SIZE_ADAPTIVE || by_seq > COUCHSTORE_NODE_SIZE_ADAPTIVE) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (db->header.disk_version < COUCH_DISK_VERSION_CODECS &&
+        (by_id != COUCHSTORE_NODE_SIZE_FIXED || by_seq != COUCHSTORE_NODE_SIZE_FIXED)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    db->header.id_sizing.policy = by_id;
+    db->header.seq_sizing.policy = by_seq;
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_arena_limit(Db *db, size_t max_bytes)
+{
+    db->arena_limit = max_bytes;
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_delta_buffer(Db *db, unsigned max_docs)
+{
+    if (max_docs > 0 && db->header.disk_version < COUCH_DISK_VERSION_CODECS) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    db->delta_max_docs = max_docs;
+    if (max_docs == 0 && !db->dropped) {
+        return db_delta_fold_for_read(db);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_write_back(Db *db, size_t max_bytes)
+{
+    db->write_back_max = max_bytes;
+    if (max_bytes == 0 && !db->dropped) {
+        return db_delta_fold_for_read(db);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Adaptive nodes are filled to a whole number of blocks, leaving room for
+// the chunk header and block prefixes.
+#define NODE_BLOCK_TARGET (COUCH_BLOCK_SIZE - 64)
+// They hold at least this many entries, which takes more blocks when the
+// entries are large:
+#define MIN_KV_ENTRIES 4
+#define MIN_KP_ENTRIES 16
+// Room for the pointer and reduce value of a KP entry
+#define KP_ENTRY_OVERHEAD 40
+
+static int whole_blocks(size_t bytes)
+{
+    size_t blocks = (bytes + NODE_BLOCK_TARGET - 1) / NODE_BLOCK_TARGET;
+    return (int)((blocks ? blocks : 1) * NODE_BLOCK_TARGET);
+}
+
+void tree_sizing_thresholds(const tree_sizing *sizing, int *kv_threshold,
+                            int *kp_threshold)
+{
+    if (sizing->policy != COUCHSTORE_NODE_SIZE_ADAPTIVE) {
+        *kv_threshold = DB_CHUNK_THRESHOLD;
+        *kp_threshold = DB_CHUNK_THRESHOLD;
+        return;
+    }
+    size_t kv_entry = sizing->avg_key_size + sizing->avg_value_size + sizeof(raw_kv_length);
+    size_t kp_entry = sizing->avg_key_size + KP_ENTRY_OVERHEAD;
+    *kv_threshold = whole_blocks(kv_entry * MIN_KV_ENTRIES);
+    *kp_threshold = whole_blocks(kp_entry * MIN_KP_ENTRIES);
+}
+
+static uint16_t fold_average(uint16_t avg, size_t bytes, size_t count)
+{
+    size_t batch = bytes / count;
+    if (batch > UINT16_MAX) {
+        batch = UINT16_MAX;
+    }
+    if (avg == 0) {
+        return (uint16_t)batch;
+    }
+    // A moving average, so that the sizes can drift with the workload
+    return (uint16_t)(((size_t)avg * 7 + batch) / 8);
+}
+
+void tree_sizing_observe(tree_sizing *sizing, size_t key_bytes,
+                         size_t value_bytes, size_t count)
+{
+    if (sizing->policy == COUCHSTORE_NODE_SIZE_ADAPTIVE && count > 0) {
+        sizing->avg_key_size = fold_average(sizing->avg_key_size, key_bytes, count);
+        sizing->avg_value_size = fold_average(sizing->avg_value_size, value_bytes, count);
+    }
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_zstd_dictionary(Db *db, const sized_buf *dict)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    codec_dict *prepared = NULL;
+    cs_off_t pos;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(codec_available(COUCHSTORE_CODEC_ZSTD) &&
+                 db->header.disk_version >= COUCH_DISK_VERSION_CODECS &&
+                 db->header.dict_ptr == 0 && dict->size > 0,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    // Checks that zstd takes it before it's there for good.
+    error_pass(codec_dict_create(dict->buf, dict->size, &prepared));
+    error_pass(static_cast<couchstore_error_t>(db_write_buf(&db->file, dict, &pos, NULL)));
+    db->header.dict_ptr = pos;
+    codec_dict_free(db->file.dict);
+    db->file.dict = prepared;
+    db->file.dict_pos = pos;
+    prepared = NULL;
+
+cleanup:
+    codec_dict_free(prepared);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_rewind_db_header(Db *db)
+{
+    couchstore_error_t errcode;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    // free current header guts
+    cs_free(db->header.by_id_root);
+    cs_free(db->header.by_seq_root);
+    cs_free(db->header.local_docs_root);
+    cs_free(db->header.expiry_root);
+    db_bloom_reset(db);
+
+    error_unless(db->header.position != 0, COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    // find older header
+    error_pass(find_header(db, db->header.position - 2));
+    db->bloom_enabled |= db->header.bloom_ptr != 0;
+    error_pass(db_delta_load(db));
+
+cleanup:
+    // if we failed, free the handle and return an error
+    if(errcode != COUCHSTORE_SUCCESS) {
+        couchstore_close_db(db);
+        errcode = COUCHSTORE_ERROR_DB_NO_LONGER_VALID;
+    }
+    return errcode;
+}
+
+// Moves a freshly opened handle back to the header at pos.
+static couchstore_error_t move_to_header(Db *db, uint64_t pos)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    cs_free(db->header.by_id_root);
+    cs_free(db->header.by_seq_root);
+    cs_free(db->header.local_docs_root);
+    cs_free(db->header.expiry_root);
+    db->header.by_id_root = NULL;
+    db->header.by_seq_root = NULL;
+    db->header.local_docs_root = NULL;
+    db->header.expiry_root = NULL;
+    db_bloom_reset(db);
+    error_unless(pos < (uint64_t)db->file.pos, COUCHSTORE_ERROR_NO_HEADER);
+    error_pass(find_header_at_pos(db, pos));
+    db->bloom_enabled |= db->header.bloom_ptr != 0;
+    error_pass(db_delta_load(db));
+cleanup:
+    return errcode;
+}
+
+couchstore_error_t db_open_at_header(const char *filename,
+                                     const couch_file_ops *ops,
+                                     uint64_t pos,
+                                     Db **pDb)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    error_pass(couchstore_open_db_ex(filename, COUCHSTORE_OPEN_FLAG_RDONLY, ops, &db));
+    if (db->header.position != pos) {
+        error_pass(move_to_header(db, pos));
+    }
+    *pDb = db;
+    db = NULL;
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    return errcode;
+}
+
+// Reads just the update_seq of the header in the given block, if there's a
+// valid one there, without loading the rest of it.
+static couchstore_error_t header_seq_at(Db *db, cs_off_t block, uint64_t *seq)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    cs_off_t pos = block * (cs_off_t)db->file.block_size;
+    char *buf = NULL;
+    uint8_t marker;
+    int len;
+    uint64_t version;
+
+    ssize_t readsize = db->file.ops->pread(&db->file.lastError, db->file.handle,
+                                           &marker, 1, pos);
+    error_unless(readsize == 1, COUCHSTORE_ERROR_READ);
+    error_unless(marker == 1 || marker == BLOCK_HEADER_CRC32C, COUCHSTORE_ERROR_NO_HEADER);
+    len = pread_header(&db->file, pos, &buf, MAX_DB_HEADER_SIZE);
+    error_unless(len >= 0, static_cast<couchstore_error_t>(len));
+    error_unless(len >= (int)sizeof(raw_file_header), COUCHSTORE_ERROR_CORRUPT);
+    version = decode_raw08(((raw_file_header*)buf)->version);
+    error_unless(version >= COUCH_MIN_DISK_VERSION && version <= COUCH_DISK_VERSION,
+                 COUCHSTORE_ERROR_HEADER_VERSION);
+    *seq = decode_raw48(((raw_file_header*)buf)->update_seq);
+cleanup:
+    cs_free(buf);
+    return errcode;
+}
+
+// Finds the newest valid header in blocks lowest to from, as find_header
+// does, reading only its update_seq.
+static couchstore_error_t header_seq_before(Db *db, cs_off_t lowest, cs_off_t from,
+                                            cs_off_t *block, uint64_t *seq)
+{
+    for (*block = from; *block >= lowest; --*block) {
+        couchstore_error_t errcode = header_seq_at(db, *block, seq);
+        if (errcode == COUCHSTORE_SUCCESS || errcode == COUCHSTORE_ERROR_ALLOC_FAIL) {
+            return errcode;
+        }
+    }
+    return COUCHSTORE_ERROR_NO_HEADER;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_db_at_seq(const char *filename,
+                                             uint64_t seq,
+                                             Db **pDb)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL;
+    cs_off_t low, high, best = -1;
+    unsigned ii;
+
+    error_pass(couchstore_open_db_ex(filename, COUCHSTORE_OPEN_FLAG_RDONLY,
+                                     couchstore_get_default_file_ops(), &db));
+    if (db->header.update_seq > seq) {
+        // The header sought is in blocks [low, high); later ones are past seq.
+        low = 0;
+        high = db->header.position / db->file.block_size;
+        // A file with hints lists its latest commits, newest first.
+        for (ii = 0; ii < db->nhints && best < 0; ii++) {
+            cs_off_t block = db->hints[ii] / db->file.block_size;
+            uint64_t found_seq;
+            if (block >= high || header_seq_at(db, block, &found_seq) != COUCHSTORE_SUCCESS) {
+                continue;
+            }
+            if (found_seq <= seq) {
+                // Nothing was committed between it and the one after.
+                best = block;
+                low = high;
+            } else {
+                high = block;
+            }
+        }
+        // Otherwise a binary search, each step scanning back to the header
+        // nearest the middle.
+        while (low < high) {
+            cs_off_t mid = low + (high - low) / 2;
+            cs_off_t block;
+            uint64_t found_seq;
+            errcode = header_seq_before(db, low, mid, &block, &found_seq);
+            if (errcode == COUCHSTORE_ERROR_NO_HEADER) {
+                errcode = COUCHSTORE_SUCCESS;
+                low = mid + 1;
+                continue;
+            }
+            error_pass(errcode);
+            if (found_seq <= seq) {
+                best = block;
+                low = block + 1;
+            } else {
+                high = block;
+            }
+        }
+        error_unless(best >= 0, COUCHSTORE_ERROR_NO_HEADER);
+        error_pass(move_to_header(db, (uint64_t)best * db->file.block_size));
+    }
+    *pDb = db;
+    db = NULL;
 cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
     return errcode;
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_rewind_db_header(Db *db)
+couchstore_error_t db_open_snapshot(Db *source, uint64_t pos, Db **pSnapshot)
 {
-    couchstore_error_t errcode;
-    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
-    // free current header guts
-    free(db->header.by_id_root);
-    free(db->header.by_seq_root);
-    free(db->header.local_docs_root);
-
-    error_unless(db->header.position != 0, COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
-    // find older header
-    error_pass(find_header(db, db->header.position - 2));
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *snap;
 
+    if (source->dropped) {
+        return COUCHSTORE_ERROR_FILE_CLOSED;
+    }
+    if ((snap = static_cast<Db*>(cs_calloc(1, sizeof(Db)))) == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    error_pass(tree_file_open_shared(&snap->file, &source->file));
+    tree_file_set_io_stats(&snap->file, &snap->io_stats);
+    error_pass(tree_file_set_buffer_options(&snap->file, &source->file.buffer_options));
+    error_pass(tree_file_set_cache(&snap->file, source->file.cache));
+    error_pass(tree_file_set_node_cache_size(&snap->file, source->file.node_cache_size));
+    snap->header_hints = source->header_hints;
+    snap->readonly = 1;
+    error_pass(find_header_at_pos(snap, pos));
+    error_pass(db_delta_load(snap));
+    snap->bloom_enabled = snap->header.bloom_ptr != 0;
+
+    *pSnapshot = snap;
+    snap = NULL;
 cleanup:
-    // if we failed, free the handle and return an error
-    if(errcode != COUCHSTORE_SUCCESS) {
-        couchstore_close_db(db);
-        errcode = COUCHSTORE_ERROR_DB_NO_LONGER_VALID;
+    if (snap != NULL) {
+        couchstore_close_db(snap);
+    }
+    return errcode;
+}
+
+couchstore_error_t db_move_snapshot(Db *snap, uint64_t pos)
+{
+    cs_free(snap->header.by_id_root);
+    cs_free(snap->header.by_seq_root);
+    cs_free(snap->header.local_docs_root);
+    cs_free(snap->header.expiry_root);
+    snap->header.by_id_root = NULL;
+    snap->header.by_seq_root = NULL;
+    snap->header.local_docs_root = NULL;
+    snap->header.expiry_root = NULL;
+    db_bloom_reset(snap);
+    couchstore_error_t errcode = find_header_at_pos(snap, pos);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = db_delta_load(snap);
     }
+    snap->bloom_enabled = snap->header.bloom_ptr != 0;
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_snapshot(Db *db, Db **pSnapshot)
+{
+    // The header last committed, which a writer can't change under us:
+    return db_open_snapshot(db, db->header.position, pSnapshot);
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_close_db(Db *db)
 {
+    read_pool_destroy(db->readers);
+    if (db->syncer != NULL) {
+        background_sync_stop(db->syncer);
+    }
     if(!db->dropped) {
         tree_file_close(&db->file);
     }
 
-    free(db->header.by_id_root);
-    free(db->header.by_seq_root);
-    free(db->header.local_docs_root);
+    cs_free(db->header.by_id_root);
+    cs_free(db->header.by_seq_root);
+    cs_free(db->header.local_docs_root);
+    cs_free(db->header.expiry_root);
+    db_bloom_reset(db);
+    db_delta_reset(db);
+    local_cache_destroy(db->local_cache);
+    db_value_log_close(db);
+    cs_free(db->op_stats);
 
     memset(db, 0xa5, sizeof(*db));
-    free(db);
+    cs_free(db);
 
     return COUCHSTORE_SUCCESS;
 }
@@ -364,7 +1465,7 @@ DocInfo* couchstore_alloc_docinfo(const sized_buf *id, const sized_buf *rev_meta
     if (rev_meta) {
         size += rev_meta->size;
     }
-    DocInfo* docInfo = static_cast<DocInfo*>(malloc(size));
+    DocInfo* docInfo = static_cast<DocInfo*>(cs_malloc(size));
     if (!docInfo) {
         return NULL;
     }
@@ -387,7 +1488,7 @@ DocInfo* couchstore_alloc_docinfo(const sized_buf *id, const sized_buf *rev_meta
 LIBCOUCHSTORE_API
 void couchstore_free_docinfo(DocInfo *docinfo)
 {
-    free(docinfo);
+    cs_free(docinfo);
 }
 
 LIBCOUCHSTORE_API
@@ -399,9 +1500,11 @@ void couchstore_free_document(Doc *doc)
     }
 }
 
-couchstore_error_t by_seq_read_docinfo(DocInfo **pInfo,
-                                       const sized_buf *k,
-                                       const sized_buf *v)
+// Fills in a DocInfo from a by-sequence index entry without allocating;
+// its id and rev_meta point into the value.
+static couchstore_error_t by_seq_decode_docinfo(DocInfo *docInfo,
+                                                const sized_buf *k,
+                                                const sized_buf *v)
 {
     const raw_seq_index_value *raw = (const raw_seq_index_value*)v->buf;
     ssize_t extraSize = v->size - sizeof(*raw);
@@ -420,24 +1523,23 @@ couchstore_error_t by_seq_read_docinfo(DocInfo **pInfo,
 
     sized_buf id = {v->buf + sizeof(*raw), idsize};
     sized_buf rev_meta = {id.buf + idsize, extraSize - id.size};
-    DocInfo* docInfo = couchstore_alloc_docinfo(&id, &rev_meta);
-    if (!docInfo) {
-        return COUCHSTORE_ERROR_ALLOC_FAIL;
-    }
 
+    docInfo->id = id;
+    docInfo->rev_meta = rev_meta;
     docInfo->db_seq = db_seq;
     docInfo->rev_seq = rev_seq;
     docInfo->deleted = deleted;
     docInfo->bp = bp;
     docInfo->size = datasize;
     docInfo->content_meta = content_meta;
-    *pInfo = docInfo;
     return COUCHSTORE_SUCCESS;
 }
 
-static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo,
-                                             const sized_buf *k,
-                                             const sized_buf *v)
+// Fills in a DocInfo from a by-ID index entry without allocating; its id
+// and rev_meta point into the key and value.
+static couchstore_error_t by_id_decode_docinfo(DocInfo *docInfo,
+                                               const sized_buf *k,
+                                               const sized_buf *v)
 {
     const raw_id_index_value *raw = (const raw_id_index_value*)v->buf;
     ssize_t revMetaSize = v->size - sizeof(*raw);
@@ -458,56 +1560,114 @@ static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo,
     revnum = decode_raw48(raw->rev_seq);
 
     sized_buf rev_meta = {v->buf + sizeof(*raw), static_cast<size_t>(revMetaSize)};
-    DocInfo* docInfo = couchstore_alloc_docinfo(k, &rev_meta);
-    if (!docInfo) {
-        return COUCHSTORE_ERROR_ALLOC_FAIL;
-    }
 
+    docInfo->id = *k;
+    docInfo->rev_meta = rev_meta;
     docInfo->db_seq = seq;
     docInfo->rev_seq = revnum;
     docInfo->deleted = deleted;
     docInfo->bp = bp;
     docInfo->size = datasize;
     docInfo->content_meta = content_meta;
+    return COUCHSTORE_SUCCESS;
+}
+
+// Copies a DocInfo whose id and rev_meta are borrowed into one allocation.
+static couchstore_error_t copy_docinfo(DocInfo **pInfo, const DocInfo *borrowed)
+{
+    DocInfo* docInfo = couchstore_alloc_docinfo(&borrowed->id, &borrowed->rev_meta);
+    if (!docInfo) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    sized_buf id = docInfo->id, rev_meta = docInfo->rev_meta;
+    *docInfo = *borrowed;
+    docInfo->id = id;
+    docInfo->rev_meta = rev_meta;
     *pInfo = docInfo;
     return COUCHSTORE_SUCCESS;
 }
 
+couchstore_error_t by_seq_read_docinfo(DocInfo **pInfo,
+                                       const sized_buf *k,
+                                       const sized_buf *v)
+{
+    DocInfo borrowed;
+    couchstore_error_t errcode = by_seq_decode_docinfo(&borrowed, k, v);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    return copy_docinfo(pInfo, &borrowed);
+}
+
+static couchstore_error_t by_id_read_docinfo(DocInfo **pInfo,
+                                             const sized_buf *k,
+                                             const sized_buf *v)
+{
+    DocInfo borrowed;
+    couchstore_error_t errcode = by_id_decode_docinfo(&borrowed, k, v);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    return copy_docinfo(pInfo, &borrowed);
+}
+
+// Makes a Doc holding a copy of a body, in one allocation.
+static couchstore_error_t body_to_doc(Doc **pDoc, const char *body, size_t size)
+{
+    fatbuf *docbuf = fatbuf_alloc(sizeof(Doc) + size);
+    if (docbuf == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *pDoc = (Doc *) fatbuf_get(docbuf, sizeof(Doc));
+
+    if (size == 0) { //Empty doc
+        (*pDoc)->data.buf = NULL;
+        (*pDoc)->data.size = 0;
+        return COUCHSTORE_SUCCESS;
+    }
+
+    (*pDoc)->data.buf = (char *) fatbuf_get(docbuf, size);
+    (*pDoc)->data.size = size;
+    memcpy((*pDoc)->data.buf, body, size);
+    return COUCHSTORE_SUCCESS;
+}
+
 //Fill in doc from reading file.
 static couchstore_error_t bp_to_doc(Doc **pDoc, Db *db, cs_off_t bp, couchstore_open_options options)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     int bodylen = 0;
     char *docbody = NULL;
-    fatbuf *docbuf = NULL;
+    int mapped = 0;
+    tree_file *file = &db->file;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
 
+    if (db->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES &&
+        (bp & BP_SEGMENTED_FLAG)) {
+        size_t size;
+        error_pass(db_read_segmented(db, bp, 0, (size_t)-1,
+                                     options & DECOMPRESS_DOC_BODIES,
+                                     &docbody, &size));
+        error_pass(body_to_doc(pDoc, docbody, size));
+        goto cleanup;
+    }
+    if (db->header.vlog_ptr && (bp & BP_VALUE_LOG_FLAG)) {
+        error_pass(db_value_log_file(db, &file));
+        bp &= ~BP_VALUE_LOG_FLAG;
+    }
     if (options & DECOMPRESS_DOC_BODIES) {
-        bodylen = pread_compressed(&db->file, bp, &docbody);
+        bodylen = pread_compressed(file, bp, &docbody);
     } else {
-        bodylen = pread_bin(&db->file, bp, &docbody);
+        bodylen = pread_bin_mapped(file, bp, &docbody, &mapped);
     }
 
     error_unless(bodylen >= 0, static_cast<couchstore_error_t>(bodylen));    // if bodylen is negative it's an error code
     error_unless(docbody || bodylen == 0, COUCHSTORE_ERROR_READ);
-
-    error_unless(docbuf = fatbuf_alloc(sizeof(Doc) + bodylen), COUCHSTORE_ERROR_ALLOC_FAIL);
-    *pDoc = (Doc *) fatbuf_get(docbuf, sizeof(Doc));
-
-    if (bodylen == 0) { //Empty doc
-        (*pDoc)->data.buf = NULL;
-        (*pDoc)->data.size = 0;
-        return COUCHSTORE_SUCCESS;
-    }
-
-    (*pDoc)->data.buf = (char *) fatbuf_get(docbuf, bodylen);
-    (*pDoc)->data.size = bodylen;
-    memcpy((*pDoc)->data.buf, docbody, bodylen);
+    error_pass(body_to_doc(pDoc, docbody, bodylen));
 
 cleanup:
-    free(docbody);
-    if (errcode < 0) {
-        fatbuf_free(docbuf);
+    if (!mapped) {
+        cs_free(docbody);
     }
     return errcode;
 }
@@ -534,24 +1694,39 @@ static couchstore_error_t docinfo_fetch_by_seq(couchfile_lookup_request *rq,
     return by_seq_read_docinfo(pInfo, k, v);
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_docinfo_by_id(Db *db,
-                                            const void *id,
-                                            size_t idlen,
-                                            DocInfo **pInfo)
+static couchstore_error_t docinfo_by_id(Db *db,
+                                        const void *id,
+                                        size_t idlen,
+                                        DocInfo **pInfo)
 {
     sized_buf key;
     sized_buf *keylist = &key;
     couchfile_lookup_request rq;
+    bloom_filter *filter;
     couchstore_error_t errcode;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
-
-    if (db->header.by_id_root == NULL) {
-        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    if (db->readers != NULL) {
+        Db *reader;
+        error_pass(read_pool_acquire(db->readers, &reader));
+        errcode = couchstore_docinfo_by_id(reader, id, idlen, pInfo);
+        read_pool_release(db->readers, reader);
+        return errcode;
     }
 
     key.buf = (char *) id;
     key.size = idlen;
+    // Pending saves are newer than anything in the tree.
+    errcode = db_delta_lookup_id(db, &key, pInfo);
+    if (errcode != COUCHSTORE_ERROR_DOC_NOT_FOUND) {
+        return errcode;
+    }
+    if (db->header.by_id_root == NULL) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+    error_pass(db_bloom_get(db, &filter));
+    if (filter && !bloom_may_contain(filter, &key)) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
 
     rq.cmp.compare = ebin_cmp;
     rq.file = &db->file;
@@ -572,6 +1747,18 @@ cleanup:
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_docinfo_by_id(Db *db,
+                                            const void *id,
+                                            size_t idlen,
+                                            DocInfo **pInfo)
+{
+    OP_STATS_START(db->op_stats);
+    couchstore_error_t errcode = docinfo_by_id(db, id, idlen, pInfo);
+    OP_STATS_END(db->op_stats, docinfo_by_id);
+    return errcode;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_docinfo_by_sequence(Db *db,
                                                   uint64_t sequence,
@@ -582,6 +1769,20 @@ couchstore_error_t couchstore_docinfo_by_sequence(Db *db,
     couchfile_lookup_request rq;
     couchstore_error_t errcode;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    if (db->readers != NULL) {
+        Db *reader;
+        error_pass(read_pool_acquire(db->readers, &reader));
+        errcode = couchstore_docinfo_by_sequence(reader, sequence, pInfo);
+        read_pool_release(db->readers, reader);
+        return errcode;
+    }
+    // A sequence passed over by a pending save is only gone from the tree
+    // once the buffer's folded in.
+    error_pass(db_delta_fold_for_read(db));
+    errcode = db_delta_lookup_seq(db, sequence, pInfo);
+    if (errcode != COUCHSTORE_ERROR_DOC_NOT_FOUND) {
+        return errcode;
+    }
 
     if (db->header.by_id_root == NULL) {
         return COUCHSTORE_ERROR_DOC_NOT_FOUND;
@@ -622,6 +1823,15 @@ couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
     if (docinfo->bp == 0) {
         return COUCHSTORE_ERROR_DOC_NOT_FOUND;
     }
+    if (db->readers != NULL) {
+        Db *reader;
+        errcode = read_pool_acquire(db->readers, &reader);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = couchstore_open_doc_with_docinfo(reader, docinfo, pDoc, options);
+            read_pool_release(db->readers, reader);
+        }
+        return errcode;
+    }
 
     if (!(docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
         options &= ~DECOMPRESS_DOC_BODIES;
@@ -637,16 +1847,294 @@ couchstore_error_t couchstore_open_doc_with_docinfo(Db *db,
 }
 
 LIBCOUCHSTORE_API
-couchstore_error_t couchstore_open_document(Db *db,
-                                            const void *id,
-                                            size_t idlen,
-                                            Doc **pDoc,
+couchstore_error_t couchstore_open_document_range(Db *db,
+                                                  const DocInfo *docinfo,
+                                                  uint64_t offset,
+                                                  size_t len,
+                                                  Doc **pDoc,
+                                                  couchstore_open_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t bp = docinfo->bp;
+    tree_file *file = &db->file;
+    char *body = NULL;
+    size_t size = 0;
+    int got;
+
+    *pDoc = NULL;
+    if (bp == 0) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+    if (db->readers != NULL) {
+        Db *reader;
+        errcode = read_pool_acquire(db->readers, &reader);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = couchstore_open_document_range(reader, docinfo, offset, len,
+                                                     pDoc, options);
+            read_pool_release(db->readers, reader);
+        }
+        return errcode;
+    }
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    if (!(docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+        options &= ~DECOMPRESS_DOC_BODIES;
+    }
+
+    if (db->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES &&
+        (bp & BP_SEGMENTED_FLAG)) {
+        error_pass(db_read_segmented(db, bp, offset, len,
+                                     options & DECOMPRESS_DOC_BODIES,
+                                     &body, &size));
+    } else if (options & DECOMPRESS_DOC_BODIES) {
+        // A body compressed whole has to be read whole.
+        error_pass(bp_to_doc(pDoc, db, bp, options));
+        if (offset >= (*pDoc)->data.size) {
+            (*pDoc)->data.buf = NULL;
+            (*pDoc)->data.size = 0;
+        } else {
+            (*pDoc)->data.buf += offset;
+            (*pDoc)->data.size -= (size_t)offset;
+            if ((*pDoc)->data.size > len) {
+                (*pDoc)->data.size = len;
+            }
+        }
+        goto found;
+    } else {
+        // Stored as it's returned, so only the range is read.
+        if (db->header.vlog_ptr && (bp & BP_VALUE_LOG_FLAG)) {
+            error_pass(db_value_log_file(db, &file));
+            bp &= ~BP_VALUE_LOG_FLAG;
+        }
+        got = pread_bin_range(file, bp, (size_t)offset, len, &body);
+        error_unless(got >= 0, static_cast<couchstore_error_t>(got));
+        size = got;
+    }
+    error_pass(body_to_doc(pDoc, body, size));
+
+found:
+    (*pDoc)->id.buf = docinfo->id.buf;
+    (*pDoc)->id.size = docinfo->id.size;
+cleanup:
+    cs_free(body);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_read_doc_into(Db *db,
+                                            const DocInfo *docinfo,
+                                            void *dst,
+                                            size_t dst_len,
+                                            size_t *out_len,
                                             couchstore_open_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t bp = docinfo->bp;
+    tree_file *file = &db->file;
+    char *body = NULL;
+    int got;
+
+    *out_len = 0;
+    if (bp == 0) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+    if (db->readers != NULL) {
+        Db *reader;
+        errcode = read_pool_acquire(db->readers, &reader);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = couchstore_read_doc_into(reader, docinfo, dst, dst_len,
+                                               out_len, options);
+            read_pool_release(db->readers, reader);
+        }
+        return errcode;
+    }
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    if (!(docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
+        options &= ~DECOMPRESS_DOC_BODIES;
+    }
+
+    if (db->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES &&
+        (bp & BP_SEGMENTED_FLAG)) {
+        // Segments are put together in a buffer of their own.
+        size_t size;
+        error_pass(db_read_segmented(db, bp, 0, (size_t)-1,
+                                     options & DECOMPRESS_DOC_BODIES,
+                                     &body, &size));
+        if (dst && size <= dst_len && size > 0) {
+            memcpy(dst, body, size);
+        }
+        *out_len = size;
+        goto cleanup;
+    }
+    if (db->header.vlog_ptr && (bp & BP_VALUE_LOG_FLAG)) {
+        error_pass(db_value_log_file(db, &file));
+        bp &= ~BP_VALUE_LOG_FLAG;
+    }
+    if (options & DECOMPRESS_DOC_BODIES) {
+        got = pread_compressed_into(file, bp, static_cast<char *>(dst), dst_len);
+    } else {
+        got = pread_bin_into(file, bp, static_cast<char *>(dst), dst_len);
+    }
+    error_unless(got >= 0, static_cast<couchstore_error_t>(got));
+    *out_len = got;
+
+cleanup:
+    cs_free(body);
+    return errcode;
+}
+
+// Ranges of the file closer together than this are prefetched as one:
+#define PREFETCH_MERGE_GAP (64 * 1024)
+
+typedef struct {
+    cs_off_t bp;
+    cs_off_t size;
+    unsigned index;
+} doc_location;
+
+static int doc_location_cmp(const void *a, const void *b)
+{
+    cs_off_t bp_a = ((const doc_location *)a)->bp;
+    cs_off_t bp_b = ((const doc_location *)b)->bp;
+    return bp_a < bp_b ? -1 : (bp_a > bp_b ? 1 : 0);
+}
+
+// Lists where the bodies of the docs are, in file order.
+static doc_location *sorted_doc_locations(DocInfo *docinfos[], unsigned numDocs,
+                                          unsigned *numLocations)
+{
+    doc_location *locations = static_cast<doc_location *>(cs_malloc((numDocs + 1) * sizeof(doc_location)));
+    unsigned i, n = 0;
+
+    if (locations == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < numDocs; ++i) {
+        if (docinfos[i]->bp == 0) {
+            continue;
+        }
+        locations[n].bp = (cs_off_t)docinfos[i]->bp;
+        // The size is what the body took up on disk, but don't trust it:
+        locations[n].size = docinfos[i]->size > 0 ? (cs_off_t)docinfos[i]->size
+                                                  : COUCH_BLOCK_SIZE;
+        locations[n].index = i;
+        ++n;
+    }
+    qsort(locations, n, sizeof(doc_location), doc_location_cmp);
+    *numLocations = n;
+    return locations;
+}
+
+static couchstore_error_t prefetch_locations(Db *db, const doc_location *locations,
+                                             unsigned n)
+{
+    unsigned i = 0;
+
+    if (db->file.map) {
+        // Already in memory, or as good as.
+        return COUCHSTORE_SUCCESS;
+    }
+    while (i < n) {
+        if ((db->header.vlog_ptr && (locations[i].bp & BP_VALUE_LOG_FLAG)) ||
+            (db->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES &&
+             (locations[i].bp & BP_SEGMENTED_FLAG))) {
+            // The rest are segmented or in the value log, sorted after the
+            // file's plain bodies.
+            break;
+        }
+        cs_off_t start = locations[i].bp;
+        cs_off_t end = start + locations[i].size;
+        for (++i; i < n && locations[i].bp <= end + PREFETCH_MERGE_GAP; ++i) {
+            if (locations[i].bp + locations[i].size > end) {
+                end = locations[i].bp + locations[i].size;
+            }
+        }
+        couchstore_error_t errcode = db->file.ops->advise(&db->file.lastError,
+                                                          db->file.handle,
+                                                          start, end - start,
+                                                          COUCHSTORE_FILE_ADVICE_WILLNEED);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_prefetch_docs(Db *db,
+                                            DocInfo *docinfos[],
+                                            unsigned numDocs)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    doc_location *locations = NULL;
+    unsigned n = 0;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    locations = sorted_doc_locations(docinfos, numDocs, &n);
+    error_unless(locations, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(prefetch_locations(db, locations, n));
+cleanup:
+    cs_free(locations);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_docs_with_docinfos(Db *db,
+                                                      DocInfo *docinfos[],
+                                                      unsigned numDocs,
+                                                      Doc *docs[],
+                                                      couchstore_open_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    doc_location *locations = NULL;
+    unsigned i, n = 0;
+
+    for (i = 0; i < numDocs; ++i) {
+        docs[i] = NULL;
+    }
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    locations = sorted_doc_locations(docinfos, numDocs, &n);
+    error_unless(locations, COUCHSTORE_ERROR_ALLOC_FAIL);
+    // Start the reads of all the bodies before blocking on the first. It's
+    // only a hint, so failing to give it is no reason to fail the reads.
+    prefetch_locations(db, locations, n);
+
+    for (i = 0; i < n; ++i) {
+        unsigned index = locations[i].index;
+        error_pass(couchstore_open_doc_with_docinfo(db, docinfos[index],
+                                                    &docs[index], options));
+    }
+
+cleanup:
+    cs_free(locations);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        for (i = 0; i < numDocs; ++i) {
+            couchstore_free_document(docs[i]);
+            docs[i] = NULL;
+        }
+    }
+    return errcode;
+}
+
+static couchstore_error_t open_document(Db *db,
+                                        const void *id,
+                                        size_t idlen,
+                                        Doc **pDoc,
+                                        couchstore_open_options options)
 {
     couchstore_error_t errcode;
     DocInfo *info;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     *pDoc = NULL;
+    if (db->readers != NULL) {
+        Db *reader;
+        error_pass(read_pool_acquire(db->readers, &reader));
+        errcode = couchstore_open_document(reader, id, idlen, pDoc, options);
+        read_pool_release(db->readers, reader);
+        return errcode;
+    }
     errcode = couchstore_docinfo_by_id(db, id, idlen, &info);
     if (errcode == COUCHSTORE_SUCCESS) {
         errcode = couchstore_open_doc_with_docinfo(db, info, pDoc, options);
@@ -661,6 +2149,19 @@ cleanup:
     return errcode;
 }
 
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_document(Db *db,
+                                            const void *id,
+                                            size_t idlen,
+                                            Doc **pDoc,
+                                            couchstore_open_options options)
+{
+    OP_STATS_START(db->op_stats);
+    couchstore_error_t errcode = open_document(db, id, idlen, pDoc, options);
+    OP_STATS_END(db->op_stats, open_document);
+    return errcode;
+}
+
 // context info passed to lookup_callback via btree_lookup
 typedef struct {
     Db *db;
@@ -682,32 +2183,40 @@ static couchstore_error_t lookup_callback(couchfile_lookup_request *rq,
     }
 
     const lookup_context *context = static_cast<const lookup_context *>(rq->callback_ctx);
-    DocInfo *docinfo = NULL;
+    int borrowing = (context->options & COUCHSTORE_BORROW_DOCINFOS) != 0;
+    DocInfo borrowed;
+    DocInfo *docinfo = &borrowed;
     couchstore_error_t errcode;
     if (context->by_id) {
-        errcode = by_id_read_docinfo(&docinfo, k, v);
+        errcode = by_id_decode_docinfo(&borrowed, k, v);
     } else {
-        errcode = by_seq_read_docinfo(&docinfo, k, v);
+        errcode = by_seq_decode_docinfo(&borrowed, k, v);
     }
     if (errcode == COUCHSTORE_ERROR_CORRUPT && (context->options & COUCHSTORE_INCLUDE_CORRUPT_DOCS)) {
         // Invoke callback even if doc info is corrupted/unreadable, if magic flag is set
-        docinfo = static_cast<DocInfo*>(calloc(sizeof(DocInfo), 1));
-        docinfo->id = *k;
-        docinfo->rev_meta = *v;
+        memset(&borrowed, 0, sizeof(borrowed));
+        borrowed.id = *k;
+        borrowed.rev_meta = *v;
     } else if (errcode) {
         return errcode;
     }
 
-    if ((context->options & COUCHSTORE_DELETES_ONLY) && docinfo->deleted == 0) {
-        couchstore_free_docinfo(docinfo);
+    // Filtered out before anything gets allocated for them:
+    if ((context->options & COUCHSTORE_DELETES_ONLY) && borrowed.deleted == 0) {
         return COUCHSTORE_SUCCESS;
     }
 
-    if ((context->options & COUCHSTORE_NO_DELETES) && docinfo->deleted == 1) {
-        couchstore_free_docinfo(docinfo);
+    if ((context->options & COUCHSTORE_NO_DELETES) && borrowed.deleted == 1) {
         return COUCHSTORE_SUCCESS;
     }
 
+    if (!borrowing) {
+        errcode = copy_docinfo(&docinfo, &borrowed);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+    }
+
     if (context->walk_callback) {
         errcode = static_cast<couchstore_error_t>(context->walk_callback(context->db,
                                                                          context->depth,
@@ -720,13 +2229,39 @@ static couchstore_error_t lookup_callback(couchfile_lookup_request *rq,
                                                                     docinfo,
                                                                     context->callback_context));
     }
+    if (borrowing) {
+        // There's nothing the callback could keep
+        return errcode < 0 ? errcode : COUCHSTORE_SUCCESS;
+    }
     if (errcode <= 0) {
         couchstore_free_docinfo(docinfo);
     } else {
         // User requested docinfo not be freed, don't free it, return success
         return COUCHSTORE_SUCCESS;
     }
-    return errcode;
+    return errcode;
+}
+
+// node_callback of filtered by-seq folds: passes over the subtrees whose
+// reduce shows that the filter would drop all of their entries.
+static couchstore_error_t seq_filter_callback(couchfile_lookup_request *rq,
+                                              uint64_t subtreeSize,
+                                              const sized_buf *reduce_value)
+{
+    const lookup_context *context = static_cast<const lookup_context *>(rq->callback_ctx);
+    (void)subtreeSize;
+    if (reduce_value == NULL || reduce_value->size < sizeof(raw_by_seq_deletes_reduce)) {
+        return COUCHSTORE_SUCCESS;
+    }
+    const raw_by_seq_deletes_reduce *raw = (const raw_by_seq_deletes_reduce*)reduce_value->buf;
+    uint64_t deleted = decode_raw40(raw->deleted);
+    if ((context->options & COUCHSTORE_DELETES_ONLY) && deleted == 0) {
+        return BTREE_SKIP_SUBTREE;
+    }
+    if ((context->options & COUCHSTORE_NO_DELETES) && deleted == decode_raw40(raw->count)) {
+        return BTREE_SKIP_SUBTREE;
+    }
+    return COUCHSTORE_SUCCESS;
 }
 
 LIBCOUCHSTORE_API
@@ -738,12 +2273,14 @@ couchstore_error_t couchstore_changes_since(Db *db,
 {
     char since_termbuf[6];
     sized_buf since_term;
-    sized_buf *keylist = &since_term;
+    sized_buf end_term = {NULL, 0};
+    sized_buf *keylist[2] = {&since_term, &since_term};
     lookup_context cbctx = {db, options, callback, ctx, 0, 0, NULL};
     couchfile_lookup_request rq;
     couchstore_error_t errcode;
 
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_pass(db_delta_fold_for_read(db));
     if (db->header.by_seq_root == NULL) {
         return COUCHSTORE_SUCCESS;
     }
@@ -755,13 +2292,25 @@ couchstore_error_t couchstore_changes_since(Db *db,
     rq.cmp.compare = seq_cmp;
     rq.file = &db->file;
     rq.num_keys = 1;
-    rq.keys = &keylist;
+    rq.keys = keylist;
     rq.callback_ctx = &cbctx;
     rq.fetch_callback = lookup_callback;
     rq.node_callback = NULL;
     rq.fold = 1;
+    // Corrupt entries are called back whatever the filter says.
+    if ((options & (COUCHSTORE_DELETES_ONLY | COUCHSTORE_NO_DELETES)) &&
+        !(options & COUCHSTORE_INCLUDE_CORRUPT_DOCS)) {
+        rq.node_callback = seq_filter_callback;
+    }
 
-    errcode = btree_lookup(&rq, db->header.by_seq_root->pointer);
+    if (options & COUCHSTORE_DESCENDING) {
+        // From the newest change down to since:
+        keylist[0] = &end_term;
+        rq.num_keys = 2;
+        errcode = btree_lookup_descending(&rq, db->header.by_seq_root->pointer);
+    } else {
+        errcode = btree_lookup(&rq, db->header.by_seq_root->pointer);
+    }
 cleanup:
     return errcode;
 }
@@ -780,6 +2329,7 @@ couchstore_error_t couchstore_all_docs(Db *db,
     couchstore_error_t errcode;
 
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_pass(db_delta_fold_for_read(db));
     if (db->header.by_id_root == NULL) {
         return COUCHSTORE_SUCCESS;
     }
@@ -797,7 +2347,11 @@ couchstore_error_t couchstore_all_docs(Db *db,
     rq.node_callback = NULL;
     rq.fold = 1;
 
-    errcode = btree_lookup(&rq, db->header.by_id_root->pointer);
+    if (options & COUCHSTORE_DESCENDING) {
+        errcode = btree_lookup_descending(&rq, db->header.by_id_root->pointer);
+    } else {
+        errcode = btree_lookup(&rq, db->header.by_id_root->pointer);
+    }
 cleanup:
     return errcode;
 }
@@ -817,6 +2371,8 @@ static couchstore_error_t walk_node_callback(struct couchfile_lookup_request *rq
         context->depth++;
         if (result < 0)
             return static_cast<couchstore_error_t>(result);
+        if (result == COUCHSTORE_WALK_SKIP_SUBTREE)
+            return BTREE_SKIP_SUBTREE;
     } else {
         context->depth--;
     }
@@ -851,6 +2407,9 @@ couchstore_error_t couchstore_walk_tree(Db *db,
     if (errcode < 0) {
         return errcode;
     }
+    if (errcode == static_cast<couchstore_error_t>(COUCHSTORE_WALK_SKIP_SUBTREE)) {
+        return COUCHSTORE_SUCCESS;
+    }
 
     if (startKeyPtr) {
         startKey = *startKeyPtr;
@@ -885,6 +2444,10 @@ couchstore_error_t couchstore_walk_id_tree(Db *db,
                                            couchstore_walk_tree_callback_fn callback,
                                            void *ctx)
 {
+    couchstore_error_t errcode = db_delta_fold_for_read(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
     return couchstore_walk_tree(db, 1, db->header.by_id_root, startDocID,
                                 options, ebin_cmp, callback, ctx);
 }
@@ -898,11 +2461,171 @@ couchstore_error_t couchstore_walk_seq_tree(Db *db,
 {
     raw_48 start_termbuf = encode_raw48(startSequence);
     sized_buf start_term = {(char*)&start_termbuf, 6};
+    couchstore_error_t errcode = db_delta_fold_for_read(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
 
     return couchstore_walk_tree(db, 0, db->header.by_seq_root, &start_term,
                                 options, seq_cmp, callback, ctx);
 }
 
+static couchstore_error_t walk_nodes(Db *db,
+                                     uint64_t pos,
+                                     uint64_t subtreesize,
+                                     int depth,
+                                     couchstore_walk_nodes_callback_fn callback,
+                                     void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    decoded_node *node = NULL;
+    couchstore_node_info info;
+    uint64_t children_size = 0;
+    unsigned i;
+
+    error_pass(btree_read_node(&db->file, pos, 1, &node));
+    info.depth = depth;
+    info.is_leaf = node->buf[0] == KV_NODE;
+    info.count = node->count;
+    info.size = node->length;
+    if (!info.is_leaf) {
+        for (i = 0; i < node->count; i++) {
+            const raw_node_pointer *raw = (const raw_node_pointer*)node->entries[i].value.buf;
+            children_size += decode_raw48(raw->subtreesize);
+        }
+    }
+    info.disk_size = subtreesize > children_size ? subtreesize - children_size : 0;
+
+    errcode = static_cast<couchstore_error_t>(callback(db, &info, ctx));
+    if (errcode < 0) {
+        goto cleanup;
+    }
+    errcode = COUCHSTORE_SUCCESS;
+    if (!info.is_leaf) {
+        for (i = 0; i < node->count; i++) {
+            const raw_node_pointer *raw = (const raw_node_pointer*)node->entries[i].value.buf;
+            error_pass(walk_nodes(db, decode_raw48(raw->pointer),
+                                  decode_raw48(raw->subtreesize), depth + 1,
+                                  callback, ctx));
+        }
+    }
+cleanup:
+    if (node != NULL) {
+        node_release(db->file.node_cache, node);
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_walk_nodes(Db *db,
+                                         couchstore_cursor_index index,
+                                         couchstore_walk_nodes_callback_fn callback,
+                                         void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const node_pointer *root;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(index == COUCHSTORE_CURSOR_BY_ID || index == COUCHSTORE_CURSOR_BY_SEQUENCE,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    error_pass(db_delta_fold_for_read(db));
+    root = index == COUCHSTORE_CURSOR_BY_ID ? db->header.by_id_root : db->header.by_seq_root;
+    if (root != NULL) {
+        errcode = walk_nodes(db, root->pointer, root->subtreesize, 0, callback, ctx);
+    }
+cleanup:
+    return errcode;
+}
+
+struct _couchstore_cursor {
+    Db *db;
+    couchstore_cursor_index index;
+    btree_cursor *tree;
+};
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_cursor_open(Db *db,
+                                          couchstore_cursor_index index,
+                                          couchstore_cursor **pCursor)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_cursor *cursor = NULL;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(index == COUCHSTORE_CURSOR_BY_ID || index == COUCHSTORE_CURSOR_BY_SEQUENCE,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    error_pass(db_delta_fold_for_read(db));
+
+    cursor = static_cast<couchstore_cursor*>(cs_calloc(1, sizeof(couchstore_cursor)));
+    error_unless(cursor, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cursor->db = db;
+    cursor->index = index;
+    error_pass(btree_cursor_create(&db->file,
+                                   index == COUCHSTORE_CURSOR_BY_ID ? ebin_cmp : seq_cmp,
+                                   &cursor->tree));
+    error_pass(couchstore_cursor_seek(cursor, NULL));
+    *pCursor = cursor;
+    cursor = NULL;
+cleanup:
+    couchstore_cursor_close(cursor);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_cursor_seek(couchstore_cursor *cursor,
+                                          const sized_buf *key)
+{
+    Db *db = cursor->db;
+    if (db->dropped) {
+        return COUCHSTORE_ERROR_FILE_CLOSED;
+    }
+    return btree_cursor_seek(cursor->tree,
+                             cursor->index == COUCHSTORE_CURSOR_BY_ID ?
+                                 db->header.by_id_root : db->header.by_seq_root,
+                             key);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_cursor_seek_sequence(couchstore_cursor *cursor,
+                                                   uint64_t sequence)
+{
+    raw_48 termbuf = encode_raw48(sequence);
+    sized_buf term = {(char*)&termbuf, 6};
+    if (cursor->index != COUCHSTORE_CURSOR_BY_SEQUENCE) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    return couchstore_cursor_seek(cursor, &term);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_cursor_next(couchstore_cursor *cursor,
+                                          DocInfo **pInfo)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf key, value;
+    int found;
+    error_unless(!cursor->db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    error_pass(btree_cursor_next(cursor->tree, &key, &value, &found));
+    if (!found) {
+        *pInfo = NULL;
+    } else if (cursor->index == COUCHSTORE_CURSOR_BY_ID) {
+        error_pass(by_id_read_docinfo(pInfo, &key, &value));
+    } else {
+        error_pass(by_seq_read_docinfo(pInfo, &key, &value));
+    }
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_cursor_close(couchstore_cursor *cursor)
+{
+    if (cursor) {
+        btree_cursor_free(cursor->tree);
+        cs_free(cursor);
+    }
+}
+
 static int id_ptr_cmp(const void *a, const void *b)
 {
     sized_buf **buf1 = (sized_buf**) a;
@@ -941,7 +2664,7 @@ static couchstore_error_t iterate_docinfos(Db *db,
     }
 
     // Create an array of *pointers to* sized_bufs, which is what btree_lookup wants:
-    keyptrs = static_cast<const sized_buf**>(malloc(numDocs * sizeof(sized_buf*)));
+    keyptrs = static_cast<const sized_buf**>(cs_malloc(numDocs * sizeof(sized_buf*)));
     error_unless(keyptrs, COUCHSTORE_ERROR_ALLOC_FAIL);
 
     {
@@ -966,11 +2689,15 @@ static couchstore_error_t iterate_docinfos(Db *db,
         rq.node_callback = NULL;
         rq.fold = fold;
 
-        // Go!
-        error_pass(btree_lookup(&rq, tree->pointer));
+        // Go! Lookups of many keys have their nodes prefetched level by level.
+        if (fold || numDocs == 1) {
+            error_pass(btree_lookup(&rq, tree->pointer));
+        } else {
+            error_pass(btree_lookup_batched(&rq, tree->pointer));
+        }
     }
 cleanup:
-    free(keyptrs);
+    cs_free(keyptrs);
     return errcode;
 }
 
@@ -982,6 +2709,21 @@ couchstore_error_t couchstore_docinfos_by_id(Db *db,
                                              couchstore_changes_callback_fn callback,
                                              void *ctx)
 {
+    couchstore_error_t errcode;
+    if (db->readers != NULL) {
+        Db *reader;
+        errcode = read_pool_acquire(db->readers, &reader);
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = couchstore_docinfos_by_id(reader, ids, numDocs, options,
+                                                callback, ctx);
+            read_pool_release(db->readers, reader);
+        }
+        return errcode;
+    }
+    errcode = db_delta_fold_for_read(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
     return iterate_docinfos(db, ids, numDocs,
                             db->header.by_id_root, id_ptr_cmp, ebin_cmp,
                             callback,
@@ -998,11 +2740,12 @@ couchstore_error_t couchstore_docinfos_by_sequence(Db *db,
                                                    void *ctx)
 {
     // Create the array of keys:
-    sized_buf *keylist = static_cast<sized_buf*>(malloc(numDocs * sizeof(sized_buf)));
-    raw_by_seq_key *keyvalues = static_cast<raw_by_seq_key*>(malloc(numDocs * sizeof(raw_by_seq_key)));
+    sized_buf *keylist = static_cast<sized_buf*>(cs_malloc(numDocs * sizeof(sized_buf)));
+    raw_by_seq_key *keyvalues = static_cast<raw_by_seq_key*>(cs_malloc(numDocs * sizeof(raw_by_seq_key)));
     couchstore_error_t errcode;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     error_unless(keylist && keyvalues, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(db_delta_fold_for_read(db));
     unsigned i;
     for (i = 0; i< numDocs; ++i) {
         keyvalues[i].sequence = encode_raw48(sequence[i]);
@@ -1016,13 +2759,139 @@ couchstore_error_t couchstore_docinfos_by_sequence(Db *db,
                                 (options & RANGES) != 0,
                                 ctx));
 cleanup:
-    free(keylist);
-    free(keyvalues);
+    cs_free(keylist);
+    cs_free(keyvalues);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_expiry_index(Db *db, int enable, uint16_t time_offset)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(!db->readonly &&
+                 db->header.disk_version >= COUCH_DISK_VERSION_EXPIRY_INDEX &&
+                 (!enable || time_offset != EXPIRY_NO_INDEX),
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    if (db->header.expiry_index == (enable != 0) &&
+        (!enable || db->header.expiry_offset == time_offset)) {
+        return COUCHSTORE_SUCCESS;
+    }
+    // The index is built from the trees, so everything has to be in them.
+    error_pass(db_fold_delta(db));
+    cs_free(db->header.expiry_root);
+    db->header.expiry_root = NULL;
+    db->header.expiry_index = 0;
+    db->header.expiry_offset = 0;
+    if (enable) {
+        db->header.expiry_offset = time_offset;
+        error_pass(db_expiry_build(db));
+        db->header.expiry_index = 1;
+    }
+cleanup:
+    return errcode;
+}
+
+// btree_lookup callback of couchstore_expired_since: looks each index
+// entry's sequence up in the by-sequence tree, for its DocInfo.
+static couchstore_error_t expiry_lookup_callback(couchfile_lookup_request *rq,
+                                                 const sized_buf *k,
+                                                 const sized_buf *v)
+{
+    lookup_context *context = static_cast<lookup_context *>(rq->callback_ctx);
+    const raw_expiry_key *key = (const raw_expiry_key*)k->buf;
+    sized_buf seq_term = { (char *)&key->seq, sizeof(key->seq) };
+    sized_buf *keylist = &seq_term;
+    couchfile_lookup_request seqrq;
+    (void)v;
+
+    // The fold's first entry isn't checked against the end of the range,
+    // and may be past the time asked for; those after it are.
+    if (rq->cmp.compare(k, rq->keys[1]) > 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    seqrq.cmp.compare = seq_cmp;
+    seqrq.file = rq->file;
+    seqrq.num_keys = 1;
+    seqrq.keys = &keylist;
+    seqrq.callback_ctx = context;
+    seqrq.fetch_callback = lookup_callback;
+    seqrq.node_callback = NULL;
+    seqrq.fold = 0;
+    return btree_lookup(&seqrq, context->db->header.by_seq_root->pointer);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_expired_since(Db *db,
+                                            uint32_t time,
+                                            couchstore_docinfos_options options,
+                                            couchstore_changes_callback_fn callback,
+                                            void *ctx)
+{
+    raw_expiry_key start, end;
+    sized_buf start_term = { (char *)&start, sizeof(start) };
+    sized_buf end_term = { (char *)&end, sizeof(end) };
+    sized_buf *keylist[2] = {&start_term, &end_term};
+    lookup_context cbctx = {db, options, callback, ctx, 0, 0, NULL};
+    couchfile_lookup_request rq;
+    couchstore_error_t errcode;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(db->header.expiry_index, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    error_pass(db_delta_fold_for_read(db));
+    if (db->header.expiry_root == NULL || db->header.by_seq_root == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    expiry_key(&start, 0, 0);
+    expiry_key(&end, time, 0xffffffffffffULL);
+    rq.cmp.compare = ebin_cmp;
+    rq.file = &db->file;
+    rq.num_keys = 2;
+    rq.keys = keylist;
+    rq.callback_ctx = &cbctx;
+    rq.fetch_callback = expiry_lookup_callback;
+    rq.node_callback = NULL;
+    rq.fold = 1;
+    errcode = btree_lookup(&rq, db->header.expiry_root->pointer);
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_value_log(Db *db,
+                                            const char *path,
+                                            const couchstore_value_log_options *options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(!db->readonly && options &&
+                 db->header.disk_version >= COUCH_DISK_VERSION_VALUE_LOG,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    error_pass(db_value_log_set(db, path, options));
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_set_body_segment_size(Db *db, uint32_t segment_size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(segment_size == 0 ||
+                 db->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    db->body_segment_size = segment_size;
+cleanup:
     return errcode;
 }
 
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_db_info(Db *db, DbInfo* dbinfo) {
+    couchstore_error_t errcode = db_delta_fold_for_read(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
     const node_pointer *id_root = db->header.by_id_root;
     const node_pointer *seq_root = db->header.by_seq_root;
     const node_pointer *local_root = db->header.local_docs_root;
@@ -1044,26 +2913,61 @@ couchstore_error_t couchstore_db_info(Db *db, DbInfo* dbinfo) {
     if(local_root) {
         dbinfo->space_used += local_root->subtreesize;
     }
+    if (db->header.expiry_root) {
+        dbinfo->space_used += db->header.expiry_root->subtreesize;
+    }
+    // Bodies in the value log take no space in the file.
+    if (db->header.vlog_live < dbinfo->space_used) {
+        dbinfo->space_used -= db->header.vlog_live;
+    } else {
+        dbinfo->space_used = 0;
+    }
     return COUCHSTORE_SUCCESS;
 }
 
-static couchstore_error_t local_doc_fetch(couchfile_lookup_request *rq,
-                                          const sized_buf *k,
-                                          const sized_buf *v)
+couchstore_error_t couchstore_fragmentation_stats(Db *db,
+                                                  couchstore_fragmentation_info *info)
 {
-    LocalDoc **lDoc = (LocalDoc **) rq->callback_ctx;
-    LocalDoc *dp;
-
-    if (!v) {
-        *lDoc = NULL;
-        return COUCHSTORE_SUCCESS;
+    couchstore_error_t errcode = db_delta_fold_for_read(db);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    const node_pointer *id_root = db->header.by_id_root;
+    const node_pointer *seq_root = db->header.by_seq_root;
+    const node_pointer *local_root = db->header.local_docs_root;
+    memset(info, 0, sizeof(*info));
+    info->file_size = db->file.pos;
+    if (id_root) {
+        raw_by_id_reduce* id_reduce = (raw_by_id_reduce*) id_root->reduce_value.buf;
+        info->live_doc_bytes = decode_raw48(id_reduce->size);
+        info->by_id_tree_bytes = id_root->subtreesize;
     }
+    if (seq_root) {
+        info->by_seq_tree_bytes = seq_root->subtreesize;
+    }
+    if (local_root) {
+        info->local_tree_bytes = local_root->subtreesize;
+    }
+    info->live_tree_bytes = info->by_id_tree_bytes + info->by_seq_tree_bytes +
+                            info->local_tree_bytes;
+    uint64_t live = info->live_doc_bytes + info->live_tree_bytes;
+    info->stale_bytes = info->file_size > live ? info->file_size - live : 0;
+    return COUCHSTORE_SUCCESS;
+}
+
+// Copies a local document into one block, which
+// couchstore_free_local_document frees.
+static couchstore_error_t copy_local_doc(const sized_buf *k,
+                                         const sized_buf *v,
+                                         LocalDoc **pDoc)
+{
+    LocalDoc *dp;
     fatbuf *ldbuf = fatbuf_alloc(sizeof(LocalDoc) + k->size + v->size);
     if (ldbuf == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
 
-    dp = *lDoc = (LocalDoc *) fatbuf_get(ldbuf, sizeof(LocalDoc));
+    dp = *pDoc = (LocalDoc *) fatbuf_get(ldbuf, sizeof(LocalDoc));
     dp->id.buf = (char *) fatbuf_get(ldbuf, k->size);
     dp->id.size = k->size;
 
@@ -1078,6 +2982,19 @@ static couchstore_error_t local_doc_fetch(couchfile_lookup_request *rq,
     return COUCHSTORE_SUCCESS;
 }
 
+static couchstore_error_t local_doc_fetch(couchfile_lookup_request *rq,
+                                          const sized_buf *k,
+                                          const sized_buf *v)
+{
+    LocalDoc **lDoc = (LocalDoc **) rq->callback_ctx;
+
+    if (!v) {
+        *lDoc = NULL;
+        return COUCHSTORE_SUCCESS;
+    }
+    return copy_local_doc(k, v, lDoc);
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_open_local_document(Db *db,
                                                   const void *id,
@@ -1088,14 +3005,22 @@ couchstore_error_t couchstore_open_local_document(Db *db,
     sized_buf *keylist = &key;
     couchfile_lookup_request rq;
     couchstore_error_t errcode;
+    const LocalDoc *cached;
+    uint64_t root;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     if (db->header.local_docs_root == NULL) {
         return COUCHSTORE_ERROR_DOC_NOT_FOUND;
     }
+    root = db->header.local_docs_root->pointer;
 
     key.buf = (char *) id;
     key.size = idlen;
 
+    cached = local_cache_get(db->local_cache, root, &key);
+    if (cached) {
+        return copy_local_doc(&cached->id, &cached->json, pDoc);
+    }
+
     rq.cmp.compare = ebin_cmp;
     rq.file = &db->file;
     rq.num_keys = 1;
@@ -1105,10 +3030,15 @@ couchstore_error_t couchstore_open_local_document(Db *db,
     rq.node_callback = NULL;
     rq.fold = 0;
 
-    errcode = btree_lookup(&rq, db->header.local_docs_root->pointer);
+    errcode = btree_lookup(&rq, root);
     if (errcode == COUCHSTORE_SUCCESS) {
         if (*pDoc == NULL) {
             errcode = COUCHSTORE_ERROR_DOC_NOT_FOUND;
+        } else {
+            if (db->local_cache == NULL) {
+                db->local_cache = local_cache_create();
+            }
+            local_cache_put(db->local_cache, root, *pDoc);
         }
     }
 cleanup:
@@ -1121,6 +3051,7 @@ couchstore_error_t couchstore_save_local_document(Db *db, LocalDoc *lDoc)
     couchstore_error_t errcode;
     couchfile_modify_action ldupdate;
     node_pointer *nroot = NULL;
+    uint64_t old_root;
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
 
     if (lDoc->deleted) {
@@ -1139,6 +3070,7 @@ couchstore_error_t couchstore_save_local_document(Db *db, LocalDoc *lDoc)
     rq.fetch_callback = NULL;
     rq.reduce = NULL;
     rq.rereduce = NULL;
+    rq.reduce_delta = NULL;
     rq.file = &db->file;
     rq.enable_purging = false;
     rq.purge_kp = NULL;
@@ -1147,11 +3079,17 @@ couchstore_error_t couchstore_save_local_document(Db *db, LocalDoc *lDoc)
     rq.kv_chunk_threshold = DB_CHUNK_THRESHOLD;
     rq.kp_chunk_threshold = DB_CHUNK_THRESHOLD;
 
+    old_root = db->header.local_docs_root ? db->header.local_docs_root->pointer : 0;
     nroot = modify_btree(&rq, db->header.local_docs_root, &errcode);
     if (errcode == COUCHSTORE_SUCCESS && nroot != db->header.local_docs_root) {
-        free(db->header.local_docs_root);
+        cs_free(db->header.local_docs_root);
         db->header.local_docs_root = nroot;
     }
+    if (errcode == COUCHSTORE_SUCCESS && nroot != NULL) {
+        local_cache_saved(db->local_cache, old_root, nroot->pointer, lDoc);
+    } else {
+        local_cache_clear(db->local_cache);
+    }
 
 cleanup:
     return errcode;
@@ -1203,7 +3141,7 @@ static couchstore_error_t btree_eval_seq_reduce(Db *db,
     int bufpos = 1, nodebuflen = 0;
     int node_type;
     char *nodebuf = NULL;
-    nodebuflen = pread_compressed(&db->file, diskpos, &nodebuf);
+    nodebuflen = pread_node(&db->file, diskpos, &nodebuf);
     error_unless(nodebuflen >= 0, (static_cast<couchstore_error_t>(nodebuflen)));  // if negative, it's an error code
 
     node_type = nodebuf[0];
@@ -1240,6 +3178,7 @@ static couchstore_error_t btree_eval_seq_reduce(Db *db,
         }
     }
 cleanup:
+    node_buf_free(nodebuf);
     return errcode;
 }
 
@@ -1259,6 +3198,7 @@ couchstore_error_t couchstore_changes_count(Db* db,
     rightkr = encode_raw48(max_seq);
 
     *count = 0;
+    error_pass(db_delta_fold_for_read(db));
     if(db->header.by_seq_root) {
         error_pass(btree_eval_seq_reduce(db, count, &leftk, &rightk, false,
                                          db->header.by_seq_root->pointer));
@@ -1266,3 +3206,199 @@ couchstore_error_t couchstore_changes_count(Db* db,
 cleanup:
     return errcode;
 }
+
+// Counting by-ID items: options picks which of the reduce value's counts apply.
+static uint64_t by_id_reduce_count(const sized_buf *reduce_value, void *ctx)
+{
+    couchstore_docinfos_options options = *(const couchstore_docinfos_options*)ctx;
+    if (reduce_value->size < sizeof(raw_by_id_reduce)) {
+        return 0;
+    }
+    const raw_by_id_reduce *raw = (const raw_by_id_reduce*)reduce_value->buf;
+    uint64_t notdeleted = decode_raw40(raw->notdeleted);
+    uint64_t deleted = decode_raw40(raw->deleted);
+    if (options & COUCHSTORE_NO_DELETES) {
+        return notdeleted;
+    } else if (options & COUCHSTORE_DELETES_ONLY) {
+        return deleted;
+    }
+    return notdeleted + deleted;
+}
+
+static uint64_t by_id_item_count(const sized_buf *k, const sized_buf *v, void *ctx)
+{
+    couchstore_docinfos_options options = *(const couchstore_docinfos_options*)ctx;
+    (void)k;
+    if (v->size < sizeof(raw_id_index_value)) {
+        return 0;
+    }
+    const raw_id_index_value *raw = (const raw_id_index_value*)v->buf;
+    int deleted = (decode_raw48(raw->bp) & BP_DELETED_FLAG) != 0;
+    if (options & COUCHSTORE_NO_DELETES) {
+        return !deleted;
+    } else if (options & COUCHSTORE_DELETES_ONLY) {
+        return deleted;
+    }
+    return 1;
+}
+
+static void by_id_count_request(Db *db, couchstore_docinfos_options *options,
+                                btree_count_request *rq)
+{
+    rq->file = &db->file;
+    rq->compare = ebin_cmp;
+    rq->reduce_count = by_id_reduce_count;
+    rq->item_count = by_id_item_count;
+    rq->ctx = options;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_count_range(Db *db,
+                                          const sized_buf *start_id,
+                                          const sized_buf *end_id,
+                                          couchstore_docinfos_options options,
+                                          uint64_t *count)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    btree_count_request rq;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+
+    *count = 0;
+    error_pass(db_delta_fold_for_read(db));
+    if (db->header.by_id_root) {
+        by_id_count_request(db, &options, &rq);
+        error_pass(btree_count_range(&rq, db->header.by_id_root->pointer,
+                                     start_id, end_id, count));
+    }
+cleanup:
+    return errcode;
+}
+
+static couchstore_error_t docinfo_fetch_by_rank(const sized_buf *k,
+                                                const sized_buf *v,
+                                                void *ctx)
+{
+    return by_id_read_docinfo((DocInfo **)ctx, k, v);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_docinfo_by_rank(Db *db,
+                                              uint64_t rank,
+                                              couchstore_docinfos_options options,
+                                              DocInfo **pInfo)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    btree_count_request rq;
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_pass(db_delta_fold_for_read(db));
+    error_unless(db->header.by_id_root, COUCHSTORE_ERROR_DOC_NOT_FOUND);
+
+    by_id_count_request(db, &options, &rq);
+    error_pass(btree_find_nth(&rq, db->header.by_id_root->pointer, rank,
+                              docinfo_fetch_by_rank, pInfo));
+cleanup:
+    return errcode;
+}
+
+// splitmix64, so that a seed gives the same sample on every platform.
+static uint64_t sample_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, range), with no bias toward the low end.
+static uint64_t sample_random_below(uint64_t *state, uint64_t range)
+{
+    uint64_t limit = UINT64_MAX - UINT64_MAX % range;
+    uint64_t x;
+    do {
+        x = sample_random(state);
+    } while (x >= limit);
+    return x % range;
+}
+
+static int rank_cmp(const void *a, const void *b)
+{
+    uint64_t r1 = *(const uint64_t *)a, r2 = *(const uint64_t *)b;
+    return r1 < r2 ? -1 : r1 > r2;
+}
+
+// Fills ranks with n distinct ranks below total, in order.
+static void sample_ranks(uint64_t *ranks, uint64_t n, uint64_t total, uint64_t seed)
+{
+    uint64_t state = seed, filled = 0, ii, jj;
+
+    if (n * 2 > total) {
+        // Most of them are picked; go through all in turn, each picked
+        // with the chance of it being one of those still to pick.
+        for (ii = 0; filled < n; ii++) {
+            if (sample_random_below(&state, total - ii) < n - filled) {
+                ranks[filled++] = ii;
+            }
+        }
+        return;
+    }
+    // Few are: draw them, and again for any drawn twice.
+    while (filled < n) {
+        for (ii = filled; ii < n; ii++) {
+            ranks[ii] = sample_random_below(&state, total);
+        }
+        qsort(ranks, (size_t)n, sizeof(uint64_t), rank_cmp);
+        for (ii = 1, jj = 1; ii < n; ii++) {
+            if (ranks[ii] != ranks[jj - 1]) {
+                ranks[jj++] = ranks[ii];
+            }
+        }
+        filled = jj;
+    }
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_sample_docinfos(Db *db,
+                                              uint64_t n,
+                                              uint64_t seed,
+                                              couchstore_docinfos_options options,
+                                              couchstore_changes_callback_fn callback,
+                                              void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    btree_count_request rq;
+    uint64_t total = 0, ii;
+    uint64_t *ranks = NULL;
+    DocInfo *info = NULL;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_pass(db_delta_fold_for_read(db));
+    if (db->header.by_id_root == NULL) {
+        goto cleanup;
+    }
+    by_id_count_request(db, &options, &rq);
+    error_pass(btree_count_range(&rq, db->header.by_id_root->pointer, NULL, NULL, &total));
+    if (n > total) {
+        n = total;
+    }
+    if (n == 0) {
+        goto cleanup;
+    }
+    ranks = static_cast<uint64_t *>(cs_malloc((size_t)n * sizeof(uint64_t)));
+    error_unless(ranks, COUCHSTORE_ERROR_ALLOC_FAIL);
+    sample_ranks(ranks, n, total, seed);
+
+    // In ID order, so that descents share the nodes they go through.
+    for (ii = 0; ii < n; ii++) {
+        error_pass(btree_find_nth(&rq, db->header.by_id_root->pointer, ranks[ii],
+                                  docinfo_fetch_by_rank, &info));
+        int result = callback(db, info, ctx);
+        if (result <= 0) {
+            couchstore_free_docinfo(info);
+        }
+        info = NULL;
+        error_unless(result >= 0, static_cast<couchstore_error_t>(result));
+    }
+cleanup:
+    cs_free(ranks);
+    return errcode;
+}
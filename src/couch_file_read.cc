@@ -4,13 +4,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <snappy.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
 
 #include "internal.h"
+#include "block_cache.h"
+#include "node_cache.h"
+#include "chunk_writer.h"
+#include "codec.h"
+#include "node_types.h"
 #include "iobuffer.h"
 #include "bitfield.h"
 #include "crc32.h"
 #include "util.h"
+#include "probes.h"
 
 
 couchstore_error_t tree_file_open(tree_file* file,
@@ -22,7 +33,7 @@ couchstore_error_t tree_file_open(tree_file* file,
 
     /* Sanity check input parameters */
     if (filename == NULL || file == NULL || ops == NULL ||
-            ops->version != 5 ||
+            ops->version < 5 || ops->version > 7 ||
             ops->constructor == NULL || ops->open == NULL ||
             ops->close == NULL || ops->pread == NULL ||
             ops->pwrite == NULL || ops->goto_eof == NULL ||
@@ -31,8 +42,10 @@ couchstore_error_t tree_file_open(tree_file* file,
     }
 
     memset(file, 0, sizeof(*file));
+    file->node_cache_size = DEFAULT_NODE_CACHE_SIZE;
+    file->block_size = COUCH_BLOCK_SIZE;
 
-    file->path = (const char *) strdup(filename);
+    file->path = (const char *) cs_strdup(filename);
     error_unless(file->path, COUCHSTORE_ERROR_ALLOC_FAIL);
 
     file->ops = couch_get_buffered_file_ops(&file->lastError, ops, &file->handle);
@@ -43,7 +56,7 @@ couchstore_error_t tree_file_open(tree_file* file,
 
 cleanup:
     if (errcode != COUCHSTORE_SUCCESS) {
-        free((char *) file->path);
+        cs_free((char *) file->path);
         file->path = NULL;
         if (file->ops) {
             file->ops->destructor(&file->lastError, file->handle);
@@ -54,13 +67,251 @@ cleanup:
     return errcode;
 }
 
+couchstore_error_t tree_file_open_shared(tree_file* file,
+                                         tree_file* source)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+
+    memset(file, 0, sizeof(*file));
+    file->node_cache_size = DEFAULT_NODE_CACHE_SIZE;
+    file->block_size = source->block_size;
+
+    file->path = (const char *) cs_strdup(source->path);
+    error_unless(file->path, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    error_pass(couch_share_buffered_file(&file->lastError, source->ops,
+                                         source->handle, &file->handle));
+    file->ops = source->ops;
+    file->pos = source->pos;
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS) {
+        cs_free((char *) file->path);
+        file->path = NULL;
+    }
+    return errcode;
+}
+
+couchstore_error_t read_file_preamble(tree_file *file)
+{
+    char buf[1 + sizeof(raw_file_preamble)];
+    const raw_file_preamble *raw = (const raw_file_preamble*)(buf + 1);
+
+    file->block_size = COUCH_BLOCK_SIZE;
+    ssize_t got = file->ops->pread(&file->lastError, file->handle,
+                                   buf, sizeof(buf), 0);
+    if (got < 0) {
+        return (couchstore_error_t)got;
+    }
+    if (got < (ssize_t)sizeof(buf) || buf[0] != BLOCK_PREAMBLE) {
+        return COUCHSTORE_SUCCESS;
+    }
+    // Nothing in the file can be found without it, so it has to check out.
+    if (decode_raw32(raw->crc32) != hash_crc32((const char*)&raw->version,
+                                               sizeof(*raw) - sizeof(raw->crc32))) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    if (decode_raw08(raw->version) != FILE_PREAMBLE_VERSION) {
+        return COUCHSTORE_ERROR_HEADER_VERSION;
+    }
+    unsigned shift = decode_raw08(raw->block_shift);
+    if (shift < COUCH_MIN_BLOCK_SHIFT || shift > COUCH_MAX_BLOCK_SHIFT) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    file->block_size = (size_t)1 << shift;
+    return COUCHSTORE_SUCCESS;
+}
+
+size_t file_preamble_size(const tree_file *file)
+{
+    return file->block_size == COUCH_BLOCK_SIZE ? 0 : 1 + sizeof(raw_file_preamble);
+}
+
+unsigned file_block_shift(const tree_file *file)
+{
+    unsigned shift = COUCH_MIN_BLOCK_SHIFT;
+    while (((size_t)1 << shift) < file->block_size) {
+        ++shift;
+    }
+    return shift;
+}
+
+couchstore_error_t tree_file_map(tree_file *file)
+{
+    tree_file_unmap(file);
+#ifndef WIN32
+    struct stat st;
+    int fd;
+    do {
+        fd = open(file->path, O_RDONLY);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1) {
+        file->lastError.error = errno;
+        return COUCHSTORE_ERROR_OPEN_FILE;
+    }
+
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            file->map = static_cast<const char *>(map);
+            file->map_size = (size_t)st.st_size;
+        } else {
+            file->lastError.error = errno;
+            errcode = COUCHSTORE_ERROR_OPEN_FILE;
+        }
+    }
+    close(fd);
+    return errcode;
+#else
+    return COUCHSTORE_SUCCESS;
+#endif
+}
+
+void tree_file_unmap(tree_file *file)
+{
+#ifndef WIN32
+    if (file->map) {
+        munmap((void *)file->map, file->map_size);
+    }
+#endif
+    file->map = NULL;
+    file->map_size = 0;
+}
+
+couchstore_error_t tree_file_set_buffer_options(tree_file *file,
+                                                const couchstore_buffer_options *options)
+{
+    couchstore_error_t errcode = couch_set_buffer_options(&file->lastError,
+                                                          file->ops, file->handle,
+                                                          options);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        file->buffer_options = *options;
+    }
+    return errcode;
+}
+
+couchstore_error_t tree_file_set_node_cache_size(tree_file *file, size_t size)
+{
+    file->node_cache_size = size;
+    if (file->node_cache) {
+        if (size > 0) {
+            node_cache_set_size(file->node_cache, size);
+        } else {
+            node_cache_destroy(file->node_cache);
+            file->node_cache = NULL;
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t tree_file_set_preallocation(tree_file *file, size_t chunk_size)
+{
+    file->prealloc_chunk = chunk_size;
+    return COUCHSTORE_SUCCESS;
+}
+
+void tree_file_set_io_stats(tree_file *file, couchstore_io_stats *stats)
+{
+    couch_set_io_stats(file->ops, file->handle, stats);
+}
+
+couchstore_error_t tree_file_set_cache(tree_file *file,
+                                       couchstore_block_cache *cache)
+{
+    if (file->cache && file->cache_file_id) {
+        block_cache_unregister(file->cache, file->cache_file_id);
+    }
+    file->cache = cache;
+    file->cache_file_id = 0;
+    if (cache) {
+        file->cache_file_id = block_cache_register(cache, file->path);
+        if (file->cache_file_id == 0) {
+            file->cache = NULL;
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Threads sharing a file take turns at it: the file ops' buffers and the
+// position appends go to are the file's, not theirs.
+void tree_file_lock(tree_file *file)
+{
+    if (file->io_mutex) {
+        cb_mutex_enter(file->io_mutex);
+    }
+}
+
+void tree_file_unlock(tree_file *file)
+{
+    if (file->io_mutex) {
+        cb_mutex_exit(file->io_mutex);
+    }
+}
+
 void tree_file_close(tree_file* file)
 {
+    // Callers may close a tree_file that never got opened, with nothing
+    // but ops, handle and path initialized.
     if (file->ops) {
+        tree_file_unmap(file);
+        if (file->cache && file->cache_file_id) {
+            block_cache_unregister(file->cache, file->cache_file_id);
+            file->cache_file_id = 0;
+        }
+        node_cache_destroy(file->node_cache);
+        file->node_cache = NULL;
+        chunk_writer_destroy(file->chunk_writer);
+        file->chunk_writer = NULL;
+        codec_dict_free(file->dict);
+        file->dict = NULL;
+        tree_file_clear_overlay(file);
+        cs_free(file->overlay);
+        file->overlay = NULL;
+        if (file->allocated > file->pos) {
+            // Give back the space reserved past the data. Nothing points
+            // into it, so a failure here only wastes some disk.
+            file->ops->truncate(&file->lastError, file->handle, file->pos);
+            file->allocated = 0;
+        }
         file->ops->close(&file->lastError, file->handle);
         file->ops->destructor(&file->lastError, file->handle);
     }
-    free((char*)file->path);
+    cs_free((char*)file->path);
+}
+
+/** Read up to len bytes lying within a single block through the block cache.
+    Misses read and cache as much of the block as the file holds. Same return
+    value as pread. */
+static ssize_t cached_pread(tree_file *file, void *dst, ssize_t len, cs_off_t pos)
+{
+    uint64_t block = (uint64_t)(pos / COUCH_BLOCK_SIZE);
+    size_t offset = (size_t)(pos % COUCH_BLOCK_SIZE);
+    char blockbuf[COUCH_BLOCK_SIZE];
+
+    if (block_cache_read(file->cache, file->cache_file_id, block, offset, dst, len)) {
+        return len;
+    }
+
+    ssize_t got_bytes = file->ops->pread(&file->lastError, file->handle,
+                                         blockbuf, COUCH_BLOCK_SIZE,
+                                         (cs_off_t)block * COUCH_BLOCK_SIZE);
+    if (got_bytes < 0) {
+        return got_bytes;
+    }
+    if (got_bytes > 0) {
+        block_cache_insert(file->cache, file->cache_file_id, block,
+                           blockbuf, (size_t)got_bytes);
+    }
+    if ((size_t)got_bytes <= offset) {
+        return 0;
+    }
+    if (len > got_bytes - (ssize_t)offset) {
+        len = got_bytes - (ssize_t)offset;
+    }
+    memcpy(dst, blockbuf + offset, len);
+    return len;
 }
 
 /** Read bytes from the database file, skipping over the header-detection bytes at every block
@@ -69,16 +320,40 @@ static couchstore_error_t read_skipping_prefixes(tree_file *file,
                                                  cs_off_t *pos,
                                                  ssize_t len,
                                                  void *dst) {
-    if (*pos % COUCH_BLOCK_SIZE == 0) {
+    const cs_off_t block_size = (cs_off_t)file->block_size;
+    if (*pos % block_size == 0) {
         ++*pos;
     }
     while (len > 0) {
-        ssize_t read_size = COUCH_BLOCK_SIZE - (*pos % COUCH_BLOCK_SIZE);
+        ssize_t read_size = block_size - (*pos % block_size);
         if (read_size > len) {
             read_size = len;
         }
-        ssize_t got_bytes = file->ops->pread(&file->lastError, file->handle,
-                                             dst, read_size, *pos);
+        ssize_t got_bytes;
+        if (file->overlay && (uint64_t)*pos >= file->overlay->base) {
+            size_t offset = (size_t)(*pos - file->overlay->base);
+            got_bytes = 0;
+            if (offset < file->overlay->size) {
+                got_bytes = read_size;
+                if ((size_t)got_bytes > file->overlay->size - offset) {
+                    got_bytes = (ssize_t)(file->overlay->size - offset);
+                }
+                memcpy(dst, file->overlay->buf + offset, got_bytes);
+            }
+        } else if (*pos + read_size <= (cs_off_t)file->map_size) {
+            memcpy(dst, file->map + *pos, read_size);
+            got_bytes = read_size;
+        } else if (file->cache) {
+            // The cache keeps COUCH_BLOCK_SIZE pieces of larger blocks.
+            ssize_t cache_room = COUCH_BLOCK_SIZE - (*pos % COUCH_BLOCK_SIZE);
+            if (read_size > cache_room) {
+                read_size = cache_room;
+            }
+            got_bytes = cached_pread(file, dst, read_size, *pos);
+        } else {
+            got_bytes = file->ops->pread(&file->lastError, file->handle,
+                                         dst, read_size, *pos);
+        }
         if (got_bytes < 0) {
             return (couchstore_error_t) got_bytes;
         } else if (got_bytes == 0) {
@@ -87,7 +362,7 @@ static couchstore_error_t read_skipping_prefixes(tree_file *file,
         *pos += got_bytes;
         len -= got_bytes;
         dst = (char*)dst + got_bytes;
-        if (*pos % COUCH_BLOCK_SIZE == 0) {
+        if (*pos % block_size == 0) {
             ++*pos;
         }
     }
@@ -98,12 +373,17 @@ static couchstore_error_t read_skipping_prefixes(tree_file *file,
  * Common subroutine of pread_bin, pread_compressed and pread_header.
  * Parameters and return value are the same as for pread_bin,
  * except the 'max_header_size' parameter which is greater than 0 if
- * reading a header, 0 otherwise.
+ * reading a header, 0 otherwise, 'mapped' which, if not NULL, allows
+ * returning a pointer into the file mapping (see pread_bin_mapped), and
+ * 'pooled' which has the buffer allocated with node_buf_alloc.
  */
-static int pread_bin_internal(tree_file *file,
-                              cs_off_t pos,
-                              char **ret_ptr,
-                              uint32_t max_header_size)
+static int read_chunk(tree_file *file,
+                      cs_off_t pos,
+                      char **ret_ptr,
+                      uint32_t max_header_size,
+                      int *mapped,
+                      unsigned *codec,
+                      int pooled)
 {
     struct {
         uint32_t chunk_len;
@@ -116,6 +396,13 @@ static int pread_bin_internal(tree_file *file,
     }
 
     info.chunk_len = ntohl(info.chunk_len) & ~0x80000000;
+    if (codec) {
+        *codec = file->chunk_codecs ? (unsigned)(info.chunk_len >> CHUNK_CODEC_SHIFT)
+                                    : (unsigned)CHUNK_CODEC_SNAPPY;
+    }
+    if (file->chunk_codecs) {
+        info.chunk_len &= CHUNK_LENGTH_MASK;
+    }
     if (max_header_size) {
         if (info.chunk_len < 4 || info.chunk_len > max_header_size)
             return COUCHSTORE_ERROR_CORRUPT;
@@ -123,16 +410,37 @@ static int pread_bin_internal(tree_file *file,
     }
     info.crc32 = ntohl(info.crc32);
 
-    char* buf = static_cast<char*>(malloc(info.chunk_len));
+    if (mapped) {
+        *mapped = 0;
+        // The chunk can be used in place if no block prefix interrupts it:
+        if (file->map && info.chunk_len > 0 &&
+            (pos % file->block_size) + info.chunk_len <= file->block_size &&
+            pos + info.chunk_len <= (cs_off_t)file->map_size) {
+            const char *src = file->map + pos;
+            if (info.crc32 && info.crc32 != chunk_crc(file->crc32c, src, info.chunk_len)) {
+                return COUCHSTORE_ERROR_CHECKSUM_FAIL;
+            }
+            *ret_ptr = const_cast<char *>(src);
+            *mapped = 1;
+            return info.chunk_len;
+        }
+    }
+
+    char* buf = pooled ? node_buf_alloc(info.chunk_len)
+                       : static_cast<char*>(cs_malloc(info.chunk_len));
     if (!buf) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
     err = read_skipping_prefixes(file, &pos, info.chunk_len, buf);
-    if (!err && info.crc32 && info.crc32 != hash_crc32(buf, info.chunk_len)) {
+    if (!err && info.crc32 && info.crc32 != chunk_crc(file->crc32c, buf, info.chunk_len)) {
         err = COUCHSTORE_ERROR_CHECKSUM_FAIL;
     }
     if (err < 0) {
-        free(buf);
+        if (pooled) {
+            node_buf_free(buf);
+        } else {
+            cs_free(buf);
+        }
         return err;
     }
 
@@ -140,6 +448,21 @@ static int pread_bin_internal(tree_file *file,
     return info.chunk_len;
 }
 
+static int pread_bin_internal(tree_file *file,
+                              cs_off_t pos,
+                              char **ret_ptr,
+                              uint32_t max_header_size,
+                              int *mapped,
+                              unsigned *codec,
+                              int pooled)
+{
+    tree_file_lock(file);
+    int len = read_chunk(file, pos, ret_ptr, max_header_size, mapped, codec, pooled);
+    tree_file_unlock(file);
+    PROBE3(chunk_read, pos, len, codec != NULL);
+    return len;
+}
+
 int pread_header(tree_file *file,
                  cs_off_t pos,
                  char **ret_ptr,
@@ -149,43 +472,258 @@ int pread_header(tree_file *file,
         return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
     }
 
-    return pread_bin_internal(file, pos + 1, ret_ptr, max_header_size);
+    return pread_bin_internal(file, pos + 1, ret_ptr, max_header_size, NULL, NULL, 0);
 }
 
 int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr)
 {
     char *compressed_buf;
-    char *new_buf;
-    int len = pread_bin_internal(file, pos, &compressed_buf, 0);
+    int mapped;
+    unsigned codec;
+    int len = pread_bin_internal(file, pos, &compressed_buf, 0, &mapped, &codec, 0);
     if (len < 0) {
         return len;
     }
+    char *to_free = mapped ? NULL : compressed_buf;
+    char *new_buf;
     size_t uncompressed_len;
 
-    if (!snappy::GetUncompressedLength(compressed_buf, len, &uncompressed_len)) {
-        //should be compressed but snappy doesn't see it as valid.
-        free(compressed_buf);
-        return COUCHSTORE_ERROR_CORRUPT;
+    couchstore_error_t errcode = codec_uncompress(file, codec, compressed_buf, len,
+                                                  &new_buf, &uncompressed_len);
+    cs_free(to_free);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
     }
+    *ret_ptr = new_buf;
+    return static_cast<int>(uncompressed_len);
+}
 
-    new_buf = static_cast<char *>(malloc(uncompressed_len));
-    if (!new_buf) {
-        free(compressed_buf);
-        return COUCHSTORE_ERROR_ALLOC_FAIL;
+int pread_compressed_into(tree_file *file, cs_off_t pos, char *dst, size_t dst_len)
+{
+    char *compressed_buf;
+    int mapped;
+    unsigned codec;
+    int len = pread_bin_internal(file, pos, &compressed_buf, 0, &mapped, &codec, 1);
+    if (len < 0) {
+        return len;
+    }
+    size_t size;
+    couchstore_error_t errcode = codec_uncompressed_length(codec, compressed_buf, len, &size);
+    if (errcode == COUCHSTORE_SUCCESS && dst && size <= dst_len) {
+        errcode = codec_uncompress_into(file, codec, compressed_buf, len, dst, size);
     }
+    if (!mapped) {
+        node_buf_free(compressed_buf);
+    }
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+    return static_cast<int>(size);
+}
 
-    if (!snappy::RawUncompress(compressed_buf, len, new_buf)) {
-        free(compressed_buf);
-        free(new_buf);
-        return COUCHSTORE_ERROR_CORRUPT;
+// Like pread_compressed, but with every buffer, the one returned and those
+// in between, from the node buffer pool.
+int pread_node(tree_file *file, cs_off_t pos, char **ret_ptr)
+{
+    char *compressed_buf;
+    int mapped;
+    unsigned codec;
+    int len = pread_bin_internal(file, pos, &compressed_buf, 0, &mapped, &codec, 1);
+    if (len < 0) {
+        return len;
     }
+    char *to_free = mapped ? NULL : compressed_buf;
+    size_t size;
+    char *buf = NULL;
 
-    free(compressed_buf);
-    *ret_ptr = new_buf;
-    return static_cast<int>(uncompressed_len);
+    couchstore_error_t errcode = codec_uncompressed_length(codec, compressed_buf, len, &size);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        buf = node_buf_alloc(size);
+        errcode = buf ? COUCHSTORE_SUCCESS : COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = codec_uncompress_into(file, codec, compressed_buf, len, buf, size);
+    }
+    node_buf_free(to_free);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        node_buf_free(buf);
+        return errcode;
+    }
+    len = static_cast<int>(size);
+    if (len == 0 || !(buf[0] & NODE_PREFIXED_KEYS)) {
+        *ret_ptr = buf;
+        return len;
+    }
+    len = expand_prefixed_node(buf, len, ret_ptr);
+    node_buf_free(buf);
+    return len;
+}
+
+int pread_bin_into(tree_file *file, cs_off_t pos, char *dst, size_t dst_len)
+{
+    struct {
+        uint32_t chunk_len;
+        uint32_t crc32;
+    } info;
+
+    tree_file_lock(file);
+    int len = read_skipping_prefixes(file, &pos, sizeof(info), &info);
+    if (len == COUCHSTORE_SUCCESS) {
+        info.chunk_len = ntohl(info.chunk_len) & ~0x80000000;
+        if (file->chunk_codecs) {
+            info.chunk_len &= CHUNK_LENGTH_MASK;
+        }
+        info.crc32 = ntohl(info.crc32);
+        len = static_cast<int>(info.chunk_len);
+        if (dst && info.chunk_len <= dst_len) {
+            couchstore_error_t err = read_skipping_prefixes(file, &pos, info.chunk_len, dst);
+            if (!err && info.crc32 && info.crc32 != chunk_crc(file->crc32c, dst, info.chunk_len)) {
+                err = COUCHSTORE_ERROR_CHECKSUM_FAIL;
+            }
+            if (err < 0) {
+                len = err;
+            }
+        }
+    }
+    tree_file_unlock(file);
+    PROBE3(chunk_read, pos, len, 0);
+    return len;
 }
 
 int pread_bin(tree_file *file, cs_off_t pos, char **ret_ptr)
 {
-    return pread_bin_internal(file, pos, ret_ptr, 0);
+    return pread_bin_internal(file, pos, ret_ptr, 0, NULL, NULL, 0);
+}
+
+int pread_bin_mapped(tree_file *file, cs_off_t pos, char **ret_ptr, int *mapped)
+{
+    return pread_bin_internal(file, pos, ret_ptr, 0, mapped, NULL, 0);
+}
+
+int pread_chunk(tree_file *file, cs_off_t pos, char **ret_ptr, unsigned *codec)
+{
+    return pread_bin_internal(file, pos, ret_ptr, 0, NULL, codec, 0);
+}
+
+static int read_raw_chunk(tree_file *file, cs_off_t pos, char **ret_ptr)
+{
+    char header[4 + 4];
+    uint32_t chunk_len;
+
+    couchstore_error_t err = read_skipping_prefixes(file, &pos, sizeof(header), header);
+    if (err < 0) {
+        return err;
+    }
+    memcpy(&chunk_len, header, 4);
+    chunk_len = ntohl(chunk_len) & ~0x80000000;
+    if (file->chunk_codecs) {
+        chunk_len &= CHUNK_LENGTH_MASK;
+    }
+
+    char *buf = static_cast<char*>(cs_malloc(sizeof(header) + chunk_len));
+    if (!buf) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(buf, header, sizeof(header));
+    err = read_skipping_prefixes(file, &pos, chunk_len, buf + sizeof(header));
+    if (err < 0) {
+        cs_free(buf);
+        return err;
+    }
+    *ret_ptr = buf;
+    return (int)(sizeof(header) + chunk_len);
+}
+
+int pread_raw_chunk(tree_file *file, cs_off_t pos, char **ret_ptr)
+{
+    tree_file_lock(file);
+    int len = read_raw_chunk(file, pos, ret_ptr);
+    tree_file_unlock(file);
+    return len;
+}
+
+// The position n bytes of data on from pos, past the block prefixes between.
+static cs_off_t skip_data(const tree_file *file, cs_off_t pos, size_t n)
+{
+    const cs_off_t block_size = (cs_off_t)file->block_size;
+    while (n > 0) {
+        if (pos % block_size == 0) {
+            ++pos;
+        }
+        size_t room = block_size - (pos % block_size);
+        if (room > n) {
+            room = n;
+        }
+        pos += room;
+        n -= room;
+    }
+    return pos;
+}
+
+static int read_chunk_range(tree_file *file, cs_off_t pos, size_t offset, size_t len,
+                            char **ret_ptr)
+{
+    uint32_t chunk_len;
+    char header[4 + 4];
+
+    *ret_ptr = NULL;
+    couchstore_error_t err = read_skipping_prefixes(file, &pos, sizeof(header), header);
+    if (err < 0) {
+        return err;
+    }
+    memcpy(&chunk_len, header, 4);
+    chunk_len = ntohl(chunk_len) & ~0x80000000;
+    if (file->chunk_codecs) {
+        chunk_len &= CHUNK_LENGTH_MASK;
+    }
+    if (offset >= chunk_len || len == 0) {
+        return 0;
+    }
+    if (len > chunk_len - offset) {
+        len = chunk_len - offset;
+    }
+    char *buf = static_cast<char*>(cs_malloc(len));
+    if (!buf) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    pos = skip_data(file, pos, offset);
+    err = read_skipping_prefixes(file, &pos, len, buf);
+    if (err < 0) {
+        cs_free(buf);
+        return err;
+    }
+    *ret_ptr = buf;
+    return (int)len;
+}
+
+int pread_bin_range(tree_file *file, cs_off_t pos, size_t offset, size_t len,
+                    char **ret_ptr)
+{
+    tree_file_lock(file);
+    int got = read_chunk_range(file, pos, offset, len, ret_ptr);
+    tree_file_unlock(file);
+    return got;
+}
+
+cs_off_t pread_header_end(tree_file *file, cs_off_t pos)
+{
+    char *buf;
+    int len = pread_header(file, pos, &buf, MAX_DB_HEADER_SIZE);
+    if (len < 0) {
+        return len;
+    }
+    cs_free(buf);
+    // The marker, then the length and CRC ahead of the header itself
+    return skip_data(file, pos + 1, 4 + 4 + len);
+}
+
+cs_off_t pread_chunk_end(tree_file *file, cs_off_t pos)
+{
+    char *buf;
+    int len = pread_bin_internal(file, pos, &buf, 0, NULL, NULL, 0);
+    if (len < 0) {
+        return len;
+    }
+    cs_free(buf);
+    return skip_data(file, pos, 4 + 4 + len);
 }
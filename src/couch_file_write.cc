@@ -4,7 +4,6 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <snappy.h>
 #include <libcouchstore/couch_db.h>
 
 #include "rfc1321/global.h"
@@ -12,57 +11,211 @@
 #include "internal.h"
 #include "crc32.h"
 #include "util.h"
+#include "chunk_writer.h"
+#include "codec.h"
+#include "node_types.h"
+#include "bitfield.h"
 
-static ssize_t raw_write(tree_file *file, const sized_buf *buf, cs_off_t pos)
+// Enough for a full db_write_chunks of bodies of a few KB to go out in one
+// gathered write, which the buffered file ops pass straight to the file.
+#define WRITE_IOV_BATCH 256
+
+// Where a file's overlay starts: past the end of any file a body pointer,
+// whose top three bits are flags, can reach, but still inside a raw_48.
+#define OVERLAY_BASE (UINT64_C(1) << 45)
+
+// Copies a batch of chunks into the overlay, which they extend.
+static ssize_t write_overlay(file_overlay *overlay, const sized_buf *iov, int iovcnt,
+                             cs_off_t pos)
+{
+    size_t offset = (size_t)(pos - overlay->base);
+    size_t expected = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        expected += iov[i].size;
+    }
+    if ((uint64_t)pos < overlay->base || offset != overlay->size) {
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    if (offset + expected > overlay->capacity) {
+        size_t capacity = overlay->capacity ? overlay->capacity : 64 * 1024;
+        while (capacity < offset + expected) {
+            capacity *= 2;
+        }
+        char *buf = static_cast<char*>(cs_realloc(overlay->buf, capacity));
+        if (buf == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        overlay->buf = buf;
+        overlay->capacity = capacity;
+    }
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(overlay->buf + overlay->size, iov[i].buf, iov[i].size);
+        overlay->size += iov[i].size;
+    }
+    return (ssize_t)expected;
+}
+
+// Hands a batch of chunks to the file ops, gathered into a single write if
+// they support it.
+static ssize_t write_chunks(tree_file *file, const sized_buf *iov, int iovcnt,
+                            cs_off_t pos)
 {
+    const couch_file_ops *ops = file->ops;
     cs_off_t write_pos = pos;
-    size_t buf_pos = 0;
-    char blockprefix = 0;
-    ssize_t written;
-    size_t block_remain;
-    while (buf_pos < buf->size) {
-        block_remain = COUCH_BLOCK_SIZE - (write_pos % COUCH_BLOCK_SIZE);
-        if (block_remain > (buf->size - buf_pos)) {
-            block_remain = buf->size - buf_pos;
+
+    if (file->overlay) {
+        return write_overlay(file->overlay, iov, iovcnt, pos);
+    }
+
+    if (ops->version >= 6 && ops->pwritev != NULL) {
+        ssize_t expected = 0;
+        for (int i = 0; i < iovcnt; ++i) {
+            expected += iov[i].size;
         }
+        ssize_t written = ops->pwritev(&file->lastError, file->handle,
+                                       iov, iovcnt, pos);
+        if (written >= 0 && written != expected) {
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        return written;
+    }
 
-        if (write_pos % COUCH_BLOCK_SIZE == 0) {
-            written = file->ops->pwrite(&file->lastError, file->handle,
-                                        &blockprefix, 1, write_pos);
+    for (int i = 0; i < iovcnt; ++i) {
+        size_t done = 0;
+        while (done < iov[i].size) {
+            ssize_t written = ops->pwrite(&file->lastError, file->handle,
+                                          iov[i].buf + done,
+                                          iov[i].size - done, write_pos);
             if (written < 0) {
                 return written;
             }
-            write_pos += 1;
-            continue;
+            done += written;
+            write_pos += written;
+        }
+    }
+    return (ssize_t)(write_pos - pos);
+}
+
+// Writes the buffers back to back at pos, interleaving the block prefix
+// byte wherever they cross a block boundary.
+static ssize_t raw_write(tree_file *file, const sized_buf *bufs, int nbufs,
+                         cs_off_t pos)
+{
+    char blockprefix = 0;
+    sized_buf iov[WRITE_IOV_BATCH];
+    int iovcnt = 0;
+    const cs_off_t block_size = (cs_off_t)file->block_size;
+    cs_off_t write_pos = pos;
+    cs_off_t batch_pos = pos;
+    ssize_t written;
+
+    for (int i = 0; i < nbufs; ++i) {
+        size_t buf_pos = 0;
+        while (buf_pos < bufs[i].size) {
+            // Leave room for a prefix and a chunk:
+            if (iovcnt > WRITE_IOV_BATCH - 2) {
+                written = write_chunks(file, iov, iovcnt, batch_pos);
+                if (written < 0) {
+                    return written;
+                }
+                batch_pos = write_pos;
+                iovcnt = 0;
+            }
+
+            if (write_pos % block_size == 0) {
+                iov[iovcnt].buf = &blockprefix;
+                iov[iovcnt].size = 1;
+                ++iovcnt;
+                write_pos += 1;
+            }
+
+            size_t block_remain = block_size - (write_pos % block_size);
+            if (block_remain > (bufs[i].size - buf_pos)) {
+                block_remain = bufs[i].size - buf_pos;
+            }
+            iov[iovcnt].buf = bufs[i].buf + buf_pos;
+            iov[iovcnt].size = block_remain;
+            ++iovcnt;
+            buf_pos += block_remain;
+            write_pos += block_remain;
         }
+    }
 
-        written = file->ops->pwrite(&file->lastError, file->handle,
-                                    buf->buf + buf_pos, block_remain, write_pos);
+    if (iovcnt > 0) {
+        written = write_chunks(file, iov, iovcnt, batch_pos);
         if (written < 0) {
             return written;
         }
-        buf_pos += written;
-        write_pos += written;
     }
 
     return (ssize_t)(write_pos - pos);
 }
 
+// Reserves disk space in whole steps ahead of a write of len bytes at pos,
+// if it would run past what's reserved already. The byte count allows for
+// the block prefixes raw_write adds. File ops that can't reserve space turn
+// preallocation off for the file; the write itself goes ahead either way.
+static void reserve_space(tree_file *file, cs_off_t pos, size_t len)
+{
+    cs_off_t step = (cs_off_t)file->prealloc_chunk;
+    cs_off_t end = pos + len + len / (file->block_size - 1) + 1;
+    if (step == 0 || file->overlay || end <= file->allocated) {
+        return;
+    }
+    cs_off_t start = file->allocated > pos ? file->allocated : pos;
+    cs_off_t new_end = (end + step - 1) / step * step;
+    if (file->ops->allocate(&file->lastError, file->handle,
+                            start, new_end - start) != COUCHSTORE_SUCCESS) {
+        file->prealloc_chunk = 0;
+        return;
+    }
+    file->allocated = new_end;
+}
+
+couchstore_error_t tree_file_start_overlay(tree_file *file)
+{
+    if (file->overlay == NULL) {
+        file->overlay = static_cast<file_overlay*>(cs_calloc(1, sizeof(file_overlay)));
+        if (file->overlay == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        file->overlay->base = OVERLAY_BASE;
+    }
+    file->pos = file->overlay->base + file->overlay->size;
+    return COUCHSTORE_SUCCESS;
+}
+
+void tree_file_clear_overlay(tree_file *file)
+{
+    file_overlay *overlay = file->overlay;
+    if (overlay == NULL) {
+        return;
+    }
+    // Block aligned, as the file's appends would be after a header.
+    overlay->base += overlay->size;
+    overlay->base += file->block_size - overlay->base % file->block_size;
+    cs_free(overlay->buf);
+    overlay->buf = NULL;
+    overlay->size = 0;
+    overlay->capacity = 0;
+}
+
 couchstore_error_t write_header(tree_file *file, sized_buf *buf, cs_off_t *pos)
 {
     cs_off_t write_pos = file->pos;
     ssize_t written;
     uint32_t size = htonl(buf->size + 4); //Len before header includes hash len.
-    uint32_t crc32 = htonl(hash_crc32(buf->buf, buf->size));
+    uint32_t crc32 = htonl(chunk_crc(file->crc32c, buf->buf, buf->size));
     char headerbuf[1 + 4 + 4];
 
-    if (write_pos % COUCH_BLOCK_SIZE != 0) {
-        write_pos += COUCH_BLOCK_SIZE - (write_pos % COUCH_BLOCK_SIZE);    //Move to next block boundary.
+    if (write_pos % file->block_size != 0) {
+        write_pos += file->block_size - (write_pos % file->block_size);    //Move to next block boundary.
     }
     *pos = write_pos;
+    reserve_space(file, write_pos, sizeof(headerbuf) + buf->size);
 
     // Write the header's block header
-    headerbuf[0] = 1;
+    headerbuf[0] = file->crc32c ? BLOCK_HEADER_CRC32C : 1;
     memcpy(&headerbuf[1], &size, 4);
     memcpy(&headerbuf[5], &crc32, 4);
 
@@ -74,7 +227,7 @@ couchstore_error_t write_header(tree_file *file, sized_buf *buf, cs_off_t *pos)
     write_pos += written;
 
     //Write actual header
-    written = raw_write(file, buf, write_pos);
+    written = raw_write(file, buf, 1, write_pos);
     if (written < 0) {
         return (couchstore_error_t)written;
     }
@@ -84,28 +237,83 @@ couchstore_error_t write_header(tree_file *file, sized_buf *buf, cs_off_t *pos)
     return COUCHSTORE_SUCCESS;
 }
 
+couchstore_error_t write_file_preamble(tree_file *file)
+{
+    char buf[1 + sizeof(raw_file_preamble)];
+    raw_file_preamble *raw = (raw_file_preamble*)(buf + 1);
+
+    buf[0] = BLOCK_PREAMBLE;
+    raw->version = encode_raw08(FILE_PREAMBLE_VERSION);
+    raw->block_shift = encode_raw08((uint8_t)file_block_shift(file));
+    raw->crc32 = encode_raw32(hash_crc32((const char*)&raw->version,
+                                         sizeof(*raw) - sizeof(raw->crc32)));
+    ssize_t written = file->ops->pwrite(&file->lastError, file->handle,
+                                        buf, sizeof(buf), 0);
+    return written < 0 ? (couchstore_error_t)written : COUCHSTORE_SUCCESS;
+}
+
 int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+{
+    return db_write_chunk(file, buf, CHUNK_CODEC_SNAPPY, pos, disk_size);
+}
+
+// Fills in the header that goes ahead of a chunk's contents: its length,
+// with the codec in the top bits if the file has them, and its CRC.
+static couchstore_error_t chunk_header(const tree_file *file, const sized_buf *buf,
+                                       unsigned codec, char *headerbuf)
+{
+    uint32_t length = (uint32_t)buf->size;
+    if (file->chunk_codecs) {
+        if (buf->size > CHUNK_LENGTH_MASK) {
+            return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+        }
+        length |= codec << CHUNK_CODEC_SHIFT;
+    } else if (codec != CHUNK_CODEC_SNAPPY) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    uint32_t size = htonl(length | 0x80000000);
+    uint32_t crc32 = htonl(chunk_crc(file->crc32c, buf->buf, buf->size));
+    memcpy(&headerbuf[0], &size, 4);
+    memcpy(&headerbuf[4], &crc32, 4);
+    return COUCHSTORE_SUCCESS;
+}
+
+// Where raw_write would end up after writing len bytes at pos.
+static cs_off_t raw_write_end(const tree_file *file, cs_off_t pos, size_t len)
+{
+    const cs_off_t block_size = (cs_off_t)file->block_size;
+    while (len > 0) {
+        if (pos % block_size == 0) {
+            ++pos;
+        }
+        size_t block_remain = block_size - (pos % block_size);
+        if (block_remain > len) {
+            block_remain = len;
+        }
+        pos += block_remain;
+        len -= block_remain;
+    }
+    return pos;
+}
+
+static int append_chunk(tree_file *file, const sized_buf *buf, unsigned codec,
+                        cs_off_t *pos, size_t *disk_size)
 {
     cs_off_t write_pos = file->pos;
     cs_off_t end_pos = write_pos;
     ssize_t written;
-    uint32_t size = htonl(buf->size | 0x80000000);
-    uint32_t crc32 = htonl(hash_crc32(buf->buf, buf->size));
     char headerbuf[4 + 4];
 
-    // Write the buffer's header:
-    memcpy(&headerbuf[0], &size, 4);
-    memcpy(&headerbuf[4], &crc32, 4);
-
-    sized_buf sized_headerbuf = { headerbuf, 8 };
-    written = raw_write(file, &sized_headerbuf, end_pos);
-    if (written < 0) {
-        return (int)written;
+    // Write the buffer's header...
+    couchstore_error_t errcode = chunk_header(file, buf, codec, headerbuf);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
     }
-    end_pos += written;
 
-    // Write actual buffer:
-    written = raw_write(file, buf, end_pos);
+    // ...followed by the actual buffer, in one go:
+    sized_buf bufs[2] = { { headerbuf, 8 }, *buf };
+    reserve_space(file, end_pos, 8 + buf->size);
+    written = raw_write(file, bufs, 2, end_pos);
     if (written < 0) {
         return (int)written;
     }
@@ -123,21 +331,131 @@ int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *d
     return 0;
 }
 
-couchstore_error_t db_write_buf_compressed(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size)
+int db_write_chunk(tree_file *file, const sized_buf *buf, unsigned codec,
+                   cs_off_t *pos, size_t *disk_size)
+{
+    tree_file_lock(file);
+    int errcode = append_chunk(file, buf, codec, pos, disk_size);
+    tree_file_unlock(file);
+    return errcode;
+}
+
+static int append_raw_chunk(tree_file *file, const sized_buf *chunk,
+                            cs_off_t *pos, size_t *disk_size)
+{
+    cs_off_t write_pos = file->pos;
+
+    reserve_space(file, write_pos, chunk->size);
+    ssize_t written = raw_write(file, chunk, 1, write_pos);
+    if (written < 0) {
+        return (int)written;
+    }
+    if (pos) {
+        *pos = write_pos;
+    }
+    file->pos = write_pos + written;
+    if (disk_size) {
+        *disk_size = (size_t)written;
+    }
+    return 0;
+}
+
+int db_write_raw_chunk(tree_file *file, const sized_buf *chunk,
+                       cs_off_t *pos, size_t *disk_size)
+{
+    tree_file_lock(file);
+    int errcode = append_raw_chunk(file, chunk, pos, disk_size);
+    tree_file_unlock(file);
+    return errcode;
+}
+
+static couchstore_error_t append_chunks(tree_file *file, const sized_buf *bufs, unsigned count,
+                                        cs_off_t *pos, size_t *disk_size)
+{
+    char headers[DB_WRITE_CHUNKS_MAX][4 + 4];
+    sized_buf parts[2 * DB_WRITE_CHUNKS_MAX];
+    cs_off_t write_pos = file->pos;
+    size_t total = 0;
+    unsigned ii;
+
+    if (count == 0) {
+        return COUCHSTORE_SUCCESS;
+    } else if (count > DB_WRITE_CHUNKS_MAX) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    for (ii = 0; ii < count; ii++) {
+        couchstore_error_t errcode = chunk_header(file, &bufs[ii], CHUNK_CODEC_SNAPPY,
+                                                  headers[ii]);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+        parts[2 * ii].buf = headers[ii];
+        parts[2 * ii].size = 8;
+        parts[2 * ii + 1] = bufs[ii];
+        total += 8 + bufs[ii].size;
+    }
+
+    reserve_space(file, write_pos, total);
+    ssize_t written = raw_write(file, parts, 2 * count, write_pos);
+    if (written < 0) {
+        return static_cast<couchstore_error_t>(written);
+    }
+    for (ii = 0; ii < count; ii++) {
+        cs_off_t end_pos = raw_write_end(file, write_pos, 8 + bufs[ii].size);
+        pos[ii] = write_pos;
+        disk_size[ii] = (size_t)(end_pos - write_pos);
+        write_pos = end_pos;
+    }
+    file->pos = write_pos;
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t db_write_chunks(tree_file *file, const sized_buf *bufs, unsigned count,
+                                   cs_off_t *pos, size_t *disk_size)
+{
+    tree_file_lock(file);
+    couchstore_error_t errcode = append_chunks(file, bufs, count, pos, disk_size);
+    tree_file_unlock(file);
+    return errcode;
+}
+
+couchstore_error_t db_write_buf_compressed(tree_file *file, const sized_buf *buf,
+                                           couchstore_codec codec,
+                                           cs_off_t *pos, size_t *disk_size)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     sized_buf to_write;
-    size_t max_size = snappy::MaxCompressedLength(buf->size);
+    unsigned chunk_codec = tree_file_chunk_codec(file, codec);
+    size_t max_size = codec_max_compressed_length(chunk_codec, buf->size);
 
-    char* compressbuf = static_cast<char *>(malloc(max_size));
+    char* compressbuf = static_cast<char *>(cs_malloc(max_size));
     to_write.buf = compressbuf;
     to_write.size = max_size;
     error_unless(to_write.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    snappy::RawCompress(buf->buf, buf->size, to_write.buf, &to_write.size);
+    error_pass(codec_compress(file, chunk_codec, buf->buf, buf->size,
+                              to_write.buf, &to_write.size));
 
-    error_pass(static_cast<couchstore_error_t>(db_write_buf(file, &to_write, pos, disk_size)));
+    error_pass(static_cast<couchstore_error_t>(db_write_chunk(file, &to_write, chunk_codec,
+                                                              pos, disk_size)));
 cleanup:
-    free(compressbuf);
+    cs_free(compressbuf);
+    return errcode;
+}
+
+couchstore_error_t tree_file_set_compression_threads(tree_file *file, unsigned threads)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (file->chunk_writer && threads != file->compression_threads) {
+        chunk_writer_destroy(file->chunk_writer);
+        file->chunk_writer = NULL;
+    }
+    file->compression_threads = threads;
+    if (threads > 0 && !file->chunk_writer) {
+        errcode = chunk_writer_create(threads, &file->chunk_writer);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            file->compression_threads = 0;
+        }
+    }
     return errcode;
 }
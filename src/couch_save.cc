@@ -5,9 +5,18 @@
 #include <stdlib.h>
 
 #include "internal.h"
+#include "arena.h"
+#include "batch_sort.h"
+#include "bloom_filter.h"
+#include "body_segments.h"
+#include "chunk_writer.h"
+#include "delta_buffer.h"
+#include "expiry_index.h"
 #include "node_types.h"
+#include "op_stats.h"
 #include "util.h"
 #include "reduces.h"
+#include "value_log.h"
 #include "couch_btree.h"
 
 #define SEQ_INDEX_RAW_VALUE_SIZE(doc_info) \
@@ -57,7 +66,8 @@ static couchstore_error_t write_doc(Db *db, const Doc *doc, uint64_t *bp,
 {
     couchstore_error_t errcode;
     if (writeopts & COMPRESS_DOC_BODIES) {
-        errcode = db_write_buf_compressed(&db->file, &doc->data, (cs_off_t *) bp, disk_size);
+        errcode = db_write_buf_compressed(&db->file, &doc->data, db->file.doc_codec,
+                                          (cs_off_t *) bp, disk_size);
     } else {
         errcode = static_cast<couchstore_error_t>(db_write_buf(&db->file, &doc->data, (cs_off_t *) bp, disk_size));
     }
@@ -65,40 +75,173 @@ static couchstore_error_t write_doc(Db *db, const Doc *doc, uint64_t *bp,
     return errcode;
 }
 
-static int ebin_ptr_compare(const void *a, const void *b)
+// Where a body queued on the Db's chunk writer ended up:
+typedef struct {
+    cs_off_t bp;
+    size_t size;
+} written_body;
+
+// Working memory of a save. A write batch keeps it from one save to the
+// next, so that in the steady state saving allocates nothing of its own.
+typedef struct {
+    fatbuf *terms;                  // index keys and values
+    fatbuf *actions;                // modify actions, and keys they remove
+    const sized_buf **sorted_ids;
+    written_body *written;
+    unsigned capacity;              // of sorted_ids and written, in docs
+    arena *tree_arena;              // for modify_btree, or NULL
+    sort_space sort;
+} save_scratch;
+
+// Returns an emptied fatbuf of at least the given size, reusing *fb if it's
+// big enough.
+static fatbuf *scratch_fatbuf(fatbuf **fb, size_t bytes)
 {
-    const sized_buf* const* buf1 = static_cast<const sized_buf* const *>(a);
-    const sized_buf* const* buf2 = static_cast<const sized_buf* const *>(b);
-    return ebin_cmp(*buf1, *buf2);
+    if (*fb && (*fb)->size >= bytes) {
+        fatbuf_reset(*fb);
+        return *fb;
+    }
+    fatbuf_free(*fb);
+    *fb = fatbuf_alloc(bytes);
+    return *fb;
 }
 
-static int seq_action_compare(const void *actv1, const void *actv2)
+static couchstore_error_t scratch_reserve(save_scratch *scratch, unsigned numdocs)
 {
-    const couchfile_modify_action *act1, *act2;
-    act1 = static_cast<const couchfile_modify_action *>(actv1);
-    act2 = static_cast<const couchfile_modify_action *>(actv2);
+    if (numdocs <= scratch->capacity) {
+        return COUCHSTORE_SUCCESS;
+    }
+    cs_free(scratch->sorted_ids);
+    cs_free(scratch->written);
+    scratch->sorted_ids = static_cast<const sized_buf**>(cs_malloc(numdocs * sizeof(sized_buf*)));
+    scratch->written = static_cast<written_body*>(cs_malloc(numdocs * sizeof(written_body)));
+    if (!scratch->sorted_ids || !scratch->written) {
+        scratch->capacity = 0;
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    scratch->capacity = numdocs;
+    return COUCHSTORE_SUCCESS;
+}
 
-    uint64_t seq1, seq2;
+static void scratch_free(save_scratch *scratch)
+{
+    fatbuf_free(scratch->terms);
+    fatbuf_free(scratch->actions);
+    cs_free(scratch->sorted_ids);
+    cs_free(scratch->written);
+    sort_space_free(&scratch->sort);
+    if (scratch->tree_arena) {
+        delete_arena(scratch->tree_arena);
+    }
+}
 
-    seq1 = decode_sequence_key(act1->key);
-    seq2 = decode_sequence_key(act2->key);
+static node_pointer *scratch_modify_btree(save_scratch *scratch,
+                                          size_t arena_limit,
+                                          couchfile_modify_request *rq,
+                                          node_pointer *root,
+                                          couchstore_error_t *errcode)
+{
+    arena *a = scratch->tree_arena;
+    if (!a) {
+        if (!arena_limit) {
+            return modify_btree(rq, root, errcode);
+        }
+        a = new_arena(0);
+        if (!a) {
+            *errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
+            return root;
+        }
+    }
+    arena_set_limit(a, arena_limit);
+    node_pointer *ret_ptr = modify_btree_in_arena(rq, root, a, errcode);
+    if (a == scratch->tree_arena) {
+        arena_reset(a);
+    } else {
+        delete_arena(a);
+    }
+    return ret_ptr;
+}
+
+// Appends the bodies of a batch through the chunk writer, so that their
+// compression is spread over its threads. They land in the same order, and
+// at the same positions, as if write_doc were called for each in turn.
+static couchstore_error_t write_bodies(Db *db,
+                                       Doc* const docs[],
+                                       DocInfo *infos[],
+                                       unsigned numdocs,
+                                       couchstore_save_options options,
+                                       written_body *written)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    chunk_writer *writer = db->file.chunk_writer;
+    unsigned ii;
 
-    if (seq1 < seq2) {
-        return -1;
+    for (ii = 0; ii < numdocs && errcode == COUCHSTORE_SUCCESS; ii++) {
+        if (docs[ii]) {
+            // Don't compress a doc unless the meta flag is set
+            int compress = (options & COMPRESS_DOC_BODIES) &&
+                           (infos[ii]->content_meta & COUCH_DOC_IS_COMPRESSED);
+            // Those for the value log or in segments are written as they're
+            // added to the trees.
+            if (db_value_log_takes(db, docs[ii]->data.size) ||
+                db_body_segmented(db, docs[ii]->data.size, compress)) {
+                continue;
+            }
+            errcode = chunk_writer_add(writer, &db->file, &docs[ii]->data, compress,
+                                       &written[ii].bp, &written[ii].size);
+        }
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = chunk_writer_flush(writer, &db->file);
     }
-    if (seq1 == seq2) {
-        if (act1->type < act2->type) {
-            return -1;
+    if (errcode != COUCHSTORE_SUCCESS) {
+        chunk_writer_discard(writer);
+    }
+    return errcode;
+}
+
+// Appends the bodies of an uncompressed batch from the caller's buffers in
+// gathered writes of DB_WRITE_CHUNKS_MAX at a time, rather than copying each
+// into the file's write buffer. Positions are as with write_doc.
+static couchstore_error_t write_bodies_gathered(Db *db,
+                                                Doc* const docs[],
+                                                unsigned numdocs,
+                                                written_body *written)
+{
+    sized_buf bufs[DB_WRITE_CHUNKS_MAX];
+    cs_off_t pos[DB_WRITE_CHUNKS_MAX];
+    size_t sizes[DB_WRITE_CHUNKS_MAX];
+    unsigned which[DB_WRITE_CHUNKS_MAX];
+    unsigned ii = 0;
+
+    while (ii < numdocs) {
+        unsigned count = 0;
+        for (; ii < numdocs && count < DB_WRITE_CHUNKS_MAX; ii++) {
+            if (docs[ii] && !db_value_log_takes(db, docs[ii]->data.size)) {
+                bufs[count] = docs[ii]->data;
+                which[count++] = ii;
+            }
         }
-        if (act1->type > act2->type) {
-            return 1;
+        if (count == 0) {
+            break;
+        }
+        couchstore_error_t errcode = db_write_chunks(&db->file, bufs, count, pos, sizes);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            return errcode;
+        }
+        for (unsigned jj = 0; jj < count; jj++) {
+            written[which[jj]].bp = pos[jj];
+            written[which[jj]].size = sizes[jj];
         }
-        return 0;
-    }
-    if (seq1 > seq2) {
-        return 1;
     }
-    return 0;
+    return COUCHSTORE_SUCCESS;
+}
+
+static int ebin_ptr_compare(const void *a, const void *b)
+{
+    const sized_buf* const* buf1 = static_cast<const sized_buf* const *>(a);
+    const sized_buf* const* buf2 = static_cast<const sized_buf* const *>(b);
+    return ebin_cmp(*buf1, *buf2);
 }
 
 typedef struct _idxupdatectx {
@@ -110,8 +253,32 @@ typedef struct _idxupdatectx {
     int valpos;
 
     fatbuf *deltermbuf;
+
+    /* Expiry index actions, if the Db has one */
+    couchfile_modify_action *expacts;
+    int exppos;
+    uint16_t expiry_offset;
+
+    /* Bytes of the value log's bodies that the removed entries pointed to */
+    uint64_t vlog_freed;
+    int vlog;
 } index_update_ctx;
 
+// Adds an expiry index action keyed by (time, seq), its key from buf.
+static void add_expiry_action(index_update_ctx *ctx, int type, uint32_t time,
+                              uint64_t seq, const sized_buf *id, fatbuf *buf)
+{
+    sized_buf *key = (sized_buf *) fatbuf_get(buf, sizeof(sized_buf));
+    key->buf = (char *) fatbuf_get(buf, sizeof(raw_expiry_key));
+    key->size = sizeof(raw_expiry_key);
+    expiry_key((raw_expiry_key*)key->buf, time, seq);
+
+    ctx->expacts[ctx->exppos].type = type;
+    ctx->expacts[ctx->exppos].value.data = const_cast<sized_buf*>(id);
+    ctx->expacts[ctx->exppos].key = key;
+    ctx->exppos++;
+}
+
 static void idfetch_update_cb(couchfile_modify_request *rq,
                               sized_buf *k, sized_buf *v, void *arg)
 {
@@ -140,6 +307,35 @@ static void idfetch_update_cb(couchfile_modify_request *rq,
     ctx->seqacts[ctx->actpos].key = delbuf;
 
     ctx->actpos++;
+
+    uint64_t bp = decode_raw48(raw->bp);
+    if (ctx->vlog && (bp & BP_VALUE_LOG_FLAG)) {
+        ctx->vlog_freed += decode_raw32(raw->size);
+    }
+
+    if (ctx->expacts) {
+        uint32_t time = expiry_of_id_value(ctx->expiry_offset, v);
+        if (time != 0) {
+            add_expiry_action(ctx, ACTION_REMOVE, time, oldseq, NULL, ctx->deltermbuf);
+        }
+    }
+}
+
+// Feeds the sizes of a batch's entries to adaptive node sizing.
+static void observe_batch(tree_sizing *sizing, const sized_buf *keys,
+                          const sized_buf *values, int count)
+{
+    size_t key_bytes = 0, value_bytes = 0;
+    int ii;
+
+    if (sizing->policy != COUCHSTORE_NODE_SIZE_ADAPTIVE) {
+        return;
+    }
+    for (ii = 0; ii < count; ii++) {
+        key_bytes += keys[ii].size;
+        value_bytes += values[ii].size;
+    }
+    tree_sizing_observe(sizing, key_bytes, value_bytes, count);
 }
 
 static couchstore_error_t update_indexes(Db *db,
@@ -147,7 +343,9 @@ static couchstore_error_t update_indexes(Db *db,
                                          sized_buf *seqvals,
                                          sized_buf *ids,
                                          sized_buf *idvals,
-                                         int numdocs)
+                                         int numdocs,
+                                         couchstore_save_options options,
+                                         save_scratch *scratch)
 {
     couchfile_modify_action *idacts;
     couchfile_modify_action *seqacts;
@@ -159,7 +357,7 @@ static couchstore_error_t update_indexes(Db *db,
     couchstore_error_t errcode;
     couchstore_error_t err;
     couchfile_modify_request seqrq, idrq;
-    int ii;
+    int ii, numacts;
     index_update_ctx fetcharg;
 
     /*
@@ -168,8 +366,13 @@ static couchstore_error_t update_indexes(Db *db,
     ** Max size of a int64 erlang term (for deleted seqs)
     */
     size = 4 * sizeof(couchfile_modify_action) + 2 * sizeof(sized_buf) + 10;
+    if (db->header.expiry_index) {
+        // An expiry index removal and insertion, with their keys
+        size += 2 * sizeof(couchfile_modify_action) +
+                2 * (sizeof(sized_buf) + sizeof(raw_expiry_key));
+    }
 
-    actbuf = fatbuf_alloc(numdocs * size);
+    actbuf = scratch_fatbuf(&scratch->actions, numdocs * size);
     error_unless(actbuf, COUCHSTORE_ERROR_ALLOC_FAIL);
 
     idacts = static_cast<couchfile_modify_action*>(fatbuf_get(actbuf, numdocs * sizeof(couchfile_modify_action) * 2));
@@ -183,46 +386,72 @@ static couchstore_error_t update_indexes(Db *db,
     fetcharg.seqvals = &seqvals;
     fetcharg.valpos = 0;
     fetcharg.deltermbuf = actbuf;
+    if (db->header.expiry_index) {
+        fetcharg.expacts = static_cast<couchfile_modify_action*>(
+            fatbuf_get(actbuf, numdocs * sizeof(couchfile_modify_action) * 2));
+        error_unless(fetcharg.expacts, COUCHSTORE_ERROR_ALLOC_FAIL);
+        fetcharg.expiry_offset = db->header.expiry_offset;
+    }
+    fetcharg.vlog = db->header.vlog_ptr != 0;
 
-    // Sort the array indexes of ids[] by ascending id. Since we can't pass context info to qsort,
+    // Sort the array indexes of ids[] by ascending id. Since the sort can't be passed context info,
     // actually sort an array of pointers to the elements of ids[], rather than the array indexes.
-    sorted_ids = static_cast<const sized_buf**>(malloc(numdocs * sizeof(sized_buf*)));
-    error_unless(sorted_ids, COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_pass(scratch_reserve(scratch, numdocs));
+    sorted_ids = scratch->sorted_ids;
     for (ii = 0; ii < numdocs; ++ii) {
         sorted_ids[ii] = &ids[ii];
     }
-    qsort(sorted_ids, numdocs, sizeof(sorted_ids[0]), &ebin_ptr_compare);
+    error_pass(sort_id_pointers(sorted_ids, numdocs, db->file.compression_threads,
+                                &scratch->sort));
 
-    // Assemble idacts[] array, in sorted order by id:
+    // Assemble idacts[] array, in sorted order by id. New documents have no
+    // previous sequence number to fetch and remove.
+    numacts = 0;
     for (ii = 0; ii < numdocs; ii++) {
         ptrdiff_t isorted = sorted_ids[ii] - ids;   // recover index of ii'th id in sort order
 
-        idacts[ii * 2].type = ACTION_FETCH;
-        idacts[ii * 2].value.arg = &fetcharg;
-        idacts[ii * 2 + 1].type = ACTION_INSERT;
-        idacts[ii * 2 + 1].value.data = &idvals[isorted];
-        idacts[ii * 2].key = &ids[isorted];
-        idacts[ii * 2 + 1].key = &ids[isorted];
+        if (!(options & COUCHSTORE_SAVE_BLIND_INSERT)) {
+            idacts[numacts].type = ACTION_FETCH;
+            idacts[numacts].value.arg = &fetcharg;
+            idacts[numacts].key = &ids[isorted];
+            numacts++;
+        }
+        idacts[numacts].type = ACTION_INSERT;
+        idacts[numacts].value.data = &idvals[isorted];
+        idacts[numacts].key = &ids[isorted];
+        numacts++;
     }
 
     idrq.cmp.compare = ebin_cmp;
     idrq.file = &db->file;
     idrq.actions = idacts;
-    idrq.num_actions = numdocs * 2;
+    idrq.num_actions = numacts;
     idrq.reduce = by_id_reduce;
     idrq.rereduce = by_id_rereduce;
+    idrq.reduce_delta = NULL;
     idrq.fetch_callback = idfetch_update_cb;
     idrq.compacting = 0;
     idrq.enable_purging = false;
     idrq.purge_kp = NULL;
     idrq.purge_kv = NULL;
-    idrq.kv_chunk_threshold = DB_CHUNK_THRESHOLD;
-    idrq.kp_chunk_threshold = DB_CHUNK_THRESHOLD;
+    observe_batch(&db->header.id_sizing, ids, idvals, numdocs);
+    tree_sizing_thresholds(&db->header.id_sizing, &idrq.kv_chunk_threshold,
+                           &idrq.kp_chunk_threshold);
 
-    new_id_root = modify_btree(&idrq, db->header.by_id_root, &err);
+    new_id_root = scratch_modify_btree(scratch, db->arena_limit, &idrq, db->header.by_id_root,
+                                       &err);
     error_pass(err);
 
     while (fetcharg.valpos < numdocs) {
+        if (fetcharg.expacts) {
+            uint32_t time = expiry_of_seq_value(fetcharg.expiry_offset,
+                                                &seqvals[fetcharg.valpos]);
+            if (time != 0) {
+                add_expiry_action(&fetcharg, ACTION_INSERT, time,
+                                  decode_raw48(*(raw_48*)seqs[fetcharg.valpos].buf),
+                                  &ids[fetcharg.valpos], actbuf);
+            }
+        }
         seqacts[fetcharg.actpos].type = ACTION_INSERT;
         seqacts[fetcharg.actpos].value.data = &seqvals[fetcharg.valpos];
         seqacts[fetcharg.actpos].key = &seqs[fetcharg.valpos];
@@ -231,41 +460,54 @@ static couchstore_error_t update_indexes(Db *db,
     }
 
     //printf("Total seq actions: %d\n", fetcharg.actpos);
-    qsort(seqacts, fetcharg.actpos, sizeof(couchfile_modify_action),
-          seq_action_compare);
+    error_pass(sort_seq_actions(seqacts, fetcharg.actpos, &scratch->sort));
 
     seqrq.cmp.compare = seq_cmp;
     seqrq.actions = seqacts;
     seqrq.num_actions = fetcharg.actpos;
-    seqrq.reduce = by_seq_reduce;
-    seqrq.rereduce = by_seq_rereduce;
+    if (db->header.disk_version >= COUCH_DISK_VERSION_SEQ_DELETES) {
+        seqrq.reduce = by_seq_deletes_reduce;
+        seqrq.rereduce = by_seq_deletes_rereduce;
+    } else {
+        seqrq.reduce = by_seq_reduce;
+        seqrq.rereduce = by_seq_rereduce;
+    }
+    seqrq.reduce_delta = NULL;
     seqrq.file = &db->file;
     seqrq.compacting = 0;
     seqrq.enable_purging = false;
     seqrq.purge_kp = NULL;
     seqrq.purge_kv = NULL;
-    seqrq.kv_chunk_threshold = DB_CHUNK_THRESHOLD;
-    seqrq.kp_chunk_threshold = DB_CHUNK_THRESHOLD;
+    observe_batch(&db->header.seq_sizing, seqs, seqvals, numdocs);
+    tree_sizing_thresholds(&db->header.seq_sizing, &seqrq.kv_chunk_threshold,
+                           &seqrq.kp_chunk_threshold);
 
-    new_seq_root = modify_btree(&seqrq, db->header.by_seq_root, &errcode);
+    new_seq_root = scratch_modify_btree(scratch, db->arena_limit, &seqrq, db->header.by_seq_root,
+                                        &errcode);
     if (errcode != COUCHSTORE_SUCCESS) {
-        fatbuf_free(actbuf);
         return errcode;
     }
 
     if (db->header.by_id_root != new_id_root) {
-        free(db->header.by_id_root);
+        cs_free(db->header.by_id_root);
         db->header.by_id_root = new_id_root;
     }
 
     if (db->header.by_seq_root != new_seq_root) {
-        free(db->header.by_seq_root);
+        cs_free(db->header.by_seq_root);
         db->header.by_seq_root = new_seq_root;
     }
 
+    if (fetcharg.expacts) {
+        error_pass(db_expiry_modify(db, fetcharg.expacts, fetcharg.exppos));
+    }
+    if (fetcharg.vlog_freed < db->header.vlog_live) {
+        db->header.vlog_live -= fetcharg.vlog_freed;
+    } else {
+        db->header.vlog_live = 0;
+    }
+
 cleanup:
-    free(sorted_ids);
-    fatbuf_free(actbuf);
     return errcode;
 }
 
@@ -278,10 +520,13 @@ static couchstore_error_t add_doc_to_update_list(Db *db,
                                                  sized_buf *seqval,
                                                  sized_buf *idval,
                                                  uint64_t seq,
+                                                 const written_body *written,
                                                  couchstore_save_options options)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     DocInfo updated = *info;
+    int compress = (options & COMPRESS_DOC_BODIES) &&
+                   (info->content_meta & COUCH_DOC_IS_COMPRESSED);
     updated.db_seq = seq;
 
     seqterm->buf = (char *) fatbuf_get(fb, RAW_SEQ_SIZE);
@@ -289,7 +534,24 @@ static couchstore_error_t add_doc_to_update_list(Db *db,
     error_unless(seqterm->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
     *(raw_48*)seqterm->buf = encode_raw48(seq);
 
-    if (doc) {
+    if (options & COUCHSTORE_SAVE_BODIES_WRITTEN) {
+        // Placed by a doc writer; without one it's a deletion.
+        if (updated.bp == 0) {
+            updated.deleted = 1;
+            updated.size = 0;
+        }
+    } else if (doc && db_value_log_takes(db, doc->data.size)) {
+        size_t disk_size;
+        error_pass(db_value_log_write(db, &doc->data, compress, &updated.bp, &disk_size));
+        updated.size = disk_size;
+    } else if (doc && db_body_segmented(db, doc->data.size, compress)) {
+        size_t disk_size;
+        error_pass(db_write_segmented(db, &doc->data, &updated.bp, &disk_size));
+        updated.size = disk_size;
+    } else if (doc && written) {
+        updated.bp = written->bp;
+        updated.size = written->size;
+    } else if (doc) {
         size_t disk_size;
 
         // Don't compress a doc unless the meta flag is set
@@ -323,12 +585,12 @@ cleanup:
     return errcode;
 }
 
-LIBCOUCHSTORE_API
-couchstore_error_t couchstore_save_documents(Db *db,
-                                             Doc* const docs[],
-                                             DocInfo *infos[],
-                                             unsigned numdocs,
-                                             couchstore_save_options options)
+static couchstore_error_t save_documents(Db *db,
+                                         Doc* const docs[],
+                                         DocInfo *infos[],
+                                         unsigned numdocs,
+                                         couchstore_save_options options,
+                                         save_scratch *scratch)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
     unsigned ii;
@@ -336,10 +598,26 @@ couchstore_error_t couchstore_save_documents(Db *db,
     size_t term_meta_size = 0;
     const Doc *curdoc;
     uint64_t seq = db->header.update_seq;
+    written_body *written = NULL;
 
     fatbuf *fb;
 
     error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_pass(db_value_log_load(db));
+    if (options & COUCHSTORE_SAVE_BODIES_WRITTEN) {
+        // Their bodies are where the infos say, so there's none to write.
+        docs = NULL;
+    }
+
+    if (docs && db->file.chunk_writer && (options & COMPRESS_DOC_BODIES) && numdocs > 1) {
+        error_pass(scratch_reserve(scratch, numdocs));
+        written = scratch->written;
+        error_pass(write_bodies(db, docs, infos, numdocs, options, written));
+    } else if (docs && !(options & COMPRESS_DOC_BODIES) && numdocs > 1) {
+        error_pass(scratch_reserve(scratch, numdocs));
+        written = scratch->written;
+        error_pass(write_bodies_gathered(db, docs, numdocs, written));
+    }
 
     for (ii = 0; ii < numdocs; ii++) {
         // Get additional size for terms to be inserted into indexes
@@ -349,12 +627,9 @@ couchstore_error_t couchstore_save_documents(Db *db,
         term_meta_size += ID_INDEX_RAW_VALUE_SIZE(*infos[ii]);
     }
 
-    fb = fatbuf_alloc(term_meta_size +
-                      numdocs * (sizeof(sized_buf) * 4)); //seq/id key and value lists
-
-    if (fb == NULL) {
-        return COUCHSTORE_ERROR_ALLOC_FAIL;
-    }
+    fb = scratch_fatbuf(&scratch->terms, term_meta_size +
+                        numdocs * (sizeof(sized_buf) * 4)); //seq/id key and value lists
+    error_unless(fb, COUCHSTORE_ERROR_ALLOC_FAIL);
 
 
     seqklist = static_cast<sized_buf*>(fatbuf_get(fb, numdocs * sizeof(sized_buf)));
@@ -378,18 +653,31 @@ couchstore_error_t couchstore_save_documents(Db *db,
         errcode = add_doc_to_update_list(db, curdoc, infos[ii], fb,
                                          &seqklist[ii], &idklist[ii],
                                          &seqvlist[ii], &idvlist[ii],
-                                         seq, options);
+                                         seq, written ? &written[ii] : NULL,
+                                         options);
         if (errcode != COUCHSTORE_SUCCESS) {
             break;
         }
     }
 
+    if (errcode == COUCHSTORE_SUCCESS && db_delta_due(db, numdocs)) {
+        // Folded before this batch is added, so that a failure can't leave
+        // it half saved.
+        errcode = db_fold_delta(db);
+    }
     if (errcode == COUCHSTORE_SUCCESS) {
-        errcode = update_indexes(db, seqklist, seqvlist,
-                                 idklist, idvlist, numdocs);
+        if (db_delta_takes(db, numdocs)) {
+            errcode = db_delta_add(db, seqklist, seqvlist, numdocs);
+        } else {
+            errcode = update_indexes(db, seqklist, seqvlist,
+                                     idklist, idvlist, numdocs, options, scratch);
+        }
+    }
+
+    for (ii = 0; ii < numdocs && errcode == COUCHSTORE_SUCCESS; ii++) {
+        db_bloom_add(db, &idklist[ii], decode_raw48(*(raw_48*)seqklist[ii].buf));
     }
 
-    fatbuf_free(fb);
     if (errcode == COUCHSTORE_SUCCESS) {
         if(options & COUCHSTORE_SEQUENCE_AS_IS) {
             // Sequences are passed as-is, make sure update_seq is >= the highest.
@@ -413,6 +701,405 @@ couchstore_error_t couchstore_save_documents(Db *db,
     return errcode;
 }
 
+couchstore_error_t db_fold_delta(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    delta_buffer *delta = db->delta;
+    sized_buf *lists = NULL;
+    save_scratch scratch;
+    unsigned ii, count;
+
+    if (delta == NULL || delta->count == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    memset(&scratch, 0, sizeof(scratch));
+    count = delta->count;
+    lists = static_cast<sized_buf*>(cs_malloc(4 * count * sizeof(sized_buf)));
+    error_unless(lists, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (ii = 0; ii < count; ii++) {
+        lists[ii] = delta->entries[ii]->seq;
+        lists[count + ii] = delta->entries[ii]->seq_value;
+        lists[2 * count + ii] = delta->entries[ii]->id;
+        lists[3 * count + ii] = delta->entries[ii]->id_value;
+    }
+    // The entries may replace documents in the trees, whose old sequences
+    // are looked up and removed as for any save.
+    error_pass(update_indexes(db, lists, lists + count, lists + 2 * count,
+                              lists + 3 * count, (int)count, 0, &scratch));
+    // Entries loaded from the log may be missing from a filter built from
+    // the trees before they got there.
+    for (ii = 0; ii < count; ii++) {
+        db_bloom_add(db, &lists[2 * count + ii], decode_raw48(*(raw_48*)lists[ii].buf));
+    }
+    db_delta_reset(db);
+    db->header.delta_ptr = 0;
+
+cleanup:
+    scratch_free(&scratch);
+    cs_free(lists);
+    return errcode;
+}
+
+couchstore_error_t db_add_entries(Db *db,
+                                  sized_buf *seqs,
+                                  sized_buf *seqvals,
+                                  sized_buf *ids,
+                                  sized_buf *idvals,
+                                  unsigned count,
+                                  couchstore_save_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    save_scratch scratch;
+    unsigned ii;
+
+    if (count == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    memset(&scratch, 0, sizeof(scratch));
+    error_pass(update_indexes(db, seqs, seqvals, ids, idvals, (int)count,
+                              options, &scratch));
+    for (ii = 0; ii < count; ii++) {
+        db_bloom_add(db, &ids[ii], decode_raw48(*(raw_48*)seqs[ii].buf));
+    }
+
+cleanup:
+    scratch_free(&scratch);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_save_documents(Db *db,
+                                             Doc* const docs[],
+                                             DocInfo *infos[],
+                                             unsigned numdocs,
+                                             couchstore_save_options options)
+{
+    OP_STATS_START(db->op_stats);
+    save_scratch scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    couchstore_error_t errcode = save_documents(db, docs, infos, numdocs, options, &scratch);
+    scratch_free(&scratch);
+    OP_STATS_END(db->op_stats, save_documents);
+    return errcode;
+}
+
+// How to give back a document the batch owns:
+typedef struct {
+    couchstore_doc_release_fn fn;
+    void *ctx;
+} doc_release;
+
+struct _couchstore_write_batch {
+    Doc **docs;
+    DocInfo **infos;
+    doc_release *releases;
+    unsigned count;
+    unsigned capacity;
+    unsigned owned;                 // documents with a release function
+    save_scratch scratch;
+};
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_write_batch_open(couchstore_write_batch **pBatch)
+{
+    couchstore_write_batch *batch =
+        static_cast<couchstore_write_batch*>(cs_calloc(1, sizeof(couchstore_write_batch)));
+    if (!batch) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    batch->scratch.tree_arena = new_arena(0);
+    if (!batch->scratch.tree_arena) {
+        cs_free(batch);
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *pBatch = batch;
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t write_batch_append(couchstore_write_batch *batch,
+                                             Doc *doc,
+                                             DocInfo *info,
+                                             couchstore_doc_release_fn release,
+                                             void *ctx)
+{
+    if (batch->count == batch->capacity) {
+        unsigned capacity = batch->capacity ? batch->capacity * 2 : 64;
+        Doc **docs = static_cast<Doc**>(cs_realloc(batch->docs, capacity * sizeof(Doc*)));
+        if (!docs) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        batch->docs = docs;
+        DocInfo **infos = static_cast<DocInfo**>(cs_realloc(batch->infos,
+                                                         capacity * sizeof(DocInfo*)));
+        if (!infos) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        batch->infos = infos;
+        doc_release *releases = static_cast<doc_release*>(
+            cs_realloc(batch->releases, capacity * sizeof(doc_release)));
+        if (!releases) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        batch->releases = releases;
+        batch->capacity = capacity;
+    }
+    batch->docs[batch->count] = doc;
+    batch->infos[batch->count] = info;
+    batch->releases[batch->count].fn = release;
+    batch->releases[batch->count].ctx = ctx;
+    ++batch->count;
+    if (release) {
+        ++batch->owned;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+// Empties the batch, handing back the documents it owns.
+static void write_batch_release(couchstore_write_batch *batch)
+{
+    for (unsigned ii = 0; ii < batch->count && batch->owned > 0; ii++) {
+        doc_release *release = &batch->releases[ii];
+        if (release->fn) {
+            release->fn(batch->docs[ii], batch->infos[ii], release->ctx);
+            --batch->owned;
+        }
+    }
+    batch->count = 0;
+    batch->owned = 0;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_write_batch_add(couchstore_write_batch *batch,
+                                              const Doc *doc,
+                                              DocInfo *info)
+{
+    return write_batch_append(batch, const_cast<Doc*>(doc), info, NULL, NULL);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_write_batch_add_owned(couchstore_write_batch *batch,
+                                                    Doc *doc,
+                                                    DocInfo *info,
+                                                    couchstore_doc_release_fn release,
+                                                    void *ctx)
+{
+    if (release == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    return write_batch_append(batch, doc, info, release, ctx);
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_save_write_batch(Db *db,
+                                               couchstore_write_batch *batch,
+                                               couchstore_save_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    if (batch->count > 0) {
+        OP_STATS_START(db->op_stats);
+        errcode = save_documents(db, batch->docs, batch->infos, batch->count,
+                                 options, &batch->scratch);
+        OP_STATS_END(db->op_stats, save_documents);
+    }
+    write_batch_release(batch);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_write_batch_clear(couchstore_write_batch *batch)
+{
+    write_batch_release(batch);
+}
+
+LIBCOUCHSTORE_API
+void couchstore_write_batch_free(couchstore_write_batch *batch)
+{
+    if (batch) {
+        write_batch_release(batch);
+        scratch_free(&batch->scratch);
+        cs_free(batch->docs);
+        cs_free(batch->infos);
+        cs_free(batch->releases);
+        cs_free(batch);
+    }
+}
+
+static int seq_ptr_compare(const void *a, const void *b)
+{
+    const sized_buf* const* buf1 = static_cast<const sized_buf* const *>(a);
+    const sized_buf* const* buf2 = static_cast<const sized_buf* const *>(b);
+    return seq_cmp(*buf1, *buf2);
+}
+
+// Builds a new B-tree out of items sorted by key, which must all be
+// different: being written bottom up, nothing would replace a repeat.
+static couchstore_error_t build_btree(tree_file *file,
+                                      compare_info *cmp,
+                                      reduce_fn reduce,
+                                      reduce_fn rereduce,
+                                      tree_sizing *sizing,
+                                      sized_buf **keys,
+                                      sized_buf *values,
+                                      sized_buf *first_key,
+                                      unsigned numitems,
+                                      node_pointer **root)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchfile_modify_result *mr;
+    unsigned ii;
+    int kv_threshold, kp_threshold;
+    arena *a = new_arena(0);
+
+    error_unless(a, COUCHSTORE_ERROR_ALLOC_FAIL);
+    observe_batch(sizing, first_key, values, (int)numitems);
+    tree_sizing_thresholds(sizing, &kv_threshold, &kp_threshold);
+    mr = new_btree_modres(a, NULL, file, cmp, reduce, rereduce, NULL,
+                          kv_threshold, kp_threshold);
+    error_unless(mr, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (ii = 0; ii < numitems; ii++) {
+        if (ii > 0) {
+            error_unless(cmp->compare(keys[ii - 1], keys[ii]) < 0,
+                         COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+        }
+        // The values are parallel to first_key, the start of the key array.
+        error_pass(mr_push_item(keys[ii], &values[keys[ii] - first_key], mr));
+    }
+    *root = complete_new_btree(mr, &errcode);
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS && file->chunk_writer) {
+        chunk_writer_discard(file->chunk_writer);
+    }
+    delete_arena(a);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_bulk_load(Db *db,
+                                        Doc* const docs[],
+                                        DocInfo *infos[],
+                                        unsigned numdocs,
+                                        couchstore_save_options options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    unsigned ii;
+    sized_buf *seqklist, *idklist, *seqvlist, *idvlist;
+    sized_buf **sorted = NULL;
+    size_t term_meta_size = 0;
+    uint64_t seq = db->header.update_seq;
+    written_body *written = NULL;
+    node_pointer *seq_root = NULL, *id_root = NULL;
+    compare_info seqcmp, idcmp;
+    int seq_deletes;
+    fatbuf *fb = NULL;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(db->header.by_id_root == NULL && db->header.by_seq_root == NULL &&
+                 (db->delta == NULL || db->delta->count == 0),
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    if (numdocs == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    error_pass(db_value_log_load(db));
+    if (options & COUCHSTORE_SAVE_BODIES_WRITTEN) {
+        // As in couchstore_save_documents:
+        docs = NULL;
+    }
+
+    if (docs && db->file.chunk_writer && (options & COMPRESS_DOC_BODIES)) {
+        written = static_cast<written_body*>(cs_malloc(numdocs * sizeof(written_body)));
+        error_unless(written, COUCHSTORE_ERROR_ALLOC_FAIL);
+        error_pass(write_bodies(db, docs, infos, numdocs, options, written));
+    } else if (docs && !(options & COMPRESS_DOC_BODIES)) {
+        written = static_cast<written_body*>(cs_malloc(numdocs * sizeof(written_body)));
+        error_unless(written, COUCHSTORE_ERROR_ALLOC_FAIL);
+        error_pass(write_bodies_gathered(db, docs, numdocs, written));
+    }
+
+    for (ii = 0; ii < numdocs; ii++) {
+        // As in couchstore_save_documents:
+        term_meta_size += RAW_SEQ_SIZE;
+        term_meta_size += SEQ_INDEX_RAW_VALUE_SIZE(*infos[ii]);
+        term_meta_size += ID_INDEX_RAW_VALUE_SIZE(*infos[ii]);
+    }
+    fb = fatbuf_alloc(term_meta_size + numdocs * (sizeof(sized_buf) * 4));
+    sorted = static_cast<sized_buf**>(cs_malloc(numdocs * sizeof(sized_buf*)));
+    error_unless(fb && sorted, COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    seqklist = static_cast<sized_buf*>(fatbuf_get(fb, numdocs * sizeof(sized_buf)));
+    idklist = static_cast<sized_buf*>(fatbuf_get(fb, numdocs * sizeof(sized_buf)));
+    seqvlist = static_cast<sized_buf*>(fatbuf_get(fb, numdocs * sizeof(sized_buf)));
+    idvlist = static_cast<sized_buf*>(fatbuf_get(fb, numdocs * sizeof(sized_buf)));
+
+    for (ii = 0; ii < numdocs; ii++) {
+        if (options & COUCHSTORE_SEQUENCE_AS_IS) {
+            seq = infos[ii]->db_seq;
+        } else {
+            seq++;
+        }
+        error_pass(add_doc_to_update_list(db, docs ? docs[ii] : NULL, infos[ii], fb,
+                                          &seqklist[ii], &idklist[ii],
+                                          &seqvlist[ii], &idvlist[ii],
+                                          seq, written ? &written[ii] : NULL,
+                                          options));
+    }
+
+    seqcmp.compare = seq_cmp;
+    for (ii = 0; ii < numdocs; ii++) {
+        sorted[ii] = &seqklist[ii];
+    }
+    if (options & COUCHSTORE_SEQUENCE_AS_IS) {
+        qsort(sorted, numdocs, sizeof(sorted[0]), &seq_ptr_compare);
+    }
+    seq_deletes = db->header.disk_version >= COUCH_DISK_VERSION_SEQ_DELETES;
+    error_pass(build_btree(&db->file, &seqcmp,
+                           seq_deletes ? by_seq_deletes_reduce : by_seq_reduce,
+                           seq_deletes ? by_seq_deletes_rereduce : by_seq_rereduce,
+                           &db->header.seq_sizing, sorted, seqvlist, seqklist, numdocs,
+                           &seq_root));
+
+    idcmp.compare = ebin_cmp;
+    for (ii = 0; ii < numdocs; ii++) {
+        sorted[ii] = &idklist[ii];
+    }
+    qsort(sorted, numdocs, sizeof(sorted[0]), &ebin_ptr_compare);
+    error_pass(build_btree(&db->file, &idcmp, by_id_reduce, by_id_rereduce,
+                           &db->header.id_sizing, sorted, idvlist, idklist, numdocs,
+                           &id_root));
+
+    if (db->header.expiry_index) {
+        expiry_builder builder;
+        errcode = expiry_builder_open(&builder, db->header.expiry_offset);
+        for (ii = 0; ii < numdocs && errcode == COUCHSTORE_SUCCESS; ii++) {
+            errcode = expiry_builder_add(&builder, &seqklist[ii], &seqvlist[ii]);
+        }
+        if (errcode == COUCHSTORE_SUCCESS) {
+            errcode = expiry_builder_finish(&builder, db);
+        }
+        expiry_builder_free(&builder);
+        error_pass(errcode);
+    }
+    db->header.by_seq_root = seq_root;
+    db->header.by_id_root = id_root;
+    seq_root = id_root = NULL;
+    for (ii = 0; ii < numdocs; ii++) {
+        uint64_t docseq = decode_raw48(*(raw_48*)seqklist[ii].buf);
+        db_bloom_add(db, &idklist[ii], docseq);
+        infos[ii]->db_seq = docseq;
+        if (docseq > db->header.update_seq) {
+            db->header.update_seq = docseq;
+        }
+    }
+
+cleanup:
+    cs_free(seq_root);
+    cs_free(id_root);
+    cs_free(sorted);
+    fatbuf_free(fb);
+    cs_free(written);
+    return errcode;
+}
+
 LIBCOUCHSTORE_API
 couchstore_error_t couchstore_save_document(Db *db, const Doc *doc,
                                             DocInfo *info, couchstore_save_options options)
@@ -7,8 +7,11 @@
 #include <sysexits.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <algorithm>
+#include <vector>
 
 #include <libcouchstore/couch_db.h>
+#include <platform/platform.h>
 #include "internal.h"
 
 // For building against lua 5.2 and up. Also requires that lua was
@@ -637,8 +640,278 @@ extern "C" {
         return 0;
     }
 
+
+    static int couch_get_bulk_each(Db *, DocInfo *di, void *ctx)
+    {
+        std::vector<DocInfo *> *infos(static_cast<std::vector<DocInfo *> *>(ctx));
+        infos->push_back(di);
+        return 1;
+    }
+
+    // couch:get_bulk({key, ...}) -> {key = value, ...}, {key = docinfo, ...}
+    //
+    // Missing keys are left out of both tables, and deleted docs only
+    // have a docinfo.
+    static int couch_get_bulk(lua_State *ls)
+    {
+        if (lua_gettop(ls) < 2 || !lua_istable(ls, 2)) {
+            lua_pushstring(ls, "couch:get_bulk takes one argument: a table of keys");
+            lua_error(ls);
+            return 1;
+        }
+
+        Db *db = getDb(ls);
+
+        // The strings stay in the argument table, so can be pointed at
+        std::vector<sized_buf> ids(lua_objlen(ls, 2));
+        for (size_t i = 0; i < ids.size(); ++i) {
+            lua_rawgeti(ls, 2, static_cast<int>(i + 1));
+            if (lua_type(ls, -1) != LUA_TSTRING) {
+                lua_pushstring(ls, "couch:get_bulk keys must be strings");
+                lua_error(ls);
+                return 1;
+            }
+            ids[i].buf = const_cast<char *>(lua_tolstring(ls, -1, &ids[i].size));
+            lua_pop(ls, 1);
+        }
+
+        std::vector<DocInfo *> infos;
+        int rc = COUCHSTORE_SUCCESS;
+        if (!ids.empty()) {
+            rc = couchstore_docinfos_by_id(db, &ids[0], static_cast<unsigned>(ids.size()),
+                                           0, couch_get_bulk_each, &infos);
+        }
+        std::vector<Doc *> docs(infos.size());
+        if (rc == COUCHSTORE_SUCCESS && !infos.empty()) {
+            rc = couchstore_open_docs_with_docinfos(db, &infos[0],
+                                                    static_cast<unsigned>(infos.size()),
+                                                    &docs[0], 0);
+        }
+        if (rc < 0) {
+            char buf[256];
+            for (size_t i = 0; i < infos.size(); ++i) {
+                couchstore_free_docinfo(infos[i]);
+            }
+            snprintf(buf, sizeof(buf), "error getting docs: %s", couchstore_strerror(rc));
+            lua_pushstring(ls, buf);
+            lua_error(ls);
+            return 1;
+        }
+
+        lua_createtable(ls, 0, static_cast<int>(infos.size()));
+        lua_createtable(ls, 0, static_cast<int>(infos.size()));
+        for (size_t i = 0; i < infos.size(); ++i) {
+            DocInfo *di(infos[i]);
+            if (docs[i] != NULL) {
+                lua_pushlstring(ls, di->id.buf, di->id.size);
+                lua_pushlstring(ls, docs[i]->data.buf, docs[i]->data.size);
+                lua_settable(ls, -4);
+                couchstore_free_document(docs[i]);
+            }
+            lua_pushlstring(ls, di->id.buf, di->id.size);
+            push_docinfo(ls, di);
+            lua_settable(ls, -3);
+        }
+
+        return 2;
+    }
+
+    typedef struct {
+        couchstore_cursor *cursor;
+        couchstore_docinfos_options options;
+    } changes_iter_t;
+
+    static int changes_iter_gc(lua_State *ls)
+    {
+        changes_iter_t *it = static_cast<changes_iter_t *>(luaL_checkudata(ls, 1, "changes_iter"));
+        couchstore_cursor_close(it->cursor);
+        it->cursor = NULL;
+        return 0;
+    }
+
+    static int changes_iter_next(lua_State *ls)
+    {
+        changes_iter_t *it = static_cast<changes_iter_t *>(lua_touserdata(ls, lua_upvalueindex(1)));
+        assert(it);
+
+        while (it->cursor != NULL) {
+            DocInfo *di(NULL);
+            int rc = couchstore_cursor_next(it->cursor, &di);
+            if (rc != COUCHSTORE_SUCCESS) {
+                char buf[128];
+                snprintf(buf, sizeof(buf), "error iterating: %s", couchstore_strerror(rc));
+                lua_pushstring(ls, buf);
+                lua_error(ls);
+                return 1;
+            }
+            if (di == NULL) {
+                // Let go of the cursor now rather than when collected,
+                // which may be after the db is closed
+                couchstore_cursor_close(it->cursor);
+                it->cursor = NULL;
+                break;
+            }
+            if (((it->options & COUCHSTORE_DELETES_ONLY) && !di->deleted) ||
+                ((it->options & COUCHSTORE_NO_DELETES) && di->deleted)) {
+                couchstore_free_docinfo(di);
+                continue;
+            }
+            push_docinfo(ls, di);
+            return 1;
+        }
+
+        lua_pushnil(ls);
+        return 1;
+    }
+
+    // for docinfo in db:changes_iter(since, options) do something end
+    //
+    // The loop should run to its end (or the iterator be collected)
+    // before the db is closed.
+    static int couch_changes_iter(lua_State *ls)
+    {
+        if (lua_gettop(ls) < 3) {
+            lua_pushstring(ls, "couch:changes_iter takes two arguments: "
+                           "rev_seq, options");
+            lua_error(ls);
+            return 1;
+        }
+
+        Db *db = getDb(ls);
+
+        uint64_t since((uint64_t)luaL_checknumber(ls, 2));
+        couchstore_docinfos_options options((uint64_t)luaL_checknumber(ls, 3));
+
+        changes_iter_t *it = static_cast<changes_iter_t *>(lua_newuserdata(ls, sizeof(changes_iter_t)));
+        assert(it);
+        it->cursor = NULL;
+        it->options = options;
+        luaL_getmetatable(ls, "changes_iter");
+        lua_setmetatable(ls, -2);
+
+        int rc = couchstore_cursor_open(db, COUCHSTORE_CURSOR_BY_SEQUENCE, &it->cursor);
+        if (rc == COUCHSTORE_SUCCESS) {
+            rc = couchstore_cursor_seek_sequence(it->cursor, since);
+        }
+        if (rc != COUCHSTORE_SUCCESS) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "error iterating: %s", couchstore_strerror(rc));
+            lua_pushstring(ls, buf);
+            lua_error(ls);
+            return 1;
+        }
+
+        lua_pushcclosure(ls, changes_iter_next, 1);
+        return 1;
+    }
+
+    // couch.now() -> seconds on a monotonic clock
+    static int couch_now(lua_State *ls)
+    {
+        lua_pushnumber(ls, gethrtime() / 1e9);
+        return 1;
+    }
+
+    // A sample of values (such as latencies) to take percentiles of
+    class Histogram
+    {
+    public:
+        Histogram() : sorted(true), total(0) {}
+
+        void add(double v) {
+            sorted = sorted && (values.empty() || values.back() <= v);
+            values.push_back(v);
+            total += v;
+        }
+
+        // p is a fraction, 0.99 for the 99th percentile
+        double percentile(double p) {
+            if (values.empty()) {
+                return 0;
+            }
+            if (!sorted) {
+                std::sort(values.begin(), values.end());
+                sorted = true;
+            }
+            p = std::max(0.0, std::min(1.0, p));
+            return values[static_cast<size_t>(p * (values.size() - 1) + 0.5)];
+        }
+
+        std::vector<double> values;
+        bool sorted;
+        double total;
+    };
+
+    static Histogram *getHistogram(lua_State *ls)
+    {
+        Histogram **h = static_cast<Histogram **>(luaL_checkudata(ls, 1, "histogram"));
+        assert(h);
+        assert(*h);
+        return *h;
+    }
+
+    // couch.histogram() -> histogram
+    static int couch_histogram(lua_State *ls)
+    {
+        Histogram **h = static_cast<Histogram **>(lua_newuserdata(ls, sizeof(Histogram *)));
+        assert(h);
+        *h = new Histogram();
+
+        luaL_getmetatable(ls, "histogram");
+        lua_setmetatable(ls, -2);
+        return 1;
+    }
+
+    // histogram:add(value)
+    static int histogram_add(lua_State *ls)
+    {
+        getHistogram(ls)->add(luaL_checknumber(ls, 2));
+        return 0;
+    }
+
+    static int histogram_count(lua_State *ls)
+    {
+        lua_pushinteger(ls, getHistogram(ls)->values.size());
+        return 1;
+    }
+
+    static int histogram_mean(lua_State *ls)
+    {
+        Histogram *h = getHistogram(ls);
+        lua_pushnumber(ls, h->values.empty() ? 0 : h->total / h->values.size());
+        return 1;
+    }
+
+    static int histogram_min(lua_State *ls)
+    {
+        lua_pushnumber(ls, getHistogram(ls)->percentile(0));
+        return 1;
+    }
+
+    static int histogram_max(lua_State *ls)
+    {
+        lua_pushnumber(ls, getHistogram(ls)->percentile(1));
+        return 1;
+    }
+
+    // histogram:percentile(fraction) -> value
+    static int histogram_percentile(lua_State *ls)
+    {
+        Histogram *h = getHistogram(ls);
+        lua_pushnumber(ls, h->percentile(luaL_checknumber(ls, 2)));
+        return 1;
+    }
+
+    static int histogram_gc(lua_State *ls)
+    {
+        delete getHistogram(ls);
+        return 0;
+    }
+
     static const luaL_Reg couch_funcs[] = {
         {"open", couch_open},
+        {"now", couch_now},
+        {"histogram", couch_histogram},
         {NULL, NULL}
     };
 
@@ -647,8 +920,10 @@ extern "C" {
         {"save_bulk", couch_save_bulk},
         {"delete", couch_delete},
         {"get", couch_get},
+        {"get_bulk", couch_get_bulk},
         {"get_from_docinfo", couch_get_from_docinfo},
         {"changes", couch_changes},
+        {"changes_iter", couch_changes_iter},
         {"save_local", couch_save_local},
         {"delete_local", couch_delete_local},
         {"get_local", couch_get_local},
@@ -758,6 +1033,22 @@ extern "C" {
         {NULL, NULL}
     };
 
+    static const luaL_Reg changes_iter_methods[] = {
+        {"__gc", changes_iter_gc},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg histogram_methods[] = {
+        {"add", histogram_add},
+        {"count", histogram_count},
+        {"mean", histogram_mean},
+        {"min", histogram_min},
+        {"max", histogram_max},
+        {"percentile", histogram_percentile},
+        {"__gc", histogram_gc},
+        {NULL, NULL}
+    };
+
 }
 
 static void initCouch(lua_State *ls)
@@ -784,6 +1075,23 @@ static void initDocInfo(lua_State *ls)
     luaL_openlib(ls, NULL, docinfo_methods, 0);
 }
 
+static void initChangesIter(lua_State *ls)
+{
+    luaL_newmetatable(ls, "changes_iter");
+    luaL_openlib(ls, NULL, changes_iter_methods, 0);
+}
+
+static void initHistogram(lua_State *ls)
+{
+    luaL_newmetatable(ls, "histogram");
+
+    lua_pushstring(ls, "__index");
+    lua_pushvalue(ls, -2);  /* pushes the metatable */
+    lua_settable(ls, -3);  /* metatable.__index = metatable */
+
+    luaL_openlib(ls, NULL, histogram_methods, 0);
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2) {
@@ -796,6 +1104,8 @@ int main(int argc, char **argv)
 
     initCouch(ls);
     initDocInfo(ls);
+    initChangesIter(ls);
+    initHistogram(ls);
 
     int rv(luaL_dofile(ls, argv[1]));
     if (rv != 0) {
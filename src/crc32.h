@@ -9,6 +9,17 @@ extern "C" {
 
     uint32_t hash_crc32(const char *key, size_t key_length);
 
+    /** The Castagnoli CRC, which files created with
+        COUCHSTORE_OPEN_FLAG_CRC32C checksum their chunks with. */
+    uint32_t hash_crc32c(const char *key, size_t key_length);
+
+    /** The checksum of a chunk or header of a file, CRC32C if crc32c is
+        nonzero. */
+    static inline uint32_t chunk_crc(int crc32c, const char *buf, size_t len)
+    {
+        return crc32c ? hash_crc32c(buf, len) : hash_crc32(buf, len);
+    }
+
 #ifdef __cplusplus
 }
 #endif
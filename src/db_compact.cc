@@ -1,13 +1,21 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 #include "internal.h"
+#include "bloom_filter.h"
+#include "body_segments.h"
+#include "delta_buffer.h"
+#include "expiry_index.h"
 #include "couch_btree.h"
 #include "reduces.h"
 #include "bitfield.h"
 #include "arena.h"
 #include "tree_writer.h"
+#include "body_reader.h"
+#include "io_throttle.h"
+#include "compact_progress.h"
 #include "node_types.h"
 #include "util.h"
+#include "value_log.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -24,11 +32,135 @@ typedef struct compact_ctx {
     couchstore_compact_hook hook;
     void* hook_ctx;
     couchstore_compact_flags flags;
+    /* Tombstones to drop without asking the hook, or NULL */
+    const couchstore_purge_policy *purge;
+    /* Reads the bodies ahead when the source has compaction threads */
+    body_reader *reader;
+    int verbatim;               /* the reader's bodies are whole chunks */
+    io_throttle *throttle;
+    compact_progress *progress; /* or NULL */
+    expiry_builder *expiry;     /* the target's expiry index, or NULL */
+    Db *source;                 /* whose value log the bodies may be in */
 } compact_ctx;
 
 static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *ctx);
 static couchstore_error_t compact_localdocs_tree(Db* source, Db* target, compact_ctx *ctx);
 
+static couchstore_error_t copy_dictionary(Db *source, Db *target)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf dict = { NULL, 0 };
+    cs_off_t pos;
+
+    int size = pread_bin(&source->file, source->header.dict_ptr, &dict.buf);
+    error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+    dict.size = size;
+    error_pass(static_cast<couchstore_error_t>(db_write_buf(&target->file, &dict, &pos, NULL)));
+    target->header.dict_ptr = pos;
+    target->file.dict_pos = pos;
+
+cleanup:
+    cs_free(dict.buf);
+    return errcode;
+}
+
+// How to create the target of compacting source, which keeps its header
+// hints, its checksum and its block size if it has them.
+static couchstore_open_flags target_open_flags(const Db *source)
+{
+    return COUCHSTORE_OPEN_FLAG_CREATE |
+           (source->header_hints ? COUCHSTORE_OPEN_FLAG_HEADER_HINTS : 0) |
+           (source->file.crc32c ? COUCHSTORE_OPEN_FLAG_CRC32C : 0) |
+           (file_preamble_size(&source->file) > 0
+                ? COUCHSTORE_OPEN_BLOCK_SHIFT(file_block_shift(&source->file)) : 0);
+}
+
+// Sets up a newly created file to take the compacted contents of source.
+static couchstore_error_t start_target(Db *source, Db *target, couchstore_compact_flags flags)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    // Over the header written on creating it, past block 0 if that holds a
+    // preamble or a list, which forgets the header.
+    target->file.pos = target->header.position + 1;
+    if (target->header_hints) {
+        target->nhints = 0;
+    }
+    target->header.update_seq = source->header.update_seq;
+    if (flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES) {
+        //Count the number of times purge has happened
+        target->header.purge_seq = source->header.purge_seq + 1;
+    } else {
+        target->header.purge_seq = source->header.purge_seq;
+    }
+    target->header.purge_ptr = source->header.purge_ptr;
+    if (source->bloom_enabled &&
+        target->header.disk_version >= COUCH_DISK_VERSION_BLOOM_FILTER) {
+        // Rebuilt from the IDs copied over, sized for the current count
+        error_pass(db_bloom_start(target, source));
+    }
+    // Chunks are copied with the codec they were written with, so those
+    // compressed with the dictionary need it in the target as well.
+    if (source->header.dict_ptr) {
+        error_pass(copy_dictionary(source, target));
+    }
+    target->header.id_sizing = source->header.id_sizing;
+    target->header.seq_sizing = source->header.seq_sizing;
+    if (source->header.expiry_index &&
+        target->header.disk_version >= COUCH_DISK_VERSION_EXPIRY_INDEX) {
+        // Its entries are added along with the items copied.
+        target->header.expiry_index = 1;
+        target->header.expiry_offset = source->header.expiry_offset;
+    }
+    if (source->header.vlog_ptr) {
+        // Shared with the target, or copied into the next log as it goes.
+        error_pass(db_value_log_start_target(source, target));
+    }
+cleanup:
+    return errcode;
+}
+
+// The settings of the source's handle that the target's takes on, which
+// unlike the header's aren't kept in the file.
+static void inherit_file_settings(Db *source, Db *target)
+{
+    target->file.doc_codec = source->file.doc_codec;
+    target->file.node_codec = source->file.node_codec;
+    target->body_segment_size = source->body_segment_size;
+    // The new file is written in one long append, where reserving its
+    // space ahead pays off most.
+    tree_file_set_preallocation(&target->file, source->file.prealloc_chunk);
+}
+
+// Whether bodies can be copied as they are on disk, header and all, with
+// neither their CRC checked nor a new one computed. Their lengths only
+// read the same if both files' chunks carry codec bits or neither's do,
+// and their CRCs only if both use the same one.
+static int copy_bodies_verbatim(const tree_file *source, const tree_file *target)
+{
+    return source->chunk_codecs == target->chunk_codecs &&
+           source->crc32c == target->crc32c;
+}
+
+// The purge policy compacting a file at header is to go by, or NULL if
+// it can't drop anything: when none is set, or when the by-ID counts say
+// there isn't a tombstone in the file. The by-sequence reductions only
+// count entries, so there's no telling which of its subtrees hold any.
+static const couchstore_purge_policy *active_purge_policy(const couchstore_purge_policy *policy,
+                                                          const db_header *header)
+{
+    if (policy->max_seq == 0 && policy->before_time == 0) {
+        return NULL;
+    }
+    const node_pointer *root = header->by_id_root;
+    if (root && root->reduce_value.size >= sizeof(raw_by_id_reduce)) {
+        const raw_by_id_reduce *reduce = (const raw_by_id_reduce*)root->reduce_value.buf;
+        if (decode_raw40(reduce->deleted) == 0) {
+            return NULL;
+        }
+    }
+    return policy;
+}
+
 couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filename,
                                             couchstore_compact_flags flags,
                                             couchstore_compact_hook hook,
@@ -37,42 +169,80 @@ couchstore_error_t couchstore_compact_db_ex(Db* source, const char* target_filen
 {
     Db* target = NULL;
     couchstore_error_t errcode;
-    compact_ctx ctx = {NULL, new_arena(0), new_arena(0), NULL, NULL, hook, hook_ctx, 0};
+    io_throttle throttle;
+    compact_progress progress;
+    expiry_builder expiry;
+    compact_ctx ctx = {NULL, new_huge_page_arena(), new_huge_page_arena(), NULL, NULL, hook,
+                       hook_ctx, 0, NULL, NULL, 0, &throttle, &progress, NULL, source};
     ctx.flags = flags;
+    ctx.purge = active_purge_policy(&source->purge_policy, &source->header);
+    io_throttle_start(&throttle, NULL, NULL, NULL);
     error_unless(!source->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
     error_unless(ctx.transient_arena && ctx.persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    error_pass(couchstore_open_db_ex(target_filename, COUCHSTORE_OPEN_FLAG_CREATE, ops, &target));
+    error_pass(couchstore_open_db_ex(target_filename, target_open_flags(source), ops, &target));
 
     ctx.target = target;
-    target->file.pos = 1;
-    target->header.update_seq = source->header.update_seq;
-    if (flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES) {
-        //Count the number of times purge has happened
-        target->header.purge_seq = source->header.purge_seq + 1;
-    } else {
-        target->header.purge_seq = source->header.purge_seq;
-    }
-    target->header.purge_ptr = source->header.purge_ptr;
+    error_pass(start_target(source, target, flags));
+    inherit_file_settings(source, target);
+    compact_progress_start(&progress, source, source, &target->file);
+    compact_progress_arena(&progress, ctx.transient_arena);
+    compact_progress_arena(&progress, ctx.persistent_arena);
+    // Before the body reader starts, whose threads take on the I/O priority.
+    io_throttle_start(&throttle, &source->compaction_throttle, &target->file, &progress);
 
     if (source->header.by_seq_root) {
+        error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_SEQ_COPY));
+        if (source->compaction_threads > 0) {
+            ctx.verbatim = copy_bodies_verbatim(&source->file, &target->file);
+            error_pass(body_reader_create(&source->file, ops, source->compaction_threads,
+                                          ctx.verbatim, &ctx.reader));
+        }
         error_pass(TreeWriterOpen(NULL, ebin_cmp, by_id_reduce, by_id_rereduce, NULL, &ctx.tree_writer));
+        if (target->header.expiry_index) {
+            ctx.expiry = &expiry;
+            error_pass(expiry_builder_open(&expiry, target->header.expiry_offset));
+        }
+        TreeWriterSetThrottle(ctx.tree_writer, &throttle);
+        TreeWriterSetSort(ctx.tree_writer, source->compaction_sort_memory,
+                          source->compaction_threads);
         error_pass(compact_seq_tree(source, target, &ctx));
-        error_pass(TreeWriterSort(ctx.tree_writer));
-        error_pass(TreeWriterWrite(ctx.tree_writer, &target->file, &target->header.by_id_root));
+        error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_ID_SORT));
+        errcode = TreeWriterSort(ctx.tree_writer);
+        // The sort can only say a record wasn't written:
+        error_pass(throttle.error);
+        error_pass(errcode);
+        int kv_threshold, kp_threshold;
+        tree_sizing_thresholds(&target->header.id_sizing, &kv_threshold, &kp_threshold);
+        error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_ID_WRITE));
+        error_pass(TreeWriterWrite(ctx.tree_writer, &target->file, kv_threshold, kp_threshold,
+                                   &target->header.by_id_root));
         TreeWriterFree(ctx.tree_writer);
         ctx.tree_writer = NULL;
+        if (ctx.expiry) {
+            error_pass(expiry_builder_finish(ctx.expiry, target));
+        }
     }
+    // Saves still in the source's delta buffer go into the new trees.
+    error_pass(db_delta_copy(target, source));
+    error_pass(db_fold_delta(target));
 
     if (source->header.local_docs_root) {
+        error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_LOCAL_DOCS));
         error_pass(compact_localdocs_tree(source, target, &ctx));
     }
     if(ctx.hook != NULL) {
         error_pass(static_cast<couchstore_error_t>(ctx.hook(ctx.target, NULL, ctx.hook_ctx)));
     }
     error_pass(couchstore_commit(target));
+    error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_DONE));
 cleanup:
+    body_reader_destroy(ctx.reader);
+    io_throttle_finish(&throttle);
     TreeWriterFree(ctx.tree_writer);
+    if (ctx.expiry) {
+        expiry_builder_free(ctx.expiry);
+    }
     delete_arena(ctx.transient_arena);
     delete_arena(ctx.persistent_arena);
     couchstore_close_db(target);
@@ -87,112 +257,290 @@ couchstore_error_t couchstore_compact_db(Db* source, const char* target_filename
     return couchstore_compact_db_ex(source, target_filename, 0, NULL, NULL, couchstore_get_default_file_ops());
 }
 
-static couchstore_error_t output_seqtree_item(const sized_buf *k,
-                                              const sized_buf *v,
-                                              compact_ctx *ctx)
+// Builds the by-ID entry of a by-sequence one, pointing into v for the ID
+// and allocating the value from a.
+static couchstore_error_t id_entry_for(arena *a, const sized_buf *k, const sized_buf *v,
+                                       sized_buf *id_k, sized_buf *id_v)
 {
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    sized_buf *v_c;
     const raw_seq_index_value* rawSeq;
     uint32_t idsize, datasize;
     uint32_t revMetaSize;
-    sized_buf id_k, id_v;
     raw_id_index_value *raw;
-    sized_buf *k_c = arena_copy_buf(ctx->transient_arena, k);
-
-    if (k_c == NULL) {
-        error_pass(COUCHSTORE_ERROR_READ);
-    }
-    v_c = arena_copy_buf(ctx->transient_arena, v);
-    if (v_c == NULL) {
-        error_pass(COUCHSTORE_ERROR_READ);
-    }
 
-    error_pass(mr_push_item(k_c, v_c, ctx->target_mr));
-    
     // Decode the by-sequence index value. See the file format doc or
     // assemble_id_index_value in couch_db.c:
     rawSeq = (const raw_seq_index_value*)v->buf;
     decode_kv_length(&rawSeq->sizes, &idsize, &datasize);
     revMetaSize = (uint32_t)v->size - (sizeof(raw_seq_index_value) + idsize);
-    
+
     // Set up sized_bufs for the ID tree key and value:
-    id_k.buf = (char*)(rawSeq + 1);
-    id_k.size = idsize;
-    id_v.size = sizeof(raw_id_index_value) + revMetaSize;
-    id_v.buf = static_cast<char*>(arena_alloc(ctx->transient_arena, id_v.size));
+    id_k->buf = (char*)(rawSeq + 1);
+    id_k->size = idsize;
+    id_v->size = sizeof(raw_id_index_value) + revMetaSize;
+    id_v->buf = static_cast<char*>(arena_alloc(a, id_v->size));
+    if (id_v->buf == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
 
-    raw = (raw_id_index_value*)id_v.buf;
+    raw = (raw_id_index_value*)id_v->buf;
     raw->db_seq = *(raw_48*)k->buf;  //Copy db seq from seq tree key
     raw->size = encode_raw32(datasize);
     raw->bp = rawSeq->bp;
     raw->content_meta = rawSeq->content_meta;
     raw->rev_seq = rawSeq->rev_seq;
     memcpy(raw + 1, (uint8_t*)(rawSeq + 1) + idsize, revMetaSize); //Copy rev_meta
+    return COUCHSTORE_SUCCESS;
+}
 
-    error_pass(TreeWriterAddItem(ctx->tree_writer, id_k, id_v));
-
-    if (ctx->target_mr->count == 0) {
-        /* No items queued, we must have just flushed. We can safely rewind the transient arena. */
-        arena_free_all(ctx->transient_arena);
+// Whether a tombstone in the source's by-sequence tree is one the purge
+// policy drops.
+static int purge_tombstone(const couchstore_purge_policy *policy,
+                           const sized_buf *k,
+                           const sized_buf *v)
+{
+    if (policy->max_seq && decode_raw48(*(raw_48*)k->buf) <= policy->max_seq) {
+        return 1;
     }
-
-cleanup:
-    return errcode;
+    if (policy->before_time) {
+        const raw_seq_index_value* rawSeq = (const raw_seq_index_value*)v->buf;
+        uint32_t idsize, datasize;
+        decode_kv_length(&rawSeq->sizes, &idsize, &datasize);
+        size_t offset = sizeof(raw_seq_index_value) + idsize + policy->time_offset;
+        if (v->size >= offset + sizeof(raw_32)) {
+            raw_32 deleted;
+            memcpy(&deleted, v->buf + offset, sizeof(deleted));
+            return decode_raw32(deleted) < policy->before_time;
+        }
+    }
+    return 0;
 }
 
-static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq,
-                                              const sized_buf *k,
-                                              const sized_buf *v)
+// Whether an item of the source's by-sequence tree goes into the target,
+// as the purge policy, the hook or the flags decide.
+static couchstore_error_t keep_seq_item(Db *target,
+                                        const couchstore_purge_policy *purge,
+                                        couchstore_compact_hook hook,
+                                        void *hook_ctx,
+                                        couchstore_compact_flags flags,
+                                        const sized_buf *k,
+                                        const sized_buf *v,
+                                        int *keep)
 {
     DocInfo* info = NULL;
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    compact_ctx *ctx = (compact_ctx *) rq->callback_ctx;
-    raw_seq_index_value* rawSeq = (raw_seq_index_value*)v->buf;
+    const raw_seq_index_value* rawSeq = (const raw_seq_index_value*)v->buf;
     uint64_t bpWithDeleted = decode_raw48(rawSeq->bp);
-    uint64_t bp = bpWithDeleted & ~BP_DELETED_FLAG;
+    *keep = 1;
+    if ((bpWithDeleted & BP_DELETED_FLAG) && purge && purge_tombstone(purge, k, v)) {
+        uint64_t seq = decode_raw48(*(raw_48*)k->buf);
+        if (seq > target->header.purge_seq) {
+            target->header.purge_seq = seq;
+        }
+        *keep = 0;
+        return COUCHSTORE_SUCCESS;
+    }
     if ((bpWithDeleted & BP_DELETED_FLAG) &&
-       (ctx->hook == NULL) &&
-       (ctx->flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES)) {
+       (hook == NULL) &&
+       (flags & COUCHSTORE_COMPACT_FLAG_DROP_DELETES)) {
+        *keep = 0;
         return COUCHSTORE_SUCCESS;
     }
 
-    if(ctx->hook) {
+    if(hook) {
         error_pass(by_seq_read_docinfo(&info, k, v));
-        int hook_action = ctx->hook(ctx->target, info, ctx->hook_ctx);
+        int hook_action = hook(target, info, hook_ctx);
         switch(hook_action) {
             case COUCHSTORE_COMPACT_KEEP_ITEM:
                 break;
             case COUCHSTORE_COMPACT_DROP_ITEM:
-                goto cleanup;
+                *keep = 0;
+                break;
             default:
                 error_pass(static_cast<couchstore_error_t>(hook_action));
         }
     }
+cleanup:
+    couchstore_free_docinfo(info);
+    return errcode;
+}
 
-    if (bp != 0) {
-        cs_off_t new_bp = 0;
-        // Copy the document from the old db file to the new one:
-        size_t new_size = 0;
-        sized_buf item;
-        item.buf = NULL;
+// Appends a body read from the old db file to the new one, and points the
+// by-sequence value at the copy. A verbatim body is a whole chunk from
+// pread_raw_chunk, and codec is unused.
+static couchstore_error_t store_body(tree_file *target, const sized_buf *item,
+                                     int verbatim, unsigned codec,
+                                     raw_seq_index_value *rawSeq)
+{
+    uint64_t bpWithDeleted = decode_raw48(rawSeq->bp);
+    cs_off_t new_bp = 0;
+    size_t new_size = 0;
+    int written;
 
-        int itemsize = pread_bin(rq->file, bp, &item.buf);
-        if (itemsize < 0) {
-	    return static_cast<couchstore_error_t>(itemsize);
-        }
-        item.size = itemsize;
+    if (verbatim) {
+        written = db_write_raw_chunk(target, item, &new_bp, &new_size);
+    } else {
+        written = db_write_chunk(target, item, codec, &new_bp, &new_size);
+    }
+    if (written < 0) {
+        return static_cast<couchstore_error_t>(written);
+    }
 
-        db_write_buf(ctx->target_mr->rq->file, &item, &new_bp, &new_size);
+    bpWithDeleted = (bpWithDeleted & BP_DELETED_FLAG) | new_bp;  //Preserve high bit
+    rawSeq->bp = encode_raw48(bpWithDeleted);
+    return COUCHSTORE_SUCCESS;
+}
 
-        bpWithDeleted = (bpWithDeleted & BP_DELETED_FLAG) | new_bp;  //Preserve high bit
-        rawSeq->bp = encode_raw48(bpWithDeleted);
-        free(item.buf);
+// Copies the body a by-sequence value points to, if it has one, from the
+// old db file to the new one, and points the value at the copy.
+static couchstore_error_t copy_body(tree_file *source, tree_file *target,
+                                    raw_seq_index_value *rawSeq)
+{
+    uint64_t bp = decode_raw48(rawSeq->bp) & ~BP_DELETED_FLAG;
+    if (bp == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    int verbatim = copy_bodies_verbatim(source, target);
+    sized_buf item;
+    item.buf = NULL;
+    unsigned codec = 0;
+    int itemsize;
+
+    if (verbatim) {
+        itemsize = pread_raw_chunk(source, bp, &item.buf);
+    } else {
+        itemsize = pread_chunk(source, bp, &item.buf, &codec);
+    }
+    if (itemsize < 0) {
+        return static_cast<couchstore_error_t>(itemsize);
+    }
+    item.size = itemsize;
+
+    couchstore_error_t errcode = store_body(target, &item, verbatim, codec, rawSeq);
+    cs_free(item.buf);
+    return errcode;
+}
+
+// Whether a by-sequence value's body is written in segments.
+static int segmented_body(const Db *source, uint64_t bp)
+{
+    return source->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES &&
+           (bp & BP_SEGMENTED_FLAG);
+}
+
+// Copies the body of a kept by-sequence value as copy_body does, or as the
+// value log or the segments' index does if it's there.
+static couchstore_error_t copy_item_body(Db *source, Db *target,
+                                         raw_seq_index_value *rawSeq)
+{
+    if (source->header.vlog_ptr && (decode_raw48(rawSeq->bp) & BP_VALUE_LOG_FLAG)) {
+        return db_value_log_copy(source, target, rawSeq);
+    }
+    if (segmented_body(source, decode_raw48(rawSeq->bp))) {
+        return db_copy_segmented(&source->file, &target->file, rawSeq);
+    }
+    return copy_body(&source->file, &target->file, rawSeq);
+}
+
+static couchstore_error_t output_seqtree_item(const sized_buf *k,
+                                              const sized_buf *v,
+                                              compact_ctx *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf *v_c;
+    sized_buf id_k, id_v;
+    sized_buf *k_c = arena_copy_buf(ctx->transient_arena, k);
+
+    if (k_c == NULL) {
+        error_pass(COUCHSTORE_ERROR_READ);
+    }
+    v_c = arena_copy_buf(ctx->transient_arena, v);
+    if (v_c == NULL) {
+        error_pass(COUCHSTORE_ERROR_READ);
+    }
+
+    error_pass(mr_push_item(k_c, v_c, ctx->target_mr));
+    error_pass(id_entry_for(ctx->transient_arena, k, v, &id_k, &id_v));
+
+    error_pass(TreeWriterAddItem(ctx->tree_writer, id_k, id_v));
+    if (ctx->expiry) {
+        error_pass(expiry_builder_add(ctx->expiry, k, v));
+    }
+    if (ctx->target->bloom) {
+        bloom_add(ctx->target->bloom, &id_k);
+    }
+
+    if (ctx->target_mr->count == 0) {
+        /* No items queued, we must have just flushed. We can safely rewind the transient arena. */
+        arena_free_all(ctx->transient_arena);
+    }
+    if (ctx->progress) {
+        compact_progress_item(ctx->progress);
+    }
+    if (ctx->throttle) {
+        error_pass(io_throttle_progress(ctx->throttle));
     }
 
-    error_pass(output_seqtree_item(k, v, ctx));
 cleanup:
-    couchstore_free_docinfo(info);
+    return errcode;
+}
+
+// Writes out the oldest item queued on the body reader, in the order the
+// items were kept, so the target is the same as when copying each in turn.
+static couchstore_error_t output_read_item(compact_ctx *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    read_body item;
+    error_pass(body_reader_take(ctx->reader, &item));
+
+    raw_seq_index_value *rawSeq;
+    rawSeq = (raw_seq_index_value*)item.value.buf;
+    if (ctx->progress) {
+        // Read on the reader's own handles, which the source's stats miss
+        compact_progress_read(ctx->progress, item.body.size);
+    }
+    if (ctx->source->header.vlog_ptr && (decode_raw48(rawSeq->bp) & BP_VALUE_LOG_FLAG)) {
+        errcode = db_value_log_copy(ctx->source, ctx->target, rawSeq);
+    } else if (segmented_body(ctx->source, decode_raw48(rawSeq->bp))) {
+        errcode = db_copy_segmented(&ctx->source->file, ctx->target_mr->rq->file, rawSeq);
+    } else if (decode_raw48(rawSeq->bp) & ~BP_DELETED_FLAG) {
+        errcode = store_body(ctx->target_mr->rq->file, &item.body, ctx->verbatim,
+                             item.codec, rawSeq);
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = output_seqtree_item(&item.key, &item.value, ctx);
+    }
+    body_reader_release(&item);
+cleanup:
+    return errcode;
+}
+
+static couchstore_error_t compact_seq_fetchcb(couchfile_lookup_request *rq,
+                                              const sized_buf *k,
+                                              const sized_buf *v)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    compact_ctx *ctx = (compact_ctx *) rq->callback_ctx;
+    int keep;
+
+    error_pass(keep_seq_item(ctx->target, ctx->purge, ctx->hook, ctx->hook_ctx, ctx->flags,
+                             k, v, &keep));
+    if (keep && ctx->reader) {
+        if (body_reader_full(ctx->reader)) {
+            error_pass(output_read_item(ctx));
+        }
+        const raw_seq_index_value *rawSeq = (const raw_seq_index_value*)v->buf;
+        uint64_t bp = decode_raw48(rawSeq->bp) & ~BP_DELETED_FLAG;
+        if ((ctx->source->header.vlog_ptr && (bp & BP_VALUE_LOG_FLAG)) ||
+            segmented_body(ctx->source, bp)) {
+            // Nothing to read ahead in one piece; see output_read_item.
+            bp = 0;
+        }
+        error_pass(body_reader_add(ctx->reader, k, v, bp));
+    } else if (keep) {
+        error_pass(copy_item_body(ctx->source, ctx->target, (raw_seq_index_value*)v->buf));
+        error_pass(output_seqtree_item(k, v, ctx));
+    }
+cleanup:
     return errcode;
 }
 
@@ -208,9 +556,15 @@ static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *
     low_key.size = 6;
     sized_buf *low_key_list = &low_key;
 
+    int kv_threshold, kp_threshold;
+    tree_sizing_thresholds(&target->header.seq_sizing, &kv_threshold, &kp_threshold);
+    int seq_deletes = target->header.disk_version >= COUCH_DISK_VERSION_SEQ_DELETES;
     ctx->target_mr = new_btree_modres(ctx->persistent_arena, ctx->transient_arena, &target->file,
-                                      &seqcmp, by_seq_reduce, by_seq_rereduce, NULL,
-                                      DB_CHUNK_THRESHOLD, DB_CHUNK_THRESHOLD);
+                                      &seqcmp,
+                                      seq_deletes ? by_seq_deletes_reduce : by_seq_reduce,
+                                      seq_deletes ? by_seq_deletes_rereduce : by_seq_rereduce,
+                                      NULL,
+                                      kv_threshold, kp_threshold);
     if (ctx->target_mr == NULL) {
         error_pass(COUCHSTORE_ERROR_ALLOC_FAIL);
     }
@@ -226,6 +580,9 @@ static couchstore_error_t compact_seq_tree(Db* source, Db* target, compact_ctx *
     srcfold.node_callback = NULL;
 
     errcode = btree_lookup(&srcfold, source->header.by_seq_root->pointer);
+    while (errcode == COUCHSTORE_SUCCESS && ctx->reader && body_reader_pending(ctx->reader)) {
+        errcode = output_read_item(ctx);
+    }
     if (errcode == COUCHSTORE_SUCCESS) {
         target->header.by_seq_root = complete_new_btree(ctx->target_mr, &errcode);
     }
@@ -246,6 +603,12 @@ static couchstore_error_t compact_localdocs_fetchcb(couchfile_lookup_request *rq
 			ctx->target_mr);
 }
 
+// Nothing is dropped from the local docs, so every leaf can be copied.
+static int compact_localdocs_unchangedcb(couchfile_lookup_request *, const node_pointer *)
+{
+    return 1;
+}
+
 static couchstore_error_t compact_localdocs_tree(Db* source, Db* target, compact_ctx *ctx)
 {
     couchstore_error_t errcode;
@@ -275,7 +638,8 @@ static couchstore_error_t compact_localdocs_tree(Db* source, Db* target, compact
     srcfold.fetch_callback = compact_localdocs_fetchcb;
     srcfold.node_callback = NULL;
 
-    errcode = btree_lookup(&srcfold, source->header.local_docs_root->pointer);
+    errcode = btree_copy_leaves(&srcfold, source->header.local_docs_root->pointer,
+                                ctx->target_mr, compact_localdocs_unchangedcb);
     if (errcode == COUCHSTORE_SUCCESS) {
         target->header.local_docs_root = complete_new_btree(ctx->target_mr, &errcode);
     }
@@ -284,6 +648,390 @@ cleanup:
     return errcode;
 }
 
+// Entries resumable compaction and catch-up gather before adding them to
+// the trees of the target, where each batch rewrites the nodes it lands in.
+#define COPY_BATCH_DOCS 16384
+
+typedef struct {
+    Db *target;
+    Db *source;                 /* of the entries being copied */
+    couchstore_compact_hook hook;
+    void *hook_ctx;
+    couchstore_compact_flags flags;
+    const couchstore_purge_policy *purge;   /* or NULL */
+    /* The source header being compacted, for the checkpoints */
+    uint64_t source_header;
+    uint64_t source_seq;
+    /* Entries not yet in the target's trees, and the memory they're in */
+    sized_buf *seqs, *seqvals, *ids, *idvals;
+    unsigned count;
+    arena *batch_arena;
+    uint64_t copied_seq;        /* highest source sequence dealt with */
+    uint64_t checkpoint_docs;
+    uint64_t since_checkpoint;
+    uint64_t max_docs;
+    uint64_t examined;          /* by this call */
+    int slice_full;
+    couchstore_save_options add_options;
+    io_throttle *throttle;      /* or NULL */
+    compact_progress *progress; /* or NULL */
+} copy_ctx;
+
+static couchstore_error_t flush_copy_batch(copy_ctx *ctx)
+{
+    couchstore_error_t errcode = db_add_entries(ctx->target, ctx->seqs, ctx->seqvals,
+                                                ctx->ids, ctx->idvals, ctx->count,
+                                                ctx->add_options);
+    ctx->count = 0;
+    arena_free_all(ctx->batch_arena);
+    return errcode;
+}
+
+// Adds what's been copied to the trees and commits the target, along with
+// where to carry on from.
+static couchstore_error_t write_checkpoint(copy_ctx *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    raw_compact_checkpoint raw;
+    sized_buf buf = { (char *)&raw, sizeof(raw) };
+    cs_off_t pos;
+
+    error_pass(flush_copy_batch(ctx));
+    raw.source_header = encode_raw48(ctx->source_header);
+    raw.source_seq = encode_raw48(ctx->source_seq);
+    raw.copied_seq = encode_raw48(ctx->copied_seq);
+    raw.flags = encode_raw32((uint32_t)ctx->flags);
+    error_pass(static_cast<couchstore_error_t>(db_write_buf(&ctx->target->file, &buf,
+                                                            &pos, NULL)));
+    ctx->target->header.compact_ptr = pos;
+    error_pass(couchstore_commit(ctx->target));
+    ctx->since_checkpoint = 0;
+cleanup:
+    return errcode;
+}
+
+// Copies a by-sequence entry of the source and its body into the batch.
+static couchstore_error_t copy_seq_item(copy_ctx *ctx, Db *source,
+                                        const sized_buf *k, const sized_buf *v)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    int keep;
+
+    error_pass(keep_seq_item(ctx->target, ctx->purge, ctx->hook, ctx->hook_ctx, ctx->flags,
+                             k, v, &keep));
+    if (keep) {
+        sized_buf *k_c = arena_copy_buf(ctx->batch_arena, k);
+        sized_buf *v_c = arena_copy_buf(ctx->batch_arena, v);
+        error_unless(k_c && v_c, COUCHSTORE_ERROR_ALLOC_FAIL);
+        error_pass(copy_item_body(source, ctx->target, (raw_seq_index_value*)v_c->buf));
+        if (ctx->progress) {
+            compact_progress_item(ctx->progress);
+        }
+        if (ctx->throttle) {
+            error_pass(io_throttle_progress(ctx->throttle));
+        }
+        ctx->seqs[ctx->count] = *k_c;
+        ctx->seqvals[ctx->count] = *v_c;
+        error_pass(id_entry_for(ctx->batch_arena, k_c, v_c,
+                                &ctx->ids[ctx->count], &ctx->idvals[ctx->count]));
+        ctx->count++;
+    }
+    ctx->copied_seq = decode_raw48(*(raw_48*)k->buf);
+    ctx->examined++;
+    ctx->since_checkpoint++;
+
+    if (ctx->checkpoint_docs && ctx->since_checkpoint == ctx->checkpoint_docs) {
+        error_pass(write_checkpoint(ctx));
+    } else if (ctx->count == COPY_BATCH_DOCS) {
+        error_pass(flush_copy_batch(ctx));
+    }
+cleanup:
+    return errcode;
+}
+
+static couchstore_error_t copy_seq_fetchcb(couchfile_lookup_request *rq,
+                                           const sized_buf *k,
+                                           const sized_buf *v)
+{
+    copy_ctx *ctx = (copy_ctx *) rq->callback_ctx;
+    if (ctx->max_docs && ctx->examined == ctx->max_docs) {
+        ctx->slice_full = 1;
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    return copy_seq_item(ctx, ctx->source, k, v);
+}
+
+// Goes through the source's by-sequence tree past the given sequence.
+static couchstore_error_t copy_seqs_after(copy_ctx *ctx, Db *source, uint64_t seq)
+{
+    couchfile_lookup_request srcfold;
+    raw_48 start = encode_raw48(seq + 1);
+    sized_buf start_key = { (char *)&start, sizeof(start) };
+    sized_buf *start_list = &start_key;
+
+    ctx->source = source;
+    if (source->header.by_seq_root == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    srcfold.cmp.compare = seq_cmp;
+    srcfold.file = &source->file;
+    srcfold.num_keys = 1;
+    srcfold.keys = &start_list;
+    srcfold.fold = 1;
+    srcfold.in_fold = 1;
+    srcfold.callback_ctx = ctx;
+    srcfold.fetch_callback = copy_seq_fetchcb;
+    srcfold.node_callback = NULL;
+    return btree_lookup(&srcfold, source->header.by_seq_root->pointer);
+}
+
+static couchstore_error_t copy_ctx_open(copy_ctx *ctx, Db *target)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->target = target;
+    ctx->batch_arena = new_arena(0);
+    ctx->seqs = static_cast<sized_buf*>(cs_malloc(4 * COPY_BATCH_DOCS * sizeof(sized_buf)));
+    if (ctx->batch_arena == NULL || ctx->seqs == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    ctx->seqvals = ctx->seqs + COPY_BATCH_DOCS;
+    ctx->ids = ctx->seqvals + COPY_BATCH_DOCS;
+    ctx->idvals = ctx->ids + COPY_BATCH_DOCS;
+    return COUCHSTORE_SUCCESS;
+}
+
+static void copy_ctx_close(copy_ctx *ctx)
+{
+    cs_free(ctx->seqs);
+    if (ctx->batch_arena) {
+        delete_arena(ctx->batch_arena);
+    }
+}
+
+// Opens the target of a resumable compaction where its last checkpoint left
+// off, along with the snapshot of the source it was compacting, which is
+// source itself unless that's been updated since. Failing that, creates
+// the target afresh to compact source into.
+static couchstore_error_t open_resumable_target(Db *source,
+                                                const char *target_filename,
+                                                couchstore_compact_flags flags,
+                                                const couch_file_ops *ops,
+                                                Db **pTarget,
+                                                Db **pSnapshot,
+                                                uint64_t *copied_seq)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *target = NULL, *snapshot = NULL;
+    char *buf = NULL;
+
+    if (couchstore_open_db_ex(target_filename, 0, ops, &target) == COUCHSTORE_SUCCESS &&
+        target->header.compact_ptr != 0) {
+        int size = pread_bin(&target->file, target->header.compact_ptr, &buf);
+        const raw_compact_checkpoint *raw = (const raw_compact_checkpoint *)buf;
+        if (size == (int)sizeof(*raw) && decode_raw32(raw->flags) == (uint32_t)flags) {
+            uint64_t pos = decode_raw48(raw->source_header);
+            uint64_t seq = decode_raw48(raw->source_seq);
+            if (source->header.position == pos && source->header.update_seq == seq) {
+                snapshot = source;
+            } else if (db_open_at_header(source->file.path, ops, pos,
+                                         &snapshot) == COUCHSTORE_SUCCESS &&
+                       snapshot->header.update_seq != seq) {
+                couchstore_close_db(snapshot);
+                snapshot = NULL;
+            }
+            *copied_seq = decode_raw48(raw->copied_seq);
+        }
+    }
+    cs_free(buf);
+    if (snapshot == NULL) {
+        // Nothing to resume, or the source file it was from is gone.
+        if (target != NULL) {
+            couchstore_close_db(target);
+            target = NULL;
+        }
+        remove(target_filename);
+        error_pass(couchstore_open_db_ex(target_filename, target_open_flags(source),
+                                         ops, &target));
+        error_pass(start_target(source, target, flags));
+        snapshot = source;
+        *copied_seq = 0;
+    }
+    inherit_file_settings(snapshot, target);
+    *pTarget = target;
+    *pSnapshot = snapshot;
+    target = NULL;
+cleanup:
+    if (target != NULL) {
+        couchstore_close_db(target);
+    }
+    return errcode;
+}
+
+couchstore_error_t couchstore_compact_db_resumable(Db* source, const char* target_filename,
+                                                   couchstore_compact_flags flags,
+                                                   couchstore_compact_hook hook,
+                                                   void* hook_ctx,
+                                                   const couch_file_ops *ops,
+                                                   uint64_t checkpoint_docs,
+                                                   uint64_t max_docs,
+                                                   int *pDone)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *target = NULL, *snapshot = NULL;
+    compact_ctx local_ctx = {NULL, NULL, new_arena(0), NULL, NULL, hook, hook_ctx, 0, NULL, NULL,
+                             0, NULL, NULL, NULL, NULL};
+    uint64_t copied_seq = 0;
+    copy_ctx ctx;
+    io_throttle throttle;
+    compact_progress progress;
+    *pDone = 0;
+    local_ctx.flags = flags;
+    io_throttle_start(&throttle, NULL, NULL, NULL);
+    errcode = copy_ctx_open(&ctx, NULL);
+    error_unless(!source->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(local_ctx.persistent_arena && errcode == COUCHSTORE_SUCCESS,
+                 COUCHSTORE_ERROR_ALLOC_FAIL);
+
+    error_pass(open_resumable_target(source, target_filename, flags, ops,
+                                     &target, &snapshot, &copied_seq));
+    compact_progress_start(&progress, source, snapshot, &target->file);
+    compact_progress_arena(&progress, local_ctx.persistent_arena);
+    compact_progress_arena(&progress, ctx.batch_arena);
+    io_throttle_start(&throttle, &source->compaction_throttle, &target->file, &progress);
+    ctx.throttle = &throttle;
+    ctx.progress = &progress;
+    ctx.target = target;
+    ctx.hook = hook;
+    ctx.hook_ctx = hook_ctx;
+    ctx.flags = flags;
+    ctx.purge = active_purge_policy(&source->purge_policy, &snapshot->header);
+    ctx.source_header = snapshot->header.position;
+    ctx.source_seq = snapshot->header.update_seq;
+    ctx.copied_seq = copied_seq;
+    ctx.checkpoint_docs = checkpoint_docs;
+    ctx.max_docs = max_docs;
+    // The trees hold none of the IDs still to come.
+    ctx.add_options = COUCHSTORE_SAVE_BLIND_INSERT;
+
+    error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_SEQ_COPY));
+    errcode = copy_seqs_after(&ctx, snapshot, copied_seq);
+    if (errcode == COUCHSTORE_ERROR_CANCEL && ctx.slice_full) {
+        // Out of time; a later call carries on from here.
+        error_pass(write_checkpoint(&ctx));
+        error_pass(compact_progress_report(&progress));
+        goto cleanup;
+    }
+    error_pass(errcode);
+    error_pass(flush_copy_batch(&ctx));
+
+    // Finished as couchstore_compact_db_ex does, and no longer resumable.
+    error_pass(db_delta_copy(target, snapshot));
+    error_pass(db_fold_delta(target));
+    if (snapshot->header.local_docs_root) {
+        local_ctx.target = target;
+        error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_LOCAL_DOCS));
+        error_pass(compact_localdocs_tree(snapshot, target, &local_ctx));
+    }
+    if (hook != NULL) {
+        error_pass(static_cast<couchstore_error_t>(hook(target, NULL, hook_ctx)));
+    }
+    target->header.compact_ptr = 0;
+    error_pass(couchstore_commit(target));
+    *pDone = 1;
+    error_pass(compact_progress_phase(&progress, COUCHSTORE_COMPACT_PHASE_DONE));
+cleanup:
+    io_throttle_finish(&throttle);
+    copy_ctx_close(&ctx);
+    if (local_ctx.persistent_arena) {
+        delete_arena(local_ctx.persistent_arena);
+    }
+    if (snapshot != NULL && snapshot != source) {
+        couchstore_close_db(snapshot);
+    }
+    if (target != NULL) {
+        couchstore_close_db(target);
+    }
+    return errcode;
+}
+
+// Replays what's been saved to source past the target's update_seq into
+// the target, and commits it.
+static couchstore_error_t catch_up_once(Db *source, Db *target, uint64_t *pReplayed)
+{
+    couchstore_error_t errcode;
+    compact_ctx local_ctx = {NULL, NULL, new_arena(0), NULL, NULL, NULL, NULL, 0, NULL, NULL, 0,
+                             NULL, NULL, NULL, NULL};
+    uint64_t since = target->header.update_seq;
+    copy_ctx ctx;
+    unsigned ii;
+
+    errcode = copy_ctx_open(&ctx, target);
+    error_unless(local_ctx.persistent_arena && errcode == COUCHSTORE_SUCCESS,
+                 COUCHSTORE_ERROR_ALLOC_FAIL);
+    error_unless(source->header.update_seq >= since, COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    arena_set_limit(local_ctx.persistent_arena, source->arena_limit);
+    arena_set_limit(ctx.batch_arena, source->arena_limit);
+
+    // The changes are copied as they are, deletions and all, and replace
+    // what the target has of the same documents.
+    error_pass(db_delta_fold_for_read(source));
+    error_pass(copy_seqs_after(&ctx, source, since));
+    error_pass(flush_copy_batch(&ctx));
+    // What a read-only handle couldn't fold goes in after the trees' own
+    // entries, which may be older saves of the same IDs.
+    if (source->delta != NULL) {
+        for (ii = 0; ii < source->delta->count; ii++) {
+            const delta_entry *entry = source->delta->entries[ii];
+            if (decode_raw48(*(raw_48*)entry->seq.buf) > since) {
+                error_pass(copy_seq_item(&ctx, source, &entry->seq, &entry->seq_value));
+            }
+        }
+        error_pass(flush_copy_batch(&ctx));
+    }
+
+    // Local documents have no sequences to go by, and are few; they're
+    // copied again.
+    cs_free(target->header.local_docs_root);
+    target->header.local_docs_root = NULL;
+    if (source->header.local_docs_root) {
+        local_ctx.target = target;
+        error_pass(compact_localdocs_tree(source, target, &local_ctx));
+    }
+    target->header.update_seq = source->header.update_seq;
+    error_pass(couchstore_commit(target));
+    *pReplayed = ctx.examined;
+cleanup:
+    copy_ctx_close(&ctx);
+    if (local_ctx.persistent_arena) {
+        delete_arena(local_ctx.persistent_arena);
+    }
+    return errcode;
+}
+
+couchstore_error_t couchstore_compact_catch_up(Db* source, Db* target,
+                                               uint64_t small_enough,
+                                               unsigned max_rounds,
+                                               uint64_t *pReplayed)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t replayed = 0;
+    unsigned round = 0;
+
+    error_unless(!source->dropped && !target->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(!target->readonly && target->header.compact_ptr == 0,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    do {
+        if (source->readonly) {
+            // Writers commit through handles of their own.
+            error_pass(db_refresh_header(source));
+        }
+        error_pass(catch_up_once(source, target, &replayed));
+    } while (replayed > small_enough && ++round < max_rounds);
+cleanup:
+    *pReplayed = replayed;
+    return errcode;
+}
+
 couchstore_error_t couchstore_set_purge_seq(Db* target, uint64_t purge_seq) {
     target->header.purge_seq = purge_seq;
     return COUCHSTORE_SUCCESS;
@@ -6,9 +6,9 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <libcouchstore/couch_db.h>
-#include <snappy-c.h>
 #include "bitfield.h"
 #include "internal.h"
+#include "tools.h"
 
 typedef enum {
     DumpBySequence,
@@ -17,6 +17,8 @@ typedef enum {
 
 static DumpMode mode = DumpBySequence;
 static bool dumpTree = false;
+static bool dumpJson = false;
+static bool dumpBodies = true;
 
 typedef struct {
     raw_64 cas;
@@ -24,100 +26,166 @@ typedef struct {
     raw_32 flags;
 } CouchbaseRevMeta;
 
-static void printsb(const sized_buf *sb)
+/* What a dump of one file prints to and counts */
+typedef struct {
+    FILE *out;
+    const char *file;
+    int count;
+} DumpCtx;
+
+static void printsb(FILE *out, const sized_buf *sb)
 {
     if (sb->buf == NULL) {
-        printf("null\n");
+        fprintf(out, "null\n");
         return;
     }
-    printf("%.*s\n", (int) sb->size, sb->buf);
+    fprintf(out, "%.*s\n", (int) sb->size, sb->buf);
 }
 
-static void printsbhex(const sized_buf *sb, int with_ascii)
+static void printsbhex(FILE *out, const sized_buf *sb, int with_ascii)
 {
     size_t i;
 
     if (sb->buf == NULL) {
-        printf("null\n");
+        fprintf(out, "null\n");
         return;
     }
-    printf("{");
+    fprintf(out, "{");
     for (i = 0; i < sb->size; ++i) {
-        printf("%.02x", (uint8_t)sb->buf[i]);
+        fprintf(out, "%.02x", (uint8_t)sb->buf[i]);
         if (i % 4 == 3) {
-            printf(" ");
+            fprintf(out, " ");
         }
     }
-    printf("}");
+    fprintf(out, "}");
     if (with_ascii) {
-        printf("  (\"");
+        fprintf(out, "  (\"");
         for (i = 0; i < sb->size; ++i) {
             uint8_t ch = sb->buf[i];
             if (ch < 32 || ch >= 127) {
                 ch = '?';
             }
-            printf("%c", ch);
+            fprintf(out, "%c", ch);
+        }
+        fprintf(out, "\")");
+    }
+    fprintf(out, "\n");
+}
+
+static void printjsonhex(FILE *out, const sized_buf *sb)
+{
+    size_t i;
+
+    fprintf(out, "\"");
+    for (i = 0; i < sb->size; ++i) {
+        fprintf(out, "%.02x", (uint8_t)sb->buf[i]);
+    }
+    fprintf(out, "\"");
+}
+
+/* Prints a document as one line of JSON */
+static int foldprintjson(Db *db, DocInfo *docinfo, DumpCtx *ctx)
+{
+    FILE *out = ctx->out;
+    Doc *doc = NULL;
+    couchstore_error_t docerr;
+
+    fprintf(out, "{\"file\": ");
+    print_json_string(out, ctx->file, strlen(ctx->file));
+    fprintf(out, ", \"seq\": %"PRIu64", \"id\": ", docinfo->db_seq);
+    print_json_string(out, docinfo->id.buf, docinfo->id.size);
+    if (docinfo->bp == 0 && docinfo->deleted == 0) {
+        fprintf(out, ", \"corrupt\": true, \"raw\": ");
+        printjsonhex(out, &docinfo->rev_meta);
+        fprintf(out, "}\n");
+        return 0;
+    }
+    fprintf(out, ", \"rev\": %"PRIu64", \"content_meta\": %d",
+            docinfo->rev_seq, docinfo->content_meta);
+    if (docinfo->rev_meta.size == sizeof(CouchbaseRevMeta)) {
+        const CouchbaseRevMeta* meta = (const CouchbaseRevMeta*)docinfo->rev_meta.buf;
+        fprintf(out, ", \"cas\": %"PRIu64", \"expiry\": %"PRIu32", \"flags\": %"PRIu32,
+                decode_raw64(meta->cas), decode_raw32(meta->expiry),
+                decode_raw32(meta->flags));
+    }
+    fprintf(out, ", \"deleted\": %s, \"size\": %"PRIu64,
+            docinfo->deleted ? "true" : "false", (uint64_t) docinfo->size);
+
+    if (dumpBodies) {
+        docerr = couchstore_open_doc_with_docinfo(db, docinfo, &doc, DECOMPRESS_DOC_BODIES);
+        if (docerr != COUCHSTORE_SUCCESS) {
+            fprintf(out, ", \"error\": ");
+            print_json_string(out, couchstore_strerror(docerr),
+                              strlen(couchstore_strerror(docerr)));
+        } else if (doc && doc->data.buf) {
+            fprintf(out, ", \"data\": ");
+            print_json_string(out, doc->data.buf, doc->data.size);
         }
-        printf("\")");
+        couchstore_free_document(doc);
     }
-    printf("\n");
+    fprintf(out, "}\n");
+    return 0;
 }
 
-static int foldprint(Db *db, DocInfo *docinfo, void *ctx)
+static int foldprint(Db *db, DocInfo *docinfo, void *vctx)
 {
-    int *count = (int *) ctx;
+    DumpCtx *ctx = (DumpCtx *) vctx;
+    FILE *out = ctx->out;
     Doc *doc = NULL;
     uint64_t cas;
     uint32_t expiry, flags;
     couchstore_error_t docerr;
-    (*count)++;
+    ctx->count++;
+
+    if (dumpJson) {
+        return foldprintjson(db, docinfo, ctx);
+    }
 
     if (mode == DumpBySequence) {
-        printf("Doc seq: %"PRIu64"\n", docinfo->db_seq);
-        printf("     id: ");
-        printsb(&docinfo->id);
+        fprintf(out, "Doc seq: %"PRIu64"\n", docinfo->db_seq);
+        fprintf(out, "     id: ");
+        printsb(out, &docinfo->id);
     } else {
-        printf(" Doc ID: ");
-        printsb(&docinfo->id);
+        fprintf(out, " Doc ID: ");
+        printsb(out, &docinfo->id);
         if (docinfo->db_seq > 0) {
-            printf("    seq: %"PRIu64"\n", docinfo->db_seq);
+            fprintf(out, "    seq: %"PRIu64"\n", docinfo->db_seq);
         }
     }
     if (docinfo->bp == 0 && docinfo->deleted == 0) {
-        printf("         ** This b-tree node is corrupt; raw node value follows:*\n");
-        printf("    raw: ");
-        printsbhex(&docinfo->rev_meta, 1);
+        fprintf(out, "         ** This b-tree node is corrupt; raw node value follows:*\n");
+        fprintf(out, "    raw: ");
+        printsbhex(out, &docinfo->rev_meta, 1);
         return 0;
     }
-    printf("     rev: %"PRIu64"\n", docinfo->rev_seq);
-    printf("     content_meta: %d\n", docinfo->content_meta);
+    fprintf(out, "     rev: %"PRIu64"\n", docinfo->rev_seq);
+    fprintf(out, "     content_meta: %d\n", docinfo->content_meta);
     if (docinfo->rev_meta.size == sizeof(CouchbaseRevMeta)) {
         const CouchbaseRevMeta* meta = (const CouchbaseRevMeta*)docinfo->rev_meta.buf;
         cas = decode_raw64(meta->cas);
         expiry = decode_raw32(meta->expiry);
         flags = decode_raw32(meta->flags);
-        printf("     cas: %"PRIu64", expiry: %"PRIu32", flags: %"PRIu32"\n", cas, expiry, flags);
+        fprintf(out, "     cas: %"PRIu64", expiry: %"PRIu32", flags: %"PRIu32"\n", cas, expiry, flags);
     }
     if (docinfo->deleted) {
-        printf("     doc deleted\n");
+        fprintf(out, "     doc deleted\n");
     }
 
-    docerr = couchstore_open_doc_with_docinfo(db, docinfo, &doc, 0);
+    if (!dumpBodies) {
+        fprintf(out, "     size: %"PRIu64"\n", (uint64_t) docinfo->size);
+        return 0;
+    }
+
+    // Decompressed by the library, whichever codec the body was written with
+    docerr = couchstore_open_doc_with_docinfo(db, docinfo, &doc, DECOMPRESS_DOC_BODIES);
     if(docerr != COUCHSTORE_SUCCESS) {
-        printf("     could not read document body: %s\n", couchstore_strerror(docerr));
+        fprintf(out, "     could not read document body: %s\n", couchstore_strerror(docerr));
     } else if (doc && (docinfo->content_meta & COUCH_DOC_IS_COMPRESSED)) {
-        size_t rlen;
-        char *decbuf;
-        size_t uncompr_len;
-
-        snappy_uncompressed_length(doc->data.buf, doc->data.size, &rlen);
-        decbuf = malloc(rlen);
-        snappy_uncompress(doc->data.buf, doc->data.size, decbuf, &uncompr_len);
-        printf("     data: (snappy) %.*s\n", (int) uncompr_len, decbuf);
-        free(decbuf);
+        fprintf(out, "     data: (compressed) ");
+        printsb(out, &doc->data);
     } else if(doc) {
-        printf("     data: ");
-        printsb(&doc->data);
+        fprintf(out, "     data: ");
+        printsb(out, &doc->data);
     }
 
     couchstore_free_document(doc);
@@ -130,43 +198,49 @@ static int visit_node(Db *db,
                       const DocInfo* docinfo,
                       uint64_t subtreeSize,
                       const sized_buf* reduceValue,
-                      void *ctx)
+                      void *vctx)
 {
+    DumpCtx *ctx = (DumpCtx *) vctx;
+    FILE *out = ctx->out;
     int i;
     (void) db;
 
     for (i = 0; i < depth; ++i)
-        printf("  ");
+        fprintf(out, "  ");
     if (reduceValue) {
         /* This is a tree node: */
-        printf("+ (%"PRIu64") ", subtreeSize);
-        printsbhex(reduceValue, 0);
+        fprintf(out, "+ (%"PRIu64") ", subtreeSize);
+        printsbhex(out, reduceValue, 0);
     } else if (docinfo->bp > 0) {
-        int *count;
         /* This is a document: */
-        printf("%c (%"PRIu64") ", (docinfo->deleted ? 'x' : '*'),
-               (uint64_t)docinfo->size);
+        fprintf(out, "%c (%"PRIu64") ", (docinfo->deleted ? 'x' : '*'),
+                (uint64_t)docinfo->size);
         if (mode == DumpBySequence) {
-            printf("#%"PRIu64" ", docinfo->db_seq);
+            fprintf(out, "#%"PRIu64" ", docinfo->db_seq);
         }
-        printsb(&docinfo->id);
+        printsb(out, &docinfo->id);
 
-        count = (int *) ctx;
-        (*count)++;
+        ctx->count++;
     } else {
         /* Document, but not in a known format: */
-        printf("**corrupt?** ");
-        printsbhex(&docinfo->rev_meta, 1);
+        fprintf(out, "**corrupt?** ");
+        printsbhex(out, &docinfo->rev_meta, 1);
     }
     return 0;
 }
 
 
-static int process_file(const char *file, int *total)
+static int process_file(const char *file, int index, FILE *out, void *vctx)
 {
+    int *counts = (int *) vctx;
     Db *db;
     couchstore_error_t errcode;
-    int count = 0;
+    couchstore_buffer_options buffers;
+    DumpCtx ctx;
+
+    ctx.out = out;
+    ctx.file = file;
+    ctx.count = 0;
 
     errcode = couchstore_open_db(file, COUCHSTORE_OPEN_FLAG_RDONLY, &db);
     if (errcode != COUCHSTORE_SUCCESS) {
@@ -175,23 +249,30 @@ static int process_file(const char *file, int *total)
         return -1;
     }
 
+    /* The walks read the trees' nodes mostly in file order; have the OS
+       fetch them ahead */
+    memset(&buffers, 0, sizeof(buffers));
+    buffers.max_readahead = 4 * 1024 * 1024;
+    buffers.advise_readahead = 1;
+    (void)couchstore_set_buffer_options(db, &buffers);
+
     switch (mode) {
         case DumpBySequence:
             if (dumpTree) {
                 errcode = couchstore_walk_seq_tree(db, 0, COUCHSTORE_INCLUDE_CORRUPT_DOCS,
-                                                   visit_node, &count);
+                                                   visit_node, &ctx);
             } else {
                 errcode = couchstore_changes_since(db, 0, COUCHSTORE_INCLUDE_CORRUPT_DOCS,
-                                                   foldprint, &count);
+                                                   foldprint, &ctx);
             }
             break;
         case DumpByID:
             if (dumpTree) {
                 errcode = couchstore_walk_id_tree(db, NULL, COUCHSTORE_INCLUDE_CORRUPT_DOCS,
-                                                  visit_node, &count);
+                                                  visit_node, &ctx);
             } else {
                 errcode = couchstore_all_docs(db, NULL, COUCHSTORE_INCLUDE_CORRUPT_DOCS,
-                                              foldprint, &count);
+                                              foldprint, &ctx);
             }
             break;
     }
@@ -203,12 +284,13 @@ static int process_file(const char *file, int *total)
         return -1;
     }
 
-    *total += count;
+    counts[index] = ctx.count;
     return 0;
 }
 
 static void usage(void) {
-    printf("USAGE: couch_dbdump [--byid | --byseq] [--tree] <file.couch>\n");
+    printf("USAGE: couch_dbdump [--byid | --byseq] [--tree | --json] [--no-bodies]\n"
+           "                    [-j <threads>] <file.couch> ...\n");
     exit(EXIT_FAILURE);
 }
 
@@ -216,34 +298,56 @@ int main(int argc, char **argv)
 {
     int error = 0;
     int count = 0;
+    int threads = 1;
+    int *counts;
     int ii = 1;
+    int i;
 
     if (argc < 2) {
         usage();
     }
 
-    while (strncmp(argv[ii], "-", 1) == 0) {
+    while (ii < argc && strncmp(argv[ii], "-", 1) == 0) {
         if (strcmp(argv[ii], "--byid") == 0) {
             mode = DumpByID;
         } else if (strcmp(argv[ii], "--byseq") == 0) {
             mode = DumpBySequence;
         } else if (strcmp(argv[ii], "--tree") == 0) {
             dumpTree = true;
+        } else if (strcmp(argv[ii], "--json") == 0) {
+            dumpJson = true;
+        } else if (strcmp(argv[ii], "--no-bodies") == 0) {
+            dumpBodies = false;
+        } else if (strcmp(argv[ii], "-j") == 0 && ii + 1 < argc) {
+            threads = atoi(argv[++ii]);
+            if (threads < 1) {
+                usage();
+            }
         } else {
             usage();
         }
         ++ii;
     }
 
-    if (ii >= argc) {
+    if (ii >= argc || (dumpTree && dumpJson)) {
         usage();
     }
 
-    for (; ii < argc; ++ii) {
-        error += process_file(argv[ii], &count);
+    counts = (int *) calloc(argc - ii, sizeof(int));
+    if (counts == NULL) {
+        fprintf(stderr, "Memory allocation failure\n");
+        exit(EXIT_FAILURE);
     }
+    error = run_tool_on_files((const char **) argv + ii, argc - ii, threads,
+                              process_file, counts, stdout);
+    for (i = 0; i < argc - ii; ++i) {
+        count += counts[i];
+    }
+    free(counts);
 
-    printf("\nTotal docs: %d\n", count);
+    if (!dumpJson) {
+        printf("\nTotal docs: %d\n", count);
+    }
     if (error) {
         exit(EXIT_FAILURE);
     } else {
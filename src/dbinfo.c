@@ -10,43 +10,367 @@
 #include "internal.h"
 #include "util.h"
 #include "bitfield.h"
+#include "tools.h"
 
 #ifdef WIN32
 #define snprintf _snprintf
 #endif
 
-static char *size_str(double size)
+/* Formats size into rfs, which the threads of -j each have their own of */
+static char *size_str(double size, char rfs[64])
 {
-    static char rfs[256];
     int i = 0;
     const char *units[] = {"bytes", "kB", "MB", "GB", "TB", "PB", "EB", "ZB", "YB"};
     while (size > 1024) {
         size /= 1024;
         i++;
     }
-    snprintf(rfs, sizeof(rfs), "%.*f %s", i, size, units[i]);
+    snprintf(rfs, 64, "%.*f %s", i, size, units[i]);
     return rfs;
 }
 
-static void print_db_info(Db* db)
+static int json_output = 0;
+static int deep_stats = 0;
+
+static void print_db_info(FILE *out, Db* db)
 {
     DbInfo info;
+    char rfs[64];
     couchstore_db_info(db, &info);
     if (info.doc_count == 0) {
-        printf("   no documents\n");
+        fprintf(out, "   no documents\n");
         return;
     }
-    printf("   doc count: %"PRIu64"\n", info.doc_count);
-    printf("   deleted doc count: %"PRIu64"\n", info.deleted_count);
-    printf("   data size: %s\n", size_str(info.space_used));
+    fprintf(out, "   doc count: %"PRIu64"\n", info.doc_count);
+    fprintf(out, "   deleted doc count: %"PRIu64"\n", info.deleted_count);
+    fprintf(out, "   data size: %s\n", size_str(info.space_used, rfs));
+}
+
+/* Prints a header's info as the start of a line of JSON */
+static void print_db_info_json(FILE *out, const char *file, Db *db,
+                               uint64_t btreesize)
+{
+    DbInfo info;
+    couchstore_db_info(db, &info);
+    fprintf(out, "{\"file\": ");
+    print_json_string(out, file, strlen(file));
+    fprintf(out, ", \"header_pos\": %"PRIu64", \"disk_version\": %"PRIu64
+            ", \"update_seq\": %"PRIu64", \"doc_count\": %"PRIu64
+            ", \"deleted_count\": %"PRIu64", \"space_used\": %"PRIu64
+            ", \"btree_size\": %"PRIu64", \"file_size\": %"PRIu64,
+            db->header.position, db->header.disk_version,
+            db->header.update_seq, info.doc_count, info.deleted_count,
+            info.space_used, btreesize, (uint64_t) db->file.pos);
+}
+
+/* Levels of a tree --stats keeps count of; deeper ones are put in the last */
+#define STATS_LEVELS 16
+/* Buckets of the size histograms: bucket i counts sizes below 2^i, from
+   2^(i-1) up */
+#define SIZE_BUCKETS 32
+
+typedef struct {
+    uint64_t *values;
+    size_t count;
+    size_t capacity;
+} value_list;
+
+typedef struct {
+    value_list entries;
+    value_list bytes;
+} node_fill;
+
+typedef struct {
+    int levels;
+    uint64_t nodes[STATS_LEVELS];
+    uint64_t disk_bytes[STATS_LEVELS];
+    uint64_t bytes[STATS_LEVELS];
+    node_fill leaves;
+    node_fill interior;
+} tree_stats;
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t buckets[SIZE_BUCKETS];
+} size_histogram;
+
+typedef struct {
+    tree_stats by_id;
+    tree_stats by_seq;
+    size_histogram key_sizes;
+    size_histogram body_sizes;
+    couchstore_fragmentation_info space;
+} db_stats;
+
+static int add_value(value_list *list, uint64_t value)
+{
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        uint64_t *values = (uint64_t *) realloc(list->values,
+                                                capacity * sizeof(uint64_t));
+        if (values == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        list->values = values;
+        list->capacity = capacity;
+    }
+    list->values[list->count++] = value;
+    return 0;
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const value_list *list, double p)
+{
+    if (list->count == 0) {
+        return 0;
+    }
+    return list->values[(size_t) (p * (list->count - 1) + 0.5)];
+}
+
+static double average(const value_list *list)
+{
+    uint64_t total = 0;
+    size_t i;
+    for (i = 0; i < list->count; ++i) {
+        total += list->values[i];
+    }
+    return list->count ? (double) total / list->count : 0.0;
 }
 
-static int process_file(const char *file)
+static void add_size(size_histogram *h, uint64_t size)
+{
+    int i = 0;
+    while (i < SIZE_BUCKETS - 1 && size >= ((uint64_t) 1 << i)) {
+        ++i;
+    }
+    h->buckets[i]++;
+    h->count++;
+    h->total += size;
+}
+
+static int stats_visit_node(Db *db, const couchstore_node_info *node,
+                            void *ctx)
+{
+    tree_stats *t = (tree_stats *) ctx;
+    int level = node->depth < STATS_LEVELS ? node->depth : STATS_LEVELS - 1;
+    node_fill *fill = node->is_leaf ? &t->leaves : &t->interior;
+    (void) db;
+
+    if (node->depth + 1 > t->levels) {
+        t->levels = node->depth + 1;
+    }
+    t->nodes[level]++;
+    t->disk_bytes[level] += node->disk_size;
+    t->bytes[level] += node->size;
+    if (add_value(&fill->entries, node->count) < 0 ||
+        add_value(&fill->bytes, node->size) < 0) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    return 0;
+}
+
+static int stats_visit_doc(Db *db, DocInfo *docinfo, void *ctx)
+{
+    db_stats *stats = (db_stats *) ctx;
+    (void) db;
+
+    add_size(&stats->key_sizes, docinfo->id.size);
+    if (!docinfo->deleted) {
+        add_size(&stats->body_sizes, docinfo->size);
+    }
+    return 0;
+}
+
+static void free_fill(node_fill *fill)
+{
+    free(fill->entries.values);
+    free(fill->bytes.values);
+}
+
+static void free_stats(db_stats *stats)
+{
+    free_fill(&stats->by_id.leaves);
+    free_fill(&stats->by_id.interior);
+    free_fill(&stats->by_seq.leaves);
+    free_fill(&stats->by_seq.interior);
+}
+
+static void sort_fill(node_fill *fill)
+{
+    qsort(fill->entries.values, fill->entries.count, sizeof(uint64_t),
+          cmp_uint64);
+    qsort(fill->bytes.values, fill->bytes.count, sizeof(uint64_t),
+          cmp_uint64);
+}
+
+/* Walks both trees and the documents of the current header */
+static couchstore_error_t collect_stats(Db *db, db_stats *stats)
+{
+    couchstore_error_t errcode;
+
+    memset(stats, 0, sizeof(*stats));
+    errcode = couchstore_walk_nodes(db, COUCHSTORE_CURSOR_BY_ID,
+                                    stats_visit_node, &stats->by_id);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = couchstore_walk_nodes(db, COUCHSTORE_CURSOR_BY_SEQUENCE,
+                                        stats_visit_node, &stats->by_seq);
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = couchstore_all_docs(db, NULL, COUCHSTORE_BORROW_DOCINFOS,
+                                      stats_visit_doc, stats);
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = couchstore_fragmentation_stats(db, &stats->space);
+    }
+    sort_fill(&stats->by_id.leaves);
+    sort_fill(&stats->by_id.interior);
+    sort_fill(&stats->by_seq.leaves);
+    sort_fill(&stats->by_seq.interior);
+    return errcode;
+}
+
+static void print_fill(FILE *out, const char *what, const node_fill *fill)
+{
+    if (fill->entries.count == 0) {
+        return;
+    }
+    fprintf(out, "      %s: entries avg %.1f, p50 %"PRIu64", p90 %"PRIu64
+            ", p99 %"PRIu64"; bytes avg %.0f, p50 %"PRIu64", p90 %"PRIu64
+            ", p99 %"PRIu64"\n", what,
+            average(&fill->entries), percentile(&fill->entries, 0.5),
+            percentile(&fill->entries, 0.9), percentile(&fill->entries, 0.99),
+            average(&fill->bytes), percentile(&fill->bytes, 0.5),
+            percentile(&fill->bytes, 0.9), percentile(&fill->bytes, 0.99));
+}
+
+static void print_tree_stats(FILE *out, const char *name, const tree_stats *t)
+{
+    char rfs[64], rfs2[64];
+    int i;
+
+    fprintf(out, "   %s tree: depth %d\n", name, t->levels);
+    for (i = 0; i < t->levels && i < STATS_LEVELS; ++i) {
+        fprintf(out, "      level %d: %"PRIu64" nodes, %s on disk, %s decompressed\n",
+                i, t->nodes[i], size_str(t->disk_bytes[i], rfs),
+                size_str(t->bytes[i], rfs2));
+    }
+    print_fill(out, "leaf nodes", &t->leaves);
+    print_fill(out, "interior nodes", &t->interior);
+}
+
+static void print_histogram(FILE *out, const char *name,
+                            const size_histogram *h)
+{
+    int i;
+
+    fprintf(out, "   %s: %"PRIu64", avg %.1f bytes\n", name, h->count,
+            h->count ? (double) h->total / h->count : 0.0);
+    for (i = 0; i < SIZE_BUCKETS; ++i) {
+        if (h->buckets[i] > 0) {
+            fprintf(out, "      < %"PRIu64": %"PRIu64"\n",
+                    (uint64_t) 1 << i, h->buckets[i]);
+        }
+    }
+}
+
+static void print_stats(FILE *out, const db_stats *stats)
+{
+    char rfs[64];
+    const couchstore_fragmentation_info *space = &stats->space;
+
+    print_tree_stats(out, "by-ID", &stats->by_id);
+    print_tree_stats(out, "by-sequence", &stats->by_seq);
+    print_histogram(out, "document ID sizes", &stats->key_sizes);
+    print_histogram(out, "live document body sizes", &stats->body_sizes);
+    fprintf(out, "   live document bodies: %s\n", size_str(space->live_doc_bytes, rfs));
+    fprintf(out, "   live by-ID tree: %s\n", size_str(space->by_id_tree_bytes, rfs));
+    fprintf(out, "   live by-sequence tree: %s\n", size_str(space->by_seq_tree_bytes, rfs));
+    fprintf(out, "   live local docs tree: %s\n", size_str(space->local_tree_bytes, rfs));
+    fprintf(out, "   stale: %s (%.1f%%)\n", size_str(space->stale_bytes, rfs),
+            space->file_size ? 100.0 * space->stale_bytes / space->file_size : 0.0);
+}
+
+static void print_fill_json(FILE *out, const char *name, const node_fill *fill)
+{
+    fprintf(out, ", \"%s\": {\"nodes\": %"PRIu64", \"entries_avg\": %.1f"
+            ", \"entries_p50\": %"PRIu64", \"entries_p90\": %"PRIu64
+            ", \"entries_p99\": %"PRIu64", \"bytes_avg\": %.0f"
+            ", \"bytes_p50\": %"PRIu64", \"bytes_p90\": %"PRIu64
+            ", \"bytes_p99\": %"PRIu64"}", name, (uint64_t) fill->entries.count,
+            average(&fill->entries), percentile(&fill->entries, 0.5),
+            percentile(&fill->entries, 0.9), percentile(&fill->entries, 0.99),
+            average(&fill->bytes), percentile(&fill->bytes, 0.5),
+            percentile(&fill->bytes, 0.9), percentile(&fill->bytes, 0.99));
+}
+
+static void print_tree_stats_json(FILE *out, const char *name,
+                                  const tree_stats *t)
+{
+    int i;
+
+    fprintf(out, ", \"%s\": {\"depth\": %d, \"levels\": [", name, t->levels);
+    for (i = 0; i < t->levels && i < STATS_LEVELS; ++i) {
+        fprintf(out, "%s{\"nodes\": %"PRIu64", \"disk_bytes\": %"PRIu64
+                ", \"bytes\": %"PRIu64"}", i ? ", " : "", t->nodes[i],
+                t->disk_bytes[i], t->bytes[i]);
+    }
+    fprintf(out, "]");
+    print_fill_json(out, "leaves", &t->leaves);
+    print_fill_json(out, "interior", &t->interior);
+    fprintf(out, "}");
+}
+
+static void print_histogram_json(FILE *out, const char *name,
+                                 const size_histogram *h)
+{
+    int i, first = 1;
+
+    fprintf(out, ", \"%s\": {\"count\": %"PRIu64", \"bytes\": %"PRIu64
+            ", \"below\": {", name, h->count, h->total);
+    for (i = 0; i < SIZE_BUCKETS; ++i) {
+        if (h->buckets[i] > 0) {
+            fprintf(out, "%s\"%"PRIu64"\": %"PRIu64, first ? "" : ", ",
+                    (uint64_t) 1 << i, h->buckets[i]);
+            first = 0;
+        }
+    }
+    fprintf(out, "}}");
+}
+
+static void print_stats_json(FILE *out, const db_stats *stats)
+{
+    const couchstore_fragmentation_info *space = &stats->space;
+
+    fprintf(out, ", \"stats\": {\"live_doc_bytes\": %"PRIu64
+            ", \"by_id_tree_bytes\": %"PRIu64", \"by_seq_tree_bytes\": %"PRIu64
+            ", \"local_tree_bytes\": %"PRIu64", \"stale_bytes\": %"PRIu64,
+            space->live_doc_bytes, space->by_id_tree_bytes,
+            space->by_seq_tree_bytes, space->local_tree_bytes,
+            space->stale_bytes);
+    print_tree_stats_json(out, "by_id", &stats->by_id);
+    print_tree_stats_json(out, "by_seq", &stats->by_seq);
+    print_histogram_json(out, "id_sizes", &stats->key_sizes);
+    print_histogram_json(out, "body_sizes", &stats->body_sizes);
+    fprintf(out, "}");
+}
+
+static int process_file(const char *file, int index, FILE *out, void *ctx)
 {
     Db *db;
     couchstore_error_t errcode;
     uint64_t btreesize = 0;
+    char rfs[64];
+    db_stats stats;
     int iterate_headers = getenv("ITERATE_HEADERS") != NULL;
+    (void) index;
+    (void) ctx;
 
     errcode = couchstore_open_db(file, COUCHSTORE_OPEN_FLAG_RDONLY, &db);
     if (errcode != COUCHSTORE_SUCCESS) {
@@ -56,21 +380,48 @@ static int process_file(const char *file)
     }
 
 next_header:
-    printf("DB Info (%s) - header at %"PRIu64"\n", file, db->header.position);
-    printf("   file format version: %"PRIu64"\n", db->header.disk_version);
-    printf("   update_seq: %"PRIu64"\n", db->header.update_seq);
-    print_db_info(db);
     if (db->header.by_id_root) {
         btreesize += db->header.by_id_root->subtreesize;
     }
     if (db->header.by_seq_root) {
         btreesize += db->header.by_seq_root->subtreesize;
     }
-    printf("   B-tree size: %s\n", size_str(btreesize));
-    printf("   total disk size: %s\n", size_str(db->file.pos));
+    if (deep_stats) {
+        errcode = collect_stats(db, &stats);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            fprintf(stderr, "Failed to walk \"%s\": %s\n",
+                    file, couchstore_strerror(errcode));
+            free_stats(&stats);
+            couchstore_close_db(db);
+            return -1;
+        }
+    }
+    if (json_output) {
+        print_db_info_json(out, file, db, btreesize);
+        if (deep_stats) {
+            print_stats_json(out, &stats);
+        }
+        fprintf(out, "}\n");
+    } else {
+        fprintf(out, "DB Info (%s) - header at %"PRIu64"\n", file, db->header.position);
+        fprintf(out, "   file format version: %"PRIu64"\n", db->header.disk_version);
+        fprintf(out, "   update_seq: %"PRIu64"\n", db->header.update_seq);
+        print_db_info(out, db);
+        fprintf(out, "   B-tree size: %s\n", size_str(btreesize, rfs));
+        fprintf(out, "   total disk size: %s\n", size_str(db->file.pos, rfs));
+        if (deep_stats) {
+            print_stats(out, &stats);
+        }
+    }
+    if (deep_stats) {
+        free_stats(&stats);
+    }
     if (iterate_headers) {
         if (couchstore_rewind_db_header(db) == COUCHSTORE_SUCCESS) {
-            printf("\n");
+            if (!json_output) {
+                fprintf(out, "\n");
+            }
+            btreesize = 0;
             goto next_header;
         }
     } else {
@@ -80,20 +431,41 @@ next_header:
     return 0;
 }
 
+static void usage(const char *prog)
+{
+    printf("USAGE: %s [--json] [--stats] [-j <threads>] <file.couch> ...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
     int error = 0;
-    int ii;
+    int threads = 1;
+    int ii = 1;
 
-    if (argc < 2) {
-        printf("USAGE: %s <file.couch>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    while (ii < argc && strncmp(argv[ii], "-", 1) == 0) {
+        if (strcmp(argv[ii], "--json") == 0) {
+            json_output = 1;
+        } else if (strcmp(argv[ii], "--stats") == 0) {
+            deep_stats = 1;
+        } else if (strcmp(argv[ii], "-j") == 0 && ii + 1 < argc) {
+            threads = atoi(argv[++ii]);
+            if (threads < 1) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+        ++ii;
     }
 
-    for (ii = 1; ii < argc; ++ii) {
-        error += process_file(argv[ii]);
+    if (ii >= argc) {
+        usage(argv[0]);
     }
 
+    error = run_tool_on_files((const char **) argv + ii, argc - ii, threads,
+                              process_file, NULL, stdout);
+
     if (error) {
         exit(EXIT_FAILURE);
     } else {
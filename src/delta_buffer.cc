@@ -0,0 +1,453 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Delta buffer of recently saved documents.
+//
+// Saving a handful of documents rewrites a whole path from the root to a
+// leaf in both trees, which for small batches written between frequent
+// commits is far more than the documents themselves. The buffer holds
+// their index entries in memory instead, and a commit only appends the
+// entries saved since the one before to a log; once enough have piled up
+// they are folded into the trees in one batch.
+//
+// In write-back mode (couchstore_set_write_back) the buffer is folded at
+// each commit instead of logged, so that the saves between two commits
+// rewrite each path through the trees once, and files of any version can
+// use it.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "body_segments.h"
+#include "delta_buffer.h"
+#include "bitfield.h"
+#include "node_types.h"
+#include "util.h"
+#include "value_log.h"
+
+// Log chunk layout: the position of the previous chunk, or 0, as a raw_48,
+// then for each entry its sequence as a raw_48, the size of its by-sequence
+// value as a raw_32, and the value.
+#define LOG_ENTRY_OVERHEAD (sizeof(raw_48) + sizeof(raw_32))
+
+// Builds an entry from a document's by-sequence key and value, deriving
+// its by-ID value as the compactor does.
+static couchstore_error_t entry_create(const sized_buf *seq,
+                                       const sized_buf *seq_value,
+                                       delta_entry **pEntry)
+{
+    const raw_seq_index_value *raw_seq = (const raw_seq_index_value*)seq_value->buf;
+    uint32_t idsize, datasize;
+    size_t rev_meta_size;
+
+    if (seq->size != sizeof(raw_48) || seq_value->size < sizeof(raw_seq_index_value)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    decode_kv_length(&raw_seq->sizes, &idsize, &datasize);
+    if (seq_value->size < sizeof(raw_seq_index_value) + idsize) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    rev_meta_size = seq_value->size - sizeof(raw_seq_index_value) - idsize;
+
+    size_t id_value_size = sizeof(raw_id_index_value) + rev_meta_size;
+    delta_entry *entry = static_cast<delta_entry*>(cs_malloc(sizeof(delta_entry) + seq->size +
+                                                          seq_value->size + id_value_size));
+    if (entry == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    char *p = (char*)(entry + 1);
+    entry->seq.buf = p;
+    entry->seq.size = seq->size;
+    memcpy(p, seq->buf, seq->size);
+    p += seq->size;
+    entry->seq_value.buf = p;
+    entry->seq_value.size = seq_value->size;
+    memcpy(p, seq_value->buf, seq_value->size);
+    entry->id.buf = p + sizeof(raw_seq_index_value);
+    entry->id.size = idsize;
+    p += seq_value->size;
+
+    raw_id_index_value *raw_id = (raw_id_index_value*)p;
+    raw_id->db_seq = *(const raw_48*)seq->buf;
+    raw_id->size = encode_raw32(datasize);
+    raw_id->bp = raw_seq->bp;
+    raw_id->content_meta = raw_seq->content_meta;
+    raw_id->rev_seq = raw_seq->rev_seq;
+    memcpy(raw_id + 1, entry->id.buf + idsize, rev_meta_size);
+    entry->id_value.buf = p;
+    entry->id_value.size = id_value_size;
+    entry->logged = 0;
+    *pEntry = entry;
+    return COUCHSTORE_SUCCESS;
+}
+
+// Finds where an ID is, or would go, in the sorted entries.
+static unsigned find_entry(const delta_buffer *delta, const sized_buf *id, int *found)
+{
+    unsigned lo = 0, hi = delta->count;
+    *found = 0;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        int cmp = ebin_cmp(&delta->entries[mid]->id, id);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static size_t entry_size(const delta_entry *entry)
+{
+    return sizeof(delta_entry) + entry->seq.size + entry->seq_value.size +
+           entry->id_value.size;
+}
+
+static void insert_entry(delta_buffer *delta, delta_entry *entry)
+{
+    int found;
+    unsigned ii = find_entry(delta, &entry->id, &found);
+    delta->entry_bytes += entry_size(entry);
+    if (found) {
+        delta->entry_bytes -= entry_size(delta->entries[ii]);
+        cs_free(delta->entries[ii]);
+    } else {
+        memmove(&delta->entries[ii + 1], &delta->entries[ii],
+                (delta->count - ii) * sizeof(delta_entry*));
+        ++delta->count;
+    }
+    delta->entries[ii] = entry;
+    ++delta->added;
+}
+
+couchstore_error_t db_delta_add(Db *db,
+                                const sized_buf *seqs,
+                                const sized_buf *seqvals,
+                                unsigned numdocs)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    delta_entry **created = NULL;
+    delta_buffer *delta = db->delta;
+    unsigned ii, made = 0;
+
+    if (delta == NULL) {
+        delta = static_cast<delta_buffer*>(cs_calloc(1, sizeof(delta_buffer)));
+        error_unless(delta, COUCHSTORE_ERROR_ALLOC_FAIL);
+        db->delta = delta;
+    }
+    // Everything that can fail comes first, so that a batch goes in whole
+    // or not at all.
+    if (delta->count + numdocs > delta->capacity) {
+        unsigned capacity = delta->capacity ? delta->capacity : 64;
+        while (capacity < delta->count + numdocs) {
+            capacity *= 2;
+        }
+        delta_entry **entries = static_cast<delta_entry**>(cs_realloc(delta->entries,
+                                                                   capacity * sizeof(delta_entry*)));
+        error_unless(entries, COUCHSTORE_ERROR_ALLOC_FAIL);
+        delta->entries = entries;
+        delta->capacity = capacity;
+    }
+    created = static_cast<delta_entry**>(cs_malloc(numdocs * sizeof(delta_entry*)));
+    error_unless(created || numdocs == 0, COUCHSTORE_ERROR_ALLOC_FAIL);
+    for (made = 0; made < numdocs; made++) {
+        error_pass(entry_create(&seqs[made], &seqvals[made], &created[made]));
+    }
+
+    // In batch order, so that a later save of an ID replaces an earlier one.
+    for (ii = 0; ii < numdocs; ii++) {
+        insert_entry(delta, created[ii]);
+    }
+    made = 0;
+
+cleanup:
+    for (ii = 0; ii < made; ii++) {
+        cs_free(created[ii]);
+    }
+    cs_free(created);
+    return errcode;
+}
+
+int db_delta_due(const Db *db, unsigned numdocs)
+{
+    if (db->delta == NULL || db->delta->count == 0) {
+        return 0;
+    }
+    if (db->write_back_max > 0) {
+        if (db->delta->entry_bytes > db->write_back_max) {
+            return 1;
+        }
+        if (db->delta_max_docs == 0) {
+            return 0;
+        }
+    }
+    return db->delta->added + numdocs > db->delta_max_docs;
+}
+
+int db_delta_takes(const Db *db, unsigned numdocs)
+{
+    return db->write_back_max > 0 ||
+           (db->delta_max_docs > 0 && numdocs <= db->delta_max_docs);
+}
+
+couchstore_error_t db_delta_fold_for_read(Db *db)
+{
+    if (db->dropped || db->delta == NULL || db->delta->count == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    if (!db->readonly) {
+        return db_fold_delta(db);
+    }
+    // A read-only handle writes the nodes to memory instead, and keeps them
+    // until it moves to another header. It's still at the one that points
+    // to the log, and its end of the file stays where it was.
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t pos = db->file.pos;
+    uint64_t delta_ptr = db->header.delta_ptr;
+    error_pass(tree_file_start_overlay(&db->file));
+    errcode = db_fold_delta(db);
+    db->header.delta_ptr = delta_ptr;
+cleanup:
+    db->file.pos = pos;
+    return errcode;
+}
+
+couchstore_error_t db_delta_lookup_id(Db *db, const sized_buf *id, DocInfo **pInfo)
+{
+    int found;
+    if (db->delta == NULL) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+    unsigned ii = find_entry(db->delta, id, &found);
+    if (!found) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+    delta_entry *entry = db->delta->entries[ii];
+    return by_seq_read_docinfo(pInfo, &entry->seq, &entry->seq_value);
+}
+
+couchstore_error_t db_delta_lookup_seq(Db *db, uint64_t seq, DocInfo **pInfo)
+{
+    unsigned ii;
+    if (db->delta == NULL) {
+        return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+    }
+    // The buffer is small and sorted by ID, so it's simply scanned.
+    for (ii = 0; ii < db->delta->count; ii++) {
+        delta_entry *entry = db->delta->entries[ii];
+        if (decode_raw48(*(const raw_48*)entry->seq.buf) == seq) {
+            return by_seq_read_docinfo(pInfo, &entry->seq, &entry->seq_value);
+        }
+    }
+    return COUCHSTORE_ERROR_DOC_NOT_FOUND;
+}
+
+couchstore_error_t db_delta_prepare_commit(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    delta_buffer *delta = db->delta;
+    sized_buf buf = { NULL, 0 };
+    cs_off_t pos;
+    unsigned ii;
+    int written;
+
+    if (delta == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    if (db->write_back_max > 0) {
+        return db_fold_delta(db);
+    }
+    buf.size = sizeof(raw_48);
+    for (ii = 0; ii < delta->count; ii++) {
+        if (!delta->entries[ii]->logged) {
+            buf.size += LOG_ENTRY_OVERHEAD + delta->entries[ii]->seq_value.size;
+        }
+    }
+    if (buf.size == sizeof(raw_48)) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    buf.buf = static_cast<char*>(cs_malloc(buf.size));
+    error_unless(buf.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    char *p;
+    p = buf.buf;
+    *(raw_48*)p = encode_raw48(db->header.delta_ptr);
+    p += sizeof(raw_48);
+    for (ii = 0; ii < delta->count; ii++) {
+        const delta_entry *entry = delta->entries[ii];
+        if (!entry->logged) {
+            memcpy(p, entry->seq.buf, sizeof(raw_48));
+            p += sizeof(raw_48);
+            *(raw_32*)p = encode_raw32((uint32_t)entry->seq_value.size);
+            p += sizeof(raw_32);
+            memcpy(p, entry->seq_value.buf, entry->seq_value.size);
+            p += entry->seq_value.size;
+        }
+    }
+
+    written = db_write_buf(&db->file, &buf, &pos, NULL);
+    if (written < 0) {
+        error_pass(static_cast<couchstore_error_t>(written));
+    }
+    db->header.delta_ptr = pos;
+    for (ii = 0; ii < delta->count; ii++) {
+        delta->entries[ii]->logged = 1;
+    }
+cleanup:
+    cs_free(buf.buf);
+    return errcode;
+}
+
+// Adds the entries of one log chunk.
+static couchstore_error_t replay_chunk(Db *db, const char *buf, size_t size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t offset = sizeof(raw_48);
+
+    while (offset < size) {
+        sized_buf seq, seq_value;
+        error_unless(size - offset >= LOG_ENTRY_OVERHEAD, COUCHSTORE_ERROR_CORRUPT);
+        seq.buf = (char*)buf + offset;
+        seq.size = sizeof(raw_48);
+        seq_value.size = decode_raw32(*(const raw_32*)(buf + offset + sizeof(raw_48)));
+        seq_value.buf = (char*)buf + offset + LOG_ENTRY_OVERHEAD;
+        offset += LOG_ENTRY_OVERHEAD;
+        error_unless(seq_value.size <= size - offset, COUCHSTORE_ERROR_CORRUPT);
+        error_unless(decode_raw48(*(const raw_48*)seq.buf) <= db->header.update_seq,
+                     COUCHSTORE_ERROR_CORRUPT);
+        error_pass(db_delta_add(db, &seq, &seq_value, 1));
+        offset += seq_value.size;
+    }
+cleanup:
+    return errcode;
+}
+
+couchstore_error_t db_delta_load(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char **chunks = NULL;
+    int *sizes = NULL;
+    unsigned nchunks = 0, capacity = 0, ii;
+    uint64_t pos = db->header.delta_ptr;
+
+    db_delta_reset(db);
+    // Anything folded into memory was for the header being left.
+    tree_file_clear_overlay(&db->file);
+    // The chain runs from the newest chunk back, and is replayed from the
+    // oldest so that later saves of an ID win.
+    while (pos != 0) {
+        if (nchunks == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **more_chunks = static_cast<char**>(cs_realloc(chunks, capacity * sizeof(char*)));
+            error_unless(more_chunks, COUCHSTORE_ERROR_ALLOC_FAIL);
+            chunks = more_chunks;
+            int *more_sizes = static_cast<int*>(cs_realloc(sizes, capacity * sizeof(int)));
+            error_unless(more_sizes, COUCHSTORE_ERROR_ALLOC_FAIL);
+            sizes = more_sizes;
+        }
+        char *buf = NULL;
+        int size = pread_bin(&db->file, pos, &buf);
+        error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+        chunks[nchunks] = buf;
+        sizes[nchunks] = size;
+        ++nchunks;
+        error_unless(size >= (int)sizeof(raw_48), COUCHSTORE_ERROR_CORRUPT);
+        uint64_t previous = decode_raw48(*(const raw_48*)buf);
+        error_unless(previous < pos, COUCHSTORE_ERROR_CORRUPT);
+        pos = previous;
+    }
+    for (ii = nchunks; ii > 0; ii--) {
+        error_pass(replay_chunk(db, chunks[ii - 1], sizes[ii - 1]));
+    }
+    if (db->delta) {
+        for (ii = 0; ii < db->delta->count; ii++) {
+            db->delta->entries[ii]->logged = 1;
+        }
+    }
+
+cleanup:
+    for (ii = 0; ii < nchunks; ii++) {
+        cs_free(chunks[ii]);
+    }
+    cs_free(chunks);
+    cs_free(sizes);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        db_delta_reset(db);
+    }
+    return errcode;
+}
+
+couchstore_error_t db_delta_copy(Db *target, Db *source)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    sized_buf value = { NULL, 0 };
+    sized_buf item = { NULL, 0 };
+    unsigned ii;
+
+    if (source->delta == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
+    for (ii = 0; ii < source->delta->count; ii++) {
+        const delta_entry *entry = source->delta->entries[ii];
+        cs_free(value.buf);
+        value.size = entry->seq_value.size;
+        value.buf = static_cast<char*>(cs_malloc(value.size));
+        error_unless(value.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+        memcpy(value.buf, entry->seq_value.buf, value.size);
+
+        raw_seq_index_value *raw = (raw_seq_index_value*)value.buf;
+        uint64_t bp = decode_raw48(raw->bp);
+        if (source->header.vlog_ptr && (bp & BP_VALUE_LOG_FLAG)) {
+            error_pass(db_value_log_copy(source, target, raw));
+        } else if (source->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES &&
+                   (bp & BP_SEGMENTED_FLAG)) {
+            error_pass(db_copy_segmented(&source->file, &target->file, raw));
+        } else if ((bp & ~BP_DELETED_FLAG) != 0) {
+            // Copied with the codec it was written with, as the compactor does.
+            unsigned codec;
+            cs_off_t new_bp;
+            int size = pread_chunk(&source->file, bp & ~BP_DELETED_FLAG, &item.buf, &codec);
+            error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+            item.size = size;
+            int written = db_write_chunk(&target->file, &item, codec, &new_bp, NULL);
+            cs_free(item.buf);
+            item.buf = NULL;
+            error_unless(written >= 0, static_cast<couchstore_error_t>(written));
+            raw->bp = encode_raw48((bp & BP_DELETED_FLAG) | new_bp);
+        }
+        error_pass(db_delta_add(target, &entry->seq, &value, 1));
+    }
+cleanup:
+    cs_free(value.buf);
+    cs_free(item.buf);
+    return errcode;
+}
+
+size_t db_delta_memory(const Db *db)
+{
+    const delta_buffer *delta = db->delta;
+    if (delta == NULL) {
+        return 0;
+    }
+    return sizeof(delta_buffer) + delta->capacity * sizeof(delta_entry*) +
+           delta->entry_bytes;
+}
+
+void db_delta_reset(Db *db)
+{
+    unsigned ii;
+    if (db->delta == NULL) {
+        return;
+    }
+    for (ii = 0; ii < db->delta->count; ii++) {
+        cs_free(db->delta->entries[ii]);
+    }
+    cs_free(db->delta->entries);
+    cs_free(db->delta);
+    db->delta = NULL;
+}
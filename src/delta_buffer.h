@@ -0,0 +1,93 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_DELTA_BUFFER_H
+#define LIBCOUCHSTORE_DELTA_BUFFER_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* The index entries of one saved document, in one allocation. */
+    typedef struct delta_entry {
+        sized_buf seq;          /* by-sequence key */
+        sized_buf seq_value;
+        sized_buf id;           /* by-ID key, inside seq_value */
+        sized_buf id_value;
+        int logged;             /* written to the log already */
+    } delta_entry;
+
+    /* Documents saved but not yet folded into a Db's trees, at most one
+       entry per ID, sorted by ID. */
+    typedef struct delta_buffer {
+        delta_entry **entries;
+        unsigned count;
+        unsigned capacity;
+        /* Saves since the last fold, replaced entries included; this also
+           bounds the length of the log. */
+        unsigned added;
+        /* The bytes the entries take */
+        size_t entry_bytes;
+    } delta_buffer;
+
+    /* The buffer is persisted as a log of chunks, each holding the entries
+       saved since the previous commit and pointing back to the chunk
+       before it; the header points to the newest. Folding the buffer into
+       the trees starts the log over. */
+
+    /** Adds the entries of saved documents, replacing any with the same ID. */
+    couchstore_error_t db_delta_add(Db *db,
+                                    const sized_buf *seqs,
+                                    const sized_buf *seqvals,
+                                    unsigned numdocs);
+
+    /** @return nonzero if the buffer should be folded into the trees
+        before numdocs more documents are saved */
+    int db_delta_due(const Db *db, unsigned numdocs);
+
+    /** @return nonzero if numdocs documents being saved go into the
+        buffer rather than the trees */
+    int db_delta_takes(const Db *db, unsigned numdocs);
+
+    /** Folds the buffer into the trees and empties it. Defined in
+        couch_save.cc, next to the code that updates the trees. */
+    couchstore_error_t db_fold_delta(Db *db);
+
+    /** Folds the buffer ahead of a read that only looks at the trees. A
+        read-only handle, which can't write the nodes to the file, keeps
+        them in memory (see tree_file_start_overlay). */
+    couchstore_error_t db_delta_fold_for_read(Db *db);
+
+    /**
+     * Looks up a document in the buffer by ID.
+     * @return COUCHSTORE_ERROR_DOC_NOT_FOUND if it isn't in the buffer
+     */
+    couchstore_error_t db_delta_lookup_id(Db *db, const sized_buf *id, DocInfo **pInfo);
+
+    /** Looks up a document in the buffer by sequence, like db_delta_lookup_id. */
+    couchstore_error_t db_delta_lookup_seq(Db *db, uint64_t seq, DocInfo **pInfo);
+
+    /** Appends the entries saved since the last commit to the log, or in
+        write-back mode folds the buffer into the trees. Called by
+        db_commit_prepare, before the header size is worked out. */
+    couchstore_error_t db_delta_prepare_commit(Db *db);
+
+    /** Reloads the buffer from the log the current header points to. */
+    couchstore_error_t db_delta_load(Db *db);
+
+    /** Gives a compaction target the source's buffer, copying the bodies
+        its entries point to, for the target to fold in. */
+    couchstore_error_t db_delta_copy(Db *target, Db *source);
+
+    /** The bytes the buffer and its entries take. */
+    size_t db_delta_memory(const Db *db);
+
+    /** Forgets the buffer, e.g. before switching headers. */
+    void db_delta_reset(Db *db);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Streaming writer of a document body; see couchstore_doc_writer_open().
+//
+// The body is written as a segmented one (see body_segments.h), one
+// segment at a time as enough of it is appended, so no more than a
+// segment of it is ever held in memory. The segments are chunks of their
+// own, so other saves may be written between them.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "body_segments.h"
+#include "util.h"
+
+// Used when the handle has no segment size set:
+#define DOC_WRITER_SEGMENT_SIZE (64 * 1024)
+
+struct _couchstore_doc_writer {
+    Db *db;
+    uint32_t segment_size;
+    char *buf;                  // the part of the next segment appended
+    size_t buffered;
+    uint64_t length;            // of the body so far
+    cs_off_t *positions;        // of the segments written
+    size_t count;
+    size_t capacity;
+    size_t disk_size;
+};
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_doc_writer_open(Db *db, couchstore_doc_writer **pWriter)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_doc_writer *writer = NULL;
+
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(!db->readonly &&
+                 db->header.disk_version >= COUCH_DISK_VERSION_SEGMENTED_BODIES,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    writer = static_cast<couchstore_doc_writer *>(cs_calloc(1, sizeof(*writer)));
+    error_unless(writer, COUCHSTORE_ERROR_ALLOC_FAIL);
+    writer->db = db;
+    writer->segment_size = db->body_segment_size ? db->body_segment_size
+                                                 : DOC_WRITER_SEGMENT_SIZE;
+    writer->buf = static_cast<char *>(cs_malloc(writer->segment_size));
+    error_unless(writer->buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    *pWriter = writer;
+    writer = NULL;
+cleanup:
+    couchstore_doc_writer_abort(writer);
+    return errcode;
+}
+
+// Writes a whole segment, compressed with the file's doc codec.
+static couchstore_error_t write_segment(couchstore_doc_writer *writer,
+                                       const char *data, size_t size)
+{
+    sized_buf segment;
+    size_t disk_size;
+
+    if (writer->count == writer->capacity) {
+        size_t capacity = writer->capacity ? 2 * writer->capacity : 16;
+        cs_off_t *positions = static_cast<cs_off_t *>(
+            cs_realloc(writer->positions, capacity * sizeof(cs_off_t)));
+        if (positions == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        writer->positions = positions;
+        writer->capacity = capacity;
+    }
+    segment.buf = const_cast<char *>(data);
+    segment.size = size;
+    couchstore_error_t errcode = db_write_buf_compressed(&writer->db->file, &segment,
+                                                         writer->db->file.doc_codec,
+                                                         &writer->positions[writer->count],
+                                                         &disk_size);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        writer->count++;
+        writer->disk_size += disk_size;
+    }
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_doc_writer_append(couchstore_doc_writer *writer,
+                                                const void *data,
+                                                size_t size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const char *from = static_cast<const char *>(data);
+
+    error_unless(!writer->db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    while (size > 0) {
+        size_t take = writer->segment_size - writer->buffered;
+        if (writer->buffered == 0 && size >= take) {
+            // A whole segment is there to write without copying it.
+            error_pass(write_segment(writer, from, take));
+        } else {
+            if (take > size) {
+                take = size;
+            }
+            memcpy(writer->buf + writer->buffered, from, take);
+            writer->buffered += take;
+            if (writer->buffered == writer->segment_size) {
+                error_pass(write_segment(writer, writer->buf, writer->buffered));
+                writer->buffered = 0;
+            }
+        }
+        writer->length += take;
+        from += take;
+        size -= take;
+    }
+cleanup:
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_doc_writer_finish(couchstore_doc_writer *writer,
+                                                DocInfo *info)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t bp;
+    size_t disk_size;
+
+    error_unless(!writer->db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    if (writer->buffered > 0) {
+        error_pass(write_segment(writer, writer->buf, writer->buffered));
+        writer->buffered = 0;
+    }
+    error_pass(db_write_segment_index(&writer->db->file, writer->length,
+                                      writer->segment_size, writer->positions,
+                                      writer->count, &bp, &disk_size));
+    info->bp = bp;
+    info->size = writer->disk_size + disk_size;
+    info->content_meta |= COUCH_DOC_IS_COMPRESSED;
+cleanup:
+    couchstore_doc_writer_abort(writer);
+    return errcode;
+}
+
+LIBCOUCHSTORE_API
+void couchstore_doc_writer_abort(couchstore_doc_writer *writer)
+{
+    if (writer) {
+        cs_free(writer->positions);
+        cs_free(writer->buf);
+        cs_free(writer);
+    }
+}
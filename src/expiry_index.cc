@@ -0,0 +1,177 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "expiry_index.h"
+#include "node_types.h"
+#include "reduces.h"
+#include "util.h"
+
+void expiry_key(raw_expiry_key *key, uint32_t time, uint64_t seq)
+{
+    key->time = encode_raw32(time);
+    key->seq = encode_raw48(seq);
+}
+
+// The time at offset in a rev_meta, or 0 if it's too short to hold one.
+static uint32_t rev_meta_time(uint16_t offset, const char *rev_meta, size_t size)
+{
+    raw_32 time;
+    if (size < (size_t)offset + sizeof(time)) {
+        return 0;
+    }
+    memcpy(&time, rev_meta + offset, sizeof(time));
+    return decode_raw32(time);
+}
+
+uint32_t expiry_of_seq_value(uint16_t offset, const sized_buf *v)
+{
+    const raw_seq_index_value *raw = (const raw_seq_index_value*)v->buf;
+    uint32_t idsize, datasize;
+    if (v->size < sizeof(*raw) || (decode_raw48(raw->bp) & BP_DELETED_FLAG)) {
+        return 0;
+    }
+    decode_kv_length(&raw->sizes, &idsize, &datasize);
+    size_t start = sizeof(*raw) + idsize;
+    if (v->size < start) {
+        return 0;
+    }
+    return rev_meta_time(offset, v->buf + start, v->size - start);
+}
+
+uint32_t expiry_of_id_value(uint16_t offset, const sized_buf *v)
+{
+    const raw_id_index_value *raw = (const raw_id_index_value*)v->buf;
+    if (v->size < sizeof(*raw) || (decode_raw48(raw->bp) & BP_DELETED_FLAG)) {
+        return 0;
+    }
+    return rev_meta_time(offset, v->buf + sizeof(*raw), v->size - sizeof(*raw));
+}
+
+couchstore_error_t expiry_builder_open(expiry_builder *builder, uint16_t offset)
+{
+    builder->writer = NULL;
+    builder->offset = offset;
+    builder->count = 0;
+    // Counted like the by-sequence entries of old files:
+    return TreeWriterOpen(NULL, ebin_cmp, by_seq_reduce, by_seq_rereduce, NULL,
+                          &builder->writer);
+}
+
+couchstore_error_t expiry_builder_add(expiry_builder *builder,
+                                      const sized_buf *k, const sized_buf *v)
+{
+    uint32_t time = expiry_of_seq_value(builder->offset, v);
+    if (time == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    const raw_seq_index_value *raw = (const raw_seq_index_value*)v->buf;
+    uint32_t idsize, datasize;
+    decode_kv_length(&raw->sizes, &idsize, &datasize);
+
+    raw_expiry_key key;
+    expiry_key(&key, time, decode_raw48(*(const raw_48*)k->buf));
+    sized_buf key_buf = { (char *)&key, sizeof(key) };
+    sized_buf id = { (char *)(raw + 1), idsize };
+    builder->count++;
+    return TreeWriterAddItem(builder->writer, key_buf, id);
+}
+
+couchstore_error_t expiry_builder_finish(expiry_builder *builder, Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    node_pointer *root = NULL;
+
+    if (builder->count > 0) {
+        error_pass(TreeWriterSort(builder->writer));
+        error_pass(TreeWriterWrite(builder->writer, &db->file,
+                                   DB_CHUNK_THRESHOLD, DB_CHUNK_THRESHOLD, &root));
+    }
+    cs_free(db->header.expiry_root);
+    db->header.expiry_root = root;
+cleanup:
+    return errcode;
+}
+
+void expiry_builder_free(expiry_builder *builder)
+{
+    TreeWriterFree(builder->writer);
+    builder->writer = NULL;
+}
+
+static couchstore_error_t build_fetchcb(couchfile_lookup_request *rq,
+                                        const sized_buf *k,
+                                        const sized_buf *v)
+{
+    return expiry_builder_add(static_cast<expiry_builder *>(rq->callback_ctx), k, v);
+}
+
+couchstore_error_t db_expiry_build(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    expiry_builder builder;
+    couchfile_lookup_request rq;
+    raw_48 start = encode_raw48(0);
+    sized_buf start_key = { (char *)&start, sizeof(start) };
+    sized_buf *start_list = &start_key;
+
+    error_pass(expiry_builder_open(&builder, db->header.expiry_offset));
+    if (db->header.by_seq_root) {
+        rq.cmp.compare = seq_cmp;
+        rq.file = &db->file;
+        rq.num_keys = 1;
+        rq.keys = &start_list;
+        rq.fold = 1;
+        rq.callback_ctx = &builder;
+        rq.fetch_callback = build_fetchcb;
+        rq.node_callback = NULL;
+        error_pass(btree_lookup(&rq, db->header.by_seq_root->pointer));
+    }
+    error_pass(expiry_builder_finish(&builder, db));
+cleanup:
+    expiry_builder_free(&builder);
+    return errcode;
+}
+
+static int action_compare(const void *a, const void *b)
+{
+    const couchfile_modify_action *act1 = static_cast<const couchfile_modify_action *>(a);
+    const couchfile_modify_action *act2 = static_cast<const couchfile_modify_action *>(b);
+    return ebin_cmp(act1->key, act2->key);
+}
+
+couchstore_error_t db_expiry_modify(Db *db, couchfile_modify_action *acts, int count)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchfile_modify_request rq;
+    node_pointer *nroot;
+
+    if (count == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    // No two actions share a key, as no two entries share a sequence.
+    qsort(acts, count, sizeof(acts[0]), action_compare);
+
+    rq.cmp.compare = ebin_cmp;
+    rq.num_actions = count;
+    rq.actions = acts;
+    rq.fetch_callback = NULL;
+    rq.reduce = by_seq_reduce;
+    rq.rereduce = by_seq_rereduce;
+    rq.reduce_delta = NULL;
+    rq.file = &db->file;
+    rq.enable_purging = false;
+    rq.purge_kp = NULL;
+    rq.purge_kv = NULL;
+    rq.compacting = 0;
+    rq.kv_chunk_threshold = DB_CHUNK_THRESHOLD;
+    rq.kp_chunk_threshold = DB_CHUNK_THRESHOLD;
+
+    nroot = modify_btree(&rq, db->header.expiry_root, &errcode);
+    if (errcode == COUCHSTORE_SUCCESS && nroot != db->header.expiry_root) {
+        cs_free(db->header.expiry_root);
+        db->header.expiry_root = nroot;
+    }
+    return errcode;
+}
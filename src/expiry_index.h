@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_EXPIRY_INDEX_H
+#define LIBCOUCHSTORE_EXPIRY_INDEX_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+#include "bitfield.h"
+#include "couch_btree.h"
+#include "tree_writer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* The optional index of a Db's live documents by expiry time, a third
+       B-tree whose root is in the header along with where in the rev_meta
+       the time is. Its keys are a raw_expiry_key, and its values the
+       documents' IDs; its reduce is a count, as in the by-sequence trees
+       of old files. Deletions, and documents whose time is 0 or whose
+       rev_meta is too short for one, aren't in it. */
+    typedef struct {
+        raw_32 time;
+        raw_48 seq;
+    } raw_expiry_key;
+
+    /* The time offset of a header whose expiry part is only there for a
+       later part of the tail, without an index */
+#define EXPIRY_NO_INDEX 0xffff
+
+    /** Fills in an index key. */
+    void expiry_key(raw_expiry_key *key, uint32_t time, uint64_t seq);
+
+    /** The time a by-sequence entry's document expires, or 0 if it isn't
+        in the index. */
+    uint32_t expiry_of_seq_value(uint16_t offset, const sized_buf *v);
+
+    /** The same for a by-ID entry. */
+    uint32_t expiry_of_id_value(uint16_t offset, const sized_buf *v);
+
+    /* Builds an index from scratch, from by-sequence entries in any
+       order, sorting them through a TreeWriter. */
+    typedef struct {
+        TreeWriter *writer;
+        uint16_t offset;
+        uint64_t count;
+    } expiry_builder;
+
+    couchstore_error_t expiry_builder_open(expiry_builder *builder, uint16_t offset);
+
+    /** Adds the index entry of a by-sequence entry, if it has one. */
+    couchstore_error_t expiry_builder_add(expiry_builder *builder,
+                                          const sized_buf *k, const sized_buf *v);
+
+    /** Writes the index out as db's, replacing whatever db had. */
+    couchstore_error_t expiry_builder_finish(expiry_builder *builder, Db *db);
+
+    void expiry_builder_free(expiry_builder *builder);
+
+    /** Builds db's index from its by-sequence tree. */
+    couchstore_error_t db_expiry_build(Db *db);
+
+    /** Applies removals and insertions of index entries, in any order. */
+    couchstore_error_t db_expiry_modify(Db *db, couchfile_modify_action *acts,
+                                        int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
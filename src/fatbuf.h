@@ -12,6 +12,8 @@ extern "C" {
     fatbuf *fatbuf_alloc(size_t bytes);
     void *fatbuf_get(fatbuf *fb, size_t bytes);
     void fatbuf_free(fatbuf *fb);
+    /* Hands out the whole buffer again, for reuse */
+    void fatbuf_reset(fatbuf *fb);
 #ifdef __cplusplus
 }
 #endif
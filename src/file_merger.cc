@@ -23,47 +23,329 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+#include "bitfield.h"
+#include "codec.h"
 
 
-typedef struct {
-    void      *data;
-    unsigned  file;
-} record_t;
-
-#define FREE_RECORD(ctx, rec)                                \
-    do {                                                     \
-        (*(ctx)->free_record)((rec)->data, (ctx)->user_ctx); \
-        free((rec));                                         \
-    } while (0)
-
 struct file_merger_ctx_t;
 
+/*
+ * A tournament tree of losers over the head records of the files being
+ * merged. Each inner node keeps the file that lost the match played there,
+ * and node 0 the overall winner, so replacing the winner's head replays
+ * only the matches on its path to the root: about log2(num_files)
+ * comparisons per record, with nothing moved around.
+ */
 typedef struct {
     struct file_merger_ctx_t  *ctx;
-    record_t                  **data;
-    unsigned                  count;
-} sorted_vector_t;
+    void                      **heads;    /* per file, NULL once it's done */
+    unsigned                  *losers;
+    unsigned                  *winners;   /* for building the tree */
+} loser_tree_t;
 
 typedef struct file_merger_ctx_t {
     unsigned                       num_files;
-    FILE                           **files;
-    FILE                           *dest_file;
+    run_file_t                     *files;
+    run_file_t                     dest;
     file_merger_read_record_t      read_record;
     file_merger_write_record_t     write_record;
     file_merger_record_free_t      free_record;
     file_merger_compare_records_t  compare_records;
     file_merger_feed_record_t      feed_record;
+    file_merger_resolve_records_t  resolve_records;
     void                           *user_ctx;
-    sorted_vector_t                sorted_vector;
+    loser_tree_t                   tree;
+    void                           **equal;    /* records being resolved */
+    unsigned                       equal_size;
 } file_merger_ctx_t;
 
 
-static int  init_sorted_vector(sorted_vector_t *sorted_vector, unsigned max_elements, file_merger_ctx_t *ctx);
-static void sorted_vector_destroy(sorted_vector_t *sorted_vector);
-static record_t *sorted_vector_pop(sorted_vector_t *sorted_vector);
-static int  sorted_vector_add(sorted_vector_t *sorted_vector, record_t *record);
+static int  init_loser_tree(loser_tree_t *tree, unsigned num_files, file_merger_ctx_t *ctx);
+static void loser_tree_destroy(loser_tree_t *tree);
+static void loser_tree_build(loser_tree_t *tree);
+static void loser_tree_replay(loser_tree_t *tree, unsigned file);
 
 static file_merger_error_t do_merge_files(file_merger_ctx_t *ctx);
+static file_merger_error_t take_head(file_merger_ctx_t *ctx, unsigned file, void **record);
+static file_merger_error_t resolve_equal(file_merger_ctx_t *ctx, void **record);
+static file_merger_error_t emit_record(file_merger_ctx_t *ctx, void *record);
+
+
+/*
+ * A compressed run is a sequence of blocks, each a raw_32 length word,
+ * with the codec in its top bits as in a chunk's, then the block as the
+ * codec compressed it. The callbacks read and write a stream made with
+ * fopencookie over the blocks.
+ */
+#ifdef HAVE_FOPENCOOKIE
+typedef struct {
+    run_file_t *run;
+    int        writing;
+    unsigned   codec;
+    char       *block;              /* records not yet written or read */
+    size_t     len;
+    size_t     pos;                 /* of the next to read */
+    char       *packed;             /* a block as stored */
+    size_t     packed_size;
+} run_blocks_t;
+#endif
+
+
+static void run_file_prefetch(run_file_t *run, size_t bytes)
+{
+    run->consumed += bytes;
+#if !defined(WIN32) && defined(POSIX_FADV_WILLNEED)
+    /* Once the buffer being read from is the last one asked for, ask for
+       the one after it. Record sizes leave out their headers, so this
+       runs a little behind, which only shortens the lead. */
+    if (run->prefetched != 0 && run->consumed + run->buffer_size >= run->prefetched) {
+        posix_fadvise(fileno(run->raw), (off_t) run->prefetched,
+                      (off_t) run->buffer_size, POSIX_FADV_WILLNEED);
+        run->prefetched += run->buffer_size;
+    }
+#endif
+}
+
+
+#ifdef HAVE_FOPENCOOKIE
+static int run_blocks_flush(run_blocks_t *blocks)
+{
+    size_t size = blocks->packed_size;
+    raw_32 word;
+
+    if (blocks->len == 0) {
+        return 0;
+    }
+    if (codec_compress(NULL, blocks->codec, blocks->block, blocks->len,
+                       blocks->packed, &size) != COUCHSTORE_SUCCESS) {
+        return -1;
+    }
+    word = encode_raw32((uint32_t) size | (blocks->codec << CHUNK_CODEC_SHIFT));
+    if (fwrite(&word, sizeof(word), 1, blocks->run->raw) != 1 ||
+        fwrite(blocks->packed, size, 1, blocks->run->raw) != 1) {
+        return -1;
+    }
+    blocks->len = 0;
+    return 0;
+}
+
+
+static ssize_t run_blocks_write(void *cookie, const char *buf, size_t size)
+{
+    run_blocks_t *blocks = (run_blocks_t *) cookie;
+    size_t done = 0;
+
+    while (done < size) {
+        size_t n = RUN_FILE_BLOCK_SIZE - blocks->len;
+        if (n > size - done) {
+            n = size - done;
+        }
+        memcpy(blocks->block + blocks->len, buf + done, n);
+        blocks->len += n;
+        done += n;
+        if (blocks->len == RUN_FILE_BLOCK_SIZE && run_blocks_flush(blocks) != 0) {
+            return 0;
+        }
+    }
+
+    return (ssize_t) size;
+}
+
+
+static ssize_t run_blocks_read(void *cookie, char *buf, size_t size)
+{
+    run_blocks_t *blocks = (run_blocks_t *) cookie;
+    raw_32 word;
+    uint32_t length;
+    size_t n;
+
+    if (blocks->pos == blocks->len) {
+        char *block;
+        size_t len;
+
+        n = fread(&word, 1, sizeof(word), blocks->run->raw);
+        if (n == 0 && feof(blocks->run->raw)) {
+            return 0;
+        }
+        if (n != sizeof(word)) {
+            return -1;
+        }
+        length = decode_raw32(word);
+        n = length & CHUNK_LENGTH_MASK;
+        if (n > blocks->packed_size ||
+            fread(blocks->packed, n, 1, blocks->run->raw) != 1) {
+            return -1;
+        }
+        run_file_prefetch(blocks->run, sizeof(word) + n);
+        if (codec_uncompress(NULL, length >> CHUNK_CODEC_SHIFT, blocks->packed, n,
+                             &block, &len) != COUCHSTORE_SUCCESS) {
+            return -1;
+        }
+        cs_free(blocks->block);
+        blocks->block = block;
+        blocks->len = len;
+        blocks->pos = 0;
+    }
+
+    n = blocks->len - blocks->pos;
+    if (n > size) {
+        n = size;
+    }
+    memcpy(buf, blocks->block + blocks->pos, n);
+    blocks->pos += n;
+
+    return (ssize_t) n;
+}
+
+
+static void run_blocks_free(run_blocks_t *blocks)
+{
+    cs_free(blocks->block);
+    cs_free(blocks->packed);
+    cs_free(blocks);
+}
+
+
+static int run_blocks_close(void *cookie)
+{
+    run_blocks_t *blocks = (run_blocks_t *) cookie;
+    int ret = 0;
+
+    if (blocks->writing) {
+        ret = run_blocks_flush(blocks);
+    }
+    run_blocks_free(blocks);
+
+    return ret;
+}
+
+
+static file_merger_error_t run_blocks_open(run_file_t *run, int reading)
+{
+    cookie_io_functions_t io;
+    run_blocks_t *blocks;
+
+    blocks = (run_blocks_t *) cs_calloc(1, sizeof(run_blocks_t));
+    if (blocks == NULL) {
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+    blocks->run = run;
+    blocks->writing = !reading;
+    blocks->codec = codec_available(COUCHSTORE_CODEC_LZ4) ? CHUNK_CODEC_LZ4 : CHUNK_CODEC_SNAPPY;
+    blocks->packed_size = codec_max_compressed_length(blocks->codec, RUN_FILE_BLOCK_SIZE);
+    blocks->packed = (char *) cs_malloc(blocks->packed_size);
+    if (!reading) {
+        blocks->block = (char *) cs_malloc(RUN_FILE_BLOCK_SIZE);
+    }
+    if (blocks->packed == NULL || (!reading && blocks->block == NULL)) {
+        run_blocks_free(blocks);
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+
+    memset(&io, 0, sizeof(io));
+    io.read = run_blocks_read;
+    io.write = run_blocks_write;
+    io.close = run_blocks_close;
+    run->f = fopencookie(blocks, reading ? "rb" : "wb", io);
+    if (run->f == NULL) {
+        run_blocks_free(blocks);
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+    run->blocks = blocks;
+
+    return FILE_MERGER_SUCCESS;
+}
+#endif
+
+
+int run_file_compression_available(void)
+{
+#ifdef HAVE_FOPENCOOKIE
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+file_merger_error_t run_file_open(run_file_t *run,
+                                  const char *path,
+                                  const char *mode,
+                                  size_t io_buffer_size,
+                                  int compressed)
+{
+    memset(run, 0, sizeof(*run));
+    run->buffer_size = io_buffer_size ? io_buffer_size : FILE_MERGER_IO_BUFFER_SIZE;
+    run->raw = fopen(path, mode);
+    if (run->raw == NULL) {
+        return FILE_MERGER_ERROR_OPEN_FILE;
+    }
+    run->f = run->raw;
+
+    /* Without a buffer of its own the file reads and writes in stdio's
+       default of a few kilobytes. */
+    run->buffer = (char *) cs_malloc(run->buffer_size);
+    if (run->buffer != NULL) {
+        setvbuf(run->raw, run->buffer, _IOFBF, run->buffer_size);
+    }
+
+#if !defined(WIN32) && defined(POSIX_FADV_WILLNEED)
+    if (mode[0] == 'r') {
+        int fd = fileno(run->raw);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, (off_t) (2 * run->buffer_size), POSIX_FADV_WILLNEED);
+        run->prefetched = 2 * run->buffer_size;
+    }
+#endif
+
+#ifdef HAVE_FOPENCOOKIE
+    if (compressed) {
+        file_merger_error_t ret = run_blocks_open(run, mode[0] == 'r');
+        if (ret != FILE_MERGER_SUCCESS) {
+            run->f = NULL;
+            run_file_close(run);
+            return ret;
+        }
+    }
+#else
+    (void) compressed;
+#endif
+
+    return FILE_MERGER_SUCCESS;
+}
+
+
+void run_file_advance(run_file_t *run, size_t bytes)
+{
+    /* A compressed run counts the blocks it reads instead. */
+    if (run->blocks == NULL) {
+        run_file_prefetch(run, bytes);
+    }
+}
+
+
+file_merger_error_t run_file_close(run_file_t *run)
+{
+    file_merger_error_t ret = FILE_MERGER_SUCCESS;
+
+    /* Closing the stream of a compressed run writes out its last block. */
+    if (run->f != NULL && run->f != run->raw && fclose(run->f) != 0) {
+        ret = FILE_MERGER_ERROR_FILE_WRITE;
+    }
+    if (run->raw != NULL && fclose(run->raw) != 0) {
+        ret = FILE_MERGER_ERROR_FILE_WRITE;
+    }
+    run->f = NULL;
+    run->raw = NULL;
+    run->blocks = NULL;
+    cs_free(run->buffer);
+    run->buffer = NULL;
+
+    return ret;
+}
 
 
 file_merger_error_t merge_files(const char *source_files[],
@@ -74,7 +356,10 @@ file_merger_error_t merge_files(const char *source_files[],
                                 file_merger_feed_record_t feed_record,
                                 file_merger_compare_records_t compare_records,
                                 file_merger_record_free_t free_record,
+                                file_merger_resolve_records_t resolve_records,
                                 int skip_writeback,
+                                size_t io_buffer_size,
+                                unsigned compression,
                                 void *user_ctx)
 {
     file_merger_ctx_t ctx;
@@ -92,56 +377,61 @@ file_merger_error_t merge_files(const char *source_files[],
     ctx.compare_records = compare_records;
     ctx.user_ctx = user_ctx;
     ctx.feed_record = feed_record;
-
-    if (feed_record && skip_writeback) {
-        ctx.dest_file = NULL;
-    } else {
-        ctx.dest_file = fopen(dest_file, "ab");
+    ctx.resolve_records = resolve_records;
+    ctx.equal = NULL;
+    ctx.equal_size = 0;
+
+    memset(&ctx.dest, 0, sizeof(ctx.dest));
+    if (!(feed_record && skip_writeback)) {
+        run_file_open(&ctx.dest, dest_file, "ab", io_buffer_size,
+                      compression & FILE_MERGER_COMPRESSED_DEST);
     }
 
-    if (!init_sorted_vector(&ctx.sorted_vector, num_files, &ctx)) {
+    if (!init_loser_tree(&ctx.tree, num_files, &ctx)) {
+        run_file_close(&ctx.dest);
         return FILE_MERGER_ERROR_ALLOC;
     }
 
-    if (feed_record == NULL && ctx.dest_file == NULL) {
-        sorted_vector_destroy(&ctx.sorted_vector);
+    if (feed_record == NULL && ctx.dest.f == NULL) {
+        loser_tree_destroy(&ctx.tree);
+        run_file_close(&ctx.dest);
         return FILE_MERGER_ERROR_OPEN_FILE;
     }
 
-    ctx.files = (FILE **) malloc(sizeof(FILE *) * num_files);
+    ctx.files = (run_file_t *) cs_calloc(num_files, sizeof(run_file_t));
 
     if (ctx.files == NULL) {
-        sorted_vector_destroy(&ctx.sorted_vector);
-        fclose(ctx.dest_file);
+        loser_tree_destroy(&ctx.tree);
+        run_file_close(&ctx.dest);
         return FILE_MERGER_ERROR_ALLOC;
     }
 
     for (i = 0; i < num_files; ++i) {
-        ctx.files[i] = fopen(source_files[i], "rb");
+        ret = run_file_open(&ctx.files[i], source_files[i], "rb", io_buffer_size,
+                            compression & FILE_MERGER_COMPRESSED_SOURCES);
 
-        if (ctx.files[i] == NULL) {
+        if (ret != FILE_MERGER_SUCCESS) {
             for (j = 0; j < i; ++j) {
-                fclose(ctx.files[j]);
+                run_file_close(&ctx.files[j]);
             }
-            free(ctx.files);
-            fclose(ctx.dest_file);
-            sorted_vector_destroy(&ctx.sorted_vector);
+            cs_free(ctx.files);
+            run_file_close(&ctx.dest);
+            loser_tree_destroy(&ctx.tree);
 
-            return FILE_MERGER_ERROR_OPEN_FILE;
+            return ret;
         }
     }
 
     ret = do_merge_files(&ctx);
 
     for (i = 0; i < ctx.num_files; ++i) {
-        if (ctx.files[i] != NULL) {
-            fclose(ctx.files[i]);
-        }
+        run_file_close(&ctx.files[i]);
     }
-    free(ctx.files);
-    sorted_vector_destroy(&ctx.sorted_vector);
-    if (ctx.dest_file) {
-        fclose(ctx.dest_file);
+    cs_free(ctx.files);
+    cs_free(ctx.equal);
+    loser_tree_destroy(&ctx.tree);
+    if (run_file_close(&ctx.dest) != FILE_MERGER_SUCCESS && ret == FILE_MERGER_SUCCESS) {
+        ret = FILE_MERGER_ERROR_FILE_WRITE;
     }
 
     return ret;
@@ -150,170 +440,252 @@ file_merger_error_t merge_files(const char *source_files[],
 
 static file_merger_error_t do_merge_files(file_merger_ctx_t *ctx)
 {
+    loser_tree_t *tree = &ctx->tree;
     unsigned i;
 
     for (i = 0; i < ctx->num_files; ++i) {
-        FILE *f = ctx->files[i];
+        run_file_t *run = &ctx->files[i];
         int record_len;
         void *record_data;
-        record_t *record;
 
-        record_len = (*ctx->read_record)(f, &record_data, ctx->user_ctx);
+        record_len = (*ctx->read_record)(run->f, &record_data, ctx->user_ctx);
 
         if (record_len == 0) {
-            fclose(f);
-            ctx->files[i] = NULL;
+            run_file_close(run);
         } else if (record_len < 0) {
             return (file_merger_error_t) record_len;
         } else {
-            int rv;
-            record = (record_t *) malloc(sizeof(*record));
-            if (record == NULL) {
-                return FILE_MERGER_ERROR_ALLOC;
-            }
-            record->data = record_data;
-            record->file = i;
-            rv = sorted_vector_add(&ctx->sorted_vector, record);
-            assert(rv);
+            run_file_advance(run, (size_t) record_len);
+            tree->heads[i] = record_data;
         }
     }
 
-    while (ctx->sorted_vector.count != 0) {
-        record_t *record;
-        void *record_data;
-        int record_len;
+    loser_tree_build(tree);
+
+    while (tree->heads[tree->losers[0]] != NULL) {
+        void *record;
         file_merger_error_t ret;
 
-        record = sorted_vector_pop(&ctx->sorted_vector);
-        assert(record != NULL);
-        assert(ctx->files[record->file] != NULL);
+        ret = take_head(ctx, tree->losers[0], &record);
+        if (ret == FILE_MERGER_SUCCESS && ctx->resolve_records) {
+            ret = resolve_equal(ctx, &record);
+        }
+        if (ret == FILE_MERGER_SUCCESS) {
+            ret = emit_record(ctx, record);
+        }
+        if (record != NULL) {
+            (*ctx->free_record)(record, ctx->user_ctx);
+        }
+        if (ret != FILE_MERGER_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return FILE_MERGER_SUCCESS;
+}
+
+
+/* Takes a file's head record, reading the next one in its place. */
+static file_merger_error_t take_head(file_merger_ctx_t *ctx,
+                                     unsigned file,
+                                     void **record)
+{
+    loser_tree_t *tree = &ctx->tree;
+    run_file_t *run = &ctx->files[file];
+    void *record_data;
+    int record_len;
+
+    assert(run->f != NULL);
+
+    *record = tree->heads[file];
+    tree->heads[file] = NULL;
+    record_len = (*ctx->read_record)(run->f, &record_data, ctx->user_ctx);
+
+    if (record_len < 0) {
+        return (file_merger_error_t) record_len;
+    }
+    if (record_len == 0) {
+        run_file_close(run);
+    } else {
+        run_file_advance(run, (size_t) record_len);
+        tree->heads[file] = record_data;
+    }
+    loser_tree_replay(tree, file);
+
+    return FILE_MERGER_SUCCESS;
+}
 
-        if (ctx->feed_record) {
-            ret = (*ctx->feed_record)(record->data, ctx->user_ctx);
-            if (ret != FILE_MERGER_SUCCESS) {
-                FREE_RECORD(ctx, record);
-                return ret;
+
+/*
+ * Takes the heads equal to record after it, and leaves in record the one
+ * resolve_records keeps, freeing the rest; on failure, frees them all and
+ * leaves NULL.
+ */
+static file_merger_error_t resolve_equal(file_merger_ctx_t *ctx, void **record)
+{
+    loser_tree_t *tree = &ctx->tree;
+    file_merger_error_t ret = FILE_MERGER_SUCCESS;
+    unsigned n = 1, i;
+    int keep;
+
+    while (tree->heads[tree->losers[0]] != NULL &&
+           (*ctx->compare_records)(*record, tree->heads[tree->losers[0]],
+                                   ctx->user_ctx) == 0) {
+        if (n == ctx->equal_size || ctx->equal == NULL) {
+            /* Duplicates within a file can outnumber the files. */
+            unsigned size = ctx->equal ? n * 2 : ctx->num_files + 1;
+            void **equal = (void **) cs_realloc(ctx->equal, size * sizeof(void *));
+            if (equal == NULL) {
+                ret = FILE_MERGER_ERROR_ALLOC;
+                break;
             }
-        } else {
-            assert(ctx->dest_file != NULL);
+            ctx->equal = equal;
+            ctx->equal_size = size;
+        }
+        ctx->equal[0] = *record;
+        ret = take_head(ctx, tree->losers[0], &ctx->equal[n]);
+        n++;
+        if (ret != FILE_MERGER_SUCCESS) {
+            break;
         }
+    }
 
-        if (ctx->dest_file) {
-            ret = (*ctx->write_record)(ctx->dest_file, record->data, ctx->user_ctx);
-            if (ret != FILE_MERGER_SUCCESS) {
-                FREE_RECORD(ctx, record);
-                return ret;
-            }
+    if (n == 1) {
+        return ret;
+    }
+    keep = -1;
+    if (ret == FILE_MERGER_SUCCESS) {
+        keep = (*ctx->resolve_records)(ctx->equal, n, ctx->user_ctx);
+        if (keep < 0) {
+            ret = (file_merger_error_t) keep;
+        } else if ((unsigned) keep >= n) {
+            ret = FILE_MERGER_ERROR_BAD_ARG;
+            keep = -1;
         }
+    }
+    for (i = 0; i < n; ++i) {
+        if ((int) i != keep && ctx->equal[i] != NULL) {
+            (*ctx->free_record)(ctx->equal[i], ctx->user_ctx);
+        }
+    }
+    *record = keep >= 0 ? ctx->equal[keep] : NULL;
+
+    return ret;
+}
 
-        record_len = (*ctx->read_record)(ctx->files[record->file],
-                                         &record_data,
-                                         ctx->user_ctx);
 
-        if (record_len == 0) {
-            fclose(ctx->files[record->file]);
-            ctx->files[record->file] = NULL;
-            FREE_RECORD(ctx, record);
-        } else if (record_len < 0) {
-            FREE_RECORD(ctx, record);
-            return (file_merger_error_t) record_len;
-        } else {
-            int rv;
-            (*ctx->free_record)(record->data, ctx->user_ctx);
-            record->data = record_data;
-            rv = sorted_vector_add(&ctx->sorted_vector, record);
-            assert(rv);
+static file_merger_error_t emit_record(file_merger_ctx_t *ctx, void *record)
+{
+    file_merger_error_t ret;
+
+    if (ctx->feed_record) {
+        ret = (*ctx->feed_record)(record, ctx->user_ctx);
+        if (ret != FILE_MERGER_SUCCESS) {
+            return ret;
         }
+    } else {
+        assert(ctx->dest.f != NULL);
+    }
 
+    if (ctx->dest.f) {
+        return (*ctx->write_record)(ctx->dest.f, record, ctx->user_ctx);
     }
 
     return FILE_MERGER_SUCCESS;
 }
 
 
-static int init_sorted_vector(sorted_vector_t *sorted_vector,
-                              unsigned max_elements,
-                              file_merger_ctx_t *ctx)
+static int init_loser_tree(loser_tree_t *tree,
+                           unsigned num_files,
+                           file_merger_ctx_t *ctx)
 {
-    sorted_vector->data = (record_t **) malloc(sizeof(record_t *) * max_elements);
-    if (sorted_vector->data == NULL) {
+    tree->ctx = ctx;
+    tree->heads = (void **) cs_calloc(num_files, sizeof(void *));
+    tree->losers = (unsigned *) cs_calloc(num_files, sizeof(unsigned));
+    tree->winners = (unsigned *) cs_calloc(2 * num_files, sizeof(unsigned));
+    if (tree->heads == NULL || tree->losers == NULL || tree->winners == NULL) {
+        cs_free(tree->heads);
+        cs_free(tree->losers);
+        cs_free(tree->winners);
         return 0;
     }
 
-    sorted_vector->count = 0;
-    sorted_vector->ctx = ctx;
-
     return 1;
 }
 
 
-static void sorted_vector_destroy(sorted_vector_t *sorted_vector)
+static void loser_tree_destroy(loser_tree_t *tree)
 {
     unsigned i;
 
-    for (i = 0; i < sorted_vector->count; ++i) {
-        FREE_RECORD(sorted_vector->ctx, sorted_vector->data[i]);
+    for (i = 0; i < tree->ctx->num_files; ++i) {
+        if (tree->heads[i] != NULL) {
+            (*tree->ctx->free_record)(tree->heads[i], tree->ctx->user_ctx);
+        }
     }
 
-    free(sorted_vector->data);
+    cs_free(tree->heads);
+    cs_free(tree->losers);
+    cs_free(tree->winners);
 }
 
 
-static record_t *sorted_vector_pop(sorted_vector_t *sorted_vector)
+/* Whether file a's head goes out before file b's. Files that are done
+   lose to any other, and ties go to the lower file. */
+static int loser_tree_beats(const loser_tree_t *tree, unsigned a, unsigned b)
 {
-    record_t *min;
+    const void *x = tree->heads[a], *y = tree->heads[b];
+    int cmp;
 
-    if (sorted_vector->count == 0) {
-        return NULL;
+    if (x == NULL || y == NULL) {
+        return y == NULL && (x != NULL || a < b);
     }
+    cmp = (*tree->ctx->compare_records)(x, y, tree->ctx->user_ctx);
 
-    min = sorted_vector->data[0];
-    sorted_vector->count--;
-    memmove(sorted_vector->data + 0, sorted_vector->data + 1, sizeof(sorted_vector->data[0])*(sorted_vector->count));
-
-    return min;
+    return cmp < 0 || (cmp == 0 && a < b);
 }
 
 
-#define SORTED_VECTOR_LESS(h, a, b)  \
-    ((*(h)->ctx->compare_records)((a)->data, (b)->data, (h)->ctx->user_ctx) < 0)
-
-static int sorted_vector_add(sorted_vector_t *sorted_vector, record_t *record)
+/*
+ * The files are the leaves, num_files + i for file i, and the matches
+ * the nodes 1 to num_files - 1 above them, node n between nodes 2n and
+ * 2n + 1, which makes a complete binary tree for any number of files.
+ */
+static void loser_tree_build(loser_tree_t *tree)
 {
-    unsigned l, r;
+    unsigned k = tree->ctx->num_files;
+    unsigned n;
 
-    if (sorted_vector->count == sorted_vector->ctx->num_files) {
-        /* sorted_vector full */
-        return 0;
+    for (n = 0; n < k; ++n) {
+        tree->winners[k + n] = n;
     }
+    for (n = k - 1; n >= 1; --n) {
+        unsigned a = tree->winners[2 * n], b = tree->winners[2 * n + 1];
 
-    l = 0;
-    r = sorted_vector->count;
-    while (r - l > 1) {
-        unsigned pos = (l + r) / 2;
-
-        if (SORTED_VECTOR_LESS(sorted_vector, record, sorted_vector->data[pos])) {
-            r = pos;
+        if (loser_tree_beats(tree, a, b)) {
+            tree->winners[n] = a;
+            tree->losers[n] = b;
         } else {
-            l = pos;
-        }
-    }
-
-    if (l == 0 && r != 0) {
-        if (SORTED_VECTOR_LESS(sorted_vector, record, sorted_vector->data[0])) {
-            r = 0;
+            tree->winners[n] = b;
+            tree->losers[n] = a;
         }
     }
+    tree->losers[0] = k > 1 ? tree->winners[1] : 0;
+}
 
-    if (r < sorted_vector->count) {
-        memmove(sorted_vector->data + r + 1,
-                sorted_vector->data + r,
-                sizeof(sorted_vector->data[0]) * (sorted_vector->count - r));
-    }
 
-    sorted_vector->count += 1;
+/* Replays the matches of a file whose head changed, which was the winner. */
+static void loser_tree_replay(loser_tree_t *tree, unsigned file)
+{
+    unsigned n = (tree->ctx->num_files + file) / 2;
 
-    sorted_vector->data[r] = record;
+    for (; n >= 1; n /= 2) {
+        if (loser_tree_beats(tree, tree->losers[n], file)) {
+            unsigned loser = file;
 
-    return 1;
+            file = tree->losers[n];
+            tree->losers[n] = loser;
+        }
+    }
+    tree->losers[0] = file;
 }
@@ -24,6 +24,7 @@
 #include "config.h"
 #include <stdio.h>
 #include <libcouchstore/couch_db.h>
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,6 +49,17 @@ extern "C" {
                                              void **record_buffer,
                                              void *user_ctx);
 
+    /*
+     * Reads a record as file_merger_read_record_t does, but allocates it
+     * from slab instead of with malloc. Such records are never given to
+     * the record free function: the slab is freed whole once they're all
+     * done with.
+     */
+    typedef int (*file_merger_read_record_slab_t)(FILE *f,
+                                                  void **record_buffer,
+                                                  arena *slab,
+                                                  void *user_ctx);
+
     /*
      * Returns FILE_MERGER_SUCCESS on success, another file_merger_error_t
      * value otherwise.
@@ -68,10 +80,35 @@ extern "C" {
     typedef void  (*file_merger_record_free_t)(void *record,
                                                void *user_ctx);
 
+    /*
+     * Points key at bytes the record sorts by: records whose bytes differ
+     * compare as memcmp has them, a prefix before what it starts, and
+     * those whose bytes are equal are left to the compare function.
+     * Returns 0 if the record has no such bytes.
+     */
+    typedef int (*file_merger_record_sort_key_t)(const void *record,
+                                                 sized_buf *key,
+                                                 void *user_ctx);
+
     /* Callback which gets called for resulting merge records */
     typedef file_merger_error_t (*file_merger_feed_record_t)(void *record_buffer,
                                                              void *user_ctx);
 
+    /*
+     * Chooses which of n records that compare equal is kept, the others
+     * being freed, and may first combine them into it. They are in the
+     * order of the files they were read from, and of each file. Returns
+     * the index of the one kept, or a negative file_merger_error_t value.
+     */
+    typedef int (*file_merger_resolve_records_t)(void *records[],
+                                                 unsigned n,
+                                                 void *user_ctx);
+
+    /*
+     * Merges the sorted source files into dest_file, or feeds the records
+     * to feed_record, or both. With resolve_records, records that compare
+     * equal come out as the one it picks; without it, all of them do.
+     */
     file_merger_error_t merge_files(const char *source_files[],
                                     unsigned num_files,
                                     const char *dest_file,
@@ -80,9 +117,66 @@ extern "C" {
                                     file_merger_feed_record_t feed_record,
                                     file_merger_compare_records_t compare_records,
                                     file_merger_record_free_t free_record,
+                                    file_merger_resolve_records_t resolve_records,
                                     int skip_writeback,
+                                    size_t io_buffer_size,
+                                    unsigned compression,
                                     void *user_ctx);
 
+    /* Buffer given to each file merged or sorted when 0 is asked for */
+#define FILE_MERGER_IO_BUFFER_SIZE (1024 * 1024)
+
+    /* Flags of merge_files' compression: which of its files are runs
+       compressed in blocks (see run_file_open) rather than plain records. */
+#define FILE_MERGER_COMPRESSED_SOURCES 0x1
+#define FILE_MERGER_COMPRESSED_DEST    0x2
+
+    /* Records compressed per block of a compressed run */
+#define RUN_FILE_BLOCK_SIZE (64 * 1024)
+
+    /*
+     * A file of records read or written sequentially through a stdio
+     * buffer of its own, of io_buffer_size bytes. One read from is also
+     * prefetched a buffer ahead of what's been taken from it (see
+     * run_file_advance), so that the system reads the next buffer in while
+     * records are parsed from this one, and a merge of many files doesn't
+     * wait on each one's reads in turn.
+     *
+     * A compressed run hands the callbacks a stream of its own as f, which
+     * compresses what's written to it in blocks of RUN_FILE_BLOCK_SIZE
+     * bytes onto raw, and reads them back the same way. It must not be
+     * moved while it's open.
+     */
+    typedef struct {
+        FILE     *f;                /* what records are read and written on */
+        FILE     *raw;              /* the file itself */
+        void     *blocks;           /* of a compressed run */
+        char     *buffer;
+        size_t   buffer_size;
+        uint64_t consumed;          /* bytes of records read */
+        uint64_t prefetched;        /* bytes asked to be read in */
+    } run_file_t;
+
+    /* Opens path with the fopen mode given; io_buffer_size 0 is the default.
+       A compressed run is written from the start whatever the mode, and is
+       only compressed if run_file_compression_available(). */
+    file_merger_error_t run_file_open(run_file_t *run,
+                                      const char *path,
+                                      const char *mode,
+                                      size_t io_buffer_size,
+                                      int compressed);
+
+    /* Whether runs can be compressed: they need streams of our own, which
+       not every C library can make. */
+    int run_file_compression_available(void);
+
+    /* Counts a record of the given size read, prefetching if it's due. */
+    void run_file_advance(run_file_t *run, size_t bytes);
+
+    /* Closes the file if it's open, and frees its buffer. Fails if what was
+       left to write couldn't be. */
+    file_merger_error_t run_file_close(run_file_t *run);
+
 
 #ifdef __cplusplus
 }
@@ -24,10 +24,17 @@
 #include <string.h>
 #include "file_sorter.h"
 #include "file_name_utils.h"
+#include "probes.h"
+#include "alloc.h"
 
 #define NSORT_RECORDS_INIT 500000
 #define NSORT_RECORD_INCR  100000
-#define NSORT_THREADS 2
+#define NSORT_MAX_THREADS  64
+#define NSORT_SLAB_CHUNK_SIZE (1024 * 1024)
+/* Runs with fewer records are sorted with compare_records alone, and
+   radix sort buckets with fewer by insertion */
+#define NSORT_RADIX_MIN    256
+#define NSORT_RADIX_SMALL  32
 
 typedef struct {
     char     *name;
@@ -39,14 +46,19 @@ typedef struct {
     const char                   *source_file;
     char                         *tmp_file_prefix;
     unsigned                      num_tmp_files;
-    unsigned                      max_buffer_size;
+    size_t                        max_buffer_size;
+    unsigned                      num_threads;
+    size_t                        io_buffer_size;
+    int                           compress_tmp_files;
     file_merger_read_record_t     read_record;
+    file_merger_read_record_slab_t read_record_slab;
     file_merger_write_record_t    write_record;
     file_merger_feed_record_t     feed_record;
     file_merger_compare_records_t compare_records;
+    file_merger_record_sort_key_t record_sort_key;
     file_merger_record_free_t     free_record;
     void                         *user_ctx;
-    FILE                         *f;
+    run_file_t                    source;
     tmp_file_t                   *tmp_files;
     unsigned                      active_tmp_files;
     int                           skip_writeback;
@@ -56,6 +68,7 @@ typedef struct {
 typedef struct {
     void       **j;
     size_t     n;
+    arena      *slab;           // the records were read into, or NULL
     tmp_file_t *t;
 } sort_job_t;
 
@@ -71,6 +84,36 @@ typedef struct {
     cb_thread_t         *threads;
 } parallel_sorter_t;
 
+// For radix sorts of runs
+typedef struct {
+    const unsigned char *key;
+    size_t              size;
+    void                *record;
+} radix_record_t;
+
+typedef struct {
+    size_t lo;
+    size_t hi;
+    size_t depth;               // bytes of key all of lo..hi share
+} radix_range_t;
+
+typedef struct {
+    radix_range_t *ranges;
+    size_t        count;
+    size_t        size;
+} radix_ranges_t;
+
+// For parallel merges
+typedef struct {
+    file_sort_ctx_t     *ctx;
+    unsigned            start;
+    unsigned            end;
+    unsigned            next_level;
+    const char          **files;
+    char                *dest;
+    file_sorter_error_t ret;
+} merge_job_t;
+
 
 static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx);
 
@@ -79,15 +122,19 @@ static void sort_records(void **records, size_t n,
 
 static tmp_file_t *create_tmp_file(file_sort_ctx_t *ctx);
 
+static file_sorter_error_t feed_record_list(void **records,
+                                            size_t n,
+                                            arena *slab,
+                                            file_merger_feed_record_t feed_record,
+                                            file_sort_ctx_t *ctx);
+
 static file_sorter_error_t write_record_list(void **records,
                                              size_t n,
+                                             arena *slab,
                                              tmp_file_t *tmp_file,
                                              file_sort_ctx_t *ctx);
 
-static void pick_merge_files(file_sort_ctx_t *ctx,
-                             unsigned *start,
-                             unsigned *end,
-                             unsigned *next_level);
+static file_sorter_error_t merge_tmp_levels(file_sort_ctx_t *ctx);
 
 static file_sorter_error_t merge_tmp_files(file_sort_ctx_t *ctx,
                                            unsigned start,
@@ -98,7 +145,8 @@ static file_sorter_error_t iterate_records_file(file_sort_ctx_t *ctx,
                                                 const char *file);
 
 
-static sort_job_t *create_sort_job(void **recs, size_t n, tmp_file_t *t);
+static sort_job_t *create_sort_job(void **recs, size_t n, arena *slab,
+                                   tmp_file_t *t);
 
 static void free_sort_job(sort_job_t *job);
 
@@ -111,7 +159,8 @@ static void sort_worker(void *args);
 
 static file_sorter_error_t parallel_sorter_addjob(parallel_sorter_t *s,
                                                   void **records,
-                                                  size_t n);
+                                                  size_t n,
+                                                  arena *slab);
 
 static file_sorter_error_t parallel_sorter_wait(parallel_sorter_t *s, size_t n);
 
@@ -120,11 +169,16 @@ static file_sorter_error_t parallel_sorter_finish(parallel_sorter_t *s);
 file_sorter_error_t sort_file(const char *source_file,
                               const char *tmp_dir,
                               unsigned num_tmp_files,
-                              unsigned max_buffer_size,
+                              size_t memory_budget,
+                              unsigned num_threads,
+                              size_t io_buffer_size,
+                              int compress_tmp_files,
                               file_merger_read_record_t read_record,
+                              file_merger_read_record_slab_t read_record_slab,
                               file_merger_write_record_t write_record,
                               file_merger_feed_record_t feed_record,
                               file_merger_compare_records_t compare_records,
+                              file_merger_record_sort_key_t record_sort_key,
                               file_merger_record_free_t free_record,
                               int skip_writeback,
                               void *user_ctx)
@@ -136,6 +190,11 @@ file_sorter_error_t sort_file(const char *source_file,
     if (num_tmp_files <= 1) {
         return FILE_SORTER_ERROR_BAD_ARG;
     }
+    if (num_threads == 0) {
+        num_threads = 1;
+    } else if (num_threads > NSORT_MAX_THREADS) {
+        num_threads = NSORT_MAX_THREADS;
+    }
 
     ctx.tmp_file_prefix = file_basename(source_file);
     if (ctx.tmp_file_prefix == NULL) {
@@ -145,11 +204,20 @@ file_sorter_error_t sort_file(const char *source_file,
     ctx.tmp_dir = tmp_dir;
     ctx.source_file = source_file;
     ctx.num_tmp_files = num_tmp_files;
-    ctx.max_buffer_size = max_buffer_size;
+    /* The buffer being filled, and one being sorted by each thread */
+    ctx.max_buffer_size = memory_budget / (num_threads + 1);
+    if (ctx.max_buffer_size == 0) {
+        ctx.max_buffer_size = 1;
+    }
+    ctx.num_threads = num_threads;
+    ctx.io_buffer_size = io_buffer_size;
+    ctx.compress_tmp_files = compress_tmp_files && run_file_compression_available();
     ctx.read_record = read_record;
+    ctx.read_record_slab = read_record_slab;
     ctx.write_record = write_record;
     ctx.feed_record = feed_record;
     ctx.compare_records = compare_records;
+    ctx.record_sort_key = record_sort_key;
     ctx.free_record = free_record;
     ctx.user_ctx = user_ctx;
     ctx.active_tmp_files = 0;
@@ -159,17 +227,16 @@ file_sorter_error_t sort_file(const char *source_file,
         return FILE_SORTER_ERROR_MISSING_CALLBACK;
     }
 
-    ctx.f = fopen(source_file, "rb");
-    if (ctx.f == NULL) {
-        free(ctx.tmp_file_prefix);
+    if (run_file_open(&ctx.source, source_file, "rb", io_buffer_size, 0) != FILE_MERGER_SUCCESS) {
+        cs_free(ctx.tmp_file_prefix);
         return FILE_SORTER_ERROR_OPEN_FILE;
     }
 
-    ctx.tmp_files = (tmp_file_t *) malloc(sizeof(tmp_file_t) * num_tmp_files);
+    ctx.tmp_files = (tmp_file_t *) cs_malloc(sizeof(tmp_file_t) * num_tmp_files);
 
     if (ctx.tmp_files == NULL) {
-        fclose(ctx.f);
-        free(ctx.tmp_file_prefix);
+        run_file_close(&ctx.source);
+        cs_free(ctx.tmp_file_prefix);
         return FILE_SORTER_ERROR_ALLOC;
     }
 
@@ -180,28 +247,28 @@ file_sorter_error_t sort_file(const char *source_file,
 
     ret = do_sort_file(&ctx);
 
-    if (ctx.f != NULL) {
-        fclose(ctx.f);
-    }
+    run_file_close(&ctx.source);
     for (i = 0; i < ctx.active_tmp_files; ++i) {
         if (ctx.tmp_files[i].name != NULL) {
             remove(ctx.tmp_files[i].name);
-            free(ctx.tmp_files[i].name);
+            cs_free(ctx.tmp_files[i].name);
         }
     }
-    free(ctx.tmp_files);
-    free(ctx.tmp_file_prefix);
+    cs_free(ctx.tmp_files);
+    cs_free(ctx.tmp_file_prefix);
 
     return ret;
 }
 
 
-static sort_job_t *create_sort_job(void **recs, size_t n, tmp_file_t *t)
+static sort_job_t *create_sort_job(void **recs, size_t n, arena *slab,
+                                   tmp_file_t *t)
 {
-    sort_job_t *job = (sort_job_t *) calloc(1, sizeof(sort_job_t));
+    sort_job_t *job = (sort_job_t *) cs_calloc(1, sizeof(sort_job_t));
     if (job) {
         job->j = recs;
         job->n = n;
+        job->slab = slab;
         job->t = t;
     }
 
@@ -211,8 +278,11 @@ static sort_job_t *create_sort_job(void **recs, size_t n, tmp_file_t *t)
 
 static void free_sort_job(sort_job_t *job)
 {
-    free(job->j);
-    free(job);
+    if (job->slab) {
+        delete_arena(job->slab);
+    }
+    cs_free(job->j);
+    cs_free(job);
 }
 
 
@@ -220,7 +290,7 @@ static parallel_sorter_t *create_parallel_sorter(size_t workers,
                                                  file_sort_ctx_t *ctx)
 {
     size_t i;
-    parallel_sorter_t *s = (parallel_sorter_t *) calloc(1, sizeof(parallel_sorter_t));
+    parallel_sorter_t *s = (parallel_sorter_t *) cs_calloc(1, sizeof(parallel_sorter_t));
     if (!s) {
         return NULL;
     }
@@ -234,16 +304,16 @@ static parallel_sorter_t *create_parallel_sorter(size_t workers,
     s->job = NULL;
     s->ctx = ctx;
 
-    s->threads = (cb_thread_t *) calloc(workers, sizeof(cb_thread_t));
+    s->threads = (cb_thread_t *) cs_calloc(workers, sizeof(cb_thread_t));
     if (!s->threads) {
-        free(s);
+        cs_free(s);
         return NULL;
     }
 
     for (i = 0; i < workers; i++) {
         if (cb_create_thread(&s->threads[i], &sort_worker, (void *) s, 0) < 0) {
-            free(s->threads);
-            free(s);
+            cs_free(s->threads);
+            cs_free(s);
             return NULL;
         }
     }
@@ -258,13 +328,16 @@ static void free_parallel_sorter(parallel_sorter_t *s)
         cb_mutex_destroy(&s->mutex);
         cb_cond_destroy(&s->cond);
         if (s->job) {
-            free(s->job->t);
-            free(s->job->j);
+            cs_free(s->job->t);
+            cs_free(s->job->j);
+            if (s->job->slab) {
+                delete_arena(s->job->slab);
+            }
         }
 
-        free(s->job);
-        free(s->threads);
-        free(s);
+        cs_free(s->job);
+        cs_free(s->threads);
+        cs_free(s);
     }
 }
 
@@ -295,7 +368,7 @@ static void sort_worker(void *args)
             cb_mutex_exit(&s->mutex);
             cb_cond_broadcast(&s->cond);
 
-            ret = write_record_list(job->j, job->n, job->t, s->ctx);
+            ret = write_record_list(job->j, job->n, job->slab, job->t, s->ctx);
             free_sort_job(job);
             if (ret != FILE_SORTER_SUCCESS) {
                 cb_mutex_enter(&s->mutex);
@@ -323,7 +396,8 @@ static void sort_worker(void *args)
  // Add a job and block wait until a worker picks up the job
 static file_sorter_error_t parallel_sorter_addjob(parallel_sorter_t *s,
                                                   void **records,
-                                                  size_t n)
+                                                  size_t n,
+                                                  arena *slab)
 {
     file_sorter_error_t ret;
     sort_job_t *job;
@@ -333,7 +407,7 @@ static file_sorter_error_t parallel_sorter_addjob(parallel_sorter_t *s,
         return FILE_SORTER_ERROR_MK_TMP_FILE;
     }
 
-    job = create_sort_job(records, n, tmp_file);
+    job = create_sort_job(records, n, slab, tmp_file);
     if (!job) {
         return FILE_SORTER_ERROR_ALLOC;
     }
@@ -404,7 +478,7 @@ static file_sorter_error_t parallel_sorter_finish(parallel_sorter_t *s)
 
 static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
 {
-    unsigned buffer_size = 0;
+    size_t buffer_size = 0;
     size_t i = 0;
     size_t record_count = NSORT_RECORDS_INIT;
     void *record;
@@ -412,13 +486,14 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
     file_sorter_error_t ret;
     file_merger_feed_record_t feed_record = ctx->feed_record;
     parallel_sorter_t *sorter;
-    void **records = (void **) calloc(record_count, sizeof(void *));
+    arena *slab = NULL;
+    void **records = (void **) cs_calloc(record_count, sizeof(void *));
 
     if (records == NULL) {
         return FILE_SORTER_ERROR_ALLOC;
     }
 
-    sorter = create_parallel_sorter(NSORT_THREADS, ctx);
+    sorter = create_parallel_sorter(ctx->num_threads, ctx);
     if (sorter == NULL) {
         return FILE_SORTER_ERROR_ALLOC;
     }
@@ -427,35 +502,51 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
 
     i = 0;
     while (1) {
-        record_size = (*ctx->read_record)(ctx->f, &record, ctx->user_ctx);
+        if (ctx->read_record_slab) {
+            if (slab == NULL) {
+                /* Runs smaller than a slab chunk make do with the default */
+                slab = new_arena(ctx->max_buffer_size < NSORT_SLAB_CHUNK_SIZE ?
+                                 0 : NSORT_SLAB_CHUNK_SIZE);
+                if (slab == NULL) {
+                    ret = FILE_SORTER_ERROR_ALLOC;
+                    goto failure;
+                }
+            }
+            record_size = (*ctx->read_record_slab)(ctx->source.f, &record,
+                                                   slab, ctx->user_ctx);
+        } else {
+            record_size = (*ctx->read_record)(ctx->source.f, &record, ctx->user_ctx);
+        }
         if (record_size < 0) {
            ret = (file_sorter_error_t) record_size;
            goto failure;
         } else if (record_size == 0) {
             break;
         }
+        run_file_advance(&ctx->source, (size_t) record_size);
 
         if (records == NULL) {
-            records = (void **) calloc(record_count, sizeof(void *));
+            records = (void **) cs_calloc(record_count, sizeof(void *));
         }
 
         records[i++] = record;
         if (i == record_count) {
             record_count += NSORT_RECORD_INCR;
-            records = (void **) realloc(records, record_count * sizeof(void *));
+            records = (void **) cs_realloc(records, record_count * sizeof(void *));
             if (records == NULL) {
                 ret =  FILE_SORTER_ERROR_ALLOC;
                 goto failure;
             }
         }
 
-        buffer_size += (unsigned) record_size;
+        buffer_size += (size_t) record_size;
 
         if (buffer_size >= ctx->max_buffer_size) {
-            ret = parallel_sorter_addjob(sorter, records, i);
+            ret = parallel_sorter_addjob(sorter, records, i, slab);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto failure;
             }
+            slab = NULL;
 
             ret = parallel_sorter_wait(sorter, 1);
             if (ret != FILE_SORTER_SUCCESS) {
@@ -469,35 +560,49 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
         }
 
         if (ctx->active_tmp_files >= ctx->num_tmp_files) {
-            unsigned start, end, next_level;
-
-            ret = parallel_sorter_wait(sorter, NSORT_THREADS);
+            ret = parallel_sorter_wait(sorter, ctx->num_threads);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto failure;
             }
 
-            pick_merge_files(ctx, &start, &end, &next_level);
-            assert(next_level > 1);
-            ret = merge_tmp_files(ctx, start, end, next_level);
+            ret = merge_tmp_levels(ctx);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto failure;
             }
         }
     }
 
-    fclose(ctx->f);
-    ctx->f = NULL;
+    run_file_close(&ctx->source);
+
+    if (buffer_size == 0 && slab != NULL) {
+        /* Made for a run that turned out to have no records */
+        delete_arena(slab);
+        slab = NULL;
+    }
 
     if (ctx->active_tmp_files == 0 && buffer_size == 0) {
         /* empty source file */
         return FILE_SORTER_SUCCESS;
     }
 
+    if (ctx->active_tmp_files == 0 && ctx->skip_writeback) {
+        /* It all fit in memory, and only the callback wants it: no run
+           needs writing and reading back. */
+        ret = parallel_sorter_finish(sorter);
+        if (ret == FILE_SORTER_SUCCESS) {
+            ret = feed_record_list(records, i, slab, feed_record, ctx);
+            slab = NULL;
+        }
+        free_parallel_sorter(sorter);
+        return ret;
+    }
+
     if (buffer_size > 0) {
-        ret = parallel_sorter_addjob(sorter, records, i);
+        ret = parallel_sorter_addjob(sorter, records, i, slab);
         if (ret != FILE_SORTER_SUCCESS) {
             goto failure;
         }
+        slab = NULL;
     }
 
     ret = parallel_sorter_finish(sorter);
@@ -514,7 +619,7 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
 
     // Restore feed_record callback for final merge */
     ctx->feed_record = feed_record;
-    if (ctx->active_tmp_files == 1) {
+    if (ctx->active_tmp_files == 1 && !ctx->compress_tmp_files) {
         if (ctx->feed_record) {
             ret = iterate_records_file(ctx, ctx->tmp_files[0].name);
             if (ret != FILE_SORTER_SUCCESS) {
@@ -532,7 +637,8 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
             ret = FILE_SORTER_ERROR_RENAME_FILE;
             goto failure;
         }
-    } else if (ctx->active_tmp_files > 1) {
+    } else {
+        /* A single compressed file is merged on its own to uncompress it. */
         ret = merge_tmp_files(ctx, 0, ctx->active_tmp_files, 0);
         if (ret != FILE_SORTER_SUCCESS) {
             goto failure;
@@ -542,49 +648,90 @@ static file_sorter_error_t do_sort_file(file_sort_ctx_t *ctx)
     ret = FILE_SORTER_SUCCESS;
 
  failure:
+    if (slab != NULL) {
+        delete_arena(slab);
+    }
     free_parallel_sorter(sorter);
     return ret;
 }
 
 
+/* Sorts the records and hands them to feed_record, freeing them, their
+   slab if they were read into one, and the list. */
+static file_sorter_error_t feed_record_list(void **records,
+                                            size_t n,
+                                            arena *slab,
+                                            file_merger_feed_record_t feed_record,
+                                            file_sort_ctx_t *ctx)
+{
+    file_sorter_error_t ret = FILE_SORTER_SUCCESS;
+    size_t i;
+
+    sort_records(records, n, ctx);
+    for (i = 0; i < n; i++) {
+        if (ret == FILE_SORTER_SUCCESS) {
+            ret = (file_sorter_error_t) (*feed_record)(records[i], ctx->user_ctx);
+        }
+        if (slab == NULL) {
+            (*ctx->free_record)(records[i], ctx->user_ctx);
+        }
+    }
+    if (slab != NULL) {
+        delete_arena(slab);
+    }
+    cs_free(records);
+
+    return ret;
+}
+
+
+/* Sorts the records and writes them to a new temporary file, freeing
+   them unless they're in a slab, which the caller frees. */
 static file_sorter_error_t write_record_list(void **records,
                                              size_t n,
+                                             arena *slab,
                                              tmp_file_t *tmp_file,
                                              file_sort_ctx_t *ctx)
 {
     size_t i;
-    FILE *f;
+    run_file_t run;
 
     sort_records(records, n, ctx);
+    PROBE1(sort_run, n);
 
     remove(tmp_file->name);
-    f = fopen(tmp_file->name, "ab");
-    if (f == NULL) {
+    if (run_file_open(&run, tmp_file->name, "ab", ctx->io_buffer_size,
+                      ctx->compress_tmp_files) != FILE_MERGER_SUCCESS) {
         return FILE_SORTER_ERROR_MK_TMP_FILE;
     }
 
-    if (ftell(f) != 0) {
+    if (ftell(run.raw) != 0) {
         /* File already existed. It's not supposed to exist, and if it
          * exists it means a temporary file name collision happened or
          * some previous sort left temporary files that were never
          * deleted. */
+        run_file_close(&run);
         return FILE_SORTER_ERROR_NOT_EMPTY_TMP_FILE;
     }
 
 
     for (i = 0; i < n; i++) {
         file_sorter_error_t err;
-        err = static_cast<file_sorter_error_t>((*ctx->write_record)(f, records[i], ctx->user_ctx));
-        (*ctx->free_record)(records[i], ctx->user_ctx);
+        err = static_cast<file_sorter_error_t>((*ctx->write_record)(run.f, records[i], ctx->user_ctx));
+        if (slab == NULL) {
+            (*ctx->free_record)(records[i], ctx->user_ctx);
+        }
         records[i] = NULL;
 
         if (err != FILE_SORTER_SUCCESS) {
-            fclose(f);
+            run_file_close(&run);
             return err;
         }
     }
 
-    fclose(f);
+    if (run_file_close(&run) != FILE_MERGER_SUCCESS) {
+        return FILE_SORTER_ERROR_FILE_WRITE;
+    }
 
     return FILE_SORTER_SUCCESS;
 }
@@ -621,8 +768,7 @@ static int qsort_cmp(const void *a, const void *b, void *ctx)
 }
 
 
-static void sort_records(void **records, size_t n,
-                                         file_sort_ctx_t *ctx)
+static void qsort_records(void **records, size_t n, file_sort_ctx_t *ctx)
 {
 #if(defined __APPLE__)
     qsort_r(records, n, sizeof(void *), ctx, &qsort_cmp);
@@ -634,6 +780,168 @@ static void sort_records(void **records, size_t n,
 }
 
 
+static int radix_ranges_push(radix_ranges_t *r, size_t lo, size_t hi, size_t depth)
+{
+    if (r->count == r->size) {
+        size_t size = r->size ? r->size * 2 : 64;
+        radix_range_t *ranges = (radix_range_t *) cs_realloc(r->ranges,
+                                                             size * sizeof(radix_range_t));
+        if (ranges == NULL) {
+            return 0;
+        }
+        r->ranges = ranges;
+        r->size = size;
+    }
+    r->ranges[r->count].lo = lo;
+    r->ranges[r->count].hi = hi;
+    r->ranges[r->count].depth = depth;
+    r->count++;
+    return 1;
+}
+
+
+/* Bucket 0 is for keys that end at depth, before those of any byte. */
+static inline unsigned radix_digit(const radix_record_t *item, size_t depth)
+{
+    return depth < item->size ? (unsigned) item->key[depth] + 1 : 0;
+}
+
+
+static int radix_compare(const radix_record_t *a, const radix_record_t *b,
+                         size_t depth, file_sort_ctx_t *ctx)
+{
+    size_t size = (a->size < b->size ? a->size : b->size) - depth;
+    int cmp = memcmp(a->key + depth, b->key + depth, size);
+    if (cmp == 0) {
+        if (a->size != b->size) {
+            return a->size < b->size ? -1 : 1;
+        }
+        cmp = (*ctx->compare_records)(a->record, b->record, ctx->user_ctx);
+    }
+    return cmp;
+}
+
+
+/*
+ * Sorts the records by their sort keys, most significant byte first, and
+ * those that tie with compare_records. Returns 0, leaving them as they
+ * were, if a record has no sort key or there's no memory for the sort.
+ */
+static int radix_sort_records(void **records, size_t n, file_sort_ctx_t *ctx)
+{
+    size_t counts[257];
+    radix_record_t *items, *tmp;
+    radix_ranges_t todo = {NULL, 0, 0}, ties = {NULL, 0, 0};
+    size_t i, j;
+    int ok = 0;
+
+    items = (radix_record_t *) cs_malloc(2 * n * sizeof(radix_record_t));
+    if (items == NULL) {
+        return 0;
+    }
+    tmp = items + n;
+    for (i = 0; i < n; ++i) {
+        sized_buf key;
+        if (!(*ctx->record_sort_key)(records[i], &key, ctx->user_ctx)) {
+            goto out;
+        }
+        items[i].key = (const unsigned char *) key.buf;
+        items[i].size = key.size;
+        items[i].record = records[i];
+    }
+
+    if (!radix_ranges_push(&todo, 0, n, 0)) {
+        goto out;
+    }
+    while (todo.count > 0) {
+        radix_range_t r = todo.ranges[--todo.count];
+        size_t count = r.hi - r.lo, start;
+        unsigned d;
+
+        if (count < NSORT_RADIX_SMALL) {
+            for (i = r.lo + 1; i < r.hi; ++i) {
+                radix_record_t item = items[i];
+                for (j = i; j > r.lo && radix_compare(&items[j - 1], &item, r.depth, ctx) > 0; --j) {
+                    items[j] = items[j - 1];
+                }
+                items[j] = item;
+            }
+            continue;
+        }
+
+        memset(counts, 0, sizeof(counts));
+        for (i = r.lo; i < r.hi; ++i) {
+            counts[radix_digit(&items[i], r.depth)]++;
+        }
+        d = radix_digit(&items[r.lo], r.depth);
+        if (counts[d] == count) {
+            /* All share the byte, or all end here and tie */
+            if (!(d == 0 ? radix_ranges_push(&ties, r.lo, r.hi, r.depth) :
+                           radix_ranges_push(&todo, r.lo, r.hi, r.depth + 1))) {
+                goto out;
+            }
+            continue;
+        }
+
+        start = r.lo;
+        for (d = 0; d < 257; ++d) {
+            size_t c = counts[d];
+            counts[d] = start;
+            if (c > 1 && !(d == 0 ? radix_ranges_push(&ties, start, start + c, r.depth) :
+                                    radix_ranges_push(&todo, start, start + c, r.depth + 1))) {
+                goto out;
+            }
+            start += c;
+        }
+        for (i = r.lo; i < r.hi; ++i) {
+            tmp[counts[radix_digit(&items[i], r.depth)]++] = items[i];
+        }
+        memcpy(items + r.lo, tmp + r.lo, count * sizeof(radix_record_t));
+    }
+
+    for (i = 0; i < n; ++i) {
+        records[i] = items[i].record;
+    }
+    for (i = 0; i < ties.count; ++i) {
+        qsort_records(records + ties.ranges[i].lo,
+                      ties.ranges[i].hi - ties.ranges[i].lo, ctx);
+    }
+    ok = 1;
+
+out:
+    cs_free(todo.ranges);
+    cs_free(ties.ranges);
+    cs_free(items);
+    return ok;
+}
+
+
+/* Runs are sorted by the parallel sorter's workers as they write them
+   out, so the radix sorts of several run side by side. */
+static void sort_records(void **records, size_t n,
+                                         file_sort_ctx_t *ctx)
+{
+    size_t i;
+
+    /* Input that's already in order, or mostly, comes in runs that are;
+       checking costs a comparison per record, sorting a dozen or more. */
+    for (i = 1; i < n; ++i) {
+        if ((*ctx->compare_records)(records[i - 1], records[i], ctx->user_ctx) > 0) {
+            break;
+        }
+    }
+    if (i >= n) {
+        return;
+    }
+
+    if (ctx->record_sort_key != NULL && n >= NSORT_RADIX_MIN &&
+            radix_sort_records(records, n, ctx)) {
+        return;
+    }
+    qsort_records(records, n, ctx);
+}
+
+
 static int tmp_file_cmp(const void *a, const void *b)
 {
     unsigned x = ((const tmp_file_t *) a)->level;
@@ -650,16 +958,62 @@ static int tmp_file_cmp(const void *a, const void *b)
 }
 
 
-static void pick_merge_files(file_sort_ctx_t *ctx,
-                             unsigned *start,
-                             unsigned *end,
-                             unsigned *next_level)
+/* The compression of merge_files for a merge of temporary files into
+   another, or into the sorted file. */
+static unsigned tmp_file_compression(const file_sort_ctx_t *ctx, int to_tmp_file)
 {
-    unsigned i, j, level;
+    if (!ctx->compress_tmp_files) {
+        return 0;
+    }
+    return FILE_MERGER_COMPRESSED_SOURCES | (to_tmp_file ? FILE_MERGER_COMPRESSED_DEST : 0);
+}
+
+
+static void merge_worker(void *args)
+{
+    merge_job_t *job = (merge_job_t *) args;
+    file_sort_ctx_t *ctx = job->ctx;
+
+    job->ret = (file_sorter_error_t) merge_files(job->files,
+                                                 job->end - job->start,
+                                                 job->dest,
+                                                 ctx->read_record,
+                                                 ctx->write_record,
+                                                 NULL,
+                                                 ctx->compare_records,
+                                                 ctx->free_record,
+                                                 NULL,
+                                                 ctx->skip_writeback,
+                                                 ctx->io_buffer_size,
+                                                 tmp_file_compression(ctx, 1),
+                                                 ctx->user_ctx);
+}
+
+
+/*
+ * Merges the temporary files of each level that has more than one into a
+ * file of the next, the levels side by side on up to num_threads threads.
+ * If every file is of a different level, the two lowest are merged.
+ */
+static file_sorter_error_t merge_tmp_levels(file_sort_ctx_t *ctx)
+{
+    merge_job_t *jobs;
+    cb_thread_t *threads;
+    unsigned njobs = 0, merged = 0, i, j, k, level;
+    int *started;
+    file_sorter_error_t ret = FILE_SORTER_SUCCESS;
+
+    jobs = (merge_job_t *) cs_calloc(ctx->num_threads, sizeof(merge_job_t));
+    threads = (cb_thread_t *) cs_calloc(ctx->num_threads, sizeof(cb_thread_t));
+    started = (int *) cs_calloc(ctx->num_threads, sizeof(int));
+    if (jobs == NULL || threads == NULL || started == NULL) {
+        ret = FILE_SORTER_ERROR_ALLOC;
+        goto out;
+    }
 
     qsort(ctx->tmp_files, ctx->active_tmp_files, sizeof(tmp_file_t), tmp_file_cmp);
 
-    for (i = 0; i < ctx->active_tmp_files; i = j) {
+    for (i = 0; i < ctx->active_tmp_files && njobs < ctx->num_threads; i = j) {
         level = ctx->tmp_files[i].level;
         assert(level > 0);
         j = i + 1;
@@ -673,19 +1027,99 @@ static void pick_merge_files(file_sort_ctx_t *ctx,
         }
 
         if ((j - i) > 1) {
-            *start = i;
-            *end = j;
-            *next_level = (j - i) * level;
-            return;
+            jobs[njobs].start = i;
+            jobs[njobs].end = j;
+            jobs[njobs].next_level = (j - i) * level;
+            njobs++;
+        }
+    }
+
+    if (njobs == 0) {
+        /* All files have a different level. */
+        assert(ctx->active_tmp_files == ctx->num_tmp_files);
+        assert(ctx->active_tmp_files >= 2);
+        jobs[0].start = 0;
+        jobs[0].end = 2;
+        jobs[0].next_level = ctx->tmp_files[0].level + ctx->tmp_files[1].level;
+        njobs = 1;
+    }
+
+    for (k = 0; k < njobs; ++k) {
+        merge_job_t *job = &jobs[k];
+        job->ctx = ctx;
+        job->files = (const char **) cs_malloc(sizeof(char *) * (job->end - job->start));
+        if (job->files == NULL) {
+            ret = FILE_SORTER_ERROR_ALLOC;
+            goto out;
+        }
+        for (i = job->start; i < job->end; ++i) {
+            job->files[i - job->start] = ctx->tmp_files[i].name;
+        }
+        job->dest = tmp_file_path(ctx->tmp_dir, ctx->tmp_file_prefix);
+        if (job->dest == NULL) {
+            ret = FILE_SORTER_ERROR_MK_TMP_FILE;
+            goto out;
         }
     }
 
-    /* All files have a different level. */
-    assert(ctx->active_tmp_files == ctx->num_tmp_files);
-    assert(ctx->active_tmp_files >= 2);
-    *start = 0;
-    *end = 2;
-    *next_level = ctx->tmp_files[0].level + ctx->tmp_files[1].level;
+    /* The calling thread takes the first, and any a thread can't be
+       started for. */
+    for (k = 1; k < njobs; ++k) {
+        started[k] = cb_create_thread(&threads[k], &merge_worker, &jobs[k], 0) == 0;
+    }
+    merge_worker(&jobs[0]);
+    for (k = 1; k < njobs; ++k) {
+        if (started[k]) {
+            cb_join_thread(threads[k]);
+        } else {
+            merge_worker(&jobs[k]);
+        }
+    }
+    for (k = 0; k < njobs; ++k) {
+        if (jobs[k].ret != FILE_SORTER_SUCCESS) {
+            ret = jobs[k].ret;
+            goto out;
+        }
+    }
+
+    for (k = 0; k < njobs; ++k) {
+        for (i = jobs[k].start; i < jobs[k].end; ++i) {
+            if (remove(ctx->tmp_files[i].name) != 0) {
+                ret = FILE_SORTER_ERROR_DELETE_FILE;
+            }
+            cs_free(ctx->tmp_files[i].name);
+            ctx->tmp_files[i].name = NULL;
+            ctx->tmp_files[i].level = 0;
+            merged++;
+        }
+    }
+
+    qsort(ctx->tmp_files, ctx->num_tmp_files, sizeof(tmp_file_t), tmp_file_cmp);
+    ctx->active_tmp_files -= merged;
+
+    for (k = 0; k < njobs; ++k) {
+        i = ctx->active_tmp_files;
+        ctx->tmp_files[i].name = jobs[k].dest;
+        ctx->tmp_files[i].level = jobs[k].next_level;
+        ctx->active_tmp_files += 1;
+        jobs[k].dest = NULL;
+    }
+
+ out:
+    if (jobs != NULL) {
+        for (k = 0; k < njobs; ++k) {
+            cs_free(jobs[k].files);
+            if (jobs[k].dest != NULL) {
+                remove(jobs[k].dest);
+                cs_free(jobs[k].dest);
+            }
+        }
+    }
+    cs_free(jobs);
+    cs_free(threads);
+    cs_free(started);
+
+    return ret;
 }
 
 
@@ -701,7 +1135,7 @@ static file_sorter_error_t merge_tmp_files(file_sort_ctx_t *ctx,
     file_merger_feed_record_t feed_record = NULL;
 
     nfiles = end - start;
-    files = (const char **) malloc(sizeof(char *) * nfiles);
+    files = (const char **) cs_malloc(sizeof(char *) * nfiles);
     if (files == NULL) {
         return FILE_SORTER_ERROR_ALLOC;
     }
@@ -722,11 +1156,12 @@ static file_sorter_error_t merge_tmp_files(file_sort_ctx_t *ctx,
     } else {
         dest_tmp_file = tmp_file_path(ctx->tmp_dir, ctx->tmp_file_prefix);
         if (dest_tmp_file == NULL) {
-            free(files);
+            cs_free(files);
             return FILE_SORTER_ERROR_MK_TMP_FILE;
         }
     }
 
+    PROBE2(sort_merge, nfiles, next_level);
     ret = (file_sorter_error_t) merge_files(files,
                                             nfiles,
                                             dest_tmp_file,
@@ -735,15 +1170,18 @@ static file_sorter_error_t merge_tmp_files(file_sort_ctx_t *ctx,
                                             feed_record,
                                             ctx->compare_records,
                                             ctx->free_record,
+                                            NULL,
                                             ctx->skip_writeback,
+                                            ctx->io_buffer_size,
+                                            tmp_file_compression(ctx, next_level != 0),
                                             ctx->user_ctx);
 
-    free(files);
+    cs_free(files);
 
     if (ret != FILE_SORTER_SUCCESS) {
         if (dest_tmp_file != ctx->source_file) {
             remove(dest_tmp_file);
-            free(dest_tmp_file);
+            cs_free(dest_tmp_file);
         }
         return ret;
     }
@@ -751,11 +1189,11 @@ static file_sorter_error_t merge_tmp_files(file_sort_ctx_t *ctx,
     for (i = start; i < end; ++i) {
         if (remove(ctx->tmp_files[i].name) != 0) {
             if (dest_tmp_file != ctx->source_file) {
-                free(dest_tmp_file);
+                cs_free(dest_tmp_file);
             }
             return FILE_SORTER_ERROR_DELETE_FILE;
         }
-        free(ctx->tmp_files[i].name);
+        cs_free(ctx->tmp_files[i].name);
         ctx->tmp_files[i].name = NULL;
         ctx->tmp_files[i].level = 0;
     }
@@ -779,15 +1217,16 @@ static file_sorter_error_t iterate_records_file(file_sort_ctx_t *ctx,
 {
     void *record_data = NULL;
     int record_len;
-    FILE *f = fopen(file, "rb");
+    run_file_t run;
     int ret = FILE_SORTER_SUCCESS;
 
-    if (f == NULL) {
+    if (run_file_open(&run, file, "rb", ctx->io_buffer_size,
+                      ctx->compress_tmp_files) != FILE_MERGER_SUCCESS) {
         return FILE_SORTER_ERROR_OPEN_FILE;
     }
 
     while (1) {
-        record_len = (*ctx->read_record)(f, &record_data, ctx->user_ctx);
+        record_len = (*ctx->read_record)(run.f, &record_data, ctx->user_ctx);
         if (record_len == 0) {
             record_data = NULL;
             break;
@@ -795,20 +1234,19 @@ static file_sorter_error_t iterate_records_file(file_sort_ctx_t *ctx,
             ret = record_len;
             goto cleanup;
         } else {
+            run_file_advance(&run, (size_t) record_len);
             ret = (*ctx->feed_record)(record_data, ctx->user_ctx);
             if (ret != FILE_SORTER_SUCCESS) {
                 goto cleanup;
             }
 
-            free(record_data);
+            cs_free(record_data);
         }
     }
 
 cleanup:
-    free(record_data);
-    if (f != NULL) {
-        fclose(f);
-    }
+    cs_free(record_data);
+    run_file_close(&run);
 
     return (file_sorter_error_t) ret;
 }
@@ -46,14 +46,34 @@ extern "C" {
     } file_sorter_error_t;
 
 
+    /*
+     * Sorts the records of source_file, in runs of up to memory_budget
+     * bytes of records in all sorted on num_threads threads at once, and
+     * merged through at most num_tmp_files temporary files. Merges of
+     * temporary files of different levels run side by side on as many.
+     * Each file read or written gets an I/O buffer of io_buffer_size bytes,
+     * or FILE_MERGER_IO_BUFFER_SIZE for 0 (see run_file_t). With
+     * compress_tmp_files the temporary files are compressed runs, where
+     * the C library allows; source_file is always written plain.
+     * With read_record_slab, the records of each in-memory run are read
+     * with it into a slab of their own, freed in one go once the run is
+     * written out or fed, and read_record only reads back temporary files.
+     * With record_sort_key, runs whose records all have sort keys are
+     * radix sorted by them, compare_records only ordering those that tie.
+     */
     file_sorter_error_t sort_file(const char *source_file,
                                   const char *tmp_dir,
                                   unsigned num_tmp_files,
-                                  unsigned max_buffer_size,
+                                  size_t memory_budget,
+                                  unsigned num_threads,
+                                  size_t io_buffer_size,
+                                  int compress_tmp_files,
                                   file_merger_read_record_t read_record,
+                                  file_merger_read_record_slab_t read_record_slab,
                                   file_merger_write_record_t write_record,
                                   file_merger_feed_record_t feed_record,
                                   file_merger_compare_records_t compare_records,
+                                  file_merger_record_sort_key_t record_sort_key,
                                   file_merger_record_free_t free_record,
                                   int skip_writeback,
                                   void *user_ctx);
@@ -11,9 +11,52 @@
 
 #include <libcouchstore/couch_db.h>
 #include "config.h"
+#include "alloc.h"
 
 #define COUCH_BLOCK_SIZE 4096
-#define COUCH_DISK_VERSION 11
+/* Disk version of new files, and so of every compacted file, since
+   compaction writes a new file. The upgrade is one way: there's no flag to
+   keep writing an older version, and versions of the library from before
+   this one can't open the result. Existing files keep their version while
+   they're appended to. */
+#define COUCH_DISK_VERSION 16
+#define COUCH_MIN_DISK_VERSION 11
+/* First disk version whose B-tree nodes may have prefix-compressed keys */
+#define COUCH_DISK_VERSION_PREFIXED_KEYS 12
+/* First disk version whose headers may point to a Bloom filter of IDs */
+#define COUCH_DISK_VERSION_BLOOM_FILTER 12
+/* First disk version whose chunks name their codec (see codec.h), and whose
+   headers may point to a zstd dictionary */
+#define COUCH_DISK_VERSION_CODECS 13
+/* First disk version whose first block may list the latest headers */
+#define COUCH_DISK_VERSION_HEADER_HINTS 14
+/* How many headers that list holds */
+#define HEADER_HINTS 8
+/* Marks block 0 of a file that lists its latest headers there */
+#define BLOCK_HEADER_HINTS 2
+/* First disk version whose chunks and headers may be checksummed with
+   CRC32C, which the marker of their header blocks tells */
+#define COUCH_DISK_VERSION_CRC32C 15
+/* Block marker of the headers of such files, instead of 1 */
+#define BLOCK_HEADER_CRC32C 3
+/* First disk version whose by-seq reduces count the deletions too */
+#define COUCH_DISK_VERSION_SEQ_DELETES 16
+/* First disk version whose headers may point to an index by expiry time */
+#define COUCH_DISK_VERSION_EXPIRY_INDEX 16
+/* ...and to a value log of large bodies */
+#define COUCH_DISK_VERSION_VALUE_LOG 16
+/* ...and whose bodies may be written in segments */
+#define COUCH_DISK_VERSION_SEGMENTED_BODIES 16
+/* ...and whose first block may hold a preamble giving a block size other
+   than COUCH_BLOCK_SIZE; see raw_file_preamble */
+#define COUCH_DISK_VERSION_BLOCK_SIZE 16
+/* Marks block 0 of a file that starts with a preamble */
+#define BLOCK_PREAMBLE 4
+/* Version of the preamble written */
+#define FILE_PREAMBLE_VERSION 1
+/* log2 of the block sizes a file may have, COUCH_BLOCK_SIZE to 1MB */
+#define COUCH_MIN_BLOCK_SHIFT 12
+#define COUCH_MAX_BLOCK_SHIFT 20
 #define COUCH_SNAPPY_THRESHOLD 64
 #define MAX_DB_HEADER_SIZE 1024    /* Conservative estimate; just for sanity check */
 
@@ -26,6 +69,15 @@ enum {
 extern "C" {
 #endif
 
+    /* Memory standing in for the file from base on, for a handle that
+       can't append to it; see tree_file_start_overlay */
+    typedef struct file_overlay {
+        uint64_t base;
+        char *buf;
+        size_t size;
+        size_t capacity;
+    } file_overlay;
+
      /* Structure representing an open file; "superclass" of Db */
     typedef struct _treefile {
         uint64_t pos;
@@ -33,6 +85,33 @@ extern "C" {
         couch_file_handle handle;
         const char* path;
         couchstore_error_info_t lastError;
+        const char *map;       /* Read-only mapping of the file, or NULL */
+        size_t map_size;
+        couchstore_block_cache *cache;
+        uint64_t cache_file_id;
+        couchstore_buffer_options buffer_options;
+        struct node_cache *node_cache;  /* Decoded interior nodes, or NULL */
+        size_t node_cache_size;
+        int prefix_keys;       /* Write nodes with prefix-compressed keys */
+        struct chunk_writer *chunk_writer;  /* Compresses chunks on threads, or NULL */
+        unsigned compression_threads;
+        int chunk_codecs;      /* Chunks carry codec bits */
+        couchstore_codec doc_codec;
+        couchstore_codec node_codec;
+        uint64_t dict_pos;     /* The file's zstd dictionary, or 0 */
+        struct codec_dict *dict;  /* ...once loaded */
+        size_t prealloc_chunk; /* Steps disk space is reserved in, or 0 */
+        cs_off_t allocated;    /* End of the space reserved past pos, or 0 */
+        cb_mutex_t *io_mutex;  /* Held by each chunk read or appended, if
+                                  threads share the file */
+        couchstore_op_stats *op_stats;  /* Times node reads and tree updates,
+                                           or NULL */
+        int crc32c;            /* Checksums are CRC32C rather than CRC32 */
+        size_t block_size;     /* Distance between prefix bytes and header
+                                  positions; COUCH_BLOCK_SIZE unless the
+                                  file's preamble says otherwise */
+        file_overlay *overlay; /* Takes the appends instead of the file, or
+                                  NULL */
     } tree_file;
 
     typedef struct _nodepointer {
@@ -42,6 +121,13 @@ extern "C" {
         uint64_t subtreesize;
     } node_pointer;
 
+    /* How one B-tree's nodes are sized; see couchstore_set_node_size_policy */
+    typedef struct {
+        couchstore_node_size_policy policy;
+        uint16_t avg_key_size;
+        uint16_t avg_value_size;
+    } tree_sizing;
+
     typedef struct _db_header {
         uint64_t disk_version;
         uint64_t update_seq;
@@ -51,6 +137,26 @@ extern "C" {
         uint64_t purge_seq;
         uint64_t purge_ptr;
         uint64_t position;
+        /* ID Bloom filter chunk, or 0, and the seq it's complete up to */
+        uint64_t bloom_ptr;
+        uint64_t bloom_seq;
+        /* zstd dictionary chunk, or 0 */
+        uint64_t dict_ptr;
+        tree_sizing id_sizing;
+        tree_sizing seq_sizing;
+        /* Newest delta log chunk, or 0 */
+        uint64_t delta_ptr;
+        /* Checkpoint of an unfinished resumable compaction into this file, or 0 */
+        uint64_t compact_ptr;
+        /* Index by expiry time; see expiry_index.h. Its root is NULL while
+           it's empty. */
+        int expiry_index;
+        uint16_t expiry_offset;
+        node_pointer *expiry_root;
+        /* Value log settings chunk, or 0, and the bytes of the log that
+           are still in use; see value_log.h */
+        uint64_t vlog_ptr;
+        uint64_t vlog_live;
     } db_header;
 
     struct _db {
@@ -58,6 +164,48 @@ extern "C" {
         db_header header;
         int dropped;
         void *userdata;
+        couchstore_io_stats io_stats;
+        uint64_t bytes_written_at_commit;
+        /* Latencies being recorded, or NULL; see op_stats.h */
+        couchstore_op_stats *op_stats;
+        /* Bloom filter of document IDs; see bloom_filter.h */
+        int bloom_enabled;
+        struct bloom_filter *bloom;
+        uint64_t bloom_unsaved;     /* IDs added since it was last written */
+        int bloom_stale;            /* some of those are below bloom_seq */
+        int readonly;
+        /* Entries not yet in the trees; see delta_buffer.h */
+        unsigned delta_max_docs;
+        struct delta_buffer *delta;
+        /* If saves wait in it for the commit, the most bytes it may hold */
+        size_t write_back_max;
+        /* Most bytes each arena of a tree update or compaction may hold, or 0 */
+        size_t arena_limit;
+        /* Threads reading bodies ahead when compacting this file */
+        unsigned compaction_threads;
+        /* Memory the by-ID sort of a compaction may take, or 0 for the default */
+        size_t compaction_sort_memory;
+        /* How compactions of this file are held back; zeroed if they aren't */
+        couchstore_compact_throttle compaction_throttle;
+        /* Told how compactions of this file are getting on, or NULL */
+        couchstore_compact_progress_fn compaction_progress;
+        void *compaction_progress_ctx;
+        /* Tombstones compactions of this file drop; zeroed for none */
+        couchstore_purge_policy purge_policy;
+        /* Block 0 lists the latest headers; see raw_header_hints */
+        int header_hints;
+        uint64_t hints[HEADER_HINTS];
+        unsigned nhints;
+        /* Snapshots serving lookups from other threads; see read_pool.h */
+        struct read_pool *readers;
+        /* Local documents last read or saved; see local_doc_cache.h */
+        struct local_doc_cache *local_cache;
+        /* Log of large bodies, once opened; see value_log.h */
+        struct value_log *vlog;
+        /* Bodies compressed in segments of this size, or 0; see body_segments.h */
+        uint32_t body_segment_size;
+        /* Syncs commits in relaxed durability mode, or NULL; see background_sync.h */
+        struct background_sync *syncer;
     };
 
     const couch_file_ops *couch_get_default_file_ops(void);
@@ -71,9 +219,97 @@ extern "C" {
                                       const char *filename,
                                       int openflags,
                                       const couch_file_ops *ops);
+    /** Opens a read-only tree_file on the same file as another one, reading
+        through its handle; see couch_share_buffered_file. Only the path and
+        block size are taken from source; it must stay open for as long as
+        the new one is.
+        @param file  Pointer to tree_file struct to initialize.
+        @param source  Pointer to the open tree_file to read through. */
+    couchstore_error_t tree_file_open_shared(tree_file* file,
+                                             tree_file* source);
+    /** Takes the block size of an open tree_file from the preamble at the
+        start of block 0, leaving it at COUCH_BLOCK_SIZE if there's none.
+        @param file  Pointer to open tree_file. */
+    couchstore_error_t read_file_preamble(tree_file *file);
+    /** Writes a preamble giving the file's block size at the start of
+        block 0, which must otherwise be unused.
+        @param file  Pointer to open tree_file. */
+    couchstore_error_t write_file_preamble(tree_file *file);
+    /** How many bytes the preamble takes at the start of block 0: 0 for
+        files of COUCH_BLOCK_SIZE blocks, which have none. */
+    size_t file_preamble_size(const tree_file *file);
+    /** log2 of the file's block size. */
+    unsigned file_block_shift(const tree_file *file);
     /** Closes a tree_file.
-        @param file  Pointer to open tree_file. Does not free this pointer! */
+        @param file  Pointer to open tree_file. Does not free this pointer!
+                     The block cache pointer is left in place so the file can
+                     be attached to it again when reopened. */
     void tree_file_close(tree_file* file);
+    /** Takes and gives back the file's io_mutex, if it has one. */
+    void tree_file_lock(tree_file *file);
+    void tree_file_unlock(tree_file *file);
+
+    /** Resizes the I/O buffers of an open tree_file.
+        @param file  Pointer to open tree_file.
+        @param options  The new buffer sizes; zero fields select the defaults. */
+    couchstore_error_t tree_file_set_buffer_options(tree_file *file,
+                                                    const couchstore_buffer_options *options);
+
+    /** Attaches an open tree_file to a block cache, replacing any previous one.
+        @param file  Pointer to open tree_file.
+        @param cache  The cache to use, or NULL to stop caching. */
+    couchstore_error_t tree_file_set_cache(tree_file *file,
+                                           couchstore_block_cache *cache);
+
+    /** Points the I/O counters of an open tree_file at a set of stats.
+        @param file  Pointer to open tree_file.
+        @param stats  The stats to add to, or NULL to stop counting. */
+    void tree_file_set_io_stats(tree_file *file, couchstore_io_stats *stats);
+
+    /** Records a successful commit in the Db's I/O stats. */
+    void db_count_commit(Db *db);
+
+    /** Sets the memory budget for the decoded B-tree nodes an open
+        tree_file keeps. Zero turns the cache off.
+        @param file  Pointer to open tree_file.
+        @param size  The budget in bytes. */
+    couchstore_error_t tree_file_set_node_cache_size(tree_file *file, size_t size);
+
+    /** Sets how many threads compress the B-tree nodes written to an open
+        tree_file. Zero compresses them on the writing thread.
+        @param file  Pointer to open tree_file.
+        @param threads  The number of worker threads. */
+    couchstore_error_t tree_file_set_compression_threads(tree_file *file, unsigned threads);
+
+    /** Sets the steps in which an open tree_file reserves disk space ahead
+        of its writes. Zero stops reserving more; what's reserved already
+        is released when the file is closed.
+        @param file  Pointer to open tree_file.
+        @param chunk_size  The step in bytes. */
+    couchstore_error_t tree_file_set_preallocation(tree_file *file, size_t chunk_size);
+
+    /** Memory-maps the current contents of a tree_file for reading,
+        replacing any previous mapping. Reads that fall inside the mapping
+        are served from it; anything past its end still goes through the
+        file ops. Does nothing on platforms without mmap.
+        @param file  Pointer to open tree_file. */
+    couchstore_error_t tree_file_map(tree_file *file);
+
+    /** Drops the mapping created by tree_file_map, if any. */
+    void tree_file_unmap(tree_file *file);
+
+    /** Sends appends to an open tree_file into memory from now on, at
+        positions past the end of any file, where reads find them; for a
+        read-only handle, which can't append to the file itself. Moves pos
+        to the end of what's there.
+        @param file  Pointer to open tree_file. */
+    couchstore_error_t tree_file_start_overlay(tree_file *file);
+
+    /** Frees what was appended to memory, if anything. Later appends go
+        past it rather than reusing its positions, which nodes cached from
+        it may still be under.
+        @param file  Pointer to open tree_file. */
+    void tree_file_clear_overlay(tree_file *file);
 
     /** Reads a chunk from the file at a given position.
         @param file The tree_file to read from
@@ -84,25 +320,138 @@ extern "C" {
         @return The length of the chunk (zero is a valid length!), or a negative error code */
     int pread_bin(tree_file *file, cs_off_t pos, char **ret_ptr);
 
+    /** Reads a chunk like pread_bin, but avoids copying it when the file is
+        memory-mapped and the chunk is contiguous in the mapping. In that case
+        *ret_ptr points into the mapping, *mapped is set to 1 and the caller
+        must neither modify nor free the buffer, which stays valid until the
+        file is unmapped. Otherwise *mapped is set to 0 and the buffer must be
+        freed as with pread_bin. */
+    int pread_bin_mapped(tree_file *file, cs_off_t pos, char **ret_ptr, int *mapped);
+
+    /** Reads a chunk like pread_bin, and also the codec its contents were
+        compressed with if they were (see codec.h), so that it can be copied
+        elsewhere as it is. */
+    int pread_chunk(tree_file *file, cs_off_t pos, char **ret_ptr, unsigned *codec);
+
+    /** Reads a chunk as it is on disk, its length and CRC header followed by
+        the contents, without checking the CRC, for db_write_raw_chunk to
+        copy into a file whose chunks carry codec bits if this one's do.
+        Returns the size of the whole, or an error code. */
+    int pread_raw_chunk(tree_file *file, cs_off_t pos, char **ret_ptr);
+
+    /** Reads up to len bytes of a plain chunk's contents from offset on
+        into a malloced buffer, or sets it NULL if there are none, reading
+        nothing else of it. The CRC isn't checked, as it covers the whole.
+        Returns the bytes read, fewer than len where the chunk ends first,
+        or an error code. */
+    int pread_bin_range(tree_file *file, cs_off_t pos, size_t offset, size_t len,
+                        char **ret_ptr);
+
     /** Reads a compressed chunk from the file at a given position.
         Parameters and return value are the same as for pread_bin. */
     int pread_compressed(tree_file *file, cs_off_t pos, char **ret_ptr);
 
+    /** Reads a chunk's contents into dst if they fit in dst_len bytes, and
+        leaves dst alone otherwise, or if it's NULL. Returns the length of
+        the contents either way, or an error code. */
+    int pread_bin_into(tree_file *file, cs_off_t pos, char *dst, size_t dst_len);
+
+    /** Like pread_bin_into, for a compressed chunk: decompresses it into
+        dst if it fits, and returns its decompressed length. */
+    int pread_compressed_into(tree_file *file, cs_off_t pos, char *dst, size_t dst_len);
+
+    /** Reads a B-tree node from the file at a given position, always in the
+        layout read_kv expects, whichever way it was written, into a buffer
+        to be freed with node_buf_free.
+        Parameters and return value are the same as for pread_bin. */
+    int pread_node(tree_file *file, cs_off_t pos, char **ret_ptr);
+
     /** Reads a file header from the file at a given position.
         Parameters and return value are the same as for pread_bin. */
     int pread_header(tree_file *file,
                      cs_off_t pos,
                      char **ret_ptr,
                      uint32_t max_header_size);
+    /** The position just past the header at pos, or an error code. */
+    cs_off_t pread_header_end(tree_file *file, cs_off_t pos);
+    /** The position just past the data chunk at pos, whose CRC is checked,
+        or an error code. */
+    cs_off_t pread_chunk_end(tree_file *file, cs_off_t pos);
 
     couchstore_error_t write_header(tree_file *file, sized_buf *buf, cs_off_t *pos);
     int db_write_buf(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size);
-    couchstore_error_t db_write_buf_compressed(tree_file *file, const sized_buf *buf, cs_off_t *pos, size_t *disk_size);
+    /** Writes a chunk whose contents are compressed with the given chunk
+        codec, like db_write_buf. */
+    int db_write_chunk(tree_file *file, const sized_buf *buf, unsigned codec,
+                       cs_off_t *pos, size_t *disk_size);
+    /** Appends a chunk read with pread_raw_chunk as it is, header and all.
+        Returns 0 or an error code, as db_write_chunk does. */
+    int db_write_raw_chunk(tree_file *file, const sized_buf *chunk,
+                           cs_off_t *pos, size_t *disk_size);
+    /** Most chunks db_write_chunks takes at a time. */
+#define DB_WRITE_CHUNKS_MAX 32
+    /** Writes up to DB_WRITE_CHUNKS_MAX plain chunks back to back in one
+        gathered write, straight from the given buffers, filling in each
+        one's position and disk size. The file ends up as if db_write_buf
+        were called for each in turn. */
+    couchstore_error_t db_write_chunks(tree_file *file, const sized_buf *bufs, unsigned count,
+                                       cs_off_t *pos, size_t *disk_size);
+    couchstore_error_t db_write_buf_compressed(tree_file *file, const sized_buf *buf,
+                                               couchstore_codec codec,
+                                               cs_off_t *pos, size_t *disk_size);
+    /** Adds the entries of documents whose bodies are written already to
+        the trees, replacing older entries of the same IDs unless options
+        has COUCHSTORE_SAVE_BLIND_INSERT. Used by the compactors that add
+        to trees they built before. Defined in couch_save.cc. */
+    couchstore_error_t db_add_entries(Db *db,
+                                      sized_buf *seqs,
+                                      sized_buf *seqvals,
+                                      sized_buf *ids,
+                                      sized_buf *idvals,
+                                      unsigned count,
+                                      couchstore_save_options options);
+    /** Moves a read-only handle on to the newest header in its file,
+        committed by some other handle since it was opened. */
+    couchstore_error_t db_refresh_header(Db *db);
+    /** Opens a file read-only at the header at the given position, which
+        needn't be the newest, as a snapshot of the database then. */
+    couchstore_error_t db_open_at_header(const char *filename,
+                                         const couch_file_ops *ops,
+                                         uint64_t pos,
+                                         Db **pDb);
+    /** Opens a snapshot of the header at pos, reading through source's
+        file; see couchstore_open_snapshot. Only reads source, so it may
+        be called from any thread if nothing else changes it meanwhile. */
+    couchstore_error_t db_open_snapshot(Db *source, uint64_t pos, Db **pSnapshot);
+    /** Moves a snapshot on to the header at pos, written since. */
+    couchstore_error_t db_move_snapshot(Db *snapshot, uint64_t pos);
     struct _os_error *get_os_error_store(void);
     couchstore_error_t by_seq_read_docinfo(DocInfo **pInfo,
                                            const sized_buf *k,
                                            const sized_buf *v);
 
+    /** Writes a new header for the Db at the end of the file. */
+    couchstore_error_t db_write_header(Db *db);
+
+    /** Puts the header at pos at the head of the Db's header hints and
+        writes them out through file, unsynced. */
+    couchstore_error_t db_add_header_hint(Db *db, tree_file *file, uint64_t pos);
+
+    /** The chunk thresholds to build a tree's nodes with. */
+    void tree_sizing_thresholds(const tree_sizing *sizing, int *kv_threshold,
+                                int *kp_threshold);
+
+    /** Folds the entries of a batch into an adaptively sized tree's
+        averages. */
+    void tree_sizing_observe(tree_sizing *sizing, size_t key_bytes,
+                             size_t value_bytes, size_t count);
+
+    /** First half of a commit: extends the file to where the end of the
+        next header will land, so that the sync that follows covers the
+        file's new size as well as its data. couchstore_commit() then
+        writes the header with db_write_header() and syncs again. */
+    couchstore_error_t db_commit_prepare(Db *db);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,155 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Rate limiting of compactions.
+//
+// A compaction reads and writes as fast as the disk lets it, which starves
+// the foreground reads sharing the disk. The copy loop and the by-ID sort
+// and write count what they move here; every THROTTLE_STEP bytes the
+// callback is asked, and the compaction sleeps for as long as it is ahead
+// of the rate. Sleeping in steps rather than per item keeps the cost off
+// the copy loop, and keeps the sleeps long enough for the timer.
+//
+// The same steps pace the progress reports (see compact_progress.h).
+
+#include "config.h"
+#include <string.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "internal.h"
+#include "compact_progress.h"
+#include "io_throttle.h"
+
+#define THROTTLE_STEP (256 * 1024)
+
+#ifdef __linux__
+// From linux/ioprio.h, which not every libc ships:
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+// Moves the calling thread into the idle I/O class, returning its former
+// priority, or -1 if it can't be set.
+static int enter_idle_io(void)
+{
+#if defined(__linux__) && defined(SYS_ioprio_get) && defined(SYS_ioprio_set)
+    int saved = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+    if (saved < 0 ||
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0) {
+        return -1;
+    }
+    return saved;
+#else
+    return -1;
+#endif
+}
+
+static void leave_idle_io(int saved)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (saved >= 0) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved);
+    }
+#else
+    (void)saved;
+#endif
+}
+
+void io_throttle_start(io_throttle *throttle,
+                       const couchstore_compact_throttle *settings,
+                       const tree_file *target,
+                       struct compact_progress *progress)
+{
+    memset(throttle, 0, sizeof(*throttle));
+    throttle->saved_ioprio = -1;
+    int throttled = settings != NULL &&
+        (settings->bytes_per_sec != 0 || settings->callback != NULL || settings->idle_io);
+    int reported = progress != NULL && progress->callback != NULL;
+    if (!throttled && !reported) {
+        return;
+    }
+    if (throttled) {
+        throttle->settings = *settings;
+    }
+    if (reported) {
+        throttle->progress = progress;
+    }
+    throttle->enabled = 1;
+    throttle->target = target;
+    throttle->target_pos = target->pos;
+    throttle->start = gethrtime();
+    if (throttle->settings.idle_io) {
+        throttle->saved_ioprio = enter_idle_io();
+    }
+    cb_mutex_initialize(&throttle->mutex);
+    cb_cond_initialize(&throttle->wait_cond);
+}
+
+void io_throttle_finish(io_throttle *throttle)
+{
+    if (!throttle->enabled) {
+        return;
+    }
+    leave_idle_io(throttle->saved_ioprio);
+    cb_cond_destroy(&throttle->wait_cond);
+    cb_mutex_destroy(&throttle->mutex);
+    throttle->enabled = 0;
+}
+
+static couchstore_error_t throttle_step(io_throttle *throttle)
+{
+    const couchstore_compact_throttle *settings = &throttle->settings;
+
+    throttle->unchecked = 0;
+    if (throttle->progress) {
+        throttle->error = compact_progress_report(throttle->progress);
+        if (throttle->error != COUCHSTORE_SUCCESS) {
+            return throttle->error;
+        }
+    }
+    if (settings->callback) {
+        throttle->error = settings->callback(throttle->bytes, settings->callback_ctx);
+        if (throttle->error != COUCHSTORE_SUCCESS) {
+            return throttle->error;
+        }
+    }
+    if (settings->bytes_per_sec) {
+        // When the bytes so far are due, in ms since the start:
+        uint64_t due = throttle->bytes * 1000 / settings->bytes_per_sec;
+        uint64_t elapsed = (gethrtime() - throttle->start) / 1000000;
+        if (due > elapsed) {
+            cb_mutex_enter(&throttle->mutex);
+            cb_cond_timedwait(&throttle->wait_cond, &throttle->mutex,
+                              (unsigned int)(due - elapsed));
+            cb_mutex_exit(&throttle->mutex);
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t io_throttle_account(io_throttle *throttle, uint64_t bytes)
+{
+    if (!throttle->enabled || throttle->error != COUCHSTORE_SUCCESS) {
+        return throttle->error;
+    }
+    throttle->bytes += bytes;
+    throttle->unchecked += bytes;
+    if (throttle->unchecked < THROTTLE_STEP) {
+        return COUCHSTORE_SUCCESS;
+    }
+    return throttle_step(throttle);
+}
+
+couchstore_error_t io_throttle_progress(io_throttle *throttle)
+{
+    if (!throttle->enabled) {
+        return COUCHSTORE_SUCCESS;
+    }
+    cs_off_t pos = throttle->target->pos;
+    uint64_t grown = pos > throttle->target_pos ? (uint64_t)(pos - throttle->target_pos) : 0;
+    throttle->target_pos = pos;
+    return io_throttle_account(throttle, grown);
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_IO_THROTTLE_H
+#define LIBCOUCHSTORE_IO_THROTTLE_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+
+struct compact_progress;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Holds a compaction to the settings of couchstore_compact_throttle,
+       counting the bytes it moves and acting on them a step at a time. */
+    typedef struct io_throttle {
+        couchstore_compact_throttle settings;
+        int enabled;
+        const tree_file *target;
+        cs_off_t target_pos;        /* counted up to */
+        uint64_t bytes;
+        uint64_t unchecked;         /* since the last step */
+        hrtime_t start;
+        couchstore_error_t error;   /* from the callback, kept */
+        int saved_ioprio;           /* to restore, or -1 */
+        cb_mutex_t mutex;           /* for sleeping on wait_cond */
+        cb_cond_t wait_cond;
+        struct compact_progress *progress;  /* reported at each step, or NULL */
+    } io_throttle;
+
+    /** Starts counting, with settings and the file whose growth counts as
+        the bytes written, and a progress to report at each step. Either
+        may be NULL; with neither, it does nothing. */
+    void io_throttle_start(io_throttle *throttle,
+                           const couchstore_compact_throttle *settings,
+                           const tree_file *target,
+                           struct compact_progress *progress);
+
+    /** Restores the I/O priority. */
+    void io_throttle_finish(io_throttle *throttle);
+
+    /** Counts bytes moved elsewhere than the target, sleeping or calling
+        back if a step is due. Returns the callback's error, once it has
+        returned one. */
+    couchstore_error_t io_throttle_account(io_throttle *throttle, uint64_t bytes);
+
+    /** Counts what the target has grown by, like io_throttle_account. */
+    couchstore_error_t io_throttle_progress(io_throttle *throttle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,6 +10,7 @@
 #include "config.h"
 #include "iobuffer.h"
 #include "internal.h"
+#include "util.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -22,6 +23,10 @@
 #define MAX_READ_BUFFERS 8
 #define WRITE_BUFFER_CAPACITY (128*1024)
 #define READ_BUFFER_CAPACITY (8*1024)
+#define MAX_READAHEAD (1024*1024)
+#define MIN_READAHEAD_WINDOW (64*1024)
+// Sequential reads in a row that switch on read-ahead:
+#define READAHEAD_TRIGGER 4
 
 #ifdef min
 #undef min
@@ -46,14 +51,28 @@ typedef struct file_buffer {
 typedef struct buffered_file_handle {
     const couch_file_ops* raw_ops;
     couch_file_handle raw_ops_handle;
+    size_t read_buffer_capacity;
+    size_t write_buffer_capacity;
+    unsigned max_read_buffers;
     unsigned nbuffers;
     file_buffer* write_buffer;
     file_buffer* first_buffer;
+    // Sequential read detection and read-ahead:
+    size_t max_readahead;
+    int advise_readahead;
+    cs_off_t seq_next;
+    unsigned seq_reads;
+    size_t readahead_window;
+    file_buffer* readahead;
+    couchstore_io_stats* stats;
+    // The raw handle is another handle's, read through but never written,
+    // closed or destroyed:
+    int borrowed;
 } buffered_file_handle;
 
 
 static file_buffer* new_buffer(buffered_file_handle* owner, size_t capacity) {
-    file_buffer *buf = static_cast<file_buffer*>(malloc(sizeof(file_buffer) + capacity));
+    file_buffer *buf = static_cast<file_buffer*>(cs_malloc(sizeof(file_buffer) + capacity));
     if (buf) {
         buf->prev = buf->next = NULL;
         buf->owner = owner;
@@ -72,7 +91,40 @@ static void free_buffer(file_buffer* buf) {
 #if LOG_BUFFER
     fprintf(stderr, "BUFFER: %p freed\n", buf);
 #endif
-    free(buf);
+    cs_free(buf);
+}
+
+
+//////// STATISTICS:
+
+
+// Calls to the raw ops are timed only if someone is collecting the numbers.
+static inline hrtime_t stats_start(buffered_file_handle* h) {
+    return h->stats ? gethrtime() : 0;
+}
+
+static inline uint64_t elapsed_us(hrtime_t start) {
+    return (uint64_t)((gethrtime() - start) / 1000);
+}
+
+static void count_read(buffered_file_handle* h, hrtime_t start, ssize_t result) {
+    if (h->stats) {
+        ++h->stats->reads;
+        if (result > 0) {
+            h->stats->bytes_read += result;
+        }
+        couch_histogram_add(&h->stats->read_latency, elapsed_us(start));
+    }
+}
+
+static void count_write(buffered_file_handle* h, hrtime_t start, ssize_t result) {
+    if (h->stats) {
+        ++h->stats->writes;
+        if (result > 0) {
+            h->stats->bytes_written += result;
+        }
+        couch_histogram_add(&h->stats->write_latency, elapsed_us(start));
+    }
 }
 
 
@@ -104,13 +156,18 @@ static size_t write_to_buffer(file_buffer* buf, const void *bytes, size_t nbyte,
 // Write the current buffer to disk and empty it.
 static couchstore_error_t flush_buffer(couchstore_error_info_t *errinfo,
                                        file_buffer* buf) {
+    if (buf == NULL) {
+        return COUCHSTORE_SUCCESS;
+    }
     while (buf->length > 0 && buf->dirty) {
         ssize_t raw_written;
+        hrtime_t start = stats_start(buf->owner);
         raw_written = buf->owner->raw_ops->pwrite(errinfo,
                                                   buf->owner->raw_ops_handle,
                                                   buf->bytes,
                                                   buf->length,
                                                   buf->offset);
+        count_write(buf->owner, start, raw_written);
 #if LOG_BUFFER
         fprintf(stderr, "BUFFER: %p flush %zd bytes at %zd --> %zd\n",
                 buf, buf->length, buf->offset, raw_written);
@@ -160,11 +217,13 @@ static couchstore_error_t load_buffer_from(couchstore_error_info_t *errinfo,
     }
 
     // Read data to extend the buffer to its capacity (if possible):
+    hrtime_t start = stats_start(buf->owner);
     ssize_t bytes_read = buf->owner->raw_ops->pread(errinfo,
                                                     buf->owner->raw_ops_handle,
                                                     buf->bytes + buf->length,
                                                     buf->capacity - buf->length,
                                                     buf->offset + buf->length);
+    count_read(buf->owner, start, bytes_read);
 #if LOG_BUFFER
     fprintf(stderr, "BUFFER: %p loaded %zd bytes from %zd\n", buf, bytes_read, offset + buf->length);
 #endif
@@ -180,15 +239,23 @@ static couchstore_error_t load_buffer_from(couchstore_error_info_t *errinfo,
 
 
 static file_buffer* find_buffer(buffered_file_handle* h, cs_off_t offset) {
-    offset = offset - offset % READ_BUFFER_CAPACITY;
+    offset = offset - offset % h->read_buffer_capacity;
+    if (h->first_buffer == NULL) {
+        // Read buffers are only allocated once the handle is read from:
+        h->first_buffer = new_buffer(h, h->read_buffer_capacity);
+        if (h->first_buffer == NULL) {
+            return NULL;
+        }
+        h->nbuffers = 1;
+    }
     // Find a buffer for this offset, or use the last one:
     file_buffer* buffer = h->first_buffer;
     while (buffer->offset != offset && buffer->next != NULL)
         buffer = buffer->next;
     if (buffer->offset != offset) {
-        if (h->nbuffers < MAX_READ_BUFFERS) {
+        if (h->nbuffers < h->max_read_buffers) {
             // Didn't find a matching one, but we can still create another:
-            file_buffer* buffer2 = new_buffer(h, READ_BUFFER_CAPACITY);
+            file_buffer* buffer2 = new_buffer(h, h->read_buffer_capacity);
             if (buffer2) {
                 buffer = buffer2;
                 ++h->nbuffers;
@@ -197,6 +264,9 @@ static file_buffer* find_buffer(buffered_file_handle* h, cs_off_t offset) {
 #if LOG_BUFFER
             fprintf(stderr, "BUFFER: %p recycled, from %zd to %zd\n", buffer, buffer->offset, offset);
 #endif
+            if (h->stats && buffer->length > 0) {
+                ++h->stats->buffer_evictions;
+            }
         }
     }
     if (buffer != h->first_buffer) {
@@ -212,9 +282,101 @@ static file_buffer* find_buffer(buffered_file_handle* h, cs_off_t offset) {
 }
 
 
+//////// READ-AHEAD:
+
+
+// Tracks whether reads that miss the buffers walk forward through the file.
+// B-tree scans are mostly ascending but keep detouring to interior nodes, so
+// a miss that doesn't continue the stream only weakens the streak instead of
+// ending it.
+static void track_miss(buffered_file_handle* h, cs_off_t offset) {
+    cs_off_t block_end = offset - (offset % h->read_buffer_capacity) +
+                         h->read_buffer_capacity;
+    if (offset >= h->seq_next &&
+        offset <= h->seq_next + (cs_off_t)h->read_buffer_capacity) {
+        ++h->seq_reads;
+        h->seq_next = block_end;
+    } else if (h->seq_reads > 0) {
+        --h->seq_reads;
+    } else {
+        h->seq_next = block_end;
+    }
+}
+
+static int readahead_enabled(buffered_file_handle* h) {
+    return h->max_readahead > h->read_buffer_capacity &&
+           h->seq_reads >= READAHEAD_TRIGGER;
+}
+
+// Fills the read-ahead buffer with a window starting at 'offset'. The window
+// doubles (up to max_readahead) each time the stream runs off the end of the
+// previous one.
+static couchstore_error_t load_readahead(couchstore_error_info_t *errinfo,
+                                         buffered_file_handle* h,
+                                         cs_off_t offset) {
+    file_buffer* ra = h->readahead;
+    if (ra == NULL) {
+        ra = h->readahead = new_buffer(h, h->max_readahead);
+        if (ra == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
+
+    cs_off_t ra_end = ra->offset + (cs_off_t)ra->length;
+    if (ra->length > 0 && offset >= ra_end &&
+        offset <= ra_end + (cs_off_t)h->read_buffer_capacity) {
+        h->readahead_window = min(h->readahead_window * 2, h->max_readahead);
+    } else {
+        h->readahead_window = min(MIN_READAHEAD_WINDOW, h->max_readahead);
+    }
+
+    ra->offset = offset - (offset % h->read_buffer_capacity);
+    ra->length = 0;
+    hrtime_t start = stats_start(h);
+    ssize_t bytes_read = h->raw_ops->pread(errinfo, h->raw_ops_handle,
+                                           ra->bytes, h->readahead_window,
+                                           ra->offset);
+    count_read(h, start, bytes_read);
+#if LOG_BUFFER
+    fprintf(stderr, "BUFFER: read-ahead %zd bytes from %zd\n", bytes_read, ra->offset);
+#endif
+    if (bytes_read < 0) {
+        return (couchstore_error_t) bytes_read;
+    }
+    ra->length = bytes_read;
+    h->seq_next = ra->offset + bytes_read;
+
+    if (h->advise_readahead && h->raw_ops->advise &&
+        (size_t)bytes_read == h->readahead_window) {
+        // Advice is only a hint, so failures don't matter:
+        h->raw_ops->advise(errinfo, h->raw_ops_handle,
+                           ra->offset + bytes_read,
+                           (cs_off_t)min(h->readahead_window * 2, h->max_readahead),
+                           COUCHSTORE_FILE_ADVICE_WILLNEED);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+
 //////// FILE API:
 
 
+static void free_buffers(buffered_file_handle *h)
+{
+    free_buffer(h->write_buffer);
+    h->write_buffer = NULL;
+    file_buffer* buffer, *next;
+    for (buffer = h->first_buffer; buffer; buffer = next) {
+        next = buffer->next;
+        free_buffer(buffer);
+    }
+    h->first_buffer = NULL;
+    h->nbuffers = 0;
+    free_buffer(h->readahead);
+    h->readahead = NULL;
+    h->readahead_window = 0;
+}
+
 static void buffered_destructor(couchstore_error_info_t *errinfo,
                                 couch_file_handle handle)
 {
@@ -222,31 +384,36 @@ static void buffered_destructor(couchstore_error_info_t *errinfo,
     if (!h) {
         return;
     }
-    h->raw_ops->destructor(errinfo, h->raw_ops_handle);
-
-    free_buffer(h->write_buffer);
-    file_buffer* buffer, *next;
-    for (buffer = h->first_buffer; buffer; buffer = next) {
-        next = buffer->next;
-        free_buffer(buffer);
+    if (!h->borrowed) {
+        h->raw_ops->destructor(errinfo, h->raw_ops_handle);
     }
-    free(h);
+
+    free_buffers(h);
+    cs_free(h);
 }
 
 static couch_file_handle buffered_constructor_with_raw_ops(couchstore_error_info_t *errinfo, const couch_file_ops* raw_ops)
 {
-    buffered_file_handle *h = static_cast<buffered_file_handle*>(malloc(sizeof(buffered_file_handle)));
+    buffered_file_handle *h = static_cast<buffered_file_handle*>(cs_malloc(sizeof(buffered_file_handle)));
     if (h) {
         h->raw_ops = raw_ops;
         h->raw_ops_handle = raw_ops->constructor(errinfo, raw_ops->cookie);
-        h->nbuffers = 1;
-        h->write_buffer = new_buffer(h, WRITE_BUFFER_CAPACITY);
-        h->first_buffer = new_buffer(h, READ_BUFFER_CAPACITY);
-
-        if (!h->write_buffer || !h->first_buffer) {
-            buffered_destructor(errinfo, (couch_file_handle)h);
-            h = NULL;
-        }
+        h->read_buffer_capacity = READ_BUFFER_CAPACITY;
+        h->write_buffer_capacity = WRITE_BUFFER_CAPACITY;
+        h->max_read_buffers = MAX_READ_BUFFERS;
+        h->max_readahead = MAX_READAHEAD;
+        h->advise_readahead = 0;
+        h->seq_next = 0;
+        h->seq_reads = 0;
+        h->readahead_window = 0;
+        h->readahead = NULL;
+        h->stats = NULL;
+        h->borrowed = 0;
+        // Buffers are allocated on first use, so read-only or memory-mapped
+        // handles never pay for a write buffer:
+        h->nbuffers = 0;
+        h->write_buffer = NULL;
+        h->first_buffer = NULL;
     }
     return (couch_file_handle) h;
 }
@@ -275,7 +442,9 @@ static void buffered_close(couchstore_error_info_t *errinfo,
         return;
     }
     flush_buffer(errinfo, h->write_buffer);
-    h->raw_ops->close(errinfo, h->raw_ops_handle);
+    if (!h->borrowed) {
+        h->raw_ops->close(errinfo, h->raw_ops_handle);
+    }
 }
 
 static ssize_t buffered_pread(couchstore_error_info_t *errinfo,
@@ -296,10 +465,34 @@ static ssize_t buffered_pread(couchstore_error_info_t *errinfo,
 
     ssize_t total_read = 0;
     while (nbyte > 0) {
+        if (h->readahead) {
+            ssize_t nbyte_read = read_from_buffer(h->readahead, buf, nbyte, offset);
+            if (nbyte_read > 0) {
+                if (h->stats) {
+                    ++h->stats->buffer_hits;
+                }
+                buf = (char*)buf + nbyte_read;
+                nbyte -= nbyte_read;
+                offset += nbyte_read;
+                total_read += nbyte_read;
+                continue;
+            }
+        }
+
         file_buffer* buffer = find_buffer(h, offset);
+        if (buffer == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
 
         // Read as much as we can from the current buffer:
         ssize_t nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
+        if (h->stats) {
+            if (nbyte_read > 0) {
+                ++h->stats->buffer_hits;
+            } else {
+                ++h->stats->buffer_misses;
+            }
+        }
         if (nbyte_read == 0) {
             /*if (nbyte > buffer->capacity) {
                 // Remainder won't fit in a single buffer, so just read it directly:
@@ -308,11 +501,21 @@ static ssize_t buffered_pread(couchstore_error_info_t *errinfo,
                     return nbyte_read;
                 }
             } else*/ {
-                // Move the buffer to cover the remainder of the data to be read.
-                cs_off_t block_start = offset - (offset % READ_BUFFER_CAPACITY);
-                err = load_buffer_from(errinfo, buffer, block_start, (size_t)(offset + nbyte - block_start));
-                if (err < 0) {
-                    return err;
+                cs_off_t block_start = offset - (offset % h->read_buffer_capacity);
+                track_miss(h, offset);
+                if (readahead_enabled(h)) {
+                    // Sequential scan: fetch a large window at once.
+                    err = load_readahead(errinfo, h, offset);
+                    if (err < 0) {
+                        return err;
+                    }
+                    buffer = h->readahead;
+                } else {
+                    // Move the buffer to cover the remainder of the data to be read.
+                    err = load_buffer_from(errinfo, buffer, block_start, (size_t)(offset + nbyte - block_start));
+                    if (err < 0) {
+                        return err;
+                    }
                 }
                 nbyte_read = read_from_buffer(buffer, buf, nbyte, offset);
                 if (nbyte_read == 0)
@@ -341,6 +544,15 @@ static ssize_t buffered_pwrite(couchstore_error_info_t *errinfo,
     }
 
     buffered_file_handle *h = (buffered_file_handle*)handle;
+    if (h->borrowed) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (h->write_buffer == NULL) {
+        h->write_buffer = new_buffer(h, h->write_buffer_capacity);
+        if (h->write_buffer == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+    }
     file_buffer* buffer = h->write_buffer;
 
     // Write data to the current buffer:
@@ -364,8 +576,10 @@ static ssize_t buffered_pwrite(couchstore_error_info_t *errinfo,
         if (nbyte <= (buffer->capacity - buffer->length)) {
             written = write_to_buffer(buffer, buf, nbyte, offset);
         } else {
+            hrtime_t start = stats_start(h);
             written = h->raw_ops->pwrite(errinfo, h->raw_ops_handle, buf,
                                          nbyte, offset);
+            count_write(h, start, written);
 #if LOG_BUFFER
             fprintf(stderr, "BUFFER: passthru %zd bytes at %zd --> %zd\n",
                     nbyte, offset, written);
@@ -380,6 +594,118 @@ static ssize_t buffered_pwrite(couchstore_error_info_t *errinfo,
     return nbyte_written;
 }
 
+// Writes every byte of the chunks with the raw ops, in one system call per
+// batch if the raw ops can gather.
+static couchstore_error_t raw_pwritev_all(couchstore_error_info_t *errinfo,
+                                          buffered_file_handle *h,
+                                          const sized_buf *iov,
+                                          int iovcnt,
+                                          cs_off_t offset)
+{
+    const couch_file_ops *raw = h->raw_ops;
+    int can_gather = raw->version >= 6 && raw->pwritev != NULL;
+    sized_buf first = iov[0];   // what's left of iov[0] after a short write
+
+    while (iovcnt > 0) {
+        ssize_t written;
+        if (first.size == 0) {
+            if (--iovcnt > 0) {
+                first = *++iov;
+            }
+            continue;
+        }
+        hrtime_t start = stats_start(h);
+        if (can_gather && first.buf == iov->buf) {
+            written = raw->pwritev(errinfo, h->raw_ops_handle, iov, iovcnt, offset);
+        } else {
+            written = raw->pwrite(errinfo, h->raw_ops_handle, first.buf,
+                                  first.size, offset);
+        }
+        count_write(h, start, written);
+#if LOG_BUFFER
+        fprintf(stderr, "BUFFER: gather %d chunks at %zd --> %zd\n",
+                iovcnt, offset, written);
+#endif
+        if (written < 0) {
+            return (couchstore_error_t) written;
+        } else if (written == 0) {
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        offset += written;
+        while (written > 0 && iovcnt > 0) {
+            size_t n = (size_t)min(written, (ssize_t)first.size);
+            first.buf += n;
+            first.size -= n;
+            written -= n;
+            if (first.size == 0 && --iovcnt > 0) {
+                first = *++iov;
+            }
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+#define GATHER_BATCH 64
+
+static ssize_t buffered_pwritev(couchstore_error_info_t *errinfo,
+                                couch_file_handle handle,
+                                const sized_buf *iov,
+                                int iovcnt,
+                                cs_off_t offset)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    size_t total = 0;
+    int i;
+
+    if (h->borrowed) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].size;
+    }
+
+    // Small writes are gathered in the write buffer like any other:
+    if (total < h->write_buffer_capacity) {
+        cs_off_t pos = offset;
+        for (i = 0; i < iovcnt; ++i) {
+            ssize_t written = buffered_pwrite(errinfo, handle, iov[i].buf,
+                                              iov[i].size, pos);
+            if (written < 0) {
+                return written;
+            }
+            pos += written;
+        }
+        return (ssize_t)(pos - offset);
+    }
+
+    // Larger ones go straight to the file. Whatever is buffered just ahead
+    // of them goes out in the same call rather than a flush of its own.
+    file_buffer *buffer = h->write_buffer;
+    couchstore_error_t err;
+    if (buffer && buffer->dirty && buffer->length > 0 &&
+            buffer->offset + (cs_off_t)buffer->length == offset &&
+            iovcnt < GATHER_BATCH) {
+        sized_buf vec[GATHER_BATCH];
+        vec[0].buf = (char *)buffer->bytes;
+        vec[0].size = buffer->length;
+        memcpy(vec + 1, iov, iovcnt * sizeof(sized_buf));
+        err = raw_pwritev_all(errinfo, h, vec, iovcnt + 1, buffer->offset);
+        if (err == COUCHSTORE_SUCCESS) {
+            buffer->length = 0;
+            buffer->dirty = 0;
+        }
+    } else {
+        err = flush_buffer(errinfo, buffer);
+        if (err == COUCHSTORE_SUCCESS) {
+            err = raw_pwritev_all(errinfo, h, iov, iovcnt, offset);
+        }
+    }
+    if (err < 0) {
+        return err;
+    }
+    return (ssize_t)total;
+}
+
 static cs_off_t buffered_goto_eof(couchstore_error_info_t *errinfo,
                                   couch_file_handle handle)
 {
@@ -393,7 +719,12 @@ static couchstore_error_t buffered_sync(couchstore_error_info_t *errinfo,
     buffered_file_handle *h = (buffered_file_handle*)handle;
     couchstore_error_t err = flush_buffer(errinfo, h->write_buffer);
     if (err == COUCHSTORE_SUCCESS) {
+        hrtime_t start = stats_start(h);
         err = h->raw_ops->sync(errinfo, h->raw_ops_handle);
+        if (h->stats) {
+            ++h->stats->syncs;
+            couch_histogram_add(&h->stats->sync_latency, elapsed_us(start));
+        }
     }
     return err;
 }
@@ -408,8 +739,38 @@ static couchstore_error_t buffered_advise(couchstore_error_info_t *errinfo,
     return h->raw_ops->advise(errinfo, h->raw_ops_handle, offs, len, adv);
 }
 
+static couchstore_error_t buffered_allocate(couchstore_error_info_t *errinfo,
+                                            couch_file_handle handle,
+                                            cs_off_t offset,
+                                            cs_off_t len)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    const couch_file_ops *raw = h->raw_ops;
+    if (h->borrowed || raw->version < 7 || raw->allocate == NULL || raw->truncate == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    return raw->allocate(errinfo, h->raw_ops_handle, offset, len);
+}
+
+static couchstore_error_t buffered_truncate(couchstore_error_info_t *errinfo,
+                                            couch_file_handle handle,
+                                            cs_off_t size)
+{
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    const couch_file_ops *raw = h->raw_ops;
+    if (h->borrowed || raw->version < 7 || raw->truncate == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    // Pending writes go out first, or they could land past the new end.
+    couchstore_error_t err = flush_buffer(errinfo, h->write_buffer);
+    if (err == COUCHSTORE_SUCCESS) {
+        err = raw->truncate(errinfo, h->raw_ops_handle, size);
+    }
+    return err;
+}
+
 static const couch_file_ops ops = {
-    (uint64_t)5,
+    (uint64_t)7,
     buffered_constructor,
     buffered_open,
     buffered_close,
@@ -419,7 +780,10 @@ static const couch_file_ops ops = {
     buffered_sync,
     buffered_advise,
     buffered_destructor,
-    NULL
+    NULL,
+    buffered_pwritev,
+    buffered_allocate,
+    buffered_truncate
 };
 
 const couch_file_ops *couch_get_buffered_file_ops(couchstore_error_info_t *errinfo,
@@ -434,3 +798,145 @@ const couch_file_ops *couch_get_buffered_file_ops(couchstore_error_info_t *errin
         return NULL;
     }
 }
+
+couchstore_error_t couch_share_buffered_file(couchstore_error_info_t *errinfo,
+                                             const couch_file_ops *buffered_ops,
+                                             couch_file_handle source,
+                                             couch_file_handle *handle)
+{
+    if (buffered_ops != &ops || source == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    buffered_file_handle *src = (buffered_file_handle*)source;
+    // What the source has written has to be in the file to be read back
+    // through its raw handle:
+    couchstore_error_t err = flush_buffer(errinfo, src->write_buffer);
+    if (err < 0) {
+        return err;
+    }
+    buffered_file_handle *h = static_cast<buffered_file_handle*>(cs_malloc(sizeof(buffered_file_handle)));
+    if (h == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *h = *src;
+    h->nbuffers = 0;
+    h->write_buffer = NULL;
+    h->first_buffer = NULL;
+    h->seq_next = 0;
+    h->seq_reads = 0;
+    h->readahead_window = 0;
+    h->readahead = NULL;
+    h->stats = NULL;
+    h->borrowed = 1;
+    *handle = (couch_file_handle) h;
+    return COUCHSTORE_SUCCESS;
+}
+
+ssize_t couch_pread_unbuffered(couchstore_error_info_t *errinfo,
+                               const couch_file_ops *buffered_ops,
+                               couch_file_handle handle,
+                               void *buf,
+                               size_t nbyte,
+                               cs_off_t offset)
+{
+    if (buffered_ops != &ops || handle == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    couchstore_error_t err = flush_buffer(errinfo, h->write_buffer);
+    if (err < 0) {
+        return err;
+    }
+    hrtime_t start = stats_start(h);
+    ssize_t got = h->raw_ops->pread(errinfo, h->raw_ops_handle, buf, nbyte, offset);
+    count_read(h, start, got);
+    return got;
+}
+
+couchstore_error_t couch_flush_buffered_file(couchstore_error_info_t *errinfo,
+                                             const couch_file_ops *buffered_ops,
+                                             couch_file_handle handle)
+{
+    if (buffered_ops != &ops || handle == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    return flush_buffer(errinfo, ((buffered_file_handle*)handle)->write_buffer);
+}
+
+ssize_t couch_pwrite_unbuffered(couchstore_error_info_t *errinfo,
+                                const couch_file_ops *buffered_ops,
+                                couch_file_handle handle,
+                                const void *buf,
+                                size_t nbyte,
+                                cs_off_t offset)
+{
+    if (buffered_ops != &ops || handle == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    hrtime_t start = stats_start(h);
+    ssize_t written = h->raw_ops->pwrite(errinfo, h->raw_ops_handle, buf,
+                                         nbyte, offset);
+    count_write(h, start, written);
+    return written;
+}
+
+couchstore_error_t couch_set_buffer_options(couchstore_error_info_t *errinfo,
+                                            const couch_file_ops *buffered_ops,
+                                            couch_file_handle handle,
+                                            const couchstore_buffer_options *options)
+{
+    if (buffered_ops != &ops || handle == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    buffered_file_handle *h = (buffered_file_handle*)handle;
+    couchstore_error_t err = flush_buffer(errinfo, h->write_buffer);
+    if (err < 0) {
+        return err;
+    }
+
+    // The buffers are recreated with the new sizes on next use:
+    free_buffers(h);
+    h->read_buffer_capacity = options->read_buffer_capacity ?
+        options->read_buffer_capacity : READ_BUFFER_CAPACITY;
+    h->write_buffer_capacity = options->write_buffer_capacity ?
+        options->write_buffer_capacity : WRITE_BUFFER_CAPACITY;
+    h->max_read_buffers = options->max_read_buffers ?
+        options->max_read_buffers : MAX_READ_BUFFERS;
+    h->max_readahead = options->max_readahead ?
+        options->max_readahead : MAX_READAHEAD;
+    h->advise_readahead = options->advise_readahead;
+    return COUCHSTORE_SUCCESS;
+}
+
+void couch_set_io_stats(const couch_file_ops *buffered_ops,
+                        couch_file_handle handle,
+                        couchstore_io_stats *stats)
+{
+    if (buffered_ops == &ops && handle != NULL) {
+        ((buffered_file_handle*)handle)->stats = stats;
+    }
+}
+
+static size_t buffer_memory(const file_buffer* buf)
+{
+    return buf ? sizeof(file_buffer) + buf->capacity : 0;
+}
+
+size_t couch_buffered_file_memory(const couch_file_ops *buffered_ops,
+                                  couch_file_handle handle)
+{
+    if (buffered_ops != &ops || handle == NULL) {
+        return 0;
+    }
+    const buffered_file_handle *h = (const buffered_file_handle*)handle;
+    size_t total = sizeof(buffered_file_handle) + buffer_memory(h->write_buffer) +
+                   buffer_memory(h->readahead);
+    const file_buffer* buffer;
+    for (buffer = h->first_buffer; buffer; buffer = buffer->next) {
+        total += buffer_memory(buffer);
+    }
+    return total;
+}
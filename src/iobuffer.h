@@ -22,4 +22,102 @@ const couch_file_ops *couch_get_buffered_file_ops(couchstore_error_info_t *errin
                                                   const couch_file_ops* raw_ops,
                                                   couch_file_handle* handle);
 
+/**
+ * Constructs a handle with buffers of its own that reads through the raw
+ * handle underneath another one, for reading a file from another thread
+ * while its owner goes on writing it. The source's pending writes are
+ * flushed first, so everything it has written can be read. The new handle
+ * can't write, and closing it leaves the raw handle open; it must be
+ * destroyed before the source is. The raw ops must allow concurrent preads
+ * on one handle, as the default ones do.
+ * @param buffered_ops the ops returned by couch_get_buffered_file_ops
+ * @param source the handle returned by couch_get_buffered_file_ops
+ * @param handle on output, the new handle, already open and used with the
+ *        same ops
+ * @return COUCHSTORE_SUCCESS, or an error if pending writes couldn't be flushed
+ */
+couchstore_error_t couch_share_buffered_file(couchstore_error_info_t *errinfo,
+                                             const couch_file_ops *buffered_ops,
+                                             couch_file_handle source,
+                                             couch_file_handle *handle);
+
+/**
+ * Reads straight from the raw handle underneath a handle created by
+ * couch_get_buffered_file_ops, passing by its read buffers, once its
+ * pending writes are flushed. For the parts of the file rewritten in
+ * place, such as the header hints, which a read buffer may hold as they
+ * were before.
+ * @param buffered_ops the ops returned by couch_get_buffered_file_ops
+ * @param handle the handle returned by couch_get_buffered_file_ops
+ * @return the bytes read, or an error
+ */
+ssize_t couch_pread_unbuffered(couchstore_error_info_t *errinfo,
+                               const couch_file_ops *buffered_ops,
+                               couch_file_handle handle,
+                               void *buf,
+                               size_t nbyte,
+                               cs_off_t offset);
+
+/**
+ * Writes out the pending writes of a handle created by
+ * couch_get_buffered_file_ops, without syncing them.
+ * @param buffered_ops the ops returned by couch_get_buffered_file_ops
+ * @param handle the handle returned by couch_get_buffered_file_ops
+ * @return COUCHSTORE_SUCCESS, or an error if they couldn't be written
+ */
+couchstore_error_t couch_flush_buffered_file(couchstore_error_info_t *errinfo,
+                                             const couch_file_ops *buffered_ops,
+                                             couch_file_handle handle);
+
+/**
+ * Writes straight to the raw handle underneath a handle created by
+ * couch_get_buffered_file_ops or couch_share_buffered_file, passing by
+ * their buffers, for a part of the file that nothing buffers writes to.
+ * Shared handles, which can't write otherwise, can write this way.
+ * @param buffered_ops the ops returned by couch_get_buffered_file_ops
+ * @param handle either handle
+ * @return the bytes written, or an error
+ */
+ssize_t couch_pwrite_unbuffered(couchstore_error_info_t *errinfo,
+                                const couch_file_ops *buffered_ops,
+                                couch_file_handle handle,
+                                const void *buf,
+                                size_t nbyte,
+                                cs_off_t offset);
+
+/**
+ * Changes the buffer sizes of a handle created by couch_get_buffered_file_ops.
+ * Pending writes are flushed and the existing buffers released; new ones are
+ * allocated with the new sizes as they are needed.
+ * @param buffered_ops the ops returned by couch_get_buffered_file_ops
+ * @param handle the handle returned by couch_get_buffered_file_ops
+ * @param options the new sizes; zero fields select the defaults
+ * @return COUCHSTORE_SUCCESS, or an error if pending writes couldn't be flushed
+ */
+couchstore_error_t couch_set_buffer_options(couchstore_error_info_t *errinfo,
+                                            const couch_file_ops *buffered_ops,
+                                            couch_file_handle handle,
+                                            const couchstore_buffer_options *options);
+
+/**
+ * Starts or stops counting the raw I/O of a handle created by
+ * couch_get_buffered_file_ops.
+ * @param buffered_ops the ops returned by couch_get_buffered_file_ops
+ * @param handle the handle returned by couch_get_buffered_file_ops
+ * @param stats where to add up the counts, or NULL to stop counting
+ */
+void couch_set_io_stats(const couch_file_ops *buffered_ops,
+                        couch_file_handle handle,
+                        couchstore_io_stats *stats);
+
+/**
+ * Gets the memory a handle created by couch_get_buffered_file_ops holds in
+ * its buffers, or 0 for any other handle.
+ * @param buffered_ops the ops returned by couch_get_buffered_file_ops
+ * @param handle the handle returned by couch_get_buffered_file_ops
+ * @return the bytes allocated for the handle and its buffers
+ */
+size_t couch_buffered_file_memory(const couch_file_ops *buffered_ops,
+                                  couch_file_handle handle);
+
 #endif // LIBCOUCHSTORE_IOBUFFER_H
@@ -0,0 +1,146 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Cache of a Db's local documents.
+//
+// Servers keep their checkpoints in local documents (_local/vbstate and
+// the like), reading them far more often than they write them, and each
+// read is a lookup in the local docs tree. A handful of entries, scanned
+// in order, holds all of the hot ones; replacing them round-robin is
+// enough at that size.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "local_doc_cache.h"
+#include "util.h"
+
+#define LOCAL_CACHE_ENTRIES 8
+#define LOCAL_CACHE_MAX_DOC 4096    // Bigger documents go to the tree each time
+
+struct local_doc_cache {
+    uint64_t root;              // where the documents' tree is rooted, or 0
+    LocalDoc *entries[LOCAL_CACHE_ENTRIES];
+    size_t sizes[LOCAL_CACHE_ENTRIES];
+    unsigned next;              // slot replaced next
+};
+
+local_doc_cache *local_cache_create(void)
+{
+    return static_cast<local_doc_cache *>(cs_calloc(1, sizeof(local_doc_cache)));
+}
+
+static void drop_entry(local_doc_cache *cache, unsigned i)
+{
+    cs_free(cache->entries[i]);
+    cache->entries[i] = NULL;
+    cache->sizes[i] = 0;
+}
+
+void local_cache_clear(local_doc_cache *cache)
+{
+    unsigned i;
+    if (cache == NULL) {
+        return;
+    }
+    for (i = 0; i < LOCAL_CACHE_ENTRIES; ++i) {
+        drop_entry(cache, i);
+    }
+    cache->root = 0;
+}
+
+void local_cache_destroy(local_doc_cache *cache)
+{
+    local_cache_clear(cache);
+    cs_free(cache);
+}
+
+static int find_entry(const local_doc_cache *cache, const sized_buf *id)
+{
+    unsigned i;
+    for (i = 0; i < LOCAL_CACHE_ENTRIES; ++i) {
+        const LocalDoc *doc = cache->entries[i];
+        if (doc && ebin_compare(&doc->id, id) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+const LocalDoc *local_cache_get(local_doc_cache *cache, uint64_t root,
+                                const sized_buf *id)
+{
+    if (cache == NULL) {
+        return NULL;
+    }
+    if (cache->root != root) {
+        local_cache_clear(cache);
+        return NULL;
+    }
+    int i = find_entry(cache, id);
+    return i < 0 ? NULL : cache->entries[i];
+}
+
+void local_cache_put(local_doc_cache *cache, uint64_t root, const LocalDoc *doc)
+{
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->root != root) {
+        local_cache_clear(cache);
+        cache->root = root;
+    }
+    int i = find_entry(cache, &doc->id);
+    if (i >= 0) {
+        drop_entry(cache, i);
+    }
+    size_t size = sizeof(LocalDoc) + doc->id.size + doc->json.size;
+    if (doc->deleted || size > LOCAL_CACHE_MAX_DOC) {
+        return;
+    }
+    LocalDoc *copy = static_cast<LocalDoc *>(cs_malloc(size));
+    if (copy == NULL) {
+        return;
+    }
+    copy->id.buf = (char *)(copy + 1);
+    copy->id.size = doc->id.size;
+    memcpy(copy->id.buf, doc->id.buf, doc->id.size);
+    copy->json.buf = copy->id.buf + doc->id.size;
+    copy->json.size = doc->json.size;
+    memcpy(copy->json.buf, doc->json.buf, doc->json.size);
+    copy->deleted = 0;
+
+    if (i < 0) {
+        i = (int)cache->next;
+        cache->next = (cache->next + 1) % LOCAL_CACHE_ENTRIES;
+        drop_entry(cache, i);
+    }
+    cache->entries[i] = copy;
+    cache->sizes[i] = size;
+}
+
+void local_cache_saved(local_doc_cache *cache, uint64_t old_root,
+                       uint64_t new_root, const LocalDoc *doc)
+{
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->root == old_root) {
+        cache->root = new_root;
+    }
+    local_cache_put(cache, new_root, doc);
+}
+
+size_t local_cache_memory(const local_doc_cache *cache)
+{
+    unsigned i;
+    if (cache == NULL) {
+        return 0;
+    }
+    size_t total = sizeof(local_doc_cache);
+    for (i = 0; i < LOCAL_CACHE_ENTRIES; ++i) {
+        total += cache->sizes[i];
+    }
+    return total;
+}
@@ -0,0 +1,50 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_LOCAL_DOC_CACHE_H
+#define LIBCOUCHSTORE_LOCAL_DOC_CACHE_H 1
+
+#include <libcouchstore/couch_db.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* The last few local documents a Db read or saved, small ones only,
+       copied out of the local docs tree whose root node is at a given
+       file position. Since nodes are never rewritten in place, they're
+       good for as long as the root stays there; a root elsewhere, after a
+       commit of someone else's saves or a rewind, empties the cache. */
+    typedef struct local_doc_cache local_doc_cache;
+
+    local_doc_cache *local_cache_create(void);
+
+    void local_cache_destroy(local_doc_cache *cache);
+
+    /** Forgets every document, e.g. when switching to another file. */
+    void local_cache_clear(local_doc_cache *cache);
+
+    /**
+     * Looks a document up in the tree rooted at root.
+     * @return the cached copy, which stays the cache's, or NULL
+     */
+    const LocalDoc *local_cache_get(local_doc_cache *cache, uint64_t root,
+                                    const sized_buf *id);
+
+    /** Keeps a copy of a document read from the tree rooted at root,
+        unless it's too big to be worth it. */
+    void local_cache_put(local_doc_cache *cache, uint64_t root,
+                         const LocalDoc *doc);
+
+    /** Follows a save of doc that moved the tree from old_root to
+        new_root: the other documents are the same in the new tree, so
+        they're kept if they were from the old one. */
+    void local_cache_saved(local_doc_cache *cache, uint64_t old_root,
+                           uint64_t new_root, const LocalDoc *doc);
+
+    /** The bytes the cache and its documents take. */
+    size_t local_cache_memory(const local_doc_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,333 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Cache of decoded B-tree nodes for a single file.
+//
+// Lookups start at the root and walk down through interior (KP) nodes that
+// change only when a commit rewrites them at a new position, so the upper
+// levels of a tree are read, decompressed and parsed again on every lookup.
+// Keeping them decoded, keyed by position, turns all of that into a hash
+// probe. Nodes are charged by size against a budget and evicted in LRU
+// order; a node still referenced by a lookup in progress is never freed.
+//
+// The cache has a lock of its own, so threads sharing a tree_file (a view
+// group's update and compaction jobs) share its nodes too. It's only held
+// for the probe or insert; decoding happens outside it.
+//
+// The memory of nodes read by lookups, their buffers and the decoded_node
+// with its entries, comes from per-thread pools of a few size classes, and
+// goes back to them when the nodes are released.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "couch_btree.h"
+#include "node_cache.h"
+#include "node_types.h"
+#include "util.h"
+
+#define NODE_CACHE_BUCKETS 256
+
+// Size classes of node buffers, the powers of two from 256 bytes to 64KB;
+// larger buffers aren't pooled.
+#define NODE_BUF_MIN_SHIFT 8
+#define NODE_BUF_CLASSES 9
+// Bytes of freed buffers each thread keeps
+#define NODE_BUF_POOL_BYTES (1024 * 1024)
+
+struct node_cache {
+    cb_mutex_t mutex;
+    size_t size;
+    size_t used;
+    decoded_node *buckets[NODE_CACHE_BUCKETS];
+    decoded_node *lru_head;     // most recently used
+    decoded_node *lru_tail;
+};
+
+static size_t node_charge(const decoded_node *node)
+{
+    return sizeof(decoded_node) + node->length + node->count * sizeof(node_entry);
+}
+
+static inline decoded_node **bucket_for(node_cache *cache, uint64_t pos)
+{
+    return &cache->buckets[(pos * 0x9E3779B97F4A7C15ULL) >> 56];
+}
+
+namespace {
+    // Ahead of every buffer; 16 bytes, which keeps the buffer aligned.
+    struct node_buf_header {
+        node_buf_header *next;      // in the pool
+        size_t size_class;          // NODE_BUF_CLASSES if not pooled
+    };
+
+    struct node_buf_pool {
+        node_buf_header *free[NODE_BUF_CLASSES];
+        size_t bytes;
+        node_buf_pool() : bytes(0) {
+            memset(free, 0, sizeof(free));
+        }
+        ~node_buf_pool() {
+            for (unsigned i = 0; i < NODE_BUF_CLASSES; ++i) {
+                while (free[i]) {
+                    node_buf_header *header = free[i];
+                    free[i] = header->next;
+                    cs_free(header);
+                }
+            }
+        }
+    };
+    thread_local node_buf_pool buf_pool;
+}
+
+static inline size_t class_size(size_t size_class)
+{
+    return (size_t)1 << (NODE_BUF_MIN_SHIFT + size_class);
+}
+
+char *node_buf_alloc(size_t size)
+{
+    size_t size_class = 0;
+    while (size_class < NODE_BUF_CLASSES && class_size(size_class) < size) {
+        ++size_class;
+    }
+    node_buf_header *header = NULL;
+    if (size_class < NODE_BUF_CLASSES) {
+        header = buf_pool.free[size_class];
+        if (header) {
+            buf_pool.free[size_class] = header->next;
+            buf_pool.bytes -= class_size(size_class);
+            return reinterpret_cast<char *>(header + 1);
+        }
+        size = class_size(size_class);
+    }
+    header = static_cast<node_buf_header *>(cs_malloc(sizeof(node_buf_header) + size));
+    if (header == NULL) {
+        return NULL;
+    }
+    header->size_class = size_class;
+    return reinterpret_cast<char *>(header + 1);
+}
+
+void node_buf_free(char *buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+    node_buf_header *header = reinterpret_cast<node_buf_header *>(buf) - 1;
+    size_t size_class = header->size_class;
+    if (size_class < NODE_BUF_CLASSES &&
+        buf_pool.bytes + class_size(size_class) <= NODE_BUF_POOL_BYTES) {
+        header->next = buf_pool.free[size_class];
+        buf_pool.free[size_class] = header;
+        buf_pool.bytes += class_size(size_class);
+    } else {
+        cs_free(header);
+    }
+}
+
+static void free_node_buf(char *buf, int pooled)
+{
+    if (pooled) {
+        node_buf_free(buf);
+    } else {
+        cs_free(buf);
+    }
+}
+
+// The entries are allocated along with the node.
+static void free_node(decoded_node *node)
+{
+    free_node_buf(node->buf, node->pooled_buf);
+    node_buf_free(reinterpret_cast<char *>(node));
+}
+
+couchstore_error_t decode_node(char *buf, int length, int flags,
+                               decoded_node **pNode)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    decoded_node *node = NULL;
+    unsigned count = 0, i;
+    int bufpos;
+
+    error_unless(length > 0, COUCHSTORE_ERROR_CORRUPT);
+    if (!(flags & DECODE_UNSPLIT_LEAF) || buf[0] != KV_NODE) {
+        for (bufpos = 1; bufpos < length; ++count) {
+            sized_buf key, value;
+            bufpos += read_kv(buf + bufpos, &key, &value);
+        }
+        error_unless(bufpos == length, COUCHSTORE_ERROR_CORRUPT);
+    }
+
+    node = reinterpret_cast<decoded_node *>(
+        node_buf_alloc(sizeof(decoded_node) + count * sizeof(node_entry)));
+    error_unless(node, COUCHSTORE_ERROR_ALLOC_FAIL);
+    memset(node, 0, sizeof(decoded_node));
+    if (count > 0) {
+        node->entries = reinterpret_cast<node_entry *>(node + 1);
+    }
+    for (i = 0, bufpos = 1; i < count; ++i) {
+        bufpos += read_kv(buf + bufpos, &node->entries[i].key, &node->entries[i].value);
+    }
+    node->buf = buf;
+    node->length = length;
+    node->count = count;
+    node->pooled_buf = (flags & DECODE_POOLED_BUF) != 0;
+    node->refcount = 1;
+    *pNode = node;
+
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS) {
+        free_node_buf(buf, flags & DECODE_POOLED_BUF);
+    }
+    return errcode;
+}
+
+static void lru_unlink(node_cache *cache, decoded_node *node)
+{
+    if (node->lru_prev) {
+        node->lru_prev->lru_next = node->lru_next;
+    } else {
+        cache->lru_head = node->lru_next;
+    }
+    if (node->lru_next) {
+        node->lru_next->lru_prev = node->lru_prev;
+    } else {
+        cache->lru_tail = node->lru_prev;
+    }
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void lru_push_front(node_cache *cache, decoded_node *node)
+{
+    node->lru_prev = NULL;
+    node->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = node;
+    } else {
+        cache->lru_tail = node;
+    }
+    cache->lru_head = node;
+}
+
+// Takes a node out of the cache, freeing it unless a lookup still has it.
+static void cache_remove(node_cache *cache, decoded_node *node)
+{
+    decoded_node **link = bucket_for(cache, node->pos);
+    while (*link != node) {
+        link = &(*link)->hash_next;
+    }
+    *link = node->hash_next;
+    node->hash_next = NULL;
+    lru_unlink(cache, node);
+    cache->used -= node_charge(node);
+    node->cached = 0;
+    if (node->refcount == 0) {
+        free_node(node);
+    }
+}
+
+static void evict_to_fit(node_cache *cache, size_t size)
+{
+    while (cache->lru_tail && cache->used > size) {
+        cache_remove(cache, cache->lru_tail);
+    }
+}
+
+void node_release(node_cache *cache, decoded_node *node)
+{
+    if (node == NULL) {
+        return;
+    }
+    if (cache) {
+        cb_mutex_enter(&cache->mutex);
+    }
+    int last = --node->refcount == 0 && !node->cached;
+    if (cache) {
+        cb_mutex_exit(&cache->mutex);
+    }
+    if (last) {
+        free_node(node);
+    }
+}
+
+node_cache *node_cache_create(size_t size)
+{
+    node_cache *cache = static_cast<node_cache *>(cs_calloc(1, sizeof(node_cache)));
+    if (cache) {
+        cb_mutex_initialize(&cache->mutex);
+        cache->size = size;
+    }
+    return cache;
+}
+
+void node_cache_destroy(node_cache *cache)
+{
+    if (cache) {
+        evict_to_fit(cache, 0);
+        cb_mutex_destroy(&cache->mutex);
+        cs_free(cache);
+    }
+}
+
+void node_cache_set_size(node_cache *cache, size_t size)
+{
+    cb_mutex_enter(&cache->mutex);
+    cache->size = size;
+    evict_to_fit(cache, size);
+    cb_mutex_exit(&cache->mutex);
+}
+
+size_t node_cache_memory(node_cache *cache)
+{
+    cb_mutex_enter(&cache->mutex);
+    size_t used = cache->used;
+    cb_mutex_exit(&cache->mutex);
+    return sizeof(node_cache) + used;
+}
+
+decoded_node *node_cache_get(node_cache *cache, uint64_t pos)
+{
+    cb_mutex_enter(&cache->mutex);
+    decoded_node *node = *bucket_for(cache, pos);
+    while (node && node->pos != pos) {
+        node = node->hash_next;
+    }
+    if (node) {
+        ++node->refcount;
+        if (node != cache->lru_head) {
+            lru_unlink(cache, node);
+            lru_push_front(cache, node);
+        }
+    }
+    cb_mutex_exit(&cache->mutex);
+    return node;
+}
+
+void node_cache_put(node_cache *cache, uint64_t pos, decoded_node *node)
+{
+    size_t charge = node_charge(node);
+    cb_mutex_enter(&cache->mutex);
+    if (node->cached || charge > cache->size) {
+        cb_mutex_exit(&cache->mutex);
+        return;
+    }
+    decoded_node **bucket = bucket_for(cache, pos);
+    for (decoded_node *other = *bucket; other; other = other->hash_next) {
+        if (other->pos == pos) {
+            // Another thread read it in first.
+            cb_mutex_exit(&cache->mutex);
+            return;
+        }
+    }
+    evict_to_fit(cache, cache->size - charge);
+    bucket = bucket_for(cache, pos);
+    node->pos = pos;
+    node->cached = 1;
+    node->hash_next = *bucket;
+    *bucket = node;
+    lru_push_front(cache, node);
+    cache->used += charge;
+    cb_mutex_exit(&cache->mutex);
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_NODE_CACHE_H
+#define LIBCOUCHSTORE_NODE_CACHE_H 1
+
+#include <libcouchstore/couch_db.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Budget of the node cache of a newly opened file, in bytes: */
+#define DEFAULT_NODE_CACHE_SIZE (512 * 1024)
+
+    typedef struct {
+        sized_buf key;
+        sized_buf value;
+    } node_entry;
+
+    /* A B-tree node read from the file, with its entries split out. */
+    typedef struct decoded_node {
+        char *buf;                  /* Decompressed node; buf[0] is the node type */
+        int length;
+        node_entry *entries;
+        unsigned count;
+        int pooled_buf;             /* buf came from node_buf_alloc */
+        /* Cache bookkeeping: */
+        uint64_t pos;
+        unsigned refcount;
+        int cached;
+        struct decoded_node *hash_next;
+        struct decoded_node *lru_prev;
+        struct decoded_node *lru_next;
+    } decoded_node;
+
+    /* Cache of decoded nodes of one file, keyed by file position. Since
+       nodes are never rewritten in place, entries never go stale. It
+       belongs to a single tree_file, but may be used from the threads
+       sharing that file. */
+    typedef struct node_cache node_cache;
+
+    /**
+     * Allocates a buffer for a node being read, from a pool of recently
+     * freed ones kept by each thread in a few size classes, so that
+     * lookups in the steady state don't go to malloc. Buffers may be
+     * freed on any thread.
+     * @return the buffer, or NULL if out of memory
+     */
+    char *node_buf_alloc(size_t size);
+
+    /** Returns a buffer from node_buf_alloc to the calling thread's pool. */
+    void node_buf_free(char *buf);
+
+    /* Flags of decode_node: */
+#define DECODE_POOLED_BUF 1         /* buf came from node_buf_alloc */
+#define DECODE_UNSPLIT_LEAF 2       /* leave a KV node's entries unsplit */
+
+    /**
+     * Splits a node into its entries. Takes ownership of buf, which is
+     * freed along with the node, with cs_free unless DECODE_POOLED_BUF
+     * is given. The node is returned referenced once.
+     */
+    couchstore_error_t decode_node(char *buf, int length, int flags,
+                                   decoded_node **pNode);
+
+    /**
+     * Drops a reference to a node returned by decode_node or
+     * node_cache_get. Nodes the cache doesn't hold are freed with their
+     * last reference.
+     */
+    void node_release(node_cache *cache, decoded_node *node);
+
+    /** Creates a cache holding up to size bytes of nodes. */
+    node_cache *node_cache_create(size_t size);
+
+    void node_cache_destroy(node_cache *cache);
+
+    /** Changes the budget of a cache, evicting nodes to fit. */
+    void node_cache_set_size(node_cache *cache, size_t size);
+
+    /** The bytes a cache and the nodes it holds take. */
+    size_t node_cache_memory(node_cache *cache);
+
+    /**
+     * Looks up the node at a file position.
+     * @return the node, referenced for the caller, or NULL if not cached
+     */
+    decoded_node *node_cache_get(node_cache *cache, uint64_t pos);
+
+    /**
+     * Adds a node read from a file position. The caller's reference is
+     * left alone. Nodes larger than the whole budget, or at a position
+     * already cached, aren't kept.
+     */
+    void node_cache_put(node_cache *cache, uint64_t pos, decoded_node *node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
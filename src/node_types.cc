@@ -8,6 +8,7 @@
 //
 
 #include "node_types.h"
+#include "node_cache.h"
 #include <stdlib.h>
 
 size_t read_kv(const void *buf, sized_buf *key, sized_buf *value)
@@ -34,6 +35,94 @@ void* write_kv(void *buf, sized_buf key, sized_buf value)
     return dst;
 }
 
+void* write_prefixed_kv(void *buf, const sized_buf *prev_key, sized_buf key, sized_buf value)
+{
+    uint8_t *dst = static_cast<uint8_t*>(buf);
+    size_t prefix = 0;
+    if (prev_key) {
+        size_t max = prev_key->size < key.size ? prev_key->size : key.size;
+        while (prefix < max && prev_key->buf[prefix] == key.buf[prefix]) {
+            ++prefix;
+        }
+    }
+    // Keys are at most 12 bits long, so two bytes always do.
+    if (prefix < 0x80) {
+        *(dst++) = (uint8_t)prefix;
+    } else {
+        *(dst++) = (uint8_t)(0x80 | (prefix >> 8));
+        *(dst++) = (uint8_t)(prefix & 0xff);
+    }
+    sized_buf suffix = {key.buf + prefix, key.size - prefix};
+    return write_kv(dst, suffix, value);
+}
+
+// Reads the shared-prefix length in front of a prefixed KV, returning the
+// bytes it took, or 0 if it runs past the end.
+static size_t read_prefix_len(const uint8_t *buf, size_t avail, uint32_t *prefix)
+{
+    if (avail < 1) {
+        return 0;
+    }
+    if (!(buf[0] & 0x80)) {
+        *prefix = buf[0];
+        return 1;
+    }
+    if (avail < 2) {
+        return 0;
+    }
+    *prefix = ((buf[0] & 0x7f) << 8) | buf[1];
+    return 2;
+}
+
+int expand_prefixed_node(const char *buf, int len, char **ret_ptr)
+{
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(buf);
+    size_t outlen = 1, pos = 1, n;
+    uint32_t prefix, suffixlen, vlen, prevlen = 0;
+
+    // First check that it all adds up, and how long it comes out:
+    while (pos < (size_t)len) {
+        n = read_prefix_len(src + pos, len - pos, &prefix);
+        if (n == 0 || pos + n + sizeof(raw_kv_length) > (size_t)len) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        pos += n;
+        decode_kv_length(reinterpret_cast<const raw_kv_length*>(src + pos), &suffixlen, &vlen);
+        pos += sizeof(raw_kv_length) + suffixlen + vlen;
+        if (pos > (size_t)len || prefix > prevlen || prefix + suffixlen > 0xfff) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        prevlen = prefix + suffixlen;
+        outlen += sizeof(raw_kv_length) + prevlen + vlen;
+    }
+
+    char *out = node_buf_alloc(outlen);
+    if (!out) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    char *dst = out;
+    *(dst++) = (char)(src[0] & ~NODE_PREFIXED_KEYS);
+    const char *prevkey = NULL;
+    for (pos = 1; pos < (size_t)len; ) {
+        pos += read_prefix_len(src + pos, len - pos, &prefix);
+        decode_kv_length(reinterpret_cast<const raw_kv_length*>(src + pos), &suffixlen, &vlen);
+        pos += sizeof(raw_kv_length);
+        *(raw_kv_length*)dst = encode_kv_length(prefix + suffixlen, vlen);
+        dst += sizeof(raw_kv_length);
+        const char *key = dst;
+        if (prefix > 0) {
+            memcpy(dst, prevkey, prefix);
+            dst += prefix;
+        }
+        memcpy(dst, buf + pos, suffixlen + vlen);
+        dst += suffixlen + vlen;
+        pos += suffixlen + vlen;
+        prevkey = key;
+    }
+    *ret_ptr = out;
+    return (int)outlen;
+}
+
 node_pointer *read_root(void *buf, int size)
 {
     if (size == 0) {
@@ -46,7 +135,7 @@ node_pointer *read_root(void *buf, int size)
     uint64_t subtreesize = decode_raw48(raw->subtreesize);
     int redsize = size - sizeof(*raw);
 
-    ptr = (node_pointer *) malloc(sizeof(node_pointer) + redsize);
+    ptr = (node_pointer *) cs_malloc(sizeof(node_pointer) + redsize);
     if (redsize > 0) {
         buf = (char *) memcpy(ptr + 1, raw + 1, redsize);
     } else {
@@ -32,6 +32,83 @@ typedef struct {
     /* Three variable-size raw_btree_root structures follow */
 } raw_file_header;
 
+/* Optionally follows the roots in a version 12 header. */
+typedef struct {
+    raw_48 pointer;       /* Position of the ID Bloom filter chunk */
+    raw_48 covered_seq;   /* Every ID saved up to this seq is in it */
+} raw_bloom_ref;
+
+typedef struct {
+    raw_48 pointer;       /* Position of the zstd dictionary chunk */
+} raw_dict_ref;
+
+typedef struct {
+    raw_08 policy;        /* couchstore_node_size_policy */
+    raw_16 avg_key_size;  /* Observed average sizes of its entries */
+    raw_16 avg_value_size;
+} raw_tree_sizing;
+
+typedef struct {
+    raw_tree_sizing by_id;
+    raw_tree_sizing by_seq;
+} raw_node_sizing;
+
+typedef struct {
+    raw_48 pointer;       /* Position of the newest delta log chunk */
+} raw_delta_ref;
+
+typedef struct {
+    raw_48 pointer;       /* Position of the compaction checkpoint chunk */
+} raw_compact_ref;
+
+typedef struct {
+    raw_16 time_offset;   /* Where in the rev_meta the expiry time is */
+    raw_48 pointer;       /* Root node of the expiry index, or 0 if empty */
+    raw_48 subtreesize;
+    raw_40 count;         /* ...and its reduce */
+} raw_expiry_ref;
+
+typedef struct {
+    raw_48 pointer;       /* Position of the value log settings chunk */
+    raw_48 live_bytes;    /* Bytes of the log's bodies still in use */
+} raw_value_log_ref;
+
+typedef struct {
+    raw_32 min_body_size; /* Smallest body that goes to the log, or 0 */
+    raw_08 max_garbage_percent;
+    raw_32 generation;    /* Number of the log file */
+    /* Variable-size base path follows */
+} raw_value_log_settings;
+
+typedef struct {
+    raw_48 length;        /* Of the whole body, uncompressed */
+    raw_32 segment_size;  /* Of each segment but the last, uncompressed */
+    /* 48-bit position of each segment follows */
+} raw_body_segments;
+
+typedef struct {
+    raw_48 source_header; /* Position of the source header being compacted */
+    raw_48 source_seq;    /* and its update_seq */
+    raw_48 copied_seq;    /* Highest by-sequence key copied so far, or 0 */
+    raw_32 flags;         /* couchstore_compact_flags the compaction runs with */
+} raw_compact_checkpoint;
+
+/* Follows the marker byte at the start of a file with header hints: the
+   positions of the last headers written, newest first. */
+typedef struct {
+    raw_32 crc32;         /* of the rest */
+    raw_08 count;
+    raw_48 headers[HEADER_HINTS];
+} raw_header_hints;
+
+/* Follows the marker byte at the start of a file whose blocks aren't
+   COUCH_BLOCK_SIZE bytes. Any header hints come after it. */
+typedef struct {
+    raw_32 crc32;         /* of the rest */
+    raw_08 version;       /* FILE_PREAMBLE_VERSION */
+    raw_08 block_shift;   /* log2 of the block size */
+} raw_file_preamble;
+
 typedef struct {
     raw_48 pointer;
     raw_48 subtreesize;
@@ -77,6 +154,10 @@ typedef struct {
 #define UINT64_C(x) (x ## ULL)
 #endif
 #define BP_DELETED_FLAG UINT64_C(0x800000000000)
+/* Set in the .bp of a body in the value log, in files that have one */
+#define BP_VALUE_LOG_FLAG UINT64_C(0x400000000000)
+/* Set in the .bp of a body written in segments; see body_segments.h */
+#define BP_SEGMENTED_FLAG UINT64_C(0x200000000000)
 
 
 node_pointer *read_root(void *buf, int size);
@@ -103,6 +184,29 @@ size_t read_kv(const void *buf, sized_buf *key, sized_buf *value);
 
 void* write_kv(void *buf, sized_buf key, sized_buf value);
 
+/**
+ * Set in the type byte of a node whose keys are written with
+ * write_prefixed_kv. Such nodes only appear in files of disk version 12 on,
+ * and are turned back into plain ones by expand_prefixed_node as they're
+ * read, so nothing past pread_node ever sees one.
+ */
+#define NODE_PREFIXED_KEYS 0x80
+
+/**
+ * Like write_kv, but leaves out the bytes the key shares with the start of
+ * the previous key in the node (NULL for the first), writing their count
+ * in one or two bytes ahead of the rest.
+ * @return The end of the written data
+ */
+void* write_prefixed_kv(void *buf, const sized_buf *prev_key, sized_buf key, sized_buf value);
+
+/**
+ * Rewrites a node written with write_prefixed_kv in the layout read_kv
+ * expects, in a buffer from node_buf_alloc.
+ * @return The length of the new node, or a negative couchstore_error_t
+ */
+int expand_prefixed_node(const char *buf, int len, char **ret_ptr);
+
 
 /**
  * Reads a 48-bit sequence number out of a sized_buf.
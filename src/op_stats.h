@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_OP_STATS_H
+#define LIBCOUCHSTORE_OP_STATS_H 1
+
+#include "config.h"
+#include <platform/platform.h>
+#include "util.h"
+
+/* Times an operation into a histogram of the couchstore_op_stats STATS
+   points to, if it isn't NULL. OP_STATS_START declares the start time in
+   the block that OP_STATS_END records it in; OP_STATS_LAP records the time
+   so far and starts again, for an operation done in steps. Built with the
+   COUCHSTORE_OP_STATS option off, they are no code at all. */
+#ifdef COUCHSTORE_OP_STATS
+#define OP_STATS_START(STATS) \
+    hrtime_t op_stats_start = (STATS) ? gethrtime() : 0
+#define OP_STATS_LAP(STATS, FIELD) \
+    do { \
+        if ((STATS) && op_stats_start) { \
+            hrtime_t op_stats_now = gethrtime(); \
+            couch_histogram_add(&(STATS)->FIELD, \
+                                (uint64_t)((op_stats_now - op_stats_start) / 1000)); \
+            op_stats_start = op_stats_now; \
+        } \
+    } while (0)
+#define OP_STATS_END(STATS, FIELD) OP_STATS_LAP(STATS, FIELD)
+#else
+#define OP_STATS_START(STATS) do { } while (0)
+#define OP_STATS_LAP(STATS, FIELD) do { } while (0)
+#define OP_STATS_END(STATS, FIELD) do { } while (0)
+#endif
+
+#endif
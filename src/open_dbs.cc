@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Opening of many files at once.
+//
+// A server opening a thousand files at startup waits on each one's header
+// reads in turn, so warmup takes the count of files times the latency of a
+// read, whatever the disk could do at once. Threads take the files from a
+// shared counter and open them side by side, after which each handle is
+// used on its own as usual.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+#include "couch_btree.h"
+#include "util.h"
+
+// Threads started at most, whatever the caller asks for:
+#define OPEN_DBS_MAX_THREADS 64
+
+typedef struct {
+    couchstore_open_request *requests;
+    size_t count;
+    couchstore_open_flags flags;
+    const couch_file_ops *ops;
+    unsigned warm_levels;
+    cb_mutex_t mutex;
+    size_t next;                    // next request to take
+} open_batch;
+
+// Reads the top levels of the trees of a newly opened file.
+static couchstore_error_t warm_db(Db *db, unsigned levels)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const node_pointer *roots[3] = {
+        db->header.by_id_root, db->header.by_seq_root, db->header.local_docs_root
+    };
+    for (int i = 0; i < 3; i++) {
+        if (roots[i]) {
+            error_pass(btree_warm(&db->file, roots[i]->pointer, levels));
+        }
+    }
+cleanup:
+    return errcode;
+}
+
+static void open_one(open_batch *batch, couchstore_open_request *rq)
+{
+    rq->db = NULL;
+    rq->error = couchstore_open_db_ex(rq->filename, batch->flags, batch->ops, &rq->db);
+    if (rq->error == COUCHSTORE_SUCCESS && batch->warm_levels > 0) {
+        rq->error = warm_db(rq->db, batch->warm_levels);
+        if (rq->error != COUCHSTORE_SUCCESS) {
+            couchstore_close_db(rq->db);
+            rq->db = NULL;
+        }
+    }
+}
+
+static void open_worker(void *arg)
+{
+    open_batch *batch = static_cast<open_batch *>(arg);
+
+    for (;;) {
+        cb_mutex_enter(&batch->mutex);
+        size_t i = batch->next < batch->count ? batch->next++ : batch->count;
+        cb_mutex_exit(&batch->mutex);
+        if (i == batch->count) {
+            return;
+        }
+        open_one(batch, &batch->requests[i]);
+    }
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_open_dbs(couchstore_open_request *requests,
+                                       size_t count,
+                                       couchstore_open_flags flags,
+                                       const couch_file_ops *ops,
+                                       unsigned threads,
+                                       unsigned warm_levels)
+{
+    cb_thread_t tids[OPEN_DBS_MAX_THREADS];
+    unsigned started = 0, i;
+    open_batch batch;
+    size_t ii;
+
+    batch.requests = requests;
+    batch.count = count;
+    batch.flags = flags;
+    batch.ops = ops;
+    batch.warm_levels = warm_levels;
+    batch.next = 0;
+    cb_mutex_initialize(&batch.mutex);
+
+    if (threads > OPEN_DBS_MAX_THREADS) {
+        threads = OPEN_DBS_MAX_THREADS;
+    }
+    if (threads > count) {
+        threads = (unsigned)count;
+    }
+    // The calling thread is one of them, and opens whatever's left over if
+    // no thread could be started.
+    for (i = 1; i < threads; i++) {
+        if (cb_create_thread(&tids[started], open_worker, &batch, 0) != 0) {
+            break;
+        }
+        ++started;
+    }
+    open_worker(&batch);
+    for (i = 0; i < started; i++) {
+        cb_join_thread(tids[i]);
+    }
+    cb_mutex_destroy(&batch.mutex);
+
+    for (ii = 0; ii < count; ii++) {
+        if (requests[ii].error != COUCHSTORE_SUCCESS) {
+            return requests[ii].error;
+        }
+    }
+    return COUCHSTORE_SUCCESS;
+}
@@ -1,9 +1,18 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifdef __linux__
+#define _GNU_SOURCE 1    /* for fallocate */
+#endif
 #include "config.h"
 #include <assert.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#ifdef HAVE_PWRITEV
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_FALLOCATE
+#include <linux/falloc.h>
+#endif
 
 #include "internal.h"
 
@@ -72,6 +81,55 @@ static ssize_t couch_pwrite(couchstore_error_info_t *errinfo,
     return rv;
 }
 
+#ifdef HAVE_PWRITEV
+#define PWRITEV_BATCH 64
+
+static ssize_t couch_pwritev(couchstore_error_info_t *errinfo,
+                             couch_file_handle handle,
+                             const sized_buf *iov,
+                             int iovcnt,
+                             cs_off_t offset)
+{
+    int fd = handle_to_fd(handle);
+    struct iovec vec[PWRITEV_BATCH];
+    ssize_t total = 0;
+
+    while (iovcnt > 0) {
+        int n = iovcnt < PWRITEV_BATCH ? iovcnt : PWRITEV_BATCH;
+        ssize_t expected = 0;
+        ssize_t rv;
+        int i;
+
+        for (i = 0; i < n; ++i) {
+            vec[i].iov_base = iov[i].buf;
+            vec[i].iov_len = iov[i].size;
+            expected += iov[i].size;
+        }
+#ifdef LOG_IO
+        fprintf(stderr, "PWRITEV %8llx -- %8llx  (%6.1f kbytes, %d chunks)\n",
+                offset, offset+expected, expected/1024.0, n);
+#endif
+        do {
+            rv = pwritev(fd, vec, n, offset);
+        } while (rv == -1 && errno == EINTR);
+
+        if (rv < 0) {
+            save_errno(errinfo);
+            return (ssize_t) COUCHSTORE_ERROR_WRITE;
+        }
+        total += rv;
+        if (rv < expected) {
+            // Let the caller pick up from where the short write stopped.
+            break;
+        }
+        offset += rv;
+        iov += n;
+        iovcnt -= n;
+    }
+    return total;
+}
+#endif
+
 static couchstore_error_t couch_open(couchstore_error_info_t *errinfo,
                                      couch_file_handle* handle,
                                      const char *path,
@@ -189,8 +247,52 @@ static couchstore_error_t couch_advise(couchstore_error_info_t *errinfo,
     return COUCHSTORE_SUCCESS;
 }
 
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+static couchstore_error_t couch_allocate(couchstore_error_info_t *errinfo,
+                                         couch_file_handle handle,
+                                         cs_off_t offset,
+                                         cs_off_t len)
+{
+    int fd = handle_to_fd(handle);
+    int rv;
+    /* KEEP_SIZE leaves the reserved space past the end of the file, where
+       neither readers nor the header search see it. */
+    do {
+        rv = fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+        save_errno(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t couch_truncate(couchstore_error_info_t *errinfo,
+                                         couch_file_handle handle,
+                                         cs_off_t size)
+{
+    int fd = handle_to_fd(handle);
+    int rv;
+    do {
+        rv = ftruncate(fd, size);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+        save_errno(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+#define COUCH_ALLOCATE couch_allocate
+#define COUCH_TRUNCATE couch_truncate
+#else
+#define COUCH_ALLOCATE NULL
+#define COUCH_TRUNCATE NULL
+#endif
+
 static const couch_file_ops default_file_ops = {
-    (uint64_t)5,
+    (uint64_t)7,
     couch_constructor,
     couch_open,
     couch_close,
@@ -200,7 +302,14 @@ static const couch_file_ops default_file_ops = {
     couch_sync,
     couch_advise,
     couch_destructor,
-    NULL
+    NULL,
+#ifdef HAVE_PWRITEV
+    couch_pwritev,
+#else
+    NULL,
+#endif
+    COUCH_ALLOCATE,
+    COUCH_TRUNCATE
 };
 
 LIBCOUCHSTORE_API
@@ -0,0 +1,546 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// couch_file_ops implementation that bypasses the OS page cache (O_DIRECT),
+// so that bulk writers such as the compactor don't evict hot data.
+//
+// Direct I/O needs the file offset, length and memory of every transfer to
+// be aligned, while the layers above issue reads and writes of any size at
+// any offset (block prefixes make sure of that). Every operation therefore
+// goes through an aligned bounce buffer taken from a process-wide pool:
+// reads are widened to whole blocks, and writes read-modify-write the
+// partially covered blocks at either end.
+//
+// Writing whole blocks can leave the file physically longer than the data
+// in it, so the handle tracks the logical size itself. Reads never see past
+// it, goto_eof reports it, and the file is trimmed back to it on sync and
+// close. A crash in between at worst leaves zero padding in the last block,
+// which nothing points to.
+//
+// On Windows the files are opened with FILE_FLAG_NO_BUFFERING, which asks
+// for the same alignment, and the few system calls below have their Win32
+// equivalents.
+
+#include "config.h"
+#include <assert.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+#define DIRECT_ALIGNMENT 4096
+#define DIRECT_BUFFER_SIZE (1024*1024)
+#define DIRECT_POOL_MAX 16
+
+#ifdef WIN32
+typedef HANDLE direct_fd_t;
+#define DIRECT_NO_FD INVALID_HANDLE_VALUE
+#else
+typedef int direct_fd_t;
+#define DIRECT_NO_FD (-1)
+#endif
+
+static inline cs_off_t align_down(cs_off_t off) {
+    return off - (off % DIRECT_ALIGNMENT);
+}
+
+static inline cs_off_t align_up(cs_off_t off) {
+    return align_down(off + DIRECT_ALIGNMENT - 1);
+}
+
+// Recycles aligned bounce buffers across all direct handles.
+class AlignedBufferPool {
+public:
+    AlignedBufferPool() : count(0) {
+        cb_mutex_initialize(&mutex);
+    }
+    ~AlignedBufferPool() {
+        while (count > 0) {
+            free_aligned(buffers[--count]);
+        }
+        cb_mutex_destroy(&mutex);
+    }
+    char *get() {
+        void *buf = NULL;
+        cb_mutex_enter(&mutex);
+        if (count > 0) {
+            buf = buffers[--count];
+        }
+        cb_mutex_exit(&mutex);
+        if (buf == NULL) {
+            buf = alloc_aligned();
+        }
+        return static_cast<char *>(buf);
+    }
+    void put(char *buf) {
+        cb_mutex_enter(&mutex);
+        if (count < DIRECT_POOL_MAX) {
+            buffers[count++] = buf;
+            buf = NULL;
+        }
+        cb_mutex_exit(&mutex);
+        free_aligned(buf);
+    }
+private:
+    static void *alloc_aligned() {
+#ifdef WIN32
+        return _aligned_malloc(DIRECT_BUFFER_SIZE, DIRECT_ALIGNMENT);
+#else
+        void *buf;
+        if (posix_memalign(&buf, DIRECT_ALIGNMENT, DIRECT_BUFFER_SIZE) != 0) {
+            return NULL;
+        }
+        return buf;
+#endif
+    }
+    static void free_aligned(void *buf) {
+#ifdef WIN32
+        _aligned_free(buf);
+#else
+        free(buf);
+#endif
+    }
+
+    cb_mutex_t mutex;
+    char *buffers[DIRECT_POOL_MAX];
+    unsigned count;
+};
+
+static AlignedBufferPool bufferPool;
+
+typedef struct {
+    direct_fd_t fd;
+    cs_off_t size;      // logical size of the file
+    int padded;         // file on disk may extend past 'size'
+} direct_file;
+
+static void save_errno(couchstore_error_info_t *errinfo) {
+    if (errinfo) {
+#ifdef WIN32
+        errinfo->error = GetLastError();
+#else
+        errinfo->error = errno;
+#endif
+    }
+}
+
+static direct_file *handle_to_file(couch_file_handle handle)
+{
+    return (direct_file *)handle;
+}
+
+#ifdef WIN32
+static ssize_t pread(direct_fd_t fd, void *buf, size_t nbyte, cs_off_t offset)
+{
+    OVERLAPPED ov;
+    DWORD done;
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = offset & 0xFFFFFFFF;
+    ov.OffsetHigh = (offset >> 32) & 0x7FFFFFFF;
+    if (!ReadFile(fd, buf, (DWORD)nbyte, &done, &ov)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return done;
+}
+
+static ssize_t pwrite(direct_fd_t fd, const void *buf, size_t nbyte, cs_off_t offset)
+{
+    OVERLAPPED ov;
+    DWORD done;
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = offset & 0xFFFFFFFF;
+    ov.OffsetHigh = (offset >> 32) & 0x7FFFFFFF;
+    if (!WriteFile(fd, buf, (DWORD)nbyte, &done, &ov)) {
+        return -1;
+    }
+    return done;
+}
+
+static int ftruncate(direct_fd_t fd, cs_off_t size)
+{
+    FILE_END_OF_FILE_INFO eof;
+
+    eof.EndOfFile.QuadPart = size;
+    return SetFileInformationByHandle(fd, FileEndOfFileInfo,
+                                      &eof, sizeof(eof)) ? 0 : -1;
+}
+
+static int fdatasync(direct_fd_t fd)
+{
+    return FlushFileBuffers(fd) ? 0 : -1;
+}
+#endif
+
+// Reads as much of an aligned range as the file holds.
+static ssize_t read_aligned(direct_fd_t fd, char *buf, size_t nbyte, cs_off_t offset)
+{
+    size_t done = 0;
+    while (done < nbyte) {
+        ssize_t rv = pread(fd, buf + done, nbyte - done, offset + done);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rv == 0) {
+            break;
+        }
+        done += rv;
+    }
+    return (ssize_t)done;
+}
+
+static ssize_t write_aligned(direct_fd_t fd, const char *buf, size_t nbyte, cs_off_t offset)
+{
+    size_t done = 0;
+    while (done < nbyte) {
+        ssize_t rv = pwrite(fd, buf + done, nbyte - done, offset + done);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += rv;
+    }
+    return (ssize_t)done;
+}
+
+// Loads the existing contents of the block at 'block' into 'dst', zero
+// filling whatever lies past the logical end of the file.
+static int load_block(direct_file *file, char *dst, cs_off_t block)
+{
+    ssize_t got = 0;
+    if (block < file->size) {
+        got = read_aligned(file->fd, dst, DIRECT_ALIGNMENT, block);
+        if (got < 0) {
+            return -1;
+        }
+        if (got > file->size - block) {
+            got = (ssize_t)(file->size - block);
+        }
+    }
+    memset(dst + got, 0, DIRECT_ALIGNMENT - got);
+    return 0;
+}
+
+static couchstore_error_t trim_padding(couchstore_error_info_t *errinfo,
+                                       direct_file *file)
+{
+    if (file->padded) {
+        int rv;
+        do {
+            rv = ftruncate(file->fd, file->size);
+        } while (rv == -1 && errno == EINTR);
+        if (rv == -1) {
+            save_errno(errinfo);
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        file->padded = 0;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static ssize_t couch_direct_pread(couchstore_error_info_t *errinfo,
+                                  couch_file_handle handle,
+                                  void *buf,
+                                  size_t nbyte,
+                                  cs_off_t offset)
+{
+    direct_file *file = handle_to_file(handle);
+    ssize_t total = 0;
+
+    if (offset >= file->size) {
+        return 0;
+    }
+    if ((cs_off_t)nbyte > file->size - offset) {
+        nbyte = (size_t)(file->size - offset);
+    }
+
+    char *bounce = bufferPool.get();
+    if (bounce == NULL) {
+        return (ssize_t) COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    while (nbyte > 0) {
+        cs_off_t start = align_down(offset);
+        cs_off_t end = align_up(offset + nbyte);
+        if (end - start > DIRECT_BUFFER_SIZE) {
+            end = start + DIRECT_BUFFER_SIZE;
+        }
+        ssize_t got = read_aligned(file->fd, bounce, (size_t)(end - start), start);
+        if (got < 0) {
+            save_errno(errinfo);
+            bufferPool.put(bounce);
+            return (ssize_t) COUCHSTORE_ERROR_READ;
+        }
+
+        size_t skip = (size_t)(offset - start);
+        if ((size_t)got <= skip) {
+            break;
+        }
+        size_t n = (size_t)got - skip;
+        if (n > nbyte) {
+            n = nbyte;
+        }
+        memcpy((char *)buf + total, bounce + skip, n);
+        total += n;
+        offset += n;
+        nbyte -= n;
+    }
+
+    bufferPool.put(bounce);
+    return total;
+}
+
+static ssize_t couch_direct_pwrite(couchstore_error_info_t *errinfo,
+                                   couch_file_handle handle,
+                                   const void *buf,
+                                   size_t nbyte,
+                                   cs_off_t offset)
+{
+    direct_file *file = handle_to_file(handle);
+    ssize_t total = 0;
+
+    char *bounce = bufferPool.get();
+    if (bounce == NULL) {
+        return (ssize_t) COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    while (nbyte > 0) {
+        cs_off_t start = align_down(offset);
+        cs_off_t end = align_up(offset + nbyte);
+        if (end - start > DIRECT_BUFFER_SIZE) {
+            end = start + DIRECT_BUFFER_SIZE;
+        }
+        size_t n = (size_t)(end - offset);
+        if (n > nbyte) {
+            n = nbyte;
+        }
+
+        // Preserve the bytes of partially covered blocks at either end:
+        cs_off_t last_block = end - DIRECT_ALIGNMENT;
+        if (offset > start && load_block(file, bounce, start) < 0) {
+            goto write_error;
+        }
+        if (offset + (cs_off_t)n < end &&
+            (last_block != start || offset == start) &&
+            load_block(file, bounce + (last_block - start), last_block) < 0) {
+            goto write_error;
+        }
+
+        memcpy(bounce + (offset - start), (const char *)buf + total, n);
+        if (write_aligned(file->fd, bounce, (size_t)(end - start), start) < 0) {
+            goto write_error;
+        }
+
+        total += n;
+        offset += n;
+        nbyte -= n;
+        if (offset > file->size) {
+            file->size = offset;
+        }
+        if (end > file->size) {
+            file->padded = 1;
+        }
+    }
+
+    bufferPool.put(bounce);
+    return total;
+
+write_error:
+    save_errno(errinfo);
+    bufferPool.put(bounce);
+    return (ssize_t) COUCHSTORE_ERROR_WRITE;
+}
+
+static couchstore_error_t couch_direct_open(couchstore_error_info_t *errinfo,
+                                            couch_file_handle* handle,
+                                            const char *path,
+                                            int oflag)
+{
+    direct_file *file = handle_to_file(*handle);
+
+    if (file == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+#ifdef WIN32
+    HANDLE fd = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ,
+                            NULL, (oflag & O_CREAT) ? OPEN_ALWAYS : OPEN_EXISTING,
+                            FILE_FLAG_NO_BUFFERING, NULL);
+    if (fd == INVALID_HANDLE_VALUE) {
+        save_errno(errinfo);
+        if (GetLastError() == ERROR_FILE_NOT_FOUND) {
+            return COUCHSTORE_ERROR_NO_SUCH_FILE;
+        }
+        return COUCHSTORE_ERROR_OPEN_FILE;
+    }
+
+    LARGE_INTEGER end;
+    if (!GetFileSizeEx(fd, &end)) {
+        save_errno(errinfo);
+        CloseHandle(fd);
+        return COUCHSTORE_ERROR_OPEN_FILE;
+    }
+    cs_off_t size = end.QuadPart;
+#else
+    int fd;
+#ifdef O_DIRECT
+    do {
+        fd = open(path, oflag | O_LARGEFILE | O_DIRECT, 0666);
+    } while (fd == -1 && errno == EINTR);
+    if (fd == -1 && errno == EINVAL) {
+        // The file system doesn't do direct I/O; the aligned path still works.
+        do {
+            fd = open(path, oflag | O_LARGEFILE, 0666);
+        } while (fd == -1 && errno == EINTR);
+    }
+#else
+    do {
+        fd = open(path, oflag | O_LARGEFILE, 0666);
+    } while (fd == -1 && errno == EINTR);
+#endif
+
+    if (fd < 0) {
+        save_errno(errinfo);
+        if (errno == ENOENT) {
+            return COUCHSTORE_ERROR_NO_SUCH_FILE;
+        } else {
+            return COUCHSTORE_ERROR_OPEN_FILE;
+        }
+    }
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    fcntl(fd, F_NOCACHE, 1);
+#endif
+
+    cs_off_t size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        save_errno(errinfo);
+        close(fd);
+        return COUCHSTORE_ERROR_OPEN_FILE;
+    }
+#endif
+
+    file->fd = fd;
+    file->size = size;
+    file->padded = 0;
+    return COUCHSTORE_SUCCESS;
+}
+
+static void couch_direct_close(couchstore_error_info_t *errinfo,
+                               couch_file_handle handle)
+{
+    direct_file *file = handle_to_file(handle);
+    int rv = 0;
+
+    if (file == NULL || file->fd == DIRECT_NO_FD) {
+        return;
+    }
+
+    trim_padding(errinfo, file);
+#ifdef WIN32
+    if (!CloseHandle(file->fd)) {
+        rv = -1;
+    }
+#else
+    do {
+        assert(file->fd >= 3);
+        rv = close(file->fd);
+    } while (rv == -1 && errno == EINTR);
+#endif
+    file->fd = DIRECT_NO_FD;
+    if (rv < 0) {
+        save_errno(errinfo);
+    }
+}
+
+static cs_off_t couch_direct_goto_eof(couchstore_error_info_t *errinfo,
+                                      couch_file_handle handle)
+{
+    (void)errinfo;
+    return handle_to_file(handle)->size;
+}
+
+static couchstore_error_t couch_direct_sync(couchstore_error_info_t *errinfo,
+                                            couch_file_handle handle)
+{
+    direct_file *file = handle_to_file(handle);
+    couchstore_error_t errcode = trim_padding(errinfo, file);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        return errcode;
+    }
+
+    int rv;
+    do {
+        rv = fdatasync(file->fd);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+        save_errno(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static couch_file_handle couch_direct_constructor(couchstore_error_info_t *errinfo,
+                                                  void* cookie)
+{
+    (void) cookie;
+    (void) errinfo;
+    direct_file *file = static_cast<direct_file *>(cs_calloc(1, sizeof(direct_file)));
+    if (file != NULL) {
+        file->fd = DIRECT_NO_FD;
+    }
+    return (couch_file_handle)file;
+}
+
+static void couch_direct_destructor(couchstore_error_info_t *errinfo,
+                                    couch_file_handle handle)
+{
+    (void)errinfo;
+    cs_free(handle_to_file(handle));
+}
+
+static couchstore_error_t couch_direct_advise(couchstore_error_info_t *errinfo,
+                                              couch_file_handle handle,
+                                              cs_off_t offset,
+                                              cs_off_t len,
+                                              couchstore_file_advice_t advice)
+{
+    // There's no page cache to advise.
+    (void) errinfo; (void) handle; (void) offset; (void) len; (void) advice;
+    return COUCHSTORE_SUCCESS;
+}
+
+static const couch_file_ops direct_file_ops = {
+    (uint64_t)5,
+    couch_direct_constructor,
+    couch_direct_open,
+    couch_direct_close,
+    couch_direct_pread,
+    couch_direct_pwrite,
+    couch_direct_goto_eof,
+    couch_direct_sync,
+    couch_direct_advise,
+    couch_direct_destructor,
+    NULL,
+    // Not in version 5, so callers write chunk by chunk and don't
+    // preallocate; set anyway, so that every member is initialized.
+    NULL,
+    NULL,
+    NULL
+};
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_direct_file_ops(void)
+{
+    return &direct_file_ops;
+}
@@ -0,0 +1,885 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * couch_file_ops implementation backed by Linux io_uring.
+ *
+ * Every handle owns a small submission/completion ring. Writes are copied
+ * into a staging buffer and queued rather than submitted, and go to the
+ * kernel together with whatever needs them: a sync is linked behind them
+ * (IOSQE_IO_LINK), so a commit's appends and its fdatasync cost a single
+ * io_uring_enter(), and so is a read of a range they cover. Other reads
+ * are submitted on their own. As with the buffered file ops, an error
+ * from a queued write is returned by the call that submits it. The ring
+ * is set up with raw syscalls so there is no dependency on liburing.
+ *
+ * Threads sharing a handle, as the snapshots of shared reads and the
+ * background syncer do, take turns at its ring and queue.
+ *
+ * If the kernel refuses to create a ring (too old, or io_uring disabled by
+ * policy) the handle silently falls back to the blocking syscalls used by
+ * the default file ops in os.c.
+ */
+
+#define _GNU_SOURCE 1    /* for fallocate */
+#include "config.h"
+#include <assert.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Writes queued per handle, at most; one more entry takes the sync, read
+   or large write that goes out behind them. */
+#define URING_QUEUED_WRITES 31
+#define URING_ENTRIES (URING_QUEUED_WRITES + 1)
+/* Room for the data of the queued writes. Writes of more than half of it
+   aren't copied, but submitted at once behind what's queued. */
+#define URING_STAGING_SIZE (1024 * 1024)
+
+typedef struct {
+    cs_off_t offset;
+    size_t size;
+    size_t staged;      /* Where its data starts in the staging buffer */
+} queued_write;
+
+typedef struct {
+    int fd;
+    int ring_fd;
+    cb_mutex_t mutex;   /* Held by each operation on the ring or queue */
+
+    char *staging;      /* Allocated with the first queued write */
+    size_t staged;
+    queued_write queued[URING_QUEUED_WRITES];
+    unsigned nqueued;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_file;
+
+static void save_errno(couchstore_error_info_t *errinfo) {
+    if (errinfo) {
+        errinfo->error = errno;
+    }
+}
+
+static void save_error(couchstore_error_info_t *errinfo, int error) {
+    errno = error;
+    save_errno(errinfo);
+}
+
+static uring_file *handle_to_file(couch_file_handle handle)
+{
+    return (uring_file *)handle;
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                        min_complete, flags, NULL, 0);
+}
+
+static void ring_teardown(uring_file *file)
+{
+    if (file->sqes != NULL) {
+        munmap(file->sqes, file->sqes_size);
+    }
+    if (file->cq_ring != NULL && file->cq_ring != file->sq_ring) {
+        munmap(file->cq_ring, file->cq_ring_size);
+    }
+    if (file->sq_ring != NULL) {
+        munmap(file->sq_ring, file->sq_ring_size);
+    }
+    if (file->ring_fd != -1) {
+        close(file->ring_fd);
+    }
+    file->sqes = NULL;
+    file->cq_ring = NULL;
+    file->sq_ring = NULL;
+    file->ring_fd = -1;
+}
+
+/*
+ * Try to create the ring for a handle. Failure is not an error; the
+ * handle just keeps using blocking syscalls.
+ */
+static void ring_setup(uring_file *file)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    file->ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (file->ring_fd < 0) {
+        file->ring_fd = -1;
+        return;
+    }
+
+    file->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    file->cq_ring_size = p.cq_off.cqes +
+                         p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (file->cq_ring_size > file->sq_ring_size) {
+            file->sq_ring_size = file->cq_ring_size;
+        }
+        file->cq_ring_size = file->sq_ring_size;
+    }
+#endif
+
+    file->sq_ring = mmap(NULL, file->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, file->ring_fd,
+                         IORING_OFF_SQ_RING);
+    if (file->sq_ring == MAP_FAILED) {
+        file->sq_ring = NULL;
+        ring_teardown(file);
+        return;
+    }
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        file->cq_ring = file->sq_ring;
+    } else
+#endif
+    {
+        file->cq_ring = mmap(NULL, file->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, file->ring_fd,
+                             IORING_OFF_CQ_RING);
+        if (file->cq_ring == MAP_FAILED) {
+            file->cq_ring = NULL;
+            ring_teardown(file);
+            return;
+        }
+    }
+
+    file->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    file->sqes = (struct io_uring_sqe *)mmap(NULL, file->sqes_size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE,
+                                             file->ring_fd, IORING_OFF_SQES);
+    if (file->sqes == MAP_FAILED) {
+        file->sqes = NULL;
+        ring_teardown(file);
+        return;
+    }
+
+    sq = (char *)file->sq_ring;
+    cq = (char *)file->cq_ring;
+    file->sq_head = (unsigned *)(sq + p.sq_off.head);
+    file->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    file->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    file->sq_array = (unsigned *)(sq + p.sq_off.array);
+    file->cq_head = (unsigned *)(cq + p.cq_off.head);
+    file->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    file->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    file->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+/* The operation ring_submit() sends behind the queued writes */
+typedef struct {
+    uint8_t opcode;     /* IORING_OP_READV, IORING_OP_WRITEV or IORING_OP_FSYNC */
+    const struct iovec *iov;
+    int iovcnt;
+    cs_off_t offset;
+} ring_op;
+
+/* Does with a blocking syscall what the kernel cancelled or cut short. */
+static int ring_op_blocking(uring_file *file, const ring_op *op)
+{
+    int rv;
+    do {
+        switch (op->opcode) {
+        case IORING_OP_READV:
+            rv = (int)preadv(file->fd, op->iov, op->iovcnt, op->offset);
+            break;
+        case IORING_OP_WRITEV:
+            rv = (int)pwritev(file->fd, op->iov, op->iovcnt, op->offset);
+            break;
+        default:
+            rv = fdatasync(file->fd);
+            break;
+        }
+    } while (rv == -1 && errno == EINTR);
+    return rv < 0 ? -errno : rv;
+}
+
+static int ring_finish_write(uring_file *file, const queued_write *w, int res)
+{
+    size_t done = res > 0 ? (size_t)res : 0;
+    while (done < w->size) {
+        ssize_t rv = pwrite(file->fd, file->staging + w->staged + done,
+                            w->size - done, w->offset + (cs_off_t)done);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += (size_t)rv;
+    }
+    return 0;
+}
+
+static int ring_flush(uring_file *file, const ring_op *op);
+
+/*
+ * Submit the first nwrites queued writes, and op behind them if it isn't
+ * NULL, in one io_uring_enter(), and wait for all of them. op is linked to
+ * the writes, so a sync covers them and a read sees them. What the kernel
+ * cancelled or cut short is finished with blocking syscalls. Returns op's
+ * result, or 0 without one: >= 0 on success, -errno on failure, the first
+ * failed write's if there was one.
+ */
+static int ring_submit(uring_file *file, unsigned nwrites, const ring_op *op)
+{
+    struct iovec vecs[URING_QUEUED_WRITES];
+    int results[URING_ENTRIES];
+    unsigned count, submitted, to_submit, done = 0, ii;
+    unsigned tail = *file->sq_tail;
+    int error = 0;
+
+#ifndef IOSQE_IO_LINK
+    /* Kernel headers from before 5.3 can't chain SQEs, so the writes go
+     * out on their own first. */
+    if (op != NULL && nwrites > 0) {
+        error = ring_submit(file, nwrites, NULL);
+        if (error < 0) {
+            return error;
+        }
+        nwrites = 0;
+    }
+#endif
+    count = nwrites + (op != NULL);
+    for (ii = 0; ii < count; ++ii) {
+        unsigned idx = (tail + ii) & *file->sq_mask;
+        struct io_uring_sqe *sqe = &file->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        file->sq_array[idx] = idx;
+        sqe->fd = file->fd;
+        sqe->user_data = ii;
+        if (ii < nwrites) {
+            const queued_write *w = &file->queued[ii];
+            vecs[ii].iov_base = file->staging + w->staged;
+            vecs[ii].iov_len = w->size;
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->off = (uint64_t)w->offset;
+            sqe->addr = (uint64_t)(uintptr_t)&vecs[ii];
+            sqe->len = 1;
+#ifdef IOSQE_IO_LINK
+            if (op != NULL) {
+                sqe->flags = IOSQE_IO_LINK;
+            }
+#endif
+        } else {
+            sqe->opcode = op->opcode;
+            if (op->opcode == IORING_OP_FSYNC) {
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            } else {
+                sqe->off = (uint64_t)op->offset;
+                sqe->addr = (uint64_t)(uintptr_t)op->iov;
+                sqe->len = (uint32_t)op->iovcnt;
+            }
+        }
+        results[ii] = -ECANCELED;
+    }
+    __atomic_store_n(file->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+    submitted = count;
+    to_submit = count;
+    for (;;) {
+        unsigned head = *file->cq_head;
+        unsigned cq_tail = __atomic_load_n(file->cq_tail, __ATOMIC_ACQUIRE);
+        int res;
+
+        while (head != cq_tail) {
+            const struct io_uring_cqe *cqe = &file->cqes[head & *file->cq_mask];
+            if (cqe->user_data < count) {
+                results[cqe->user_data] = cqe->res;
+            }
+            ++head;
+            ++done;
+        }
+        __atomic_store_n(file->cq_head, head, __ATOMIC_RELEASE);
+        if (done >= submitted) {
+            break;
+        }
+        res = sys_io_uring_enter(file->ring_fd, to_submit, 1,
+                                 IORING_ENTER_GETEVENTS);
+        if (res >= 0) {
+            to_submit -= (unsigned)res < to_submit ? (unsigned)res : to_submit;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            unsigned taken = tail + count - to_submit;
+            if (to_submit > 0 &&
+                __atomic_load_n(file->sq_head, __ATOMIC_ACQUIRE) == taken) {
+                /* The kernel never took these; withdraw them, so that no
+                 * later submit hands it iovecs that are gone by then, and
+                 * do them below instead. */
+                __atomic_store_n(file->sq_tail, taken, __ATOMIC_RELEASE);
+                submitted -= to_submit;
+                to_submit = 0;
+                continue;
+            }
+            /* No way to wait for what's in flight: give up on the ring,
+             * which closing it cancels, and redo that below. */
+            ring_teardown(file);
+            break;
+        }
+    }
+
+    for (ii = 0; ii < nwrites; ++ii) {
+        const queued_write *w = &file->queued[ii];
+        int res = results[ii];
+        if (res == (int)w->size) {
+            continue;
+        }
+        if (res >= 0 || res == -ECANCELED) {
+            res = ring_finish_write(file, w, res);
+        }
+        if (res < 0 && error == 0) {
+            error = res;
+        }
+    }
+    /* Writes that stayed queued move up to the front */
+    if (nwrites > 0) {
+        memmove(file->queued, file->queued + nwrites,
+                (file->nqueued - nwrites) * sizeof(queued_write));
+        file->nqueued -= nwrites;
+        if (file->nqueued == 0) {
+            file->staged = 0;
+        }
+    }
+    if (file->ring_fd == -1 && file->nqueued > 0) {
+        int res = ring_flush(file, NULL);
+        if (res < 0 && error == 0) {
+            error = res;
+        }
+    }
+    if (error < 0) {
+        return error;
+    }
+    if (op != NULL) {
+        int res = results[count - 1];
+        if (res == -ECANCELED) {
+            res = ring_op_blocking(file, op);
+        }
+        return res;
+    }
+    return 0;
+}
+
+/*
+ * Submits all the queued writes and op behind them, or once the ring has
+ * been given up on, does them with blocking syscalls.
+ */
+static int ring_flush(uring_file *file, const ring_op *op)
+{
+    int error = 0;
+    unsigned ii;
+
+    if (file->ring_fd != -1) {
+        return ring_submit(file, file->nqueued, op);
+    }
+    for (ii = 0; ii < file->nqueued; ++ii) {
+        int res = ring_finish_write(file, &file->queued[ii], 0);
+        if (res < 0 && error == 0) {
+            error = res;
+        }
+    }
+    file->nqueued = 0;
+    file->staged = 0;
+    if (error < 0) {
+        return error;
+    }
+    return op != NULL ? ring_op_blocking(file, op) : 0;
+}
+
+/* Whether nbyte at offset overlap a queued write */
+static int ring_overlaps_queued(const uring_file *file, size_t nbyte,
+                                  cs_off_t offset)
+{
+    unsigned ii;
+    for (ii = 0; ii < file->nqueued; ++ii) {
+        const queued_write *w = &file->queued[ii];
+        if (offset < w->offset + (cs_off_t)w->size &&
+            w->offset < offset + (cs_off_t)nbyte) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copy a write into the staging buffer and queue it, appending it to the
+ * last one it follows on from, after submitting what's queued if there's
+ * no room or the write overlaps it: unlinked writes may complete in any
+ * order. Writes too large to copy are submitted at once behind the queued
+ * ones. Returns the bytes written or queued, or -errno.
+ */
+static ssize_t ring_queue_write(uring_file *file, const struct iovec *iov,
+                                int iovcnt, cs_off_t offset)
+{
+    queued_write *last = file->nqueued ? &file->queued[file->nqueued - 1] : NULL;
+    size_t nbyte = 0;
+    int i, res;
+
+    for (i = 0; i < iovcnt; ++i) {
+        nbyte += iov[i].iov_len;
+    }
+    if (file->staging == NULL && nbyte <= URING_STAGING_SIZE / 2) {
+        file->staging = (char *)cs_malloc(URING_STAGING_SIZE);
+    }
+    if (file->staging == NULL || nbyte > URING_STAGING_SIZE / 2 ||
+        file->ring_fd == -1) {
+        ring_op op = { IORING_OP_WRITEV, iov, iovcnt, offset };
+        return ring_flush(file, &op);
+    }
+
+    if (file->staged + nbyte > URING_STAGING_SIZE ||
+        ring_overlaps_queued(file, nbyte, offset) ||
+        (file->nqueued == URING_QUEUED_WRITES &&
+         last->offset + (cs_off_t)last->size != offset)) {
+        ring_op op = { IORING_OP_WRITEV, iov, iovcnt, offset };
+        res = ring_flush(file, NULL);
+        if (res < 0) {
+            return res;
+        }
+        if (file->ring_fd == -1) {
+            return ring_flush(file, &op);
+        }
+        last = NULL;
+    }
+    if (last == NULL || last->offset + (cs_off_t)last->size != offset) {
+        last = &file->queued[file->nqueued++];
+        last->offset = offset;
+        last->size = 0;
+        last->staged = file->staged;
+    }
+    for (i = 0; i < iovcnt; ++i) {
+        memcpy(file->staging + file->staged, iov[i].iov_base, iov[i].iov_len);
+        file->staged += iov[i].iov_len;
+    }
+    last->size += nbyte;
+    return (ssize_t)nbyte;
+}
+
+static ssize_t couch_uring_pread(couchstore_error_info_t *errinfo,
+                                 couch_file_handle handle,
+                                 void *buf,
+                                 size_t nbyte,
+                                 cs_off_t offset)
+{
+    uring_file *file = handle_to_file(handle);
+    ssize_t rv;
+
+    if (file->ring_fd != -1) {
+        struct iovec iov;
+        ring_op op = { IORING_OP_READV, &iov, 1, offset };
+
+        iov.iov_base = buf;
+        iov.iov_len = nbyte;
+        cb_mutex_enter(&file->mutex);
+        if (ring_overlaps_queued(file, nbyte, offset)) {
+            rv = ring_flush(file, &op);
+        } else if (file->ring_fd != -1) {
+            rv = ring_submit(file, 0, &op);
+        } else {
+            rv = ring_op_blocking(file, &op);
+        }
+        cb_mutex_exit(&file->mutex);
+    } else {
+        do {
+            rv = pread(file->fd, buf, nbyte, offset);
+        } while (rv == -1 && errno == EINTR);
+        if (rv < 0) {
+            rv = -errno;
+        }
+    }
+
+    if (rv < 0) {
+        save_error(errinfo, (int)-rv);
+        return (ssize_t) COUCHSTORE_ERROR_READ;
+    }
+    return rv;
+}
+
+static ssize_t couch_uring_pwrite(couchstore_error_info_t *errinfo,
+                                  couch_file_handle handle,
+                                  const void *buf,
+                                  size_t nbyte,
+                                  cs_off_t offset)
+{
+    uring_file *file = handle_to_file(handle);
+    ssize_t rv;
+
+    if (file->ring_fd != -1) {
+        struct iovec iov;
+
+        iov.iov_base = (void *)buf;
+        iov.iov_len = nbyte;
+        cb_mutex_enter(&file->mutex);
+        rv = ring_queue_write(file, &iov, 1, offset);
+        cb_mutex_exit(&file->mutex);
+    } else {
+        do {
+            rv = pwrite(file->fd, buf, nbyte, offset);
+        } while (rv == -1 && errno == EINTR);
+        if (rv < 0) {
+            rv = -errno;
+        }
+    }
+
+    if (rv < 0) {
+        save_error(errinfo, (int)-rv);
+        return (ssize_t) COUCHSTORE_ERROR_WRITE;
+    }
+    return rv;
+}
+
+#define PWRITEV_BATCH 64
+
+static ssize_t couch_uring_pwritev(couchstore_error_info_t *errinfo,
+                                   couch_file_handle handle,
+                                   const sized_buf *iov,
+                                   int iovcnt,
+                                   cs_off_t offset)
+{
+    uring_file *file = handle_to_file(handle);
+    struct iovec vec[PWRITEV_BATCH];
+    ssize_t total = 0;
+
+    while (iovcnt > 0) {
+        int n = iovcnt < PWRITEV_BATCH ? iovcnt : PWRITEV_BATCH;
+        ssize_t expected = 0;
+        ssize_t rv;
+        int i;
+
+        for (i = 0; i < n; ++i) {
+            vec[i].iov_base = iov[i].buf;
+            vec[i].iov_len = iov[i].size;
+            expected += iov[i].size;
+        }
+        if (file->ring_fd != -1) {
+            cb_mutex_enter(&file->mutex);
+            rv = ring_queue_write(file, vec, n, offset);
+            cb_mutex_exit(&file->mutex);
+        } else {
+            do {
+                rv = pwritev(file->fd, vec, n, offset);
+            } while (rv == -1 && errno == EINTR);
+            if (rv < 0) {
+                rv = -errno;
+            }
+        }
+
+        if (rv < 0) {
+            save_error(errinfo, (int)-rv);
+            return (ssize_t) COUCHSTORE_ERROR_WRITE;
+        }
+        total += rv;
+        if (rv < expected) {
+            break;
+        }
+        offset += rv;
+        iov += n;
+        iovcnt -= n;
+    }
+    return total;
+}
+
+static couchstore_error_t couch_uring_open(couchstore_error_info_t *errinfo,
+                                           couch_file_handle* handle,
+                                           const char *path,
+                                           int oflag)
+{
+    uring_file *file = handle_to_file(*handle);
+    int fd;
+
+    if (file == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    do {
+        fd = open(path, oflag | O_LARGEFILE, 0666);
+    } while (fd == -1 && errno == EINTR);
+
+    if (fd < 0) {
+        save_errno(errinfo);
+        if (errno == ENOENT) {
+            return COUCHSTORE_ERROR_NO_SUCH_FILE;
+        } else {
+            return COUCHSTORE_ERROR_OPEN_FILE;
+        }
+    }
+
+    file->fd = fd;
+    if (file->ring_fd == -1) {
+        ring_setup(file);
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static void couch_uring_close(couchstore_error_info_t *errinfo,
+                              couch_file_handle handle)
+{
+    uring_file *file = handle_to_file(handle);
+    int rv = 0;
+
+    if (file == NULL) {
+        return;
+    }
+
+    if (file->ring_fd != -1) {
+        cb_mutex_enter(&file->mutex);
+        rv = ring_flush(file, NULL);
+        cb_mutex_exit(&file->mutex);
+        if (rv < 0) {
+            save_error(errinfo, -rv);
+        }
+        rv = 0;
+    }
+    ring_teardown(file);
+    if (file->fd != -1) {
+        do {
+            assert(file->fd >= 3);
+            rv = close(file->fd);
+        } while (rv == -1 && errno == EINTR);
+        file->fd = -1;
+    }
+    if (rv < 0) {
+        save_errno(errinfo);
+    }
+}
+
+static cs_off_t couch_uring_goto_eof(couchstore_error_info_t *errinfo,
+                                     couch_file_handle handle)
+{
+    uring_file *file = handle_to_file(handle);
+    cs_off_t rv;
+
+    /* The file's size has to take in what's queued */
+    if (file->ring_fd != -1) {
+        int res;
+        cb_mutex_enter(&file->mutex);
+        res = ring_flush(file, NULL);
+        cb_mutex_exit(&file->mutex);
+        if (res < 0) {
+            save_error(errinfo, -res);
+            return -1;
+        }
+    }
+    rv = lseek(file->fd, 0, SEEK_END);
+    if (rv < 0) {
+        save_errno(errinfo);
+    }
+    return rv;
+}
+
+static couchstore_error_t couch_uring_sync(couchstore_error_info_t *errinfo,
+                                           couch_file_handle handle)
+{
+    uring_file *file = handle_to_file(handle);
+    int rv;
+
+    if (file->ring_fd != -1) {
+        ring_op op = { IORING_OP_FSYNC, NULL, 0, 0 };
+        cb_mutex_enter(&file->mutex);
+        rv = ring_flush(file, &op);
+        cb_mutex_exit(&file->mutex);
+
+        if (rv < 0) {
+            save_error(errinfo, -rv);
+            return COUCHSTORE_ERROR_WRITE;
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+
+    do {
+        rv = fdatasync(file->fd);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+        save_errno(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
+static couch_file_handle couch_uring_constructor(couchstore_error_info_t *errinfo,
+                                                 void* cookie)
+{
+    uring_file *file;
+    (void) cookie;
+    (void) errinfo;
+
+    file = (uring_file *)cs_calloc(1, sizeof(uring_file));
+    if (file != NULL) {
+        file->fd = -1;
+        file->ring_fd = -1;
+        cb_mutex_initialize(&file->mutex);
+    }
+    return (couch_file_handle)file;
+}
+
+static void couch_uring_destructor(couchstore_error_info_t *errinfo,
+                                   couch_file_handle handle)
+{
+    uring_file *file = handle_to_file(handle);
+    (void)errinfo;
+
+    if (file != NULL) {
+        ring_teardown(file);
+        cb_mutex_destroy(&file->mutex);
+        cs_free(file->staging);
+        cs_free(file);
+    }
+}
+
+static couchstore_error_t couch_uring_advise(couchstore_error_info_t *errinfo,
+                                             couch_file_handle handle,
+                                             cs_off_t offset,
+                                             cs_off_t len,
+                                             couchstore_file_advice_t advice)
+{
+#ifdef POSIX_FADV_NORMAL
+    uring_file *file = handle_to_file(handle);
+    int error = posix_fadvise(file->fd, offset, len, (int) advice);
+    if (error != 0) {
+        save_error(errinfo, error);
+    }
+    switch(error) {
+        case EINVAL:
+        case ESPIPE:
+            return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+            break;
+        case EBADF:
+            return COUCHSTORE_ERROR_OPEN_FILE;
+            break;
+    }
+#else
+    (void) handle; (void)offset; (void)len; (void)advice;
+    (void)errinfo;
+#endif
+    return COUCHSTORE_SUCCESS;
+}
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+/* Space is reserved rarely and in large steps, so these block. */
+static couchstore_error_t couch_uring_allocate(couchstore_error_info_t *errinfo,
+                                               couch_file_handle handle,
+                                               cs_off_t offset,
+                                               cs_off_t len)
+{
+    uring_file *file = handle_to_file(handle);
+    int rv;
+
+    cb_mutex_enter(&file->mutex);
+    rv = ring_flush(file, NULL);
+    cb_mutex_exit(&file->mutex);
+    if (rv < 0) {
+        save_error(errinfo, -rv);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    do {
+        rv = fallocate(file->fd, FALLOC_FL_KEEP_SIZE, offset, len);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+        save_errno(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t couch_uring_truncate(couchstore_error_info_t *errinfo,
+                                               couch_file_handle handle,
+                                               cs_off_t size)
+{
+    uring_file *file = handle_to_file(handle);
+    int rv;
+
+    cb_mutex_enter(&file->mutex);
+    rv = ring_flush(file, NULL);
+    cb_mutex_exit(&file->mutex);
+    if (rv < 0) {
+        save_error(errinfo, -rv);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    do {
+        rv = ftruncate(file->fd, size);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1) {
+        save_errno(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+#define COUCH_URING_ALLOCATE couch_uring_allocate
+#define COUCH_URING_TRUNCATE couch_uring_truncate
+#else
+#define COUCH_URING_ALLOCATE NULL
+#define COUCH_URING_TRUNCATE NULL
+#endif
+
+static const couch_file_ops uring_file_ops = {
+    (uint64_t)7,
+    couch_uring_constructor,
+    couch_uring_open,
+    couch_uring_close,
+    couch_uring_pread,
+    couch_uring_pwrite,
+    couch_uring_goto_eof,
+    couch_uring_sync,
+    couch_uring_advise,
+    couch_uring_destructor,
+    NULL,
+    couch_uring_pwritev,
+    COUCH_URING_ALLOCATE,
+    COUCH_URING_TRUNCATE
+};
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_io_uring_file_ops(void)
+{
+    return &uring_file_ops;
+}
+
+#else
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_io_uring_file_ops(void)
+{
+    return NULL;
+}
+
+#endif
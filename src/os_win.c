@@ -1,4 +1,20 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * couch_file_ops implementation for Windows, with overlapped I/O.
+ *
+ * Handles are opened with FILE_FLAG_OVERLAPPED, so that the I/O manager
+ * doesn't serialize their operations and keep a file pointer for them.
+ * Each operation waits for its own completion, through events owned by
+ * the calling thread, so the interface stays that of the other file ops
+ * and a handle can be used from several threads at once; pwritev issues
+ * its chunks together, up to WIN_MAX_IN_FLIGHT at once, and then waits
+ * for them all, keeping the device's queue full the way the io_uring ops
+ * do on Linux.
+ *
+ * The direct I/O ops of os_direct.cc open their files with
+ * FILE_FLAG_NO_BUFFERING.
+ */
 #include "config.h"
 #include <assert.h>
 #include <sys/types.h>
@@ -14,7 +30,19 @@
 
 #include <io.h>
 #include <share.h>
-#include <assert.h>
+
+/* Operations in flight at once per handle, by pwritev */
+#define WIN_MAX_IN_FLIGHT 16
+
+typedef struct {
+    HANDLE file;
+} win_file;
+
+/* Fiber local slot holding each thread's events: manual reset, one per
+   operation in flight. Ops sharing a handle, as shared reads and the
+   background syncer do, must not wait on each other's events. */
+static INIT_ONCE events_once = INIT_ONCE_STATIC_INIT;
+static DWORD events_index = FLS_OUT_OF_INDEXES;
 
 static DWORD save_windows_error(couchstore_error_info_t *errinfo) {
     DWORD err = GetLastError();
@@ -25,14 +53,99 @@ static DWORD save_windows_error(couchstore_error_info_t *errinfo) {
     return err;
 }
 
-static HANDLE handle_to_win(couch_file_handle handle)
+static win_file *handle_to_file(couch_file_handle handle)
+{
+    return (win_file *)handle;
+}
+
+static void close_events(HANDLE *events)
+{
+    int i;
+
+    for (i = 0; i < WIN_MAX_IN_FLIGHT; ++i) {
+        if (events[i] != NULL) {
+            CloseHandle(events[i]);
+        }
+    }
+    cs_free(events);
+}
+
+static void WINAPI free_thread_events(void *events)
+{
+    if (events != NULL) {
+        close_events((HANDLE *)events);
+    }
+}
+
+static BOOL CALLBACK alloc_events_index(PINIT_ONCE once, void *param,
+                                        void **context)
+{
+    (void) once;
+    (void) param;
+    (void) context;
+    events_index = FlsAlloc(free_thread_events);
+    return events_index != FLS_OUT_OF_INDEXES;
+}
+
+/* Returns the calling thread's events, creating them on first use, or
+   NULL, with the error for GetLastError(). */
+static HANDLE *thread_events(void)
+{
+    HANDLE *events;
+    int i;
+
+    if (!InitOnceExecuteOnce(&events_once, alloc_events_index, NULL, NULL)) {
+        return NULL;
+    }
+    events = (HANDLE *)FlsGetValue(events_index);
+    if (events != NULL) {
+        return events;
+    }
+
+    events = (HANDLE *)cs_calloc(WIN_MAX_IN_FLIGHT, sizeof(HANDLE));
+    if (events == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    for (i = 0; i < WIN_MAX_IN_FLIGHT; ++i) {
+        events[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (events[i] == NULL) {
+            DWORD err = GetLastError();
+            close_events(events);
+            SetLastError(err);
+            return NULL;
+        }
+    }
+    if (!FlsSetValue(events_index, events)) {
+        DWORD err = GetLastError();
+        close_events(events);
+        SetLastError(err);
+        return NULL;
+    }
+    return events;
+}
+
+static void set_offset(OVERLAPPED *ov, cs_off_t offset, HANDLE event)
 {
-    return (HANDLE)(intptr_t)handle;
+    memset(ov, 0, sizeof(*ov));
+    ov->Offset = offset & 0xFFFFFFFF;
+    ov->OffsetHigh = (offset >> 32) & 0x7FFFFFFF;
+    ov->hEvent = event;
 }
 
-static couch_file_handle win_to_handle(HANDLE hdl)
+/* Starts a read or write at the offset in ov. Returns FALSE, with the
+   error for GetLastError(), unless it completed or is in progress. */
+static BOOL start_io(win_file *file, int write, void *buf, size_t nbyte,
+                     OVERLAPPED *ov)
 {
-    return (couch_file_handle)(intptr_t)hdl;
+    BOOL rv;
+
+    if (write) {
+        rv = WriteFile(file->file, buf, (DWORD)nbyte, NULL, ov);
+    } else {
+        rv = ReadFile(file->file, buf, (DWORD)nbyte, NULL, ov);
+    }
+    return rv || GetLastError() == ERROR_IO_PENDING;
 }
 
 static ssize_t couch_pread(couchstore_error_info_t *errinfo,
@@ -44,15 +157,21 @@ static ssize_t couch_pread(couchstore_error_info_t *errinfo,
 #ifdef LOG_IO
     fprintf(stderr, "PREAD  %8llx -- %8llx  (%6.1f kbytes)\n", offset, offset+nbyte, nbyte/1024.0);
 #endif
-    HANDLE file = handle_to_win(handle);
-    BOOL rv;
+    win_file *file = handle_to_file(handle);
+    HANDLE *events = thread_events();
     DWORD bytesread;
-    OVERLAPPED winoffs;
-    memset(&winoffs, 0, sizeof(winoffs));
-    winoffs.Offset = offset & 0xFFFFFFFF;
-    winoffs.OffsetHigh = (offset >> 32) & 0x7FFFFFFF;
-    rv = ReadFile(file, buf, nbyte, &bytesread, &winoffs);
-    if(!rv) {
+    OVERLAPPED ov;
+
+    if (events == NULL) {
+        save_windows_error(errinfo);
+        return (ssize_t) COUCHSTORE_ERROR_READ;
+    }
+    set_offset(&ov, offset, events[0]);
+    if (!start_io(file, 0, buf, nbyte, &ov) ||
+        !GetOverlappedResult(file->file, &ov, &bytesread, TRUE)) {
+        if (GetLastError() == ERROR_HANDLE_EOF) {
+            return 0;
+        }
         save_windows_error(errinfo);
         return (ssize_t) COUCHSTORE_ERROR_READ;
     }
@@ -68,59 +187,142 @@ static ssize_t couch_pwrite(couchstore_error_info_t *errinfo,
 #ifdef LOG_IO
     fprintf(stderr, "PWRITE %8llx -- %8llx  (%6.1f kbytes)\n", offset, offset+nbyte, nbyte/1024.0);
 #endif
-    HANDLE file = handle_to_win(handle);
-    BOOL rv;
+    win_file *file = handle_to_file(handle);
+    HANDLE *events = thread_events();
     DWORD byteswritten;
-    OVERLAPPED winoffs;
-    memset(&winoffs, 0, sizeof(winoffs));
-    winoffs.Offset = offset & 0xFFFFFFFF;
-    winoffs.OffsetHigh = (offset >> 32) & 0x7FFFFFFF;
-    rv = WriteFile(file, buf, nbyte, &byteswritten, &winoffs);
-    if(!rv) {
+    OVERLAPPED ov;
+
+    if (events == NULL) {
+        save_windows_error(errinfo);
+        return (ssize_t) COUCHSTORE_ERROR_WRITE;
+    }
+    set_offset(&ov, offset, events[0]);
+    if (!start_io(file, 1, (void *)buf, nbyte, &ov) ||
+        !GetOverlappedResult(file->file, &ov, &byteswritten, TRUE)) {
         save_windows_error(errinfo);
         return (ssize_t) COUCHSTORE_ERROR_WRITE;
     }
     return byteswritten;
 }
 
+static ssize_t couch_pwritev(couchstore_error_info_t *errinfo,
+                             couch_file_handle handle,
+                             const sized_buf *iov,
+                             int iovcnt,
+                             cs_off_t offset)
+{
+    win_file *file = handle_to_file(handle);
+    HANDLE *events = thread_events();
+    OVERLAPPED ov[WIN_MAX_IN_FLIGHT];
+    ssize_t total = 0;
+    int failed = 0;
+
+    if (events == NULL) {
+        save_windows_error(errinfo);
+        return (ssize_t) COUCHSTORE_ERROR_WRITE;
+    }
+
+    while (iovcnt > 0 && !failed) {
+        int n = iovcnt < WIN_MAX_IN_FLIGHT ? iovcnt : WIN_MAX_IN_FLIGHT;
+        int started = 0;
+        int complete = 1;       /* every chunk so far written in full */
+        cs_off_t pos = offset;
+        int i;
+
+#ifdef LOG_IO
+        fprintf(stderr, "PWRITEV %8llx (%d chunks)\n", offset, n);
+#endif
+        for (i = 0; i < n; ++i) {
+            set_offset(&ov[i], pos, events[i]);
+            if (!start_io(file, 1, iov[i].buf, iov[i].size, &ov[i])) {
+                save_windows_error(errinfo);
+                failed = 1;
+                break;
+            }
+            ++started;
+            pos += iov[i].size;
+        }
+
+        /* Every write started must be waited for, whatever happened to
+           the others, before ov goes */
+        for (i = 0; i < started; ++i) {
+            DWORD written;
+
+            if (!GetOverlappedResult(file->file, &ov[i], &written, TRUE)) {
+                save_windows_error(errinfo);
+                failed = 1;
+                complete = 0;
+                continue;
+            }
+            if (complete) {
+                total += written;
+                if (written < iov[i].size) {
+                    /* Let the caller pick up from where it stopped */
+                    complete = 0;
+                    failed = 1;
+                }
+            }
+        }
+        offset = pos;
+        iov += n;
+        iovcnt -= n;
+    }
+
+    if (failed && total == 0) {
+        return (ssize_t) COUCHSTORE_ERROR_WRITE;
+    }
+    return total;
+}
+
 static couchstore_error_t couch_open(couchstore_error_info_t *errinfo,
                                      couch_file_handle* handle,
                                      const char *path,
                                      int oflag)
 {
+    win_file *file = handle_to_file(*handle);
     int creationflag = OPEN_EXISTING;
+
+    if (file == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
     if(oflag & O_CREAT) {
         creationflag = OPEN_ALWAYS;
     }
 
     HANDLE os_handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
                                    FILE_SHARE_DELETE | FILE_SHARE_WRITE | FILE_SHARE_READ,
-                                   NULL, creationflag, 0, NULL);
+                                   NULL, creationflag, FILE_FLAG_OVERLAPPED, NULL);
 
     if(os_handle == INVALID_HANDLE_VALUE) {
         if(save_windows_error(errinfo) == ERROR_FILE_NOT_FOUND) {
-            return (ssize_t) COUCHSTORE_ERROR_NO_SUCH_FILE;
+            return COUCHSTORE_ERROR_NO_SUCH_FILE;
         };
         return COUCHSTORE_ERROR_OPEN_FILE;
     }
-    /* Tell the caller about the new handle (file descriptor) */
-    *handle = win_to_handle(os_handle);
+    file->file = os_handle;
     return COUCHSTORE_SUCCESS;
 }
 
 static void couch_close(couchstore_error_info_t *errinfo,
                         couch_file_handle handle)
 {
-    HANDLE file = handle_to_win(handle);
-    CloseHandle(handle);
+    win_file *file = handle_to_file(handle);
+
+    if (file == NULL || file->file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    if (!CloseHandle(file->file)) {
+        save_windows_error(errinfo);
+    }
+    file->file = INVALID_HANDLE_VALUE;
 }
 
 static cs_off_t couch_goto_eof(couchstore_error_info_t *errinfo,
                                couch_file_handle handle)
 {
-    HANDLE file = handle_to_win(handle);
+    win_file *file = handle_to_file(handle);
     LARGE_INTEGER size;
-    if(!GetFileSizeEx(file, &size)) {
+    if(!GetFileSizeEx(file->file, &size)) {
         save_windows_error(errinfo);
         return (cs_off_t) COUCHSTORE_ERROR_READ;
     }
@@ -131,9 +333,9 @@ static cs_off_t couch_goto_eof(couchstore_error_info_t *errinfo,
 static couchstore_error_t couch_sync(couchstore_error_info_t *errinfo,
                                      couch_file_handle handle)
 {
-    HANDLE file = handle_to_win(handle);
+    win_file *file = handle_to_file(handle);
 
-    if (!FlushFileBuffers(file)) {
+    if (!FlushFileBuffers(file->file)) {
         save_windows_error(errinfo);
         return COUCHSTORE_ERROR_WRITE;
     }
@@ -145,16 +347,22 @@ static couch_file_handle couch_constructor(couchstore_error_info_t *errinfo,
                                            void* cookie)
 {
     (void) cookie;
-    /*  We don't have a file descriptor till couch_open runs,
-        so return an invalid value for now. */
-    return handle_to_win(INVALID_HANDLE_VALUE);
+    (void) errinfo;
+    /*  We don't have a file handle till couch_open runs. */
+    win_file *file = (win_file *) cs_calloc(1, sizeof(win_file));
+    if (file != NULL) {
+        file->file = INVALID_HANDLE_VALUE;
+    }
+    return (couch_file_handle)file;
 }
 
 static void couch_destructor(couchstore_error_info_t *errinfo,
                              couch_file_handle handle)
 {
-    /* nothing to do here */
-    (void)handle;
+    win_file *file = handle_to_file(handle);
+
+    (void) errinfo;
+    cs_free(file);
 }
 
 static couchstore_error_t couch_advise(couchstore_error_info_t *errinfo,
@@ -165,8 +373,56 @@ static couchstore_error_t couch_advise(couchstore_error_info_t *errinfo,
     return COUCHSTORE_SUCCESS;
 }
 
+static couchstore_error_t couch_allocate(couchstore_error_info_t *errinfo,
+                                         couch_file_handle handle,
+                                         cs_off_t offset,
+                                         cs_off_t len)
+{
+    win_file *file = handle_to_file(handle);
+    FILE_STANDARD_INFO standard;
+    FILE_ALLOCATION_INFO allocation;
+
+    /* Setting the allocation size below what's allocated would free the
+       rest; it leaves the end of the file where it is either way */
+    if (!GetFileInformationByHandleEx(file->file, FileStandardInfo,
+                                      &standard, sizeof(standard))) {
+        save_windows_error(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    if (standard.AllocationSize.QuadPart >= offset + len) {
+        return COUCHSTORE_SUCCESS;
+    }
+    allocation.AllocationSize.QuadPart = offset + len;
+    if (!SetFileInformationByHandle(file->file, FileAllocationInfo,
+                                    &allocation, sizeof(allocation))) {
+        save_windows_error(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t couch_truncate(couchstore_error_info_t *errinfo,
+                                         couch_file_handle handle,
+                                         cs_off_t size)
+{
+    win_file *file = handle_to_file(handle);
+    FILE_END_OF_FILE_INFO eof;
+    FILE_ALLOCATION_INFO allocation;
+
+    eof.EndOfFile.QuadPart = size;
+    allocation.AllocationSize.QuadPart = size;
+    if (!SetFileInformationByHandle(file->file, FileEndOfFileInfo,
+                                    &eof, sizeof(eof)) ||
+        !SetFileInformationByHandle(file->file, FileAllocationInfo,
+                                    &allocation, sizeof(allocation))) {
+        save_windows_error(errinfo);
+        return COUCHSTORE_ERROR_WRITE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
 static const couch_file_ops default_file_ops = {
-    (uint64_t)5,
+    (uint64_t)7,
     couch_constructor,
     couch_open,
     couch_close,
@@ -176,7 +432,10 @@ static const couch_file_ops default_file_ops = {
     couch_sync,
     couch_advise,
     couch_destructor,
-    NULL
+    NULL,
+    couch_pwritev,
+    couch_allocate,
+    couch_truncate
 };
 
 LIBCOUCHSTORE_API
@@ -184,3 +443,9 @@ const couch_file_ops *couchstore_get_default_file_ops(void)
 {
     return &default_file_ops;
 }
+
+LIBCOUCHSTORE_API
+const couch_file_ops *couchstore_get_io_uring_file_ops(void)
+{
+    return NULL;
+}
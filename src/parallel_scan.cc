@@ -0,0 +1,307 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Scans of a whole index on several threads; see couchstore_parallel_scan().
+//
+// The index is split into key ranges at the boundaries of its upper
+// interior nodes, as evenly by subtree size as they allow, and each range
+// is walked by a cursor on a snapshot of its own, on a thread of its own.
+// Snapshots share the file descriptor and block cache, but each has its
+// read buffers, so the ranges' reads go ahead side by side.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "couch_btree.h"
+#include "node_cache.h"
+#include "node_types.h"
+#include "util.h"
+
+// Levels of the tree are split into their children until there are this
+// many subtrees to a partition to even them out with, or the next level
+// down would be the leaves.
+#define SCAN_SUBTREES_PER_PARTITION 8
+#define SCAN_MAX_PARTITIONS 64
+
+// How many documents a partition goes through between looks at whether
+// another one has failed.
+#define SCAN_STOP_CHECK_INTERVAL 64
+
+typedef struct {
+    sized_buf key;              // the greatest in it, as its parent has it
+    uint64_t pointer;
+    uint64_t size;
+} scan_subtree;
+
+typedef struct parallel_scan parallel_scan;
+
+typedef struct {
+    parallel_scan *scan;
+    int number;
+    Db *snapshot;
+    sized_buf after;            // keys up to this are an earlier partition's
+    sized_buf last;             // and keys past this a later one's
+    cb_thread_t thread;
+    int started;
+    couchstore_error_t errcode;
+} scan_partition;
+
+struct parallel_scan {
+    couchstore_cursor_index index;
+    couchstore_docinfos_options options;
+    couchstore_parallel_scan_fn callback;
+    void *ctx;
+    cb_mutex_t mutex;
+    int stopped;                // once a partition has failed
+};
+
+static void free_subtrees(scan_subtree *subtrees, size_t count)
+{
+    size_t ii;
+    if (subtrees != NULL) {
+        for (ii = 0; ii < count; ii++) {
+            cs_free(subtrees[ii].key.buf);
+        }
+        cs_free(subtrees);
+    }
+}
+
+// Replaces a level of subtrees with their children, unless those are
+// leaves, in which case *expanded is cleared and the level is kept.
+static couchstore_error_t expand_level(tree_file *file, scan_subtree **subtrees,
+                                       size_t *count, int *expanded)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    scan_subtree *children = NULL;
+    size_t nchildren = 0, capacity = 0, ii;
+    decoded_node *node = NULL;
+    unsigned jj;
+
+    *expanded = 0;
+    for (ii = 0; ii < *count; ii++) {
+        error_pass(btree_read_node(file, (*subtrees)[ii].pointer, 0, &node));
+        if (node->buf[0] != KP_NODE) {
+            goto cleanup;
+        }
+        if (nchildren + node->count > capacity) {
+            size_t grown = 2 * (nchildren + node->count);
+            scan_subtree *more = static_cast<scan_subtree *>(
+                cs_realloc(children, grown * sizeof(scan_subtree)));
+            error_unless(more, COUCHSTORE_ERROR_ALLOC_FAIL);
+            children = more;
+            capacity = grown;
+        }
+        for (jj = 0; jj < node->count; jj++) {
+            const raw_node_pointer *raw =
+                (const raw_node_pointer*)node->entries[jj].value.buf;
+            scan_subtree *child = &children[nchildren];
+            child->key.size = node->entries[jj].key.size;
+            child->key.buf = static_cast<char *>(cs_malloc(child->key.size));
+            error_unless(child->key.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+            memcpy(child->key.buf, node->entries[jj].key.buf, child->key.size);
+            child->pointer = decode_raw48(raw->pointer);
+            child->size = decode_raw48(raw->subtreesize);
+            nchildren++;
+        }
+        node_release(file->node_cache, node);
+        node = NULL;
+    }
+    free_subtrees(*subtrees, *count);
+    *subtrees = children;
+    *count = nchildren;
+    children = NULL;
+    *expanded = 1;
+cleanup:
+    if (node != NULL) {
+        node_release(file->node_cache, node);
+    }
+    free_subtrees(children, nchildren);
+    return errcode;
+}
+
+// Splits a level of subtrees into at most nparts runs of about the same
+// size, setting the key ranges of the partitions; returns how many.
+static int split_subtrees(const scan_subtree *subtrees, size_t count,
+                          scan_partition *parts, int nparts)
+{
+    uint64_t total = 0, sum = 0;
+    size_t ii;
+    int p = 0;
+
+    for (ii = 0; ii < count; ii++) {
+        total += subtrees[ii].size;
+    }
+    for (ii = 0; ii + 1 < count && p + 1 < nparts; ii++) {
+        sum += subtrees[ii].size;
+        if (sum * nparts >= total * (p + 1)) {
+            parts[p].last = subtrees[ii].key;
+            parts[p + 1].after = subtrees[ii].key;
+            p++;
+        }
+    }
+    return p + 1;
+}
+
+static int scan_stopped(parallel_scan *scan)
+{
+    cb_mutex_enter(&scan->mutex);
+    int stopped = scan->stopped;
+    cb_mutex_exit(&scan->mutex);
+    return stopped;
+}
+
+static couchstore_error_t scan_range(scan_partition *part)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    parallel_scan *scan = part->scan;
+    int (*compare)(const sized_buf *, const sized_buf *) =
+        scan->index == COUCHSTORE_CURSOR_BY_ID ? ebin_cmp : seq_cmp;
+    couchstore_cursor *cursor = NULL;
+    DocInfo *info = NULL;
+    raw_48 seqbuf;
+    sized_buf key;
+    unsigned visited = 0;
+
+    error_pass(couchstore_cursor_open(part->snapshot, scan->index, &cursor));
+    if (part->after.buf != NULL) {
+        error_pass(couchstore_cursor_seek(cursor, &part->after));
+    }
+    for (;;) {
+        if (++visited % SCAN_STOP_CHECK_INTERVAL == 0 && scan_stopped(scan)) {
+            break;
+        }
+        error_pass(couchstore_cursor_next(cursor, &info));
+        if (info == NULL) {
+            break;
+        }
+        if (scan->index == COUCHSTORE_CURSOR_BY_ID) {
+            key = info->id;
+        } else {
+            seqbuf = encode_raw48(info->db_seq);
+            key.buf = (char*)&seqbuf;
+            key.size = sizeof(seqbuf);
+        }
+        if (part->last.buf != NULL && compare(&key, &part->last) > 0) {
+            break;
+        }
+        if ((part->after.buf != NULL && compare(&key, &part->after) <= 0) ||
+            ((scan->options & COUCHSTORE_DELETES_ONLY) && !info->deleted) ||
+            ((scan->options & COUCHSTORE_NO_DELETES) && info->deleted)) {
+            couchstore_free_docinfo(info);
+            info = NULL;
+            continue;
+        }
+        int result = scan->callback(part->snapshot, part->number, info, scan->ctx);
+        if (result <= 0) {
+            couchstore_free_docinfo(info);
+        }
+        info = NULL;
+        error_unless(result >= 0, static_cast<couchstore_error_t>(result));
+    }
+cleanup:
+    couchstore_free_docinfo(info);
+    couchstore_cursor_close(cursor);
+    return errcode;
+}
+
+static void scan_worker(void *arg)
+{
+    scan_partition *part = static_cast<scan_partition *>(arg);
+    part->errcode = scan_range(part);
+    if (part->errcode != COUCHSTORE_SUCCESS) {
+        cb_mutex_enter(&part->scan->mutex);
+        part->scan->stopped = 1;
+        cb_mutex_exit(&part->scan->mutex);
+    }
+}
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_parallel_scan(Db *db,
+                                            couchstore_cursor_index index,
+                                            int nthreads,
+                                            couchstore_docinfos_options options,
+                                            couchstore_parallel_scan_fn callback,
+                                            void *ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    parallel_scan scan;
+    scan_partition parts[SCAN_MAX_PARTITIONS];
+    scan_subtree *subtrees = NULL;
+    size_t count = 0;
+    const node_pointer *root;
+    int nparts = 0, expanded = 1, ii;
+    Db *snapshot = NULL;
+
+    memset(parts, 0, sizeof(parts));
+    scan.index = index;
+    scan.options = options;
+    scan.callback = callback;
+    scan.ctx = ctx;
+    scan.stopped = 0;
+    cb_mutex_initialize(&scan.mutex);
+    error_unless(!db->dropped, COUCHSTORE_ERROR_FILE_CLOSED);
+    error_unless(index == COUCHSTORE_CURSOR_BY_ID || index == COUCHSTORE_CURSOR_BY_SEQUENCE,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    error_unless(nthreads > 0, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    if (nthreads > SCAN_MAX_PARTITIONS) {
+        nthreads = SCAN_MAX_PARTITIONS;
+    }
+
+    // Every partition sees the same commit, which the first snapshot's
+    // tree is split by.
+    error_pass(couchstore_open_snapshot(db, &snapshot));
+    root = index == COUCHSTORE_CURSOR_BY_ID ? snapshot->header.by_id_root
+                                            : snapshot->header.by_seq_root;
+    if (root == NULL) {
+        goto cleanup;
+    }
+    subtrees = static_cast<scan_subtree *>(cs_calloc(1, sizeof(scan_subtree)));
+    error_unless(subtrees, COUCHSTORE_ERROR_ALLOC_FAIL);
+    subtrees[0].pointer = root->pointer;
+    subtrees[0].size = root->subtreesize;
+    count = 1;
+    while (nthreads > 1 && expanded &&
+           count < (size_t)nthreads * SCAN_SUBTREES_PER_PARTITION) {
+        error_pass(expand_level(&snapshot->file, &subtrees, &count, &expanded));
+    }
+    nparts = split_subtrees(subtrees, count, parts, nthreads);
+
+    parts[0].snapshot = snapshot;
+    snapshot = NULL;
+    for (ii = 1; ii < nparts; ii++) {
+        error_pass(couchstore_open_snapshot(db, &parts[ii].snapshot));
+    }
+    // The calling thread takes the first partition, and any a thread
+    // couldn't be started for.
+    for (ii = 0; ii < nparts; ii++) {
+        parts[ii].scan = &scan;
+        parts[ii].number = ii;
+        parts[ii].started = ii > 0 &&
+                            cb_create_thread(&parts[ii].thread, scan_worker, &parts[ii], 0) == 0;
+        if (ii > 0 && !parts[ii].started) {
+            scan_worker(&parts[ii]);
+        }
+    }
+    scan_worker(&parts[0]);
+    for (ii = 1; ii < nparts; ii++) {
+        if (parts[ii].started) {
+            cb_join_thread(parts[ii].thread);
+        }
+    }
+    for (ii = 0; ii < nparts && errcode == COUCHSTORE_SUCCESS; ii++) {
+        errcode = parts[ii].errcode;
+    }
+cleanup:
+    for (ii = 0; ii < nparts; ii++) {
+        if (parts[ii].snapshot != NULL) {
+            couchstore_close_db(parts[ii].snapshot);
+        }
+    }
+    if (snapshot != NULL) {
+        couchstore_close_db(snapshot);
+    }
+    free_subtrees(subtrees, count);
+    cb_mutex_destroy(&scan.mutex);
+    return errcode;
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_PROBES_H
+#define LIBCOUCHSTORE_PROBES_H 1
+
+/* Static tracepoints (USDT probes) of the "couchstore" provider, for
+   correlating what the library does with system-level traces in bpftrace,
+   perf or SystemTap, e.g.
+
+       bpftrace -e 'usdt:./libcouchstore.so:couchstore:chunk_read
+                    { @bytes = hist(arg1); }'
+
+   A probe is a single nop until a tracer attaches to it; its arguments
+   are values already at hand, so they cost next to nothing either. The
+   probes are built in when the COUCHSTORE_PROBES CMake option is on and
+   <sys/sdt.h> is found, and are no code at all otherwise.
+
+   chunk_read(pos, len, compressed)       a chunk read through pread_*;
+                                          len is negative on errors
+   node_flush(type, items, bytes, pos)    a B-tree node written (pos is 0
+                                          if it's left to the chunk writer)
+   commit_start(pos)                      couchstore_commit() begins...
+   commit_end(pos, errcode)               ...and ends, pos being where the
+                                          header went
+   find_header(pos, errcode)              each block looked at for a header
+   view_update_batch(actions, bytes)      a batch of view index updates
+   sort_run(records)                      a run of the file sorter sorted
+   sort_merge(files, level)               sorted runs merged, level 0
+                                          being the final merge
+*/
+
+#include "config.h"
+
+#if defined(COUCHSTORE_PROBES) && defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#define PROBE1(NAME, A) DTRACE_PROBE1(couchstore, NAME, A)
+#define PROBE2(NAME, A, B) DTRACE_PROBE2(couchstore, NAME, A, B)
+#define PROBE3(NAME, A, B, C) DTRACE_PROBE3(couchstore, NAME, A, B, C)
+#define PROBE4(NAME, A, B, C, D) DTRACE_PROBE4(couchstore, NAME, A, B, C, D)
+#else
+#define PROBE1(NAME, A) do { } while (0)
+#define PROBE2(NAME, A, B) do { } while (0)
+#define PROBE3(NAME, A, B, C) do { } while (0)
+#define PROBE4(NAME, A, B, C, D) do { } while (0)
+#endif
+
+#endif
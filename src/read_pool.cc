@@ -0,0 +1,131 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Lookups on one Db from many threads.
+//
+// A tree_file's buffered handle and node cache belong to one thread, so a
+// Db can't be looked up in from several at once. Opening a Db per thread
+// instead multiplies the descriptors and caches by the thread count. Here
+// a lookup borrows a snapshot (see couchstore_open_snapshot) from a free
+// list for the length of the call. Snapshots read through the writer's raw
+// handle, so they cost buffers and a node cache but no descriptor, and
+// only as many are ever opened as lookups have run at once.
+//
+// New snapshots are cloned from a template taken when the pool was made,
+// which is never read from, rather than from the Db, whose state the
+// writer changes under us.
+
+#include "config.h"
+#include <stdlib.h>
+#include "internal.h"
+#include "read_pool.h"
+#include "util.h"
+
+struct read_pool {
+    cb_mutex_t mutex;
+    Db *base;                       // the template
+    uint64_t committed;             // header lookups are to see
+    Db **spare;
+    unsigned nspare;
+    unsigned capacity;
+};
+
+couchstore_error_t read_pool_create(Db *db, read_pool **pPool)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    read_pool *pool = static_cast<read_pool *>(cs_calloc(1, sizeof(*pool)));
+    error_unless(pool, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cb_mutex_initialize(&pool->mutex);
+    pool->committed = db->header.position;
+    errcode = couchstore_open_snapshot(db, &pool->base);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        read_pool_destroy(pool);
+        return errcode;
+    }
+    *pPool = pool;
+cleanup:
+    return errcode;
+}
+
+void read_pool_destroy(read_pool *pool)
+{
+    unsigned i;
+
+    if (pool == NULL) {
+        return;
+    }
+    for (i = 0; i < pool->nspare; ++i) {
+        couchstore_close_db(pool->spare[i]);
+    }
+    cs_free(pool->spare);
+    if (pool->base) {
+        couchstore_close_db(pool->base);
+    }
+    cb_mutex_destroy(&pool->mutex);
+    cs_free(pool);
+}
+
+void read_pool_committed(read_pool *pool, uint64_t pos)
+{
+    cb_mutex_enter(&pool->mutex);
+    pool->committed = pos;
+    cb_mutex_exit(&pool->mutex);
+}
+
+couchstore_error_t read_pool_acquire(read_pool *pool, Db **pReader)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *reader = NULL;
+
+    cb_mutex_enter(&pool->mutex);
+    uint64_t pos = pool->committed;
+    if (pool->nspare > 0) {
+        reader = pool->spare[--pool->nspare];
+    }
+    cb_mutex_exit(&pool->mutex);
+
+    if (reader == NULL) {
+        errcode = db_open_snapshot(pool->base, pos, &reader);
+    } else if (reader->header.position != pos) {
+        errcode = db_move_snapshot(reader, pos);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            couchstore_close_db(reader);
+        }
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        *pReader = reader;
+    }
+    return errcode;
+}
+
+size_t read_pool_memory(read_pool *pool)
+{
+    couchstore_memory_stats stats;
+    unsigned i;
+
+    cb_mutex_enter(&pool->mutex);
+    size_t total = sizeof(read_pool) + pool->capacity * sizeof(Db *);
+    for (i = 0; i < pool->nspare; ++i) {
+        couchstore_get_memory_stats(pool->spare[i], &stats);
+        total += sizeof(Db) + stats.total;
+    }
+    cb_mutex_exit(&pool->mutex);
+    return total;
+}
+
+void read_pool_release(read_pool *pool, Db *reader)
+{
+    cb_mutex_enter(&pool->mutex);
+    if (pool->nspare == pool->capacity) {
+        unsigned capacity = pool->capacity ? pool->capacity * 2 : 8;
+        Db **spare = static_cast<Db **>(cs_realloc(pool->spare, capacity * sizeof(Db *)));
+        if (spare == NULL) {
+            cb_mutex_exit(&pool->mutex);
+            couchstore_close_db(reader);
+            return;
+        }
+        pool->spare = spare;
+        pool->capacity = capacity;
+    }
+    pool->spare[pool->nspare++] = reader;
+    cb_mutex_exit(&pool->mutex);
+}
@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_READ_POOL_H
+#define LIBCOUCHSTORE_READ_POOL_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Snapshots of a Db opened with COUCHSTORE_OPEN_FLAG_SHARED_READS, lent
+       to the threads looking documents up in it. Each lookup borrows one,
+       moved on to the last commit if it's behind, so lookups on different
+       threads have read buffers and node caches of their own while sharing
+       the file descriptor and block cache. There are as many as there have
+       been lookups at once, not as many as there are threads. */
+    typedef struct read_pool read_pool;
+
+    /** Creates the pool of a Db, on the thread writing it. */
+    couchstore_error_t read_pool_create(Db *db, read_pool **pPool);
+
+    /** Closes the snapshots. None may be lent out. */
+    void read_pool_destroy(read_pool *pool);
+
+    /** Moves lookups on to the header at pos, on the thread writing the
+        Db, once the header is synced. */
+    void read_pool_committed(read_pool *pool, uint64_t pos);
+
+    /** Lends out a snapshot of the last commit, opening one if there's
+        none to spare. */
+    couchstore_error_t read_pool_acquire(read_pool *pool, Db **pReader);
+
+    /** Takes a snapshot back. */
+    void read_pool_release(read_pool *pool, Db *reader);
+
+    /** The bytes the pool and its spare snapshots take. Those lent out
+        are in use on other threads, and aren't counted. */
+    size_t read_pool_memory(read_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
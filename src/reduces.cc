@@ -40,6 +40,63 @@ couchstore_error_t by_seq_rereduce(char *dst, size_t *size_r, const nodelist *pt
 }
 
 
+couchstore_error_t by_seq_deletes_reduce(char *dst, size_t *size_r, const nodelist *leaflist, int count, void *ctx)
+{
+    raw_by_seq_deletes_reduce *raw = (raw_by_seq_deletes_reduce*)dst;
+    uint64_t deleted = 0;
+    const nodelist *i = leaflist;
+    int n = count;
+
+    (void) ctx;
+
+    while (i != NULL && n > 0) {
+        const raw_seq_index_value *value = (const raw_seq_index_value*)i->data.buf;
+        if (decode_raw48(value->bp) & BP_DELETED_FLAG) {
+            deleted++;
+        }
+        i = i->next;
+        n--;
+    }
+    raw->count = encode_raw40(count);
+    raw->deleted = encode_raw40(deleted);
+    *size_r = sizeof(*raw);
+
+    return COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t by_seq_deletes_rereduce(char *dst, size_t *size_r, const nodelist *ptrlist, int count, void *ctx)
+{
+    uint64_t total = 0, deleted = 0;
+    int have_deleted = 1;
+    const nodelist *i = ptrlist;
+
+    (void) ctx;
+
+    while (i != NULL && count > 0) {
+        const sized_buf *value = &i->pointer->reduce_value;
+        const raw_by_seq_deletes_reduce *reduce = (const raw_by_seq_deletes_reduce*) value->buf;
+        total += decode_raw40(reduce->count);
+        if (value->size >= sizeof(raw_by_seq_deletes_reduce)) {
+            deleted += decode_raw40(reduce->deleted);
+        } else {
+            have_deleted = 0;
+        }
+
+        i = i->next;
+        count--;
+    }
+    raw_by_seq_deletes_reduce *raw = (raw_by_seq_deletes_reduce*)dst;
+    raw->count = encode_raw40(total);
+    if (have_deleted) {
+        raw->deleted = encode_raw40(deleted);
+        *size_r = sizeof(raw_by_seq_deletes_reduce);
+    } else {
+        *size_r = sizeof(raw_by_seq_reduce);
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
 static size_t encode_by_id_reduce(char *dst, uint64_t notdeleted, uint64_t deleted, uint64_t size)
 {
     raw_by_id_reduce *raw = (raw_by_id_reduce*)dst;
@@ -10,6 +10,13 @@ typedef struct {
     raw_40 count;
 } raw_by_seq_reduce;
 
+/* The by-seq reduce since COUCH_DISK_VERSION_SEQ_DELETES, which starts
+   with the same count */
+typedef struct {
+    raw_40 count;
+    raw_40 deleted;
+} raw_by_seq_deletes_reduce;
+
 typedef struct {
     raw_40 notdeleted;
     raw_40 deleted;
@@ -23,6 +30,11 @@ extern "C" {
     couchstore_error_t by_seq_reduce(char *dst, size_t *size_r, const nodelist *leaflist, int count, void *ctx);
     couchstore_error_t by_seq_rereduce(char *dst, size_t *size_r, const nodelist *leaflist, int count, void *ctx);
 
+    /* By-seq reduces that also count deletions. A subtree whose reduce
+       doesn't have that count leaves it out of its parents' too. */
+    couchstore_error_t by_seq_deletes_reduce(char *dst, size_t *size_r, const nodelist *leaflist, int count, void *ctx);
+    couchstore_error_t by_seq_deletes_rereduce(char *dst, size_t *size_r, const nodelist *leaflist, int count, void *ctx);
+
     couchstore_error_t by_id_rereduce(char *dst, size_t *size_r, const nodelist *leaflist, int count, void *ctx);
     couchstore_error_t by_id_reduce(char *dst, size_t *size_r, const nodelist *leaflist, int count, void *ctx);
 
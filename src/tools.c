@@ -0,0 +1,178 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "tools.h"
+#include <stdlib.h>
+#include <platform/platform.h>
+
+typedef struct {
+    const char **files;
+    int num_files;
+    tool_file_fn fn;
+    void *ctx;
+    FILE **outputs;
+    int *results;
+    int *done;
+    int next;
+    cb_mutex_t mutex;
+    cb_cond_t cond;
+} tool_pool;
+
+
+static void tool_worker(void *arg)
+{
+    tool_pool *pool = (tool_pool *) arg;
+
+    for (;;) {
+        int i;
+        FILE *out;
+
+        cb_mutex_enter(&pool->mutex);
+        i = pool->next++;
+        cb_mutex_exit(&pool->mutex);
+        if (i >= pool->num_files) {
+            return;
+        }
+
+        out = tmpfile();
+        if (out == NULL) {
+            fprintf(stderr, "Failed to create a temporary file for \"%s\"\n",
+                    pool->files[i]);
+            pool->results[i] = -1;
+        } else {
+            pool->results[i] = pool->fn(pool->files[i], i, out, pool->ctx);
+        }
+
+        cb_mutex_enter(&pool->mutex);
+        pool->outputs[i] = out;
+        pool->done[i] = 1;
+        cb_cond_broadcast(&pool->cond);
+        cb_mutex_exit(&pool->mutex);
+    }
+}
+
+
+static void copy_output(FILE *from, FILE *to)
+{
+    char buf[65536];
+    size_t n;
+
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0) {
+        fwrite(buf, 1, n, to);
+    }
+    fclose(from);
+}
+
+
+int run_tool_on_files(const char **files, int num_files, int threads,
+                      tool_file_fn fn, void *ctx, FILE *out)
+{
+    tool_pool pool;
+    cb_thread_t *ids;
+    int started = 0;
+    int result = 0;
+    int i;
+
+    if (threads > num_files) {
+        threads = num_files;
+    }
+    if (threads <= 1) {
+        for (i = 0; i < num_files; ++i) {
+            result += fn(files[i], i, out, ctx);
+        }
+        return result;
+    }
+
+    pool.files = files;
+    pool.num_files = num_files;
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.next = 0;
+    pool.outputs = (FILE **) calloc(num_files, sizeof(FILE *));
+    pool.results = (int *) calloc(num_files, sizeof(int));
+    pool.done = (int *) calloc(num_files, sizeof(int));
+    ids = (cb_thread_t *) calloc(threads, sizeof(cb_thread_t));
+    if (pool.outputs == NULL || pool.results == NULL || pool.done == NULL ||
+        ids == NULL) {
+        free(pool.outputs);
+        free(pool.results);
+        free(pool.done);
+        free(ids);
+        fprintf(stderr, "Memory allocation failure\n");
+        return -num_files;
+    }
+    cb_mutex_initialize(&pool.mutex);
+    cb_cond_initialize(&pool.cond);
+
+    for (i = 0; i < threads; ++i) {
+        if (cb_create_thread(&ids[started], tool_worker, &pool, 0) == 0) {
+            ++started;
+        }
+    }
+    if (started == 0) {
+        /* Do it all here then */
+        tool_worker(&pool);
+    }
+
+    for (i = 0; i < num_files; ++i) {
+        FILE *output;
+
+        cb_mutex_enter(&pool.mutex);
+        while (!pool.done[i]) {
+            cb_cond_wait(&pool.cond, &pool.mutex);
+        }
+        output = pool.outputs[i];
+        cb_mutex_exit(&pool.mutex);
+
+        if (output != NULL) {
+            copy_output(output, out);
+        }
+        result += pool.results[i];
+    }
+
+    for (i = 0; i < started; ++i) {
+        cb_join_thread(ids[i]);
+    }
+    cb_cond_destroy(&pool.cond);
+    cb_mutex_destroy(&pool.mutex);
+    free(pool.outputs);
+    free(pool.results);
+    free(pool.done);
+    free(ids);
+    return result;
+}
+
+
+void print_json_string(FILE *out, const char *bytes, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    fputc('"', out);
+    for (i = 0; i < size; ++i) {
+        unsigned char ch = (unsigned char) bytes[i];
+        switch (ch) {
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            break;
+        case '\r':
+            fputs("\\r", out);
+            break;
+        case '\t':
+            fputs("\\t", out);
+            break;
+        default:
+            if (ch < 0x20) {
+                fprintf(out, "\\u00%c%c", hex[ch >> 4], hex[ch & 0xf]);
+            } else {
+                fputc(ch, out);
+            }
+        }
+    }
+    fputc('"', out);
+}
@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef COUCHSTORE_TOOLS_H
+#define COUCHSTORE_TOOLS_H
+
+/* Helpers shared by the command line tools */
+
+#include "config.h"
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* Works on files[index], writing what it has to say to out */
+    typedef int (*tool_file_fn)(const char *file, int index, FILE *out,
+                                void *ctx);
+
+    /* Calls fn on each of the files, on up to threads of them at once,
+       and returns the sum of what the calls return. With more than one
+       thread each call writes to a temporary file, copied to out once it's
+       done and the calls on the files before it have been copied, so the
+       output is the same as a run on one thread's; fn must be safe to
+       call from several threads at once, telling its calls apart by
+       index. */
+    int run_tool_on_files(const char **files, int num_files, int threads,
+                          tool_file_fn fn, void *ctx, FILE *out);
+
+    /* Prints bytes as a JSON string, quotes included */
+    void print_json_string(FILE *out, const char *bytes, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
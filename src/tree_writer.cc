@@ -2,38 +2,129 @@
 #include "config.h"
 
 #include "arena.h"
+#include "batch_sort.h"
 #include "bitfield.h"
 #include "couch_btree.h"
+#include "file_name_utils.h"
+#include "file_sorter.h"
 #include "internal.h"
-#include "mergesort.h"
+#include "io_throttle.h"
 #include "reduces.h"
 #include "tree_writer.h"
 #include "util.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 
-#define ID_SORT_CHUNK_SIZE (100 * 1024 * 1024) // 100MB. Make tuneable?
-#define ID_SORT_MAX_RECORD_SIZE 4196
+// Runs merged at once. Past this many, runs are merged into larger ones
+// first, which only a budget far too small for the file comes to.
+#define ID_SORT_MAX_TMP_FILES 64
 
 
-static char *alloc_record(void);
-static char *duplicate_record(char *rec);
-static void free_record(char *rec);
-static int read_id_record(FILE *in, void *buf, void *ctx);
-static int write_id_record(FILE *out, void *ptr, void *ctx);
+// A pair as sorted; with the key first, a pointer to one is one to its key.
+typedef struct extsort_record {
+    sized_buf k;
+    sized_buf v;
+    char buf[1];
+} extsort_record;
+
+
+static int read_id_record(FILE *in, void **buf, void *ctx);
+static int read_id_record_slab(FILE *in, void **buf, arena *slab, void *ctx);
+static file_merger_error_t write_id_record(FILE *out, void *ptr, void *ctx);
 static int compare_id_record(const void *r1, const void *r2, void *ctx);
+static int id_record_sort_key(const void *r, sized_buf *key, void *ctx);
+static void free_id_record(void *rec, void *ctx);
 
 
 struct TreeWriter {
     FILE* file;
+    char* path;
+    char* tmp_dir;                  // of the sort's runs
+    int temporary;                  // path is removed when freed
     compare_callback key_compare;
     reduce_fn reduce;
     reduce_fn rereduce;
     void *user_reduce_ctx;
+    io_throttle *throttle;
+    size_t sort_memory;
+    unsigned sort_threads;
+    int sorted;                     // no pair is out of order
+    sized_buf last_key;             // of the pairs added, while sorted
+    size_t last_key_capacity;
+    // Pairs kept in memory, until they'd take more than the sort's budget
+    // and go to the file. NULL once they have.
+    arena* items;
+    extsort_record** records;
+    size_t count;
+    size_t capacity;
+    size_t held;
 };
 
 
+static const char *system_tmp_dir(void)
+{
+    const char *dir = getenv("TMPDIR");
+#ifdef WIN32
+    if (dir == NULL) {
+        dir = getenv("TEMP");
+    }
+#endif
+#ifdef P_tmpdir
+    if (dir == NULL) {
+        dir = P_tmpdir;
+    }
+#endif
+    return dir ? dir : ".";
+}
+
+// The directory of a path, malloced.
+static char *path_dir(const char *path)
+{
+    const char *end = strrchr(path, '/');
+#ifdef WIN32
+    const char *bs = strrchr(path, '\\');
+    if (bs && (end == NULL || bs > end)) {
+        end = bs;
+    }
+#endif
+    if (end == NULL) {
+        return cs_strdup(".");
+    }
+    if (end == path) {
+        return cs_strdup("/");
+    }
+    char *dir = static_cast<char*>(cs_malloc(end - path + 1));
+    if (dir) {
+        memcpy(dir, path, end - path);
+        dir[end - path] = '\0';
+    }
+    return dir;
+}
+
+
+// Makes the temporary file of a TreeWriter opened without one. The sort
+// needs the file by name, so it isn't a tmpfile().
+static couchstore_error_t open_tmp_file(TreeWriter* writer)
+{
+    writer->tmp_dir = cs_strdup(system_tmp_dir());
+    if (!writer->tmp_dir) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    writer->path = tmp_file_path(writer->tmp_dir, "tree_writer");
+    if (!writer->path) {
+        return COUCHSTORE_ERROR_NO_SUCH_FILE;
+    }
+    writer->temporary = 1;
+    writer->file = fopen(writer->path, "w+b");
+    if (!writer->file) {
+        return COUCHSTORE_ERROR_NO_SUCH_FILE;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+
 couchstore_error_t TreeWriterOpen(const char* unsortedFilePath,
                                   compare_callback key_compare,
                                   reduce_fn reduce,
@@ -42,17 +133,38 @@ couchstore_error_t TreeWriterOpen(const char* unsortedFilePath,
                                   TreeWriter** out_writer)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    TreeWriter* writer = static_cast<TreeWriter*>(calloc(1, sizeof(TreeWriter)));
+    TreeWriter* writer = static_cast<TreeWriter*>(cs_calloc(1, sizeof(TreeWriter)));
     error_unless(writer, COUCHSTORE_ERROR_ALLOC_FAIL);
-    writer->file = unsortedFilePath ? fopen(unsortedFilePath, "r+b") : tmpfile();
-    if (!writer->file) {
-        TreeWriterFree(writer);
-        error_pass(COUCHSTORE_ERROR_NO_SUCH_FILE);
-    }
+    writer->key_compare = (key_compare ? key_compare : ebin_cmp);
     if (unsortedFilePath) {
+        writer->path = cs_strdup(unsortedFilePath);
+        writer->tmp_dir = path_dir(unsortedFilePath);
+        if (!writer->path || !writer->tmp_dir) {
+            TreeWriterFree(writer);
+            error_pass(COUCHSTORE_ERROR_ALLOC_FAIL);
+        }
+        writer->file = fopen(writer->path, "r+b");
+        if (!writer->file) {
+            TreeWriterFree(writer);
+            error_pass(COUCHSTORE_ERROR_NO_SUCH_FILE);
+        }
         fseek(writer->file, 0, SEEK_END);  // in case more items will be added
+    } else if (writer->key_compare == ebin_cmp) {
+        // What's sorted in memory is sorted by sort_id_pointers.
+        writer->items = new_huge_page_arena();
+        if (!writer->items) {
+            TreeWriterFree(writer);
+            error_pass(COUCHSTORE_ERROR_ALLOC_FAIL);
+        }
+    } else {
+        errcode = open_tmp_file(writer);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            TreeWriterFree(writer);
+            return errcode;
+        }
     }
-    writer->key_compare = (key_compare ? key_compare : ebin_cmp);
+    // Of a file's contents, nothing is known.
+    writer->sorted = (unsortedFilePath == NULL);
     writer->reduce = reduce;
     writer->rereduce = rereduce;
     writer->user_reduce_ctx = user_reduce_ctx;
@@ -64,10 +176,140 @@ cleanup:
 
 void TreeWriterFree(TreeWriter* writer)
 {
-    if (writer && writer->file) {
+    if (writer == NULL) {
+        return;
+    }
+    if (writer->file) {
         fclose(writer->file);
     }
-    free(writer);
+    if (writer->temporary && writer->path) {
+        remove(writer->path);
+    }
+    cs_free(writer->path);
+    cs_free(writer->tmp_dir);
+    cs_free(writer->last_key.buf);
+    if (writer->items) {
+        delete_arena(writer->items);
+    }
+    cs_free(writer->records);
+    cs_free(writer);
+}
+
+
+void TreeWriterSetThrottle(TreeWriter* writer, io_throttle* throttle)
+{
+    writer->throttle = throttle;
+}
+
+
+void TreeWriterSetSort(TreeWriter* writer, size_t memory_budget, unsigned threads)
+{
+    writer->sort_memory = memory_budget;
+    writer->sort_threads = threads;
+}
+
+
+void TreeWriterSetSorted(TreeWriter* writer)
+{
+    writer->sorted = 1;
+    cs_free(writer->last_key.buf);
+    writer->last_key.buf = NULL;
+    writer->last_key_capacity = 0;
+}
+
+
+// Keeps track of whether the pairs are still in order, as long as they are.
+static couchstore_error_t note_key(TreeWriter* writer, const sized_buf *key)
+{
+    if (writer->last_key.buf && writer->key_compare(&writer->last_key, key) > 0) {
+        writer->sorted = 0;
+        cs_free(writer->last_key.buf);
+        writer->last_key.buf = NULL;
+        return COUCHSTORE_SUCCESS;
+    }
+    if (key->size > writer->last_key_capacity || writer->last_key.buf == NULL) {
+        size_t capacity = key->size > 64 ? key->size : 64;
+        char *buf = static_cast<char*>(cs_realloc(writer->last_key.buf, capacity));
+        if (buf == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        writer->last_key.buf = buf;
+        writer->last_key_capacity = capacity;
+    }
+    memcpy(writer->last_key.buf, key->buf, key->size);
+    writer->last_key.size = key->size;
+    return COUCHSTORE_SUCCESS;
+}
+
+
+static int write_pair(FILE* out, const sized_buf *key, const sized_buf *value)
+{
+    uint16_t klen = htons((uint16_t) key->size);
+    uint32_t vlen = htonl((uint32_t) value->size);
+    return fwrite(&klen, sizeof(klen), 1, out) == 1 &&
+           fwrite(&vlen, sizeof(vlen), 1, out) == 1 &&
+           (key->size == 0 || fwrite(key->buf, key->size, 1, out) == 1) &&
+           (value->size == 0 || fwrite(value->buf, value->size, 1, out) == 1);
+}
+
+
+static size_t sort_memory(const TreeWriter* writer)
+{
+    return writer->sort_memory ? writer->sort_memory : TREE_WRITER_SORT_MEMORY;
+}
+
+
+// Moves the pairs kept in memory to the temporary file, in the order they
+// were added, which the ones after them are appended to.
+static couchstore_error_t spill_items(TreeWriter* writer)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t ii;
+
+    error_pass(open_tmp_file(writer));
+    for (ii = 0; ii < writer->count; ii++) {
+        const extsort_record *rec = writer->records[ii];
+        error_unless(write_pair(writer->file, &rec->k, &rec->v), COUCHSTORE_ERROR_WRITE);
+    }
+    delete_arena(writer->items);
+    writer->items = NULL;
+    cs_free(writer->records);
+    writer->records = NULL;
+    writer->count = writer->capacity = writer->held = 0;
+cleanup:
+    return errcode;
+}
+
+
+static couchstore_error_t keep_item(TreeWriter* writer, const sized_buf *key,
+                                    const sized_buf *value)
+{
+    size_t size = sizeof(extsort_record) + key->size + value->size;
+    extsort_record *rec;
+
+    if (writer->count == writer->capacity) {
+        size_t capacity = writer->capacity ? writer->capacity * 2 : 1024;
+        extsort_record **records = static_cast<extsort_record**>(
+            cs_realloc(writer->records, capacity * sizeof(extsort_record*)));
+        if (records == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        writer->records = records;
+        writer->capacity = capacity;
+    }
+    rec = static_cast<extsort_record*>(arena_alloc(writer->items, size));
+    if (rec == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    rec->k.size = key->size;
+    rec->k.buf = rec->buf;
+    rec->v.size = value->size;
+    rec->v.buf = rec->buf + key->size;
+    memcpy(rec->k.buf, key->buf, key->size);
+    memcpy(rec->v.buf, value->buf, value->size);
+    writer->records[writer->count++] = rec;
+    writer->held += size + sizeof(extsort_record*);
+    return COUCHSTORE_SUCCESS;
 }
 
 
@@ -75,42 +317,97 @@ couchstore_error_t TreeWriterAddItem(TreeWriter* writer, sized_buf key, sized_bu
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
 
-    uint16_t klen = htons((uint16_t) key.size);
-    uint32_t vlen = htonl((uint32_t) value.size);
-    error_unless(fwrite(&klen, sizeof(klen), 1, writer->file) == 1, COUCHSTORE_ERROR_WRITE);
-    error_unless(fwrite(&vlen, sizeof(vlen), 1, writer->file) == 1, COUCHSTORE_ERROR_WRITE);
-    error_unless(fwrite(key.buf, key.size, 1, writer->file) == 1, COUCHSTORE_ERROR_WRITE);
-    error_unless(fwrite(value.buf, value.size, 1, writer->file) == 1, COUCHSTORE_ERROR_WRITE);
+    if (writer->sorted) {
+        error_pass(note_key(writer, &key));
+    }
+    if (writer->items) {
+        size_t size = sizeof(extsort_record) + key.size + value.size + sizeof(extsort_record*);
+        if (writer->held + size <= sort_memory(writer)) {
+            return keep_item(writer, &key, &value);
+        }
+        error_pass(spill_items(writer));
+    }
+    error_unless(write_pair(writer->file, &key, &value), COUCHSTORE_ERROR_WRITE);
 
 cleanup:
     return errcode;
 }
 
 
+static couchstore_error_t sort_error(file_sorter_error_t ret)
+{
+    switch (ret) {
+    case FILE_SORTER_SUCCESS:
+        return COUCHSTORE_SUCCESS;
+    case FILE_SORTER_ERROR_ALLOC:
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    case FILE_SORTER_ERROR_FILE_READ:
+        return COUCHSTORE_ERROR_READ;
+    default:
+        return COUCHSTORE_ERROR_WRITE;
+    }
+}
+
+
 couchstore_error_t TreeWriterSort(TreeWriter* writer)
 {
-    rewind(writer->file);
-    return static_cast<couchstore_error_t>(merge_sort(writer->file,
-                                                      writer->file,
-                                                      read_id_record,
-                                                      write_id_record,
-                                                      compare_id_record,
-                                                      alloc_record,
-                                                      duplicate_record,
-                                                      free_record,
-                                                      writer,  // 'context' parameter to the above callbacks
-                                                      ID_SORT_CHUNK_SIZE,
-                                                      NULL));
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    file_sorter_error_t ret;
+
+    if (writer->items) {
+        if (!writer->sorted) {
+            sort_space space = {NULL, 0};
+            errcode = sort_id_pointers((const sized_buf **) writer->records,
+                                       writer->count,
+                                       writer->sort_threads > 1 ? writer->sort_threads - 1 : 0,
+                                       &space);
+            sort_space_free(&space);
+        }
+        return errcode;
+    }
+    if (writer->sorted) {
+        error_unless(fflush(writer->file) == 0, COUCHSTORE_ERROR_WRITE);
+        return COUCHSTORE_SUCCESS;
+    }
+    // The sorted file replaces this one.
+    error_unless(fclose(writer->file) == 0, COUCHSTORE_ERROR_WRITE);
+    writer->file = NULL;
+    ret = sort_file(writer->path,
+                    writer->tmp_dir,
+                    ID_SORT_MAX_TMP_FILES,
+                    sort_memory(writer),
+                    writer->sort_threads,
+                    0,
+                    1,
+                    read_id_record,
+                    read_id_record_slab,
+                    write_id_record,
+                    NULL,
+                    compare_id_record,
+                    // Keys compared bytewise, or fixed-width sequences,
+                    // sort as their bytes do.
+                    (writer->key_compare == ebin_cmp ||
+                     writer->key_compare == seq_cmp) ? id_record_sort_key : NULL,
+                    free_id_record,
+                    0,
+                    writer);  // 'context' parameter to the above callbacks
+    writer->file = fopen(writer->path, "r+b");
+    error_pass(sort_error(ret));
+    error_unless(writer->file, COUCHSTORE_ERROR_NO_SUCH_FILE);
+cleanup:
+    return errcode;
 }
 
 
 couchstore_error_t TreeWriterWrite(TreeWriter* writer,
                                    tree_file* treefile,
+                                   int kv_chunk_threshold,
+                                   int kp_chunk_threshold,
                                    node_pointer** out_root)
 {
     couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    arena* transient_arena = new_arena(0);
-    arena* persistent_arena = new_arena(0);
+    arena* transient_arena = new_huge_page_arena();
+    arena* persistent_arena = new_huge_page_arena();
     compare_info idcmp;
     uint16_t klen;
     uint32_t vlen;
@@ -120,8 +417,6 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
 
     error_unless(transient_arena && persistent_arena, COUCHSTORE_ERROR_ALLOC_FAIL);
 
-    rewind(writer->file);
-
     // Create the structure to write the tree to the db:
     idcmp.compare = writer->key_compare;
 
@@ -131,13 +426,30 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
                                  writer->reduce,
                                  writer->rereduce,
                                  writer->user_reduce_ctx,
-                                 DB_CHUNK_THRESHOLD,
-                                 DB_CHUNK_THRESHOLD);
+                                 kv_chunk_threshold,
+                                 kp_chunk_threshold);
     if (target_mr == NULL) {
         error_pass(COUCHSTORE_ERROR_ALLOC_FAIL);
     }
 
+    // Pairs kept in memory are added from there:
+    if (writer->items) {
+        size_t ii;
+        for (ii = 0; ii < writer->count; ii++) {
+            mr_push_item(&writer->records[ii]->k, &writer->records[ii]->v, target_mr);
+            if (writer->throttle) {
+                error_pass(io_throttle_progress(writer->throttle));
+            }
+            if (target_mr->count == 0) {
+                arena_free_all(transient_arena);
+            }
+        }
+        *out_root = complete_new_btree(target_mr, &errcode);
+        goto cleanup;
+    }
+
     // Read all the key/value pairs from the file and add them to the tree:
+    rewind(writer->file);
     while (1) {
         if (fread(&klen, sizeof(klen), 1, writer->file) != 1) {
             break;
@@ -157,6 +469,9 @@ couchstore_error_t TreeWriterWrite(TreeWriter* writer,
         }
         //printf("K: '%.*s'\n", k.size, k.buf);
         mr_push_item(&k, &v, target_mr);
+        if (writer->throttle) {
+            error_pass(io_throttle_progress(writer->throttle));
+        }
         if (target_mr->count == 0) {
             /* No items queued, we must have just flushed. We can safely rewind the transient arena. */
             arena_free_all(transient_arena);
@@ -179,92 +494,91 @@ cleanup:
 }
 
 
-//////// MERGE-SORT CALLBACKS:
+//////// SORT CALLBACKS:
 
 
-typedef struct extsort_record {
-    sized_buf k;
-    sized_buf v;
-    char buf[1];
-} extsort_record;
-
-static int read_id_record(FILE *in, void *buf, void *ctx)
+// Reads a record into slab, or mallocs it if that's NULL.
+static int read_id_record_into(FILE *in, void **buf, arena *slab)
 {
-    (void) ctx;
     uint16_t klen;
     uint32_t vlen;
-    extsort_record *rec = (extsort_record *) buf;
+    extsort_record *rec;
     if (fread(&klen, 2, 1, in) != 1) {
         if (feof(in)) {
             return 0;
         } else {
-            return -1;
+            return FILE_MERGER_ERROR_FILE_READ;
         }
     }
     if (fread(&vlen, 4, 1, in) != 1) {
-        return -1;
+        return FILE_MERGER_ERROR_FILE_READ;
     }
     klen = ntohs(klen);
     vlen = ntohl(vlen);
+    if (slab) {
+        rec = static_cast<extsort_record*>(arena_alloc(slab, sizeof(extsort_record) + klen + vlen));
+    } else {
+        rec = static_cast<extsort_record*>(cs_malloc(sizeof(extsort_record) + klen + vlen));
+    }
+    if (rec == NULL) {
+        return FILE_MERGER_ERROR_ALLOC;
+    }
     rec->k.size = klen;
     rec->k.buf = rec->buf;
     rec->v.size = vlen;
     rec->v.buf = rec->buf + klen;
-    if (fread(rec->k.buf, klen, 1, in) != 1) {
-        return -1;
-    }
-    if (fread(rec->v.buf, vlen, 1, in) != 1) {
-        return -1;
+    if (fread(rec->buf, klen + vlen, 1, in) != 1 && klen + vlen > 0) {
+        if (!slab) {
+            cs_free(rec);
+        }
+        return FILE_MERGER_ERROR_FILE_READ;
     }
+    *buf = rec;
     return sizeof(extsort_record) + klen + vlen;
 }
 
-static int write_id_record(FILE *out, void *ptr, void *ctx)
+static int read_id_record(FILE *in, void **buf, void *ctx)
 {
     (void) ctx;
+    return read_id_record_into(in, buf, NULL);
+}
+
+static int read_id_record_slab(FILE *in, void **buf, arena *slab, void *ctx)
+{
+    (void) ctx;
+    return read_id_record_into(in, buf, slab);
+}
+
+static file_merger_error_t write_id_record(FILE *out, void *ptr, void *ctx)
+{
+    TreeWriter* writer = static_cast<TreeWriter*>(ctx);
     extsort_record *rec = (extsort_record *) ptr;
-    uint16_t klen = htons((uint16_t) rec->k.size);
-    uint32_t vlen = htonl((uint32_t) rec->v.size);
-    if (fwrite(&klen, 2, 1, out) != 1) {
-        return 0;
-    }
-    if (fwrite(&vlen, 4, 1, out) != 1) {
-        return 0;
+    if (!write_pair(out, &rec->k, &rec->v)) {
+        return FILE_MERGER_ERROR_FILE_WRITE;
     }
-    if (fwrite(rec->buf, rec->k.size + rec->v.size, 1, out) != 1) {
-        return 0;
+    if (writer->throttle &&
+        io_throttle_account(writer->throttle, 6 + rec->k.size + rec->v.size) < 0) {
+        return FILE_MERGER_ERROR_FILE_WRITE;
     }
-    return 1;
+    return FILE_MERGER_SUCCESS;
 }
 
 static int compare_id_record(const void *r1, const void *r2, void *ctx)
 {
     TreeWriter* writer = static_cast<TreeWriter*>(ctx);
-    extsort_record *e1 = (extsort_record *) r1, *e2 = (extsort_record *) r2;
-    e1->k.buf = e1->buf;
-    e2->k.buf = e2->buf;
+    const extsort_record *e1 = (const extsort_record *) r1, *e2 = (const extsort_record *) r2;
     return writer->key_compare(&e1->k, &e2->k);
 }
 
-static char *alloc_record(void)
-{
-    return static_cast<char*>(malloc(ID_SORT_MAX_RECORD_SIZE));
-}
-
-static char *duplicate_record(char *rec)
+static int id_record_sort_key(const void *r, sized_buf *key, void *ctx)
 {
-    extsort_record *record = (extsort_record *) rec;
-    size_t record_size = sizeof(extsort_record) + record->k.size + record->v.size;
-    extsort_record *new_record = (extsort_record *) malloc(record_size);
-
-    if (new_record != NULL) {
-        memcpy(new_record, record, record_size);
-    }
-
-    return (char *) new_record;
+    (void) ctx;
+    *key = ((const extsort_record *) r)->k;
+    return 1;
 }
 
-static void free_record(char *rec)
+static void free_id_record(void *rec, void *ctx)
 {
-    free(rec);
+    (void) ctx;
+    cs_free(rec);
 }
@@ -9,13 +9,17 @@ extern "C" {
 #endif
 
 typedef struct TreeWriter TreeWriter;
+struct io_throttle;
+
+/* Default memory budget of TreeWriterSort */
+#define TREE_WRITER_SORT_MEMORY (100 * 1024 * 1024)
 
 
 /**
  * Creates a new TreeWriter.
  * @param unsortedFilePath If non-NULL, the path to an existing file containing a series of unsorted
  * key/value pairs in TreeWriter format. If NULL, an empty TreeWriter will be created (using a
- * temporary file for the external sorting.)
+ * temporary file in the system's temporary directory for the external sorting.)
  * @param key_compare Callback function that compares two keys.
  * @param out_writer The new TreeWriter pointer will be stored here.
  * @return Error code or COUCHSTORE_SUCCESS.
@@ -32,24 +36,49 @@ couchstore_error_t TreeWriterOpen(const char* unsortedFilePath,
  */
 void TreeWriterFree(TreeWriter* writer);
 
+/**
+ * Counts the records written while sorting, and the growth of the tree file
+ * while writing, against a throttle (see io_throttle.h), which an error
+ * from the throttle aborts. NULL stops counting.
+ */
+void TreeWriterSetThrottle(TreeWriter* writer, struct io_throttle* throttle);
+
+/**
+ * Sets the memory the sort may take and the threads it sorts runs on.
+ * 0 memory is TREE_WRITER_SORT_MEMORY, and 0 threads is one.
+ */
+void TreeWriterSetSort(TreeWriter* writer, size_t memory_budget, unsigned threads);
+
+/**
+ * Declares the key/value pairs to be in key order already, so that
+ * TreeWriterSort leaves them as they are. Items added in order are noticed
+ * without it, but not the contents of a file the TreeWriter was opened on.
+ */
+void TreeWriterSetSorted(TreeWriter* writer);
+
 /**
  * Adds a key/value pair to a TreeWriter. These can be added in any order.
  */
 couchstore_error_t TreeWriterAddItem(TreeWriter* writer, sized_buf key, sized_buf value);
 
 /**
- * Sorts the key/value pairs already added.
- * The keys are sorted by ebin_cmp (basic lexicographic order by byte values).
+ * Sorts the key/value pairs already added, with the key_compare given to
+ * TreeWriterOpen. Runs as large as the memory budget are sorted in memory
+ * and merged in one pass, through temporary files next to the one being
+ * sorted (see sort_file). Pairs already in order aren't sorted at all.
  * If this TreeWriter was opened on an existing data file, the contents of the file will be sorted.
  */
 couchstore_error_t TreeWriterSort(TreeWriter* writer);
 
 /**
  * Writes the key/value pairs to a tree file, returning a pointer to the new root.
- * The items should first have been sorted.
+ * The items should first have been sorted. The thresholds are those of
+ * couchfile_modify_request.
  */
 couchstore_error_t TreeWriterWrite(TreeWriter* writer,
                                    tree_file* to_file,
+                                   int kv_chunk_threshold,
+                                   int kp_chunk_threshold,
                                    node_pointer** out_root);
 
 
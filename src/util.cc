@@ -10,22 +10,18 @@
 
 int ebin_cmp(const sized_buf *e1, const sized_buf *e2)
 {
-    size_t size;
-    if (e2->size < e1->size) {
-        size = e2->size;
-    } else {
-        size = e1->size;
-    }
+    return ebin_compare(e1, e2);
+}
 
-    int cmp = memcmp(e1->buf, e2->buf, size);
-    if (cmp == 0) {
-        if (size < e2->size) {
-            return -1;
-        } else if (size < e1->size) {
-            return 1;
-        }
+void couch_histogram_add(couchstore_histogram *histogram, uint64_t value)
+{
+    unsigned bucket = 0;
+    while (value >> bucket && bucket < COUCHSTORE_HISTOGRAM_BUCKETS - 1) {
+        ++bucket;
     }
-    return cmp;
+    ++histogram->count;
+    histogram->total += value;
+    ++histogram->buckets[bucket];
 }
 
 int seq_cmp(const sized_buf *k1, const sized_buf *k2)
@@ -40,7 +36,7 @@ int seq_cmp(const sized_buf *k1, const sized_buf *k2)
 
 fatbuf *fatbuf_alloc(size_t bytes)
 {
-    fatbuf *fb = (fatbuf *) malloc(sizeof(fatbuf) + bytes);
+    fatbuf *fb = (fatbuf *) cs_malloc(sizeof(fatbuf) + bytes);
 #ifdef DEBUG
     memset(fb->buf, 0x44, bytes);
 #endif
@@ -70,7 +66,15 @@ void *fatbuf_get(fatbuf *fb, size_t bytes)
 
 void fatbuf_free(fatbuf *fb)
 {
-    free(fb);
+    cs_free(fb);
+}
+
+void fatbuf_reset(fatbuf *fb)
+{
+#ifdef DEBUG
+    memset(fb->buf, 0x44, fb->size);
+#endif
+    fb->pos = 0;
 }
 
 #ifdef DEBUG
@@ -0,0 +1,296 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Value log of a Db; see value_log.h.
+//
+// Compaction copies every body it keeps into the new file, and with
+// bodies of hundreds of KB that's most of what it writes. Bodies from a
+// size up go to a log of their own instead, which a compaction leaves as
+// it is, only pointing the new file's trees at the same places. It's
+// rewritten, by copying what's still used into the next log, only once a
+// set share of it is unused.
+
+#include "config.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "bitfield.h"
+#include "value_log.h"
+#include "util.h"
+
+struct value_log {
+    tree_file file;
+    uint64_t settings_pos;      // the settings chunk this was loaded from
+    uint32_t min_body_size;     // 0 once it takes no more bodies
+    uint8_t max_garbage_percent;
+    uint32_t generation;
+    char *base;
+};
+
+// The file of a log of the given number.
+static char *log_path(const char *base, uint32_t generation)
+{
+    size_t size = strlen(base) + 12;
+    char *path = static_cast<char *>(cs_malloc(size));
+    if (path) {
+        snprintf(path, size, "%s.%u", base, (unsigned)generation);
+    }
+    return path;
+}
+
+static void free_log(value_log *log)
+{
+    if (log) {
+        if (log->file.ops) {
+            tree_file_close(&log->file);
+        }
+        cs_free(log->base);
+        cs_free(log);
+    }
+}
+
+// Opens a log, creating its file if asked, for appending at its end.
+static couchstore_error_t open_log(Db *db, const char *base, uint32_t generation,
+                                   int create, value_log **pLog)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *path = NULL;
+    cs_off_t eof;
+    value_log *log = static_cast<value_log *>(cs_calloc(1, sizeof(value_log)));
+    int flags = db->readonly ? O_RDONLY : O_RDWR;
+    if (create) {
+        flags |= O_CREAT;
+    }
+
+    error_unless(log, COUCHSTORE_ERROR_ALLOC_FAIL);
+    log->base = cs_strdup(base);
+    path = log_path(base, generation);
+    error_unless(log->base && path, COUCHSTORE_ERROR_ALLOC_FAIL);
+    log->generation = generation;
+    error_pass(tree_file_open(&log->file, path, flags, couchstore_get_default_file_ops()));
+    tree_file_set_io_stats(&log->file, &db->io_stats);
+    // Chunks are laid out and checked as in the database file.
+    log->file.chunk_codecs = db->file.chunk_codecs;
+    log->file.crc32c = db->file.crc32c;
+    eof = log->file.ops->goto_eof(&log->file.lastError, log->file.handle);
+    error_unless(eof >= 0, COUCHSTORE_ERROR_READ);
+    log->file.pos = eof;
+    *pLog = log;
+    log = NULL;
+cleanup:
+    cs_free(path);
+    free_log(log);
+    return errcode;
+}
+
+// Writes where a log is and how it's used to db's file, for its header.
+static couchstore_error_t write_settings(Db *db, const value_log *log)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    size_t baselen = strlen(log->base);
+    sized_buf buf;
+    raw_value_log_settings *raw;
+    cs_off_t pos;
+
+    buf.size = sizeof(raw_value_log_settings) + baselen;
+    buf.buf = static_cast<char *>(cs_malloc(buf.size));
+    error_unless(buf.buf, COUCHSTORE_ERROR_ALLOC_FAIL);
+    raw = (raw_value_log_settings*)buf.buf;
+    raw->min_body_size = encode_raw32(log->min_body_size);
+    raw->max_garbage_percent = encode_raw08(log->max_garbage_percent);
+    raw->generation = encode_raw32(log->generation);
+    memcpy(raw + 1, log->base, baselen);
+    error_pass(static_cast<couchstore_error_t>(db_write_buf(&db->file, &buf, &pos, NULL)));
+    db->header.vlog_ptr = pos;
+cleanup:
+    cs_free(buf.buf);
+    return errcode;
+}
+
+couchstore_error_t db_value_log_load(Db *db)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char *buf = NULL, *base = NULL;
+    value_log *log = NULL;
+    const raw_value_log_settings *raw;
+    size_t baselen;
+    int size;
+
+    if (db->vlog || db->header.vlog_ptr == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    size = pread_bin(&db->file, db->header.vlog_ptr, &buf);
+    error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+    error_unless(size > (int)sizeof(raw_value_log_settings), COUCHSTORE_ERROR_CORRUPT);
+    raw = (const raw_value_log_settings*)buf;
+    baselen = size - sizeof(*raw);
+    base = static_cast<char *>(cs_malloc(baselen + 1));
+    error_unless(base, COUCHSTORE_ERROR_ALLOC_FAIL);
+    memcpy(base, raw + 1, baselen);
+    base[baselen] = '\0';
+
+    error_pass(open_log(db, base, decode_raw32(raw->generation), 0, &log));
+    log->settings_pos = db->header.vlog_ptr;
+    log->min_body_size = decode_raw32(raw->min_body_size);
+    log->max_garbage_percent = decode_raw08(raw->max_garbage_percent);
+    db->vlog = log;
+cleanup:
+    cs_free(buf);
+    cs_free(base);
+    return errcode;
+}
+
+couchstore_error_t db_value_log_set(Db *db, const char *path,
+                                    const couchstore_value_log_options *options)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    value_log *started = NULL;
+
+    error_pass(db_value_log_load(db));
+    if (db->vlog == NULL) {
+        error_unless(path, COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+        error_pass(open_log(db, path, 1, 1, &started));
+        db->vlog = started;
+    } else {
+        // The bodies already in it are only found by its name.
+        error_unless(path == NULL || strcmp(path, db->vlog->base) == 0,
+                     COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    }
+    db->vlog->min_body_size = options->min_body_size;
+    db->vlog->max_garbage_percent = options->max_garbage_percent;
+    error_pass(write_settings(db, db->vlog));
+    db->vlog->settings_pos = db->header.vlog_ptr;
+cleanup:
+    if (errcode != COUCHSTORE_SUCCESS && started) {
+        db->vlog = NULL;
+        free_log(started);
+    }
+    return errcode;
+}
+
+int db_value_log_takes(const Db *db, size_t size)
+{
+    return db->vlog && !db->readonly && db->vlog->min_body_size &&
+           size >= db->vlog->min_body_size;
+}
+
+couchstore_error_t db_value_log_write(Db *db, const sized_buf *body, int compress,
+                                      uint64_t *bp, size_t *disk_size)
+{
+    couchstore_error_t errcode;
+    cs_off_t pos;
+    size_t size;
+
+    if (compress) {
+        errcode = db_write_buf_compressed(&db->vlog->file, body, db->file.doc_codec,
+                                          &pos, &size);
+    } else {
+        errcode = static_cast<couchstore_error_t>(db_write_buf(&db->vlog->file, body,
+                                                               &pos, &size));
+    }
+    if (errcode == COUCHSTORE_SUCCESS) {
+        *bp = (uint64_t)pos | BP_VALUE_LOG_FLAG;
+        *disk_size = size;
+        db->header.vlog_live += size;
+    }
+    return errcode < 0 ? errcode : COUCHSTORE_SUCCESS;
+}
+
+couchstore_error_t db_value_log_file(Db *db, tree_file **file)
+{
+    couchstore_error_t errcode = db_value_log_load(db);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        if (db->vlog == NULL) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        *file = &db->vlog->file;
+    }
+    return errcode;
+}
+
+couchstore_error_t db_value_log_sync(Db *db)
+{
+    if (db->vlog == NULL || db->readonly) {
+        return COUCHSTORE_SUCCESS;
+    }
+    return db->vlog->file.ops->sync(&db->vlog->file.lastError, db->vlog->file.handle);
+}
+
+void db_value_log_moved(Db *db)
+{
+    if (db->vlog && db->vlog->settings_pos != db->header.vlog_ptr) {
+        db_value_log_close(db);
+    }
+}
+
+void db_value_log_close(Db *db)
+{
+    free_log(db->vlog);
+    db->vlog = NULL;
+}
+
+couchstore_error_t db_value_log_start_target(Db *source, Db *target)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    value_log *log = NULL;
+
+    error_pass(db_value_log_load(source));
+    error_unless(target->header.disk_version >= COUCH_DISK_VERSION_VALUE_LOG,
+                 COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    {
+        value_log *from = source->vlog;
+        cs_off_t size = from->file.ops->goto_eof(&from->file.lastError, from->file.handle);
+        uint64_t live = source->header.vlog_live;
+        uint32_t generation = from->generation;
+        if (from->max_garbage_percent && size > 0 && (uint64_t)size > live &&
+            ((uint64_t)size - live) * 100 >= (uint64_t)size * from->max_garbage_percent) {
+            ++generation;
+        }
+        error_pass(open_log(target, from->base, generation, 1, &log));
+        log->min_body_size = from->min_body_size;
+        log->max_garbage_percent = from->max_garbage_percent;
+    }
+    error_pass(write_settings(target, log));
+    log->settings_pos = target->header.vlog_ptr;
+    db_value_log_close(target);
+    target->vlog = log;
+    log = NULL;
+    // Counted again as the bodies are copied.
+    target->header.vlog_live = 0;
+cleanup:
+    free_log(log);
+    return errcode;
+}
+
+couchstore_error_t db_value_log_copy(Db *source, Db *target, raw_seq_index_value *raw)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t bp = decode_raw48(raw->bp);
+    uint32_t idsize, datasize;
+    sized_buf item = { NULL, 0 };
+
+    error_pass(db_value_log_load(source));
+    error_pass(db_value_log_load(target));
+    error_unless(source->vlog && target->vlog, COUCHSTORE_ERROR_CORRUPT);
+    decode_kv_length(&raw->sizes, &idsize, &datasize);
+    if (source->vlog->generation != target->vlog->generation ||
+        strcmp(source->vlog->base, target->vlog->base) != 0) {
+        // Copied with the codec it was written with, as the compactor does.
+        unsigned codec;
+        cs_off_t new_bp;
+        int size = pread_chunk(&source->vlog->file,
+                               bp & ~(BP_DELETED_FLAG | BP_VALUE_LOG_FLAG),
+                               &item.buf, &codec);
+        error_unless(size >= 0, static_cast<couchstore_error_t>(size));
+        item.size = size;
+        int written = db_write_chunk(&target->vlog->file, &item, codec, &new_bp, NULL);
+        error_unless(written >= 0, static_cast<couchstore_error_t>(written));
+        raw->bp = encode_raw48((bp & BP_DELETED_FLAG) | BP_VALUE_LOG_FLAG | new_bp);
+    }
+    target->header.vlog_live += datasize;
+cleanup:
+    cs_free(item.buf);
+    return errcode;
+}
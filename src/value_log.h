@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LIBCOUCHSTORE_VALUE_LOG_H
+#define LIBCOUCHSTORE_VALUE_LOG_H 1
+
+#include <libcouchstore/couch_db.h>
+#include "internal.h"
+#include "node_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* A Db's value log: a file of its own that the bodies of large
+       documents are appended to instead of the database file, so that
+       compacting the database can leave them where they are. A body there
+       has BP_VALUE_LOG_FLAG set in its bp. The header points to a chunk of
+       raw_value_log_settings followed by the log's base path, and counts
+       the bytes of the bodies in the log that the trees still point to.
+       Logs are numbered: a compaction that finds too much of one unused
+       copies what's left into the next, named after the base path with
+       the number added, as in "base.2". */
+    typedef struct value_log value_log;
+
+    /** Starts a log for db, or changes its settings. */
+    couchstore_error_t db_value_log_set(Db *db, const char *path,
+                                        const couchstore_value_log_options *options);
+
+    /** Opens db's log, if its header has one and it isn't open yet. */
+    couchstore_error_t db_value_log_load(Db *db);
+
+    /** Whether a body of this size goes to the loaded log. */
+    int db_value_log_takes(const Db *db, size_t size);
+
+    /** Appends a body to the log, as write_doc does to the file. */
+    couchstore_error_t db_value_log_write(Db *db, const sized_buf *body, int compress,
+                                          uint64_t *bp, size_t *disk_size);
+
+    /** The file a body with BP_VALUE_LOG_FLAG is read from. */
+    couchstore_error_t db_value_log_file(Db *db, tree_file **file);
+
+    /** Makes what's been appended to the log durable, ahead of a header
+        that points to it. */
+    couchstore_error_t db_value_log_sync(Db *db);
+
+    /** Follows the header to another position: closes the log if it isn't
+        the one the new header has. */
+    void db_value_log_moved(Db *db);
+
+    void db_value_log_close(Db *db);
+
+    /** Sets up the target of compacting source, which has a log: to share
+        it, or to start the next one if too much of it is unused. */
+    couchstore_error_t db_value_log_start_target(Db *source, Db *target);
+
+    /** Copies a body in source's log to target's, unless they share the
+        log, and counts it in target's. */
+    couchstore_error_t db_value_log_copy(Db *source, Db *target,
+                                         raw_seq_index_value *raw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,748 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/*
+ * couch_view_bench: benchmarks of the view indexing path, reported as JSON
+ * on stdout like couchstore_bench's. It makes up map output, and times
+ * sorting it (sort_view_kvs_file), merging sorted batches of btree
+ * operations (merge_view_kvs_ops_files), building a view group from it
+ * (couchstore_build_view_group) and updating that group with a batch of
+ * changed documents (couchstore_update_view_group), the last two with each
+ * of the reducers.
+ *
+ * Every document, numbered from 0, is in partition number % partitions and
+ * emits one key of the key shape asked for. The keys come from a seeded
+ * generator, so two runs with the same options do the same work. Values
+ * are integers with the _sum and _stats reducers, which need numbers, and
+ * strings of --value-size bytes otherwise.
+ */
+
+#include "config.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../internal.h"
+#include "../../couch_btree.h"
+#include "../file_sorter.h"
+#include "../file_merger.h"
+#include "../index_header.h"
+#include "../keys.h"
+#include "../sorted_list.h"
+#include "../values.h"
+#include "../view_group.h"
+
+#ifdef WIN32
+#define snprintf _snprintf
+#endif
+
+#define ID_FORMAT "doc-%010u"
+#define ID_SIZE 14
+
+/* Sorted files of btree operations the merge benchmark merges */
+#define MERGE_FILES 4
+
+typedef enum {
+    KEY_INTS,
+    KEY_ASCII,
+    KEY_UNICODE,
+    KEY_ARRAY,
+    KEY_SHAPES
+} key_shape_t;
+
+static const char *key_shape_names[KEY_SHAPES] = {
+    "ints", "ascii", "unicode", "array"
+};
+
+typedef struct {
+    const char *name;
+    /* NULL for a view without a reducer */
+    const char *reducer;
+    /* whether its values must be numbers */
+    int numeric;
+} bench_reducer;
+
+static const bench_reducer reducers[] = {
+    { "none", NULL, 0 },
+    { "_count", "_count", 0 },
+    { "_sum", "_sum", 1 },
+    { "_stats", "_stats", 1 },
+    { "js", "function(key, values, rereduce) {"
+            " return rereduce ? sum(values) : values.length; }", 0 }
+};
+
+typedef struct {
+    const char *dir;
+    unsigned records;
+    unsigned value_size;
+    unsigned partitions;
+    unsigned updates;
+    unsigned batch_size;
+    int key_shape;              /* or -1 for all of them */
+    uint64_t seed;
+} bench_options;
+
+static int first_result = 1;
+
+
+static void exit_error(const char *what, int errcode)
+{
+    fprintf(stderr, "%s: error %d\n", what, errcode);
+    exit(1);
+}
+
+static void exit_view_error(const char *what, couchstore_error_t errcode,
+                            const view_error_t *error_info)
+{
+    if (error_info->error_msg != NULL) {
+        fprintf(stderr, "%s: %s (view %s)\n", what, error_info->error_msg,
+                error_info->view_name ? error_info->view_name : "?");
+    } else {
+        fprintf(stderr, "%s: %s\n", what, couchstore_strerror(errcode));
+    }
+    exit(1);
+}
+
+static void exit_alloc(void)
+{
+    fprintf(stderr, "Memory allocation failure\n");
+    exit(1);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--dir <path>] [--records <n>]"
+            " [--value-size <bytes>] [--partitions <n>] [--updates <n>]"
+            " [--batch-size <n>] [--key-shape ints|ascii|unicode|array|all]"
+            " [--seed <n>]\n", prog);
+    exit(1);
+}
+
+
+/* The key number of document doc after it's been changed generation
+   times: splitmix64 of them all, so that any of them can be worked out
+   again without keeping it */
+static uint64_t key_number(const bench_options *opts, unsigned doc,
+                           unsigned generation)
+{
+    uint64_t z = opts->seed + ((uint64_t) doc << 8) + generation;
+    z = (z + UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+/* Writes the JSON key of the given shape for a key number to buf,
+   returning its length */
+static size_t make_json_key(char *buf, size_t size, key_shape_t shape,
+                            uint64_t number)
+{
+    unsigned n = (unsigned) (number % 1000000000);
+    int len = 0;
+
+    switch (shape) {
+    case KEY_INTS:
+        len = snprintf(buf, size, "%u", n);
+        break;
+    case KEY_ASCII:
+        len = snprintf(buf, size, "\"key-%09u\"", n);
+        break;
+    case KEY_UNICODE:
+        /* "été-", then "ключ-" for every other key, so that collation
+           has to look past the first characters */
+        len = snprintf(buf, size, (n & 1) ?
+                       "\"\xc3\xa9t\xc3\xa9-%09u\"" :
+                       "\"\xd0\xba\xd0\xbb\xd1\x8e\xd1\x87-%09u\"", n);
+        break;
+    case KEY_ARRAY:
+        len = snprintf(buf, size, "[%u,\"key-%06u\",%s]", n % 1000,
+                       n / 1000, (n & 1) ? "true" : "null");
+        break;
+    default:
+        break;
+    }
+    return (size_t) len;
+}
+
+/* Writes the document's JSON value to buf, returning its length */
+static size_t make_json_value(char *buf, size_t size, int numeric,
+                              unsigned value_size, uint64_t number)
+{
+    size_t len;
+
+    if (numeric) {
+        return (size_t) snprintf(buf, size, "%u", (unsigned) (number % 1000));
+    }
+    len = value_size < 2 ? 2 : value_size;
+    if (len > size) {
+        len = size;
+    }
+    memset(buf + 1, 'a' + (char) (number % 26), len - 2);
+    buf[0] = '"';
+    buf[len - 1] = '"';
+    return len;
+}
+
+
+/* Appends a record in the format of the records files, with an operation
+   if op isn't negative */
+static void write_record(FILE *f, int op, const char *key, size_t klen,
+                         const char *val, size_t vlen)
+{
+    uint32_t len = (uint32_t) ((op >= 0 ? 1 : 0) + 2 + klen + vlen);
+    uint16_t klen16 = htons((uint16_t) klen);
+    uint8_t op8 = (uint8_t) op;
+
+    if (fwrite(&len, sizeof(len), 1, f) != 1 ||
+        (op >= 0 && fwrite(&op8, 1, 1, f) != 1) ||
+        fwrite(&klen16, sizeof(klen16), 1, f) != 1 ||
+        fwrite(key, klen, 1, f) != 1 ||
+        (vlen > 0 && fwrite(val, vlen, 1, f) != 1)) {
+        fprintf(stderr, "Error writing records file\n");
+        exit(1);
+    }
+}
+
+/* Appends the view btree record of a document's key */
+static void write_kv_record(FILE *f, int op, const bench_options *opts,
+                            key_shape_t shape, int numeric, unsigned doc,
+                            unsigned generation)
+{
+    char id[ID_SIZE + 1];
+    char json_key[64];
+    char *json_value;
+    char *key_buf, *val_buf = NULL;
+    size_t key_size, val_size = 0;
+    uint64_t number = key_number(opts, doc, generation);
+    view_btree_key_t key;
+    view_btree_value_t value;
+    sized_buf json;
+    couchstore_error_t errcode;
+
+    json_value = (char *) malloc(opts->value_size + 32);
+    if (json_value == NULL) {
+        exit_alloc();
+    }
+    snprintf(id, sizeof(id), ID_FORMAT, doc);
+    key.json_key.buf = json_key;
+    key.json_key.size = make_json_key(json_key, sizeof(json_key), shape,
+                                      number);
+    key.doc_id.buf = id;
+    key.doc_id.size = ID_SIZE;
+    errcode = encode_view_btree_key(&key, &key_buf, &key_size);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Encoding view key", errcode);
+    }
+
+    if (op != ACTION_REMOVE) {
+        json.buf = json_value;
+        json.size = make_json_value(json_value, opts->value_size + 32,
+                                    numeric, opts->value_size, number);
+        value.partition = (uint16_t) (doc % opts->partitions);
+        value.num_values = 1;
+        value.values = &json;
+        errcode = encode_view_btree_value(&value, &val_buf, &val_size);
+        if (errcode != COUCHSTORE_SUCCESS) {
+            exit_error("Encoding view value", errcode);
+        }
+    }
+
+    write_record(f, op, key_buf, key_size, val_buf, val_size);
+    free(key_buf);
+    free(val_buf);
+    free(json_value);
+}
+
+/* Appends the id btree record of a document, mapping it to its key */
+static void write_id_record(FILE *f, int op, const bench_options *opts,
+                            key_shape_t shape, unsigned doc,
+                            unsigned generation)
+{
+    char id[ID_SIZE + 1];
+    char json_key[64];
+    char *key_buf, *val_buf;
+    size_t key_size, val_size;
+    view_id_btree_key_t key;
+    view_id_btree_value_t value;
+    view_keys_mapping_t map;
+    sized_buf json;
+    couchstore_error_t errcode;
+
+    snprintf(id, sizeof(id), ID_FORMAT, doc);
+    key.partition = (uint16_t) (doc % opts->partitions);
+    key.doc_id.buf = id;
+    key.doc_id.size = ID_SIZE;
+    errcode = encode_view_id_btree_key(&key, &key_buf, &key_size);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Encoding id key", errcode);
+    }
+
+    json.buf = json_key;
+    json.size = make_json_key(json_key, sizeof(json_key), shape,
+                              key_number(opts, doc, generation));
+    map.view_id = 0;
+    map.num_keys = 1;
+    map.json_keys = &json;
+    value.partition = key.partition;
+    value.num_view_keys_map = 1;
+    value.view_keys_map = &map;
+    errcode = encode_view_id_btree_value(&value, &val_buf, &val_size);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Encoding id value", errcode);
+    }
+
+    write_record(f, op, key_buf, key_size, val_buf, val_size);
+    free(key_buf);
+    free(val_buf);
+}
+
+
+static FILE *create_file(char *path, size_t size, const bench_options *opts,
+                         const char *name)
+{
+    FILE *f;
+
+    snprintf(path, size, "%s/couch_view_bench_%s", opts->dir, name);
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Error creating %s\n", path);
+        exit(1);
+    }
+    return f;
+}
+
+static uint64_t path_size(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    long size;
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+    size = ftell(f);
+    fclose(f);
+    return (uint64_t) size;
+}
+
+
+static void report_start(const char *name, key_shape_t shape,
+                         const char *reducer, uint64_t records,
+                         hrtime_t elapsed)
+{
+    double seconds = elapsed / 1e9;
+
+    printf("%s    {\"name\": \"%s\", \"key_shape\": \"%s\","
+           " \"reducer\": \"%s\", \"records\": %" PRIu64 ","
+           " \"seconds\": %.6f, \"records_per_sec\": %.1f",
+           first_result ? "" : ",\n", name, key_shape_names[shape],
+           reducer, records, seconds, seconds > 0 ? records / seconds : 0.0);
+}
+
+static void report_btree_stats(const char *name, const view_btree_stats_t *s)
+{
+    printf(", \"%s\": {\"sort_ms\": %.3f, \"modify_ms\": %.3f,"
+           " \"reduce_ms\": %.3f, \"js_reduce_ms\": %.3f,"
+           " \"reduce_calls\": %" PRIu64 ", \"nodes_written\": %" PRIu64 ","
+           " \"node_bytes\": %" PRIu64 "}", name,
+           s->sort_ns / 1e6, s->modify_ns / 1e6, s->reduce_ns / 1e6,
+           s->js_reduce_ns / 1e6, s->reduce_calls, s->nodes_written,
+           s->node_bytes);
+}
+
+static void report_end(void)
+{
+    printf("}");
+    fflush(stdout);
+    first_result = 0;
+}
+
+
+static void bench_sort(const bench_options *opts, key_shape_t shape)
+{
+    char path[1024];
+    FILE *f = create_file(path, sizeof(path), opts, "sort");
+    hrtime_t start, elapsed;
+    file_sorter_error_t ret;
+    unsigned i;
+
+    for (i = 0; i < opts->records; ++i) {
+        write_kv_record(f, -1, opts, shape, 0, i, 0);
+    }
+    fclose(f);
+
+    start = gethrtime();
+    ret = sort_view_kvs_file(path, opts->dir, NULL, NULL);
+    elapsed = gethrtime() - start;
+    if (ret != FILE_SORTER_SUCCESS) {
+        exit_error("Sorting view records", ret);
+    }
+
+    report_start("sort", shape, "none", opts->records, elapsed);
+    printf(", \"file_bytes\": %" PRIu64, path_size(path));
+    report_end();
+    remove(path);
+}
+
+
+/* Merges MERGE_FILES sorted files of insertions, each of a stretch of
+   the documents */
+static void bench_merge(const bench_options *opts, key_shape_t shape)
+{
+    char paths[MERGE_FILES][1024];
+    const char *sources[MERGE_FILES];
+    char dest[1024];
+    hrtime_t start, elapsed;
+    file_merger_error_t ret;
+    unsigned i, j;
+
+    for (i = 0; i < MERGE_FILES; ++i) {
+        char name[32];
+        FILE *f;
+
+        snprintf(name, sizeof(name), "merge_%u", i);
+        f = create_file(paths[i], sizeof(paths[i]), opts, name);
+        for (j = i; j < opts->records; j += MERGE_FILES) {
+            write_kv_record(f, ACTION_INSERT, opts, shape, 0, j, 0);
+        }
+        fclose(f);
+        if (sort_view_kvs_ops_file(paths[i], opts->dir) !=
+            FILE_SORTER_SUCCESS) {
+            exit_error("Sorting view operations", 0);
+        }
+        sources[i] = paths[i];
+    }
+    fclose(create_file(dest, sizeof(dest), opts, "merged"));
+
+    start = gethrtime();
+    ret = merge_view_kvs_ops_files(sources, MERGE_FILES, dest);
+    elapsed = gethrtime() - start;
+    if (ret != FILE_MERGER_SUCCESS) {
+        exit_error("Merging view operations", ret);
+    }
+
+    report_start("merge", shape, "none", opts->records, elapsed);
+    printf(", \"files\": %d", MERGE_FILES);
+    report_end();
+    for (i = 0; i < MERGE_FILES; ++i) {
+        remove(paths[i]);
+    }
+    remove(dest);
+}
+
+
+static int part_seq_cmp(const void *a, const void *b)
+{
+    return ((part_seq_t *) a)->part_id - ((part_seq_t *) b)->part_id;
+}
+
+static int part_id_cmp(const void *a, const void *b)
+{
+    return *((uint16_t *) a) - *((uint16_t *) b);
+}
+
+static int part_versions_cmp(const void *a, const void *b)
+{
+    return ((part_version_t *) a)->part_id - ((part_version_t *) b)->part_id;
+}
+
+/* Creates the index file of a group of one view, with nothing indexed
+   yet and every partition active, as the build starts from */
+static uint64_t create_index_file(const bench_options *opts, const char *path)
+{
+    index_header_t *header;
+    node_pointer *view_state = NULL;
+    tree_file file;
+    uint64_t pos;
+    unsigned i;
+    couchstore_error_t errcode;
+
+    header = (index_header_t *) calloc(1, sizeof(*header));
+    if (header == NULL) {
+        exit_alloc();
+    }
+    header->version = LATEST_INDEX_HEADER_VERSION;
+    header->num_views = 1;
+    header->num_partitions = (uint16_t) opts->partitions;
+    for (i = 0; i < opts->partitions; ++i) {
+        set_bit(&header->active_bitmask, (uint16_t) i);
+    }
+    header->seqs = sorted_list_create(part_seq_cmp);
+    header->replicas_on_transfer = sorted_list_create(part_id_cmp);
+    header->pending_transition.active = sorted_list_create(part_id_cmp);
+    header->pending_transition.passive = sorted_list_create(part_id_cmp);
+    header->pending_transition.unindexable = sorted_list_create(part_id_cmp);
+    header->unindexable_seqs = sorted_list_create(part_seq_cmp);
+    header->part_versions = sorted_list_create(part_versions_cmp);
+    header->view_btree_states = (node_pointer **) malloc(sizeof(view_state));
+    if (header->seqs == NULL || header->replicas_on_transfer == NULL ||
+        header->pending_transition.active == NULL ||
+        header->pending_transition.passive == NULL ||
+        header->pending_transition.unindexable == NULL ||
+        header->unindexable_seqs == NULL || header->part_versions == NULL ||
+        header->view_btree_states == NULL) {
+        exit_alloc();
+    }
+    header->view_btree_states[0] = view_state;
+
+    remove(path);
+    errcode = tree_file_open(&file, path, O_RDWR | O_CREAT,
+                             couchstore_get_default_file_ops());
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Creating index file", errcode);
+    }
+    errcode = write_view_group_header(&file, &pos, header);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Writing index header", errcode);
+    }
+    tree_file_close(&file);
+    free_index_header(header);
+    return pos;
+}
+
+/* The definition of a group of one view with the given reducer, its index
+   in path at header_pos, read as couch_view_index_builder reads it */
+static view_group_info_t *group_info(const char *path, uint64_t header_pos,
+                                     const bench_reducer *reducer)
+{
+    view_group_info_t *info;
+    FILE *def = tmpfile();
+
+    if (def == NULL) {
+        fprintf(stderr, "Error creating view group definition\n");
+        exit(1);
+    }
+    fprintf(def, "%s\n%" PRIu64 "\n1\n", path, header_pos);
+    if (reducer->reducer == NULL) {
+        fprintf(def, "0\n");
+    } else {
+        fprintf(def, "1\nview\n%u\n%s", (unsigned) strlen(reducer->reducer),
+                reducer->reducer);
+    }
+    rewind(def);
+    info = couchstore_read_view_group_info(def, stderr);
+    fclose(def);
+    if (info == NULL) {
+        exit(1);
+    }
+    return info;
+}
+
+/* Reads the header of an index file, encoded for an update */
+static void read_header(view_group_info_t *info, sized_buf *header_buf)
+{
+    index_header_t *header;
+    couchstore_error_t errcode;
+
+    errcode = tree_file_open(&info->file, info->filepath, O_RDONLY,
+                             couchstore_get_default_file_ops());
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = read_view_group_header(info, &header);
+    }
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Reading index header", errcode);
+    }
+    tree_file_close(&info->file);
+    memset(&info->file, 0, sizeof(info->file));
+
+    errcode = encode_index_header(header, &header_buf->buf, &header_buf->size);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_error("Encoding index header", errcode);
+    }
+    free_index_header(header);
+}
+
+
+/* Builds the group from every document's key, then changes the key of
+   opts->updates documents spread over them, as an update would */
+static void bench_build_update(const bench_options *opts, key_shape_t shape,
+                               const bench_reducer *reducer)
+{
+    char source_path[1024], index_path[1024];
+    char id_path[1024], kv_path[1024];
+    const char *kv_paths[1];
+    view_btree_stats_t build_stats[2];
+    view_btree_stats_t update_btree_stats[2];
+    view_group_update_stats_t update_stats;
+    view_error_t error_info = { NULL, NULL };
+    view_group_info_t *info;
+    sized_buf header_buf = { NULL, 0 };
+    sized_buf header_outbuf = { NULL, 0 };
+    uint64_t header_pos;
+    unsigned updates = opts->updates < opts->records ?
+                       opts->updates : opts->records;
+    unsigned stride = updates ? opts->records / updates : 1;
+    hrtime_t start, elapsed;
+    FILE *id_f, *kv_f;
+    couchstore_error_t errcode;
+    unsigned i;
+
+    id_f = create_file(id_path, sizeof(id_path), opts, "build_ids");
+    kv_f = create_file(kv_path, sizeof(kv_path), opts, "build_kvs");
+    for (i = 0; i < opts->records; ++i) {
+        write_id_record(id_f, -1, opts, shape, i, 0);
+        write_kv_record(kv_f, -1, opts, shape, reducer->numeric, i, 0);
+    }
+    fclose(id_f);
+    fclose(kv_f);
+    kv_paths[0] = kv_path;
+
+    snprintf(source_path, sizeof(source_path), "%s/couch_view_bench_empty.view",
+             opts->dir);
+    snprintf(index_path, sizeof(index_path), "%s/couch_view_bench.view",
+             opts->dir);
+    remove(index_path);
+    info = group_info(source_path, create_index_file(opts, source_path),
+                      reducer);
+
+    memset(build_stats, 0, sizeof(build_stats));
+    start = gethrtime();
+    errcode = couchstore_build_view_group_with_stats(info, id_path, kv_paths,
+                                                     index_path, opts->dir,
+                                                     &header_pos, build_stats,
+                                                     &error_info);
+    elapsed = gethrtime() - start;
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_view_error("Building view group", errcode, &error_info);
+    }
+    couchstore_free_view_group_info(info);
+    remove(source_path);
+    remove(id_path);
+    remove(kv_path);
+
+    report_start("build", shape, reducer->name, opts->records, elapsed);
+    printf(", \"index_bytes\": %" PRIu64, path_size(index_path));
+    report_btree_stats("id_btree", &build_stats[0]);
+    report_btree_stats("view_btree", &build_stats[1]);
+    report_end();
+
+    if (updates == 0) {
+        remove(index_path);
+        return;
+    }
+
+    id_f = create_file(id_path, sizeof(id_path), opts, "update_ids");
+    kv_f = create_file(kv_path, sizeof(kv_path), opts, "update_kvs");
+    for (i = 0; i < updates; ++i) {
+        unsigned doc = i * stride;
+        write_id_record(id_f, ACTION_INSERT, opts, shape, doc, 1);
+        write_kv_record(kv_f, ACTION_REMOVE, opts, shape, reducer->numeric,
+                        doc, 0);
+        write_kv_record(kv_f, ACTION_INSERT, opts, shape, reducer->numeric,
+                        doc, 1);
+    }
+    fclose(id_f);
+    fclose(kv_f);
+
+    info = group_info(index_path, header_pos, reducer);
+    read_header(info, &header_buf);
+
+    memset(&update_stats, 0, sizeof(update_stats));
+    memset(update_btree_stats, 0, sizeof(update_btree_stats));
+    update_stats.btree_stats = update_btree_stats;
+    start = gethrtime();
+    errcode = couchstore_update_view_group(info, id_path, kv_paths,
+                                           opts->batch_size, &header_buf, 0,
+                                           opts->dir, &update_stats,
+                                           &header_outbuf, &error_info);
+    elapsed = gethrtime() - start;
+    if (errcode != COUCHSTORE_SUCCESS) {
+        exit_view_error("Updating view group", errcode, &error_info);
+    }
+
+    report_start("update", shape, reducer->name, updates, elapsed);
+    printf(", \"kvs_inserted\": %" PRIu64 ", \"kvs_removed\": %" PRIu64
+           ", \"index_bytes\": %" PRIu64, update_stats.kvs_inserted,
+           update_stats.kvs_removed, path_size(index_path));
+    report_btree_stats("id_btree", &update_btree_stats[0]);
+    report_btree_stats("view_btree", &update_btree_stats[1]);
+    report_end();
+
+    couchstore_free_view_group_info(info);
+    free(header_buf.buf);
+    free(header_outbuf.buf);
+    remove(id_path);
+    remove(kv_path);
+    remove(index_path);
+}
+
+
+int main(int argc, char **argv)
+{
+    bench_options opts;
+    int shape;
+    unsigned i;
+    int argp;
+
+    opts.dir = ".";
+    opts.records = 100000;
+    opts.value_size = 32;
+    opts.partitions = 64;
+    opts.updates = 10000;
+    opts.batch_size = 4096;
+    opts.key_shape = -1;
+    opts.seed = 42;
+
+    for (argp = 1; argp < argc; argp += 2) {
+        const char *arg = argv[argp];
+        const char *val;
+        if (argp + 1 >= argc) {
+            usage(argv[0]);
+        }
+        val = argv[argp + 1];
+        if (!strcmp(arg, "--dir")) {
+            opts.dir = val;
+        } else if (!strcmp(arg, "--records")) {
+            opts.records = (unsigned) strtoul(val, NULL, 10);
+        } else if (!strcmp(arg, "--value-size")) {
+            opts.value_size = (unsigned) strtoul(val, NULL, 10);
+        } else if (!strcmp(arg, "--partitions")) {
+            opts.partitions = (unsigned) strtoul(val, NULL, 10);
+        } else if (!strcmp(arg, "--updates")) {
+            opts.updates = (unsigned) strtoul(val, NULL, 10);
+        } else if (!strcmp(arg, "--batch-size")) {
+            opts.batch_size = (unsigned) strtoul(val, NULL, 10);
+        } else if (!strcmp(arg, "--seed")) {
+            opts.seed = strtoull(val, NULL, 10);
+        } else if (!strcmp(arg, "--key-shape")) {
+            opts.key_shape = -2;
+            if (!strcmp(val, "all")) {
+                opts.key_shape = -1;
+            }
+            for (shape = 0; shape < KEY_SHAPES; ++shape) {
+                if (!strcmp(val, key_shape_names[shape])) {
+                    opts.key_shape = shape;
+                }
+            }
+            if (opts.key_shape == -2) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (opts.records == 0 || opts.partitions == 0 ||
+        opts.partitions > 1024 || opts.batch_size == 0) {
+        usage(argv[0]);
+    }
+
+    printf("{\"options\": {\"records\": %u, \"value_size\": %u,"
+           " \"partitions\": %u, \"updates\": %u, \"batch_size\": %u,"
+           " \"seed\": %" PRIu64 "},\n \"results\": [\n",
+           opts.records, opts.value_size, opts.partitions, opts.updates,
+           opts.batch_size, opts.seed);
+
+    for (shape = 0; shape < KEY_SHAPES; ++shape) {
+        if (opts.key_shape >= 0 && opts.key_shape != shape) {
+            continue;
+        }
+        bench_sort(&opts, (key_shape_t) shape);
+        bench_merge(&opts, (key_shape_t) shape);
+        for (i = 0; i < sizeof(reducers) / sizeof(reducers[0]); ++i) {
+            bench_build_update(&opts, (key_shape_t) shape, &reducers[i]);
+        }
+    }
+
+    printf("\n]}\n");
+    return 0;
+}
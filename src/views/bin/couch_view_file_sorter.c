@@ -194,7 +194,9 @@ int main(int argc, char *argv[])
                 /* For sorting the spatial file extra information
                  * (the bounding box) is needed */
                 error = sort_spatial_kvs_file(view_files[i], tmp_dir,
-                                              extra_data[i], num_doubles[i]);
+                                              extra_data[i], num_doubles[i],
+                                              SPATIAL_ORDER_ZCODE,
+                                              NULL, NULL);
                 break;
             }
             if (error != FILE_SORTER_SUCCESS) {
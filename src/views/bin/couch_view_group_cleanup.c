@@ -29,17 +29,22 @@
 
 #define BUF_SIZE 8192
 
-int main(int argc, char *argv[])
+int run_view_group_cleanup(int argc, char *argv[], int server)
 {
     view_group_info_t *group_info = NULL;
     uint64_t purge_count;
     int ret = 2;
     uint64_t header_pos;
-    view_error_t error_info;
+    uint64_t time_limit_ms = 0;
+    int complete = 1;
+    view_error_t error_info = {NULL, NULL};
     cb_thread_t exit_thread;
 
-    (void) argc;
-    (void) argv;
+    /* An optional time limit in milliseconds, after which what's left is
+       kept for the next run to clean */
+    if (argc > 1) {
+        time_limit_ms = strtoull(argv[1], NULL, 10);
+    }
 
     group_info = couchstore_read_view_group_info(stdin, stderr);
     if (group_info == NULL) {
@@ -47,16 +52,20 @@ int main(int argc, char *argv[])
         goto out;
     }
 
-    ret = start_exit_listener(&exit_thread);
-    if (ret) {
-        fprintf(stderr, "Error starting stdin exit listener thread\n");
-        goto out;
+    if (!server) {
+        ret = start_exit_listener(&exit_thread);
+        if (ret) {
+            fprintf(stderr, "Error starting stdin exit listener thread\n");
+            goto out;
+        }
     }
 
-    ret = couchstore_cleanup_view_group(group_info,
-                                        &header_pos,
-                                        &purge_count,
-                                        &error_info);
+    ret = couchstore_cleanup_view_group_bounded(group_info,
+                                                time_limit_ms,
+                                                &header_pos,
+                                                &purge_count,
+                                                &complete,
+                                                &error_info);
 
     if (ret != COUCHSTORE_SUCCESS) {
         if (error_info.error_msg != NULL && error_info.view_name != NULL) {
@@ -69,6 +78,9 @@ int main(int argc, char *argv[])
     }
 
     fprintf(stdout, "PurgedCount %"PRIu64"\n", purge_count);
+    if (time_limit_ms > 0) {
+        fprintf(stdout, "Complete %d\n", complete);
+    }
 
 out:
     couchstore_free_view_group_info(group_info);
@@ -77,3 +89,10 @@ out:
 
     return (ret < 0) ? (100 + ret) : ret;
 }
+
+#ifndef COUCH_VIEW_SERVER
+int main(int argc, char *argv[])
+{
+    return run_view_group_cleanup(argc, argv, 0);
+}
+#endif
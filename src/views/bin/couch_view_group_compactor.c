@@ -36,7 +36,7 @@ static void stats_updater(uint64_t freq, uint64_t inserted)
     }
 }
 
-int main(int argc, char *argv[])
+int run_view_group_compactor(int argc, char *argv[], int server)
 {
     view_group_info_t *group_info = NULL;
     char buf[BUF_SIZE];
@@ -45,7 +45,7 @@ int main(int argc, char *argv[])
     sized_buf header_buf = {NULL, 0};
     sized_buf header_outbuf = {NULL, 0};
     uint64_t total_changes = 0;
-    view_error_t error_info;
+    view_error_t error_info = {NULL, NULL};
     cb_thread_t exit_thread;
     compactor_stats_t stats;
 
@@ -54,9 +54,11 @@ int main(int argc, char *argv[])
 
     /*
      * Disable buffering for stdout since progress stats needs to be
-     * immediately available at erlang side
+     * immediately available at erlang side (the server does it once)
      */
-    setvbuf(stdout, (char *)NULL, _IONBF, 0);
+    if (!server) {
+        setvbuf(stdout, (char *)NULL, _IONBF, 0);
+    }
 
     /* Read target filepath */
     if (couchstore_read_line(stdin, buf, BUF_SIZE) != buf) {
@@ -112,10 +114,12 @@ int main(int argc, char *argv[])
     stats.update_fun = stats_updater;
     stats.freq = MAX(total_changes / 100, 1);
 
-    ret = start_exit_listener(&exit_thread);
-    if (ret) {
-        fprintf(stderr, "Error starting stdin exit listener thread\n");
-        goto out;
+    if (!server) {
+        ret = start_exit_listener(&exit_thread);
+        if (ret) {
+            fprintf(stderr, "Error starting stdin exit listener thread\n");
+            goto out;
+        }
     }
 
     ret = couchstore_compact_view_group(group_info,
@@ -152,3 +156,9 @@ out:
     return (ret < 0) ? (100 + ret) : ret;
 }
 
+#ifndef COUCH_VIEW_SERVER
+int main(int argc, char *argv[])
+{
+    return run_view_group_compactor(argc, argv, 0);
+}
+#endif
@@ -30,7 +30,7 @@
 #define BUF_SIZE 8192
 
 
-int main(int argc, char *argv[])
+int run_view_index_builder(int argc, char *argv[], int server)
 {
     view_group_info_t *group_info = NULL;
     char buf[BUF_SIZE];
@@ -40,11 +40,10 @@ int main(int argc, char *argv[])
     int i;
     int ret = 2;
     uint64_t header_pos;
-    view_error_t error_info;
+    view_error_t error_info = {NULL, NULL};
     cb_thread_t exit_thread;
-
-    (void) argc;
-    (void) argv;
+    view_btree_stats_t *btree_stats = NULL;
+    int print_stats = (argc > 1 && strcmp(argv[1], BTREE_STATS_OPTION) == 0);
 
     group_info = couchstore_read_view_group_info(stdin, stderr);
     if (group_info == NULL) {
@@ -65,6 +64,16 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    if (print_stats) {
+        btree_stats = (view_btree_stats_t *) calloc(group_info->num_btrees + 1,
+                                                    sizeof(view_btree_stats_t));
+        if (btree_stats == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            ret = COUCHSTORE_ERROR_ALLOC_FAIL;
+            goto out;
+        }
+    }
+
     source_files = (char **) calloc(group_info->num_btrees + 1, sizeof(char *));
     if (source_files == NULL) {
         fprintf(stderr, "Memory allocation failure\n");
@@ -105,19 +114,22 @@ int main(int argc, char *argv[])
         }
     }
 
-    ret = start_exit_listener(&exit_thread);
-    if (ret) {
-        fprintf(stderr, "Error starting stdin exit listener thread\n");
-        goto out;
+    if (!server) {
+        ret = start_exit_listener(&exit_thread);
+        if (ret) {
+            fprintf(stderr, "Error starting stdin exit listener thread\n");
+            goto out;
+        }
     }
 
-    ret = couchstore_build_view_group(group_info,
-                                      source_files[0],
-                                      (const char **) &source_files[1],
-                                      dest_file,
-                                      tmp_dir,
-                                      &header_pos,
-                                      &error_info);
+    ret = couchstore_build_view_group_with_stats(group_info,
+                                                 source_files[0],
+                                                 (const char **) &source_files[1],
+                                                 dest_file,
+                                                 tmp_dir,
+                                                 &header_pos,
+                                                 btree_stats,
+                                                 &error_info);
 
     if (ret != COUCHSTORE_SUCCESS) {
         if (error_info.error_msg != NULL && error_info.view_name != NULL) {
@@ -129,6 +141,10 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    if (print_stats) {
+        print_btree_stats(stdout, group_info, btree_stats);
+    }
+
 out:
     if (source_files != NULL) {
         for (i = 0; i <= group_info->num_btrees; ++i) {
@@ -138,9 +154,17 @@ out:
     }
     free(tmp_dir);
     free(dest_file);
+    free(btree_stats);
     couchstore_free_view_group_info(group_info);
     free((void *) error_info.error_msg);
     free((void *) error_info.view_name);
 
     return (ret < 0) ? (100 + ret) : ret;
 }
+
+#ifndef COUCH_VIEW_SERVER
+int main(int argc, char *argv[])
+{
+    return run_view_index_builder(argc, argv, 0);
+}
+#endif
@@ -29,7 +29,7 @@
 
 #define BUF_SIZE 8192
 
-int main(int argc, char *argv[])
+int run_view_index_updater(int argc, char *argv[], int server)
 {
     view_group_info_t *group_info = NULL;
     char buf[BUF_SIZE];
@@ -39,14 +39,22 @@ int main(int argc, char *argv[])
     int batch_size;
     int ret = 2;
     int is_sorted = 0;
+    int in_stream = 0;
     view_group_update_stats_t stats;
     sized_buf header_buf = {NULL, 0};
     sized_buf header_outbuf = {NULL, 0};
-    view_error_t error_info;
+    view_error_t error_info = {NULL, NULL};
     cb_thread_t exit_thread;
-
-    (void) argc;
-    (void) argv;
+    int print_stats = 0;
+    int incremental_rereduce = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], BTREE_STATS_OPTION) == 0) {
+            print_stats = 1;
+        } else if (strcmp(argv[i], INCREMENTAL_REREDUCE_OPTION) == 0) {
+            incremental_rereduce = 1;
+        }
+    }
 
     /* Set all stats counters to zero */
     memset((char *) &stats, 0, sizeof(view_group_update_stats_t));
@@ -69,6 +77,7 @@ int main(int argc, char *argv[])
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto out;
     }
+    group_info->incremental_rereduce = incremental_rereduce;
 
     if (couchstore_read_line(stdin, buf, BUF_SIZE) != buf) {
         fprintf(stderr, "Error reading is_sorted flag\n");
@@ -80,6 +89,16 @@ int main(int argc, char *argv[])
         is_sorted = 1;
     }
 
+    if (print_stats) {
+        stats.btree_stats = (view_btree_stats_t *) calloc(group_info->num_btrees + 1,
+                                                          sizeof(view_btree_stats_t));
+        if (stats.btree_stats == NULL) {
+            fprintf(stderr, "Memory allocation failure\n");
+            ret = COUCHSTORE_ERROR_ALLOC_FAIL;
+            goto out;
+        }
+    }
+
     source_files = (char **) calloc(group_info->num_btrees + 1, sizeof(char *));
     if (source_files == NULL) {
         fprintf(stderr, "Memory allocation failure\n");
@@ -99,6 +118,15 @@ int main(int argc, char *argv[])
             goto out;
         }
 
+        /* "-" for every source: the records follow the header on stdin */
+        if (i == 0) {
+            in_stream = (strcmp(buf, "-") == 0);
+        } else if (in_stream != (strcmp(buf, "-") == 0)) {
+            fprintf(stderr, "Either all or none of the sources must be stdin\n");
+            ret = COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+            goto out;
+        }
+
         source_files[i] = strdup(buf);
         if (source_files[i] == NULL) {
             fprintf(stderr, "Memory allocation failure\n");
@@ -133,22 +161,42 @@ int main(int argc, char *argv[])
         goto out;
     }
 
-    ret = start_exit_listener(&exit_thread);
-    if (ret) {
-        fprintf(stderr, "Error starting stdin exit listener thread\n");
-        goto out;
-    }
+    if (in_stream) {
+        /* Stdin carries the records, so there's no listening on it for
+           exit; the caller closing it early fails the update instead */
+        if (!is_sorted) {
+            fprintf(stderr, "Records streamed on stdin must be sorted\n");
+            ret = COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+            goto out;
+        }
+
+        ret = couchstore_update_view_group_stream(group_info,
+                                                  stdin,
+                                                  batch_size,
+                                                  &header_buf,
+                                                  &stats,
+                                                  &header_outbuf,
+                                                  &error_info);
+    } else {
+        if (!server) {
+            ret = start_exit_listener(&exit_thread);
+            if (ret) {
+                fprintf(stderr, "Error starting stdin exit listener thread\n");
+                goto out;
+            }
+        }
 
-    ret = couchstore_update_view_group(group_info,
-                                      source_files[0],
-                                      (const char **) &source_files[1],
-                                      batch_size,
-                                      &header_buf,
-                                      is_sorted,
-                                      tmp_dir,
-                                      &stats,
-                                      &header_outbuf,
-                                      &error_info);
+        ret = couchstore_update_view_group(group_info,
+                                          source_files[0],
+                                          (const char **) &source_files[1],
+                                          batch_size,
+                                          &header_buf,
+                                          is_sorted,
+                                          tmp_dir,
+                                          &stats,
+                                          &header_outbuf,
+                                          &error_info);
+    }
 
 
     if (ret != COUCHSTORE_SUCCESS) {
@@ -176,6 +224,9 @@ int main(int argc, char *argv[])
                    stats.kvs_inserted,
                    stats.kvs_removed,
                    stats.purged);
+    if (print_stats) {
+        print_btree_stats(stdout, group_info, stats.btree_stats);
+    }
 
 out:
     if (source_files != NULL) {
@@ -190,7 +241,15 @@ out:
     free((void *) error_info.view_name);
     free((void *) header_buf.buf);
     free((void *) header_outbuf.buf);
+    free(stats.btree_stats);
     free(tmp_dir);
 
     return (ret < 0) ? (100 + ret) : ret;
 }
+
+#ifndef COUCH_VIEW_SERVER
+int main(int argc, char *argv[])
+{
+    return run_view_index_updater(argc, argv, 0);
+}
+#endif
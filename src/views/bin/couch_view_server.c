@@ -0,0 +1,112 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+/*
+ * Runs the work of the view tools one request after another in a single
+ * process, so that small updates don't each pay for a process start, for
+ * V8 and ICU getting going, and for the threads and pooled memory that
+ * stay around between requests.
+ *
+ * Each request is a line on stdin naming the tool, with the arguments it
+ * takes on its command line:
+ *
+ *     couch_view_index_updater [--btree-stats] [--incremental-rereduce]
+ *     couch_view_index_builder [--btree-stats]
+ *     couch_view_group_compactor
+ *     couch_view_group_cleanup [time limit ms]
+ *
+ * followed by the input that tool reads from its stdin. What it writes
+ * comes out on stdout and stderr as before, then a line "Exit <status>"
+ * on stdout, status being what the tool would have exited with. A status
+ * other than 0 also ends the server with it, since the request's input may
+ * have been left half read. An "exit" line or the end of stdin ends it
+ * with 0.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+#include "util.h"
+
+#define BUF_SIZE 8192
+#define MAX_ARGS 8
+
+typedef int (*view_tool_fn)(int argc, char *argv[], int server);
+
+static const struct {
+    const char   *name;
+    view_tool_fn run;
+} view_tools[] = {
+    { "couch_view_index_updater",   run_view_index_updater },
+    { "couch_view_index_builder",   run_view_index_builder },
+    { "couch_view_group_compactor", run_view_group_compactor },
+    { "couch_view_group_cleanup",   run_view_group_cleanup }
+};
+
+#define NUM_VIEW_TOOLS (sizeof(view_tools) / sizeof(view_tools[0]))
+
+
+int main(int argc, char *argv[])
+{
+    char buf[BUF_SIZE];
+
+    (void) argc;
+    (void) argv;
+
+    /* The compactor's progress stats must reach the caller right away */
+    setvbuf(stdout, (char *)NULL, _IONBF, 0);
+
+    while (couchstore_read_line(stdin, buf, BUF_SIZE) == buf) {
+        char *args[MAX_ARGS];
+        int nargs = 0;
+        char *arg;
+        unsigned i;
+        int ret;
+
+        for (arg = strtok(buf, " "); arg != NULL && nargs < MAX_ARGS;
+             arg = strtok(NULL, " ")) {
+            args[nargs++] = arg;
+        }
+        if (nargs == 0) {
+            continue;
+        }
+        if (strcmp(args[0], "exit") == 0) {
+            break;
+        }
+
+        for (i = 0; i < NUM_VIEW_TOOLS; ++i) {
+            if (strcmp(args[0], view_tools[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == NUM_VIEW_TOOLS) {
+            fprintf(stderr, "Unknown command `%s`\n", args[0]);
+            ret = 100 + COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+        } else {
+            ret = view_tools[i].run(nargs, args, 1);
+        }
+
+        fflush(stderr);
+        fprintf(stdout, "Exit %d\n", ret);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
@@ -22,6 +22,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 
 static void exit_thread_helper(void *args)
 {
@@ -53,3 +54,34 @@ int start_exit_listener(cb_thread_t *id)
 
     return ret;
 }
+
+void print_btree_stats(FILE *out,
+                       const view_group_info_t *info,
+                       const view_btree_stats_t *stats)
+{
+    int i;
+
+    for (i = 0; i <= info->num_btrees; ++i) {
+        const view_btree_stats_t *s = &stats[i];
+
+        fprintf(out, "Btree stats ="
+                     " btree : %s"
+                     ", sort_ns : %"PRIu64
+                     ", modify_ns : %"PRIu64
+                     ", reduce_ns : %"PRIu64
+                     ", js_reduce_ns : %"PRIu64
+                     ", reduce_calls : %"PRIu64
+                     ", js_reduce_calls : %"PRIu64
+                     ", nodes_written : %"PRIu64
+                     ", node_bytes : %"PRIu64"\n",
+                     i == 0 ? "id_btree" : info->btree_infos[i - 1].names[0],
+                     s->sort_ns,
+                     s->modify_ns,
+                     s->reduce_ns,
+                     s->js_reduce_ns,
+                     s->reduce_calls,
+                     s->js_reduce_calls,
+                     s->nodes_written,
+                     s->node_bytes);
+    }
+}
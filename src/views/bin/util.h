@@ -22,7 +22,29 @@
 #define _BIN_UTILS_H
 
 #include "config.h"
+#include <stdio.h>
+#include "../view_group.h"
+
+/* Makes the builder and updater also print what each btree took */
+#define BTREE_STATS_OPTION "--btree-stats"
+
+/* Makes the updater reduce nodes from their changed children where it can */
+#define INCREMENTAL_REREDUCE_OPTION "--incremental-rereduce"
+
     /* Start a thread to handle exit message*/
     int start_exit_listener(cb_thread_t *id);
 
+    /* The work of each tool, which its main() runs with server 0 and
+       couch_view_server with server 1: the server's stdin carries its
+       commands, so it isn't listened on for an exit message. */
+    int run_view_index_builder(int argc, char *argv[], int server);
+    int run_view_index_updater(int argc, char *argv[], int server);
+    int run_view_group_compactor(int argc, char *argv[], int server);
+    int run_view_group_cleanup(int argc, char *argv[], int server);
+
+    /* Print the stats of the id btree and each view's, a line each */
+    void print_btree_stats(FILE *out,
+                           const view_group_info_t *info,
+                           const view_btree_stats_t *stats);
+
 #endif
@@ -20,6 +20,7 @@
 
 #include "config.h"
 #include "bitmap.h"
+#include <stdint.h>
 #include <string.h>
 
 #define CHUNK_BITS            (sizeof(unsigned char) * CHAR_BIT)
@@ -46,19 +47,51 @@ void unset_bit(bitmap_t *bm, uint16_t bit)
     ((MAP_CHUNK(*bm, bit)) &= ~(1 << CHUNK_OFFSET(bit)));
 }
 
+/* The bitmaps are worked through a 64 bit word at a time, which the
+   compiler also turns into vector instructions where it has them. Words
+   are copied in and out, a bitmap's chunks having no alignment of their
+   own. */
+#define BITMAP_WORDS (sizeof(bitmap_t) / sizeof(uint64_t))
+
+static inline uint64_t bitmap_word(const bitmap_t *bm, unsigned int i)
+{
+    uint64_t w;
+    memcpy(&w, bm->chunks + i * sizeof(w), sizeof(w));
+    return w;
+}
+
+static inline void set_bitmap_word(bitmap_t *bm, unsigned int i, uint64_t w)
+{
+    memcpy(bm->chunks + i * sizeof(w), &w, sizeof(w));
+}
+
+static inline int word_popcount(uint64_t w)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(w);
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((w * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
 void union_bitmaps(bitmap_t *dst_bm, const bitmap_t *src_bm)
 {
     unsigned int i;
-    for (i = 0; i < 1024 / CHUNK_BITS; ++i) {
-        dst_bm->chunks[i] |= src_bm->chunks[i];
+    for (i = 0; i < BITMAP_WORDS; ++i) {
+        set_bitmap_word(dst_bm, i,
+                        bitmap_word(dst_bm, i) | bitmap_word(src_bm, i));
     }
 }
 
 void intersect_bitmaps(bitmap_t *dst_bm, const bitmap_t *src_bm)
 {
     unsigned int i;
-    for (i = 0; i < 1024 / CHUNK_BITS; ++i) {
-        dst_bm->chunks[i] &= src_bm->chunks[i];
+    for (i = 0; i < BITMAP_WORDS; ++i) {
+        set_bitmap_word(dst_bm, i,
+                        bitmap_word(dst_bm, i) & bitmap_word(src_bm, i));
     }
 }
 
@@ -66,3 +99,43 @@ int is_equal_bitmap(const bitmap_t *bm1, const bitmap_t *bm2)
 {
     return !memcmp(bm1, bm2, sizeof(bitmap_t));
 }
+
+int bitmap_is_empty(const bitmap_t *bm)
+{
+    uint64_t any = 0;
+    unsigned int i;
+    for (i = 0; i < BITMAP_WORDS; ++i) {
+        any |= bitmap_word(bm, i);
+    }
+    return any == 0;
+}
+
+int bitmap_popcount(const bitmap_t *bm)
+{
+    int count = 0;
+    unsigned int i;
+    for (i = 0; i < BITMAP_WORDS; ++i) {
+        count += word_popcount(bitmap_word(bm, i));
+    }
+    return count;
+}
+
+int bitmap_intersects(const bitmap_t *bm1, const bitmap_t *bm2)
+{
+    uint64_t any = 0;
+    unsigned int i;
+    for (i = 0; i < BITMAP_WORDS; ++i) {
+        any |= bitmap_word(bm1, i) & bitmap_word(bm2, i);
+    }
+    return any != 0;
+}
+
+int bitmap_is_subset(const bitmap_t *bm1, const bitmap_t *bm2)
+{
+    uint64_t extra = 0;
+    unsigned int i;
+    for (i = 0; i < BITMAP_WORDS; ++i) {
+        extra |= bitmap_word(bm1, i) & ~bitmap_word(bm2, i);
+    }
+    return extra == 0;
+}
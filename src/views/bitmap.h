@@ -43,6 +43,14 @@ void unset_bit(bitmap_t *bm, uint16_t bit);
 void union_bitmaps(bitmap_t *dst_bm, const bitmap_t *src_bm);
 void intersect_bitmaps(bitmap_t *dst_bm, const bitmap_t *src_bm);
 int is_equal_bitmap(const bitmap_t *bm1, const bitmap_t *bm2);
+/* whether no bit is set */
+int bitmap_is_empty(const bitmap_t *bm);
+/* the number of bits set */
+int bitmap_popcount(const bitmap_t *bm);
+/* whether a bit is set in both */
+int bitmap_intersects(const bitmap_t *bm1, const bitmap_t *bm2);
+/* whether every bit set in bm1 is set in bm2 */
+int bitmap_is_subset(const bitmap_t *bm1, const bitmap_t *bm2);
 
 
 #ifdef __cplusplus
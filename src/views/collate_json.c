@@ -4,16 +4,20 @@
 
 #include "config.h"
 #include "collate_json.h"
+#include "collator.h"
+#include "../alloc.h"
 #include <assert.h>
 #include <ctype.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unicode/ucol.h>
 #include <unicode/ucasemap.h>
-#include <unicode/ucnv.h>
+#include <unicode/ustring.h>
 
 
 static int cmp(int n1, int n2)
@@ -113,10 +117,74 @@ char ConvertJSONEscape(const char **in)
 }
 
 
-static int compareStringsASCII(const char** in1, const char** in2)
+/* A byte in every byte of a word, and the top bit of each */
+#define kWordOnes  0x0101010101010101ULL
+#define kWordHighs 0x8080808080808080ULL
+
+/* Whether any byte of w is b */
+static bool wordHasByte(uint64_t w, unsigned char b)
+{
+    uint64_t x = w ^ (kWordOnes * b);
+    return ((x - kWordOnes) & ~x & kWordHighs) != 0;
+}
+
+
+/* Finds the closing quote of the JSON string at in, its opening quote, a
+   word at a time. Returns NULL if the string has an escape, or doesn't
+   end before end; *ascii tells if none of its bytes is past 0x7f. */
+static const char* scanPlainString(const char* in, const char* end,
+                                   bool* ascii)
+{
+    const char* p = in + 1;
+    uint64_t highs = 0;
+
+    while (end - p >= (ptrdiff_t)sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        if (wordHasByte(w, '"') || wordHasByte(w, '\\')) {
+            break;
+        }
+        highs |= w & kWordHighs;
+        p += sizeof(w);
+    }
+    for (; p < end; ++p) {
+        if (*p == '"') {
+            *ascii = (highs == 0);
+            return p;
+        } else if (*p == '\\') {
+            return NULL;
+        }
+        highs |= (unsigned char)*p & 0x80;
+    }
+    return NULL;
+}
+
+
+static int compareStringsASCII(const char** in1, const char* end1,
+                               const char** in2, const char* end2)
 {
     const char* str1 = *in1, *str2 = *in2;
+    const char* close1, *close2;
+    bool ascii1, ascii2;
     int s;
+
+    /* Unescaped ASCII compares the same as bytes */
+    close1 = scanPlainString(str1, end1, &ascii1);
+    close2 = close1 ? scanPlainString(str2, end2, &ascii2) : NULL;
+    if (close2 && ascii1 && ascii2) {
+        size_t len1 = close1 - str1 - 1, len2 = close2 - str2 - 1;
+        s = memcmp(str1 + 1, str2 + 1, len1 < len2 ? len1 : len2);
+        if (s == 0) {
+            s = (len1 > len2) - (len1 < len2);
+        }
+        if (s) {
+            return cmp(s, 0);
+        }
+        *in1 = close1 + 1;
+        *in2 = close2 + 1;
+        return 0;
+    }
+
     while(true) {
         char c1 = *++str1;
         char c2 = *++str2;
@@ -150,7 +218,9 @@ static int compareStringsASCII(const char** in1, const char** in2)
 }
 
 
-static const char* createStringFromJSON(const char** in, size_t *length, bool *freeWhenDone)
+/* Unescaped strings are decoded into scratch if they fit, else malloc'd. */
+static const char* createStringFromJSON(const char** in, size_t *length, bool *freeWhenDone,
+                                        char *scratch, size_t scratchSize)
 {
     char* buf;
     char* dst;
@@ -176,7 +246,12 @@ static const char* createStringFromJSON(const char** in, size_t *length, bool *f
     *freeWhenDone = false;
     if (escapes > 0) {
         *length -= escapes;
-        buf = malloc(*length);
+        if (*length <= scratchSize) {
+            buf = scratch;
+        } else {
+            buf = cs_malloc(*length);
+            *freeWhenDone = true;
+        }
         dst = buf;
         for (str = start; (c = *str) != '"'; ++str) {
             if (c == '\\')
@@ -185,33 +260,27 @@ static const char* createStringFromJSON(const char** in, size_t *length, bool *f
         }
         assert(dst - buf == (int)*length);
         start = buf;
-        *freeWhenDone = true;
     }
 
     return start;
 }
 
 
-static int compareUnicodeSlow(const char* str1, size_t len1,
-                              const char* str2, size_t len2)
+static int compareUnicode(const char* str1, size_t len1,
+                          const char* str2, size_t len2)
 {
-    static UCollator* coll = NULL;
-    UCharIterator iterA, iterB;
+    UCollator* coll = view_collator();
     int result;
 
     UErrorCode status = U_ZERO_ERROR;
     if (!coll) {
-        coll = ucol_open("", &status);
-        if (U_FAILURE(status)) {
-            fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
-            return -1;
-        }
+        return -1;
     }
 
-    uiter_setUTF8(&iterA, str1, (int)len1);
-    uiter_setUTF8(&iterB, str2, (int)len2);
-
-    result = ucol_strcollIter(coll, &iterA, &iterB, &status);
+    /* Collated as UTF-8, with no conversion to UTF-16 first: ICU skips a
+       common prefix, and Latin text takes its fast path. Ill-formed
+       sequences collate as U+FFFD. */
+    result = ucol_strcollUTF8(coll, str1, (int32_t)len1, str2, (int32_t)len2, &status);
 
     if (U_FAILURE(status)) {
         fprintf(stderr, "CouchStore CollateJSON: ICU error %d\n", (int)status);
@@ -228,115 +297,47 @@ static int compareUnicodeSlow(const char* str1, size_t len1,
 }
 
 
-static int convertUTF8toUChar(const char *src, UChar *dst, int len)
-{
-    static UConverter *c;
-    UErrorCode status;
-    UChar *p = dst;
-    const char *s = src;
-
-    if (!c) {
-        status = U_ZERO_ERROR;
-        c = ucnv_open("UTF-8", &status);
-        if (!c) {
-            fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
-            abort();
-        }
-    }
-
-    while (len) {
-        unsigned char ch = (unsigned char)(*s);
-        if ((ch & 0x80)) {
-            goto icu_conv;
-        }
-        *p++ = (UChar)(ch);
-        s++;
-        len--;
-    }
-
-    return p - dst;
-
-icu_conv:
-    status = U_ZERO_ERROR;
-    ucnv_toUnicode(c, &p, p + len + 1, &s, s + len + 1, NULL, TRUE, &status);
-
-    if (U_FAILURE(status)) {
-        return -1;
-    }
-
-    return p - dst;
-}
-
-static int compareUnicode(const char* str1, size_t len1,
-                          const char* str2, size_t len2)
+static int compareStringsUnicode(const char** in1, const char* end1,
+                                 const char** in2, const char* end2)
 {
-    static UCollator* coll = NULL;
-    UChar *b1;
-    UChar *b2;
-    int ret1, ret2;
+    char scratch1[256], scratch2[256];
+    size_t len1, len2;
+    bool free1, free2;
+    const char* str1;
+    const char* str2;
+    const char* close1, *close2;
+    bool ascii1, ascii2;
     int result;
 
-    UErrorCode status = U_ZERO_ERROR;
-    if (!coll) {
-        coll = ucol_open("", &status);
-        if (U_FAILURE(status)) {
-            fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
-            return -1;
+    /* Unescaped strings are compared where they are, and identical ones
+       without the collator */
+    close1 = scanPlainString(*in1, end1, &ascii1);
+    close2 = close1 ? scanPlainString(*in2, end2, &ascii2) : NULL;
+    if (close2) {
+        str1 = *in1 + 1;
+        str2 = *in2 + 1;
+        len1 = close1 - str1;
+        len2 = close2 - str2;
+        *in1 = close1 + 1;
+        *in2 = close2 + 1;
+        if (len1 == len2 && memcmp(str1, str2, len1) == 0) {
+            return 0;
         }
+        return compareUnicode(str1, len1, str2, len2);
     }
 
-    if (len1 > 256 || len2 > 256) {
-        return compareUnicodeSlow(str1, len1, str2, len2);
-    }
-
-    b1 = malloc(len1 * sizeof(UChar));
-    b2 = malloc(len2 * sizeof(UChar));
-    if (b1 == NULL || b2 == NULL) {
-        free(b1);
-        free(b2);
-        fprintf(stderr, "CouchStore CollateJSON: Couldn't allocate memory\n");
-        return -2;
-    }
-
-    ret1 = convertUTF8toUChar(str1, b1, len1);
-    ret2 = convertUTF8toUChar(str2, b2, len2);
-
-    if (ret1 < 0 || ret2 < 0) {
-        /* something went wrong with utf8->utf32 conversion */
-        free(b1);
-        free(b2);
-        return compareUnicodeSlow(str1, len1, str2, len2);
-    }
-
-    result = ucol_strcoll(coll, b1, len1, b2, len2);
-    free(b1);
-    free(b2);
-
-    if (result < 0) {
-        return -1;
-    } else if (result > 0) {
-        return 1;
-    }
-
-    return 0;
-
-}
-
-
-static int compareStringsUnicode(const char** in1, const char** in2)
-{
-    size_t len1, len2;
-    bool free1, free2;
-    const char* str1 = createStringFromJSON(in1, &len1, &free1);
-    const char* str2 = createStringFromJSON(in2, &len2, &free2);
+    str1 = createStringFromJSON(in1, &len1, &free1,
+                                scratch1, sizeof(scratch1));
+    str2 = createStringFromJSON(in2, &len2, &free2,
+                                scratch2, sizeof(scratch2));
 
-    int result = compareUnicode(str1, len1, str2, len2);
+    result = compareUnicode(str1, len1, str2, len2);
 
     if (free1) {
-        free((char*)str1);
+        cs_free((char*)str1);
     }
     if (free2) {
-        free((char*)str2);
+        cs_free((char*)str2);
     }
     return result;
 }
@@ -353,7 +354,7 @@ static double readNumber(const char* start, const char* end, char** endOfNumber)
 
     assert(end > start);
     len = end - start;
-    str = (len < sizeof(buf)) ? buf : malloc(len + 1);
+    str = (len < sizeof(buf)) ? buf : cs_malloc(len + 1);
     if (!str)
         return 0.0;
     memcpy(str, start, len);
@@ -362,17 +363,80 @@ static double readNumber(const char* start, const char* end, char** endOfNumber)
     result = strtod(str, &endInStr);
     *endOfNumber = (char*)start + (endInStr - str);
     if (len >= sizeof(buf))
-        free(str);
+        cs_free(str);
     return result;
 }
 
 
+/* Most digits of an integer compared digit by digit: any integer of up to
+   15 digits is a double exactly, so it compares as strtod's would. */
+#define kMaxExactDigits 15
+
+typedef struct {
+    const char *digits;     /* past the sign and any leading zeros */
+    size_t count;           /* of digits; 0 for zero */
+    bool negative;
+    const char *next;       /* past the number */
+} IntegerToken;
+
+
+/* Reads the number at str, before end, as an integer of no more than
+   kMaxExactDigits digits; false if it's anything else, left to strtod */
+static bool readInteger(const char *str, const char *end, IntegerToken *tok)
+{
+    const char *p = str;
+
+    tok->negative = (p < end && *p == '-');
+    if (tok->negative) {
+        ++p;
+    }
+    if (p >= end || !isdigit((unsigned char)*p)) {
+        return false;
+    }
+    while (p < end && *p == '0') {
+        ++p;
+    }
+    tok->digits = p;
+    while (p < end && isdigit((unsigned char)*p)) {
+        ++p;
+    }
+    if (p < end && (*p == '.' || *p == 'e' || *p == 'E' ||
+                    *p == 'x' || *p == 'X')) {
+        return false;
+    }
+    tok->count = p - tok->digits;
+    tok->next = p;
+    return tok->count <= kMaxExactDigits;
+}
+
+
+static int compareIntegers(const IntegerToken *n1, const IntegerToken *n2)
+{
+    /* -0 is 0 */
+    bool neg1 = n1->negative && n1->count > 0;
+    bool neg2 = n2->negative && n2->count > 0;
+    int s;
+
+    if (neg1 != neg2) {
+        return neg1 ? -1 : 1;
+    }
+    s = cmp((int)n1->count, (int)n2->count);
+    if (s == 0) {
+        s = memcmp(n1->digits, n2->digits, n1->count);
+        s = cmp(s, 0);
+    }
+    return neg1 ? -s : s;
+}
+
+
 int CollateJSON(const sized_buf *buf1,
                 const sized_buf *buf2,
                 CollateJSONMode mode)
 {
     const char* str1 = buf1->buf;
     const char* str2 = buf2->buf;
+    const char* end1 = buf1->buf + buf1->size;
+    const char* end2 = buf2->buf + buf2->size;
     int depth = 0;
 
     do {
@@ -399,13 +463,23 @@ int CollateJSON(const sized_buf *buf1,
                 break;
             case kNumber: {
                 char* next1, *next2;
+                IntegerToken int1, int2;
                 int diff;
+                if (readInteger(str1, end1, &int1) &&
+                    readInteger(str2, end2, &int2)) {
+                    diff = compareIntegers(&int1, &int2);
+                    if (diff)
+                        return diff; /* Numbers don't match */
+                    str1 = int1.next;
+                    str2 = int2.next;
+                    break;
+                }
                 if (depth == 0) {
                     /* At depth 0, be careful not to fall off the end of the
                        input, because there won't be any delimiters (']' or
                        '}') after the number! */
-                    diff = dcmp( readNumber(str1, buf1->buf + buf1->size, &next1),
-                                 readNumber(str2, buf2->buf + buf2->size, &next2) );
+                    diff = dcmp( readNumber(str1, end1, &next1),
+                                 readNumber(str2, end2, &next2) );
                 } else {
                     diff = dcmp( strtod(str1, &next1), strtod(str2, &next2) );
                 }
@@ -418,9 +492,9 @@ int CollateJSON(const sized_buf *buf1,
             case kString: {
                 int diff;
                 if (mode == kCollateJSON_Unicode)
-                    diff = compareStringsUnicode(&str1, &str2);
+                    diff = compareStringsUnicode(&str1, end1, &str2, end2);
                 else
-                    diff = compareStringsASCII(&str1, &str2);
+                    diff = compareStringsASCII(&str1, end1, &str2, end2);
                 if (diff)
                     return diff; /* Strings don't match */
                 break;
@@ -449,3 +523,172 @@ int CollateJSON(const sized_buf *buf1,
     } while (depth > 0);
     return 0;
 }
+
+
+/* Numbers in a sort key: the bytes of the double, big-endian, with the sign
+   bit flipped for positive ones and every bit for negative ones. */
+static void writeSortKeyNumber(double n, char *out)
+{
+    uint64_t bits;
+    int i;
+
+    if (n == 0.0) {
+        n = 0.0;    /* -0 collates equal to 0 */
+    }
+    memcpy(&bits, &n, sizeof(bits));
+    if (bits >> 63) {
+        bits = ~bits;
+    } else {
+        bits |= (uint64_t)1 << 63;
+    }
+    for (i = 7; i >= 0; --i) {
+        out[i] = (char)(bits & 0xff);
+        bits >>= 8;
+    }
+}
+
+
+/* Appends the ICU sort key of the JSON string at *in, NUL terminated, and
+   moves *in past it. Returns the key's length or -1. */
+static int writeSortKeyString(const char **in, const char *end,
+                              char *out, size_t size)
+{
+    UCollator* coll = view_collator();
+    char scratch[256];
+    UChar buf[256];
+    UChar *ustr = buf;
+    const char *str;
+    const char *p;
+    size_t len;
+    bool freeWhenDone;
+    int32_t ulen;
+    int32_t keylen;
+    UErrorCode status = U_ZERO_ERROR;
+
+    if (!coll) {
+        return -1;
+    }
+
+    /* createStringFromJSON trusts the closing quote to be there */
+    for (p = *in + 1; p < end && *p != '"'; ++p) {
+        if (*p == '\\') {
+            p += (p + 1 < end && p[1] == 'u') ? 5 : 1;
+        }
+    }
+    if (p >= end) {
+        return -1;
+    }
+
+    str = createStringFromJSON(in, &len, &freeWhenDone,
+                               scratch, sizeof(scratch));
+    if (len > sizeof(buf) / sizeof(buf[0])) {
+        ustr = cs_malloc(len * sizeof(UChar));
+    }
+    keylen = -1;
+    if (ustr != NULL) {
+        /* Strictly: what the collator makes of ill-formed UTF-8 depends on
+           how it's converted */
+        u_strFromUTF8(ustr, (int32_t)len, &ulen, str, (int32_t)len, &status);
+        if (U_SUCCESS(status)) {
+            keylen = ucol_getSortKey(coll, ustr, ulen,
+                                     (uint8_t *)out, (int32_t)size);
+            if (keylen == 0 || (size_t)keylen > size) {
+                keylen = -1;
+            }
+        }
+    }
+
+    if (ustr != buf) {
+        cs_free(ustr);
+    }
+    if (freeWhenDone) {
+        cs_free((char*)str);
+    }
+    return keylen;
+}
+
+
+int CollateJSONSortKey(const sized_buf *json, char *out, size_t size)
+{
+    const char *str = json->buf;
+    const char *end = json->buf + json->size;
+    size_t pos = 0;
+    int depth = 0;
+
+    do {
+        ValueType type;
+
+        if (str >= end || pos >= size) {
+            return -1;
+        }
+        type = valueTypeOf(*str);
+        if (type == kIllegal) {
+            return -1;
+        }
+        out[pos++] = (char)type;
+
+        switch (type) {
+            case kNull:
+            case kTrue:
+                str += 4;
+                break;
+            case kFalse:
+                str += 5;
+                break;
+            case kNumber: {
+                /* strtod stops short of the delimiters, so it reads the
+                   same out of a copy as CollateJSON does in place */
+                char buf[64];
+                char *next;
+                const char *p;
+                double n;
+
+                for (p = str; p < end && *p != ',' && *p != ']' &&
+                         *p != '}' && *p != ':'; ++p) {
+                }
+                if ((size_t)(p - str) >= sizeof(buf) || pos + 8 > size) {
+                    return -1;
+                }
+                memcpy(buf, str, p - str);
+                buf[p - str] = '\0';
+                n = strtod(buf, &next);
+                if (next != buf + (p - str) || isnan(n)) {
+                    return -1;
+                }
+                writeSortKeyNumber(n, out + pos);
+                pos += 8;
+                str = p;
+                break;
+            }
+            case kString: {
+                int len = writeSortKeyString(&str, end, out + pos, size - pos);
+                if (len < 0) {
+                    return -1;
+                }
+                pos += len;
+                break;
+            }
+            case kArray:
+            case kObject:
+                ++str;
+                ++depth;
+                break;
+            case kEndArray:
+            case kEndObject:
+                ++str;
+                --depth;
+                break;
+            case kComma:
+            case kColon:
+                ++str;
+                break;
+            case kIllegal:
+                return -1;
+        }
+    } while (depth > 0);
+
+    if (str > end || depth < 0) {
+        return -1;
+    }
+    return (int)pos;
+}
@@ -30,6 +30,16 @@ int CollateJSON(const sized_buf *buf1,
                 const sized_buf *buf2,
                 CollateJSONMode mode);
 
+/**
+ * Writes a sort key of a UTF-8 JSON value to out: bytes that compare with
+ * memcmp as CollateJSON compares the values in kCollateJSON_Unicode mode.
+ * The key of a value is never a prefix of another's, so bytes can follow
+ * it and still compare after it. Returns its length, or -1 if it's longer
+ * than size, or if the value isn't JSON as CollateJSON expects it or has a
+ * string that isn't valid UTF-8.
+ */
+int CollateJSONSortKey(const sized_buf *json, char *out, size_t size);
+
 /* not part of the API -- exposed for testing only (see collate_json_test.c) */
 char ConvertJSONEscape(const char **in);
 
@@ -0,0 +1,49 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+#include "collator.h"
+#include <stdio.h>
+
+namespace {
+    struct thread_collator {
+        UCollator* coll;
+        bool failed;                // don't retry on every comparison
+        thread_collator() : coll(NULL), failed(false) {}
+        ~thread_collator() {
+            if (coll) {
+                ucol_close(coll);
+            }
+        }
+    };
+    thread_local thread_collator collator;
+}
+
+UCollator *view_collator(void)
+{
+    if (!collator.coll && !collator.failed) {
+        UErrorCode status = U_ZERO_ERROR;
+        collator.coll = ucol_open("", &status);
+        if (U_FAILURE(status)) {
+            fprintf(stderr, "CouchStore CollateJSON: Couldn't initialize ICU (%d)\n", (int)status);
+            if (collator.coll) {
+                ucol_close(collator.coll);
+                collator.coll = NULL;
+            }
+            collator.failed = true;
+        }
+    }
+    return collator.coll;
+}
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+#ifndef _VIEW_COLLATOR_H
+#define _VIEW_COLLATOR_H
+
+#include "config.h"
+#include <unicode/ucol.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /*
+     * Returns the calling thread's ICU root collator, which view keys are
+     * collated with, or NULL if ICU couldn't open one. Each thread opens
+     * its own the first time, and it's closed when the thread exits, so
+     * the sorter's and the builders' threads never share one.
+     */
+    UCollator *view_collator(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,46 +21,73 @@
 #include "bitmap.h"
 #include "values.h"
 #include "compaction.h"
+#include "reductions.h"
 #include "../couch_btree.h"
 
 int view_id_btree_filter(const sized_buf *k, const sized_buf *v,
                                              const bitmap_t *bm)
 {
-    int ret = 0;
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    view_id_btree_value_t *val = NULL;
+    couchstore_error_t errcode;
+    view_id_btree_value_view_t val;
     (void) k;
 
-    errcode = decode_view_id_btree_value(v->buf, v->size, &val);
+    errcode = view_id_btree_value_view(v->buf, v->size, &val);
     if (errcode != COUCHSTORE_SUCCESS) {
-        ret = (int) errcode;
-        goto cleanup;
+        return (int) errcode;
     }
 
-    ret = is_bit_set(bm, val->partition);
-
-cleanup:
-    free_view_id_btree_value(val);
-    return ret;
+    return is_bit_set(bm, val.partition);
 }
 
 int view_btree_filter(const sized_buf *k, const sized_buf *v,
                                           const bitmap_t *bm)
 {
-    int ret = 0;
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
-    view_btree_value_t *val = NULL;
+    couchstore_error_t errcode;
+    view_btree_value_view_t val;
     (void) k;
 
-    errcode = decode_view_btree_value(v->buf, v->size, &val);
+    errcode = view_btree_value_view(v->buf, v->size, &val);
     if (errcode != COUCHSTORE_SUCCESS) {
-        ret = (int) errcode;
-        goto cleanup;
+        return (int) errcode;
+    }
+
+    return is_bit_set(bm, val.partition);
+}
+
+int view_id_btree_filter_kp(const node_pointer *ptr, const bitmap_t *bm,
+                                                     uint64_t *count)
+{
+    int ret;
+    view_id_btree_reduction_t *r = NULL;
+
+    ret = (int) decode_view_id_btree_reduction(ptr->reduce_value.buf, &r);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+
+    *count = r->kv_count;
+    ret = bm == NULL || !bitmap_intersects(bm, &r->partitions_bitmap);
+    free_view_id_btree_reduction(r);
+
+    return ret;
+}
+
+int view_btree_filter_kp(const node_pointer *ptr, const bitmap_t *bm,
+                                                  uint64_t *count)
+{
+    int ret;
+    view_btree_reduction_t *r = NULL;
+
+    ret = (int) decode_view_btree_reduction(ptr->reduce_value.buf,
+                                            ptr->reduce_value.size,
+                                            &r);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
     }
 
-    ret = is_bit_set(bm, val->partition);
+    *count = r->kv_count;
+    ret = bm == NULL || !bitmap_intersects(bm, &r->partitions_bitmap);
+    free_view_btree_reduction(r);
 
-cleanup:
-    free_view_btree_value(val);
     return ret;
 }
@@ -37,6 +37,13 @@ extern "C" {
     typedef int (*compact_filter_fn)(const sized_buf *k, const sized_buf *v,
                                                          const bitmap_t *bm);
 
+    /* Whether no item under a KP entry would be filtered out, from the
+       partitions of its reduction: 1 if so, with *count set to the
+       reduction's count, 0 if some may be, or a negative error code */
+    typedef int (*compact_filter_kp_fn)(const node_pointer *ptr,
+                                        const bitmap_t *bm,
+                                        uint64_t *count);
+
     /* Function spec for updating compactor progress */
     typedef void (*stats_update_fn)(uint64_t freq, uint64_t inserted);
 
@@ -52,7 +59,9 @@ extern "C" {
         arena *transient_arena;
         const bitmap_t *filterbm;
         compact_filter_fn filter_fun;
+        compact_filter_kp_fn filter_kp_fun;
         compactor_stats_t *stats;
+        cb_mutex_t *stats_mutex;    /* of stats shared by several threads */
     } view_compact_ctx_t;
 
     int view_id_btree_filter(const sized_buf *k, const sized_buf *v,
@@ -61,6 +70,12 @@ extern "C" {
     int view_btree_filter(const sized_buf *k, const sized_buf *v,
                                               const bitmap_t *bm);
 
+    int view_id_btree_filter_kp(const node_pointer *ptr, const bitmap_t *bm,
+                                                         uint64_t *count);
+
+    int view_btree_filter_kp(const node_pointer *ptr, const bitmap_t *bm,
+                                                      uint64_t *count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,6 +26,7 @@ static file_merger_error_t merge_view_files(const char *source_files[],
                                             unsigned num_source_files,
                                             const char *dest_path,
                                             view_file_merge_ctx_t *ctx);
+static int keep_last_record(void *records[], unsigned n, void *ctx);
 
 
 LIBCOUCHSTORE_API
@@ -36,6 +37,8 @@ file_merger_error_t merge_view_kvs_ops_files(const char *source_files[],
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_key_cmp;
+    ctx.key_cmp_ctx = NULL;
+    ctx.sort_key_fun = view_key_sort_key;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
     return merge_view_files(source_files, num_source_files, dest_path, &ctx);
@@ -50,12 +53,27 @@ file_merger_error_t merge_view_ids_ops_files(const char *source_files[],
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_id_cmp;
+    ctx.key_cmp_ctx = NULL;
+    ctx.sort_key_fun = NULL;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
     return merge_view_files(source_files, num_source_files, dest_path, &ctx);
 }
 
 
+/*
+ * Records of the same key and operation are the same change logged more
+ * than once; only one must reach the btree update, which inserts every
+ * record it's given.
+ */
+static int keep_last_record(void *records[], unsigned n, void *ctx)
+{
+    (void) records;
+    (void) ctx;
+    return (int) n - 1;
+}
+
+
 static file_merger_error_t merge_view_files(const char *source_files[],
                                             unsigned num_source_files,
                                             const char *dest_path,
@@ -63,5 +81,5 @@ static file_merger_error_t merge_view_files(const char *source_files[],
 {
     return merge_files(source_files, num_source_files, dest_path,
                        read_view_record, write_view_record, NULL, compare_view_records,
-                       free_view_record, 0, ctx);
+                       free_view_record, keep_last_record, 0, 0, 0, ctx);
 }
@@ -21,9 +21,13 @@
 #include "file_sorter.h"
 #include "util.h"
 #include "spatial.h"
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
-#define SORT_MAX_BUFFER_SIZE       (64 * 1024 * 1024)
+#define SORT_MEMORY_BUDGET         (192 * 1024 * 1024)
 #define SORT_MAX_NUM_TMP_FILES     16
+#define SORT_MAX_THREADS           16
 
 
 static file_sorter_error_t do_sort_file(const char *file_path,
@@ -39,6 +43,8 @@ file_sorter_error_t sort_view_kvs_ops_file(const char *file_path,
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_key_cmp;
+    ctx.key_cmp_ctx = NULL;
+    ctx.sort_key_fun = view_key_sort_key;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
     return do_sort_file(file_path, tmp_dir, NULL, 0, &ctx);
@@ -54,6 +60,8 @@ file_sorter_error_t sort_view_kvs_file(const char *file_path,
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_key_cmp;
+    ctx.key_cmp_ctx = NULL;
+    ctx.sort_key_fun = view_key_sort_key;
     ctx.type = INITIAL_BUILD_VIEW_RECORD;
     ctx.user_ctx = user_ctx;
 
@@ -68,6 +76,8 @@ file_sorter_error_t sort_view_ids_ops_file(const char *file_path,
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_id_cmp;
+    ctx.key_cmp_ctx = NULL;
+    ctx.sort_key_fun = NULL;
     ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
     return do_sort_file(file_path, tmp_dir, NULL, 0, &ctx);
@@ -83,6 +93,8 @@ file_sorter_error_t sort_view_ids_file(const char *file_path,
     view_file_merge_ctx_t ctx;
 
     ctx.key_cmp_fun = view_id_cmp;
+    ctx.key_cmp_ctx = NULL;
+    ctx.sort_key_fun = NULL;
     ctx.type = INITIAL_BUILD_VIEW_RECORD;
     ctx.user_ctx = user_ctx;
 
@@ -94,24 +106,79 @@ LIBCOUCHSTORE_API
 file_sorter_error_t sort_spatial_kvs_file(const char *file_path,
                                           const char *tmp_dir,
                                           const double *mbb,
-                                          const uint16_t mbb_num)
+                                          const uint16_t mbb_num,
+                                          spatial_order_t order,
+                                          file_merger_feed_record_t callback,
+                                          void *user_ctx)
 {
     file_sorter_error_t ret;
     view_file_merge_ctx_t ctx;
-    scale_factor_t *user_ctx = spatial_scale_factor(mbb, mbb_num/2,
-                                                    ZCODE_MAX_VALUE);
+    scale_factor_t *sf = spatial_scale_factor(mbb, mbb_num/2,
+                                              ZCODE_MAX_VALUE);
+
+    if (sf == NULL) {
+        return FILE_SORTER_ERROR_ALLOC;
+    }
+    sf->order = order;
 
     ctx.key_cmp_fun = spatial_key_cmp;
+    ctx.key_cmp_ctx = (void *)sf;
+    ctx.sort_key_fun = spatial_key_sort_key;
     ctx.type = INITIAL_BUILD_SPATIAL_RECORD;
-    ctx.user_ctx = (void *)user_ctx;
+    ctx.user_ctx = user_ctx;
+
+    ret = do_sort_file(file_path, tmp_dir, callback, callback != NULL, &ctx);
+
+    free_spatial_scale_factor(sf);
+    return ret;
+}
+
+
+LIBCOUCHSTORE_API
+file_sorter_error_t sort_spatial_kvs_ops_file(const char *file_path,
+                                              const char *tmp_dir,
+                                              const double *mbb,
+                                              const uint16_t mbb_num,
+                                              spatial_order_t order)
+{
+    file_sorter_error_t ret;
+    view_file_merge_ctx_t ctx;
+    scale_factor_t *sf = spatial_scale_factor(mbb, mbb_num/2,
+                                              ZCODE_MAX_VALUE);
+
+    if (sf == NULL) {
+        return FILE_SORTER_ERROR_ALLOC;
+    }
+    sf->order = order;
+
+    ctx.key_cmp_fun = spatial_key_cmp;
+    ctx.key_cmp_ctx = (void *)sf;
+    ctx.sort_key_fun = spatial_key_sort_key;
+    ctx.type = INCREMENTAL_UPDATE_VIEW_RECORD;
 
     ret = do_sort_file(file_path, tmp_dir, NULL, 0, &ctx);
 
-    free_spatial_scale_factor(user_ctx);
+    free_spatial_scale_factor(sf);
     return ret;
 }
 
 
+/* One sorting thread per core, up to SORT_MAX_THREADS. */
+static unsigned sort_threads(void)
+{
+#if !defined(WIN32) && defined(_SC_NPROCESSORS_ONLN)
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > SORT_MAX_THREADS) {
+        return SORT_MAX_THREADS;
+    }
+    if (cores > 0) {
+        return (unsigned) cores;
+    }
+#endif
+    return 2;
+}
+
+
 static file_sorter_error_t do_sort_file(const char *file_path,
                                         const char *tmp_dir,
                                         file_merger_feed_record_t callback,
@@ -121,11 +188,16 @@ static file_sorter_error_t do_sort_file(const char *file_path,
     return sort_file(file_path,
                      tmp_dir,
                      SORT_MAX_NUM_TMP_FILES,
-                     SORT_MAX_BUFFER_SIZE,
+                     SORT_MEMORY_BUDGET,
+                     sort_threads(),
+                     0,
+                     1,
                      read_view_record,
+                     read_view_record_slab,
                      write_view_record,
                      callback,
                      compare_view_records,
+                     view_record_sort_key,
                      free_view_record,
                      skip_writeback,
                      ctx);
@@ -24,6 +24,7 @@
 #include "config.h"
 #include <libcouchstore/visibility.h>
 #include "../file_sorter.h"
+#include "spatial.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,13 +65,30 @@ extern "C" {
                                            void *user_ctx);
 
     /*
-     * Sort a file containing records for a spatial index.
+     * Sort a file containing records for a spatial index, along the
+     * Z-curve or Hilbert curve, as order has it, through the enclosing
+     * MBB given.
      */
     LIBCOUCHSTORE_API
     file_sorter_error_t sort_spatial_kvs_file(const char *file_path,
                                               const char *tmp_dir,
                                               const double *mbb,
-                                              const uint16_t mbb_num);
+                                              const uint16_t mbb_num,
+                                              spatial_order_t order,
+                                              file_merger_feed_record_t callback,
+                                              void *user_ctx);
+
+    /*
+     * Sort a file containing records of btree operations for a spatial
+     * index, along the curve through the enclosing MBB given, which
+     * must be the one its btree's keys are ordered along.
+     */
+    LIBCOUCHSTORE_API
+    file_sorter_error_t sort_spatial_kvs_ops_file(const char *file_path,
+                                                  const char *tmp_dir,
+                                                  const double *mbb,
+                                                  const uint16_t mbb_num,
+                                                  spatial_order_t order);
 
     /* Record file sorter */
     typedef file_sorter_error_t (*sort_record_fn)(const char *file_path,
@@ -63,7 +63,7 @@ couchstore_error_t decode_index_header(const char *bytes,
         return COUCHSTORE_ERROR_CORRUPT;
     }
 
-    b = uncomp = (char *) malloc(uncompLen);
+    b = uncomp = (char *) cs_malloc(uncompLen);
     if (b == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -72,7 +72,7 @@ couchstore_error_t decode_index_header(const char *bytes,
         goto alloc_error;
     }
 
-    h = (index_header_t *) malloc(sizeof(index_header_t));
+    h = (index_header_t *) cs_malloc(sizeof(index_header_t));
     if (h == NULL) {
         goto alloc_error;
     }
@@ -84,6 +84,7 @@ couchstore_error_t decode_index_header(const char *bytes,
     h->pending_transition.passive = NULL;
     h->pending_transition.unindexable = NULL;
     h->unindexable_seqs = NULL;
+    h->part_versions = NULL;
     memcpy(h->signature, bytes, 16);
 
     h->version = (uint8_t) b[0];
@@ -103,7 +104,7 @@ couchstore_error_t decode_index_header(const char *bytes,
     b += 2;
 
     h->seqs = sorted_list_create(part_seq_cmp);
-    if (h->seqs == NULL) {
+    if (h->seqs == NULL || sorted_list_reserve(h->seqs, num_seqs) != 0) {
         goto alloc_error;
     }
 
@@ -128,7 +129,7 @@ couchstore_error_t decode_index_header(const char *bytes,
     h->num_views = (uint8_t) b[0];
     b += 1;
 
-    h->view_btree_states = (node_pointer **) malloc(sizeof(node_pointer *) * h->num_views);
+    h->view_btree_states = (node_pointer **) cs_malloc(sizeof(node_pointer *) * h->num_views);
     if (h->view_btree_states == NULL) {
         goto alloc_error;
     }
@@ -146,7 +147,8 @@ couchstore_error_t decode_index_header(const char *bytes,
     sz = dec_uint16(b);
     b += 2;
     h->replicas_on_transfer = sorted_list_create(part_id_cmp);
-    if (h->replicas_on_transfer == NULL) {
+    if (h->replicas_on_transfer == NULL ||
+        sorted_list_reserve(h->replicas_on_transfer, sz) != 0) {
         goto alloc_error;
     }
 
@@ -163,7 +165,8 @@ couchstore_error_t decode_index_header(const char *bytes,
     b += 2;
 
     h->pending_transition.active = sorted_list_create(part_id_cmp);
-    if (h->pending_transition.active == NULL) {
+    if (h->pending_transition.active == NULL ||
+        sorted_list_reserve(h->pending_transition.active, sz) != 0) {
         goto alloc_error;
     }
 
@@ -181,7 +184,8 @@ couchstore_error_t decode_index_header(const char *bytes,
     b += 2;
 
     h->pending_transition.passive = sorted_list_create(part_id_cmp);
-    if (h->pending_transition.passive == NULL) {
+    if (h->pending_transition.passive == NULL ||
+        sorted_list_reserve(h->pending_transition.passive, sz) != 0) {
         goto alloc_error;
     }
 
@@ -199,7 +203,8 @@ couchstore_error_t decode_index_header(const char *bytes,
     b += 2;
 
     h->pending_transition.unindexable = sorted_list_create(part_id_cmp);
-    if (h->pending_transition.unindexable == NULL) {
+    if (h->pending_transition.unindexable == NULL ||
+        sorted_list_reserve(h->pending_transition.unindexable, sz) != 0) {
         goto alloc_error;
     }
 
@@ -217,7 +222,8 @@ couchstore_error_t decode_index_header(const char *bytes,
     b += 2;
 
     h->unindexable_seqs = sorted_list_create(part_seq_cmp);
-    if (h->unindexable_seqs == NULL) {
+    if (h->unindexable_seqs == NULL ||
+        sorted_list_reserve(h->unindexable_seqs, num_seqs) != 0) {
         goto alloc_error;
     }
 
@@ -239,7 +245,8 @@ couchstore_error_t decode_index_header(const char *bytes,
         b += 2;
 
         h->part_versions = sorted_list_create(part_versions_cmp);
-        if (h->part_versions == NULL) {
+        if (h->part_versions == NULL ||
+            sorted_list_reserve(h->part_versions, num_part_versions) != 0) {
             goto alloc_error;
         }
 
@@ -250,7 +257,7 @@ couchstore_error_t decode_index_header(const char *bytes,
             b += 2;
             pver.num_failover_log = dec_uint16(b);
             b += 2;
-            pver.failover_log = (failover_log_t *) malloc(
+            pver.failover_log = (failover_log_t *) cs_malloc(
                 sizeof(failover_log_t) * pver.num_failover_log);
 
             if (pver.failover_log == NULL) {
@@ -264,20 +271,20 @@ couchstore_error_t decode_index_header(const char *bytes,
                 b += 8;
             }
             if (sorted_list_add(h->part_versions, &pver, sizeof(pver)) != 0) {
-                free(pver.failover_log);
+                cs_free(pver.failover_log);
                 goto alloc_error;
             }
         }
     }
 
-    free(uncomp);
+    cs_free(uncomp);
     *header = h;
 
     return COUCHSTORE_SUCCESS;
 
  alloc_error:
     free_index_header(h);
-    free(uncomp);
+    cs_free(uncomp);
     return COUCHSTORE_ERROR_ALLOC_FAIL;
 }
 
@@ -353,7 +360,7 @@ couchstore_error_t encode_index_header(const index_header_t *header,
         sz += size_of_partition_versions(header->part_versions);
     }
 
-    b = buf = (char *) malloc(sz);
+    b = buf = (char *) cs_malloc(sz);
     if (buf == NULL) {
         goto alloc_error;
     }
@@ -412,7 +419,7 @@ couchstore_error_t encode_index_header(const index_header_t *header,
     }
 
     comp_size = snappy_max_compressed_length(sz);
-    comp = (char *) malloc(16 + comp_size);
+    comp = (char *) cs_malloc(16 + comp_size);
 
     if (comp == NULL) {
         goto alloc_error;
@@ -422,19 +429,19 @@ couchstore_error_t encode_index_header(const index_header_t *header,
 
     if (res != SNAPPY_OK) {
         /* TODO: a new error for couchstore_error_t */
-        free(comp);
+        cs_free(comp);
         goto alloc_error;
     }
 
     memcpy(comp, header->signature, 16);
     *buffer = comp;
     *buffer_size = 16 + comp_size;
-    free(buf);
+    cs_free(buf);
 
     return COUCHSTORE_SUCCESS;
 
  alloc_error:
-    free(buf);
+    cs_free(buf);
     *buffer = NULL;
     *buffer_size = 0;
     return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -450,13 +457,13 @@ void free_index_header(index_header_t *header)
     }
 
     sorted_list_free(header->seqs);
-    free(header->id_btree_state);
+    cs_free(header->id_btree_state);
 
     if (header->view_btree_states != NULL) {
         for (i = 0; i < header->num_views; ++i) {
-            free(header->view_btree_states[i]);
+            cs_free(header->view_btree_states[i]);
         }
-        free(header->view_btree_states);
+        cs_free(header->view_btree_states);
     }
 
     sorted_list_free(header->replicas_on_transfer);
@@ -468,15 +475,20 @@ void free_index_header(index_header_t *header)
         free_part_versions(header->part_versions);
     }
 
-    free(header);
+    cs_free(header);
 }
 
 static void free_part_versions(part_version_t *part_versions) {
-    void *it = sorted_list_iterator(part_versions);
+    void *it;
     part_version_t *pver = NULL;
+
+    if (part_versions == NULL) {
+        return;
+    }
+    it = sorted_list_iterator(part_versions);
     pver = sorted_list_next(it);
     while (pver != NULL) {
-        free(pver->failover_log);
+        cs_free(pver->failover_log);
         pver = sorted_list_next(it);
     }
     sorted_list_free_iterator(it);
@@ -34,7 +34,12 @@ extern "C" {
 #endif
 
 
-#define LATEST_INDEX_HEADER_VERSION 2
+#define LATEST_INDEX_HEADER_VERSION 3
+
+/* Groups with headers from this version on may have view btree reductions
+   with compact partition bitmaps (see encode_view_btree_reduction_compact).
+   The header itself is the same as version 2's. */
+#define INDEX_HEADER_COMPACT_BITMAPS_VERSION 3
 
 typedef struct {
     uint16_t part_id;
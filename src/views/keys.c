@@ -5,7 +5,7 @@
 #include <stdlib.h>
 
 
-#define dec_uint16(b) (decode_raw16(*((raw_16 *) b)))
+#define dec_uint16(b) (decode_raw16(*((raw_16 *) (b))))
 
 static void enc_uint16(uint16_t u, char **buf);
 
@@ -17,7 +17,7 @@ couchstore_error_t decode_view_btree_key(const char *bytes,
     view_btree_key_t *k = NULL;
     uint16_t sz;
 
-    k = (view_btree_key_t *) malloc(sizeof(view_btree_key_t));
+    k = (view_btree_key_t *) cs_malloc(sizeof(view_btree_key_t));
     if (k == NULL) {
         goto alloc_error;
     }
@@ -31,7 +31,7 @@ couchstore_error_t decode_view_btree_key(const char *bytes,
     len -= 2;
 
     k->json_key.size = sz;
-    k->json_key.buf = (char *) malloc(sz);
+    k->json_key.buf = (char *) cs_malloc(sz);
 
     if (k->json_key.buf == NULL) {
         goto alloc_error;
@@ -45,7 +45,7 @@ couchstore_error_t decode_view_btree_key(const char *bytes,
 
     k->doc_id.size = len;
 
-    k->doc_id.buf = (char *) malloc(len);
+    k->doc_id.buf = (char *) cs_malloc(len);
 
 
     if (k->doc_id.buf == NULL) {
@@ -64,6 +64,60 @@ couchstore_error_t decode_view_btree_key(const char *bytes,
 }
 
 
+couchstore_error_t decode_view_btree_key_in_arena(const char *bytes,
+                                                  size_t len,
+                                                  arena *a,
+                                                  view_btree_key_t **key)
+{
+    view_btree_key_t *k;
+    uint16_t sz;
+
+    assert(len >= 2);
+    k = (view_btree_key_t *) arena_alloc(a, sizeof(view_btree_key_t));
+    if (k == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    sz = dec_uint16(bytes);
+    bytes += 2;
+    len -= 2;
+
+    assert(len >= sz);
+    k->json_key.size = sz;
+    k->json_key.buf = (char *) bytes;
+    k->doc_id.size = len - sz;
+    k->doc_id.buf = (char *) bytes + sz;
+
+    *key = k;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+couchstore_error_t view_btree_key_view(const char *bytes,
+                                       size_t len,
+                                       view_btree_key_t *key)
+{
+    uint16_t sz;
+
+    if (len < 2) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    sz = dec_uint16(bytes);
+    bytes += 2;
+    len -= 2;
+    if (len < sz) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    key->json_key.size = sz;
+    key->json_key.buf = (char *) bytes;
+    key->doc_id.size = len - sz;
+    key->doc_id.buf = (char *) bytes + sz;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
 couchstore_error_t encode_view_btree_key(const view_btree_key_t *key,
                                          char **buffer,
                                          size_t *buffer_size)
@@ -75,7 +129,7 @@ couchstore_error_t encode_view_btree_key(const view_btree_key_t *key,
     sz += key->json_key.size;
     sz += key->doc_id.size;
 
-    b = buf = (char *) malloc(sz);
+    b = buf = (char *) cs_malloc(sz);
     if (buf == NULL) {
         goto alloc_error;
     }
@@ -93,7 +147,7 @@ couchstore_error_t encode_view_btree_key(const view_btree_key_t *key,
     return COUCHSTORE_SUCCESS;
 
  alloc_error:
-    free(buf);
+    cs_free(buf);
     *buffer = NULL;
     *buffer_size = 0;
     return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -106,9 +160,9 @@ void free_view_btree_key(view_btree_key_t *key)
         return;
     }
 
-    free(key->json_key.buf);
-    free(key->doc_id.buf);
-    free(key);
+    cs_free(key->json_key.buf);
+    cs_free(key->doc_id.buf);
+    cs_free(key);
 }
 
 
@@ -118,7 +172,7 @@ couchstore_error_t decode_view_id_btree_key(const char *bytes,
 {
     view_id_btree_key_t *k = NULL;
 
-    k = (view_id_btree_key_t *) malloc(sizeof(view_id_btree_key_t));
+    k = (view_id_btree_key_t *) cs_malloc(sizeof(view_id_btree_key_t));
     if (k == NULL) {
         goto alloc_error;
     }
@@ -132,7 +186,7 @@ couchstore_error_t decode_view_id_btree_key(const char *bytes,
 
     k->doc_id.size = len;
 
-    k->doc_id.buf = (char *) malloc(len);
+    k->doc_id.buf = (char *) cs_malloc(len);
 
     if (k->doc_id.buf == NULL) {
         goto alloc_error;
@@ -150,6 +204,21 @@ couchstore_error_t decode_view_id_btree_key(const char *bytes,
 }
 
 
+couchstore_error_t view_id_btree_key_view(const char *bytes,
+                                          size_t len,
+                                          view_id_btree_key_t *key)
+{
+    if (len < 2) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    key->partition = dec_uint16(bytes);
+    key->doc_id.size = len - 2;
+    key->doc_id.buf = (char *) bytes + 2;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
 couchstore_error_t encode_view_id_btree_key(const view_id_btree_key_t *key,
                                             char **buffer,
                                             size_t *buffer_size)
@@ -160,7 +229,7 @@ couchstore_error_t encode_view_id_btree_key(const view_id_btree_key_t *key,
     sz += 2;             /* uint16_t */
     sz += key->doc_id.size;
 
-    b = buf = (char *) malloc(sz);
+    b = buf = (char *) cs_malloc(sz);
     if (buf == NULL) {
         goto alloc_error;
     }
@@ -176,7 +245,7 @@ couchstore_error_t encode_view_id_btree_key(const view_id_btree_key_t *key,
     return COUCHSTORE_SUCCESS;
 
  alloc_error:
-    free(buf);
+    cs_free(buf);
     *buffer = NULL;
     *buffer_size = 0;
     return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -189,8 +258,8 @@ void free_view_id_btree_key(view_id_btree_key_t *key)
         return;
     }
 
-    free(key->doc_id.buf);
-    free(key);
+    cs_free(key->doc_id.buf);
+    cs_free(key);
 }
 
 static void enc_uint16(uint16_t u, char **buf)
@@ -7,6 +7,7 @@
 #include <libcouchstore/visibility.h>
 #include <libcouchstore/couch_db.h>
 #include <libcouchstore/couch_common.h>
+#include "../arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +35,20 @@ couchstore_error_t encode_view_btree_key(const view_btree_key_t *key,
 
 void free_view_btree_key(view_btree_key_t *key);
 
+/* Decodes a key allocated from arena a, pointing into bytes rather than
+   copying them (see decode_view_btree_value_in_arena). */
+couchstore_error_t decode_view_btree_key_in_arena(const char *bytes,
+                                                  size_t len,
+                                                  arena *a,
+                                                  view_btree_key_t **key);
+
+/* Parses a key into the caller's struct, pointing into bytes like
+   view_btree_value_view. Returns COUCHSTORE_ERROR_CORRUPT if it's cut
+   short. */
+couchstore_error_t view_btree_key_view(const char *bytes,
+                                       size_t len,
+                                       view_btree_key_t *key);
+
 couchstore_error_t decode_view_id_btree_key(const char *bytes,
                                             size_t len,
                                             view_id_btree_key_t **key);
@@ -44,6 +59,10 @@ couchstore_error_t encode_view_id_btree_key(const view_id_btree_key_t *key,
 
 void free_view_id_btree_key(view_id_btree_key_t *key);
 
+couchstore_error_t view_id_btree_key_view(const char *bytes,
+                                          size_t len,
+                                          view_id_btree_key_t *key);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Where map functions' emits are collected. This is a private header, do
+ * not include it in other applications/libraries.
+ **/
+
+#ifndef _EMIT_BUFFER_H
+#define _EMIT_BUFFER_H
+
+#include "mapreduce.h"
+#include "../../alloc.h"
+#include <string.h>
+#include <new>
+#include <vector>
+
+/* A buffer keeps up to this much of its memory when cleared */
+#define EMIT_BUFFER_MAX_KEPT (1024 * 1024)
+
+/* The rows emitted for a document, each key's JSON then its value's, one
+   after the other in a single buffer. A context keeps one from document
+   to document, so emitting doesn't allocate once it's grown. Throws
+   std::bad_alloc. */
+class EmitBuffer {
+public:
+    size_t rows() const {
+        return ends.size() / 2;
+    }
+
+    /* Room for the next key's or value's JSON, length bytes */
+    char *append(size_t length) {
+        size_t at = json.size();
+        json.resize(at + length);
+        ends.push_back(at + length);
+        return length > 0 ? &json[at] : NULL;
+    }
+
+    void append(const char *p, size_t length) {
+        if (length > 0) {
+            memcpy(append(length), p, length);
+        } else {
+            append(0);
+        }
+    }
+
+    /* Drops the rows after the first n, and any key after them without
+       its value */
+    void truncate(size_t n) {
+        json.resize(n > 0 ? ends[2 * n - 1] : 0);
+        ends.resize(2 * n);
+    }
+
+    /* Copies the rows from begin to end to a list allocated all at once,
+       their JSON after the array, for a single cs_free. */
+    void copyRows(size_t begin, size_t end, mapreduce_kv_list_t *list) const {
+        size_t n = end - begin;
+        size_t from = rowStart(begin);
+        size_t to = rowStart(end);
+        size_t sz = sizeof(mapreduce_kv_t) * n + (to - from);
+        mapreduce_kv_t *kvs = (mapreduce_kv_t *) cs_malloc(sz > 0 ? sz : 1);
+
+        if (kvs == NULL) {
+            throw std::bad_alloc();
+        }
+        char *p = (char *) (kvs + n);
+        if (to > from) {
+            memcpy(p, &json[from], to - from);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            size_t r = begin + i;
+            size_t start = rowStart(r);
+
+            kvs[i].key.json = p + (start - from);
+            kvs[i].key.length = (int) (ends[2 * r] - start);
+            kvs[i].value.json = p + (ends[2 * r] - from);
+            kvs[i].value.length = (int) (ends[2 * r + 1] - ends[2 * r]);
+        }
+        list->kvs = kvs;
+        list->length = (int) n;
+    }
+
+    void clear() {
+        if (json.capacity() > EMIT_BUFFER_MAX_KEPT) {
+            std::vector<char>().swap(json);
+            std::vector<size_t>().swap(ends);
+        } else {
+            json.clear();
+            ends.clear();
+        }
+    }
+
+private:
+    size_t rowStart(size_t r) const {
+        return r > 0 ? ends[2 * r - 1] : 0;
+    }
+
+    std::vector<char> json;
+    /* Where each key's and value's JSON ends */
+    std::vector<size_t> ends;
+};
+
+#endif
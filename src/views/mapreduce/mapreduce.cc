@@ -18,18 +18,29 @@
 
 #include "mapreduce.h"
 #include "mapreduce_internal.h"
+#include "../../alloc.h"
+#include "../../file_name_utils.h"
 #include <iostream>
+#include <cstdio>
 #include <cstring>
+#include <new>
 #include <stdlib.h>
 #include <v8.h>
 
 
 using namespace v8;
 
+// The global helper functions (see JS_HELPERS)
+#define NUM_JS_HELPERS 3
+
 typedef struct {
     Persistent<Object>    jsonObject;
     Persistent<Function>  jsonParseFun;
     Persistent<Function>  stringifyFun;
+    // Each helper, once compiled or assigned to (see getHelper)
+    Persistent<Value>     helpers[NUM_JS_HELPERS];
+    // Of the documents passed unparsed (see lazyDoc)
+    Persistent<ObjectTemplate> lazyDocTemplate;
     mapreduce_ctx_t       *ctx;
 } isolate_data_t;
 
@@ -92,29 +103,115 @@ static const char *BASE64_FUNCTION_STRING =
     "    return arr;"
     "})";
 
+// Every context has these as globals. The V8 versions we build against
+// can't start a context from a snapshot of one, so rather than compiling
+// them all for each context, which most functions never use, the globals
+// are accessors that compile a helper the first time it's looked up.
+static const struct {
+    const char *name;
+    const char *source;
+} JS_HELPERS[NUM_JS_HELPERS] = {
+    { "sum", SUM_FUNCTION_STRING },
+    { "decodeBase64", BASE64_FUNCTION_STRING },
+    { "dateToArray", DATE_FUNCTION_STRING }
+};
+
+// A reduction is stringified when the reduce function returns it, and is
+// parsed back by the rereduce of the node above, usually a moment later.
+// Those whose JSON parses back to an equal value are kept for that
+// rereduce to take instead, each one only once since functions may modify
+// their arguments. What's never rereduced, such as the reductions of
+// roots, goes when the cache fills up.
+#define MAX_KEPT_REDUCTIONS        1024
+#define MAX_KEPT_REDUCTION_SIZE    4096
+#define MAX_KEPT_REDUCTION_DEPTH   16
+
+// Every context compiles its functions, and the view tools start a process
+// for each update. The V8 versions we build against can't cache compiled
+// code, but their preparser's data can be, which spares the parse of the
+// functions' bodies. It's kept in a file per function, in the code cache
+// directory, named after a hash of V8's version and the source. The file
+// holds the source, then a NUL, then the data: one whose source differs,
+// for a hash that collided, is ignored.
+#define CODE_CACHE_ENV_VAR          "MAPREDUCE_CODE_CACHE_DIR"
+
+static std::string codeCacheDir;
+static bool codeCacheDirSet = false;
+
+// With lazy documents, map functions get a document as an object whose
+// members are parsed from its JSON as they're looked up, and kept. The
+// whole of it is parsed, and the members put in JSON order, as soon as a
+// function does anything else with it: assigns, deletes, enumerates or
+// asks after a member, or looks up too many (each lookup goes through the
+// JSON).
+#define LAZY_DOC_MAX_LOOKUPS        4
+
+static volatile bool lazyDocs = false;
 
 
 #ifdef V8_POST_3_19_API
 static Local<Context> createJsContext();
 static void emit(const v8::FunctionCallbackInfo<Value> &args);
+static void getHelper(Local<String> name,
+                      const PropertyCallbackInfo<Value> &info);
+static void setHelper(Local<String> name,
+                      Local<Value> value,
+                      const PropertyCallbackInfo<void> &info);
 #else
 static Persistent<Context> createJsContext();
 static Handle<Value> emit(const Arguments &args);
+static Handle<Value> getHelper(Local<String> name, const AccessorInfo &info);
+static void setHelper(Local<String> name,
+                      Local<Value> value,
+                      const AccessorInfo &info);
 #endif
 
+static Handle<ObjectTemplate> createLazyDocTemplate();
+static Handle<Value> lazyDoc(const mapreduce_json_t &doc);
+static Handle<Value> lazyDocGet(Handle<Object> doc, Handle<String> name);
+static void lazyDocParse(Handle<Object> doc);
+
 static void doInitContext(mapreduce_ctx_t *ctx);
+static bool mapDocNatively(mapreduce_ctx_t *ctx,
+                           const mapreduce_json_t &doc,
+                           const mapreduce_json_t &meta,
+                           mapreduce_map_result_list_t *results);
+static void setMapResult(const EmitBuffer &kvs,
+                         size_t begin,
+                         size_t end,
+                         mapreduce_map_result_t *mapResult);
+static void mapDocInContext(mapreduce_ctx_t *ctx,
+                            const mapreduce_json_t &doc,
+                            const mapreduce_json_t &meta,
+                            mapreduce_map_result_list_t *results);
 static Handle<Function> compileFunction(const std::string &function);
+static std::string preparseDataPath(const std::string &dir,
+                                    const std::string &source);
+static ScriptData *loadPreparseData(const std::string &path,
+                                    const std::string &source);
+static void storePreparseData(const std::string &dir,
+                              const std::string &path,
+                              const std::string &source,
+                              const Handle<String> &jsSource);
 static std::string exceptionString(const TryCatch &tryCatch);
 static void loadFunctions(mapreduce_ctx_t *ctx,
                           const std::list<std::string> &function_sources);
 static inline isolate_data_t *getIsolateData();
+static inline Handle<Value> callStringify(const Handle<Value> &obj);
 static inline mapreduce_json_t jsonStringify(const Handle<Value> &obj);
+static inline void emitJson(const Handle<Value> &obj, EmitBuffer &kvs);
 static inline Handle<Value> jsonParse(const mapreduce_json_t &thing);
 static inline void taskStarted(mapreduce_ctx_t *ctx);
 static inline void taskFinished(mapreduce_ctx_t *ctx);
-static void freeKvListEntries(kv_list_int_t &kvs);
 static void freeJsonListEntries(json_results_list_t &list);
 static inline Handle<Array> jsonListToJsArray(const mapreduce_json_list_t &list);
+static Handle<Array> reductionsToJsArray(mapreduce_ctx_t *ctx,
+                                         const mapreduce_json_list_t &reductions);
+static bool parsesBackEqual(const Handle<Value> &value, int depth);
+static void keepReduction(mapreduce_ctx_t *ctx,
+                          const mapreduce_json_t &json,
+                          const Handle<Value> &value);
+static void clearReductions(mapreduce_ctx_t *ctx);
 
 
 void initContext(mapreduce_ctx_t *ctx,
@@ -165,7 +262,25 @@ void destroyContext(mapreduce_ctx_t *ctx)
         }
         delete ctx->functions;
 
+        if (ctx->natives != NULL) {
+            for (unsigned int i = 0; i < ctx->natives->size(); ++i) {
+                nativeMapFree((*ctx->natives)[i]);
+            }
+            delete ctx->natives;
+        }
+
+        if (ctx->reductions != NULL) {
+            clearReductions(ctx);
+            delete ctx->reductions;
+        }
+
         isolate_data_t *isoData = getIsolateData();
+        isoData->lazyDocTemplate.Dispose();
+        isoData->lazyDocTemplate.Clear();
+        for (int i = 0; i < NUM_JS_HELPERS; ++i) {
+            isoData->helpers[i].Dispose();
+            isoData->helpers[i].Clear();
+        }
         isoData->jsonObject.Dispose();
         isoData->jsonObject.Clear();
         isoData->jsonParseFun.Dispose();
@@ -209,15 +324,17 @@ static void doInitContext(mapreduce_ctx_t *ctx)
     isoData->jsonObject.Reset(ctx->isolate, jsonObject);
     isoData->jsonParseFun.Reset(ctx->isolate, parseFun);
     isoData->stringifyFun.Reset(ctx->isolate, stringifyFun);
+    isoData->lazyDocTemplate.Reset(ctx->isolate, createLazyDocTemplate());
 #else
     isoData->jsonObject = Persistent<Object>::New(jsonObject);
     isoData->jsonParseFun = Persistent<Function>::New(parseFun);
     isoData->stringifyFun = Persistent<Function>::New(stringifyFun);
+    isoData->lazyDocTemplate = Persistent<ObjectTemplate>::New(createLazyDocTemplate());
 #endif
     isoData->ctx = ctx;
 
     ctx->isolate->SetData(isoData);
-    ctx->taskStartTime = -1;
+    ctx->taskStartTime = 0;
 }
 
 
@@ -233,22 +350,16 @@ static Persistent<Context> createJsContext()
 
     Handle<ObjectTemplate> global = ObjectTemplate::New();
     global->Set(String::New("emit"), FunctionTemplate::New(emit));
+    for (int i = 0; i < NUM_JS_HELPERS; ++i) {
+        global->SetAccessor(String::New(JS_HELPERS[i].name),
+                            getHelper, setHelper, Integer::New(i));
+    }
 
 #ifdef V8_POST_3_19_API
     Handle<Context> context = Context::New(Isolate::GetCurrent(), NULL, global);
 #else
     Persistent<Context> context = Context::New(NULL, global);
 #endif
-    Context::Scope contextScope(context);
-
-    Handle<Function> sumFun = compileFunction(SUM_FUNCTION_STRING);
-    context->Global()->Set(String::New("sum"), sumFun);
-
-    Handle<Function> decodeBase64Fun = compileFunction(BASE64_FUNCTION_STRING);
-    context->Global()->Set(String::New("decodeBase64"), decodeBase64Fun);
-
-    Handle<Function> dateToArrayFun = compileFunction(DATE_FUNCTION_STRING);
-    context->Global()->Set(String::New("dateToArray"), dateToArrayFun);
 
 #ifdef V8_POST_3_19_API
     return handleScope.Close(context);
@@ -263,6 +374,10 @@ void mapDoc(mapreduce_ctx_t *ctx,
             const mapreduce_json_t &meta,
             mapreduce_map_result_list_t *results)
 {
+    if (mapDocNatively(ctx, doc, meta, results)) {
+        return;
+    }
+
     Locker locker(ctx->isolate);
     Isolate::Scope isolateScope(ctx->isolate);
 #ifdef V8_POST_3_19_API
@@ -272,7 +387,114 @@ void mapDoc(mapreduce_ctx_t *ctx,
     HandleScope handleScope;
     Context::Scope contextScope(ctx->jsContext);
 #endif
-    Handle<Value> docObject = jsonParse(doc);
+    mapDocInContext(ctx, doc, meta, results);
+}
+
+
+void mapDocs(mapreduce_ctx_t *ctx,
+             const mapreduce_json_t docs[],
+             const mapreduce_json_t metas[],
+             int num_docs,
+             mapreduce_map_result_list_t results[])
+{
+    std::vector<int> pending;
+
+    for (int i = 0; i < num_docs; ++i) {
+        if (!mapDocNatively(ctx, docs[i], metas[i], &results[i])) {
+            pending.push_back(i);
+        }
+    }
+    if (pending.empty()) {
+        return;
+    }
+
+    Locker locker(ctx->isolate);
+    Isolate::Scope isolateScope(ctx->isolate);
+#ifdef V8_POST_3_19_API
+    HandleScope handleScope(ctx->isolate);
+    Context::Scope contextScope(ctx->isolate, ctx->jsContext);
+#else
+    HandleScope handleScope;
+    Context::Scope contextScope(ctx->jsContext);
+#endif
+
+    for (size_t j = 0; j < pending.size(); ++j) {
+        int i = pending[j];
+        // Each document's handles go with it, so that a large batch
+        // doesn't hold them all.
+#ifdef V8_POST_3_19_API
+        HandleScope docScope(ctx->isolate);
+#else
+        HandleScope docScope;
+#endif
+        mapDocInContext(ctx, docs[i], metas[i], &results[i]);
+    }
+}
+
+
+// Maps a document without entering V8, if every function has a native
+// version that can map it.
+static bool mapDocNatively(mapreduce_ctx_t *ctx,
+                           const mapreduce_json_t &doc,
+                           const mapreduce_json_t &meta,
+                           mapreduce_map_result_list_t *results)
+{
+    native_doc_t ndoc;
+
+    if (!ctx->allNative || !nativeDocInit(&ndoc, doc, meta)) {
+        return false;
+    }
+
+    EmitBuffer &kvs = ctx->emitBuffer;
+    std::vector<size_t> firstRows(ctx->natives->size() + 1);
+    unsigned int i;
+
+    kvs.clear();
+    for (i = 0; i < ctx->natives->size(); ++i) {
+        firstRows[i] = kvs.rows();
+        if (!nativeMapRun((*ctx->natives)[i], ndoc, kvs)) {
+            break;
+        }
+    }
+    if (i < ctx->natives->size()) {
+        kvs.clear();
+        return false;
+    }
+    firstRows[i] = kvs.rows();
+
+    for (i = 0; i < ctx->natives->size(); ++i) {
+        setMapResult(kvs, firstRows[i], firstRows[i + 1], &results->list[i]);
+        results->length += 1;
+    }
+    kvs.clear();
+    return true;
+}
+
+
+// Copies a function's emits to its result.
+static void setMapResult(const EmitBuffer &kvs,
+                         size_t begin,
+                         size_t end,
+                         mapreduce_map_result_t *mapResult)
+{
+    kvs.copyRows(begin, end, &mapResult->result.kvs);
+    mapResult->error = MAPREDUCE_SUCCESS;
+}
+
+
+// Maps a document with the isolate and context entered.
+static void mapDocInContext(mapreduce_ctx_t *ctx,
+                            const mapreduce_json_t &doc,
+                            const mapreduce_json_t &meta,
+                            mapreduce_map_result_list_t *results)
+{
+    Handle<Value> docObject;
+    if (lazyDocs) {
+        docObject = lazyDoc(doc);
+    }
+    if (docObject.IsEmpty()) {
+        docObject = jsonParse(doc);
+    }
     Handle<Value> metaObject = jsonParse(meta);
 
     if (!metaObject->IsObject()) {
@@ -280,13 +502,30 @@ void mapDoc(mapreduce_ctx_t *ctx,
     }
 
     Handle<Value> funArgs[] = { docObject, metaObject };
+    native_doc_t ndoc;
+    int haveNativeDoc = -1;
 
     taskStarted(ctx);
-    kv_list_int_t kvs;
+    EmitBuffer &kvs = ctx->emitBuffer;
+    kvs.clear();
     ctx->kvs = &kvs;
 
     for (unsigned int i = 0; i < ctx->functions->size(); ++i) {
         mapreduce_map_result_t mapResult;
+        native_map_t *native = (*ctx->natives)[i];
+
+        // Functions mapped natively in a context that has others
+        if (native != NULL) {
+            if (haveNativeDoc < 0) {
+                haveNativeDoc = nativeDocInit(&ndoc, doc, meta);
+            }
+            if (haveNativeDoc && nativeMapRun(native, ndoc, kvs)) {
+                setMapResult(kvs, 0, kvs.rows(), &results->list[i]);
+                results->length += 1;
+                kvs.clear();
+                continue;
+            }
+        }
 #ifdef V8_POST_3_19_API
         Local<Function> fun = Local<Function>::New(ctx->isolate, *(*ctx->functions)[i]);
 #else
@@ -296,20 +535,9 @@ void mapDoc(mapreduce_ctx_t *ctx,
         Handle<Value> result = fun->Call(fun, 2, funArgs);
 
         if (!result.IsEmpty()) {
-            mapResult.error = MAPREDUCE_SUCCESS;
-            mapResult.result.kvs.length = kvs.size();
-            size_t sz = sizeof(mapreduce_kv_t) * mapResult.result.kvs.length;
-            mapResult.result.kvs.kvs = (mapreduce_kv_t *) malloc(sz);
-            if (mapResult.result.kvs.kvs == NULL) {
-                freeKvListEntries(kvs);
-                throw std::bad_alloc();
-            }
-            kv_list_int_t::iterator it = kvs.begin();
-            for (int j = 0; it != kvs.end(); ++it, ++j) {
-                mapResult.result.kvs.kvs[j] = *it;
-            }
+            setMapResult(kvs, 0, kvs.rows(), &mapResult);
         } else {
-            freeKvListEntries(kvs);
+            kvs.clear();
 
             if (!trycatch.CanContinue()) {
                 throw MapReduceError(MAPREDUCE_TIMEOUT, "timeout");
@@ -319,7 +547,7 @@ void mapDoc(mapreduce_ctx_t *ctx,
             std::string exceptString = exceptionString(trycatch);
             size_t len = exceptString.length();
 
-            mapResult.result.error_msg = (char *) malloc(len + 1);
+            mapResult.result.error_msg = (char *) cs_malloc(len + 1);
             if (mapResult.result.error_msg == NULL) {
                 throw std::bad_alloc();
             }
@@ -379,6 +607,10 @@ json_results_list_t runReduce(mapreduce_ctx_t *ctx,
         try {
             mapreduce_json_t jsonResult = jsonStringify(result);
             results.push_back(jsonResult);
+            // Another function could still modify what this one returned
+            if (ctx->functions->size() == 1) {
+                keepReduction(ctx, jsonResult, result);
+            }
         } catch(...) {
             freeJsonListEntries(results);
             throw;
@@ -436,7 +668,10 @@ mapreduce_json_t runReduce(mapreduce_ctx_t *ctx,
         throw MapReduceError(MAPREDUCE_RUNTIME_ERROR, exceptionString(trycatch));
     }
 
-    return jsonStringify(result);
+    mapreduce_json_t jsonResult = jsonStringify(result);
+    keepReduction(ctx, jsonResult, result);
+
+    return jsonResult;
 }
 
 
@@ -465,7 +700,7 @@ mapreduce_json_t runRereduce(mapreduce_ctx_t *ctx,
 #else
     Handle<Function> fun = (*ctx->functions)[reduceFunNum];
 #endif
-    Handle<Array> valuesArray = jsonListToJsArray(reductions);
+    Handle<Array> valuesArray = reductionsToJsArray(ctx, reductions);
     Handle<Value> args[] = { Null(), valuesArray, Boolean::New(true) };
 
     taskStarted(ctx);
@@ -483,27 +718,21 @@ mapreduce_json_t runRereduce(mapreduce_ctx_t *ctx,
         throw MapReduceError(MAPREDUCE_RUNTIME_ERROR, exceptionString(trycatch));
     }
 
-    return jsonStringify(result);
-}
-
+    mapreduce_json_t jsonResult = jsonStringify(result);
+    keepReduction(ctx, jsonResult, result);
 
-void terminateTask(mapreduce_ctx_t *ctx)
-{
-    V8::TerminateExecution(ctx->isolate);
-    taskFinished(ctx);
+    return jsonResult;
 }
 
 
-static void freeKvListEntries(kv_list_int_t &kvs)
+bool terminateTask(mapreduce_ctx_t *ctx, uint64_t startTime)
 {
-    kv_list_int_t::iterator it = kvs.begin();
-
-    for ( ; it != kvs.end(); ++it) {
-        mapreduce_kv_t kv = *it;
-        free(kv.key.json);
-        free(kv.value.json);
+    // Only the task that started then, not one that has started since
+    if (!ctx->taskStartTime.compare_exchange_strong(startTime, 0)) {
+        return false;
     }
-    kvs.clear();
+    V8::TerminateExecution(ctx->isolate);
+    return true;
 }
 
 
@@ -512,7 +741,7 @@ static void freeJsonListEntries(json_results_list_t &list)
     json_results_list_t::iterator it = list.begin();
 
     for ( ; it != list.end(); ++it) {
-        free((*it).json);
+        cs_free((*it).json);
     }
     list.clear();
 }
@@ -527,11 +756,29 @@ static Handle<Function> compileFunction(const std::string &funSource)
 #endif
     TryCatch trycatch;
     Handle<String> source = String::New(funSource.data(), funSource.length());
-    Handle<Script> script = Script::Compile(source);
+    std::string cacheDir, cachePath;
+    ScriptData *preparseData = NULL;
+
+    if (codeCacheDirSet) {
+        cacheDir = codeCacheDir;
+    } else if (getenv(CODE_CACHE_ENV_VAR) != NULL) {
+        cacheDir = getenv(CODE_CACHE_ENV_VAR);
+    }
+    if (!cacheDir.empty()) {
+        cachePath = preparseDataPath(cacheDir, funSource);
+        preparseData = loadPreparseData(cachePath, funSource);
+    }
+
+    Handle<Script> script = Script::Compile(source, NULL, preparseData);
+    bool cached = (preparseData != NULL);
+    delete preparseData;
 
     if (script.IsEmpty()) {
         throw MapReduceError(MAPREDUCE_SYNTAX_ERROR, exceptionString(trycatch));
     }
+    if (!cachePath.empty() && !cached) {
+        storePreparseData(cacheDir, cachePath, funSource, source);
+    }
 
     Handle<Value> result = script->Run();
 
@@ -548,6 +795,115 @@ static Handle<Function> compileFunction(const std::string &funSource)
 }
 
 
+void setCodeCacheDir(const char *dir)
+{
+    codeCacheDir = (dir != NULL) ? dir : "";
+    codeCacheDirSet = true;
+}
+
+
+void setLazyDocs(bool lazy)
+{
+    lazyDocs = lazy;
+}
+
+
+static std::string preparseDataPath(const std::string &dir,
+                                    const std::string &source)
+{
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    const char *version = V8::GetVersion();
+    char name[32];
+
+    for (size_t i = 0; i <= strlen(version); ++i) {
+        hash = (hash ^ static_cast<unsigned char>(version[i])) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < source.length(); ++i) {
+        hash = (hash ^ static_cast<unsigned char>(source[i])) * 1099511628211ULL;
+    }
+    snprintf(name, sizeof(name), "/%016llx.v8pre",
+             static_cast<unsigned long long>(hash));
+
+    return dir + name;
+}
+
+
+static ScriptData *loadPreparseData(const std::string &path,
+                                    const std::string &source)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    std::string contents;
+    char buf[4096];
+    size_t n;
+
+    if (f == NULL) {
+        return NULL;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        contents.append(buf, n);
+    }
+    fclose(f);
+
+    size_t offset = source.length() + 1;
+    if (contents.length() <= offset ||
+        contents.compare(0, source.length(), source) != 0 ||
+        contents[source.length()] != '\0') {
+        return NULL;
+    }
+
+    ScriptData *data = ScriptData::New(contents.data() + offset,
+                                       static_cast<int>(contents.length() - offset));
+    if (data != NULL && data->HasError()) {
+        delete data;
+        data = NULL;
+    }
+
+    return data;
+}
+
+
+// Written to a file of its own, then renamed, so that processes compiling
+// the same function don't read each other's halves.
+static void storePreparseData(const std::string &dir,
+                              const std::string &path,
+                              const std::string &source,
+                              const Handle<String> &jsSource)
+{
+    ScriptData *data = ScriptData::PreCompile(jsSource);
+
+    if (data == NULL) {
+        return;
+    }
+    if (data->HasError() || data->Length() <= 0) {
+        delete data;
+        return;
+    }
+
+    char *tmpPath = tmp_file_path(dir.c_str(), "v8pre");
+    if (tmpPath == NULL) {
+        delete data;
+        return;
+    }
+
+    FILE *f = fopen(tmpPath, "wb");
+    bool ok = false;
+    if (f != NULL) {
+        size_t len = static_cast<size_t>(data->Length());
+        ok = fwrite(source.data(), 1, source.length(), f) == source.length() &&
+             fputc('\0', f) != EOF &&
+             fwrite(data->Data(), 1, len, f) == len;
+        ok = (fclose(f) == 0) && ok;
+    }
+    if (!ok || rename(tmpPath, path.c_str()) != 0) {
+        remove(tmpPath);
+    }
+
+    cs_free(tmpPath);
+    delete data;
+}
+
+
 static std::string exceptionString(const TryCatch &tryCatch)
 {
 #ifdef V8_POST_3_19_API
@@ -576,11 +932,21 @@ static void loadFunctions(mapreduce_ctx_t *ctx,
 #endif
 
     ctx->functions = new function_vector_t();
+    ctx->natives = new native_map_vector_t();
+    ctx->allNative = !function_sources.empty();
+    ctx->reductions = new value_map_t();
 
     std::list<std::string>::const_iterator it = function_sources.begin();
 
     for ( ; it != function_sources.end(); ++it) {
         Handle<Function> fun = compileFunction(*it);
+        // Still compiled, for its syntax errors and for the documents
+        // it can't map natively
+        native_map_t *native = nativeMapCompile(*it);
+        ctx->natives->push_back(native);
+        if (native == NULL) {
+            ctx->allNative = false;
+        }
 #ifdef V8_POST_3_19_API
         Persistent<Function> *perFn = new Persistent<Function>();
         perFn->Reset(ctx->isolate, fun);
@@ -608,12 +974,11 @@ static Handle<Value> emit(const Arguments &args)
 #endif
     }
 
+    EmitBuffer *kvs = isoData->ctx->kvs;
+    size_t rows = kvs->rows();
     try {
-        mapreduce_kv_t result;
-
-        result.key   = jsonStringify(args[0]);
-        result.value = jsonStringify(args[1]);
-        isoData->ctx->kvs->push_back(result);
+        emitJson(args[0], *kvs);
+        emitJson(args[1], *kvs);
 
 #ifdef V8_POST_3_19_API
         return;
@@ -621,6 +986,7 @@ static Handle<Value> emit(const Arguments &args)
         return Undefined();
 #endif
     } catch(Handle<Value> &ex) {
+        kvs->truncate(rows);
 #ifdef V8_POST_3_19_API
         ThrowException(ex);
 #else
@@ -630,6 +996,259 @@ static Handle<Value> emit(const Arguments &args)
 }
 
 
+#ifdef V8_POST_3_19_API
+static void getHelper(Local<String> name,
+                      const PropertyCallbackInfo<Value> &info)
+#else
+static Handle<Value> getHelper(Local<String> name, const AccessorInfo &info)
+#endif
+{
+    isolate_data_t *isoData = getIsolateData();
+    int i = info.Data()->Int32Value();
+
+    if (isoData->helpers[i].IsEmpty()) {
+        Handle<Function> fun;
+        try {
+            fun = compileFunction(JS_HELPERS[i].source);
+        } catch (MapReduceError &e) {
+            // Not to be thrown through V8's frames; only a terminated
+            // task gets here
+#ifdef V8_POST_3_19_API
+            ThrowException(String::New(e.getMsg().c_str()));
+            return;
+#else
+            return ThrowException(String::New(e.getMsg().c_str()));
+#endif
+        }
+#ifdef V8_POST_3_19_API
+        isoData->helpers[i].Reset(info.GetIsolate(), fun);
+#else
+        isoData->helpers[i] = Persistent<Value>::New(fun);
+#endif
+    }
+
+#ifdef V8_POST_3_19_API
+    info.GetReturnValue().Set(Local<Value>::New(info.GetIsolate(),
+                                                isoData->helpers[i]));
+#else
+    return isoData->helpers[i];
+#endif
+}
+
+
+// Assigning to a helper replaces it, as it would a plain global.
+#ifdef V8_POST_3_19_API
+static void setHelper(Local<String> name,
+                      Local<Value> value,
+                      const PropertyCallbackInfo<void> &info)
+#else
+static void setHelper(Local<String> name,
+                      Local<Value> value,
+                      const AccessorInfo &info)
+#endif
+{
+    isolate_data_t *isoData = getIsolateData();
+    int i = info.Data()->Int32Value();
+
+    isoData->helpers[i].Dispose();
+#ifdef V8_POST_3_19_API
+    isoData->helpers[i].Reset(info.GetIsolate(), value);
+#else
+    isoData->helpers[i] = Persistent<Value>::New(value);
+#endif
+}
+
+
+#ifdef V8_POST_3_19_API
+static void lazyDocGetter(Local<String> name,
+                          const PropertyCallbackInfo<Value> &info)
+{
+    Handle<Value> value = lazyDocGet(info.Holder(), name);
+    if (!value.IsEmpty()) {
+        info.GetReturnValue().Set(value);
+    }
+}
+
+
+static void lazyDocSetter(Local<String> name,
+                          Local<Value> value,
+                          const PropertyCallbackInfo<Value> &info)
+{
+    lazyDocParse(info.Holder());
+}
+
+
+static void lazyDocQuery(Local<String> name,
+                         const PropertyCallbackInfo<Integer> &info)
+{
+    lazyDocParse(info.Holder());
+}
+
+
+static void lazyDocDeleter(Local<String> name,
+                           const PropertyCallbackInfo<Boolean> &info)
+{
+    lazyDocParse(info.Holder());
+}
+
+
+static void lazyDocEnumerator(const PropertyCallbackInfo<Array> &info)
+{
+    lazyDocParse(info.Holder());
+}
+#else
+// Interceptors return an empty handle to leave the rest to V8, which then
+// finds the members lazyDocGet and lazyDocParse put on the object.
+static Handle<Value> lazyDocGetter(Local<String> name, const AccessorInfo &info)
+{
+    return lazyDocGet(info.Holder(), name);
+}
+
+
+static Handle<Value> lazyDocSetter(Local<String> name,
+                                   Local<Value> value,
+                                   const AccessorInfo &info)
+{
+    lazyDocParse(info.Holder());
+    return Handle<Value>();
+}
+
+
+static Handle<Integer> lazyDocQuery(Local<String> name, const AccessorInfo &info)
+{
+    lazyDocParse(info.Holder());
+    return Handle<Integer>();
+}
+
+
+static Handle<Boolean> lazyDocDeleter(Local<String> name, const AccessorInfo &info)
+{
+    lazyDocParse(info.Holder());
+    return Handle<Boolean>();
+}
+
+
+static Handle<Array> lazyDocEnumerator(const AccessorInfo &info)
+{
+    lazyDocParse(info.Holder());
+    return Handle<Array>();
+}
+#endif
+
+
+// A document's object keeps its JSON in its first internal field until
+// it's wholly parsed, and in the second the lookups made through it.
+static Handle<ObjectTemplate> createLazyDocTemplate()
+{
+#ifdef V8_POST_3_19_API
+    HandleScope handleScope(Isolate::GetCurrent());
+#else
+    HandleScope handleScope;
+#endif
+    Handle<ObjectTemplate> docTemplate = ObjectTemplate::New();
+
+    docTemplate->SetInternalFieldCount(2);
+    docTemplate->SetNamedPropertyHandler(lazyDocGetter, lazyDocSetter,
+                                         lazyDocQuery, lazyDocDeleter,
+                                         lazyDocEnumerator);
+    return handleScope.Close(docTemplate);
+}
+
+
+// The object for a document, or an empty handle if it must be parsed
+// up front (see nativeLazyDocCheck).
+static Handle<Value> lazyDoc(const mapreduce_json_t &doc)
+{
+    if (!nativeLazyDocCheck(doc)) {
+        return Handle<Value>();
+    }
+
+    isolate_data_t *isoData = getIsolateData();
+#ifdef V8_POST_3_19_API
+    Local<ObjectTemplate> docTemplate =
+        Local<ObjectTemplate>::New(Isolate::GetCurrent(), isoData->lazyDocTemplate);
+    Handle<Object> docObject = docTemplate->NewInstance();
+#else
+    Handle<Object> docObject = isoData->lazyDocTemplate->NewInstance();
+#endif
+
+    docObject->SetInternalField(0, String::New(doc.json, doc.length));
+    docObject->SetInternalField(1, Integer::New(0));
+    return docObject;
+}
+
+
+// A member of a document not yet wholly parsed, or an empty handle to
+// leave its lookup to V8.
+static Handle<Value> lazyDocGet(Handle<Object> doc, Handle<String> name)
+{
+    Handle<Value> json = doc->GetInternalField(0);
+
+    if (!json->IsString() || doc->HasRealNamedProperty(name)) {
+        return Handle<Value>();
+    }
+    int lookups = doc->GetInternalField(1)->Int32Value();
+    if (lookups >= LAZY_DOC_MAX_LOOKUPS) {
+        lazyDocParse(doc);
+        return Handle<Value>();
+    }
+    doc->SetInternalField(1, Integer::New(lookups + 1));
+
+    String::Utf8Value docJson(json);
+    String::Utf8Value key(name);
+    mapreduce_json_t raw = { *docJson, docJson.length() };
+    mapreduce_json_t memberJson;
+
+    if (!nativeDocMember(raw, std::string(*key, key.length()), &memberJson)) {
+        return Handle<Value>();
+    }
+    try {
+        Handle<Value> member = jsonParse(memberJson);
+        doc->ForceSet(name, member);
+        return member;
+    } catch (MapReduceError &) {
+        // Only a terminated task can't parse it
+        return Handle<Value>();
+    }
+}
+
+
+// Parses the whole of a document, keeping the members already looked up,
+// which the function may have modified.
+static void lazyDocParse(Handle<Object> doc)
+{
+    Handle<Value> json = doc->GetInternalField(0);
+
+    if (!json->IsString()) {
+        return;
+    }
+    doc->SetInternalField(0, Null());
+
+    String::Utf8Value docJson(json);
+    mapreduce_json_t raw = { *docJson, docJson.length() };
+    Handle<Object> parsed;
+    try {
+        parsed = Handle<Object>::Cast(jsonParse(raw));
+    } catch (MapReduceError &) {
+        return;
+    }
+
+    Handle<Array> names = parsed->GetOwnPropertyNames();
+    for (uint32_t i = 0; i < names->Length(); ++i) {
+        Handle<String> name = names->Get(i)->ToString();
+
+        if (doc->HasRealNamedProperty(name)) {
+            // Moved to its place in the JSON's order
+            Handle<Value> member = doc->GetRealNamedProperty(name);
+            doc->ForceDelete(name);
+            doc->ForceSet(name, member);
+        } else {
+            doc->ForceSet(name, parsed->Get(name));
+        }
+    }
+}
+
+
 static inline isolate_data_t *getIsolateData()
 {
     Isolate *isolate = Isolate::GetCurrent();
@@ -637,7 +1256,7 @@ static inline isolate_data_t *getIsolateData()
 }
 
 
-static inline mapreduce_json_t jsonStringify(const Handle<Value> &obj)
+static inline Handle<Value> callStringify(const Handle<Value> &obj)
 {
     isolate_data_t *isoData = getIsolateData();
     Handle<Value> args[] = { obj };
@@ -654,12 +1273,19 @@ static inline mapreduce_json_t jsonStringify(const Handle<Value> &obj)
         throw trycatch.Exception();
     }
 
+    return result;
+}
+
+
+static inline mapreduce_json_t jsonStringify(const Handle<Value> &obj)
+{
+    Handle<Value> result = callStringify(obj);
     mapreduce_json_t jsonResult;
 
     if (!result->IsUndefined()) {
         Handle<String> str = Handle<String>::Cast(result);
         jsonResult.length = str->Utf8Length();
-        jsonResult.json = (char *) malloc(jsonResult.length);
+        jsonResult.json = (char *) cs_malloc(jsonResult.length);
         if (jsonResult.json == NULL) {
             throw std::bad_alloc();
         }
@@ -667,7 +1293,7 @@ static inline mapreduce_json_t jsonStringify(const Handle<Value> &obj)
                        NULL, String::NO_NULL_TERMINATION);
     } else {
         jsonResult.length = sizeof("null") - 1;
-        jsonResult.json = (char *) malloc(jsonResult.length);
+        jsonResult.json = (char *) cs_malloc(jsonResult.length);
         if (jsonResult.json == NULL) {
             throw std::bad_alloc();
         }
@@ -679,6 +1305,22 @@ static inline mapreduce_json_t jsonStringify(const Handle<Value> &obj)
 }
 
 
+// Appends the JSON of a key or value emitted.
+static inline void emitJson(const Handle<Value> &obj, EmitBuffer &kvs)
+{
+    Handle<Value> result = callStringify(obj);
+
+    if (!result->IsUndefined()) {
+        Handle<String> str = Handle<String>::Cast(result);
+        int length = str->Utf8Length();
+        str->WriteUtf8(kvs.append(length), length,
+                       NULL, String::NO_NULL_TERMINATION);
+    } else {
+        kvs.append("null", sizeof("null") - 1);
+    }
+}
+
+
 static inline Handle<Value> jsonParse(const mapreduce_json_t &thing)
 {
     isolate_data_t *isoData = getIsolateData();
@@ -702,14 +1344,17 @@ static inline Handle<Value> jsonParse(const mapreduce_json_t &thing)
 
 static inline void taskStarted(mapreduce_ctx_t *ctx)
 {
-    ctx->taskStartTime = time(NULL);
+    uint64_t now = gethrtime() / 1000000;
+
+    // 0 is for no task
+    ctx->taskStartTime.store(now > 0 ? now : 1, std::memory_order_relaxed);
     ctx->kvs = NULL;
 }
 
 
 static inline void taskFinished(mapreduce_ctx_t *ctx)
 {
-    ctx->taskStartTime = -1;
+    ctx->taskStartTime.store(0, std::memory_order_relaxed);
 }
 
 
@@ -724,3 +1369,144 @@ static inline Handle<Array> jsonListToJsArray(const mapreduce_json_list_t &list)
 
     return array;
 }
+
+
+static Handle<Array> reductionsToJsArray(mapreduce_ctx_t *ctx,
+                                         const mapreduce_json_list_t &reductions)
+{
+    Handle<Array> array = Array::New(reductions.length);
+    value_map_t &kept = *ctx->reductions;
+
+    for (int i = 0 ; i < reductions.length; ++i) {
+        const mapreduce_json_t &json = reductions.values[i];
+        value_map_t::iterator it = kept.end();
+        Handle<Value> v;
+
+        if (!kept.empty() && json.length <= MAX_KEPT_REDUCTION_SIZE) {
+            it = kept.find(std::string(json.json, json.length));
+        }
+        if (it != kept.end()) {
+#ifdef V8_POST_3_19_API
+            v = Local<Value>::New(ctx->isolate, *it->second);
+#else
+            v = Local<Value>::New(*it->second);
+#endif
+            it->second->Dispose();
+            delete it->second;
+            kept.erase(it);
+        } else {
+            v = jsonParse(json);
+        }
+        array->Set(Number::New(i), v);
+    }
+
+    return array;
+}
+
+
+// Whether JSON.parse(JSON.stringify(value)) would equal value: it holds
+// nothing that stringify drops or changes, or that parse makes differently.
+static bool parsesBackEqual(const Handle<Value> &value, int depth)
+{
+    if (value->IsNull() || value->IsBoolean()) {
+        return true;
+    }
+    if (value->IsNumber()) {
+        double d = value->NumberValue();
+        // Not NaN nor infinite, which become null, nor -0, which becomes 0
+        return (d - d) == 0 && !(d == 0 && 1 / d < 0);
+    }
+    if (value->IsString()) {
+        // Only ASCII: lone surrogates would come back as U+FFFD
+        Handle<String> str = Handle<String>::Cast(value);
+        return str->Utf8Length() == str->Length();
+    }
+    if (depth == 0 || !value->IsObject() || value->IsFunction()) {
+        return false;
+    }
+
+    Handle<Object> obj = Handle<Object>::Cast(value);
+    Handle<Array> names = obj->GetOwnPropertyNames();
+
+    if (value->IsArray()) {
+        Handle<Array> array = Handle<Array>::Cast(value);
+        // Holes become nulls, and named properties are dropped
+        if (names->Length() != array->Length()) {
+            return false;
+        }
+        for (uint32_t i = 0; i < array->Length(); ++i) {
+            if (!parsesBackEqual(array->Get(i), depth - 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Dates, boxed primitives and the like are stringified their own way
+    String::Utf8Value constructor(obj->GetConstructorName());
+    if (*constructor == NULL || strcmp(*constructor, "Object") != 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < names->Length(); ++i) {
+        Handle<Value> name = names->Get(i);
+        if (name->IsString() && !parsesBackEqual(name, depth - 1)) {
+            return false;
+        }
+        Handle<Value> v = obj->Get(name);
+        // Undefined values are dropped
+        if (v->IsUndefined() || !parsesBackEqual(v, depth - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void keepReduction(mapreduce_ctx_t *ctx,
+                          const mapreduce_json_t &json,
+                          const Handle<Value> &value)
+{
+    if (json.length > MAX_KEPT_REDUCTION_SIZE ||
+        !parsesBackEqual(value, MAX_KEPT_REDUCTION_DEPTH)) {
+        return;
+    }
+    value_map_t &kept = *ctx->reductions;
+    if (kept.size() >= MAX_KEPT_REDUCTIONS) {
+        clearReductions(ctx);
+    }
+
+    try {
+        std::pair<value_map_t::iterator, bool> res =
+            kept.insert(std::make_pair(std::string(json.json, json.length),
+                                       static_cast<Persistent<Value> *>(NULL)));
+        if (!res.second) {
+            // One equal to it is kept already
+            return;
+        }
+        Persistent<Value> *perValue = new (std::nothrow) Persistent<Value>();
+        if (perValue == NULL) {
+            kept.erase(res.first);
+            return;
+        }
+#ifdef V8_POST_3_19_API
+        perValue->Reset(ctx->isolate, value);
+#else
+        *perValue = Persistent<Value>::New(value);
+#endif
+        res.first->second = perValue;
+    } catch (std::bad_alloc &) {
+        // It's only parsed again
+    }
+}
+
+
+static void clearReductions(mapreduce_ctx_t *ctx)
+{
+    value_map_t &kept = *ctx->reductions;
+
+    for (value_map_t::iterator it = kept.begin(); it != kept.end(); ++it) {
+        it->second->Dispose();
+        delete it->second;
+    }
+    kept.clear();
+}
@@ -55,6 +55,8 @@ extern "C" {
         MAPREDUCE_TIMEOUT
     } mapreduce_error_t;
 
+    /* The keys' and values' JSON of a map result live in the same
+       allocation as its kvs array, and go with the result list. */
     typedef struct {
         mapreduce_kv_t *kvs;
         int            length;
@@ -99,6 +101,61 @@ extern "C" {
                                     const mapreduce_json_t *meta,
                                     mapreduce_map_result_list_t **result);
 
+    /**
+     * Maps num_docs documents, entering the JavaScript engine once for the
+     * whole batch instead of once per document, which is a good part of
+     * the cost of mapping small documents. (*results)[i] is what
+     * mapreduce_map() gives for docs[i] and metas[i]; all the lists are in
+     * one allocation.
+     *
+     * An error that fails mapreduce_map() (a timeout, metadata that isn't
+     * an object) fails the whole batch. If return value is
+     * MAPREDUCE_SUCCESS, the caller is responsible for free'ing results
+     * with a call to mapreduce_free_map_result_batch().
+     */
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_map_batch(void *context,
+                                          const mapreduce_json_t docs[],
+                                          const mapreduce_json_t metas[],
+                                          int num_docs,
+                                          mapreduce_map_result_list_t **results);
+
+    /**
+     * Starts num_contexts map contexts running the same functions, each
+     * with an isolate and a thread of its own, so that batches given to
+     * mapreduce_map_pool() are mapped on that many cores. Their timeouts
+     * are those of any other context.
+     *
+     * If return value other than MAPREDUCE_SUCCESS, error_msg might be
+     * assigned an error message, for which the caller is responsible to
+     * deallocate via mapreduce_free_error_msg().
+     **/
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_start_map_pool(const char *map_functions[],
+                                               int num_functions,
+                                               int num_contexts,
+                                               void **pool,
+                                               char **error_msg);
+
+    /**
+     * Like mapreduce_map_batch(), but the batch is cut into pieces that
+     * the pool's threads map at once. The results are still in document
+     * order. Batches given from several threads are mapped one after the
+     * other.
+     *
+     * If return value is MAPREDUCE_SUCCESS, the caller is responsible for
+     * free'ing results with a call to mapreduce_free_map_result_batch().
+     */
+    LIBMAPREDUCE_API
+    mapreduce_error_t mapreduce_map_pool(void *pool,
+                                         const mapreduce_json_t docs[],
+                                         const mapreduce_json_t metas[],
+                                         int num_docs,
+                                         mapreduce_map_result_list_t **results);
+
+    LIBMAPREDUCE_API
+    void mapreduce_free_map_pool(void *pool);
+
     LIBMAPREDUCE_API
     void mapreduce_free_json_list(mapreduce_json_list_t *list);
 
@@ -108,6 +165,10 @@ extern "C" {
     LIBMAPREDUCE_API
     void mapreduce_free_map_result_list(mapreduce_map_result_list_t *list);
 
+    LIBMAPREDUCE_API
+    void mapreduce_free_map_result_batch(mapreduce_map_result_list_t *results,
+                                         int num_docs);
+
     LIBMAPREDUCE_API
     void mapreduce_free_error_msg(char *error_msg);
 
@@ -177,6 +238,27 @@ extern "C" {
     LIBMAPREDUCE_API
     void mapreduce_set_timeout(unsigned int seconds);
 
+    /**
+     * Sets the directory, which must exist, where contexts keep what V8
+     * works out compiling their functions, for the contexts of later
+     * processes to start from rather than compile from scratch. Until it's
+     * called, it's the MAPREDUCE_CODE_CACHE_DIR environment variable, and
+     * NULL disables it. Call it before starting any contexts.
+     **/
+    LIBMAPREDUCE_API
+    void mapreduce_set_code_cache_dir(const char *dir);
+
+    /**
+     * Sets whether map functions get documents unparsed, as objects whose
+     * members are parsed from the JSON as they're looked up, so that a
+     * function that doesn't use the document, or uses a few of its
+     * members, doesn't pay for parsing the whole of it. The objects
+     * behave as the parsed documents would, but are parsed in full when
+     * enumerated or modified. Off by default.
+     **/
+    LIBMAPREDUCE_API
+    void mapreduce_set_lazy_docs(int lazy);
+
 
 #ifdef __cplusplus
 }
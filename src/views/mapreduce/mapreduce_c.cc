@@ -21,32 +21,32 @@
  **/
 #include "mapreduce.h"
 #include "mapreduce_internal.h"
+#include "../../alloc.h"
 #include <iostream>
 #include <map>
 #include <cstring>
 #include <assert.h>
 
-#if defined(WIN32) || defined(_WIN32)
-#define doSleep(Secs) Sleep(Secs * 1000)
-#else
-#include <unistd.h>
-#define doSleep(Secs) sleep(Secs)
-#endif
-
 static const char *MEM_ALLOC_ERROR_MSG = "memory allocation failure";
 
 static cb_thread_t terminator_thread;
 static bool terminator_thread_created = false;
 static volatile unsigned int terminator_timeout = 5;
 
+/* The terminator thread looks again at least this many times a timeout,
+   so no task runs more than this much of one over it */
+#define TERMINATOR_TICKS_PER_TIMEOUT 8
+
 static std::map<uintptr_t, mapreduce_ctx_t *> ctx_registry;
 
 class RegistryMutex {
 public:
     RegistryMutex() {
         cb_mutex_initialize(&mutex);
+        cb_cond_initialize(&cond);
     }
     ~RegistryMutex() {
+        cb_cond_destroy(&cond);
         cb_mutex_destroy(&mutex);
     }
     void lock() {
@@ -55,12 +55,53 @@ public:
     void unlock() {
         cb_mutex_exit(&mutex);
     }
+    // With the mutex held, by the terminator thread
+    void wait(unsigned int ms) {
+        cb_cond_timedwait(&cond, &mutex, ms);
+    }
+    void wakeUp() {
+        cb_cond_signal(&cond);
+    }
 private:
     cb_mutex_t mutex;
+    cb_cond_t cond;
 };
 
 static RegistryMutex registryMutex;
 
+/* Pieces a map pool's batch is cut into, per context */
+#define MAP_POOL_CHUNKS_PER_CONTEXT 4
+
+struct mapreduce_map_pool_t;
+
+typedef struct {
+    mapreduce_map_pool_t *pool;
+    mapreduce_ctx_t      *ctx;
+    cb_thread_t          thread;
+} map_pool_worker_t;
+
+/* The contexts of a map pool, a thread each, and the batch they share out.
+   The contexts are registered like any other, so the terminator thread
+   times their tasks out too. */
+struct mapreduce_map_pool_t {
+    cb_mutex_t                  mutex;
+    cb_cond_t                   work_cond;  /* workers wait for a batch */
+    cb_cond_t                   done_cond;  /* callers wait for it to end */
+    map_pool_worker_t           *workers;
+    int                         num_contexts;
+    int                         num_threads;
+    bool                        shutdown;
+    /* The batch being mapped, if docs isn't NULL: */
+    const mapreduce_json_t      *docs;
+    const mapreduce_json_t      *metas;
+    mapreduce_map_result_list_t *results;
+    int                         num_docs;
+    int                         next;       /* first document not handed out */
+    int                         chunk;      /* documents handed out at once */
+    int                         running;    /* workers mapping a piece */
+    mapreduce_error_t           error;
+};
+
 
 static mapreduce_error_t start_context(const char *functions[],
                                        int num_functions,
@@ -72,6 +113,16 @@ static void make_function_list(const char *sources[],
                                std::list<std::string> &list);
 
 static void copy_error_msg(const std::string &msg, char **to);
+static void free_map_results(mapreduce_map_result_list_t *list);
+static mapreduce_error_t alloc_map_batch(int num_funs,
+                                         int num_docs,
+                                         mapreduce_map_result_list_t **results);
+static mapreduce_error_t map_docs(mapreduce_ctx_t *ctx,
+                                  const mapreduce_json_t docs[],
+                                  const mapreduce_json_t metas[],
+                                  int num_docs,
+                                  mapreduce_map_result_list_t results[]);
+static void map_pool_worker(void *arg);
 
 static void register_ctx(mapreduce_ctx_t *ctx);
 static void unregister_ctx(mapreduce_ctx_t *ctx);
@@ -96,17 +147,17 @@ mapreduce_error_t mapreduce_map(void *context,
 {
     mapreduce_ctx_t *ctx = (mapreduce_ctx_t *) context;
 
-    *result = (mapreduce_map_result_list_t *) malloc(sizeof(**result));
+    *result = (mapreduce_map_result_list_t *) cs_malloc(sizeof(**result));
     if (*result == NULL) {
         return MAPREDUCE_ALLOC_ERROR;
     }
 
     int num_funs = ctx->functions->size();
     size_t sz = sizeof(mapreduce_map_result_t) * num_funs;
-    (*result)->list = (mapreduce_map_result_t *) malloc(sz);
+    (*result)->list = (mapreduce_map_result_t *) cs_malloc(sz);
 
     if ((*result)->list == NULL) {
-        free(*result);
+        cs_free(*result);
         *result = NULL;
         return MAPREDUCE_ALLOC_ERROR;
     }
@@ -129,6 +180,172 @@ mapreduce_error_t mapreduce_map(void *context,
 }
 
 
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_map_batch(void *context,
+                                      const mapreduce_json_t docs[],
+                                      const mapreduce_json_t metas[],
+                                      int num_docs,
+                                      mapreduce_map_result_list_t **results)
+{
+    mapreduce_ctx_t *ctx = (mapreduce_ctx_t *) context;
+    mapreduce_error_t ret;
+
+    ret = alloc_map_batch(ctx->functions->size(), num_docs, results);
+    if (ret != MAPREDUCE_SUCCESS) {
+        return ret;
+    }
+
+    ret = map_docs(ctx, docs, metas, num_docs, *results);
+    if (ret != MAPREDUCE_SUCCESS) {
+        mapreduce_free_map_result_batch(*results, num_docs);
+        *results = NULL;
+    }
+    return ret;
+}
+
+
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_start_map_pool(const char *map_functions[],
+                                           int num_functions,
+                                           int num_contexts,
+                                           void **pool,
+                                           char **error_msg)
+{
+    mapreduce_map_pool_t *p;
+    mapreduce_error_t ret = MAPREDUCE_SUCCESS;
+
+    if (num_contexts <= 0) {
+        copy_error_msg("a map pool needs at least one context", error_msg);
+        return MAPREDUCE_INVALID_ARG;
+    }
+
+    p = (mapreduce_map_pool_t *) cs_calloc(1, sizeof(*p));
+    if (p != NULL) {
+        p->workers = (map_pool_worker_t *) cs_calloc(num_contexts, sizeof(map_pool_worker_t));
+    }
+    if (p == NULL || p->workers == NULL) {
+        cs_free(p);
+        copy_error_msg(MEM_ALLOC_ERROR_MSG, error_msg);
+        return MAPREDUCE_ALLOC_ERROR;
+    }
+    cb_mutex_initialize(&p->mutex);
+    cb_cond_initialize(&p->work_cond);
+    cb_cond_initialize(&p->done_cond);
+
+    /* Every context compiles the functions itself: compiled functions
+       belong to an isolate, and can't be handed to another. */
+    for (int i = 0; i < num_contexts && ret == MAPREDUCE_SUCCESS; ++i) {
+        void *ctx = NULL;
+
+        ret = start_context(map_functions, num_functions, &ctx, error_msg);
+        if (ret == MAPREDUCE_SUCCESS) {
+            p->workers[i].pool = p;
+            p->workers[i].ctx = (mapreduce_ctx_t *) ctx;
+            ++p->num_contexts;
+        }
+    }
+    for (int i = 0; i < p->num_contexts && ret == MAPREDUCE_SUCCESS; ++i) {
+        if (cb_create_thread(&p->workers[i].thread, map_pool_worker,
+                             &p->workers[i], 0) != 0) {
+            copy_error_msg("failed to create a map pool thread", error_msg);
+            ret = MAPREDUCE_ALLOC_ERROR;
+        } else {
+            ++p->num_threads;
+        }
+    }
+
+    if (ret != MAPREDUCE_SUCCESS) {
+        mapreduce_free_map_pool(p);
+        return ret;
+    }
+    *pool = (void *) p;
+    *error_msg = NULL;
+    return MAPREDUCE_SUCCESS;
+}
+
+
+LIBMAPREDUCE_API
+mapreduce_error_t mapreduce_map_pool(void *pool,
+                                     const mapreduce_json_t docs[],
+                                     const mapreduce_json_t metas[],
+                                     int num_docs,
+                                     mapreduce_map_result_list_t **results)
+{
+    mapreduce_map_pool_t *p = (mapreduce_map_pool_t *) pool;
+    mapreduce_error_t ret;
+
+    ret = alloc_map_batch(p->workers[0].ctx->functions->size(), num_docs, results);
+    if (ret != MAPREDUCE_SUCCESS) {
+        return ret;
+    }
+
+    cb_mutex_enter(&p->mutex);
+    /* One batch at a time */
+    while (p->docs != NULL) {
+        cb_cond_wait(&p->done_cond, &p->mutex);
+    }
+    p->docs = docs;
+    p->metas = metas;
+    p->results = *results;
+    p->num_docs = num_docs;
+    p->next = 0;
+    p->error = MAPREDUCE_SUCCESS;
+    /* Enough pieces for the threads to even out, but not so many that
+       entering an isolate for each one costs much */
+    p->chunk = num_docs / (p->num_contexts * MAP_POOL_CHUNKS_PER_CONTEXT);
+    if (p->chunk < 1) {
+        p->chunk = 1;
+    }
+    cb_cond_broadcast(&p->work_cond);
+    while (p->running > 0 ||
+           (p->next < p->num_docs && p->error == MAPREDUCE_SUCCESS)) {
+        cb_cond_wait(&p->done_cond, &p->mutex);
+    }
+    ret = p->error;
+    p->docs = NULL;
+    p->metas = NULL;
+    p->results = NULL;
+    p->num_docs = 0;
+    p->next = 0;
+    cb_cond_broadcast(&p->done_cond);
+    cb_mutex_exit(&p->mutex);
+
+    if (ret != MAPREDUCE_SUCCESS) {
+        mapreduce_free_map_result_batch(*results, num_docs);
+        *results = NULL;
+    }
+    return ret;
+}
+
+
+LIBMAPREDUCE_API
+void mapreduce_free_map_pool(void *pool)
+{
+    mapreduce_map_pool_t *p = (mapreduce_map_pool_t *) pool;
+
+    if (p == NULL) {
+        return;
+    }
+
+    cb_mutex_enter(&p->mutex);
+    p->shutdown = true;
+    cb_cond_broadcast(&p->work_cond);
+    cb_mutex_exit(&p->mutex);
+    for (int i = 0; i < p->num_threads; ++i) {
+        cb_join_thread(p->workers[i].thread);
+    }
+    for (int i = 0; i < p->num_contexts; ++i) {
+        mapreduce_free_context(p->workers[i].ctx);
+    }
+
+    cb_cond_destroy(&p->work_cond);
+    cb_cond_destroy(&p->done_cond);
+    cb_mutex_destroy(&p->mutex);
+    cs_free(p->workers);
+    cs_free(p);
+}
+
+
 LIBMAPREDUCE_API
 mapreduce_error_t mapreduce_start_reduce_context(const char *reduce_functions[],
                                                  int num_functions,
@@ -155,20 +372,20 @@ mapreduce_error_t mapreduce_reduce_all(void *context,
 
         assert(sz == ctx->functions->size());
 
-        *result = (mapreduce_json_list_t *) malloc(sizeof(**result));
+        *result = (mapreduce_json_list_t *) cs_malloc(sizeof(**result));
         if (*result == NULL) {
             for ( ; it != list.end(); ++it) {
-                free((*it).json);
+                cs_free((*it).json);
             }
             throw std::bad_alloc();
         }
 
         (*result)->length = sz;
-        (*result)->values = (mapreduce_json_t *) malloc(sizeof(mapreduce_json_t) * sz);
+        (*result)->values = (mapreduce_json_t *) cs_malloc(sizeof(mapreduce_json_t) * sz);
         if ((*result)->values == NULL) {
-            free(*result);
+            cs_free(*result);
             for ( ; it != list.end(); ++it) {
-                free((*it).json);
+                cs_free((*it).json);
             }
             throw std::bad_alloc();
         }
@@ -203,9 +420,9 @@ mapreduce_error_t mapreduce_reduce(void *context,
     try {
         mapreduce_json_t red = runReduce(ctx, reduceFunNum, *keys, *values);
 
-        *result = (mapreduce_json_t *) malloc(sizeof(**result));
+        *result = (mapreduce_json_t *) cs_malloc(sizeof(**result));
         if (*result == NULL) {
-            free(red.json);
+            cs_free(red.json);
             throw std::bad_alloc();
         }
         **result = red;
@@ -236,9 +453,9 @@ mapreduce_error_t mapreduce_rereduce(void *context,
     try {
         mapreduce_json_t red = runRereduce(ctx, reduceFunNum, *reductions);
 
-        *result = (mapreduce_json_t *) malloc(sizeof(**result));
+        *result = (mapreduce_json_t *) cs_malloc(sizeof(**result));
         if (*result == NULL) {
-            free(red.json);
+            cs_free(red.json);
             throw std::bad_alloc();
         }
         **result = red;
@@ -274,8 +491,8 @@ LIBMAPREDUCE_API
 void mapreduce_free_json(mapreduce_json_t *value)
 {
     if (value != NULL) {
-        free(value->json);
-        free(value);
+        cs_free(value->json);
+        cs_free(value);
     }
 }
 
@@ -285,10 +502,10 @@ void mapreduce_free_json_list(mapreduce_json_list_t *list)
 {
     if (list != NULL) {
         for (int i = 0; i < list->length; ++i) {
-            free(list->values[i].json);
+            cs_free(list->values[i].json);
         }
-        free(list->values);
-        free(list);
+        cs_free(list->values);
+        cs_free(list);
     }
 }
 
@@ -300,44 +517,159 @@ void mapreduce_free_map_result_list(mapreduce_map_result_list_t *list)
         return;
     }
 
+    free_map_results(list);
+    cs_free(list->list);
+    cs_free(list);
+}
+
+
+LIBMAPREDUCE_API
+void mapreduce_free_map_result_batch(mapreduce_map_result_list_t *results,
+                                     int num_docs)
+{
+    if (results == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < num_docs; ++i) {
+        free_map_results(&results[i]);
+    }
+    cs_free(results);
+}
+
+
+static mapreduce_error_t alloc_map_batch(int num_funs,
+                                         int num_docs,
+                                         mapreduce_map_result_list_t **results)
+{
+    if (num_docs < 0) {
+        *results = NULL;
+        return MAPREDUCE_INVALID_ARG;
+    }
+
+    /* The lists, then each document's results for every function */
+    size_t sz = sizeof(mapreduce_map_result_list_t) * num_docs +
+        sizeof(mapreduce_map_result_t) * num_funs * num_docs;
+    *results = (mapreduce_map_result_list_t *) cs_malloc(sz > 0 ? sz : 1);
+    if (*results == NULL) {
+        return MAPREDUCE_ALLOC_ERROR;
+    }
+
+    mapreduce_map_result_t *list = (mapreduce_map_result_t *) (*results + num_docs);
+    for (int i = 0; i < num_docs; ++i) {
+        (*results)[i].list = list + i * num_funs;
+        (*results)[i].length = 0;
+    }
+    return MAPREDUCE_SUCCESS;
+}
+
+
+static mapreduce_error_t map_docs(mapreduce_ctx_t *ctx,
+                                  const mapreduce_json_t docs[],
+                                  const mapreduce_json_t metas[],
+                                  int num_docs,
+                                  mapreduce_map_result_list_t results[])
+{
+    try {
+        mapDocs(ctx, docs, metas, num_docs, results);
+    } catch (MapReduceError &e) {
+        return e.getError();
+    } catch (std::bad_alloc &) {
+        return MAPREDUCE_ALLOC_ERROR;
+    }
+    return MAPREDUCE_SUCCESS;
+}
+
+
+/* Maps pieces of the pool's batch with the worker's context, in whatever
+   order they're handed out; each one's results go to its documents'
+   slots, so the caller gets them in document order. */
+static void map_pool_worker(void *arg)
+{
+    map_pool_worker_t *worker = (map_pool_worker_t *) arg;
+    mapreduce_map_pool_t *pool = worker->pool;
+
+    cb_mutex_enter(&pool->mutex);
+    while (!pool->shutdown) {
+        if (pool->docs == NULL || pool->next >= pool->num_docs ||
+            pool->error != MAPREDUCE_SUCCESS) {
+            cb_cond_wait(&pool->work_cond, &pool->mutex);
+            continue;
+        }
+        int start = pool->next;
+        int n = pool->num_docs - start;
+        if (n > pool->chunk) {
+            n = pool->chunk;
+        }
+        pool->next += n;
+        ++pool->running;
+        cb_mutex_exit(&pool->mutex);
+
+        mapreduce_error_t ret = map_docs(worker->ctx,
+                                         pool->docs + start,
+                                         pool->metas + start,
+                                         n,
+                                         pool->results + start);
+
+        cb_mutex_enter(&pool->mutex);
+        if (ret != MAPREDUCE_SUCCESS && pool->error == MAPREDUCE_SUCCESS) {
+            pool->error = ret;
+        }
+        --pool->running;
+        if (pool->running == 0) {
+            cb_cond_broadcast(&pool->done_cond);
+        }
+    }
+    cb_mutex_exit(&pool->mutex);
+}
+
+
+static void free_map_results(mapreduce_map_result_list_t *list)
+{
     for (int i = 0; i < list->length; ++i) {
         mapreduce_map_result_t mr = list->list[i];
 
         switch (mr.error) {
         case MAPREDUCE_SUCCESS:
-            {
-                mapreduce_kv_list_t kvs = mr.result.kvs;
-
-                for (int j = 0; j < kvs.length; ++j) {
-                    mapreduce_kv_t kv = kvs.kvs[j];
-                    free(kv.key.json);
-                    free(kv.value.json);
-                }
-                free(kvs.kvs);
-            }
+            /* The keys and values are in the same block */
+            cs_free(mr.result.kvs.kvs);
             break;
         default:
-            free(mr.result.error_msg);
+            cs_free(mr.result.error_msg);
             break;
         }
     }
-
-    free(list->list);
-    free(list);
 }
 
 
 LIBMAPREDUCE_API
 void mapreduce_free_error_msg(char *error_msg)
 {
-    free(error_msg);
+    cs_free(error_msg);
 }
 
 
 LIBMAPREDUCE_API
 void mapreduce_set_timeout(unsigned int seconds)
 {
+    registryMutex.lock();
     terminator_timeout = seconds;
+    registryMutex.wakeUp();
+    registryMutex.unlock();
+}
+
+
+LIBMAPREDUCE_API
+void mapreduce_set_code_cache_dir(const char *dir)
+{
+    setCodeCacheDir(dir);
+}
+
+
+LIBMAPREDUCE_API
+void mapreduce_set_lazy_docs(int lazy)
+{
+    setLazyDocs(lazy != 0);
 }
 
 
@@ -397,7 +729,7 @@ static void copy_error_msg(const std::string &msg, char **to)
     if (to != NULL) {
         size_t len = msg.length();
 
-        *to = (char *) malloc(len + 1);
+        *to = (char *) cs_malloc(len + 1);
         if (*to != NULL) {
             msg.copy(*to, len);
             (*to)[len] = '\0';
@@ -435,25 +767,35 @@ static void unregister_ctx(mapreduce_ctx_t *ctx)
 }
 
 
+/* Tasks mark their contexts when they start and end, with no locking
+   (see taskStarted); this thread finds those that have overrun the
+   timeout, and sleeps until the next running one would, or at most a
+   tick, rather than polling every timeout. Only registering contexts
+   contends for the mutex. */
 static void terminator_loop(void *)
 {
     std::map<uintptr_t, mapreduce_ctx_t *>::iterator it;
-    time_t now;
 
+    registryMutex.lock();
     while (true) {
-        registryMutex.lock();
-        now = time(NULL);
+        uint64_t timeout = (uint64_t) terminator_timeout * 1000;
+        uint64_t now = gethrtime() / 1000000;
+        uint64_t wait = timeout / TERMINATOR_TICKS_PER_TIMEOUT;
+
         for (it = ctx_registry.begin(); it != ctx_registry.end(); ++it) {
             mapreduce_ctx_t *ctx = (*it).second;
+            uint64_t start = ctx->taskStartTime.load(std::memory_order_relaxed);
 
-            if (ctx->taskStartTime >= 0) {
-                if (ctx->taskStartTime + terminator_timeout < now) {
-                    terminateTask(ctx);
-                }
+            if (start == 0) {
+                continue;
+            }
+            if (start + timeout <= now) {
+                terminateTask(ctx, start);
+            } else if (start + timeout - now < wait) {
+                wait = start + timeout - now;
             }
         }
 
-        registryMutex.unlock();
-        doSleep(terminator_timeout);
+        registryMutex.wait(wait > 0 ? (unsigned int) wait : 1);
     }
 }
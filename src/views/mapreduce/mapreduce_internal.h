@@ -24,10 +24,13 @@
 #define _MAPREDUCE_INTERNAL_H
 
 #include "mapreduce.h"
+#include "native_map.h"
 #include <iostream>
 #include <string>
 #include <list>
+#include <map>
 #include <vector>
+#include <atomic>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
@@ -37,19 +40,30 @@
 class MapReduceError;
 
 typedef std::list<mapreduce_json_t>                    json_results_list_t;
-typedef std::list<mapreduce_kv_t>                      kv_list_int_t;
+typedef std::vector<native_map_t *>                    native_map_vector_t;
 #ifdef V8_POST_3_19_API
 typedef std::vector< v8::Persistent<v8::Function>* >   function_vector_t;
 #else
 typedef std::vector< v8::Persistent<v8::Function> >    function_vector_t;
 #endif
+typedef std::map< std::string, v8::Persistent<v8::Value>* > value_map_t;
 
 typedef struct {
     v8::Persistent<v8::Context> jsContext;
     v8::Isolate                 *isolate;
     function_vector_t           *functions;
-    kv_list_int_t               *kvs;
-    volatile time_t             taskStartTime;
+    /* Per function, the native version, or NULL (see native_map.h) */
+    native_map_vector_t         *natives;
+    bool                        allNative;
+    /* Reductions returned, by their JSON, until rereduced (see runRereduce) */
+    value_map_t                 *reductions;
+    /* Where emit() puts rows, while a map runs, or NULL */
+    EmitBuffer                  *kvs;
+    EmitBuffer                  emitBuffer;
+    /* When the running task started, in milliseconds of gethrtime(), or 0
+       between tasks. Only the terminator thread reads it (see
+       terminateTask), so tasks set it with plain, unfenced stores. */
+    std::atomic<uint64_t>       taskStartTime;
 } mapreduce_ctx_t;
 
 
@@ -63,6 +77,12 @@ void mapDoc(mapreduce_ctx_t *ctx,
             const mapreduce_json_t &meta,
             mapreduce_map_result_list_t *result);
 
+void mapDocs(mapreduce_ctx_t *ctx,
+             const mapreduce_json_t docs[],
+             const mapreduce_json_t metas[],
+             int num_docs,
+             mapreduce_map_result_list_t results[]);
+
 json_results_list_t runReduce(mapreduce_ctx_t *ctx,
                               const mapreduce_json_list_t &keys,
                               const mapreduce_json_list_t &values);
@@ -76,7 +96,11 @@ mapreduce_json_t runRereduce(mapreduce_ctx_t *ctx,
                              int reduceFunNum,
                              const mapreduce_json_list_t &reductions);
 
-void terminateTask(mapreduce_ctx_t *ctx);
+bool terminateTask(mapreduce_ctx_t *ctx, uint64_t startTime);
+
+void setCodeCacheDir(const char *dir);
+
+void setLazyDocs(bool lazy);
 
 
 
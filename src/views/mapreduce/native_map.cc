@@ -0,0 +1,668 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+// Map functions run without V8.
+//
+// Many views are projections: their map function emits a field or two of
+// the document, or just its ID, and nothing else. For those, calling into
+// V8 costs far more than the function does, since the document has to be
+// parsed into JS objects and the emitted values stringified back. Here the
+// source of such a function is recognized when the context is made, and
+// the fields are found by scanning the document's JSON in place.
+//
+// Only what would come out byte for byte as V8 makes it is done here:
+// strings of printable ASCII without escapes, integers that are exact as
+// doubles, and literals. Anything else (objects, arrays, fractions, a
+// missing parent, keys with escapes) sends the document to V8 for that
+// function, so the results never depend on which of the two ran it.
+
+#include "native_map.h"
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+// Deeper documents are left to V8.
+#define MAX_JSON_DEPTH 512
+
+// Digits of the largest integer emitted natively: any 15 digit integer is
+// exact as a double, and V8 prints it back the same way.
+#define MAX_INTEGER_DIGITS 15
+
+typedef enum {
+    ARG_CONSTANT,
+    ARG_DOC,
+    ARG_META
+} native_arg_kind_t;
+
+typedef struct {
+    native_arg_kind_t        kind;
+    std::string              json;      // of a constant
+    std::vector<std::string> path;      // fields of doc or meta
+} native_arg_t;
+
+typedef struct {
+    native_arg_t key;
+    native_arg_t value;
+} native_emit_t;
+
+struct native_map {
+    std::vector<native_emit_t> emits;
+};
+
+// Names found on every object through its prototype, which a missing
+// field would give instead of undefined.
+static const char *PROTOTYPE_NAMES[] = {
+    "__proto__", "__defineGetter__", "__defineSetter__", "__lookupGetter__",
+    "__lookupSetter__", "constructor", "hasOwnProperty", "isPrototypeOf",
+    "propertyIsEnumerable", "toLocaleString", "toString", "valueOf", NULL
+};
+
+
+static inline bool isIdentStart(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$';
+}
+
+
+static inline bool isIdentChar(char c)
+{
+    return isIdentStart(c) || (c >= '0' && c <= '9');
+}
+
+
+// Recognizes "(function [name](doc, meta) { emit(a, b); ... })". No
+// comments, and nothing but emits in the body.
+class SourceParser {
+public:
+    SourceParser(const std::string &source)
+        : p(source.data()), end(source.data() + source.length()) {
+    }
+
+    bool parse(native_map_t *map) {
+        std::string name;
+
+        skipWs();
+        if (!token("(") || !keyword("function")) {
+            return false;
+        }
+        // A function expression may be named
+        ident(name);
+        if (!token("(")) {
+            return false;
+        }
+        if (!token(")")) {
+            if (!ident(docName)) {
+                return false;
+            }
+            if (token(",") && !ident(metaName)) {
+                return false;
+            }
+            if (!token(")")) {
+                return false;
+            }
+        }
+        if (docName == "emit" || metaName == "emit" ||
+            (!metaName.empty() && docName == metaName)) {
+            return false;
+        }
+        if (!token("{")) {
+            return false;
+        }
+        while (keyword("emit")) {
+            native_emit_t e;
+
+            if (!token("(") || !arg(e.key) || !token(",") || !arg(e.value) ||
+                !token(")")) {
+                return false;
+            }
+            token(";");
+            map->emits.push_back(e);
+        }
+        return token("}") && token(")") && p == end;
+    }
+
+private:
+    void skipWs() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+            ++p;
+        }
+    }
+
+    // Takes a punctuation token and the whitespace after it.
+    bool token(const char *tok) {
+        size_t len = strlen(tok);
+
+        if ((size_t) (end - p) < len || memcmp(p, tok, len) != 0) {
+            return false;
+        }
+        p += len;
+        skipWs();
+        return true;
+    }
+
+    bool keyword(const char *word) {
+        size_t len = strlen(word);
+
+        if ((size_t) (end - p) < len || memcmp(p, word, len) != 0 ||
+            (p + len < end && isIdentChar(p[len]))) {
+            return false;
+        }
+        p += len;
+        skipWs();
+        return true;
+    }
+
+    bool ident(std::string &name) {
+        const char *start = p;
+
+        if (p == end || !isIdentStart(*p)) {
+            return false;
+        }
+        while (p < end && isIdentChar(*p)) {
+            ++p;
+        }
+        name.assign(start, p - start);
+        skipWs();
+        return true;
+    }
+
+    bool arg(native_arg_t &a) {
+        static const char *literals[] = { "null", "true", "false", NULL };
+        std::string name;
+
+        a.kind = ARG_CONSTANT;
+        for (int i = 0; literals[i] != NULL; ++i) {
+            if (keyword(literals[i])) {
+                a.json = literals[i];
+                return true;
+            }
+        }
+        if (p < end && (*p == '\'' || *p == '"')) {
+            return stringLiteral(a);
+        }
+        if (p < end && (*p == '-' || (*p >= '0' && *p <= '9'))) {
+            return integerLiteral(a);
+        }
+        if (!ident(name)) {
+            return false;
+        }
+        if (name == docName) {
+            a.kind = ARG_DOC;
+        } else if (!metaName.empty() && name == metaName) {
+            a.kind = ARG_META;
+        } else {
+            return false;
+        }
+        while (p < end && *p == '.') {
+            ++p;
+            skipWs();
+            if (!ident(name)) {
+                return false;
+            }
+            for (int i = 0; PROTOTYPE_NAMES[i] != NULL; ++i) {
+                if (name == PROTOTYPE_NAMES[i]) {
+                    return false;
+                }
+            }
+            a.path.push_back(name);
+        }
+        // The whole object would be reformatted by JSON.stringify
+        return !a.path.empty();
+    }
+
+    bool stringLiteral(native_arg_t &a) {
+        char quote = *p++;
+        const char *start = p;
+
+        while (p < end && *p != quote) {
+            if (*p < 0x20 || *p > 0x7e || *p == '\\' || *p == '"') {
+                return false;
+            }
+            ++p;
+        }
+        if (p == end) {
+            return false;
+        }
+        a.json = "\"";
+        a.json.append(start, p - start);
+        a.json += '"';
+        ++p;
+        skipWs();
+        return true;
+    }
+
+    bool integerLiteral(native_arg_t &a) {
+        const char *start = p;
+
+        if (*p == '-') {
+            ++p;
+        }
+        const char *digits = p;
+        while (p < end && *p >= '0' && *p <= '9') {
+            ++p;
+        }
+        // No octals, fractions, exponents or -0
+        if (p == digits || p - digits > MAX_INTEGER_DIGITS ||
+            (*digits == '0' && (p - digits > 1 || digits != start)) ||
+            (p < end && (isIdentChar(*p) || *p == '.'))) {
+            return false;
+        }
+        a.json.assign(start, p - start);
+        skipWs();
+        return true;
+    }
+
+    const char *p;
+    const char *end;
+    std::string docName;
+    std::string metaName;
+};
+
+
+static inline const char *skipJsonWs(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        ++p;
+    }
+    return p;
+}
+
+
+static inline bool isHex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+
+// Skips the string at p, at its opening quote. Returns NULL if invalid;
+// escaped tells whether it has escapes.
+static const char *skipJsonString(const char *p, const char *end, bool *escaped)
+{
+    *escaped = false;
+    for (++p; p < end; ++p) {
+        unsigned char c = (unsigned char) *p;
+
+        if (c == '"') {
+            return p + 1;
+        } else if (c < 0x20) {
+            return NULL;
+        } else if (c == '\\') {
+            *escaped = true;
+            if (++p == end) {
+                return NULL;
+            }
+            switch (*p) {
+            case '"': case '\\': case '/': case 'b':
+            case 'f': case 'n': case 'r': case 't':
+                break;
+            case 'u':
+                if (end - p < 5 || !isHex(p[1]) || !isHex(p[2]) ||
+                    !isHex(p[3]) || !isHex(p[4])) {
+                    return NULL;
+                }
+                p += 4;
+                break;
+            default:
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static const char *skipJsonDigits(const char *p, const char *end)
+{
+    const char *start = p;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        ++p;
+    }
+    return p == start ? NULL : p;
+}
+
+
+static const char *skipJsonNumber(const char *p, const char *end)
+{
+    if (*p == '-') {
+        ++p;
+    }
+    if (p < end && *p == '0') {
+        ++p;
+    } else if ((p = skipJsonDigits(p, end)) == NULL) {
+        return NULL;
+    }
+    if (p < end && *p == '.' && (p = skipJsonDigits(p + 1, end)) == NULL) {
+        return NULL;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        if (p < end && (*p == '+' || *p == '-')) {
+            ++p;
+        }
+        if ((p = skipJsonDigits(p, end)) == NULL) {
+            return NULL;
+        }
+    }
+    return p;
+}
+
+
+static const char *skipJsonLiteral(const char *p, const char *end, const char *lit)
+{
+    size_t len = strlen(lit);
+
+    if ((size_t) (end - p) < len || memcmp(p, lit, len) != 0) {
+        return NULL;
+    }
+    return p + len;
+}
+
+
+// Skips the value at p, validating it as JSON.parse would. Returns NULL if
+// it's invalid, or too deep to bother with.
+static const char *skipJsonValue(const char *p, const char *end, int depth)
+{
+    bool escaped;
+
+    if (p == end) {
+        return NULL;
+    }
+    switch (*p) {
+    case '"':
+        return skipJsonString(p, end, &escaped);
+    case 't':
+        return skipJsonLiteral(p, end, "true");
+    case 'f':
+        return skipJsonLiteral(p, end, "false");
+    case 'n':
+        return skipJsonLiteral(p, end, "null");
+    case '{':
+    case '[':
+        break;
+    default:
+        return skipJsonNumber(p, end);
+    }
+
+    char close = (*p == '{') ? '}' : ']';
+    bool object = (*p == '{');
+
+    if (depth >= MAX_JSON_DEPTH) {
+        return NULL;
+    }
+    p = skipJsonWs(p + 1, end);
+    if (p < end && *p == close) {
+        return p + 1;
+    }
+    while (p < end) {
+        if (object) {
+            if (*p != '"' || (p = skipJsonString(p, end, &escaped)) == NULL) {
+                return NULL;
+            }
+            p = skipJsonWs(p, end);
+            if (p == end || *p != ':') {
+                return NULL;
+            }
+            p = skipJsonWs(p + 1, end);
+        }
+        if ((p = skipJsonValue(p, end, depth + 1)) == NULL) {
+            return NULL;
+        }
+        p = skipJsonWs(p, end);
+        if (p == end) {
+            return NULL;
+        }
+        if (*p == close) {
+            return p + 1;
+        }
+        if (*p != ',') {
+            return NULL;
+        }
+        p = skipJsonWs(p + 1, end);
+    }
+    return NULL;
+}
+
+
+// Finds the value of the last member named key (the one JSON.parse keeps)
+// of the valid object at p. Returns false if a key has escapes, since it
+// might be the one after unescaping.
+static bool findJsonMember(const char *p,
+                           const char *end,
+                           const std::string &key,
+                           const char **value,
+                           const char **value_end)
+{
+    bool escaped;
+
+    *value = NULL;
+    p = skipJsonWs(p + 1, end);
+    while (*p == '"') {
+        const char *key_start = p + 1;
+        p = skipJsonString(p, end, &escaped);
+        if (escaped) {
+            return false;
+        }
+        size_t key_len = p - 1 - key_start;
+        p = skipJsonWs(skipJsonWs(p, end) + 1, end);
+        const char *v = p;
+        p = skipJsonValue(p, end, 0);
+        if (key_len == key.length() && memcmp(key_start, key.data(), key_len) == 0) {
+            *value = v;
+            *value_end = p;
+        }
+        p = skipJsonWs(p, end);
+        if (*p == ',') {
+            p = skipJsonWs(p + 1, end);
+        }
+    }
+    return true;
+}
+
+
+// Whether V8 gives back the value's JSON as it is.
+static bool isCanonicalJson(const char *p, const char *end)
+{
+    switch (*p) {
+    case '"':
+        for (++p; p < end - 1; ++p) {
+            if (*p < 0x20 || *p > 0x7e || *p == '\\') {
+                return false;
+            }
+        }
+        return true;
+    case 't':
+    case 'f':
+    case 'n':
+        return true;
+    case '-':
+        if (end - p == 2 && p[1] == '0') {
+            return false;
+        }
+        ++p;
+        break;
+    }
+    if (end - p > MAX_INTEGER_DIGITS) {
+        return false;
+    }
+    for ( ; p < end; ++p) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static bool argJson(const native_arg_t &a,
+                    const native_doc_t &ndoc,
+                    const char **json,
+                    size_t *length)
+{
+    if (a.kind == ARG_CONSTANT) {
+        *json = a.json.data();
+        *length = a.json.length();
+        return true;
+    }
+
+    const mapreduce_json_t &obj = (a.kind == ARG_DOC) ? ndoc.doc : ndoc.meta;
+    const char *end = obj.json + obj.length;
+    const char *p = skipJsonWs(obj.json, end);
+    const char *value_end = end;
+
+    for (size_t i = 0; i < a.path.size(); ++i) {
+        const char *value;
+
+        if (*p != '{' || !findJsonMember(p, end, a.path[i], &value, &value_end)) {
+            return false;
+        }
+        if (value == NULL) {
+            // emit() stringifies undefined as null; anything under it
+            // is a TypeError
+            if (i + 1 < a.path.size()) {
+                return false;
+            }
+            *json = "null";
+            *length = sizeof("null") - 1;
+            return true;
+        }
+        p = value;
+    }
+    if (!isCanonicalJson(p, value_end)) {
+        return false;
+    }
+    *json = p;
+    *length = value_end - p;
+    return true;
+}
+
+
+native_map_t *nativeMapCompile(const std::string &source)
+{
+    native_map_t *map = new native_map_t();
+    SourceParser parser(source);
+
+    if (!parser.parse(map)) {
+        delete map;
+        return NULL;
+    }
+    return map;
+}
+
+
+void nativeMapFree(native_map_t *map)
+{
+    delete map;
+}
+
+
+static bool isJsonObject(const mapreduce_json_t &json)
+{
+    const char *end = json.json + json.length;
+    const char *p = skipJsonWs(json.json, end);
+
+    if (p == end || *p != '{') {
+        return false;
+    }
+    p = skipJsonValue(p, end, 0);
+    return p != NULL && skipJsonWs(p, end) == end;
+}
+
+
+bool nativeDocInit(native_doc_t *ndoc,
+                   const mapreduce_json_t &doc,
+                   const mapreduce_json_t &meta)
+{
+    if (!isJsonObject(doc) || !isJsonObject(meta)) {
+        return false;
+    }
+    ndoc->doc = doc;
+    ndoc->meta = meta;
+    return true;
+}
+
+
+bool nativeMapRun(const native_map_t *map,
+                  const native_doc_t &ndoc,
+                  EmitBuffer &kvs)
+{
+    size_t n = map->emits.size();
+    std::vector<const char *> json(2 * n);
+    std::vector<size_t> length(2 * n);
+
+    // All or nothing: find every emit's JSON before copying any
+    for (size_t i = 0; i < n; ++i) {
+        if (!argJson(map->emits[i].key, ndoc, &json[2 * i], &length[2 * i]) ||
+            !argJson(map->emits[i].value, ndoc, &json[2 * i + 1], &length[2 * i + 1])) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < 2 * n; ++i) {
+        kvs.append(json[i], length[i]);
+    }
+    return true;
+}
+
+
+static bool isArrayIndex(const char *key, size_t len)
+{
+    if (len == 0 || len > 10 || (key[0] == '0' && len > 1)) {
+        return false;
+    }
+    uint64_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (key[i] < '0' || key[i] > '9') {
+            return false;
+        }
+        n = n * 10 + (key[i] - '0');
+    }
+    return n < 0xffffffffULL;
+}
+
+
+bool nativeLazyDocCheck(const mapreduce_json_t &doc)
+{
+    const char *end = doc.json + doc.length;
+    const char *p = skipJsonWs(doc.json, end);
+    bool escaped;
+
+    if (!isJsonObject(doc)) {
+        return false;
+    }
+    p = skipJsonWs(p + 1, end);
+    while (*p == '"') {
+        const char *key_start = p + 1;
+        p = skipJsonString(p, end, &escaped);
+        size_t key_len = p - 1 - key_start;
+        if (escaped || isArrayIndex(key_start, key_len) ||
+            (key_len == sizeof("__proto__") - 1 &&
+             memcmp(key_start, "__proto__", key_len) == 0)) {
+            return false;
+        }
+        p = skipJsonWs(skipJsonWs(p, end) + 1, end);
+        p = skipJsonWs(skipJsonValue(p, end, 0), end);
+        if (*p == ',') {
+            p = skipJsonWs(p + 1, end);
+        }
+    }
+    return true;
+}
+
+
+bool nativeDocMember(const mapreduce_json_t &doc,
+                     const std::string &key,
+                     mapreduce_json_t *value)
+{
+    const char *end = doc.json + doc.length;
+    const char *v;
+    const char *v_end;
+
+    if (!findJsonMember(skipJsonWs(doc.json, end), end, key, &v, &v_end) ||
+        v == NULL) {
+        return false;
+    }
+    value->json = (char *) v;
+    value->length = (int) (v_end - v);
+    return true;
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Map functions run without V8. This is a private header, do not include
+ * it in other applications/libraries.
+ **/
+
+#ifndef _NATIVE_MAP_H
+#define _NATIVE_MAP_H
+
+#include "mapreduce.h"
+#include "emit_buffer.h"
+#include <string>
+
+/* A map function recognized as nothing but emits of document fields,
+   metadata fields and constants, such as
+   "function(doc, meta) { emit(meta.id, null); }". */
+typedef struct native_map native_map_t;
+
+/* A document and its metadata, checked once for all the functions mapping
+   it: they're kept only if both are JSON objects. */
+typedef struct {
+    mapreduce_json_t doc;
+    mapreduce_json_t meta;
+} native_doc_t;
+
+/**
+ * Returns the native version of a map function's source, as compiled by
+ * V8 (wrapped in parentheses), or NULL if it isn't one of the patterns
+ * recognized. Functions that return NULL only need running in V8.
+ */
+native_map_t *nativeMapCompile(const std::string &source);
+
+void nativeMapFree(native_map_t *map);
+
+/**
+ * Checks a document can be mapped natively: it and its metadata must be
+ * valid JSON objects. Anything else is left to V8, which reports the
+ * errors.
+ */
+bool nativeDocInit(native_doc_t *ndoc,
+                   const mapreduce_json_t &doc,
+                   const mapreduce_json_t &meta);
+
+/**
+ * Appends what the function emits for a document to kvs, exactly as V8
+ * would have stringified it. Returns false, having added nothing, if the
+ * document needs V8 for this function after all: a field that isn't a
+ * plain string, integer or literal, a missing parent object, or one whose
+ * keys have escapes. Throws std::bad_alloc.
+ */
+bool nativeMapRun(const native_map_t *map,
+                  const native_doc_t &ndoc,
+                  EmitBuffer &kvs);
+
+/**
+ * Checks a document can be handed to V8 functions unparsed, to parse its
+ * members as they're looked up (see mapreduce_set_lazy_docs): it must be
+ * a valid JSON object none of whose keys have escapes, are array indexes
+ * or are "__proto__", which V8 looks up differently.
+ */
+bool nativeLazyDocCheck(const mapreduce_json_t &doc);
+
+/**
+ * Finds the JSON of the member named key of a document that passed
+ * nativeLazyDocCheck, as JSON.parse would keep it. Returns false if it
+ * has none.
+ */
+bool nativeDocMember(const mapreduce_json_t &doc,
+                     const std::string &key,
+                     mapreduce_json_t *value);
+
+#endif
@@ -48,17 +48,21 @@ static int view_purgekp_action(bitmap_t *clearbm, bitmap_t *redbm,
                                                   view_purger_ctx_t *ctx)
 {
     int action = PURGE_PARTIAL;
-    bitmap_t emptybm, dstbm = *clearbm;
-    memset(&emptybm, 0, sizeof(emptybm));
 
-    if (is_equal_bitmap(redbm, clearbm)) {
+    if (ctx->deadline != 0 && !ctx->stopped && gethrtime() >= ctx->deadline) {
+        ctx->stopped = 1;
+    }
+    if (ctx->stopped) {
+        return PURGE_KEEP;
+    }
+
+    /* A subtree whose partitions are all being cleaned goes whole, however
+       many more the cleanup takes out elsewhere */
+    if (!bitmap_intersects(clearbm, redbm)) {
+        action = PURGE_KEEP;
+    } else if (bitmap_is_subset(redbm, clearbm)) {
         action = PURGE_ITEM;
         ctx->count += kvcount;
-    } else {
-        intersect_bitmaps(&dstbm, redbm);
-        if (is_equal_bitmap(&dstbm, &emptybm)) {
-            action = PURGE_KEEP;
-        }
     }
 
     return action;
@@ -67,25 +71,19 @@ static int view_purgekp_action(bitmap_t *clearbm, bitmap_t *redbm,
 int view_id_btree_purge_kv(const sized_buf *key, const sized_buf *val,
                                                  void *ctx)
 {
-    int action;
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_error_t errcode;
     view_purger_ctx_t *purge_ctx = (view_purger_ctx_t *) ctx;
-    view_id_btree_value_t *v = NULL;
+    view_id_btree_value_view_t v;
     (void) key;
 
-    errcode = decode_view_id_btree_value(val->buf, val->size, &v);
+    errcode = view_id_btree_value_view(val->buf, val->size, &v);
     if (errcode != COUCHSTORE_SUCCESS) {
-        action = (int) errcode;
-        goto cleanup;
+        return (int) errcode;
     }
 
-    action = view_purgekv_action(&purge_ctx->cbitmask, v->partition,
-                                                       1,
-                                                       purge_ctx);
-
-cleanup:
-    free_view_id_btree_value(v);
-    return action;
+    return view_purgekv_action(&purge_ctx->cbitmask, v.partition,
+                                                     1,
+                                                     purge_ctx);
 }
 
 int view_id_btree_purge_kp(const node_pointer *ptr, void *ctx)
@@ -112,26 +110,19 @@ cleanup:
 
 int view_btree_purge_kv(const sized_buf *key, const sized_buf *val, void *ctx)
 {
-    int action;
-    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_error_t errcode;
     view_purger_ctx_t *purge_ctx = (view_purger_ctx_t *) ctx;
-    view_btree_value_t *v = NULL;
+    view_btree_value_view_t v;
     (void) key;
 
-    errcode = decode_view_btree_value(val->buf, val->size, &v);
+    errcode = view_btree_value_view(val->buf, val->size, &v);
     if (errcode != COUCHSTORE_SUCCESS) {
-        action = (int) errcode;
-        goto cleanup;
+        return (int) errcode;
     }
 
-    action = view_purgekv_action(&purge_ctx->cbitmask, v->partition,
-                                                       v->num_values,
-                                                       purge_ctx);
-
-cleanup:
-    free_view_btree_value(v);
-
-    return action;
+    return view_purgekv_action(&purge_ctx->cbitmask, v.partition,
+                                                     v.num_values,
+                                                     purge_ctx);
 }
 
 int view_btree_purge_kp(const node_pointer *ptr, void *ctx)
@@ -38,6 +38,10 @@ extern "C" {
     typedef struct {
         bitmap_t cbitmask;
         uint64_t count;
+        /* When non-zero, nodes are kept whole from then on, the cleanup
+           of what's left being picked up by the next one */
+        hrtime_t deadline;
+        int      stopped;
     } view_purger_ctx_t;
 
     int view_id_btree_purge_kv(const sized_buf *key, const sized_buf *val,
@@ -0,0 +1,689 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "query.h"
+#include "collate_json.h"
+#include "keys.h"
+#include "values.h"
+#include "reductions.h"
+#include "../arena.h"
+#include "../node_cache.h"
+#include "../node_types.h"
+
+/* Reductions gathered for a group before they're rereduced into one */
+#define QUERY_MAX_PIECES 64
+
+typedef struct {
+    tree_file               *file;
+    view_reducer_ctx_t      *red_ctx;
+    const view_query_t      *query;
+    view_query_row_fn       callback;
+    void                    *callback_ctx;
+    /* The range of JSON keys being walked, either bound NULL for none */
+    const sized_buf         *low;
+    const sized_buf         *high;
+    int                     low_inclusive;
+    int                     high_inclusive;
+    int                     range_done;
+    uint64_t                skip;           /* rows still to pass over */
+    uint64_t                limit;          /* rows still to return */
+    /* Of a reduce: the current group's key, the reductions gathered for
+       it and the items of the leaf being read that belong to it */
+    int                     in_group;
+    char                    *group_buf;
+    size_t                  group_size;
+    size_t                  group_alloc;
+    arena                   *pieces_arena;
+    nodelist                *pieces;
+    nodelist                *pieces_end;
+    int                     num_pieces;
+    arena                   *kvs_arena;
+    nodelist                *kvs;
+    nodelist                *kvs_end;
+    int                     num_kvs;
+    char                    *redbuf;        /* MAX_REDUCTION_SIZE */
+    /* For reductions and group keys looked at once */
+    arena                   *scratch;
+} query_ctx;
+
+
+static int query_stopped(const query_ctx *q)
+{
+    return q->range_done || q->limit == 0;
+}
+
+static couchstore_error_t json_key_of(const sized_buf *key, sized_buf *json)
+{
+    view_btree_key_t k;
+    couchstore_error_t ret = view_btree_key_view(key->buf, key->size, &k);
+
+    if (ret == COUCHSTORE_SUCCESS) {
+        *json = k.json_key;
+    }
+    return ret;
+}
+
+/* Where a JSON key lies: below the range (< 0), in it (0) or above it */
+static int range_position(const query_ctx *q, const sized_buf *json)
+{
+    int c;
+
+    if (q->low != NULL) {
+        c = CollateJSON(json, q->low, kCollateJSON_Unicode);
+        if (c < 0 || (c == 0 && !q->low_inclusive)) {
+            return -1;
+        }
+    }
+    if (q->high != NULL) {
+        c = CollateJSON(json, q->high, kCollateJSON_Unicode);
+        if (c > 0 || (c == 0 && !q->high_inclusive)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether the rows of the partitions in bm are wanted: all (1), none (0)
+   or only some (-1) */
+static int partitions_wanted(const query_ctx *q, const bitmap_t *bm)
+{
+    const bitmap_t *wanted = q->query->partitions;
+
+    if (wanted == NULL || bitmap_is_subset(bm, wanted)) {
+        return 1;
+    }
+    return bitmap_intersects(bm, wanted) ? -1 : 0;
+}
+
+static const char *json_skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        ++p;
+    }
+    return p;
+}
+
+/* The end of the JSON value starting at p, or NULL if it's cut short */
+static const char *json_skip_value(const char *p, const char *end)
+{
+    int depth = 0;
+
+    p = json_skip_space(p, end);
+    do {
+        if (p >= end) {
+            return NULL;
+        }
+        switch (*p) {
+        case '"':
+            for (++p; p < end && *p != '"'; ++p) {
+                if (*p == '\\') {
+                    ++p;
+                }
+            }
+            if (p >= end) {
+                return NULL;
+            }
+            ++p;
+            break;
+        case '[':
+        case '{':
+            ++depth;
+            ++p;
+            break;
+        case ']':
+        case '}':
+            --depth;
+            ++p;
+            break;
+        default:
+            if (depth > 0) {
+                ++p;
+                break;
+            }
+            while (p < end && *p != ',' && *p != ']' && *p != '}' &&
+                   *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+                ++p;
+            }
+        }
+    } while (depth > 0);
+
+    return p;
+}
+
+/* The key of the group json is in, allocated from the scratch arena if
+   it isn't json itself */
+static couchstore_error_t group_key(query_ctx *q,
+                                   const sized_buf *json,
+                                   sized_buf *group)
+{
+    const char *end = json->buf + json->size;
+    const char *p;
+    int level = q->query->group_level;
+    int i;
+
+    if (level == 0) {
+        group->buf = NULL;
+        group->size = 0;
+        return COUCHSTORE_SUCCESS;
+    }
+    *group = *json;
+    if (level == VIEW_QUERY_GROUP_EXACT) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    p = json_skip_space(json->buf, end);
+    if (p >= end || *p != '[') {
+        return COUCHSTORE_SUCCESS;
+    }
+    ++p;
+    for (i = 0; i < level; ++i) {
+        p = json_skip_space(p, end);
+        if (p >= end || *p == ']') {
+            return COUCHSTORE_SUCCESS;
+        }
+        if (i > 0) {
+            if (*p != ',') {
+                return COUCHSTORE_ERROR_CORRUPT;
+            }
+            ++p;
+        }
+        p = json_skip_value(p, end);
+        if (p == NULL) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+    }
+    p = json_skip_space(p, end);
+    if (p >= end || *p == ']') {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    /* The first level items, and the bracket closing them */
+    group->size = p - json->buf + 1;
+    group->buf = (char *) arena_alloc(q->scratch, group->size);
+    if (group->buf == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(group->buf, json->buf, group->size - 1);
+    group->buf[group->size - 1] = ']';
+    return COUCHSTORE_SUCCESS;
+}
+
+static int groups_equal(const sized_buf *g1, const sized_buf *g2)
+{
+    if (g1->size == 0 || g2->size == 0) {
+        return g1->size == g2->size;
+    }
+    return CollateJSON(g1, g2, kCollateJSON_Unicode) == 0;
+}
+
+/* Whether two JSON keys are in the same group */
+static couchstore_error_t same_group(query_ctx *q,
+                                    const sized_buf *json1,
+                                    const sized_buf *json2,
+                                    int *same)
+{
+    couchstore_error_t ret;
+    sized_buf g1, g2;
+
+    arena_free_all(q->scratch);
+    ret = group_key(q, json1, &g1);
+    if (ret == COUCHSTORE_SUCCESS) {
+        ret = group_key(q, json2, &g2);
+    }
+    if (ret == COUCHSTORE_SUCCESS) {
+        *same = groups_equal(&g1, &g2);
+    }
+    return ret;
+}
+
+static couchstore_error_t emit_row(query_ctx *q, const view_query_row_t *row)
+{
+    if (q->skip > 0) {
+        q->skip--;
+        return COUCHSTORE_SUCCESS;
+    }
+    q->limit--;
+    return q->callback(row, q->callback_ctx);
+}
+
+static couchstore_error_t add_piece(query_ctx *q, const char *reduction, size_t size)
+{
+    couchstore_error_t ret;
+    node_pointer *ptr;
+    nodelist *n;
+
+    ptr = (node_pointer *) arena_alloc(q->pieces_arena, sizeof(node_pointer) + size);
+    n = (nodelist *) arena_alloc(q->pieces_arena, sizeof(nodelist));
+    if (ptr == NULL || n == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memset(ptr, 0, sizeof(*ptr));
+    memset(n, 0, sizeof(*n));
+    ptr->reduce_value.buf = (char *) (ptr + 1);
+    ptr->reduce_value.size = size;
+    memcpy(ptr->reduce_value.buf, reduction, size);
+    n->pointer = ptr;
+
+    if (q->pieces_end != NULL) {
+        q->pieces_end->next = n;
+    } else {
+        q->pieces = n;
+    }
+    q->pieces_end = n;
+    q->num_pieces++;
+
+    if (q->num_pieces < QUERY_MAX_PIECES) {
+        return COUCHSTORE_SUCCESS;
+    }
+    /* Rereduced into one, before the arena they're in is reset */
+    ret = view_btree_rereduce(q->redbuf, &size, q->pieces, q->num_pieces,
+                              q->red_ctx);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+    arena_free_all(q->pieces_arena);
+    q->pieces = q->pieces_end = NULL;
+    q->num_pieces = 0;
+    return add_piece(q, q->redbuf, size);
+}
+
+/* Reduces the leaf items gathered into one of the group's reductions */
+static couchstore_error_t flush_kvs(query_ctx *q)
+{
+    couchstore_error_t ret;
+    size_t size;
+
+    if (q->num_kvs == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+    ret = view_btree_reduce(q->redbuf, &size, q->kvs, q->num_kvs, q->red_ctx);
+    arena_free_all(q->kvs_arena);
+    q->kvs = q->kvs_end = NULL;
+    q->num_kvs = 0;
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+    return add_piece(q, q->redbuf, size);
+}
+
+static couchstore_error_t add_kv(query_ctx *q, const sized_buf *k, const sized_buf *v)
+{
+    nodelist *n = (nodelist *) arena_alloc(q->kvs_arena, sizeof(nodelist));
+
+    if (n == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memset(n, 0, sizeof(*n));
+    n->key = *k;
+    n->data = *v;
+    if (q->kvs_end != NULL) {
+        q->kvs_end->next = n;
+    } else {
+        q->kvs = n;
+    }
+    q->kvs_end = n;
+    q->num_kvs++;
+    return COUCHSTORE_SUCCESS;
+}
+
+/* Returns the current group's row, with the reduction of all gathered */
+static couchstore_error_t emit_group(query_ctx *q)
+{
+    couchstore_error_t ret;
+    view_btree_reduction_t *r = NULL;
+    view_query_row_t row;
+    const char *reduction;
+    size_t size;
+
+    if (!q->in_group) {
+        return COUCHSTORE_SUCCESS;
+    }
+    q->in_group = 0;
+    ret = flush_kvs(q);
+    if (ret != COUCHSTORE_SUCCESS || q->num_pieces == 0) {
+        return ret;
+    }
+
+    if (q->num_pieces == 1) {
+        reduction = q->pieces->pointer->reduce_value.buf;
+        size = q->pieces->pointer->reduce_value.size;
+    } else {
+        ret = view_btree_rereduce(q->redbuf, &size, q->pieces, q->num_pieces,
+                                  q->red_ctx);
+        if (ret != COUCHSTORE_SUCCESS) {
+            return ret;
+        }
+        reduction = q->redbuf;
+    }
+    ret = decode_view_btree_reduction_in_arena(reduction, size, q->pieces_arena, &r);
+    if (ret == COUCHSTORE_SUCCESS && q->query->reducer >= r->num_values) {
+        ret = COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+    if (ret == COUCHSTORE_SUCCESS) {
+        memset(&row, 0, sizeof(row));
+        row.key.buf = q->group_buf;
+        row.key.size = q->group_size;
+        row.value = r->reduce_values[q->query->reducer];
+        ret = emit_row(q, &row);
+    }
+
+    arena_free_all(q->pieces_arena);
+    q->pieces = q->pieces_end = NULL;
+    q->num_pieces = 0;
+    return ret;
+}
+
+/* Makes the group of json the current one, returning the one before if
+   it's another */
+static couchstore_error_t enter_group(query_ctx *q, const sized_buf *json)
+{
+    couchstore_error_t ret;
+    sized_buf group, current;
+
+    arena_free_all(q->scratch);
+    ret = group_key(q, json, &group);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+    if (q->in_group) {
+        current.buf = q->group_buf;
+        current.size = q->group_size;
+        if (groups_equal(&current, &group)) {
+            return COUCHSTORE_SUCCESS;
+        }
+        ret = emit_group(q);
+        if (ret != COUCHSTORE_SUCCESS) {
+            return ret;
+        }
+    }
+
+    if (group.size > q->group_alloc) {
+        char *buf = (char *) cs_realloc(q->group_buf, group.size);
+        if (buf == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        q->group_buf = buf;
+        q->group_alloc = group.size;
+    }
+    if (group.size > 0) {
+        memcpy(q->group_buf, group.buf, group.size);
+    }
+    q->group_size = group.size;
+    q->in_group = 1;
+    return COUCHSTORE_SUCCESS;
+}
+
+static couchstore_error_t query_leaf_item(query_ctx *q,
+                                          const sized_buf *key,
+                                          const sized_buf *value)
+{
+    couchstore_error_t ret;
+    view_btree_key_t k;
+    view_btree_value_view_t v;
+    view_query_row_t row;
+    int pos;
+
+    ret = view_btree_key_view(key->buf, key->size, &k);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+    pos = range_position(q, &k.json_key);
+    if (pos != 0) {
+        /* Past the end of the range, in the direction walked */
+        if ((pos > 0) != (q->query->descending != 0)) {
+            q->range_done = 1;
+        }
+        return COUCHSTORE_SUCCESS;
+    }
+
+    ret = view_btree_value_view(value->buf, value->size, &v);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+    if (q->query->partitions != NULL &&
+        !is_bit_set(q->query->partitions, v.partition)) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    if (q->query->reduce) {
+        ret = enter_group(q, &k.json_key);
+        if (ret != COUCHSTORE_SUCCESS || q->limit == 0) {
+            return ret;
+        }
+        return add_kv(q, key, value);
+    }
+
+    row.key = k.json_key;
+    row.doc_id = k.doc_id;
+    row.partition = v.partition;
+    while (ret == COUCHSTORE_SUCCESS && q->limit > 0 &&
+           view_btree_value_next(&v, &row.value)) {
+        ret = emit_row(q, &row);
+    }
+    return ret;
+}
+
+static couchstore_error_t query_node(query_ctx *q, uint64_t pos,
+                                     const sized_buf *prev);
+
+/* Walks the subtree ptr points to, whose keys are all past prev (the key
+   before it in the tree, or NULL if there's none), or uses its reduction
+   for it when that's enough */
+static couchstore_error_t query_subtree(query_ctx *q,
+                                        const node_pointer *ptr,
+                                        const sized_buf *prev)
+{
+    couchstore_error_t ret;
+    view_btree_reduction_t *r = NULL;
+    sized_buf last, first;
+    int pos, inside, wanted, same = 1;
+    uint64_t kv_count;
+
+    ret = json_key_of(&ptr->key, &last);
+    if (ret == COUCHSTORE_SUCCESS && prev != NULL) {
+        ret = json_key_of(prev, &first);
+    }
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+
+    pos = range_position(q, &last);
+    if (pos < 0) {
+        /* All below the range */
+        q->range_done = q->query->descending;
+        return COUCHSTORE_SUCCESS;
+    }
+    if (prev != NULL && q->high != NULL &&
+        CollateJSON(&first, q->high, kCollateJSON_Unicode) >= 0) {
+        /* All above it */
+        q->range_done = !q->query->descending;
+        return COUCHSTORE_SUCCESS;
+    }
+    inside = pos == 0 &&
+        (q->low == NULL ||
+         (prev != NULL && CollateJSON(&first, q->low, kCollateJSON_Unicode) >= 0));
+
+    arena_free_all(q->scratch);
+    ret = decode_view_btree_reduction_in_arena(ptr->reduce_value.buf,
+                                               ptr->reduce_value.size,
+                                               q->scratch, &r);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+    wanted = partitions_wanted(q, &r->partitions_bitmap);
+    kv_count = r->kv_count;
+    if (wanted == 0) {
+        return COUCHSTORE_SUCCESS;
+    }
+
+    if (inside && wanted > 0) {
+        if (!q->query->reduce && q->skip >= kv_count) {
+            q->skip -= kv_count;
+            return COUCHSTORE_SUCCESS;
+        }
+        if (q->query->reduce && q->query->group_level != 0) {
+            if (prev == NULL) {
+                same = 0;
+            } else {
+                ret = same_group(q, &first, &last, &same);
+                if (ret != COUCHSTORE_SUCCESS) {
+                    return ret;
+                }
+            }
+        }
+        if (q->query->reduce && same) {
+            ret = enter_group(q, &last);
+            if (ret != COUCHSTORE_SUCCESS || q->limit == 0) {
+                return ret;
+            }
+            return add_piece(q, ptr->reduce_value.buf, ptr->reduce_value.size);
+        }
+    }
+
+    return query_node(q, ptr->pointer, prev);
+}
+
+static couchstore_error_t query_node(query_ctx *q, uint64_t pos,
+                                     const sized_buf *prev)
+{
+    couchstore_error_t ret;
+    decoded_node *node = NULL;
+    unsigned n, i;
+
+    ret = btree_read_node(q->file, pos, 1, &node);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+
+    for (n = 0; n < node->count && ret == COUCHSTORE_SUCCESS && !query_stopped(q); ++n) {
+        i = q->query->descending ? node->count - 1 - n : n;
+        if (node->buf[0] == KP_NODE) {
+            const raw_node_pointer *raw =
+                (const raw_node_pointer *) node->entries[i].value.buf;
+            node_pointer child;
+
+            child.key = node->entries[i].key;
+            child.pointer = decode_raw48(raw->pointer);
+            child.subtreesize = decode_raw48(raw->subtreesize);
+            child.reduce_value.buf = node->entries[i].value.buf + sizeof(*raw);
+            child.reduce_value.size = decode_raw16(raw->reduce_value_size);
+            ret = query_subtree(q, &child, i > 0 ? &node->entries[i - 1].key : prev);
+        } else {
+            ret = query_leaf_item(q, &node->entries[i].key, &node->entries[i].value);
+        }
+    }
+    /* The items gathered point into the leaf */
+    if (ret == COUCHSTORE_SUCCESS && node->buf[0] == KV_NODE) {
+        ret = flush_kvs(q);
+    }
+
+    node_release(q->file->node_cache, node);
+    return ret;
+}
+
+static couchstore_error_t query_range(query_ctx *q,
+                                      const node_pointer *root,
+                                      const sized_buf *start,
+                                      const sized_buf *end,
+                                      int inclusive_end)
+{
+    if (q->query->descending) {
+        q->high = start;
+        q->high_inclusive = 1;
+        q->low = end;
+        q->low_inclusive = inclusive_end;
+    } else {
+        q->low = start;
+        q->low_inclusive = 1;
+        q->high = end;
+        q->high_inclusive = inclusive_end;
+    }
+    q->range_done = 0;
+    return query_node(q, root->pointer, NULL);
+}
+
+couchstore_error_t view_btree_query(tree_file *file,
+                                    const node_pointer *root,
+                                    view_reducer_ctx_t *red_ctx,
+                                    const view_query_t *query,
+                                    view_query_row_fn callback,
+                                    void *ctx)
+{
+    couchstore_error_t ret = COUCHSTORE_SUCCESS;
+    query_ctx q;
+    unsigned i;
+
+    if (query->reduce && red_ctx == NULL) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    memset(&q, 0, sizeof(q));
+    q.file = file;
+    q.red_ctx = red_ctx;
+    q.query = query;
+    q.callback = callback;
+    q.callback_ctx = ctx;
+    q.skip = query->skip;
+    q.limit = query->limit ? query->limit : UINT64_MAX;
+    q.scratch = new_arena(0);
+    q.pieces_arena = new_arena(0);
+    q.kvs_arena = new_arena(0);
+    q.redbuf = (char *) cs_malloc(MAX_REDUCTION_SIZE);
+    if (q.scratch == NULL || q.pieces_arena == NULL || q.kvs_arena == NULL ||
+        q.redbuf == NULL) {
+        ret = COUCHSTORE_ERROR_ALLOC_FAIL;
+        goto cleanup;
+    }
+
+    if (root == NULL) {
+        goto cleanup;
+    }
+    if (query->num_keys > 0) {
+        for (i = 0; i < query->num_keys && q.limit > 0; ++i) {
+            ret = query_range(&q, root, &query->keys[i], &query->keys[i], 1);
+            if (ret != COUCHSTORE_SUCCESS) {
+                goto cleanup;
+            }
+        }
+    } else {
+        ret = query_range(&q, root, query->start_key, query->end_key,
+                          query->inclusive_end);
+        if (ret != COUCHSTORE_SUCCESS) {
+            goto cleanup;
+        }
+    }
+    if (query->reduce) {
+        ret = emit_group(&q);
+    }
+
+cleanup:
+    if (q.scratch != NULL) {
+        delete_arena(q.scratch);
+    }
+    if (q.pieces_arena != NULL) {
+        delete_arena(q.pieces_arena);
+    }
+    if (q.kvs_arena != NULL) {
+        delete_arena(q.kvs_arena);
+    }
+    cs_free(q.redbuf);
+    cs_free(q.group_buf);
+
+    return ret;
+}
@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+#ifndef _VIEW_QUERY_H
+#define _VIEW_QUERY_H
+
+#include "config.h"
+#include <stdint.h>
+#include <libcouchstore/visibility.h>
+#include <libcouchstore/couch_db.h>
+#include <libcouchstore/couch_common.h>
+#include "../couch_btree.h"
+#include "bitmap.h"
+#include "reducers.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* group_level grouping reduce rows by their whole keys */
+#define VIEW_QUERY_GROUP_EXACT -1
+
+    /* A query of a mapreduce view's btree. Keys are JSON, in CollateJSON
+       order (CouchDB's), and rows come in that order, or the reverse if
+       descending. */
+    typedef struct {
+        /* The rows from start_key to end_key, either NULL for no bound;
+           in descending order start_key is the highest. The end is left
+           out unless inclusive_end is set. */
+        const sized_buf *start_key;
+        const sized_buf *end_key;
+        int inclusive_end;
+        /* Or, if num_keys > 0, those with these keys, one key after the
+           other in the order given */
+        const sized_buf *keys;
+        unsigned num_keys;
+        int descending;
+        /* Only the rows of these partitions, or of all if NULL */
+        const bitmap_t *partitions;
+        /* Rows passed over, then most rows returned (0 for no limit) */
+        uint64_t skip;
+        uint64_t limit;
+        /* Whether the rows are reduced with the btree's reducer'th reduce
+           function: grouped by the first group_level items of their keys
+           (the whole of those that aren't arrays or have fewer), by their
+           whole keys if VIEW_QUERY_GROUP_EXACT, or all into one if 0 */
+        int reduce;
+        unsigned reducer;
+        int group_level;
+    } view_query_t;
+
+    /* A row: of a map query, a value emitted for the key and document;
+       of a reduce query, the key of a group (empty if the query has no
+       grouping) and its reduction, with an empty doc_id and partition 0.
+       It only lives as long as the callback. */
+    typedef struct {
+        sized_buf key;
+        sized_buf doc_id;
+        sized_buf value;
+        uint16_t partition;
+    } view_query_row_t;
+
+    /* Called with each row in turn; anything but COUCHSTORE_SUCCESS stops
+       the query, which returns it. */
+    typedef couchstore_error_t (*view_query_row_fn)(const view_query_row_t *row,
+                                                    void *ctx);
+
+    /*
+     * Runs a query of the view btree at root in file, whose reductions
+     * red_ctx works out. Reduce queries take the reductions of the
+     * subtrees wholly within a group rather than reading their leaves,
+     * and map queries pass over skipped subtrees by their reductions'
+     * counts; subtrees none of whose partitions are wanted aren't read.
+     */
+    couchstore_error_t view_btree_query(tree_file *file,
+                                        const node_pointer *root,
+                                        view_reducer_ctx_t *red_ctx,
+                                        const view_query_t *query,
+                                        view_query_row_fn callback,
+                                        void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,23 +25,27 @@
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <math.h>
 #include "bitmap.h"
 #include "keys.h"
 #include "reductions.h"
 #include "values.h"
 #include "reducers.h"
 #include "../couch_btree.h"
+#include "../arena.h"
 
 typedef enum {
     VIEW_REDUCER_SUCCESS                = 0,
     VIEW_REDUCER_ERROR_NOT_A_NUMBER     = 1,
-    VIEW_REDUCER_ERROR_BAD_STATS_OBJECT = 2
+    VIEW_REDUCER_ERROR_BAD_STATS_OBJECT = 2,
+    VIEW_REDUCER_ERROR_BAD_HLL_OBJECT   = 3
 } builtin_reducer_error_t;
 
 static const char *builtin_reducer_error_msg[] = {
     NULL,
     "Value is not a number",
-    "Invalid _stats JSON object"
+    "Invalid _stats JSON object",
+    "Invalid _approx_count_distinct JSON object"
 };
 
 typedef struct {
@@ -71,6 +75,9 @@ typedef struct {
     unsigned                 num_reducers;
     reducer_fn_t             *reducers;
     reducer_ctx_t            *reducer_contexts;
+
+    /* What a reduce or rereduce call decodes, emptied by the next call */
+    arena                    *scratch;
 } reducer_private_t;
 
 
@@ -79,12 +86,22 @@ typedef struct {
         sscanf(buf, "{\"sum\":%lg,\"count\":%"SCNu64",\"min\":%lg,\"max\":%lg,\"sumsqr\":%lg}",\
                &sum, &count, &min, &max, &sumsqr)
 
-#define sprint_stats(buf, sum, count, min, max, sumsqr) \
-        sprintf(buf, "{\"sum\":%g,\"count\":%"PRIu64",\"min\":%g,\"max\":%g,\"sumsqr\":%g}",\
-                sum, count, min, max, sumsqr)
 
-static void free_key_excluding_elements(view_btree_key_t *key);
-static void free_json_key_list(mapreduce_json_list_t *list);
+/* Integers below 10^15 and 10^6 are printed whole by DOUBLE_FMT and %g */
+#define DOUBLE_FMT_INTEGRAL_LIMIT 1e15
+#define STATS_FMT_INTEGRAL_LIMIT  1e6
+
+/* Powers of ten a double holds exactly */
+static const double exact_powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static couchstore_error_t run_reducer(view_reducer_ctx_t *red_ctx,
+                                      unsigned i,
+                                      const mapreduce_json_list_t *keys,
+                                      const mapreduce_json_list_t *values,
+                                      sized_buf *buf);
 
 
 static int json_to_str(const mapreduce_json_t *buf, char str[32])
@@ -99,11 +116,175 @@ static int json_to_str(const mapreduce_json_t *buf, char str[32])
 }
 
 
+/*
+ * Parses a JSON number of at most 15 significant digits, whose exponent,
+ * counting the fraction's digits, is within 22 of 0. Both its digits and
+ * that power of ten are exact doubles, so the one multiplication or
+ * division rounds as strtod would. Returns 0, for strtod to deal with, on
+ * anything else.
+ */
+static int parse_simple_double(const char *str, size_t len, double *out_num)
+{
+    const char *p = str, *end = str + len;
+    int negative = 0, digits = 0, exp = 0;
+    uint64_t m = 0;
+    double n;
+
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return 0;
+    }
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if ((m != 0 || *p != '0') && ++digits > 15) {
+            return 0;
+        }
+        m = m * 10 + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        if (++p == end || *p < '0' || *p > '9') {
+            return 0;
+        }
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if ((m != 0 || *p != '0') && ++digits > 15) {
+                return 0;
+            }
+            m = m * 10 + (*p - '0');
+            exp--;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int e = 0, exp_negative = 0;
+
+        if (++p < end && (*p == '+' || *p == '-')) {
+            exp_negative = (*p++ == '-');
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            return 0;
+        }
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            e = e * 10 + (*p - '0');
+            if (e > 100) {
+                return 0;
+            }
+        }
+        exp += exp_negative ? -e : e;
+    }
+    if (p != end || exp < -22 || exp > 22) {
+        return 0;
+    }
+
+    n = (double) m;
+    if (exp < 0) {
+        n /= exact_powers_of_ten[-exp];
+    } else {
+        n *= exact_powers_of_ten[exp];
+    }
+    *out_num = negative ? -n : n;
+
+    return 1;
+}
+
+
+/* Parses up to 19 digits, which can't overflow, as strtoull would. */
+static int parse_simple_uint64(const char *str, size_t len, uint64_t *out_num)
+{
+    uint64_t n = 0;
+    size_t i;
+
+    if (len < 1 || len > 19) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return 0;
+        }
+        n = n * 10 + (str[i] - '0');
+    }
+    *out_num = n;
+
+    return 1;
+}
+
+
+/* Whether n is an integer below limit, other than -0, which
+   printf("%.<p>g") prints as its digits when limit is 10^p. */
+static int is_integral_double(double n, double limit)
+{
+    return n > -limit && n < limit && n == (double) (int64_t) n &&
+           !(n == 0 && 1 / n < 0);
+}
+
+
+/* Prints n as printf("%.<p>g") does, where limit is 10^p, if it's an
+   integer below limit, which that prints as its digits. Returns the
+   length printed, or 0 having printed nothing. */
+static int sprint_integral_double(char *buf, double n, double limit)
+{
+    char digits[24];
+    int len = 0, size = 0;
+    uint64_t u;
+
+    if (!is_integral_double(n, limit)) {
+        return 0;
+    }
+    if (n < 0) {
+        buf[size++] = '-';
+        n = -n;
+    }
+    u = (uint64_t) n;
+    do {
+        digits[len++] = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    while (len > 0) {
+        buf[size++] = digits[--len];
+    }
+
+    return size;
+}
+
+
+static int sprint_double(char *buf, const char *fmt, double n, double limit)
+{
+    int size = sprint_integral_double(buf, n, limit);
+
+    if (size == 0) {
+        size = sprintf(buf, fmt, n);
+    }
+
+    return size;
+}
+
+
+static int sprint_stats(char *buf, const stats_t *s)
+{
+    int size = 0;
+
+    size += sprintf(buf + size, "{\"sum\":");
+    size += sprint_double(buf + size, "%g", s->sum, STATS_FMT_INTEGRAL_LIMIT);
+    size += sprintf(buf + size, ",\"count\":%"PRIu64",\"min\":", s->count);
+    size += sprint_double(buf + size, "%g", s->min, STATS_FMT_INTEGRAL_LIMIT);
+    size += sprintf(buf + size, ",\"max\":");
+    size += sprint_double(buf + size, "%g", s->max, STATS_FMT_INTEGRAL_LIMIT);
+    size += sprintf(buf + size, ",\"sumsqr\":");
+    size += sprint_double(buf + size, "%g", s->sumsqr, STATS_FMT_INTEGRAL_LIMIT);
+    buf[size++] = '}';
+
+    return size;
+}
+
+
 static int json_to_double(const mapreduce_json_t *buf, double *out_num)
 {
     char str[32];
     char *end;
 
+    if (parse_simple_double(buf->json, buf->length, out_num)) {
+        return 1;
+    }
     if (!json_to_str(buf, str)) {
         return 0;
     }
@@ -118,6 +299,9 @@ static int json_to_uint64(const mapreduce_json_t *buf, uint64_t *out_num)
     char str[32];
     char *end;
 
+    if (parse_simple_uint64(buf->json, buf->length, out_num)) {
+        return 1;
+    }
     if (!json_to_str(buf, str)) {
         return 0;
     }
@@ -139,7 +323,7 @@ couchstore_error_t view_id_btree_reduce(char *dst,
     const nodelist *i;
 
     (void) ctx;
-    r = (view_id_btree_reduction_t *) malloc(sizeof(view_id_btree_reduction_t));
+    r = (view_id_btree_reduction_t *) cs_malloc(sizeof(view_id_btree_reduction_t));
     if (r == NULL) {
         errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto alloc_error;
@@ -147,14 +331,13 @@ couchstore_error_t view_id_btree_reduce(char *dst,
     memset(&r->partitions_bitmap, 0, sizeof(bitmap_t));
 
     for (i = leaflist; i != NULL && count > 0; i = i->next, count--) {
-        view_id_btree_value_t *v = NULL;
-        errcode = decode_view_id_btree_value(i->data.buf, i->data.size, &v);
+        view_id_btree_value_view_t v;
+        errcode = view_id_btree_value_view(i->data.buf, i->data.size, &v);
         if (errcode != COUCHSTORE_SUCCESS) {
             goto alloc_error;
         }
-        set_bit(&r->partitions_bitmap, v->partition);
+        set_bit(&r->partitions_bitmap, v.partition);
         subtree_count++;
-        free_view_id_btree_value(v);
     }
     r->kv_count = subtree_count;
     errcode = encode_view_id_btree_reduction(r, dst, size_r);
@@ -178,7 +361,7 @@ couchstore_error_t view_id_btree_rereduce(char *dst,
     const nodelist *i;
 
     (void) ctx;
-    r = (view_id_btree_reduction_t *) malloc(sizeof(view_id_btree_reduction_t));
+    r = (view_id_btree_reduction_t *) cs_malloc(sizeof(view_id_btree_reduction_t));
     if (r == NULL) {
         errcode = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto alloc_error;
@@ -204,6 +387,53 @@ alloc_error:
 }
 
 
+/* Finds the number of the next field of a _stats reduction, as
+   sprint_stats prints it. */
+static int next_stats_field(const char **p, const char *end, const char *name,
+                            const char **num, size_t *num_len)
+{
+    size_t name_len = strlen(name);
+
+    if ((size_t) (end - *p) <= name_len || memcmp(*p, name, name_len) != 0) {
+        return 0;
+    }
+    *num = *p + name_len;
+    *p = *num;
+    while (*p < end && **p != ',' && **p != '}') {
+        (*p)++;
+    }
+    *num_len = *p - *num;
+
+    return *p < end;
+}
+
+
+/* Parses a _stats reduction in the form sprint_stats prints, without
+   copying it for sscanf. Returns 0 for scan_stats to deal with anything
+   else. */
+static int parse_stats(const mapreduce_json_t *value, stats_t *s)
+{
+    const char *p = value->json, *end = value->json + value->length;
+    const char *num;
+    size_t len;
+
+    if (!next_stats_field(&p, end, "{\"sum\":", &num, &len) ||
+        !parse_simple_double(num, len, &s->sum) ||
+        !next_stats_field(&p, end, ",\"count\":", &num, &len) ||
+        !parse_simple_uint64(num, len, &s->count) ||
+        !next_stats_field(&p, end, ",\"min\":", &num, &len) ||
+        !parse_simple_double(num, len, &s->min) ||
+        !next_stats_field(&p, end, ",\"max\":", &num, &len) ||
+        !parse_simple_double(num, len, &s->max) ||
+        !next_stats_field(&p, end, ",\"sumsqr\":", &num, &len) ||
+        !parse_simple_double(num, len, &s->sumsqr)) {
+        return 0;
+    }
+
+    return p + 1 == end;
+}
+
+
 static couchstore_error_t builtin_sum_reducer(const mapreduce_json_list_t *keys,
                                               const mapreduce_json_list_t *values,
                                               reducer_ctx_t *ctx,
@@ -228,7 +458,7 @@ static couchstore_error_t builtin_sum_reducer(const mapreduce_json_list_t *keys,
             } else {
                 /* reduce */
                 mapreduce_json_t *key = &keys->values[i];
-                char *error_key = (char *) malloc(key->length + 1);
+                char *error_key = (char *) cs_malloc(key->length + 1);
 
                 if (error_key == NULL) {
                     return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -242,9 +472,9 @@ static couchstore_error_t builtin_sum_reducer(const mapreduce_json_list_t *keys,
         }
     }
 
-    size = sprintf(red, DOUBLE_FMT, sum);
+    size = sprint_double(red, DOUBLE_FMT, sum, DOUBLE_FMT_INTEGRAL_LIMIT);
     assert(size > 0);
-    buf->buf = (char *) malloc(size);
+    buf->buf = (char *) cs_malloc(size);
     if (buf->buf == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -284,7 +514,7 @@ static couchstore_error_t builtin_count_reducer(const mapreduce_json_list_t *key
 
     size = sprintf(red, "%"PRIu64, count);
     assert(size > 0);
-    buf->buf = (char *) malloc(size);
+    buf->buf = (char *) cs_malloc(size);
     if (buf->buf == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -312,18 +542,22 @@ static couchstore_error_t builtin_stats_reducer(const mapreduce_json_list_t *key
 
         if (keys == NULL) {
             /* rereduce */
-            char *value_buf = (char *) malloc(value->length + 1);
+            if (parse_stats(value, &reduced)) {
+                scanned = 5;
+            } else {
+                char *value_buf = (char *) cs_malloc(value->length + 1);
 
-            if (value_buf == NULL) {
-                return COUCHSTORE_ERROR_ALLOC_FAIL;
-            }
+                if (value_buf == NULL) {
+                    return COUCHSTORE_ERROR_ALLOC_FAIL;
+                }
 
-            memcpy(value_buf, value->json, value->length);
-            value_buf[value->length] = '\0';
-            scanned = scan_stats(value_buf,
-                                 reduced.sum, reduced.count, reduced.min,
-                                 reduced.max, reduced.sumsqr);
-            free(value_buf);
+                memcpy(value_buf, value->json, value->length);
+                value_buf[value->length] = '\0';
+                scanned = scan_stats(value_buf,
+                                     reduced.sum, reduced.count, reduced.min,
+                                     reduced.max, reduced.sumsqr);
+                cs_free(value_buf);
+            }
             if (scanned == 5) {
                 if (reduced.min < s.min || s.count == 0) {
                     s.min = reduced.min;
@@ -361,7 +595,7 @@ static couchstore_error_t builtin_stats_reducer(const mapreduce_json_list_t *key
                 } else {
                     /* reduce */
                     mapreduce_json_t *key = &keys->values[i];
-                    char *error_key = (char *) malloc(key->length + 1);
+                    char *error_key = (char *) cs_malloc(key->length + 1);
 
                     if (error_key == NULL) {
                         return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -376,9 +610,224 @@ static couchstore_error_t builtin_stats_reducer(const mapreduce_json_list_t *key
         }
     }
 
-    size = sprint_stats(red, s.sum, s.count, s.min, s.max, s.sumsqr);
+    size = sprint_stats(red, &s);
     assert(size > 0);
-    buf->buf = (char *) malloc(size);
+    buf->buf = (char *) cs_malloc(size);
+    if (buf->buf == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    memcpy(buf->buf, red, size);
+    buf->size = size;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+/*
+ * _approx_count_distinct estimates the number of distinct keys with a
+ * HyperLogLog sketch of HLL_REGISTERS registers, about 3% off. Its
+ * reduction is {"count":<estimate>,"hll":"<registers>"}, each register
+ * being a character of hll_digits, and each run of 2 to 64 empty ones a
+ * '-' followed by the digit of its length less one, so that the sketches
+ * of few keys stay small. Rereducing takes the largest of each register.
+ */
+#define HLL_PRECISION 10
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+#define HLL_MAX_RUN   64
+#define HLL_PREFIX    "{\"count\":"
+#define HLL_FIELD     ",\"hll\":\""
+
+static const char hll_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int hll_digit_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    } else if (c == '+') {
+        return 62;
+    } else if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+/* FNV-1a, followed by a finalizer that spreads the bits of similar keys
+   over the whole word, as the register and its rank come from all of it */
+static uint64_t hll_hash(const mapreduce_json_t *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < key->length; ++i) {
+        h ^= (uint8_t) key->json[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static void hll_add(uint8_t *registers, const mapreduce_json_t *key)
+{
+    uint64_t h = hll_hash(key);
+    unsigned reg = (unsigned) (h >> (64 - HLL_PRECISION));
+    uint64_t w = h << HLL_PRECISION;
+    uint8_t rank = 1;
+
+    while (rank <= 64 - HLL_PRECISION && (w & (1ULL << 63)) == 0) {
+        w <<= 1;
+        rank++;
+    }
+    if (rank > registers[reg]) {
+        registers[reg] = rank;
+    }
+}
+
+static uint64_t hll_estimate(const uint8_t *registers)
+{
+    double m = HLL_REGISTERS;
+    double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double sum = 0.0, e;
+    unsigned i, zeros = 0;
+
+    for (i = 0; i < HLL_REGISTERS; ++i) {
+        sum += 1.0 / (double) (1ULL << registers[i]);
+        if (registers[i] == 0) {
+            zeros++;
+        }
+    }
+    e = alpha * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0) {
+        /* Few keys: count the empty registers instead */
+        e = m * log(m / zeros);
+    }
+
+    return (uint64_t) (e + 0.5);
+}
+
+/* Merges the registers of a reduction hll_print printed into registers.
+   Returns 0 if it isn't one. */
+static int hll_merge(uint8_t *registers, const mapreduce_json_t *value)
+{
+    const char *p = value->json, *end = value->json + value->length;
+    unsigned reg = 0;
+
+    if (end - p < (int) sizeof(HLL_PREFIX) - 1 ||
+        memcmp(p, HLL_PREFIX, sizeof(HLL_PREFIX) - 1) != 0) {
+        return 0;
+    }
+    p += sizeof(HLL_PREFIX) - 1;
+    while (p < end && *p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (end - p < (int) sizeof(HLL_FIELD) - 1 ||
+        memcmp(p, HLL_FIELD, sizeof(HLL_FIELD) - 1) != 0) {
+        return 0;
+    }
+    p += sizeof(HLL_FIELD) - 1;
+
+    while (p < end && *p != '"') {
+        int v;
+
+        if (*p == '-') {
+            if (p + 1 >= end || (v = hll_digit_value(p[1])) < 0 ||
+                reg + v + 1 > HLL_REGISTERS) {
+                return 0;
+            }
+            reg += v + 1;
+            p += 2;
+        } else {
+            if ((v = hll_digit_value(*p)) < 0 || v > 64 - HLL_PRECISION + 1 ||
+                reg >= HLL_REGISTERS) {
+                return 0;
+            }
+            if (v > registers[reg]) {
+                registers[reg] = (uint8_t) v;
+            }
+            reg++;
+            p++;
+        }
+    }
+
+    return reg == HLL_REGISTERS && end - p == 2 && p[1] == '}';
+}
+
+/* Most a reduction hll_print prints takes */
+#define HLL_MAX_SIZE (sizeof(HLL_PREFIX) + 20 + sizeof(HLL_FIELD) + \
+                      HLL_REGISTERS + 2)
+
+/* Prints the reduction of registers, returning its length. */
+
+static int hll_print(char *buf, const uint8_t *registers)
+{
+    int size = sprintf(buf, HLL_PREFIX "%" PRIu64 HLL_FIELD,
+                       hll_estimate(registers));
+    unsigned i = 0;
+
+    while (i < HLL_REGISTERS) {
+        if (registers[i] == 0) {
+            unsigned run = 1;
+
+            while (run < HLL_MAX_RUN && i + run < HLL_REGISTERS &&
+                   registers[i + run] == 0) {
+                run++;
+            }
+            if (run > 1) {
+                buf[size++] = '-';
+                buf[size++] = hll_digits[run - 1];
+            } else {
+                buf[size++] = hll_digits[0];
+            }
+            i += run;
+        } else {
+            buf[size++] = hll_digits[registers[i]];
+            i++;
+        }
+    }
+    buf[size++] = '"';
+    buf[size++] = '}';
+
+    return size;
+}
+
+
+static couchstore_error_t builtin_approx_count_distinct_reducer(const mapreduce_json_list_t *keys,
+                                                                const mapreduce_json_list_t *values,
+                                                                reducer_ctx_t *ctx,
+                                                                sized_buf *buf)
+{
+    uint8_t registers[HLL_REGISTERS];
+    char red[HLL_MAX_SIZE];
+    int i, size;
+
+    memset(registers, 0, sizeof(registers));
+
+    for (i = 0; i < values->length; ++i) {
+        if (keys == NULL) {
+            /* rereduce */
+            if (!hll_merge(registers, &values->values[i])) {
+                reducer_private_t *priv = (reducer_private_t *) ctx->parent_ctx;
+                priv->builtin_error = VIEW_REDUCER_ERROR_BAD_HLL_OBJECT;
+                return COUCHSTORE_ERROR_REDUCER_FAILURE;
+            }
+        } else {
+            /* reduce */
+            hll_add(registers, &keys->values[i]);
+        }
+    }
+
+    size = hll_print(red, registers);
+    assert(size > 0 && (size_t) size <= sizeof(red));
+    buf->buf = (char *) cs_malloc(size);
     if (buf->buf == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
@@ -408,16 +857,16 @@ static couchstore_error_t js_reducer(const mapreduce_json_list_t *keys,
             priv->mapreduce_error = ret;
             return COUCHSTORE_ERROR_REDUCER_FAILURE;
         }
-        buf->buf = (char *) malloc(result->length);
+        buf->buf = (char *) cs_malloc(result->length);
         if (buf->buf == NULL) {
-            free(result->json);
-            free(result);
+            cs_free(result->json);
+            cs_free(result);
             return COUCHSTORE_ERROR_ALLOC_FAIL;
         }
         buf->size = result->length;
         memcpy(buf->buf, result->json, result->length);
-        free(result->json);
-        free(result);
+        cs_free(result->json);
+        cs_free(result);
     } else {
         /* reduce */
         mapreduce_json_list_t *results = NULL;
@@ -433,7 +882,7 @@ static couchstore_error_t js_reducer(const mapreduce_json_list_t *keys,
             return COUCHSTORE_ERROR_REDUCER_FAILURE;
         }
         assert(results->length == 1);
-        buf->buf = (char *) malloc(results->values[0].length);
+        buf->buf = (char *) cs_malloc(results->values[0].length);
         if (buf->buf == NULL) {
             mapreduce_free_json_list(results);
             return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -447,36 +896,27 @@ static couchstore_error_t js_reducer(const mapreduce_json_list_t *keys,
 }
 
 
-static void free_key_excluding_elements(view_btree_key_t *key)
-{
-    if (key != NULL) {
-        free(key->doc_id.buf);
-        free(key);
-    }
-}
-
-
-static void free_json_key_list(mapreduce_json_list_t *list)
+/* Runs the context's ith reduce function, timing it if it's JavaScript */
+static couchstore_error_t run_reducer(view_reducer_ctx_t *red_ctx,
+                                      unsigned i,
+                                      const mapreduce_json_list_t *keys,
+                                      const mapreduce_json_list_t *values,
+                                      sized_buf *buf)
 {
-    int i;
+    reducer_private_t *priv = (reducer_private_t *) red_ctx->private;
+    couchstore_error_t ret;
+    hrtime_t start;
 
-    if (list == NULL) {
-        return;
+    if (priv->reducers[i] != js_reducer) {
+        return priv->reducers[i](keys, values, &priv->reducer_contexts[i], buf);
     }
 
-    for (i = list->length - 1; i > 0; --i) {
-        if (list->values[i].json == list->values[i - 1].json) {
-            list->values[i].length = 0;
-        }
-    }
+    start = gethrtime();
+    ret = js_reducer(keys, values, &priv->reducer_contexts[i], buf);
+    red_ctx->js_ns += gethrtime() - start;
+    red_ctx->js_calls++;
 
-    for (i = 0; i < list->length; ++i) {
-        if (list->values[i].length != 0) {
-            free(list->values[i].json);
-        }
-    }
-    free(list->values);
-    free(list);
+    return ret;
 }
 
 
@@ -485,24 +925,29 @@ view_reducer_ctx_t *make_view_reducer_ctx(const char *functions[],
                                           char **error_msg)
 {
     unsigned i;
-    reducer_private_t *priv = calloc(1, sizeof(*priv));
-    view_reducer_ctx_t *ctx = calloc(1, sizeof(*ctx));
+    reducer_private_t *priv = cs_calloc(1, sizeof(*priv));
+    view_reducer_ctx_t *ctx = cs_calloc(1, sizeof(*ctx));
 
     if (ctx == NULL || priv == NULL) {
         goto error;
     }
 
     priv->num_reducers = num_functions;
-    priv->reducers = calloc(num_functions, sizeof(reducer_fn_t));
+    priv->reducers = cs_calloc(num_functions, sizeof(reducer_fn_t));
     if (priv->reducers == NULL) {
         goto error;
     }
 
-    priv->reducer_contexts = calloc(num_functions, sizeof(reducer_ctx_t));
+    priv->reducer_contexts = cs_calloc(num_functions, sizeof(reducer_ctx_t));
     if (priv->reducer_contexts == NULL) {
         goto error;
     }
 
+    priv->scratch = new_arena(0);
+    if (priv->scratch == NULL) {
+        goto error;
+    }
+
     for (i = 0; i < num_functions; ++i) {
         priv->reducer_contexts[i].parent_ctx = (void *) priv;
 
@@ -512,6 +957,8 @@ view_reducer_ctx_t *make_view_reducer_ctx(const char *functions[],
             priv->reducers[i] = builtin_sum_reducer;
         } else if (strcmp(functions[i], "_stats") == 0) {
             priv->reducers[i] = builtin_stats_reducer;
+        } else if (strcmp(functions[i], "_approx_count_distinct") == 0) {
+            priv->reducers[i] = builtin_approx_count_distinct_reducer;
         } else {
             mapreduce_error_t mapred_error;
             void *mapred_ctx = NULL;
@@ -541,12 +988,15 @@ error:
             for (i = 0; i < num_functions; ++i) {
                 mapreduce_free_context(priv->reducer_contexts[i].mapreduce_ctx);
             }
-            free(priv->reducer_contexts);
+            cs_free(priv->reducer_contexts);
         }
-        free(priv->reducers);
-        free(priv);
+        if (priv->scratch != NULL) {
+            delete_arena(priv->scratch);
+        }
+        cs_free(priv->reducers);
+        cs_free(priv);
     }
-    free(ctx);
+    cs_free(ctx);
 
     return NULL;
 }
@@ -565,11 +1015,12 @@ void free_view_reducer_ctx(view_reducer_ctx_t *ctx)
     for (i = 0; i < priv->num_reducers; ++i) {
         mapreduce_free_context(priv->reducer_contexts[i].mapreduce_ctx);
     }
-    free(priv->reducer_contexts);
-    free(priv->reducers);
-    free(priv);
-    free((void *) ctx->error);
-    free(ctx);
+    cs_free(priv->reducer_contexts);
+    cs_free(priv->reducers);
+    delete_arena(priv->scratch);
+    cs_free(priv);
+    cs_free((void *) ctx->error);
+    cs_free(ctx);
 }
 
 
@@ -579,7 +1030,7 @@ static void add_error_message(view_reducer_ctx_t *red_ctx, int rereduce)
    char *error_msg;
 
    if (red_ctx->error != NULL) {
-       free((void *) red_ctx->error);
+       cs_free((void *) red_ctx->error);
        red_ctx->error = NULL;
    }
 
@@ -588,15 +1039,15 @@ static void add_error_message(view_reducer_ctx_t *red_ctx, int rereduce)
 
        assert(priv->mapreduce_error == MAPREDUCE_SUCCESS);
        if (!rereduce && (priv->error_key != NULL)) {
-           error_msg = (char *) malloc(strlen(base_msg) + 12 + strlen(priv->error_key));
+           error_msg = (char *) cs_malloc(strlen(base_msg) + 12 + strlen(priv->error_key));
            assert(error_msg != NULL);
            sprintf(error_msg, "%s (key %s)", base_msg, priv->error_key);
        } else {
-           error_msg = strdup(base_msg);
+           error_msg = cs_strdup(base_msg);
            assert(error_msg != NULL);
        }
        if (priv->error_key != NULL) {
-           free((void *) priv->error_key);
+           cs_free((void *) priv->error_key);
            priv->error_key = NULL;
        }
    } else {
@@ -605,10 +1056,10 @@ static void add_error_message(view_reducer_ctx_t *red_ctx, int rereduce)
            error_msg = priv->error_msg;
        } else {
            if (priv->mapreduce_error == MAPREDUCE_TIMEOUT) {
-               error_msg = strdup("function timeout");
+               error_msg = cs_strdup("function timeout");
                assert(error_msg != NULL);
            } else {
-               error_msg = malloc(64);
+               error_msg = cs_malloc(64);
                assert(error_msg != NULL);
                sprintf(error_msg, "mapreduce error: %d", priv->mapreduce_error);
            }
@@ -619,6 +1070,18 @@ static void add_error_message(view_reducer_ctx_t *red_ctx, int rereduce)
 }
 
 
+static couchstore_error_t encode_reduction(const view_reducer_ctx_t *red_ctx,
+                                           const view_btree_reduction_t *red,
+                                           char *dst,
+                                           size_t *size_r)
+{
+    if (red_ctx->compact_bitmaps) {
+        return encode_view_btree_reduction_compact(red, dst, size_r);
+    }
+    return encode_view_btree_reduction(red, dst, size_r);
+}
+
+
 couchstore_error_t view_btree_reduce(char *dst,
                                      size_t *size_r,
                                      const nodelist *leaflist,
@@ -627,85 +1090,85 @@ couchstore_error_t view_btree_reduce(char *dst,
 {
     view_reducer_ctx_t *red_ctx = (view_reducer_ctx_t *) ctx;
     reducer_private_t *priv = (reducer_private_t *) red_ctx->private;
+    arena *a = priv->scratch;
     unsigned i;
-    reducer_fn_t reducer;
     view_btree_reduction_t *red = NULL;
     const nodelist *n;
     int c;
     couchstore_error_t ret = COUCHSTORE_SUCCESS;
     mapreduce_json_list_t *key_list = NULL;
     mapreduce_json_list_t *value_list = NULL;
-    view_btree_value_t **values = NULL;
+    view_btree_value_view_t *values = NULL;
 
-    values = (view_btree_value_t **) calloc(count, sizeof(view_btree_value_t *));
-    red = (view_btree_reduction_t *) calloc(1, sizeof(*red));
-    key_list = (mapreduce_json_list_t *) calloc(1, sizeof(*key_list));
-    value_list = (mapreduce_json_list_t *) calloc(1, sizeof(*value_list));
+    arena_reset(a);
+    values = (view_btree_value_view_t *) arena_alloc(a, count * sizeof(view_btree_value_view_t));
+    red = (view_btree_reduction_t *) arena_alloc(a, sizeof(*red));
+    key_list = (mapreduce_json_list_t *) arena_alloc(a, sizeof(*key_list));
+    value_list = (mapreduce_json_list_t *) arena_alloc(a, sizeof(*value_list));
 
     if (values == NULL || red == NULL || key_list == NULL || value_list == NULL) {
+        red = NULL;
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto out;
     }
+    memset(red, 0, sizeof(*red));
+    memset(key_list, 0, sizeof(*key_list));
+    memset(value_list, 0, sizeof(*value_list));
 
     for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
-        view_btree_value_t *v = NULL;
+        view_btree_value_view_t *v = &values[c];
 
-        ret = decode_view_btree_value(n->data.buf, n->data.size, &v);
+        ret = view_btree_value_view(n->data.buf, n->data.size, v);
         if (ret != COUCHSTORE_SUCCESS) {
             goto out;
         }
         set_bit(&red->partitions_bitmap, v->partition);
         red->kv_count += v->num_values;
-        values[c] = v;
     }
 
-    value_list->values = (mapreduce_json_t *) calloc(red->kv_count,
-                                                     sizeof(mapreduce_json_t));
-    if (value_list->values == NULL) {
-        ret = COUCHSTORE_ERROR_ALLOC_FAIL;
-        goto out;
-    }
-    key_list->values = (mapreduce_json_t *) calloc(red->kv_count,
-                                                   sizeof(mapreduce_json_t));
-    if (key_list->values == NULL) {
+    value_list->values = (mapreduce_json_t *) arena_alloc(a, red->kv_count *
+                                                             sizeof(mapreduce_json_t));
+    key_list->values = (mapreduce_json_t *) arena_alloc(a, red->kv_count *
+                                                           sizeof(mapreduce_json_t));
+    if (red->kv_count > 0 &&
+        (value_list->values == NULL || key_list->values == NULL)) {
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto out;
     }
 
     for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
-        view_btree_value_t *v = values[c];
-        view_btree_key_t *k = NULL;
+        view_btree_value_view_t *v = &values[c];
+        view_btree_key_t k;
+        sized_buf json;
 
-        ret = decode_view_btree_key(n->key.buf, n->key.size, &k);
+        ret = view_btree_key_view(n->key.buf, n->key.size, &k);
         if (ret != COUCHSTORE_SUCCESS) {
-            free_view_btree_value(v);
             goto out;
         }
-        for (i = 0; i < v->num_values; ++i) {
-            value_list->values[value_list->length].length = v->values[i].size;
-            value_list->values[value_list->length].json = v->values[i].buf;
+        while (view_btree_value_next(v, &json)) {
+            value_list->values[value_list->length].length = json.size;
+            value_list->values[value_list->length].json = json.buf;
             value_list->length++;
-            key_list->values[key_list->length].length = k->json_key.size;
-            key_list->values[key_list->length].json = k->json_key.buf;
+            key_list->values[key_list->length].length = k.json_key.size;
+            key_list->values[key_list->length].json = k.json_key.buf;
             key_list->length++;
         }
-        free_key_excluding_elements(k);
     }
 
     if (priv->num_reducers > 0) {
-        red->reduce_values = (sized_buf *) calloc(priv->num_reducers, sizeof(sized_buf));
+        red->reduce_values = (sized_buf *) arena_alloc(a, priv->num_reducers *
+                                                          sizeof(sized_buf));
         if (red->reduce_values == NULL) {
             ret = COUCHSTORE_ERROR_ALLOC_FAIL;
             goto out;
         }
+        memset(red->reduce_values, 0, priv->num_reducers * sizeof(sized_buf));
     }
 
     red->num_values = priv->num_reducers;
     for (i = 0; i < priv->num_reducers; ++i) {
         sized_buf buf;
-        reducer = priv->reducers[i];
-
-        ret = (*reducer)(key_list, value_list, &priv->reducer_contexts[i], &buf);
+        ret = run_reducer(red_ctx, i, key_list, value_list, &buf);
         if (ret != COUCHSTORE_SUCCESS) {
             add_error_message(red_ctx, 0);
             goto out;
@@ -714,26 +1177,13 @@ couchstore_error_t view_btree_reduce(char *dst,
         red->reduce_values[i] = buf;
     }
 
-    ret = encode_view_btree_reduction(red, dst, size_r);
+    ret = encode_reduction(red_ctx, red, dst, size_r);
 
  out:
     if (red != NULL) {
         for (i = 0; i < red->num_values; ++i) {
-            free(red->reduce_values[i].buf);
-        }
-        free(red->reduce_values);
-        free(red);
-    }
-    free_json_key_list(key_list);
-    if (values != NULL) {
-        for (c = 0; c < count; ++c) {
-            free_view_btree_value(values[c]);
+            cs_free(red->reduce_values[i].buf);
         }
-        free(values);
-    }
-    if (value_list != NULL) {
-        free(value_list->values);
-        free(value_list);
     }
 
     return ret;
@@ -748,37 +1198,46 @@ couchstore_error_t view_btree_rereduce(char *dst,
 {
     view_reducer_ctx_t *red_ctx = (view_reducer_ctx_t *) ctx;
     reducer_private_t *priv = (reducer_private_t *) red_ctx->private;
+    arena *a = priv->scratch;
     unsigned i;
-    reducer_fn_t reducer;
     view_btree_reduction_t *red = NULL;
     const nodelist *n;
     int c;
     couchstore_error_t ret = COUCHSTORE_SUCCESS;
-    mapreduce_json_list_t *value_list = NULL;
+    mapreduce_json_list_t value_list;
     view_btree_reduction_t **reductions = NULL;
 
-    reductions = (view_btree_reduction_t **) calloc(count, sizeof(view_btree_reduction_t *));
-    red = (view_btree_reduction_t *) calloc(1, sizeof(*red));
+    arena_reset(a);
+    reductions = (view_btree_reduction_t **) arena_alloc(a, count * sizeof(view_btree_reduction_t *));
+    red = (view_btree_reduction_t *) arena_alloc(a, sizeof(*red));
 
     if (reductions == NULL || red == NULL) {
+        red = NULL;
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto out;
     }
+    memset(red, 0, sizeof(*red));
 
-    red->num_values = priv->num_reducers;
-    red->reduce_values = (sized_buf *) calloc(red->num_values, sizeof(sized_buf));
-    value_list = (mapreduce_json_list_t *) calloc(1, sizeof(*value_list));
+    red->reduce_values = (sized_buf *) arena_alloc(a, priv->num_reducers * sizeof(sized_buf));
+    value_list.values = (mapreduce_json_t *) arena_alloc(a, count * sizeof(mapreduce_json_t));
+    value_list.length = 0;
 
-    if (red->reduce_values == NULL || value_list == NULL) {
+    if (priv->num_reducers > 0 &&
+        (red->reduce_values == NULL || value_list.values == NULL)) {
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto out;
     }
+    if (priv->num_reducers > 0) {
+        memset(red->reduce_values, 0, priv->num_reducers * sizeof(sized_buf));
+    }
+    red->num_values = priv->num_reducers;
 
     for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
         view_btree_reduction_t *r = NULL;
 
-        ret = decode_view_btree_reduction(n->pointer->reduce_value.buf,
-                                          n->pointer->reduce_value.size, &r);
+        ret = decode_view_btree_reduction_in_arena(n->pointer->reduce_value.buf,
+                                                   n->pointer->reduce_value.size,
+                                                   a, &r);
         if (ret != COUCHSTORE_SUCCESS) {
             goto out;
         }
@@ -789,57 +1248,327 @@ couchstore_error_t view_btree_rereduce(char *dst,
         reductions[c] = r;
     }
 
-    if (priv->num_reducers > 0) {
-        value_list->values = (mapreduce_json_t *) calloc(count,
-                                                         sizeof(mapreduce_json_t));
-        if (value_list->values == NULL) {
-            ret = COUCHSTORE_ERROR_ALLOC_FAIL;
-            goto out;
-        }
-    }
-
     for (i = 0; i < priv->num_reducers; ++i) {
         sized_buf buf;
 
         for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
             view_btree_reduction_t *r = reductions[c];
 
-            value_list->values[value_list->length].json = r->reduce_values[i].buf;
-            value_list->values[value_list->length].length = r->reduce_values[i].size;
-            value_list->length++;
+            value_list.values[value_list.length].json = r->reduce_values[i].buf;
+            value_list.values[value_list.length].length = r->reduce_values[i].size;
+            value_list.length++;
         }
 
-        reducer = priv->reducers[i];
-        ret = (*reducer)(NULL, value_list, &priv->reducer_contexts[i], &buf);
+        ret = run_reducer(red_ctx, i, NULL, &value_list, &buf);
         if (ret != COUCHSTORE_SUCCESS) {
             add_error_message(red_ctx, 1);
             goto out;
         }
 
-        value_list->length = 0;
+        value_list.length = 0;
         red->reduce_values[i] = buf;
     }
 
-    ret = encode_view_btree_reduction(red, dst, size_r);
+    ret = encode_reduction(red_ctx, red, dst, size_r);
 
  out:
     if (red != NULL) {
         for (i = 0; i < red->num_values; ++i) {
-            free(red->reduce_values[i].buf);
+            cs_free(red->reduce_values[i].buf);
         }
-        free(red->reduce_values);
-        free(red);
     }
-    if (reductions != NULL) {
-        for (c = 0; c < count; ++c) {
-            free_view_btree_reduction(reductions[c]);
+
+    return ret;
+}
+
+
+/* The reductions a node's is worked out from by view_btree_reduce_delta */
+typedef struct {
+    const view_btree_reduction_t *old;
+    view_btree_reduction_t       **removed;
+    int                          num_removed;
+    view_btree_reduction_t       **added;
+    int                          num_added;
+} reduction_delta_t;
+
+
+static mapreduce_json_t reduce_value_json(const view_btree_reduction_t *r,
+                                          unsigned i)
+{
+    mapreduce_json_t json;
+
+    json.json = r->reduce_values[i].buf;
+    json.length = (int) r->reduce_values[i].size;
+
+    return json;
+}
+
+
+/* Each of the deltas below prints reducer i's new value in red, as its
+   rereduce would have, and returns its length, or 0 if it can't be told
+   from the delta. */
+static int count_delta(const reduction_delta_t *d, unsigned i, char *red)
+{
+    mapreduce_json_t json;
+    uint64_t count, n;
+    int j;
+
+    json = reduce_value_json(d->old, i);
+    if (!json_to_uint64(&json, &count)) {
+        return 0;
+    }
+    for (j = 0; j < d->num_removed; ++j) {
+        json = reduce_value_json(d->removed[j], i);
+        if (!json_to_uint64(&json, &n) || n > count) {
+            return 0;
         }
-        free(reductions);
+        count -= n;
     }
-    if (value_list != NULL) {
-        free(value_list->values);
-        free(value_list);
+    for (j = 0; j < d->num_added; ++j) {
+        json = reduce_value_json(d->added[j], i);
+        if (!json_to_uint64(&json, &n)) {
+            return 0;
+        }
+        count += n;
     }
 
-    return ret;
+    return sprintf(red, "%"PRIu64, count);
+}
+
+
+/* Sums are only taken apart while they and what they're made of are
+   integers printed whole: those add up exactly in any order, so the
+   result is what adding up all the children prints. */
+static int sum_delta(const reduction_delta_t *d, unsigned i, char *red)
+{
+    mapreduce_json_t json;
+    double sum, n;
+    int j;
+
+    json = reduce_value_json(d->old, i);
+    if (!json_to_double(&json, &sum) ||
+        !is_integral_double(sum, DOUBLE_FMT_INTEGRAL_LIMIT)) {
+        return 0;
+    }
+    for (j = 0; j < d->num_removed; ++j) {
+        json = reduce_value_json(d->removed[j], i);
+        if (!json_to_double(&json, &n) ||
+            !is_integral_double(n, DOUBLE_FMT_INTEGRAL_LIMIT)) {
+            return 0;
+        }
+        sum -= n;
+    }
+    for (j = 0; j < d->num_added; ++j) {
+        json = reduce_value_json(d->added[j], i);
+        if (!json_to_double(&json, &n) ||
+            !is_integral_double(n, DOUBLE_FMT_INTEGRAL_LIMIT)) {
+            return 0;
+        }
+        sum += n;
+    }
+    if (!is_integral_double(sum, DOUBLE_FMT_INTEGRAL_LIMIT)) {
+        return 0;
+    }
+
+    return sprint_double(red, DOUBLE_FMT, sum, DOUBLE_FMT_INTEGRAL_LIMIT);
+}
+
+
+static int parse_integral_stats(const mapreduce_json_t *json, stats_t *s)
+{
+    return parse_stats(json, s) &&
+           is_integral_double(s->sum, STATS_FMT_INTEGRAL_LIMIT) &&
+           is_integral_double(s->min, STATS_FMT_INTEGRAL_LIMIT) &&
+           is_integral_double(s->max, STATS_FMT_INTEGRAL_LIMIT) &&
+           is_integral_double(s->sumsqr, STATS_FMT_INTEGRAL_LIMIT);
+}
+
+
+/* The old minimum and maximum are only known to be left if no child
+   removed had them. */
+static int stats_delta(const reduction_delta_t *d, unsigned i, char *red)
+{
+    mapreduce_json_t json;
+    stats_t s, r;
+    int j;
+
+    json = reduce_value_json(d->old, i);
+    if (!parse_integral_stats(&json, &s)) {
+        return 0;
+    }
+    for (j = 0; j < d->num_removed; ++j) {
+        json = reduce_value_json(d->removed[j], i);
+        if (!parse_integral_stats(&json, &r) || r.count >= s.count ||
+            r.min <= s.min || r.max >= s.max) {
+            return 0;
+        }
+        s.count -= r.count;
+        s.sum -= r.sum;
+        s.sumsqr -= r.sumsqr;
+    }
+    for (j = 0; j < d->num_added; ++j) {
+        json = reduce_value_json(d->added[j], i);
+        if (!parse_integral_stats(&json, &r)) {
+            return 0;
+        }
+        if (r.min < s.min) {
+            s.min = r.min;
+        }
+        if (r.max > s.max) {
+            s.max = r.max;
+        }
+        s.count += r.count;
+        s.sum += r.sum;
+        s.sumsqr += r.sumsqr;
+    }
+    if (!is_integral_double(s.sum, STATS_FMT_INTEGRAL_LIMIT) ||
+        !is_integral_double(s.sumsqr, STATS_FMT_INTEGRAL_LIMIT)) {
+        return 0;
+    }
+
+    return sprint_stats(red, &s);
+}
+
+
+/* Decodes the reductions of a delta's list of pointers into rs. */
+static couchstore_error_t decode_delta_reductions(const nodelist *list,
+                                                  int count,
+                                                  arena *a,
+                                                  view_btree_reduction_t **rs)
+{
+    const nodelist *n;
+    int c;
+    couchstore_error_t ret;
+
+    for (n = list, c = 0; n != NULL && c < count; n = n->next, ++c) {
+        ret = decode_view_btree_reduction_in_arena(n->pointer->reduce_value.buf,
+                                                   n->pointer->reduce_value.size,
+                                                   a, &rs[c]);
+        if (ret != COUCHSTORE_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+int view_btree_reduce_delta(char *dst,
+                            size_t *size_r,
+                            const nodelist *itmlist,
+                            int count,
+                            const reduce_delta *delta,
+                            void *ctx)
+{
+    view_reducer_ctx_t *red_ctx = (view_reducer_ctx_t *) ctx;
+    reducer_private_t *priv = (reducer_private_t *) red_ctx->private;
+    arena *a = priv->scratch;
+    reduction_delta_t d;
+    view_btree_reduction_t *old = NULL;
+    view_btree_reduction_t red;
+    bitmap_t removed_bm, added_bm;
+    unsigned i;
+    int j;
+    couchstore_error_t ret;
+
+    (void) itmlist;
+    (void) count;
+
+    /* Only counts, sums and stats can be taken apart */
+    for (i = 0; i < priv->num_reducers; ++i) {
+        if (priv->reducers[i] != builtin_count_reducer &&
+            priv->reducers[i] != builtin_sum_reducer &&
+            priv->reducers[i] != builtin_stats_reducer) {
+            return 0;
+        }
+    }
+
+    arena_reset(a);
+    d.removed = (view_btree_reduction_t **) arena_alloc(a, delta->removed_count *
+                                                           sizeof(view_btree_reduction_t *));
+    d.num_removed = delta->removed_count;
+    d.added = (view_btree_reduction_t **) arena_alloc(a, delta->added_count *
+                                                         sizeof(view_btree_reduction_t *));
+    d.num_added = delta->added_count;
+    red.reduce_values = (sized_buf *) arena_alloc(a, priv->num_reducers *
+                                                     sizeof(sized_buf));
+    if ((d.removed == NULL && d.num_removed > 0) ||
+        (d.added == NULL && d.num_added > 0) ||
+        (red.reduce_values == NULL && priv->num_reducers > 0)) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    ret = decode_view_btree_reduction_in_arena(delta->old_reduction->buf,
+                                               delta->old_reduction->size,
+                                               a, &old);
+    if (ret == COUCHSTORE_SUCCESS) {
+        ret = decode_delta_reductions(delta->removed, d.num_removed, a,
+                                      d.removed);
+    }
+    if (ret == COUCHSTORE_SUCCESS) {
+        ret = decode_delta_reductions(delta->added, d.num_added, a, d.added);
+    }
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+    d.old = old;
+    if (old->num_values != priv->num_reducers) {
+        return 0;
+    }
+
+    red.kv_count = old->kv_count;
+    red.partitions_bitmap = old->partitions_bitmap;
+    memset(&removed_bm, 0, sizeof(removed_bm));
+    memset(&added_bm, 0, sizeof(added_bm));
+    for (j = 0; j < d.num_removed; ++j) {
+        if (d.removed[j]->num_values != priv->num_reducers ||
+            d.removed[j]->kv_count > red.kv_count) {
+            return 0;
+        }
+        red.kv_count -= d.removed[j]->kv_count;
+        union_bitmaps(&removed_bm, &d.removed[j]->partitions_bitmap);
+    }
+    for (j = 0; j < d.num_added; ++j) {
+        if (d.added[j]->num_values != priv->num_reducers) {
+            return 0;
+        }
+        red.kv_count += d.added[j]->kv_count;
+        union_bitmaps(&added_bm, &d.added[j]->partitions_bitmap);
+    }
+    /* The partitions of the children removed are only known to be left
+       if the children added have them */
+    if (!bitmap_is_subset(&removed_bm, &added_bm)) {
+        return 0;
+    }
+    union_bitmaps(&red.partitions_bitmap, &added_bm);
+
+    red.num_values = priv->num_reducers;
+    for (i = 0; i < priv->num_reducers; ++i) {
+        char buf[4096];
+        int size;
+
+        if (priv->reducers[i] == builtin_count_reducer) {
+            size = count_delta(&d, i, buf);
+        } else if (priv->reducers[i] == builtin_sum_reducer) {
+            size = sum_delta(&d, i, buf);
+        } else {
+            size = stats_delta(&d, i, buf);
+        }
+        if (size == 0) {
+            return 0;
+        }
+        red.reduce_values[i].buf = (char *) arena_alloc(a, size);
+        if (red.reduce_values[i].buf == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        memcpy(red.reduce_values[i].buf, buf, size);
+        red.reduce_values[i].size = size;
+    }
+
+    ret = encode_reduction(red_ctx, &red, dst, size_r);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
+    }
+
+    return 1;
 }
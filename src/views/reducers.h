@@ -39,6 +39,11 @@ extern "C" {
            readable error message. */
         const char           *error;
         void                 *private;
+        /* Calls of JavaScript reduce functions, and the time they took */
+        uint64_t             js_calls;
+        hrtime_t             js_ns;
+        /* Reductions are written with compact partition bitmaps */
+        int                  compact_bitmaps;
     } view_reducer_ctx_t;
 
     typedef struct {
@@ -77,6 +82,17 @@ extern "C" {
                                            int count,
                                            void *ctx);
 
+    /* The reduce_delta of a view btree: works out a node's reduction from
+       the delta when its reducers are all _count, _sum or _stats and
+       their values integers, the same as view_btree_rereduce would; otherwise it leaves
+       the node to that. */
+    int view_btree_reduce_delta(char *dst,
+                                size_t *size_r,
+                                const nodelist *itmlist,
+                                int count,
+                                const reduce_delta *delta,
+                                void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,14 +8,32 @@
 
 #define BITMASK_BYTE_SIZE      (1024 / CHAR_BIT)
 
-#define dec_uint16(b) (decode_raw16(*((raw_16 *) b)))
-#define dec_uint48(b) (decode_raw48(*((raw_48 *) b)))
-#define dec_uint40(b) (decode_raw40(*((raw_40 *) b)))
+#define dec_uint16(b) (decode_raw16(*((raw_16 *) (b))))
+#define dec_uint48(b) (decode_raw48(*((raw_48 *) (b))))
+#define dec_uint40(b) (decode_raw40(*((raw_40 *) (b))))
+
+/* Set in the first byte of a reduction's kv_count when its partitions
+   bitmap is compact, that is it starts with one of these bytes: */
+#define COMPACT_BITMAP_FLAG    0x80
+#define COMPACT_BITMAP_LIST    0x00     /* | n, then n partition ids */
+#define COMPACT_BITMAP_RUNS    0x40     /* | n, then n first and last ids */
+#define COMPACT_BITMAP_FULL    0xff     /* then the whole bitmap */
+#define COMPACT_BITMAP_MAX_N   0x3f
+#define COMPACT_BITMAP_MAX_SIZE (1 + BITMASK_BYTE_SIZE)
 
 static void enc_uint16(uint16_t u, char **buf);
 
 static void enc_raw40(uint64_t u, char **buf);
 
+static size_t encode_compact_bitmap(const bitmap_t *bm, char *buf);
+
+static int decode_compact_bitmap(const char *bytes, size_t len, bitmap_t *bm);
+
+static couchstore_error_t encode_reduction(const view_btree_reduction_t *reduction,
+                                           int compact,
+                                           char *buffer,
+                                           size_t *buffer_size);
+
 
 couchstore_error_t decode_view_btree_reduction(const char *bytes,
                                                size_t len,
@@ -26,21 +44,35 @@ couchstore_error_t decode_view_btree_reduction(const char *bytes,
     uint16_t sz;
     const char *bs;
     size_t length;
+    int compact;
 
-    r = (view_btree_reduction_t *) malloc(sizeof(view_btree_reduction_t));
+    r = (view_btree_reduction_t *) cs_malloc(sizeof(view_btree_reduction_t));
     if (r == NULL) {
         goto alloc_error;
     }
 
     assert(len >= 5);
-    r->kv_count = dec_uint40(bytes);
+    compact = (bytes[0] & COMPACT_BITMAP_FLAG) != 0;
+    r->kv_count = dec_uint40(bytes) & ~((uint64_t) COMPACT_BITMAP_FLAG << 32);
     bytes += 5;
     len -= 5;
 
-    assert(len >= BITMASK_BYTE_SIZE);
-    memcpy(&r->partitions_bitmap, bytes, BITMASK_BYTE_SIZE);
-    bytes += BITMASK_BYTE_SIZE;
-    len -= BITMASK_BYTE_SIZE;
+    if (compact) {
+        int used = decode_compact_bitmap(bytes, len, &r->partitions_bitmap);
+        if (used < 0) {
+            r->reduce_values = NULL;
+            r->num_values = 0;
+            free_view_btree_reduction(r);
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        bytes += used;
+        len -= used;
+    } else {
+        assert(len >= BITMASK_BYTE_SIZE);
+        memcpy(&r->partitions_bitmap, bytes, BITMASK_BYTE_SIZE);
+        bytes += BITMASK_BYTE_SIZE;
+        len -= BITMASK_BYTE_SIZE;
+    }
 
     bs = bytes;
     length = len;
@@ -66,7 +98,7 @@ couchstore_error_t decode_view_btree_reduction(const char *bytes,
     }
 
     if (r->num_values > 0) {
-        r->reduce_values = (sized_buf *) malloc(r->num_values * sizeof(sized_buf));
+        r->reduce_values = (sized_buf *) cs_malloc(r->num_values * sizeof(sized_buf));
         if (r->reduce_values == NULL) {
             goto alloc_error;
         }
@@ -87,7 +119,7 @@ couchstore_error_t decode_view_btree_reduction(const char *bytes,
         len -= 2;
 
         r->reduce_values[i].size = sz;
-        r->reduce_values[i].buf = (char *) malloc(sz);
+        r->reduce_values[i].buf = (char *) cs_malloc(sz);
 
         if (r->reduce_values[i].buf == NULL) {
             goto alloc_error;
@@ -109,16 +141,110 @@ couchstore_error_t decode_view_btree_reduction(const char *bytes,
 }
 
 
+couchstore_error_t decode_view_btree_reduction_in_arena(const char *bytes,
+                                                        size_t len,
+                                                        arena *a,
+                                                        view_btree_reduction_t **reduction)
+{
+    view_btree_reduction_t *r;
+    uint8_t i;
+    uint16_t sz;
+    const char *bs;
+    int compact;
+
+    r = (view_btree_reduction_t *) arena_alloc(a, sizeof(view_btree_reduction_t));
+    if (r == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    assert(len >= 5);
+    compact = (bytes[0] & COMPACT_BITMAP_FLAG) != 0;
+    r->kv_count = dec_uint40(bytes) & ~((uint64_t) COMPACT_BITMAP_FLAG << 32);
+    bytes += 5;
+    len -= 5;
+
+    if (compact) {
+        int used = decode_compact_bitmap(bytes, len, &r->partitions_bitmap);
+        if (used < 0) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        bytes += used;
+        len -= used;
+    } else {
+        assert(len >= BITMASK_BYTE_SIZE);
+        memcpy(&r->partitions_bitmap, bytes, BITMASK_BYTE_SIZE);
+        bytes += BITMASK_BYTE_SIZE;
+        len -= BITMASK_BYTE_SIZE;
+    }
+
+    bs = bytes;
+
+    r->num_values = 0;
+    while (len > 0) {
+        assert(len >= 2);
+        sz = dec_uint16(bs);
+        bs += 2;
+        len -= 2;
+
+        assert(len >= sz);
+        bs += sz;
+        len -= sz;
+        r->num_values++;
+    }
+
+    r->reduce_values = (sized_buf *) arena_alloc(a, r->num_values * sizeof(sized_buf));
+    if (r->reduce_values == NULL && r->num_values > 0) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    for (i = 0; i < r->num_values; ++i) {
+        sz = dec_uint16(bytes);
+        bytes += 2;
+        r->reduce_values[i].size = sz;
+        r->reduce_values[i].buf = (char *) bytes;
+        bytes += sz;
+    }
+
+    *reduction = r;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
 couchstore_error_t encode_view_btree_reduction(const view_btree_reduction_t *reduction,
                                                char *buffer,
                                                size_t *buffer_size)
+{
+    return encode_reduction(reduction, 0, buffer, buffer_size);
+}
+
+
+couchstore_error_t encode_view_btree_reduction_compact(const view_btree_reduction_t *reduction,
+                                                       char *buffer,
+                                                       size_t *buffer_size)
+{
+    return encode_reduction(reduction, 1, buffer, buffer_size);
+}
+
+
+static couchstore_error_t encode_reduction(const view_btree_reduction_t *reduction,
+                                           int compact,
+                                           char *buffer,
+                                           size_t *buffer_size)
 {
     char *b = NULL;
+    char bitmap[COMPACT_BITMAP_MAX_SIZE];
+    size_t bitmap_size = BITMASK_BYTE_SIZE;
     size_t sz = 0;
     int i;
 
+    if (compact) {
+        bitmap_size = encode_compact_bitmap(&reduction->partitions_bitmap,
+                                            bitmap);
+    }
+
     sz += 5;                     /* kv_count */
-    sz += BITMASK_BYTE_SIZE; /* partitions bitmap */
+    sz += bitmap_size;           /* partitions bitmap */
     /* reduce values */
     for (i = 0; i < reduction->num_values; ++i) {
         sz += 2;             /* size_t */
@@ -133,8 +259,13 @@ couchstore_error_t encode_view_btree_reduction(const view_btree_reduction_t *red
 
     enc_raw40(reduction->kv_count, &b);
 
-    memcpy(b, &reduction->partitions_bitmap, BITMASK_BYTE_SIZE);
-    b += BITMASK_BYTE_SIZE;
+    if (compact) {
+        buffer[0] |= COMPACT_BITMAP_FLAG;
+        memcpy(b, bitmap, bitmap_size);
+    } else {
+        memcpy(b, &reduction->partitions_bitmap, BITMASK_BYTE_SIZE);
+    }
+    b += bitmap_size;
 
     for (i = 0; i < reduction->num_values; ++i) {
         enc_uint16(reduction->reduce_values[i].size, &b);
@@ -159,12 +290,12 @@ void free_view_btree_reduction(view_btree_reduction_t *reduction)
 
     if (reduction->reduce_values != NULL){
         for (i = 0; i < reduction->num_values; ++i) {
-            free(reduction->reduce_values[i].buf);
+            cs_free(reduction->reduce_values[i].buf);
         }
-        free(reduction->reduce_values);
+        cs_free(reduction->reduce_values);
     }
 
-    free(reduction);
+    cs_free(reduction);
 }
 
 
@@ -173,7 +304,7 @@ couchstore_error_t decode_view_id_btree_reduction(const char *bytes,
 {
     view_id_btree_reduction_t *r = NULL;
 
-    r = (view_id_btree_reduction_t *) malloc(sizeof(view_id_btree_reduction_t));
+    r = (view_id_btree_reduction_t *) cs_malloc(sizeof(view_id_btree_reduction_t));
     if (r == NULL) {
         goto alloc_error;
     }
@@ -225,7 +356,7 @@ void free_view_id_btree_reduction(view_id_btree_reduction_t *reduction)
         return;
     }
 
-    free(reduction);
+    cs_free(reduction);
 }
 
 static void enc_uint16(uint16_t u, char **buf)
@@ -242,3 +373,120 @@ static void enc_raw40(uint64_t u, char **buf)
     memcpy(*buf, &r, 5);
     *buf += 5;
 }
+
+
+/*
+ * Writes the smallest of a list of the partitions set, a list of the runs
+ * of them, or the whole bitmap, returning its size. A node usually covers
+ * a few partitions, or a few ranges of them.
+ */
+static size_t encode_compact_bitmap(const bitmap_t *bm, char *buf)
+{
+    uint16_t ids[COMPACT_BITMAP_MAX_N];
+    uint16_t runs[COMPACT_BITMAP_MAX_N][2];
+    unsigned num_ids = 0, num_runs = 0;
+    int in_run = 0;
+    unsigned bit, k;
+    char *b = buf;
+
+    for (bit = 0; bit < 1024; ++bit) {
+        if (bm->chunks[BITMASK_BYTE_SIZE - 1 - bit / CHAR_BIT] == 0) {
+            in_run = 0;
+            bit |= CHAR_BIT - 1;
+            continue;
+        }
+        if (!is_bit_set(bm, (uint16_t) bit)) {
+            in_run = 0;
+            continue;
+        }
+        if (num_ids < COMPACT_BITMAP_MAX_N) {
+            ids[num_ids] = (uint16_t) bit;
+        }
+        ++num_ids;
+        if (in_run) {
+            runs[num_runs - 1][1] = (uint16_t) bit;
+        } else {
+            if (num_runs < COMPACT_BITMAP_MAX_N) {
+                runs[num_runs][0] = runs[num_runs][1] = (uint16_t) bit;
+                in_run = 1;
+            }
+            ++num_runs;
+        }
+    }
+
+    if (num_ids <= COMPACT_BITMAP_MAX_N && 2 * num_ids <= 4 * num_runs) {
+        *b++ = (char) (COMPACT_BITMAP_LIST | num_ids);
+        for (k = 0; k < num_ids; ++k) {
+            enc_uint16(ids[k], &b);
+        }
+    } else if (num_runs <= COMPACT_BITMAP_MAX_N &&
+               4 * num_runs < BITMASK_BYTE_SIZE) {
+        *b++ = (char) (COMPACT_BITMAP_RUNS | num_runs);
+        for (k = 0; k < num_runs; ++k) {
+            enc_uint16(runs[k][0], &b);
+            enc_uint16(runs[k][1], &b);
+        }
+    } else {
+        *b++ = (char) COMPACT_BITMAP_FULL;
+        memcpy(b, bm, BITMASK_BYTE_SIZE);
+        b += BITMASK_BYTE_SIZE;
+    }
+
+    return (size_t) (b - buf);
+}
+
+
+/* Decodes what encode_compact_bitmap wrote, returning its size, or -1 if
+   it's not one. */
+static int decode_compact_bitmap(const char *bytes, size_t len, bitmap_t *bm)
+{
+    unsigned char kind;
+    unsigned n, k;
+    uint16_t first, last, bit;
+
+    if (len < 1) {
+        return -1;
+    }
+    kind = (unsigned char) bytes[0];
+    if (kind == COMPACT_BITMAP_FULL) {
+        if (len < 1 + BITMASK_BYTE_SIZE) {
+            return -1;
+        }
+        memcpy(bm, bytes + 1, BITMASK_BYTE_SIZE);
+        return 1 + BITMASK_BYTE_SIZE;
+    }
+
+    memset(bm, 0, sizeof(*bm));
+    n = kind & COMPACT_BITMAP_MAX_N;
+    switch (kind & ~COMPACT_BITMAP_MAX_N) {
+    case COMPACT_BITMAP_LIST:
+        if (len < 1 + 2 * (size_t) n) {
+            return -1;
+        }
+        for (k = 0; k < n; ++k) {
+            bit = dec_uint16(bytes + 1 + 2 * k);
+            if (bit >= 1024) {
+                return -1;
+            }
+            set_bit(bm, bit);
+        }
+        return 1 + 2 * n;
+    case COMPACT_BITMAP_RUNS:
+        if (len < 1 + 4 * (size_t) n) {
+            return -1;
+        }
+        for (k = 0; k < n; ++k) {
+            first = dec_uint16(bytes + 1 + 4 * k);
+            last = dec_uint16(bytes + 3 + 4 * k);
+            if (first > last || last >= 1024) {
+                return -1;
+            }
+            for (bit = first; bit <= last; ++bit) {
+                set_bit(bm, bit);
+            }
+        }
+        return 1 + 4 * n;
+    default:
+        return -1;
+    }
+}
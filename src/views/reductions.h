@@ -8,6 +8,7 @@
 #include <libcouchstore/couch_db.h>
 #include <libcouchstore/couch_common.h>
 #include "bitmap.h"
+#include "../arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,8 +37,24 @@ couchstore_error_t encode_view_btree_reduction(const view_btree_reduction_t *red
                                                char *buffer,
                                                size_t *buffer_size);
 
+/* As encode_view_btree_reduction, but with the partitions bitmap in as
+   few bytes as it takes: a list of the partitions, of the ranges of them,
+   or the whole bitmap. Only for groups whose header is
+   INDEX_HEADER_COMPACT_BITMAPS_VERSION or later, since only readers of those
+   know it; this library's decoders take either. */
+couchstore_error_t encode_view_btree_reduction_compact(const view_btree_reduction_t *reduction,
+                                                       char *buffer,
+                                                       size_t *buffer_size);
+
 void free_view_btree_reduction(view_btree_reduction_t *reduction);
 
+/* Decodes a reduction allocated from arena a, its values pointing into
+   bytes rather than copied (see decode_view_btree_value_in_arena). */
+couchstore_error_t decode_view_btree_reduction_in_arena(const char *bytes,
+                                                        size_t len,
+                                                        arena *a,
+                                                        view_btree_reduction_t **reduction);
+
 couchstore_error_t decode_view_id_btree_reduction(const char *bytes,
                                                   view_id_btree_reduction_t **reduction);
 
@@ -19,90 +19,125 @@
  **/
 
 #include <stdlib.h>
-#include <assert.h>
 #include <string.h>
 #include "sorted_list.h"
+#include "../alloc.h"
 
 
-typedef struct sorted_list_node_t {
-    void *element;
-    struct sorted_list_node_t *next;
-} sorted_list_node_t;
-
+/* Elements are kept in an array of pointers in order, so lookups are
+   binary searches and adding in order (as headers are decoded) appends,
+   while what sorted_list_get returns stays put as the list grows. */
 typedef struct {
     sorted_list_cmp_t cmp_fun;
-    sorted_list_node_t *head;
+    void **elements;
     int length;
+    int capacity;
 } sorted_list_t;
 
 typedef struct {
-    sorted_list_node_t *current;
+    const sorted_list_t *list;
+    int pos;
 } sorted_list_iterator_t;
 
 
 void *sorted_list_create(sorted_list_cmp_t cmp_fun)
 {
-    sorted_list_t *list = (sorted_list_t *) malloc(sizeof(sorted_list_t));
+    sorted_list_t *list = (sorted_list_t *) cs_malloc(sizeof(sorted_list_t));
 
     if (list != NULL) {
         list->cmp_fun = cmp_fun;
-        list->head = NULL;
+        list->elements = NULL;
         list->length = 0;
+        list->capacity = 0;
     }
 
     return (void *) list;
 }
 
 
-int sorted_list_add(void *list, const void *elem, size_t elem_size)
+int sorted_list_reserve(void *list, int n)
 {
     sorted_list_t *l = (sorted_list_t *) list;
-    sorted_list_node_t *n = l->head;
-    sorted_list_node_t *prev = NULL;
-    sorted_list_node_t *new_node;
-    int cmp = 0;
+    void **elements;
 
-    new_node = (sorted_list_node_t *) malloc(sizeof(sorted_list_node_t));
-    if (new_node == NULL) {
-        return -1;
+    if (n <= l->capacity) {
+        return 0;
     }
-    new_node->element = malloc(elem_size);
-    if (new_node->element == NULL) {
-        free(new_node);
+    elements = (void **) cs_realloc(l->elements, n * sizeof(void *));
+    if (elements == NULL) {
         return -1;
     }
-    memcpy(new_node->element, elem, elem_size);
+    l->elements = elements;
+    l->capacity = n;
 
-    if (l->head == NULL) {
-        new_node->next = NULL;
-        l->head = new_node;
-        l->length += 1;
-        return 0;
+    return 0;
+}
+
+
+/* Returns the position of the first element not less than elem, setting
+   *found if it's equal to it. */
+static int sorted_list_search(const sorted_list_t *l, const void *elem,
+                              int *found)
+{
+    int lo = 0, hi = l->length;
+    int cmp;
+
+    *found = 0;
+    /* Elements mostly come in order */
+    if (hi > 0) {
+        cmp = l->cmp_fun(l->elements[hi - 1], elem);
+        if (cmp < 0) {
+            return hi;
+        } else if (cmp == 0) {
+            *found = 1;
+            return hi - 1;
+        }
+        hi--;
     }
 
-    while (n != NULL) {
-        cmp = l->cmp_fun(n->element, elem);
-        if (cmp >= 0) {
-            break;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        cmp = l->cmp_fun(l->elements[mid], elem);
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else if (cmp > 0) {
+            hi = mid;
+        } else {
+            *found = 1;
+            return mid;
         }
-        prev = n;
-        n = n->next;
     }
 
-    if (prev != NULL) {
-        prev->next = new_node;
-    } else {
-        l->head = new_node;
+    return lo;
+}
+
+
+int sorted_list_add(void *list, const void *elem, size_t elem_size)
+{
+    sorted_list_t *l = (sorted_list_t *) list;
+    void *copy;
+    int pos, found;
+
+    if (l->length == l->capacity &&
+        sorted_list_reserve(l, l->capacity == 0 ? 8 : l->capacity * 2) != 0) {
+        return -1;
     }
+    copy = cs_malloc(elem_size);
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, elem, elem_size);
 
-    if (cmp == 0) {
-        new_node->next = n->next;
-        free(n->element);
-        free(n);
+    pos = sorted_list_search(l, elem, &found);
+    if (found) {
+        cs_free(l->elements[pos]);
     } else {
+        memmove(l->elements + pos + 1, l->elements + pos,
+                (l->length - pos) * sizeof(void *));
         l->length += 1;
-        new_node->next = n;
     }
+    l->elements[pos] = copy;
 
     return 0;
 }
@@ -111,50 +146,25 @@ int sorted_list_add(void *list, const void *elem, size_t elem_size)
 void *sorted_list_get(const void *list, const void *elem)
 {
     const sorted_list_t *l = (const sorted_list_t *) list;
-    sorted_list_node_t *n = l->head;
-    int cmp;
+    int pos, found;
 
-    while (n != NULL) {
-        cmp = l->cmp_fun(n->element, elem);
-        if (cmp == 0) {
-            return n->element;
-        } else if (cmp > 0) {
-            return NULL;
-        } else {
-            n = n->next;
-        }
-    }
+    pos = sorted_list_search(l, elem, &found);
 
-    return n;
+    return found ? l->elements[pos] : NULL;
 }
 
 
 void sorted_list_remove(void *list, const void *elem)
 {
     sorted_list_t *l = (sorted_list_t *) list;
-    sorted_list_node_t *n = l->head;
-    sorted_list_node_t *prev = NULL;
-    int cmp;
-
-    while (n != NULL) {
-        cmp = l->cmp_fun(n->element, elem);
-        if (cmp == 0) {
-            if (prev == NULL) {
-                assert(n == l->head);
-                l->head = n->next;
-            } else {
-                prev->next = n->next;
-            }
-            l->length -= 1;
-            free(n->element);
-            free(n);
-            break;
-        } else if (cmp > 0) {
-            return;
-        } else {
-            prev = n;
-            n = n->next;
-        }
+    int pos, found;
+
+    pos = sorted_list_search(l, elem, &found);
+    if (found) {
+        cs_free(l->elements[pos]);
+        l->length -= 1;
+        memmove(l->elements + pos, l->elements + pos + 1,
+                (l->length - pos) * sizeof(void *));
     }
 }
 
@@ -162,16 +172,14 @@ void sorted_list_remove(void *list, const void *elem)
 void sorted_list_free(void *list)
 {
     sorted_list_t *l = (sorted_list_t *) list;
-    sorted_list_node_t *n = NULL;
+    int i;
 
     if (l != NULL) {
-        while (l->head != NULL) {
-            n = l->head;
-            l->head = l->head->next;
-            free(n->element);
-            free(n);
+        for (i = 0; i < l->length; ++i) {
+            cs_free(l->elements[i]);
         }
-        free(list);
+        cs_free(l->elements);
+        cs_free(list);
     }
 }
 
@@ -189,9 +197,10 @@ void *sorted_list_iterator(const void *list)
    const sorted_list_t *l = (const sorted_list_t *) list;
    sorted_list_iterator_t *it = NULL;
 
-   it = (sorted_list_iterator_t *) malloc(sizeof(*it));
+   it = (sorted_list_iterator_t *) cs_malloc(sizeof(*it));
    if (it != NULL) {
-       it->current = l->head;
+       it->list = l;
+       it->pos = 0;
    }
 
    return (void *) it;
@@ -201,18 +210,16 @@ void *sorted_list_iterator(const void *list)
 void *sorted_list_next(void *iterator)
 {
     sorted_list_iterator_t *it = (sorted_list_iterator_t *) iterator;
-    void *elem = NULL;
 
-    if (it->current != NULL) {
-        elem = it->current->element;
-        it->current = it->current->next;
+    if (it->pos < it->list->length) {
+        return it->list->elements[it->pos++];
     }
 
-    return elem;
+    return NULL;
 }
 
 
 void sorted_list_free_iterator(void *iterator)
 {
-    free(iterator);
+    cs_free(iterator);
 }
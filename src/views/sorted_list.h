@@ -40,6 +40,10 @@ void *sorted_list_create(sorted_list_cmp_t less_fun);
 
 int   sorted_list_add(void *list, const void *elem, size_t elem_size);
 
+/* Makes room for n elements, for a list about to be filled. Elements added
+   in order are appended, so a list built that way takes linear time. */
+int   sorted_list_reserve(void *list, int n);
+
 void *sorted_list_get(const void *list, const void *elem);
 
 void sorted_list_remove(void *list, const void *elem);
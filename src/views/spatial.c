@@ -21,9 +21,16 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <assert.h>
+#include <string.h>
 #include "spatial.h"
+#include "values.h"
+#include "reductions.h"
 #include "../bitfield.h"
 
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
 
 #define BYTE_PER_COORD sizeof(uint32_t)
 
@@ -34,10 +41,38 @@
 #define CHUNK_OFFSET(bit)           ((bit) % CHUNK_BITS)
 
 
-int spatial_key_cmp(const sized_buf *key1, const sized_buf *key2,
-                    const void *user_ctx)
+/* The curve code of a key's MBB's centre, in code, made on the stack;
+ * -1 if the key has more dimensions than there's room for, or not those
+ * of sf */
+static int key_curve_code(const sized_buf *key, const scale_factor_t *sf,
+                          unsigned char *code)
+{
+    double center[SPATIAL_STACK_DIM];
+    uint32_t scaled[SPATIAL_STACK_DIM];
+    sized_mbb_t mbb;
+
+    if (sf->dim > SPATIAL_STACK_DIM || key->size < sizeof(uint16_t)) {
+        return -1;
+    }
+    mbb.num = decode_raw16(*((raw_16 *) key->buf));
+    if (mbb.num != sf->dim * 2u ||
+        key->size < sizeof(uint16_t) + mbb.num * sizeof(double)) {
+        return -1;
+    }
+    mbb.mbb = (double *)(key->buf + sizeof(uint16_t));
+
+    spatial_center_to(&mbb, center);
+    spatial_scale_point_to(center, sf, scaled);
+    spatial_curve_code_to(scaled, sf, code);
+
+    return 0;
+}
+
+
+static int spatial_key_cmp_alloc(const sized_buf *key1,
+                                 const sized_buf *key2,
+                                 const scale_factor_t *sf)
 {
-    scale_factor_t *sf = (scale_factor_t *)user_ctx;
     uint16_t mbb1_num = decode_raw16(*((raw_16 *) key1->buf));
     uint16_t mbb2_num = decode_raw16(*((raw_16 *) key2->buf));
     sized_mbb_t mbbs[2];
@@ -50,27 +85,73 @@ int spatial_key_cmp(const sized_buf *key1, const sized_buf *key2,
     mbbs[0].mbb = (double *)(key1->buf + sizeof(uint16_t));
     mbbs_center[0] = spatial_center(&mbbs[0]);
     mbbs_scaled[0] = spatial_scale_point(mbbs_center[0], sf);
-    mbbs_zcode[0] = interleave_uint32s(mbbs_scaled[0], sf->dim);
+    mbbs_zcode[0] = spatial_curve_code(mbbs_scaled[0], sf);
 
     mbbs[1].num = mbb2_num;
     mbbs[1].mbb = (double *)(key2->buf + sizeof(uint16_t));
     mbbs_center[1] = spatial_center(&mbbs[1]);
     mbbs_scaled[1] = spatial_scale_point(mbbs_center[1], sf);
-    mbbs_zcode[1] = interleave_uint32s(mbbs_scaled[1], sf->dim);
+    mbbs_zcode[1] = spatial_curve_code(mbbs_scaled[1], sf);
 
     res = memcmp(mbbs_zcode[0], mbbs_zcode[1], sf->dim * BYTE_PER_COORD);
 
-    free(mbbs_center[0]);
-    free(mbbs_scaled[0]);
-    free(mbbs_zcode[0]);
-    free(mbbs_center[1]);
-    free(mbbs_scaled[1]);
-    free(mbbs_zcode[1]);
+    cs_free(mbbs_center[0]);
+    cs_free(mbbs_scaled[0]);
+    cs_free(mbbs_zcode[0]);
+    cs_free(mbbs_center[1]);
+    cs_free(mbbs_scaled[1]);
+    cs_free(mbbs_zcode[1]);
+
+    return res;
+}
+
+
+int spatial_key_cmp(const sized_buf *key1, const sized_buf *key2,
+                    const void *user_ctx)
+{
+    const scale_factor_t *sf = (const scale_factor_t *)user_ctx;
+    unsigned char code1[SPATIAL_STACK_DIM * BYTE_PER_COORD];
+    unsigned char code2[SPATIAL_STACK_DIM * BYTE_PER_COORD];
+    int res;
+
+    if (key_curve_code(key1, sf, code1) == 0 &&
+        key_curve_code(key2, sf, code2) == 0) {
+        res = memcmp(code1, code2, sf->dim * BYTE_PER_COORD);
+    } else {
+        res = spatial_key_cmp_alloc(key1, key2, sf);
+    }
+
+    if (res == 0) {
+        size_t size = key1->size < key2->size ? key1->size : key2->size;
+
+        res = memcmp(key1->buf, key2->buf, size);
+        if (res == 0) {
+            res = (key1->size > key2->size) - (key1->size < key2->size);
+        }
+    }
 
     return res;
 }
 
 
+int spatial_key_sort_key(const sized_buf *key, char *out, size_t size,
+                         const void *user_ctx)
+{
+    const scale_factor_t *sf = (const scale_factor_t *)user_ctx;
+    size_t code_size = sf->dim * BYTE_PER_COORD;
+
+    /* The codes are all of a size, so the keys following them only count
+       when they're equal, as in spatial_key_cmp */
+    if (size < code_size || size - code_size < key->size ||
+        key_curve_code(key, sf, (unsigned char *) out) < 0) {
+        return -1;
+    }
+    memcpy(out + code_size, key->buf, key->size);
+
+    return (int) (code_size + key->size);
+}
+
+
 scale_factor_t *spatial_scale_factor(const double *mbb, uint16_t dim,
                                      uint32_t max)
 {
@@ -80,19 +161,19 @@ scale_factor_t *spatial_scale_factor(const double *mbb, uint16_t dim,
     double *offsets = NULL;
     double *scales = NULL;
 
-    sf = (scale_factor_t *)malloc(sizeof(scale_factor_t));
+    sf = (scale_factor_t *)cs_malloc(sizeof(scale_factor_t));
     if (sf == NULL) {
         return NULL;
     }
-    offsets = (double *)malloc(sizeof(double) * dim);
+    offsets = (double *)cs_malloc(sizeof(double) * dim);
     if (offsets == NULL) {
-        free(sf);
+        cs_free(sf);
         return NULL;
     }
-    scales = (double *)malloc(sizeof(double) * dim);
+    scales = (double *)cs_malloc(sizeof(double) * dim);
     if (scales == NULL) {
-        free(sf);
-        free(offsets);
+        cs_free(sf);
+        cs_free(offsets);
         return NULL;
     }
 
@@ -109,6 +190,7 @@ scale_factor_t *spatial_scale_factor(const double *mbb, uint16_t dim,
     sf->offsets = offsets;
     sf->scales = scales;
     sf->dim = dim;
+    sf->order = SPATIAL_ORDER_ZCODE;
     return sf;
 }
 
@@ -117,41 +199,56 @@ void free_spatial_scale_factor(scale_factor_t *sf)
     if (sf == NULL) {
         return;
     }
-    free(sf->offsets);
-    free(sf->scales);
-    free(sf);
+    cs_free(sf->offsets);
+    cs_free(sf->scales);
+    cs_free(sf);
 }
 
 
-double *spatial_center(const sized_mbb_t *mbb)
+void spatial_center_to(const sized_mbb_t *mbb, double *center)
 {
-    double *center = (double *)malloc(sizeof(double) * (mbb->num/2));
     uint32_t i;
-    if (center == NULL) {
-        return NULL;
-    }
 
     for (i = 0; i < mbb->num; i += 2) {
         center[i/2] = mbb->mbb[i] + ((mbb->mbb[i+1] - mbb->mbb[i])/2);
     }
-    return center;
 }
 
 
-uint32_t *spatial_scale_point(const double *point, const scale_factor_t *sf)
+double *spatial_center(const sized_mbb_t *mbb)
 {
-    int i;
-    uint32_t *scaled = (uint32_t *)malloc(sizeof(uint32_t) * sf->dim);
-    if (scaled == NULL) {
+    double *center = (double *)cs_malloc(sizeof(double) * (mbb->num/2));
+    if (center == NULL) {
         return NULL;
     }
 
+    spatial_center_to(mbb, center);
+    return center;
+}
+
+
+void spatial_scale_point_to(const double *point, const scale_factor_t *sf,
+                            uint32_t *scaled)
+{
+    int i;
+
     for (i = 0; i < sf->dim; ++i) {
         /* casting to int is OK. No rounding is needed for the
            space-filling curve */
         scaled[i] = (uint32_t)((point[i] - sf->offsets[i]) *
                                sf->scales[i]);
     }
+}
+
+
+uint32_t *spatial_scale_point(const double *point, const scale_factor_t *sf)
+{
+    uint32_t *scaled = (uint32_t *)cs_malloc(sizeof(uint32_t) * sf->dim);
+    if (scaled == NULL) {
+        return NULL;
+    }
+
+    spatial_scale_point_to(point, sf, scaled);
     return scaled;
 }
 
@@ -162,20 +259,43 @@ void set_bit_sized(unsigned char *bitmap, uint16_t size, uint16_t bit)
 }
 
 
-unsigned char *interleave_uint32s(uint32_t *numbers, uint16_t num)
+/* The bits of x spread out to the even bits of the result */
+static uint64_t spread_uint32(uint32_t x)
+{
+#ifdef __BMI2__
+    return _pdep_u64(x, 0x5555555555555555ULL);
+#else
+    uint64_t v = x;
+
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+#endif
+}
+
+
+void interleave_uint32s_to(const uint32_t *numbers, uint16_t num,
+                           unsigned char *bitmap)
 {
     uint8_t i;
     uint16_t j, bitmap_size;
-    unsigned char *bitmap = NULL;
 
     assert(num < 16384);
 
+    /* Two dimensions, the common case, a word at a time */
+    if (num == 2) {
+        raw_64 code = encode_raw64((spread_uint32(numbers[0]) << 1) |
+                                   spread_uint32(numbers[1]));
+        memcpy(bitmap, &code, sizeof(code));
+        return;
+    }
+
     /* bitmap_size in bits (hence the `*8`) */
     bitmap_size = (sizeof(uint32_t) * num * 8);
-    bitmap = (unsigned char *)calloc(bitmap_size / 8, sizeof(unsigned char));
-    if (bitmap == NULL) {
-        return NULL;
-    }
+    memset(bitmap, 0, bitmap_size / 8);
 
     /* i is the bit offset within a number
      * j is the current number offset */
@@ -188,5 +308,280 @@ unsigned char *interleave_uint32s(uint32_t *numbers, uint16_t num)
             }
         }
     }
+}
+
+
+unsigned char *interleave_uint32s(uint32_t *numbers, uint16_t num)
+{
+    unsigned char *bitmap;
+
+    assert(num < 16384);
+
+    bitmap = (unsigned char *)cs_malloc(sizeof(uint32_t) * num);
+    if (bitmap == NULL) {
+        return NULL;
+    }
+
+    interleave_uint32s_to(numbers, num, bitmap);
     return bitmap;
 }
+
+
+/* Skilling's transform ("Programming the Hilbert curve", 2004) of a point
+ * to its Hilbert index, in place, with the index's bits left spread over
+ * the numbers, the most significant in the first: interleaving them gives
+ * the index. */
+static void hilbert_transpose(uint32_t *x, uint16_t num)
+{
+    const uint32_t m = (uint32_t) 1 << (ZCODE_PRECISION - 1);
+    uint32_t p, q, t;
+    uint16_t i;
+
+    /* Inverse undo */
+    for (q = m; q > 1; q >>= 1) {
+        p = q - 1;
+        for (i = 0; i < num; i++) {
+            if (x[i] & q) {
+                x[0] ^= p;
+            } else {
+                t = (x[0] ^ x[i]) & p;
+                x[0] ^= t;
+                x[i] ^= t;
+            }
+        }
+    }
+
+    /* Gray encode */
+    for (i = 1; i < num; i++) {
+        x[i] ^= x[i - 1];
+    }
+    t = 0;
+    for (q = m; q > 1; q >>= 1) {
+        if (x[num - 1] & q) {
+            t ^= q - 1;
+        }
+    }
+    for (i = 0; i < num; i++) {
+        x[i] ^= t;
+    }
+}
+
+
+void hilbert_uint32s_to(uint32_t *numbers, uint16_t num,
+                        unsigned char *index)
+{
+    /* In one dimension the curve is the line itself */
+    if (num >= 2) {
+        hilbert_transpose(numbers, num);
+    }
+    interleave_uint32s_to(numbers, num, index);
+}
+
+
+unsigned char *hilbert_uint32s(uint32_t *numbers, uint16_t num)
+{
+    uint32_t *transposed;
+    unsigned char *index;
+
+    transposed = (uint32_t *)cs_malloc(sizeof(uint32_t) * num);
+    index = (unsigned char *)cs_malloc(sizeof(uint32_t) * num);
+    if (transposed == NULL || index == NULL) {
+        cs_free(transposed);
+        cs_free(index);
+        return NULL;
+    }
+    memcpy(transposed, numbers, sizeof(uint32_t) * num);
+    hilbert_uint32s_to(transposed, num, index);
+    cs_free(transposed);
+
+    return index;
+}
+
+
+void spatial_curve_code_to(uint32_t *numbers, const scale_factor_t *sf,
+                           unsigned char *code)
+{
+    if (sf->order == SPATIAL_ORDER_HILBERT) {
+        hilbert_uint32s_to(numbers, sf->dim, code);
+    } else {
+        interleave_uint32s_to(numbers, sf->dim, code);
+    }
+}
+
+
+unsigned char *spatial_curve_code(uint32_t *numbers,
+                                  const scale_factor_t *sf)
+{
+    if (sf->order == SPATIAL_ORDER_HILBERT) {
+        return hilbert_uint32s(numbers, sf->dim);
+    }
+    return interleave_uint32s(numbers, sf->dim);
+}
+
+
+/* The MBB a key or a reduce value starts with */
+static couchstore_error_t read_mbb(const sized_buf *buf,
+                                   uint16_t *num,
+                                   const char **values)
+{
+    if (buf->size < sizeof(uint16_t)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    *num = decode_raw16(*((raw_16 *) buf->buf));
+    if (*num == 0 || *num % 2 != 0 ||
+        buf->size < sizeof(uint16_t) + *num * sizeof(double)) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    *values = buf->buf + sizeof(uint16_t);
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+/* Widens the MBB in enclosing, allocated on the first call, to take in
+ * the num values given. The values may be unaligned. */
+static couchstore_error_t union_mbb(sized_buf *enclosing,
+                                    uint16_t num,
+                                    const char *values)
+{
+    char *dst;
+    double a[2], b[2];
+    uint16_t i;
+
+    if (enclosing->buf == NULL) {
+        raw_16 raw_num = encode_raw16(num);
+
+        enclosing->size = sizeof(uint16_t) + num * sizeof(double);
+        enclosing->buf = (char *) cs_malloc(enclosing->size);
+        if (enclosing->buf == NULL) {
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        memcpy(enclosing->buf, &raw_num, sizeof(raw_num));
+        memcpy(enclosing->buf + sizeof(uint16_t), values,
+               num * sizeof(double));
+        return COUCHSTORE_SUCCESS;
+    }
+
+    if (decode_raw16(*((raw_16 *) enclosing->buf)) != num) {
+        /* MBBs of different dimensions */
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    dst = enclosing->buf + sizeof(uint16_t);
+    for (i = 0; i < num; i += 2) {
+        memcpy(a, dst + i * sizeof(double), sizeof(a));
+        memcpy(b, values + i * sizeof(double), sizeof(b));
+        if (b[0] < a[0]) {
+            a[0] = b[0];
+        }
+        if (b[1] > a[1]) {
+            a[1] = b[1];
+        }
+        memcpy(dst + i * sizeof(double), a, sizeof(a));
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+couchstore_error_t spatial_btree_reduce(char *dst,
+                                        size_t *size_r,
+                                        const nodelist *leaflist,
+                                        int count,
+                                        void *ctx)
+{
+    view_btree_reduction_t red;
+    sized_buf mbb = { NULL, 0 };
+    const nodelist *n;
+    int c;
+    couchstore_error_t ret = COUCHSTORE_SUCCESS;
+
+    (void) ctx;
+    memset(&red, 0, sizeof(red));
+
+    for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
+        view_btree_value_view_t v;
+        const char *values;
+        uint16_t num;
+
+        ret = view_btree_value_view(n->data.buf, n->data.size, &v);
+        if (ret != COUCHSTORE_SUCCESS) {
+            goto out;
+        }
+        set_bit(&red.partitions_bitmap, v.partition);
+        red.kv_count += v.num_values;
+
+        ret = read_mbb(&n->key, &num, &values);
+        if (ret != COUCHSTORE_SUCCESS) {
+            goto out;
+        }
+        ret = union_mbb(&mbb, num, values);
+        if (ret != COUCHSTORE_SUCCESS) {
+            goto out;
+        }
+    }
+
+    if (mbb.buf != NULL) {
+        red.num_values = 1;
+        red.reduce_values = &mbb;
+    }
+    ret = encode_view_btree_reduction(&red, dst, size_r);
+
+ out:
+    cs_free(mbb.buf);
+
+    return ret;
+}
+
+
+couchstore_error_t spatial_btree_rereduce(char *dst,
+                                          size_t *size_r,
+                                          const nodelist *leaflist,
+                                          int count,
+                                          void *ctx)
+{
+    view_btree_reduction_t red;
+    sized_buf mbb = { NULL, 0 };
+    const nodelist *n;
+    int c;
+    couchstore_error_t ret = COUCHSTORE_SUCCESS;
+
+    (void) ctx;
+    memset(&red, 0, sizeof(red));
+
+    for (n = leaflist, c = 0; n != NULL && c < count; n = n->next, ++c) {
+        view_btree_reduction_t *r = NULL;
+        const char *values;
+        uint16_t num;
+
+        ret = decode_view_btree_reduction(n->pointer->reduce_value.buf,
+                                          n->pointer->reduce_value.size, &r);
+        if (ret != COUCHSTORE_SUCCESS) {
+            goto out;
+        }
+        union_bitmaps(&red.partitions_bitmap, &r->partitions_bitmap);
+        red.kv_count += r->kv_count;
+
+        if (r->num_values > 0) {
+            ret = read_mbb(&r->reduce_values[0], &num, &values);
+            if (ret == COUCHSTORE_SUCCESS) {
+                ret = union_mbb(&mbb, num, values);
+            }
+        }
+        free_view_btree_reduction(r);
+        if (ret != COUCHSTORE_SUCCESS) {
+            goto out;
+        }
+    }
+
+    if (mbb.buf != NULL) {
+        red.num_values = 1;
+        red.reduce_values = &mbb;
+    }
+    ret = encode_view_btree_reduction(&red, dst, size_r);
+
+ out:
+    cs_free(mbb.buf);
+
+    return ret;
+}
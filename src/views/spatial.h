@@ -24,12 +24,23 @@
 #include "config.h"
 #include <libcouchstore/couch_db.h>
 #include "../file_merger.h"
+#include "../couch_btree.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
     #define ZCODE_PRECISION 32
     #define ZCODE_MAX_VALUE UINT32_MAX
+    /* Most dimensions keys are compared in without allocating */
+    #define SPATIAL_STACK_DIM 16
+
+    /* The space-filling curve the keys of a spatial index are ordered
+     * along. The Hilbert curve keeps keys that are near in the order near
+     * in space, so the R-tree's nodes get tighter MBBs. */
+    typedef enum {
+        SPATIAL_ORDER_ZCODE = 0,
+        SPATIAL_ORDER_HILBERT
+    } spatial_order_t;
 
     typedef struct {
         const double *mbb;
@@ -46,16 +57,47 @@ extern "C" {
         double *scales;
         /* the total number of values, one per dimension */
         uint16_t dim;
+        /* The curve keys are ordered along, spatial_key_cmp's order */
+        spatial_order_t order;
     } scale_factor_t;
 
 
-    /* compare keys of a spatial index */
+    /* compare keys of a spatial index, by the Z-order or Hilbert order
+     * (see scale_factor_t's order) of their MBBs' centres within the
+     * enclosing MBB of user_ctx (a scale_factor_t).
+     * Keys whose centres fall on the same point are ordered by their
+     * bytes, so no two different keys compare equal. */
     int spatial_key_cmp(const sized_buf *key1, const sized_buf *key2,
                         const void *user_ctx);
 
+    /* writes bytes to out which compare with memcmp as spatial_key_cmp
+     * compares the key: its curve code, then the key. Returns their
+     * length; -1 if there are more than size, or the key has more than
+     * SPATIAL_STACK_DIM dimensions or not those of user_ctx. */
+    int spatial_key_sort_key(const sized_buf *key, char *out, size_t size,
+                             const void *user_ctx);
+
+    /* Reducers of a spatial index's btree, an R-tree. Keys start with an
+     * MBB (its number of values as a raw 16 bit integer, then the values
+     * as doubles), and values are those of a mapreduce view's btree. The
+     * reductions are those of a mapreduce view's btree with a single reduce
+     * value, the union of the MBBs under the node, in the same layout as a
+     * key's MBB. ctx is unused. */
+    couchstore_error_t spatial_btree_reduce(char *dst,
+                                            size_t *size_r,
+                                            const nodelist *leaflist,
+                                            int count,
+                                            void *ctx);
+
+    couchstore_error_t spatial_btree_rereduce(char *dst,
+                                              size_t *size_r,
+                                              const nodelist *leaflist,
+                                              int count,
+                                              void *ctx);
+
     /* Return the scale factor for every dimension that would be needed to
      * scale this MBB to the maximum value `max` (when shifted to the
-     * origin)
+     * origin), for keys in Z-order
      * Memory is dynamically allocted within the function, make sure to call
      * free_spatial_scale_factor() afterwards */
     scale_factor_t *spatial_scale_factor(const double *mbb, uint16_t dim,
@@ -67,11 +109,19 @@ extern "C" {
     /* Calculate the center of an multi-dimensional bounding box (MBB) */
     double *spatial_center(const sized_mbb_t *mbb);
 
+    /* The same, written to center, which has room for mbb->num/2 values */
+    void spatial_center_to(const sized_mbb_t *mbb, double *center);
+
     /* Scales all dimensions of a (multi-dimensional) point
      * with the given factor and offset */
     uint32_t *spatial_scale_point(const double *point,
                                   const scale_factor_t *sf);
 
+    /* The same, written to scaled, which has room for sf->dim values */
+    void spatial_scale_point_to(const double *point,
+                                const scale_factor_t *sf,
+                                uint32_t *scaled);
+
     /* Set a bit on a buffer with a certain size */
     void set_bit_sized(unsigned char *bitmap, uint16_t size, uint16_t bit);
 
@@ -80,6 +130,30 @@ extern "C" {
      * The maximum number of numbers is (2^14)-1 (16383). */
     unsigned char *interleave_uint32s(uint32_t *numbers, uint16_t num);
 
+    /* The same, written to bitmap, which has room for 4 bytes * num */
+    void interleave_uint32s_to(const uint32_t *numbers, uint16_t num,
+                               unsigned char *bitmap);
+
+    /* The index of a point along the Hilbert curve, in the same layout
+     * and with the same limit on the number of numbers as
+     * interleave_uint32s(). */
+    unsigned char *hilbert_uint32s(uint32_t *numbers, uint16_t num);
+
+    /* The same, written to index, which has room for 4 bytes * num. The
+     * numbers are transformed in place on the way. */
+    void hilbert_uint32s_to(uint32_t *numbers, uint16_t num,
+                            unsigned char *index);
+
+    /* The code of a scaled point the keys are ordered by, its Z-code or
+     * Hilbert index as sf's order has it */
+    unsigned char *spatial_curve_code(uint32_t *numbers,
+                                      const scale_factor_t *sf);
+
+    /* The same, written to code, which has room for 4 bytes * sf->dim.
+     * The numbers may be overwritten. */
+    void spatial_curve_code_to(uint32_t *numbers, const scale_factor_t *sf,
+                               unsigned char *code);
+
 #ifdef __cplusplus
 }
 #endif
@@ -59,6 +59,39 @@ int view_key_cmp(const sized_buf *key1, const sized_buf *key2,
 }
 
 
+int view_key_sort_key(const sized_buf *key, char *out, size_t size,
+                      const void *user_ctx)
+{
+    uint16_t json_key_len;
+    sized_buf json_key;
+    size_t doc_id_size;
+    int len;
+
+    (void)user_ctx;
+
+    if (key->size < sizeof(uint16_t)) {
+        return -1;
+    }
+    json_key_len = decode_raw16(*((raw_16 *) key->buf));
+    if (key->size - sizeof(uint16_t) < json_key_len) {
+        return -1;
+    }
+    json_key.buf = key->buf + sizeof(uint16_t);
+    json_key.size = json_key_len;
+    doc_id_size = key->size - sizeof(uint16_t) - json_key_len;
+
+    /* The JSON's sort key is never a prefix of another's, so the doc ids
+       following them only count when the JSON collates equal */
+    len = CollateJSONSortKey(&json_key, out, size);
+    if (len < 0 || size - (size_t) len < doc_id_size) {
+        return -1;
+    }
+    memcpy(out + len, json_key.buf + json_key.size, doc_id_size);
+
+    return len + (int) doc_id_size;
+}
+
+
 int view_id_cmp(const sized_buf *key1, const sized_buf *key2,
                 const void *user_ctx)
 {
@@ -67,40 +100,96 @@ int view_id_cmp(const sized_buf *key1, const sized_buf *key2,
 }
 
 
-int read_view_record(FILE *in, void **buf, void *ctx)
+/*
+ * Gives a record the sort key of its key, made once when it's read so that
+ * the many comparisons of a sort or merge are each a memcmp. Keys it can't
+ * be made for are left to key_cmp_fun.
+ */
+/* A record read into slab grows there instead of being reallocated. */
+static view_file_merge_record_t *add_sort_key(view_file_merge_record_t *rec,
+                                              const view_file_merge_ctx_t *ctx,
+                                              arena *slab)
+{
+    char sort_key[VIEW_RECORD_SORT_KEY_MAX];
+    view_file_merge_record_t *r;
+    sized_buf k;
+    int len;
+
+    k.size = rec->ksize;
+    k.buf = VIEW_RECORD_KEY(rec);
+    len = ctx->sort_key_fun(&k, sort_key, sizeof(sort_key),
+                            ctx->key_cmp_ctx);
+    if (len <= 0) {
+        return rec;
+    }
+
+    if (slab != NULL) {
+        r = (view_file_merge_record_t *) arena_realloc_last(slab, rec,
+                                                 sizeof(*rec) + rec->ksize + rec->vsize,
+                                                 sizeof(*rec) + rec->ksize + rec->vsize + len);
+        if (r == NULL) {
+            return NULL;
+        }
+    } else {
+        r = (view_file_merge_record_t *) cs_realloc(rec, sizeof(*rec) + rec->ksize +
+                                                 rec->vsize + len);
+        if (r == NULL) {
+            cs_free(rec);
+            return NULL;
+        }
+    }
+    r->sksize = (uint16_t) len;
+    memcpy(VIEW_RECORD_SORT_KEY(r), sort_key, len);
+
+    return r;
+}
+
+
+static int read_view_record_into(FILE *in, void **buf, arena *slab, void *ctx)
 {
     uint32_t len, vlen;
     uint16_t klen;
-    uint8_t op;
+    uint8_t op = 0;
+    /* len, then op for an incremental update, then klen */
+    char header[sizeof(len) + sizeof(op) + sizeof(klen)];
+    size_t header_size = sizeof(header);
+    size_t got;
     view_file_merge_record_t *rec;
     view_file_merge_ctx_t *merge_ctx = (view_file_merge_ctx_t *) ctx;
 
     /* On disk format is a bit weird, but it's compatible with what
-       Erlang's file_sorter module requires. */
+       Erlang's file_sorter module requires. The fixed part is taken from
+       the stream's buffer in one go, and the key and value in another. */
 
-    if (fread(&len, sizeof(len), 1, in) != 1) {
-        if (feof(in)) {
+    if (merge_ctx->type != INCREMENTAL_UPDATE_VIEW_RECORD) {
+        header_size -= sizeof(op);
+    }
+    got = fread(header, 1, header_size, in);
+    if (got != header_size) {
+        if (got == 0 && feof(in)) {
             return 0;
         } else {
             return FILE_MERGER_ERROR_FILE_READ;
         }
     }
+
+    memcpy(&len, header, sizeof(len));
     if (merge_ctx->type == INCREMENTAL_UPDATE_VIEW_RECORD) {
-        if (fread(&op, sizeof(rec->op), 1, in) != 1) {
-            return FILE_MERGER_ERROR_FILE_READ;
-        }
-    }
-    if (fread(&klen, sizeof(klen), 1, in) != 1) {
-        return FILE_MERGER_ERROR_FILE_READ;
+        op = (uint8_t) header[sizeof(len)];
     }
+    memcpy(&klen, header + header_size - sizeof(klen), sizeof(klen));
 
     klen = ntohs(klen);
-    vlen = len - sizeof(klen) - klen;
-    if (merge_ctx->type == INCREMENTAL_UPDATE_VIEW_RECORD) {
-        vlen -= sizeof(op);
+    if (len < header_size - sizeof(len) + klen) {
+        return FILE_MERGER_ERROR_FILE_READ;
     }
+    vlen = len - (header_size - sizeof(len)) - klen;
 
-    rec = (view_file_merge_record_t *) malloc(sizeof(*rec) + klen + vlen);
+    if (slab != NULL) {
+        rec = (view_file_merge_record_t *) arena_alloc(slab, sizeof(*rec) + klen + vlen);
+    } else {
+        rec = (view_file_merge_record_t *) cs_malloc(sizeof(*rec) + klen + vlen);
+    }
     if (rec == NULL) {
         return FILE_MERGER_ERROR_ALLOC;
     }
@@ -108,18 +197,40 @@ int read_view_record(FILE *in, void **buf, void *ctx)
     rec->op = op;
     rec->ksize = klen;
     rec->vsize = vlen;
+    rec->sksize = 0;
 
     if (fread(VIEW_RECORD_KEY(rec), klen + vlen, 1, in) != 1) {
-        free(rec);
+        if (slab == NULL) {
+            cs_free(rec);
+        }
         return FILE_MERGER_ERROR_FILE_READ;
     }
 
+    if (merge_ctx->sort_key_fun != NULL) {
+        rec = add_sort_key(rec, merge_ctx, slab);
+        if (rec == NULL) {
+            return FILE_MERGER_ERROR_ALLOC;
+        }
+    }
+
     *buf = (void *) rec;
 
     return klen + vlen;
 }
 
 
+int read_view_record(FILE *in, void **buf, void *ctx)
+{
+    return read_view_record_into(in, buf, NULL, ctx);
+}
+
+
+int read_view_record_slab(FILE *in, void **buf, arena *slab, void *ctx)
+{
+    return read_view_record_into(in, buf, slab, ctx);
+}
+
+
 file_merger_error_t write_view_record(FILE *out, void *buf, void *ctx)
 {
     view_file_merge_record_t *rec = (view_file_merge_record_t *) buf;
@@ -159,13 +270,21 @@ int compare_view_records(const void *r1, const void *r2, void *ctx)
     sized_buf k1, k2;
     int res;
 
-    k1.size = rec1->ksize;
-    k1.buf = VIEW_RECORD_KEY(rec1);
+    if (rec1->sksize != 0 && rec2->sksize != 0) {
+        k1.size = rec1->sksize;
+        k1.buf = VIEW_RECORD_SORT_KEY(rec1);
+        k2.size = rec2->sksize;
+        k2.buf = VIEW_RECORD_SORT_KEY(rec2);
 
-    k2.size = rec2->ksize;
-    k2.buf = VIEW_RECORD_KEY(rec2);
+        res = ebin_compare(&k1, &k2);
+    } else {
+        k1.size = rec1->ksize;
+        k1.buf = VIEW_RECORD_KEY(rec1);
+        k2.size = rec2->ksize;
+        k2.buf = VIEW_RECORD_KEY(rec2);
 
-    res = merge_ctx->key_cmp_fun(&k1, &k2, merge_ctx->user_ctx);
+        res = merge_ctx->key_cmp_fun(&k1, &k2, merge_ctx->key_cmp_ctx);
+    }
 
     if (res == 0 && merge_ctx->type == INCREMENTAL_UPDATE_VIEW_RECORD) {
         return ((int) rec1->op) - ((int) rec2->op);
@@ -175,10 +294,25 @@ int compare_view_records(const void *r1, const void *r2, void *ctx)
 }
 
 
+int view_record_sort_key(const void *record, sized_buf *key, void *ctx)
+{
+    const view_file_merge_record_t *rec = (const view_file_merge_record_t *) record;
+    (void) ctx;
+
+    if (rec->sksize == 0) {
+        return 0;
+    }
+    key->buf = VIEW_RECORD_SORT_KEY(rec);
+    key->size = rec->sksize;
+
+    return 1;
+}
+
+
 void free_view_record(void *record, void *ctx)
 {
     (void) ctx;
-    free(record);
+    cs_free(record);
 }
 
 
@@ -232,9 +366,9 @@ char *view_error_msg(couchstore_error_t ret)
     switch (ret) {
     case COUCHSTORE_ERROR_REDUCTION_TOO_LARGE:
         /* TODO: add reduction byte size information to error message */
-        error_msg =  strdup("reduction too large");
+        error_msg =  cs_strdup("reduction too large");
     default:
-        error_msg = (char *) malloc(64);
+        error_msg = (char *) cs_malloc(64);
         if (error_msg != NULL) {
             sprintf(error_msg, "%d", ret);
         }
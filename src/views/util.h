@@ -34,10 +34,15 @@ extern "C" {
         uint8_t   op;
         uint16_t  ksize;
         uint32_t  vsize;
+        uint16_t  sksize;       /* of the sort key after the value, or 0 */
     } __attribute__((packed)) view_file_merge_record_t;
 
 #define VIEW_RECORD_KEY(rec) (((char *) rec) + sizeof(view_file_merge_record_t))
 #define VIEW_RECORD_VAL(rec) (VIEW_RECORD_KEY(rec) + rec->ksize)
+#define VIEW_RECORD_SORT_KEY(rec) (VIEW_RECORD_VAL(rec) + rec->vsize)
+
+    /* Longest sort key a record is given */
+#define VIEW_RECORD_SORT_KEY_MAX 4096
 
     enum view_record_type {
         INITIAL_BUILD_VIEW_RECORD,
@@ -51,6 +56,13 @@ extern "C" {
         enum view_record_type type;
         int (*key_cmp_fun)(const sized_buf *key1, const sized_buf *key2,
                            const void *user_ctx);
+        /* given to key_cmp_fun */
+        const void *key_cmp_ctx;
+        /* if not NULL, records read get a sort key made of their keys
+           with it (given key_cmp_ctx), compared instead of key_cmp_fun;
+           see view_key_sort_key */
+        int (*sort_key_fun)(const sized_buf *key, char *out, size_t size,
+                            const void *user_ctx);
         const void *user_ctx;
     } view_file_merge_ctx_t;
 
@@ -58,6 +70,13 @@ extern "C" {
     int view_key_cmp(const sized_buf *key1, const sized_buf *key2,
                      const void *user_ctx);
 
+    /* writes bytes to out which compare with memcmp as view_key_cmp
+       compares the key, returning their length; -1 if there are more
+       than size or the key's JSON can't be given a sort key (see
+       CollateJSONSortKey) */
+    int view_key_sort_key(const sized_buf *key, char *out, size_t size,
+                          const void *user_ctx);
+
     /* compare keys of the id btree of an index */
     int view_id_cmp(const sized_buf *key1, const sized_buf *key2,
                     const void *user_ctx);
@@ -66,6 +85,10 @@ extern "C" {
        prototype defined in src/file_merger.h */
     int read_view_record(FILE *in, void **buf, void *ctx);
 
+    /* read view index record from a file into slab, obbeys the slab read
+       record function prototype defined in src/file_merger.h */
+    int read_view_record_slab(FILE *in, void **buf, arena *slab, void *ctx);
+
     /* write view index record from a file, obbeys the write record function
        prototype defined in src/file_merger.h */
     file_merger_error_t write_view_record(FILE *out, void *buf, void *ctx);
@@ -74,6 +97,10 @@ extern "C" {
        prototype defined in src/file_merger.h */
     int compare_view_records(const void *r1, const void *r2, void *ctx);
 
+    /* gives a view record's sort key, if it has one, obbeys the record
+       sort key function prototype defined in src/file_merger.h */
+    int view_record_sort_key(const void *record, sized_buf *key, void *ctx);
+
     /* frees a view record, obbeys the record free function prototype
        defined in src/file_merger.h */
     void free_view_record(void *record, void *ctx);
@@ -6,8 +6,8 @@
 #include <stdio.h>
 #include <string.h>
 
-#define dec_uint16(b) (decode_raw16(*((raw_16 *) b)))
-#define dec_raw24(b) (decode_raw24(*((raw_24 *) b)))
+#define dec_uint16(b) (decode_raw16(*((raw_16 *) (b))))
+#define dec_raw24(b) (decode_raw24(*((raw_24 *) (b))))
 
 static void enc_uint16(uint16_t u, char **buf);
 static void enc_raw24(uint32_t u, char **buf);
@@ -23,7 +23,7 @@ couchstore_error_t decode_view_btree_value(const char *bytes,
     const char    *bs;
     size_t length;
 
-    v = (view_btree_value_t *) malloc(sizeof(view_btree_value_t));
+    v = (view_btree_value_t *) cs_malloc(sizeof(view_btree_value_t));
     if (v == NULL) {
         goto alloc_error;
     }
@@ -57,7 +57,7 @@ couchstore_error_t decode_view_btree_value(const char *bytes,
         return COUCHSTORE_ERROR_CORRUPT;
     }
 
-    v->values = (sized_buf *) malloc(v->num_values * sizeof(sized_buf));
+    v->values = (sized_buf *) cs_malloc(v->num_values * sizeof(sized_buf));
 
     if (v->values == NULL) {
         goto alloc_error;
@@ -76,7 +76,7 @@ couchstore_error_t decode_view_btree_value(const char *bytes,
         len -= 3;
 
         v->values[i].size = sz;
-        v->values[i].buf = (char *) malloc(sz);
+        v->values[i].buf = (char *) cs_malloc(sz);
 
         if (v->values[i].buf == NULL) {
             goto alloc_error;
@@ -98,6 +98,104 @@ couchstore_error_t decode_view_btree_value(const char *bytes,
 }
 
 
+couchstore_error_t decode_view_btree_value_in_arena(const char *bytes,
+                                                    size_t len,
+                                                    arena *a,
+                                                    view_btree_value_t **value)
+{
+    view_btree_value_t *v;
+    uint16_t i;
+    uint32_t sz;
+    const char *bs;
+
+    assert(len >= 2);
+    v = (view_btree_value_t *) arena_alloc(a, sizeof(view_btree_value_t));
+    if (v == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    v->partition = dec_uint16(bytes);
+    bytes += 2;
+    len -= 2;
+
+    bs = bytes;
+
+    v->num_values = 0;
+    while (len > 0) {
+        assert(len >= 3);
+        sz = dec_raw24(bs);
+        bs += 3;
+        len -= 3;
+
+        assert(len >= sz);
+        bs += sz;
+        len -= sz;
+        v->num_values++;
+    }
+
+    v->values = (sized_buf *) arena_alloc(a, v->num_values * sizeof(sized_buf));
+    if (v->values == NULL && v->num_values > 0) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+
+    for (i = 0; i < v->num_values; ++i) {
+        sz = dec_raw24(bytes);
+        bytes += 3;
+        v->values[i].size = sz;
+        v->values[i].buf = (char *) bytes;
+        bytes += sz;
+    }
+
+    *value = v;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+couchstore_error_t view_btree_value_view(const char *bytes,
+                                         size_t len,
+                                         view_btree_value_view_t *value)
+{
+    const char *end = bytes + len;
+    const char *bs;
+    uint32_t sz;
+
+    if (len < 2) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    value->partition = dec_uint16(bytes);
+    value->num_values = 0;
+    value->pos = bytes + 2;
+    value->end = end;
+
+    for (bs = value->pos; bs != end; bs += sz) {
+        if (end - bs < 3) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        sz = dec_raw24(bs);
+        bs += 3;
+        if ((size_t) (end - bs) < sz) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        value->num_values++;
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+int view_btree_value_next(view_btree_value_view_t *value, sized_buf *json)
+{
+    if (value->pos == value->end) {
+        return 0;
+    }
+    json->size = dec_raw24(value->pos);
+    json->buf = (char *) value->pos + 3;
+    value->pos = json->buf + json->size;
+
+    return 1;
+}
+
+
 couchstore_error_t encode_view_btree_value(const view_btree_value_t *value,
                                            char **buffer,
                                            size_t *buffer_size)
@@ -113,7 +211,7 @@ couchstore_error_t encode_view_btree_value(const view_btree_value_t *value,
         sz += value->values[i].size;
     }
 
-    b = buf = (char *) malloc(sz);
+    b = buf = (char *) cs_malloc(sz);
     if (buf == NULL) {
         goto alloc_error;
     }
@@ -133,7 +231,7 @@ couchstore_error_t encode_view_btree_value(const view_btree_value_t *value,
     return COUCHSTORE_SUCCESS;
 
  alloc_error:
-    free(buf);
+    cs_free(buf);
     *buffer = NULL;
     *buffer_size = 0;
     return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -149,12 +247,12 @@ void free_view_btree_value(view_btree_value_t *value)
 
     if (value->values != NULL){
         for (i = 0; i < value->num_values; ++i) {
-            free(value->values[i].buf);
+            cs_free(value->values[i].buf);
         }
-        free(value->values);
+        cs_free(value->values);
     }
 
-    free(value);
+    cs_free(value);
 }
 
 
@@ -167,7 +265,7 @@ couchstore_error_t decode_view_id_btree_value(const char *bytes,
     const char *bs;
     size_t sz, length;
 
-    v = (view_id_btree_value_t *) malloc(sizeof(view_id_btree_value_t));
+    v = (view_id_btree_value_t *) cs_malloc(sizeof(view_id_btree_value_t));
     if (v == NULL) {
         goto alloc_error;
     }
@@ -214,7 +312,7 @@ couchstore_error_t decode_view_id_btree_value(const char *bytes,
         return COUCHSTORE_ERROR_CORRUPT;
     }
 
-    v->view_keys_map = (view_keys_mapping_t *) malloc(v->num_view_keys_map *
+    v->view_keys_map = (view_keys_mapping_t *) cs_malloc(v->num_view_keys_map *
                                                      sizeof(view_keys_mapping_t));
 
     if (v->view_keys_map == NULL) {
@@ -238,7 +336,7 @@ couchstore_error_t decode_view_id_btree_value(const char *bytes,
         bytes += 2;
         len -= 2;
 
-        v->view_keys_map[i].json_keys = (sized_buf *) malloc (num_keys * sizeof(sized_buf));
+        v->view_keys_map[i].json_keys = (sized_buf *) cs_malloc(num_keys * sizeof(sized_buf));
         if (v->view_keys_map[i].json_keys == NULL) {
             goto alloc_error;
         }
@@ -254,7 +352,7 @@ couchstore_error_t decode_view_id_btree_value(const char *bytes,
             len -= 2;
 
             v->view_keys_map[i].json_keys[j].size = sz;
-            v->view_keys_map[i].json_keys[j].buf = (char *) malloc(sz);
+            v->view_keys_map[i].json_keys[j].buf = (char *) cs_malloc(sz);
 
             if (v->view_keys_map[i].json_keys[j].buf == NULL) {
                 goto alloc_error;
@@ -278,6 +376,84 @@ couchstore_error_t decode_view_id_btree_value(const char *bytes,
 }
 
 
+couchstore_error_t view_id_btree_value_view(const char *bytes,
+                                            size_t len,
+                                            view_id_btree_value_view_t *value)
+{
+    const char *end = bytes + len;
+    const char *bs;
+    uint16_t j, num_keys, sz;
+
+    if (len < 2) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+    value->partition = dec_uint16(bytes);
+    value->num_view_keys_map = 0;
+    value->pos = bytes + 2;
+    value->end = end;
+
+    for (bs = value->pos; bs != end; value->num_view_keys_map++) {
+        if (end - bs < 3) {
+            return COUCHSTORE_ERROR_CORRUPT;
+        }
+        num_keys = dec_uint16(bs + 1);
+        bs += 3;
+
+        for (j = 0; j < num_keys; ++j) {
+            if (end - bs < 2) {
+                return COUCHSTORE_ERROR_CORRUPT;
+            }
+            sz = dec_uint16(bs);
+            bs += 2;
+            if (end - bs < sz) {
+                return COUCHSTORE_ERROR_CORRUPT;
+            }
+            bs += sz;
+        }
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+int view_id_btree_value_next(view_id_btree_value_view_t *value,
+                             view_keys_mapping_view_t *mapping)
+{
+    const char *bs = value->pos;
+    uint16_t j;
+
+    if (bs == value->end) {
+        return 0;
+    }
+    mapping->view_id = (uint8_t) bs[0];
+    mapping->num_keys = dec_uint16(bs + 1);
+    mapping->keys_left = mapping->num_keys;
+    bs += 3;
+    mapping->pos = bs;
+
+    for (j = 0; j < mapping->num_keys; ++j) {
+        bs += 2 + dec_uint16(bs);
+    }
+    value->pos = bs;
+
+    return 1;
+}
+
+
+int view_keys_mapping_next(view_keys_mapping_view_t *mapping, sized_buf *key)
+{
+    if (mapping->keys_left == 0) {
+        return 0;
+    }
+    key->size = dec_uint16(mapping->pos);
+    key->buf = (char *) mapping->pos + 2;
+    mapping->pos = key->buf + key->size;
+    mapping->keys_left--;
+
+    return 1;
+}
+
+
 couchstore_error_t encode_view_id_btree_value(const view_id_btree_value_t *value,
                                               char **buffer,
                                               size_t *buffer_size)
@@ -299,7 +475,7 @@ couchstore_error_t encode_view_id_btree_value(const view_id_btree_value_t *value
         }
     }
 
-    b = buf = (char *) malloc(sz);
+    b = buf = (char *) cs_malloc(sz);
     if (buf == NULL) {
         goto alloc_error;
     }
@@ -330,7 +506,7 @@ couchstore_error_t encode_view_id_btree_value(const view_id_btree_value_t *value
     return COUCHSTORE_SUCCESS;
 
  alloc_error:
-    free(buf);
+    cs_free(buf);
     *buffer = NULL;
     *buffer_size = 0;
     return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -350,17 +526,17 @@ void free_view_id_btree_value(view_id_btree_value_t *value)
         for (i = 0; i < value->num_view_keys_map; ++i) {
             if (value->view_keys_map[i].json_keys != NULL) {
                 for (j = 0; j <value->view_keys_map[i].num_keys; ++j) {
-                    free (value->view_keys_map[i].json_keys[j].buf);
+                    cs_free(value->view_keys_map[i].json_keys[j].buf);
                 }
 
-                free(value->view_keys_map[i].json_keys);
+                cs_free(value->view_keys_map[i].json_keys);
             }
         }
 
-        free(value->view_keys_map);
+        cs_free(value->view_keys_map);
     }
 
-    free(value);
+    cs_free(value);
 }
 
 static void enc_uint16(uint16_t u, char **buf)
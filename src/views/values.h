@@ -7,6 +7,7 @@
 #include <libcouchstore/visibility.h>
 #include <libcouchstore/couch_db.h>
 #include <libcouchstore/couch_common.h>
+#include "../arena.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,6 +43,34 @@ couchstore_error_t encode_view_btree_value(const view_btree_value_t *value,
 
 void free_view_btree_value(view_btree_value_t *value);
 
+/* Decodes a value allocated from arena a, its values pointing into bytes
+   rather than copied: it's freed with the arena, and only lives as long
+   as bytes do. */
+couchstore_error_t decode_view_btree_value_in_arena(const char *bytes,
+                                                    size_t len,
+                                                    arena *a,
+                                                    view_btree_value_t **value);
+
+/* A value parsed where it lies, for loops that look at each record once:
+   nothing is allocated or copied, and it only lives as long as bytes do.
+   Its values are read in turn with view_btree_value_next. */
+typedef struct {
+    uint16_t        partition;
+    uint16_t        num_values;
+    const char      *pos;           /* the next value */
+    const char      *end;
+} view_btree_value_view_t;
+
+/* Checks bytes hold a whole value, and parses it into the caller's view.
+   Returns COUCHSTORE_ERROR_CORRUPT if they don't. */
+couchstore_error_t view_btree_value_view(const char *bytes,
+                                         size_t len,
+                                         view_btree_value_view_t *value);
+
+/* Points json at the view's next value, or returns 0 if there are none
+   left. */
+int view_btree_value_next(view_btree_value_view_t *value, sized_buf *json);
+
 couchstore_error_t decode_view_id_btree_value(const char *bytes,
                                               size_t len,
                                               view_id_btree_value_t **value);
@@ -52,6 +81,32 @@ couchstore_error_t encode_view_id_btree_value(const view_id_btree_value_t *value
 
 void free_view_id_btree_value(view_id_btree_value_t *value);
 
+/* The id btree's counterparts of view_btree_value_view_t: a value's
+   mappings are read in turn with view_id_btree_value_next, and each
+   mapping's keys with view_keys_mapping_next. */
+typedef struct {
+    uint8_t     view_id;
+    uint16_t    num_keys;
+    uint16_t    keys_left;
+    const char  *pos;               /* the next key */
+} view_keys_mapping_view_t;
+
+typedef struct {
+    uint16_t    partition;
+    uint16_t    num_view_keys_map;
+    const char  *pos;               /* the next mapping */
+    const char  *end;
+} view_id_btree_value_view_t;
+
+couchstore_error_t view_id_btree_value_view(const char *bytes,
+                                            size_t len,
+                                            view_id_btree_value_view_t *value);
+
+int view_id_btree_value_next(view_id_btree_value_view_t *value,
+                             view_keys_mapping_view_t *mapping);
+
+int view_keys_mapping_next(view_keys_mapping_view_t *mapping, sized_buf *key);
+
 #ifdef __cplusplus
 }
 #endif
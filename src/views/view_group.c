@@ -21,6 +21,9 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
 #include "view_group.h"
 #include "reducers.h"
 #include "reductions.h"
@@ -28,15 +31,86 @@
 #include "purgers.h"
 #include "util.h"
 #include "file_sorter.h"
+#include "spatial.h"
 #include "../arena.h"
 #include "../couch_btree.h"
 #include "../internal.h"
+#include "../node_cache.h"
+#include "../probes.h"
 #include "../util.h"
 
 #define VIEW_KV_CHUNK_THRESHOLD (7 * 1024)
 #define VIEW_KP_CHUNK_THRESHOLD (6 * 1024)
 #define MAX_HEADER_SIZE         (64 * 1024)
-#define MAX_ACTIONS_SIZE        (2 * 1024 * 1024)
+/* Stands for the number of reducers of a spatial view's btree */
+#define SPATIAL_BTREE_LINE      "spatial"
+/* The same, for one whose keys are in Hilbert order */
+#define SPATIAL_HILBERT_BTREE_LINE "spatial hilbert"
+/* What an update's batch starts with room for; it grows as far as the
+   batch size in bytes takes it, whatever the size of the records */
+#define INITIAL_ACTIONS_SIZE    (256 * 1024)
+/* What each record in a batch costs besides its key and value */
+#define ACTION_OVERHEAD         (sizeof(couchfile_modify_action) + 2 * sizeof(sized_buf))
+/* Most btrees a build or update works on at once; each sorts its records
+   with a memory budget and threads of its own. */
+#define VIEW_MAX_BTREE_THREADS  4
+
+/* A btree to build or update, on whichever thread takes it */
+typedef struct {
+    const char              *source_file;
+    const view_btree_info_t *info;          /* NULL for the id btree */
+    const node_pointer      *old_root;      /* of an update */
+    node_pointer            *root;
+    view_purger_ctx_t       purge_ctx;      /* of an update */
+    uint64_t                arena_peak;
+    uint64_t                inserted;
+    uint64_t                removed;
+    view_btree_stats_t      stats;
+    view_error_t            error_info;
+    couchstore_error_t      ret;
+} view_btree_job_t;
+
+typedef struct view_btree_jobs_t view_btree_jobs_t;
+
+/* Whether a group's view btree reductions are written with compact
+   partition bitmaps, which only readers of its header version know */
+#define COMPACT_BITMAPS(header) \
+    ((header)->version >= INDEX_HEADER_COMPACT_BITMAPS_VERSION)
+
+/* Stands in for a btree's reduce functions, counting and timing the
+   nodes they're called for: one call per node written */
+typedef struct {
+    reduce_fn               reduce;
+    reduce_fn               rereduce;
+    reduce_delta_fn         reduce_delta;
+    void                    *ctx;
+    view_btree_stats_t      *stats;
+} view_counted_reduce_ctx_t;
+
+struct view_btree_jobs_t {
+    cb_mutex_t              mutex;          /* of the jobs */
+    cb_mutex_t              io_mutex;       /* of the file */
+    view_btree_job_t        *jobs;
+    int                     num_jobs;
+    int                     next;           /* the next job to take */
+    int                     failed;
+    void                    (*run)(view_btree_jobs_t *ctx, view_btree_job_t *job);
+    tree_file               *file;
+    const char              *tmpdir;
+    int                     compact_bitmaps;    /* see COMPACT_BITMAPS */
+    /* Of an update */
+    size_t                  batch_size;
+    int                     is_sorted;
+    FILE                    *stream;        /* of all the jobs' records */
+    size_t                  arena_limit;    /* of each job */
+    int                     incremental_rereduce;
+    /* Of a compaction */
+    tree_file               *source;
+    cb_mutex_t              source_mutex;   /* of the source */
+    const bitmap_t          *filterbm;
+    compactor_stats_t       *stats;
+    cb_mutex_t              stats_mutex;
+};
 
 static couchstore_error_t open_view_group_file(const char *path,
                                                couchstore_open_flags open_flags,
@@ -49,58 +123,142 @@ static couchstore_error_t build_btree(const char *source_file,
                                       reduce_fn rereduce_fun,
                                       const char *tmpdir,
                                       sort_record_fn sort_fun,
+                                      const view_btree_info_t *spatial_info,
                                       void *reduce_ctx,
+                                      view_btree_stats_t *stats,
                                       node_pointer **out_root);
 
 static couchstore_error_t build_id_btree(const char *source_file,
                                          tree_file *dest_file,
                                          const char *tmpdir,
+                                         view_btree_stats_t *stats,
                                          node_pointer **out_root);
 
 static couchstore_error_t build_view_btree(const char *source_file,
                                            const view_btree_info_t *info,
+                                           int compact_bitmaps,
                                            tree_file *dest_file,
                                            const char *tmpdir,
+                                           view_btree_stats_t *stats,
                                            node_pointer **out_root,
                                            view_error_t *error_info);
 
+static void run_build_job(view_btree_jobs_t *ctx, view_btree_job_t *job);
+
+static void run_update_job(view_btree_jobs_t *ctx, view_btree_job_t *job);
+
+static void run_compact_job(view_btree_jobs_t *ctx, view_btree_job_t *job);
+
+static int btree_job_threads(int num_jobs, int max_threads);
+
+static couchstore_error_t run_btree_jobs(view_btree_jobs_t *ctx,
+                                         int max_threads);
+
+static void report_btree_jobs_error(view_btree_job_t *jobs,
+                                    int num_jobs,
+                                    view_error_t *error_info);
+
 static void close_view_group_file(view_group_info_t *info);
 
-static int read_record(FILE *f, arena *a, sized_buf *k, sized_buf *v,
-                                                        uint8_t *op);
+static couchstore_error_t counted_reduce(char *dst,
+                                         size_t *size_r,
+                                         const nodelist *leaflist,
+                                         int count,
+                                         void *ctx);
+
+static couchstore_error_t counted_rereduce(char *dst,
+                                           size_t *size_r,
+                                           const nodelist *itmlist,
+                                           int count,
+                                           void *ctx);
+
+static int counted_reduce_delta(char *dst,
+                                size_t *size_r,
+                                const nodelist *itmlist,
+                                int count,
+                                const reduce_delta *delta,
+                                void *ctx);
+
+static void add_btree_stats(view_btree_stats_t *dst,
+                            const view_btree_stats_t *src);
+
+/* A record's length and op, which are read ahead of its key and value */
+typedef struct {
+    uint32_t len;
+    uint8_t  op;
+    uint16_t klen;
+} view_record_header_t;
+
+static int read_record_header(FILE *f, int in_stream, view_record_header_t *h);
+
+static int read_record_body(FILE *f, arena *a, const view_record_header_t *h,
+                            sized_buf *k, sized_buf *v);
+
+static couchstore_error_t update_view_group(view_group_info_t *info,
+                                            const char *id_records_file,
+                                            const char *kv_records_files[],
+                                            FILE *stream,
+                                            size_t batch_size,
+                                            const sized_buf *header_buf,
+                                            int is_sorted,
+                                            const char *tmp_dir,
+                                            view_group_update_stats_t *stats,
+                                            sized_buf *header_outbuf,
+                                            view_error_t *error_info);
+
+static couchstore_error_t grow_actions(couchfile_modify_action **actions,
+                                       sized_buf **keybufs,
+                                       sized_buf **valbufs,
+                                       int *capacity,
+                                       int num_actions);
 
 static couchstore_error_t update_btree(const char *source_file,
+                                       FILE *stream,
                                        tree_file *dest_file,
                                        const node_pointer *root,
                                        size_t batch_size,
                                        compare_info *cmp,
                                        reduce_fn reduce_fun,
                                        reduce_fn rereduce_fun,
+                                       reduce_delta_fn reduce_delta_fun,
                                        purge_kv_fn purge_kv,
                                        purge_kp_fn purge_kp,
                                        view_reducer_ctx_t *red_ctx,
                                        view_purger_ctx_t *purge_ctx,
+                                       size_t arena_limit,
+                                       uint64_t *arena_peak,
                                        uint64_t *inserted,
                                        uint64_t *removed,
+                                       view_btree_stats_t *stats,
                                        node_pointer **out_root);
 
 static couchstore_error_t update_id_btree(const char *source_file,
+                                         FILE *stream,
                                          tree_file *dest_file,
                                          const node_pointer *root,
                                          size_t batch_size,
                                          view_purger_ctx_t *purge_ctx,
+                                         size_t arena_limit,
+                                         uint64_t *arena_peak,
                                          uint64_t *inserted,
                                          uint64_t *removed,
+                                         view_btree_stats_t *stats,
                                          node_pointer **out_root);
 
 static couchstore_error_t update_view_btree(const char *source_file,
+                                            FILE *stream,
                                             const view_btree_info_t *info,
+                                            int compact_bitmaps,
                                             tree_file *dest_file,
                                             const node_pointer *root,
                                             size_t batch_size,
+                                            int incremental_rereduce,
                                             view_purger_ctx_t *purge_ctx,
+                                            size_t arena_limit,
+                                            uint64_t *arena_peak,
                                             uint64_t *inserted,
                                             uint64_t *removed,
+                                            view_btree_stats_t *stats,
                                             node_pointer **out_root,
                                             view_error_t *error_info);
 
@@ -115,9 +273,11 @@ static couchstore_error_t compact_btree(tree_file *source,
                                  reduce_fn reduce_fun,
                                  reduce_fn rereduce_fun,
                                  compact_filter_fn filter_fun,
+                                 compact_filter_kp_fn filter_kp_fun,
                                  view_reducer_ctx_t *red_ctx,
                                  const bitmap_t *filterbm,
                                  compactor_stats_t *stats,
+                                 cb_mutex_t *stats_mutex,
                                  node_pointer **out_root);
 
 static couchstore_error_t compact_id_btree(tree_file *source,
@@ -125,17 +285,83 @@ static couchstore_error_t compact_id_btree(tree_file *source,
                                     const node_pointer *root,
                                     const bitmap_t *filterbm,
                                     compactor_stats_t *stats,
+                                    cb_mutex_t *stats_mutex,
                                     node_pointer **out_root);
 
 static couchstore_error_t compact_view_btree(tree_file *source,
                                       tree_file *target,
                                       const view_btree_info_t *info,
+                                      int compact_bitmaps,
                                       const node_pointer *root,
                                       const bitmap_t *filterbm,
                                       compactor_stats_t *stats,
+                                      cb_mutex_t *stats_mutex,
                                       node_pointer **out_root,
                                       view_error_t *error_info);
 
+/*
+ * Reads the rest of a spatial view's btree definition: the enclosing MBB
+ * and the view's name, kept as its only "reducer" so that it's freed, and
+ * reported in errors, like a mapreduce view's.
+ */
+static int read_spatial_btree_info(FILE *in_stream,
+                                   FILE *error_stream,
+                                   int i,
+                                   view_btree_info_t *bti)
+{
+    char buf[4096];
+    char *end;
+    uint64_t num;
+    uint16_t j;
+    couchstore_error_t ret;
+
+    num = couchstore_read_int(in_stream, buf, sizeof(buf), &ret);
+    if (ret != COUCHSTORE_SUCCESS || num == 0 || num % 2 != 0 ||
+        num > UINT16_MAX) {
+        fprintf(error_stream,
+                "Error reading btree %d enclosing MBB size\n", i);
+        return -1;
+    }
+
+    bti->mbb = (double *) cs_malloc(num * sizeof(double));
+    bti->names = (const char **) cs_calloc(1, sizeof(char *));
+    bti->reducers = (const char **) cs_calloc(1, sizeof(char *));
+    if (bti->mbb == NULL || bti->names == NULL || bti->reducers == NULL) {
+        fprintf(error_stream, "Memory allocation failure\n");
+        return -1;
+    }
+    bti->num_reducers = 1;
+    bti->mbb_num = (uint16_t) num;
+
+    for (j = 0; j < bti->mbb_num; ++j) {
+        if (couchstore_read_line(in_stream, buf, sizeof(buf)) != buf) {
+            fprintf(error_stream,
+                    "Error reading btree %d enclosing MBB\n", i);
+            return -1;
+        }
+        bti->mbb[j] = strtod(buf, &end);
+        if (end == buf) {
+            fprintf(error_stream,
+                    "Error reading btree %d enclosing MBB\n", i);
+            return -1;
+        }
+    }
+
+    if (couchstore_read_line(in_stream, buf, sizeof(buf)) != buf) {
+        fprintf(error_stream, "Error reading btree %d view name\n", i);
+        return -1;
+    }
+    bti->names[0] = (const char *) cs_strdup(buf);
+    bti->reducers[0] = (const char *) cs_strdup("");
+    if (bti->names[0] == NULL || bti->reducers[0] == NULL) {
+        fprintf(error_stream, "Memory allocation failure\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
 LIBCOUCHSTORE_API
 view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
                                                    FILE *error_stream)
@@ -147,7 +373,7 @@ view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
     int reduce_len;
     couchstore_error_t ret;
 
-    info = (view_group_info_t *) calloc(1, sizeof(*info));
+    info = (view_group_info_t *) cs_calloc(1, sizeof(*info));
     if (info == NULL) {
         fprintf(error_stream, "Memory allocation failure\n");
         goto out_error;
@@ -157,7 +383,7 @@ view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
         fprintf(stderr, "Error reading source index file path\n");
         goto out_error;
     }
-    dup = strdup(buf);
+    dup = cs_strdup(buf);
     if (dup == NULL) {
         fprintf(error_stream, "Memory allocation failure\n");
         goto out_error;
@@ -181,7 +407,7 @@ view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
     }
 
     info->btree_infos = (view_btree_info_t *)
-        calloc(info->num_btrees, sizeof(view_btree_info_t));
+        cs_calloc(info->num_btrees, sizeof(view_btree_info_t));
     if (info->btree_infos == NULL) {
         fprintf(error_stream, "Memory allocation failure\n");
         info->num_btrees = 0;
@@ -191,29 +417,39 @@ view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
     for (i = 0; i < info->num_btrees; ++i) {
         view_btree_info_t *bti = &info->btree_infos[i];
 
-        bti->num_reducers = couchstore_read_int(in_stream,
-                                                buf,
-                                                sizeof(buf),
-                                                &ret);
+        if (couchstore_read_line(in_stream, buf, sizeof(buf)) != buf) {
+            fprintf(error_stream,
+                    "Error reading number of reducers for btree %d\n", i);
+            goto out_error;
+        }
+        if (strcmp(buf, SPATIAL_BTREE_LINE) == 0 ||
+            strcmp(buf, SPATIAL_HILBERT_BTREE_LINE) == 0) {
+            bti->order = strcmp(buf, SPATIAL_HILBERT_BTREE_LINE) == 0 ?
+                SPATIAL_ORDER_HILBERT : SPATIAL_ORDER_ZCODE;
+            if (read_spatial_btree_info(in_stream, error_stream, i, bti) < 0) {
+                goto out_error;
+            }
+            continue;
+        }
 
-        if (ret != COUCHSTORE_SUCCESS) {
+        if (sscanf(buf, "%d", &bti->num_reducers) != 1) {
             fprintf(error_stream,
                     "Error reading number of reducers for btree %d\n", i);
             goto out_error;
         }
 
-        bti->names = (const char **) calloc(bti->num_reducers, sizeof(char *));
+        bti->names = (const char **) cs_calloc(bti->num_reducers, sizeof(char *));
         if (bti->names == NULL) {
             fprintf(error_stream, "Memory allocation failure\n");
             bti->num_reducers = 0;
             goto out_error;
         }
 
-        bti->reducers = (const char **) calloc(bti->num_reducers, sizeof(char *));
+        bti->reducers = (const char **) cs_calloc(bti->num_reducers, sizeof(char *));
         if (bti->reducers == NULL) {
             fprintf(error_stream, "Memory allocation failure\n");
             bti->num_reducers = 0;
-            free(bti->names);
+            cs_free(bti->names);
             goto out_error;
         }
 
@@ -223,7 +459,7 @@ view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
                         "Error reading btree %d view %d name\n", i, j);
                 goto out_error;
             }
-            dup = strdup(buf);
+            dup = cs_strdup(buf);
             if (dup == NULL) {
                 fprintf(error_stream, "Memory allocation failure\n");
                 goto out_error;
@@ -241,7 +477,7 @@ view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
                 goto out_error;
             }
 
-            dup = (char *) malloc(reduce_len + 1);
+            dup = (char *) cs_malloc(reduce_len + 1);
             if (dup == NULL) {
                 fprintf(error_stream, "Memory allocation failure\n");
                 goto out_error;
@@ -250,7 +486,7 @@ view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
             if (fread(dup, reduce_len, 1, in_stream) != 1) {
                 fprintf(error_stream,
                         "Error reading btree %d view %d reducer\n", i, j);
-                free(dup);
+                cs_free(dup);
                 goto out_error;
             }
             dup[reduce_len] = '\0';
@@ -281,15 +517,16 @@ void couchstore_free_view_group_info(view_group_info_t *info)
         view_btree_info_t vi = info->btree_infos[i];
 
         for (j = 0; j < vi.num_reducers; ++j) {
-            free((void *) vi.names[j]);
-            free((void *) vi.reducers[j]);
+            cs_free((void *) vi.names[j]);
+            cs_free((void *) vi.reducers[j]);
         }
-        free(vi.names);
-        free(vi.reducers);
+        cs_free(vi.names);
+        cs_free(vi.reducers);
+        cs_free(vi.mbb);
     }
-    free(info->btree_infos);
-    free((void *) info->filepath);
-    free(info);
+    cs_free(info->btree_infos);
+    cs_free((void *) info->filepath);
+    cs_free(info);
 }
 
 
@@ -301,7 +538,7 @@ static void close_view_group_file(view_group_info_t *info)
         info->file.ops = NULL;
         info->file.handle = NULL;
     }
-    free((void *) info->file.path);
+    cs_free((void *) info->file.path);
     info->file.path = NULL;
 }
 
@@ -343,12 +580,34 @@ couchstore_error_t couchstore_build_view_group(view_group_info_t *info,
                                                const char *tmpdir,
                                                uint64_t *header_pos,
                                                view_error_t *error_info)
+{
+    return couchstore_build_view_group_with_stats(info,
+                                                  id_records_file,
+                                                  kv_records_files,
+                                                  dst_file,
+                                                  tmpdir,
+                                                  header_pos,
+                                                  NULL,
+                                                  error_info);
+}
+
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_build_view_group_with_stats(
+                                               view_group_info_t *info,
+                                               const char *id_records_file,
+                                               const char *kv_records_files[],
+                                               const char *dst_file,
+                                               const char *tmpdir,
+                                               uint64_t *header_pos,
+                                               view_btree_stats_t *btree_stats,
+                                               view_error_t *error_info)
 {
     couchstore_error_t ret;
     tree_file index_file;
     index_header_t *header = NULL;
-    node_pointer *id_root = NULL;
-    node_pointer **view_roots = NULL;
+    view_btree_job_t *jobs = NULL;
+    view_btree_jobs_t ctx;
     int i;
 
     error_info->view_name = NULL;
@@ -357,11 +616,17 @@ couchstore_error_t couchstore_build_view_group(view_group_info_t *info,
     index_file.ops = NULL;
     index_file.path = NULL;
 
-    view_roots = (node_pointer **) calloc(
-        info->num_btrees, sizeof(node_pointer *));
-    if (view_roots == NULL) {
+    /* The id btree is job 0, view i's is job i + 1 */
+    jobs = (view_btree_job_t *) cs_calloc(info->num_btrees + 1,
+                                       sizeof(view_btree_job_t));
+    if (jobs == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
+    jobs[0].source_file = id_records_file;
+    for (i = 0; i < info->num_btrees; ++i) {
+        jobs[i + 1].source_file = kv_records_files[i];
+        jobs[i + 1].info = &info->btree_infos[i];
+    }
 
     ret = open_view_group_file(info->filepath,
                                COUCHSTORE_OPEN_FLAG_RDONLY,
@@ -383,29 +648,32 @@ couchstore_error_t couchstore_build_view_group(view_group_info_t *info,
         goto out;
     }
 
-    ret = build_id_btree(id_records_file, &index_file, tmpdir, &id_root);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.jobs = jobs;
+    ctx.num_jobs = info->num_btrees + 1;
+    ctx.run = run_build_job;
+    ctx.file = &index_file;
+    ctx.tmpdir = tmpdir;
+    ctx.compact_bitmaps = COMPACT_BITMAPS(header);
+    ret = run_btree_jobs(&ctx, info->btree_threads);
+    if (btree_stats != NULL) {
+        for (i = 0; i <= info->num_btrees; ++i) {
+            add_btree_stats(&btree_stats[i], &jobs[i].stats);
+        }
+    }
     if (ret != COUCHSTORE_SUCCESS) {
+        report_btree_jobs_error(jobs, info->num_btrees + 1, error_info);
         goto out;
     }
 
-    free(header->id_btree_state);
-    header->id_btree_state = id_root;
-    id_root = NULL;
+    cs_free(header->id_btree_state);
+    header->id_btree_state = jobs[0].root;
+    jobs[0].root = NULL;
 
     for (i = 0; i < info->num_btrees; ++i) {
-        ret = build_view_btree(kv_records_files[i],
-                               &info->btree_infos[i],
-                               &index_file,
-                               tmpdir,
-                               &view_roots[i],
-                               error_info);
-        if (ret != COUCHSTORE_SUCCESS) {
-            goto out;
-        }
-
-        free(header->view_btree_states[i]);
-        header->view_btree_states[i] = view_roots[i];
-        view_roots[i] = NULL;
+        cs_free(header->view_btree_states[i]);
+        header->view_btree_states[i] = jobs[i + 1].root;
+        jobs[i + 1].root = NULL;
     }
 
     ret = write_view_group_header(&index_file, header_pos, header);
@@ -419,80 +687,307 @@ out:
     free_index_header(header);
     close_view_group_file(info);
     tree_file_close(&index_file);
-    free(id_root);
-    if (view_roots != NULL) {
-        for (i = 0; i < info->num_btrees; ++i) {
-            free(view_roots[i]);
-        }
-        free(view_roots);
+    for (i = 0; i <= info->num_btrees; ++i) {
+        cs_free(jobs[i].root);
     }
+    cs_free(jobs);
 
     return ret;
 }
 
 
+static void run_build_job(view_btree_jobs_t *ctx, view_btree_job_t *job)
+{
+    hrtime_t start = gethrtime();
+
+    if (job->info == NULL) {
+        job->ret = build_id_btree(job->source_file, ctx->file,
+                                  ctx->tmpdir, &job->stats, &job->root);
+    } else {
+        job->ret = build_view_btree(job->source_file, job->info,
+                                    ctx->compact_bitmaps,
+                                    ctx->file, ctx->tmpdir, &job->stats,
+                                    &job->root, &job->error_info);
+    }
+    job->stats.modify_ns += gethrtime() - start;
+}
+
+
+static void btree_worker(void *args)
+{
+    view_btree_jobs_t *ctx = (view_btree_jobs_t *) args;
+
+    for (;;) {
+        view_btree_job_t *job = NULL;
+
+        cb_mutex_enter(&ctx->mutex);
+        if (!ctx->failed && ctx->next < ctx->num_jobs) {
+            job = &ctx->jobs[ctx->next++];
+        }
+        cb_mutex_exit(&ctx->mutex);
+        if (job == NULL) {
+            return;
+        }
+
+        ctx->run(ctx, job);
+        if (job->ret != COUCHSTORE_SUCCESS) {
+            cb_mutex_enter(&ctx->mutex);
+            ctx->failed = 1;
+            cb_mutex_exit(&ctx->mutex);
+        }
+    }
+}
+
+
+/* max_threads if it's set, else one thread per core, up to
+   VIEW_MAX_BTREE_THREADS; never more than there are jobs. */
+static int btree_job_threads(int num_jobs, int max_threads)
+{
+    int threads = 1;
+
+    if (max_threads > 0) {
+        threads = max_threads;
+    } else {
+#if !defined(WIN32) && defined(_SC_NPROCESSORS_ONLN)
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cores > 1) {
+            threads = (int) cores;
+        }
+#endif
+    }
+    if (threads > VIEW_MAX_BTREE_THREADS) {
+        threads = VIEW_MAX_BTREE_THREADS;
+    }
+    return threads < num_jobs ? threads : num_jobs;
+}
+
+
 /*
- * Similar to util.c:read_view_record(), but it uses arena allocator, which is
- * required for the existing semantics/api of btree bottom-up build in
- * src/btree_modify.cc.
+ * Runs the jobs on the file, several at once: each works through its
+ * records on a thread of its own, taking turns with the others to read and
+ * append nodes. Jobs not started when one fails are skipped. Returns the
+ * error of the first job that failed.
  */
-static int read_record(FILE *f, arena *a, sized_buf *k, sized_buf *v,
-                                                        uint8_t *op)
+static couchstore_error_t run_btree_jobs(view_btree_jobs_t *ctx,
+                                         int max_threads)
 {
-    uint16_t klen;
-    uint8_t oplen = 0;
-    uint32_t vlen, len;
+    cb_thread_t threads[VIEW_MAX_BTREE_THREADS];
+    int num_threads = btree_job_threads(ctx->num_jobs, max_threads);
+    int started = 0;
+    int i;
 
-    if (fread(&len, sizeof(len), 1, f) != 1) {
-        if (feof(f)) {
-            return 0;
+    cb_mutex_initialize(&ctx->mutex);
+    cb_mutex_initialize(&ctx->io_mutex);
+    ctx->next = 0;
+    ctx->failed = 0;
+
+    if (num_threads > 1) {
+        ctx->file->io_mutex = &ctx->io_mutex;
+        if (ctx->source != NULL) {
+            cb_mutex_initialize(&ctx->source_mutex);
+            ctx->source->io_mutex = &ctx->source_mutex;
+        }
+        /* This thread takes jobs too, and all of them if no other thread
+           could be started. */
+        while (started < num_threads - 1 &&
+               cb_create_thread(&threads[started], btree_worker, ctx, 0) == 0) {
+            started++;
+        }
+    }
+    btree_worker(ctx);
+    for (i = 0; i < started; ++i) {
+        cb_join_thread(threads[i]);
+    }
+    ctx->file->io_mutex = NULL;
+    cb_mutex_destroy(&ctx->io_mutex);
+    if (ctx->source != NULL && ctx->source->io_mutex != NULL) {
+        ctx->source->io_mutex = NULL;
+        cb_mutex_destroy(&ctx->source_mutex);
+    }
+    cb_mutex_destroy(&ctx->mutex);
+
+    for (i = 0; i < ctx->num_jobs; ++i) {
+        if (ctx->jobs[i].ret != COUCHSTORE_SUCCESS) {
+            return ctx->jobs[i].ret;
+        }
+    }
+
+    return COUCHSTORE_SUCCESS;
+}
+
+
+/* Hands on the error of the first job that failed, freeing the others'. */
+static void report_btree_jobs_error(view_btree_job_t *jobs,
+                                    int num_jobs,
+                                    view_error_t *error_info)
+{
+    int reported = 0;
+    int i;
+
+    for (i = 0; i < num_jobs; ++i) {
+        if (jobs[i].ret != COUCHSTORE_SUCCESS && !reported) {
+            *error_info = jobs[i].error_info;
+            reported = 1;
         } else {
-            return COUCHSTORE_ERROR_READ;
+            cs_free((char *) jobs[i].error_info.view_name);
+            cs_free((char *) jobs[i].error_info.error_msg);
         }
     }
+}
+
+
+static void count_node(view_btree_stats_t *stats,
+                       const nodelist *items,
+                       int count,
+                       hrtime_t start)
+{
+    stats->reduce_ns += gethrtime() - start;
+    stats->reduce_calls++;
+    stats->nodes_written++;
+    /* The node's type, then each item with its lengths */
+    stats->node_bytes += 1;
+    for (; items != NULL && count > 0; items = items->next, --count) {
+        stats->node_bytes += sizeof(raw_kv_length) + items->key.size +
+                             items->data.size;
+    }
+}
+
+
+static couchstore_error_t counted_reduce(char *dst,
+                                         size_t *size_r,
+                                         const nodelist *leaflist,
+                                         int count,
+                                         void *ctx)
+{
+    view_counted_reduce_ctx_t *c = (view_counted_reduce_ctx_t *) ctx;
+    hrtime_t start = gethrtime();
+    couchstore_error_t ret = c->reduce(dst, size_r, leaflist, count, c->ctx);
+
+    count_node(c->stats, leaflist, count, start);
+
+    return ret;
+}
+
+
+static couchstore_error_t counted_rereduce(char *dst,
+                                           size_t *size_r,
+                                           const nodelist *itmlist,
+                                           int count,
+                                           void *ctx)
+{
+    view_counted_reduce_ctx_t *c = (view_counted_reduce_ctx_t *) ctx;
+    hrtime_t start = gethrtime();
+    couchstore_error_t ret = c->rereduce(dst, size_r, itmlist, count, c->ctx);
+
+    count_node(c->stats, itmlist, count, start);
+
+    return ret;
+}
+
+
+/* A node left to rereduce is counted there instead */
+static int counted_reduce_delta(char *dst,
+                                size_t *size_r,
+                                const nodelist *itmlist,
+                                int count,
+                                const reduce_delta *delta,
+                                void *ctx)
+{
+    view_counted_reduce_ctx_t *c = (view_counted_reduce_ctx_t *) ctx;
+    hrtime_t start = gethrtime();
+    int ret = c->reduce_delta(dst, size_r, itmlist, count, delta, c->ctx);
+
+    if (ret > 0) {
+        count_node(c->stats, itmlist, count, start);
+    }
+
+    return ret;
+}
+
+
+static void add_btree_stats(view_btree_stats_t *dst,
+                            const view_btree_stats_t *src)
+{
+    dst->sort_ns += src->sort_ns;
+    dst->modify_ns += src->modify_ns;
+    dst->reduce_ns += src->reduce_ns;
+    dst->js_reduce_ns += src->js_reduce_ns;
+    dst->reduce_calls += src->reduce_calls;
+    dst->js_reduce_calls += src->js_reduce_calls;
+    dst->nodes_written += src->nodes_written;
+    dst->node_bytes += src->node_bytes;
+}
+
+
+/*
+ * Reads the length, op and key length of an ops record. Returns 1 when
+ * one's read, 0 at the end of the records and a negative value on error.
+ * A file's records end with it, and a stream's section of them with a
+ * zero length; a stream that ends before that was cut short.
+ */
+static int read_record_header(FILE *f, int in_stream, view_record_header_t *h)
+{
+    char buf[sizeof(h->op) + sizeof(h->klen)];
 
-    /* For incremental update, read optype */
-    if (op != NULL) {
-        if (fread(op, sizeof(uint8_t), 1, f) != 1) {
+    if (fread(&h->len, sizeof(h->len), 1, f) != 1) {
+        if (feof(f) && !in_stream) {
+            return 0;
+        } else {
             return COUCHSTORE_ERROR_READ;
         }
+    }
 
-        oplen = 1;
+    if (h->len == 0 && in_stream) {
+        return 0;
     }
 
-    if (fread(&klen, sizeof(klen), 1, f) != 1) {
+    /* The op and key length in one read; a stream's zero length can't
+       be read past, as the next section follows it. */
+    if (fread(buf, sizeof(buf), 1, f) != 1) {
         return COUCHSTORE_ERROR_READ;
     }
+    h->op = (uint8_t) buf[0];
+    memcpy(&h->klen, buf + sizeof(h->op), sizeof(h->klen));
+
+    h->klen = ntohs(h->klen);
+    if (h->len < sizeof(h->op) + sizeof(h->klen) + h->klen) {
+        return COUCHSTORE_ERROR_CORRUPT;
+    }
+
+    return 1;
+}
+
 
-    klen = ntohs(klen);
-    vlen = len - sizeof(klen) - klen - oplen;
+/*
+ * Similar to util.c:read_view_record(), but it uses arena allocator, which is
+ * required for the existing semantics/api of btree bottom-up build in
+ * src/btree_modify.cc. Both buffers are allocated before anything's read,
+ * so on COUCHSTORE_ERROR_ALLOC_FAIL the record can be read again, from
+ * its header, once the arena's been emptied.
+ */
+static int read_record_body(FILE *f, arena *a, const view_record_header_t *h,
+                            sized_buf *k, sized_buf *v)
+{
+    /* The value follows the key in the record, so both are read in one
+       go into one buffer */
+    size_t size = h->len - sizeof(h->op) - sizeof(h->klen);
+    char *buf = (char *) arena_alloc(a, size);
 
-    k->size = klen;
-    k->buf = (char *) arena_alloc(a, k->size);
-    if (k->buf == NULL) {
+    if (buf == NULL && size > 0) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
     }
 
-    v->size = vlen;
+    k->size = h->klen;
+    k->buf = buf;
+    v->size = size - h->klen;
     /* Handle zero len vals */
-    if (v->size) {
-        v->buf = (char *) arena_alloc(a, v->size);
-        if (v->buf == NULL) {
-            return COUCHSTORE_ERROR_ALLOC_FAIL;
-        }
-    } else {
-        v->buf = NULL;
-    }
-
-    if (fread(k->buf, k->size, 1, f) != 1) {
-        return FILE_MERGER_ERROR_FILE_READ;
-    }
+    v->buf = v->size ? buf + h->klen : NULL;
 
-    if (v->size && fread(v->buf, v->size, 1, f) != 1) {
+    if (size > 0 && fread(buf, size, 1, f) != 1) {
         return FILE_MERGER_ERROR_FILE_READ;
     }
 
-    return len;
+    return 0;
 }
 
 
@@ -508,6 +1003,97 @@ static int view_btree_cmp(const sized_buf *key1, const sized_buf *key2)
 }
 
 
+/*
+ * The order and reducers of a view's btree. A spatial view's is an R-tree:
+ * its keys are MBBs in the Z-order or Hilbert order of their centres, and
+ * its reductions hold the union of the MBBs under them, so that queries
+ * can skip the nodes outside their bounding box. It runs no JavaScript.
+ */
+typedef struct {
+    compare_info        cmp;
+    reduce_fn           reduce;
+    reduce_fn           rereduce;
+    reduce_delta_fn     reduce_delta;   /* NULL: rereduce every node */
+    view_reducer_ctx_t *red_ctx;
+    scale_factor_t     *sf;
+} view_btree_funs_t;
+
+static couchstore_error_t make_view_btree_funs(const view_btree_info_t *info,
+                                               int compact_bitmaps,
+                                               view_btree_funs_t *funs,
+                                               view_error_t *error_info)
+{
+    char *error_msg = NULL;
+
+    memset(funs, 0, sizeof(*funs));
+    if (info->mbb_num > 0) {
+        funs->sf = spatial_scale_factor(info->mbb, info->mbb_num / 2,
+                                        ZCODE_MAX_VALUE);
+        if (funs->sf == NULL) {
+            error_info->error_msg = (const char *) view_error_msg(COUCHSTORE_ERROR_ALLOC_FAIL);
+            error_info->view_name = (const char *) cs_strdup(info->names[0]);
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        funs->sf->order = info->order;
+        funs->cmp.compare = NULL;
+        funs->cmp.compare_arg = spatial_key_cmp;
+        funs->cmp.arg = funs->sf;
+        funs->reduce = spatial_btree_reduce;
+        funs->rereduce = spatial_btree_rereduce;
+        return COUCHSTORE_SUCCESS;
+    }
+
+    funs->cmp.compare = view_btree_cmp;
+    funs->reduce = view_btree_reduce;
+    funs->rereduce = view_btree_rereduce;
+    funs->reduce_delta = view_btree_reduce_delta;
+    funs->red_ctx = make_view_reducer_ctx(info->reducers,
+                                          info->num_reducers,
+                                          &error_msg);
+    if (funs->red_ctx == NULL) {
+        error_info->error_msg = (const char *) error_msg;
+        error_info->view_name = (const char *) cs_strdup(info->names[0]);
+        return COUCHSTORE_ERROR_REDUCER_FAILURE;
+    }
+    funs->red_ctx->compact_bitmaps = compact_bitmaps;
+
+    return COUCHSTORE_SUCCESS;
+}
+
+/* Reports a failure on the view's btree */
+static void view_btree_funs_error(const view_btree_info_t *info,
+                                  const view_btree_funs_t *funs,
+                                  couchstore_error_t ret,
+                                  view_error_t *error_info)
+{
+    char *error_msg = NULL;
+
+    if (funs->red_ctx != NULL && funs->red_ctx->error != NULL) {
+        error_msg = cs_strdup(funs->red_ctx->error);
+    } else {
+        error_msg = view_error_msg(ret);
+    }
+    error_info->error_msg = (const char *) error_msg;
+    error_info->view_name = (const char *) cs_strdup(info->names[0]);
+}
+
+static void free_view_btree_funs(view_btree_funs_t *funs)
+{
+    free_view_reducer_ctx(funs->red_ctx);
+    free_spatial_scale_factor(funs->sf);
+}
+
+/* Counts the JavaScript reductions of the view's btree */
+static void view_btree_funs_stats(const view_btree_funs_t *funs,
+                                  view_btree_stats_t *stats)
+{
+    if (funs->red_ctx != NULL) {
+        stats->js_reduce_ns += funs->red_ctx->js_ns;
+        stats->js_reduce_calls += funs->red_ctx->js_calls;
+    }
+}
+
+
 /*
  * For initial btree build, feed the btree builder as soon as
  * sorted records are available.
@@ -550,27 +1136,34 @@ static couchstore_error_t build_btree(const char *source_file,
                                       reduce_fn rereduce_fun,
                                       const char *tmpdir,
                                       sort_record_fn sort_fun,
+                                      const view_btree_info_t *spatial_info,
                                       void *reduce_ctx,
+                                      view_btree_stats_t *stats,
                                       node_pointer **out_root)
 {
     couchstore_error_t ret = COUCHSTORE_SUCCESS;
-    arena *transient_arena = new_arena(0);
-    arena *persistent_arena = new_arena(0);
+    arena *transient_arena = new_huge_page_arena();
+    arena *persistent_arena = new_huge_page_arena();
     couchfile_modify_result *mr;
     view_btree_builder_ctx_t build_ctx;
+    view_counted_reduce_ctx_t counted;
 
     if (transient_arena == NULL || persistent_arena == NULL) {
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto out;
     }
 
+    counted.reduce = reduce_fun;
+    counted.rereduce = rereduce_fun;
+    counted.ctx = reduce_ctx;
+    counted.stats = stats;
     mr = new_btree_modres(persistent_arena,
                           transient_arena,
                           dest_file,
                           cmp,
-                          reduce_fun,
-                          rereduce_fun,
-                          reduce_ctx,
+                          counted_reduce,
+                          counted_rereduce,
+                          &counted,
                           VIEW_KV_CHUNK_THRESHOLD + (VIEW_KV_CHUNK_THRESHOLD / 3),
                           VIEW_KP_CHUNK_THRESHOLD + (VIEW_KP_CHUNK_THRESHOLD / 3));
     if (mr == NULL) {
@@ -581,9 +1174,20 @@ static couchstore_error_t build_btree(const char *source_file,
     build_ctx.transient_arena = transient_arena;
     build_ctx.modify_result = mr;
 
-    ret = (couchstore_error_t) sort_fun(source_file,
-                                        tmpdir,
-                                        build_btree_record_callback, &build_ctx);
+    /* A spatial view's R-tree is loaded along its curve */
+    if (spatial_info != NULL) {
+        ret = (couchstore_error_t) sort_spatial_kvs_file(source_file,
+                                                         tmpdir,
+                                                         spatial_info->mbb,
+                                                         spatial_info->mbb_num,
+                                                         spatial_info->order,
+                                                         build_btree_record_callback,
+                                                         &build_ctx);
+    } else {
+        ret = (couchstore_error_t) sort_fun(source_file,
+                                            tmpdir,
+                                            build_btree_record_callback, &build_ctx);
+    }
     if (ret != COUCHSTORE_SUCCESS) {
         goto out;
     }
@@ -611,6 +1215,7 @@ out:
 static couchstore_error_t build_id_btree(const char *source_file,
                                          tree_file *dest_file,
                                          const char *tmpdir,
+                                         view_btree_stats_t *stats,
                                          node_pointer **out_root)
 {
     couchstore_error_t ret;
@@ -626,6 +1231,8 @@ static couchstore_error_t build_id_btree(const char *source_file,
                       tmpdir,
                       sort_view_ids_file,
                       NULL,
+                      NULL,
+                      stats,
                       out_root);
 
     return ret;
@@ -634,49 +1241,39 @@ static couchstore_error_t build_id_btree(const char *source_file,
 
 static couchstore_error_t build_view_btree(const char *source_file,
                                            const view_btree_info_t *info,
+                                           int compact_bitmaps,
                                            tree_file *dest_file,
                                            const char *tmpdir,
+                                           view_btree_stats_t *stats,
                                            node_pointer **out_root,
                                            view_error_t *error_info)
 {
     couchstore_error_t ret;
-    compare_info cmp;
-    view_reducer_ctx_t *red_ctx = NULL;
-    char *error_msg = NULL;
+    view_btree_funs_t funs;
 
-    cmp.compare = view_btree_cmp;
-    red_ctx = make_view_reducer_ctx(info->reducers,
-                                    info->num_reducers,
-                                    &error_msg);
-    if (red_ctx == NULL) {
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
-        return COUCHSTORE_ERROR_REDUCER_FAILURE;
+    ret = make_view_btree_funs(info, compact_bitmaps, &funs, error_info);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
     }
 
     ret = build_btree(source_file,
                       dest_file,
-                      &cmp,
-                      view_btree_reduce,
-                      view_btree_rereduce,
+                      &funs.cmp,
+                      funs.reduce,
+                      funs.rereduce,
                       tmpdir,
                       sort_view_kvs_file,
-                      red_ctx,
+                      info->mbb_num > 0 ? info : NULL,
+                      funs.red_ctx,
+                      stats,
                       out_root);
+    view_btree_funs_stats(&funs, stats);
 
     if (ret != COUCHSTORE_SUCCESS) {
-        char *error_msg = NULL;
-
-        if (red_ctx->error != NULL) {
-            error_msg = strdup(red_ctx->error);
-        } else {
-            error_msg = view_error_msg(ret);
-        }
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
+        view_btree_funs_error(info, &funs, ret, error_info);
     }
 
-    free_view_reducer_ctx(red_ctx);
+    free_view_btree_funs(&funs);
 
     return ret;
 }
@@ -711,7 +1308,7 @@ couchstore_error_t read_view_group_header(view_group_info_t *info,
     }
 
     ret = decode_index_header(header_buf, (size_t) header_len, header);
-    free(header_buf);
+    cs_free(header_buf);
 
     return ret;
 }
@@ -742,7 +1339,7 @@ couchstore_error_t write_view_group_header(tree_file *file,
     *pos = (uint64_t) p;
 
 out:
-    free(buf.buf);
+    cs_free(buf.buf);
 
     return ret;
 }
@@ -800,10 +1397,15 @@ static couchstore_error_t cleanup_btree(tree_file *file,
                                         purge_kp_fn purge_kp,
                                         view_purger_ctx_t *purge_ctx,
                                         view_reducer_ctx_t *red_ctx,
+                                        int max_threads,
                                         node_pointer **out_root)
 {
     couchstore_error_t errcode;
     couchfile_modify_request rq;
+    view_purger_ctx_t thread_ctxs[VIEW_MAX_BTREE_THREADS];
+    void *ctxs[VIEW_MAX_BTREE_THREADS];
+    int threads = btree_job_threads(VIEW_MAX_BTREE_THREADS, max_threads);
+    int i;
 
     rq.cmp = *cmp;
     rq.file = file;
@@ -811,6 +1413,7 @@ static couchstore_error_t cleanup_btree(tree_file *file,
     rq.num_actions = 0;
     rq.reduce = reduce;
     rq.rereduce = rereduce;
+    rq.reduce_delta = NULL;
     rq.compacting = 0;
     rq.kv_chunk_threshold = VIEW_KV_CHUNK_THRESHOLD;
     rq.kp_chunk_threshold = VIEW_KP_CHUNK_THRESHOLD;
@@ -820,7 +1423,20 @@ static couchstore_error_t cleanup_btree(tree_file *file,
     rq.guided_purge_ctx = purge_ctx;
     rq.user_reduce_ctx = red_ctx;
 
-    *out_root = guided_purge_btree(&rq, root, &errcode);
+    /* The root's subtrees are planned on as many threads, each counting
+       what it purges in a context of its own */
+    for (i = 0; i < threads; ++i) {
+        thread_ctxs[i] = *purge_ctx;
+        thread_ctxs[i].count = 0;
+        ctxs[i] = &thread_ctxs[i];
+    }
+
+    *out_root = guided_purge_btree_parallel(&rq, root, threads, ctxs, &errcode);
+
+    for (i = 0; i < threads; ++i) {
+        purge_ctx->count += thread_ctxs[i].count;
+        purge_ctx->stopped |= thread_ctxs[i].stopped;
+    }
 
     return errcode;
 }
@@ -829,6 +1445,7 @@ static couchstore_error_t cleanup_id_btree(tree_file *file,
                                            node_pointer *root,
                                            node_pointer **out_root,
                                            view_purger_ctx_t *purge_ctx,
+                                           int max_threads,
                                            view_error_t *error_info)
 {
     couchstore_error_t ret;
@@ -845,6 +1462,7 @@ static couchstore_error_t cleanup_id_btree(tree_file *file,
                         view_id_btree_purge_kp,
                         purge_ctx,
                         NULL,
+                        max_threads,
                         out_root);
 
     return ret;
@@ -854,52 +1472,37 @@ static couchstore_error_t cleanup_id_btree(tree_file *file,
 static couchstore_error_t cleanup_view_btree(tree_file *file,
                                              node_pointer *root,
                                              const view_btree_info_t *info,
+                                             int compact_bitmaps,
                                              node_pointer **out_root,
                                              view_purger_ctx_t *purge_ctx,
+                                             int max_threads,
                                              view_error_t *error_info)
 {
     couchstore_error_t ret;
-    compare_info cmp;
-    view_reducer_ctx_t *red_ctx = NULL;
-    char *error_msg = NULL;
+    view_btree_funs_t funs;
 
-    cmp.compare = view_btree_cmp;
-    red_ctx = make_view_reducer_ctx(info->reducers,
-                                    info->num_reducers,
-                                    &error_msg);
-    if (red_ctx == NULL) {
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
-        return COUCHSTORE_ERROR_REDUCER_FAILURE;
+    ret = make_view_btree_funs(info, compact_bitmaps, &funs, error_info);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
     }
 
     ret = cleanup_btree(file,
                         root,
-                        &cmp,
-                        view_btree_reduce,
-                        view_btree_rereduce,
+                        &funs.cmp,
+                        funs.reduce,
+                        funs.rereduce,
                         view_btree_purge_kv,
                         view_btree_purge_kp,
                         purge_ctx,
-                        red_ctx,
+                        funs.red_ctx,
+                        max_threads,
                         out_root);
 
     if (ret != COUCHSTORE_SUCCESS) {
-        char *error_msg = NULL;
-
-        if (red_ctx->error != NULL) {
-            error_msg = strdup(red_ctx->error);
-        } else {
-            error_msg = (char *) malloc(64);
-            if (error_msg != NULL) {
-                sprintf(error_msg, "%d", ret);
-            }
-        }
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
+        view_btree_funs_error(info, &funs, ret, error_info);
     }
 
-    free_view_reducer_ctx(red_ctx);
+    free_view_btree_funs(&funs);
 
     return ret;
 }
@@ -910,6 +1513,26 @@ couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
                                                  uint64_t *header_pos,
                                                  uint64_t *purge_count,
                                                  view_error_t *error_info)
+{
+    int complete;
+
+    return couchstore_cleanup_view_group_bounded(info,
+                                                 0,
+                                                 header_pos,
+                                                 purge_count,
+                                                 &complete,
+                                                 error_info);
+}
+
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_cleanup_view_group_bounded(
+                                                 view_group_info_t *info,
+                                                 uint64_t time_limit_ms,
+                                                 uint64_t *header_pos,
+                                                 uint64_t *purge_count,
+                                                 int *complete,
+                                                 view_error_t *error_info)
 {
     couchstore_error_t ret;
     tree_file index_file;
@@ -921,13 +1544,14 @@ couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
     int i;
 
     memset(&bm_cleanup, 0, sizeof(bm_cleanup));
+    memset(&purge_ctx, 0, sizeof(purge_ctx));
     error_info->view_name = NULL;
     error_info->error_msg = NULL;
     index_file.handle = NULL;
     index_file.ops = NULL;
     index_file.path = NULL;
 
-    view_roots = (node_pointer **) calloc(
+    view_roots = (node_pointer **) cs_calloc(
         info->num_btrees, sizeof(node_pointer *));
     if (view_roots == NULL) {
         return COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -950,6 +1574,9 @@ couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
     /* Setup purger context */
     purge_ctx.count = 0;
     purge_ctx.cbitmask = header->cleanup_bitmask;
+    if (time_limit_ms > 0) {
+        purge_ctx.deadline = gethrtime() + time_limit_ms * 1000000;
+    }
 
     ret = open_view_group_file(info->filepath,
                                0,
@@ -964,13 +1591,14 @@ couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
     /* Cleanup id_bree */
     ret = cleanup_id_btree(&index_file, header->id_btree_state, &id_root,
                                                                 &purge_ctx,
+                                                                info->btree_threads,
                                                                 error_info);
     if (ret != COUCHSTORE_SUCCESS) {
         goto cleanup;
     }
 
     if (header->id_btree_state != id_root) {
-        free(header->id_btree_state);
+        cs_free(header->id_btree_state);
     }
 
     header->id_btree_state = id_root;
@@ -982,8 +1610,10 @@ couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
         ret = cleanup_view_btree(&index_file,
                                  (node_pointer *) header->view_btree_states[i],
                                  &info->btree_infos[i],
+                                 COMPACT_BITMAPS(header),
                                  &view_roots[i],
                                  &purge_ctx,
+                                 info->btree_threads,
                                  error_info);
 
         if (ret != COUCHSTORE_SUCCESS) {
@@ -991,7 +1621,7 @@ couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
         }
 
         if (header->view_btree_states[i] != view_roots[i]) {
-            free(header->view_btree_states[i]);
+            cs_free(header->view_btree_states[i]);
         }
 
         header->view_btree_states[i] = view_roots[i];
@@ -999,10 +1629,11 @@ couchstore_error_t couchstore_cleanup_view_group(view_group_info_t *info,
         view_roots[i] = NULL;
     }
 
-    /* Set resulting cleanup bitmask */
-    /* TODO: This code can be removed, if we do not plan for cleanup STOP command */
+    /* Set resulting cleanup bitmask: what a cleanup stopped early left
+       in the btrees is cleaned by the next one */
     intersect_bitmaps(&bm_cleanup, &purge_ctx.cbitmask);
     header->cleanup_bitmask = bm_cleanup;
+    *complete = bitmap_is_empty(&bm_cleanup);
 
     /* Update header with new btree infos */
     ret = write_view_group_header(&index_file, header_pos, header);
@@ -1017,79 +1648,125 @@ cleanup:
     free_index_header(header);
     close_view_group_file(info);
     tree_file_close(&index_file);
-    free(id_root);
+    cs_free(id_root);
     if (view_roots != NULL) {
         for (i = 0; i < info->num_btrees; ++i) {
-            free(view_roots[i]);
+            cs_free(view_roots[i]);
         }
-        free(view_roots);
+        cs_free(view_roots);
     }
 
     return ret;
 }
 
+/*
+ * Doubles the room for a batch's actions. The actions point into the key
+ * and value arrays, so the num_actions already read are pointed again.
+ */
+static couchstore_error_t grow_actions(couchfile_modify_action **actions,
+                                       sized_buf **keybufs,
+                                       sized_buf **valbufs,
+                                       int *capacity,
+                                       int num_actions)
+{
+    int new_capacity = *capacity ? *capacity * 2 :
+                       (int) (INITIAL_ACTIONS_SIZE / ACTION_OVERHEAD);
+    void *p;
+    int i;
+
+    p = cs_realloc(*actions, new_capacity * sizeof(couchfile_modify_action));
+    if (p == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *actions = (couchfile_modify_action *) p;
+
+    p = cs_realloc(*keybufs, new_capacity * sizeof(sized_buf));
+    if (p == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *keybufs = (sized_buf *) p;
+
+    p = cs_realloc(*valbufs, new_capacity * sizeof(sized_buf));
+    if (p == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    *valbufs = (sized_buf *) p;
+
+    for (i = 0; i < num_actions; ++i) {
+        (*actions)[i].key = &(*keybufs)[i];
+        (*actions)[i].value.data = &(*valbufs)[i];
+    }
+    *capacity = new_capacity;
+
+    return COUCHSTORE_SUCCESS;
+}
+
 static couchstore_error_t update_btree(const char *source_file,
+                                       FILE *stream,
                                        tree_file *dest_file,
                                        const node_pointer *root,
                                        size_t batch_size,
                                        compare_info *cmp,
                                        reduce_fn reduce_fun,
                                        reduce_fn rereduce_fun,
+                                       reduce_delta_fn reduce_delta_fun,
                                        purge_kv_fn purge_kv,
                                        purge_kp_fn purge_kp,
                                        view_reducer_ctx_t *red_ctx,
                                        view_purger_ctx_t *purge_ctx,
+                                       size_t arena_limit,
+                                       uint64_t *arena_peak,
                                        uint64_t *inserted,
                                        uint64_t *removed,
+                                       view_btree_stats_t *stats,
                                        node_pointer **out_root)
 {
     couchstore_error_t ret = COUCHSTORE_SUCCESS;
     couchfile_modify_request rq;
     node_pointer *newroot = (node_pointer *) root;
     arena *transient_arena = new_arena(0);
+    arena *tree_arena = new_arena(0);
+    arena_stats records_mem, tree_mem;
     FILE *f = NULL;
+    run_file_t run;
     couchfile_modify_action *actions = NULL;
     sized_buf *keybufs = NULL, *valbufs = NULL;
     size_t bufsize = 0;
     int last_record = 0;
-    bitmap_t empty_bm;
-    int max_actions = MAX_ACTIONS_SIZE /
-                (sizeof(couchfile_modify_action) + 2 * sizeof(sized_buf));
-
-    memset(&empty_bm, 0, sizeof(empty_bm));
-
-    if (transient_arena == NULL) {
-        ret = COUCHSTORE_ERROR_ALLOC_FAIL;
-        goto cleanup;
-    }
+    int full = 0;
+    int pending = 0;
+    view_record_header_t header;
+    view_counted_reduce_ctx_t counted;
+    int capacity = 0;
 
+    memset(&run, 0, sizeof(run));
 
-    actions = (couchfile_modify_action *) calloc(
-                                            max_actions,
-                                            sizeof(couchfile_modify_action));
-    if (actions == NULL) {
+    if (transient_arena == NULL || tree_arena == NULL) {
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto cleanup;
     }
+    /* Each arena gets half; the batch is flushed early when the records
+       take up theirs, and the update fails if the tree update does. */
+    arena_set_limit(transient_arena, arena_limit / 2);
+    arena_set_limit(tree_arena, arena_limit / 2);
 
-    keybufs = (sized_buf *) calloc(max_actions, sizeof(sized_buf));
-    if (keybufs == NULL) {
-        ret = COUCHSTORE_ERROR_ALLOC_FAIL;
+    ret = grow_actions(&actions, &keybufs, &valbufs, &capacity, 0);
+    if (ret != COUCHSTORE_SUCCESS) {
         goto cleanup;
     }
 
-    valbufs = (sized_buf *) calloc(max_actions, sizeof(sized_buf));
-    if (valbufs == NULL) {
-        ret = COUCHSTORE_ERROR_ALLOC_FAIL;
-        goto cleanup;
-    }
+    counted.reduce = reduce_fun;
+    counted.rereduce = rereduce_fun;
+    counted.reduce_delta = reduce_delta_fun;
+    counted.ctx = red_ctx;
+    counted.stats = stats;
 
     rq.cmp = *cmp;
     rq.file = dest_file;
-    rq.actions = actions;
     rq.num_actions = 0;
-    rq.reduce = reduce_fun;
-    rq.rereduce = rereduce_fun;
+    rq.reduce = counted_reduce;
+    rq.rereduce = counted_rereduce;
+    rq.reduce_delta = reduce_delta_fun ? counted_reduce_delta : NULL;
     rq.compacting = 0;
     rq.kv_chunk_threshold = VIEW_KV_CHUNK_THRESHOLD;
     rq.kp_chunk_threshold = VIEW_KP_CHUNK_THRESHOLD;
@@ -1097,33 +1774,67 @@ static couchstore_error_t update_btree(const char *source_file,
     rq.purge_kv = purge_kv;
     rq.guided_purge_ctx = purge_ctx;
     rq.enable_purging = 1;
-    rq.user_reduce_ctx = red_ctx;
+    rq.user_reduce_ctx = &counted;
 
     /* If cleanup bitmask is empty, no need to try purging */
-    if (is_equal_bitmap(&empty_bm, &purge_ctx->cbitmask)) {
+    if (bitmap_is_empty(&purge_ctx->cbitmask)) {
         rq.enable_purging = 0;
     }
 
-    f = fopen(source_file, "rb");
-    if (f == NULL) {
-        ret = COUCHSTORE_ERROR_OPEN_FILE;
-        goto cleanup;
+    if (stream != NULL) {
+        f = stream;
+    } else {
+        /* Read through a large buffer, prefetched ahead of the records */
+        if (run_file_open(&run, source_file, "rb", 0, 0) != FILE_MERGER_SUCCESS) {
+            ret = COUCHSTORE_ERROR_OPEN_FILE;
+            goto cleanup;
+        }
+        f = run.f;
     }
 
     while (!last_record) {
         int read_ret;
         uint8_t op;
 
-        read_ret = read_record(f, transient_arena, &keybufs[rq.num_actions],
-                                                   &valbufs[rq.num_actions],
-                                                   &op);
-        if (read_ret == 0) {
-            last_record = 1;
+        if (!pending) {
+            read_ret = read_record_header(f, stream != NULL, &header);
+            if (read_ret == 0) {
+                last_record = 1;
+                goto flush;
+            } else if (read_ret < 0) {
+                ret = (couchstore_error_t) read_ret;
+                goto cleanup;
+            }
+        }
+        pending = 0;
+
+        if (rq.num_actions == capacity) {
+            ret = grow_actions(&actions, &keybufs, &valbufs, &capacity,
+                               rq.num_actions);
+            if (ret != COUCHSTORE_SUCCESS) {
+                goto cleanup;
+            }
+        }
+
+        read_ret = read_record_body(f, transient_arena,
+                                    &header,
+                                    &keybufs[rq.num_actions],
+                                    &valbufs[rq.num_actions]);
+        if (read_ret == COUCHSTORE_ERROR_ALLOC_FAIL && arena_limit &&
+            rq.num_actions > 0) {
+            /* Out of room for the batch: apply what's read, and read the
+               rest of the record into the emptied arena */
+            full = 1;
+            pending = 1;
             goto flush;
         } else if (read_ret < 0) {
             ret = (couchstore_error_t) read_ret;
             goto cleanup;
         }
+        op = header.op;
+        if (stream == NULL) {
+            run_file_advance(&run, sizeof(header.len) + header.len);
+        }
 
         /* Add action */
         actions[rq.num_actions].type = op;
@@ -1136,21 +1847,26 @@ static couchstore_error_t update_btree(const char *source_file,
             (*removed)++;
         }
 
+        /* The batch is flushed once it's taken up batch_size bytes, so
+           how many records that is follows from how large they are */
         bufsize += keybufs[rq.num_actions].size +
                    valbufs[rq.num_actions].size +
-                   sizeof(uint8_t);
+                   ACTION_OVERHEAD;
         rq.num_actions++;
 
 flush:
-        if (rq.num_actions && (last_record || bufsize > batch_size ||
-                               rq.num_actions == max_actions)) {
-            newroot = modify_btree(&rq, newroot, &ret);
+        if (rq.num_actions && (last_record || full || bufsize > batch_size)) {
+            PROBE2(view_update_batch, rq.num_actions, bufsize);
+            rq.actions = actions;
+            newroot = modify_btree_in_arena(&rq, newroot, tree_arena, &ret);
+            arena_reset(tree_arena);
             if (ret != COUCHSTORE_SUCCESS) {
                 goto cleanup;
             }
 
             rq.num_actions = 0;
             bufsize = 0;
+            full = 0;
             arena_free_all(transient_arena);
         }
     }
@@ -1158,28 +1874,40 @@ flush:
     *out_root = newroot;
 
 cleanup:
-    free(actions);
-    free(keybufs);
-    free(valbufs);
+    cs_free(actions);
+    cs_free(keybufs);
+    cs_free(valbufs);
 
-    if (f != NULL) {
-        fclose(f);
-    }
+    run_file_close(&run);
 
+    if (transient_arena != NULL && tree_arena != NULL) {
+        arena_get_stats(transient_arena, &records_mem);
+        arena_get_stats(tree_arena, &tree_mem);
+        if (records_mem.peak + tree_mem.peak > *arena_peak) {
+            *arena_peak = records_mem.peak + tree_mem.peak;
+        }
+    }
     if (transient_arena != NULL) {
         delete_arena(transient_arena);
     }
+    if (tree_arena != NULL) {
+        delete_arena(tree_arena);
+    }
 
     return ret;
 }
 
 static couchstore_error_t update_id_btree(const char *source_file,
+                                         FILE *stream,
                                          tree_file *dest_file,
                                          const node_pointer *root,
                                          size_t batch_size,
                                          view_purger_ctx_t *purge_ctx,
+                                         size_t arena_limit,
+                                         uint64_t *arena_peak,
                                          uint64_t *inserted,
                                          uint64_t *removed,
+                                         view_btree_stats_t *stats,
                                          node_pointer **out_root)
 {
     couchstore_error_t ret;
@@ -1188,18 +1916,23 @@ static couchstore_error_t update_id_btree(const char *source_file,
     cmp.compare = id_btree_cmp;
 
     ret = update_btree(source_file,
+                      stream,
                       dest_file,
                       root,
                       batch_size,
                       &cmp,
                       view_id_btree_reduce,
                       view_id_btree_rereduce,
+                      NULL,
                       view_id_btree_purge_kv,
                       view_id_btree_purge_kp,
                       NULL,
                       purge_ctx,
+                      arena_limit,
+                      arena_peak,
                       inserted,
                       removed,
+                      stats,
                       out_root);
 
     return ret;
@@ -1207,59 +1940,56 @@ static couchstore_error_t update_id_btree(const char *source_file,
 
 
 static couchstore_error_t update_view_btree(const char *source_file,
+                                            FILE *stream,
                                             const view_btree_info_t *info,
+                                            int compact_bitmaps,
                                             tree_file *dest_file,
                                             const node_pointer *root,
                                             size_t batch_size,
+                                            int incremental_rereduce,
                                             view_purger_ctx_t *purge_ctx,
+                                            size_t arena_limit,
+                                            uint64_t *arena_peak,
                                             uint64_t *inserted,
                                             uint64_t *removed,
+                                            view_btree_stats_t *stats,
                                             node_pointer **out_root,
                                             view_error_t *error_info)
 {
     couchstore_error_t ret;
-    compare_info cmp;
-    view_reducer_ctx_t *red_ctx = NULL;
-    char *error_msg = NULL;
+    view_btree_funs_t funs;
 
-    cmp.compare = view_btree_cmp;
-    red_ctx = make_view_reducer_ctx(info->reducers,
-                                    info->num_reducers,
-                                    &error_msg);
-    if (red_ctx == NULL) {
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
-        return COUCHSTORE_ERROR_REDUCER_FAILURE;
+    ret = make_view_btree_funs(info, compact_bitmaps, &funs, error_info);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
     }
 
     ret = update_btree(source_file,
+                      stream,
                       dest_file,
                       root,
                       batch_size,
-                      &cmp,
-                      view_btree_reduce,
-                      view_btree_rereduce,
+                      &funs.cmp,
+                      funs.reduce,
+                      funs.rereduce,
+                      incremental_rereduce ? funs.reduce_delta : NULL,
                       view_btree_purge_kv,
                       view_btree_purge_kp,
-                      red_ctx,
+                      funs.red_ctx,
                       purge_ctx,
+                      arena_limit,
+                      arena_peak,
                       inserted,
                       removed,
+                      stats,
                       out_root);
+    view_btree_funs_stats(&funs, stats);
 
     if (ret != COUCHSTORE_SUCCESS) {
-        char *error_msg = NULL;
-
-        if (red_ctx->error != NULL) {
-            error_msg = strdup(red_ctx->error);
-        } else {
-            error_msg = view_error_msg(ret);
-        }
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
+        view_btree_funs_error(info, &funs, ret, error_info);
     }
 
-    free_view_reducer_ctx(red_ctx);
+    free_view_btree_funs(&funs);
 
     return ret;
 }
@@ -1275,42 +2005,104 @@ couchstore_error_t couchstore_update_view_group(view_group_info_t *info,
                                                view_group_update_stats_t *stats,
                                                sized_buf *header_outbuf,
                                                view_error_t *error_info)
+{
+    return update_view_group(info,
+                             id_records_file,
+                             kv_records_files,
+                             NULL,
+                             batch_size,
+                             header_buf,
+                             is_sorted,
+                             tmp_dir,
+                             stats,
+                             header_outbuf,
+                             error_info);
+}
+
+
+LIBCOUCHSTORE_API
+couchstore_error_t couchstore_update_view_group_stream(
+                                               view_group_info_t *info,
+                                               FILE *stream,
+                                               size_t batch_size,
+                                               const sized_buf *header_buf,
+                                               view_group_update_stats_t *stats,
+                                               sized_buf *header_outbuf,
+                                               view_error_t *error_info)
+{
+    return update_view_group(info,
+                             NULL,
+                             NULL,
+                             stream,
+                             batch_size,
+                             header_buf,
+                             1,
+                             NULL,
+                             stats,
+                             header_outbuf,
+                             error_info);
+}
+
+
+static couchstore_error_t update_view_group(view_group_info_t *info,
+                                            const char *id_records_file,
+                                            const char *kv_records_files[],
+                                            FILE *stream,
+                                            size_t batch_size,
+                                            const sized_buf *header_buf,
+                                            int is_sorted,
+                                            const char *tmp_dir,
+                                            view_group_update_stats_t *stats,
+                                            sized_buf *header_outbuf,
+                                            view_error_t *error_info)
 {
     couchstore_error_t ret;
     tree_file index_file;
     index_header_t *header = NULL;
-    node_pointer *id_root = NULL;
-    node_pointer **view_roots = NULL;
+    view_btree_job_t *jobs = NULL;
+    view_btree_jobs_t ctx;
     view_purger_ctx_t purge_ctx;
     bitmap_t bm_cleanup;
+    int threads;
     int i;
 
-    ret = decode_index_header(header_buf->buf, header_buf->size, &header);
-    if (ret < 0) {
-        goto cleanup;
-    }
-
-    memset(&bm_cleanup, 0, sizeof(bm_cleanup));
-
     error_info->view_name = NULL;
     error_info->error_msg = NULL;
     index_file.handle = NULL;
     index_file.ops = NULL;
     index_file.path = NULL;
 
-    view_roots = (node_pointer **) calloc(info->num_btrees,
-                                          sizeof(node_pointer *));
-    if (view_roots == NULL) {
-        ret = COUCHSTORE_ERROR_ALLOC_FAIL;
+    ret = decode_index_header(header_buf->buf, header_buf->size, &header);
+    if (ret < 0) {
         goto cleanup;
     }
 
+    memset(&bm_cleanup, 0, sizeof(bm_cleanup));
+
     assert(info->num_btrees == header->num_views);
 
     /* Setup purger context */
-    purge_ctx.count = 0;
+    memset(&purge_ctx, 0, sizeof(purge_ctx));
     purge_ctx.cbitmask = header->cleanup_bitmask;
 
+    /* The id btree is job 0, view i's is job i + 1 */
+    jobs = (view_btree_job_t *) cs_calloc(info->num_btrees + 1,
+                                       sizeof(view_btree_job_t));
+    if (jobs == NULL) {
+        ret = COUCHSTORE_ERROR_ALLOC_FAIL;
+        goto cleanup;
+    }
+    jobs[0].source_file = id_records_file;
+    jobs[0].old_root = header->id_btree_state;
+    for (i = 0; i < info->num_btrees; ++i) {
+        jobs[i + 1].source_file = stream ? NULL : kv_records_files[i];
+        jobs[i + 1].info = &info->btree_infos[i];
+        jobs[i + 1].old_root = header->view_btree_states[i];
+    }
+    for (i = 0; i <= info->num_btrees; ++i) {
+        jobs[i].purge_ctx = purge_ctx;
+    }
+
     ret = open_view_group_file(info->filepath,
                                0,
                                &index_file);
@@ -1322,73 +2114,70 @@ couchstore_error_t couchstore_update_view_group(view_group_info_t *info,
     index_file.pos = index_file.ops->goto_eof(&index_file.lastError,
                                               index_file.handle);
 
-    if (!is_sorted) {
-        ret = (couchstore_error_t) sort_view_ids_ops_file(id_records_file, tmp_dir);
-        if (ret != COUCHSTORE_SUCCESS) {
-            char buf[1024];
-            snprintf(buf, sizeof(buf),
-                    "Error sorting records file: %s", id_records_file);
-            error_info->error_msg = strdup(buf);
-            error_info->view_name = (const char *) strdup("id_btree");
-            goto cleanup;
-        }
+    /* Each batch walks down the interior nodes the one before it wrote,
+       which are kept decoded in the file's node cache (the btrees' jobs
+       share it), so give every btree a default cache's worth */
+    ret = tree_file_set_node_cache_size(&index_file, DEFAULT_NODE_CACHE_SIZE *
+                                        (size_t) (info->num_btrees + 1));
+    if (ret != COUCHSTORE_SUCCESS) {
+        goto cleanup;
     }
 
-    ret = update_id_btree(id_records_file, &index_file,
-                                           header->id_btree_state,
-                                           batch_size,
-                                           &purge_ctx,
-                                           &stats->ids_inserted,
-                                           &stats->ids_removed,
-                                           &id_root);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.jobs = jobs;
+    ctx.num_jobs = info->num_btrees + 1;
+    ctx.run = run_update_job;
+    ctx.file = &index_file;
+    ctx.tmpdir = tmp_dir;
+    ctx.compact_bitmaps = COMPACT_BITMAPS(header);
+    ctx.batch_size = batch_size;
+    ctx.is_sorted = is_sorted;
+    ctx.stream = stream;
+    ctx.incremental_rereduce = info->incremental_rereduce;
+    /* A stream's sections are read in the order of the jobs, one at a
+       time; otherwise the btrees updated at once share the limit */
+    threads = stream ? 1 : info->btree_threads;
+    ctx.arena_limit = info->arena_limit /
+                      btree_job_threads(ctx.num_jobs, threads);
+    ret = run_btree_jobs(&ctx, threads);
+
+    for (i = 0; i <= info->num_btrees; ++i) {
+        if (jobs[i].arena_peak > stats->arena_peak_bytes) {
+            stats->arena_peak_bytes = jobs[i].arena_peak;
+        }
+        if (stats->btree_stats != NULL) {
+            add_btree_stats(&stats->btree_stats[i], &jobs[i].stats);
+        }
+    }
     if (ret != COUCHSTORE_SUCCESS) {
+        report_btree_jobs_error(jobs, info->num_btrees + 1, error_info);
         goto cleanup;
     }
 
-
-    if (header->id_btree_state != id_root) {
-        free(header->id_btree_state);
+    stats->ids_inserted += jobs[0].inserted;
+    stats->ids_removed += jobs[0].removed;
+    if (header->id_btree_state != jobs[0].root) {
+        cs_free(header->id_btree_state);
     }
-
-    header->id_btree_state = id_root;
-    view_id_bitmask(id_root, &bm_cleanup);
-    id_root = NULL;
+    header->id_btree_state = jobs[0].root;
+    view_id_bitmask(jobs[0].root, &bm_cleanup);
+    purge_ctx.count += jobs[0].purge_ctx.count;
 
     for (i = 0; i < info->num_btrees; ++i) {
-        if (!is_sorted) {
-            ret = (couchstore_error_t) sort_view_kvs_ops_file(kv_records_files[i], tmp_dir);
-            if (ret != COUCHSTORE_SUCCESS) {
-                char buf[1024];
-                snprintf(buf, sizeof(buf),
-                        "Error sorting records file: %s", kv_records_files[i]);
-                error_info->error_msg = strdup(buf);
-                error_info->view_name = (const char *) strdup(info->btree_infos[i].names[0]);
-                goto cleanup;
-            }
-        }
-
-        ret = update_view_btree(kv_records_files[i],
-                                &info->btree_infos[i],
-                                &index_file,
-                                header->view_btree_states[i],
-                                batch_size,
-                                &purge_ctx,
-                                &stats->kvs_inserted,
-                                &stats->kvs_removed,
-                                &view_roots[i],
-                                error_info);
-
-        if (ret != COUCHSTORE_SUCCESS) {
-            goto cleanup;
-        }
+        view_btree_job_t *job = &jobs[i + 1];
 
-        if (header->view_btree_states[i] != view_roots[i]) {
-            free(header->view_btree_states[i]);
+        stats->kvs_inserted += job->inserted;
+        stats->kvs_removed += job->removed;
+        if (header->view_btree_states[i] != job->root) {
+            cs_free(header->view_btree_states[i]);
         }
-
-        header->view_btree_states[i] = view_roots[i];
-        view_bitmask(view_roots[i], &bm_cleanup);
-        view_roots[i] = NULL;
+        header->view_btree_states[i] = job->root;
+        view_bitmask(job->root, &bm_cleanup);
+        purge_ctx.count += job->purge_ctx.count;
+    }
+    /* The header holds the roots now */
+    for (i = 0; i <= info->num_btrees; ++i) {
+        jobs[i].root = NULL;
     }
 
     /* Set resulting cleanup bitmask */
@@ -1404,20 +2193,102 @@ couchstore_error_t couchstore_update_view_group(view_group_info_t *info,
     ret = COUCHSTORE_SUCCESS;
 
 cleanup:
+    if (jobs != NULL) {
+        /* New roots of the btrees done when another failed */
+        for (i = 0; i <= info->num_btrees; ++i) {
+            if (jobs[i].root != jobs[i].old_root) {
+                cs_free(jobs[i].root);
+            }
+        }
+        cs_free(jobs);
+    }
     free_index_header(header);
     close_view_group_file(info);
     tree_file_close(&index_file);
-    free(id_root);
-    if (view_roots != NULL) {
-        for (i = 0; i < info->num_btrees; ++i) {
-            free(view_roots[i]);
-        }
-        free(view_roots);
-    }
 
     return ret;
 }
 
+
+static void run_update_job(view_btree_jobs_t *ctx, view_btree_job_t *job)
+{
+    const char *name = job->info ? job->info->names[0] : "id_btree";
+    hrtime_t start = gethrtime();
+
+    if (!ctx->is_sorted) {
+        if (job->info == NULL) {
+            job->ret = (couchstore_error_t) sort_view_ids_ops_file(job->source_file,
+                                                                   ctx->tmpdir);
+        } else if (job->info->mbb_num > 0) {
+            job->ret = (couchstore_error_t) sort_spatial_kvs_ops_file(job->source_file,
+                                                                      ctx->tmpdir,
+                                                                      job->info->mbb,
+                                                                      job->info->mbb_num,
+                                                                      job->info->order);
+        } else {
+            job->ret = (couchstore_error_t) sort_view_kvs_ops_file(job->source_file,
+                                                                   ctx->tmpdir);
+        }
+        if (job->ret != COUCHSTORE_SUCCESS) {
+            char buf[1024];
+            snprintf(buf, sizeof(buf),
+                    "Error sorting records file: %s", job->source_file);
+            job->error_info.error_msg = cs_strdup(buf);
+            job->error_info.view_name = (const char *) cs_strdup(name);
+            return;
+        }
+        job->stats.sort_ns += gethrtime() - start;
+        start = gethrtime();
+    }
+
+    if (job->info == NULL) {
+        job->ret = update_id_btree(job->source_file, ctx->stream, ctx->file,
+                                   job->old_root,
+                                   ctx->batch_size,
+                                   &job->purge_ctx,
+                                   ctx->arena_limit,
+                                   &job->arena_peak,
+                                   &job->inserted,
+                                   &job->removed,
+                                   &job->stats,
+                                   &job->root);
+    } else {
+        job->ret = update_view_btree(job->source_file, ctx->stream,
+                                     job->info, ctx->compact_bitmaps,
+                                     ctx->file,
+                                     job->old_root,
+                                     ctx->batch_size,
+                                     ctx->incremental_rereduce,
+                                     &job->purge_ctx,
+                                     ctx->arena_limit,
+                                     &job->arena_peak,
+                                     &job->inserted,
+                                     &job->removed,
+                                     &job->stats,
+                                     &job->root,
+                                     &job->error_info);
+    }
+    job->stats.modify_ns += gethrtime() - start;
+}
+
+static void add_compact_stats(view_compact_ctx_t *ctx, uint64_t inserted)
+{
+    compactor_stats_t *stats = ctx->stats;
+
+    if (stats) {
+        if (ctx->stats_mutex) {
+            cb_mutex_enter(ctx->stats_mutex);
+        }
+        stats->inserted += inserted;
+        if (stats->update_fun) {
+            stats->update_fun(stats->freq, stats->inserted);
+        }
+        if (ctx->stats_mutex) {
+            cb_mutex_exit(ctx->stats_mutex);
+        }
+    }
+}
+
 /* Add the kv pair to modify result */
 static couchstore_error_t compact_view_fetchcb(couchfile_lookup_request *rq,
                                         const sized_buf *k,
@@ -1426,7 +2297,6 @@ static couchstore_error_t compact_view_fetchcb(couchfile_lookup_request *rq,
     int ret;
     sized_buf *k_c, *v_c;
     view_compact_ctx_t *ctx = (view_compact_ctx_t *) rq->callback_ctx;
-    compactor_stats_t *stats = ctx->stats;
 
     if (k == NULL || v == NULL) {
         return COUCHSTORE_ERROR_READ;
@@ -1448,12 +2318,7 @@ static couchstore_error_t compact_view_fetchcb(couchfile_lookup_request *rq,
         return ret;
     }
 
-    if (stats) {
-        stats->inserted++;
-        if (stats->update_fun) {
-            stats->update_fun(stats->freq, stats->inserted);
-        }
-    }
+    add_compact_stats(ctx, 1);
 
     if (ctx->mr->count == 0) {
         arena_free_all(ctx->transient_arena);
@@ -1462,6 +2327,24 @@ static couchstore_error_t compact_view_fetchcb(couchfile_lookup_request *rq,
     return (couchstore_error_t) ret;
 }
 
+/* Whether the leaves under a KP entry can be copied over as they are,
+   none of their items being filtered out. The progress counts them
+   by their reductions, which for views count values rather than keys. */
+static int compact_view_unchangedcb(couchfile_lookup_request *rq,
+                                    const node_pointer *ptr)
+{
+    view_compact_ctx_t *ctx = (view_compact_ctx_t *) rq->callback_ctx;
+    uint64_t count = 0;
+    int ret;
+
+    ret = ctx->filter_kp_fun(ptr, ctx->filter_fun ? ctx->filterbm : NULL, &count);
+    if (ret > 0) {
+        add_compact_stats(ctx, count);
+    }
+
+    return ret;
+}
+
 static couchstore_error_t compact_btree(tree_file *source,
                                  tree_file *target,
                                  const node_pointer *root,
@@ -1469,9 +2352,11 @@ static couchstore_error_t compact_btree(tree_file *source,
                                  reduce_fn reduce_fun,
                                  reduce_fn rereduce_fun,
                                  compact_filter_fn filter_fun,
+                                 compact_filter_kp_fn filter_kp_fun,
                                  view_reducer_ctx_t *red_ctx,
                                  const bitmap_t *filterbm,
                                  compactor_stats_t *stats,
+                                 cb_mutex_t *stats_mutex,
                                  node_pointer **out_root)
 {
     couchstore_error_t ret = COUCHSTORE_SUCCESS;
@@ -1487,8 +2372,8 @@ static couchstore_error_t compact_btree(tree_file *source,
         return COUCHSTORE_SUCCESS;
     }
 
-    transient_arena = new_arena(0);
-    persistent_arena = new_arena(0);
+    transient_arena = new_huge_page_arena();
+    persistent_arena = new_huge_page_arena();
 
     if (transient_arena == NULL || persistent_arena == NULL) {
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
@@ -1511,16 +2396,18 @@ static couchstore_error_t compact_btree(tree_file *source,
     }
 
     compact_ctx.filter_fun = NULL;
+    compact_ctx.filter_kp_fun = filter_kp_fun;
     compact_ctx.mr = modify_result;
     compact_ctx.transient_arena = transient_arena;
     compact_ctx.stats = stats;
+    compact_ctx.stats_mutex = stats_mutex;
 
     if (filterbm) {
         compact_ctx.filterbm = filterbm;
         compact_ctx.filter_fun = filter_fun;
     }
 
-    lookup_rq.cmp.compare = cmp->compare;
+    lookup_rq.cmp = *cmp;
     lookup_rq.file = source;
     lookup_rq.num_keys = 1;
     lookup_rq.keys = &lowkeys;
@@ -1529,7 +2416,10 @@ static couchstore_error_t compact_btree(tree_file *source,
     lookup_rq.node_callback = NULL;
     lookup_rq.fold = 1;
 
-    ret = btree_lookup(&lookup_rq, root->pointer);
+    /* Leaves none of whose partitions are filtered out are copied still
+       compressed, with only the levels above them built anew */
+    ret = btree_copy_leaves(&lookup_rq, root->pointer, modify_result,
+                            compact_view_unchangedcb);
     if (ret != COUCHSTORE_SUCCESS) {
         goto cleanup;
     }
@@ -1553,6 +2443,7 @@ static couchstore_error_t compact_id_btree(tree_file *source,
                                     const node_pointer *root,
                                     const bitmap_t *filterbm,
                                     compactor_stats_t *stats,
+                                    cb_mutex_t *stats_mutex,
                                     node_pointer **out_root)
 {
     couchstore_error_t ret;
@@ -1567,9 +2458,11 @@ static couchstore_error_t compact_id_btree(tree_file *source,
                         view_id_btree_reduce,
                         view_id_btree_rereduce,
                         view_id_btree_filter,
+                        view_id_btree_filter_kp,
                         NULL,
                         filterbm,
                         stats,
+                        stats_mutex,
                         out_root);
 
     return ret;
@@ -1578,52 +2471,41 @@ static couchstore_error_t compact_id_btree(tree_file *source,
 static couchstore_error_t compact_view_btree(tree_file *source,
                                       tree_file *target,
                                       const view_btree_info_t *info,
+                                      int compact_bitmaps,
                                       const node_pointer *root,
                                       const bitmap_t *filterbm,
                                       compactor_stats_t *stats,
+                                      cb_mutex_t *stats_mutex,
                                       node_pointer **out_root,
                                       view_error_t *error_info)
 {
     couchstore_error_t ret;
-    compare_info cmp;
-    view_reducer_ctx_t *red_ctx = NULL;
-    char *error_msg = NULL;
+    view_btree_funs_t funs;
 
-    cmp.compare = view_btree_cmp;
-    red_ctx = make_view_reducer_ctx(info->reducers,
-                                    info->num_reducers,
-                                    &error_msg);
-    if (red_ctx == NULL) {
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
-        return COUCHSTORE_ERROR_REDUCER_FAILURE;
+    ret = make_view_btree_funs(info, compact_bitmaps, &funs, error_info);
+    if (ret != COUCHSTORE_SUCCESS) {
+        return ret;
     }
 
     ret = compact_btree(source,
                         target,
                         root,
-                        &cmp,
-                        view_btree_reduce,
-                        view_btree_rereduce,
+                        &funs.cmp,
+                        funs.reduce,
+                        funs.rereduce,
                         view_btree_filter,
-                        red_ctx,
+                        view_btree_filter_kp,
+                        funs.red_ctx,
                         filterbm,
                         stats,
+                        stats_mutex,
                         out_root);
 
     if (ret != COUCHSTORE_SUCCESS) {
-        char *error_msg = NULL;
-
-        if (red_ctx->error != NULL) {
-            error_msg = strdup(red_ctx->error);
-        } else {
-            error_msg = view_error_msg(ret);
-        }
-        error_info->error_msg = (const char *) error_msg;
-        error_info->view_name = (const char *) strdup(info->names[0]);
+        view_btree_funs_error(info, &funs, ret, error_info);
     }
 
-    free_view_reducer_ctx(red_ctx);
+    free_view_btree_funs(&funs);
 
     return ret;
 }
@@ -1640,9 +2522,8 @@ couchstore_error_t couchstore_compact_view_group(view_group_info_t *info,
     tree_file index_file;
     tree_file compact_file;
     index_header_t *header = NULL;
-    node_pointer *id_root = NULL;
-    node_pointer **view_roots = NULL;
-    bitmap_t *filterbm = NULL;
+    view_btree_job_t *jobs = NULL;
+    view_btree_jobs_t ctx;
     bitmap_t emptybm;
     int i;
 
@@ -1655,6 +2536,7 @@ couchstore_error_t couchstore_compact_view_group(view_group_info_t *info,
     compact_file.handle = NULL;
     compact_file.ops = NULL;
     compact_file.path = NULL;
+    memset(&ctx, 0, sizeof(ctx));
 
     ret = decode_index_header(header_buf->buf, header_buf->size, &header);
     if (ret < 0) {
@@ -1662,18 +2544,24 @@ couchstore_error_t couchstore_compact_view_group(view_group_info_t *info,
     }
 
     /* Set filter bitmask if required */
-    if (!is_equal_bitmap(&emptybm, &header->cleanup_bitmask)) {
-        filterbm = &header->cleanup_bitmask;
+    if (!bitmap_is_empty(&header->cleanup_bitmask)) {
+        ctx.filterbm = &header->cleanup_bitmask;
     }
 
-    view_roots = (node_pointer **) calloc(info->num_btrees,
-                                          sizeof(node_pointer *));
-    if (view_roots == NULL) {
+    assert(info->num_btrees == header->num_views);
+
+    /* The id btree is job 0, view i's is job i + 1 */
+    jobs = (view_btree_job_t *) cs_calloc(info->num_btrees + 1,
+                                       sizeof(view_btree_job_t));
+    if (jobs == NULL) {
         ret = COUCHSTORE_ERROR_ALLOC_FAIL;
         goto cleanup;
     }
-
-    assert(info->num_btrees == header->num_views);
+    jobs[0].old_root = header->id_btree_state;
+    for (i = 0; i < info->num_btrees; ++i) {
+        jobs[i + 1].info = &info->btree_infos[i];
+        jobs[i + 1].old_root = header->view_btree_states[i];
+    }
 
     ret = open_view_group_file(info->filepath,
                                COUCHSTORE_OPEN_FLAG_RDONLY,
@@ -1693,36 +2581,30 @@ couchstore_error_t couchstore_compact_view_group(view_group_info_t *info,
 
     compact_file.pos = compact_file.ops->goto_eof(&compact_file.lastError,
                                                   compact_file.handle);
-    ret = compact_id_btree(&index_file, &compact_file,
-                                        header->id_btree_state,
-                                        filterbm,
-                                        stats,
-                                        &id_root);
+
+    ctx.jobs = jobs;
+    ctx.num_jobs = info->num_btrees + 1;
+    ctx.run = run_compact_job;
+    ctx.file = &compact_file;
+    ctx.source = &index_file;
+    ctx.compact_bitmaps = COMPACT_BITMAPS(header);
+    ctx.stats = stats;
+    cb_mutex_initialize(&ctx.stats_mutex);
+    ret = run_btree_jobs(&ctx, info->btree_threads);
+    cb_mutex_destroy(&ctx.stats_mutex);
     if (ret != COUCHSTORE_SUCCESS) {
+        report_btree_jobs_error(jobs, info->num_btrees + 1, error_info);
         goto cleanup;
     }
 
-    free(header->id_btree_state);
-    header->id_btree_state = id_root;
-    id_root = NULL;
+    cs_free(header->id_btree_state);
+    header->id_btree_state = jobs[0].root;
+    jobs[0].root = NULL;
 
     for (i = 0; i < info->num_btrees; ++i) {
-        ret = compact_view_btree(&index_file,
-                                 &compact_file,
-                                 &info->btree_infos[i],
-                                 header->view_btree_states[i],
-                                 filterbm,
-                                 stats,
-                                 &view_roots[i],
-                                 error_info);
-
-        if (ret != COUCHSTORE_SUCCESS) {
-            goto cleanup;
-        }
-
-        free(header->view_btree_states[i]);
-        header->view_btree_states[i] = view_roots[i];
-        view_roots[i] = NULL;
+        cs_free(header->view_btree_states[i]);
+        header->view_btree_states[i] = jobs[i + 1].root;
+        jobs[i + 1].root = NULL;
     }
 
     header->cleanup_bitmask = emptybm;
@@ -1738,13 +2620,119 @@ cleanup:
     close_view_group_file(info);
     tree_file_close(&index_file);
     tree_file_close(&compact_file);
-    free(id_root);
-    if (view_roots != NULL) {
-        for (i = 0; i < info->num_btrees; ++i) {
-            free(view_roots[i]);
+    if (jobs != NULL) {
+        for (i = 0; i <= info->num_btrees; ++i) {
+            cs_free(jobs[i].root);
         }
-        free(view_roots);
+        cs_free(jobs);
+    }
+
+    return ret;
+}
+
+
+static void run_compact_job(view_btree_jobs_t *ctx, view_btree_job_t *job)
+{
+    /* The stats are only shared when other threads take jobs too */
+    cb_mutex_t *stats_mutex = ctx->file->io_mutex ? &ctx->stats_mutex : NULL;
+
+    if (job->info == NULL) {
+        job->ret = compact_id_btree(ctx->source, ctx->file,
+                                    job->old_root,
+                                    ctx->filterbm,
+                                    ctx->stats,
+                                    stats_mutex,
+                                    &job->root);
+    } else {
+        job->ret = compact_view_btree(ctx->source, ctx->file,
+                                      job->info,
+                                      ctx->compact_bitmaps,
+                                      job->old_root,
+                                      ctx->filterbm,
+                                      ctx->stats,
+                                      stats_mutex,
+                                      &job->root,
+                                      &job->error_info);
+    }
+}
+
+
+couchstore_error_t couchstore_query_view_group(view_group_info_t *info,
+                                               int view_idx,
+                                               const view_query_t *query,
+                                               view_query_row_fn callback,
+                                               void *ctx,
+                                               view_error_t *error_info)
+{
+    couchstore_error_t ret;
+    index_header_t *header = NULL;
+    const view_btree_info_t *btree_info;
+    view_btree_funs_t funs;
+    view_query_t q = *query;
+    bitmap_t wanted;
+    int have_funs = 0;
+    size_t i;
+
+    error_info->view_name = NULL;
+    error_info->error_msg = NULL;
+
+    if (view_idx < 0 || view_idx >= info->num_btrees) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
     }
+    btree_info = &info->btree_infos[view_idx];
+    if (btree_info->mbb_num > 0 ||
+        (query->reduce && query->reducer >= (unsigned) btree_info->num_reducers)) {
+        return COUCHSTORE_ERROR_INVALID_ARGUMENTS;
+    }
+
+    ret = open_view_group_file(info->filepath,
+                               COUCHSTORE_OPEN_FLAG_RDONLY,
+                               &info->file);
+    if (ret != COUCHSTORE_SUCCESS) {
+        goto cleanup;
+    }
+
+    ret = read_view_group_header(info, &header);
+    if (ret != COUCHSTORE_SUCCESS) {
+        goto cleanup;
+    }
+    assert(info->num_btrees == header->num_views);
+
+    /* What's being cleaned up is no longer there */
+    if (!bitmap_is_empty(&header->cleanup_bitmask)) {
+        if (query->partitions != NULL) {
+            wanted = *query->partitions;
+        } else {
+            memset(&wanted, 0xff, sizeof(wanted));
+        }
+        for (i = 0; i < sizeof(wanted.chunks); ++i) {
+            wanted.chunks[i] &= ~header->cleanup_bitmask.chunks[i];
+        }
+        q.partitions = &wanted;
+    }
+
+    if (query->reduce) {
+        ret = make_view_btree_funs(btree_info, COMPACT_BITMAPS(header), &funs,
+                                   error_info);
+        if (ret != COUCHSTORE_SUCCESS) {
+            goto cleanup;
+        }
+        have_funs = 1;
+    }
+
+    ret = view_btree_query(&info->file, header->view_btree_states[view_idx],
+                           have_funs ? funs.red_ctx : NULL,
+                           &q, callback, ctx);
+    if (ret != COUCHSTORE_SUCCESS && have_funs && funs.red_ctx->error != NULL) {
+        view_btree_funs_error(btree_info, &funs, ret, error_info);
+    }
+
+cleanup:
+    if (have_funs) {
+        free_view_btree_funs(&funs);
+    }
+    free_index_header(header);
+    close_view_group_file(info);
 
     return ret;
 }
@@ -26,6 +26,8 @@
 #include <libcouchstore/couch_db.h>
 #include "index_header.h"
 #include "compaction.h"
+#include "spatial.h"
+#include "query.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -40,6 +42,14 @@ extern "C" {
         int           num_reducers;
         const char  **names;
         const char  **reducers;
+        /* A spatial view's btree is an R-tree, whose keys are kept in the
+           order (Z-order or Hilbert) of their MBBs' centres within this MBB,
+           the one enclosing them all; mbb_num is its number of values, two
+           per dimension, or 0 for a mapreduce view. A spatial view has a
+           name and no reducer. */
+        uint16_t      mbb_num;
+        double       *mbb;
+        spatial_order_t order;
     } view_btree_info_t;
 
     typedef struct {
@@ -48,14 +58,43 @@ extern "C" {
         int                 num_btrees;
         view_btree_info_t  *btree_infos;
         tree_file           file;
+        /* Most bytes the arenas of an update may hold, or 0 */
+        size_t              arena_limit;
+        /* Btrees built, updated or compacted at once, and threads a
+           cleanup shares out each btree's subtrees among; 0 picks one per
+           core, up to 4, and 1 works through them in turn */
+        int                 btree_threads;
+        /* Whether an update works out the reductions of the view btrees'
+           modified nodes from their old ones and those of the children
+           replaced, rather than from all their children, when their
+           reducers are _count, _sum or _stats and the values integers */
+        int                 incremental_rereduce;
     } view_group_info_t;
 
+    /* Where the time of a btree's build or update went. A build sorts its
+       records as it feeds them to the btree, so it's all modify_ns. */
+    typedef struct {
+        uint64_t sort_ns;           /* sorting and merging its records file */
+        uint64_t modify_ns;         /* putting the records in the btree */
+        uint64_t reduce_ns;         /* of modify_ns, in its reduce functions */
+        uint64_t js_reduce_ns;      /* of reduce_ns, in JavaScript ones */
+        uint64_t reduce_calls;
+        uint64_t js_reduce_calls;
+        uint64_t nodes_written;
+        uint64_t node_bytes;        /* of the nodes, before compression */
+    } view_btree_stats_t;
+
     typedef struct {
        uint64_t ids_inserted;
        uint64_t ids_removed;
        uint64_t kvs_inserted;
        uint64_t kvs_removed;
        uint64_t purged;
+       /* Most bytes the arenas of a btree's update held */
+       uint64_t arena_peak_bytes;
+       /* If not NULL, num_btrees + 1 stats added to: the id btree's, then
+          each view's */
+       view_btree_stats_t *btree_stats;
     } view_group_update_stats_t;
 
     typedef struct {
@@ -64,7 +103,11 @@ extern "C" {
     } view_btree_builder_ctx_t;
 
     /* Read a view group definition from an input stream, and write any
-       errors to the optional error stream. */
+       errors to the optional error stream. A spatial view's btree is given
+       by the line "spatial" (keys in Z-order) or "spatial hilbert" (keys
+       in Hilbert order) where a btree's number of reducers would be, then
+       lines with the number of values of its enclosing MBB, each of
+       the values, and the view's name. */
     LIBCOUCHSTORE_API
     view_group_info_t *couchstore_read_view_group_info(FILE *in_stream,
                                                        FILE *error_stream);
@@ -81,6 +124,19 @@ extern "C" {
                                                    uint64_t *header_pos,
                                                    view_error_t *error_info);
 
+    /* Like couchstore_build_view_group, also adding to num_btrees + 1
+       btree_stats: the id btree's, then each view's. */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_build_view_group_with_stats(
+                                               view_group_info_t *info,
+                                               const char *id_records_file,
+                                               const char *kv_records_files[],
+                                               const char *dst_file,
+                                               const char *tmpdir,
+                                               uint64_t *header_pos,
+                                               view_btree_stats_t *btree_stats,
+                                               view_error_t *error_info);
+
     couchstore_error_t read_view_group_header(view_group_info_t *info,
                                               index_header_t **header);
 
@@ -94,6 +150,23 @@ extern "C" {
                                                      uint64_t *purge_count,
                                                      view_error_t *error_info);
 
+    /*
+     * Like couchstore_cleanup_view_group, but stops cleaning once
+     * time_limit_ms have passed (0 for no limit), keeping the subtrees
+     * not got to yet as they are. The header written keeps the partitions
+     * still found in the btrees in its cleanup bitmask, so calling it
+     * again carries on, skipping the subtrees already cleaned; *complete
+     * is set when there's nothing left to clean.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_cleanup_view_group_bounded(
+                                                     view_group_info_t *info,
+                                                     uint64_t time_limit_ms,
+                                                     uint64_t *header_pos,
+                                                     uint64_t *purge_count,
+                                                     int *complete,
+                                                     view_error_t *error_info);
+
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_update_view_group(
                                                view_group_info_t *info,
@@ -107,6 +180,24 @@ extern "C" {
                                                sized_buf *header_outbuf,
                                                view_error_t *error_info);
 
+    /*
+     * Like couchstore_update_view_group, but takes the sorted ids ops and
+     * kvs ops records from a stream, such as a pipe or socket, rather than
+     * from files, and updates each btree in batches as they arrive. The
+     * stream holds the id btree's records followed by each view btree's,
+     * in the records files' format, every section ending with a zero
+     * length (a record's leading uint32_t). The btrees are updated in turn.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_update_view_group_stream(
+                                               view_group_info_t *info,
+                                               FILE *stream,
+                                               size_t batch_size,
+                                               const sized_buf *header_buf,
+                                               view_group_update_stats_t *stats,
+                                               sized_buf *header_outbuf,
+                                               view_error_t *error_info);
+
     LIBCOUCHSTORE_API
     couchstore_error_t couchstore_compact_view_group(
                                                  view_group_info_t *info,
@@ -116,6 +207,21 @@ extern "C" {
                                                  sized_buf *header_outbuf,
                                                  view_error_t *error_info);
 
+    /*
+     * Runs a query (see query.h) of the view_idx'th view btree of the group
+     * at info->header_pos, calling callback with each row in turn. The rows
+     * of the partitions the group's header has to clean up are left out.
+     * A reduce query needs the btree to have a reducer'th reducer; spatial
+     * views can't be queried this way.
+     */
+    LIBCOUCHSTORE_API
+    couchstore_error_t couchstore_query_view_group(view_group_info_t *info,
+                                                   int view_idx,
+                                                   const view_query_t *query,
+                                                   view_query_row_fn callback,
+                                                   void *ctx,
+                                                   view_error_t *error_info);
+
 #ifdef __cplusplus
 }
 #endif
@@ -98,6 +98,39 @@ static couchstore_error_t count_rereduce(char *dst, size_t *size_r,
     return COUCHSTORE_SUCCESS;
 }
 
+/* Counts from the delta, checking that against counting the children;
+   ctx counts the nodes done so */
+static int count_reduce_delta(char *dst, size_t *size_r,
+                              const nodelist *ptrlist,
+                              int count,
+                              const reduce_delta *delta,
+                              void *ctx)
+{
+    int total = *(const int *) delta->old_reduction->buf;
+    int check[1];
+    size_t check_size = 0;
+    const nodelist *i;
+    int n;
+
+    for (i = delta->removed, n = delta->removed_count; i != NULL && n > 0;
+         i = i->next, n--) {
+        total -= *(const int *) i->pointer->reduce_value.buf;
+    }
+    for (i = delta->added, n = delta->added_count; i != NULL && n > 0;
+         i = i->next, n--) {
+        total += *(const int *) i->pointer->reduce_value.buf;
+    }
+
+    count_rereduce((char *) check, &check_size, ptrlist, count, NULL);
+    assert(total == check[0]);
+
+    memcpy(dst, &total, sizeof(total));
+    *size_r = sizeof(total);
+    (*(int *) ctx)++;
+
+    return 1;
+}
+
 static couchstore_error_t evenodd_reduce(char *dst, size_t *size_r,
                                                     const nodelist *leaflist,
                                                     int count,
@@ -480,6 +513,7 @@ static node_pointer *insert_items(tree_file *file, node_pointer *root,
     rq.num_actions = n;
     rq.reduce = reduce;
     rq.rereduce = rereduce;
+    rq.reduce_delta = NULL;
     rq.compacting = 0;
     rq.kv_chunk_threshold = 6 * 1024;
     rq.kp_chunk_threshold = 6 * 1024;
@@ -511,6 +545,7 @@ static couchfile_modify_request purge_request(tree_file *file, reduce_fn reduce,
     rq.num_actions = 0;
     rq.reduce = reduce;
     rq.rereduce = rereduce;
+    rq.reduce_delta = NULL;
     rq.compacting = 0;
     rq.kv_chunk_threshold = 6 * 1024;
     rq.kp_chunk_threshold = 6 * 1024;
@@ -766,6 +801,51 @@ cleanup:
     assert(errcode == 0);
 }
 
+void test_parallel_partial_purge()
+{
+    int errcode, N, i;
+    int exp_evenodd[2];
+    int purge_counts[4] = {0, 0, 0, 0};
+    void *ctxs[4];
+    Db *db = NULL;
+    node_pointer *root = NULL, *newroot = NULL;
+    couchfile_modify_request purge_rq;
+    fprintf(stderr, "\nExecuting test_parallel_partial_purge...\n");
+
+    N = 211341;
+    exp_evenodd[0] = N / 2;
+    exp_evenodd[1] = N / 2 + N % 2;
+
+    remove(testpurgefile);
+    try(couchstore_open_db(testpurgefile, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    root = insert_items(&db->file, NULL, evenodd_reduce, evenodd_rereduce, N);
+    assert(root != NULL);
+
+    for (i = 0; i < 4; i++) {
+        ctxs[i] = &purge_counts[i];
+    }
+    purge_rq = purge_request(&db->file, evenodd_reduce, evenodd_rereduce,
+                    evenodd_purge_kp, evenodd_purge_kv, NULL);
+    newroot = guided_purge_btree_parallel(&purge_rq, root, 4, ctxs, &errcode);
+    assert(errcode == 0);
+
+    assert(purge_counts[0] + purge_counts[1] + purge_counts[2] +
+           purge_counts[3] == exp_evenodd[1]);
+    fprintf(stderr, "guided_purge threads' accumulators add up to NumOdd\n");
+
+    assert(red_intval(newroot, 0) == exp_evenodd[0] && red_intval(newroot, 1) == 0);
+    fprintf(stderr, "Reduce value after guided purge equals {NumEven, 0}\n");
+
+    try(iter_btree(&db->file, newroot, NULL, check_odd_callback));
+    fprintf(stderr, "Btree has no odd values after guided purge\n");
+
+cleanup:
+    free(root);
+    free(newroot);
+    couchstore_close_db(db);
+    assert(errcode == 0);
+}
+
 void test_add_remove_purge()
 {
     int errcode, N, i;
@@ -886,3 +966,71 @@ cleanup:
     couchstore_close_db(db);
     assert(errcode == 0);
 }
+
+void test_reduce_delta()
+{
+    int errcode, N, i;
+    int delta_calls = 0;
+    Db *db = NULL;
+    node_pointer *root = NULL, *newroot = NULL;
+    couchfile_modify_request rq;
+    int *arr = NULL;
+    couchfile_modify_action *acts = NULL;
+    sized_buf *keys = NULL;
+    int nacts = 3004;
+    fprintf(stderr, "\nExecuting test_reduce_delta...\n");
+
+    N = 211341;
+    remove(testpurgefile);
+    try(couchstore_open_db(testpurgefile, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    root = insert_items(&db->file, NULL, count_reduce, count_rereduce, N);
+    assert(root != NULL);
+    assert(red_intval(root, 0) == N);
+
+    /* An update, a few removals, and enough inserts past the end to split
+       the last leaves */
+    arr = (int *) calloc(nacts, sizeof(int));
+    keys = (sized_buf *) calloc(nacts, sizeof(sized_buf));
+    acts = (couchfile_modify_action *) calloc(nacts, sizeof(couchfile_modify_action));
+
+    arr[0] = 2;
+    arr[1] = 4;
+    arr[2] = 10;
+    arr[3] = 200000;
+    acts[0].type = ACTION_INSERT;
+    acts[1].type = ACTION_REMOVE;
+    acts[2].type = ACTION_REMOVE;
+    acts[3].type = ACTION_REMOVE;
+    for (i = 4; i < nacts; i++) {
+        arr[i] = 500000 + i;
+        acts[i].type = ACTION_INSERT;
+    }
+    for (i = 0; i < nacts; i++) {
+        keys[i].size  = sizeof(int);
+        keys[i].buf = (void *) &arr[i];
+        acts[i].key = &keys[i];
+        acts[i].value.data = &keys[i];
+    }
+
+    rq = purge_request(&db->file, count_reduce, count_rereduce, NULL, NULL, NULL);
+    rq.reduce_delta = count_reduce_delta;
+    rq.user_reduce_ctx = &delta_calls;
+    rq.enable_purging = 0;
+    rq.actions = acts;
+    rq.num_actions = nacts;
+    newroot = modify_btree(&rq, root, &errcode);
+    assert(errcode == 0);
+
+    assert(red_intval(newroot, 0) == N - 3 + (nacts - 4));
+    assert(delta_calls > 0);
+    fprintf(stderr, "Reduce value from deltas equals the count\n");
+
+cleanup:
+    free(root);
+    free(newroot);
+    free(keys);
+    free(acts);
+    free(arr);
+    couchstore_close_db(db);
+    assert(errcode == 0);
+}
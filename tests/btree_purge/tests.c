@@ -28,6 +28,8 @@ void purge_tests()
     test_partial_purge_items();
     test_partial_purge_items2();
     test_partial_purge_with_stop();
+    test_parallel_partial_purge();
     test_only_single_leafnode();
     test_add_remove_purge();
+    test_reduce_delta();
 }
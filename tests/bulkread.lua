@@ -0,0 +1,106 @@
+package.path = package.path .. ";tests/?.lua"
+local testlib = require("testlib")
+
+local function make_db(dbname)
+   local t = {}
+   for i = 1, 1000, 1 do
+      table.insert(t, {"k" .. i, "value " .. i, 1})
+   end
+
+   local db = couch.open(dbname, true)
+   db:save_bulk(t)
+   db:commit()
+
+   db:delete("k10")
+   db:commit()
+   return db
+end
+
+function test_get_bulk(dbname)
+   local db = make_db(dbname)
+
+   local values, infos = db:get_bulk({"k1", "k500", "k10", "missing", "k1000"})
+
+   for i,k in ipairs({"k1", "k500", "k1000"}) do
+      local expected = "value " .. string.sub(k, 2)
+      if values[k] ~= expected then
+         error("Expected '" .. expected .. "' for " .. k .. ", got " .. tostring(values[k]))
+      end
+      if infos[k]:id() ~= k then
+         error("Expected docinfo for " .. k .. ", got " .. infos[k]:id())
+      end
+   end
+
+   if values["k10"] ~= nil or infos["k10"]:deleted() ~= 1 then
+      error("Expected k10 to be deleted")
+   end
+   if values["missing"] ~= nil or infos["missing"] ~= nil then
+      error("Expected nothing for a missing key")
+   end
+
+   local none = db:get_bulk({})
+   if next(none) ~= nil then
+      error("Expected no results for no keys")
+   end
+
+   db:close()
+end
+
+function test_changes_iter(dbname)
+   local db = make_db(dbname)
+
+   local found, last = 0, 0
+   for di in db:changes_iter(0, 0) do
+      if di:db_seq() <= last then
+         error("Expected ascending sequences, got " .. di:db_seq() .. " after " .. last)
+      end
+      last = di:db_seq()
+      found = found + 1
+   end
+   if found ~= 1000 then
+      error("Expected 1000 results, found " .. found)
+   end
+
+   found = 0
+   for di in db:changes_iter(0, 4) do
+      found = found + 1
+   end
+   if found ~= 999 then
+      error("Expected 999 live results, found " .. found)
+   end
+
+   found = 0
+   for di in db:changes_iter(last, 2) do
+      found = found + 1
+   end
+   if found ~= 1 then
+      error("Expected the deletion only, found " .. found)
+   end
+
+   db:close()
+end
+
+function test_timing(dbname)
+   local start = couch.now()
+   local h = couch.histogram()
+   for i = 100, 1, -1 do
+      h:add(i)
+   end
+   if couch.now() < start then
+      error("Expected a monotonic clock")
+   end
+
+   if h:count() ~= 100 or h:min() ~= 1 or h:max() ~= 100 then
+      error("Expected 100 samples from 1 to 100")
+   end
+   if h:mean() ~= 50.5 then
+      error("Expected a mean of 50.5, got " .. h:mean())
+   end
+   if h:percentile(0.5) ~= 51 or h:percentile(0.99) ~= 99 then
+      error("Unexpected percentiles " .. h:percentile(0.5) .. ", " .. h:percentile(0.99))
+   end
+end
+
+testlib.run_test("get_bulk test", test_get_bulk)
+testlib.run_test("changes_iter test", test_changes_iter)
+testlib.run_test("Timing helpers test", test_timing)
@@ -27,6 +27,7 @@
 
 #define N_FILES 4
 #define MAX_RECORDS_PER_FILE 100
+#define MANY_FILES 37
 
 
 static int read_record(FILE *f, void **buffer, void *ctx)
@@ -110,6 +111,161 @@ static unsigned long check_file_sorted(const char *file_path)
 }
 
 
+/* Many files, not a power of two of them, running out at different times */
+static void test_merge_many_files(void)
+{
+    char names[MANY_FILES][32];
+    const char *source_files[MANY_FILES];
+    const char *dest_file = "merged_file.tmp";
+    unsigned i, num_records = 0;
+    int j;
+    file_merger_error_t ret;
+
+    for (i = 0; i < MANY_FILES; ++i) {
+        FILE *f;
+
+        sprintf(names[i], "sorted_file_many_%u.tmp", i);
+        source_files[i] = names[i];
+        remove(source_files[i]);
+        f = fopen(source_files[i], "ab");
+        assert(f != NULL);
+        for (j = 0; j < (int) (i % 5) * 10; ++j) {
+            int rec = j * MANY_FILES + i;
+            assert(fwrite(&rec, sizeof(rec), 1, f) == 1);
+            num_records += 1;
+        }
+        fclose(f);
+    }
+
+    remove(dest_file);
+    ret = merge_files(source_files, MANY_FILES,
+                      dest_file,
+                      read_record, write_record, NULL, compare_records,
+                      free_record, NULL, 0, 0, 0, NULL);
+
+    assert(ret == FILE_MERGER_SUCCESS);
+    assert(check_file_sorted(dest_file) == num_records);
+
+    for (i = 0; i < MANY_FILES; ++i) {
+        remove(source_files[i]);
+    }
+    remove(dest_file);
+}
+
+
+/* Records of the dedup test: a key, and where the record came from */
+#define DEDUP_KEY(rec) ((rec) / 100)
+#define DEDUP_FILES 5
+#define DEDUP_KEYS 60
+
+static int dedup_resolved;
+
+static int compare_dedup_keys(const void *rec1, const void *rec2, void *ctx)
+{
+    (void) ctx;
+
+    return DEDUP_KEY(*((const int *) rec1)) - DEDUP_KEY(*((const int *) rec2));
+}
+
+/* Keeps the last, checking they come in file order and, within a file, in
+   the file's order */
+static int keep_last(void *records[], unsigned n, void *ctx)
+{
+    unsigned i;
+    (void) ctx;
+
+    assert(n > 1);
+    for (i = 1; i < n; ++i) {
+        assert(compare_dedup_keys(records[i - 1], records[i], NULL) == 0);
+        assert(*((int *) records[i - 1]) < *((int *) records[i]));
+    }
+    dedup_resolved += 1;
+
+    return (int) n - 1;
+}
+
+static int fail_resolve(void *records[], unsigned n, void *ctx)
+{
+    (void) records;
+    (void) n;
+    (void) ctx;
+
+    return FILE_MERGER_ERROR_ALLOC;
+}
+
+/* File i has keys that are multiples of i + 1; the first file holds some
+   of its keys twice. */
+static void test_merge_dedup(void)
+{
+    char names[DEDUP_FILES][32];
+    const char *source_files[DEDUP_FILES];
+    const char *dest_file = "merged_file.tmp";
+    int expected[DEDUP_KEYS];
+    int rec, prev = -1;
+    unsigned i, num_records = 0;
+    int k, resolves = 0;
+    file_merger_error_t ret;
+    FILE *f;
+
+    for (i = 0; i < DEDUP_FILES; ++i) {
+        sprintf(names[i], "sorted_file_dedup_%u.tmp", i);
+        source_files[i] = names[i];
+        remove(source_files[i]);
+        f = fopen(source_files[i], "ab");
+        assert(f != NULL);
+        for (k = 0; k < DEDUP_KEYS; ++k) {
+            if (k % (i + 1) != 0) {
+                continue;
+            }
+            rec = k * 100 + i * 10;
+            assert(fwrite(&rec, sizeof(rec), 1, f) == 1);
+            expected[k] = rec;
+            if (i == 0 && k % 7 == 0) {
+                rec += 1;
+                assert(fwrite(&rec, sizeof(rec), 1, f) == 1);
+                expected[k] = rec;
+            }
+        }
+        fclose(f);
+    }
+    /* Keys held more than once are those of a second file or 7's */
+    for (k = 0; k < DEDUP_KEYS; ++k) {
+        resolves += (k % 2 == 0 || k % 3 == 0 || k % 5 == 0 || k % 7 == 0);
+    }
+
+    remove(dest_file);
+    dedup_resolved = 0;
+    ret = merge_files(source_files, DEDUP_FILES,
+                      dest_file,
+                      read_record, write_record, NULL, compare_dedup_keys,
+                      free_record, keep_last, 0, 0, 0, NULL);
+    assert(ret == FILE_MERGER_SUCCESS);
+    assert(dedup_resolved == resolves);
+
+    f = fopen(dest_file, "rb");
+    assert(f != NULL);
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        assert(DEDUP_KEY(rec) > prev);
+        prev = DEDUP_KEY(rec);
+        assert(rec == expected[prev]);
+        num_records += 1;
+    }
+    fclose(f);
+    assert(num_records == DEDUP_KEYS);
+
+    /* The resolver's error is the merge's */
+    ret = merge_files(source_files, DEDUP_FILES,
+                      dest_file,
+                      read_record, write_record, NULL, compare_dedup_keys,
+                      free_record, fail_resolve, 0, 0, 0, NULL);
+    assert(ret == FILE_MERGER_ERROR_ALLOC);
+
+    for (i = 0; i < DEDUP_FILES; ++i) {
+        remove(source_files[i]);
+    }
+    remove(dest_file);
+}
+
 void file_merger_tests(void)
 {
     const char *source_files[N_FILES] = {
@@ -160,7 +316,7 @@ void file_merger_tests(void)
     ret = merge_files(source_files, N_FILES,
                       dest_file,
                       read_record, write_record, NULL, compare_records,
-                      free_record, 0, NULL);
+                      free_record, NULL, 0, 0, 0, NULL);
 
     assert(ret == FILE_MERGER_SUCCESS);
     assert(check_file_sorted(dest_file) == num_records);
@@ -170,5 +326,8 @@ void file_merger_tests(void)
     }
     remove(dest_file);
 
+    test_merge_many_files();
+    test_merge_dedup();
+
     fprintf(stderr, "Running file merger tests passed\n\n");
 }
@@ -158,6 +158,63 @@ static int read_record(FILE *f, void **buffer, void *ctx)
     return sizeof(int);
 }
 
+static int read_record_slab(FILE *f, void **buffer, arena *slab, void *ctx)
+{
+    int *rec = (int *) arena_alloc(slab, sizeof(int));
+    (void) ctx;
+
+    if (rec == NULL) {
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+
+    if (fread(rec, sizeof(int), 1, f) != 1) {
+        if (feof(f)) {
+            return 0;
+        } else {
+            return FILE_MERGER_ERROR_FILE_READ;
+        }
+    }
+
+    *buffer = rec;
+
+    return sizeof(int);
+}
+
+/* Reads a record followed by a big-endian sort key of its value over 64,
+   leaving dozens of records at a time to tie */
+static int read_keyed_record_slab(FILE *f, void **buffer, arena *slab, void *ctx)
+{
+    int *rec = (int *) arena_alloc(slab, 2 * sizeof(int));
+    (void) ctx;
+
+    if (rec == NULL) {
+        return FILE_MERGER_ERROR_ALLOC;
+    }
+
+    if (fread(rec, sizeof(int), 1, f) != 1) {
+        if (feof(f)) {
+            return 0;
+        } else {
+            return FILE_MERGER_ERROR_FILE_READ;
+        }
+    }
+    rec[1] = (int) htonl((uint32_t) rec[0] >> 6);
+
+    *buffer = rec;
+
+    return sizeof(int);
+}
+
+static int record_sort_key(const void *rec, sized_buf *key, void *ctx)
+{
+    (void) ctx;
+
+    key->buf = (char *) ((const int *) rec + 1);
+    key->size = sizeof(int);
+
+    return 1;
+}
+
 static file_merger_error_t write_record(FILE *f, void *buffer, void *ctx)
 {
     (void) ctx;
@@ -240,9 +297,13 @@ static file_merger_error_t check_sorted_callback(void *buf, void *ctx)
 }
 
 static void test_file_sort(unsigned buffer_size,
+                           unsigned threads,
+                           unsigned io_buffer_size,
+                           int compress,
                            unsigned temp_files,
                            file_merger_feed_record_t callback,
-                           int skip_writeback)
+                           int skip_writeback,
+                           int slab)
 {
     file_sorter_error_t ret;
     int i = 0;
@@ -252,16 +313,64 @@ static void test_file_sort(unsigned buffer_size,
                     SORT_TMP_DIR,
                     temp_files,
                     buffer_size,
+                    threads,
+                    io_buffer_size,
+                    compress,
+                    read_record,
+                    slab ? read_record_slab : NULL,
+                    write_record,
+                    callback,
+                    compare_records,
+                    NULL,
+                    free_record,
+                    skip_writeback,
+                    &i);
+
+    assert(ret == FILE_SORTER_SUCCESS);
+
+    if (!skip_writeback) {
+        assert(check_file_sorted(UNSORTED_FILE_PATH));
+    } else {
+        assert(check_file_sorted(UNSORTED_FILE_PATH) == 0);
+    }
+
+    remove(UNSORTED_FILE_PATH);
+}
+
+
+/* Runs of a few hundred records or more are radix sorted by their keys,
+   written out to temporary files, or fed from memory. */
+static void test_radix_sort(unsigned buffer_size,
+                            unsigned threads,
+                            file_merger_feed_record_t callback,
+                            int skip_writeback)
+{
+    file_sorter_error_t ret;
+    int i = 0;
+    create_file();
+
+    ret = sort_file(UNSORTED_FILE_PATH,
+                    SORT_TMP_DIR,
+                    3,
+                    buffer_size,
+                    threads,
+                    0,
+                    0,
                     read_record,
+                    read_keyed_record_slab,
                     write_record,
                     callback,
                     compare_records,
+                    record_sort_key,
                     free_record,
                     skip_writeback,
                     &i);
 
     assert(ret == FILE_SORTER_SUCCESS);
 
+    if (callback != NULL) {
+        assert(i == (int) (sizeof(data) / sizeof(int)));
+    }
     if (!skip_writeback) {
         assert(check_file_sorted(UNSORTED_FILE_PATH));
     } else {
@@ -272,6 +381,39 @@ static void test_file_sort(unsigned buffer_size,
 }
 
 
+/* Records that fit the budget, fed and not written back, never go to a
+   temporary file: there's no directory for one here. */
+static void test_in_memory_sort(void)
+{
+    file_sorter_error_t ret;
+    int i = 0;
+    create_file();
+
+    ret = sort_file(UNSORTED_FILE_PATH,
+                    "./no-such-dir",
+                    3,
+                    sizeof(int) * 1000000,
+                    2,
+                    0,
+                    0,
+                    read_record,
+                    read_record_slab,
+                    write_record,
+                    check_sorted_callback,
+                    compare_records,
+                    NULL,
+                    free_record,
+                    1,
+                    &i);
+
+    assert(ret == FILE_SORTER_SUCCESS);
+    assert(i == (int) (sizeof(data) / sizeof(int)));
+    assert(check_file_sorted(UNSORTED_FILE_PATH) == 0);
+
+    remove(UNSORTED_FILE_PATH);
+}
+
+
 static int int_cmp(const void *a, const void *b)
 {
     return *((const int *) a) - *((const int *) b);
@@ -293,8 +435,12 @@ void file_sorter_tests(void)
         (sizeof(int) - 1) * 99,
         sizeof(int) * 1000000
     };
+    const unsigned threads[] = {
+        1, 2, 8
+    };
 
-    unsigned i, j;
+    unsigned i, j, k;
+    int compress;
     unsigned long nrecords = (unsigned long) (sizeof(data) / sizeof(int));
 
     fprintf(stderr, "Running file sorter tests...\n");
@@ -306,11 +452,17 @@ void file_sorter_tests(void)
 
     for (i = 0; i < (sizeof(buffer_sizes) / sizeof(unsigned)); ++i) {
         for (j = 0; j < (sizeof(temp_files) / sizeof(unsigned)); ++j) {
-            fprintf(stderr,
-            "Testing file sort (%lu records) with buffer size of %u bytes"
-            " and %u temporary files\n",
-            nrecords, buffer_sizes[i], temp_files[j]);
-            test_file_sort(buffer_sizes[i], temp_files[j], NULL, 0);
+            for (k = 0; k < (sizeof(threads) / sizeof(unsigned)); ++k) {
+                for (compress = 0; compress <= 1; ++compress) {
+                    fprintf(stderr,
+                    "Testing file sort (%lu records) with buffer size of %u bytes,"
+                    " %u threads and %u %stemporary files\n",
+                    nrecords, buffer_sizes[i], threads[k], temp_files[j],
+                    compress ? "compressed " : "");
+                    test_file_sort(buffer_sizes[i], threads[k], 0, compress,
+                                   temp_files[j], NULL, 0, 0);
+                }
+            }
         }
     }
 
@@ -318,26 +470,63 @@ void file_sorter_tests(void)
             "Testing file sort callback (%lu records) with buffer size of %lu bytes"
             " and %u temporary files\n",
             nrecords, sizeof(int) * 501, 3);
-    test_file_sort(sizeof(int) * 501, 3, check_sorted_callback, 0);
+    test_file_sort(sizeof(int) * 501, 2, 0, 0, 3, check_sorted_callback, 0, 0);
 
     fprintf(stderr,
             "Testing file sort callback (%lu records) with buffer size of %lu bytes"
             " and %u temporary files\n",
             nrecords, sizeof(int) * 50, 10);
-    test_file_sort(sizeof(int) * 50, 10, check_sorted_callback, 0);
+    test_file_sort(sizeof(int) * 50, 8, 64, 1, 10, check_sorted_callback, 0, 0);
 
 
     fprintf(stderr,
             "Testing file sort callback with skip writeback (%lu records)"
             "with buffer size of %lu bytes and %u temporary files\n",
             nrecords, sizeof(int) * 501, 3);
-    test_file_sort(sizeof(int) * 501, 3, check_sorted_callback, 1);
+    test_file_sort(sizeof(int) * 501, 2, 0, 0, 3, check_sorted_callback, 1, 0);
 
     fprintf(stderr,
             "Testing file sort callback with skip writeback (%lu records)"
             "with buffer size of %lu bytes and %u temporary files\n",
             nrecords, sizeof(int) * 50, 10);
-    test_file_sort(sizeof(int) * 50, 10, check_sorted_callback, 1);
+    test_file_sort(sizeof(int) * 50, 8, 64, 1, 10, check_sorted_callback, 1, 0);
+
+    fprintf(stderr,
+            "Testing file sort callback (%lu records)"
+            " from a single compressed temporary file\n", nrecords);
+    test_file_sort(sizeof(int) * 1000000, 2, 0, 1, 3, check_sorted_callback, 0, 0);
+
+    for (k = 0; k < (sizeof(threads) / sizeof(unsigned)); ++k) {
+        fprintf(stderr,
+                "Testing file sort (%lu records) read into slabs with buffer"
+                " size of %lu bytes and %u threads\n",
+                nrecords, sizeof(int) * 33, threads[k]);
+        test_file_sort(sizeof(int) * 33, threads[k], 0, 0, 4, NULL, 0, 1);
+    }
+
+    fprintf(stderr,
+            "Testing file sort callback with skip writeback (%lu records)"
+            " read into slabs with buffer size of %lu bytes\n",
+            nrecords, sizeof(int) * 50);
+    test_file_sort(sizeof(int) * 50, 8, 64, 1, 10, check_sorted_callback, 1, 1);
+
+    fprintf(stderr,
+            "Testing file sort callback with skip writeback (%lu records)"
+            " in memory\n", nrecords);
+    test_in_memory_sort();
+
+    for (k = 0; k < (sizeof(threads) / sizeof(unsigned)); ++k) {
+        fprintf(stderr,
+                "Testing radix file sort (%lu records) with buffer size of %lu"
+                " bytes and %u threads\n",
+                nrecords, sizeof(int) * 500 * (threads[k] + 1), threads[k]);
+        test_radix_sort(sizeof(int) * 500 * (threads[k] + 1), threads[k], NULL, 0);
+    }
+
+    fprintf(stderr,
+            "Testing radix file sort callback with skip writeback (%lu records)"
+            " in memory\n", nrecords);
+    test_radix_sort(sizeof(int) * 1000000, 2, check_sorted_callback, 1);
 
     fprintf(stderr, "File sorter tests passed\n\n");
 }
@@ -441,6 +441,278 @@ static void test_map_multiple_emits(void)
 }
 
 
+static void test_map_batch(void)
+{
+    void *context = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(doc, meta) { emit(meta.id, doc.value); }",
+        "function(doc, meta) { if (doc.value != 2) { throw('foobar'); } }"
+    };
+    const mapreduce_json_t docs[] = { doc1, doc2, doc3 };
+    const mapreduce_json_t metas[] = { meta1, meta2, meta3 };
+    const mapreduce_json_t bad_metas[] = { meta1, doc2, meta3 };
+    const char *ids[] = { "\"doc1\"", "\"doc2\"", "\"doc3\"" };
+    const char *values[] = { "1", "2", "3" };
+    mapreduce_map_result_list_t *results = NULL;
+    int i;
+
+    ret = mapreduce_start_map_context(functions, 2, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(context != NULL);
+
+    ret = mapreduce_map_batch(context, docs, metas, 3, &results);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(results != NULL);
+
+    for (i = 0; i < 3; ++i) {
+        assert(results[i].length == 2);
+        assert(results[i].list != NULL);
+
+        assert(results[i].list[0].error == MAPREDUCE_SUCCESS);
+        assert(results[i].list[0].result.kvs.length == 1);
+        assert(results[i].list[0].result.kvs.kvs[0].key.length == (int) strlen(ids[i]));
+        assert(memcmp(results[i].list[0].result.kvs.kvs[0].key.json,
+                      ids[i],
+                      strlen(ids[i])) == 0);
+        assert(results[i].list[0].result.kvs.kvs[0].value.length == (int) strlen(values[i]));
+        assert(memcmp(results[i].list[0].result.kvs.kvs[0].value.json,
+                      values[i],
+                      strlen(values[i])) == 0);
+
+        if (i == 1) {
+            assert(results[i].list[1].error == MAPREDUCE_SUCCESS);
+            assert(results[i].list[1].result.kvs.length == 0);
+        } else {
+            assert(results[i].list[1].error == MAPREDUCE_RUNTIME_ERROR);
+            assert(strcmp("foobar", results[i].list[1].result.error_msg) == 0);
+        }
+    }
+
+    mapreduce_free_map_result_batch(results, 3);
+
+    /* A document whose metadata isn't an object fails the batch */
+    ret = mapreduce_map_batch(context, docs, bad_metas, 3, &results);
+    assert(ret == MAPREDUCE_INVALID_ARG);
+    assert(results == NULL);
+
+    ret = mapreduce_map_batch(context, docs, metas, 0, &results);
+    assert(ret == MAPREDUCE_SUCCESS);
+    mapreduce_free_map_result_batch(results, 0);
+
+    mapreduce_free_context(context);
+}
+
+
+static void test_map_pool(void)
+{
+    void *pool = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(doc, meta) { emit(meta.id, doc.value); }"
+    };
+    enum { NUM_DOCS = 200 };
+    char doc_bufs[NUM_DOCS][32];
+    char meta_bufs[NUM_DOCS][32];
+    mapreduce_json_t docs[NUM_DOCS];
+    mapreduce_json_t metas[NUM_DOCS];
+    mapreduce_map_result_list_t *results = NULL;
+    int i;
+
+    for (i = 0; i < NUM_DOCS; ++i) {
+        docs[i].json = doc_bufs[i];
+        docs[i].length = sprintf(doc_bufs[i], "{\"value\": %d}", i);
+        metas[i].json = meta_bufs[i];
+        metas[i].length = sprintf(meta_bufs[i], "{\"id\":\"doc%d\"}", i);
+    }
+
+    ret = mapreduce_start_map_pool(functions, 1, 0, &pool, &error_msg);
+    assert(ret == MAPREDUCE_INVALID_ARG);
+    mapreduce_free_error_msg(error_msg);
+
+    ret = mapreduce_start_map_pool(functions, 1, 3, &pool, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(pool != NULL);
+
+    ret = mapreduce_map_pool(pool, docs, metas, NUM_DOCS, &results);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(results != NULL);
+
+    /* Results come back in document order */
+    for (i = 0; i < NUM_DOCS; ++i) {
+        char key[32];
+        char value[32];
+        int key_len = sprintf(key, "\"doc%d\"", i);
+        int value_len = sprintf(value, "%d", i);
+
+        assert(results[i].length == 1);
+        assert(results[i].list[0].error == MAPREDUCE_SUCCESS);
+        assert(results[i].list[0].result.kvs.length == 1);
+        assert(results[i].list[0].result.kvs.kvs[0].key.length == key_len);
+        assert(memcmp(results[i].list[0].result.kvs.kvs[0].key.json,
+                      key, key_len) == 0);
+        assert(results[i].list[0].result.kvs.kvs[0].value.length == value_len);
+        assert(memcmp(results[i].list[0].result.kvs.kvs[0].value.json,
+                      value, value_len) == 0);
+    }
+
+    mapreduce_free_map_result_batch(results, NUM_DOCS);
+
+    /* A bad document fails the batch, and the pool carries on */
+    metas[NUM_DOCS / 2] = docs[0];
+    ret = mapreduce_map_pool(pool, docs, metas, NUM_DOCS, &results);
+    assert(ret == MAPREDUCE_INVALID_ARG);
+    assert(results == NULL);
+
+    ret = mapreduce_map_pool(pool, docs, metas, NUM_DOCS / 2, &results);
+    assert(ret == MAPREDUCE_SUCCESS);
+    mapreduce_free_map_result_batch(results, NUM_DOCS / 2);
+
+    mapreduce_free_map_pool(pool);
+}
+
+
+static void test_native_map(void)
+{
+    void *context = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    /* The first two are mapped natively where they can be; the others
+       are the same functions as V8 runs them */
+    const char *functions[] = {
+        "function(doc, meta) { emit(meta.id, doc.value); }",
+        "function(d, m) { emit(d.a.b, null); emit('x', -12); }",
+        "function(doc, meta) { if (true) { emit(meta.id, doc.value); } }",
+        "function(d, m) { if (true) { emit(d.a.b, null); emit('x', -12); } }"
+    };
+    const char *doc_jsons[] = {
+        "{\"value\": 1, \"a\": {\"b\": \"foo\"}}",
+        "{\"value\": \"two\", \"value\": true, \"a\": {}}",
+        "{\"value\": 3.50, \"a\": {\"b\": [1, 2]}}",
+        "{\"value\": \"\\u0066\\n\", \"a\": 1}",
+        "{\"value\": 1e3, \"a\": {\"b\": {\"c\" : null}}}",
+        "{\"value\": -0, \"a\": {\"\\u0062\": 12345678901234567890}}",
+        "{}"
+    };
+    mapreduce_map_result_list_t *result = NULL;
+    int i, j, k;
+
+    ret = mapreduce_start_map_context(functions, 4, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+
+    for (i = 0; i < (int) (sizeof(doc_jsons) / sizeof(doc_jsons[0])); ++i) {
+        mapreduce_json_t doc;
+
+        doc.json = (char *) doc_jsons[i];
+        doc.length = strlen(doc_jsons[i]);
+        ret = mapreduce_map(context, &doc, &meta1, &result);
+        assert(ret == MAPREDUCE_SUCCESS);
+        assert(result->length == 4);
+
+        for (j = 0; j < 2; ++j) {
+            const mapreduce_map_result_t *native = &result->list[j];
+            const mapreduce_map_result_t *v8 = &result->list[j + 2];
+
+            assert(native->error == v8->error);
+            if (v8->error != MAPREDUCE_SUCCESS) {
+                assert(strcmp(native->result.error_msg, v8->result.error_msg) == 0);
+                continue;
+            }
+            assert(native->result.kvs.length == v8->result.kvs.length);
+            for (k = 0; k < v8->result.kvs.length; ++k) {
+                const mapreduce_kv_t *a = &native->result.kvs.kvs[k];
+                const mapreduce_kv_t *b = &v8->result.kvs.kvs[k];
+
+                assert(a->key.length == b->key.length);
+                assert(memcmp(a->key.json, b->key.json, b->key.length) == 0);
+                assert(a->value.length == b->value.length);
+                assert(memcmp(a->value.json, b->value.json, b->value.length) == 0);
+            }
+        }
+        mapreduce_free_map_result_list(result);
+    }
+
+    mapreduce_free_context(context);
+}
+
+
+/* Lazy documents map to just what parsed ones do */
+static void test_lazy_docs(void)
+{
+    void *context = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(doc, meta) { if (meta.id) { emit(meta.id, null); } }",
+        "function(doc, meta) { if (doc.b) { emit(doc.b, doc.a); } }",
+        "function(doc, meta) { var x = doc.b; emit(JSON.stringify(doc), x); }",
+        "function(doc, meta) { doc.a.x = 1; doc.c = 2; emit(doc, 'c' in doc); }",
+        "function(doc, meta) { emit(Object.keys(doc), doc.z === undefined); }",
+        "function(doc, meta) { emit(doc.a, doc.b); emit(doc.a, doc.b); emit(doc.c, doc); }",
+        "function(doc, meta) { delete doc.a; emit(doc.toString(), doc); }"
+    };
+    const char *doc_jsons[] = {
+        "{\"a\": {\"y\": [1, 2]}, \"b\": \"foo\"}",
+        "{\"b\": 1, \"a\": {}, \"b\": true}",
+        "{\"a\": {\"\\u0062\": 1}, \"c\": null, \"b\": 3.50}",
+        "{\"0\": 1, \"a\": {}}",
+        "{\"a\": {}, \"\\u0062\": 1}",
+        "[1, 2]",
+        "{}"
+    };
+    mapreduce_map_result_list_t *results[2];
+    int num_functions = (int) (sizeof(functions) / sizeof(functions[0]));
+    int i, j, k, lazy;
+
+    ret = mapreduce_start_map_context(functions, num_functions, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+
+    for (i = 0; i < (int) (sizeof(doc_jsons) / sizeof(doc_jsons[0])); ++i) {
+        mapreduce_json_t doc;
+
+        doc.json = (char *) doc_jsons[i];
+        doc.length = strlen(doc_jsons[i]);
+        for (lazy = 0; lazy < 2; ++lazy) {
+            mapreduce_set_lazy_docs(lazy);
+            ret = mapreduce_map(context, &doc, &meta1, &results[lazy]);
+            assert(ret == MAPREDUCE_SUCCESS);
+            assert(results[lazy]->length == num_functions);
+        }
+
+        for (j = 0; j < num_functions; ++j) {
+            const mapreduce_map_result_t *eager = &results[0]->list[j];
+            const mapreduce_map_result_t *deferred = &results[1]->list[j];
+
+            assert(deferred->error == eager->error);
+            if (eager->error != MAPREDUCE_SUCCESS) {
+                continue;
+            }
+            assert(deferred->result.kvs.length == eager->result.kvs.length);
+            for (k = 0; k < eager->result.kvs.length; ++k) {
+                const mapreduce_kv_t *a = &deferred->result.kvs.kvs[k];
+                const mapreduce_kv_t *b = &eager->result.kvs.kvs[k];
+
+                assert(a->key.length == b->key.length);
+                assert(memcmp(a->key.json, b->key.json, b->key.length) == 0);
+                assert(a->value.length == b->value.length);
+                assert(memcmp(a->value.json, b->value.json, b->value.length) == 0);
+            }
+        }
+        mapreduce_free_map_result_list(results[0]);
+        mapreduce_free_map_result_list(results[1]);
+    }
+
+    mapreduce_set_lazy_docs(0);
+    mapreduce_free_context(context);
+}
+
+
 static void test_timeout(void)
 {
     void *context = NULL;
@@ -503,6 +775,13 @@ void map_tests(void)
         test_map_no_emit();
         test_map_single_emit();
         test_map_multiple_emits();
+        test_map_batch();
+        test_native_map();
+        test_lazy_docs();
+    }
+
+    for (i = 0; i < 10; ++i) {
+        test_map_pool();
     }
 
     test_timeout();
@@ -311,6 +311,68 @@ static void test_reduce_and_rereduce_success(void)
     free_json_list(values);
 }
 
+static void test_rereduce_of_reductions(void)
+{
+    void *context = NULL;
+    char *error_msg = NULL;
+    mapreduce_error_t ret;
+    const char *functions[] = {
+        "function(key, values, rereduce) {"
+        "  if (rereduce) {"
+        "    var r = values[0];"
+        "    for (var i = 1; i < values.length; ++i) {"
+        "      r.count += values[i].count;"
+        "      r.sum += values[i].sum;"
+        "    }"
+        "    return r;"
+        "  } else {"
+        "    return {count: values.length, sum: sum(values)};"
+        "  }"
+        "}"
+    };
+    const char *expected_reduction = "{\"count\":4,\"sum\":110}";
+    const char *expected_rereduction = "{\"count\":8,\"sum\":220}";
+    mapreduce_json_list_t *keys = all_keys();
+    mapreduce_json_list_t *values = all_values();
+    mapreduce_json_t *reduction = NULL;
+    mapreduce_json_t *rereduction = NULL;
+    mapreduce_json_t reductions[2];
+    mapreduce_json_list_t reductions_list;
+
+    ret = mapreduce_start_reduce_context(functions, 1, &context, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+
+    ret = mapreduce_reduce(context, 1, keys, values, &reduction, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(reduction->length == strlen(expected_reduction));
+    assert(memcmp(reduction->json, expected_reduction, reduction->length) == 0);
+
+    /* The same reduction twice, as its rereduce modifies the first one */
+    reductions[0] = *reduction;
+    reductions[1] = *reduction;
+    reductions_list.values = reductions;
+    reductions_list.length = 2;
+
+    ret = mapreduce_rereduce(context, 1, &reductions_list, &rereduction, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(error_msg == NULL);
+    assert(rereduction->length == strlen(expected_rereduction));
+    assert(memcmp(rereduction->json, expected_rereduction, rereduction->length) == 0);
+    mapreduce_free_json(rereduction);
+
+    ret = mapreduce_rereduce(context, 1, &reductions_list, &rereduction, &error_msg);
+    assert(ret == MAPREDUCE_SUCCESS);
+    assert(rereduction->length == strlen(expected_rereduction));
+    assert(memcmp(rereduction->json, expected_rereduction, rereduction->length) == 0);
+    mapreduce_free_json(rereduction);
+
+    mapreduce_free_json(reduction);
+    mapreduce_free_context(context);
+    free_json_list(keys);
+    free_json_list(values);
+}
+
 static void test_timeout(void)
 {
     void *context = NULL;
@@ -416,6 +478,7 @@ void reduce_tests(void)
         test_runtime_error();
         test_reduce_emits();
         test_reduce_and_rereduce_success();
+        test_rereduce_of_reductions();
     }
 
     test_timeout();
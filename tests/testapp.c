@@ -3,15 +3,26 @@
 #include <libcouchstore/couch_db.h>
 #include "../src/fatbuf.h"
 #include "../src/internal.h"
+#include "../src/couch_btree.h"
+#include "../src/crc32.h"
 #include "../src/node_types.h"
+#include "../src/node_cache.h"
+#include "../src/bloom_filter.h"
+#include "../src/delta_buffer.h"
 #include "../src/reduces.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "macros.h"
 #include "file_tests.h"
 
+/* From src/util.h, whose error macros clash with the ones in macros.h */
+int ebin_cmp(const sized_buf *e1, const sized_buf *e2);
+
 extern void mapreduce_tests();
 extern void view_tests();
 extern void purge_tests();
@@ -527,6 +538,86 @@ cleanup:
     assert(errcode == 0);
 }
 
+static void set_local_doc(LocalDoc *doc, const char *id, const char *json)
+{
+    doc->id.buf = (char *)id;
+    doc->id.size = strlen(id);
+    doc->json.buf = (char *)json;
+    doc->json.size = json ? strlen(json) : 0;
+    doc->deleted = json == NULL;
+}
+
+static void check_local_doc(Db *db, const char *id, const char *json)
+{
+    LocalDoc *doc = NULL;
+    couchstore_error_t errcode = couchstore_open_local_document(db, id, strlen(id), &doc);
+    if (json == NULL) {
+        assert(errcode == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+        return;
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+    assert(doc->json.size == strlen(json));
+    assert(memcmp(doc->json.buf, json, doc->json.size) == 0);
+    couchstore_free_local_document(doc);
+}
+
+static void test_local_doc_cache(void)
+{
+    couchstore_error_t errcode;
+    couchstore_io_stats stats;
+    couchstore_memory_stats mem;
+    Db *db = NULL;
+    LocalDoc doc;
+
+    fprintf(stderr, "local doc cache... ");
+    fflush(stderr);
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    set_local_doc(&doc, "_local/vbstate", "{\"state\":\"active\"}");
+    try(couchstore_save_local_document(db, &doc));
+    set_local_doc(&doc, "_local/other", "{\"n\":1}");
+    try(couchstore_save_local_document(db, &doc));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    // The first read goes to the tree, the next ones don't.
+    try(couchstore_open_db(testfilepath, 0, &db));
+    check_local_doc(db, "_local/vbstate", "{\"state\":\"active\"}");
+    couchstore_get_memory_stats(db, &mem);
+    assert(mem.local_docs > 0);
+    couchstore_reset_io_stats(db);
+    check_local_doc(db, "_local/vbstate", "{\"state\":\"active\"}");
+    couchstore_get_io_stats(db, &stats);
+    assert(stats.buffer_hits + stats.buffer_misses == 0);
+
+    // Saves replace what's cached, and keep the rest of it.
+    set_local_doc(&doc, "_local/vbstate", "{\"state\":\"replica\"}");
+    try(couchstore_save_local_document(db, &doc));
+    couchstore_reset_io_stats(db);
+    check_local_doc(db, "_local/vbstate", "{\"state\":\"replica\"}");
+    couchstore_get_io_stats(db, &stats);
+    assert(stats.buffer_hits + stats.buffer_misses == 0);
+    try(couchstore_commit(db));
+    set_local_doc(&doc, "_local/vbstate", NULL);
+    try(couchstore_save_local_document(db, &doc));
+    check_local_doc(db, "_local/vbstate", NULL);
+    check_local_doc(db, "_local/other", "{\"n\":1}");
+    try(couchstore_commit(db));
+
+    // Going back to an older header goes back to its documents.
+    try(couchstore_rewind_db_header(db));
+    check_local_doc(db, "_local/vbstate", "{\"state\":\"replica\"}");
+    try(couchstore_rewind_db_header(db));
+    check_local_doc(db, "_local/vbstate", "{\"state\":\"active\"}");
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
 static void test_open_file_error(void)
 {
     Db *db = NULL;
@@ -781,62 +872,5573 @@ cleanup:
    assert(errcode == COUCHSTORE_SUCCESS);
 }
 
-int main(int argc, const char *argv[])
+static void test_io_uring_file_ops(void)
 {
-    int doc_counts[] = { 4, 69, 666, 9090 };
-    unsigned i;
-    const char *small_doc_tpl = "{\"test_doc_index\":%d}";
-    const char *large_doc_tpl =
-        "{"
-        "\"test_doc_index\":%d,"
-        "\"field1\": \"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\","
-        "\"field2\": \"bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb\","
-        "\"field3\": \"cccccccccccccccccccccccccccccccccccccccccccccccccc"
-        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
-        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
-        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
-        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
-        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
-        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc\""
-        "}";
+    couchstore_error_t errcode;
+    const couch_file_ops *ops = couchstore_get_io_uring_file_ops();
+    Db* db = NULL;
+    Doc d;
+    DocInfo i;
+    Doc* rd;
+    couchstore_error_info_t errinfo;
+    couch_file_handle handle = NULL;
+    char buf[8];
 
-    file_merger_tests();
-    file_sorter_tests();
+    fprintf(stderr, "io_uring file ops.... ");
+    fflush(stderr);
 
-    if (argc > 1)
-        strcpy(testfilepath, argv[1]);
-    printf("Using test database at %s\n", testfilepath);
+    if (ops == NULL) {
+        fprintf(stderr, "(not available) ");
+        return;
+    }
 
-    test_bitfield_fns();
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE,
+                              ops, &db));
+    setdoc(&d, &i, "test", 4, "foo", 3, NULL, 0);
+    try(couchstore_save_document(db, &d, &i, 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
 
-    test_open_file_error();
-    fprintf(stderr, "OK \n");
-    test_dump_empty_db();
-    fprintf(stderr, " OK\n");
-    test_save_doc();
-    fprintf(stderr, " OK\n");
-    for (i = 0; i < (sizeof(doc_counts) / sizeof(int)); ++i) {
-        test_save_docs(doc_counts[i], small_doc_tpl);
-        fprintf(stderr, " OK\n");
-        test_save_docs(doc_counts[i], large_doc_tpl);
-        fprintf(stderr, " OK\n");
-    }
-    test_local_docs();
-    fprintf(stderr, " OK\n");
-    test_compressed_doc_body();
-    fprintf(stderr, " OK\n");
-    test_changes_no_dups();
-    fprintf(stderr, " OK\n");
-    mb5086();
-    fprintf(stderr, " OK\n");
-    remove(testfilepath);
-    test_huge_revseq();
-    fprintf(stderr, " OK\n");
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY,
+                              ops, &db));
+    try(couchstore_open_document(db, "test", 4, &rd, 0));
+    assert(rd->data.size == 3);
+    assert(memcmp(rd->data.buf, "foo", 3) == 0);
+    couchstore_free_document(rd);
+
+    /* Writes wait in the queue until a read of what they cover, the size
+       of the file or a sync needs them, overwrites landing in order */
     remove(testfilepath);
-    test_asis_seqs();
-    fprintf(stderr, " OK\n");
+    handle = ops->constructor(&errinfo, NULL);
+    try(ops->open(&errinfo, &handle, testfilepath, O_RDWR | O_CREAT));
+    assert(ops->pwrite(&errinfo, handle, "abcd", 4, 0) == 4);
+    assert(ops->pwrite(&errinfo, handle, "efgh", 4, 4) == 4);
+    assert(ops->pwrite(&errinfo, handle, "XY", 2, 2) == 2);
+    assert(ops->goto_eof(&errinfo, handle) == 8);
+    assert(ops->pread(&errinfo, handle, buf, 8, 0) == 8);
+    assert(memcmp(buf, "abXYefgh", 8) == 0);
+    assert(ops->pwrite(&errinfo, handle, "ij", 2, 8) == 2);
+    try(ops->sync(&errinfo, handle));
+    assert(ops->pread(&errinfo, handle, buf, 4, 6) == 4);
+    assert(memcmp(buf, "ghij", 4) == 0);
+
+cleanup:
+    if (handle != NULL) {
+        ops->close(&errinfo, handle);
+        ops->destructor(&errinfo, handle);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_mmap_read(void)
+{
+    couchstore_error_t errcode;
+    Db* db = NULL;
+    Doc d[2];
+    DocInfo i[2];
+    Doc *dp[2] = { &d[0], &d[1] };
+    DocInfo *ip[2] = { &i[0], &i[1] };
+    Doc* rd;
+    char *large = malloc(3 * COUCH_BLOCK_SIZE);
+    int n;
+
+    fprintf(stderr, "mmap read.... ");
+    fflush(stderr);
+
+    assert(large != NULL);
+    for (n = 0; n < 3 * COUCH_BLOCK_SIZE; ++n) {
+        large[n] = 'a' + (n % 26);
+    }
+
+    /* A writable database can't be mapped */
+    assert(couchstore_open_db(testfilepath,
+                              COUCHSTORE_OPEN_FLAG_CREATE | COUCHSTORE_OPEN_FLAG_MMAP,
+                              &db) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    db = NULL;
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    setdoc(&d[0], &i[0], "small", 5, "foo", 3, NULL, 0);
+    setdoc(&d[1], &i[1], "large", 5, large, 3 * COUCH_BLOCK_SIZE, NULL, 0);
+    try(couchstore_save_documents(db, dp, ip, 2, 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db(testfilepath,
+                           COUCHSTORE_OPEN_FLAG_RDONLY | COUCHSTORE_OPEN_FLAG_MMAP,
+                           &db));
+    try(couchstore_open_document(db, "small", 5, &rd, 0));
+    assert(rd->data.size == 3);
+    assert(memcmp(rd->data.buf, "foo", 3) == 0);
+    couchstore_free_document(rd);
+    try(couchstore_open_document(db, "large", 5, &rd, 0));
+    assert(rd->data.size == 3 * COUCH_BLOCK_SIZE);
+    assert(memcmp(rd->data.buf, large, 3 * COUCH_BLOCK_SIZE) == 0);
+    couchstore_free_document(rd);
+
+    try(couchstore_drop_file(db));
+    try(couchstore_reopen_file(db, testfilepath,
+                               COUCHSTORE_OPEN_FLAG_RDONLY | COUCHSTORE_OPEN_FLAG_MMAP));
+    try(couchstore_open_document(db, "small", 5, &rd, 0));
+    assert(rd->data.size == 3);
+    couchstore_free_document(rd);
+
+cleanup:
+    free(large);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int read_doc_cb(Db *db, DocInfo *info, void *ctx)
+{
+    Doc *doc;
+    int *count = ctx;
+    assert(couchstore_open_doc_with_docinfo(db, info, &doc, 0) == COUCHSTORE_SUCCESS);
+    couchstore_free_document(doc);
+    ++*count;
+    return 0;
+}
+
+static void test_block_cache(void)
+{
+    couchstore_error_t errcode;
+    couchstore_block_cache *cache = NULL;
+    couchstore_block_cache *tiny = NULL;
+    couchstore_block_cache_stats stats;
+    Db *db = NULL, *db2 = NULL;
+    Doc *docs = calloc(2000, sizeof(Doc));
+    DocInfo *infos = calloc(2000, sizeof(DocInfo));
+    Doc **docp = calloc(2000, sizeof(Doc *));
+    DocInfo **infop = calloc(2000, sizeof(DocInfo *));
+    char *ids = malloc(2000 * 16);
+    char *bodies = malloc(2000 * 64);
+    uint64_t misses;
+    int i, count;
+
+    fprintf(stderr, "block cache.... ");
+    fflush(stderr);
+
+    assert(couchstore_block_cache_create(COUCH_BLOCK_SIZE, 4, &cache) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    try(couchstore_block_cache_create(4 * 1024 * 1024, 4, &cache));
+    try(couchstore_block_cache_create(16 * COUCH_BLOCK_SIZE, 1, &tiny));
+
+    assert(docs && infos && docp && infop && ids && bodies);
+    for (i = 0; i < 2000; ++i) {
+        char *id = ids + i * 16;
+        char *body = bodies + i * 64;
+        int idlen = sprintf(id, "doc%d", i);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%030d\"}", i, i);
+        setdoc(&docs[i], &infos[i], id, idlen, body, bodylen, NULL, 0);
+        docp[i] = &docs[i];
+        infop[i] = &infos[i];
+    }
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_save_documents(db, docp, infop, 2000, 0));
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* First handle populates the cache */
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    try(couchstore_set_block_cache(db, cache));
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, read_doc_cb, &count));
+    assert(count == 2000);
+    couchstore_block_cache_get_stats(cache, &stats);
+    assert(stats.misses > 0);
+    assert(stats.size > 0 && stats.size <= stats.capacity);
+    misses = stats.misses;
+
+    /* A second handle on the same file is served from it */
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db2));
+    try(couchstore_set_block_cache(db2, cache));
+    count = 0;
+    try(couchstore_changes_since(db2, 0, 0, read_doc_cb, &count));
+    assert(count == 2000);
+    couchstore_block_cache_get_stats(cache, &stats);
+    assert(stats.hits > 0);
+    assert(stats.misses == misses);
+    assert(stats.evictions == 0);
+
+    /* The attachment survives dropping and reopening the file */
+    try(couchstore_drop_file(db2));
+    try(couchstore_reopen_file(db2, testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY));
+    count = 0;
+    try(couchstore_changes_since(db2, 0, 0, read_doc_cb, &count));
+    assert(count == 2000);
+    couchstore_block_cache_get_stats(cache, &stats);
+    /* Only the header block, first read through the cache by the reopen */
+    assert(stats.misses == misses + 1);
+
+    /* A cache smaller than the file has to evict */
+    try(couchstore_set_block_cache(db2, tiny));
+    count = 0;
+    try(couchstore_changes_since(db2, 0, 0, read_doc_cb, &count));
+    assert(count == 2000);
+    couchstore_block_cache_get_stats(tiny, &stats);
+    assert(stats.evictions > 0);
+    assert(stats.size == stats.capacity);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (db2 != NULL) {
+        couchstore_close_db(db2);
+    }
+    couchstore_block_cache_destroy(cache);
+    couchstore_block_cache_destroy(tiny);
+    free(docs);
+    free(infos);
+    free(docp);
+    free(infop);
+    free(ids);
+    free(bodies);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_buffer_options(void)
+{
+    couchstore_error_t errcode;
+    couchstore_buffer_options tiny = { 512, 2, 256 };
+    couchstore_buffer_options large = { 64 * 1024, 16, 4 * 1024 * 1024 };
+    Db *db = NULL;
+    Doc d;
+    DocInfo info;
+    Doc *rd;
+    char id[32], body[64];
+    int i, count;
+
+    fprintf(stderr, "buffer options.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_buffer_options(db, &tiny));
+    for (i = 0; i < 500; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        int bodylen = sprintf(body, "{\"value\": %d}", i);
+        setdoc(&d, &info, id, idlen, body, bodylen, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+        if (i == 250) {
+            /* Resizing flushes whatever is still buffered */
+            try(couchstore_set_buffer_options(db, &large));
+        }
+    }
+    try(couchstore_commit(db));
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, read_doc_cb, &count));
+    assert(count == 500);
+
+    /* The sizes survive reopening the file */
+    try(couchstore_drop_file(db));
+    try(couchstore_set_buffer_options(db, &tiny));
+    try(couchstore_reopen_file(db, testfilepath, 0));
+    assert(db->file.buffer_options.read_buffer_capacity == 512);
+    try(couchstore_open_document(db, "doc499", 6, &rd, 0));
+    assert(rd->data.size == strlen("{\"value\": 499}"));
+    couchstore_free_document(rd);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, read_doc_cb, &count));
+    assert(count == 500);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int check_numbered_doc_cb(Db *db, DocInfo *info, void *ctx)
+{
+    Doc *doc;
+    char id[32];
+    char expected[160];
+    int n, len;
+    int *count = ctx;
+
+    assert(info->id.size < sizeof(id));
+    memcpy(id, info->id.buf, info->id.size);
+    id[info->id.size] = 0;
+    assert(sscanf(id, "doc%d", &n) == 1);
+    len = sprintf(expected, "{\"value\": %d, \"padding\": \"%0100d\"}", n, n);
+    assert(couchstore_open_doc_with_docinfo(db, info, &doc, DECOMPRESS_DOC_BODIES) == COUCHSTORE_SUCCESS);
+    assert(doc->data.size == (size_t)len);
+    assert(memcmp(doc->data.buf, expected, len) == 0);
+    couchstore_free_document(doc);
+    ++*count;
+    return 0;
+}
+
+static void test_readahead(void)
+{
+    couchstore_error_t errcode;
+    couchstore_buffer_options options = { 0, 0, 0, 256 * 1024, 1 };
+    couchstore_buffer_options disabled = { 0, 0, 0, 1, 0 };
+    Db *db = NULL;
+    Doc d;
+    DocInfo info;
+    char id[32], body[160];
+    int i, count;
+
+    fprintf(stderr, "sequential read-ahead.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < 3000; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", i, i);
+        setdoc(&d, &info, id, idlen, body, bodylen, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+        if (i % 100 == 0) {
+            try(couchstore_commit(db));
+        }
+    }
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    try(couchstore_set_buffer_options(db, &options));
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 3000);
+    count = 0;
+    try(couchstore_all_docs(db, NULL, 0, check_numbered_doc_cb, &count));
+    assert(count == 3000);
+
+    try(couchstore_set_buffer_options(db, &disabled));
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 3000);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void save_numbered_docs(Db *db, int first, int n)
+{
+    couchstore_error_t errcode;
+    Doc d;
+    DocInfo info;
+    char id[32], body[160];
+    int i;
+
+    for (i = first; i < first + n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", i, i);
+        setdoc(&d, &info, id, idlen, body, bodylen, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+        if (i % 100 == 0) {
+            try(couchstore_commit(db));
+        }
+    }
+    try(couchstore_commit(db));
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_direct_file_ops(void)
+{
+    couchstore_error_t errcode;
+    const couch_file_ops *ops = couchstore_get_direct_file_ops();
+    char target[1024];
+    Db *db = NULL;
+    cs_off_t end;
+    FILE *fp;
+    int count;
+
+    fprintf(stderr, "direct I/O file ops.... ");
+    fflush(stderr);
+
+    if (ops == NULL) {
+        fprintf(stderr, "(not available) ");
+        return;
+    }
+    sprintf(target, "%s.compact", testfilepath);
+
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE,
+                              ops, &db));
+    save_numbered_docs(db, 0, 1000);
+    end = db->file.pos;
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Block padding is trimmed off again on close */
+    fp = fopen(testfilepath, "rb");
+    assert(fp != NULL);
+    fseek(fp, 0, SEEK_END);
+    assert(ftell(fp) == end);
+    fclose(fp);
+
+    /* Appending read-modify-writes the partial last block */
+    try(couchstore_open_db_ex(testfilepath, 0, ops, &db));
+    save_numbered_docs(db, 1000, 10);
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 1010);
+
+    try(couchstore_compact_db_ex(db, target, 0, NULL, NULL, ops));
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db_ex(target, COUCHSTORE_OPEN_FLAG_RDONLY, ops, &db));
+    count = 0;
+    try(couchstore_all_docs(db, NULL, 0, check_numbered_doc_cb, &count));
+    assert(count == 1010);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(target);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_large_docs(const couch_file_ops *ops)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    Doc d;
+    DocInfo info;
+    Doc *rd;
+    char id[32];
+    size_t sizes[] = { 10, 4095, 4096, 100 * 1024, 300 * 1024 + 7 };
+    size_t i, j;
+    char *body = malloc(sizes[4]);
+
+    assert(body != NULL);
+    for (j = 0; j < sizes[4]; ++j) {
+        body[j] = 'a' + (j % 23);
+    }
+
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, ops, &db));
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        int idlen = sprintf(id, "doc%d", (int)i);
+        setdoc(&d, &info, id, idlen, body, sizes[i], NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+    }
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        int idlen = sprintf(id, "doc%d", (int)i);
+        try(couchstore_open_document(db, id, idlen, &rd, 0));
+        assert(rd->data.size == sizes[i]);
+        assert(memcmp(rd->data.buf, body, sizes[i]) == 0);
+        couchstore_free_document(rd);
+    }
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    free(body);
     remove(testfilepath);
-    test_dropped_handle();
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_vectored_writes(void)
+{
+    couch_file_ops v5_ops;
+
+    fprintf(stderr, "vectored writes.... ");
+    fflush(stderr);
+
+    check_large_docs(couchstore_get_default_file_ops());
+    if (couchstore_get_io_uring_file_ops() != NULL) {
+        check_large_docs(couchstore_get_io_uring_file_ops());
+    }
+
+    /* Version 5 ops have no pwritev, and are written one chunk at a time */
+    memcpy(&v5_ops, couchstore_get_default_file_ops(), sizeof(v5_ops));
+    v5_ops.version = 5;
+    check_large_docs(&v5_ops);
+}
+
+typedef struct {
+    int called;
+    couchstore_error_t result;
+} commit_result;
+
+static void record_commit_cb(Db *db, couchstore_error_t result, void *ctx)
+{
+    commit_result *r = ctx;
+    (void)db;
+    r->called++;
+    r->result = result;
+}
+
+static void test_group_commit(void)
+{
+    couchstore_error_t errcode;
+    couchstore_commit_group *group = NULL;
+    couchstore_commit_group_stats stats;
+    Db *dbs[8] = { NULL };
+    commit_result results[8];
+    char path[1024], id[32];
+    Doc d;
+    DocInfo info;
+    Doc *rd;
+    int i, round;
+
+    fprintf(stderr, "group commit.... ");
+    fflush(stderr);
+
+    memset(results, 0, sizeof(results));
+    for (i = 0; i < 8; ++i) {
+        sprintf(path, "%s.%d", testfilepath, i);
+        remove(path);
+        try(couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_CREATE, &dbs[i]));
+    }
+
+    try(couchstore_commit_group_create(50, 2, &group));
+    for (round = 0; round < 2; ++round) {
+        for (i = 0; i < 8; ++i) {
+            int idlen = sprintf(id, "doc%d", round);
+            setdoc(&d, &info, id, idlen, "{\"a\":1}", 7, NULL, 0);
+            try(couchstore_save_document(dbs[i], &d, &info, 0));
+            try(couchstore_commit_async(group, dbs[i], record_commit_cb, &results[i]));
+        }
+        if (round == 0) {
+            /* A Db can't be queued again until its commit completes */
+            do {
+                couchstore_commit_group_get_stats(group, &stats);
+            } while (stats.commits < 8);
+            assert(stats.batches < 8);
+        }
+    }
+    /* Destroying the group waits for what's queued */
+    couchstore_commit_group_destroy(group);
+    group = NULL;
+
+    for (i = 0; i < 8; ++i) {
+        assert(results[i].called == 2);
+        assert(results[i].result == COUCHSTORE_SUCCESS);
+        couchstore_close_db(dbs[i]);
+        dbs[i] = NULL;
+
+        sprintf(path, "%s.%d", testfilepath, i);
+        try(couchstore_open_db(path, COUCHSTORE_OPEN_FLAG_RDONLY, &dbs[i]));
+        try(couchstore_open_document(dbs[i], "doc1", 4, &rd, 0));
+        couchstore_free_document(rd);
+    }
+
+cleanup:
+    couchstore_commit_group_destroy(group);
+    for (i = 0; i < 8; ++i) {
+        if (dbs[i] != NULL) {
+            couchstore_close_db(dbs[i]);
+        }
+        sprintf(path, "%s.%d", testfilepath, i);
+        remove(path);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_relaxed_durability(void)
+{
+    couchstore_error_t errcode;
+    couchstore_relaxed_durability relaxed;
+    Db *db = NULL;
+    Db *other = NULL;
+    Doc d;
+    DocInfo info;
+    Doc *rd;
+    char id[32];
+    uint64_t pos, seq, durable_pos, durable_seq;
+    int i;
+
+    fprintf(stderr, "relaxed durability.... ");
+    fflush(stderr);
+
+    /* Only files with header hints can say which header is durable */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    relaxed.interval_ms = 20;
+    relaxed.max_bytes = 0;
+    assert(couchstore_set_relaxed_durability(db, &relaxed) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    couchstore_close_db(db);
+    db = NULL;
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                           COUCHSTORE_OPEN_FLAG_HEADER_HINTS, &db));
+    couchstore_get_durable_header(db, &durable_pos, &durable_seq);
+    assert(durable_pos == couchstore_get_header_position(db));
+    relaxed.interval_ms = 20;
+    relaxed.max_bytes = 0;
+    try(couchstore_set_relaxed_durability(db, &relaxed));
+
+    /* Commits return before they're synced, and are synced after */
+    for (i = 0; i < 10; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        setdoc(&d, &info, id, idlen, "{\"a\":1}", 7, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+        try(couchstore_commit(db));
+    }
+    pos = couchstore_get_header_position(db);
+    seq = db->header.update_seq;
+    try(couchstore_wait_durable(db, pos));
+    couchstore_get_durable_header(db, &durable_pos, &durable_seq);
+    assert(durable_pos == pos && durable_seq == seq);
+    assert(couchstore_wait_durable(db, pos + 1) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    /* Enough written syncs without waiting out the interval */
+    relaxed.interval_ms = 60000;
+    relaxed.max_bytes = 1;
+    try(couchstore_set_relaxed_durability(db, &relaxed));
+    setdoc(&d, &info, "doc10", 5, "{\"a\":1}", 7, NULL, 0);
+    try(couchstore_save_document(db, &d, &info, 0));
+    try(couchstore_commit(db));
+    try(couchstore_wait_durable(db, couchstore_get_header_position(db)));
+
+    /* Opening the file goes to the newest header synced, not a later one
+       whose data may not be on disk */
+    relaxed.max_bytes = 0;
+    try(couchstore_set_relaxed_durability(db, &relaxed));
+    couchstore_get_durable_header(db, &durable_pos, &durable_seq);
+    setdoc(&d, &info, "doc12", 5, "{\"a\":1}", 7, NULL, 0);
+    try(couchstore_save_document(db, &d, &info, 0));
+    try(couchstore_commit(db));
+    couchstore_get_durable_header(db, &pos, &seq);
+    assert(pos == durable_pos && pos < couchstore_get_header_position(db));
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &other));
+    assert(couchstore_get_header_position(other) == durable_pos);
+    assert(other->header.update_seq == durable_seq);
+    couchstore_close_db(other);
+    other = NULL;
+
+    /* Closing syncs what's left */
+    setdoc(&d, &info, "doc11", 5, "{\"a\":1}", 7, NULL, 0);
+    relaxed.max_bytes = 0;
+    try(couchstore_set_relaxed_durability(db, &relaxed));
+    try(couchstore_save_document(db, &d, &info, 0));
+    try(couchstore_commit(db));
+    seq = db->header.update_seq;
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    assert(db->header.update_seq == seq);
+    try(couchstore_open_document(db, "doc11", 5, &rd, 0));
+    couchstore_free_document(rd);
+    try(couchstore_open_document(db, "doc12", 5, &rd, 0));
+    couchstore_free_document(rd);
+    assert(couchstore_set_relaxed_durability(db, &relaxed) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    if (other != NULL) {
+        couchstore_close_db(other);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    DocInfo *infos[300];
+    unsigned count;
+} docinfo_list;
+
+static int keep_docinfo_cb(Db *db, DocInfo *info, void *ctx)
+{
+    docinfo_list *list = ctx;
+    (void)db;
+    list->infos[list->count++] = info;
+    return 1;
+}
+
+static void test_open_docs_batched(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    Doc d;
+    DocInfo info;
+    Doc *docs[300];
+    sized_buf ids[300];
+    char idbufs[300][16];
+    char body[160];
+    docinfo_list list;
+    unsigned i;
+
+    fprintf(stderr, "batched open by docinfo.... ");
+    fflush(stderr);
+
+    list.count = 0;
+    memset(docs, 0, sizeof(docs));
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_docs(db, 0, 300);
+    /* A deleted doc has no body to read */
+    setdoc(&d, &info, "doc7", 4, NULL, 0, NULL, 0);
+    info.deleted = 1;
+    try(couchstore_save_document(db, NULL, &info, 0));
+    try(couchstore_commit(db));
+
+    /* Ask for them out of file order */
+    for (i = 0; i < 300; ++i) {
+        ids[i].buf = idbufs[i];
+        ids[i].size = sprintf(idbufs[i], "doc%u", (i * 7) % 300);
+    }
+    try(couchstore_docinfos_by_id(db, ids, 300, 0, keep_docinfo_cb, &list));
+    assert(list.count == 300);
+
+    try(couchstore_prefetch_docs(db, list.infos, list.count));
+    try(couchstore_open_docs_with_docinfos(db, list.infos, list.count, docs, 0));
+    for (i = 0; i < list.count; ++i) {
+        int n;
+        char id[16];
+        memcpy(id, list.infos[i]->id.buf, list.infos[i]->id.size);
+        id[list.infos[i]->id.size] = 0;
+        assert(sscanf(id, "doc%d", &n) == 1);
+        if (n == 7) {
+            assert(docs[i] == NULL);
+            continue;
+        }
+        assert(docs[i] != NULL);
+        assert(docs[i]->data.size ==
+               (size_t)sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", n, n));
+        assert(memcmp(docs[i]->data.buf, body, docs[i]->data.size) == 0);
+    }
+
+cleanup:
+    for (i = 0; i < list.count; ++i) {
+        couchstore_free_document(docs[i]);
+        couchstore_free_docinfo(list.infos[i]);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_io_stats(void)
+{
+    couchstore_error_t errcode;
+    couchstore_io_stats stats;
+    Db *db = NULL;
+    uint64_t bucket_total;
+    int i, count;
+
+    fprintf(stderr, "I/O statistics.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    couchstore_reset_io_stats(db);
+    save_numbered_docs(db, 0, 500);
+    couchstore_get_io_stats(db, &stats);
+    assert(stats.commits == 6);
+    assert(stats.syncs == 2 * stats.commits);
+    assert(stats.sync_latency.count == stats.syncs);
+    assert(stats.writes > 0 && stats.write_latency.count == stats.writes);
+    assert(stats.bytes_written > 500 * 100);
+    assert(stats.commit_bytes.count == stats.commits);
+    assert(stats.commit_bytes.total == stats.bytes_written);
+    bucket_total = 0;
+    for (i = 0; i < COUCHSTORE_HISTOGRAM_BUCKETS; ++i) {
+        bucket_total += stats.commit_bytes.buckets[i];
+    }
+    assert(bucket_total == stats.commits);
+
+    couchstore_reset_io_stats(db);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 500);
+    couchstore_get_io_stats(db, &stats);
+    assert(stats.writes == 0 && stats.commits == 0);
+    assert(stats.reads > 0 && stats.read_latency.count == stats.reads);
+    assert(stats.bytes_read > 0);
+    assert(stats.buffer_hits > stats.buffer_misses);
+    assert(stats.buffer_misses > 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_op_stats(void)
+{
+    couchstore_error_t errcode;
+    couchstore_op_stats stats;
+    Db *db = NULL;
+    Doc *doc;
+    DocInfo *info;
+    char compactpath[1024];
+    int i;
+
+    fprintf(stderr, "operation latencies.... ");
+    fflush(stderr);
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(compactpath);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    errcode = couchstore_set_op_stats(db, 1);
+    if (errcode == COUCHSTORE_ERROR_INVALID_ARGUMENTS) {
+        // Built without them
+        errcode = COUCHSTORE_SUCCESS;
+        fprintf(stderr, "(not built in) ");
+        goto cleanup;
+    }
+    try(errcode);
+    save_numbered_docs(db, 0, 500);
+    couchstore_get_op_stats(db, &stats);
+    assert(stats.save_documents.count == 500);
+    assert(stats.commit.count == 6);
+    assert(stats.tree_update.count >= stats.commit.count);
+    assert(stats.open_document.count == 0 && stats.docinfo_by_id.count == 0);
+
+    couchstore_reset_op_stats(db);
+    for (i = 0; i < 50; ++i) {
+        char id[32];
+        int idlen = sprintf(id, "doc%d", i * 10);
+        try(couchstore_open_document(db, id, idlen, &doc, 0));
+        couchstore_free_document(doc);
+    }
+    assert(couchstore_docinfo_by_id(db, "nodoc", 5, &info) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    couchstore_get_op_stats(db, &stats);
+    assert(stats.open_document.count == 50);
+    assert(stats.docinfo_by_id.count == 51);
+    assert(stats.save_documents.count == 0 && stats.commit.count == 0);
+    assert(stats.node_read.count > 0);
+    assert(stats.node_decode.count <= stats.node_read.count);
+
+    try(couchstore_compact_db(db, compactpath));
+    couchstore_get_op_stats(db, &stats);
+    assert(stats.compact_phase[COUCHSTORE_COMPACT_PHASE_SEQ_COPY].count == 1);
+    assert(stats.compact_phase[COUCHSTORE_COMPACT_PHASE_ID_WRITE].count == 1);
+    assert(stats.compact_phase[COUCHSTORE_COMPACT_PHASE_DONE].count == 0);
+
+    try(couchstore_set_op_stats(db, 0));
+    couchstore_get_op_stats(db, &stats);
+    assert(stats.open_document.count == 0);
+    try(couchstore_open_document(db, "doc1", 4, &doc, 0));
+    couchstore_free_document(doc);
+    couchstore_get_op_stats(db, &stats);
+    assert(stats.open_document.count == 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static size_t counted_allocs, counted_frees;
+
+static void *counting_malloc(void *ctx, size_t size)
+{
+    ++*(size_t *)ctx;
+    return malloc(size);
+}
+
+static void *counting_calloc(void *ctx, size_t count, size_t size)
+{
+    ++*(size_t *)ctx;
+    return calloc(count, size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        ++*(size_t *)ctx;
+    }
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr)
+{
+    (void)ctx;
+    if (ptr != NULL) {
+        ++counted_frees;
+    }
+    free(ptr);
+}
+
+static void test_memory_stats(void)
+{
+    couchstore_error_t errcode;
+    couchstore_memory_stats stats;
+    couchstore_allocator allocator = {
+        counting_malloc, counting_calloc, counting_realloc, NULL, &counted_allocs
+    };
+    Db *db = NULL;
+    Doc *doc;
+    int i;
+
+    fprintf(stderr, "memory stats.... ");
+    fflush(stderr);
+
+    assert(couchstore_set_allocator(&allocator) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    allocator.free_fn = counting_free;
+    try(couchstore_set_allocator(&allocator));
+
+    try(couchstore_open_db(testfilepath,
+                           COUCHSTORE_OPEN_FLAG_CREATE | COUCHSTORE_OPEN_FLAG_BLOOM_FILTER,
+                           &db));
+    assert(counted_allocs > 0);
+    save_numbered_docs(db, 0, 500);
+    for (i = 0; i < 50; ++i) {
+        char id[32];
+        int idlen = sprintf(id, "doc%d", i * 10);
+        try(couchstore_open_document(db, id, idlen, &doc, 0));
+        couchstore_free_document(doc);
+    }
+    couchstore_get_memory_stats(db, &stats);
+    assert(stats.io_buffers > 0);
+    assert(stats.node_cache > 0);
+    assert(stats.bloom_filter > 0);
+    assert(stats.delta_buffer == 0 && stats.read_pool == 0);
+    assert(stats.local_docs == 0);
+    assert(stats.total == stats.io_buffers + stats.node_cache + stats.bloom_filter +
+                          stats.dictionary + stats.local_docs);
+
+    try(couchstore_set_delta_buffer(db, 100));
+    save_numbered_docs(db, 500, 10);
+    couchstore_get_memory_stats(db, &stats);
+    assert(stats.delta_buffer > 0);
+
+    try(couchstore_set_node_cache_size(db, 0));
+    couchstore_get_memory_stats(db, &stats);
+    assert(stats.node_cache == 0);
+
+    couchstore_get_memory_stats(NULL, &stats);
+    assert(stats.io_buffers == 0 && stats.total == 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(counted_frees > 0);
+    couchstore_set_allocator(NULL);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+// Looks up docs saved by save_numbered_docs, returning the buffered reads
+// that took.
+static uint64_t lookup_numbered_docs(Db *db, int n, uint64_t min_seq)
+{
+    couchstore_error_t errcode;
+    couchstore_io_stats stats;
+    DocInfo *info;
+    char id[32];
+    int i;
+
+    couchstore_reset_io_stats(db);
+    for (i = 0; i < n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        try(couchstore_docinfo_by_id(db, id, idlen, &info));
+        assert(info->id.size == (size_t)idlen);
+        assert(memcmp(info->id.buf, id, idlen) == 0);
+        assert(info->db_seq >= min_seq);
+        couchstore_free_docinfo(info);
+    }
+    assert(couchstore_docinfo_by_id(db, "nodoc", 5, &info) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+    couchstore_get_io_stats(db, &stats);
+    return stats.buffer_hits + stats.buffer_misses;
+}
+
+static void test_node_cache(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    uint64_t cached, uncached;
+
+    fprintf(stderr, "node cache.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_docs(db, 0, 2000);
+    lookup_numbered_docs(db, 2000, 1);
+    assert(db->file.node_cache != NULL);
+    cached = lookup_numbered_docs(db, 2000, 1);
+
+    try(couchstore_set_node_cache_size(db, 0));
+    assert(db->file.node_cache == NULL);
+    uncached = lookup_numbered_docs(db, 2000, 1);
+    assert(cached < uncached);
+
+    // Rewritten nodes land at new positions, so updates are seen:
+    try(couchstore_set_node_cache_size(db, 64 * 1024));
+    lookup_numbered_docs(db, 2000, 1);
+    save_numbered_docs(db, 0, 2000);
+    lookup_numbered_docs(db, 2000, 2001);
+
+    try(couchstore_drop_file(db));
+    try(couchstore_set_node_cache_size(db, 32 * 1024));
+    try(couchstore_reopen_file(db, testfilepath, 0));
+    assert(db->file.node_cache_size == 32 * 1024);
+    lookup_numbered_docs(db, 2000, 2001);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_node_buf_pool(void)
+{
+    char *buf, *again, *big;
+
+    fprintf(stderr, "node buffer pool.... ");
+    fflush(stderr);
+
+    /* A freed buffer serves the next request of its size class */
+    buf = node_buf_alloc(1000);
+    assert(buf != NULL);
+    memset(buf, 'x', 1024);
+    node_buf_free(buf);
+    again = node_buf_alloc(600);
+    assert(again == buf);
+    node_buf_free(again);
+
+    big = node_buf_alloc(1024 * 1024);
+    assert(big != NULL && big != buf);
+    memset(big, 'x', 1024 * 1024);
+    node_buf_free(big);
+    node_buf_free(NULL);
+}
+
+static int compare_calls;
+
+static int counting_cmp(const sized_buf *k1, const sized_buf *k2)
+{
+    ++compare_calls;
+    return ebin_cmp(k1, k2);
+}
+
+static couchstore_error_t count_found_cb(couchfile_lookup_request *rq,
+                                         const sized_buf *k,
+                                         const sized_buf *v)
+{
+    (void)k;
+    if (v != NULL) {
+        ++*(int *)rq->callback_ctx;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static void test_lookup_compares(void)
+{
+    couchstore_error_t errcode;
+    couchfile_lookup_request rq;
+    sized_buf key, *keys[1] = { &key };
+    Db *db = NULL;
+    char id[32];
+    int i, found = 0;
+
+    fprintf(stderr, "lookup comparisons.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_docs(db, 0, 5000);
+
+    memset(&rq, 0, sizeof(rq));
+    rq.cmp.compare = counting_cmp;
+    rq.file = &db->file;
+    rq.num_keys = 1;
+    rq.keys = keys;
+    rq.callback_ctx = &found;
+    rq.fetch_callback = count_found_cb;
+    compare_calls = 0;
+    for (i = 0; i < 5000; i += 7) {
+        key.buf = id;
+        key.size = sprintf(id, "doc%d", i);
+        try(btree_lookup(&rq, db->header.by_id_root->pointer));
+    }
+    assert(found == (5000 + 6) / 7);
+    // A linear scan compares against about half of every node on the way
+    // down (over 30 comparisons a lookup here); a binary search takes a
+    // handful per level.
+    assert(compare_calls < found * 25);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int willneed_advices;
+
+static couchstore_error_t counting_advise(couchstore_error_info_t *errinfo,
+                                          couch_file_handle handle,
+                                          cs_off_t offset,
+                                          cs_off_t len,
+                                          couchstore_file_advice_t advice)
+{
+    if (advice == COUCHSTORE_FILE_ADVICE_WILLNEED) {
+        ++willneed_advices;
+    }
+    return couchstore_get_default_file_ops()->advise(errinfo, handle, offset,
+                                                     len, advice);
+}
+
+typedef struct {
+    char last[32];
+    int count;
+} ordered_ids;
+
+static int check_id_order_cb(Db *db, DocInfo *info, void *ctx)
+{
+    ordered_ids *ids = ctx;
+    sized_buf last = { ids->last, strlen(ids->last) };
+    (void)db;
+    assert(info->id.size < sizeof(ids->last));
+    assert(ids->count == 0 || ebin_cmp(&last, &info->id) < 0);
+    memcpy(ids->last, info->id.buf, info->id.size);
+    ids->last[info->id.size] = 0;
+    ++ids->count;
+    return 0;
+}
+
+static void test_batched_lookup(void)
+{
+    couchstore_error_t errcode;
+    couch_file_ops ops;
+    sized_buf ids[1000];
+    char idbufs[1000][16];
+    ordered_ids seen;
+    Db *db = NULL;
+    int i;
+
+    fprintf(stderr, "batched lookup.... ");
+    fflush(stderr);
+
+    memcpy(&ops, couchstore_get_default_file_ops(), sizeof(ops));
+    ops.advise = counting_advise;
+    try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &ops, &db));
+    save_numbered_docs(db, 0, 5000);
+
+    /* Every fifth doc, asked for in reverse, plus some that don't exist */
+    for (i = 0; i < 1000; ++i) {
+        ids[i].buf = idbufs[i];
+        ids[i].size = sprintf(idbufs[i], i % 100 ? "doc%d" : "nodoc%d", 5 * (999 - i));
+    }
+    willneed_advices = 0;
+    memset(&seen, 0, sizeof(seen));
+    try(couchstore_docinfos_by_id(db, ids, 1000, 0, check_id_order_cb, &seen));
+    assert(seen.count == 990);
+    assert(willneed_advices > 0);
+
+    /* A single key has nothing to overlap with */
+    willneed_advices = 0;
+    memset(&seen, 0, sizeof(seen));
+    try(couchstore_docinfos_by_id(db, ids + 1, 1, 0, check_id_order_cb, &seen));
+    assert(seen.count == 1);
+    assert(willneed_advices == 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void expect_cursor_id(couchstore_cursor *cursor, const char *id)
+{
+    couchstore_error_t errcode;
+    DocInfo *info = NULL;
+
+    try(couchstore_cursor_next(cursor, &info));
+    if (id == NULL) {
+        assert(info == NULL);
+    } else {
+        assert(info != NULL);
+        assert(info->id.size == strlen(id));
+        assert(memcmp(info->id.buf, id, info->id.size) == 0);
+    }
+
+cleanup:
+    couchstore_free_docinfo(info);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_cursor(void)
+{
+    couchstore_error_t errcode;
+    couchstore_cursor *by_id = NULL, *by_seq = NULL;
+    DocInfo *info = NULL;
+    ordered_ids seen;
+    sized_buf key;
+    Db *db = NULL;
+    uint64_t seq;
+
+    fprintf(stderr, "cursors.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_cursor_open(db, COUCHSTORE_CURSOR_BY_ID, &by_id));
+    expect_cursor_id(by_id, NULL);
+    couchstore_cursor_close(by_id);
+    by_id = NULL;
+
+    save_numbered_docs(db, 0, 1000);
+    try(couchstore_cursor_open(db, COUCHSTORE_CURSOR_BY_ID, &by_id));
+    try(couchstore_cursor_open(db, COUCHSTORE_CURSOR_BY_SEQUENCE, &by_seq));
+    assert(couchstore_cursor_seek_sequence(by_id, 1) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    /* Two scans interleaved, with the index changing under them */
+    memset(&seen, 0, sizeof(seen));
+    for (seq = 1; seq <= 1000; ++seq) {
+        try(couchstore_cursor_next(by_seq, &info));
+        assert(info != NULL && info->db_seq == seq);
+        couchstore_free_docinfo(info);
+        info = NULL;
+        try(couchstore_cursor_next(by_id, &info));
+        assert(info != NULL);
+        check_id_order_cb(db, info, &seen);
+        couchstore_free_docinfo(info);
+        info = NULL;
+        if (seq == 500) {
+            save_numbered_docs(db, 1000, 100);
+        }
+    }
+    assert(seen.count == 1000);
+    expect_cursor_id(by_id, NULL);
+    expect_cursor_id(by_id, NULL);
+    try(couchstore_cursor_next(by_seq, &info));
+    assert(info == NULL);
+
+    /* Seeking picks up the new documents */
+    try(couchstore_cursor_seek_sequence(by_seq, 1100));
+    try(couchstore_cursor_next(by_seq, &info));
+    assert(info != NULL && info->db_seq == 1100);
+    couchstore_free_docinfo(info);
+    info = NULL;
+    try(couchstore_cursor_seek_sequence(by_seq, 1101));
+    try(couchstore_cursor_next(by_seq, &info));
+    assert(info == NULL);
+
+    key.buf = "doc5";
+    key.size = 4;
+    try(couchstore_cursor_seek(by_id, &key));
+    expect_cursor_id(by_id, "doc5");
+    expect_cursor_id(by_id, "doc50");
+    key.buf = "doc50a";
+    key.size = 6;
+    try(couchstore_cursor_seek(by_id, &key));
+    expect_cursor_id(by_id, "doc51");
+    key.buf = "doc999";
+    key.size = 6;
+    try(couchstore_cursor_seek(by_id, &key));
+    expect_cursor_id(by_id, "doc999");
+    expect_cursor_id(by_id, NULL);
+    try(couchstore_cursor_seek(by_id, NULL));
+    expect_cursor_id(by_id, "doc0");
+    expect_cursor_id(by_id, "doc1");
+    expect_cursor_id(by_id, "doc10");
+
+cleanup:
+    couchstore_free_docinfo(info);
+    couchstore_cursor_close(by_id);
+    couchstore_cursor_close(by_seq);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    int count;
+    int limit;
+    int by_id;
+    uint64_t last_seq;
+    char first_id[32];
+    char last_id[32];
+} descending_scan;
+
+static int check_descending_cb(Db *db, DocInfo *info, void *ctx)
+{
+    descending_scan *scan = ctx;
+    sized_buf last = { scan->last_id, strlen(scan->last_id) };
+    (void)db;
+    assert(info->id.size < sizeof(scan->last_id));
+    if (scan->count > 0) {
+        if (scan->by_id) {
+            assert(ebin_cmp(&info->id, &last) < 0);
+        } else {
+            assert(info->db_seq < scan->last_seq);
+        }
+    }
+    memcpy(scan->last_id, info->id.buf, info->id.size);
+    scan->last_id[info->id.size] = 0;
+    if (scan->count == 0) {
+        strcpy(scan->first_id, scan->last_id);
+    }
+    scan->last_seq = info->db_seq;
+    if (++scan->count == scan->limit) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    return 0;
+}
+
+static void test_descending_scans(void)
+{
+    couchstore_error_t errcode;
+    descending_scan scan;
+    sized_buf key;
+    Db *db = NULL;
+    char id[32];
+    int i, expected;
+
+    fprintf(stderr, "descending scans.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_docs(db, 0, 1000);
+    save_numbered_docs(db, 0, 50);
+
+    /* By sequence, i.e. latest first */
+    memset(&scan, 0, sizeof(scan));
+    try(couchstore_changes_since(db, 0, COUCHSTORE_DESCENDING, check_descending_cb, &scan));
+    assert(scan.count == 1000);
+    assert(strcmp(scan.first_id, "doc49") == 0);
+    assert(scan.last_seq == 51);
+    memset(&scan, 0, sizeof(scan));
+    try(couchstore_changes_since(db, 990, COUCHSTORE_DESCENDING, check_descending_cb, &scan));
+    assert(scan.count == 61 && scan.last_seq == 990);
+    memset(&scan, 0, sizeof(scan));
+    scan.limit = 10;
+    assert(couchstore_changes_since(db, 0, COUCHSTORE_DESCENDING, check_descending_cb,
+                                    &scan) == COUCHSTORE_ERROR_CANCEL);
+    assert(scan.count == 10 && scan.last_seq == 1041);
+    memset(&scan, 0, sizeof(scan));
+    try(couchstore_changes_since(db, 2000, COUCHSTORE_DESCENDING, check_descending_cb, &scan));
+    assert(scan.count == 0);
+
+    /* By ID */
+    memset(&scan, 0, sizeof(scan));
+    scan.by_id = 1;
+    try(couchstore_all_docs(db, NULL, COUCHSTORE_DESCENDING, check_descending_cb, &scan));
+    assert(scan.count == 1000);
+    assert(strcmp(scan.first_id, "doc999") == 0 && strcmp(scan.last_id, "doc0") == 0);
+    for (i = 0, expected = 0; i < 1000; ++i) {
+        sprintf(id, "doc%d", i);
+        expected += strcmp(id, "doc5") <= 0;
+    }
+    key.buf = "doc5";
+    key.size = 4;
+    memset(&scan, 0, sizeof(scan));
+    scan.by_id = 1;
+    try(couchstore_all_docs(db, &key, COUCHSTORE_DESCENDING, check_descending_cb, &scan));
+    assert(scan.count == expected);
+    assert(strcmp(scan.first_id, "doc5") == 0 && strcmp(scan.last_id, "doc0") == 0);
+    key.buf = "doc50a";
+    key.size = 6;
+    memset(&scan, 0, sizeof(scan));
+    scan.by_id = 1;
+    scan.limit = 2;
+    assert(couchstore_all_docs(db, &key, COUCHSTORE_DESCENDING, check_descending_cb,
+                               &scan) == COUCHSTORE_ERROR_CANCEL);
+    assert(strcmp(scan.first_id, "doc509") == 0 && strcmp(scan.last_id, "doc508") == 0);
+    key.buf = "a";
+    key.size = 1;
+    memset(&scan, 0, sizeof(scan));
+    scan.by_id = 1;
+    try(couchstore_all_docs(db, &key, COUCHSTORE_DESCENDING, check_descending_cb, &scan));
+    assert(scan.count == 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int check_borrowed_cb(Db *db, DocInfo *info, void *ctx)
+{
+    DocInfo *copy;
+    assert(info->id.buf != (char *)(info + 1));
+    assert(couchstore_docinfo_by_id(db, info->id.buf, info->id.size,
+                                    &copy) == COUCHSTORE_SUCCESS);
+    assert(copy->db_seq == info->db_seq && copy->bp == info->bp);
+    assert(copy->size == info->size && copy->deleted == info->deleted);
+    assert(copy->rev_meta.size == info->rev_meta.size);
+    assert(memcmp(copy->rev_meta.buf, info->rev_meta.buf, info->rev_meta.size) == 0);
+    couchstore_free_docinfo(copy);
+    ++*(int *)ctx;
+    /* Asking to keep it must be harmless */
+    return 1;
+}
+
+static void test_borrowed_docinfos(void)
+{
+    couchstore_error_t errcode;
+    DocInfo info;
+    Doc d;
+    Db *db = NULL;
+    int count;
+
+    fprintf(stderr, "borrowed docinfos.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_docs(db, 0, 300);
+    setdoc(&d, &info, "doc7", 4, NULL, 0, "meta", 4);
+    info.deleted = 1;
+    try(couchstore_save_document(db, NULL, &info, 0));
+    try(couchstore_commit(db));
+
+    count = 0;
+    try(couchstore_changes_since(db, 0, COUCHSTORE_BORROW_DOCINFOS,
+                                 check_borrowed_cb, &count));
+    assert(count == 300);
+    count = 0;
+    try(couchstore_all_docs(db, NULL, COUCHSTORE_BORROW_DOCINFOS | COUCHSTORE_NO_DELETES,
+                            check_borrowed_cb, &count));
+    assert(count == 299);
+    count = 0;
+    try(couchstore_all_docs(db, NULL, COUCHSTORE_BORROW_DOCINFOS | COUCHSTORE_DELETES_ONLY |
+                            COUCHSTORE_DESCENDING, check_borrowed_cb, &count));
+    assert(count == 1);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+// Deletes docs doc<first> to doc<first + n - 1>, then commits.
+static void delete_numbered_docs(Db *db, int first, int n)
+{
+    couchstore_error_t errcode;
+    Doc d;
+    DocInfo info;
+    char id[32];
+    int i;
+
+    for (i = first; i < first + n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        setdoc(&d, &info, id, idlen, NULL, 0, NULL, 0);
+        info.deleted = 1;
+        try(couchstore_save_document(db, NULL, &info, 0));
+    }
+    try(couchstore_commit(db));
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    int live;
+    int deleted;
+} change_counts;
+
+static int count_deleted_cb(Db *db, DocInfo *info, void *ctx)
+{
+    change_counts *counts = ctx;
+    (void)db;
+    if (info->deleted) {
+        counts->deleted++;
+    } else {
+        counts->live++;
+    }
+    return 0;
+}
+
+// Counts the changes a filtered feed gives, and the buffer reads it took.
+static change_counts count_changes(Db *db, couchstore_docinfos_options options,
+                                   uint64_t *reads)
+{
+    couchstore_error_t errcode;
+    couchstore_io_stats stats;
+    change_counts counts = {0, 0};
+
+    couchstore_reset_io_stats(db);
+    try(couchstore_changes_since(db, 0, options | COUCHSTORE_BORROW_DOCINFOS,
+                                 count_deleted_cb, &counts));
+    couchstore_get_io_stats(db, &stats);
+    *reads = stats.buffer_hits + stats.buffer_misses;
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+    return counts;
+}
+
+static void test_seq_filter_pushdown(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    uint64_t versions[2] = { COUCH_DISK_VERSION_SEQ_DELETES - 1, COUCH_DISK_VERSION };
+    uint64_t all_reads, live_reads, deleted_reads, reads;
+    change_counts counts;
+    Db *db = NULL;
+    int v;
+
+    fprintf(stderr, "filtered changes skip subtrees.... ");
+    fflush(stderr);
+
+    for (v = 0; v < 2; ++v) {
+        remove(testfilepath);
+        try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+        db->header.disk_version = versions[v];
+        save_numbered_docs(db, 0, 3000);
+        delete_numbered_docs(db, 0, 2000);
+        save_numbered_docs(db, 3000, 500);
+
+        // Warms the caches, so that each feed measured after reads alike.
+        count_changes(db, 0, &reads);
+        counts = count_changes(db, 0, &all_reads);
+        assert(counts.live == 1500 && counts.deleted == 2000);
+        counts = count_changes(db, COUCHSTORE_NO_DELETES, &live_reads);
+        assert(counts.live == 1500 && counts.deleted == 0);
+        counts = count_changes(db, COUCHSTORE_DELETES_ONLY, &deleted_reads);
+        assert(counts.live == 0 && counts.deleted == 2000);
+        counts = count_changes(db, COUCHSTORE_DELETES_ONLY | COUCHSTORE_DESCENDING, &reads);
+        assert(counts.live == 0 && counts.deleted == 2000);
+        assert(reads == deleted_reads);
+
+        if (versions[v] >= COUCH_DISK_VERSION_SEQ_DELETES) {
+            assert(live_reads < all_reads && deleted_reads < all_reads);
+            assert(live_reads + deleted_reads < all_reads * 3 / 2);
+        } else {
+            // Nothing to go by, so every leaf is read.
+            assert(live_reads == all_reads && deleted_reads == all_reads);
+        }
+        couchstore_close_db(db);
+        db = NULL;
+    }
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+// Saves docs with IDs sharing a long prefix into a file of the given disk
+// version, returning the file's size.
+static cs_off_t save_prefixed_ids(uint64_t disk_version)
+{
+    couchstore_error_t errcode;
+    DocInfo *found = NULL;
+    DocInfo info;
+    Doc d;
+    Db *db = NULL;
+    char id[64], *node = NULL;
+    cs_off_t size = 0;
+    int i, len;
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    assert(db->header.disk_version == COUCH_DISK_VERSION);
+    if (disk_version < COUCH_DISK_VERSION_PREFIXED_KEYS) {
+        db->header.disk_version = disk_version;
+        db->file.prefix_keys = 0;
+    }
+    for (i = 0; i < 2000; ++i) {
+        int idlen = sprintf(id, "tenant-0042::customer::%08d", i);
+        setdoc(&d, &info, id, idlen, "{}", 2, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+    }
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* The format sticks to the file */
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->header.disk_version == disk_version);
+    assert(db->file.prefix_keys == (disk_version >= COUCH_DISK_VERSION_PREFIXED_KEYS));
+    len = pread_compressed(&db->file, db->header.by_id_root->pointer, &node);
+    assert(len > 0);
+    assert(((node[0] & NODE_PREFIXED_KEYS) != 0) == db->file.prefix_keys);
+    for (i = 0; i < 2000; i += 37) {
+        int idlen = sprintf(id, "tenant-0042::customer::%08d", i);
+        try(couchstore_docinfo_by_id(db, id, idlen, &found));
+        assert(found->id.size == (size_t)idlen && memcmp(found->id.buf, id, idlen) == 0);
+        couchstore_free_docinfo(found);
+        found = NULL;
+    }
+    size = couchstore_get_header_position(db);
+
+cleanup:
+    free(node);
+    couchstore_free_docinfo(found);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+    return size;
+}
+
+static void test_prefixed_keys(void)
+{
+    /* type KV, prefixed; one entry claiming 3 bytes of a previous key */
+    char bad_first[] = { (char)(KV_NODE | NODE_PREFIXED_KEYS), 3, 0, 0x10, 0, 0, 0, 'a' };
+    /* a KV length running past the end */
+    char truncated[] = { (char)(KV_NODE | NODE_PREFIXED_KEYS), 0, 0, 0x20, 0, 0, 0, 'a' };
+    char good[] = { (char)(KV_NODE | NODE_PREFIXED_KEYS),
+                    0, 0, 0x20, 0, 0, 1, 'a', 'b', 'x',
+                    1, 0, 0x10, 0, 0, 1, 'c', 'y' };
+    sized_buf k, v;
+    char *out = NULL;
+    cs_off_t plain, prefixed;
+
+    fprintf(stderr, "prefix-compressed keys.... ");
+    fflush(stderr);
+
+    assert(expand_prefixed_node(bad_first, sizeof(bad_first), &out) == COUCHSTORE_ERROR_CORRUPT);
+    assert(expand_prefixed_node(truncated, sizeof(truncated), &out) == COUCHSTORE_ERROR_CORRUPT);
+    assert(expand_prefixed_node(good, sizeof(good), &out) == 1 + 2 * 5 + 2 + 1 + 2 + 1);
+    assert(out[0] == KV_NODE);
+    read_kv(out + 1, &k, &v);
+    assert(k.size == 2 && memcmp(k.buf, "ab", 2) == 0 && v.size == 1 && v.buf[0] == 'x');
+    read_kv(v.buf + 1, &k, &v);
+    assert(k.size == 2 && memcmp(k.buf, "ac", 2) == 0 && v.size == 1 && v.buf[0] == 'y');
+    node_buf_free(out);
+
+    plain = save_prefixed_ids(COUCH_MIN_DISK_VERSION);
+    prefixed = save_prefixed_ids(COUCH_DISK_VERSION);
+    assert(prefixed < plain);
+}
+
+static uint64_t lookup_missing_docs(Db *db, int n)
+{
+    couchstore_io_stats stats;
+    DocInfo *info;
+    char id[32];
+    int i;
+
+    /* Count every node read */
+    assert(couchstore_set_node_cache_size(db, 0) == COUCHSTORE_SUCCESS);
+    couchstore_reset_io_stats(db);
+    for (i = 0; i < n; ++i) {
+        int idlen = sprintf(id, "missing%d", i);
+        assert(couchstore_docinfo_by_id(db, id, idlen, &info) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    }
+    couchstore_get_io_stats(db, &stats);
+    return stats.buffer_hits + stats.buffer_misses;
+}
+
+static void test_bloom_filter(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    bloom_filter *filter = NULL;
+    char target[1024], bad[8] = { 0 };
+    uint64_t bloom_ptr;
+
+    fprintf(stderr, "bloom filter.... ");
+    fflush(stderr);
+    sprintf(target, "%s.compacted", testfilepath);
+
+    assert(bloom_decode(bad, sizeof(bad), &filter) == COUCHSTORE_ERROR_CORRUPT);
+
+    /* Not kept unless asked for */
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_docs(db, 0, 500);
+    assert(db->bloom == NULL && db->header.bloom_ptr == 0);
+    assert(lookup_missing_docs(db, 100) >= 100);
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Built from the existing tree, then saved with the next commit */
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_BLOOM_FILTER, &db));
+    lookup_numbered_docs(db, 500, 1);
+    assert(db->bloom != NULL && db->header.bloom_ptr == 0);
+    assert(lookup_missing_docs(db, 100) < 10);
+    save_numbered_docs(db, 500, 100);
+    assert(db->header.bloom_ptr != 0);
+    assert(db->header.bloom_seq == db->header.update_seq);
+
+    /* A few more don't get it rewritten... */
+    bloom_ptr = db->header.bloom_ptr;
+    save_numbered_docs(db, 600, 10);
+    assert(db->header.bloom_ptr == bloom_ptr);
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* ...but are picked up again from the by-sequence tree when loading */
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->bloom_enabled);
+    lookup_numbered_docs(db, 610, 1);
+    assert(db->bloom_unsaved == 10);
+    assert(lookup_missing_docs(db, 100) < 10);
+
+    try(couchstore_compact_db(db, target));
+    couchstore_close_db(db);
+    db = NULL;
+
+    try(couchstore_open_db(target, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    assert(db->header.bloom_ptr != 0);
+    lookup_numbered_docs(db, 610, 1);
+    assert(lookup_missing_docs(db, 100) < 10);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(target);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    char ids[2000][16];
+    int deleted[2000];
+    int count;
+} id_listing;
+
+static int list_ids_cb(Db *db, DocInfo *info, void *ctx)
+{
+    id_listing *list = ctx;
+    (void)db;
+    assert(list->count < 2000 && info->id.size < 16);
+    memcpy(list->ids[list->count], info->id.buf, info->id.size);
+    list->ids[list->count][info->id.size] = 0;
+    list->deleted[list->count++] = info->deleted;
+    return 0;
+}
+
+static void test_count_and_rank(void)
+{
+    static id_listing list;
+    static const int ranges[][2] = { { 0, 1999 }, { 0, 0 }, { 17, 1203 },
+                                     { 640, 641 }, { 1500, 1999 }, { 999, 998 } };
+    couchstore_docinfos_options options[] = { 0, COUCHSTORE_NO_DELETES, COUCHSTORE_DELETES_ONLY };
+    couchstore_error_t errcode;
+    couchstore_io_stats stats;
+    Db *db = NULL;
+    DocInfo *info = NULL;
+    Doc d;
+    DocInfo newinfo;
+    char id[16];
+    uint64_t count;
+    unsigned i, o;
+    int j;
+
+    fprintf(stderr, "count and rank.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    assert(couchstore_docinfo_by_rank(db, 0, 0, &info) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    try(couchstore_count_range(db, NULL, NULL, 0, &count));
+    assert(count == 0);
+    save_numbered_docs(db, 0, 2000);
+    for (i = 0; i < 2000; i += 10) {
+        int idlen = sprintf(id, "doc%u", i);
+        setdoc(&d, &newinfo, id, idlen, NULL, 0, NULL, 0);
+        newinfo.deleted = 1;
+        try(couchstore_save_document(db, NULL, &newinfo, 0));
+    }
+    try(couchstore_commit(db));
+    try(couchstore_all_docs(db, NULL, 0, list_ids_cb, &list));
+    assert(list.count == 2000);
+
+    for (o = 0; o < sizeof(options) / sizeof(options[0]); ++o) {
+        int expected = 0;
+        for (j = 0; j < list.count; ++j) {
+            expected += !(options[o] & COUCHSTORE_NO_DELETES && list.deleted[j]) &&
+                        !(options[o] & COUCHSTORE_DELETES_ONLY && !list.deleted[j]);
+        }
+        try(couchstore_count_range(db, NULL, NULL, options[o], &count));
+        assert(count == (uint64_t)expected);
+
+        for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+            sized_buf start = { list.ids[ranges[i][0]], strlen(list.ids[ranges[i][0]]) };
+            sized_buf end = { list.ids[ranges[i][1]], strlen(list.ids[ranges[i][1]]) };
+            expected = 0;
+            for (j = ranges[i][0]; j <= ranges[i][1]; ++j) {
+                expected += !(options[o] & COUCHSTORE_NO_DELETES && list.deleted[j]) &&
+                            !(options[o] & COUCHSTORE_DELETES_ONLY && !list.deleted[j]);
+            }
+            try(couchstore_count_range(db, &start, &end, options[o], &count));
+            assert(count == (uint64_t)expected);
+        }
+    }
+
+    /* Ranks count only the documents the options select */
+    for (j = 0, count = 0; j < list.count; ++j) {
+        if (list.deleted[j]) {
+            continue;
+        }
+        if (count % 97 == 0) {
+            try(couchstore_docinfo_by_rank(db, count, COUCHSTORE_NO_DELETES, &info));
+            assert(strlen(list.ids[j]) == info->id.size);
+            assert(memcmp(info->id.buf, list.ids[j], info->id.size) == 0);
+            couchstore_free_docinfo(info);
+            info = NULL;
+        }
+        ++count;
+    }
+    assert(couchstore_docinfo_by_rank(db, count, COUCHSTORE_NO_DELETES, &info) ==
+           COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    try(couchstore_docinfo_by_rank(db, 1999, 0, &info));
+    assert(strlen(list.ids[1999]) == info->id.size);
+    couchstore_free_docinfo(info);
+    info = NULL;
+
+    /* Only the edges of the range are read */
+    try(couchstore_set_node_cache_size(db, 0));
+    couchstore_reset_io_stats(db);
+    {
+        sized_buf start = { list.ids[3], strlen(list.ids[3]) };
+        sized_buf end = { list.ids[1996], strlen(list.ids[1996]) };
+        try(couchstore_count_range(db, &start, &end, 0, &count));
+        assert(count == 1994);
+    }
+    couchstore_get_io_stats(db, &stats);
+    assert(stats.buffer_hits + stats.buffer_misses < 40);
+
+cleanup:
+    couchstore_free_docinfo(info);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_sample_docinfos(void)
+{
+    static id_listing sample, again;
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    Doc d;
+    DocInfo newinfo;
+    char id[16];
+    int i;
+
+    fprintf(stderr, "sample docinfos.... ");
+    fflush(stderr);
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_docs(db, 0, 2000);
+    for (i = 0; i < 2000; i += 10) {
+        int idlen = sprintf(id, "doc%d", i);
+        setdoc(&d, &newinfo, id, idlen, NULL, 0, NULL, 0);
+        newinfo.deleted = 1;
+        try(couchstore_save_document(db, NULL, &newinfo, 0));
+    }
+    try(couchstore_commit(db));
+
+    /* Distinct documents in ID order, of those the options select */
+    memset(&sample, 0, sizeof(sample));
+    try(couchstore_sample_docinfos(db, 100, 42, COUCHSTORE_NO_DELETES,
+                                   list_ids_cb, &sample));
+    assert(sample.count == 100);
+    for (i = 0; i < sample.count; ++i) {
+        assert(!sample.deleted[i]);
+        assert(i == 0 || strcmp(sample.ids[i - 1], sample.ids[i]) < 0);
+    }
+
+    /* The same seed picks the same ones, another seed others */
+    memset(&again, 0, sizeof(again));
+    try(couchstore_sample_docinfos(db, 100, 42, COUCHSTORE_NO_DELETES,
+                                   list_ids_cb, &again));
+    assert(memcmp(sample.ids, again.ids, sizeof(sample.ids)) == 0);
+    memset(&again, 0, sizeof(again));
+    try(couchstore_sample_docinfos(db, 100, 43, COUCHSTORE_NO_DELETES,
+                                   list_ids_cb, &again));
+    assert(again.count == 100);
+    assert(memcmp(sample.ids, again.ids, sizeof(sample.ids)) != 0);
+
+    /* Most or all of them */
+    memset(&sample, 0, sizeof(sample));
+    try(couchstore_sample_docinfos(db, 150, 7, COUCHSTORE_DELETES_ONLY,
+                                   list_ids_cb, &sample));
+    assert(sample.count == 150);
+    for (i = 0; i < sample.count; ++i) {
+        assert(sample.deleted[i]);
+        assert(i == 0 || strcmp(sample.ids[i - 1], sample.ids[i]) < 0);
+    }
+    memset(&sample, 0, sizeof(sample));
+    try(couchstore_sample_docinfos(db, 5000, 7, COUCHSTORE_NO_DELETES,
+                                   list_ids_cb, &sample));
+    assert(sample.count == 1800);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_blind_insert(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    Doc d;
+    DocInfo info;
+    char id[32], body[160];
+    int i, count;
+
+    fprintf(stderr, "blind inserts.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    for (i = 0; i < 1000; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", i, i);
+        setdoc(&d, &info, id, idlen, body, bodylen, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, COUCHSTORE_SAVE_BLIND_INSERT));
+    }
+    try(couchstore_commit(db));
+    lookup_numbered_docs(db, 1000, 1);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 1000);
+
+    /* Ordinary updates afterwards still replace the blindly inserted seqs */
+    save_numbered_docs(db, 0, 1000);
+    lookup_numbered_docs(db, 1000, 1001);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 1000);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void save_numbered_batch(Db *db, int first, int n,
+                                couchstore_save_options options)
+{
+    couchstore_error_t errcode;
+    Doc *docs = calloc(n, sizeof(Doc));
+    DocInfo *infos = calloc(n, sizeof(DocInfo));
+    Doc **docp = calloc(n, sizeof(Doc *));
+    DocInfo **infop = calloc(n, sizeof(DocInfo *));
+    char *ids = malloc(n * 32);
+    char *bodies = malloc(n * 160);
+    int i;
+
+    assert(docs && infos && docp && infop && ids && bodies);
+    for (i = 0; i < n; ++i) {
+        char *id = ids + i * 32, *body = bodies + i * 160;
+        int idlen = sprintf(id, "doc%d", first + i);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}",
+                              first + i, first + i);
+        setdoc(&docs[i], &infos[i], id, idlen, body, bodylen, NULL, 0);
+        if ((options & COMPRESS_DOC_BODIES) && i % 2 == 0) {
+            infos[i].content_meta = COUCH_DOC_IS_COMPRESSED;
+        }
+        docp[i] = &docs[i];
+        infop[i] = &infos[i];
+    }
+    try(couchstore_save_documents(db, docp, infop, n, options));
+    try(couchstore_commit(db));
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+    free(docs);
+    free(infos);
+    free(docp);
+    free(infop);
+    free(ids);
+    free(bodies);
+}
+
+static void test_compression_threads(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *plain = NULL;
+    Doc *doc;
+    char plainpath[1024];
+    FILE *f1 = NULL, *f2 = NULL;
+    int c1, c2, count;
+
+    fprintf(stderr, "compression threads.... ");
+    fflush(stderr);
+
+    sprintf(plainpath, "%s.plain", testfilepath);
+    remove(plainpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_open_db(plainpath, COUCHSTORE_OPEN_FLAG_CREATE, &plain));
+    try(couchstore_set_compression_threads(db, 3));
+
+    /* A fresh tree, then one updated in place and grown, with half the
+       bodies compressed: */
+    save_numbered_batch(db, 0, 3000, 0);
+    save_numbered_batch(plain, 0, 3000, 0);
+    save_numbered_batch(db, 1000, 3000, COMPRESS_DOC_BODIES);
+    save_numbered_batch(plain, 1000, 3000, COMPRESS_DOC_BODIES);
+
+    lookup_numbered_docs(db, 4000, 1);
+    try(couchstore_open_document(db, "doc1234", 7, &doc, DECOMPRESS_DOC_BODIES));
+    assert(doc->data.size >= 14);
+    assert(memcmp(doc->data.buf, "{\"value\": 1234", 14) == 0);
+    couchstore_free_document(doc);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 4000);
+
+    /* The nodes are written in the same order either way */
+    assert(couchstore_get_header_position(db) == couchstore_get_header_position(plain));
+    f1 = fopen(testfilepath, "rb");
+    f2 = fopen(plainpath, "rb");
+    assert(f1 && f2);
+    do {
+        c1 = getc(f1);
+        c2 = getc(f2);
+        assert(c1 == c2);
+    } while (c1 != EOF);
+
+    /* The setting outlives a reopen */
+    try(couchstore_drop_file(db));
+    try(couchstore_reopen_file(db, testfilepath, 0));
+    save_numbered_batch(db, 0, 500, COMPRESS_DOC_BODIES);
+    lookup_numbered_docs(db, 4000, 1);
+
+cleanup:
+    if (f1 != NULL) {
+        fclose(f1);
+    }
+    if (f2 != NULL) {
+        fclose(f2);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (plain != NULL) {
+        couchstore_close_db(plain);
+    }
+    remove(plainpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_large_batch_sorts(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *plain = NULL;
+    char plainpath[1024];
+    FILE *f1 = NULL, *f2 = NULL;
+    int c1, c2, count;
+
+    fprintf(stderr, "large batch sorts.... ");
+    fflush(stderr);
+
+    sprintf(plainpath, "%s.plain", testfilepath);
+    remove(testfilepath);
+    remove(plainpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_open_db(plainpath, COUCHSTORE_OPEN_FLAG_CREATE, &plain));
+    try(couchstore_set_compression_threads(db, 3));
+
+    /* Big enough for the IDs to be sorted in parts on the threads; the
+       update removes seqs in ID order, far from sequence order */
+    save_numbered_batch(db, 0, 40000, 0);
+    save_numbered_batch(plain, 0, 40000, 0);
+    save_numbered_batch(db, 10000, 30000, 0);
+    save_numbered_batch(plain, 10000, 30000, 0);
+
+    lookup_numbered_docs(db, 40000, 1);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 40000);
+
+    /* Sorted the same as with qsort alone */
+    assert(couchstore_get_header_position(db) == couchstore_get_header_position(plain));
+    f1 = fopen(testfilepath, "rb");
+    f2 = fopen(plainpath, "rb");
+    assert(f1 && f2);
+    do {
+        c1 = getc(f1);
+        c2 = getc(f2);
+        assert(c1 == c2);
+    } while (c1 != EOF);
+
+cleanup:
+    if (f1 != NULL) {
+        fclose(f1);
+    }
+    if (f2 != NULL) {
+        fclose(f2);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (plain != NULL) {
+        couchstore_close_db(plain);
+    }
+    remove(plainpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_write_batch(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    couchstore_write_batch *batch = NULL;
+    Doc docs[50];
+    DocInfo infos[50], *info = NULL;
+    char ids[50][32], bodies[50][160];
+    int round, i, count;
+
+    fprintf(stderr, "write batches.... ");
+    fflush(stderr);
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_write_batch_open(&batch));
+    /* Rounds overlapping by half, so that later ones update earlier docs */
+    for (round = 0; round < 40; ++round) {
+        for (i = 0; i < 50; ++i) {
+            int n = round * 25 + i;
+            int idlen = sprintf(ids[i], "doc%d", n);
+            int bodylen = sprintf(bodies[i], "{\"value\": %d, \"padding\": \"%0100d\"}", n, n);
+            setdoc(&docs[i], &infos[i], ids[i], idlen, bodies[i], bodylen, NULL, 0);
+            try(couchstore_write_batch_add(batch, &docs[i], &infos[i]));
+        }
+        try(couchstore_save_write_batch(db, batch, 0));
+        assert(infos[49].db_seq == (uint64_t)(round + 1) * 50);
+    }
+    try(couchstore_commit(db));
+    lookup_numbered_docs(db, 1025, 1);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 1025);
+
+    /* A deletion, and a cleared batch that saves nothing */
+    setdoc(&docs[0], &infos[0], "doc7", 4, NULL, 0, NULL, 0);
+    infos[0].deleted = 1;
+    try(couchstore_write_batch_add(batch, NULL, &infos[0]));
+    try(couchstore_save_write_batch(db, batch, 0));
+    try(couchstore_write_batch_add(batch, &docs[1], &infos[1]));
+    couchstore_write_batch_clear(batch);
+    try(couchstore_save_write_batch(db, batch, 0));
+    assert(db->header.update_seq == 2001);
+    try(couchstore_docinfo_by_id(db, "doc7", 4, &info));
+    assert(info->deleted);
+
+cleanup:
+    couchstore_free_docinfo(info);
+    couchstore_write_batch_free(batch);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    Doc doc;
+    DocInfo info;
+    char id[32];
+    char body[3000];
+} owned_doc;
+
+typedef struct {
+    int released;
+    uint64_t last_seq;
+} release_count;
+
+static void release_owned_doc(Doc *doc, DocInfo *info, void *ctx)
+{
+    release_count *counts = ctx;
+    owned_doc *owned = (owned_doc *)((char *)info - offsetof(owned_doc, info));
+    assert(doc == NULL || doc == &owned->doc);
+    counts->released++;
+    counts->last_seq = info->db_seq;
+    free(owned);
+}
+
+static owned_doc *new_owned_doc(int n)
+{
+    owned_doc *owned = (owned_doc *)malloc(sizeof(owned_doc));
+    int idlen, bodylen;
+    assert(owned);
+    memset(owned, 0, sizeof(*owned));
+    idlen = sprintf(owned->id, "doc%d", n);
+    /* Sizes from empty to most of a block, so that bodies straddle block
+       boundaries at different offsets */
+    bodylen = (n * 97) % (int)sizeof(owned->body);
+    memset(owned->body, 'a' + n % 26, bodylen);
+    setdoc(&owned->doc, &owned->info, owned->id, idlen, owned->body, bodylen, NULL, 0);
+    return owned;
+}
+
+static void test_owned_write_batch(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    couchstore_write_batch *batch = NULL;
+    release_count counts = { 0, 0 };
+    Doc *doc = NULL;
+    char expected[3000];
+    int i;
+
+    fprintf(stderr, "owned write batches.... ");
+    fflush(stderr);
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_write_batch_open(&batch));
+    /* More than one gathered write's worth, with a deletion among them */
+    for (i = 0; i < 100; ++i) {
+        owned_doc *owned = new_owned_doc(i);
+        if (i == 40) {
+            owned->info.deleted = 1;
+            try(couchstore_write_batch_add_owned(batch, NULL, &owned->info,
+                                                 release_owned_doc, &counts));
+        } else {
+            try(couchstore_write_batch_add_owned(batch, &owned->doc, &owned->info,
+                                                 release_owned_doc, &counts));
+        }
+    }
+    assert(couchstore_write_batch_add_owned(batch, NULL, NULL, NULL, NULL) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    try(couchstore_save_write_batch(db, batch, 0));
+    assert(counts.released == 100);
+    assert(counts.last_seq == 100);
+    try(couchstore_commit(db));
+
+    for (i = 0; i < 100; ++i) {
+        char id[32];
+        int idlen = sprintf(id, "doc%d", i);
+        size_t bodylen = (size_t)((i * 97) % (int)sizeof(expected));
+        errcode = couchstore_open_document(db, id, idlen, &doc, 0);
+        if (i == 40) {
+            assert(errcode == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+            continue;
+        }
+        try(errcode);
+        memset(expected, 'a' + i % 26, bodylen);
+        assert(doc->data.size == bodylen);
+        assert(memcmp(doc->data.buf, expected, bodylen) == 0);
+        couchstore_free_document(doc);
+        doc = NULL;
+    }
+
+    /* Clearing and freeing give back the documents too */
+    for (i = 200; i < 203; ++i) {
+        owned_doc *owned = new_owned_doc(i);
+        try(couchstore_write_batch_add_owned(batch, &owned->doc, &owned->info,
+                                             release_owned_doc, &counts));
+        if (i == 201) {
+            couchstore_write_batch_clear(batch);
+            assert(counts.released == 102);
+        }
+    }
+    couchstore_write_batch_free(batch);
+    batch = NULL;
+    assert(counts.released == 103);
+
+cleanup:
+    couchstore_free_document(doc);
+    couchstore_write_batch_free(batch);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_bulk_load(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    Doc *docs = calloc(3000, sizeof(Doc));
+    DocInfo *infos = calloc(3000, sizeof(DocInfo));
+    Doc **docp = calloc(3000, sizeof(Doc *));
+    DocInfo **infop = calloc(3000, sizeof(DocInfo *));
+    char *ids = malloc(3000 * 32);
+    char *bodies = malloc(3000 * 160);
+    DbInfo dbinfo;
+    int i, count;
+
+    fprintf(stderr, "bulk load.... ");
+    fflush(stderr);
+
+    /* IDs out of order, and sequences given out of order too */
+    assert(docs && infos && docp && infop && ids && bodies);
+    for (i = 0; i < 3000; ++i) {
+        int n = (i * 7) % 3000;
+        char *id = ids + i * 32, *body = bodies + i * 160;
+        int idlen = sprintf(id, "doc%d", n);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", n, n);
+        setdoc(&docs[i], &infos[i], id, idlen, body, bodylen, NULL, 0);
+        infos[i].content_meta = COUCH_DOC_IS_COMPRESSED;
+        infos[i].db_seq = n + 1;
+        docp[i] = &docs[i];
+        infop[i] = &infos[i];
+    }
+
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_compression_threads(db, 2));
+    try(couchstore_bulk_load(db, docp, infop, 3000,
+                             COMPRESS_DOC_BODIES | COUCHSTORE_SEQUENCE_AS_IS));
+    try(couchstore_commit(db));
+    lookup_numbered_docs(db, 3000, 1);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 3000);
+    try(couchstore_db_info(db, &dbinfo));
+    assert(dbinfo.doc_count == 3000);
+    assert(dbinfo.last_sequence == 3000);
+
+    /* Only into an empty database; afterwards it's updated as usual */
+    assert(couchstore_bulk_load(db, docp, infop, 1, 0) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    save_numbered_docs(db, 1000, 3000);
+    lookup_numbered_docs(db, 4000, 1);
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* A repeated ID can't be loaded */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    docp[1] = docp[0];
+    infop[1] = infop[0];
+    assert(couchstore_bulk_load(db, docp, infop, 10, 0) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    assert(db->header.by_id_root == NULL);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    free(docs);
+    free(infos);
+    free(docp);
+    free(infop);
+    free(ids);
+    free(bodies);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    int nodes;
+    int max_depth;
+} tree_shape;
+
+static int tree_shape_cb(Db *db, int depth, const DocInfo *doc_info,
+                         uint64_t subtree_size, const sized_buf *reduce_value,
+                         void *ctx)
+{
+    tree_shape *shape = ctx;
+    (void)db;
+    (void)subtree_size;
+    (void)reduce_value;
+    if (doc_info == NULL) {
+        ++shape->nodes;
+    } else if (depth > shape->max_depth) {
+        shape->max_depth = depth;
+    }
+    return 0;
+}
+
+static void test_node_size_policy(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *fixed = NULL;
+    char fixedpath[1024], compactpath[1024];
+    tree_shape adaptive_shape = { 0, 0 }, fixed_shape = { 0, 0 };
+    int i;
+
+    fprintf(stderr, "node size policy.... ");
+    fflush(stderr);
+
+    sprintf(fixedpath, "%s.fixed", testfilepath);
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(fixedpath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_open_db(fixedpath, COUCHSTORE_OPEN_FLAG_CREATE, &fixed));
+    try(couchstore_set_node_size_policy(db, COUCHSTORE_NODE_SIZE_ADAPTIVE,
+                                        COUCHSTORE_NODE_SIZE_ADAPTIVE));
+    for (i = 0; i < 4; ++i) {
+        save_numbered_batch(db, i * 2000, 2000, 0);
+        save_numbered_batch(fixed, i * 2000, 2000, 0);
+    }
+    lookup_numbered_docs(db, 8000, 1);
+
+    /* Small entries make for wider nodes, so far fewer of them */
+    try(couchstore_walk_id_tree(db, NULL, 0, tree_shape_cb, &adaptive_shape));
+    try(couchstore_walk_id_tree(fixed, NULL, 0, tree_shape_cb, &fixed_shape));
+    assert(adaptive_shape.nodes * 2 < fixed_shape.nodes);
+    assert(adaptive_shape.max_depth <= fixed_shape.max_depth);
+
+    /* The policy and the averages are kept in the header */
+    try(couchstore_drop_file(db));
+    try(couchstore_reopen_file(db, testfilepath, 0));
+    assert(db->header.id_sizing.policy == COUCHSTORE_NODE_SIZE_ADAPTIVE);
+    assert(db->header.id_sizing.avg_key_size >= 4 && db->header.id_sizing.avg_key_size <= 7);
+    assert(db->header.seq_sizing.avg_key_size == 6);
+    assert(fixed->header.id_sizing.policy == COUCHSTORE_NODE_SIZE_FIXED);
+
+    /* ...and compaction keeps them */
+    try(couchstore_compact_db(db, compactpath));
+    couchstore_close_db(db);
+    try(couchstore_open_db(compactpath, 0, &db));
+    assert(db->header.seq_sizing.policy == COUCHSTORE_NODE_SIZE_ADAPTIVE);
+    lookup_numbered_docs(db, 8000, 1);
+
+    /* Older files keep the sizes they've always had */
+    fixed->header.disk_version = COUCH_DISK_VERSION_CODECS - 1;
+    assert(couchstore_set_node_size_policy(fixed, COUCHSTORE_NODE_SIZE_ADAPTIVE,
+                                           COUCHSTORE_NODE_SIZE_FIXED) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (fixed != NULL) {
+        couchstore_close_db(fixed);
+    }
+    remove(fixedpath);
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+/* Saves documents one per commit, as a commit-heavy writer would, and
+   returns the bytes that took. */
+static uint64_t save_committing_each(Db *db, int first, int n)
+{
+    couchstore_error_t errcode;
+    couchstore_io_stats stats;
+    Doc d;
+    DocInfo info;
+    char id[32], body[160];
+    int i;
+
+    couchstore_reset_io_stats(db);
+    for (i = first; i < first + n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", i, i);
+        setdoc(&d, &info, id, idlen, body, bodylen, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+        try(couchstore_commit(db));
+    }
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+    couchstore_get_io_stats(db, &stats);
+    return stats.bytes_written;
+}
+
+static void test_delta_buffer(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *plain = NULL, *reader = NULL;
+    char plainpath[1024], compactpath[1024];
+    uint64_t buffered_bytes, plain_bytes;
+    DocInfo *info;
+    DbInfo dbinfo;
+    Doc d;
+    DocInfo deleted;
+    int count;
+
+    fprintf(stderr, "delta buffer.... ");
+    fflush(stderr);
+
+    sprintf(plainpath, "%s.plain", testfilepath);
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(plainpath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_open_db(plainpath, COUCHSTORE_OPEN_FLAG_CREATE, &plain));
+    save_numbered_batch(db, 0, 2000, 0);
+    save_numbered_batch(plain, 0, 2000, 0);
+
+    /* Small commits log just their entries instead of new tree paths */
+    try(couchstore_set_delta_buffer(db, 100));
+    buffered_bytes = save_committing_each(db, 1000, 250);
+    plain_bytes = save_committing_each(plain, 1000, 250);
+    assert(buffered_bytes * 4 < plain_bytes);
+    assert(db->delta != NULL && db->delta->count == 50);
+
+    /* Pending saves are found by ID and sequence... */
+    try(couchstore_docinfo_by_id(db, "doc1240", 7, &info));
+    assert(info->db_seq > 2000);
+    couchstore_free_docinfo(info);
+    try(couchstore_docinfo_by_sequence(db, 2250, &info));
+    assert(info->id.size == 7 && memcmp(info->id.buf, "doc1249", 7) == 0);
+    couchstore_free_docinfo(info);
+
+    /* ...also once the log is reloaded, and through a read-only handle */
+    try(couchstore_drop_file(db));
+    try(couchstore_reopen_file(db, testfilepath, 0));
+    assert(db->delta != NULL && db->delta->count == 50);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &reader));
+    try(couchstore_docinfo_by_id(reader, "doc1240", 7, &info));
+    assert(info->db_seq > 2000);
+    couchstore_free_docinfo(info);
+
+    /* Other reads see them too, the reader folding them in memory */
+    count = 0;
+    try(couchstore_changes_since(reader, 2001, 0, check_numbered_doc_cb, &count));
+    assert(count == 250);
+    assert(reader->delta == NULL && reader->header.delta_ptr != 0);
+    assert(reader->file.overlay != NULL && reader->file.overlay->size > 0);
+    try(couchstore_db_info(reader, &dbinfo));
+    assert(dbinfo.doc_count == 2000 && dbinfo.last_sequence == 2250);
+    assert(dbinfo.file_size == db->file.pos);
+
+    /* Compacting the reader carries the pending saves over */
+    try(couchstore_compact_db(reader, compactpath));
+    couchstore_close_db(reader);
+    try(couchstore_open_db(compactpath, COUCHSTORE_OPEN_FLAG_RDONLY, &reader));
+    assert(reader->delta == NULL);
+    count = 0;
+    try(couchstore_changes_since(reader, 2001, 0, check_numbered_doc_cb, &count));
+    assert(count == 250);
+    lookup_numbered_docs(reader, 2000, 1);
+
+    /* Other reads fold the buffer in first, so nothing is seen twice */
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 2000);
+    assert(db->delta == NULL);
+    try(couchstore_db_info(db, &dbinfo));
+    assert(dbinfo.doc_count == 2000);
+    try(couchstore_commit(db));
+    assert(db->header.delta_ptr == 0);
+
+    /* A deletion is buffered like any save */
+    setdoc(&d, &deleted, "doc5", 4, NULL, 0, NULL, 0);
+    try(couchstore_save_document(db, NULL, &deleted, 0));
+    try(couchstore_docinfo_by_id(db, "doc5", 4, &info));
+    assert(info->deleted);
+    couchstore_free_docinfo(info);
+    try(couchstore_set_delta_buffer(db, 0));
+    assert(db->delta == NULL);
+    try(couchstore_db_info(db, &dbinfo));
+    assert(dbinfo.doc_count == 1999 && dbinfo.deleted_count == 1);
+
+    /* Older files update the trees at once */
+    plain->header.disk_version = COUCH_DISK_VERSION_CODECS - 1;
+    assert(couchstore_set_delta_buffer(plain, 100) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (plain != NULL) {
+        couchstore_close_db(plain);
+    }
+    if (reader != NULL) {
+        couchstore_close_db(reader);
+    }
+    remove(plainpath);
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+/* Saves docs first..first+n-1 one call each, committing every per_commit */
+static uint64_t save_batches_committing(Db *db, int first, int n, int per_commit)
+{
+    couchstore_error_t errcode;
+    couchstore_io_stats stats;
+    Doc d;
+    DocInfo info;
+    char id[32], body[160];
+    int i;
+
+    couchstore_reset_io_stats(db);
+    for (i = first; i < first + n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        int bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", i, i);
+        setdoc(&d, &info, id, idlen, body, bodylen, NULL, 0);
+        try(couchstore_save_document(db, &d, &info, 0));
+        if ((i - first + 1) % per_commit == 0) {
+            try(couchstore_commit(db));
+        }
+    }
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+    couchstore_get_io_stats(db, &stats);
+    return stats.bytes_written;
+}
+
+static void test_write_back(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *plain = NULL, *reader = NULL;
+    char plainpath[1024];
+    uint64_t held_bytes, plain_bytes;
+    DocInfo *info;
+    DbInfo dbinfo;
+
+    fprintf(stderr, "write-back.... ");
+    fflush(stderr);
+
+    sprintf(plainpath, "%s.plain", testfilepath);
+    remove(testfilepath);
+    remove(plainpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_open_db(plainpath, COUCHSTORE_OPEN_FLAG_CREATE, &plain));
+    save_numbered_batch(db, 0, 2000, 0);
+    save_numbered_batch(plain, 0, 2000, 0);
+
+    /* Saves between commits rewrite the paths they touch once */
+    try(couchstore_set_write_back(db, 1024 * 1024));
+    held_bytes = save_batches_committing(db, 1000, 500, 50);
+    plain_bytes = save_batches_committing(plain, 1000, 500, 50);
+    assert(held_bytes * 2 < plain_bytes);
+    assert(db->delta == NULL && db->header.delta_ptr == 0);
+
+    /* Held saves are found by ID before the commit, and by other
+       handles after it */
+    save_batches_committing(db, 1990, 20, 1000);
+    assert(db->delta != NULL && db->delta->count == 20);
+    try(couchstore_docinfo_by_id(db, "doc2005", 7, &info));
+    couchstore_free_docinfo(info);
+    try(couchstore_commit(db));
+    assert(db->delta == NULL);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &reader));
+    try(couchstore_docinfo_by_id(reader, "doc2005", 7, &info));
+    couchstore_free_docinfo(info);
+    try(couchstore_db_info(reader, &dbinfo));
+    assert(dbinfo.doc_count == 2010);
+
+    /* Past the cap they're folded in without waiting for the commit */
+    try(couchstore_set_write_back(db, 4096));
+    save_batches_committing(db, 0, 100, 1000);
+    assert(db->delta != NULL && db->delta->count < 100);
+    try(couchstore_set_write_back(db, 0));
+    assert(db->delta == NULL);
+    try(couchstore_commit(db));
+
+    /* Nothing is logged, so older files can hold saves too */
+    plain->header.disk_version = COUCH_DISK_VERSION_CODECS - 1;
+    try(couchstore_set_write_back(plain, 1024 * 1024));
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (plain != NULL) {
+        couchstore_close_db(plain);
+    }
+    if (reader != NULL) {
+        couchstore_close_db(reader);
+    }
+    remove(plainpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_preallocation(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    struct stat st;
+    int reserved, count;
+
+    fprintf(stderr, "preallocation.... ");
+    fflush(stderr);
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_preallocation(db, 1024 * 1024));
+    save_numbered_batch(db, 0, 1000, 0);
+
+    /* Space is reserved past the data without moving the end of the file,
+       unless the filesystem can't do that */
+    reserved = db->file.prealloc_chunk != 0;
+    assert(stat(testfilepath, &st) == 0);
+    assert((uint64_t)st.st_size == db->file.pos);
+    if (reserved) {
+        assert(db->file.allocated == 1024 * 1024);
+        assert(st.st_blocks * 512 >= 1024 * 1024);
+    }
+
+    /* ...and given back when the file is dropped, to be taken again */
+    try(couchstore_drop_file(db));
+    assert(stat(testfilepath, &st) == 0);
+    assert(st.st_blocks * 512 < 1024 * 1024);
+    try(couchstore_reopen_file(db, testfilepath, 0));
+    assert(!reserved || db->file.prealloc_chunk == 1024 * 1024);
+    save_numbered_batch(db, 1000, 7000, 0);
+    if (reserved) {
+        assert(db->file.allocated >= db->file.pos);
+        assert(db->file.allocated % (1024 * 1024) == 0);
+        assert(db->file.allocated > 1024 * 1024);
+    }
+    couchstore_close_db(db);
+    db = NULL;
+
+    assert(stat(testfilepath, &st) == 0);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &db));
+    assert((uint64_t)st.st_blocks * 512 < db->file.pos + 1024 * 1024);
+    assert((uint64_t)st.st_size == db->file.pos);
+    count = 0;
+    try(couchstore_changes_since(db, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 8000);
+    lookup_numbered_docs(db, 8000, 1);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_resumable_compaction(void)
+{
+    couchstore_error_t errcode;
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    Db *db = NULL, *compacted = NULL;
+    LocalDoc localdoc, *ldoc = NULL;
+    DocInfo *info = NULL;
+    DbInfo dbinfo;
+    char compactpath[1024];
+    int done, calls, count;
+
+    fprintf(stderr, "resumable compaction.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                           COUCHSTORE_OPEN_FLAG_BLOOM_FILTER, &db));
+    save_numbered_batch(db, 0, 20000, 0);
+    save_numbered_batch(db, 5000, 5000, 0);
+    localdoc.id.buf = "_local/testlocal";
+    localdoc.id.size = 16;
+    localdoc.json.buf = "{\"test\":true}";
+    localdoc.json.size = 13;
+    localdoc.deleted = 0;
+    try(couchstore_save_local_document(db, &localdoc));
+    try(couchstore_commit(db));
+
+    /* A first slice, with checkpoints along the way */
+    try(couchstore_compact_db_resumable(db, compactpath, 0, NULL, NULL, ops,
+                                        3000, 8000, &done));
+    assert(!done);
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(compacted->header.compact_ptr != 0);
+    try(couchstore_db_info(compacted, &dbinfo));
+    assert(dbinfo.doc_count == 8000);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+
+    /* The source moves on and is reopened; the compaction carries on with
+       the header it started from */
+    save_numbered_batch(db, 20000, 1000, 0);
+    try(couchstore_commit(db));
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(testfilepath, 0, &db));
+    calls = 0;
+    do {
+        try(couchstore_compact_db_resumable(db, compactpath, 0, NULL, NULL, ops,
+                                            3000, 8000, &done));
+        ++calls;
+    } while (!done);
+    assert(calls == 2);
+
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(compacted->header.compact_ptr == 0);
+    assert(compacted->header.update_seq == 25000);
+    assert(compacted->header.bloom_ptr != 0);
+    lookup_numbered_docs(compacted, 20000, 1);
+    assert(couchstore_docinfo_by_id(compacted, "doc20000", 8, &info) ==
+           COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    count = 0;
+    try(couchstore_changes_since(compacted, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 20000);
+    try(couchstore_open_local_document(compacted, "_local/testlocal", 16, &ldoc));
+    assert(ldoc->json.size == 13);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+
+    /* A finished target has nothing to resume, so it's started over */
+    try(couchstore_compact_db_resumable(db, compactpath, 0, NULL, NULL, ops,
+                                        0, 0, &done));
+    assert(done);
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    lookup_numbered_docs(compacted, 21000, 1);
+
+cleanup:
+    couchstore_free_local_document(ldoc);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_compact_catch_up(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *reader = NULL, *compacted = NULL;
+    Doc doc;
+    DocInfo delinfo, *info = NULL;
+    LocalDoc localdoc, *ldoc = NULL;
+    char compactpath[1024];
+    uint64_t replayed;
+    int count;
+
+    fprintf(stderr, "compaction catch-up.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 5000, 0);
+    try(couchstore_commit(db));
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY, &reader));
+    try(couchstore_compact_db(reader, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+
+    /* The writer carries on through its own handle: updates, new docs, a
+       deletion and a local doc */
+    save_numbered_batch(db, 4000, 2000, 0);
+    setdoc(&doc, &delinfo, "doc7", 4, NULL, 0, NULL, 0);
+    delinfo.deleted = 1;
+    try(couchstore_save_document(db, NULL, &delinfo, 0));
+    localdoc.id.buf = "_local/testlocal";
+    localdoc.id.size = 16;
+    localdoc.json.buf = "{\"test\":true}";
+    localdoc.json.size = 13;
+    localdoc.deleted = 0;
+    try(couchstore_save_local_document(db, &localdoc));
+    try(couchstore_commit(db));
+
+    try(couchstore_compact_catch_up(reader, compacted, 0, 3, &replayed));
+    assert(replayed == 0);
+    assert(compacted->header.update_seq == db->header.update_seq);
+    lookup_numbered_docs(compacted, 6000, 1);
+    try(couchstore_docinfo_by_id(compacted, "doc7", 4, &info));
+    assert(info->deleted);
+    couchstore_free_docinfo(info);
+    info = NULL;
+    /* The old sequences of updated docs are gone */
+    count = 0;
+    try(couchstore_changes_since(compacted, 0, COUCHSTORE_NO_DELETES,
+                                 check_numbered_doc_cb, &count));
+    assert(count == 5999);
+
+    /* Saves the writer has committed to its delta log, which the reader
+       can't fold into its trees */
+    try(couchstore_set_delta_buffer(db, 1000));
+    save_numbered_batch(db, 6000, 100, 0);
+    try(couchstore_commit(db));
+    try(couchstore_compact_catch_up(reader, compacted, 0, 2, &replayed));
+    assert(compacted->header.update_seq == db->header.update_seq);
+    lookup_numbered_docs(compacted, 6100, 1);
+    count = 0;
+    try(couchstore_changes_since(compacted, 0, COUCHSTORE_NO_DELETES,
+                                 check_numbered_doc_cb, &count));
+    assert(count == 6099);
+    try(couchstore_open_local_document(compacted, "_local/testlocal", 16, &ldoc));
+    assert(ldoc->json.size == 13);
+
+cleanup:
+    couchstore_free_docinfo(info);
+    couchstore_free_local_document(ldoc);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (reader != NULL) {
+        couchstore_close_db(reader);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int drop_every_seventh(Db *target, DocInfo *info, void *ctx)
+{
+    (void)target;
+    (void)ctx;
+    if (info != NULL && info->db_seq % 7 == 0) {
+        return COUCHSTORE_COMPACT_DROP_ITEM;
+    }
+    return COUCHSTORE_COMPACT_KEEP_ITEM;
+}
+
+static void test_compaction_threads(void)
+{
+    couchstore_error_t errcode;
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    Db *db = NULL, *compacted = NULL;
+    char serialpath[1024], threadedpath[1024];
+    Doc *doc = NULL;
+    FILE *f1 = NULL, *f2 = NULL;
+    char body[160];
+    int c1, c2, count, bodylen;
+
+    fprintf(stderr, "compaction threads.... ");
+    fflush(stderr);
+
+    sprintf(serialpath, "%s.serial", testfilepath);
+    sprintf(threadedpath, "%s.threaded", testfilepath);
+    remove(testfilepath);
+    remove(serialpath);
+    remove(threadedpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    /* More bodies than the reader holds, some compressed, some replaced */
+    save_numbered_batch(db, 0, 20000, COMPRESS_DOC_BODIES);
+    save_numbered_batch(db, 5000, 5000, 0);
+
+    try(couchstore_compact_db_ex(db, serialpath, 0, drop_every_seventh, NULL, ops));
+    try(couchstore_set_compaction_threads(db, 3));
+    try(couchstore_compact_db_ex(db, threadedpath, 0, drop_every_seventh, NULL, ops));
+
+    /* Read ahead, but written the same as one body after another */
+    f1 = fopen(serialpath, "rb");
+    f2 = fopen(threadedpath, "rb");
+    assert(f1 && f2);
+    do {
+        c1 = getc(f1);
+        c2 = getc(f2);
+        assert(c1 == c2);
+    } while (c1 != EOF);
+
+    try(couchstore_open_db(threadedpath, 0, &compacted));
+    count = 0;
+    try(couchstore_changes_since(compacted, 0, 0, check_numbered_doc_cb, &count));
+    /* Live at seqs 1-5000 and 10001-25000, less every seventh */
+    assert(count == 20000 - 5000 / 7 - (25000 / 7 - 10000 / 7));
+
+    /* Bodies are copied as they were, compressed or not, CRCs and all */
+    try(couchstore_open_document(compacted, "doc2", 4, &doc, DECOMPRESS_DOC_BODIES));
+    bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", 2, 2);
+    assert(doc->data.size == (size_t)bodylen && memcmp(doc->data.buf, body, bodylen) == 0);
+    couchstore_free_document(doc);
+    doc = NULL;
+    try(couchstore_open_document(compacted, "doc6000", 7, &doc, 0));
+    bodylen = sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", 6000, 6000);
+    assert(doc->data.size == (size_t)bodylen && memcmp(doc->data.buf, body, bodylen) == 0);
+
+cleanup:
+    couchstore_free_document(doc);
+    if (f1 != NULL) {
+        fclose(f1);
+    }
+    if (f2 != NULL) {
+        fclose(f2);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(serialpath);
+    remove(threadedpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    int calls;
+    uint64_t last_bytes;
+    int cancel_after;
+} throttle_count;
+
+static couchstore_error_t count_throttle_calls(uint64_t bytes, void *ctx)
+{
+    throttle_count *count = ctx;
+    assert(bytes > count->last_bytes);
+    count->last_bytes = bytes;
+    if (++count->calls == count->cancel_after) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static void test_compaction_throttle(void)
+{
+    couchstore_error_t errcode;
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    Db *db = NULL, *compacted = NULL;
+    couchstore_compact_throttle throttle;
+    throttle_count count;
+    char compactpath[1024];
+    FILE *f;
+    int changes;
+
+    fprintf(stderr, "compaction throttle.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 20000, 0);
+
+    /* Called back in steps, with the bytes going up; a limit well above
+       what the test moves in its time only adds the checks */
+    memset(&throttle, 0, sizeof(throttle));
+    memset(&count, 0, sizeof(count));
+    throttle.bytes_per_sec = 1024 * 1024 * 1024;
+    throttle.callback = count_throttle_calls;
+    throttle.callback_ctx = &count;
+    throttle.idle_io = 1;
+    try(couchstore_set_compaction_throttle(db, &throttle));
+    try(couchstore_compact_db_ex(db, compactpath, 0, NULL, NULL, ops));
+    assert(count.calls > 4);
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    changes = 0;
+    try(couchstore_changes_since(compacted, 0, 0, check_numbered_doc_cb, &changes));
+    assert(changes == 20000);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    remove(compactpath);
+
+    /* An error from the callback stops the compaction, and the target goes */
+    memset(&count, 0, sizeof(count));
+    count.cancel_after = 3;
+    assert(couchstore_compact_db_ex(db, compactpath, 0, NULL, NULL, ops) ==
+           COUCHSTORE_ERROR_CANCEL);
+    assert(count.calls == 3);
+    f = fopen(compactpath, "rb");
+    assert(f == NULL);
+
+    /* Cleared, compactions aren't held back at all */
+    memset(&count, 0, sizeof(count));
+    try(couchstore_set_compaction_throttle(db, NULL));
+    try(couchstore_compact_db_ex(db, compactpath, 0, NULL, NULL, ops));
+    assert(count.calls == 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_fragmentation_stats(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    couchstore_fragmentation_info frag, after;
+    DbInfo dbinfo;
+    char compactpath[1024];
+
+    fprintf(stderr, "fragmentation stats.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 10000, 0);
+    save_numbered_batch(db, 0, 10000, 0);
+
+    /* The same live bytes as the DbInfo, split up */
+    try(couchstore_fragmentation_stats(db, &frag));
+    try(couchstore_db_info(db, &dbinfo));
+    assert(frag.file_size == dbinfo.file_size);
+    assert(frag.live_doc_bytes + frag.live_tree_bytes == dbinfo.space_used);
+    assert(frag.live_tree_bytes == frag.by_id_tree_bytes + frag.by_seq_tree_bytes +
+                                   frag.local_tree_bytes);
+    assert(frag.by_id_tree_bytes > 0 && frag.by_seq_tree_bytes > 0);
+    assert(frag.local_tree_bytes == 0);
+    assert(frag.stale_bytes == frag.file_size - dbinfo.space_used);
+    /* Every body was written twice */
+    assert(frag.stale_bytes > frag.live_doc_bytes);
+
+    /* Compaction keeps the live bytes and frees the stale ones */
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    try(couchstore_fragmentation_stats(compacted, &after));
+    assert(after.live_doc_bytes == frag.live_doc_bytes);
+    assert(after.stale_bytes < frag.stale_bytes / 10);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    int nodes;
+    int calls;
+    int bad_order;
+    uint64_t disk_bytes;
+    uint64_t leaf_entries;
+} node_walk;
+
+static int node_walk_cb(Db *db, const couchstore_node_info *node, void *ctx)
+{
+    node_walk *walk = ctx;
+    (void)db;
+    /* The root comes first, and nothing else is at its depth */
+    if ((walk->calls++ == 0) != (node->depth == 0)) {
+        ++walk->bad_order;
+    }
+    ++walk->nodes;
+    walk->disk_bytes += node->disk_size;
+    if (node->is_leaf) {
+        walk->leaf_entries += node->count;
+    }
+    assert(node->size > 0 && node->count > 0);
+    return 0;
+}
+
+static void test_walk_nodes(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    couchstore_fragmentation_info frag;
+    tree_shape shape = { 0, 0 };
+    node_walk by_id, by_seq;
+
+    fprintf(stderr, "walk nodes.... ");
+    fflush(stderr);
+
+    memset(&by_id, 0, sizeof(by_id));
+    memset(&by_seq, 0, sizeof(by_seq));
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 10000, 0);
+    save_numbered_batch(db, 5000, 10000, 0);
+
+    try(couchstore_walk_nodes(db, COUCHSTORE_CURSOR_BY_ID, node_walk_cb, &by_id));
+    try(couchstore_walk_nodes(db, COUCHSTORE_CURSOR_BY_SEQUENCE, node_walk_cb, &by_seq));
+    assert(by_id.bad_order == 0 && by_seq.bad_order == 0);
+    /* Every document once, and every node the document walk goes through */
+    assert(by_id.leaf_entries == 15000 && by_seq.leaf_entries == 15000);
+    try(couchstore_walk_id_tree(db, NULL, 0, tree_shape_cb, &shape));
+    assert(by_id.nodes == shape.nodes);
+    /* The nodes' own sizes add up to their trees' */
+    try(couchstore_fragmentation_stats(db, &frag));
+    assert(by_id.disk_bytes == frag.by_id_tree_bytes);
+    assert(by_seq.disk_bytes == frag.by_seq_tree_bytes);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    int skip_depth;             /* of the subtrees to pass over */
+    int skip_once;              /* only the first of them */
+    int nodes;
+    int skipped;
+    int docs;
+    uint64_t first_seq;
+} pruned_walk;
+
+static int pruned_walk_cb(Db *db, int depth, const DocInfo *doc_info,
+                          uint64_t subtree_size, const sized_buf *reduce_value,
+                          void *ctx)
+{
+    pruned_walk *walk = ctx;
+    (void)db;
+    (void)subtree_size;
+    (void)reduce_value;
+    if (doc_info != NULL) {
+        if (walk->docs++ == 0) {
+            walk->first_seq = doc_info->db_seq;
+        }
+        return 0;
+    }
+    ++walk->nodes;
+    if (depth == walk->skip_depth && !(walk->skip_once && walk->skipped > 0)) {
+        ++walk->skipped;
+        return COUCHSTORE_WALK_SKIP_SUBTREE;
+    }
+    return 0;
+}
+
+static void test_walk_pruning(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    pruned_walk walk;
+
+    fprintf(stderr, "walk pruning.... ");
+    fflush(stderr);
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 10000, 0);
+
+    /* Skipping the root walks nothing else */
+    memset(&walk, 0, sizeof(walk));
+    try(couchstore_walk_id_tree(db, NULL, 0, pruned_walk_cb, &walk));
+    assert(walk.nodes == 1 && walk.docs == 0);
+
+    /* Skipping each of the root's children is only called for them */
+    memset(&walk, 0, sizeof(walk));
+    walk.skip_depth = 1;
+    try(couchstore_walk_id_tree(db, NULL, 0, pruned_walk_cb, &walk));
+    assert(walk.skipped > 1);
+    assert(walk.nodes == walk.skipped + 1 && walk.docs == 0);
+
+    /* Skipping the first goes on with the ones after it */
+    memset(&walk, 0, sizeof(walk));
+    walk.skip_depth = 1;
+    walk.skip_once = 1;
+    try(couchstore_walk_seq_tree(db, 0, 0, pruned_walk_cb, &walk));
+    assert(walk.skipped == 1);
+    assert(walk.docs > 0 && walk.docs < 10000);
+    assert(walk.first_seq == (uint64_t)(10000 - walk.docs + 1));
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+#define SCAN_TEST_THREADS 4
+
+typedef struct {
+    int count;
+    int ordered;
+    uint64_t first_seq;
+    uint64_t last_seq;
+} scan_part_log;
+
+typedef struct {
+    scan_part_log parts[SCAN_TEST_THREADS];
+    int fail_at;                /* sequence to fail at, or 0 */
+} scan_log;
+
+static int scan_log_cb(Db *db, int partition, DocInfo *docinfo, void *ctx)
+{
+    scan_log *log = ctx;
+    scan_part_log *part = &log->parts[partition];
+    (void)db;
+    assert(partition >= 0 && partition < SCAN_TEST_THREADS);
+    if (log->fail_at != 0 && docinfo->db_seq == (uint64_t)log->fail_at) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    if (part->count++ == 0) {
+        part->first_seq = docinfo->db_seq;
+        part->ordered = 1;
+    } else if (docinfo->db_seq <= part->last_seq) {
+        part->ordered = 0;
+    }
+    part->last_seq = docinfo->db_seq;
+    return 0;
+}
+
+static void test_parallel_scan(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    scan_log log;
+    int i, total, used;
+
+    fprintf(stderr, "parallel scan.... ");
+    fflush(stderr);
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 20000, 0);
+    try(couchstore_commit(db));
+
+    /* Every document once, each partition in order and after the one before */
+    memset(&log, 0, sizeof(log));
+    try(couchstore_parallel_scan(db, COUCHSTORE_CURSOR_BY_SEQUENCE, SCAN_TEST_THREADS, 0,
+                                 scan_log_cb, &log));
+    for (i = 0, total = 0, used = 0; i < SCAN_TEST_THREADS; ++i) {
+        if (log.parts[i].count == 0) {
+            continue;
+        }
+        assert(i == used++);
+        assert(log.parts[i].ordered);
+        assert(log.parts[i].last_seq - log.parts[i].first_seq + 1 ==
+               (uint64_t)log.parts[i].count);
+        assert(log.parts[i].first_seq == (uint64_t)total + 1);
+        total += log.parts[i].count;
+    }
+    assert(total == 20000 && used > 1);
+
+    memset(&log, 0, sizeof(log));
+    try(couchstore_parallel_scan(db, COUCHSTORE_CURSOR_BY_ID, SCAN_TEST_THREADS, 0,
+                                 scan_log_cb, &log));
+    for (i = 0, total = 0; i < SCAN_TEST_THREADS; ++i) {
+        total += log.parts[i].count;
+    }
+    assert(total == 20000);
+
+    /* One partition failing fails the scan */
+    memset(&log, 0, sizeof(log));
+    log.fail_at = 15000;
+    assert(couchstore_parallel_scan(db, COUCHSTORE_CURSOR_BY_SEQUENCE, SCAN_TEST_THREADS, 0,
+                                    scan_log_cb, &log) == COUCHSTORE_ERROR_CANCEL);
+    assert(couchstore_parallel_scan(db, COUCHSTORE_CURSOR_BY_SEQUENCE, 0, 0,
+                                    scan_log_cb, &log) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+/* Appends what a crash can leave past the last header: a long run of
+   zeroed blocks, as reserved by preallocation. */
+static void append_zero_tail(const char *path, size_t size)
+{
+    char block[4096];
+    FILE *f = fopen(path, "ab");
+    size_t done;
+
+    assert(f != NULL);
+    memset(block, 0, sizeof(block));
+    for (done = 0; done < size; done += sizeof(block)) {
+        assert(fwrite(block, sizeof(block), 1, f) == 1);
+    }
+    fclose(f);
+}
+
+static void overwrite_byte(const char *path, long pos, int byte)
+{
+    FILE *f = fopen(path, "r+b");
+    assert(f != NULL);
+    assert(fseek(f, pos, SEEK_SET) == 0);
+    assert(fputc(byte, f) == byte);
+    fclose(f);
+}
+
+static void test_header_hints(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *plain = NULL, *compacted = NULL;
+    couchstore_io_stats hinted_stats, plain_stats;
+    char plainpath[1024], compactpath[1024];
+    uint64_t newest, previous, seq;
+    int round;
+
+    fprintf(stderr, "header hints.... ");
+    fflush(stderr);
+
+    sprintf(plainpath, "%s.plain", testfilepath);
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(plainpath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                           COUCHSTORE_OPEN_FLAG_HEADER_HINTS, &db));
+    try(couchstore_open_db(plainpath, COUCHSTORE_OPEN_FLAG_CREATE, &plain));
+    assert(db->header.position == 4096 && plain->header.position == 0);
+    /* More commits than the list holds */
+    for (round = 0; round < 12; ++round) {
+        save_numbered_batch(db, round * 100, 100, 0);
+        save_numbered_batch(plain, round * 100, 100, 0);
+    }
+    newest = db->header.position;
+    previous = db->hints[1];
+    seq = db->header.update_seq;
+    assert(db->nhints == 8 && db->hints[0] == newest && previous < newest);
+    couchstore_close_db(db);
+    db = NULL;
+    couchstore_close_db(plain);
+    plain = NULL;
+
+    /* Found straight away past a tail the scan reads all of */
+    append_zero_tail(testfilepath, 4 * 1024 * 1024);
+    append_zero_tail(plainpath, 4 * 1024 * 1024);
+    try(couchstore_open_db(testfilepath, 0, &db));
+    try(couchstore_open_db(plainpath, 0, &plain));
+    assert(db->header.position == newest && db->header.update_seq == seq);
+    assert(plain->header.update_seq == seq);
+    couchstore_get_io_stats(db, &hinted_stats);
+    couchstore_get_io_stats(plain, &plain_stats);
+    assert(hinted_stats.bytes_read < 64 * 1024);
+    assert(plain_stats.bytes_read > 1024 * 1024);
+    couchstore_close_db(plain);
+    plain = NULL;
+
+    /* Compaction keeps the list */
+    try(couchstore_compact_db(db, compactpath));
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(compacted->header_hints && compacted->nhints == 1);
+    assert(compacted->hints[0] == compacted->header.position);
+    assert(compacted->header.update_seq == seq);
+    lookup_numbered_docs(compacted, 1200, 1);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+
+    /* A torn newest header falls back to the one before */
+    overwrite_byte(testfilepath, (long)newest + 6, 0x5a);
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->header.position == previous);
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* And a list that doesn't check out to the scan */
+    overwrite_byte(testfilepath, 3, 0x5a);
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(!db->header_hints);
+    assert(db->header.position == previous);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (plain != NULL) {
+        couchstore_close_db(plain);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(plainpath);
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int read_byte(const char *path, long pos)
+{
+    FILE *f = fopen(path, "rb");
+    int byte;
+    assert(f != NULL);
+    assert(fseek(f, pos, SEEK_SET) == 0);
+    byte = fgetc(f);
+    fclose(f);
+    return byte;
+}
+
+static void test_crc32c(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    Doc *doc;
+    char compactpath[1024];
+    uint64_t pos;
+    int round;
+
+    fprintf(stderr, "CRC32C files.... ");
+    fflush(stderr);
+
+    assert(hash_crc32("123456789", 9) == 0xcbf43926);
+    assert(hash_crc32c("123456789", 9) == 0xe3069283);
+    assert(hash_crc32c("", 0) == 0);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                           COUCHSTORE_OPEN_FLAG_CRC32C, &db));
+    assert(db->file.crc32c);
+    for (round = 0; round < 5; ++round) {
+        save_numbered_batch(db, round * 100, 100, 0);
+    }
+    pos = db->header.position;
+    couchstore_close_db(db);
+    db = NULL;
+    assert(read_byte(testfilepath, (long)pos) == BLOCK_HEADER_CRC32C);
+
+    /* Files keep it without the flag, and compaction carries it over */
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->file.crc32c && db->header.position == pos);
+    assert(db->header.disk_version >= COUCH_DISK_VERSION_CRC32C);
+    lookup_numbered_docs(db, 500, 1);
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(compacted->file.crc32c);
+    assert(read_byte(compactpath, (long)compacted->header.position) == BLOCK_HEADER_CRC32C);
+    lookup_numbered_docs(compacted, 500, 1);
+    for (round = 0; round < 500; round += 50) {
+        char id[32];
+        int idlen = sprintf(id, "doc%d", round);
+        try(couchstore_open_document(compacted, id, idlen, &doc, DECOMPRESS_DOC_BODIES));
+        couchstore_free_document(doc);
+    }
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Other files go on using CRC32 */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 100, 0);
+    assert(!db->file.crc32c);
+    assert(read_byte(testfilepath, (long)db->header.position) == 1);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_open_dbs(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_open_request requests[6];
+    char paths[6][1024];
+    Db *db;
+    int i, count;
+
+    fprintf(stderr, "open dbs.... ");
+    fflush(stderr);
+
+    memset(requests, 0, sizeof(requests));
+    for (i = 0; i < 6; ++i) {
+        sprintf(paths[i], "%s.%d", testfilepath, i);
+        remove(paths[i]);
+        requests[i].filename = paths[i];
+    }
+    /* All but the last, which stays missing */
+    for (i = 0; i < 5; ++i) {
+        try(couchstore_open_db(paths[i], COUCHSTORE_OPEN_FLAG_CREATE, &db));
+        save_numbered_batch(db, 0, 200 + i * 100, 0);
+        couchstore_close_db(db);
+    }
+
+    assert(couchstore_open_dbs(requests, 6, 0, couchstore_get_default_file_ops(),
+                               3, 2) == COUCHSTORE_ERROR_NO_SUCH_FILE);
+    assert(requests[5].db == NULL);
+    assert(requests[5].error == COUCHSTORE_ERROR_NO_SUCH_FILE);
+    for (i = 0; i < 5; ++i) {
+        assert(requests[i].error == COUCHSTORE_SUCCESS && requests[i].db != NULL);
+        count = 0;
+        try(couchstore_all_docs(requests[i].db, NULL, 0, check_numbered_doc_cb, &count));
+        assert(count == 200 + i * 100);
+        lookup_numbered_docs(requests[i].db, count, 0);
+        couchstore_close_db(requests[i].db);
+        requests[i].db = NULL;
+    }
+
+    /* And one after another, on this thread */
+    assert(couchstore_open_dbs(requests, 5, 0, couchstore_get_default_file_ops(),
+                               0, 0) == COUCHSTORE_SUCCESS);
+    for (i = 0; i < 5; ++i) {
+        assert(requests[i].db->header.update_seq == (uint64_t)(200 + i * 100));
+        couchstore_close_db(requests[i].db);
+        requests[i].db = NULL;
+    }
+
+cleanup:
+    for (i = 0; i < 6; ++i) {
+        if (requests[i].db != NULL) {
+            couchstore_close_db(requests[i].db);
+        }
+        remove(paths[i]);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int count_docs(Db *db)
+{
+    int count = 0;
+    assert(couchstore_all_docs(db, NULL, 0, check_numbered_doc_cb, &count) == COUCHSTORE_SUCCESS);
+    return count;
+}
+
+static void scan_snapshot(void *arg)
+{
+    Db *snap = arg;
+    int round;
+
+    for (round = 0; round < 5; ++round) {
+        assert(count_docs(snap) == 500);
+        lookup_numbered_docs(snap, 500, 0);
+    }
+}
+
+static void test_snapshots(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *snaps[4] = { NULL };
+    cb_thread_t threads[4];
+    Doc doc;
+    DocInfo info;
+    int i;
+
+    fprintf(stderr, "snapshots.... ");
+    fflush(stderr);
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 500, 0);
+    /* Saved but not committed, so not in the snapshots */
+    setdoc(&doc, &info, "doc900", 6, "{\"value\": 900}", 14, NULL, 0);
+    try(couchstore_save_document(db, &doc, &info, 0));
+    for (i = 0; i < 4; ++i) {
+        try(couchstore_open_snapshot(db, &snaps[i]));
+        assert(snaps[i]->header.position == db->header.position);
+    }
+    assert(couchstore_docinfo_by_id(snaps[0], "doc900", 6, NULL) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+
+    /* Read from other threads while this one goes on committing */
+    for (i = 0; i < 4; ++i) {
+        assert(cb_create_thread(&threads[i], scan_snapshot, snaps[i], 0) == 0);
+    }
+    for (i = 0; i < 5; ++i) {
+        save_numbered_batch(db, 500 + i * 100, 100, 0);
+    }
+    for (i = 0; i < 4; ++i) {
+        assert(cb_join_thread(threads[i]) == 0);
+    }
+    assert(count_docs(db) == 1000);
+    for (i = 0; i < 4; ++i) {
+        assert(count_docs(snaps[i]) == 500);
+    }
+
+    /* Snapshots can't write */
+    assert(couchstore_save_document(snaps[0], &doc, &info, 0) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    assert(count_docs(db) == 1000);
+
+cleanup:
+    for (i = 0; i < 4; ++i) {
+        if (snaps[i] != NULL) {
+            couchstore_close_db(snaps[i]);
+        }
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void look_up_shared(void *arg)
+{
+    Db *db = arg;
+    DocInfo *missing;
+    char id[32];
+    int round, i;
+
+    for (round = 0; round < 5; ++round) {
+        for (i = 0; i < 500; i += 7) {
+            DocInfo *info;
+            Doc *doc;
+            int idlen = sprintf(id, "doc%d", i);
+            assert(couchstore_docinfo_by_id(db, id, idlen, &info) == COUCHSTORE_SUCCESS);
+            assert(info->id.size == (size_t)idlen);
+            assert(couchstore_open_doc_with_docinfo(db, info, &doc, 0) == COUCHSTORE_SUCCESS);
+            couchstore_free_document(doc);
+            couchstore_free_docinfo(info);
+            assert(couchstore_open_document(db, id, idlen, &doc, 0) == COUCHSTORE_SUCCESS);
+            couchstore_free_document(doc);
+        }
+        assert(couchstore_docinfo_by_id(db, "nodoc", 5, &missing) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    }
+}
+
+static void test_shared_reads(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL;
+    cb_thread_t threads[4];
+    DocInfo *info;
+    Doc doc;
+    DocInfo newinfo;
+    int i;
+
+    fprintf(stderr, "shared reads.... ");
+    fflush(stderr);
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                           COUCHSTORE_OPEN_FLAG_SHARED_READS, &db));
+    save_numbered_batch(db, 0, 500, 0);
+
+    /* Looked up from other threads while this one goes on committing */
+    for (i = 0; i < 4; ++i) {
+        assert(cb_create_thread(&threads[i], look_up_shared, db, 0) == 0);
+    }
+    for (i = 0; i < 5; ++i) {
+        save_numbered_batch(db, 500 + i * 100, 100, 0);
+    }
+    for (i = 0; i < 4; ++i) {
+        assert(cb_join_thread(threads[i]) == 0);
+    }
+    assert(count_docs(db) == 1000);
+    try(couchstore_docinfo_by_id(db, "doc999", 6, &info));
+    couchstore_free_docinfo(info);
+
+    /* Lookups see the last commit */
+    setdoc(&doc, &newinfo, "doc2000", 7, "{\"value\": 2000}", 15, NULL, 0);
+    try(couchstore_save_document(db, &doc, &newinfo, 0));
+    assert(couchstore_docinfo_by_id(db, "doc2000", 7, &info) == COUCHSTORE_ERROR_DOC_NOT_FOUND);
+    try(couchstore_commit(db));
+    try(couchstore_docinfo_by_id(db, "doc2000", 7, &info));
+    couchstore_free_docinfo(info);
+
+    /* The io_uring ops share one ring per handle between the threads */
+    if (couchstore_get_io_uring_file_ops() != NULL) {
+        couchstore_close_db(db);
+        db = NULL;
+        remove(testfilepath);
+        try(couchstore_open_db_ex(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                                  COUCHSTORE_OPEN_FLAG_SHARED_READS,
+                                  couchstore_get_io_uring_file_ops(), &db));
+        save_numbered_batch(db, 0, 500, 0);
+        for (i = 0; i < 4; ++i) {
+            assert(cb_create_thread(&threads[i], look_up_shared, db, 0) == 0);
+        }
+        for (i = 0; i < 5; ++i) {
+            save_numbered_batch(db, 500 + i * 100, 100, 0);
+        }
+        for (i = 0; i < 4; ++i) {
+            assert(cb_join_thread(threads[i]) == 0);
+        }
+        assert(count_docs(db) == 1000);
+    }
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+/* Saves doc<first>..doc<first+n-1>, deleted if asked, with a rev_meta of
+   a CAS, the given time as big-endian and the flags, as deletions have. */
+static void save_timed_docs(Db *db, int first, int n, int deleted, uint32_t time)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char id[32], meta[16];
+    Doc doc;
+    DocInfo info;
+    int i;
+
+    memset(meta, 0, sizeof(meta));
+    meta[8] = (char)(time >> 24);
+    meta[9] = (char)(time >> 16);
+    meta[10] = (char)(time >> 8);
+    meta[11] = (char)time;
+    for (i = first; i < first + n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        setdoc(&doc, &info, id, idlen, "{}", 2, meta, sizeof(meta));
+        info.deleted = deleted;
+        try(couchstore_save_document(db, deleted ? NULL : &doc, &info, 0));
+    }
+    try(couchstore_commit(db));
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static int count_hooked(Db *target, DocInfo *info, void *ctx)
+{
+    (void)target;
+    if (info != NULL && info->deleted) {
+        ++*(int *)ctx;
+    }
+    return COUCHSTORE_COMPACT_KEEP_ITEM;
+}
+
+static void test_purge_policy(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    Db *db = NULL, *compacted = NULL;
+    couchstore_purge_policy policy;
+    DbInfo info;
+    char compactpath[1024];
+    int hooked, done;
+
+    fprintf(stderr, "purge policy.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    /* Seqs 1-30 live, then 31-40 deleted at 100 and 41-50 at 200 */
+    save_timed_docs(db, 0, 30, 0, 0);
+    save_timed_docs(db, 0, 10, 1, 100);
+    save_timed_docs(db, 10, 10, 1, 200);
+
+    /* By sequence, with the hook seeing only the tombstones kept */
+    memset(&policy, 0, sizeof(policy));
+    policy.max_seq = 40;
+    try(couchstore_set_purge_policy(db, &policy));
+    hooked = 0;
+    try(couchstore_compact_db_ex(db, compactpath, 0, count_hooked, &hooked, ops));
+    assert(hooked == 10);
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    try(couchstore_db_info(compacted, &info));
+    assert(info.doc_count == 10 && info.deleted_count == 10);
+    assert(compacted->header.purge_seq == 40);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    remove(compactpath);
+
+    /* By deletion time, resumably */
+    memset(&policy, 0, sizeof(policy));
+    policy.before_time = 150;
+    policy.time_offset = 8;
+    try(couchstore_set_purge_policy(db, &policy));
+    try(couchstore_compact_db_resumable(db, compactpath, 0, NULL, NULL, ops, 7, 0, &done));
+    assert(done);
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    try(couchstore_db_info(compacted, &info));
+    assert(info.doc_count == 10 && info.deleted_count == 10);
+    assert(compacted->header.purge_seq == 40);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    remove(compactpath);
+
+    /* Either rule drops; cleared, nothing is */
+    policy.max_seq = 45;
+    policy.before_time = 250;
+    try(couchstore_set_purge_policy(db, &policy));
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    try(couchstore_db_info(compacted, &info));
+    assert(info.doc_count == 10 && info.deleted_count == 0);
+    assert(compacted->header.purge_seq == 50);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    remove(compactpath);
+    try(couchstore_set_purge_policy(db, NULL));
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    try(couchstore_db_info(compacted, &info));
+    assert(info.deleted_count == 20 && compacted->header.purge_seq == 0);
+
+cleanup:
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    int count;
+    int ordered;
+    uint32_t last;
+} expiry_log;
+
+static int log_expiry(Db *db, DocInfo *info, void *ctx)
+{
+    expiry_log *log = ctx;
+    const unsigned char *meta = (const unsigned char *)info->rev_meta.buf;
+    uint32_t time = ((uint32_t)meta[8] << 24) | ((uint32_t)meta[9] << 16) |
+                    ((uint32_t)meta[10] << 8) | meta[11];
+    (void)db;
+    if (time < log->last || info->deleted) {
+        log->ordered = 0;
+    }
+    log->last = time;
+    log->count++;
+    return 0;
+}
+
+static int count_expired(Db *db, uint32_t time)
+{
+    couchstore_error_t errcode;
+    expiry_log log = { 0, 1, 0 };
+    try(couchstore_expired_since(db, time, 0, log_expiry, &log));
+    assert(log.ordered);
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+    return log.count;
+}
+
+static void test_expiry_index(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *compacted = NULL;
+    char compactpath[1024];
+
+    fprintf(stderr, "expiry index.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    assert(couchstore_expired_since(db, 100, 0, log_expiry, NULL) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    save_timed_docs(db, 0, 10, 0, 0);
+    save_timed_docs(db, 20, 10, 0, 100);
+    /* Built from what's there */
+    try(couchstore_set_expiry_index(db, 1, 8));
+    assert(count_expired(db, 99) == 0);
+    assert(count_expired(db, 100) == 10);
+
+    /* Kept up by saves: new documents, updates and deletions */
+    save_timed_docs(db, 10, 10, 0, 300);
+    save_timed_docs(db, 0, 5, 0, 200);
+    save_timed_docs(db, 25, 5, 0, 400);
+    save_timed_docs(db, 10, 5, 1, 300);
+    assert(count_expired(db, 100) == 5);
+    assert(count_expired(db, 200) == 10);
+    assert(count_expired(db, 300) == 15);
+    assert(count_expired(db, 0xffffffff) == 20);
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Kept in the header, and rewritten by compaction */
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->header.expiry_index && db->header.expiry_offset == 8);
+    assert(count_expired(db, 300) == 15);
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(count_expired(compacted, 200) == 10);
+    assert(count_expired(compacted, 400) == 20);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+
+    /* Dropped */
+    try(couchstore_set_expiry_index(db, 0, 0));
+    try(couchstore_commit(db));
+    assert(couchstore_expired_since(db, 400, 0, log_expiry, NULL) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(!db->header.expiry_index);
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Older files can't have one */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    db->header.disk_version = COUCH_DISK_VERSION_EXPIRY_INDEX - 1;
+    assert(couchstore_set_expiry_index(db, 1, 8) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void save_filled_docs(Db *db, int first, int n, size_t size, char fill)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char id[32];
+    char *body = malloc(size);
+    Doc doc;
+    DocInfo info;
+    int i;
+
+    assert(body);
+    memset(body, fill, size);
+    for (i = first; i < first + n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        setdoc(&doc, &info, id, idlen, body, size, NULL, 0);
+        try(couchstore_save_document(db, &doc, &info, 0));
+    }
+    try(couchstore_commit(db));
+cleanup:
+    free(body);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_filled_docs(Db *db, int first, int n, size_t size, char fill)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    char id[32];
+    Doc *doc = NULL;
+    size_t j;
+    int i;
+
+    for (i = first; i < first + n; ++i) {
+        int idlen = sprintf(id, "doc%d", i);
+        try(couchstore_open_document(db, id, idlen, &doc, 0));
+        assert(doc->data.size == size);
+        for (j = 0; j < size; ++j) {
+            assert(doc->data.buf[j] == fill);
+        }
+        couchstore_free_document(doc);
+        doc = NULL;
+    }
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_block_size(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    couchstore_block_cache *cache = NULL;
+    char compactpath[1024];
+    uint64_t pos, seq;
+    int round;
+
+    fprintf(stderr, "block size.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    assert(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                              COUCHSTORE_OPEN_BLOCK_SHIFT(11), &db) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    assert(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                              COUCHSTORE_OPEN_BLOCK_SHIFT(21), &db) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE |
+                           COUCHSTORE_OPEN_FLAG_HEADER_HINTS |
+                           COUCHSTORE_OPEN_BLOCK_SHIFT(16), &db));
+    assert(db->file.block_size == 65536 && db->header.position == 65536);
+    /* Bodies larger than a block, and headers on its boundaries */
+    for (round = 0; round < 4; ++round) {
+        save_filled_docs(db, round * 10, 10, 100000, 'a' + round);
+        assert(db->header.position % 65536 == 0);
+    }
+    pos = db->header.position;
+    seq = db->header.update_seq;
+    couchstore_close_db(db);
+    db = NULL;
+    assert(read_byte(testfilepath, 0) == BLOCK_PREAMBLE);
+    assert(read_byte(testfilepath, (long)pos) == 1);
+
+    /* Files keep it without the flag, read through the cache or a mapping */
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->file.block_size == 65536 && db->header_hints);
+    assert(db->header.position == pos && db->header.update_seq == seq);
+    check_filled_docs(db, 0, 10, 100000, 'a');
+    try(couchstore_block_cache_create(4 * 1024 * 1024, 4, &cache));
+    try(couchstore_set_block_cache(db, cache));
+    check_filled_docs(db, 30, 10, 100000, 'd');
+    check_filled_docs(db, 30, 10, 100000, 'd');
+    couchstore_close_db(db);
+    db = NULL;
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_RDONLY |
+                           COUCHSTORE_OPEN_FLAG_MMAP, &db));
+    check_filled_docs(db, 10, 10, 100000, 'b');
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Found by the scan back too, in 64KB steps */
+    overwrite_byte(testfilepath, 1 + sizeof(raw_file_preamble) + 3, 0x5a);
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(!db->header_hints && db->header.position == pos);
+    save_filled_docs(db, 40, 10, 300, 'e');
+    assert(db->header.position % 65536 == 0);
+
+    /* Compaction carries it over */
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(compacted->file.block_size == 65536);
+    assert(compacted->header.position % 65536 == 0);
+    check_filled_docs(compacted, 20, 10, 100000, 'c');
+    check_filled_docs(compacted, 40, 10, 300, 'e');
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* A preamble that doesn't check out leaves nothing to go by */
+    overwrite_byte(testfilepath, 5, 0x11);
+    assert(couchstore_open_db(testfilepath, 0, &db) == COUCHSTORE_ERROR_CORRUPT);
+    db = NULL;
+
+    /* Other files have no preamble */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    assert(db->file.block_size == COUCH_BLOCK_SIZE && db->header.position == 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    if (cache != NULL) {
+        couchstore_block_cache_destroy(cache);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_value_log(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *compacted = NULL;
+    couchstore_value_log_options options;
+    char compactpath[1024], logpath[1024], log1[1024], log2[1024];
+    struct stat st;
+    off_t log1_size;
+
+    fprintf(stderr, "value log.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    sprintf(logpath, "%s.values", testfilepath);
+    sprintf(log1, "%s.1", logpath);
+    sprintf(log2, "%s.2", logpath);
+    remove(testfilepath);
+    remove(compactpath);
+    remove(log1);
+    remove(log2);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    options.min_body_size = 1000;
+    options.max_garbage_percent = 50;
+    try(couchstore_set_value_log(db, logpath, &options));
+    /* Large bodies go to the log, small ones stay in the file */
+    save_filled_docs(db, 0, 10, 4000, 'a');
+    save_filled_docs(db, 10, 10, 100, 'x');
+    assert(stat(testfilepath, &st) == 0 && st.st_size < 40000);
+    assert(stat(log1, &st) == 0 && st.st_size >= 40000);
+    check_filled_docs(db, 0, 10, 4000, 'a');
+    check_filled_docs(db, 10, 10, 100, 'x');
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Found again through the header */
+    try(couchstore_open_db(testfilepath, 0, &db));
+    assert(db->header.vlog_ptr != 0 && db->header.vlog_live >= 40000);
+    check_filled_docs(db, 0, 10, 4000, 'a');
+    assert(couchstore_set_value_log(db, compactpath, &options) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+    /* Compaction shares the log while little of it is garbage */
+    try(couchstore_compact_db(db, compactpath));
+    assert(stat(log2, &st) != 0);
+    try(couchstore_open_db(compactpath, COUCHSTORE_OPEN_FLAG_RDONLY, &compacted));
+    assert(compacted->header.vlog_live == db->header.vlog_live);
+    check_filled_docs(compacted, 0, 10, 4000, 'a');
+    check_filled_docs(compacted, 10, 10, 100, 'x');
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    remove(compactpath);
+
+    /* ...and copies what's left into the next one once most of it is */
+    save_filled_docs(db, 0, 10, 4000, 'b');
+    save_filled_docs(db, 0, 10, 4000, 'c');
+    assert(db->header.vlog_live < 50000);
+    assert(stat(log1, &st) == 0);
+    log1_size = st.st_size;
+    try(couchstore_compact_db(db, compactpath));
+    assert(stat(log2, &st) == 0 && st.st_size < log1_size / 2);
+    try(couchstore_open_db(compactpath, COUCHSTORE_OPEN_FLAG_RDONLY, &compacted));
+    check_filled_docs(compacted, 0, 10, 4000, 'c');
+    check_filled_docs(compacted, 10, 10, 100, 'x');
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Older files can't have one */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    db->header.disk_version = COUCH_DISK_VERSION_VALUE_LOG - 1;
+    assert(couchstore_set_value_log(db, logpath, &options) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    remove(testfilepath);
+    remove(log1);
+    remove(log2);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_body_range(Db *db, const char *id, const char *body, size_t size,
+                             uint64_t offset, size_t len)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    DocInfo *info = NULL;
+    Doc *doc = NULL;
+    size_t expected = offset >= size ? 0 : size - offset;
+    if (expected > len) {
+        expected = len;
+    }
+
+    try(couchstore_docinfo_by_id(db, id, strlen(id), &info));
+    try(couchstore_open_document_range(db, info, offset, len, &doc, DECOMPRESS_DOC_BODIES));
+    assert(doc->id.size == strlen(id));
+    assert(doc->data.size == expected);
+    assert(expected == 0 || memcmp(doc->data.buf, body + offset, expected) == 0);
+cleanup:
+    couchstore_free_document(doc);
+    couchstore_free_docinfo(info);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_body_ranges(Db *db, const char *id, const char *body, size_t size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    DocInfo *info = NULL;
+    Doc *whole = NULL, *part = NULL;
+
+    check_body_range(db, id, body, size, 0, size);
+    check_body_range(db, id, body, size, 1500, 1200);
+    check_body_range(db, id, body, size, 999, 2);
+    check_body_range(db, id, body, size, size - 500, 1000);
+    check_body_range(db, id, body, size, size, 10);
+    check_body_range(db, id, body, size, size + 1000, 10);
+
+    /* Unless decompressing, the range is of the body as stored */
+    try(couchstore_docinfo_by_id(db, id, strlen(id), &info));
+    try(couchstore_open_doc_with_docinfo(db, info, &whole, 0));
+    try(couchstore_open_document_range(db, info, 10, 100, &part, 0));
+    assert(part->data.size == 100);
+    assert(memcmp(part->data.buf, whole->data.buf + 10, 100) == 0);
+cleanup:
+    couchstore_free_document(part);
+    couchstore_free_document(whole);
+    couchstore_free_docinfo(info);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_read_doc_into(Db *db, const char *id, const char *body, size_t size)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    DocInfo *info = NULL;
+    Doc *stored = NULL;
+    char buf[6000];
+    size_t len;
+
+    try(couchstore_docinfo_by_id(db, id, strlen(id), &info));
+    /* Asking for the length, then with too small a buffer */
+    try(couchstore_read_doc_into(db, info, NULL, 0, &len, DECOMPRESS_DOC_BODIES));
+    assert(len == size);
+    memset(buf, 0, sizeof(buf));
+    try(couchstore_read_doc_into(db, info, buf, size - 1, &len, DECOMPRESS_DOC_BODIES));
+    assert(len == size && buf[0] == 0);
+    try(couchstore_read_doc_into(db, info, buf, sizeof(buf), &len, DECOMPRESS_DOC_BODIES));
+    assert(len == size && memcmp(buf, body, size) == 0);
+
+    /* Without decompressing, the body as stored */
+    try(couchstore_open_doc_with_docinfo(db, info, &stored, 0));
+    try(couchstore_read_doc_into(db, info, buf, sizeof(buf), &len, 0));
+    assert(len == stored->data.size && memcmp(buf, stored->data.buf, len) == 0);
+cleanup:
+    couchstore_free_document(stored);
+    couchstore_free_docinfo(info);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_body_ranges(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *compacted = NULL;
+    DocInfo *info = NULL;
+    char compactpath[1024];
+    char body[5500];
+    Doc doc;
+    DocInfo docinfo;
+    unsigned seed = 1;
+    size_t i;
+
+    fprintf(stderr, "body ranges.... ");
+    fflush(stderr);
+
+    for (i = 0; i < sizeof(body); ++i) {
+        seed = seed * 1103515245 + 12345;
+        body[i] = 'a' + (seed >> 16) % 26;
+    }
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    setdoc(&doc, &docinfo, "plain", 5, body, sizeof(body), NULL, 0);
+    try(couchstore_save_document(db, &doc, &docinfo, 0));
+    setdoc(&doc, &docinfo, "whole", 5, body, sizeof(body), NULL, 0);
+    docinfo.content_meta = COUCH_DOC_IS_COMPRESSED;
+    try(couchstore_save_document(db, &doc, &docinfo, COMPRESS_DOC_BODIES));
+    /* Compressed bodies larger than the size are split up */
+    try(couchstore_set_body_segment_size(db, 1000));
+    setdoc(&doc, &docinfo, "split", 5, body, sizeof(body), NULL, 0);
+    docinfo.content_meta = COUCH_DOC_IS_COMPRESSED;
+    try(couchstore_save_document(db, &doc, &docinfo, COMPRESS_DOC_BODIES));
+    setdoc(&doc, &docinfo, "small", 5, body, 800, NULL, 0);
+    docinfo.content_meta = COUCH_DOC_IS_COMPRESSED;
+    try(couchstore_save_document(db, &doc, &docinfo, COMPRESS_DOC_BODIES));
+    try(couchstore_commit(db));
+
+    try(couchstore_docinfo_by_id(db, "split", 5, &info));
+    assert(info->bp & BP_SEGMENTED_FLAG);
+    couchstore_free_docinfo(info);
+    info = NULL;
+    try(couchstore_docinfo_by_id(db, "small", 5, &info));
+    assert(!(info->bp & BP_SEGMENTED_FLAG));
+    couchstore_free_docinfo(info);
+    info = NULL;
+
+    check_body_ranges(db, "plain", body, sizeof(body));
+    check_body_ranges(db, "whole", body, sizeof(body));
+    check_body_ranges(db, "split", body, sizeof(body));
+    check_body_ranges(db, "small", body, 800);
+    check_read_doc_into(db, "plain", body, sizeof(body));
+    check_read_doc_into(db, "whole", body, sizeof(body));
+    check_read_doc_into(db, "split", body, sizeof(body));
+    check_read_doc_into(db, "small", body, 800);
+
+    /* Compaction keeps the segments */
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, COUCHSTORE_OPEN_FLAG_RDONLY, &compacted));
+    try(couchstore_docinfo_by_id(compacted, "split", 5, &info));
+    assert(info->bp & BP_SEGMENTED_FLAG);
+    check_body_ranges(compacted, "plain", body, sizeof(body));
+    check_body_ranges(compacted, "split", body, sizeof(body));
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Older files can't have segmented bodies */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    db->header.disk_version = COUCH_DISK_VERSION_SEGMENTED_BODIES - 1;
+    assert(couchstore_set_body_segment_size(db, 1000) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    try(couchstore_set_body_segment_size(db, 0));
+
+cleanup:
+    couchstore_free_docinfo(info);
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_doc_writer(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *compacted = NULL;
+    couchstore_doc_writer *writer = NULL;
+    char compactpath[1024];
+    char *body = malloc(200000);
+    DocInfo streamed, *saved = &streamed;
+    Doc *doc = NULL;
+    unsigned seed = 7;
+    size_t i, size = 200000;
+
+    fprintf(stderr, "doc writer.... ");
+    fflush(stderr);
+
+    assert(body);
+    for (i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        body[i] = 'a' + (seed >> 16) % 26;
+    }
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_body_segment_size(db, 10000));
+    try(couchstore_doc_writer_open(db, &writer));
+    for (i = 0; i < size; i += 7777) {
+        try(couchstore_doc_writer_append(writer, body + i,
+                                         size - i < 7777 ? size - i : 7777));
+        if (i == 7777 * 10) {
+            /* Other saves may come between the pieces */
+            save_filled_docs(db, 0, 5, 100, 'x');
+        }
+    }
+    memset(&streamed, 0, sizeof(streamed));
+    streamed.id.buf = "streamed";
+    streamed.id.size = 8;
+    errcode = couchstore_doc_writer_finish(writer, &streamed);
+    writer = NULL;
+    try(errcode);
+    assert(streamed.content_meta & COUCH_DOC_IS_COMPRESSED);
+    try(couchstore_save_documents(db, NULL, &saved, 1, COUCHSTORE_SAVE_BODIES_WRITTEN));
+    try(couchstore_commit(db));
+
+    try(couchstore_open_document(db, "streamed", 8, &doc, DECOMPRESS_DOC_BODIES));
+    assert(doc->data.size == size);
+    assert(memcmp(doc->data.buf, body, size) == 0);
+    couchstore_free_document(doc);
+    doc = NULL;
+    check_body_range(db, "streamed", body, size, 12345, 30000);
+    check_filled_docs(db, 0, 5, 100, 'x');
+
+    /* An empty body */
+    try(couchstore_doc_writer_open(db, &writer));
+    memset(&streamed, 0, sizeof(streamed));
+    streamed.id.buf = "empty";
+    streamed.id.size = 5;
+    errcode = couchstore_doc_writer_finish(writer, &streamed);
+    writer = NULL;
+    try(errcode);
+    try(couchstore_save_documents(db, NULL, &saved, 1, COUCHSTORE_SAVE_BODIES_WRITTEN));
+    try(couchstore_open_document(db, "empty", 5, &doc, DECOMPRESS_DOC_BODIES));
+    assert(doc->data.size == 0);
+    couchstore_free_document(doc);
+    doc = NULL;
+    try(couchstore_commit(db));
+
+    /* Compaction copies it like any segmented body */
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, COUCHSTORE_OPEN_FLAG_RDONLY, &compacted));
+    check_body_range(compacted, "streamed", body, size, 0, size);
+    check_body_range(compacted, "streamed", body, size, 199990, 100);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    couchstore_close_db(db);
+    db = NULL;
+
+    /* Older files can't have bodies written this way */
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    db->header.disk_version = COUCH_DISK_VERSION_SEGMENTED_BODIES - 1;
+    assert(couchstore_doc_writer_open(db, &writer) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    couchstore_doc_writer_abort(writer);
+    couchstore_free_document(doc);
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    remove(testfilepath);
+    free(body);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_open_at_seqs(couchstore_open_flags flags)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *past = NULL;
+    DocInfo *info = NULL;
+    char id[32];
+    uint64_t seq;
+    int i, idlen;
+
+    remove(testfilepath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE | flags, &db));
+    /* One commit per sequence, some far apart */
+    for (i = 0; i < 40; ++i) {
+        save_filled_docs(db, i, 1, i % 5 == 0 ? 20000 : 100, 'a');
+    }
+    couchstore_close_db(db);
+    db = NULL;
+
+    for (seq = 1; seq <= 45; seq += (seq < 10 ? 1 : 7)) {
+        uint64_t expected = seq < 40 ? seq : 40;
+        try(couchstore_open_db_at_seq(testfilepath, seq, &past));
+        assert(past->header.update_seq == expected);
+        idlen = sprintf(id, "doc%d", (int)expected - 1);
+        try(couchstore_docinfo_by_id(past, id, idlen, &info));
+        couchstore_free_docinfo(info);
+        info = NULL;
+        idlen = sprintf(id, "doc%d", (int)expected);
+        assert(couchstore_docinfo_by_id(past, id, idlen, &info) ==
+               COUCHSTORE_ERROR_DOC_NOT_FOUND);
+        couchstore_close_db(past);
+        past = NULL;
+    }
+
+cleanup:
+    couchstore_free_docinfo(info);
+    if (past != NULL) {
+        couchstore_close_db(past);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_open_at_seq(void)
+{
+    fprintf(stderr, "open at seq.... ");
+    fflush(stderr);
+    check_open_at_seqs(0);
+    check_open_at_seqs(COUCHSTORE_OPEN_FLAG_HEADER_HINTS);
+    check_open_at_seqs(COUCHSTORE_OPEN_BLOCK_SHIFT(16));
+}
+
+static couchstore_error_t restore_range(uint64_t pos, const void *buf, size_t size,
+                                        void *ctx)
+{
+    return couchstore_restore_write(ctx, pos, buf, size);
+}
+
+// Brings the copy up to date with db since the header at since.
+static void backup_into(Db *db, const char *copypath, uint64_t since)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    couchstore_restore *restore = NULL;
+
+    try(couchstore_restore_open(copypath, since, &restore));
+    errcode = couchstore_backup_since(db, since, restore_range, restore);
+    if (errcode != COUCHSTORE_SUCCESS) {
+        couchstore_restore_abort(restore);
+        goto cleanup;
+    }
+    try(couchstore_restore_finish(restore));
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_backups(couchstore_open_flags flags)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *copy = NULL;
+    char copypath[1024];
+    uint64_t since;
+
+    sprintf(copypath, "%s.copy", testfilepath);
+    remove(testfilepath);
+    remove(copypath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE | flags, &db));
+    save_filled_docs(db, 0, 50, 300, 'a');
+    backup_into(db, copypath, 0);
+    since = couchstore_get_header_position(db);
+
+    /* Block 0, read by the last backup, is rewritten by the next commit */
+    save_filled_docs(db, 70, 1, 300, 'd');
+    backup_into(db, copypath, since);
+    since = couchstore_get_header_position(db);
+    save_filled_docs(db, 71, 1, 300, 'd');
+    backup_into(db, copypath, since);
+    try(couchstore_open_db(copypath, COUCHSTORE_OPEN_FLAG_RDONLY, &copy));
+    assert(copy->header.position == db->header.position);
+    couchstore_close_db(copy);
+    copy = NULL;
+    since = couchstore_get_header_position(db);
+
+    /* Several commits later, only what they added is sent */
+    save_filled_docs(db, 50, 20, 20000, 'b');
+    save_filled_docs(db, 0, 10, 300, 'c');
+    assert(couchstore_backup_since(db, since + 1, restore_range, NULL) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    backup_into(db, copypath, since);
+    try(couchstore_open_db(copypath, COUCHSTORE_OPEN_FLAG_RDONLY, &copy));
+    assert(copy->header.update_seq == db->header.update_seq);
+    assert(copy->header.position == db->header.position);
+    check_filled_docs(copy, 0, 10, 300, 'c');
+    check_filled_docs(copy, 10, 40, 300, 'a');
+    check_filled_docs(copy, 50, 20, 20000, 'b');
+
+cleanup:
+    if (copy != NULL) {
+        couchstore_close_db(copy);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testfilepath);
+    remove(copypath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_incremental_backup(void)
+{
+    fprintf(stderr, "incremental backup.... ");
+    fflush(stderr);
+    check_backups(0);
+    check_backups(COUCHSTORE_OPEN_FLAG_HEADER_HINTS);
+    check_backups(COUCHSTORE_OPEN_FLAG_HEADER_HINTS | COUCHSTORE_OPEN_BLOCK_SHIFT(16));
+}
+
+// Whether the padding before the header at pos holds the one-byte chunk
+// db_commit_prepare writes to grow the file, zeroes on either side of it.
+static int padding_has_commit_byte(const char *path, uint64_t pos)
+{
+    static const char chunk_start[] = { 0, (char)0x80, 0, 0, 1 };
+    char block[4096];
+    FILE *f = fopen(path, "rb");
+    size_t ii, jj;
+    int found = 0;
+
+    assert(f != NULL && pos >= sizeof(block));
+    assert(fseek(f, (long)(pos - sizeof(block)), SEEK_SET) == 0);
+    assert(fread(block, 1, sizeof(block), f) == sizeof(block));
+    fclose(f);
+    for (ii = 0; ii + sizeof(chunk_start) + 8 <= sizeof(block) && !found; ii++) {
+        if (memcmp(block + ii, chunk_start, sizeof(chunk_start)) != 0) {
+            continue;
+        }
+        found = 1;
+        for (jj = ii + sizeof(chunk_start) + 8; jj < sizeof(block); jj++) {
+            found = found && block[jj] == 0;
+        }
+    }
+    return found;
+}
+
+static void test_backup_commit_padding(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *copy = NULL;
+    char copypath[1024];
+    uint64_t since;
+    int round;
+
+    fprintf(stderr, "backup of commit padding.... ");
+    fflush(stderr);
+
+    sprintf(copypath, "%s.copy", testfilepath);
+    remove(testfilepath);
+    remove(copypath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_filled_docs(db, 0, 5, 100, 'a');
+    backup_into(db, copypath, 0);
+    /* Each small commit leaves the byte before its header */
+    for (round = 1; round < 6; ++round) {
+        since = couchstore_get_header_position(db);
+        save_filled_docs(db, round * 5, 5, 100, 'a' + round);
+        assert(padding_has_commit_byte(testfilepath, couchstore_get_header_position(db)));
+        backup_into(db, copypath, since);
+    }
+    try(couchstore_open_db(copypath, COUCHSTORE_OPEN_FLAG_RDONLY, &copy));
+    assert(copy->header.position == db->header.position);
+    assert(copy->header.update_seq == db->header.update_seq);
+    for (round = 0; round < 6; ++round) {
+        check_filled_docs(copy, round * 5, 5, 100, 'a' + round);
+    }
+
+cleanup:
+    if (copy != NULL) {
+        couchstore_close_db(copy);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testfilepath);
+    remove(copypath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+typedef struct {
+    couchstore_restore *restore;
+    uint64_t flip;              /* position of a byte to damage */
+} damaging_restore;
+
+static couchstore_error_t damage_range(uint64_t pos, const void *buf, size_t size,
+                                       void *ctx)
+{
+    damaging_restore *damage = ctx;
+    couchstore_error_t errcode;
+    char *copy;
+
+    if (damage->flip < pos || damage->flip >= pos + size) {
+        return couchstore_restore_write(damage->restore, pos, buf, size);
+    }
+    copy = malloc(size);
+    assert(copy);
+    memcpy(copy, buf, size);
+    copy[damage->flip - pos] ^= 0xff;
+    errcode = couchstore_restore_write(damage->restore, pos, copy, size);
+    free(copy);
+    return errcode;
+}
+
+// Applies a stream with one byte of it damaged, which the restore must
+// turn away, leaving the copy as it was.
+static void check_damaged_backup(Db *db, const char *copypath, uint64_t since,
+                                 uint64_t flip, couchstore_error_t expected)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    damaging_restore damage;
+
+    damage.flip = flip;
+    try(couchstore_restore_open(copypath, since, &damage.restore));
+    errcode = couchstore_backup_since(db, since, damage_range, &damage);
+    if (errcode == COUCHSTORE_SUCCESS) {
+        errcode = couchstore_restore_finish(damage.restore);
+    } else {
+        couchstore_restore_abort(damage.restore);
+    }
+    assert(errcode == expected || (expected == COUCHSTORE_ERROR_CORRUPT &&
+                                   errcode == COUCHSTORE_ERROR_CHECKSUM_FAIL));
+    errcode = COUCHSTORE_SUCCESS;
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_replica(couchstore_open_flags flags)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    Db *db = NULL, *replica = NULL;
+    char copypath[1024];
+    uint64_t since, end;
+
+    sprintf(copypath, "%s.copy", testfilepath);
+    remove(testfilepath);
+    remove(copypath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE | flags, &db));
+    save_filled_docs(db, 0, 30, 300, 'a');
+    backup_into(db, copypath, 0);
+    since = couchstore_get_header_position(db);
+    try(couchstore_open_db(copypath, COUCHSTORE_OPEN_FLAG_RDONLY, &replica));
+
+    save_filled_docs(db, 30, 10, 20000, 'b');
+    save_filled_docs(db, 0, 10, 300, 'c');
+    end = couchstore_get_header_position(db);
+
+    /* Damage on the way is found, and the replica keeps its header */
+    check_damaged_backup(db, copypath, since, since + (end - since) / 2,
+                         COUCHSTORE_ERROR_CORRUPT);
+    check_damaged_backup(db, copypath, since, end + 20, COUCHSTORE_ERROR_CORRUPT);
+    /* As is a stream that isn't from the replica's header */
+    check_damaged_backup(db, copypath, since, since + 20,
+                         COUCHSTORE_ERROR_DB_NO_LONGER_VALID);
+    try(couchstore_refresh_db_header(replica));
+    assert(replica->header.position == since);
+    check_filled_docs(replica, 0, 30, 300, 'a');
+
+    /* The open replica moves on to the new header */
+    backup_into(db, copypath, since);
+    check_filled_docs(replica, 0, 30, 300, 'a');
+    try(couchstore_refresh_db_header(replica));
+    assert(replica->header.position == end);
+    assert(replica->header.update_seq == db->header.update_seq);
+    check_filled_docs(replica, 0, 10, 300, 'c');
+    check_filled_docs(replica, 10, 20, 300, 'a');
+    check_filled_docs(replica, 30, 10, 20000, 'b');
+    assert(couchstore_refresh_db_header(db) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+
+cleanup:
+    if (replica != NULL) {
+        couchstore_close_db(replica);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testfilepath);
+    remove(copypath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_replica_apply(void)
+{
+    fprintf(stderr, "replica apply.... ");
+    fflush(stderr);
+    check_replica(0);
+    check_replica(COUCHSTORE_OPEN_FLAG_HEADER_HINTS);
+}
+
+typedef struct {
+    int calls;
+    int ordered;
+    int fail_after;
+    couchstore_compact_progress last;
+} progress_log;
+
+static couchstore_error_t log_progress(const couchstore_compact_progress *progress, void *ctx)
+{
+    progress_log *log = ctx;
+    if (log->calls > 0 && progress->phase < log->last.phase) {
+        log->ordered = 0;
+    }
+    log->last = *progress;
+    if (++log->calls == log->fail_after) {
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+    return COUCHSTORE_SUCCESS;
+}
+
+static void test_compaction_progress(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    Db *db = NULL;
+    progress_log log;
+    char compactpath[1024];
+    int done;
+
+    fprintf(stderr, "compaction progress.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 20000, 0);
+
+    memset(&log, 0, sizeof(log));
+    log.ordered = 1;
+    try(couchstore_set_compaction_progress(db, log_progress, &log));
+    try(couchstore_compact_db_ex(db, compactpath, 0, NULL, NULL, ops));
+    /* A report per phase at least, and some between */
+    assert(log.calls > COUCHSTORE_COMPACT_PHASE_DONE && log.ordered);
+    assert(log.last.phase == COUCHSTORE_COMPACT_PHASE_DONE);
+    assert(log.last.items_total == 20000 && log.last.items_copied == 20000);
+    assert(log.last.bytes_written > 0 && log.last.estimated_bytes > 0);
+    assert(log.last.remaining_ns == 0);
+    assert(log.last.elapsed_ns >= log.last.phase_ns[COUCHSTORE_COMPACT_PHASE_SEQ_COPY]);
+    remove(compactpath);
+
+    /* Resumably, in one call */
+    memset(&log, 0, sizeof(log));
+    log.ordered = 1;
+    try(couchstore_compact_db_resumable(db, compactpath, 0, NULL, NULL, ops, 0, 0, &done));
+    assert(done && log.ordered && log.last.phase == COUCHSTORE_COMPACT_PHASE_DONE);
+    assert(log.last.items_copied == 20000);
+    remove(compactpath);
+
+    /* An error from the callback ends the compaction */
+    memset(&log, 0, sizeof(log));
+    log.fail_after = 2;
+    assert(couchstore_compact_db_ex(db, compactpath, 0, NULL, NULL, ops) ==
+           COUCHSTORE_ERROR_CANCEL);
+    assert(log.calls == 2);
+
+    /* Cleared, nothing is reported */
+    try(couchstore_set_compaction_progress(db, NULL, NULL));
+    memset(&log, 0, sizeof(log));
+    remove(compactpath);
+    try(couchstore_compact_db(db, compactpath));
+    assert(log.calls == 0);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+/* On a thread of its own, whose pool starts out empty */
+static void use_arena_pool(void *arg)
+{
+    arena *a = new_arena(0), *b;
+    int i;
+
+    (void)arg;
+    assert(a != NULL && arena_pooled_chunks() == 0);
+    for (i = 0; i < 8; i++) {
+        assert(arena_alloc(a, 20000) != NULL);
+    }
+    /* Resetting keeps the first chunk and pools the others */
+    arena_reset(a);
+    assert(arena_pooled_chunks() == 7);
+    b = new_arena(0);
+    assert(arena_alloc(b, 100) != NULL);
+    assert(arena_pooled_chunks() == 6);
+    delete_arena(b);
+    delete_arena(a);
+    assert(arena_pooled_chunks() == 8);
+
+    /* Chunks of other sizes aren't pooled */
+    a = new_arena(100000);
+    assert(arena_alloc(a, 100) != NULL);
+    delete_arena(a);
+    assert(arena_pooled_chunks() == 8);
+
+    /* Nor more than a thread's share */
+    a = new_arena(0);
+    for (i = 0; i < 100; i++) {
+        assert(arena_alloc(a, 20000) != NULL);
+    }
+    delete_arena(a);
+    assert(arena_pooled_chunks() == 32);
+}
+
+static void test_arena_pool(void)
+{
+    cb_thread_t thread;
+
+    fprintf(stderr, "arena pool.... ");
+    fflush(stderr);
+
+    assert(cb_create_thread(&thread, use_arena_pool, NULL, 0) == 0);
+    assert(cb_join_thread(thread) == 0);
+}
+
+static void test_arena_limits(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    Db *db = NULL;
+    arena *a = new_arena(0);
+    arena_stats stats;
+    progress_log log;
+    Doc doc;
+    DocInfo info;
+    char compactpath[1024];
+    char body[160];
+
+    fprintf(stderr, "arena limits.... ");
+    fflush(stderr);
+
+    /* Room for two chunks */
+    assert(a != NULL);
+    arena_set_limit(a, 65536);
+    assert(arena_alloc(a, 20000) != NULL);
+    assert(arena_alloc(a, 20000) != NULL);
+    arena_get_stats(a, &stats);
+    assert(stats.held > 32768 && stats.held <= 65536 && stats.peak == stats.held);
+    assert(arena_alloc(a, 20000) == NULL);
+    arena_free_all(a);
+    arena_get_stats(a, &stats);
+    assert(stats.held == 0 && stats.peak > 32768);
+    assert(arena_alloc(a, 20000) != NULL);
+    delete_arena(a);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 5000, 0);
+
+    /* Updates that can't fit fail cleanly, and leave the file as it was */
+    try(couchstore_set_arena_limit(db, 1));
+    sprintf(body, "{\"value\": %d, \"padding\": \"%0100d\"}", 5000, 5000);
+    setdoc(&doc, &info, "doc5000", 7, body, strlen(body), NULL, 0);
+    assert(couchstore_save_document(db, &doc, &info, 0) == COUCHSTORE_ERROR_ALLOC_FAIL);
+    assert(couchstore_compact_db_ex(db, compactpath, 0, NULL, NULL, ops) ==
+           COUCHSTORE_ERROR_ALLOC_FAIL);
+    remove(compactpath);
+    assert(count_docs(db) == 5000);
+
+    /* What compaction's arenas hold is reported */
+    try(couchstore_set_arena_limit(db, 1024 * 1024));
+    memset(&log, 0, sizeof(log));
+    try(couchstore_set_compaction_progress(db, log_progress, &log));
+    try(couchstore_compact_db_ex(db, compactpath, 0, NULL, NULL, ops));
+    assert(log.last.phase == COUCHSTORE_COMPACT_PHASE_DONE);
+    assert(log.last.arena_peak_bytes > 0 && log.last.arena_peak_bytes >= log.last.arena_bytes);
+
+    try(couchstore_set_arena_limit(db, 0));
+    try(couchstore_save_document(db, &doc, &info, 0));
+    try(couchstore_commit(db));
+    assert(count_docs(db) == 5001);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(compactpath);
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_huge_page_arena(void)
+{
+    arena *a = new_huge_page_arena();
+    arena_stats stats;
+    char *p;
+    int i;
+
+    fprintf(stderr, "huge page arena.... ");
+    fflush(stderr);
+
+    /* One chunk takes many small blocks, and is kept when freed */
+    assert(a != NULL);
+    for (i = 0; i < 1000; i++) {
+        p = arena_alloc(a, 1000);
+        assert(p != NULL);
+        memset(p, i, 1000);
+    }
+    arena_get_stats(a, &stats);
+    assert(stats.held >= 1000 * 1000 && stats.held < 2 * 1024 * 1024);
+    p = arena_alloc(a, 3 * 1024 * 1024);
+    assert(p != NULL);
+    memset(p, 1, 3 * 1024 * 1024);
+    arena_free_all(a);
+    arena_get_stats(a, &stats);
+    assert(stats.held > 0 && stats.held < 2 * 1024 * 1024);
+    assert(arena_alloc(a, 1000) != NULL);
+    delete_arena(a);
+
+    /* Under a limit too small for a huge page, chunks are malloced */
+    a = new_huge_page_arena();
+    arena_set_limit(a, 65536);
+    assert(arena_alloc(a, 1000) != NULL);
+    arena_get_stats(a, &stats);
+    assert(stats.held <= 65536);
+    delete_arena(a);
+}
+
+static void test_compaction_sort_memory(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    char defaultpath[1024], smallpath[1024];
+    FILE *f1 = NULL, *f2 = NULL;
+    int c1, c2;
+
+    fprintf(stderr, "compaction sort memory.... ");
+    fflush(stderr);
+
+    sprintf(defaultpath, "%s.default", testfilepath);
+    sprintf(smallpath, "%s.small", testfilepath);
+    remove(testfilepath);
+    remove(defaultpath);
+    remove(smallpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    /* Saved in numeric order, so out of the IDs' byte order */
+    save_numbered_batch(db, 0, 20000, 0);
+
+    /* Sorted in one run, and in far more than are merged at once */
+    try(couchstore_compact_db(db, defaultpath));
+    try(couchstore_set_compaction_sort_memory(db, 16 * 1024));
+    try(couchstore_set_compaction_threads(db, 2));
+    try(couchstore_compact_db(db, smallpath));
+
+    f1 = fopen(defaultpath, "rb");
+    f2 = fopen(smallpath, "rb");
+    assert(f1 && f2);
+    do {
+        c1 = getc(f1);
+        c2 = getc(f2);
+        assert(c1 == c2);
+    } while (c1 != EOF);
+
+    try(couchstore_open_db(smallpath, 0, &compacted));
+    assert(count_docs(compacted) == 20000);
+
+cleanup:
+    if (f1 != NULL) {
+        fclose(f1);
+    }
+    if (f2 != NULL) {
+        fclose(f2);
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(defaultpath);
+    remove(smallpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_compaction_sorted_ids(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    Doc *doc = NULL;
+    char compactpath[1024];
+
+    fprintf(stderr, "compaction of sorted IDs.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    /* IDs of as many digits come in their byte order, and aren't sorted */
+    save_numbered_batch(db, 1000000, 5000, 0);
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(count_docs(compacted) == 5000);
+    try(couchstore_open_document(compacted, "doc1004999", 10, &doc, 0));
+    couchstore_free_document(doc);
+    doc = NULL;
+    couchstore_close_db(compacted);
+    compacted = NULL;
+
+    /* One out of order after them, and all of them are */
+    save_numbered_batch(db, 1000, 1, 0);
+    remove(compactpath);
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(count_docs(compacted) == 5001);
+    try(couchstore_open_document(compacted, "doc1000", 7, &doc, 0));
+
+cleanup:
+    couchstore_free_document(doc);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_compaction_local_docs(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    LocalDoc doc;
+    char compactpath[1024], recompactpath[1024];
+    char id[32], json[64];
+    int ii;
+
+    fprintf(stderr, "compaction of local docs.... ");
+    fflush(stderr);
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    sprintf(recompactpath, "%s.compact2", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    remove(recompactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    /* Enough for their leaves, copied over as they are, to need KP nodes */
+    for (ii = 0; ii < 3000; ++ii) {
+        sprintf(id, "_local/doc%05d", ii);
+        sprintf(json, "{\"n\":%d,\"pad\":\"abcdefghijklmnopqrstuvwxyz\"}", ii);
+        set_local_doc(&doc, id, json);
+        try(couchstore_save_local_document(db, &doc));
+    }
+    set_local_doc(&doc, "_local/doc01500", NULL);
+    try(couchstore_save_local_document(db, &doc));
+    try(couchstore_commit(db));
+
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    /* And once more, from a tree made of copied leaves */
+    try(couchstore_compact_db(compacted, recompactpath));
+    couchstore_close_db(compacted);
+    compacted = NULL;
+    try(couchstore_open_db(recompactpath, 0, &compacted));
+    for (ii = 0; ii < 3000; ++ii) {
+        sprintf(id, "_local/doc%05d", ii);
+        sprintf(json, "{\"n\":%d,\"pad\":\"abcdefghijklmnopqrstuvwxyz\"}", ii);
+        check_local_doc(compacted, id, ii == 1500 ? NULL : json);
+    }
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    remove(recompactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+#ifndef WIN32
+static void test_compaction_in_memory_sort(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    char compactpath[1024];
+    char *tmpdir = getenv("TMPDIR");
+
+    fprintf(stderr, "compaction in-memory sort.... ");
+    fflush(stderr);
+
+    if (tmpdir) {
+        tmpdir = strdup(tmpdir);
+    }
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    save_numbered_batch(db, 0, 5000, 0);
+
+    /* IDs that fit the budget need no temporary file, which can't be made */
+    setenv("TMPDIR", "/nonexistent/couchstore", 1);
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    assert(count_docs(compacted) == 5000);
+    couchstore_close_db(compacted);
+    compacted = NULL;
+
+    /* Those that don't go to one */
+    remove(compactpath);
+    try(couchstore_set_compaction_sort_memory(db, 64 * 1024));
+    assert(couchstore_compact_db(db, compactpath) != COUCHSTORE_SUCCESS);
+
+cleanup:
+    if (tmpdir) {
+        setenv("TMPDIR", tmpdir, 1);
+        free(tmpdir);
+    } else {
+        unsetenv("TMPDIR");
+    }
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+#endif
+
+#define SHARED_APPEND_THREADS 4
+#define SHARED_APPEND_CHUNKS 300
+
+typedef struct {
+    tree_file *file;
+    int thread;
+    cs_off_t pos[SHARED_APPEND_CHUNKS];
+} shared_append;
+
+static void append_chunks(void *arg)
+{
+    shared_append *job = (shared_append *) arg;
+    char buf[3000];
+    int i;
+
+    for (i = 0; i < SHARED_APPEND_CHUNKS; i++) {
+        sized_buf chunk = { buf, (size_t) (100 + (i * 37) % 2900) };
+        memset(buf, 'a' + job->thread, chunk.size);
+        memcpy(buf, &i, sizeof(i));
+        assert(db_write_buf(job->file, &chunk, &job->pos[i], NULL) == 0);
+        /* Reading back an earlier one, between the others' appends */
+        if (i % 2 == 1) {
+            char *back;
+            int len = pread_bin(job->file, job->pos[i / 2], &back);
+            assert(len == 100 + ((i / 2) * 37) % 2900);
+            assert(back[len - 1] == 'a' + job->thread);
+            free(back);
+        }
+    }
+}
+
+/* Threads reading and appending to a file with an io mutex each get their
+   chunks written where they're told */
+static void test_shared_file_io(void)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    tree_file file;
+    cb_mutex_t mutex;
+    cb_thread_t threads[SHARED_APPEND_THREADS];
+    shared_append *jobs = NULL;
+    char *buf;
+    int i, j, len;
+
+    fprintf(stderr, "shared file io.... ");
+    fflush(stderr);
+
+    memset(&file, 0, sizeof(file));
+    remove(testfilepath);
+    try(tree_file_open(&file, testfilepath, O_RDWR | O_CREAT,
+                       couchstore_get_default_file_ops()));
+    jobs = (shared_append *) calloc(SHARED_APPEND_THREADS, sizeof(shared_append));
+    error_unless(jobs, COUCHSTORE_ERROR_ALLOC_FAIL);
+    cb_mutex_initialize(&mutex);
+    file.io_mutex = &mutex;
+    for (i = 0; i < SHARED_APPEND_THREADS; i++) {
+        jobs[i].file = &file;
+        jobs[i].thread = i;
+        assert(cb_create_thread(&threads[i], append_chunks, &jobs[i], 0) == 0);
+    }
+    for (i = 0; i < SHARED_APPEND_THREADS; i++) {
+        assert(cb_join_thread(threads[i]) == 0);
+    }
+    file.io_mutex = NULL;
+    cb_mutex_destroy(&mutex);
+
+    for (i = 0; i < SHARED_APPEND_THREADS; i++) {
+        for (j = 0; j < SHARED_APPEND_CHUNKS; j++) {
+            len = pread_bin(&file, jobs[i].pos[j], &buf);
+            assert(len == 100 + (j * 37) % 2900);
+            assert(memcmp(buf, &j, sizeof(j)) == 0);
+            assert(buf[len - 1] == 'a' + i);
+            free(buf);
+        }
+    }
+
+cleanup:
+    free(jobs);
+    tree_file_close(&file);
+    remove(testfilepath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void check_codec(couchstore_codec codec, int use_dict, unsigned threads)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL, *compacted = NULL;
+    Doc *doc;
+    char compactpath[1024];
+    int count;
+
+    sprintf(compactpath, "%s.compact", testfilepath);
+    remove(testfilepath);
+    remove(compactpath);
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    try(couchstore_set_compression_threads(db, threads));
+    try(couchstore_set_codecs(db, codec, codec));
+    if (use_dict) {
+        /* zstd takes any content as a raw dictionary */
+        sized_buf dict = { "{\"value\": 12345, \"padding\": \"0000000000000000\"}", 48 };
+        try(couchstore_set_zstd_dictionary(db, &dict));
+        assert(couchstore_set_zstd_dictionary(db, &dict) == COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    }
+    save_numbered_batch(db, 0, 2000, COMPRESS_DOC_BODIES);
+    save_numbered_docs(db, 1500, 1000);
+
+    /* Read back through a fresh handle, which has to find the dictionary */
+    try(couchstore_drop_file(db));
+    try(couchstore_reopen_file(db, testfilepath, 0));
+    lookup_numbered_docs(db, 2500, 1);
+    try(couchstore_open_document(db, "doc1234", 7, &doc, DECOMPRESS_DOC_BODIES));
+    assert(doc->data.size >= 14);
+    assert(memcmp(doc->data.buf, "{\"value\": 1234", 14) == 0);
+    couchstore_free_document(doc);
+
+    /* Compaction copies the bodies as they are, and the dictionary too */
+    try(couchstore_compact_db(db, compactpath));
+    try(couchstore_open_db(compactpath, 0, &compacted));
+    lookup_numbered_docs(compacted, 2500, 1);
+    count = 0;
+    try(couchstore_changes_since(compacted, 0, 0, check_numbered_doc_cb, &count));
+    assert(count == 2500);
+    assert((compacted->header.dict_ptr != 0) == use_dict);
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    if (compacted != NULL) {
+        couchstore_close_db(compacted);
+    }
+    remove(compactpath);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+static void test_codecs(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+
+    fprintf(stderr, "codecs.... ");
+    fflush(stderr);
+
+    /* Files of older versions can't say which codec a chunk uses */
+    try(couchstore_open_db(testfilepath, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    db->header.disk_version = COUCH_DISK_VERSION_CODECS - 1;
+    assert(couchstore_set_codecs(db, COUCHSTORE_CODEC_LZ4, COUCHSTORE_CODEC_SNAPPY) ==
+           COUCHSTORE_ERROR_INVALID_ARGUMENTS);
+    try(couchstore_set_codecs(db, COUCHSTORE_CODEC_SNAPPY, COUCHSTORE_CODEC_SNAPPY));
+    couchstore_close_db(db);
+    db = NULL;
+
+    check_codec(COUCHSTORE_CODEC_SNAPPY, 0, 0);
+#ifdef HAVE_LZ4_H
+    check_codec(COUCHSTORE_CODEC_LZ4, 0, 0);
+    check_codec(COUCHSTORE_CODEC_LZ4, 0, 2);
+#endif
+#ifdef HAVE_ZSTD_H
+    check_codec(COUCHSTORE_CODEC_ZSTD, 0, 0);
+    check_codec(COUCHSTORE_CODEC_ZSTD, 1, 0);
+    check_codec(COUCHSTORE_CODEC_ZSTD, 1, 2);
+#endif
+
+cleanup:
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
+
+int main(int argc, const char *argv[])
+{
+    int doc_counts[] = { 4, 69, 666, 9090 };
+    unsigned i;
+    const char *small_doc_tpl = "{\"test_doc_index\":%d}";
+    const char *large_doc_tpl =
+        "{"
+        "\"test_doc_index\":%d,"
+        "\"field1\": \"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\","
+        "\"field2\": \"bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb\","
+        "\"field3\": \"cccccccccccccccccccccccccccccccccccccccccccccccccc"
+        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
+        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
+        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
+        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
+        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc"
+        "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc\""
+        "}";
+
+    file_merger_tests();
+    file_sorter_tests();
+
+    if (argc > 1)
+        strcpy(testfilepath, argv[1]);
+    printf("Using test database at %s\n", testfilepath);
+
+    test_bitfield_fns();
+
+    test_open_file_error();
+    fprintf(stderr, "OK \n");
+    test_dump_empty_db();
+    fprintf(stderr, " OK\n");
+    test_save_doc();
+    fprintf(stderr, " OK\n");
+    for (i = 0; i < (sizeof(doc_counts) / sizeof(int)); ++i) {
+        test_save_docs(doc_counts[i], small_doc_tpl);
+        fprintf(stderr, " OK\n");
+        test_save_docs(doc_counts[i], large_doc_tpl);
+        fprintf(stderr, " OK\n");
+    }
+    test_local_docs();
+    fprintf(stderr, " OK\n");
+    test_local_doc_cache();
+    fprintf(stderr, " OK\n");
+    test_compressed_doc_body();
+    fprintf(stderr, " OK\n");
+    test_changes_no_dups();
+    fprintf(stderr, " OK\n");
+    mb5086();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_huge_revseq();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_asis_seqs();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_dropped_handle();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_io_uring_file_ops();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_mmap_read();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_block_cache();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_buffer_options();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_readahead();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_direct_file_ops();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_vectored_writes();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_group_commit();
+    test_relaxed_durability();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_open_docs_batched();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_io_stats();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_op_stats();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_memory_stats();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_node_cache();
+    fprintf(stderr, " OK\n");
+    test_node_buf_pool();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_lookup_compares();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_batched_lookup();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_cursor();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_descending_scans();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_borrowed_docinfos();
+    fprintf(stderr, " OK\n");
+    test_seq_filter_pushdown();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_prefixed_keys();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_bloom_filter();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_count_and_rank();
+    test_sample_docinfos();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_blind_insert();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_compression_threads();
+    test_large_batch_sorts();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_codecs();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_bulk_load();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_write_batch();
+    test_owned_write_batch();
+    fprintf(stderr, " OK\n");
+    remove(testfilepath);
+    test_node_size_policy();
+    test_delta_buffer();
+    test_write_back();
+    test_preallocation();
+    test_resumable_compaction();
+    test_compact_catch_up();
+    test_compaction_threads();
+    test_compaction_throttle();
+    test_fragmentation_stats();
+    test_walk_nodes();
+    test_walk_pruning();
+    test_parallel_scan();
+    test_header_hints();
+    test_crc32c();
+    test_block_size();
+    test_open_dbs();
+    test_snapshots();
+    test_shared_reads();
+    test_purge_policy();
+    test_expiry_index();
+    test_value_log();
+    test_body_ranges();
+    test_doc_writer();
+    test_open_at_seq();
+    test_incremental_backup();
+    test_backup_commit_padding();
+    test_replica_apply();
+    test_compaction_progress();
+    test_arena_pool();
+    test_arena_limits();
+    test_huge_page_arena();
+    test_compaction_sort_memory();
+    test_compaction_sorted_ids();
+    test_compaction_local_docs();
+#ifndef WIN32
+    test_compaction_in_memory_sort();
+#endif
+    test_shared_file_io();
     fprintf(stderr, " OK\n");
     remove(testfilepath);
 
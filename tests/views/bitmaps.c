@@ -113,4 +113,30 @@ void test_bitmaps(void)
     set_bit(&bm2, 1000);
     assert(!is_equal_bitmap(&bm1, &bm2));
 
+    /* Tests for emptiness, popcount, intersects and subset operations */
+    memset(&bm1, 0, sizeof(bitmap_t));
+    memset(&bm2, 0, sizeof(bitmap_t));
+    assert(bitmap_is_empty(&bm1));
+    assert(bitmap_popcount(&bm1) == 0);
+    assert(!bitmap_intersects(&bm1, &bm2));
+    assert(bitmap_is_subset(&bm1, &bm2));
+    set_bit(&bm1, 1023);
+    assert(!bitmap_is_empty(&bm1));
+    assert(bitmap_popcount(&bm1) == 1);
+    assert(!bitmap_is_subset(&bm1, &bm2));
+    set_bit(&bm1, 0);
+    set_bit(&bm1, 64);
+    set_bit(&bm1, 65);
+    assert(bitmap_popcount(&bm1) == 4);
+    set_bit(&bm2, 65);
+    assert(bitmap_intersects(&bm1, &bm2));
+    assert(bitmap_is_subset(&bm2, &bm1));
+    assert(!bitmap_is_subset(&bm1, &bm2));
+    unset_bit(&bm1, 65);
+    assert(!bitmap_intersects(&bm1, &bm2));
+    for (i = 0; i < 1024; ++i) {
+        set_bit(&bm2, i);
+    }
+    assert(bitmap_popcount(&bm2) == 1024);
+    assert(bitmap_is_subset(&bm1, &bm2));
 }
@@ -91,6 +91,19 @@ static void test_view_id_btree_cleanup()
 
     assert(view_id_btree_purge_kp(&np, &purge_ctx) == PURGE_PARTIAL);
     assert(purge_ctx.count == 0);
+
+    /* Every partition of the node being cleaned, with others */
+    set_bit(&purge_ctx.cbitmask, 100);
+    set_bit(&purge_ctx.cbitmask, 200);
+    assert(view_id_btree_purge_kp(&np, &purge_ctx) == PURGE_ITEM);
+    assert(purge_ctx.count == 11);
+    purge_ctx.count = 0;
+
+    /* Past the deadline everything's kept */
+    purge_ctx.deadline = 1;
+    assert(view_id_btree_purge_kp(&np, &purge_ctx) == PURGE_KEEP);
+    assert(purge_ctx.stopped);
+    assert(purge_ctx.count == 0);
 }
 
 static void test_view_btree_cleanup()
@@ -3,6 +3,7 @@
 /*  Reference: http://wiki.apache.org/couchdb/View_collation */
 
 #include "../src/views/collate_json.h"
+#include "../src/util.h"
 #include "../macros.h"
 #include "view_tests.h"
 #include <string.h>
@@ -110,6 +111,51 @@ static void TestCollateRaw(void)
     assert_eq(collateStrs("[\"b\"]", "[\"b\",\"c\",\"a\"]", mode), -1);
 }
 
+static void TestCollateIntegers(void)
+{
+    CollateJSONMode mode = kCollateJSON_Unicode;
+    fprintf(stderr, "integers... ");
+    assert_eq(collateStrs("10", "9", mode), 1);
+    assert_eq(collateStrs("-10", "-9", mode), -1);
+    assert_eq(collateStrs("-1", "1", mode), -1);
+    assert_eq(collateStrs("-0", "0", mode), 0);
+    assert_eq(collateStrs("007", "7", mode), 0);
+    assert_eq(collateStrs("7", "7.5", mode), -1);
+    assert_eq(collateStrs("100", "1e2", mode), 0);
+    assert_eq(collateStrs("123456789012345", "123456789012346", mode), -1);
+    /* Past what a double holds exactly, they compare as doubles do */
+    assert_eq(collateStrs("9007199254740993", "9007199254740992", mode), 0);
+    assert_eq(collateStrs("[1,2]", "[1,10]", mode), -1);
+    assert_eq(collateStrs("[-3,4]", "[-3,4]", mode), 0);
+    assert_eq(collateStrs("[12,\"a\"]", "[12.0,\"b\"]", mode), -1);
+}
+
+static void TestCollatePlainStrings(void)
+{
+    fprintf(stderr, "plain strings... ");
+    /* Scanned a word at a time, with the quote or escape in any byte */
+    assert_eq(collateStrs("\"abcdefghijklmnop\"", "\"abcdefghijklmnop\"",
+                          kCollateJSON_Unicode), 0);
+    assert_eq(collateStrs("\"abcdefghijklmnop\"", "\"abcdefghijklmnoq\"",
+                          kCollateJSON_Unicode), -1);
+    assert_eq(collateStrs("\"abcdefghijklmnoP\"", "\"abcdefghijklmnop\"",
+                          kCollateJSON_Unicode), 1);
+    assert_eq(collateStrs("\"abcdefghij\\/klmnop\"", "\"abcdefghij/klmnop\"",
+                          kCollateJSON_Unicode), 0);
+    assert_eq(collateStrs("[\"abcdefghijk\",1]", "[\"abcdefghijk\",2]",
+                          kCollateJSON_Unicode), -1);
+    assert_eq(collateStrs("\"abcdefghijklmnop\"", "\"abcdefghijklmno\"",
+                          kCollateJSON_ASCII), 1);
+    assert_eq(collateStrs("\"abcdefghijklmnoB\"", "\"abcdefghijklmnoa\"",
+                          kCollateJSON_ASCII), -1);
+    assert_eq(collateStrs("\"abcdefghij\\/klmnop\"", "\"abcdefghij/klmnop\"",
+                          kCollateJSON_ASCII), 0);
+    assert_eq(collateStrs("\"abcdefgh\xc3\xa9\"", "\"abcdefgh\"",
+                          kCollateJSON_ASCII), 1);
+    assert_eq(collateStrs("\"abcdefgh\xc3\xa9\"", "\"abcdefghz\"",
+                          kCollateJSON_ASCII), -1);
+}
+
 static void TestCollateArrays(void)
 {
     CollateJSONMode mode = kCollateJSON_Unicode;
@@ -132,6 +178,29 @@ static void TestCollateNestedArrays(void)
     assert_eq(collateStrs("[1,[2,3],4]", "[1,[2,3.1],4,5,6]", mode), -1);
 }
 
+static void TestCollateLongStrings(void)
+{
+    /* Past the scratch buffers strings are unescaped into */
+    char escaped[700], plain[400], accented[400];
+    int i;
+
+    strcpy(escaped, "\"");
+    strcpy(plain, "\"");
+    strcpy(accented, "\"");
+    for (i = 0; i < 150; ++i) {
+        strcat(escaped, "\\/a");
+        strcat(plain, "/a");
+        strcat(accented, i == 149 ? "\xc3\xa1" : "/a");
+    }
+    strcat(escaped, "\"");
+    strcat(plain, "\"");
+    strcat(accented, "\"");
+
+    assert_eq(collateStrs(escaped, plain, kCollateJSON_Unicode), 0);
+    assert_eq(collateStrs(plain, accented, kCollateJSON_Unicode), -1);
+    assert_eq(collateStrs(accented, escaped, kCollateJSON_Unicode), 1);
+}
+
 static void TestCollateUnicodeStrings(void)
 {
     /* Make sure that TDJSON never creates escape sequences we can't parse.
@@ -142,6 +211,107 @@ static void TestCollateUnicodeStrings(void)
     assert_eq(collateStrs("\"ømø\"",  "\"omo\"", mode), 1);
     assert_eq(collateStrs("\"\t\"",   "\" \"", mode), -1);
     assert_eq(collateStrs("\"\001\"", "\" \"", mode), -1);
+    TestCollateLongStrings();
+}
+
+static int sortKeyOf(const char* str, char* out, size_t size)
+{
+    sized_buf buf;
+    buf.buf = (char*) str;
+    buf.size = strlen(str);
+    return CollateJSONSortKey(&buf, out, size);
+}
+
+static int sign(int n)
+{
+    return n > 0 ? 1 : (n < 0 ? -1 : 0);
+}
+
+static void TestCollateSortKeys(void)
+{
+    static const char* values[] = {
+        "null", "false", "true", "-1e10", "-1.5", "-0", "0", "0.0", "1",
+        "1.0", "2", "10", "123.4", "1e300", "-10", "-9", "007",
+        "9007199254740992", "9007199254740993",
+        "\"\"", "\"a\"", "\"A\"", "\"aa\"", "\"B\"", "\"b\"", "\"fréd\"",
+        "\"ømø\"", "\"omo\"", "\"\t\"", "\"\001\"", "\" \"", "\"12\\/34\"",
+        "\"12/34\"", "\"1234\"", "\"\\u0045\"", "\"E\"",
+        "[]", "[null]", "[[]]", "[\"a\"]", "[\"a\",\"b\"]", "[\"b\"]",
+        "[123.4,\"wow\"]", "[123.40,789]", "[1,2]", "[1,10]", "[-3,4]", "[1,[2,3],4]", "[1,[2,3.1],4,5,6]",
+        "{}", "{\"a\":1}", "{\"a\":1,\"b\":2}", "{\"b\":1}", "{\"a\":[1]}",
+        NULL
+    };
+    char key1[1024], key2[1024];
+    char longStr[600];
+    int len1, len2;
+    int i, j;
+
+    fprintf(stderr, "sort keys... ");
+    for (i = 0; values[i]; ++i) {
+        len1 = sortKeyOf(values[i], key1, sizeof(key1));
+        assert(len1 > 0);
+        for (j = 0; values[j]; ++j) {
+            sized_buf k1, k2;
+            len2 = sortKeyOf(values[j], key2, sizeof(key2));
+            assert(len2 > 0);
+            k1.buf = key1;
+            k1.size = len1;
+            k2.buf = key2;
+            k2.size = len2;
+            assert_eq(sign(ebin_compare(&k1, &k2)),
+                      collateStrs(values[i], values[j], kCollateJSON_Unicode));
+        }
+    }
+
+    /* Strings past what CollateJSON converts up front */
+    memset(longStr, 'x', sizeof(longStr) - 1);
+    longStr[0] = '"';
+    longStr[sizeof(longStr) - 2] = '"';
+    longStr[sizeof(longStr) - 1] = '\0';
+    len1 = sortKeyOf(longStr, key1, sizeof(key1));
+    assert(len1 > 0);
+    len2 = sortKeyOf("\"xy\"", key2, sizeof(key2));
+    assert(len2 > 0);
+    assert(memcmp(key1, key2, len1 < len2 ? len1 : len2) < 0);
+    assert_eq(collateStrs(longStr, "\"xy\"", kCollateJSON_Unicode), -1);
+    assert_eq(sortKeyOf(longStr, key1, 16), -1);
+
+    assert_eq(sortKeyOf(" 1", key1, sizeof(key1)), -1);
+    assert_eq(sortKeyOf("[1", key1, sizeof(key1)), -1);
+    assert_eq(sortKeyOf("\"abc", key1, sizeof(key1)), -1);
+    assert_eq(sortKeyOf("\"\xff\"", key1, sizeof(key1)), -1);
+    assert_eq(sortKeyOf("12abc", key1, sizeof(key1)), -1);
+}
+
+static void collateOnThread(void* arg)
+{
+    int* failures = arg;
+    int i;
+
+    for (i = 0; i < 2000; ++i) {
+        if (collateStrs("\"ømø\"", "\"omo\"", kCollateJSON_Unicode) != 1 ||
+            collateStrs("[\"fréd\",1]", "[\"fred\",2]", kCollateJSON_Unicode) != 1 ||
+            collateStrs("\"a\"", "\"A\"", kCollateJSON_Unicode) != -1) {
+            ++*failures;
+        }
+    }
+}
+
+static void TestCollateThreads(void)
+{
+    /* Each thread collates with a collator of its own */
+    cb_thread_t threads[4];
+    int failures[4] = { 0 };
+    int i;
+
+    fprintf(stderr, "threads... ");
+    for (i = 0; i < 4; ++i) {
+        assert(cb_create_thread(&threads[i], collateOnThread, &failures[i], 0) == 0);
+    }
+    for (i = 0; i < 4; ++i) {
+        assert(cb_join_thread(threads[i]) == 0);
+        assert_eq(failures[i], 0);
+    }
 }
 
 void test_collate_json(void)
@@ -151,8 +321,12 @@ void test_collate_json(void)
     TestCollateScalars();
     TestCollateASCII();
     TestCollateRaw();
+    TestCollateIntegers();
+    TestCollatePlainStrings();
     TestCollateArrays();
     TestCollateNestedArrays();
     TestCollateUnicodeStrings();
+    TestCollateSortKeys();
+    TestCollateThreads();
     fprintf(stderr, "OK\n");
 }
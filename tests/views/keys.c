@@ -52,6 +52,32 @@ static void test_view_id_btree_key_encoding(const view_id_btree_key_t *k,
     assert(res == COUCHSTORE_SUCCESS);
 }
 
+static void test_view_btree_key_views(const char *key_bin, size_t key_len,
+                                      const char *id_btree_key_bin,
+                                      size_t id_btree_key_len)
+{
+    view_btree_key_t k;
+    view_id_btree_key_t id_btree_k;
+
+    assert(view_btree_key_view(key_bin, key_len, &k) == COUCHSTORE_SUCCESS);
+    assert(k.json_key.size == 4);
+    assert(k.json_key.buf == key_bin + 2);
+    assert(memcmp(k.json_key.buf, "\"23\"", k.json_key.size) == 0);
+    assert(k.doc_id.size == 12);
+    assert(memcmp(k.doc_id.buf, "doc_00000023", k.doc_id.size) == 0);
+    assert(view_btree_key_view(key_bin, 5, &k) == COUCHSTORE_ERROR_CORRUPT);
+    assert(view_btree_key_view(key_bin, 1, &k) == COUCHSTORE_ERROR_CORRUPT);
+
+    assert(view_id_btree_key_view(id_btree_key_bin, id_btree_key_len,
+                                  &id_btree_k) == COUCHSTORE_SUCCESS);
+    assert(id_btree_k.partition == 57);
+    assert(id_btree_k.doc_id.size == 12);
+    assert(id_btree_k.doc_id.buf == id_btree_key_bin + 2);
+    assert(memcmp(id_btree_k.doc_id.buf, "doc_00000057", id_btree_k.doc_id.size) == 0);
+    assert(view_id_btree_key_view(id_btree_key_bin, 1,
+                                  &id_btree_k) == COUCHSTORE_ERROR_CORRUPT);
+}
+
 void test_keys()
 {
     char key_bin[] = {
@@ -79,6 +105,10 @@ void test_keys()
     fprintf(stderr, "Decoding a view id btree key ...\n");
     id_btree_k = test_view_id_btree_key_decoding(id_btree_key_bin, sizeof(id_btree_key_bin));
 
+    fprintf(stderr, "Parsing views of view btree keys ...\n");
+    test_view_btree_key_views(key_bin, sizeof(key_bin),
+                              id_btree_key_bin, sizeof(id_btree_key_bin));
+
     fprintf(stderr, "Encoding the previously decoded view btree key ...\n");
     test_view_btree_key_encoding(k, &k_bin2, &k_bin2_size);
 
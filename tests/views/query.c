@@ -0,0 +1,302 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy of
+ * the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations under
+ * the License.
+ **/
+
+#include "view_tests.h"
+#include "../src/couch_btree.h"
+#include "../src/internal.h"
+#include "../src/views/query.h"
+#include "../src/views/util.h"
+
+/* Keys [i / 100, i] of documents doci, emitting i in partition i % 4 */
+#define QUERY_TEST_ITEMS 1000
+#define QUERY_TEST_ROWS 16
+
+static char testqueryfile[1024] = "query.couch";
+
+typedef struct {
+    int rows;
+    int first;
+    int last;
+    int descending;
+    char keys[QUERY_TEST_ROWS][32];
+    double values[QUERY_TEST_ROWS];
+} query_result_t;
+
+static int query_test_cmp(const sized_buf *key1, const sized_buf *key2)
+{
+    return view_key_cmp(key1, key2, NULL);
+}
+
+static couchstore_error_t query_test_row(const view_query_row_t *row, void *ctx)
+{
+    query_result_t *res = (query_result_t *) ctx;
+    char buf[32];
+    int n;
+
+    if (row->doc_id.size > 0) {
+        /* A map row: the documents come in order */
+        assert(row->doc_id.size < sizeof(buf));
+        memcpy(buf, row->doc_id.buf, row->doc_id.size);
+        buf[row->doc_id.size] = '\0';
+        n = atoi(buf + 3);
+        assert(row->partition == n % 4);
+        if (res->rows > 0) {
+            assert(res->descending ? n < res->last : n > res->last);
+        } else {
+            res->first = n;
+        }
+        res->last = n;
+    } else {
+        assert(res->rows < QUERY_TEST_ROWS);
+        assert(row->key.size < sizeof(res->keys[0]));
+        memcpy(res->keys[res->rows], row->key.buf, row->key.size);
+        res->keys[res->rows][row->key.size] = '\0';
+        assert(row->value.size < sizeof(buf));
+        memcpy(buf, row->value.buf, row->value.size);
+        buf[row->value.size] = '\0';
+        res->values[res->rows] = atof(buf);
+    }
+    res->rows++;
+    return COUCHSTORE_SUCCESS;
+}
+
+static node_pointer *build_query_btree(tree_file *file, view_reducer_ctx_t *red_ctx)
+{
+    couchstore_error_t errcode = COUCHSTORE_SUCCESS;
+    arena *a = new_arena(0);
+    couchfile_modify_result *mr;
+    compare_info cmp;
+    node_pointer *root = NULL;
+    sized_buf *kvs = (sized_buf *) calloc(2 * QUERY_TEST_ITEMS, sizeof(sized_buf));
+    char json[32], doc_id[32], value[32];
+    view_btree_key_t key;
+    view_btree_value_t val;
+    sized_buf val_json;
+    int i;
+
+    assert(a != NULL && kvs != NULL);
+    cmp.compare = query_test_cmp;
+    /* Small nodes, for a few levels of them */
+    mr = new_btree_modres(a, NULL, file, &cmp, view_btree_reduce,
+                          view_btree_rereduce, red_ctx, 300, 300);
+    assert(mr != NULL);
+
+    for (i = 0; i < QUERY_TEST_ITEMS; ++i) {
+        key.json_key.buf = json;
+        key.json_key.size = sprintf(json, "[%d,%d]", i / 100, i);
+        key.doc_id.buf = doc_id;
+        key.doc_id.size = sprintf(doc_id, "doc%04d", i);
+        assert(encode_view_btree_key(&key, &kvs[2 * i].buf,
+                                     &kvs[2 * i].size) == COUCHSTORE_SUCCESS);
+        val_json.buf = value;
+        val_json.size = sprintf(value, "%d", i);
+        val.partition = i % 4;
+        val.num_values = 1;
+        val.values = &val_json;
+        assert(encode_view_btree_value(&val, &kvs[2 * i + 1].buf,
+                                       &kvs[2 * i + 1].size) == COUCHSTORE_SUCCESS);
+        try(mr_push_item(&kvs[2 * i], &kvs[2 * i + 1], mr));
+    }
+    root = complete_new_btree(mr, &errcode);
+
+cleanup:
+    assert(errcode == COUCHSTORE_SUCCESS && root != NULL);
+    for (i = 0; i < 2 * QUERY_TEST_ITEMS; ++i) {
+        free(kvs[i].buf);
+    }
+    free(kvs);
+    delete_arena(a);
+    return root;
+}
+
+static void run_query(tree_file *file, const node_pointer *root,
+                      view_reducer_ctx_t *red_ctx, const view_query_t *query,
+                      query_result_t *res)
+{
+    memset(res, 0, sizeof(*res));
+    res->descending = query->descending;
+    assert(view_btree_query(file, root, red_ctx, query, query_test_row,
+                            res) == COUCHSTORE_SUCCESS);
+}
+
+static void set_key(sized_buf *buf, const char *json)
+{
+    buf->buf = (char *) json;
+    buf->size = strlen(json);
+}
+
+static void test_map_queries(tree_file *file, const node_pointer *root)
+{
+    view_query_t query;
+    query_result_t res;
+    sized_buf start, end, keys[2];
+    bitmap_t partitions;
+
+    /* Skips, by the counts of the subtrees passed over */
+    memset(&query, 0, sizeof(query));
+    query.skip = 250;
+    query.limit = 10;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 10 && res.first == 250 && res.last == 259);
+
+    /* [5] comes before all keys starting with 5 */
+    memset(&query, 0, sizeof(query));
+    set_key(&start, "[3]");
+    set_key(&end, "[5]");
+    query.start_key = &start;
+    query.end_key = &end;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 200 && res.first == 300 && res.last == 499);
+    query.inclusive_end = 1;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 200);
+
+    memset(&query, 0, sizeof(query));
+    set_key(&start, "[4,450]");
+    set_key(&end, "[4,440]");
+    query.start_key = &start;
+    query.end_key = &end;
+    query.descending = 1;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 10 && res.first == 450 && res.last == 441);
+    query.inclusive_end = 1;
+    query.skip = 1;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 10 && res.first == 449 && res.last == 440);
+
+    memset(&query, 0, sizeof(query));
+    memset(&partitions, 0, sizeof(partitions));
+    set_bit(&partitions, 1);
+    query.partitions = &partitions;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 250 && res.first == 1 && res.last == 997);
+    query.skip = 100;
+    query.limit = 5;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 5 && res.first == 401 && res.last == 417);
+
+    memset(&query, 0, sizeof(query));
+    set_key(&keys[0], "[2,205]");
+    set_key(&keys[1], "[7,701]");
+    query.keys = keys;
+    query.num_keys = 2;
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 2 && res.first == 205 && res.last == 701);
+    set_key(&keys[0], "[7,702]");
+    set_key(&keys[1], "[7]");
+    run_query(file, root, NULL, &query, &res);
+    assert(res.rows == 1 && res.first == 702);
+}
+
+static void test_reduce_queries(tree_file *file, const node_pointer *root,
+                                view_reducer_ctx_t *red_ctx)
+{
+    view_query_t query;
+    query_result_t res;
+    sized_buf start, end;
+    bitmap_t partitions;
+
+    memset(&query, 0, sizeof(query));
+    query.reduce = 1;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 1 && res.keys[0][0] == '\0' && res.values[0] == 1000);
+    query.reducer = 1;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 1 && res.values[0] == 499500);
+
+    set_key(&start, "[2]");
+    set_key(&end, "[2,250]");
+    query.start_key = &start;
+    query.end_key = &end;
+    query.inclusive_end = 1;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 1 && res.values[0] == (200 + 250) * 51 / 2);
+
+    memset(&query, 0, sizeof(query));
+    query.reduce = 1;
+    query.group_level = 1;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 10);
+    assert(strcmp(res.keys[0], "[0]") == 0 && res.values[0] == 100);
+    assert(strcmp(res.keys[9], "[9]") == 0 && res.values[9] == 100);
+    query.skip = 2;
+    query.limit = 3;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 3 && strcmp(res.keys[0], "[2]") == 0 &&
+           strcmp(res.keys[2], "[4]") == 0);
+    query.skip = 0;
+    query.limit = 2;
+    query.descending = 1;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 2 && strcmp(res.keys[0], "[9]") == 0 &&
+           strcmp(res.keys[1], "[8]") == 0);
+
+    memset(&query, 0, sizeof(query));
+    set_key(&start, "[1,150]");
+    set_key(&end, "[1,152]");
+    query.start_key = &start;
+    query.end_key = &end;
+    query.inclusive_end = 1;
+    query.reduce = 1;
+    query.group_level = VIEW_QUERY_GROUP_EXACT;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 3 && strcmp(res.keys[1], "[1,151]") == 0 &&
+           res.values[1] == 1);
+
+    /* Partitions 0 and 1, i % 4 < 2 */
+    memset(&query, 0, sizeof(query));
+    memset(&partitions, 0, sizeof(partitions));
+    set_bit(&partitions, 0);
+    set_bit(&partitions, 1);
+    query.partitions = &partitions;
+    query.reduce = 1;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 1 && res.values[0] == 500);
+    query.reducer = 1;
+    run_query(file, root, red_ctx, &query, &res);
+    assert(res.rows == 1 && res.values[0] == 249250);
+}
+
+void query_tests(void)
+{
+    couchstore_error_t errcode;
+    Db *db = NULL;
+    node_pointer *root = NULL;
+    view_reducer_ctx_t *red_ctx = NULL;
+    const char *function_sources[] = { "_count", "_sum" };
+    char *error_msg = NULL;
+
+    fprintf(stderr, "Running view query tests\n");
+
+    remove(testqueryfile);
+    try(couchstore_open_db(testqueryfile, COUCHSTORE_OPEN_FLAG_CREATE, &db));
+    red_ctx = make_view_reducer_ctx(function_sources, 2, &error_msg);
+    assert(red_ctx != NULL);
+    root = build_query_btree(&db->file, red_ctx);
+
+    test_map_queries(&db->file, root);
+    test_reduce_queries(&db->file, root, red_ctx);
+    fprintf(stderr, "End of view query tests\n");
+
+cleanup:
+    free(root);
+    free_view_reducer_ctx(red_ctx);
+    if (db != NULL) {
+        couchstore_close_db(db);
+    }
+    remove(testqueryfile);
+    assert(errcode == COUCHSTORE_SUCCESS);
+}
@@ -3,6 +3,7 @@
 #include "view_tests.h"
 #include "../src/couch_btree.h"
 #include "../src/views/mapreduce/mapreduce.h"
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 
@@ -635,6 +636,8 @@ static void test_view_btree_count_reducer(void)
     free_view_reduction(&reduction1);
     free_view_reduction(&reduction2);
     free_view_btree_reduction(red);
+    /* Builtins aren't timed as JavaScript */
+    assert(ctx->js_calls == 0);
     free_view_reducer_ctx(ctx);
     free(key1_bin);
     free(key2_bin);
@@ -1080,6 +1083,7 @@ static void test_view_btree_js_reducer(void)
     free_view_reduction(&reduction1);
     free_view_reduction(&reduction2);
     free_view_btree_reduction(red);
+    assert(ctx->js_calls > 0);
     free_view_reducer_ctx(ctx);
     free(key1_bin);
     free(key2_bin);
@@ -1524,6 +1528,321 @@ static void test_view_btree_no_reducers(void)
     free_node_list(nl);
 }
 
+/* A leaf of n items keyed first, first + 1, ..., whose values are all 1 */
+static nodelist *make_numbered_leaf(int first, int n)
+{
+    nodelist *head = NULL, **tail = &head;
+    view_btree_value_t value;
+    sized_buf one = { "1", 1 };
+    int i;
+
+    value.partition = 1;
+    value.num_values = 1;
+    value.values = &one;
+
+    for (i = 0; i < n; ++i) {
+        view_btree_key_t key;
+        char json[16];
+        char *bin = NULL;
+        size_t size = 0;
+        nodelist *item = (nodelist *) calloc(1, sizeof(nodelist));
+
+        assert(item != NULL);
+        sprintf(json, "%d", first + i);
+        key.json_key.buf = json;
+        key.json_key.size = strlen(json);
+        key.doc_id.buf = "doc";
+        key.doc_id.size = 3;
+        assert(encode_view_btree_key(&key, &bin, &size) == COUCHSTORE_SUCCESS);
+        item->key.buf = bin;
+        item->key.size = size;
+        assert(encode_view_btree_value(&value, &bin, &size) == COUCHSTORE_SUCCESS);
+        item->data.buf = bin;
+        item->data.size = size;
+        *tail = item;
+        tail = &item->next;
+    }
+
+    return head;
+}
+
+static void free_numbered_leaf(nodelist *nl)
+{
+    while (nl != NULL) {
+        nodelist *next = nl->next;
+        free(nl->key.buf);
+        free(nl->data.buf);
+        free(nl);
+        nl = next;
+    }
+}
+
+/* The estimate of a _approx_count_distinct reduction */
+static uint64_t approx_count(const char *bin, size_t size)
+{
+    view_btree_reduction_t *red = NULL;
+    uint64_t count = 0;
+
+    assert(decode_view_btree_reduction(bin, size, &red) == COUCHSTORE_SUCCESS);
+    assert(red->num_values == 1);
+    assert(red->reduce_values[0].size > sizeof("{\"count\":") - 1);
+    assert(strncmp(red->reduce_values[0].buf, "{\"count\":",
+                   sizeof("{\"count\":") - 1) == 0);
+    assert(sscanf(red->reduce_values[0].buf + sizeof("{\"count\":") - 1,
+                  "%" SCNu64, &count) == 1);
+    free_view_btree_reduction(red);
+
+    return count;
+}
+
+static void test_view_btree_approx_count_distinct_reducer(void)
+{
+    char *error_msg = NULL;
+    view_reducer_ctx_t *ctx = NULL;
+    const char *function_sources[] = { "_approx_count_distinct" };
+    nodelist *leaf1, *leaf2, *leaf3;
+    char red1_bin[MAX_REDUCTION_SIZE], red2_bin[MAX_REDUCTION_SIZE];
+    char red_bin[MAX_REDUCTION_SIZE];
+    size_t red1_size = 0, red2_size = 0, red_size = 0;
+    node_pointer np1, np2;
+    nodelist nl1, nl2;
+    view_btree_reduction_t bad;
+    sized_buf bad_value = { "{\"count\":3}", sizeof("{\"count\":3}") - 1 };
+    char bad_bin[512];
+    size_t bad_size = 0;
+    uint64_t count;
+
+    ctx = make_view_reducer_ctx(function_sources, 1, &error_msg);
+    assert(ctx != NULL);
+
+    /* Few keys are counted exactly, and a key twice counts once */
+    leaf1 = make_numbered_leaf(0, 10);
+    leaf2 = make_numbered_leaf(5, 10);
+    assert(view_btree_reduce(red_bin, &red_size, leaf1, 10, ctx) == COUCHSTORE_SUCCESS);
+    assert(approx_count(red_bin, red_size) == 10);
+    for (leaf3 = leaf1; leaf3->next != NULL; leaf3 = leaf3->next) {
+    }
+    leaf3->next = leaf2;
+    assert(view_btree_reduce(red_bin, &red_size, leaf1, 20, ctx) == COUCHSTORE_SUCCESS);
+    assert(approx_count(red_bin, red_size) == 15);
+    free_numbered_leaf(leaf1);
+
+    /* Two overlapping leaves of 3000 keys, 4500 distinct ones in all */
+    leaf1 = make_numbered_leaf(0, 3000);
+    leaf2 = make_numbered_leaf(1500, 3000);
+    assert(view_btree_reduce(red1_bin, &red1_size, leaf1, 3000, ctx) == COUCHSTORE_SUCCESS);
+    assert(view_btree_reduce(red2_bin, &red2_size, leaf2, 3000, ctx) == COUCHSTORE_SUCCESS);
+    count = approx_count(red1_bin, red1_size);
+    assert(count > 2700 && count < 3300);
+    /* A dense sketch is one character a register */
+    assert(red1_size < 1200);
+
+    memset(&np1, 0, sizeof(np1));
+    np1.reduce_value.buf = red1_bin;
+    np1.reduce_value.size = red1_size;
+    memset(&np2, 0, sizeof(np2));
+    np2.reduce_value.buf = red2_bin;
+    np2.reduce_value.size = red2_size;
+    memset(&nl1, 0, sizeof(nl1));
+    nl1.pointer = &np1;
+    nl1.next = &nl2;
+    memset(&nl2, 0, sizeof(nl2));
+    nl2.pointer = &np2;
+    assert(view_btree_rereduce(red_bin, &red_size, &nl1, 2, ctx) == COUCHSTORE_SUCCESS);
+    count = approx_count(red_bin, red_size);
+    assert(count > 4050 && count < 4950);
+
+    /* Rereducing a sketch and the keys it came from changes nothing */
+    leaf3 = make_numbered_leaf(0, 3000);
+    assert(view_btree_reduce(red2_bin, &red2_size, leaf3, 3000, ctx) == COUCHSTORE_SUCCESS);
+    np2.reduce_value.size = red2_size;
+    assert(view_btree_rereduce(red_bin, &red_size, &nl1, 2, ctx) == COUCHSTORE_SUCCESS);
+    assert(approx_count(red_bin, red_size) == approx_count(red1_bin, red1_size));
+
+    /* Something else to rereduce is an error */
+    memset(&bad, 0, sizeof(bad));
+    bad.num_values = 1;
+    bad.reduce_values = &bad_value;
+    assert(encode_view_btree_reduction(&bad, bad_bin, &bad_size) == COUCHSTORE_SUCCESS);
+    np2.reduce_value.buf = bad_bin;
+    np2.reduce_value.size = bad_size;
+    assert(view_btree_rereduce(red_bin, &red_size, &nl1, 2, ctx) == COUCHSTORE_ERROR_REDUCER_FAILURE);
+    assert(ctx->error != NULL);
+    assert(strcmp(ctx->error, "Invalid _approx_count_distinct JSON object") == 0);
+
+    free_numbered_leaf(leaf1);
+    free_numbered_leaf(leaf2);
+    free_numbered_leaf(leaf3);
+    free_view_reducer_ctx(ctx);
+}
+
+/* A child of a KP node, for rereduce: its pointer and its reduction */
+typedef struct {
+    nodelist     item;
+    node_pointer pointer;
+    char         bin[512];
+} delta_child_t;
+
+static void make_delta_child(delta_child_t *child,
+                             uint64_t kv_count,
+                             uint16_t partition,
+                             const char *count,
+                             const char *sum,
+                             const char *stats)
+{
+    view_btree_reduction_t r;
+    sized_buf values[3];
+    size_t size = 0;
+
+    values[0].buf = (char *) count;
+    values[0].size = strlen(count);
+    values[1].buf = (char *) sum;
+    values[1].size = strlen(sum);
+    values[2].buf = (char *) stats;
+    values[2].size = strlen(stats);
+    r.kv_count = kv_count;
+    memset(&r.partitions_bitmap, 0, sizeof(r.partitions_bitmap));
+    set_bit(&r.partitions_bitmap, partition);
+    r.num_values = 3;
+    r.reduce_values = values;
+    assert(encode_view_btree_reduction(&r, child->bin, &size) == COUCHSTORE_SUCCESS);
+
+    memset(child, 0, offsetof(delta_child_t, bin));
+    child->pointer.reduce_value.buf = child->bin;
+    child->pointer.reduce_value.size = size;
+    child->item.pointer = &child->pointer;
+}
+
+/* Rereduces the children given, in turn */
+static void rereduce_children(delta_child_t *children[],
+                              int count,
+                              view_reducer_ctx_t *ctx,
+                              char *red_bin,
+                              size_t *red_bin_size)
+{
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        children[i]->item.next = (i + 1 < count) ? &children[i + 1]->item : NULL;
+    }
+    assert(view_btree_rereduce(red_bin, red_bin_size, &children[0]->item,
+                               count, ctx) == COUCHSTORE_SUCCESS);
+}
+
+/* Works out the reduction of new_children, which are old_children with
+   the one at index replaced by added, from the old one; returns what
+   view_btree_reduce_delta did, having checked a reduction it worked out
+   is what rereducing them gives. */
+static int reduce_delta_of(delta_child_t *old_children[],
+                           delta_child_t *added,
+                           int index,
+                           int count,
+                           view_reducer_ctx_t *ctx)
+{
+    delta_child_t *new_children[3];
+    nodelist removed_item, added_item;
+    char old_bin[512], red_bin[512], delta_bin[512];
+    size_t old_size = 0, red_size = 0, delta_size = 0;
+    sized_buf old_reduction;
+    reduce_delta delta;
+    int i, ret;
+
+    rereduce_children(old_children, count, ctx, old_bin, &old_size);
+    for (i = 0; i < count; ++i) {
+        new_children[i] = (i == index) ? added : old_children[i];
+    }
+
+    old_reduction.buf = old_bin;
+    old_reduction.size = old_size;
+    memset(&removed_item, 0, sizeof(removed_item));
+    removed_item.pointer = &old_children[index]->pointer;
+    memset(&added_item, 0, sizeof(added_item));
+    added_item.pointer = &added->pointer;
+    delta.old_reduction = &old_reduction;
+    delta.removed = &removed_item;
+    delta.removed_count = 1;
+    delta.added = &added_item;
+    delta.added_count = 1;
+
+    ret = view_btree_reduce_delta(delta_bin, &delta_size, NULL, count,
+                                  &delta, ctx);
+    assert(ret >= 0);
+    if (ret > 0) {
+        rereduce_children(new_children, count, ctx, red_bin, &red_size);
+        assert(delta_size == red_size);
+        assert(memcmp(delta_bin, red_bin, red_size) == 0);
+    }
+
+    return ret;
+}
+
+static void test_view_btree_reduce_delta(void)
+{
+    char *error_msg = NULL;
+    const char *builtins[] = { "_count", "_sum", "_stats" };
+    const char *with_js[] = { "_count", "function(k, v, r) { return 1; }" };
+    view_reducer_ctx_t *ctx;
+    delta_child_t c1, c2, c3, added;
+    delta_child_t *children[3];
+
+    ctx = make_view_reducer_ctx(builtins, 3, &error_msg);
+    assert(ctx != NULL);
+
+    make_delta_child(&c1, 3, 1, "3", "30",
+                     "{\"sum\":30,\"count\":3,\"min\":1,\"max\":20,\"sumsqr\":402}");
+    make_delta_child(&c2, 2, 2, "2", "7",
+                     "{\"sum\":7,\"count\":2,\"min\":3,\"max\":4,\"sumsqr\":25}");
+    make_delta_child(&c3, 4, 3, "4", "-12",
+                     "{\"sum\":-12,\"count\":4,\"min\":-10,\"max\":30,\"sumsqr\":1001}");
+    children[0] = &c1;
+    children[1] = &c2;
+    children[2] = &c3;
+
+    /* A child neither the minimum nor the maximum came from */
+    make_delta_child(&added, 3, 2, "3", "12",
+                     "{\"sum\":12,\"count\":3,\"min\":2,\"max\":6,\"sumsqr\":56}");
+    assert(reduce_delta_of(children, &added, 1, 3, ctx) == 1);
+
+    /* One with a new minimum and maximum */
+    make_delta_child(&added, 1, 2, "1", "-50",
+                     "{\"sum\":-50,\"count\":1,\"min\":-50,\"max\":-50,\"sumsqr\":2500}");
+    assert(reduce_delta_of(children, &added, 1, 3, ctx) == 1);
+
+    /* The one the minimum came from is replaced: rereduce */
+    make_delta_child(&added, 4, 3, "4", "-2",
+                     "{\"sum\":-2,\"count\":4,\"min\":-1,\"max\":30,\"sumsqr\":901}");
+    assert(reduce_delta_of(children, &added, 2, 3, ctx) == 0);
+
+    /* Its replacement may not have the partition of the one removed */
+    make_delta_child(&added, 2, 4, "2", "7",
+                     "{\"sum\":7,\"count\":2,\"min\":3,\"max\":4,\"sumsqr\":25}");
+    assert(reduce_delta_of(children, &added, 1, 3, ctx) == 0);
+
+    /* Sums that aren't integers don't take apart exactly */
+    make_delta_child(&added, 2, 2, "2", "7.5",
+                     "{\"sum\":7,\"count\":2,\"min\":3,\"max\":4,\"sumsqr\":25}");
+    assert(reduce_delta_of(children, &added, 1, 3, ctx) == 0);
+
+    free_view_reducer_ctx(ctx);
+
+    /* JavaScript reductions are always rereduced */
+    ctx = make_view_reducer_ctx(with_js, 2, &error_msg);
+    if (ctx != NULL) {
+        reduce_delta delta;
+        sized_buf old_reduction = { c1.bin, c1.pointer.reduce_value.size };
+        char red_bin[512];
+        size_t red_size = 0;
+
+        memset(&delta, 0, sizeof(delta));
+        delta.old_reduction = &old_reduction;
+        assert(view_btree_reduce_delta(red_bin, &red_size, NULL, 0,
+                                       &delta, ctx) == 0);
+        free_view_reducer_ctx(ctx);
+    } else {
+        free(error_msg);
+    }
+}
+
 void reducer_tests(void)
 {
     fprintf(stderr, "Running built-in reducer tests ... \n");
@@ -1541,4 +1860,8 @@ void reducer_tests(void)
     fprintf(stderr, "End of view btree multiple reducer tests\n");
     test_view_btree_no_reducers();
     fprintf(stderr, "End of view btree no reducer tests\n");
+    test_view_btree_approx_count_distinct_reducer();
+    fprintf(stderr, "End of built-in view btree approx count distinct reducer tests\n");
+    test_view_btree_reduce_delta();
+    fprintf(stderr, "End of view btree reduce delta tests\n");
 }
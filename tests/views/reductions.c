@@ -78,6 +78,68 @@ static void test_view_id_btree_reduction_encoding(const view_id_btree_reduction_
     assert(res == COUCHSTORE_SUCCESS);
 }
 
+static void check_compact_bitmap(view_btree_reduction_t *r,
+                                 const bitmap_t *bm,
+                                 size_t bitmap_size)
+{
+    char bin[MAX_REDUCTION_SIZE];
+    size_t size = 0;
+    size_t values_size = 2 + 4 + 2 + 5 + 2 + 9;
+    view_btree_reduction_t *r2 = NULL;
+    arena *a = new_arena(0);
+
+    r->partitions_bitmap = *bm;
+    assert(encode_view_btree_reduction_compact(r, bin, &size) == COUCHSTORE_SUCCESS);
+    assert(size == 5 + bitmap_size + values_size);
+
+    assert(decode_view_btree_reduction(bin, size, &r2) == COUCHSTORE_SUCCESS);
+    assert(r2->kv_count == 1582);
+    assert(is_equal_bitmap(&r2->partitions_bitmap, bm));
+    assert(r2->num_values == 3);
+    assert(memcmp(r2->reduce_values[2].buf, "110120647", 9) == 0);
+    free_view_btree_reduction(r2);
+
+    assert(decode_view_btree_reduction_in_arena(bin, size, a, &r2) == COUCHSTORE_SUCCESS);
+    assert(r2->kv_count == 1582);
+    assert(is_equal_bitmap(&r2->partitions_bitmap, bm));
+    assert(r2->num_values == 3);
+    assert(memcmp(r2->reduce_values[1].buf, "-1582", 5) == 0);
+    delete_arena(a);
+}
+
+static void test_compact_reduction_bitmaps(view_btree_reduction_t *r)
+{
+    bitmap_t bm = r->partitions_bitmap;
+    char bad[5 + 1] = { (char)0x80, 0, 0, 6, 46, (char)0x80 };
+    view_btree_reduction_t *r2 = NULL;
+    unsigned i;
+
+    fprintf(stderr, "Encoding view btree reductions with compact bitmaps ...\n");
+
+    /* 0 to 63: one run */
+    check_compact_bitmap(r, &bm, 1 + 4);
+
+    memset(&bm, 0, sizeof(bm));
+    check_compact_bitmap(r, &bm, 1);
+
+    set_bit(&bm, 7);
+    set_bit(&bm, 500);
+    set_bit(&bm, 1023);
+    check_compact_bitmap(r, &bm, 1 + 3 * 2);
+
+    for (i = 100; i < 400; ++i) {
+        set_bit(&bm, i);
+    }
+    check_compact_bitmap(r, &bm, 1 + 4 * 4);
+
+    for (i = 0; i < 1024; i += 2) {
+        set_bit(&bm, i);
+    }
+    check_compact_bitmap(r, &bm, 1 + sizeof(bm));
+
+    assert(decode_view_btree_reduction(bad, sizeof(bad), &r2) == COUCHSTORE_ERROR_CORRUPT);
+}
+
 void test_reductions()
 {
     unsigned char reduction_bin[] = {
@@ -143,6 +205,8 @@ void test_reductions()
     assert(id_btree_r_bin3_size == sizeof(id_btree_reduction_bin));
     assert(memcmp(id_btree_r_bin3, id_btree_reduction_bin, id_btree_r_bin3_size) == 0);
 
+    test_compact_reduction_bitmaps(r2);
+
     free_view_btree_reduction(r);
     free_view_btree_reduction(r2);
 
@@ -150,4 +150,36 @@ void test_sorted_lists()
     sorted_list_free_iterator(iterator);
 
     sorted_list_free(list);
+
+    /* A list of many elements, reserved for and filled in order, then
+       filled again backwards */
+    list = sorted_list_create(int_cmp_fun);
+    assert(list != NULL);
+    assert(sorted_list_reserve(list, 1024) == 0);
+    for (i = 0; i < 1024; ++i) {
+        assert(sorted_list_add(list, &i, sizeof(i)) == 0);
+    }
+    for (i = 1023; i >= 0; --i) {
+        assert(sorted_list_add(list, &i, sizeof(i)) == 0);
+    }
+    assert(sorted_list_size(list) == 1024);
+    for (i = 0; i < 1024; i += 2) {
+        sorted_list_remove(list, &i);
+    }
+    assert(sorted_list_size(list) == 512);
+
+    iterator = sorted_list_iterator(list);
+    assert(iterator != NULL);
+    for (i = 1; i < 1024; i += 2) {
+        int *e = sorted_list_next(iterator);
+
+        assert(e != NULL);
+        assert(*e == i);
+        assert(sorted_list_get(list, &i) == e);
+    }
+    assert(sorted_list_next(iterator) == NULL);
+    sorted_list_free_iterator(iterator);
+
+    sorted_list_free(list);
+    free(sorted_elements);
 }
@@ -148,6 +148,89 @@ void test_interleaving()
 }
 
 
+/* The low 32 bits of a point's Hilbert index, enough for small points */
+static uint32_t hilbert_index(uint32_t *numbers, uint16_t num)
+{
+    unsigned char *index = hilbert_uint32s(numbers, num);
+    size_t size = num * sizeof(uint32_t);
+    uint32_t low = 0;
+    size_t i;
+
+    assert(index != NULL);
+    for (i = size - sizeof(uint32_t); i < size; ++i) {
+        low = (low << 8) | index[i];
+    }
+    free(index);
+
+    return low;
+}
+
+
+/* The first side^num points of the curve fill the cube of that side at
+ * the origin, each a step away from the one before */
+static void check_hilbert_cube(uint16_t num, uint32_t side)
+{
+    uint32_t count = 1, i, k, at;
+    uint32_t point[3], prev[3];
+    uint32_t *points;
+    uint16_t d;
+
+    for (d = 0; d < num; ++d) {
+        count *= side;
+    }
+    points = (uint32_t *)malloc(count * num * sizeof(uint32_t));
+    for (k = 0; k < count; ++k) {
+        points[k * num] = UINT32_MAX;
+    }
+
+    for (i = 0; i < count; ++i) {
+        for (d = 0, at = i; d < num; ++d, at /= side) {
+            point[d] = at % side;
+        }
+        k = hilbert_index(point, num);
+        assert(k < count);
+        assert(points[k * num] == UINT32_MAX);
+        memcpy(&points[k * num], point, num * sizeof(uint32_t));
+    }
+
+    for (k = 1; k < count; ++k) {
+        uint32_t steps = 0;
+
+        memcpy(prev, &points[(k - 1) * num], num * sizeof(uint32_t));
+        for (d = 0; d < num; ++d) {
+            uint32_t a = prev[d], b = points[k * num + d];
+            steps += a > b ? a - b : b - a;
+        }
+        assert(steps == 1);
+    }
+    free(points);
+}
+
+
+void test_hilbert()
+{
+    uint32_t numbers[2];
+    unsigned char *index;
+
+    fprintf(stderr, "Running spatial Hilbert curve tests\n");
+
+    check_hilbert_cube(2, 16);
+    check_hilbert_cube(3, 8);
+
+    /* The curve starts at the origin and ends in the last quadrant */
+    numbers[0] = 0;
+    numbers[1] = 0;
+    index = hilbert_uint32s(numbers, 2);
+    assert(memcmp(index, "\0\0\0\0\0\0\0\0", 8) == 0);
+    free(index);
+    numbers[0] = UINT32_MAX;
+    numbers[1] = 0;
+    index = hilbert_uint32s(numbers, 2);
+    assert(memcmp(index, "\xff\xff\xff\xff\xff\xff\xff\xff", 8) == 0);
+    free(index);
+}
+
+
 void test_spatial_scale_factor()
 {
     double mbb[] = {1.0, 3.0, 30.33, 31.33, 15.4, 138.7, 7.8, 7.8};
@@ -179,6 +262,7 @@ void test_spatial_center()
     double mbb2[] = {6.3, 18.7};
     sized_mbb_t mbb_struct;
     double *center;
+    double center_to[4];
 
     fprintf(stderr, "Running spatial scale factor tests\n");
 
@@ -190,6 +274,9 @@ void test_spatial_center()
     assert(center[2] == 77.05);
     assert(center[3] == 7.8);
     free(center);
+    spatial_center_to(&mbb_struct, center_to);
+    assert(center_to[0] == 2.0);
+    assert(center_to[3] == 7.8);
 
     mbb_struct.mbb = mbb2;
     mbb_struct.num = sizeof(mbb2)/sizeof(double);
@@ -207,6 +294,7 @@ void test_spatial_scale_point()
     uint32_t max = ZCODE_MAX_VALUE;
     scale_factor_t *sf = NULL;
     uint32_t *scaled;
+    uint32_t scaled_to[4];
 
     fprintf(stderr, "Running spatial scale point tests\n");
 
@@ -217,6 +305,10 @@ void test_spatial_scale_point()
     assert(scaled[2] < UINT32_MAX/2 && scaled[2] > 0);
     assert(scaled[3] == 0);
 
+    memset(scaled_to, 0, sizeof(scaled_to));
+    spatial_scale_point_to(point, sf, scaled_to);
+    assert(memcmp(scaled, scaled_to, sizeof(scaled_to)) == 0);
+
     free_spatial_scale_factor(sf);
     free(scaled);
 }
@@ -271,3 +363,209 @@ void test_set_bit_sized()
     free(bitmap);
     free(bitmap2);
 }
+
+
+/* A key of a spatial index: the MBB, then the document ID */
+static sized_buf *spatial_key(const double *mbb, uint16_t num,
+                              const char *docid)
+{
+    sized_buf *key = (sized_buf *) malloc(sizeof(sized_buf));
+    raw_16 raw_num = encode_raw16(num);
+
+    assert(key != NULL);
+    key->size = sizeof(raw_num) + num * sizeof(double) + strlen(docid);
+    key->buf = (char *) malloc(key->size);
+    assert(key->buf != NULL);
+    memcpy(key->buf, &raw_num, sizeof(raw_num));
+    memcpy(key->buf + sizeof(raw_num), mbb, num * sizeof(double));
+    memcpy(key->buf + sizeof(raw_num) + num * sizeof(double), docid,
+           strlen(docid));
+
+    return key;
+}
+
+static void free_spatial_key(sized_buf *key)
+{
+    free(key->buf);
+    free(key);
+}
+
+/* Whether a and b sort by their sort keys as they compare */
+static int sort_keys_agree(const sized_buf *a, const sized_buf *b,
+                           const scale_factor_t *sf)
+{
+    char ska[256], skb[256];
+    int la = spatial_key_sort_key(a, ska, sizeof(ska), sf);
+    int lb = spatial_key_sort_key(b, skb, sizeof(skb), sf);
+    int cmp = spatial_key_cmp(a, b, sf);
+    int sk_cmp;
+
+    assert(la > 0 && lb > 0);
+    sk_cmp = memcmp(ska, skb, la < lb ? la : lb);
+    if (sk_cmp == 0) {
+        sk_cmp = la - lb;
+    }
+
+    return (cmp < 0) == (sk_cmp < 0) && (cmp > 0) == (sk_cmp > 0);
+}
+
+
+/* The MBB of a spatial reduction */
+static void reduction_mbb(const view_btree_reduction_t *red, double *mbb,
+                          uint16_t num)
+{
+    assert(red->num_values == 1);
+    assert(red->reduce_values[0].size == sizeof(raw_16) + num * sizeof(double));
+    assert(decode_raw16(*((raw_16 *) red->reduce_values[0].buf)) == num);
+    memcpy(mbb, red->reduce_values[0].buf + sizeof(raw_16),
+           num * sizeof(double));
+}
+
+
+void test_spatial_key_cmp()
+{
+    double enclosing[] = {0.0, 10.0, 0.0, 10.0};
+    double mbb1[] = {1.0, 3.0, 1.0, 3.0};
+    double mbb2[] = {2.0, 2.0, 2.0, 2.0};
+    double mbb3[] = {8.0, 9.0, 8.0, 9.0};
+    double mbb4[] = {7.0, 8.0, 2.0, 3.0};
+    scale_factor_t *sf = spatial_scale_factor(enclosing, 2, ZCODE_MAX_VALUE);
+    sized_buf *k1 = spatial_key(mbb1, 4, "doc1");
+    sized_buf *k2 = spatial_key(mbb2, 4, "doc1");
+    sized_buf *k3 = spatial_key(mbb1, 4, "doc2");
+    sized_buf *k4 = spatial_key(mbb3, 4, "doc0");
+
+    fprintf(stderr, "Running spatial key compare tests\n");
+
+    assert(spatial_key_cmp(k1, k1, sf) == 0);
+    /* Same centre, told apart all the same, and consistently */
+    assert(spatial_key_cmp(k1, k2, sf) != 0);
+    assert(spatial_key_cmp(k1, k2, sf) == -spatial_key_cmp(k2, k1, sf));
+    assert(spatial_key_cmp(k1, k3, sf) < 0);
+    assert(spatial_key_cmp(k3, k1, sf) > 0);
+    /* The Z-order decides first */
+    assert(spatial_key_cmp(k1, k4, sf) < 0);
+    assert(spatial_key_cmp(k4, k3, sf) > 0);
+    /* Sort keys order the same */
+    assert(sort_keys_agree(k1, k1, sf));
+    assert(sort_keys_agree(k1, k2, sf));
+    assert(sort_keys_agree(k2, k1, sf));
+    assert(sort_keys_agree(k1, k3, sf));
+    assert(sort_keys_agree(k4, k3, sf));
+
+    free_spatial_key(k1);
+    free_spatial_key(k2);
+    free_spatial_key(k3);
+    free_spatial_key(k4);
+
+    /* The Hilbert curve turns back where the Z-curve jumps across */
+    k1 = spatial_key(mbb3, 4, "doc1");
+    k2 = spatial_key(mbb4, 4, "doc1");
+    assert(spatial_key_cmp(k1, k2, sf) > 0);
+    sf->order = SPATIAL_ORDER_HILBERT;
+    assert(spatial_key_cmp(k1, k1, sf) == 0);
+    assert(spatial_key_cmp(k1, k2, sf) < 0);
+    assert(spatial_key_cmp(k2, k1, sf) > 0);
+    assert(sort_keys_agree(k1, k2, sf));
+    assert(sort_keys_agree(k2, k1, sf));
+    free_spatial_key(k1);
+    free_spatial_key(k2);
+
+    free_spatial_scale_factor(sf);
+}
+
+
+void test_spatial_reducers()
+{
+    double mbb1[] = {1.0, 3.0, 5.0, 6.0};
+    double mbb2[] = {-2.0, 2.0, 5.5, 5.5};
+    double mbb3[] = {4.0, 4.5, -1.0, 0.0};
+    double mbb[4];
+    sized_buf *k1 = spatial_key(mbb1, 4, "doc1");
+    sized_buf *k2 = spatial_key(mbb2, 4, "doc2");
+    sized_buf *k3 = spatial_key(mbb3, 4, "doc3");
+    view_btree_value_t value;
+    sized_buf geometry;
+    char *v1, *v2, *v3;
+    size_t v1_size, v2_size, v3_size;
+    nodelist nl1, nl2, nl3, pl1, pl2;
+    node_pointer np1, np2;
+    char red1[MAX_REDUCTION_SIZE], red2[MAX_REDUCTION_SIZE];
+    char red3[MAX_REDUCTION_SIZE];
+    size_t size;
+    view_btree_reduction_t *red = NULL;
+
+    fprintf(stderr, "Running spatial reducers tests\n");
+
+    geometry.buf = "{}";
+    geometry.size = 2;
+    value.num_values = 1;
+    value.values = &geometry;
+    value.partition = 3;
+    assert(encode_view_btree_value(&value, &v1, &v1_size) == COUCHSTORE_SUCCESS);
+    value.partition = 7;
+    assert(encode_view_btree_value(&value, &v2, &v2_size) == COUCHSTORE_SUCCESS);
+    value.partition = 64;
+    assert(encode_view_btree_value(&value, &v3, &v3_size) == COUCHSTORE_SUCCESS);
+
+    nl1.key = *k1;
+    nl1.data.buf = v1;
+    nl1.data.size = v1_size;
+    nl1.pointer = NULL;
+    nl1.next = &nl2;
+    nl2.key = *k2;
+    nl2.data.buf = v2;
+    nl2.data.size = v2_size;
+    nl2.pointer = NULL;
+    nl2.next = NULL;
+    nl3.key = *k3;
+    nl3.data.buf = v3;
+    nl3.data.size = v3_size;
+    nl3.pointer = NULL;
+    nl3.next = NULL;
+
+    assert(spatial_btree_reduce(red1, &size, &nl1, 2, NULL) == COUCHSTORE_SUCCESS);
+    assert(decode_view_btree_reduction(red1, size, &red) == COUCHSTORE_SUCCESS);
+    assert(red->kv_count == 2);
+    assert(is_bit_set(&red->partitions_bitmap, 3));
+    assert(is_bit_set(&red->partitions_bitmap, 7));
+    assert(!is_bit_set(&red->partitions_bitmap, 64));
+    reduction_mbb(red, mbb, 4);
+    assert(mbb[0] == -2.0 && mbb[1] == 3.0);
+    assert(mbb[2] == 5.0 && mbb[3] == 6.0);
+    free_view_btree_reduction(red);
+    np1.reduce_value.buf = red1;
+    np1.reduce_value.size = size;
+
+    assert(spatial_btree_reduce(red2, &size, &nl3, 1, NULL) == COUCHSTORE_SUCCESS);
+    np2.reduce_value.buf = red2;
+    np2.reduce_value.size = size;
+
+    pl1.pointer = &np1;
+    pl1.next = &pl2;
+    pl2.pointer = &np2;
+    pl2.next = NULL;
+    assert(spatial_btree_rereduce(red3, &size, &pl1, 2, NULL) == COUCHSTORE_SUCCESS);
+    assert(decode_view_btree_reduction(red3, size, &red) == COUCHSTORE_SUCCESS);
+    assert(red->kv_count == 3);
+    assert(is_bit_set(&red->partitions_bitmap, 3));
+    assert(is_bit_set(&red->partitions_bitmap, 7));
+    assert(is_bit_set(&red->partitions_bitmap, 64));
+    reduction_mbb(red, mbb, 4);
+    assert(mbb[0] == -2.0 && mbb[1] == 4.5);
+    assert(mbb[2] == -1.0 && mbb[3] == 6.0);
+    free_view_btree_reduction(red);
+
+    /* MBBs of different dimensions can't be joined */
+    free_spatial_key(k3);
+    k3 = spatial_key(mbb3, 2, "doc3");
+    nl2.key = *k3;
+    assert(spatial_btree_reduce(red1, &size, &nl1, 2, NULL) == COUCHSTORE_ERROR_CORRUPT);
+
+    free(v1);
+    free(v2);
+    free(v3);
+    free_spatial_key(k1);
+    free_spatial_key(k2);
+    free_spatial_key(k3);
+}
@@ -28,11 +28,17 @@
 #include "../macros.h"
 #include "../src/views/bitmap.h"
 #include "../src/views/spatial.h"
+#include "../src/views/values.h"
+#include "../src/views/reductions.h"
+#include "../src/bitfield.h"
 
 void test_interleaving(void);
+void test_hilbert(void);
 void test_spatial_scale_factor(void);
 void test_spatial_center(void);
 void test_spatial_scale_point(void);
 void test_set_bit_sized(void);
+void test_spatial_key_cmp(void);
+void test_spatial_reducers(void);
 
 #endif
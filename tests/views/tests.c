@@ -36,11 +36,15 @@ void view_tests()
     test_values();
     reducer_tests();
     cleanup_tests();
+    query_tests();
 
     /* spatial tests */
     test_interleaving();
+    test_hilbert();
     test_spatial_scale_factor();
     test_spatial_center();
     test_spatial_scale_point();
     test_set_bit_sized();
+    test_spatial_key_cmp();
+    test_spatial_reducers();
 }
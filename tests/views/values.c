@@ -75,6 +75,73 @@ static void test_view_id_btree_value_encoding(const view_id_btree_value_t *v,
     assert(res == COUCHSTORE_SUCCESS);
 }
 
+static void test_view_btree_value_view(const char *value_bin, size_t len)
+{
+    view_btree_value_view_t v;
+    sized_buf json;
+
+    assert(view_btree_value_view(value_bin, len, &v) == COUCHSTORE_SUCCESS);
+    assert(v.partition == 10);
+    assert(v.num_values == 2);
+
+    assert(view_btree_value_next(&v, &json));
+    assert(json.size == 4);
+    assert(json.buf == value_bin + 5);
+    assert(memcmp(json.buf, "6155", json.size) == 0);
+    assert(view_btree_value_next(&v, &json));
+    assert(json.size == 4);
+    assert(memcmp(json.buf, "6154", json.size) == 0);
+    assert(!view_btree_value_next(&v, &json));
+
+    /* Cut short in a value, and in a value's size */
+    assert(view_btree_value_view(value_bin, len - 1, &v) == COUCHSTORE_ERROR_CORRUPT);
+    assert(view_btree_value_view(value_bin, 8, &v) == COUCHSTORE_ERROR_CORRUPT);
+    assert(view_btree_value_view(value_bin, 10, &v) == COUCHSTORE_ERROR_CORRUPT);
+    assert(view_btree_value_view(value_bin, 1, &v) == COUCHSTORE_ERROR_CORRUPT);
+    assert(view_btree_value_view(value_bin, 2, &v) == COUCHSTORE_SUCCESS);
+    assert(v.num_values == 0);
+    assert(!view_btree_value_next(&v, &json));
+}
+
+static void test_view_id_btree_value_view(const char *id_btree_value_bin,
+                                          size_t len)
+{
+    view_id_btree_value_view_t v;
+    view_keys_mapping_view_t m;
+    sized_buf key;
+
+    assert(view_id_btree_value_view(id_btree_value_bin, len, &v) == COUCHSTORE_SUCCESS);
+    assert(v.partition == 67);
+    assert(v.num_view_keys_map == 2);
+
+    assert(view_id_btree_value_next(&v, &m));
+    assert(m.view_id == 0);
+    assert(m.num_keys == 2);
+    assert(view_keys_mapping_next(&m, &key));
+    assert(key.size == 14);
+    assert(memcmp(key.buf, "[123,\"foobar\"]", key.size) == 0);
+    assert(view_keys_mapping_next(&m, &key));
+    assert(key.size == 4);
+    assert(memcmp(key.buf, "-321", key.size) == 0);
+    assert(!view_keys_mapping_next(&m, &key));
+
+    /* The second mapping's found without reading the first one's keys */
+    assert(view_id_btree_value_view(id_btree_value_bin, len, &v) == COUCHSTORE_SUCCESS);
+    assert(view_id_btree_value_next(&v, &m));
+    assert(view_id_btree_value_next(&v, &m));
+    assert(m.view_id == 1);
+    assert(m.num_keys == 1);
+    assert(view_keys_mapping_next(&m, &key));
+    assert(key.size == 7);
+    assert(memcmp(key.buf, "[5,6,7]", key.size) == 0);
+    assert(!view_keys_mapping_next(&m, &key));
+    assert(!view_id_btree_value_next(&v, &m));
+
+    assert(view_id_btree_value_view(id_btree_value_bin, len - 1, &v) == COUCHSTORE_ERROR_CORRUPT);
+    assert(view_id_btree_value_view(id_btree_value_bin, 4, &v) == COUCHSTORE_ERROR_CORRUPT);
+    assert(view_id_btree_value_view(id_btree_value_bin, 6, &v) == COUCHSTORE_ERROR_CORRUPT);
+}
+
 void test_values()
 {
     char value_bin[] = {
@@ -104,6 +171,12 @@ void test_values()
     id_btree_v = test_view_id_btree_value_decoding(id_btree_value_bin,
                                                    sizeof(id_btree_value_bin));
 
+    fprintf(stderr, "Parsing views of a view btree value ...\n");
+    test_view_btree_value_view(value_bin, sizeof(value_bin));
+
+    fprintf(stderr, "Parsing views of a view id btree value ...\n");
+    test_view_id_btree_value_view(id_btree_value_bin, sizeof(id_btree_value_bin));
+
     fprintf(stderr, "Encoding the previously decoded view btree value ...\n");
     test_view_btree_value_encoding(v, &v_bin2, &v_bin2_size);
 
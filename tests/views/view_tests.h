@@ -46,5 +46,6 @@ void test_keys(void);
 void test_values(void);
 void reducer_tests(void);
 void cleanup_tests(void);
+void query_tests(void);
 
 #endif